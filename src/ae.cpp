@@ -72,14 +72,14 @@ aeFileEvent::aeFileEvent()
 
 }
 
-aeTimeEvent::aeTimeEvent(long long in_id, long long in_milliseconds, aeTimeProc *proc, void *in_clientData, aeEventFinalizerProc *in_finalizerProc, aeTimeEvent* in_next)
+aeTimeEvent::aeTimeEvent(long long in_id, long long in_milliseconds, aeTimeProc *proc, void *in_clientData, aeEventFinalizerProc *in_finalizerProc)
 : m_id(in_id)
 , m_when_sec(0) /* seconds */
 , m_when_ms(0) /* milliseconds */
 , m_timeProc(proc)
 , m_finalizerProc(in_finalizerProc)
 , m_clientData(in_clientData)
-, m_next(in_next)
+, m_heapIndex(-1)
 {
     aeAddMillisecondsToNow(in_milliseconds, &m_when_sec, &m_when_ms);
 }
@@ -90,12 +90,23 @@ aeEventLoop::aeEventLoop(int in_setsize)
     m_fired  = (aeFiredEvent *)zmalloc(sizeof(aeFiredEvent)*in_setsize);
     m_setsize = in_setsize;
     m_lastTime = time(NULL);
-    m_timeEventHead = NULL;
+    m_timeHeap = NULL;
+    m_timeHeapSize = 0;
+    m_timeHeapAlloc = 0;
+    m_timeIds = NULL;
+    m_timeIdsSize = 0;
+    m_timeIdsAlloc = 0;
+    m_timeIdsLive = 0;
     m_timeEventNextId = 0;
     m_stop = 0;
     m_maxfd = -1;
     m_beforesleep = NULL;
     m_aftersleep = NULL;
+    m_busyPollUs = 0;
+    m_busyPollMaxCpu = 100;
+    m_busyPollWindow = 0;
+    m_busyPollWindowUs = 0;
+    memset(&m_busyPollStats,0,sizeof(m_busyPollStats));
     aeApiCreate();
     /* Events with m_mask == AE_NONE are not set. So let's initialize the
      * vector with it. */
@@ -157,6 +168,8 @@ aeEventLoop::~aeEventLoop()
     aeApiFree();
     zfree(m_events);
     zfree(m_fired);
+    zfree(m_timeHeap);
+    zfree(m_timeIds);
 }
 
 void aeDeleteEventLoop(aeEventLoop *eventLoop)
@@ -216,6 +229,16 @@ int aeEventLoop::aeGetFileEvents(int fd) {
     return fe->m_mask;
 }
 
+/* Return the client data of the events registered for 'fd', or NULL if
+ * there are none. */
+void *aeEventLoop::aeGetFileClientData(int fd) {
+    if (fd >= m_setsize) return NULL;
+    aeFileEvent *fe = &m_events[fd];
+
+    if (fe->m_mask == AE_NONE) return NULL;
+    return fe->m_clientData;
+}
+
 static void aeGetTime(long *seconds, long *milliseconds)
 {
     struct timeval tv;
@@ -239,6 +262,125 @@ static void aeAddMillisecondsToNow(long long milliseconds, long *sec, long *ms)
     *ms = when_ms;
 }
 
+/* Return non zero if time event 'a' expires before time event 'b'. */
+static int aeTimeEventBefore(aeTimeEvent *a, aeTimeEvent *b) {
+    return a->m_when_sec < b->m_when_sec ||
+           (a->m_when_sec == b->m_when_sec && a->m_when_ms < b->m_when_ms);
+}
+
+void aeEventLoop::timeHeapSiftUp(int idx) {
+    aeTimeEvent *te = m_timeHeap[idx];
+
+    while (idx > 0) {
+        int parent = (idx-1)/2;
+        if (!aeTimeEventBefore(te,m_timeHeap[parent])) break;
+        m_timeHeap[idx] = m_timeHeap[parent];
+        m_timeHeap[idx]->m_heapIndex = idx;
+        idx = parent;
+    }
+    m_timeHeap[idx] = te;
+    te->m_heapIndex = idx;
+}
+
+void aeEventLoop::timeHeapSiftDown(int idx) {
+    aeTimeEvent *te = m_timeHeap[idx];
+
+    while (1) {
+        int child = idx*2+1;
+        if (child >= m_timeHeapSize) break;
+        if (child+1 < m_timeHeapSize &&
+            aeTimeEventBefore(m_timeHeap[child+1],m_timeHeap[child]))
+            child++;
+        if (!aeTimeEventBefore(m_timeHeap[child],te)) break;
+        m_timeHeap[idx] = m_timeHeap[child];
+        m_timeHeap[idx]->m_heapIndex = idx;
+        idx = child;
+    }
+    m_timeHeap[idx] = te;
+    te->m_heapIndex = idx;
+}
+
+int aeEventLoop::timeHeapInsert(aeTimeEvent *te) {
+    if (m_timeHeapSize == m_timeHeapAlloc) {
+        int alloc = m_timeHeapAlloc ? m_timeHeapAlloc*2 : 16;
+        aeTimeEvent **heap = (aeTimeEvent **)zrealloc(m_timeHeap,
+                                                      sizeof(aeTimeEvent*)*alloc);
+        if (heap == NULL) return AE_ERR;
+        m_timeHeap = heap;
+        m_timeHeapAlloc = alloc;
+    }
+    m_timeHeap[m_timeHeapSize++] = te;
+    timeHeapSiftUp(m_timeHeapSize-1);
+    return AE_OK;
+}
+
+/* Remove the element at position 'idx' from the heap, without freeing it. */
+void aeEventLoop::timeHeapRemove(int idx) {
+    aeTimeEvent *te = m_timeHeap[idx];
+
+    te->m_heapIndex = -1;
+    if (--m_timeHeapSize == idx) return;
+    m_timeHeap[idx] = m_timeHeap[m_timeHeapSize];
+    m_timeHeap[idx]->m_heapIndex = idx;
+    if (idx > 0 && aeTimeEventBefore(m_timeHeap[idx],m_timeHeap[(idx-1)/2]))
+        timeHeapSiftUp(idx);
+    else
+        timeHeapSiftDown(idx);
+}
+
+/* Binary search the id index, returns the slot or -1 if not found. */
+int aeEventLoop::timeIdsFind(long long id) {
+    int lo = 0, hi = m_timeIdsSize-1;
+
+    while (lo <= hi) {
+        int mid = lo+(hi-lo)/2;
+        if (m_timeIds[mid].m_id == id) return mid;
+        if (m_timeIds[mid].m_id < id) lo = mid+1;
+        else hi = mid-1;
+    }
+    return -1;
+}
+
+int aeEventLoop::timeIdsAppend(long long id, aeTimeEvent *te) {
+    if (m_timeIdsSize == m_timeIdsAlloc) {
+        /* Compact the deleted entries away before growing. */
+        if (m_timeIdsLive < m_timeIdsSize/2) {
+            int j, k = 0;
+            for (j = 0; j < m_timeIdsSize; j++)
+                if (m_timeIds[j].m_te) m_timeIds[k++] = m_timeIds[j];
+            m_timeIdsSize = k;
+        } else {
+            int alloc = m_timeIdsAlloc ? m_timeIdsAlloc*2 : 16;
+            aeTimeEventId *ids = (aeTimeEventId *)zrealloc(m_timeIds,
+                                                           sizeof(aeTimeEventId)*alloc);
+            if (ids == NULL) return AE_ERR;
+            m_timeIds = ids;
+            m_timeIdsAlloc = alloc;
+        }
+    }
+    m_timeIds[m_timeIdsSize].m_id = id;
+    m_timeIds[m_timeIdsSize].m_te = te;
+    m_timeIdsSize++;
+    m_timeIdsLive++;
+    return AE_OK;
+}
+
+/* Drop 'id' from the index, returning the event it referenced, or NULL
+ * if no live event with such id exists. */
+aeTimeEvent *aeEventLoop::timeIdsRemove(long long id) {
+    int slot = timeIdsFind(id);
+    aeTimeEvent *te;
+
+    if (slot == -1 || m_timeIds[slot].m_te == NULL) return NULL;
+    te = m_timeIds[slot].m_te;
+    m_timeIds[slot].m_te = NULL;
+    m_timeIdsLive--;
+    /* Trailing tombstones can be reclaimed right away. */
+    while (m_timeIdsSize && m_timeIds[m_timeIdsSize-1].m_te == NULL)
+        m_timeIdsSize--;
+    return te;
+}
+
 long long aeEventLoop::aeCreateTimeEvent(long long milliseconds, aeTimeProc *proc, void *clientData, aeEventFinalizerProc *finalizerProc)
 {
     aeTimeEvent *te = NULL;
@@ -247,23 +389,34 @@ long long aeEventLoop::aeCreateTimeEvent(long long milliseconds, aeTimeProc *pro
     if (aeTimeEvent_mem == NULL) return AE_ERR;
 
     long long id = m_timeEventNextId++;
-    te = new (aeTimeEvent_mem) aeTimeEvent(id, milliseconds, proc, clientData, finalizerProc, m_timeEventHead);
+    te = new (aeTimeEvent_mem) aeTimeEvent(id, milliseconds, proc, clientData, finalizerProc);
 
-    m_timeEventHead = te;
+    if (timeIdsAppend(id, te) == AE_ERR) {
+        zfree(te);
+        return AE_ERR;
+    }
+    if (timeHeapInsert(te) == AE_ERR) {
+        timeIdsRemove(id);
+        zfree(te);
+        return AE_ERR;
+    }
     return id;
 }
 
+/* Mark the event as deleted and move it to the top of the heap: it will
+ * be released, and its finalizer called, by the next processTimeEvents()
+ * call, as it was when time events were kept in a list. */
 int aeEventLoop::aeDeleteTimeEvent(long long id)
 {
-    aeTimeEvent *te = m_timeEventHead;
-    while(te) {
-        if (te->m_id == id) {
-            te->m_id = AE_DELETED_EVENT_ID;
-            return AE_OK;
-        }
-        te = te->m_next;
-    }
-    return AE_ERR; /* NO event with the specified ID found */
+    aeTimeEvent *te = timeIdsRemove(id);
+
+    if (te == NULL) return AE_ERR; /* NO event with the specified ID found */
+    te->m_id = AE_DELETED_EVENT_ID;
+    te->m_when_sec = 0;
+    te->m_when_ms = 0;
+    /* Events set aside by processTimeEvents() are not in the heap now. */
+    if (te->m_heapIndex != -1) timeHeapSiftUp(te->m_heapIndex);
+    return AE_OK;
 }
 
 /* Search the first timer to fire.
@@ -271,32 +424,34 @@ int aeEventLoop::aeDeleteTimeEvent(long long id)
  * put in sleep without to delay any event.
  * If there are no timers NULL is returned.
  *
- * Note that's O(N) since time events are unsorted.
- * Possible optimizations (not needed by Redis so far, but...):
- * 1) Insert the event in order, so that the nearest is just the head.
- *    Much better but still insertion or deletion of timers is O(N).
- * 2) Use a skiplist to have this operation as O(1) and insertion as O(log(N)).
- */
+ * Time events are kept in a binary min-heap ordered by expire time, so
+ * this is O(1), while insertion and deletion are O(log(N)). */
 aeTimeEvent *aeEventLoop::aeSearchNearestTimer()
 {
-    aeTimeEvent *te = m_timeEventHead;
-    aeTimeEvent *nearest = NULL;
-
-    while(te) {
-        if (!nearest || te->m_when_sec < nearest->m_when_sec ||
-                (te->m_when_sec == nearest->m_when_sec &&
-                 te->m_when_ms < nearest->m_when_ms))
-            nearest = te;
-        te = te->m_next;
+    return m_timeHeapSize ? m_timeHeap[0] : NULL;
+}
+
+/* Move the event at the index 'idx' of the heap to the array 'skipped' of
+ * processTimeEvents(), growing it as needed. */
+void aeEventLoop::timeHeapSetAside(int idx, aeTimeEvent ***skipped,
+                                   int *numskipped, int *skippedalloc)
+{
+    if (*numskipped == *skippedalloc) {
+        *skippedalloc = *skippedalloc ? *skippedalloc*2 : 16;
+        *skipped = (aeTimeEvent **)zrealloc(*skipped,
+                                            sizeof(aeTimeEvent*)*(*skippedalloc));
     }
-    return nearest;
+    (*skipped)[(*numskipped)++] = m_timeHeap[idx];
+    timeHeapRemove(idx);
 }
 
 /* Process time events */
 int aeEventLoop::processTimeEvents()
 {
-    int processed = 0;
-    aeTimeEvent *te, *prev;
+    int processed = 0, j;
+    aeTimeEvent *te;
+    aeTimeEvent **skipped = NULL;
+    int numskipped = 0, skippedalloc = 0;
     long long maxId;
     time_t now = time(NULL);
 
@@ -307,64 +462,67 @@ int aeEventLoop::processTimeEvents()
      * Here we try to detect system clock skews, and force all the time
      * events to be processed ASAP when this happens: the idea is that
      * processing events earlier is less dangerous than delaying them
-     * indefinitely, and practice suggests it is. */
+     * indefinitely, and practice suggests it is. Since all the events get
+     * the same expire time the heap property still holds. */
     if (now < m_lastTime) {
-        te = m_timeEventHead;
-        while(te) {
-            te->m_when_sec = 0;
-            te = te->m_next;
+        for (j = 0; j < m_timeHeapSize; j++) {
+            m_timeHeap[j]->m_when_sec = 0;
+            m_timeHeap[j]->m_when_ms = 0;
         }
     }
     m_lastTime = now;
 
-    prev = NULL;
-    te = m_timeEventHead;
     maxId = m_timeEventNextId-1;
-    while(te) {
+    while(m_timeHeapSize) {
         long now_sec, now_ms;
         long long id;
 
+        te = m_timeHeap[0];
+
         /* Remove events scheduled for deletion. */
         if (te->m_id == AE_DELETED_EVENT_ID) {
-            aeTimeEvent *next = te->m_next;
-            if (prev == NULL)
-                m_timeEventHead = te->m_next;
-            else
-                prev->m_next = te->m_next;
+            timeHeapRemove(0);
             if (te->m_finalizerProc)
                 te->m_finalizerProc(this, te->m_clientData);
             zfree(te);
-            te = next;
             continue;
         }
 
         /* Make sure we don't process time events created by time events in
-         * this iteration. Note that this check is currently useless: we always
-         * add new timers on the head, however if we change the implementation
-         * detail, this check may be useful again: we keep it here for future
-         * defense. */
+         * this iteration: they are moved aside and put back in the heap
+         * once we are done. */
         if (te->m_id > maxId) {
-            te = te->m_next;
+            timeHeapSetAside(0,&skipped,&numskipped,&skippedalloc);
             continue;
         }
         aeGetTime(&now_sec, &now_ms);
-        if (now_sec > te->m_when_sec ||
-            (now_sec == te->m_when_sec && now_ms >= te->m_when_ms))
-        {
-            int retval;
-
-            id = te->m_id;
-            retval = te->m_timeProc(this, id, te->m_clientData);
-            processed++;
-            if (retval != AE_NOMORE) {
-                aeAddMillisecondsToNow(retval, &te->m_when_sec, &te->m_when_ms);
-            } else {
-                te->m_id = AE_DELETED_EVENT_ID;
-            }
+        if (now_sec < te->m_when_sec ||
+            (now_sec == te->m_when_sec && now_ms < te->m_when_ms))
+            break; /* The nearest timer did not expire yet. */
+
+        int retval;
+
+        id = te->m_id;
+        retval = te->m_timeProc(this, id, te->m_clientData);
+        processed++;
+        /* The callback may have deleted the event itself, in that case it
+         * is already at the top of the heap waiting to be released. */
+        if (te->m_id == AE_DELETED_EVENT_ID) continue;
+        if (retval != AE_NOMORE) {
+            /* Every event fires at most once per call, like when they were
+             * kept in a list: one rescheduled in 0 milliseconds would be
+             * expired again at the top of the heap, and never let the loop
+             * get back to the file events. */
+            aeAddMillisecondsToNow(retval, &te->m_when_sec, &te->m_when_ms);
+            timeHeapSetAside(te->m_heapIndex,&skipped,&numskipped,
+                             &skippedalloc);
+        } else {
+            aeDeleteTimeEvent(id);
         }
-        prev = te;
-        te = te->m_next;
     }
+    for (j = 0; j < numskipped; j++)
+        timeHeapInsert(skipped[j]);
+    zfree(skipped);
     return processed;
 }
 
@@ -435,7 +593,7 @@ int aeEventLoop::aeProcessEvents(int flags)
 
         /* Call the multiplexing API, will return only on timeout or when
          * some event fires. */
-        numevents = aeApiPoll(tvp);
+        numevents = aePoll(tvp);
 
         /* After sleep callback. */
         if (m_aftersleep != NULL && flags & AE_CALL_AFTER_SLEEP)
@@ -468,6 +626,71 @@ int aeEventLoop::aeProcessEvents(int flags)
     return processed; /* return the number of processed file/time events */
 }
 
+static long long aeMonotonicUs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (long long)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+/* Enable busy polling: before sleeping in the multiplexing API the loop
+ * polls it without blocking for up to 'usec' microseconds, trading CPU
+ * time for the wakeup latency of the sleep. At most 'maxcpu' percent of
+ * every second is spent spinning, after that the loop just sleeps until
+ * the next second. A 'usec' of zero disables busy polling. */
+void aeEventLoop::aeSetBusyPoll(long long usec, int maxcpu) {
+    m_busyPollUs = usec;
+    m_busyPollMaxCpu = maxcpu;
+}
+
+void aeEventLoop::aeGetBusyPollStats(aeBusyPollStats *stats) {
+    *stats = m_busyPollStats;
+}
+
+/* aeApiPoll() with the busy polling described in aeSetBusyPoll(). The
+ * spin never lasts more than the timeout, so timers still fire on time. */
+int aeEventLoop::aePoll(struct timeval *tvp) {
+    struct timeval zero = {0,0}, left;
+    long long timeout, budget, start, now;
+    int numevents;
+
+    if (m_busyPollUs == 0) return aeApiPoll(tvp);
+    timeout = tvp ? (long long)tvp->tv_sec*1000000 + tvp->tv_usec : -1;
+    if (timeout == 0) return aeApiPoll(tvp);
+
+    start = aeMonotonicUs();
+    if (start - m_busyPollWindow >= 1000000) {
+        m_busyPollWindow = start;
+        m_busyPollWindowUs = 0;
+    }
+    if (m_busyPollWindowUs >= 10000LL*m_busyPollMaxCpu) {
+        m_busyPollStats.throttled++;
+        return aeApiPoll(tvp);
+    }
+
+    budget = m_busyPollUs;
+    if (timeout != -1 && timeout < budget) budget = timeout;
+    do {
+        numevents = aeApiPoll(&zero);
+        now = aeMonotonicUs();
+    } while (numevents == 0 && now - start < budget);
+    m_busyPollWindowUs += now - start;
+    m_busyPollStats.spin_us += now - start;
+    if (numevents) {
+        m_busyPollStats.spins++;
+        return numevents;
+    }
+
+    /* Nothing arrived: sleep for what is left of the timeout. */
+    m_busyPollStats.sleeps++;
+    if (timeout == -1) return aeApiPoll(NULL);
+    timeout -= now - start;
+    if (timeout < 0) timeout = 0;
+    left.tv_sec = timeout/1000000;
+    left.tv_usec = timeout%1000000;
+    return aeApiPoll(&left);
+}
+
 /* Wait for milliseconds until the given file descriptor becomes
  * writable/readable/exception */
 int aeWait(int fd, int mask, long long milliseconds) {
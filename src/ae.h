@@ -77,7 +77,7 @@ public:
 class aeTimeEvent
 {
 public:
-    aeTimeEvent(long long in_id, long long in_milliseconds, aeTimeProc *proc, void *in_clientData, aeEventFinalizerProc *in_finalizerProc, aeTimeEvent* in_next);
+    aeTimeEvent(long long in_id, long long in_milliseconds, aeTimeProc *proc, void *in_clientData, aeEventFinalizerProc *in_finalizerProc);
 
     long long m_id; /* time event identifier. */
     long m_when_sec; /* seconds */
@@ -85,7 +85,23 @@ public:
     aeTimeProc *m_timeProc;
     aeEventFinalizerProc *m_finalizerProc;
     void *m_clientData;
-    struct aeTimeEvent *m_next;
+    int m_heapIndex; /* position in the event loop timer heap */
+};
+
+/* Entry of the id -> time event index. Ids are assigned in increasing
+ * order, so the index is kept sorted just by appending to it. */
+struct aeTimeEventId {
+    long long m_id;
+    aeTimeEvent *m_te; /* NULL once the event was deleted */
+};
+
+/* Busy polling statistics, see aeSetBusyPoll(). */
+struct aeBusyPollStats {
+    long long spins;     /* Waits that found events while spinning. */
+    long long sleeps;    /* Waits that spun in vain, then slept. */
+    long long throttled; /* Waits that slept without spinning because of
+                            the CPU cap. */
+    long long spin_us;   /* Time spent spinning. */
 };
 
 /* A fired event */
@@ -112,6 +128,7 @@ public:
     int aeCreateFileEvent(int fd, int mask, aeFileProc *proc, void *clientData);
     void aeDeleteFileEvent(int fd, int mask);
     int aeGetFileEvents(int fd);
+    void *aeGetFileClientData(int fd);
     long long aeCreateTimeEvent(long long milliseconds,
         aeTimeProc *proc, void *clientData,
         aeEventFinalizerProc *finalizerProc);
@@ -123,6 +140,8 @@ public:
     int aeGetSetSize();
     int aeResizeSetSize(int in_setsize);
     char *aeApiName();
+    void aeSetBusyPoll(long long usec, int maxcpu);
+    void aeGetBusyPollStats(aeBusyPollStats *stats);
 
 private:
     int m_maxfd;   /* highest file descriptor currently registered */
@@ -131,14 +150,34 @@ private:
     time_t m_lastTime;     /* Used to detect system clock skew */
     aeFileEvent *m_events; /* Registered events */
     aeFiredEvent *m_fired; /* Fired events */
-    aeTimeEvent *m_timeEventHead;
+    aeTimeEvent **m_timeHeap;   /* Time events, binary min-heap on expiry */
+    int m_timeHeapSize;
+    int m_timeHeapAlloc;
+    aeTimeEventId *m_timeIds;   /* Time events sorted by id */
+    int m_timeIdsSize;
+    int m_timeIdsAlloc;
+    int m_timeIdsLive;          /* Entries of m_timeIds not yet deleted */
     int m_stop;
     void *m_apidata; /* This is used for polling API specific data */
     aeBeforeSleepProc *m_beforesleep;
     aeBeforeSleepProc *m_aftersleep;
+    long long m_busyPollUs;       /* Max time to spin before sleeping, or 0 */
+    int m_busyPollMaxCpu;         /* Max percentage of time spent spinning */
+    long long m_busyPollWindow;   /* Start of the current CPU cap window */
+    long long m_busyPollWindowUs; /* Time spent spinning in the window */
+    aeBusyPollStats m_busyPollStats;
 
     aeTimeEvent* aeSearchNearestTimer();
+    int aePoll(struct timeval *tvp);
     int processTimeEvents();
+    void timeHeapSiftUp(int idx);
+    void timeHeapSiftDown(int idx);
+    int timeHeapInsert(aeTimeEvent *te);
+    void timeHeapRemove(int idx);
+    void timeHeapSetAside(int idx, aeTimeEvent ***skipped, int *numskipped, int *skippedalloc);
+    int timeIdsFind(long long id);
+    int timeIdsAppend(long long id, aeTimeEvent *te);
+    aeTimeEvent *timeIdsRemove(long long id);
 
     int aeApiCreate();
     int aeApiResize(int setsize);
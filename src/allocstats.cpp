@@ -0,0 +1,228 @@
+/* Allocations profiler by command and call site.
+ *
+ * When alloc-profiler is enabled call() gives zmalloc a tracker while the
+ * command runs, so that every allocation and reallocation made by the main
+ * thread is accounted to the command, and to its call site: the return
+ * address of zmalloc(), zcalloc() or zrealloc(), that is the function
+ * allocating, like sdsnewlen() or createObject(). MEMORY ALLOCSTATS reports
+ * the commands and the call sites making the most allocations, so that the
+ * commands allocating more than necessary can be found under real traffic.
+ *
+ * The allocations made by the commands called by EXEC, EVAL and the modules
+ * are also accounted to the caller. The call sites are tracked in a fixed
+ * table, since the allocations can't allocate themselves: the sites that
+ * don't fit are accounted as "other". With the profiler disabled zmalloc
+ * only checks that the calling thread has no tracker.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "allocstats.h"
+#include <dlfcn.h>
+
+#define ALLOCSTATS_MAX_PROBES 16    /* Slots checked before giving up. */
+
+/* The zmallocTracker site callback. */
+static void allocStatsSite(zmallocTracker *t, void *caller, size_t size) {
+    allocProfiler *ap = (allocProfiler *)t;
+    unsigned long idx = (unsigned long)(((uintptr_t)caller>>2)*
+                                        0x9E3779B97F4A7C15ULL);
+    allocSite *site = NULL;
+
+    for (int j = 0; j < ALLOCSTATS_MAX_PROBES; j++) {
+        allocSite *s = ap->sites+((idx+j) & (ALLOCSTATS_SITES-1));
+        if (s->caller == caller) {
+            site = s;
+            break;
+        }
+        if (s->caller == NULL) {
+            s->caller = caller;
+            ap->sites_used++;
+            site = s;
+            break;
+        }
+    }
+    if (site == NULL) site = &ap->other;
+    site->allocs++;
+    site->bytes += size;
+}
+
+static void allocStatsReset(allocProfiler *ap) {
+    memset(ap->sites,0,sizeof(ap->sites));
+    memset(&ap->other,0,sizeof(ap->other));
+    ap->sites_used = 0;
+    ap->reset_time = mstime();
+
+    dictIterator di(server.commands);
+    dictEntry *de;
+    while ((de = di.dictNext()) != NULL) {
+        struct redisCommand *cmd = (struct redisCommand *)de->dictGetVal();
+        cmd->alloc_calls = cmd->allocs = cmd->alloc_bytes = 0;
+    }
+}
+
+/* Create the profiler the first time alloc-profiler is enabled. It is never
+ * released, since call() may be using it while the profiler is disabled:
+ * call() just stops tracking the commands. */
+void allocStatsInit(void) {
+    if (!server.alloc_profiler || server.allocprof) return;
+    allocProfiler *ap = (allocProfiler *)zcalloc(sizeof(*ap));
+    ap->tracker.site = allocStatsSite;
+    allocStatsReset(ap);
+    server.allocprof = ap;
+}
+
+static int allocStatsCompareCommands(const void *a, const void *b) {
+    const struct redisCommand *ca = *(const struct redisCommand **)a,
+                              *cb = *(const struct redisCommand **)b;
+    if (ca->allocs == cb->allocs) return 0;
+    return ca->allocs > cb->allocs ? -1 : 1;
+}
+
+static int allocStatsCompareSites(const void *a, const void *b) {
+    const allocSite *sa = (const allocSite *)a, *sb = (const allocSite *)b;
+    if (sa->allocs == sb->allocs) return 0;
+    return sa->allocs > sb->allocs ? -1 : 1;
+}
+
+/* Name the call site as "symbol+offset" when the symbol is known. */
+static sds allocStatsSiteName(void *caller) {
+    Dl_info info;
+
+    if (dladdr(caller,&info) != 0 && info.dli_sname != NULL)
+        return sdscatprintf(sdsempty(),"%s+0x%lx",info.dli_sname,
+            (unsigned long)((char*)caller-(char*)info.dli_saddr));
+    return sdscatprintf(sdsempty(),"%p",caller);
+}
+
+static void addReplyAllocSite(client *c, allocSite *site) {
+    c->addReplyMultiBulkLen(4);
+    c->addReplyBulkCString("allocs");
+    c->addReplyLongLong(site->allocs);
+    c->addReplyBulkCString("bytes");
+    c->addReplyLongLong(site->bytes);
+}
+
+/* MEMORY ALLOCSTATS [COUNT <count>]
+ * MEMORY ALLOCSTATS RESET
+ *
+ * Report, since the profiler was enabled or reset, the 'count' commands
+ * and call sites that made the most allocations. */
+void memoryAllocStatsCommand(client *c) {
+    allocProfiler *ap = server.allocprof;
+    long long count = ALLOCSTATS_DEFAULT_COUNT;
+
+    if (c->m_argc == 3 && !strcasecmp((const char*)c->m_argv[2]->ptr,"reset")) {
+        if (ap) allocStatsReset(ap);
+        c->addReply(shared.ok);
+        return;
+    }
+    for (int j = 2; j < c->m_argc; j++) {
+        if (!strcasecmp((const char*)c->m_argv[j]->ptr,"count") &&
+            j+1 < c->m_argc)
+        {
+            if (getLongLongFromObjectOrReply(c,c->m_argv[j+1],&count,NULL)
+                 == C_ERR) return;
+            if (count < 1) {
+                c->addReplyError("COUNT must be > 0");
+                return;
+            }
+            j++;
+        } else {
+            c->addReply(shared.syntaxerr);
+            return;
+        }
+    }
+    if (ap == NULL) {
+        c->addReplyError("The allocations profiler is disabled, "
+                         "set alloc-profiler to enable it");
+        return;
+    }
+
+    /* Commands by allocations. */
+    struct redisCommand **cmds = (struct redisCommand **)
+        zmalloc(sizeof(struct redisCommand *)*server.commands->dictSize());
+    size_t ncmds = 0;
+    {
+        dictIterator di(server.commands);
+        dictEntry *de;
+        while ((de = di.dictNext()) != NULL) {
+            struct redisCommand *cmd = (struct redisCommand *)de->dictGetVal();
+            if (cmd->alloc_calls) cmds[ncmds++] = cmd;
+        }
+    }
+    qsort(cmds,ncmds,sizeof(*cmds),allocStatsCompareCommands);
+
+    /* Call sites by allocations. The copy is taken before the reply, that
+     * allocates while this command is itself tracked. */
+    allocSite *sites = (allocSite *)zmalloc(sizeof(allocSite)*ALLOCSTATS_SITES);
+    size_t nsites = 0;
+    for (int j = 0; j < ALLOCSTATS_SITES; j++)
+        if (ap->sites[j].caller) sites[nsites++] = ap->sites[j];
+    allocSite other = ap->other;
+    qsort(sites,nsites,sizeof(*sites),allocStatsCompareSites);
+
+    size_t creply = ncmds < (size_t)count ? ncmds : (size_t)count;
+    size_t sreply = nsites < (size_t)count ? nsites : (size_t)count;
+    c->addReplyMultiBulkLen(10);
+    c->addReplyBulkCString("enabled");
+    c->addReplyLongLong(server.alloc_profiler);
+    c->addReplyBulkCString("age.ms");
+    c->addReplyLongLong(mstime()-ap->reset_time);
+    c->addReplyBulkCString("commands");
+    c->addReplyMultiBulkLen(creply*2);
+    for (size_t j = 0; j < creply; j++) {
+        struct redisCommand *cmd = cmds[j];
+        c->addReplyBulkCString(cmd->name);
+        c->addReplyMultiBulkLen(10);
+        c->addReplyBulkCString("calls");
+        c->addReplyLongLong(cmd->alloc_calls);
+        c->addReplyBulkCString("allocs");
+        c->addReplyLongLong(cmd->allocs);
+        c->addReplyBulkCString("bytes");
+        c->addReplyLongLong(cmd->alloc_bytes);
+        c->addReplyBulkCString("allocs.per.call");
+        c->addReplyDouble((double)cmd->allocs/cmd->alloc_calls);
+        c->addReplyBulkCString("bytes.per.call");
+        c->addReplyDouble((double)cmd->alloc_bytes/cmd->alloc_calls);
+    }
+    c->addReplyBulkCString("sites");
+    c->addReplyMultiBulkLen(sreply*2);
+    for (size_t j = 0; j < sreply; j++) {
+        c->addReplyBulkSds(allocStatsSiteName(sites[j].caller));
+        addReplyAllocSite(c,sites+j);
+    }
+    c->addReplyBulkCString("other");
+    addReplyAllocSite(c,&other);
+
+    zfree(cmds);
+    zfree(sites);
+}
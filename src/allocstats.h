@@ -0,0 +1,86 @@
+/* allocstats.h -- allocations profiler by command and call site API header
+ * See allocstats.cpp for more information.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __ALLOCSTATS_H
+#define __ALLOCSTATS_H
+
+#define ALLOCSTATS_SITES 1024       /* Call sites tracked, a power of two. */
+#define ALLOCSTATS_DEFAULT_COUNT 10 /* Entries returned by MEMORY ALLOCSTATS. */
+
+/* The allocations made from a call site, that is the return address of
+ * zmalloc(), zcalloc() or zrealloc(). */
+struct allocSite {
+    void *caller;                   /* NULL if the slot is free. */
+    unsigned long long allocs;
+    unsigned long long bytes;
+};
+
+/* The tracker is the first member, so that the call site callback can find
+ * the profiler. Its totals are never reset, call() accounts the difference
+ * between their values after and before every command. */
+struct allocProfiler {
+    zmallocTracker tracker;
+    allocSite sites[ALLOCSTATS_SITES]; /* Open addressing by caller. */
+    unsigned long sites_used;
+    allocSite other;                /* Sites not tracked, the table is full. */
+    mstime_t reset_time;
+};
+
+/* Exported API */
+void allocStatsInit(void);
+void memoryAllocStatsCommand(client *c);
+
+/* Start accounting the allocations of the calling thread to the profiler,
+ * if enabled. Return the tracker to restore with allocStatsEnd(). */
+static inline zmallocTracker *allocStatsStart(allocProfiler *ap,
+                                              size_t *allocs, size_t *bytes)
+{
+    if (ap == NULL) return NULL;
+    *allocs = ap->tracker.allocs;
+    *bytes = ap->tracker.bytes;
+    return zmalloc_set_tracker(&ap->tracker);
+}
+
+/* Account the allocations made since allocStatsStart() to 'cmd'. */
+static inline void allocStatsEnd(allocProfiler *ap, zmallocTracker *prev,
+                                 struct redisCommand *cmd,
+                                 size_t allocs, size_t bytes)
+{
+    if (ap == NULL) return;
+    zmalloc_set_tracker(prev);
+    cmd->alloc_calls++;
+    cmd->allocs += ap->tracker.allocs-allocs;
+    cmd->alloc_bytes += ap->tracker.bytes-bytes;
+}
+
+#endif
@@ -30,6 +30,7 @@
 #include "server.h"
 #include "bio.h"
 #include "rio.h"
+#include "lazyload.h"
 
 #include <signal.h>
 #include <fcntl.h>
@@ -66,6 +67,14 @@ struct aofrwblock
     char m_buf[AOF_RW_BUF_BLOCK_SIZE];
 };
 
+/* The blocks are released only once the child got them, so they are
+ * allocated from the transient arena, see zmalloc_transient_begin(). */
+static void aofRewriteBlockFree(void *block) {
+    zmalloc_transient_begin();
+    zfree(block);
+    zmalloc_transient_end();
+}
+
 /* This function free the old AOF rewrite buffer if needed, and initialize
  * a fresh new one. It tests for server.aof_rewrite_buf_blocks equal to NULL
  * so can be used for the first initialization as well. */
@@ -74,7 +83,7 @@ void aofRewriteBufferReset() {
         listRelease(server.aof_rewrite_buf_blocks);
 
     server.aof_rewrite_buf_blocks = listCreate();
-    server.aof_rewrite_buf_blocks->listSetFreeMethod(zfree);
+    server.aof_rewrite_buf_blocks->listSetFreeMethod(aofRewriteBlockFree);
 }
 
 /* Return the current size of the AOF rewrite buffer. */
@@ -141,7 +150,9 @@ void aofRewriteBufferAppend(unsigned char *s, unsigned long len) {
         }
 
         if (len) { /* First block to allocate, or need another block. */
+            zmalloc_transient_begin();
             block = (aofrwblock *)zmalloc(sizeof(aofrwblock));
+            zmalloc_transient_end();
             block->m_free = AOF_RW_BUF_BLOCK_SIZE;
             block->m_used = 0;
             server.aof_rewrite_buf_blocks->listAddNodeTail(block);
@@ -190,6 +201,513 @@ ssize_t aofRewriteBufferWrite(int fd) {
     return count;
 }
 
+/* ----------------------------------------------------------------------------
+ * Multi part AOF
+ *
+ * With aof-multi-part the AOF is not a single file: the manifest file
+ * <appendfilename>.manifest lists a base file and the incremental files
+ * following it, that are loaded in order. A rewrite opens a new incremental
+ * file just before forking, and the commands executed from then on go only
+ * there, so no rewrite buffer is accumulated and nothing is sent to the
+ * child: when the child is done its output becomes the new base, and the
+ * manifest is replaced with one listing the new base and the last
+ * incremental file, the older files being deleted. If the rewrite fails
+ * the manifest still lists all the files needed to rebuild the dataset.
+ *
+ * Every line of the manifest describes a file:
+ *
+ *   file <name> seq <n> type <b|i>
+ *
+ * When aof-multi-part is enabled on an existing single file AOF, the file is
+ * used as the base, without renaming it.
+ * ------------------------------------------------------------------------- */
+
+static void aofManifestFreeName(void *name) {
+    sdsfree((sds)name);
+}
+
+static aofManifest *aofManifestCreate(void) {
+    aofManifest *am = (aofManifest *)zmalloc(sizeof(*am));
+
+    am->base = NULL;
+    am->incrs = listCreate();
+    am->incrs->listSetFreeMethod(aofManifestFreeName);
+    am->seq = 0;
+    return am;
+}
+
+static void aofManifestFree(aofManifest *am) {
+    sdsfree(am->base);
+    listRelease(am->incrs);
+    zfree(am);
+}
+
+static sds aofManifestFilename(void) {
+    return sdscatprintf(sdsempty(),"%s.manifest",server.aof_filename);
+}
+
+/* The sequence number in the name <appendfilename>.<seq>.<type>.<ext>, or
+ * 0 for a single file AOF used as the base. */
+static long long aofFileSeq(const char *name) {
+    size_t len = strlen(server.aof_filename);
+
+    if (strncmp(name,server.aof_filename,len) || name[len] != '.') return 0;
+    return strtoll(name+len+1,NULL,10);
+}
+
+/* Load the manifest from disk. Without a manifest the single file AOF, if
+ * it exists, becomes the base. Errors in the manifest are fatal. */
+static aofManifest *aofManifestLoad(void) {
+    aofManifest *am = aofManifestCreate();
+    sds filename = aofManifestFilename();
+    FILE *fp = fopen(filename,"r");
+    char buf[1024];
+    int linenum = 0;
+
+    if (fp == NULL) {
+        if (errno != ENOENT) {
+            serverLog(LL_WARNING,"Fatal error: can't open the AOF manifest "
+                "%s for reading: %s",filename,strerror(errno));
+            exit(1);
+        }
+        if (access(server.aof_filename,F_OK) == 0)
+            am->base = sdsnew(server.aof_filename);
+        sdsfree(filename);
+        return am;
+    }
+
+    while (fgets(buf,sizeof(buf),fp) != NULL) {
+        int argc;
+        sds *argv;
+
+        linenum++;
+        argv = sdssplitargs(buf,&argc);
+        if (argv == NULL || (argc != 0 && argv[0][0] != '#' &&
+            (argc != 6 || strcasecmp(argv[0],"file") ||
+             strcasecmp(argv[2],"seq") || strcasecmp(argv[4],"type") ||
+             (strcasecmp(argv[5],"b") && strcasecmp(argv[5],"i")))))
+        {
+            serverLog(LL_WARNING,"Fatal error: bad line %d in the AOF "
+                "manifest %s",linenum,filename);
+            exit(1);
+        }
+        if (argc != 0 && argv[0][0] != '#') {
+            long long seq = strtoll(argv[3],NULL,10);
+
+            if (!strcasecmp(argv[5],"b")) {
+                sdsfree(am->base);
+                am->base = sdsdup(argv[1]);
+            } else {
+                am->incrs->listAddNodeTail(sdsdup(argv[1]));
+            }
+            if (seq > am->seq) am->seq = seq;
+        }
+        sdsfreesplitres(argv,argc);
+    }
+    fclose(fp);
+    sdsfree(filename);
+    return am;
+}
+
+/* Write the manifest to disk, replacing the old one atomically. */
+static int aofManifestPersist(aofManifest *am) {
+    sds filename = aofManifestFilename();
+    sds tmpfile = sdscatprintf(sdsempty(),"temp-%s",filename);
+    sds content = sdsempty();
+    long long seq;
+    listNode *ln;
+    int fd = -1;
+
+    if (am->base) {
+        seq = aofFileSeq(am->base);
+        content = sdscatprintf(content,"file %s seq %lld type b\n",
+                               am->base,seq);
+    }
+    listIter li(am->incrs);
+    while ((ln = li.listNext()) != NULL) {
+        sds name = (sds)ln->listNodeValue();
+
+        seq = aofFileSeq(name);
+        content = sdscatprintf(content,"file %s seq %lld type i\n",name,seq);
+    }
+
+    if ((fd = open(tmpfile,O_WRONLY|O_CREAT|O_TRUNC,0644)) == -1 ||
+        write(fd,content,sdslen(content)) != (ssize_t)sdslen(content) ||
+        aof_fsync(fd) == -1 || close(fd) == -1)
+    {
+        serverLog(LL_WARNING,"Error writing the AOF manifest %s: %s",
+            tmpfile,strerror(errno));
+        if (fd != -1) close(fd);
+        goto err;
+    }
+    if (rename(tmpfile,filename) == -1) {
+        serverLog(LL_WARNING,"Error renaming the AOF manifest %s: %s",
+            tmpfile,strerror(errno));
+        goto err;
+    }
+    sdsfree(content);
+    sdsfree(tmpfile);
+    sdsfree(filename);
+    return C_OK;
+
+err:
+    unlink(tmpfile);
+    sdsfree(content);
+    sdsfree(tmpfile);
+    sdsfree(filename);
+    return C_ERR;
+}
+
+/* The size of the files of the manifest before the current incremental
+ * file, that is the one of server.aof_fd. */
+static off_t aofManifestOlderFilesSize(void) {
+    aofManifest *am = server.aof_manifest;
+    struct redis_stat sb;
+    off_t size = 0;
+    listNode *ln;
+
+    if (am->base && redis_stat(am->base,&sb) == 0) size += sb.st_size;
+    listIter li(am->incrs);
+    while ((ln = li.listNext()) != NULL && ln != am->incrs->listLast()) {
+        if (redis_stat((sds)ln->listNodeValue(),&sb) == 0) size += sb.st_size;
+    }
+    return size;
+}
+
+/* Delete a file of the AOF without blocking: the last reference, that makes
+ * close(2) release the blocks, is closed by a background thread. */
+static void aofUnlinkInBackground(const char *filename) {
+    int fd = open(filename,O_RDONLY|O_NONBLOCK);
+
+    if (unlink(filename) == -1 && errno != ENOENT)
+        serverLog(LL_WARNING,"Error deleting the old AOF file %s: %s",
+            filename,strerror(errno));
+    if (fd != -1) bioCreateBackgroundJob(BIO_CLOSE_FILE,(void*)(long)fd,NULL,NULL);
+}
+
+/* Switch the AOF writes to a new incremental file, flushing and syncing the
+ * current one first. The manifest is updated only while the AOF is on:
+ * while it waits for the first rewrite the files on disk are not in sync
+ * with the dataset anyway. */
+static int aofOpenNewIncr(void) {
+    sds name = sdscatprintf(sdsempty(),"%s.%lld.incr.aof",
+                            server.aof_filename,server.aof_manifest->seq+1);
+    int fd;
+
+    /* The commands executed so far belong to the current file. */
+    if (server.aof_fd != -1) {
+        flushAppendOnlyFile(1);
+        if (server.aof_fsync != AOF_FSYNC_NO) aof_fsync(server.aof_fd);
+    }
+    if ((fd = open(name,O_WRONLY|O_APPEND|O_CREAT|O_TRUNC,0644)) == -1) {
+        serverLog(LL_WARNING,"Can't open the AOF incremental file %s: %s",
+            name,strerror(errno));
+        sdsfree(name);
+        return C_ERR;
+    }
+    server.aof_manifest->seq++;
+    server.aof_manifest->incrs->listAddNodeTail(name);
+    if (server.aof_state == AOF_ON &&
+        aofManifestPersist(server.aof_manifest) == C_ERR)
+    {
+        server.aof_manifest->incrs->listDelNode(
+            server.aof_manifest->incrs->listLast());
+        server.aof_manifest->seq--;
+        close(fd);
+        unlink(name);
+        return C_ERR;
+    }
+    if (server.aof_fd != -1)
+        bioCreateBackgroundJob(BIO_CLOSE_FILE,(void*)(long)server.aof_fd,
+                               NULL,NULL);
+    server.aof_fd = fd;
+    server.aof_fd_size = 0;
+    server.aof_selected_db = -1; /* Make sure SELECT is re-issued */
+    return C_OK;
+}
+
+/* Open the AOF at startup, creating the first incremental file and the
+ * manifest if needed. */
+void aofOpenOnStartup(void) {
+    server.aof_manifest = aofManifestLoad();
+    if (server.aof_manifest->incrs->listLength() == 0) {
+        if (aofOpenNewIncr() == C_ERR) exit(1);
+        return;
+    }
+
+    sds last = (sds)server.aof_manifest->incrs->listLast()->listNodeValue();
+    server.aof_fd = open(last,O_WRONLY|O_APPEND|O_CREAT,0644);
+    if (server.aof_fd == -1) {
+        serverLog(LL_WARNING, "Can't open the append-only file %s: %s",
+            last,strerror(errno));
+        exit(1);
+    }
+}
+
+/* Load the AOF, that is the single file appendfilename or with
+ * aof-multi-part the files of the manifest in order. Returns C_ERR if
+ * there was nothing to load. */
+int loadAppendOnlyFiles(void) {
+    int loaded = 0;
+    listNode *ln;
+
+    if (!server.aof_multi_part) return loadAppendOnlyFile(server.aof_filename);
+    if (server.aof_manifest == NULL) server.aof_manifest = aofManifestLoad();
+
+    if (server.aof_manifest->base &&
+        loadAppendOnlyFile(server.aof_manifest->base) == C_OK) loaded = 1;
+    listIter li(server.aof_manifest->incrs);
+    while ((ln = li.listNext()) != NULL) {
+        if (loadAppendOnlyFile((sds)ln->listNodeValue()) == C_OK) loaded = 1;
+    }
+    aofUpdateCurrentSize();
+    server.aof_rewrite_base_size = server.aof_current_size;
+    return loaded ? C_OK : C_ERR;
+}
+
+/* Set up the AOF state as loadAppendOnlyFiles() does, without loading the
+ * files, when the dataset was loaded from elsewhere (see handoff.cpp). */
+void aofLoadManifest(void) {
+    if (server.aof_multi_part && server.aof_manifest == NULL)
+        server.aof_manifest = aofManifestLoad();
+    aofUpdateCurrentSize();
+    server.aof_rewrite_base_size = server.aof_current_size;
+}
+
+/* Make the base written by the rewrite child the new base of the AOF, and
+ * delete the files it replaces. */
+static int aofInstallNewBase(const char *tmpfile) {
+    aofManifest *old = server.aof_manifest, *am = aofManifestCreate();
+    listNode *ln;
+
+    am->seq = old->seq;
+    am->base = sdscatprintf(sdsempty(),"%s.%lld.base.%s",server.aof_filename,
+                            old->seq,server.aof_use_rdb_preamble ? "rdb" : "aof");
+    am->incrs->listAddNodeTail(
+        sdsdup((sds)old->incrs->listLast()->listNodeValue()));
+    if (rename(tmpfile,am->base) == -1) {
+        serverLog(LL_WARNING,
+            "Error trying to rename the temporary AOF file %s into %s: %s",
+            tmpfile,am->base,strerror(errno));
+        aofManifestFree(am);
+        return C_ERR;
+    }
+    if (aofManifestPersist(am) == C_ERR) {
+        unlink(am->base);
+        aofManifestFree(am);
+        return C_ERR;
+    }
+
+    if (old->base && strcmp(old->base,am->base)) aofUnlinkInBackground(old->base);
+    old->incrs->listDelNode(old->incrs->listLast());
+    listIter li(old->incrs);
+    while ((ln = li.listNext()) != NULL)
+        aofUnlinkInBackground((sds)ln->listNodeValue());
+    aofManifestFree(old);
+    server.aof_manifest = am;
+    return C_OK;
+}
+
+/* ----------------------------------------------------------------------------
+ * AOF group commit
+ *
+ * With appendfsync always the write(2) and the fsync(2) of the AOF buffer
+ * are performed by a writer thread instead of beforeSleep(). Every event
+ * loop iteration queues its buffer as a new batch and goes on serving the
+ * clients; the batches queued while the thread is busy with the previous
+ * fsync are committed together by the next one. A client that wrote in a
+ * batch gets its replies only once the batch is durable, so the guarantee
+ * of appendfsync always is preserved.
+ * ------------------------------------------------------------------------- */
+
+static int aofGroupCommitEnabled(void) {
+    return server.aof_group_commit && server.aof_fsync == AOF_FSYNC_ALWAYS;
+}
+
+void *aofWriterMain(void *arg) {
+    aofWriter *w = (aofWriter*)arg;
+
+    pthread_mutex_lock(&w->mutex);
+    while(1) {
+        while (sdslen(w->buf) == 0)
+            pthread_cond_wait(&w->work_cond,&w->mutex);
+
+        /* Take all the batches queued so far, new ones can be queued
+         * while we write. */
+        sds buf = w->buf;
+        w->buf = sdsempty();
+        long long seq = w->queued_seq;
+        int fd = server.aof_fd, dosync = w->fsync;
+        pthread_mutex_unlock(&w->mutex);
+
+        size_t nwritten = 0;
+        while (nwritten < sdslen(buf)) {
+            ssize_t n = write(fd,buf+nwritten,sdslen(buf)-nwritten);
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0) {
+                /* Same as the write error when the fsync policy is always:
+                 * the writes of the batch were already executed. */
+                serverLog(LL_WARNING,"Error writing to the AOF file: %s. "
+                    "Can't recover from AOF write error when the AOF fsync "
+                    "policy is 'always'. Exiting...",
+                    n == -1 ? strerror(errno) : "short write");
+                exit(1);
+            }
+            nwritten += n;
+        }
+        if (dosync) aof_fsync(fd);
+        zmalloc_transient_begin();
+        sdsfree(buf);
+        zmalloc_transient_end();
+
+        pthread_mutex_lock(&w->mutex);
+        w->durable_seq = seq;
+        w->commits++;
+        pthread_cond_broadcast(&w->done_cond);
+        if (write(w->notify_pipe[1],"A",1) != 1) {
+            /* Ignore the error, the event loop is awake anyway. */
+        }
+    }
+    return NULL;
+}
+
+/* Send back the replies of the clients whose writes are now durable. */
+static void aofReleaseWaitingClients(void) {
+    aofWriter *w = server.aof_writer;
+    long long durable;
+    listNode *ln;
+
+    pthread_mutex_lock(&w->mutex);
+    durable = w->durable_seq;
+    pthread_mutex_unlock(&w->mutex);
+    w->released_seq = durable;
+
+    listIter li(server.clients_waiting_aof);
+    while((ln = li.listNext())) {
+        client *c = (client *)ln->listNodeValue();
+        if (c->m_aof_commit_seq > durable) continue;
+        server.clients_waiting_aof->listDelNode(ln);
+        c->m_flags &= ~CLIENT_AOF_COMMIT_WAIT;
+        if (c->clientHasPendingReplies() &&
+            !(c->m_flags & CLIENT_PENDING_WRITE))
+        {
+            c->m_flags |= CLIENT_PENDING_WRITE;
+            server.clients_pending_write->listAddNodeHead(c);
+        }
+    }
+}
+
+static void aofWriterNotifyHandler(aeEventLoop *el, int fd, void *privdata,
+                                   int mask)
+{
+    char buf[64];
+    UNUSED(el);
+    UNUSED(privdata);
+    UNUSED(mask);
+
+    while (read(fd,buf,sizeof(buf)) > 0);
+    server.aof_last_fsync = server.unixtime;
+    aofReleaseWaitingClients();
+}
+
+static aofWriter *aofWriterStart(void) {
+    aofWriter *w = (aofWriter*)zcalloc(sizeof(*w));
+
+    w->buf = sdsempty();
+    pthread_mutex_init(&w->mutex,NULL);
+    pthread_cond_init(&w->work_cond,NULL);
+    pthread_cond_init(&w->done_cond,NULL);
+    if (pipe(w->notify_pipe) == -1 ||
+        anetNonBlock(NULL,w->notify_pipe[0]) != ANET_OK ||
+        anetNonBlock(NULL,w->notify_pipe[1]) != ANET_OK ||
+        server.el->aeCreateFileEvent(w->notify_pipe[0],AE_READABLE,
+            aofWriterNotifyHandler,NULL) == AE_ERR ||
+        pthread_create(&w->thread,NULL,aofWriterMain,w) != 0)
+    {
+        serverLog(LL_WARNING,"Can't start the AOF group commit thread: %s",
+            strerror(errno));
+        exit(1);
+    }
+    return server.aof_writer = w;
+}
+
+/* Queue the AOF buffer as a new batch for the writer thread. */
+static void aofWriterQueue(void) {
+    aofWriter *w = server.aof_writer ? server.aof_writer : aofWriterStart();
+    size_t len = sdslen(server.aof_buf);
+
+    pthread_mutex_lock(&w->mutex);
+    zmalloc_transient_begin();
+    w->buf = sdscatlen(w->buf,server.aof_buf,len);
+    zmalloc_transient_end();
+    w->fsync = !(server.aof_no_fsync_on_rewrite &&
+                 (server.aof_child_pid != -1 || server.rdb_child_pid != -1));
+    w->queued_seq++;
+    pthread_cond_signal(&w->work_cond);
+    pthread_mutex_unlock(&w->mutex);
+
+    server.aof_current_size += len;
+    server.aof_fd_size += len;
+    if ((len+sdsavail(server.aof_buf)) < 4000) {
+        sdsclear(server.aof_buf);
+    } else {
+        zmalloc_transient_begin();
+        sdsfree(server.aof_buf);
+        server.aof_buf = sdsempty();
+        zmalloc_transient_end();
+    }
+}
+
+/* Wait for the writer thread to commit all the queued batches. This must be
+ * called before anything else writes to, syncs or replaces aof_fd. */
+static void aofWriterDrain(void) {
+    aofWriter *w = server.aof_writer;
+    mstime_t latency;
+
+    if (w == NULL || w->released_seq == w->queued_seq) return;
+    latencyStartMonitor(latency);
+    pthread_mutex_lock(&w->mutex);
+    while (w->durable_seq != w->queued_seq)
+        pthread_cond_wait(&w->done_cond,&w->mutex);
+    pthread_mutex_unlock(&w->mutex);
+    latencyEndMonitor(latency);
+    latencyAddSampleIfNeeded("aof-group-commit-drain",latency);
+    aofReleaseWaitingClients();
+}
+
+/* Called when feeding the AOF: the current client will get its replies only
+ * after the batch being accumulated is durable. */
+static void aofTrackCommitOfCurrentClient(void) {
+    if (!aofGroupCommitEnabled() || server.current_client == NULL) return;
+    server.current_client->m_aof_commit_seq =
+        (server.aof_writer ? server.aof_writer->queued_seq : 0)+1;
+}
+
+/* Return non zero if the replies of 'c' must wait for some AOF batch. */
+int aofClientMustWaitCommit(client *c) {
+    return server.aof_writer && c->m_aof_commit_seq > server.aof_writer->released_seq;
+}
+
+/* Stop writing to 'c' until its AOF batch is durable. */
+void aofHoldClientReplies(client *c) {
+    if (c->m_flags & CLIENT_AOF_COMMIT_WAIT) return;
+    c->m_flags |= CLIENT_AOF_COMMIT_WAIT;
+    server.clients_waiting_aof->listAddNodeTail(c);
+    server.el->aeDeleteFileEvent(c->m_fd,AE_WRITABLE);
+}
+
+long long aofGroupCommits(void) {
+    aofWriter *w = server.aof_writer;
+    long long commits = 0;
+
+    if (w) {
+        pthread_mutex_lock(&w->mutex);
+        commits = w->commits;
+        pthread_mutex_unlock(&w->mutex);
+    }
+    return commits;
+}
+
 /* ----------------------------------------------------------------------------
  * AOF file implementation
  * ------------------------------------------------------------------------- */
@@ -226,7 +744,7 @@ void stopAppendOnly() {
         server.aof_child_pid = -1;
         server.aof_rewrite_time_start = -1;
         /* close pipes used for IPC between the two processes. */
-        aofClosePipes();
+        if (!server.aof_multi_part) aofClosePipes();
     }
 }
 
@@ -236,9 +754,16 @@ int startAppendOnly() {
     char cwd[MAXPATHLEN]; /* Current working dir path for error messages. */
 
     server.aof_last_fsync = server.unixtime;
-    server.aof_fd = open(server.aof_filename,O_WRONLY|O_APPEND|O_CREAT,0644);
     serverAssert(server.aof_state == AOF_OFF);
-    if (server.aof_fd == -1) {
+    if (server.aof_multi_part) {
+        /* The rewrite opens the incremental file, and then replaces the
+         * files of the manifest, if any. */
+        if (server.aof_manifest == NULL)
+            server.aof_manifest = aofManifestLoad();
+    } else {
+        server.aof_fd = open(server.aof_filename,O_WRONLY|O_APPEND|O_CREAT,0644);
+    }
+    if (!server.aof_multi_part && server.aof_fd == -1) {
         char *cwdp = getcwd(cwd,MAXPATHLEN);
 
         serverLog(LL_WARNING,
@@ -253,7 +778,8 @@ int startAppendOnly() {
         server.aof_rewrite_scheduled = 1;
         serverLog(LL_WARNING,"AOF was enabled but there is already a child process saving an RDB file on disk. An AOF background was scheduled to start when possible.");
     } else if (rewriteAppendOnlyFileBackground() == C_ERR) {
-        close(server.aof_fd);
+        if (server.aof_fd != -1) close(server.aof_fd);
+        server.aof_fd = -1;
         serverLog(LL_WARNING,"Redis needs to enable the AOF but can't trigger a background AOF rewrite operation. Check the above logs for more info about the error.");
         return C_ERR;
     }
@@ -287,6 +813,16 @@ void flushAppendOnlyFile(int force) {
     int sync_in_progress = 0;
     mstime_t latency;
 
+    /* With group commit the writer thread does the job. Otherwise wait for
+     * the batches it may still have, queued before the switch, since they
+     * come first in the file. */
+    if (aofGroupCommitEnabled()) {
+        if (sdslen(server.aof_buf)) aofWriterQueue();
+        if (force) aofWriterDrain();
+        return;
+    }
+    aofWriterDrain();
+
     if (sdslen(server.aof_buf) == 0) return;
 
     if (server.aof_fsync == AOF_FSYNC_EVERYSEC)
@@ -365,7 +901,7 @@ void flushAppendOnlyFile(int force) {
                                        (long long)sdslen(server.aof_buf));
             }
 
-            if (ftruncate(server.aof_fd, server.aof_current_size) == -1) {
+            if (ftruncate(server.aof_fd, server.aof_fd_size) == -1) {
                 if (can_log) {
                     serverLog(LL_WARNING, "Could not remove short write "
                              "from the append-only file.  Redis may refuse "
@@ -398,6 +934,7 @@ void flushAppendOnlyFile(int force) {
              * was no way to undo it with ftruncate(2). */
             if (nwritten > 0) {
                 server.aof_current_size += nwritten;
+                server.aof_fd_size += nwritten;
                 sdsrange(server.aof_buf,nwritten,-1);
             }
             return; /* We'll try again on the next call... */
@@ -412,14 +949,17 @@ void flushAppendOnlyFile(int force) {
         }
     }
     server.aof_current_size += nwritten;
+    server.aof_fd_size += nwritten;
 
     /* Re-use AOF buffer when it is small enough. The maximum comes from the
      * arena size of 4k minus some overhead (but is otherwise arbitrary). */
     if ((sdslen(server.aof_buf)+sdsavail(server.aof_buf)) < 4000) {
         sdsclear(server.aof_buf);
     } else {
+        zmalloc_transient_begin();
         sdsfree(server.aof_buf);
         server.aof_buf = sdsempty();
+        zmalloc_transient_end();
     }
 
     /* Don't fsync if no-appendfsync-on-rewrite is set to yes and there are
@@ -444,11 +984,85 @@ void flushAppendOnlyFile(int force) {
     }
 }
 
+static sds catAppendOnlyVarint(sds dst, uint64_t v) {
+    unsigned char buf[10];
+    int len = 0;
+
+    while (v >= 0x80) {
+        buf[len++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    buf[len++] = v;
+    return sdscatlen(dst,buf,len);
+}
+
+/* Read a varint written by catAppendOnlyVarint(). Return 0 on EOF, read
+ * error or if the varint is malformed. */
+int aofReadBinaryVarint(FILE *fp, uint64_t *v) {
+    int shift = 0, c;
+
+    *v = 0;
+    while ((c = getc(fp)) != EOF) {
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) return 1;
+        if ((shift += 7) > 63) return 0;
+    }
+    return 0;
+}
+
+/* Binary version of catAppendOnlyGenericCommand(), see AOF_BINARY_CMD. The
+ * command is resolved from argv[0] as the loader of the RESP records would
+ * do, and bound to its ID first if not yet done in the current file. */
+static sds catAppendOnlyBinaryCommand(sds dst, struct redisCommand *cmd,
+                                      int argc, robj **argv)
+{
+    if (cmd->aof_epoch != server.aof_binary_epoch) {
+        robj *name = getDecodedObject(argv[0]);
+
+        if (cmd->aof_id == 0) cmd->aof_id = ++server.aof_binary_last_id;
+        cmd->aof_epoch = server.aof_binary_epoch;
+        dst = sdscatlen(dst,"\xf6",1);
+        dst = catAppendOnlyVarint(dst,cmd->aof_id);
+        dst = catAppendOnlyVarint(dst,sdslen((sds)name->ptr));
+        dst = sdscatsds(dst,(sds)name->ptr);
+        decrRefCount(name);
+    }
+    dst = sdscatlen(dst,"\xf7",1);
+    dst = catAppendOnlyVarint(dst,cmd->aof_id);
+    dst = catAppendOnlyVarint(dst,argc-1);
+    for (int j = 1; j < argc; j++) {
+        robj *o = argv[j];
+        long long value;
+
+        if (o->encoding == OBJ_ENCODING_INT ||
+            string2ll((const char*)o->ptr,sdslen((sds)o->ptr),&value))
+        {
+            if (o->encoding == OBJ_ENCODING_INT) value = (long)o->ptr;
+            dst = sdscatlen(dst,"\x01",1);
+            dst = catAppendOnlyVarint(dst,
+                ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+        } else {
+            dst = sdscatlen(dst,"\x00",1);
+            dst = catAppendOnlyVarint(dst,sdslen((sds)o->ptr));
+            dst = sdscatsds(dst,(sds)o->ptr);
+        }
+    }
+    return dst;
+}
+
 sds catAppendOnlyGenericCommand(sds dst, int argc, robj **argv) {
     char buf[32];
     int len, j;
     robj *o;
 
+    if (server.aof_binary_format) {
+        robj *name = getDecodedObject(argv[0]);
+        struct redisCommand *cmd = lookupCommand((sds)name->ptr);
+
+        decrRefCount(name);
+        if (cmd) return catAppendOnlyBinaryCommand(dst,cmd,argc,argv);
+    }
+
     buf[0] = '*';
     len = 1+ll2string(buf+1,sizeof(buf)-1,argc);
     buf[len++] = '\r';
@@ -506,8 +1120,9 @@ sds catAppendOnlyExpireAtCommand(sds buf, struct redisCommand *cmd, robj *key, r
     return buf;
 }
 
-void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int argc) {
-    sds buf = sdsempty();
+/* Append to 'buf' the AOF representation of the command, preceded by a
+ * SELECT if it targets a DB other than the one of the last command. */
+sds catAppendOnlyCommand(sds buf, struct redisCommand *cmd, int dictid, robj **argv, int argc) {
     robj *tmpargv[3];
 
     /* The DB this command was targeting is not the same as the last command
@@ -555,20 +1170,38 @@ void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int a
          * for the replication itself. */
         buf = catAppendOnlyGenericCommand(buf,argc,argv);
     }
+    return buf;
+}
 
+/* Append to the AOF the commands in 'buf', as created by
+ * catAppendOnlyCommand(). */
+void feedAppendOnlyFileBuffer(sds buf) {
     /* Append to the AOF buffer. This will be flushed on disk just before
      * of re-entering the event loop, so before the client will get a
-     * positive reply about the operation performed. */
-    if (server.aof_state == AOF_ON)
+     * positive reply about the operation performed. With a multi part AOF
+     * the incremental file opened by the rewrite gets the commands also
+     * while waiting for the first rewrite to complete. */
+    if (server.aof_state == AOF_ON ||
+        (server.aof_multi_part && server.aof_child_pid != -1))
+    {
+        zmalloc_transient_begin();
         server.aof_buf = sdscatlen(server.aof_buf,buf,sdslen(buf));
+        zmalloc_transient_end();
+        aofTrackCommitOfCurrentClient();
+    }
 
     /* If a background append only file rewriting is in progress we want to
      * accumulate the differences between the child DB and the current one
      * in a buffer, so that when the child process will do its work we
      * can append the differences to the new append only file. */
-    if (server.aof_child_pid != -1)
+    if (server.aof_child_pid != -1 && !server.aof_multi_part)
         aofRewriteBufferAppend((unsigned char*)buf,sdslen(buf));
+}
 
+void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int argc) {
+    sds buf = catAppendOnlyCommand(sdsempty(),cmd,dictid,argv,argc);
+
+    feedAppendOnlyFileBuffer(buf);
     sdsfree(buf);
 }
 
@@ -576,10 +1209,294 @@ void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int a
  * AOF loading
  * ------------------------------------------------------------------------- */
 
+/* Commands bound to the binary IDs seen so far while loading. */
+struct aofBinaryIds {
+    uint64_t size;
+    sds *names;
+    struct redisCommand **cmds;
+};
+
+/* A command read from the AOF, ready to be executed. */
+struct aofCommand {
+    struct redisCommand *cmd;
+    int argc;
+    robj **argv;
+    off_t end;                  /* File offset after the command. */
+};
+
+/* Return values of aofReadCommand(). */
+#define AOF_READ_OK 0           /* A command was read. */
+#define AOF_READ_EOF 1          /* End of file between two commands. */
+#define AOF_READ_ERR 2          /* Read error or truncated command. */
+#define AOF_READ_FMTERR 3       /* Bad file format. */
+#define AOF_READ_UNKNOWN 4      /* Unknown command, already logged. */
+
+static void aofBinaryIdsFree(aofBinaryIds *ids) {
+    for (uint64_t j = 0; j < ids->size; j++) sdsfree(ids->names[j]);
+    zfree(ids->names);
+    zfree(ids->cmds);
+}
+
+static void aofFreeArgv(int argc, robj **argv) {
+    for (int j = 0; j < argc; j++) decrRefCount(argv[j]);
+    zfree(argv);
+}
+
+/* Load an AOF_BINARY_DEF record, the type byte was already consumed. */
+static int aofReadBinaryDef(FILE *fp, aofBinaryIds *ids) {
+    uint64_t id, len;
+
+    if (!aofReadBinaryVarint(fp,&id) || !aofReadBinaryVarint(fp,&len))
+        return AOF_READ_ERR;
+    if (id == 0 || id > INT_MAX || len > PROTO_INLINE_MAX_SIZE)
+        return AOF_READ_FMTERR;
+
+    sds name = sdsnewlen(NULL,len);
+    if (len && fread(name,len,1,fp) == 0) {
+        sdsfree(name);
+        return AOF_READ_ERR;
+    }
+    struct redisCommand *cmd = lookupCommandReadOnly(name);
+    if (!cmd) {
+        serverLog(LL_WARNING,"Unknown command '%s' reading the append only file", name);
+        sdsfree(name);
+        return AOF_READ_UNKNOWN;
+    }
+    if (id >= ids->size) {
+        uint64_t size = id+16;
+        ids->names = (sds*)zrealloc(ids->names,sizeof(sds)*size);
+        ids->cmds = (redisCommand**)zrealloc(ids->cmds,sizeof(redisCommand*)*size);
+        memset(ids->names+ids->size,0,sizeof(sds)*(size-ids->size));
+        memset(ids->cmds+ids->size,0,sizeof(redisCommand*)*(size-ids->size));
+        ids->size = size;
+    }
+    sdsfree(ids->names[id]);
+    ids->names[id] = name;
+    ids->cmds[id] = cmd;
+    return AOF_READ_OK;
+}
+
+/* Load an AOF_BINARY_CMD record, the type byte was already consumed. The
+ * arguments are created straight from the record, without going through the
+ * RESP parsing and the command lookup. On error the arguments already read
+ * are freed. */
+static int aofReadBinaryCommand(FILE *fp, aofBinaryIds *ids, aofCommand *ac) {
+    uint64_t id, argc, len;
+    int res = AOF_READ_OK;
+
+    if (!aofReadBinaryVarint(fp,&id) || !aofReadBinaryVarint(fp,&argc))
+        return AOF_READ_ERR;
+    if (id >= ids->size || ids->cmds[id] == NULL || argc >= INT_MAX)
+        return AOF_READ_FMTERR;
+
+    ac->cmd = ids->cmds[id];
+    ac->argv = (robj **)zmalloc(sizeof(robj*)*(argc+1));
+    ac->argv[0] = createStringObject(ids->names[id],sdslen(ids->names[id]));
+    ac->argc = 1;
+    for (uint64_t j = 1; j <= argc; j++) {
+        int type = getc(fp);
+
+        if (type == AOF_BINARY_ARG_INT) {
+            char buf[LONG_STR_SIZE];
+            uint64_t zz;
+
+            if (!aofReadBinaryVarint(fp,&zz)) { res = AOF_READ_ERR; break; }
+            long long value = (long long)(zz >> 1) ^ -(long long)(zz & 1);
+            ac->argv[j] = createStringObject(buf,ll2string(buf,sizeof(buf),value));
+        } else if (type == AOF_BINARY_ARG_STR) {
+            if (!aofReadBinaryVarint(fp,&len)) { res = AOF_READ_ERR; break; }
+            sds arg = sdsnewlen(NULL,len);
+            if (len && fread(arg,len,1,fp) == 0) {
+                sdsfree(arg);
+                res = AOF_READ_ERR;
+                break;
+            }
+            ac->argv[j] = createObject(OBJ_STRING,arg);
+        } else {
+            res = type == EOF ? AOF_READ_ERR : AOF_READ_FMTERR;
+            break;
+        }
+        ac->argc++;
+    }
+    if (res != AOF_READ_OK) aofFreeArgv(ac->argc,ac->argv);
+    return res;
+}
+
+/* Read the next command of the AOF, in RESP format or as binary records.
+ * Only the file and 'ids' are touched, so that this can also run in the
+ * prefetch thread. */
+static int aofReadCommand(FILE *fp, aofBinaryIds *ids, aofCommand *ac) {
+    int argc, j, type, res;
+    unsigned long len;
+    robj **argv;
+    char buf[128];
+    sds argsds;
+
+    /* Binding records are consumed along the way. */
+    while ((type = getc(fp)) == AOF_BINARY_DEF)
+        if ((res = aofReadBinaryDef(fp,ids)) != AOF_READ_OK) return res;
+
+    if (type == AOF_BINARY_CMD) {
+        res = aofReadBinaryCommand(fp,ids,ac);
+        ac->end = ftello(fp);
+        return res;
+    }
+    if (type == EOF) return feof(fp) ? AOF_READ_EOF : AOF_READ_ERR;
+    ungetc(type,fp);
+
+    if (fgets(buf,sizeof(buf),fp) == NULL) return AOF_READ_ERR;
+    if (buf[0] != '*') return AOF_READ_FMTERR;
+    if (buf[1] == '\0') return AOF_READ_ERR;
+    argc = atoi(buf+1);
+    if (argc < 1) return AOF_READ_FMTERR;
+
+    argv = (robj **)zmalloc(sizeof(robj*)*argc);
+    for (j = 0; j < argc; j++) {
+        if (fgets(buf,sizeof(buf),fp) == NULL) {
+            aofFreeArgv(j,argv);
+            return AOF_READ_ERR;
+        }
+        if (buf[0] != '$') {
+            aofFreeArgv(j,argv);
+            return AOF_READ_FMTERR;
+        }
+        len = strtol(buf+1,NULL,10);
+        argsds = sdsnewlen(NULL,len);
+        if (len && fread(argsds,len,1,fp) == 0) {
+            sdsfree(argsds);
+            aofFreeArgv(j,argv);
+            return AOF_READ_ERR;
+        }
+        argv[j] = createObject(OBJ_STRING,argsds);
+        if (fread(buf,2,1,fp) == 0) {
+            aofFreeArgv(j+1,argv);
+            return AOF_READ_ERR; /* discard CRLF */
+        }
+    }
+
+    /* Command lookup */
+    ac->cmd = lookupCommandReadOnly((sds)argv[0]->ptr);
+    if (!ac->cmd) {
+        serverLog(LL_WARNING,"Unknown command '%s' reading the append only file", (char*)argv[0]->ptr);
+        aofFreeArgv(argc,argv);
+        return AOF_READ_UNKNOWN;
+    }
+    ac->argc = argc;
+    ac->argv = argv;
+    ac->end = ftello(fp);
+    return AOF_READ_OK;
+}
+
+/* With aof-load-prefetch the AOF is read and parsed by a thread while the
+ * main thread executes the commands, handed over in batches. */
+#define AOF_PREFETCH_BATCH 256
+#define AOF_PREFETCH_MAX_BATCHES 64
+
+struct aofPrefetchBatch {
+    int count;                  /* Commands in the batch. */
+    int status;                 /* Read status after the last command. */
+    int read_errno;             /* errno of the reader, on AOF_READ_ERR. */
+    aofCommand cmds[AOF_PREFETCH_BATCH];
+};
+
+struct aofPrefetch {
+    FILE *fp;
+    aofBinaryIds *ids;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;        /* Batches became ready or were consumed. */
+    list *ready;                /* Parsed batches, oldest first. */
+    aofPrefetchBatch *current;  /* Batch being executed. */
+    int pos;                    /* Next command of 'current'. */
+};
+
+void *aofPrefetchMain(void *arg) {
+    aofPrefetch *pf = (aofPrefetch*)arg;
+    int status = AOF_READ_OK;
+
+    while (status == AOF_READ_OK) {
+        aofPrefetchBatch *batch = (aofPrefetchBatch*)zmalloc(sizeof(*batch));
+
+        batch->count = 0;
+        while (batch->count < AOF_PREFETCH_BATCH) {
+            status = aofReadCommand(pf->fp,pf->ids,batch->cmds+batch->count);
+            if (status != AOF_READ_OK) break;
+            batch->count++;
+        }
+        batch->status = batch->count == AOF_PREFETCH_BATCH ? AOF_READ_OK : status;
+        batch->read_errno = errno;
+
+        pthread_mutex_lock(&pf->mutex);
+        while (pf->ready->listLength() >= AOF_PREFETCH_MAX_BATCHES)
+            pthread_cond_wait(&pf->cond,&pf->mutex);
+        pf->ready->listAddNodeTail(batch);
+        pthread_cond_signal(&pf->cond);
+        pthread_mutex_unlock(&pf->mutex);
+    }
+    return NULL;
+}
+
+static aofPrefetch *aofPrefetchStart(FILE *fp, aofBinaryIds *ids) {
+    aofPrefetch *pf = (aofPrefetch*)zcalloc(sizeof(*pf));
+
+    pf->fp = fp;
+    pf->ids = ids;
+    pf->ready = listCreate();
+    pthread_mutex_init(&pf->mutex,NULL);
+    pthread_cond_init(&pf->cond,NULL);
+    if (pthread_create(&pf->thread,NULL,aofPrefetchMain,pf) != 0) {
+        serverLog(LL_WARNING,"Can't start the AOF prefetch thread, "
+                             "loading the AOF without it.");
+        listRelease(pf->ready);
+        zfree(pf);
+        return NULL;
+    }
+    return pf;
+}
+
+/* Return the next command parsed by the prefetch thread, with the same
+ * semantic of aofReadCommand(). Once the end of the file or an error is
+ * reached the thread is joined and, for read errors, its errno is restored,
+ * so that the caller can access the file again. */
+static int aofPrefetchNext(aofPrefetch *pf, aofCommand *ac) {
+    while (pf->current == NULL || pf->pos == pf->current->count) {
+        if (pf->current) {
+            int status = pf->current->status;
+            if (status != AOF_READ_OK) {
+                errno = pf->current->read_errno;
+                return status;
+            }
+            zfree(pf->current);
+        }
+        pthread_mutex_lock(&pf->mutex);
+        while (pf->ready->listLength() == 0)
+            pthread_cond_wait(&pf->cond,&pf->mutex);
+        listNode *ln = pf->ready->listFirst();
+        pf->current = (aofPrefetchBatch*)ln->listNodeValue();
+        pf->ready->listDelNode(ln);
+        pthread_cond_signal(&pf->cond);
+        pthread_mutex_unlock(&pf->mutex);
+        pf->pos = 0;
+        if (pf->current->status != AOF_READ_OK)
+            pthread_join(pf->thread,NULL);
+    }
+    *ac = pf->current->cmds[pf->pos++];
+    return AOF_READ_OK;
+}
+
+static void aofPrefetchFree(aofPrefetch *pf) {
+    zfree(pf->current);
+    listRelease(pf->ready);
+    pthread_mutex_destroy(&pf->mutex);
+    pthread_cond_destroy(&pf->cond);
+    zfree(pf);
+}
+
 /* In Redis commands are always executed in the context of a client, so in
  * order to load the append only file we need to create a fake client. */
 struct client *createFakeClient() {
-    struct client* c = (client*)zmalloc(sizeof(*c));
+    /* Zeroed, so that the fields not set below are NULL or 0 as well. */
+    struct client* c = (client*)zcalloc(sizeof(*c));
 
     c->selectDb(0);
     c->m_fd = -1;
@@ -597,8 +1514,10 @@ struct client *createFakeClient() {
     c->m_reply = listCreate();
     c->m_reply_bytes = 0;
     c->m_obuf_soft_limit_reached_time = 0;
+    c->m_aof_commit_seq = 0;
     c->m_watched_keys = listCreate();
     c->m_cached_peer_id = NULL;
+    c->m_reply_builder = NULL;
     c->m_reply->listSetFreeMethod(decrRefCountVoid);
     c->m_reply->listSetDupMethod(dupClientReplyValue);
     initClientMultiState(c);
@@ -631,6 +1550,8 @@ int loadAppendOnlyFile(char *filename) {
     int old_aof_state = server.aof_state;
     long loops = 0;
     off_t valid_up_to = 0; /* Offset of latest well-formed command loaded. */
+    aofBinaryIds ids = {0,NULL,NULL};
+    aofPrefetch *pf = NULL;
 
     if (fp == NULL) {
         serverLog(LL_WARNING,"Fatal error: can't open the append log file for reading: %s",strerror(errno));
@@ -676,69 +1597,32 @@ int loadAppendOnlyFile(char *filename) {
         }
     }
 
-    /* Read the actual AOF file, in REPL format, command by command. */
+    /* Read the actual AOF file, in REPL format or as binary records,
+     * command by command. */
+    if (server.aof_load_prefetch) pf = aofPrefetchStart(fp,&ids);
     while(1) {
-        int argc, j;
-        unsigned long len;
-        robj **argv;
-        char buf[128];
-        sds argsds;
-        struct redisCommand *cmd;
+        aofCommand ac;
+        int res;
+
+        res = pf ? aofPrefetchNext(pf,&ac) : aofReadCommand(fp,&ids,&ac);
+        if (res == AOF_READ_EOF) break;
+        if (res == AOF_READ_ERR) goto readerr;
+        if (res == AOF_READ_FMTERR) goto fmterr;
+        if (res == AOF_READ_UNKNOWN) exit(1);
 
         /* Serve the clients from time to time */
         if (!(loops++ % 1000)) {
-            loadingProgress(ftello(fp));
+            loadingProgress(ac.end);
             processEventsWhileBlocked();
         }
 
-        if (fgets(buf,sizeof(buf),fp) == NULL) {
-            if (feof(fp))
-                break;
-            else
-                goto readerr;
-        }
-        if (buf[0] != '*') goto fmterr;
-        if (buf[1] == '\0') goto readerr;
-        argc = atoi(buf+1);
-        if (argc < 1) goto fmterr;
-
-        argv = (robj **)zmalloc(sizeof(robj*)*argc);
-        fakeClient->m_argc = argc;
-        fakeClient->m_argv = argv;
-
-        for (j = 0; j < argc; j++) {
-            if (fgets(buf,sizeof(buf),fp) == NULL) {
-                fakeClient->m_argc = j; /* Free up to j-1. */
-                freeFakeClientArgv(fakeClient);
-                goto readerr;
-            }
-            if (buf[0] != '$') goto fmterr;
-            len = strtol(buf+1,NULL,10);
-            argsds = sdsnewlen(NULL,len);
-            if (len && fread(argsds,len,1,fp) == 0) {
-                sdsfree(argsds);
-                fakeClient->m_argc = j; /* Free up to j-1. */
-                freeFakeClientArgv(fakeClient);
-                goto readerr;
-            }
-            argv[j] = createObject(OBJ_STRING,argsds);
-            if (fread(buf,2,1,fp) == 0) {
-                fakeClient->m_argc = j+1; /* Free up to j. */
-                freeFakeClientArgv(fakeClient);
-                goto readerr; /* discard CRLF */
-            }
-        }
-
-        /* Command lookup */
-        cmd = lookupCommand((sds)argv[0]->ptr);
-        if (!cmd) {
-            serverLog(LL_WARNING,"Unknown command '%s' reading the append only file", (char*)argv[0]->ptr);
-            exit(1);
-        }
-
         /* Run the command in the context of a fake client */
-        fakeClient->m_cmd = cmd;
-        cmd->proc(fakeClient);
+        fakeClient->m_argc = ac.argc;
+        fakeClient->m_argv = ac.argv;
+        fakeClient->m_cmd = ac.cmd;
+        size_t arena_mark = zarena_mark();
+        ac.cmd->proc(fakeClient);
+        zarena_release(arena_mark);
 
         /* The fake client should not have a reply */
         serverAssert(fakeClient->m_response_buff_pos == 0 && fakeClient->m_reply->listLength() == 0);
@@ -749,7 +1633,7 @@ int loadAppendOnlyFile(char *filename) {
          * argv/argc of the client instead of the local variables. */
         freeFakeClientArgv(fakeClient);
         fakeClient->m_cmd = NULL;
-        if (server.aof_load_truncated) valid_up_to = ftello(fp);
+        if (server.aof_load_truncated) valid_up_to = ac.end;
     }
 
     /* This point can only be reached when EOF is reached without errors.
@@ -759,6 +1643,8 @@ int loadAppendOnlyFile(char *filename) {
 loaded_ok: /* DB loaded, cleanup and return C_OK to the caller. */
     fclose(fp);
     freeFakeClient(fakeClient);
+    aofBinaryIdsFree(&ids);
+    if (pf) aofPrefetchFree(pf);
     server.aof_state = old_aof_state;
     stopLoading();
     aofUpdateCurrentSize();
@@ -821,6 +1707,28 @@ int rio::rioWriteBulkObject(robj *obj)
         return rioWriteBulkLongLong((long)obj->ptr);
     } else if (sdsEncodedObject(obj)) {
         return rioWriteBulkString((const char *)obj->ptr,sdslen((sds)obj->ptr));
+    } else if (obj->encoding == OBJ_ENCODING_CHUNKED) {
+        /* Stream the chunks, writing zeros for the missing ones, instead
+         * of building the whole string. */
+        static const unsigned char zeros[CHUNKED_BITMAP_CHUNK_BYTES] = {0};
+        const chunkedBitmap *cb = (const chunkedBitmap *)obj->ptr;
+        size_t len = cb->chunkedBitmapLen(), nwritten;
+
+        if ((nwritten = rioWriteBulkCount('$',len)) == 0) return 0;
+        for (size_t i = 0; i < cb->chunkedBitmapNumChunks(); i++) {
+            const unsigned char *chunk = cb->chunkedBitmapChunk(i);
+            size_t n = len-i*CHUNKED_BITMAP_CHUNK_BYTES;
+
+            if (n > CHUNKED_BITMAP_CHUNK_BYTES) n = CHUNKED_BITMAP_CHUNK_BYTES;
+            if (rioWrite(chunk ? chunk : zeros,n) == 0) return 0;
+        }
+        if (rioWrite("\r\n",2) == 0) return 0;
+        return nwritten+len+2;
+    } else if (obj->encoding == OBJ_ENCODING_COMPRESSED) {
+        sds s = compressedStringObjectToSds(obj);
+        size_t nwritten = rioWriteBulkString(s,sdslen(s));
+        sdsfree(s);
+        return nwritten;
     } else {
         serverPanic("Unknown string encoding");
     }
@@ -881,6 +1789,25 @@ int rewriteSetObject(rio *r, robj *key, robj *o) {
             if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
             items--;
         }
+    } else if (o->encoding == OBJ_ENCODING_ROARING) {
+        roaring *rb = (roaring *)o->ptr;
+        roaringIterator it;
+        int64_t llval;
+
+        rb->roaringInitIterator(&it);
+        while(rb->roaringNext(&it,&llval)) {
+            if (count == 0) {
+                int cmd_items = (items > AOF_REWRITE_ITEMS_PER_CMD) ?
+                    AOF_REWRITE_ITEMS_PER_CMD : items;
+
+                if (r->rioWriteBulkCount('*',2+cmd_items) == 0) return 0;
+                if (r->rioWriteBulkString("SADD",4) == 0) return 0;
+                if (r->rioWriteBulkObject(key) == 0) return 0;
+            }
+            if (r->rioWriteBulkLongLong(llval) == 0) return 0;
+            if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
+            items--;
+        }
     } else if (o->encoding == OBJ_ENCODING_HT) {
         dictIterator di((dict *)o->ptr);
         dictEntry *de;
@@ -910,7 +1837,7 @@ int rewriteSetObject(rio *r, robj *key, robj *o) {
 int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
     long long count = 0, items = zsetLength(o);
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char* zl = (unsigned char*)o->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -918,13 +1845,13 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
         long long vll;
         double score;
 
-        eptr = ziplistIndex(zl,0);
+        eptr = lpFirst(zl);
         serverAssert(eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         while (eptr != NULL) {
-            serverAssert(ziplistGet(eptr,&vstr,&vlen,&vll));
+            serverAssert(lpGetValue(eptr,&vstr,&vlen,&vll));
             score = zzlGetScore(sptr);
 
             if (count == 0) {
@@ -945,14 +1872,16 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
             if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
             items--;
         }
-    } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (o->encoding == OBJ_ENCODING_SKIPLIST ||
+               o->encoding == OBJ_ENCODING_BTREE)
+    {
         zset* zs = (zset*)o->ptr;
         dictIterator di((dict *)zs->_dict);
         dictEntry *de;
 
         while((de = di.dictNext()) != NULL) {
             sds ele = (sds)de->dictGetKey();
-            double* score = (double*)de->dictGetVal();
+            double score = zsetDictScore(zs,de);
 
             if (count == 0) {
                 int cmd_items = (items > AOF_REWRITE_ITEMS_PER_CMD) ?
@@ -962,7 +1891,7 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
                 if (r->rioWriteBulkString("ZADD",4) == 0) return 0;
                 if (r->rioWriteBulkObject(key) == 0) return 0;
             }
-            if (r->rioWriteBulkDouble(*score) == 0) return 0;
+            if (r->rioWriteBulkDouble(score) == 0) return 0;
             if (r->rioWriteBulkString(ele,sdslen(ele)) == 0) return 0;
             if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
             items--;
@@ -980,25 +1909,132 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
  *
  * The function returns 0 on error, non-zero on success. */
 static int rioWriteHashIteratorCursor(rio *r, hashTypeIterator *hi, int what) {
-    if (hi->encoding() == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding() == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        hi->hashTypeCurrentFromZiplist(what, &vstr, &vlen, &vll);
+        hi->hashTypeCurrentFromListpack(what, &vstr, &vlen, &vll);
         if (vstr)
             return r->rioWriteBulkString((char*)vstr, vlen);
         else
             return r->rioWriteBulkLongLong(vll);
     } else if (hi->encoding() == OBJ_ENCODING_HT) {
-        sds value = hi->hashTypeCurrentFromHashTable(what);
-        return r->rioWriteBulkString(value, sdslen(value));
+        sds value;
+        long long vll;
+
+        hi->hashTypeCurrentFromHashTable(what, &value, &vll);
+        if (value)
+            return r->rioWriteBulkString(value, sdslen(value));
+        else
+            return r->rioWriteBulkLongLong(vll);
     }
 
     serverPanic("Unknown hash encoding");
     return 0;
 }
 
+/* Emit the commands needed to rebuild a stream object: an XADD with its
+ * own ID for every entry. The function returns 0 on error, 1 on success. */
+int rewriteStreamObject(rio *r, robj *key, robj *o) {
+    stream *s = (stream *)o->ptr;
+    streamIterator si;
+    streamIteratorStart(&si,s,NULL,NULL,0);
+    streamID id;
+    int64_t numfields;
+
+    while(streamIteratorGetID(&si,&id,&numfields)) {
+        /* Emit the XADD <key> <id> ...fields... command. */
+        sds replyid = streamIDToSds(&id);
+        int ok = r->rioWriteBulkCount('*',3+numfields*2) &&
+                 r->rioWriteBulkString("XADD",4) &&
+                 r->rioWriteBulkObject(key) &&
+                 r->rioWriteBulkString(replyid,sdslen(replyid));
+        sdsfree(replyid);
+        while(ok && numfields--) {
+            unsigned char *field, *value;
+            int64_t field_len, value_len;
+            streamIteratorGetField(&si,&field,&value,&field_len,&value_len);
+            ok = r->rioWriteBulkString((char*)field,field_len) &&
+                 r->rioWriteBulkString((char*)value,value_len);
+        }
+        if (!ok) {
+            streamIteratorStop(&si);
+            return 0;
+        }
+    }
+    streamIteratorStop(&si);
+
+    /* A stream trimmed to zero entries still remembers its last ID: add an
+     * entry with that ID and trim it away with MAXLEN 0, so that the key
+     * exists and new IDs keep growing after the reload. */
+    if (s->length == 0) {
+        sds lastid = streamIDToSds(&s->last_id);
+        int ok = r->rioWriteBulkCount('*',7) &&
+                 r->rioWriteBulkString("XADD",4) &&
+                 r->rioWriteBulkObject(key) &&
+                 r->rioWriteBulkString("MAXLEN",6) &&
+                 r->rioWriteBulkString("0",1) &&
+                 r->rioWriteBulkString(lastid,sdslen(lastid)) &&
+                 r->rioWriteBulkString("x",1) &&
+                 r->rioWriteBulkString("y",1);
+        sdsfree(lastid);
+        if (!ok) return 0;
+    }
+
+    /* Create all the stream consumer groups, then claim every pending
+     * entry for its owner: XCLAIM with FORCE creates the pending entry
+     * together with the consumer. */
+    if (s->cgroups) {
+        raxIterator ri;
+        raxStart(&ri,s->cgroups);
+        raxSeek(&ri,"^",NULL,0);
+        while(raxNext(&ri)) {
+            streamCG *group = (streamCG *)ri.data;
+            sds lastid = streamIDToSds(&group->last_id);
+            int ok = r->rioWriteBulkCount('*',5) &&
+                     r->rioWriteBulkString("XGROUP",6) &&
+                     r->rioWriteBulkString("CREATE",6) &&
+                     r->rioWriteBulkObject(key) &&
+                     r->rioWriteBulkString((char*)ri.key,ri.key_len) &&
+                     r->rioWriteBulkString(lastid,sdslen(lastid));
+            sdsfree(lastid);
+
+            raxIterator ri_pel;
+            raxStart(&ri_pel,group->pel);
+            raxSeek(&ri_pel,"^",NULL,0);
+            while(ok && raxNext(&ri_pel)) {
+                streamNACK *nack = (streamNACK *)ri_pel.data;
+                streamID id;
+                streamDecodeID(ri_pel.key,&id);
+                sds pelid = streamIDToSds(&id);
+                ok = r->rioWriteBulkCount('*',12) &&
+                     r->rioWriteBulkString("XCLAIM",6) &&
+                     r->rioWriteBulkObject(key) &&
+                     r->rioWriteBulkString((char*)ri.key,ri.key_len) &&
+                     r->rioWriteBulkString(nack->consumer->name,
+                                           sdslen(nack->consumer->name)) &&
+                     r->rioWriteBulkString("0",1) &&
+                     r->rioWriteBulkString(pelid,sdslen(pelid)) &&
+                     r->rioWriteBulkString("TIME",4) &&
+                     r->rioWriteBulkLongLong(nack->delivery_time) &&
+                     r->rioWriteBulkString("RETRYCOUNT",10) &&
+                     r->rioWriteBulkLongLong(nack->delivery_count) &&
+                     r->rioWriteBulkString("JUSTID",6) &&
+                     r->rioWriteBulkString("FORCE",5);
+                sdsfree(pelid);
+            }
+            raxStop(&ri_pel);
+            if (!ok) {
+                raxStop(&ri);
+                return 0;
+            }
+        }
+        raxStop(&ri);
+    }
+    return 1;
+}
+
 /* Emit the commands needed to rebuild a hash object.
  * The function returns 0 on error, 1 on success. */
 int rewriteHashObject(rio *r, robj *key, robj *o)
@@ -1023,6 +2059,25 @@ int rewriteHashObject(rio *r, robj *key, robj *o)
         items--;
     }
 
+    /* Then the TTL of the fields that have one, one HPEXPIREAT each. */
+    if (hashTypeFieldExpires(o)) {
+        zskiplistPair *pairs;
+        unsigned long j, len = hashTypeGetFieldExpires(o,&pairs);
+        int ok = 1;
+
+        for (j = 0; j < len && ok; j++) {
+            ok = r->rioWriteBulkCount('*',6) &&
+                 r->rioWriteBulkString("HPEXPIREAT",10) &&
+                 r->rioWriteBulkObject(key) &&
+                 r->rioWriteBulkLongLong((long long)pairs[j].score) &&
+                 r->rioWriteBulkString("FIELDS",6) &&
+                 r->rioWriteBulkLongLong(1) &&
+                 r->rioWriteBulkString(pairs[j].ele,sdslen(pairs[j].ele));
+        }
+        for (j = 0; j < len; j++) sdsfree(pairs[j].ele);
+        zfree(pairs);
+        if (!ok) return 0;
+    }
     return 1;
 }
 
@@ -1048,6 +2103,9 @@ ssize_t aofReadDiffFromParent() {
     char buf[65536]; /* Default pipe buffer size on most Linux systems. */
     ssize_t nread, total = 0;
 
+    /* A multi part AOF has no diff: see aofOpenNewIncr(). */
+    if (server.aof_multi_part) return 0;
+
     while ((nread =
             read(server.aof_pipe_read_data_from_parent,buf,sizeof(buf))) > 0) {
         server.aof_child_diff = sdscatlen(server.aof_child_diff,buf,nread);
@@ -1062,6 +2120,22 @@ int rewriteAppendOnlyFileRio(rio *aof) {
     long long now = mstime();
     int j;
 
+    /* The functions first, so that the scripts following can call them. */
+    if (server.lua_functions->dictSize()) {
+        dictIterator fi(server.lua_functions);
+        while((de = fi.dictNext()) != NULL) {
+            sds name = (sds)de->dictGetKey();
+            robj *body = ((luaFunction *)de->dictGetVal())->body;
+
+            if (aof->rioWriteBulkCount('*',5) == 0) goto werr;
+            if (aof->rioWriteBulkString("FUNCTION",8) == 0) goto werr;
+            if (aof->rioWriteBulkString("LOAD",4) == 0) goto werr;
+            if (aof->rioWriteBulkString("REPLACE",7) == 0) goto werr;
+            if (aof->rioWriteBulkString(name,sdslen(name)) == 0) goto werr;
+            if (aof->rioWriteBulkObject(body) == 0) goto werr;
+        }
+    }
+
     for (j = 0; j < server.dbnum; j++) {
         char selectcmd[] = "*2\r\n$6\r\nSELECT\r\n";
         redisDb *db = server.db+j;
@@ -1081,9 +2155,11 @@ int rewriteAppendOnlyFileRio(rio *aof) {
 
             keystr = (sds)de->dictGetKey();
             o = (robj *)de->dictGetVal();
+            if (o->encoding == OBJ_ENCODING_LAZY) lazyLoadValue(o);
             initStaticStringObject(key,keystr);
 
             expiretime = getExpire(db,&key);
+            sendChildCowInfoIfNeeded();
 
             /* If this key is already expired skip it */
             if (expiretime != -1 && expiretime < now) continue;
@@ -1104,6 +2180,8 @@ int rewriteAppendOnlyFileRio(rio *aof) {
                 if (rewriteSortedSetObject(aof,&key,o) == 0) goto werr;
             } else if (o->type == OBJ_HASH) {
                 if (rewriteHashObject(aof,&key,o) == 0) goto werr;
+            } else if (o->type == OBJ_STREAM) {
+                if (rewriteStreamObject(aof,&key,o) == 0) goto werr;
             } else if (o->type == OBJ_MODULE) {
                 if (rewriteModuleObject(aof,&key,o) == 0) goto werr;
             } else {
@@ -1173,6 +2251,10 @@ int rewriteAppendOnlyFile(char *filename) {
     if (fflush(fp) == EOF) goto werr;
     if (fsync(fileno(fp)) == -1) goto werr;
 
+    /* A multi part AOF rewrite has no diff to append: the parent writes
+     * the new commands to a new incremental file meanwhile. */
+    if (server.aof_multi_part) goto finalize;
+
     /* Read again a few times to get more data from the parent.
      * We can't read forever (the server may receive data from clients
      * faster than it is able to send data to the child), so we try to read
@@ -1211,6 +2293,7 @@ int rewriteAppendOnlyFile(char *filename) {
     if (aof.rioWrite(server.aof_child_diff,sdslen(server.aof_child_diff)) == 0)
         goto werr;
 
+finalize:
     /* Make sure data will not remain on the OS's output buffers */
     if (fflush(fp) == EOF) goto werr;
     if (fsync(fileno(fp)) == -1) goto werr;
@@ -1328,7 +2411,14 @@ int rewriteAppendOnlyFileBackground() {
     long long start;
 
     if (server.aof_child_pid != -1 || server.rdb_child_pid != -1) return C_ERR;
-    if (aofCreatePipes() != C_OK) return C_ERR;
+    if (server.aof_multi_part) {
+        /* The child snapshot is the base of the commands from now on. */
+        if (server.aof_manifest == NULL)
+            server.aof_manifest = aofManifestLoad();
+        if (aofOpenNewIncr() != C_OK) return C_ERR;
+    } else if (aofCreatePipes() != C_OK) {
+        return C_ERR;
+    }
     openChildInfoPipe();
     start = ustime();
     if ((childpid = fork()) == 0) {
@@ -1336,6 +2426,7 @@ int rewriteAppendOnlyFileBackground() {
 
         /* Child */
         closeListeningSockets(0);
+        childInfoStartReports();
         redisSetProcTitle("redis-aof-rewrite");
         snprintf(tmpfile,256,"temp-rewriteaof-bg-%d.aof", (int) getpid());
         if (rewriteAppendOnlyFile(tmpfile) == C_OK) {
@@ -1363,7 +2454,7 @@ int rewriteAppendOnlyFileBackground() {
             serverLog(LL_WARNING,
                 "Can't rewrite append only file in background: fork: %s",
                 strerror(errno));
-            aofClosePipes();
+            if (!server.aof_multi_part) aofClosePipes();
             return C_ERR;
         }
         serverLog(LL_NOTICE,
@@ -1375,8 +2466,10 @@ int rewriteAppendOnlyFileBackground() {
         /* We set appendseldb to -1 in order to force the next call to the
          * feedAppendOnlyFile() to issue a SELECT command, so the differences
          * accumulated by the parent into server.aof_rewrite_buf will start
-         * with a SELECT statement and it will be safe to merge. */
+         * with a SELECT statement and it will be safe to merge. For the
+         * same reason the binary command IDs are bound again. */
         server.aof_selected_db = -1;
+        server.aof_binary_epoch++;
         replicationScriptCacheFlush();
         return C_OK;
     }
@@ -1416,7 +2509,10 @@ void aofUpdateCurrentSize() {
         serverLog(LL_WARNING,"Unable to obtain the AOF file length. stat: %s",
             strerror(errno));
     } else {
+        server.aof_fd_size = sb.st_size;
         server.aof_current_size = sb.st_size;
+        if (server.aof_multi_part)
+            server.aof_current_size += aofManifestOlderFilesSize();
     }
     latencyEndMonitor(latency);
     latencyAddSampleIfNeeded("aof-fstat",latency);
@@ -1425,7 +2521,39 @@ void aofUpdateCurrentSize() {
 /* A background append only file rewriting (BGREWRITEAOF) terminated its work.
  * Handle this. */
 void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
-    if (!bysignal && exitcode == 0) {
+    if (!bysignal && exitcode == 0 && server.aof_multi_part) {
+        char tmpfile[256];
+        mstime_t latency;
+
+        serverLog(LL_NOTICE,
+            "Background AOF rewrite terminated with success");
+
+        /* The commands executed meanwhile are already in the last
+         * incremental file: just replace the base. */
+        snprintf(tmpfile,256,"temp-rewriteaof-bg-%d.aof",
+            (int)server.aof_child_pid);
+        latencyStartMonitor(latency);
+        if (aofInstallNewBase(tmpfile) == C_ERR) goto cleanup;
+        latencyEndMonitor(latency);
+        latencyAddSampleIfNeeded("aof-rename",latency);
+        aofUpdateCurrentSize();
+        server.aof_rewrite_base_size = server.aof_current_size;
+        server.aof_lastbgrewrite_status = C_OK;
+
+        serverLog(LL_NOTICE, "Background AOF rewrite finished successfully");
+        if (server.aof_state == AOF_WAIT_REWRITE)
+            server.aof_state = AOF_ON;
+
+        /* With the AOF disabled this was a one time rewrite: the commands
+         * executed meanwhile complete the incremental file. */
+        if (server.aof_state == AOF_OFF) {
+            flushAppendOnlyFile(1);
+            aof_fsync(server.aof_fd);
+            bioCreateBackgroundJob(BIO_CLOSE_FILE,(void*)(long)server.aof_fd,
+                                   NULL,NULL);
+            server.aof_fd = -1;
+        }
+    } else if (!bysignal && exitcode == 0) {
         int newfd, oldfd;
         char tmpfile[256];
         long long now = ustime();
@@ -1434,6 +2562,10 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
         serverLog(LL_NOTICE,
             "Background AOF rewrite terminated with success");
 
+        /* The group commit thread must be done with the old file before
+         * it gets replaced. */
+        aofWriterDrain();
+
         /* Flush the differences accumulated by the parent to the
          * rewritten AOF. */
         latencyStartMonitor(latency);
@@ -1531,8 +2663,10 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
 
             /* Clear regular AOF buffer since its contents was just written to
              * the new AOF from the background rewrite buffer. */
+            zmalloc_transient_begin();
             sdsfree(server.aof_buf);
             server.aof_buf = sdsempty();
+            zmalloc_transient_end();
         }
 
         server.aof_lastbgrewrite_status = C_OK;
@@ -1562,7 +2696,7 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
     }
 
 cleanup:
-    aofClosePipes();
+    if (!server.aof_multi_part) aofClosePipes();
     aofRewriteBufferReset();
     aofRemoveTempFile(server.aof_child_pid);
     server.aof_child_pid = -1;
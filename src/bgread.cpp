@@ -0,0 +1,659 @@
+/* Background execution and streaming of large reads.
+ *
+ * HGETALL, HKEYS, HVALS, SMEMBERS, LRANGE, ZRANGE and ZREVRANGE replying
+ * many elements don't build the whole reply at once: the command replies
+ * the length of the array, then the client is suspended while its reply is
+ * produced a part at a time (see startReplyProducer()), as the output
+ * buffer of the client drains. So the memory used by the reply stays
+ * bounded whatever the speed of the client.
+ *
+ * Reading at least reply-stream-threshold elements, the main thread walks
+ * the value a chunk of BGREAD_CHUNK_BYTES at a time. Reading at least
+ * bgread-threshold elements, a thread walks the value instead, and the
+ * main thread appends to the output buffer of the client the chunks of
+ * protocol that it produces. The other clients are served meanwhile. The
+ * thread stops when BGREAD_MAX_PENDING bytes are not sent yet, and as
+ * soon as the client is freed.
+ *
+ * The value is pinned while it is walked: a reference is held, so that
+ * deleting or overwriting the key doesn't free it, and it is not modified.
+ * The walks of the main thread are just completed at once before a command
+ * modifies the value. The write commands about a value walked by the
+ * thread are blocked (BLOCKED_BGREAD) and executed again once it is
+ * unpinned, the replication link, the scripts and the modules wait
+ * synchronously in lookupKeyWrite() instead, and the thread doesn't wait
+ * for the clients meanwhile. The thread only walks the encodings that the
+ * read commands of the main thread don't modify: hash tables not
+ * rehashing, quicklists not compressed, skiplists, B+trees, intsets and
+ * roaring bitmaps. The main thread also walks compressed quicklists.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "bgread.h"
+#include "intset.h"
+#include "roaring.h"
+#include "zbtree.h"
+#include <math.h>
+
+#define BGREAD_CHUNK_ROOM (BGREAD_CHUNK_BYTES+64)
+
+/* A read walked by the thread, or by the main thread while its reply is
+ * sent. */
+struct bgreadJob {
+    client *c;          /* Client reading, NULL once it is freed. */
+    robj *o;            /* Value read, referenced while pinned. */
+    long count;         /* Elements still to walk. */
+    int flags;          /* BGREAD_* flags. */
+    int threaded;       /* Walked by the thread. */
+    list *waiters;      /* Clients waiting to modify the value. */
+    sds buf;            /* Protocol being produced. */
+
+    /* Position of the walk, depending on the encoding. */
+    unsigned long cursor;   /* dictScan() cursor. */
+    uint32_t pos;           /* Intset position. */
+    roaringIterator rit;
+    quicklistIter *qi;
+    zskiplistNode *zn;
+    zbtCursor zcur;
+    int zvalid;
+
+    /* Under the mutex. */
+    list *chunks;       /* Protocol produced, not sent yet. */
+    size_t pending;     /* Bytes in 'chunks'. */
+    int done;           /* The thread doesn't read the value anymore. */
+    int canceled;       /* The client is gone: stop reading. */
+    int unthrottled;    /* A write waits for the job: don't wait for the
+                           client. */
+};
+
+static struct {
+    int started;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;            /* Jobs queued, or protocol sent. */
+    pthread_cond_t done_cond;       /* A job is done, see bgreadWaitValue(). */
+    list *todo;                     /* Jobs queued, under the mutex. */
+    int notify_pipe[2];
+} bgread;
+
+/* --------------------------------- Walk ---------------------------------- */
+
+/* Append a bulk string to the protocol of the job. */
+static void bgreadAddBulk(bgreadJob *job, const char *s, size_t len) {
+    char hdr[LONG_STR_SIZE+3];
+    int n;
+
+    hdr[0] = '$';
+    n = 1+ll2string(hdr+1,sizeof(hdr)-1,len);
+    hdr[n++] = '\r';
+    hdr[n++] = '\n';
+    job->buf = sdscatlen(job->buf,hdr,n);
+    job->buf = sdscatlen(job->buf,s,len);
+    job->buf = sdscatlen(job->buf,"\r\n",2);
+}
+
+static void bgreadAddBulkLongLong(bgreadJob *job, long long value) {
+    char buf[LONG_STR_SIZE];
+    int len = ll2string(buf,sizeof(buf),value);
+
+    bgreadAddBulk(job,buf,len);
+}
+
+/* Same format as addReplyDouble(). */
+static void bgreadAddDouble(bgreadJob *job, double d) {
+    char buf[128];
+    int len;
+
+    if (isinf(d)) {
+        bgreadAddBulk(job,d > 0 ? "inf" : "-inf",d > 0 ? 3 : 4);
+        return;
+    }
+    len = d2string(buf,sizeof(buf),d);
+    bgreadAddBulk(job,buf,len);
+}
+
+static int bgreadChunkIsFull(bgreadJob *job) {
+    return sdslen(job->buf) >= BGREAD_CHUNK_BYTES;
+}
+
+/* dictScan() callback of the hashes and the sets. */
+static void bgreadScanCallback(void *privdata, const dictEntry *de) {
+    bgreadJob *job = (bgreadJob*)privdata;
+    sds key = (sds)de->dictGetKey();
+
+    if (job->o->type == OBJ_SET || job->flags & BGREAD_HASH_FIELDS)
+        bgreadAddBulk(job,key,sdslen(key));
+    if (job->o->type == OBJ_HASH && job->flags & BGREAD_HASH_VALUES) {
+        if (hashDictValIsInt(de)) {
+            bgreadAddBulkLongLong(job,hashDictValGetInt(de));
+        } else {
+            sds val = (sds)de->dictGetVal();
+            bgreadAddBulk(job,val,sdslen(val));
+        }
+    }
+}
+
+/* Append the protocol of the next elements of the value to job->buf, until
+ * it holds BGREAD_CHUNK_BYTES. Return 1 if some elements are left. The
+ * thread, as the main thread, may walk the value a chunk at a time, since
+ * it is not modified meanwhile. */
+static int bgreadWalk(bgreadJob *job) {
+    robj *o = job->o;
+    int reverse = job->flags & BGREAD_REVERSE;
+    int withscores = job->flags & BGREAD_WITHSCORES;
+    int64_t value;
+
+    if (o->encoding == OBJ_ENCODING_HT) {
+        dict *d = (dict*)o->ptr;
+        do {
+            job->cursor = d->dictScan(job->cursor,bgreadScanCallback,NULL,job);
+        } while (job->cursor && !bgreadChunkIsFull(job));
+        return job->cursor != 0;
+    } else if (o->encoding == OBJ_ENCODING_INTSET) {
+        intset *is = (intset*)o->ptr;
+        while (!bgreadChunkIsFull(job) && is->intsetGet(job->pos,&value)) {
+            bgreadAddBulkLongLong(job,value);
+            job->pos++;
+        }
+        return job->pos < is->intsetLen();
+    } else if (o->encoding == OBJ_ENCODING_ROARING) {
+        roaring *r = (roaring*)o->ptr;
+        while (!bgreadChunkIsFull(job)) {
+            if (!r->roaringNext(&job->rit,&value)) return 0;
+            bgreadAddBulkLongLong(job,value);
+        }
+        return 1;
+    } else if (o->encoding == OBJ_ENCODING_QUICKLIST) {
+        quicklistEntry entry;
+        while (job->count && !bgreadChunkIsFull(job)) {
+            if (!job->qi->quicklistNext(entry)) return 0;
+            if (entry.m_value)
+                bgreadAddBulk(job,(char*)entry.m_value,entry.m_size);
+            else
+                bgreadAddBulkLongLong(job,entry.m_longval);
+            job->count--;
+        }
+        /* The main thread may read the list before the next chunk. */
+        if (job->count) job->qi->quicklistSuspend();
+        return job->count != 0;
+    } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
+        while (job->count && job->zn && !bgreadChunkIsFull(job)) {
+            bgreadAddBulk(job,job->zn->ele,sdslen(job->zn->ele));
+            if (withscores) bgreadAddDouble(job,job->zn->score);
+            job->zn = reverse ? job->zn->backward : job->zn->level[0].forward;
+            job->count--;
+        }
+        return job->count && job->zn;
+    } else {
+        while (job->count && job->zvalid && !bgreadChunkIsFull(job)) {
+            sds ele = zbtCursorEle(&job->zcur);
+            bgreadAddBulk(job,ele,sdslen(ele));
+            if (withscores) bgreadAddDouble(job,zbtCursorScore(&job->zcur));
+            job->zvalid = reverse ? zbtPrev(&job->zcur) : zbtNext(&job->zcur);
+            job->count--;
+        }
+        return job->count && job->zvalid;
+    }
+}
+
+/* ---------------------------- Reader thread ------------------------------ */
+
+static void bgreadNotify() {
+    if (write(bgread.notify_pipe[1],"B",1) != 1) {
+        /* Ignore the error, the event loop is awake anyway. */
+    }
+}
+
+/* Hand the protocol produced over to the main thread, after waiting for
+ * the client to receive enough of the previous one. Return 0 if the job
+ * was canceled, so the read must stop. */
+static int bgreadPush(bgreadJob *job) {
+    int canceled, wake = 0;
+
+    pthread_mutex_lock(&bgread.mutex);
+    while (job->pending >= BGREAD_MAX_PENDING && !job->canceled &&
+           !job->unthrottled)
+        pthread_cond_wait(&bgread.cond,&bgread.mutex);
+    canceled = job->canceled;
+    if (!canceled && sdslen(job->buf)) {
+        wake = job->chunks->listLength() == 0;
+        job->chunks->listAddNodeTail(job->buf);
+        job->pending += sdslen(job->buf);
+        job->buf = NULL;
+    }
+    pthread_mutex_unlock(&bgread.mutex);
+
+    if (job->buf == NULL)
+        job->buf = sdsMakeRoomFor(sdsempty(),BGREAD_CHUNK_ROOM);
+    if (wake) bgreadNotify();
+    return !canceled;
+}
+
+static void *bgreadMain(void *arg) {
+    UNUSED(arg);
+
+    while (1) {
+        pthread_mutex_lock(&bgread.mutex);
+        while (bgread.todo->listLength() == 0)
+            pthread_cond_wait(&bgread.cond,&bgread.mutex);
+        listNode *ln = bgread.todo->listFirst();
+        bgreadJob *job = (bgreadJob*)ln->listNodeValue();
+        bgread.todo->listDelNode(ln);
+        pthread_mutex_unlock(&bgread.mutex);
+
+        int more;
+        job->buf = sdsMakeRoomFor(sdsempty(),BGREAD_CHUNK_ROOM);
+        do {
+            more = bgreadWalk(job);
+        } while (bgreadPush(job) && more);
+        sdsfree(job->buf);
+        job->buf = NULL;
+
+        pthread_mutex_lock(&bgread.mutex);
+        job->done = 1;
+        pthread_cond_broadcast(&bgread.done_cond);
+        pthread_mutex_unlock(&bgread.mutex);
+        bgreadNotify();
+    }
+    return NULL;
+}
+
+/* ------------------------------ Main thread ------------------------------ */
+
+/* The value is not walked anymore: release it, and execute the commands of
+ * the clients that waited to modify it. */
+static void bgreadUnpin(bgreadJob *job) {
+    robj *o = job->o;
+    listNode *ln;
+
+    if (job->qi) {
+        quicklistReleaseIterator(job->qi);
+        job->qi = NULL;
+    }
+    job->o = NULL;
+    server.bgread_pinned--;
+    if (!lazyfreeFreeObjectIfNeeded(o,0)) decrRefCount(o);
+
+    while ((ln = job->waiters->listFirst()) != NULL) {
+        client *c = (client*)ln->listNodeValue();
+        job->waiters->listDelNode(ln);
+        if (--c->m_blocking_state.m_bgread_waits == 0) {
+            c->m_blocking_state.m_rerun = 1;
+            c->unblockClient();
+        }
+    }
+}
+
+static void bgreadFreeJob(bgreadJob *job) {
+    listNode *ln;
+
+    if (job->o) bgreadUnpin(job);
+    while ((ln = job->chunks->listFirst()) != NULL) {
+        sdsfree((sds)ln->listNodeValue());
+        job->chunks->listDelNode(ln);
+    }
+    listRelease(job->chunks);
+    listRelease(job->waiters);
+    sdsfree(job->buf);
+    ln = server.bgread_jobs->listSearchKey(job);
+    serverAssert(ln != NULL);
+    server.bgread_jobs->listDelNode(ln);
+    zfree(job);
+}
+
+/* Walk the next chunk of the value in the main thread, and append it to
+ * the reply. Return 1 if some elements are left. */
+static int bgreadReplyChunk(bgreadJob *job) {
+    int more = bgreadWalk(job);
+
+    if (sdslen(job->buf)) job->c->addReplySds(job->buf);
+    else sdsfree(job->buf);
+    job->buf = more ? sdsMakeRoomFor(sdsempty(),BGREAD_CHUNK_ROOM) : NULL;
+    if (!more) bgreadUnpin(job);
+    return more;
+}
+
+/* Walk the rest of the value in the main thread, before modifying it. */
+static void bgreadFinish(bgreadJob *job) {
+    while (bgreadReplyChunk(job));
+}
+
+/* replyProducerProc of the reads: walk the next chunk of the value, or
+ * append the chunks produced by the thread, as long as they fit below
+ * PROTO_REPLY_PRODUCER_BYTES. */
+static int bgreadProduce(client *c, void *privdata) {
+    bgreadJob *job = (bgreadJob*)privdata;
+
+    if (!job->threaded) return job->o && bgreadReplyChunk(job);
+
+    unsigned long used = c->getClientOutputBufferMemoryUsage();
+    size_t room = used < PROTO_REPLY_PRODUCER_BYTES ?
+                  PROTO_REPLY_PRODUCER_BYTES-used : 0;
+    list *chunks = listCreate();
+    listNode *ln;
+    int done, left;
+
+    pthread_mutex_lock(&bgread.mutex);
+    while (room && (ln = job->chunks->listFirst()) != NULL) {
+        sds chunk = (sds)ln->listNodeValue();
+        room -= sdslen(chunk) < room ? sdslen(chunk) : room;
+        job->pending -= sdslen(chunk);
+        chunks->listAddNodeTail(chunk);
+        job->chunks->listDelNode(ln);
+    }
+    if (chunks->listLength()) pthread_cond_signal(&bgread.cond);
+    done = job->done;
+    left = job->chunks->listLength() != 0;
+    pthread_mutex_unlock(&bgread.mutex);
+
+    while ((ln = chunks->listFirst()) != NULL) {
+        c->addReplySds((sds)ln->listNodeValue());
+        chunks->listDelNode(ln);
+    }
+    listRelease(chunks);
+
+    if (done && job->o) bgreadUnpin(job);
+    return !done || left;
+}
+
+/* The client is resumed or freed: the job forgets it, and is freed unless
+ * the thread still walks the value. */
+static void bgreadDetach(void *privdata) {
+    bgreadJob *job = (bgreadJob*)privdata;
+    int done = 1;
+
+    job->c = NULL;
+    if (job->threaded) {
+        pthread_mutex_lock(&bgread.mutex);
+        job->canceled = 1;
+        done = job->done;
+        pthread_cond_signal(&bgread.cond);
+        pthread_mutex_unlock(&bgread.mutex);
+    }
+    if (done) bgreadFreeJob(job);
+}
+
+/* The thread produced some protocol or completed a job. */
+static void bgreadNotifyHandler(aeEventLoop *el, int fd, void *privdata,
+                                int mask)
+{
+    char buf[64];
+    listNode *ln;
+    UNUSED(el);
+    UNUSED(privdata);
+    UNUSED(mask);
+
+    while (read(fd,buf,sizeof(buf)) > 0);
+    listIter li(server.bgread_jobs);
+    while ((ln = li.listNext())) {
+        bgreadJob *job = (bgreadJob*)ln->listNodeValue();
+        int done;
+
+        if (!job->threaded) continue;
+        pthread_mutex_lock(&bgread.mutex);
+        done = job->done;
+        pthread_mutex_unlock(&bgread.mutex);
+
+        /* Don't wait for the client to receive the reply to unpin it. */
+        if (done && job->o) bgreadUnpin(job);
+        if (job->c) produceClientReply(job->c);
+        else if (done) bgreadFreeJob(job);
+    }
+}
+
+static void bgreadStartThread() {
+    bgread.todo = listCreate();
+    pthread_mutex_init(&bgread.mutex,NULL);
+    pthread_cond_init(&bgread.cond,NULL);
+    pthread_cond_init(&bgread.done_cond,NULL);
+    if (pipe(bgread.notify_pipe) == -1 ||
+        anetNonBlock(NULL,bgread.notify_pipe[0]) != ANET_OK ||
+        anetNonBlock(NULL,bgread.notify_pipe[1]) != ANET_OK ||
+        server.el->aeCreateFileEvent(bgread.notify_pipe[0],AE_READABLE,
+            bgreadNotifyHandler,NULL) == AE_ERR ||
+        pthread_create(&bgread.thread,NULL,bgreadMain,NULL) != 0)
+    {
+        serverLog(LL_WARNING,"Can't start the background reads thread: %s",
+            strerror(errno));
+        exit(1);
+    }
+    bgread.started = 1;
+}
+
+/* Return 1 if 'o' may be walked a chunk at a time, without modifying it,
+ * while the main thread serves the read commands about it. Only the main
+ * thread may walk compressed quicklists, since reading a node decompresses
+ * it in place. */
+static int bgreadEncodingIsSafe(robj *o, int threaded) {
+    switch(o->type) {
+    case OBJ_HASH:
+        return o->encoding == OBJ_ENCODING_HT &&
+               !((dict*)o->ptr)->dictIsRehashing() &&
+               hashTypeFieldExpires(o) == NULL;
+    case OBJ_SET:
+        return o->encoding == OBJ_ENCODING_INTSET ||
+               o->encoding == OBJ_ENCODING_ROARING ||
+               (o->encoding == OBJ_ENCODING_HT &&
+                !((dict*)o->ptr)->dictIsRehashing());
+    case OBJ_LIST:
+        return o->encoding == OBJ_ENCODING_QUICKLIST &&
+               (!threaded || ((quicklist*)o->ptr)->m_compress_depth == 0);
+    case OBJ_ZSET:
+        return o->encoding == OBJ_ENCODING_SKIPLIST ||
+               o->encoding == OBJ_ENCODING_BTREE;
+    default:
+        return 0;
+    }
+}
+
+/* Called by the read commands before replying the 'count' elements of 'o'
+ * starting at 'start' (lists and zsets only): if they are at least
+ * reply-stream-threshold or bgread-threshold, reply the length of the
+ * array, suspend the client while the rest of the reply is produced, and
+ * return 1. Otherwise return 0 and the command replies as usual. */
+int bgreadStart(client *c, robj *o, long start, long count, int flags) {
+    int threaded = server.bgread_threshold &&
+                   count >= server.bgread_threshold &&
+                   bgreadEncodingIsSafe(o,1);
+
+    if (!threaded && !(server.reply_stream_threshold &&
+                       count >= server.reply_stream_threshold &&
+                       bgreadEncodingIsSafe(o,0)))
+        return 0;
+    if (c->m_fd == -1 || server.lua_caller || io_thread_current_client ||
+        datasetReadShared() || c != server.current_client ||
+        c->m_flags & (CLIENT_MULTI|CLIENT_LUA|CLIENT_MASTER|
+                      CLIENT_REPLY_OFF|CLIENT_REPLY_SKIP))
+        return 0;
+
+    long len = count;
+    if (o->type == OBJ_HASH &&
+        (flags & (BGREAD_HASH_FIELDS|BGREAD_HASH_VALUES)) ==
+        (BGREAD_HASH_FIELDS|BGREAD_HASH_VALUES)) len *= 2;
+    if (flags & BGREAD_WITHSCORES) len *= 2;
+    c->addReplyMultiBulkLen(len);
+
+    bgreadJob *job = (bgreadJob*)zcalloc(sizeof(*job));
+    incrRefCount(o);
+    job->c = c;
+    job->o = o;
+    job->count = count;
+    job->flags = flags;
+    job->threaded = threaded;
+    job->waiters = listCreate();
+    job->chunks = listCreate();
+    if (o->encoding == OBJ_ENCODING_ROARING) {
+        ((roaring*)o->ptr)->roaringInitIterator(&job->rit);
+    } else if (o->encoding == OBJ_ENCODING_QUICKLIST) {
+        job->qi = quicklistGetIteratorAtIdx((quicklist*)o->ptr,
+            AL_START_HEAD,start);
+    } else if (o->type == OBJ_ZSET) {
+        zset *zs = (zset*)o->ptr;
+        unsigned long llen = zsetLength(o);
+        unsigned long rank = flags & BGREAD_REVERSE ? llen-start : start+1;
+
+        if (o->encoding == OBJ_ENCODING_SKIPLIST)
+            job->zn = zs->zsl->zslGetElementByRank(rank);
+        else
+            job->zvalid = zs->zbt->zbtGetElementByRank(rank,&job->zcur);
+    }
+    server.bgread_jobs->listAddNodeTail(job);
+    server.bgread_pinned++;
+
+    if (!threaded) {
+        server.stat_streamed_replies++;
+        job->buf = sdsMakeRoomFor(sdsempty(),BGREAD_CHUNK_ROOM);
+        startReplyProducer(c,bgreadProduce,bgreadDetach,job);
+        return 1;
+    }
+
+    server.stat_bgread_jobs++;
+    startReplyProducer(c,bgreadProduce,bgreadDetach,job);
+    if (!bgread.started) bgreadStartThread();
+    pthread_mutex_lock(&bgread.mutex);
+    bgread.todo->listAddNodeTail(job);
+    pthread_cond_signal(&bgread.cond);
+    pthread_mutex_unlock(&bgread.mutex);
+    return 1;
+}
+
+/* Return 1 if a read walks 'o'. */
+int bgreadValueIsPinned(robj *o) {
+    listNode *ln;
+
+    if (server.bgread_pinned == 0) return 0;
+    listIter li(server.bgread_jobs);
+    while ((ln = li.listNext())) {
+        if (((bgreadJob*)ln->listNodeValue())->o == o) return 1;
+    }
+    return 0;
+}
+
+/* The thread doesn't wait for the clients of 'job' and of the jobs queued
+ * before it anymore, so that it completes 'job' as soon as possible. */
+static void bgreadUnthrottle(bgreadJob *job) {
+    listNode *ln;
+
+    pthread_mutex_lock(&bgread.mutex);
+    listIter li(server.bgread_jobs);
+    while ((ln = li.listNext())) {
+        bgreadJob *j = (bgreadJob*)ln->listNodeValue();
+        if (j->threaded) j->unthrottled = 1;
+        if (j == job) break;
+    }
+    pthread_cond_broadcast(&bgread.cond);
+    pthread_mutex_unlock(&bgread.mutex);
+}
+
+/* Complete the reads of 'o' before modifying it out of processCommand():
+ * the main thread walks the rest of its reads at once, and waits for the
+ * thread to walk the rest of its own. */
+void bgreadWaitValue(robj *o) {
+    listNode *ln;
+
+    listIter li(server.bgread_jobs);
+    while ((ln = li.listNext())) {
+        bgreadJob *job = (bgreadJob*)ln->listNodeValue();
+        if (job->o != o) continue;
+
+        if (!job->threaded) {
+            bgreadFinish(job);
+            continue;
+        }
+        bgreadUnthrottle(job);
+        pthread_mutex_lock(&bgread.mutex);
+        while (!job->done)
+            pthread_cond_wait(&bgread.done_cond,&bgread.mutex);
+        pthread_mutex_unlock(&bgread.mutex);
+        bgreadUnpin(job);
+    }
+}
+
+/* Called by processCommand() before executing a write command: the reads
+ * of its keys walked by the main thread are completed at once. If the
+ * thread walks some of them, block the client until the reads complete,
+ * and return 1. The command is executed again once unblocked, without
+ * blocking again, see processUnblockedClients(). */
+int bgreadBlockClientIfNeeded(client *c) {
+    int numkeys, waits = 0;
+    int *keys;
+
+    if (server.bgread_pinned == 0 || !(c->m_cmd->m_flags & CMD_WRITE) ||
+        c->m_fd == -1 || c->m_flags & CLIENT_MASTER ||
+        c->m_blocking_state.m_rerun)
+        return 0;
+
+    keys = getKeysFromCommand(c->m_cmd,c->m_argv,c->m_argc,&numkeys);
+    for (int j = 0; j < numkeys; j++) {
+        dictEntry *de = c->m_cur_selected_db->m_dict->dictFind(
+            c->m_argv[keys[j]]->ptr);
+        listNode *ln;
+
+        if (de == NULL) continue;
+        robj *o = (robj*)de->dictGetVal();
+        listIter li(server.bgread_jobs);
+        while ((ln = li.listNext())) {
+            bgreadJob *job = (bgreadJob*)ln->listNodeValue();
+            if (job->o != o) continue;
+            if (!job->threaded) {
+                bgreadFinish(job);
+                continue;
+            }
+            if (job->waiters->listSearchKey(c)) continue;
+            job->waiters->listAddNodeTail(c);
+            bgreadUnthrottle(job);
+            waits++;
+        }
+    }
+    getKeysFreeResult(keys);
+    if (waits == 0) return 0;
+
+    server.stat_bgread_waits++;
+    c->m_blocking_state.m_timeout = 0;
+    c->m_blocking_state.m_bgread_waits = waits;
+    blockClient(c,BLOCKED_BGREAD);
+    return 1;
+}
+
+/* Called by unblockClient(): the client doesn't wait anymore for the
+ * reads in progress. */
+void unblockClientFromBgread(client *c) {
+    listNode *ln;
+
+    listIter li(server.bgread_jobs);
+    while ((ln = li.listNext())) {
+        bgreadJob *job = (bgreadJob*)ln->listNodeValue();
+        listNode *cn = job->waiters->listSearchKey(c);
+        if (cn) job->waiters->listDelNode(cn);
+    }
+    c->m_blocking_state.m_bgread_waits = 0;
+}
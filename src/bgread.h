@@ -0,0 +1,53 @@
+/* bgread.h -- background execution of large reads, header file.
+ * See bgread.cpp for more information.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __BGREAD_H
+#define __BGREAD_H
+
+/* What a read replies, besides the elements. */
+#define BGREAD_HASH_FIELDS (1<<0)   /* The fields of a hash. */
+#define BGREAD_HASH_VALUES (1<<1)   /* The values of a hash. */
+#define BGREAD_REVERSE (1<<2)       /* From the last element of the range. */
+#define BGREAD_WITHSCORES (1<<3)    /* The scores of a sorted set. */
+
+#define BGREAD_CHUNK_BYTES (64*1024)    /* Protocol handed over at once. */
+#define BGREAD_MAX_PENDING (1024*1024)  /* Protocol of the thread not sent
+                                           yet, per read. */
+
+int bgreadStart(client *c, robj *o, long start, long count, int flags);
+int bgreadValueIsPinned(robj *o);
+void bgreadWaitValue(robj *o);
+int bgreadBlockClientIfNeeded(client *c);
+void unblockClientFromBgread(client *c);
+
+#endif
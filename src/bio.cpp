@@ -24,6 +24,12 @@
  * recently inserted to the most recently inserted (older jobs processed
  * first).
  *
+ * The exception is BIO_LAZY_FREE, that is served by a pool of
+ * 'lazyfree-threads' threads sharing the same queue, so its jobs may run in
+ * parallel and complete in any order. Its low priority jobs (the chunks of
+ * huge databases being freed) are started only when no other job is queued,
+ * so that an UNLINK is not stuck behind a FLUSHALL ASYNC.
+ *
  * Currently there is no way for the creator of the job to be notified about
  * the completion of the operation, this will only be added when/if needed.
  *
@@ -60,12 +66,16 @@
 
 #include "server.h"
 #include "bio.h"
+#include "placement.h"
+#include <stdarg.h>
 
-static pthread_t bio_threads[BIO_NUM_OPS];
+static pthread_t bio_threads[BIO_NUM_OPS][BIO_MAX_THREADS_PER_OP];
+static int bio_numthreads[BIO_NUM_OPS];
 static pthread_mutex_t bio_mutex[BIO_NUM_OPS];
 static pthread_cond_t bio_newjob_cond[BIO_NUM_OPS];
 static pthread_cond_t bio_step_cond[BIO_NUM_OPS];
 static list *bio_jobs[BIO_NUM_OPS];
+static list *bio_low_jobs[BIO_NUM_OPS]; /* Jobs with BIO_JOB_LOW_PRIORITY. */
 /* The following array is used to hold the number of pending jobs for every
  * OP type. This allows us to export the bioPendingJobsOfType() API that is
  * useful when the main thread wants to perform some operation that may involve
@@ -81,12 +91,12 @@ struct bio_job {
     /* Job specific arguments pointers. If we need to pass more than three
      * arguments we can just pass a pointer to a structure or alike. */
     void *arg1, *arg2, *arg3;
+    /* Lazy free jobs instead call the function with its arguments. */
+    lazy_free_fn *free_fn;
+    void *free_args[];
 };
 
 void *bioProcessBackgroundJobs(void *arg);
-void lazyfreeFreeObjectFromBioThread(robj *o);
-void lazyfreeFreeDatabaseFromBioThread(dict *ht1, dict *ht2);
-void lazyfreeFreeSlotsMapFromBioThread(rax *sl);
 
 /* Make sure we have enough stack to perform all the things we do in the
  * main thread. */
@@ -105,8 +115,13 @@ void bioInit() {
         pthread_cond_init(&bio_newjob_cond[j],NULL);
         pthread_cond_init(&bio_step_cond[j],NULL);
         bio_jobs[j] = listCreate();
+        bio_low_jobs[j] = listCreate();
         bio_pending[j] = 0;
+        bio_numthreads[j] = 1;
     }
+    /* Freeing is the only job that several threads can do in parallel:
+     * the jobs are independent and the allocator is thread safe. */
+    bio_numthreads[BIO_LAZY_FREE] = server.lazyfree_threads;
 
     /* Set the stack size as by default it may be small in some system */
     pthread_attr_init(&attr);
@@ -120,26 +135,50 @@ void bioInit() {
      * responsible of. */
     for (j = 0; j < BIO_NUM_OPS; j++) {
         void *arg = (void*)(unsigned long) j;
-        if (pthread_create(&thread,&attr,bioProcessBackgroundJobs,arg) != 0) {
-            serverLog(LL_WARNING,"Fatal: Can't initialize Background Jobs.");
-            exit(1);
+        for (int i = 0; i < bio_numthreads[j]; i++) {
+            if (pthread_create(&thread,&attr,bioProcessBackgroundJobs,arg) != 0) {
+                serverLog(LL_WARNING,"Fatal: Can't initialize Background Jobs.");
+                exit(1);
+            }
+            bio_threads[j][i] = thread;
         }
-        bio_threads[j] = thread;
     }
 }
 
+static void bioSubmitJob(int type, bio_job *job, int flags) {
+    list *queue = (flags & BIO_JOB_LOW_PRIORITY) ? bio_low_jobs[type] :
+                                                   bio_jobs[type];
+    job->time = time(NULL);
+    pthread_mutex_lock(&bio_mutex[type]);
+    queue->listAddNodeTail(job);
+    bio_pending[type]++;
+    pthread_cond_signal(&bio_newjob_cond[type]);
+    pthread_mutex_unlock(&bio_mutex[type]);
+}
+
 void bioCreateBackgroundJob(int type, void *arg1, void *arg2, void *arg3) {
     bio_job* job = (bio_job*)zmalloc(sizeof(*job));
 
-    job->time = time(NULL);
     job->arg1 = arg1;
     job->arg2 = arg2;
     job->arg3 = arg3;
-    pthread_mutex_lock(&bio_mutex[type]);
-    bio_jobs[type]->listAddNodeTail(job);
-    bio_pending[type]++;
-    pthread_cond_signal(&bio_newjob_cond[type]);
-    pthread_mutex_unlock(&bio_mutex[type]);
+    job->free_fn = NULL;
+    bioSubmitJob(type,job,0);
+}
+
+/* Queue a BIO_LAZY_FREE job calling 'free_fn' with an array of the
+ * 'arg_count' pointers that follow. */
+void bioCreateLazyFreeJob(lazy_free_fn *free_fn, int flags, int arg_count, ...) {
+    va_list valist;
+    bio_job *job = (bio_job*)zmalloc(sizeof(*job)+sizeof(void*)*arg_count);
+
+    job->arg1 = job->arg2 = job->arg3 = NULL;
+    job->free_fn = free_fn;
+    va_start(valist,arg_count);
+    for (int j = 0; j < arg_count; j++)
+        job->free_args[j] = va_arg(valist,void*);
+    va_end(valist);
+    bioSubmitJob(BIO_LAZY_FREE,job,flags);
 }
 
 void *bioProcessBackgroundJobs(void *arg) {
@@ -167,18 +206,24 @@ void *bioProcessBackgroundJobs(void *arg) {
     if (pthread_sigmask(SIG_BLOCK, &sigset, NULL))
         serverLog(LL_WARNING,
             "Warning: can't mask SIGALRM in bio.c thread: %s", strerror(errno));
+    setcpuaffinity(server.bio_cpulist);
 
     while(1) {
         listNode *ln;
+        list *queue = bio_jobs[type]->listLength() ? bio_jobs[type] :
+                                                     bio_low_jobs[type];
 
         /* The loop always starts with the lock hold. */
-        if (bio_jobs[type]->listLength() == 0) {
+        if (queue->listLength() == 0) {
             pthread_cond_wait(&bio_newjob_cond[type],&bio_mutex[type]);
             continue;
         }
-        /* Pop the job from the queue. */
-        ln = bio_jobs[type]->listFirst();
+        /* Pop the job from the queue. It is unlinked right away since the
+         * other threads of the same type serve the queue meanwhile: the
+         * job is still accounted as pending until it is done. */
+        ln = queue->listFirst();
         job = (bio_job*)ln->listNodeValue();
+        queue->listDelNode(ln);
         /* It is now possible to unlock the background system as we know have
          * a stand alone job structure to process.*/
         pthread_mutex_unlock(&bio_mutex[type]);
@@ -189,29 +234,21 @@ void *bioProcessBackgroundJobs(void *arg) {
         } else if (type == BIO_AOF_FSYNC) {
             aof_fsync((long)job->arg1);
         } else if (type == BIO_LAZY_FREE) {
-            /* What we free changes depending on what arguments are set:
-             * arg1 -> free the object at pointer.
-             * arg2 & arg3 -> free two dictionaries (a Redis DB).
-             * only arg3 -> free the skiplist. */
-            if (job->arg1)
-                lazyfreeFreeObjectFromBioThread((robj *)job->arg1);
-            else if (job->arg2 && job->arg3)
-                lazyfreeFreeDatabaseFromBioThread((dict *)job->arg2, (dict *)job->arg3);
-            else if (job->arg3)
-                lazyfreeFreeSlotsMapFromBioThread((rax *)job->arg3);
+            job->free_fn(job->free_args);
+        } else if (type == BIO_CLUSTER_CONFIG) {
+            clusterSaveConfigJob();
         } else {
             serverPanic("Wrong job type in bioProcessBackgroundJobs().");
         }
         zfree(job);
 
-        /* Unblock threads blocked on bioWaitStepOfType() if any. */
-        pthread_cond_broadcast(&bio_step_cond[type]);
-
         /* Lock again before reiterating the loop, if there are no longer
          * jobs to process we'll block again in pthread_cond_wait(). */
         pthread_mutex_lock(&bio_mutex[type]);
-        bio_jobs[type]->listDelNode(ln);
         bio_pending[type]--;
+
+        /* Unblock threads blocked on bioWaitStepOfType() if any. */
+        pthread_cond_broadcast(&bio_step_cond[type]);
     }
 }
 
@@ -251,11 +288,12 @@ unsigned long long bioWaitStepOfType(int type) {
  * Currently Redis does this only on crash (for instance on SIGSEGV) in order
  * to perform a fast memory check without other threads messing with memory. */
 void bioKillThreads() {
-    int err, j;
+    int err, j, i;
 
     for (j = 0; j < BIO_NUM_OPS; j++) {
-        if (pthread_cancel(bio_threads[j]) == 0) {
-            if ((err = pthread_join(bio_threads[j],NULL)) != 0) {
+        for (i = 0; i < bio_numthreads[j]; i++) {
+            if (pthread_cancel(bio_threads[j][i]) != 0) continue;
+            if ((err = pthread_join(bio_threads[j][i],NULL)) != 0) {
                 serverLog(LL_WARNING,
                     "Bio thread for job type #%d can be joined: %s",
                         j, strerror(err));
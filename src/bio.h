@@ -30,6 +30,8 @@
 /* Exported API */
 void bioInit();
 void bioCreateBackgroundJob(int type, void *arg1, void *arg2, void *arg3);
+typedef void lazy_free_fn(void *args[]);
+void bioCreateLazyFreeJob(lazy_free_fn *free_fn, int flags, int arg_count, ...);
 unsigned long long bioPendingJobsOfType(int type);
 unsigned long long bioWaitStepOfType(int type);
 time_t bioOlderJobOfType(int type);
@@ -39,4 +41,11 @@ void bioKillThreads();
 #define BIO_CLOSE_FILE    0 /* Deferred close(2) syscall. */
 #define BIO_AOF_FSYNC     1 /* Deferred AOF fsync. */
 #define BIO_LAZY_FREE     2 /* Deferred objects freeing. */
-#define BIO_NUM_OPS       3
+#define BIO_CLUSTER_CONFIG 3 /* Deferred cluster config save. */
+#define BIO_NUM_OPS       4
+
+/* Flags of bioCreateLazyFreeJob(). Low priority jobs are served only when
+ * there are no other jobs of the same type waiting. */
+#define BIO_JOB_LOW_PRIORITY (1<<0)
+
+#define BIO_MAX_THREADS_PER_OP 16 /* Max value of lazyfree-threads. */
@@ -0,0 +1,547 @@
+/* Scalar and vector kernels of the bit operations, see bitkernel.h.
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bitkernel.h"
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__clang__) || __GNUC__ >= 5)
+#define HAVE_BITKERNEL_AVX2 1
+#if defined(__clang__) ? (__clang_major__ >= 6) : (__GNUC__ >= 8)
+#define HAVE_BITKERNEL_AVX512 1
+#endif
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define HAVE_BITKERNEL_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* -----------------------------------------------------------------------------
+ * Scalar kernels
+ * -------------------------------------------------------------------------- */
+
+static const unsigned char bitsinbyte[256] = {0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,4,5,5,6,5,6,6,7,5,6,6,7,6,7,7,8};
+
+static size_t popcountScalar(const unsigned char *p, size_t count) {
+    size_t bits = 0;
+    const uint32_t *p4;
+
+    /* Count initial bytes not aligned to 32 bit. */
+    while((unsigned long)p & 3 && count) {
+        bits += bitsinbyte[*p++];
+        count--;
+    }
+
+    /* Count bits 28 bytes at a time */
+    p4 = (const uint32_t*)p;
+    while(count>=28) {
+        uint32_t aux1, aux2, aux3, aux4, aux5, aux6, aux7;
+
+        aux1 = *p4++;
+        aux2 = *p4++;
+        aux3 = *p4++;
+        aux4 = *p4++;
+        aux5 = *p4++;
+        aux6 = *p4++;
+        aux7 = *p4++;
+        count -= 28;
+
+        aux1 = aux1 - ((aux1 >> 1) & 0x55555555);
+        aux1 = (aux1 & 0x33333333) + ((aux1 >> 2) & 0x33333333);
+        aux2 = aux2 - ((aux2 >> 1) & 0x55555555);
+        aux2 = (aux2 & 0x33333333) + ((aux2 >> 2) & 0x33333333);
+        aux3 = aux3 - ((aux3 >> 1) & 0x55555555);
+        aux3 = (aux3 & 0x33333333) + ((aux3 >> 2) & 0x33333333);
+        aux4 = aux4 - ((aux4 >> 1) & 0x55555555);
+        aux4 = (aux4 & 0x33333333) + ((aux4 >> 2) & 0x33333333);
+        aux5 = aux5 - ((aux5 >> 1) & 0x55555555);
+        aux5 = (aux5 & 0x33333333) + ((aux5 >> 2) & 0x33333333);
+        aux6 = aux6 - ((aux6 >> 1) & 0x55555555);
+        aux6 = (aux6 & 0x33333333) + ((aux6 >> 2) & 0x33333333);
+        aux7 = aux7 - ((aux7 >> 1) & 0x55555555);
+        aux7 = (aux7 & 0x33333333) + ((aux7 >> 2) & 0x33333333);
+        bits += ((((aux1 + (aux1 >> 4)) & 0x0F0F0F0F) +
+                    ((aux2 + (aux2 >> 4)) & 0x0F0F0F0F) +
+                    ((aux3 + (aux3 >> 4)) & 0x0F0F0F0F) +
+                    ((aux4 + (aux4 >> 4)) & 0x0F0F0F0F) +
+                    ((aux5 + (aux5 >> 4)) & 0x0F0F0F0F) +
+                    ((aux6 + (aux6 >> 4)) & 0x0F0F0F0F) +
+                    ((aux7 + (aux7 >> 4)) & 0x0F0F0F0F))* 0x01010101) >> 24;
+    }
+    /* Count the remaining bytes. */
+    p = (const unsigned char*)p4;
+    while(count--) bits += bitsinbyte[*p++];
+    return bits;
+}
+
+/* Return the number of leading bytes of 'p' that are 'skipval', rounded
+ * down to 8 bytes, so that the caller finds the exact position. */
+static size_t skipScalar(const unsigned char *p, size_t count,
+                         unsigned char skipval)
+{
+    uint64_t word, skipword = skipval ? UINT64_MAX : 0;
+    size_t skipped = 0;
+
+    while (count - skipped >= 32) {
+        uint64_t w[4];
+        memcpy(w,p+skipped,sizeof(w));
+        if (w[0] != skipword || w[1] != skipword ||
+            w[2] != skipword || w[3] != skipword) break;
+        skipped += 32;
+    }
+    while (count - skipped >= 8) {
+        memcpy(&word,p+skipped,8);
+        if (word != skipword) break;
+        skipped += 8;
+    }
+    return skipped;
+}
+
+/* Compute the operation 32 bytes at a time for the first 'len' bytes of
+ * every source, returning the number of bytes of 'res' written. Unaligned
+ * words are read with memcpy(), that compiles to plain loads where they
+ * are allowed. */
+static size_t opScalar(int op, unsigned char *res, unsigned char **src,
+                       unsigned long numkeys, size_t len)
+{
+    size_t j;
+    unsigned long i;
+
+    for (j = 0; j + 32 <= len; j += 32) {
+        uint64_t r[4], w[4];
+
+        memcpy(r,src[0]+j,sizeof(r));
+        /* Different branches per different operations for speed. */
+        if (op == BITKERNEL_AND) {
+            for (i = 1; i < numkeys; i++) {
+                memcpy(w,src[i]+j,sizeof(w));
+                r[0] &= w[0]; r[1] &= w[1]; r[2] &= w[2]; r[3] &= w[3];
+            }
+        } else if (op == BITKERNEL_OR) {
+            for (i = 1; i < numkeys; i++) {
+                memcpy(w,src[i]+j,sizeof(w));
+                r[0] |= w[0]; r[1] |= w[1]; r[2] |= w[2]; r[3] |= w[3];
+            }
+        } else if (op == BITKERNEL_XOR) {
+            for (i = 1; i < numkeys; i++) {
+                memcpy(w,src[i]+j,sizeof(w));
+                r[0] ^= w[0]; r[1] ^= w[1]; r[2] ^= w[2]; r[3] ^= w[3];
+            }
+        } else {
+            r[0] = ~r[0]; r[1] = ~r[1]; r[2] = ~r[2]; r[3] = ~r[3];
+        }
+        memcpy(res+j,r,sizeof(r));
+    }
+    return j;
+}
+
+/* -----------------------------------------------------------------------------
+ * AVX2 kernels
+ * -------------------------------------------------------------------------- */
+
+#ifdef HAVE_BITKERNEL_AVX2
+#define BITKERNEL_AVX2 __attribute__((target("avx2")))
+
+/* Bits set in every 64 bit lane of 'v', counting the nibbles with a table
+ * lookup of vpshufb. */
+BITKERNEL_AVX2
+static inline __m256i popcount256(__m256i v) {
+    const __m256i lookup = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+                                            0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_and_si256(v,low);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi32(v,4),low);
+    __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lookup,lo),
+                                  _mm256_shuffle_epi8(lookup,hi));
+    return _mm256_sad_epu8(cnt,_mm256_setzero_si256());
+}
+
+/* Carry save adder: 'h' and 'l' are the high and low bits of a+b+c. */
+#define CSA256(h,l,a,b,c) do {                                              \
+    __m256i u_ = _mm256_xor_si256(a,b);                                     \
+    h = _mm256_or_si256(_mm256_and_si256(a,b),_mm256_and_si256(u_,c));     \
+    l = _mm256_xor_si256(u_,c);                                             \
+} while(0)
+
+/* Harley-Seal population count: sixteen vectors at a time are reduced by a
+ * tree of carry save adders, so that only one vector in sixteen needs the
+ * actual count. */
+BITKERNEL_AVX2
+static size_t popcountAvx2(const unsigned char *p, size_t count) {
+    __m256i total = _mm256_setzero_si256();
+    __m256i ones = _mm256_setzero_si256(), twos = _mm256_setzero_si256();
+    __m256i fours = _mm256_setzero_si256(), eights = _mm256_setzero_si256();
+    __m256i sixteens, twosA, twosB, foursA, foursB, eightsA, eightsB;
+    const __m256i *v = (const __m256i*)p;
+    uint64_t lanes[4];
+
+#define LD(i) _mm256_loadu_si256(v+(i))
+    while (count >= 32*16) {
+        CSA256(twosA,ones,ones,LD(0),LD(1));
+        CSA256(twosB,ones,ones,LD(2),LD(3));
+        CSA256(foursA,twos,twos,twosA,twosB);
+        CSA256(twosA,ones,ones,LD(4),LD(5));
+        CSA256(twosB,ones,ones,LD(6),LD(7));
+        CSA256(foursB,twos,twos,twosA,twosB);
+        CSA256(eightsA,fours,fours,foursA,foursB);
+        CSA256(twosA,ones,ones,LD(8),LD(9));
+        CSA256(twosB,ones,ones,LD(10),LD(11));
+        CSA256(foursA,twos,twos,twosA,twosB);
+        CSA256(twosA,ones,ones,LD(12),LD(13));
+        CSA256(twosB,ones,ones,LD(14),LD(15));
+        CSA256(foursB,twos,twos,twosA,twosB);
+        CSA256(eightsB,fours,fours,foursA,foursB);
+        CSA256(sixteens,eights,eights,eightsA,eightsB);
+        total = _mm256_add_epi64(total,popcount256(sixteens));
+        v += 16;
+        count -= 32*16;
+    }
+#undef LD
+    total = _mm256_slli_epi64(total,4);
+    total = _mm256_add_epi64(total,_mm256_slli_epi64(popcount256(eights),3));
+    total = _mm256_add_epi64(total,_mm256_slli_epi64(popcount256(fours),2));
+    total = _mm256_add_epi64(total,_mm256_slli_epi64(popcount256(twos),1));
+    total = _mm256_add_epi64(total,popcount256(ones));
+    while (count >= 32) {
+        total = _mm256_add_epi64(total,popcount256(_mm256_loadu_si256(v)));
+        v++;
+        count -= 32;
+    }
+    _mm256_storeu_si256((__m256i*)lanes,total);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+           popcountScalar((const unsigned char*)v,count);
+}
+
+BITKERNEL_AVX2
+static size_t skipAvx2(const unsigned char *p, size_t count,
+                       unsigned char skipval)
+{
+    const __m256i ones = _mm256_set1_epi8(-1);
+    size_t skipped = 0;
+
+    /* Check 128 bytes at a time, folding the four vectors with AND when
+     * skipping ones and with OR when skipping zeros. */
+    while (count - skipped >= 128) {
+        const __m256i *v = (const __m256i*)(p+skipped);
+        __m256i a = _mm256_loadu_si256(v), b = _mm256_loadu_si256(v+1);
+        __m256i c = _mm256_loadu_si256(v+2), d = _mm256_loadu_si256(v+3);
+        if (skipval) {
+            __m256i x = _mm256_and_si256(_mm256_and_si256(a,b),
+                                         _mm256_and_si256(c,d));
+            if (!_mm256_testc_si256(x,ones)) break;
+        } else {
+            __m256i x = _mm256_or_si256(_mm256_or_si256(a,b),
+                                        _mm256_or_si256(c,d));
+            if (!_mm256_testz_si256(x,x)) break;
+        }
+        skipped += 128;
+    }
+    return skipped + skipScalar(p+skipped,count-skipped,skipval);
+}
+
+BITKERNEL_AVX2
+static size_t opAvx2(int op, unsigned char *res, unsigned char **src,
+                     unsigned long numkeys, size_t len)
+{
+    const __m256i ones = _mm256_set1_epi8(-1);
+    size_t j;
+    unsigned long i;
+
+    for (j = 0; j + 32 <= len; j += 32) {
+        __m256i r = _mm256_loadu_si256((const __m256i*)(src[0]+j));
+        if (op == BITKERNEL_AND) {
+            for (i = 1; i < numkeys; i++)
+                r = _mm256_and_si256(r,
+                        _mm256_loadu_si256((const __m256i*)(src[i]+j)));
+        } else if (op == BITKERNEL_OR) {
+            for (i = 1; i < numkeys; i++)
+                r = _mm256_or_si256(r,
+                        _mm256_loadu_si256((const __m256i*)(src[i]+j)));
+        } else if (op == BITKERNEL_XOR) {
+            for (i = 1; i < numkeys; i++)
+                r = _mm256_xor_si256(r,
+                        _mm256_loadu_si256((const __m256i*)(src[i]+j)));
+        } else {
+            r = _mm256_xor_si256(r,ones);
+        }
+        _mm256_storeu_si256((__m256i*)(res+j),r);
+    }
+    return j;
+}
+#endif
+
+/* -----------------------------------------------------------------------------
+ * AVX-512 kernels
+ * -------------------------------------------------------------------------- */
+
+#ifdef HAVE_BITKERNEL_AVX512
+/* With VPOPCNTDQ the count of a whole 64 byte vector is one instruction. */
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static size_t popcountAvx512(const unsigned char *p, size_t count) {
+    __m512i a = _mm512_setzero_si512(), b = _mm512_setzero_si512();
+
+    /* Two accumulators in order to hide the latency of the adds. */
+    while (count >= 128) {
+        a = _mm512_add_epi64(a,_mm512_popcnt_epi64(_mm512_loadu_si512(p)));
+        b = _mm512_add_epi64(b,_mm512_popcnt_epi64(_mm512_loadu_si512(p+64)));
+        p += 128;
+        count -= 128;
+    }
+    if (count >= 64) {
+        a = _mm512_add_epi64(a,_mm512_popcnt_epi64(_mm512_loadu_si512(p)));
+        p += 64;
+        count -= 64;
+    }
+    uint64_t lanes[8], bits = 0;
+    _mm512_storeu_si512(lanes,_mm512_add_epi64(a,b));
+    for (int j = 0; j < 8; j++) bits += lanes[j];
+    return bits + popcountScalar(p,count);
+}
+#endif
+
+/* -----------------------------------------------------------------------------
+ * NEON kernels
+ * -------------------------------------------------------------------------- */
+
+#ifdef HAVE_BITKERNEL_NEON
+static size_t popcountNeon(const unsigned char *p, size_t count) {
+    uint64x2_t total = vdupq_n_u64(0);
+
+    /* vcntq_u8 counts the bits of every byte: the byte counts of up to 31
+     * vectors fit 8 bits, then they are widened into the 64 bit total. */
+    while (count >= 16) {
+        uint8x16_t acc = vdupq_n_u8(0);
+        int n = 0;
+        while (count >= 16 && n < 31) {
+            acc = vaddq_u8(acc,vcntq_u8(vld1q_u8(p)));
+            p += 16;
+            count -= 16;
+            n++;
+        }
+        total = vaddq_u64(total,vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(acc))));
+    }
+    return vgetq_lane_u64(total,0) + vgetq_lane_u64(total,1) +
+           popcountScalar(p,count);
+}
+
+static size_t skipNeon(const unsigned char *p, size_t count,
+                       unsigned char skipval)
+{
+    uint8x16_t skipvec = vdupq_n_u8(skipval);
+    size_t skipped = 0;
+
+    while (count - skipped >= 64) {
+        uint8x16_t x = veorq_u8(vld1q_u8(p+skipped),skipvec);
+        x = vorrq_u8(x,veorq_u8(vld1q_u8(p+skipped+16),skipvec));
+        x = vorrq_u8(x,veorq_u8(vld1q_u8(p+skipped+32),skipvec));
+        x = vorrq_u8(x,veorq_u8(vld1q_u8(p+skipped+48),skipvec));
+        if (vmaxvq_u8(x)) break;
+        skipped += 64;
+    }
+    return skipped + skipScalar(p+skipped,count-skipped,skipval);
+}
+
+static size_t opNeon(int op, unsigned char *res, unsigned char **src,
+                     unsigned long numkeys, size_t len)
+{
+    size_t j;
+    unsigned long i;
+
+    for (j = 0; j + 32 <= len; j += 32) {
+        uint8x16_t r0 = vld1q_u8(src[0]+j), r1 = vld1q_u8(src[0]+j+16);
+        if (op == BITKERNEL_AND) {
+            for (i = 1; i < numkeys; i++) {
+                r0 = vandq_u8(r0,vld1q_u8(src[i]+j));
+                r1 = vandq_u8(r1,vld1q_u8(src[i]+j+16));
+            }
+        } else if (op == BITKERNEL_OR) {
+            for (i = 1; i < numkeys; i++) {
+                r0 = vorrq_u8(r0,vld1q_u8(src[i]+j));
+                r1 = vorrq_u8(r1,vld1q_u8(src[i]+j+16));
+            }
+        } else if (op == BITKERNEL_XOR) {
+            for (i = 1; i < numkeys; i++) {
+                r0 = veorq_u8(r0,vld1q_u8(src[i]+j));
+                r1 = veorq_u8(r1,vld1q_u8(src[i]+j+16));
+            }
+        } else {
+            r0 = vmvnq_u8(r0);
+            r1 = vmvnq_u8(r1);
+        }
+        vst1q_u8(res+j,r0);
+        vst1q_u8(res+j+16,r1);
+    }
+    return j;
+}
+#endif
+
+/* -----------------------------------------------------------------------------
+ * Runtime dispatch
+ * -------------------------------------------------------------------------- */
+
+struct bitkernelImpl {
+    const char *name;
+    size_t (*popcount)(const unsigned char *p, size_t count);
+    size_t (*skip)(const unsigned char *p, size_t count, unsigned char skipval);
+    size_t (*op)(int op, unsigned char *res, unsigned char **src,
+                 unsigned long numkeys, size_t len);
+};
+
+static const bitkernelImpl bitkernelScalar =
+    {"scalar", popcountScalar, skipScalar, opScalar};
+#ifdef HAVE_BITKERNEL_AVX2
+static const bitkernelImpl bitkernelAvx2 =
+    {"avx2", popcountAvx2, skipAvx2, opAvx2};
+#endif
+#ifdef HAVE_BITKERNEL_AVX512
+static const bitkernelImpl bitkernelAvx512 =
+    {"avx512", popcountAvx512, skipAvx2, opAvx2};
+#endif
+#ifdef HAVE_BITKERNEL_NEON
+static const bitkernelImpl bitkernelNeon =
+    {"neon", popcountNeon, skipNeon, opNeon};
+#endif
+
+static const bitkernelImpl *bitkernelSelect(void) {
+#ifdef HAVE_BITKERNEL_AVX2
+    __builtin_cpu_init();
+#ifdef HAVE_BITKERNEL_AVX512
+    if (__builtin_cpu_supports("avx2") &&
+        __builtin_cpu_supports("avx512vpopcntdq")) return &bitkernelAvx512;
+#endif
+    if (__builtin_cpu_supports("avx2")) return &bitkernelAvx2;
+#endif
+#ifdef HAVE_BITKERNEL_NEON
+    return &bitkernelNeon;
+#endif
+    return &bitkernelScalar;
+}
+
+/* The kernels are selected the first time they are used. */
+static inline const bitkernelImpl *bitkernelGet(void) {
+    static const bitkernelImpl *impl = bitkernelSelect();
+    return impl;
+}
+
+/* Count number of bits set in the binary array pointed by 's' and long
+ * 'count' bytes. */
+size_t bitkernelPopcount(const void *s, size_t count) {
+    return bitkernelGet()->popcount((const unsigned char*)s,count);
+}
+
+/* Return a number of leading bytes of 's' that are all 'skipval', that
+ * must be 0 or 255, less than 8 bytes before the first byte that is not
+ * 'skipval'. */
+size_t bitkernelSkip(const void *s, size_t count, unsigned char skipval) {
+    return bitkernelGet()->skip((const unsigned char*)s,count,skipval);
+}
+
+/* Store into 'res' the BITKERNEL_* operation 'op' of the 'numkeys' sources
+ * 'src', all of them at least 'len' bytes. Only whole blocks of 32 bytes
+ * are processed: the number of bytes stored is returned, and the caller
+ * completes the remaining ones. */
+size_t bitkernelOp(int op, unsigned char *res, unsigned char **src,
+                   unsigned long numkeys, size_t len)
+{
+    return bitkernelGet()->op(op,res,src,numkeys,len);
+}
+
+/* Name of the kernels in use, "scalar", "avx2", "avx512" or "neon". */
+const char *bitkernelName(void) {
+    return bitkernelGet()->name;
+}
+
+#ifdef BITKERNEL_BENCHMARK_MAIN
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+static double timeInSeconds(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return tv.tv_sec + tv.tv_usec/1000000.0;
+}
+
+static void benchmarkKernels(const bitkernelImpl *impl, unsigned char **src,
+                             unsigned char *zeros, unsigned char *res,
+                             size_t len, int rounds)
+{
+    size_t bits = 0, skipped = 0;
+    double start, gb = (double)len*rounds/(1024*1024*1024);
+    int j;
+
+    start = timeInSeconds();
+    for (j = 0; j < rounds; j++) bits += impl->popcount(src[0],len);
+    printf("%-8s BITCOUNT: %6.2f GB/s (%zu bits)\n", impl->name,
+        gb/(timeInSeconds()-start), bits/rounds);
+
+    start = timeInSeconds();
+    for (j = 0; j < rounds; j++) skipped += impl->skip(zeros,len,0);
+    printf("%-8s BITPOS:   %6.2f GB/s (%zu bytes skipped)\n", impl->name,
+        gb/(timeInSeconds()-start), skipped/rounds);
+
+    start = timeInSeconds();
+    for (j = 0; j < rounds; j++) impl->op(BITKERNEL_AND,res,src,2,len);
+    printf("%-8s BITOP:    %6.2f GB/s of every source, AND of 2 keys\n",
+        impl->name, gb/(timeInSeconds()-start));
+}
+
+/* Usage: bitkernel-benchmark [megabytes] [rounds]
+ * Report the throughput of the scalar kernels and of the ones selected for
+ * this CPU, over random bitmaps. */
+int main(int argc, char **argv) {
+    size_t len = (size_t)(argc > 1 ? atol(argv[1]) : 64)*1024*1024;
+    int rounds = argc > 2 ? atoi(argv[2]) : 10;
+    unsigned char *src[2], *zeros, *res;
+    size_t j;
+
+    src[0] = (unsigned char*)malloc(len);
+    src[1] = (unsigned char*)malloc(len);
+    zeros = (unsigned char*)calloc(len,1);
+    res = (unsigned char*)malloc(len);
+    for (j = 0; j < len; j++) {
+        src[0][j] = rand();
+        src[1][j] = rand();
+    }
+
+    benchmarkKernels(&bitkernelScalar,src,zeros,res,len,rounds);
+    if (bitkernelGet() != &bitkernelScalar)
+        benchmarkKernels(bitkernelGet(),src,zeros,res,len,rounds);
+    if (popcountScalar(src[0],len) != bitkernelPopcount(src[0],len)) {
+        printf("ERROR: the %s popcount differs from the scalar one\n",
+            bitkernelName());
+        return 1;
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,28 @@
+/* Kernels of the bit operations on long strings: the population count of
+ * BITCOUNT, the search of the first interesting byte of BITPOS, and the
+ * AND / OR / XOR / NOT of BITOP.
+ *
+ * Every kernel has a portable scalar implementation, and vector ones that
+ * are selected at runtime from what the CPU supports: AVX2 (Harley-Seal
+ * popcount) and AVX-512 VPOPCNTDQ on x86-64, NEON on AArch64. The vector
+ * kernels are compiled for their instruction set with target attributes,
+ * so the binary still runs on CPUs without them. */
+
+#ifndef __BITKERNEL_H
+#define __BITKERNEL_H
+
+#include <stddef.h>
+
+/* Operations of bitkernelOp(), the same values of BITOP_* in bitops.cpp. */
+#define BITKERNEL_AND 0
+#define BITKERNEL_OR  1
+#define BITKERNEL_XOR 2
+#define BITKERNEL_NOT 3
+
+size_t bitkernelPopcount(const void *s, size_t count);
+size_t bitkernelSkip(const void *s, size_t count, unsigned char skipval);
+size_t bitkernelOp(int op, unsigned char *res, unsigned char **src,
+                   unsigned long numkeys, size_t len);
+const char *bitkernelName(void);
+
+#endif
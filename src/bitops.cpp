@@ -29,6 +29,7 @@
  */
 
 #include "server.h"
+#include "bitkernel.h"
 
 /* -----------------------------------------------------------------------------
  * Helpers and low level bit functions.
@@ -38,57 +39,7 @@
  * 'count' bytes. The implementation of this function is required to
  * work with a input string length up to 512 MB. */
 size_t redisPopcount(void *s, long count) {
-    size_t bits = 0;
-    unsigned char *p = (unsigned char *)s;
-    uint32_t *p4;
-    static const unsigned char bitsinbyte[256] = {0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,4,5,5,6,5,6,6,7,5,6,6,7,6,7,7,8};
-
-    /* Count initial bytes not aligned to 32 bit. */
-    while((unsigned long)p & 3 && count) {
-        bits += bitsinbyte[*p++];
-        count--;
-    }
-
-    /* Count bits 28 bytes at a time */
-    p4 = (uint32_t*)p;
-    while(count>=28) {
-        uint32_t aux1, aux2, aux3, aux4, aux5, aux6, aux7;
-
-        aux1 = *p4++;
-        aux2 = *p4++;
-        aux3 = *p4++;
-        aux4 = *p4++;
-        aux5 = *p4++;
-        aux6 = *p4++;
-        aux7 = *p4++;
-        count -= 28;
-
-        aux1 = aux1 - ((aux1 >> 1) & 0x55555555);
-        aux1 = (aux1 & 0x33333333) + ((aux1 >> 2) & 0x33333333);
-        aux2 = aux2 - ((aux2 >> 1) & 0x55555555);
-        aux2 = (aux2 & 0x33333333) + ((aux2 >> 2) & 0x33333333);
-        aux3 = aux3 - ((aux3 >> 1) & 0x55555555);
-        aux3 = (aux3 & 0x33333333) + ((aux3 >> 2) & 0x33333333);
-        aux4 = aux4 - ((aux4 >> 1) & 0x55555555);
-        aux4 = (aux4 & 0x33333333) + ((aux4 >> 2) & 0x33333333);
-        aux5 = aux5 - ((aux5 >> 1) & 0x55555555);
-        aux5 = (aux5 & 0x33333333) + ((aux5 >> 2) & 0x33333333);
-        aux6 = aux6 - ((aux6 >> 1) & 0x55555555);
-        aux6 = (aux6 & 0x33333333) + ((aux6 >> 2) & 0x33333333);
-        aux7 = aux7 - ((aux7 >> 1) & 0x55555555);
-        aux7 = (aux7 & 0x33333333) + ((aux7 >> 2) & 0x33333333);
-        bits += ((((aux1 + (aux1 >> 4)) & 0x0F0F0F0F) +
-                    ((aux2 + (aux2 >> 4)) & 0x0F0F0F0F) +
-                    ((aux3 + (aux3 >> 4)) & 0x0F0F0F0F) +
-                    ((aux4 + (aux4 >> 4)) & 0x0F0F0F0F) +
-                    ((aux5 + (aux5 >> 4)) & 0x0F0F0F0F) +
-                    ((aux6 + (aux6 >> 4)) & 0x0F0F0F0F) +
-                    ((aux7 + (aux7 >> 4)) & 0x0F0F0F0F))* 0x01010101) >> 24;
-    }
-    /* Count the remaining bytes. */
-    p = (unsigned char*)p4;
-    while(count--) bits += bitsinbyte[*p++];
-    return bits;
+    return bitkernelPopcount(s,count);
 }
 
 /* Return the position of the first bit set to one (if 'bit' is 1) or
@@ -129,9 +80,14 @@ long redisBitpos(void *s, unsigned long count, int bit) {
         pos += 8;
     }
 
-    /* Skip bits with full word step. */
+    /* Skip bits with full word step, most of them with the vector kernel
+     * when the string is long. */
     l = (unsigned long*) c;
     if (!found) {
+        unsigned long skipped = bitkernelSkip(c,count,bit ? 0 : UCHAR_MAX);
+        l = (unsigned long*) (c+skipped);
+        count -= skipped;
+        pos += skipped*8;
         skipval = bit ? 0 : ULONG_MAX;
         while (count >= sizeof(*l)) {
             if (*l != skipval) break;
@@ -480,16 +436,143 @@ robj *lookupStringForBitCommand(client *c, size_t maxbit) {
     robj *o = lookupKeyWrite(c->m_cur_selected_db,c->m_argv[1]);
 
     if (o == NULL) {
-        o = createObject(OBJ_STRING,sdsnewlen(NULL, byte+1));
+        /* Big bitmaps start chunked, so that only the ranges actually
+         * used take memory. */
+        if (server.bitmap_chunked_min_bytes &&
+            byte+1 >= server.bitmap_chunked_min_bytes)
+        {
+            chunkedBitmap *cb = chunkedBitmapCreate();
+            cb->chunkedBitmapGrow(byte+1);
+            o = createChunkedBitmapObject(cb);
+        } else {
+            o = createObject(OBJ_STRING,sdsnewlen(NULL, byte+1));
+        }
         dbAdd(c->m_cur_selected_db,c->m_argv[1],o);
     } else {
         if (checkType(c,o,OBJ_STRING)) return NULL;
+        if (o->encoding == OBJ_ENCODING_CHUNKED) {
+            if (o->refcount != 1) {
+                o = createChunkedBitmapObject(chunkedBitmap::chunkedBitmapDup(
+                    (chunkedBitmap *)o->ptr));
+                dbOverwrite(c->m_cur_selected_db,c->m_argv[1],o);
+            }
+            ((chunkedBitmap *)o->ptr)->chunkedBitmapGrow(byte+1);
+            return o;
+        }
         o = dbUnshareStringValue(c->m_cur_selected_db,c->m_argv[1],o);
+
+        /* A plain string that is growing past bitmap-chunked-min-bytes, or
+         * doubling its size, is converted if it is sparse enough. Checking
+         * only in these cases keeps the cost of the scan amortized. */
+        size_t curlen = sdslen((sds)o->ptr);
+        if (byte+1 > curlen &&
+            (curlen < server.bitmap_chunked_min_bytes || byte+1 >= curlen*2) &&
+            tryChunkedBitmapEncoding(o,byte+1)) return o;
         o->ptr = sdsgrowzero((sds)o->ptr,byte+1);
     }
     return o;
 }
 
+/* Like redisBitpos() for the 'count' bytes of the chunked bitmap 'cb'
+ * starting at 'start', that must be inside the string. The missing chunks
+ * are all zero bits, so they are skipped when looking for a set bit. */
+static long chunkedBitpos(const chunkedBitmap *cb, size_t start, size_t count,
+                          int bit)
+{
+    size_t pos = start, end = start+count;
+
+    while (pos < end) {
+        size_t i = pos/CHUNKED_BITMAP_CHUNK_BYTES;
+        size_t off = pos%CHUNKED_BITMAP_CHUNK_BYTES;
+        size_t n = CHUNKED_BITMAP_CHUNK_BYTES-off;
+        const unsigned char *chunk = cb->chunkedBitmapChunk(i);
+
+        if (n > end-pos) n = end-pos;
+        if (chunk == NULL) {
+            if (bit == 0) return (pos-start)*8;
+        } else {
+            long found = redisBitpos((void*)(chunk+off),n,bit);
+            if (bit ? found != -1 : found != (long)n*8)
+                return (pos-start)*8+found;
+        }
+        pos += n;
+    }
+    return bit ? -1 : count*8;
+}
+
+/* BITOP with at least one chunked source. The result is computed one
+ * chunk at a time and stored chunked as well, allocating only its chunks
+ * with some bit set. The plain sources are read in place, zero padding
+ * their last partial chunk in 'tmp'. */
+static chunkedBitmap *bitopChunked(unsigned long op, robj **objects,
+                                   unsigned char **src, unsigned long *len,
+                                   unsigned long numkeys, unsigned long maxlen)
+{
+    static unsigned char zeros[CHUNKED_BITMAP_CHUNK_BYTES];
+    const size_t chunkbytes = CHUNKED_BITMAP_CHUNK_BYTES;
+    unsigned char **chunks = (unsigned char **)zmalloc(sizeof(unsigned char*) * numkeys);
+    unsigned char *tmp = (unsigned char *)zmalloc(chunkbytes * numkeys);
+    unsigned char res[CHUNKED_BITMAP_CHUNK_BYTES];
+    chunkedBitmap *cb = chunkedBitmapCreate();
+    unsigned long i, j;
+
+    cb->chunkedBitmapGrow(maxlen);
+    for (i = 0; i < cb->chunkedBitmapNumChunks(); i++) {
+        size_t start = i*chunkbytes, n = maxlen-start, k;
+        unsigned long missing = 0;
+
+        if (n > chunkbytes) n = chunkbytes;
+        for (j = 0; j < numkeys; j++) {
+            if (objects[j] && objects[j]->encoding == OBJ_ENCODING_CHUNKED) {
+                const chunkedBitmap *s = (const chunkedBitmap *)objects[j]->ptr;
+                chunks[j] = (unsigned char *)s->chunkedBitmapChunk(i);
+            } else if (len[j] >= start+chunkbytes) {
+                chunks[j] = src[j]+start;
+            } else if (len[j] > start) {
+                chunks[j] = tmp+j*chunkbytes;
+                memcpy(chunks[j],src[j]+start,len[j]-start);
+                memset(chunks[j]+len[j]-start,0,chunkbytes-(len[j]-start));
+            } else {
+                chunks[j] = NULL;
+            }
+            if (chunks[j] == NULL) {
+                chunks[j] = zeros;
+                missing++;
+            }
+        }
+
+        /* A zero source makes the AND zero, and so does the OR or XOR of
+         * sources that are all zero. */
+        if ((op == BITOP_AND && missing) ||
+            (op != BITOP_NOT && missing == numkeys)) continue;
+
+        k = 0;
+        #ifndef USE_ALIGNED_ACCESS
+        k = bitkernelOp(op,res,chunks,numkeys,chunkbytes);
+        #endif
+        for (; k < chunkbytes; k++) {
+            unsigned char output = chunks[0][k];
+            if (op == BITOP_NOT) output = ~output;
+            for (j = 1; j < numkeys; j++) {
+                switch(op) {
+                case BITOP_AND: output &= chunks[j][k]; break;
+                case BITOP_OR:  output |= chunks[j][k]; break;
+                case BITOP_XOR: output ^= chunks[j][k]; break;
+                }
+            }
+            res[k] = output;
+        }
+
+        /* Keep the bytes after the end of the string zero, as NOT set them. */
+        if (n < chunkbytes) memset(res+n,0,chunkbytes-n);
+        for (k = 0; k < chunkbytes && res[k] == 0; k++);
+        if (k < chunkbytes) cb->chunkedBitmapSetChunk(i,res);
+    }
+    zfree(chunks);
+    zfree(tmp);
+    return cb;
+}
+
 /* Return a pointer to the string object content, and stores its length
  * in 'len'. The user is required to pass (likely stack allocated) buffer
  * 'llbuf' of at least LONG_STR_SIZE bytes. Such a buffer is used in the case
@@ -546,14 +629,25 @@ void setbitCommand(client *c) {
 
     /* Get current values */
     byte = bitoffset >> 3;
-    byteval = ((uint8_t*)o->ptr)[byte];
     bit = 7 - (bitoffset & 0x7);
-    bitval = byteval & (1 << bit);
+    if (o->encoding == OBJ_ENCODING_CHUNKED) {
+        chunkedBitmap *cb = (chunkedBitmap *)o->ptr;
+        byteval = cb->chunkedBitmapGetByte(byte);
+        bitval = byteval & (1 << bit);
+
+        /* Allocate the chunk only if its content actually changes. */
+        if (!bitval != !on)
+            cb->chunkedBitmapChunkForWrite(byte/CHUNKED_BITMAP_CHUNK_BYTES)
+                [byte%CHUNKED_BITMAP_CHUNK_BYTES] = byteval ^ (1 << bit);
+    } else {
+        byteval = ((uint8_t*)o->ptr)[byte];
+        bitval = byteval & (1 << bit);
 
-    /* Update byte with new bit value and return original value */
-    byteval &= ~(1 << bit);
-    byteval |= ((on & 0x1) << bit);
-    ((uint8_t*)o->ptr)[byte] = byteval;
+        /* Update byte with new bit value and return original value */
+        byteval &= ~(1 << bit);
+        byteval |= ((on & 0x1) << bit);
+        ((uint8_t*)o->ptr)[byte] = byteval;
+    }
     signalModifiedKey(c->m_cur_selected_db,c->m_argv[1]);
     notifyKeyspaceEvent(NOTIFY_STRING,"setbit",c->m_argv[1],c->m_cur_selected_db->m_id);
     server.dirty++;
@@ -579,6 +673,8 @@ void getbitCommand(client *c) {
     if (sdsEncodedObject(o)) {
         if (byte < sdslen((sds)o->ptr))
             bitval = ((uint8_t*)o->ptr)[byte] & (1 << bit);
+    } else if (o->encoding == OBJ_ENCODING_CHUNKED) {
+        bitval = ((chunkedBitmap *)o->ptr)->chunkedBitmapGetByte(byte) & (1 << bit);
     } else {
         if (byte < (size_t)ll2string(llbuf,sizeof(llbuf),(long)o->ptr))
             bitval = llbuf[byte] & (1 << bit);
@@ -598,6 +694,8 @@ void bitopCommand(client *c) {
                                        and max len. */
     unsigned long minlen = 0;    /* Min len among the input keys. */
     unsigned char *res = NULL; /* Resulting string. */
+    chunkedBitmap *cbres = NULL; /* Resulting string, if chunked. */
+    int chunked = 0;             /* True if some source is chunked. */
 
     /* Parse the operation name. */
     if ((opname[0] == 'a' || opname[0] == 'A') && !strcasecmp(opname,"and"))
@@ -646,86 +744,38 @@ void bitopCommand(client *c) {
             zfree(objects);
             return;
         }
-        objects[j] = getDecodedObject(o);
-        src[j] = (unsigned char *)objects[j]->ptr;
-        len[j] = sdslen((sds)objects[j]->ptr);
+        if (o->encoding == OBJ_ENCODING_CHUNKED) {
+            incrRefCount(o);
+            objects[j] = o;
+            src[j] = NULL;
+            len[j] = ((chunkedBitmap *)o->ptr)->chunkedBitmapLen();
+            chunked = 1;
+        } else {
+            objects[j] = getDecodedObject(o);
+            src[j] = (unsigned char *)objects[j]->ptr;
+            len[j] = sdslen((sds)objects[j]->ptr);
+        }
         if (len[j] > maxlen) maxlen = len[j];
         if (j == 0 || len[j] < minlen) minlen = len[j];
     }
 
     /* Compute the bit operation, if at least one string is not empty. */
-    if (maxlen) {
+    if (maxlen && chunked) {
+        cbres = bitopChunked(op,objects,src,len,numkeys,maxlen);
+    } else if (maxlen) {
         res = (unsigned char*) sdsnewlen(NULL,maxlen);
         unsigned char output, byte;
         unsigned long i;
 
         /* Fast path: as far as we have data for all the input bitmaps we
          * can take a fast path that performs much better than the
-         * vanilla algorithm. On ARM we skip the fast path since it will
-         * result in GCC compiling the code using multiple-words load/store
+         * vanilla algorithm, processing 32 bytes at a time with the vector
+         * kernels for this CPU. On ARM without unaligned access we skip
+         * the fast path since it will result in multiple-words load/store
          * operations that are not supported even in ARM >= v6. */
         j = 0;
         #ifndef USE_ALIGNED_ACCESS
-        if (minlen >= sizeof(unsigned long)*4 && numkeys <= 16) {
-            unsigned long *lp[16];
-            unsigned long *lres = (unsigned long*) res;
-
-            /* Note: sds pointer is always aligned to 8 byte boundary. */
-            memcpy(lp,src,sizeof(unsigned long*)*numkeys);
-            memcpy(res,src[0],minlen);
-
-            /* Different branches per different operations for speed (sorry). */
-            if (op == BITOP_AND) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    for (i = 1; i < numkeys; i++) {
-                        lres[0] &= lp[i][0];
-                        lres[1] &= lp[i][1];
-                        lres[2] &= lp[i][2];
-                        lres[3] &= lp[i][3];
-                        lp[i]+=4;
-                    }
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            } else if (op == BITOP_OR) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    for (i = 1; i < numkeys; i++) {
-                        lres[0] |= lp[i][0];
-                        lres[1] |= lp[i][1];
-                        lres[2] |= lp[i][2];
-                        lres[3] |= lp[i][3];
-                        lp[i]+=4;
-                    }
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            } else if (op == BITOP_XOR) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    for (i = 1; i < numkeys; i++) {
-                        lres[0] ^= lp[i][0];
-                        lres[1] ^= lp[i][1];
-                        lres[2] ^= lp[i][2];
-                        lres[3] ^= lp[i][3];
-                        lp[i]+=4;
-                    }
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            } else if (op == BITOP_NOT) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    lres[0] = ~lres[0];
-                    lres[1] = ~lres[1];
-                    lres[2] = ~lres[2];
-                    lres[3] = ~lres[3];
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            }
-        }
+        j = bitkernelOp(op,res,src,numkeys,minlen);
         #endif
 
         /* j is set to the next byte to process by the previous loop. */
@@ -753,7 +803,8 @@ void bitopCommand(client *c) {
 
     /* Store the computed value into the target key */
     if (maxlen) {
-        o = createObject(OBJ_STRING,res);
+        o = cbres ? createChunkedBitmapObject(cbres) :
+                    createObject(OBJ_STRING,res);
         setKey(c->m_cur_selected_db,targetkey,o);
         notifyKeyspaceEvent(NOTIFY_STRING,"set",targetkey,c->m_cur_selected_db->m_id);
         decrRefCount(o);
@@ -775,7 +826,12 @@ void bitcountCommand(client *c) {
     /* Lookup, check for type, and return 0 for non existing keys. */
     if ((o = lookupKeyReadOrReply(c,c->m_argv[1],shared.czero)) == NULL ||
         checkType(c,o,OBJ_STRING)) return;
-    p = getObjectReadOnlyString(o,&strlen,llbuf);
+    if (o->encoding == OBJ_ENCODING_CHUNKED) {
+        p = NULL;
+        strlen = ((chunkedBitmap *)o->ptr)->chunkedBitmapLen();
+    } else {
+        p = getObjectReadOnlyString(o,&strlen,llbuf);
+    }
 
     /* Parse start/end range if any. */
     if (c->m_argc == 4) {
@@ -810,7 +866,10 @@ void bitcountCommand(client *c) {
     } else {
         long bytes = end-start+1;
 
-        c->addReplyLongLong(redisPopcount(p+start,bytes));
+        if (p == NULL)
+            c->addReplyLongLong(((chunkedBitmap *)o->ptr)->chunkedBitmapPopcount(start,bytes));
+        else
+            c->addReplyLongLong(redisPopcount(p+start,bytes));
     }
 }
 
@@ -839,7 +898,12 @@ void bitposCommand(client *c) {
         return;
     }
     if (checkType(c,o,OBJ_STRING)) return;
-    p = getObjectReadOnlyString(o,&strlen,llbuf);
+    if (o->encoding == OBJ_ENCODING_CHUNKED) {
+        p = NULL;
+        strlen = ((chunkedBitmap *)o->ptr)->chunkedBitmapLen();
+    } else {
+        p = getObjectReadOnlyString(o,&strlen,llbuf);
+    }
 
     /* Parse start/end range if any. */
     if (c->m_argc == 4 || c->m_argc == 5) {
@@ -874,7 +938,8 @@ void bitposCommand(client *c) {
         c->addReplyLongLong( -1);
     } else {
         long bytes = end-start+1;
-        long pos = redisBitpos(p+start,bytes,bit);
+        long pos = p ? redisBitpos(p+start,bytes,bit) :
+                       chunkedBitpos((chunkedBitmap *)o->ptr,start,bytes,bit);
 
         /* If we are looking for clear bits, and the user specified an exact
          * range with start-end, we can't consider the right of the range as
@@ -1016,6 +1081,19 @@ void bitfieldCommand(client *c) {
              * for simplicity. SET return value is the previous value so
              * we need fetch & store as well. */
 
+            unsigned char *p = (unsigned char *)o->ptr, buf[9], orig[9];
+            uint64_t offset = thisop->offset;
+            size_t byte = offset >> 3;
+
+            /* Chunked bitmaps are operated on a copy of the up to 9 bytes
+             * of the field, that is written back below if changed. */
+            if (o->encoding == OBJ_ENCODING_CHUNKED) {
+                ((chunkedBitmap *)o->ptr)->chunkedBitmapRead(byte,buf,9);
+                memcpy(orig,buf,9);
+                p = buf;
+                offset -= byte*8;
+            }
+
             /* We need two different but very similar code paths for signed
              * and unsigned operations, since the set of functions to get/set
              * the integers and the used variables types are different. */
@@ -1023,8 +1101,7 @@ void bitfieldCommand(client *c) {
                 int64_t oldval, newval, wrapped, retval;
                 int overflow;
 
-                oldval = getSignedBitfield((unsigned char *)o->ptr,thisop->offset,
-                        thisop->bits);
+                oldval = getSignedBitfield(p,offset,thisop->bits);
 
                 if (thisop->opcode == BITFIELDOP_INCRBY) {
                     newval = oldval + thisop->i64;
@@ -1044,8 +1121,7 @@ void bitfieldCommand(client *c) {
                  * NULL to signal the condition. */
                 if (!(overflow && thisop->owtype == BFOVERFLOW_FAIL)) {
                     c->addReplyLongLong(retval);
-                    setSignedBitfield((unsigned char *)o->ptr,thisop->offset,
-                                      thisop->bits,newval);
+                    setSignedBitfield(p,offset,thisop->bits,newval);
                 } else {
                     c->addReply(shared.nullbulk);
                 }
@@ -1053,8 +1129,7 @@ void bitfieldCommand(client *c) {
                 uint64_t oldval, newval, wrapped, retval;
                 int overflow;
 
-                oldval = getUnsignedBitfield((unsigned char *)o->ptr,thisop->offset,
-                        thisop->bits);
+                oldval = getUnsignedBitfield(p,offset,thisop->bits);
 
                 if (thisop->opcode == BITFIELDOP_INCRBY) {
                     newval = oldval + thisop->i64;
@@ -1073,12 +1148,15 @@ void bitfieldCommand(client *c) {
                  * NULL to signal the condition. */
                 if (!(overflow && thisop->owtype == BFOVERFLOW_FAIL)) {
                     c->addReplyLongLong(retval);
-                    setUnsignedBitfield((unsigned char *)o->ptr,thisop->offset,
-                                        thisop->bits,newval);
+                    setUnsignedBitfield(p,offset,thisop->bits,newval);
                 } else {
                     c->addReply(shared.nullbulk);
                 }
             }
+            if (p == buf && memcmp(buf,orig,9)) {
+                ((chunkedBitmap *)o->ptr)->chunkedBitmapWrite(byte,buf,
+                    ((offset+thisop->bits-1)>>3)+1);
+            }
             changes++;
         } else {
             /* GET */
@@ -1087,9 +1165,6 @@ void bitfieldCommand(client *c) {
             unsigned char *src = NULL;
             char llbuf[LONG_STR_SIZE];
 
-            if (o != NULL)
-                src = getObjectReadOnlyString(o,&strlen,llbuf);
-
             /* For GET we use a trick: before executing the operation
              * copy up to 9 bytes to a local buffer, so that we can easily
              * execute up to 64 bit operations that are at actual string
@@ -1097,9 +1172,15 @@ void bitfieldCommand(client *c) {
             memset(buf,0,9);
             int i;
             size_t byte = thisop->offset >> 3;
-            for (i = 0; i < 9; i++) {
-                if (src == NULL || i+byte >= (size_t)strlen) break;
-                buf[i] = src[i+byte];
+            if (o != NULL && o->encoding == OBJ_ENCODING_CHUNKED) {
+                ((chunkedBitmap *)o->ptr)->chunkedBitmapRead(byte,buf,9);
+            } else {
+                if (o != NULL)
+                    src = getObjectReadOnlyString(o,&strlen,llbuf);
+                for (i = 0; i < 9; i++) {
+                    if (src == NULL || i+byte >= (size_t)strlen) break;
+                    buf[i] = src[i+byte];
+                }
             }
 
             /* Now operate on the copied buffer which is guaranteed
@@ -1,4 +1,4 @@
-/* blocked.c - generic support for blocking operations like BLPOP & WAIT.
+/* blocked.c - generic support for blocking operations like BLPOP, XREAD & WAIT.
  *
  * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
  * All rights reserved.
@@ -56,6 +56,10 @@
  * to 0, no timeout is processed).
  * It usually just needs to send a reply to the client.
  *
+ * A command waiting for something other than keys or replicas should just
+ * suspend itself with blockClientOnContinuation(), and be resumed with
+ * resumeBlockedClient(), instead of adding a blocking type.
+ *
  * When implementing a new type of blocking opeation, the implementation
  * should modify unblockClient() and replyToBlockedClientTimedOut() in order
  * to handle the btype-specific behavior of this two functions.
@@ -64,6 +68,8 @@
  */
 
 #include "server.h"
+#include "tier.h"
+#include "bgread.h"
 
 /* Get a timeout value from an object and store it into 'timeout'.
  * The final timeout is always stored as milliseconds as a time where the
@@ -101,6 +107,144 @@ void blockClient(client *c, int btype) {
     c->m_flags |= CLIENT_BLOCKED;
     c->m_blocking_op_type = btype;
     server.bpop_blocked_clients++;
+    if (c->m_blocking_state.m_timeout != 0) addClientToTimeoutTable(c);
+}
+
+/* The clients blocked with a timeout are indexed by deadline in
+ * server.clients_timeout_table, so that a time event set at the first
+ * deadline only visits the clients timing out, instead of the cron checking
+ * all the clients a few times per second. The key is the big endian
+ * deadline followed by the big endian client ID, that makes it unique. */
+#define CLIENT_TIMEOUT_KEYLEN 16
+
+static void clientTimeoutKey(unsigned char *buf, client *c) {
+    uint64_t timeout = c->m_blocking_state.m_timeout;
+    uint64_t id = c->m_client_id;
+
+    for (int j = 0; j < 8; j++) {
+        buf[j] = timeout >> (56-j*8);
+        buf[j+8] = id >> (56-j*8);
+    }
+}
+
+static mstime_t clientTimeoutKeyDeadline(unsigned char *buf) {
+    uint64_t timeout = 0;
+
+    for (int j = 0; j < 8; j++) timeout = (timeout << 8) | buf[j];
+    return (mstime_t)timeout;
+}
+
+/* Time event firing at the first deadline of the table: reply to the
+ * clients timed out, and run again at the next deadline, if any. */
+static int blockedClientsTimeoutProc(aeEventLoop *el, long long id,
+                                     void *clientData)
+{
+    mstime_t now = mstime();
+    raxIterator ri;
+    UNUSED(el);
+    UNUSED(id);
+    UNUSED(clientData);
+
+    raxStart(&ri,server.clients_timeout_table);
+    while (1) {
+        /* Seek again every time: unblocking removes the client. */
+        raxSeek(&ri,"^",NULL,0);
+        if (!raxNext(&ri)) break;
+        mstime_t deadline = clientTimeoutKeyDeadline(ri.key);
+        if (deadline > now) {
+            raxStop(&ri);
+            server.clients_timeout_when = deadline;
+            return deadline-now;
+        }
+        client *c = (client *)ri.data;
+        replyToBlockedClientTimedOut(c);
+        c->unblockClient();
+    }
+    raxStop(&ri);
+    server.clients_timeout_timer = -1;
+    return AE_NOMORE;
+}
+
+/* Index the blocked client 'c' by its deadline, moving the time event of
+ * the table earlier if needed. */
+void addClientToTimeoutTable(client *c) {
+    unsigned char buf[CLIENT_TIMEOUT_KEYLEN];
+    mstime_t timeout = c->m_blocking_state.m_timeout;
+
+    clientTimeoutKey(buf,c);
+    raxInsert(server.clients_timeout_table,buf,sizeof(buf),c,NULL);
+    c->m_blocking_state.m_in_timeout_table = 1;
+
+    if (server.clients_timeout_timer != -1 &&
+        server.clients_timeout_when <= timeout) return;
+    if (server.clients_timeout_timer != -1)
+        server.el->aeDeleteTimeEvent(server.clients_timeout_timer);
+    mstime_t now = mstime();
+    server.clients_timeout_when = timeout;
+    server.clients_timeout_timer = server.el->aeCreateTimeEvent(
+        timeout > now ? timeout-now : 0,blockedClientsTimeoutProc,NULL,NULL);
+}
+
+/* Remove the client from the table when it is unblocked. The time event is
+ * left alone: firing with no client timed out just moves it. */
+void removeClientFromTimeoutTable(client *c) {
+    unsigned char buf[CLIENT_TIMEOUT_KEYLEN];
+
+    if (!c->m_blocking_state.m_in_timeout_table) return;
+    clientTimeoutKey(buf,c);
+    raxRemove(server.clients_timeout_table,buf,sizeof(buf),NULL);
+    c->m_blocking_state.m_in_timeout_table = 0;
+}
+
+/* Suspend the command of 'c' until resumeBlockedClient() is called, or the
+ * timeout, if not zero, elapses, without a btype of its own: 'resume' is
+ * the rest of the command, called with 'privdata' and CONTINUATION_DONE
+ * or CONTINUATION_TIMEOUT, and 'free_privdata', if not NULL, releases
+ * 'privdata' once the command is resumed, or when the client is unblocked
+ * or freed before. The code waiting for a background job, a replication
+ * offset or anything else only needs to remember the client, and to resume
+ * it from the main thread.
+ *
+ * The continuation can suspend the client again, so a command can go
+ * through several steps, each one waiting for something else. */
+void blockClientOnContinuation(client *c, mstime_t timeout,
+                               clientResumeProc *resume,
+                               clientResumeFreeProc *free_privdata,
+                               void *privdata)
+{
+    c->m_blocking_state.m_timeout = timeout;
+    c->m_blocking_state.m_resume = resume;
+    c->m_blocking_state.m_resume_free = free_privdata;
+    c->m_blocking_state.m_resume_privdata = privdata;
+    blockClient(c,BLOCKED_CONTINUATION);
+}
+
+/* Unblock the client suspended by blockClientOnContinuation() and run the
+ * continuation of its command with 'status'. */
+void resumeBlockedClient(client *c, int status) {
+    serverAssert(c->m_blocking_op_type == BLOCKED_CONTINUATION);
+    clientResumeProc *resume = c->m_blocking_state.m_resume;
+    clientResumeFreeProc *free_privdata = c->m_blocking_state.m_resume_free;
+    void *privdata = c->m_blocking_state.m_resume_privdata;
+
+    /* Detach the state first: the continuation may suspend again. */
+    c->m_blocking_state.m_resume_privdata = NULL;
+    c->unblockClient();
+    resume(c,privdata,status);
+    if (free_privdata) free_privdata(privdata);
+}
+
+/* Called by unblockClient(): the state of a command that is not resumed,
+ * since the client timed out, was freed or unblocked, is released. */
+static void unblockClientFromContinuation(client *c) {
+    void *privdata = c->m_blocking_state.m_resume_privdata;
+
+    if (privdata && c->m_blocking_state.m_resume_free)
+        c->m_blocking_state.m_resume_free(privdata);
+    c->m_blocking_state.m_resume = NULL;
+    c->m_blocking_state.m_resume_free = NULL;
+    c->m_blocking_state.m_resume_privdata = NULL;
+    c->m_blocking_state.m_produce = NULL;
 }
 
 /* This function is called in the beforeSleep() function of the event loop
@@ -121,6 +265,16 @@ void processUnblockedClients() {
          * is blocked again. Actually processInputBuffer() checks that the
          * client is not blocked before to proceed, but things may change and
          * the code is conceptually more correct this way. */
+        if (!(c->m_flags & CLIENT_BLOCKED) &&
+            c->m_blocking_state.m_rerun)
+        {
+            /* The values of the command are loaded from the tiering file,
+             * or not read in background anymore: execute it now. */
+            int retval = c->processCommandAndResetClient();
+            c->m_blocking_state.m_rerun = 0;
+            server.current_client = NULL;
+            if (retval == C_ERR) continue;
+        }
         if (!(c->m_flags & CLIENT_BLOCKED)) {
             if (c->m_query_buf && sdslen(c->m_query_buf) > 0) {
                 c->processInputBuffer();
@@ -132,15 +286,26 @@ void processUnblockedClients() {
 /* Unblock a client calling the right function depending on the kind
  * of operation the client is blocking for. */
 void client::unblockClient() {
-    if (m_blocking_op_type == BLOCKED_LIST) {
+    if (m_blocking_op_type == BLOCKED_LIST ||
+        m_blocking_op_type == BLOCKED_STREAM)
+    {
         unblockClientWaitingData();
     } else if (m_blocking_op_type == BLOCKED_WAIT) {
         unblockClientWaitingReplicas(this);
     } else if (m_blocking_op_type == BLOCKED_MODULE) {
         unblockClientFromModule();
+    } else if (m_blocking_op_type == BLOCKED_MIGRATE) {
+        unblockClientFromMigrate(this);
+    } else if (m_blocking_op_type == BLOCKED_TIER) {
+        unblockClientFromTier(this);
+    } else if (m_blocking_op_type == BLOCKED_BGREAD) {
+        unblockClientFromBgread(this);
+    } else if (m_blocking_op_type == BLOCKED_CONTINUATION) {
+        unblockClientFromContinuation(this);
     } else {
         serverPanic("Unknown btype in unblockClient().");
     }
+    removeClientFromTimeoutTable(this);
     /* Clear the flags, and put the client in the unblocked list so that
      * we'll process new commands in its query buffer ASAP. */
     m_flags &= ~CLIENT_BLOCKED;
@@ -158,12 +323,17 @@ void client::unblockClient() {
  * send it a reply of some kind. After this function is called,
  * unblockClient() will be called with the same client as argument. */
 void replyToBlockedClientTimedOut(client *c) {
-    if (c->m_blocking_op_type == BLOCKED_LIST) {
+    if (c->m_blocking_op_type == BLOCKED_LIST ||
+        c->m_blocking_op_type == BLOCKED_STREAM)
+    {
         c->addReply(shared.nullmultibulk);
     } else if (c->m_blocking_op_type == BLOCKED_WAIT) {
         c->addReplyLongLong(replicationCountAcksByOffset(c->m_blocking_state.m_replication_offset));
     } else if (c->m_blocking_op_type == BLOCKED_MODULE) {
         moduleBlockedClientTimedOut(c);
+    } else if (c->m_blocking_op_type == BLOCKED_CONTINUATION) {
+        c->m_blocking_state.m_resume(c,c->m_blocking_state.m_resume_privdata,
+                                     CONTINUATION_TIMEOUT);
     } else {
         serverPanic("Unknown btype in replyToBlockedClientTimedOut().");
     }
@@ -183,7 +353,15 @@ void disconnectAllBlockedClients() {
     while((ln = li.listNext())) {
         client *c = (client *)ln->listNodeValue();
 
-        if (c->m_flags & CLIENT_BLOCKED) {
+        /* The clients waiting for the tiering file or a background read
+         * didn't execute their command yet: it is checked again once they
+         * are unblocked. The replies being produced are not affected and
+         * are being sent. */
+        if (c->m_flags & CLIENT_BLOCKED &&
+            c->m_blocking_op_type != BLOCKED_TIER &&
+            c->m_blocking_op_type != BLOCKED_BGREAD &&
+            c->m_blocking_state.m_produce == NULL)
+        {
             c->addReplySds(sdsnew(
                 "-UNBLOCKED force unblock from blocking operation, "
                 "instance state changed (master -> slave?)\r\n"));
@@ -192,3 +370,190 @@ void disconnectAllBlockedClients() {
         }
     }
 }
+
+/* This is how the current blocking lists calls such as BLPOP works, we use
+ * BLPOP as example:
+ * - If the user calls BLPOP and the key exists and contains a non empty list
+ *   then LPOP is called instead. So BLPOP is semantically the same as LPOP
+ *   if blocking is not required.
+ * - If instead BLPOP is called and the key does not exists or the list is
+ *   empty we need to block. In order to do so we remove the notification for
+ *   new data to read in the client socket (so that we'll not serve new
+ *   requests if the blocking request is not served). Also we put the client
+ *   in a dictionary (db->m_blocking_keys) mapping keys to a list of clients
+ *   blocking for this keys.
+ * - If a PUSH operation against a key with blocked clients waiting is
+ *   performed, we mark this key as "ready", and after the current command,
+ *   MULTI/EXEC block, or script, is executed, we serve all the clients waiting
+ *   for this list, from the one that blocked first, to the last, accordingly
+ *   to the number of elements we have in the ready list.
+ *
+ * XREAD BLOCK works the same way with BLOCKED_STREAM: XADD marks the key as
+ * ready, and the clients waiting for IDs smaller than the new top item of
+ * the stream are served.
+ */
+
+/* Set a client in blocking mode for the specified key (list or stream), with
+ * the specified timeout. The 'type' argument is BLOCKED_LIST or
+ * BLOCKED_STREAM depending on the kind of operation we are waiting for an
+ * empty key in order to awake the client. The client is blocked for all the
+ * 'numkeys' keys as in the 'keys' argument. When we block for stream keys,
+ * we also provide an array of streamID structures: clients will be unblocked
+ * only when items with an ID greater or equal to the specified one is
+ * appended to the stream. */
+void blockForKeys(client *c, int btype, robj **keys, int numkeys,
+                  mstime_t timeout, robj *target, streamID *ids)
+{
+    dictEntry *de;
+    list *l;
+    int j;
+
+    c->m_blocking_state.m_timeout = timeout;
+    c->m_blocking_state.m_target = target;
+
+    if (target != NULL) incrRefCount(target);
+
+    for (j = 0; j < numkeys; j++) {
+        /* The value associated with the key name in the m_keys dict is NULL
+         * for lists, or the stream ID for streams. */
+        streamID *key_data = NULL;
+        if (btype == BLOCKED_STREAM) {
+            key_data = (streamID *)zmalloc(sizeof(streamID));
+            *key_data = ids[j];
+        }
+
+        /* If the key already exists in the dict ignore it. */
+        if (c->m_blocking_state.m_keys->dictAdd(keys[j],key_data) != DICT_OK) {
+            zfree(key_data);
+            continue;
+        }
+        incrRefCount(keys[j]);
+
+        /* And in the other "side", to map keys -> clients */
+        de = c->m_cur_selected_db->m_blocking_keys->dictFind(keys[j]);
+        if (de == NULL) {
+            int retval;
+
+            /* For every key we take a list of clients blocked for it */
+            l = listCreate();
+            retval = c->m_cur_selected_db->m_blocking_keys->dictAdd(keys[j],l);
+            incrRefCount(keys[j]);
+            serverAssertWithInfo(c,keys[j],retval == DICT_OK);
+        } else {
+            l = (list *)de->dictGetVal();
+        }
+        l->listAddNodeTail(c);
+    }
+    blockClient(c,btype);
+}
+
+/* Unblock a client that's waiting in a blocking operation such as BLPOP.
+ * You should never call this function directly, but unblockClient() instead. */
+void client::unblockClientWaitingData() {
+    dictEntry *de;
+
+    serverAssertWithInfo(this,NULL,m_blocking_state.m_keys->dictSize() != 0);
+    {
+        dictIterator di(m_blocking_state.m_keys);
+        /* The client may wait for multiple keys, so unblock it for every key. */
+        while((de = di.dictNext()) != NULL) {
+            robj *key = (robj *)de->dictGetKey();
+
+            /* Remove this client from the list of clients waiting for this key. */
+            list *l = (list *)(m_cur_selected_db->m_blocking_keys)->dictFetchValue(key);
+            serverAssertWithInfo(this,key,l != NULL);
+            l->listDelNode(l->listSearchKey(this));
+            /* If the list is empty we need to remove it to avoid wasting memory */
+            if (l->listLength() == 0)
+                m_cur_selected_db->m_blocking_keys->dictDelete(key);
+        }
+    }
+
+    /* Cleanup the client structure */
+    m_blocking_state.m_keys->dictEmpty(NULL);
+    if (m_blocking_state.m_target) {
+        decrRefCount(m_blocking_state.m_target);
+        m_blocking_state.m_target = NULL;
+    }
+    if (m_blocking_state.m_xread_group) {
+        decrRefCount(m_blocking_state.m_xread_group);
+        decrRefCount(m_blocking_state.m_xread_consumer);
+        m_blocking_state.m_xread_group = NULL;
+        m_blocking_state.m_xread_consumer = NULL;
+    }
+}
+
+/* If the specified key has clients blocked waiting for list pushes or
+ * stream entries, this function will put the key reference into the
+ * server.ready_keys list. Note that db->m_ready_keys is a hash table that
+ * allows us to avoid putting the same key again and again in the list in
+ * case of multiple pushes made by a script or in the context of MULTI/EXEC.
+ *
+ * The list will be finally processed by handleClientsBlockedOnKeys() */
+void signalKeyAsReady(redisDb *db, robj *key) {
+    readyList *rl;
+
+    /* No clients blocking for this key? No need to queue it. */
+    if (db->m_blocking_keys->dictFind(key) == NULL) return;
+
+    /* Key was already signaled? No need to queue it again. */
+    if (db->m_ready_keys->dictFind(key) != NULL) return;
+
+    /* Ok, we need to queue this key into server.ready_keys. */
+    rl = (readyList *)zmalloc(sizeof(*rl));
+    rl->key = key;
+    rl->db = db;
+    incrRefCount(key);
+    server.ready_keys->listAddNodeTail(rl);
+
+    /* We also add the key in the db->m_ready_keys dictionary in order
+     * to avoid adding it multiple times into a list with a simple O(1)
+     * check. */
+    incrRefCount(key);
+    serverAssert(db->m_ready_keys->dictAdd(key,NULL) == DICT_OK);
+}
+
+/* This function should be called by Redis every time a single command,
+ * a MULTI/EXEC block, or a Lua script, terminated its execution after
+ * being called by a client.
+ *
+ * All the keys with at least one client blocked that received at least
+ * one new element via some PUSH or XADD operation are accumulated into
+ * the server.ready_keys list. This function will run the list and will
+ * serve clients accordingly. Note that the function will iterate again and
+ * again as a result of serving BRPOPLPUSH we can have new blocking clients
+ * to serve because of the PUSH side of BRPOPLPUSH. */
+void handleClientsBlockedOnKeys() {
+    while(server.ready_keys->listLength() != 0) {
+
+        /* Point server.ready_keys to a fresh list and save the current one
+         * locally. This way as we run the old list we are free to call
+         * signalKeyAsReady() that may push new elements in server.ready_keys
+         * when handling clients blocked into BRPOPLPUSH. */
+        list *l = server.ready_keys;
+        server.ready_keys = listCreate();
+
+        while(l->listLength() != 0) {
+            listNode *ln = l->listFirst();
+            readyList *rl = (readyList *)ln->listNodeValue();
+
+            /* First of all remove this key from db->m_ready_keys so that
+             * we can safely call signalKeyAsReady() against this key. */
+            rl->db->m_ready_keys->dictDelete(rl->key);
+
+            /* Serve the blocked clients with data, depending on the type
+             * of the key. */
+            robj *o = lookupKeyWrite(rl->db,rl->key);
+            if (o != NULL && o->type == OBJ_LIST)
+                handleClientsBlockedOnList(rl->db,rl->key,o);
+            else if (o != NULL && o->type == OBJ_STREAM)
+                handleClientsBlockedOnStream(rl->db,rl->key,o);
+
+            /* Free this item. */
+            decrRefCount(rl->key);
+            zfree(rl);
+            l->listDelNode(ln);
+        }
+        listRelease(l); /* We have the new list on place at this point. */
+    }
+}
@@ -0,0 +1,460 @@
+/* bloom.cpp - Redis scalable Bloom filters.
+ *
+ * A Bloom filter answers if an element was added to it, using a few bits
+ * per element whatever its size, at the cost of false positives: an
+ * element never added may be reported as added, with a probability that
+ * depends on the bits per element. An element added is always reported.
+ *
+ * Like the HyperLogLogs no new type is introduced: a Bloom filter is a
+ * string starting with a header, so that it is saved in the RDB file and
+ * replicated as any other string. Since the number of elements is not
+ * known in advance the filter is scalable [1]: it starts with a filter
+ * sized for BLOOM_INITIAL_CAPACITY elements, and once it is full another
+ * filter twice as big is appended, with an error rate halved, so that the
+ * error rate of the whole filter stays below BLOOM_ERROR_RATE. An element
+ * is in the filter if it is in any of them, and is added to the last one.
+ *
+ * The bit positions of an element are derived from a single 64 bit
+ * MurmurHash64A() of the element, as h1 + i*h2 [2], so the hash is
+ * computed once for all the filters. When the CPU supports AVX2 the bits
+ * of an element are tested 8 at a time with a gather, selected at runtime
+ * like the kernels of bitkernel.cpp, and BF.MEXISTS prefetches the bits of
+ * a batch of elements before testing them.
+ *
+ * [1] Almeida, Baquero, Preguica, Hutchison: Scalable Bloom Filters.
+ * [2] Kirsch, Mitzenmacher: Less Hashing, Same Performance: Building a
+ *     Better Bloom Filter.
+ *
+ * The string is composed of a 16 bytes header:
+ *
+ * +------+---+-----+----------+
+ * | BLOM | F | xxx | count    |
+ * +------+---+-----+----------+
+ *
+ * Where F is the number of filters and count, a 64 bit little endian
+ * integer, the number of elements added. The filters follow, each one a
+ * 24 bytes header followed by its bits, a multiple of 64:
+ *
+ * +----------+----------+------+---+-----+-------------------+
+ * | capacity | count    | bits | K | xxx | bits ...          |
+ * +----------+----------+------+---+-----+-------------------+
+ *
+ * With 'capacity' and 'count' 64 bit and 'bits' 32 bit little endian
+ * integers, and K the number of bits set by an element.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "endianconv.h"
+#include <math.h>
+
+#define BLOOM_INITIAL_CAPACITY 1024     /* Elements of the first filter. */
+#define BLOOM_ERROR_RATE 0.01           /* False positives of the filter. */
+#define BLOOM_MAX_FILTERS 32
+#define BLOOM_MAX_BITS 0xffffffc0UL     /* Bits of a filter, multiple of 64. */
+#define BLOOM_MAX_SIZE (512*1024*1024)  /* Max length of a string. */
+#define BLOOM_MAX_HASHES 64
+#define BLOOM_SEED 0x5bd1e995
+#define BLOOM_BATCH 16                  /* Elements prefetched by BF.MEXISTS. */
+
+struct bloomhdr {
+    char magic[4];      /* "BLOM" */
+    uint8_t filters;    /* Number of filters. */
+    uint8_t notused[3]; /* Reserved for future use, must be zero. */
+    uint8_t count[8];   /* Elements added, little endian. */
+};
+
+struct bloomfilter {
+    uint8_t capacity[8];    /* Elements held at its error rate. */
+    uint8_t count[8];       /* Elements added. */
+    uint8_t bits[4];        /* Bits following the header. */
+    uint8_t hashes;         /* Bits set by an element. */
+    uint8_t notused[3];
+};
+
+static const char *invalid_bloom_err = "-WRONGTYPE Key is not a valid "
+                                       "Bloom filter string value.\r\n";
+static const char *full_bloom_err = "-ERR the Bloom filter is full\r\n";
+
+/* ============================ Low level API =============================== */
+
+static uint64_t bloomGet64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v,p,sizeof(v));
+    memrev64ifbe(&v);
+    return v;
+}
+
+static void bloomSet64(uint8_t *p, uint64_t v) {
+    memrev64ifbe(&v);
+    memcpy(p,&v,sizeof(v));
+}
+
+static uint32_t bloomGet32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v,p,sizeof(v));
+    memrev32ifbe(&v);
+    return v;
+}
+
+static void bloomSet32(uint8_t *p, uint32_t v) {
+    memrev32ifbe(&v);
+    memcpy(p,&v,sizeof(v));
+}
+
+/* Bytes of the bits of the filter 'f'. */
+static size_t bloomFilterBytes(const bloomfilter *f) {
+    return bloomGet32(f->bits)/8;
+}
+
+static uint8_t *bloomFilterBits(bloomfilter *f) {
+    return (uint8_t*)(f+1);
+}
+
+static bloomfilter *bloomNextFilter(bloomfilter *f) {
+    return (bloomfilter*)(bloomFilterBits(f)+bloomFilterBytes(f));
+}
+
+static bloomfilter *bloomFirstFilter(robj *o) {
+    return (bloomfilter*)((char*)o->ptr+sizeof(bloomhdr));
+}
+
+/* Size the filter number 'n' of the scalable filter: twice the capacity of
+ * the previous one, and half its error rate. Return 0 if it would be too
+ * big. */
+static int bloomFilterParams(int n, uint64_t *capacity, uint32_t *bits,
+                             int *hashes)
+{
+    double error, m;
+
+    if (n >= BLOOM_MAX_FILTERS) return 0;
+    error = BLOOM_ERROR_RATE/(2ULL << n);
+    *capacity = (uint64_t)BLOOM_INITIAL_CAPACITY << n;
+    m = ceil(*capacity * -log(error) / (M_LN2*M_LN2));
+    m = ceil(m/64)*64;
+    if (m > BLOOM_MAX_BITS) return 0;
+    *bits = (uint32_t)m;
+    *hashes = (int)ceil(-log2(error));
+    if (*hashes > BLOOM_MAX_HASHES) *hashes = BLOOM_MAX_HASHES;
+    return 1;
+}
+
+/* Append the next filter to the string of 'o'. Return 0 if it would be too
+ * big. */
+static int bloomAddFilter(robj *o) {
+    bloomhdr *hdr = (bloomhdr*)o->ptr;
+    size_t len = sdslen((sds)o->ptr);
+    uint64_t capacity;
+    uint32_t bits;
+    int hashes;
+
+    if (!bloomFilterParams(hdr->filters,&capacity,&bits,&hashes) ||
+        len+sizeof(bloomfilter)+bits/8 > BLOOM_MAX_SIZE) return 0;
+    o->ptr = sdsgrowzero((sds)o->ptr,len+sizeof(bloomfilter)+bits/8);
+    hdr = (bloomhdr*)o->ptr;
+    hdr->filters++;
+
+    bloomfilter *f = (bloomfilter*)((char*)o->ptr+len);
+    bloomSet64(f->capacity,capacity);
+    bloomSet32(f->bits,bits);
+    f->hashes = hashes;
+    return 1;
+}
+
+/* Return a new Bloom filter object holding no element. */
+static robj *createBloomObject() {
+    robj *o = createObject(OBJ_STRING,sdsnewlen(NULL,sizeof(bloomhdr)));
+    bloomhdr *hdr = (bloomhdr*)o->ptr;
+
+    memcpy(hdr->magic,"BLOM",4);
+    serverAssert(bloomAddFilter(o));
+    return o;
+}
+
+/* Check that 'o' is a Bloom filter: the filters must exactly cover the
+ * string. Otherwise reply an error and return C_ERR. */
+static int isBloomObjectOrReply(client *c, robj *o) {
+    bloomhdr *hdr;
+    size_t len, off;
+
+    if (checkType(c,o,OBJ_STRING))
+        return C_ERR; /* Error already sent. */
+
+    if (!sdsEncodedObject(o)) goto invalid;
+    len = stringObjectLen(o);
+    if (len < sizeof(*hdr)) goto invalid;
+    hdr = (bloomhdr*)o->ptr;
+    if (memcmp(hdr->magic,"BLOM",4) || hdr->filters == 0) goto invalid;
+
+    off = sizeof(*hdr);
+    for (int j = 0; j < hdr->filters; j++) {
+        bloomfilter *f = (bloomfilter*)((char*)o->ptr+off);
+        uint32_t bits;
+
+        if (len-off < sizeof(*f)) goto invalid;
+        bits = bloomGet32(f->bits);
+        if (bits == 0 || bits % 64 || f->hashes == 0 ||
+            f->hashes > BLOOM_MAX_HASHES) goto invalid;
+        off += sizeof(*f)+bits/8;
+        if (off > len) goto invalid;
+    }
+    if (off != len) goto invalid;
+    return C_OK;
+
+invalid:
+    c->addReplySds(sdsnew(invalid_bloom_err));
+    return C_ERR;
+}
+
+/* Store in 'pos' the bits of the filter of 'bits' bits to test or set for
+ * the element of hash 'hash'. */
+static void bloomPositions(uint64_t hash, uint32_t bits, int hashes,
+                           uint32_t *pos)
+{
+    uint32_t h1 = (uint32_t)hash, h2 = (uint32_t)(hash >> 32) | 1;
+
+    for (int j = 0; j < hashes; j++) {
+        pos[j] = (uint32_t)(((uint64_t)h1 * bits) >> 32);
+        h1 += h2;
+    }
+}
+
+static int bloomAllSetScalar(const uint8_t *bits, const uint32_t *pos, int n) {
+    for (int j = 0; j < n; j++)
+        if (!(bits[pos[j]>>3] & (1 << (pos[j]&7)))) return 0;
+    return 1;
+}
+
+#if defined(__x86_64__) && (defined(__clang__) || __GNUC__ >= 5)
+#define HAVE_BLOOM_AVX2 1
+#include <immintrin.h>
+
+/* Gather the 32 bit words holding 8 bits at a time. The bits are a
+ * multiple of 64, so the words are all inside the filter. */
+__attribute__((target("avx2")))
+static int bloomAllSetAvx2(const uint8_t *bits, const uint32_t *pos, int n) {
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i low = _mm256_set1_epi32(31);
+    int j;
+
+    for (j = 0; j+8 <= n; j += 8) {
+        __m256i p = _mm256_loadu_si256((const __m256i*)(pos+j));
+        __m256i w = _mm256_i32gather_epi32((const int*)bits,
+            _mm256_srli_epi32(p,5),4);
+        __m256i b = _mm256_and_si256(
+            _mm256_srlv_epi32(w,_mm256_and_si256(p,low)),one);
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(b,one)) != -1) return 0;
+    }
+    return bloomAllSetScalar(bits,pos+j,n-j);
+}
+
+static int bloomHaveAvx2(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+/* Return 1 if the 'n' bits at 'pos' are all set. */
+static int bloomAllSet(const uint8_t *bits, const uint32_t *pos, int n) {
+#ifdef HAVE_BLOOM_AVX2
+    static int avx2 = bloomHaveAvx2();
+    if (avx2 && n >= 8) return bloomAllSetAvx2(bits,pos,n);
+#endif
+    return bloomAllSetScalar(bits,pos,n);
+}
+
+static uint64_t bloomHash(robj *ele) {
+    return MurmurHash64A(ele->ptr,sdslen((sds)ele->ptr),BLOOM_SEED);
+}
+
+/* Return 1 if the element of hash 'hash' is in the Bloom filter 'o'. */
+static int bloomExists(robj *o, uint64_t hash) {
+    bloomhdr *hdr = (bloomhdr*)o->ptr;
+    bloomfilter *f = bloomFirstFilter(o);
+    uint32_t pos[BLOOM_MAX_HASHES];
+
+    for (int j = 0; j < hdr->filters; j++, f = bloomNextFilter(f)) {
+        bloomPositions(hash,bloomGet32(f->bits),f->hashes,pos);
+        if (bloomAllSet(bloomFilterBits(f),pos,f->hashes)) return 1;
+    }
+    return 0;
+}
+
+/* Add the element to the Bloom filter 'o', that may grow. Return 1 if it
+ * was added, 0 if it was already in the filter, -1 if the filter is full. */
+static int bloomAdd(robj *o, robj *ele) {
+    uint64_t hash = bloomHash(ele);
+    uint32_t pos[BLOOM_MAX_HASHES];
+    bloomhdr *hdr;
+    bloomfilter *f, *last;
+
+    if (bloomExists(o,hash)) return 0;
+
+    /* Find the last filter, and append another one once it is full. */
+    hdr = (bloomhdr*)o->ptr;
+    last = f = bloomFirstFilter(o);
+    for (int j = 1; j < hdr->filters; j++) last = f = bloomNextFilter(f);
+    if (bloomGet64(last->count) >= bloomGet64(last->capacity)) {
+        size_t off = (char*)last-(char*)o->ptr;
+        if (!bloomAddFilter(o)) return -1;
+        last = bloomNextFilter((bloomfilter*)((char*)o->ptr+off));
+        hdr = (bloomhdr*)o->ptr;
+    }
+
+    uint8_t *bits = bloomFilterBits(last);
+    bloomPositions(hash,bloomGet32(last->bits),last->hashes,pos);
+    for (int j = 0; j < last->hashes; j++)
+        bits[pos[j]>>3] |= 1 << (pos[j]&7);
+    bloomSet64(last->count,bloomGet64(last->count)+1);
+    bloomSet64(hdr->count,bloomGet64(hdr->count)+1);
+    return 1;
+}
+
+/* Set found[j] for the 'n' elements of 'argv' in the Bloom filter 'o'. The
+ * elements are tested against a filter in batches: the bits of the whole
+ * batch are prefetched first, so that the cache misses of a big filter
+ * overlap. */
+static void bloomMultiExists(robj *o, robj **argv, int n, int *found) {
+    bloomhdr *hdr = (bloomhdr*)o->ptr;
+    uint32_t pos[BLOOM_BATCH][BLOOM_MAX_HASHES];
+    uint64_t hashes[BLOOM_BATCH];
+
+    for (int base = 0; base < n; base += BLOOM_BATCH) {
+        int batch = n-base < BLOOM_BATCH ? n-base : BLOOM_BATCH;
+        bloomfilter *f = bloomFirstFilter(o);
+
+        for (int j = 0; j < batch; j++) {
+            hashes[j] = bloomHash(argv[base+j]);
+            found[base+j] = 0;
+        }
+        for (int i = 0; i < hdr->filters; i++, f = bloomNextFilter(f)) {
+            uint8_t *bits = bloomFilterBits(f);
+            uint32_t m = bloomGet32(f->bits);
+
+            for (int j = 0; j < batch; j++) {
+                if (found[base+j]) continue;
+                bloomPositions(hashes[j],m,f->hashes,pos[j]);
+                for (int k = 0; k < f->hashes; k++)
+                    __builtin_prefetch(bits+(pos[j][k]>>3));
+            }
+            for (int j = 0; j < batch; j++) {
+                if (found[base+j]) continue;
+                found[base+j] = bloomAllSet(bits,pos[j],f->hashes);
+            }
+        }
+    }
+}
+
+/* ========================== Bloom filter commands ========================= */
+
+/* Lookup the Bloom filter of BF.ADD and BF.MADD, creating it if needed.
+ * Return NULL if the key holds something else, after replying an error. */
+static robj *bloomLookupWriteOrCreate(client *c, robj *key) {
+    robj *o = lookupKeyWrite(c->m_cur_selected_db,key);
+
+    if (o == NULL) {
+        o = createBloomObject();
+        dbAdd(c->m_cur_selected_db,key,o);
+        return o;
+    }
+    if (isBloomObjectOrReply(c,o) != C_OK) return NULL;
+    return dbUnshareStringValue(c->m_cur_selected_db,key,o);
+}
+
+static void bloomNotifyAdded(client *c, const char *event, int added) {
+    if (!added) return;
+    signalModifiedKey(c->m_cur_selected_db,c->m_argv[1]);
+    notifyKeyspaceEvent(NOTIFY_STRING,(char*)event,c->m_argv[1],
+        c->m_cur_selected_db->m_id);
+    server.dirty += added;
+}
+
+/* BF.ADD key element => :1 if added, :0 if it may already be there. */
+void bfaddCommand(client *c) {
+    robj *o = bloomLookupWriteOrCreate(c,c->m_argv[1]);
+    int retval;
+
+    if (o == NULL) return;
+    retval = bloomAdd(o,c->m_argv[2]);
+    if (retval == -1) {
+        c->addReplySds(sdsnew(full_bloom_err));
+        return;
+    }
+    bloomNotifyAdded(c,"bf.add",retval);
+    c->addReply(retval ? shared.cone : shared.czero);
+}
+
+/* BF.MADD key element [element ...] => array of BF.ADD replies. */
+void bfmaddCommand(client *c) {
+    robj *o = bloomLookupWriteOrCreate(c,c->m_argv[1]);
+    int added = 0;
+
+    if (o == NULL) return;
+    c->addReplyMultiBulkLen(c->m_argc-2);
+    for (int j = 2; j < c->m_argc; j++) {
+        int retval = bloomAdd(o,c->m_argv[j]);
+        if (retval == -1) {
+            c->addReplySds(sdsnew(full_bloom_err));
+            continue;
+        }
+        added += retval;
+        c->addReply(retval ? shared.cone : shared.czero);
+    }
+    bloomNotifyAdded(c,"bf.madd",added);
+}
+
+/* BF.EXISTS key element => :1 if it may be there, :0 if it is not. */
+void bfexistsCommand(client *c) {
+    robj *o = lookupKeyRead(c->m_cur_selected_db,c->m_argv[1]);
+
+    if (o == NULL) {
+        c->addReply(shared.czero);
+        return;
+    }
+    if (isBloomObjectOrReply(c,o) != C_OK) return;
+    c->addReply(bloomExists(o,bloomHash(c->m_argv[2])) ?
+                shared.cone : shared.czero);
+}
+
+/* BF.MEXISTS key element [element ...] => array of BF.EXISTS replies. */
+void bfmexistsCommand(client *c) {
+    robj *o = lookupKeyRead(c->m_cur_selected_db,c->m_argv[1]);
+    int n = c->m_argc-2;
+    int *found;
+
+    if (o != NULL && isBloomObjectOrReply(c,o) != C_OK) return;
+    found = (int*)zcalloc(sizeof(int)*n);
+    if (o) bloomMultiExists(o,c->m_argv+2,n,found);
+    c->addReplyMultiBulkLen(n);
+    for (int j = 0; j < n; j++)
+        c->addReply(found[j] ? shared.cone : shared.czero);
+    zfree(found);
+}
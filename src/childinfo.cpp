@@ -43,6 +43,9 @@ void openChildInfoPipe() {
     } else {
         memset(&server.child_info_data,0,sizeof(server.child_info_data));
     }
+    server.stat_current_cow_bytes = 0;
+    server.stat_current_cow_updated = 0;
+    memset(server.stat_cow_writes,0,sizeof(server.stat_cow_writes));
 }
 
 /* Close the pipes opened with openChildInfoPipe(). */
@@ -69,17 +72,59 @@ void sendChildInfo(int ptype) {
     }
 }
 
-/* Receive COW data from parent. */
+/* Set in the child by childInfoStartReports(). */
+static int child_info_reports = 0;
+static mstime_t child_info_next_report;
+
+/* Called by the child after the fork: sendChildCowInfoIfNeeded() reports
+ * the copy on write so far while the child saves the dataset. */
+void childInfoStartReports() {
+    child_info_reports = 1;
+    child_info_next_report = mstime()+CHILD_INFO_REPORT_PERIOD;
+}
+
+/* Called by the child for every key saved: every CHILD_INFO_REPORT_PERIOD
+ * milliseconds send the COW so far to the parent, so that its growth can
+ * be followed in INFO while the save runs. Measuring the COW reads the
+ * smaps of the process, and the time is only checked every 1024 keys. */
+void sendChildCowInfoIfNeeded() {
+    static unsigned int calls = 0;
+
+    if (!child_info_reports || (++calls & 1023)) return;
+    if (mstime() < child_info_next_report) return;
+    server.child_info_data.cow_size = zmalloc_get_private_dirty(-1);
+    sendChildInfo(CHILD_INFO_TYPE_CURRENT_INFO);
+    child_info_next_report = mstime()+CHILD_INFO_REPORT_PERIOD;
+}
+
+/* Receive COW data from the child: the reports sent during the save, and
+ * the final one once it exited. */
 void receiveChildInfo() {
     if (server.child_info_pipe[0] == -1) return;
     ssize_t wlen = sizeof(server.child_info_data);
-    if (read(server.child_info_pipe[0],&server.child_info_data,wlen) == wlen &&
-        server.child_info_data.magic == CHILD_INFO_MAGIC)
+    while (read(server.child_info_pipe[0],&server.child_info_data,wlen) == wlen &&
+           server.child_info_data.magic == CHILD_INFO_MAGIC)
     {
         if (server.child_info_data.process_type == CHILD_INFO_TYPE_RDB) {
             server.stat_rdb_cow_bytes = server.child_info_data.cow_size;
         } else if (server.child_info_data.process_type == CHILD_INFO_TYPE_AOF) {
             server.stat_aof_cow_bytes = server.child_info_data.cow_size;
+        } else if (server.child_info_data.process_type ==
+                   CHILD_INFO_TYPE_CURRENT_INFO)
+        {
+            server.stat_current_cow_bytes = server.child_info_data.cow_size;
+            server.stat_current_cow_updated = mstime();
         }
     }
 }
+
+/* Called when a key is written while a child saves the dataset: the pages
+ * of the key are copied, if they were not already, so counting the writes
+ * by type tells what drives the copy on write. */
+void childInfoTrackWrite(redisDb *db, robj *key) {
+    dictEntry *de = db->m_dict->dictFind(key->ptr);
+    int type = OBJ_STREAM+1; /* Deleted. */
+
+    if (de) type = ((robj *)de->dictGetVal())->type;
+    server.stat_cow_writes[type]++;
+}
@@ -0,0 +1,200 @@
+/* Chunked encoding of sparse bitmaps, see chunkedbitmap.h.
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "chunkedbitmap.h"
+#include "bitkernel.h"
+#include "zmalloc.h"
+#include <string.h>
+#include <new>
+
+#define CHUNK CHUNKED_BITMAP_CHUNK_BYTES
+
+/* Return non zero if the 'len' bytes of 'p' are all zero. */
+static int bytesAreZero(const unsigned char *p, size_t len) {
+    size_t j = bitkernelSkip(p,len,0);
+
+    while (j < len) if (p[j++]) return 0;
+    return 1;
+}
+
+chunkedBitmap::chunkedBitmap()
+: m_chunks(NULL)
+, m_numchunks(0)
+, m_used(0)
+, m_len(0)
+{
+}
+
+chunkedBitmap::~chunkedBitmap()
+{
+    for (size_t i = 0; i < m_numchunks; i++) zfree(m_chunks[i]);
+    zfree(m_chunks);
+}
+
+chunkedBitmap *chunkedBitmapCreate(void) {
+    void *mem = zmalloc(sizeof(chunkedBitmap));
+    return new (mem) chunkedBitmap;
+}
+
+void chunkedBitmapFree(chunkedBitmap *cb) {
+    cb->~chunkedBitmap();
+    zfree(cb);
+}
+
+/* Make the string at least 'len' bytes, zero padded. */
+void chunkedBitmap::chunkedBitmapGrow(size_t len) {
+    if (len <= m_len) return;
+    size_t numchunks = (len+CHUNK-1)/CHUNK;
+    if (numchunks > m_numchunks) {
+        m_chunks = (unsigned char **)zrealloc(m_chunks,
+            sizeof(unsigned char*)*numchunks);
+        memset(m_chunks+m_numchunks,0,
+               sizeof(unsigned char*)*(numchunks-m_numchunks));
+        m_numchunks = numchunks;
+    }
+    m_len = len;
+}
+
+/* Return chunk 'i', that must be inside the string, allocating it zeroed
+ * if it was missing. */
+unsigned char *chunkedBitmap::chunkedBitmapChunkForWrite(size_t i) {
+    if (m_chunks[i] == NULL) {
+        m_chunks[i] = (unsigned char *)zcalloc(CHUNK);
+        m_used++;
+    }
+    return m_chunks[i];
+}
+
+/* Set chunk 'i', that must be inside the string, to a copy of 'data', or
+ * drop it if 'data' is NULL. */
+void chunkedBitmap::chunkedBitmapSetChunk(size_t i, const unsigned char *data) {
+    if (data == NULL) {
+        if (m_chunks[i]) {
+            zfree(m_chunks[i]);
+            m_chunks[i] = NULL;
+            m_used--;
+        }
+        return;
+    }
+    memcpy(chunkedBitmapChunkForWrite(i),data,CHUNK);
+}
+
+unsigned char chunkedBitmap::chunkedBitmapGetByte(size_t byte) const {
+    const unsigned char *chunk = chunkedBitmapChunk(byte/CHUNK);
+    return chunk ? chunk[byte%CHUNK] : 0;
+}
+
+/* Copy 'len' bytes starting at 'offset' into 'buf'. The bytes after the
+ * end of the string are read as zero. */
+void chunkedBitmap::chunkedBitmapRead(size_t offset, unsigned char *buf,
+                                      size_t len) const
+{
+    while (len) {
+        size_t i = offset/CHUNK, off = offset%CHUNK;
+        size_t n = CHUNK-off < len ? CHUNK-off : len;
+        const unsigned char *chunk = chunkedBitmapChunk(i);
+
+        if (chunk) memcpy(buf,chunk+off,n);
+        else memset(buf,0,n);
+        buf += n;
+        offset += n;
+        len -= n;
+    }
+}
+
+/* Write 'len' bytes starting at 'offset', growing the string if needed. */
+void chunkedBitmap::chunkedBitmapWrite(size_t offset, const unsigned char *buf,
+                                       size_t len)
+{
+    chunkedBitmapGrow(offset+len);
+    while (len) {
+        size_t i = offset/CHUNK, off = offset%CHUNK;
+        size_t n = CHUNK-off < len ? CHUNK-off : len;
+
+        memcpy(chunkedBitmapChunkForWrite(i)+off,buf,n);
+        buf += n;
+        offset += n;
+        len -= n;
+    }
+}
+
+/* Count the bits set in the 'count' bytes starting at 'start', that must be
+ * inside the string. */
+size_t chunkedBitmap::chunkedBitmapPopcount(size_t start, size_t count) const {
+    size_t bits = 0, end = start+count;
+
+    while (start < end) {
+        size_t i = start/CHUNK, off = start%CHUNK;
+        size_t n = CHUNK-off < end-start ? CHUNK-off : end-start;
+
+        if (m_chunks[i]) bits += bitkernelPopcount(m_chunks[i]+off,n);
+        start += n;
+    }
+    return bits;
+}
+
+chunkedBitmap *chunkedBitmap::chunkedBitmapDup(const chunkedBitmap *cb) {
+    chunkedBitmap *dup = chunkedBitmapCreate();
+
+    dup->chunkedBitmapGrow(cb->m_len);
+    for (size_t i = 0; i < cb->m_numchunks; i++)
+        if (cb->m_chunks[i]) dup->chunkedBitmapSetChunk(i,cb->m_chunks[i]);
+    return dup;
+}
+
+/* Create a chunked bitmap with the content of the 'len' bytes of 's',
+ * allocating only the chunks with some bit set. */
+chunkedBitmap *chunkedBitmap::chunkedBitmapFromBuffer(const unsigned char *s,
+                                                      size_t len)
+{
+    chunkedBitmap *cb = chunkedBitmapCreate();
+
+    cb->chunkedBitmapGrow(len);
+    for (size_t i = 0; i*CHUNK < len; i++) {
+        size_t n = len-i*CHUNK < CHUNK ? len-i*CHUNK : CHUNK;
+        if (bytesAreZero(s+i*CHUNK,n)) continue;
+        memcpy(cb->chunkedBitmapChunkForWrite(i),s+i*CHUNK,n);
+    }
+    return cb;
+}
+
+/* Return the number of chunks of the 'len' bytes of 's' with some bit set,
+ * that is, the chunks that chunkedBitmapFromBuffer() would allocate. */
+size_t chunkedBitmap::chunkedBitmapCountChunks(const unsigned char *s,
+                                               size_t len)
+{
+    size_t used = 0;
+
+    for (size_t i = 0; i*CHUNK < len; i++) {
+        size_t n = len-i*CHUNK < CHUNK ? len-i*CHUNK : CHUNK;
+        if (!bytesAreZero(s+i*CHUNK,n)) used++;
+    }
+    return used;
+}
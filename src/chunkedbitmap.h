@@ -0,0 +1,61 @@
+/* Chunked encoding of big and sparse strings used as bitmaps.
+ *
+ * The string is split in chunks of CHUNKED_BITMAP_CHUNK_BYTES bytes, and
+ * only the chunks where some bit was ever set are allocated: the others
+ * are implicitly zero. A directory with a pointer per chunk, NULL for the
+ * missing ones, makes the access to any byte O(1). A bitmap of 2^32 bits
+ * used by a few dense ranges of user IDs takes the directory, 4MB, plus the
+ * chunks of those ranges, instead of 512MB.
+ *
+ * The bytes of the last chunk after the length of the string are always
+ * zero, so that the chunks can be counted and combined as a whole. */
+
+#ifndef __CHUNKEDBITMAP_H
+#define __CHUNKEDBITMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CHUNKED_BITMAP_CHUNK_BYTES 1024
+
+class chunkedBitmap
+{
+public:
+    chunkedBitmap();
+    ~chunkedBitmap();
+
+    void chunkedBitmapGrow(size_t len);
+    unsigned char *chunkedBitmapChunkForWrite(size_t i);
+    void chunkedBitmapSetChunk(size_t i, const unsigned char *data);
+    unsigned char chunkedBitmapGetByte(size_t byte) const;
+    void chunkedBitmapRead(size_t offset, unsigned char *buf, size_t len) const;
+    void chunkedBitmapWrite(size_t offset, const unsigned char *buf, size_t len);
+    size_t chunkedBitmapPopcount(size_t start, size_t count) const;
+
+    static chunkedBitmap *chunkedBitmapDup(const chunkedBitmap *cb);
+    static chunkedBitmap *chunkedBitmapFromBuffer(const unsigned char *s, size_t len);
+    static size_t chunkedBitmapCountChunks(const unsigned char *s, size_t len);
+
+    /* Chunk 'i', or NULL if all its bytes are zero. */
+    inline const unsigned char *chunkedBitmapChunk(size_t i) const {
+        return i < m_numchunks ? m_chunks[i] : NULL;
+    }
+    inline size_t chunkedBitmapLen() const {return m_len;}
+    inline size_t chunkedBitmapNumChunks() const {return m_numchunks;}
+    inline size_t chunkedBitmapUsedChunks() const {return m_used;}
+    inline size_t allocSize() const {
+        return sizeof(unsigned char*)*m_numchunks +
+               CHUNKED_BITMAP_CHUNK_BYTES*m_used;
+    }
+
+private:
+    unsigned char **m_chunks;   /* Directory, NULL for zero chunks. */
+    size_t m_numchunks;         /* Chunks needed for m_len bytes. */
+    size_t m_used;              /* Chunks allocated. */
+    size_t m_len;               /* Length of the string in bytes. */
+};
+
+chunkedBitmap *chunkedBitmapCreate(void);
+void chunkedBitmapFree(chunkedBitmap *cb);
+
+#endif
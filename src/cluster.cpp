@@ -31,6 +31,8 @@
 #include "server.h"
 #include "cluster.h"
 #include "endianconv.h"
+#include "lazyload.h"
+#include "bio.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -51,6 +53,7 @@ clusterNode *createClusterNode(char *nodename, int flags);
 int clusterAddNode(clusterNode *node); //!
 void clusterAcceptHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void clusterReadHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+void clusterWriteHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void clusterSendPing(clusterLink *link, int type); //!
 void clusterSendFail(char *nodename);
 void clusterSendFailoverAuthIfNeeded(clusterNode *node, clusterMsg *request); //!
@@ -62,10 +65,13 @@ void clusterSetMaster(clusterNode *n); //!
 void clusterHandleSlaveFailover();
 void clusterHandleSlaveMigration(int max_slaves);
 int bitmapTestBit(unsigned char *bitmap, int pos);
+void bitmapSetBit(unsigned char *bitmap, int pos);
 void clusterDoBeforeSleep(int flags);
 void clusterSendUpdate(clusterLink *link, clusterNode *node);
 void resetManualFailover();
 void clusterCloseAllSlots();
+void clusterUpdateOpenSlots();
+void clusterInvalidateSlotsReply();
 void clusterDelNode(clusterNode *delnode);
 sds representClusterNodeFlags(sds ci, uint16_t flags);
 uint64_t clusterGetMaxEpoch();
@@ -267,6 +273,7 @@ int clusterLoadConfig(char *filename) {
     }
     /* Config sanity check */
     if (server.cluster->m_myself == NULL) goto fmterr;
+    clusterUpdateOpenSlots();
 
     zfree(line);
     fclose(fp);
@@ -291,8 +298,34 @@ fmterr:
 
 /* Cluster node configuration is exactly the same as CLUSTER NODES output.
  *
- * This function writes the node config and returns 0, on error -1
- * is returned.
+ * The config is saved in the background by a BIO_CLUSTER_CONFIG job, so
+ * that a failover touching many nodes doesn't add write and fsync to the
+ * critical path of the event loop. The main thread generates the payload,
+ * and the job writes the latest one: the saves requested while a job is
+ * pending just replace its payload. The mutex is held for the duration of
+ * the write, so that a synchronous save is never overwritten by an older
+ * background one. */
+static pthread_mutex_t cluster_config_mutex = PTHREAD_MUTEX_INITIALIZER;
+static sds cluster_config_pending = NULL;   /* Payload not yet written. */
+static int cluster_config_pending_fsync = 0;
+static int cluster_config_failed = 0;       /* A background save failed. */
+
+/* The epochs of the last synchronous save with fsync. */
+static uint64_t cluster_config_saved_current_epoch = 0;
+static uint64_t cluster_config_saved_vote_epoch = 0;
+static uint64_t cluster_config_saved_config_epoch = 0;
+
+/* Generate the payload of the config file: the nodes description and our
+ * "vars" directive to save currentEpoch and lastVoteEpoch. */
+static sds clusterGenConfig() {
+    sds ci = clusterGenNodesDescription(CLUSTER_NODE_HANDSHAKE);
+    return sdscatprintf(ci,"vars currentEpoch %llu lastVoteEpoch %llu\n",
+        (unsigned long long) server.cluster->m_currentEpoch,
+        (unsigned long long) server.cluster->m_lastVoteEpoch);
+}
+
+/* Write the payload 'ci' to the config file, freeing it. Returns 0 on
+ * success, -1 on error.
  *
  * Note: we need to write the file in an atomic way from the point of view
  * of the POSIX filesystem semantics, so that if the server is stopped
@@ -300,23 +333,13 @@ fmterr:
  * new one. Since we have the full payload to write available we can use
  * a single write to write the whole file. If the pre-existing file was
  * bigger we pad our payload with newlines that are anyway ignored and truncate
- * the file afterward. */
-int clusterSaveConfig(int do_fsync) {
-    sds ci;
-    size_t content_size;
+ * the file afterward. The file is never renamed, since it is locked with
+ * flock(), see clusterLockConfig(). */
+static int clusterWriteConfig(sds ci, int do_fsync) {
+    size_t content_size = sdslen(ci);
     struct stat sb;
     int fd;
 
-    server.cluster->m_todo_before_sleep &= ~CLUSTER_TODO_SAVE_CONFIG;
-
-    /* Get the nodes description and concatenate our "vars" directive to
-     * save currentEpoch and lastVoteEpoch. */
-    ci = clusterGenNodesDescription(CLUSTER_NODE_HANDSHAKE);
-    ci = sdscatprintf(ci,"vars currentEpoch %llu lastVoteEpoch %llu\n",
-        (unsigned long long) server.cluster->m_currentEpoch,
-        (unsigned long long) server.cluster->m_lastVoteEpoch);
-    content_size = sdslen(ci);
-
     if ((fd = open(server.cluster_configfile,O_WRONLY|O_CREAT,0644))
         == -1) goto err;
 
@@ -328,10 +351,7 @@ int clusterSaveConfig(int do_fsync) {
         }
     }
     if (write(fd,ci,sdslen(ci)) != (ssize_t)sdslen(ci)) goto err;
-    if (do_fsync) {
-        server.cluster->m_todo_before_sleep &= ~CLUSTER_TODO_FSYNC_CONFIG;
-        fsync(fd);
-    }
+    if (do_fsync) fsync(fd);
 
     /* Truncate the file if needed to remove the final \n padding that
      * is just garbage. */
@@ -348,6 +368,31 @@ err:
     return -1;
 }
 
+/* Save the config synchronously, and returns 0 on success, -1 on error.
+ * A pending background save is dropped, being older. */
+int clusterSaveConfig(int do_fsync) {
+    sds ci;
+    int retval;
+
+    server.cluster->m_todo_before_sleep &= ~CLUSTER_TODO_SAVE_CONFIG;
+    if (do_fsync)
+        server.cluster->m_todo_before_sleep &= ~CLUSTER_TODO_FSYNC_CONFIG;
+
+    ci = clusterGenConfig();
+    pthread_mutex_lock(&cluster_config_mutex);
+    sdsfree(cluster_config_pending);
+    cluster_config_pending = NULL;
+    retval = clusterWriteConfig(ci,do_fsync);
+    pthread_mutex_unlock(&cluster_config_mutex);
+
+    if (retval == 0 && do_fsync) {
+        cluster_config_saved_current_epoch = server.cluster->m_currentEpoch;
+        cluster_config_saved_vote_epoch = server.cluster->m_lastVoteEpoch;
+        cluster_config_saved_config_epoch = myself->m_configEpoch;
+    }
+    return retval;
+}
+
 void clusterSaveConfigOrDie(int do_fsync) {
     if (clusterSaveConfig(do_fsync) == -1) {
         serverLog(LL_WARNING,"Fatal: can't update cluster config file.");
@@ -355,6 +400,47 @@ void clusterSaveConfigOrDie(int do_fsync) {
     }
 }
 
+/* Queue the save of the config to a BIO_CLUSTER_CONFIG job, or replace the
+ * payload of the job already queued. */
+void clusterSaveConfigAsync(int do_fsync) {
+    sds ci = clusterGenConfig();
+    int queue_job;
+
+    server.cluster->m_todo_before_sleep &=
+        ~(CLUSTER_TODO_SAVE_CONFIG|CLUSTER_TODO_FSYNC_CONFIG);
+
+    pthread_mutex_lock(&cluster_config_mutex);
+    queue_job = cluster_config_pending == NULL;
+    if (queue_job) cluster_config_pending_fsync = 0;
+    sdsfree(cluster_config_pending);
+    cluster_config_pending = ci;
+    cluster_config_pending_fsync |= do_fsync;
+    pthread_mutex_unlock(&cluster_config_mutex);
+
+    if (queue_job) bioCreateBackgroundJob(BIO_CLUSTER_CONFIG,NULL,NULL,NULL);
+}
+
+/* Called by the BIO_CLUSTER_CONFIG thread to write the pending payload. */
+void clusterSaveConfigJob() {
+    pthread_mutex_lock(&cluster_config_mutex);
+    if (cluster_config_pending) {
+        sds ci = cluster_config_pending;
+
+        cluster_config_pending = NULL;
+        if (clusterWriteConfig(ci,cluster_config_pending_fsync) == -1)
+            cluster_config_failed = 1;
+    }
+    pthread_mutex_unlock(&cluster_config_mutex);
+}
+
+/* Return true if the epochs, that must be persisted before we vote or
+ * advertise them, changed since the last synchronous save. */
+static int clusterEpochsChangedSinceSave() {
+    return server.cluster->m_currentEpoch != cluster_config_saved_current_epoch ||
+           server.cluster->m_lastVoteEpoch != cluster_config_saved_vote_epoch ||
+           myself->m_configEpoch != cluster_config_saved_config_epoch;
+}
+
 /* Lock the cluster config using flock(), and leaks the file descriptor used to
  * acquire the lock so that the file will be locked forever.
  *
@@ -424,7 +510,9 @@ void clusterInit() {
         server.cluster->m_stats_bus_messages_sent[i] = 0;
         server.cluster->m_stats_bus_messages_received[i] = 0;
     }
+    server.cluster->m_stats_bus_compact_sent = 0;
     server.cluster->m_stats_pfail_nodes = 0;
+    server.cluster->m_slots_reply = NULL;
     memset(server.cluster->m_slots,0, sizeof(server.cluster->m_slots));
     clusterCloseAllSlots();
 
@@ -462,7 +550,7 @@ void clusterInit() {
     }
 
     if (listenToPort(server.port+CLUSTER_PORT_INCR,
-        server.cfd,&server.cfd_count) == C_ERR)
+        server.cfd,&server.cfd_count,0) == C_ERR)
     {
         exit(1);
     } else {
@@ -476,11 +564,6 @@ void clusterInit() {
         }
     }
 
-    /* The slots -> keys map is a radix tree. Initialize it here. */
-    server.cluster->m_slots_to_keys = raxNew();
-    memset(server.cluster->m_slots_keys_count,0,
-           sizeof(server.cluster->m_slots_keys_count));
-
     /* Set myself->m_port / cport to my listening ports, we'll just need to
      * discover the IP address via MEET messages. */
     myself->m_port = server.port;
@@ -575,6 +658,15 @@ clusterLink::clusterLink(clusterNode *in_node, int in_fd)
 , m_rcvbuf(sdsempty())
 , m_node(in_node)
 , m_fd(in_fd)
+, m_compact(0)
+, m_slots_sent(NULL)
+, m_slots_rcvd(NULL)
+, m_gossip_ids(NULL)
+, m_gossip_sent(NULL)
+, m_gossip_rcvd(NULL)
+, m_gossip_sent_count(0)
+, m_gossip_rcvd_count(0)
+, m_tls(NULL)
 {
 
 }
@@ -594,18 +686,51 @@ void freeClusterLink(clusterLink*& link)
 
 clusterLink::~clusterLink()
 {
+    if (m_tls) tlsCancelHandshake(m_tls);
     if (m_fd != -1) {
         server.el->aeDeleteFileEvent(m_fd, AE_WRITABLE);
         server.el->aeDeleteFileEvent(m_fd, AE_READABLE);
     }
     sdsfree(m_sndbuf);
     sdsfree(m_rcvbuf);
+    zfree(m_slots_sent);
+    zfree(m_slots_rcvd);
+    if (m_gossip_ids) raxFree(m_gossip_ids);
+    zfree(m_gossip_sent);
+    zfree(m_gossip_rcvd);
     if (m_node)
         m_node->m_link = NULL;
     close(m_fd);
 
 }
 
+/* The TLS handshake of a link is done, start serving it, sending what was
+ * queued in the meantime. */
+static void clusterTLSHandshakeDone(int fd, int ok, void *privdata) {
+    clusterLink *link = (clusterLink*) privdata;
+
+    link->m_tls = NULL;
+    if (!ok) {
+        freeClusterLink(link);
+        return;
+    }
+    server.el->aeCreateFileEvent(fd,AE_READABLE,clusterReadHandler,link);
+    if (sdslen(link->m_sndbuf))
+        server.el->aeCreateFileEvent(fd,AE_WRITABLE,clusterWriteHandler,link);
+}
+
+/* Install the handlers of a new link, or with tls-cluster start its TLS
+ * handshake. On error C_ERR is returned and the link should be freed. */
+static int clusterLinkStart(clusterLink *link, int role) {
+    if (server.tls_cluster) {
+        link->m_tls = tlsStartHandshake(link->m_fd,role,
+            clusterTLSHandshakeDone,link);
+        return link->m_tls ? C_OK : C_ERR;
+    }
+    server.el->aeCreateFileEvent(link->m_fd,AE_READABLE,clusterReadHandler,link);
+    return C_OK;
+}
+
 #define MAX_CLUSTER_ACCEPTS_PER_CALL 1000
 void clusterAcceptHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
     int cport, cfd;
@@ -639,7 +764,7 @@ void clusterAcceptHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
          * which node is, but the right node is references once we know the
          * node identity. */
         link = createClusterLink(NULL, cfd);
-        server.el->aeCreateFileEvent(cfd,AE_READABLE,clusterReadHandler,link);
+        if (clusterLinkStart(link,TLS_ACCEPT) == C_ERR) freeClusterLink(link);
     }
 }
 
@@ -654,24 +779,25 @@ void clusterAcceptHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
  * { and } is hashed. This may be useful in the future to force certain
  * keys to be in the same node (assuming no resharding is in progress). */
 unsigned int keyHashSlot(char *key, int keylen) {
-    int s, e; /* start-end indexes of { and } */
+    int s; /* index of { */
+    char *e; /* position of } */
 
-    for (s = 0; s < keylen; s++)
-        if (key[s] == '{') break;
+    /* Look for '{' and hash the key up to it in the same pass. */
+    uint16_t crc = crc16UntilByte(key,keylen,'{',&s);
 
-    /* No '{' ? Hash the whole key. This is the base case. */
-    if (s == keylen) return crc16(key,keylen) & 0x3FFF;
+    /* No '{' ? The whole key was hashed. This is the base case. */
+    if (s == keylen) return crc & 0x3FFF;
 
     /* '{' found? Check if we have the corresponding '}'. */
-    for (e = s+1; e < keylen; e++)
-        if (key[e] == '}') break;
+    e = (char*)memchr(key+s+1,'}',keylen-s-1);
 
-    /* No '}' or nothing betweeen {} ? Hash the whole key. */
-    if (e == keylen || e == s+1) return crc16(key,keylen) & 0x3FFF;
+    /* No '}' or nothing betweeen {} ? Hash the rest of the key too. */
+    if (e == NULL || e == key+s+1)
+        return crc16Continue(crc,key+s,keylen-s) & 0x3FFF;
 
     /* If we are here there is both a { and a } on its right. Hash
      * what is in the middle between { and }. */
-    return crc16(key+s+1,e-s-1) & 0x3FFF;
+    return crc16(key+s+1,e-key-s-1) & 0x3FFF;
 }
 
 /* -----------------------------------------------------------------------------
@@ -718,6 +844,7 @@ clusterNode::clusterNode(char *nodename, int flags)
     m_repl_offset_time = 0;
     m_repl_offset = 0;
     m_fail_reports->listSetFreeMethod(zfree);
+    m_slots_info = NULL;
 }
 
 /* This function is called every time we get a failure report from a node.
@@ -825,6 +952,7 @@ int clusterNodeRemoveSlave(clusterNode *master, clusterNode *slave) {
             master->m_numslaves--;
             if (master->m_numslaves == 0)
                 master->m_flags &= ~CLUSTER_NODE_MIGRATE_TO;
+            clusterInvalidateSlotsReply();
             return C_OK;
         }
     }
@@ -843,6 +971,7 @@ int clusterNode::clusterNodeAddSlave(clusterNode *slave)
     m_slaves[m_numslaves] = slave;
     m_numslaves++;
     m_flags |= CLUSTER_NODE_MIGRATE_TO;
+    clusterInvalidateSlotsReply();
     return C_OK;
 }
 
@@ -875,8 +1004,10 @@ void freeClusterNode(clusterNode *n) {
     /* Release link and associated data structures. */
     freeClusterLink(n->m_link);
     listRelease(n->m_fail_reports);
+    sdsfree(n->m_slots_info);
     zfree(n->m_slaves);
     zfree(n);
+    clusterInvalidateSlotsReply();
 }
 
 /* Add a node to the nodes hash table */
@@ -884,6 +1015,7 @@ int clusterAddNode(clusterNode *node) {
     int retval;
 
     retval = server.cluster->m_nodes->dictAdd(sdsnewlen(node->m_name,CLUSTER_NAMELEN), node);
+    clusterInvalidateSlotsReply();
     return (retval == DICT_OK) ? C_OK : C_ERR;
 }
 
@@ -911,6 +1043,7 @@ void clusterDelNode(clusterNode *delnode) {
         if (server.cluster->m_slots[j] == delnode)
             clusterDelSlot(j);
     }
+    clusterUpdateOpenSlots();
     
     /* 2) Remove failure reports. */
     {
@@ -1407,6 +1540,7 @@ void clusterProcessGossipSection(clusterMsg *hdr, clusterLink *link) {
                 node->m_port = ntohs(g->m_port);
                 node->m_cport = ntohs(g->m_cport);
                 node->m_flags &= ~CLUSTER_NODE_NOADDR;
+                clusterInvalidateSlotsReply();
             }
         } else {
             /* If it's not in NOADDR state and we don't have it, we
@@ -1475,6 +1609,7 @@ int nodeUpdateAddressIfNeeded(clusterNode *node, clusterLink *link,
     memcpy(node->m_ip,ip,sizeof(ip));
     node->m_port = port;
     node->m_cport = cport;
+    clusterInvalidateSlotsReply();
     freeClusterLink(node->m_link);
     node->m_flags &= ~CLUSTER_NODE_NOADDR;
     serverLog(LL_WARNING,"Address updated for node %.40s, now %s:%d",
@@ -1640,6 +1775,10 @@ int clusterProcessPacket(clusterLink *link) {
     uint64_t senderCurrentEpoch = 0, senderConfigEpoch = 0;
     clusterNode *sender;
 
+    /* Reply with compact messages only if the peer accepts them. */
+    link->m_compact = server.cluster_bus_compact &&
+                      (hdr->m_mflags[0] & CLUSTERMSG_FLAG0_COMPACT);
+
     if (type == CLUSTERMSG_TYPE_PING || type == CLUSTERMSG_TYPE_PONG ||
         type == CLUSTERMSG_TYPE_MEET)
     {
@@ -1654,7 +1793,8 @@ int clusterProcessPacket(clusterLink *link) {
 
         explen += sizeof(clusterMsgDataFail);
         if (totlen != explen) return 1;
-    } else if (type == CLUSTERMSG_TYPE_PUBLISH) {
+    } else if (type == CLUSTERMSG_TYPE_PUBLISH ||
+               type == CLUSTERMSG_TYPE_PUBLISHSHARD) {
         uint32_t explen = sizeof(clusterMsg)-sizeof(union clusterMsgData);
 
         explen += sizeof(clusterMsgDataPublish) -
@@ -1986,14 +2126,17 @@ int clusterProcessPacket(clusterLink *link) {
                 "Ignoring FAIL message from unknown node %.40s about %.40s",
                 hdr->m_sender, hdr->m_data.fail.about.nodename);
         }
-    } else if (type == CLUSTERMSG_TYPE_PUBLISH) {
+    } else if (type == CLUSTERMSG_TYPE_PUBLISH ||
+               type == CLUSTERMSG_TYPE_PUBLISHSHARD) {
         robj *channel, *message;
         uint32_t channel_len, message_len;
+        int shard = type == CLUSTERMSG_TYPE_PUBLISHSHARD;
 
         /* Don't bother creating useless objects if there are no
          * Pub/Sub subscribers. */
-        if (server.pubsub_channels->dictSize() ||
-           server.pubsub_patterns->listLength())
+        if ((shard && server.pubsubshard_channels->dictSize()) ||
+            (!shard && (server.pubsub_channels->dictSize() ||
+                        server.pubsub_patterns->listLength())))
         {
             channel_len = ntohl(hdr->m_data.publish.msg.channel_len);
             message_len = ntohl(hdr->m_data.publish.msg.message_len);
@@ -2002,7 +2145,10 @@ int clusterProcessPacket(clusterLink *link) {
             message = createStringObject(
                         (char*)hdr->m_data.publish.msg.bulk_data+channel_len,
                         message_len);
-            pubsubPublishMessage(channel,message);
+            if (shard)
+                pubsubPublishShardMessage(channel,message);
+            else
+                pubsubPublishMessage(channel,message);
             decrRefCount(channel);
             decrRefCount(message);
         }
@@ -2072,6 +2218,281 @@ void handleLinkIOError(clusterLink *link) {
     freeClusterLink(link);
 }
 
+/* -----------------------------------------------------------------------------
+ * Compact encoding of the cluster bus messages
+ * -------------------------------------------------------------------------- */
+
+/* Every message carries the 2k slots bitmap of the sender and PING, PONG and
+ * MEET a full 104 bytes entry for every gossiped node: in big clusters most of
+ * the bus traffic is the same information sent again and again.
+ *
+ * The nodes setting CLUSTERMSG_FLAG0_COMPACT accept compact messages, that
+ * use the signature "RCmc". They are only sent on a link where the peer set
+ * the flag, and are decoded back to the normal format as soon as received,
+ * so clusterProcessPacket() only sees normal messages. A compact message is
+ * the header without the slots bitmap and the reserved bytes, followed by:
+ *
+ * - The slots: 0xffff if they are the same of the last compact message sent
+ *   on the link, 0xfffe followed by the bitmap, or the number of ranges
+ *   followed by the first and last slot of every range of assigned slots.
+ * - For PING, PONG and MEET, the gossip entries. Every node gets an index the
+ *   first time it is gossiped on the link, and an entry is the index, a mask
+ *   of the fields changed since the last time the node was gossiped on the
+ *   link, and those fields: the node name is only sent with a new index.
+ * - The data of the other messages, unmodified.
+ *
+ * The state of the indexes and of the last slots is per link and per
+ * direction: TCP keeps the two ends in sync, and a new link starts over. */
+#define CLUSTER_COMPACT_SAME_SLOTS 0xffff
+#define CLUSTER_COMPACT_RAW_SLOTS 0xfffe
+#define CLUSTER_COMPACT_MAX_IDS 0xffff
+
+#define CLUSTER_GOSSIP_NAME (1<<0)
+#define CLUSTER_GOSSIP_PING (1<<1)
+#define CLUSTER_GOSSIP_PONG (1<<2)
+#define CLUSTER_GOSSIP_ADDR (1<<3)
+#define CLUSTER_GOSSIP_FLAGS (1<<4)
+#define CLUSTER_GOSSIP_ALL 0x1f
+
+/* Header bytes copied as they are: the fields before the slots, the ones
+ * between the slots and the reserved bytes, and the ones after them. */
+#define CLUSTER_COMPACT_HDR1_OFF 8
+#define CLUSTER_COMPACT_HDR1_LEN (offsetof(clusterMsg,m_myslots)-8)
+#define CLUSTER_COMPACT_HDR2_OFF offsetof(clusterMsg,m_slaveof)
+#define CLUSTER_COMPACT_HDR2_LEN (offsetof(clusterMsg,m_notused1)-offsetof(clusterMsg,m_slaveof))
+#define CLUSTER_COMPACT_HDR3_OFF offsetof(clusterMsg,m_cport)
+#define CLUSTER_COMPACT_HDR3_LEN (CLUSTERMSG_MIN_LEN-offsetof(clusterMsg,m_cport))
+#define CLUSTER_COMPACT_HDR_LEN (8+CLUSTER_COMPACT_HDR1_LEN+CLUSTER_COMPACT_HDR2_LEN+CLUSTER_COMPACT_HDR3_LEN)
+#define CLUSTER_COMPACT_MIN_LEN (CLUSTER_COMPACT_HDR_LEN+2)
+
+#define CLUSTER_GOSSIP_ADDR_LEN (NET_IP_STR_LEN+4) /* ip, port and cport. */
+
+/* Append to 'm' the slots section of the message with the slots 'slots'. */
+static sds clusterCompactSlots(clusterLink *link, sds m, unsigned char *slots) {
+    uint16_t ranges[CLUSTER_SLOTS];
+    uint16_t marker;
+    int j, n = 0;
+
+    if (link->m_slots_sent &&
+        memcmp(link->m_slots_sent,slots,CLUSTER_SLOTS/8) == 0)
+    {
+        marker = htons(CLUSTER_COMPACT_SAME_SLOTS);
+        return sdscatlen(m,&marker,sizeof(marker));
+    }
+    if (link->m_slots_sent == NULL)
+        link->m_slots_sent = (unsigned char *)zmalloc(CLUSTER_SLOTS/8);
+    memcpy(link->m_slots_sent,slots,CLUSTER_SLOTS/8);
+
+    for (j = 0; j < CLUSTER_SLOTS; j++) {
+        if (!bitmapTestBit(slots,j)) continue;
+        ranges[n++] = htons(j);
+        while (j+1 < CLUSTER_SLOTS && bitmapTestBit(slots,j+1)) j++;
+        ranges[n++] = htons(j);
+    }
+    /* Very fragmented slots are smaller as a bitmap. */
+    if (n*sizeof(uint16_t) >= CLUSTER_SLOTS/8) {
+        marker = htons(CLUSTER_COMPACT_RAW_SLOTS);
+        m = sdscatlen(m,&marker,sizeof(marker));
+        return sdscatlen(m,slots,CLUSTER_SLOTS/8);
+    }
+    marker = htons(n/2);
+    m = sdscatlen(m,&marker,sizeof(marker));
+    return sdscatlen(m,ranges,n*sizeof(uint16_t));
+}
+
+/* Append to 'm' the compact form of the gossip entry 'g'. */
+static sds clusterCompactGossip(clusterLink *link, sds m, clusterMsgDataGossip *g) {
+    void *id = raxFind(link->m_gossip_ids,(unsigned char*)g->m_nodename,
+                       CLUSTER_NAMELEN);
+    clusterMsgDataGossip *last;
+    unsigned char mask = 0;
+    uint16_t idx;
+
+    if (id == raxNotFound) {
+        idx = link->m_gossip_sent_count++;
+        raxInsert(link->m_gossip_ids,(unsigned char*)g->m_nodename,
+                  CLUSTER_NAMELEN,(void*)(uintptr_t)idx,NULL);
+        link->m_gossip_sent = (clusterMsgDataGossip *)zrealloc(
+            link->m_gossip_sent,sizeof(*g)*link->m_gossip_sent_count);
+        mask = CLUSTER_GOSSIP_ALL;
+    } else {
+        idx = (uint16_t)(uintptr_t)id;
+        last = link->m_gossip_sent+idx;
+        if (last->m_ping_sent != g->m_ping_sent) mask |= CLUSTER_GOSSIP_PING;
+        if (last->m_pong_received != g->m_pong_received)
+            mask |= CLUSTER_GOSSIP_PONG;
+        if (memcmp(last->m_ip,g->m_ip,CLUSTER_GOSSIP_ADDR_LEN) != 0)
+            mask |= CLUSTER_GOSSIP_ADDR;
+        if (last->m_flags != g->m_flags) mask |= CLUSTER_GOSSIP_FLAGS;
+    }
+    link->m_gossip_sent[idx] = *g;
+
+    uint16_t nidx = htons(idx);
+    m = sdscatlen(m,&nidx,sizeof(nidx));
+    m = sdscatlen(m,&mask,1);
+    if (mask & CLUSTER_GOSSIP_NAME)
+        m = sdscatlen(m,g->m_nodename,CLUSTER_NAMELEN);
+    if (mask & CLUSTER_GOSSIP_PING)
+        m = sdscatlen(m,&g->m_ping_sent,sizeof(g->m_ping_sent));
+    if (mask & CLUSTER_GOSSIP_PONG)
+        m = sdscatlen(m,&g->m_pong_received,sizeof(g->m_pong_received));
+    if (mask & CLUSTER_GOSSIP_ADDR)
+        m = sdscatlen(m,g->m_ip,CLUSTER_GOSSIP_ADDR_LEN);
+    if (mask & CLUSTER_GOSSIP_FLAGS)
+        m = sdscatlen(m,&g->m_flags,sizeof(g->m_flags));
+    return m;
+}
+
+/* Return the compact form of the message 'hdr' of 'msglen' bytes to send
+ * on 'link', or NULL if it must be sent as it is. */
+static sds clusterCompactMessage(clusterLink *link, clusterMsg *hdr, size_t msglen) {
+    uint16_t type = ntohs(hdr->m_type);
+    uint16_t count = ntohs(hdr->m_count);
+    int ping = type == CLUSTERMSG_TYPE_PING || type == CLUSTERMSG_TYPE_PONG ||
+               type == CLUSTERMSG_TYPE_MEET;
+    uint32_t totlen;
+
+    if (ping && link->m_gossip_sent_count+count > CLUSTER_COMPACT_MAX_IDS)
+        return NULL;
+
+    sds m = sdsnewlen("RCmc\0\0\0\0",8);
+    m = sdscatlen(m,(char*)hdr+CLUSTER_COMPACT_HDR1_OFF,CLUSTER_COMPACT_HDR1_LEN);
+    m = sdscatlen(m,(char*)hdr+CLUSTER_COMPACT_HDR2_OFF,CLUSTER_COMPACT_HDR2_LEN);
+    m = sdscatlen(m,(char*)hdr+CLUSTER_COMPACT_HDR3_OFF,CLUSTER_COMPACT_HDR3_LEN);
+    m = clusterCompactSlots(link,m,hdr->m_myslots);
+    if (ping) {
+        if (link->m_gossip_ids == NULL) link->m_gossip_ids = raxNew();
+        for (int j = 0; j < count; j++)
+            m = clusterCompactGossip(link,m,hdr->m_data.ping.gossip+j);
+    } else {
+        m = sdscatlen(m,(char*)hdr+CLUSTERMSG_MIN_LEN,msglen-CLUSTERMSG_MIN_LEN);
+    }
+    totlen = htonl(sdslen(m));
+    memcpy(m+4,&totlen,sizeof(totlen));
+    return m;
+}
+
+/* Decode the compact message in the receive buffer of 'link' to a normal
+ * message. Return NULL if the message is not valid. */
+static sds clusterExpandCompactMessage(clusterLink *link) {
+    unsigned char *p = (unsigned char*)link->m_rcvbuf;
+    unsigned char *end = p+sdslen(link->m_rcvbuf);
+    uint16_t marker, type, count;
+    uint32_t totlen;
+    clusterMsg *hdr;
+
+    if (end-p < (long)CLUSTER_COMPACT_MIN_LEN) return NULL;
+    sds m = sdsnewlen(NULL,CLUSTERMSG_MIN_LEN);
+    hdr = (clusterMsg*)m;
+    memcpy(hdr->m_sig,"RCmb",4);
+    p += 8;
+    memcpy((char*)hdr+CLUSTER_COMPACT_HDR1_OFF,p,CLUSTER_COMPACT_HDR1_LEN);
+    p += CLUSTER_COMPACT_HDR1_LEN;
+    memcpy((char*)hdr+CLUSTER_COMPACT_HDR2_OFF,p,CLUSTER_COMPACT_HDR2_LEN);
+    p += CLUSTER_COMPACT_HDR2_LEN;
+    memcpy((char*)hdr+CLUSTER_COMPACT_HDR3_OFF,p,CLUSTER_COMPACT_HDR3_LEN);
+    p += CLUSTER_COMPACT_HDR3_LEN;
+    type = ntohs(hdr->m_type);
+    count = ntohs(hdr->m_count);
+
+    /* Slots. */
+    memcpy(&marker,p,sizeof(marker));
+    marker = ntohs(marker);
+    p += sizeof(marker);
+    if (marker == CLUSTER_COMPACT_SAME_SLOTS) {
+        if (link->m_slots_rcvd == NULL) goto err;
+    } else {
+        if (link->m_slots_rcvd == NULL)
+            link->m_slots_rcvd = (unsigned char *)zmalloc(CLUSTER_SLOTS/8);
+        if (marker == CLUSTER_COMPACT_RAW_SLOTS) {
+            if (end-p < CLUSTER_SLOTS/8) goto err;
+            memcpy(link->m_slots_rcvd,p,CLUSTER_SLOTS/8);
+            p += CLUSTER_SLOTS/8;
+        } else {
+            memset(link->m_slots_rcvd,0,CLUSTER_SLOTS/8);
+            if (end-p < marker*4) goto err;
+            while (marker--) {
+                uint16_t first, last;
+
+                memcpy(&first,p,2);
+                memcpy(&last,p+2,2);
+                first = ntohs(first);
+                last = ntohs(last);
+                p += 4;
+                if (first > last || last >= CLUSTER_SLOTS) goto err;
+                while (first <= last) bitmapSetBit(link->m_slots_rcvd,first++);
+            }
+        }
+    }
+    memcpy(hdr->m_myslots,link->m_slots_rcvd,CLUSTER_SLOTS/8);
+
+    if (type == CLUSTERMSG_TYPE_PING || type == CLUSTERMSG_TYPE_PONG ||
+        type == CLUSTERMSG_TYPE_MEET)
+    {
+        while (count--) {
+            clusterMsgDataGossip *g;
+            unsigned char mask;
+            uint16_t idx;
+            size_t need = 0;
+
+            if (end-p < 3) goto err;
+            memcpy(&idx,p,2);
+            idx = ntohs(idx);
+            mask = p[2];
+            p += 3;
+            if (idx > link->m_gossip_rcvd_count) goto err;
+            if (idx == link->m_gossip_rcvd_count) {
+                if (!(mask & CLUSTER_GOSSIP_NAME)) goto err;
+                link->m_gossip_rcvd = (clusterMsgDataGossip *)zrealloc(
+                    link->m_gossip_rcvd,sizeof(*g)*(++link->m_gossip_rcvd_count));
+                memset(link->m_gossip_rcvd+idx,0,sizeof(*g));
+            }
+            g = link->m_gossip_rcvd+idx;
+
+            if (mask & CLUSTER_GOSSIP_NAME) need += CLUSTER_NAMELEN;
+            if (mask & CLUSTER_GOSSIP_PING) need += sizeof(g->m_ping_sent);
+            if (mask & CLUSTER_GOSSIP_PONG) need += sizeof(g->m_pong_received);
+            if (mask & CLUSTER_GOSSIP_ADDR) need += CLUSTER_GOSSIP_ADDR_LEN;
+            if (mask & CLUSTER_GOSSIP_FLAGS) need += sizeof(g->m_flags);
+            if ((size_t)(end-p) < need) goto err;
+
+            if (mask & CLUSTER_GOSSIP_NAME) {
+                memcpy(g->m_nodename,p,CLUSTER_NAMELEN);
+                p += CLUSTER_NAMELEN;
+            }
+            if (mask & CLUSTER_GOSSIP_PING) {
+                memcpy(&g->m_ping_sent,p,sizeof(g->m_ping_sent));
+                p += sizeof(g->m_ping_sent);
+            }
+            if (mask & CLUSTER_GOSSIP_PONG) {
+                memcpy(&g->m_pong_received,p,sizeof(g->m_pong_received));
+                p += sizeof(g->m_pong_received);
+            }
+            if (mask & CLUSTER_GOSSIP_ADDR) {
+                memcpy(g->m_ip,p,CLUSTER_GOSSIP_ADDR_LEN);
+                p += CLUSTER_GOSSIP_ADDR_LEN;
+            }
+            if (mask & CLUSTER_GOSSIP_FLAGS) {
+                memcpy(&g->m_flags,p,sizeof(g->m_flags));
+                p += sizeof(g->m_flags);
+            }
+            m = sdscatlen(m,g,sizeof(*g));
+        }
+    } else {
+        m = sdscatlen(m,p,end-p);
+        p = end;
+    }
+    if (p != end) goto err;
+
+    totlen = htonl(sdslen(m));
+    memcpy(m+4,&totlen,sizeof(totlen));
+    return m;
+
+err:
+    sdsfree(m);
+    return NULL;
+}
+
 /* Send data. This is handled using a trivial send buffer that gets
  * consumed by write(). We don't try to optimize this for speed too much
  * as this is a very low traffic channel. */
@@ -2088,6 +2509,7 @@ void clusterWriteHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
         handleLinkIOError(link);
         return;
     }
+    server.stat_cluster_bus_output_bytes += nwritten;
     sdsrange(link->m_sndbuf,nwritten,-1);
     if (sdslen(link->m_sndbuf) == 0)
         server.el->aeDeleteFileEvent( link->m_fd, AE_WRITABLE);
@@ -2117,8 +2539,11 @@ void clusterReadHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
             if (rcvbuflen == 8) {
                 /* Perform some sanity check on the message signature
                  * and length. */
-                if (memcmp(hdr->m_sig,"RCmb",4) != 0 ||
-                    ntohl(hdr->m_totlen) < CLUSTERMSG_MIN_LEN)
+                int compact = memcmp(hdr->m_sig,"RCmc",4) == 0;
+
+                if ((memcmp(hdr->m_sig,"RCmb",4) != 0 && !compact) ||
+                    ntohl(hdr->m_totlen) < (compact ? CLUSTER_COMPACT_MIN_LEN :
+                                                      CLUSTERMSG_MIN_LEN))
                 {
                     serverLog(LL_WARNING,
                         "Bad message length or signature received "
@@ -2145,10 +2570,23 @@ void clusterReadHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
             link->m_rcvbuf = sdscatlen(link->m_rcvbuf,buf,nread);
             hdr = (clusterMsg*) link->m_rcvbuf;
             rcvbuflen += nread;
+            server.stat_cluster_bus_input_bytes += nread;
         }
 
         /* Total length obtained? Process this packet. */
         if (rcvbuflen >= 8 && rcvbuflen == ntohl(hdr->m_totlen)) {
+            if (memcmp(hdr->m_sig,"RCmc",4) == 0) {
+                sds msg = clusterExpandCompactMessage(link);
+
+                if (msg == NULL) {
+                    serverLog(LL_WARNING,
+                        "Bad compact message received from Cluster bus.");
+                    handleLinkIOError(link);
+                    return;
+                }
+                sdsfree(link->m_rcvbuf);
+                link->m_rcvbuf = msg;
+            }
             if (clusterProcessPacket(link)) {
                 sdsfree(link->m_rcvbuf);
                 link->m_rcvbuf = sdsempty();
@@ -2166,14 +2604,25 @@ void clusterReadHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
  * from event handlers that will do stuff with the same link later. */
 void clusterLink::clusterSendMessage(unsigned char *msg, size_t msglen)
 {
-    if (sdslen(m_sndbuf) == 0 && msglen != 0)
+    clusterMsg *hdr = (clusterMsg*) msg;
+    sds compact = NULL;
+
+    /* During the TLS handshake the messages are just queued. */
+    if (sdslen(m_sndbuf) == 0 && msglen != 0 && m_tls == NULL)
         server.el->aeCreateFileEvent(m_fd,AE_WRITABLE,
                     clusterWriteHandler,this);
 
-    m_sndbuf = sdscatlen(m_sndbuf, msg, msglen);
+    if (m_compact && msglen >= CLUSTERMSG_MIN_LEN)
+        compact = clusterCompactMessage(this,hdr,msglen);
+    if (compact) {
+        m_sndbuf = sdscatsds(m_sndbuf, compact);
+        sdsfree(compact);
+        server.cluster->m_stats_bus_compact_sent++;
+    } else {
+        m_sndbuf = sdscatlen(m_sndbuf, msg, msglen);
+    }
 
     /* Populate sent messages stats. */
-    clusterMsg *hdr = (clusterMsg*) msg;
     uint16_t type = ntohs(hdr->m_type);
     if (type < CLUSTERMSG_TYPE_COUNT)
         server.cluster->m_stats_bus_messages_sent[type]++;
@@ -2261,6 +2710,8 @@ void clusterBuildMessageHdr(clusterMsg *hdr, int type) {
     /* Set the message flags. */
     if (myself->nodeIsMaster() && server.cluster->m_mf_end)
         hdr->m_mflags[0] |= CLUSTERMSG_FLAG0_PAUSED;
+    if (server.cluster_bus_compact)
+        hdr->m_mflags[0] |= CLUSTERMSG_FLAG0_COMPACT;
 
     /* Compute the message length for certain messages. For other messages
      * this is up to the caller. */
@@ -2465,10 +2916,30 @@ void clusterBroadcastPong(int target) {
     }
 }
 
-/* Send a PUBLISH message.
+/* Send a message to the other nodes of the shard of this node, that is, the
+ * master serving our slots and its slaves. */
+void clusterBroadcastMessageToShard(void *buf, size_t len) {
+    clusterNode *master = myself->nodeIsSlave() ? myself->m_slaveof : myself;
+    dictEntry *de;
+
+    if (master == NULL) return;
+    dictIterator di(server.cluster->m_nodes, 1);
+    while((de = di.dictNext()) != NULL) {
+        clusterNode* node = (clusterNode*)de->dictGetVal();
+
+        if (!node->m_link) continue;
+        if (node->m_flags & (CLUSTER_NODE_MYSELF|CLUSTER_NODE_HANDSHAKE))
+            continue;
+        if (node != master && node->m_slaveof != master) continue;
+        node->m_link->clusterSendMessage((unsigned char *)buf,len);
+    }
+}
+
+/* Send a PUBLISH (or PUBLISHSHARD if 'type' says so) message.
  *
- * If link is NULL, then the message is broadcasted to the whole cluster. */
-void clusterSendPublish(clusterLink *link, robj *channel, robj *message) {
+ * If link is NULL, then a PUBLISH message is broadcasted to the whole
+ * cluster, and a PUBLISHSHARD message to the shard of this node. */
+void clusterSendPublish(clusterLink *link, robj *channel, robj *message, int type) {
     unsigned char buf[sizeof(clusterMsg)], *payload;
     clusterMsg *hdr = (clusterMsg*) buf;
     uint32_t totlen;
@@ -2479,7 +2950,7 @@ void clusterSendPublish(clusterLink *link, robj *channel, robj *message) {
     channel_len = sdslen((sds)channel->ptr);
     message_len = sdslen((sds)message->ptr);
 
-    clusterBuildMessageHdr(hdr,CLUSTERMSG_TYPE_PUBLISH);
+    clusterBuildMessageHdr(hdr,type);
     totlen = sizeof(clusterMsg)-sizeof(union clusterMsgData);
     totlen += sizeof(clusterMsgDataPublish) - 8 + channel_len + message_len;
 
@@ -2501,6 +2972,8 @@ void clusterSendPublish(clusterLink *link, robj *channel, robj *message) {
 
     if (link)
         link->clusterSendMessage(payload,totlen);
+    else if (type == CLUSTERMSG_TYPE_PUBLISHSHARD)
+        clusterBroadcastMessageToShard(payload,totlen);
     else
         clusterBroadcastMessage(payload,totlen);
 
@@ -2546,7 +3019,31 @@ void clusterSendUpdate(clusterLink *link, clusterNode *node) {
  * messages to hosts without receives for a given channel.
  * -------------------------------------------------------------------------- */
 void clusterPropagatePublish(robj *channel, robj *message) {
-    clusterSendPublish(NULL, channel, message);
+    clusterSendPublish(NULL, channel, message, CLUSTERMSG_TYPE_PUBLISH);
+}
+
+/* Shard channels hash to slots like keys, and their messages (SPUBLISH) are
+ * only propagated to the nodes of the shard serving the slot, so the cost of
+ * a message doesn't grow with the size of the cluster. */
+void clusterPropagatePublishShard(robj *channel, robj *message) {
+    clusterSendPublish(NULL, channel, message, CLUSTERMSG_TYPE_PUBLISHSHARD);
+}
+
+/* Unsubscribe the clients of the shard channels whose slot is no longer
+ * served by the shard of this node, after a slot was moved or this node
+ * started to replicate another master. */
+void clusterUpdatePubsubShardChannels() {
+    clusterNode *master = myself->nodeIsSlave() ? myself->m_slaveof : myself;
+    dictEntry *de;
+
+    dictIterator di(server.pubsubshard_channels, 1);
+    while((de = di.dictNext()) != NULL) {
+        robj *channel = (robj *)de->dictGetKey();
+        int slot = keyHashSlot((char*)channel->ptr,sdslen((sds)channel->ptr));
+
+        if (master == NULL || server.cluster->m_slots[slot] != master)
+            pubsubShardUnsubscribeAllClients(channel);
+    }
 }
 
 /* -----------------------------------------------------------------------------
@@ -3286,8 +3783,11 @@ void clusterCron() {
                 }
                 link = createClusterLink(node, fd);
                 node->m_link = link;
-                server.el->aeCreateFileEvent(link->m_fd,AE_READABLE,
-                        clusterReadHandler,link);
+                if (clusterLinkStart(link,TLS_CONNECT) == C_ERR) {
+                    if (node->m_ping_sent == 0) node->m_ping_sent = mstime();
+                    freeClusterLink(link);
+                    continue;
+                }
                 /* Queue a PING in the new connection ASAP: this is crucial
                  * to avoid false positives in failure detection.
                  *
@@ -3475,6 +3975,18 @@ void clusterCron() {
  * handlers, or to perform potentially expansive tasks that we need to do
  * a single time before replying to clients. */
 void clusterBeforeSleep() {
+    int failed;
+
+    /* A background save of the config failed: as for a synchronous save,
+     * there is no way to go on without a consistent config. */
+    pthread_mutex_lock(&cluster_config_mutex);
+    failed = cluster_config_failed;
+    pthread_mutex_unlock(&cluster_config_mutex);
+    if (failed) {
+        serverLog(LL_WARNING,"Fatal: can't update cluster config file.");
+        exit(1);
+    }
+
     /* Handle failover, this is needed when it is likely that there is already
      * the quorum from masters in order to react fast. */
     if (server.cluster->m_todo_before_sleep & CLUSTER_TODO_HANDLE_FAILOVER)
@@ -3484,11 +3996,21 @@ void clusterBeforeSleep() {
     if (server.cluster->m_todo_before_sleep & CLUSTER_TODO_UPDATE_STATE)
         clusterUpdateState();
 
-    /* Save the config, possibly using fsync. */
+    /* Drop the shard channels subscriptions of slots we no longer serve. */
+    if (server.cluster->m_todo_before_sleep & CLUSTER_TODO_UPDATE_PUBSUBSHARD)
+        clusterUpdatePubsubShardChannels();
+
+    /* Save the config, possibly using fsync. A new epoch or vote must be
+     * on disk before this node acts on it, that is, before the messages
+     * sent in this event loop iteration, so those saves stay synchronous.
+     * The others are left to a background job. */
     if (server.cluster->m_todo_before_sleep & CLUSTER_TODO_SAVE_CONFIG) {
         int fsync = server.cluster->m_todo_before_sleep &
                     CLUSTER_TODO_FSYNC_CONFIG;
-        clusterSaveConfigOrDie(fsync);
+        if (fsync && clusterEpochsChangedSinceSave())
+            clusterSaveConfigOrDie(1);
+        else
+            clusterSaveConfigAsync(fsync);
     }
 
     /* Reset our flags (not strictly needed since every single function
@@ -3498,6 +4020,9 @@ void clusterBeforeSleep() {
 
 void clusterDoBeforeSleep(int flags) {
     server.cluster->m_todo_before_sleep |= flags;
+
+    /* Whatever changes the config to save may change CLUSTER SLOTS. */
+    if (flags & CLUSTER_TODO_SAVE_CONFIG) clusterInvalidateSlotsReply();
 }
 
 /* -----------------------------------------------------------------------------
@@ -3550,6 +4075,9 @@ int clusterNode::clusterNodeSetSlotBit(int slot)
     bitmapSetBit(m_slots,slot);
     if (!old) {
         m_numslots++;
+        sdsfree(m_slots_info);
+        m_slots_info = NULL;
+        clusterInvalidateSlotsReply();
         /* When a master gets its first slot, even if it has no slaves,
          * it gets flagged with MIGRATE_TO, that is, the master is a valid
          * target for replicas migration, if and only if at least one of
@@ -3573,7 +4101,12 @@ int clusterNode::clusterNodeSetSlotBit(int slot)
 int clusterNodeClearSlotBit(clusterNode *n, int slot) {
     int old = bitmapTestBit(n->m_slots,slot);
     bitmapClearBit(n->m_slots,slot);
-    if (old) n->m_numslots--;
+    if (old) {
+        n->m_numslots--;
+        sdsfree(n->m_slots_info);
+        n->m_slots_info = NULL;
+        clusterInvalidateSlotsReply();
+    }
     return old;
 }
 
@@ -3602,6 +4135,8 @@ int clusterDelSlot(int slot) {
     if (!n) return C_ERR;
     serverAssert(clusterNodeClearSlotBit(n,slot) == 1);
     server.cluster->m_slots[slot] = NULL;
+    if (server.pubsubshard_channels->dictSize())
+        clusterDoBeforeSleep(CLUSTER_TODO_UPDATE_PUBSUBSHARD);
     return C_OK;
 }
 
@@ -3626,6 +4161,20 @@ void clusterCloseAllSlots() {
         sizeof(server.cluster->m_migrating_slots_to));
     memset(server.cluster->m_importing_slots_from,0,
         sizeof(server.cluster->m_importing_slots_from));
+    server.cluster->m_open_slots = 0;
+}
+
+/* Count the slots in migrating or importing state. Must be called every time
+ * the state of a slot is changed, since when no slot is open getNodeByQuery()
+ * routes the single key commands without checking it. */
+void clusterUpdateOpenSlots() {
+    int j, open = 0;
+
+    for (j = 0; j < CLUSTER_SLOTS; j++) {
+        if (server.cluster->m_migrating_slots_to[j] ||
+            server.cluster->m_importing_slots_from[j]) open++;
+    }
+    server.cluster->m_open_slots = open;
 }
 
 /* -----------------------------------------------------------------------------
@@ -3796,6 +4345,7 @@ int verifyClusterConfigWithData() {
             server.cluster->m_importing_slots_from[j] = server.cluster->m_slots[j];
         }
     }
+    clusterUpdateOpenSlots();
     if (update_config) clusterSaveConfigOrDie(1);
     return C_OK;
 }
@@ -3822,6 +4372,7 @@ void clusterSetMaster(clusterNode *n) {
     n->clusterNodeAddSlave(myself);
     replicationSetMaster(n->m_ip, n->m_port);
     resetManualFailover();
+    clusterDoBeforeSleep(CLUSTER_TODO_UPDATE_PUBSUBSHARD);
 }
 
 /* -----------------------------------------------------------------------------
@@ -3890,25 +4441,33 @@ sds clusterGenNodeDescription(clusterNode *node) {
         (node->m_link || node->m_flags & CLUSTER_NODE_MYSELF) ?
                     "connected" : "disconnected");
 
-    /* Slots served by this instance */
-    start = -1;
-    for (j = 0; j < CLUSTER_SLOTS; j++) {
-        int bit;
+    /* Slots served by this instance. Scanning the slots bitmap of every
+     * node is the most expensive part of CLUSTER NODES, so the ranges are
+     * cached until the slots of the node change. */
+    if (node->m_slots_info == NULL) {
+        sds si = sdsempty();
 
-        if ((bit = node->clusterNodeGetSlotBit(j)) != 0) {
-            if (start == -1) start = j;
-        }
-        if (start != -1 && (!bit || j == CLUSTER_SLOTS-1)) {
-            if (bit && j == CLUSTER_SLOTS-1) j++;
+        start = -1;
+        for (j = 0; j < CLUSTER_SLOTS; j++) {
+            int bit;
 
-            if (start == j-1) {
-                ci = sdscatprintf(ci," %d",start);
-            } else {
-                ci = sdscatprintf(ci," %d-%d",start,j-1);
+            if ((bit = node->clusterNodeGetSlotBit(j)) != 0) {
+                if (start == -1) start = j;
+            }
+            if (start != -1 && (!bit || j == CLUSTER_SLOTS-1)) {
+                if (bit && j == CLUSTER_SLOTS-1) j++;
+
+                if (start == j-1) {
+                    si = sdscatprintf(si," %d",start);
+                } else {
+                    si = sdscatprintf(si," %d-%d",start,j-1);
+                }
+                start = -1;
             }
-            start = -1;
         }
+        node->m_slots_info = si;
     }
+    ci = sdscatsds(ci,node->m_slots_info);
 
     /* Just for MYSELF node we also dump info about slots that
      * we are migrating to other instances or importing from other
@@ -3971,6 +4530,7 @@ const char *clusterGetMessageTypeString(int type) {
     case CLUSTERMSG_TYPE_FAILOVER_AUTH_ACK: return "auth-ack";
     case CLUSTERMSG_TYPE_UPDATE: return "update";
     case CLUSTERMSG_TYPE_MFSTART: return "mfstart";
+    case CLUSTERMSG_TYPE_PUBLISHSHARD: return "publishshard";
     }
     return "unknown";
 }
@@ -3987,7 +4547,20 @@ int getSlotOrReply(client *c, robj *o) {
     return (int) slot;
 }
 
-void clusterReplyMultiBulkSlots(client *c) {
+/* Append to 's' the protocol of a [ip, port, id] node entry of the
+ * CLUSTER SLOTS reply. */
+static sds clusterCatSlotsNode(sds s, clusterNode *node) {
+    size_t iplen = strlen(node->m_ip);
+
+    s = sdscatprintf(s,"*3\r\n$%zu\r\n",iplen);
+    s = sdscatlen(s,node->m_ip,iplen);
+    s = sdscatprintf(s,"\r\n:%d\r\n$%d\r\n",node->m_port,CLUSTER_NAMELEN);
+    s = sdscatlen(s,node->m_name,CLUSTER_NAMELEN);
+    return sdscatlen(s,"\r\n",2);
+}
+
+/* Generate the protocol of the CLUSTER SLOTS reply. */
+static sds clusterGenSlotsReply() {
     /* Format: 1) 1) start slot
      *            2) end slot
      *            3) 1) master IP
@@ -4000,7 +4573,7 @@ void clusterReplyMultiBulkSlots(client *c) {
      */
 
     int num_masters = 0;
-    void *slot_replylen = c->addDeferredMultiBulkLength();
+    sds ranges = sdsempty(), reply;
 
     dictEntry *de;
     dictIterator di(server.cluster->m_nodes, 1);
@@ -4020,45 +4593,53 @@ void clusterReplyMultiBulkSlots(client *c) {
             }
             if (start != -1 && (!bit || j == CLUSTER_SLOTS-1)) {
                 int nested_elements = 3; /* slots (2) + master addr (1). */
-                void *nested_replylen = c->addDeferredMultiBulkLength();
 
                 if (bit && j == CLUSTER_SLOTS-1) j++;
 
-                /* If slot exists in output map, add to it's list.
-                 * else, create a new output map for this slot */
-                if (start == j-1) {
-                    c->addReplyLongLong( start); /* only one slot; low==high */
-                    c->addReplyLongLong( start);
-                } else {
-                    c->addReplyLongLong( start); /* low */
-                    c->addReplyLongLong( j-1);   /* high */
-                }
+                /* Replicas are only counted once the range is known. */
+                for (i = 0; i < node->m_numslaves; i++)
+                    if (!node->m_slaves[i]->nodeFailed()) nested_elements++;
+                ranges = sdscatprintf(ranges,"*%d\r\n:%d\r\n:%d\r\n",
+                    nested_elements,start,j-1);
                 start = -1;
 
                 /* First node reply position is always the master */
-                c->addReplyMultiBulkLen(3);
-                c->addReplyBulkCString(node->m_ip);
-                c->addReplyLongLong(node->m_port);
-                c->addReplyBulkCBuffer(node->m_name, CLUSTER_NAMELEN);
+                ranges = clusterCatSlotsNode(ranges,node);
 
                 /* Remaining nodes in reply are replicas for slot range */
                 for (i = 0; i < node->m_numslaves; i++) {
                     /* This loop is copy/pasted from clusterGenNodeDescription()
                      * with modifications for per-slot node aggregation */
                     if (node->m_slaves[i]->nodeFailed()) continue;
-                    c->addReplyMultiBulkLen(3);
-                    c->addReplyBulkCString(node->m_slaves[i]->m_ip);
-                    c->addReplyLongLong(node->m_slaves[i]->m_port);
-                    c->addReplyBulkCBuffer(node->m_slaves[i]->m_name, CLUSTER_NAMELEN);
-                    nested_elements++;
+                    ranges = clusterCatSlotsNode(ranges,node->m_slaves[i]);
                 }
-                c->setDeferredMultiBulkLength( nested_replylen, nested_elements);
                 num_masters++;
             }
         }
     }
 
-    c->setDeferredMultiBulkLength( slot_replylen, num_masters);
+    reply = sdscatprintf(sdsempty(),"*%d\r\n",num_masters);
+    reply = sdscatsds(reply,ranges);
+    sdsfree(ranges);
+    return reply;
+}
+
+/* Drop the cached CLUSTER SLOTS reply. Called every time the slots, the
+ * nodes, their addresses or the replicas may have changed. */
+void clusterInvalidateSlotsReply() {
+    if (server.cluster == NULL) return;
+    sdsfree(server.cluster->m_slots_reply);
+    server.cluster->m_slots_reply = NULL;
+}
+
+/* Reply CLUSTER SLOTS. Smart clients call it on every reconnection and
+ * after every MOVED redirection, so the reply is generated once and
+ * cached until the cluster config changes. */
+void clusterReplyMultiBulkSlots(client *c) {
+    if (server.cluster->m_slots_reply == NULL)
+        server.cluster->m_slots_reply = clusterGenSlotsReply();
+    c->addReplyString(server.cluster->m_slots_reply,
+                      sdslen(server.cluster->m_slots_reply));
 }
 
 void clusterCommand(client *c) {
@@ -4166,6 +4747,7 @@ void clusterCommand(client *c) {
             }
         }
         zfree(slots);
+        clusterUpdateOpenSlots();
         clusterDoBeforeSleep(CLUSTER_TODO_UPDATE_STATE|CLUSTER_TODO_SAVE_CONFIG);
         c->addReply(shared.ok);
     } else if (!strcasecmp((const char*)c->m_argv[1]->ptr,"setslot") && c->m_argc >= 4) {
@@ -4263,6 +4845,7 @@ void clusterCommand(client *c) {
                 "Invalid CLUSTER SETSLOT action or number of arguments");
             return;
         }
+        clusterUpdateOpenSlots();
         clusterDoBeforeSleep(CLUSTER_TODO_SAVE_CONFIG|CLUSTER_TODO_UPDATE_STATE);
         c->addReply(shared.ok);
     } else if (!strcasecmp((const char*)c->m_argv[1]->ptr,"bumpepoch") && c->m_argc == 2) {
@@ -4343,6 +4926,19 @@ void clusterCommand(client *c) {
         info = sdscatprintf(info,
             "cluster_stats_messages_received:%lld\r\n", tot_msg_received);
 
+        /* Show stats about the bus traffic. */
+        info = sdscatprintf(info,
+            "cluster_stats_compact_messages_sent:%lld\r\n"
+            "cluster_stats_bus_bytes_sent:%lld\r\n"
+            "cluster_stats_bus_bytes_received:%lld\r\n"
+            "cluster_stats_bus_instantaneous_input_kbps:%.2f\r\n"
+            "cluster_stats_bus_instantaneous_output_kbps:%.2f\r\n",
+            server.cluster->m_stats_bus_compact_sent,
+            server.stat_cluster_bus_output_bytes,
+            server.stat_cluster_bus_input_bytes,
+            (float)getInstantaneousMetric(STATS_METRIC_CLUSTER_BUS_INPUT)/1024,
+            (float)getInstantaneousMetric(STATS_METRIC_CLUSTER_BUS_OUTPUT)/1024);
+
         /* Produce the reply protocol. */
         c->addReplySds(sdscatprintf(sdsempty(),"$%lu\r\n",
             (unsigned long)sdslen(info)));
@@ -4871,12 +5467,17 @@ void migrateCloseTimedoutSockets() {
  *
  * On in the multiple keys form:
  *
- * MIGRATE host port "" dbid timeout [COPY | REPLACE] KEYS key1 key2 ... keyN */
+ * MIGRATE host port "" dbid timeout [COPY | REPLACE] KEYS key1 key2 ... keyN
+ *
+ * Or to migrate a whole hash slot in the background:
+ *
+ * MIGRATE host port "" dbid timeout [COPY | REPLACE] SLOT slot [ATOMIC] */
 void migrateCommand(client *c) {
     migrateCachedSocket *cs;
-    int copy, replace, j;
+    int copy, replace, atomic = 0, j;
     long timeout;
     long dbid;
+    long slot = -1; /* Slot to migrate with the SLOT option. */
     robj **ov = NULL; /* Objects to migrate. */
     robj **kv = NULL; /* Key names. */
     robj **newargv = NULL; /* Used to rewrite the command as DEL ... keys ... */
@@ -4902,6 +5503,8 @@ void migrateCommand(client *c) {
             copy = 1;
         } else if (!strcasecmp((const char*)c->m_argv[j]->ptr,"replace")) {
             replace = 1;
+        } else if (!strcasecmp((const char*)c->m_argv[j]->ptr,"atomic")) {
+            atomic = 1;
         } else if (!strcasecmp((const char*)c->m_argv[j]->ptr,"keys")) {
             if (sdslen((sds)c->m_argv[3]->ptr) != 0) {
                 c->addReplyError(
@@ -4909,9 +5512,28 @@ void migrateCommand(client *c) {
                     " must be set to the empty string");
                 return;
             }
+            if (slot != -1) {
+                c->addReply(shared.syntaxerr);
+                return;
+            }
             first_key = j+1;
             num_keys = c->m_argc - j - 1;
             break; /* All the remaining args are keys. */
+        } else if (!strcasecmp((const char*)c->m_argv[j]->ptr,"slot") &&
+                   j+1 < c->m_argc)
+        {
+            if (sdslen((sds)c->m_argv[3]->ptr) != 0) {
+                c->addReplyError(
+                    "When using MIGRATE SLOT option, the key argument"
+                    " must be set to the empty string");
+                return;
+            }
+            if (getLongFromObjectOrReply(c,c->m_argv[++j],&slot,NULL) != C_OK)
+                return;
+            if (slot < 0 || slot >= CLUSTER_SLOTS) {
+                c->addReplyError("Invalid or out of range slot");
+                return;
+            }
         } else {
             c->addReply(shared.syntaxerr);
             return;
@@ -4926,6 +5548,15 @@ void migrateCommand(client *c) {
     }
     if (timeout <= 0) timeout = 1000;
 
+    if (atomic && (slot == -1 || copy)) {
+        c->addReply(shared.syntaxerr);
+        return;
+    }
+    if (slot != -1) {
+        migrateSlotCommand(c,slot,dbid,timeout,copy,replace,atomic);
+        return;
+    }
+
     /* Check if the keys are here. If at least one key is to migrate, do it
      * otherwise if all the keys are missing reply with "NOKEY" to signal
      * the caller there was nothing to migrate. We don't return an error in
@@ -5147,6 +5778,770 @@ socket_err:
     return;
 }
 
+/* -----------------------------------------------------------------------------
+ * MIGRATE ... SLOT: asynchronous migration of a whole hash slot
+ * -------------------------------------------------------------------------- */
+
+/* MIGRATE host port "" dbid timeout [COPY | REPLACE] SLOT slot [ATOMIC]
+ *
+ * Instead of serializing a few keys and waiting for the RESTORE replies,
+ * the SLOT form moves all the keys of a hash slot in the background: the
+ * client is blocked, while a job with its own non blocking connection to
+ * the target scans the slot and pipelines the keys, keeping at most
+ * cluster-migrate-inflight-bytes of protocol sent and not yet acknowledged.
+ * Every key is deleted locally, and the deletion propagated, as soon as the
+ * target acknowledged it, so the event loop never waits for the target and
+ * many slots can be migrated in parallel, each to its target.
+ *
+ * The small keys are sent with RESTORE-ASKING. With REPLACE, the collections
+ * with more than MIGRATE_SLOT_CHUNK_ITEMS elements are sent as the commands
+ * an AOF rewrite would emit (RPUSH, SADD, ZADD, HMSET, ...), each preceded by
+ * ASKING, so that the target never has to load a huge payload at once.
+ * Without REPLACE they are sent with RESTORE-ASKING too, so that a key
+ * already existing in the target is still reported as an error.
+ *
+ * Until its deletion a key is still served locally: if it is modified in
+ * the meantime it is sent again, replacing the copy of the target.
+ *
+ * With ATOMIC the clients never see an ASK redirection: the target must be
+ * importing the slot, but the source keeps serving all the keys of the slot
+ * during the migration. The keys are sent as a snapshot, the key of the slot
+ * that is not yet sent being queued if written, and the writes to the keys
+ * already sent are streamed to the target as they are propagated to the
+ * slaves. Once the snapshot is complete the clients are paused until the
+ * stream is acknowledged, then the target is asked to take the slot with
+ * CLUSTER SETSLOT NODE, bumping its epoch, and the source drops its keys.
+ * The snapshot always replaces the keys of the target, that may have
+ * received them first as the destination of a multi key write. */
+#define MIGRATE_SLOT_CHUNK_ITEMS 1024
+#define MIGRATE_SLOT_READ_LEN (1024*16)
+
+/* States of an ATOMIC migration. */
+#define MIGRATE_SLOT_SNAPSHOT 0 /* Sending the keys of the slot. */
+#define MIGRATE_SLOT_DRAIN 1    /* Clients paused, waiting for the stream. */
+#define MIGRATE_SLOT_FLIP 2     /* Waiting for the target to take the slot. */
+#define MIGRATE_SLOT_DONE 3     /* The target owns the slot. */
+
+typedef struct migrateSlotKey {
+    robj *key;      /* NULL for commands not related to a key (SELECT). */
+    int replies;    /* Replies still expected from the target. */
+    size_t bytes;   /* Protocol sent for the key. */
+    int dirty;      /* The key was modified after it was serialized. */
+    int flip;       /* The CLUSTER SETSLOT of an ATOMIC migration. */
+} migrateSlotKey;
+
+typedef struct migrateSlotJob {
+    client *c;              /* Client blocked in MIGRATE, NULL if gone. */
+    redisDb *db;
+    int slot;
+    long dbid;              /* Target DB. */
+    long timeout;           /* Milliseconds without I/O before failing. */
+    int copy, replace;
+    int atomic;             /* ATOMIC: stream the writes, flip the owner. */
+    int state;              /* MIGRATE_SLOT_* state of an ATOMIC migration. */
+    char target[CLUSTER_NAMELEN]; /* ATOMIC: name of the target node. */
+    mstime_t pause_end;     /* ATOMIC: end of our pause of the clients. */
+    dict *queued;           /* ATOMIC: keys written before they were sent. */
+    int fd;
+    int connected;
+    unsigned long cursor;   /* dictScan() cursor of the keys of the slot. */
+    int scan_done;
+    list *batch;            /* Keys found by the last scan step. */
+    list *retry;            /* Keys modified while in flight. */
+    list *pending;          /* migrateSlotKey waiting for replies, in order. */
+    dict *inflight;         /* Key name -> migrateSlotKey of 'pending'. */
+    dict *sent;             /* COPY and ATOMIC: keys already transferred. */
+    sds outbuf;
+    size_t outpos;          /* Bytes of 'outbuf' already written. */
+    sds inbuf;
+    size_t inflight_bytes;  /* Protocol not yet acknowledged. */
+    long long moved;        /* Keys acknowledged by the target. */
+    mstime_t lastio;
+} migrateSlotJob;
+
+static void migrateSlotFeed(migrateSlotJob *job);
+static void migrateSlotWriteHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+
+static const char migrateAskingCmd[] = "*1\r\n$6\r\nASKING\r\n";
+
+/* Release the job, replying to the client, if still there, with the error
+ * 'err' (without the leading "-") or with +OK. */
+static void migrateSlotFinish(migrateSlotJob *job, const char *err) {
+    client *c = job->c;
+    listNode *ln;
+
+    if (c) {
+        c->unblockClient();
+        if (err)
+            c->addReplySds(sdscatprintf(sdsempty(),"-%s\r\n",err));
+        else if (job->moved == 0)
+            c->addReplySds(sdsnew("+NOKEY\r\n"));
+        else
+            c->addReply(shared.ok);
+    }
+
+    if (job->fd != -1) {
+        server.el->aeDeleteFileEvent(job->fd,AE_READABLE|AE_WRITABLE);
+        close(job->fd);
+    }
+    if (job->pause_end && server.clients_pause_end_time == job->pause_end) {
+        server.clients_pause_end_time = 0;
+        clientsArePaused(); /* Unpause the clients now. */
+    }
+    listIter li(job->pending);
+    while((ln = li.listNext())) {
+        migrateSlotKey *mk = (migrateSlotKey *)ln->listNodeValue();
+        if (mk->key) decrRefCount(mk->key);
+        zfree(mk);
+    }
+    listIter li2(job->batch);
+    while((ln = li2.listNext())) decrRefCount((robj *)ln->listNodeValue());
+    listIter li3(job->retry);
+    while((ln = li3.listNext())) decrRefCount((robj *)ln->listNodeValue());
+    listRelease(job->pending);
+    listRelease(job->batch);
+    listRelease(job->retry);
+    dictRelease(job->inflight);
+    if (job->sent) dictRelease(job->sent);
+    if (job->queued) dictRelease(job->queued);
+    sdsfree(job->outbuf);
+    sdsfree(job->inbuf);
+
+    ln = server.migrate_slot_jobs->listSearchKey(job);
+    serverAssert(ln != NULL);
+    server.migrate_slot_jobs->listDelNode(ln);
+    zfree(job);
+}
+
+/* Called by unblockClient() when the client blocked in MIGRATE SLOT is
+ * unblocked, or freed: the job continues without it. */
+void unblockClientFromMigrate(client *c) {
+    migrateSlotJob *job = (migrateSlotJob *)c->m_blocking_state.m_migrate_job;
+
+    job->c = NULL;
+    c->m_blocking_state.m_migrate_job = NULL;
+}
+
+/* Called by signalModifiedKey(): a key in flight that is modified must be
+ * sent again once acknowledged. */
+void migrateSlotKeyModified(redisDb *db, robj *key) {
+    listNode *ln;
+
+    if (!sdsEncodedObject(key)) return;
+    listIter li(server.migrate_slot_jobs);
+    while((ln = li.listNext())) {
+        migrateSlotJob *job = (migrateSlotJob *)ln->listNodeValue();
+        if (job->db != db || job->copy) continue;
+
+        migrateSlotKey *mk =
+            (migrateSlotKey *)job->inflight->dictFetchValue(key->ptr);
+        if (mk) mk->dirty = 1;
+    }
+}
+
+/* Collect the keys of a dictScan() step of the keys of the slot. */
+static void migrateSlotScanCallback(void *privdata, const dictEntry *de) {
+    migrateSlotJob *job = (migrateSlotJob *)privdata;
+    sds key = (sds)de->dictGetKey();
+
+    if (job->inflight->dictFind(key)) return;
+    if (job->sent && job->sent->dictFind(key)) return;
+    if (job->queued && job->queued->dictFind(key)) return;
+    job->batch->listAddNodeTail(createStringObject(key,sdslen(key)));
+}
+
+/* Return the next key to send, setting '*resend' if it was already sent
+ * once, or NULL when there are no keys left for now. */
+static robj *migrateSlotNextKey(migrateSlotJob *job, int *resend) {
+    list *l = NULL;
+
+    while (job->retry->listLength() == 0 && job->batch->listLength() == 0 &&
+           !job->scan_done)
+    {
+        dict *d = slotKeysDict(job->slot);
+        if (d) job->cursor = d->dictScan(job->cursor,
+                                         migrateSlotScanCallback,NULL,job);
+        if (d == NULL || job->cursor == 0) job->scan_done = 1;
+    }
+
+    if (job->retry->listLength()) {
+        l = job->retry;
+        *resend = 1;
+    } else if (job->batch->listLength()) {
+        l = job->batch;
+        *resend = 0;
+    } else {
+        return NULL;
+    }
+    listNode *ln = l->listFirst();
+    robj *key = (robj *)ln->listNodeValue();
+    l->listDelNode(ln);
+    return key;
+}
+
+/* Return the number of elements of a collection to send in chunks, or 0. */
+static unsigned long migrateSlotChunkedLength(robj *o) {
+    unsigned long len;
+
+    switch(o->type) {
+    case OBJ_LIST: len = listTypeLength(o); break;
+    case OBJ_SET: len = setTypeSize(o); break;
+    case OBJ_ZSET: len = zsetLength(o); break;
+    case OBJ_HASH: len = hashTypeLength(o); break;
+    default: return 0;
+    }
+    return len > MIGRATE_SLOT_CHUNK_ITEMS ? len : 0;
+}
+
+/* Append to 'cmd' the commands rebuilding 'o', each preceded by ASKING.
+ * Return the number of replies to expect. */
+static int migrateSlotRewriteObject(rioBufferIO *cmd, robj *key, robj *o) {
+    rioBufferIO aux(sdsempty());
+    int ok, replies = 0;
+
+    switch(o->type) {
+    case OBJ_LIST: ok = rewriteListObject(&aux,key,o); break;
+    case OBJ_SET: ok = rewriteSetObject(&aux,key,o); break;
+    case OBJ_ZSET: ok = rewriteSortedSetObject(&aux,key,o); break;
+    default: ok = rewriteHashObject(&aux,key,o); break;
+    }
+    serverAssert(ok);
+
+    /* Split the protocol in commands: we emitted it, so it is well formed. */
+    char *p = aux.m_ptr, *end = aux.m_ptr+sdslen(aux.m_ptr);
+    while (p < end) {
+        char *start = p;
+        long argc = strtol(p+1,&p,10);
+
+        p += 2;
+        while (argc--) p = strchr(p,'\n')+1+strtol(p+1,NULL,10)+2;
+        cmd->m_ptr = sdscatlen(cmd->m_ptr,migrateAskingCmd,
+                               sizeof(migrateAskingCmd)-1);
+        cmd->m_ptr = sdscatlen(cmd->m_ptr,start,p-start);
+        replies += 2;
+    }
+    sdsfree(aux.m_ptr);
+    return replies;
+}
+
+/* Serialize 'key' into the output buffer, taking its reference. */
+static void migrateSlotSendKey(migrateSlotJob *job, robj *key, int resend) {
+    int replace = job->replace || resend;
+    int replies = 1;
+    robj *o = NULL;
+
+    if (job->queued) job->queued->dictDelete(key->ptr);
+    if (job->inflight->dictFind(key->ptr) ||
+        (job->sent && job->sent->dictFind(key->ptr)))
+    {
+        /* Found twice by the scan. */
+        decrRefCount(key);
+        return;
+    }
+    if (!expireIfNeeded(job->db,key)) {
+        dictEntry *de = job->db->m_dict->dictFind(key->ptr);
+        if (de) o = (robj *)de->dictGetVal();
+        if (o && o->encoding == OBJ_ENCODING_LAZY) lazyLoadValue(o);
+    }
+
+    rioBufferIO cmd(sdsempty());
+    if (o == NULL) {
+        if (!resend) {
+            decrRefCount(key);
+            return;
+        }
+        /* Deleted after it was sent: delete the copy of the target. */
+        cmd.m_ptr = sdscatlen(cmd.m_ptr,migrateAskingCmd,
+                              sizeof(migrateAskingCmd)-1);
+        serverAssert(cmd.rioWriteBulkCount('*',2));
+        serverAssert(cmd.rioWriteBulkString("DEL",3));
+        serverAssert(cmd.rioWriteBulkObject(key));
+        replies = 2;
+    } else {
+        long long ttl = 0;
+        long long expireat = getExpire(job->db,key);
+
+        if (expireat != -1) {
+            ttl = expireat-mstime();
+            if (ttl < 1) ttl = 1;
+        }
+
+        if (replace && migrateSlotChunkedLength(o)) {
+            cmd.m_ptr = sdscatlen(cmd.m_ptr,migrateAskingCmd,
+                                  sizeof(migrateAskingCmd)-1);
+            serverAssert(cmd.rioWriteBulkCount('*',2));
+            serverAssert(cmd.rioWriteBulkString("DEL",3));
+            serverAssert(cmd.rioWriteBulkObject(key));
+            replies = 2+migrateSlotRewriteObject(&cmd,key,o);
+            if (ttl) {
+                cmd.m_ptr = sdscatlen(cmd.m_ptr,migrateAskingCmd,
+                                      sizeof(migrateAskingCmd)-1);
+                serverAssert(cmd.rioWriteBulkCount('*',3));
+                serverAssert(cmd.rioWriteBulkString("PEXPIRE",7));
+                serverAssert(cmd.rioWriteBulkObject(key));
+                serverAssert(cmd.rioWriteBulkLongLong(ttl));
+                replies += 2;
+            }
+        } else {
+            rioBufferIO payload(sdsempty());
+            createDumpPayload(&payload,o);
+
+            serverAssert(cmd.rioWriteBulkCount('*',replace ? 5 : 4));
+            serverAssert(cmd.rioWriteBulkString("RESTORE-ASKING",14));
+            serverAssert(cmd.rioWriteBulkObject(key));
+            serverAssert(cmd.rioWriteBulkLongLong(ttl));
+            serverAssert(cmd.rioWriteBulkString(payload.m_ptr,
+                                                sdslen(payload.m_ptr)));
+            if (replace) serverAssert(cmd.rioWriteBulkString("REPLACE",7));
+            sdsfree(payload.m_ptr);
+        }
+    }
+
+    migrateSlotKey *mk = (migrateSlotKey *)zmalloc(sizeof(*mk));
+    mk->key = key;
+    mk->replies = replies;
+    mk->bytes = sdslen(cmd.m_ptr);
+    mk->dirty = 0;
+    job->pending->listAddNodeTail(mk);
+    job->inflight->dictAdd(key->ptr,mk);
+    /* The writes to the key are streamed from now on. */
+    if (job->atomic) job->sent->dictAdd(sdsdup((sds)key->ptr),NULL);
+    job->outbuf = sdscatsds(job->outbuf,cmd.m_ptr);
+    job->inflight_bytes += mk->bytes;
+    sdsfree(cmd.m_ptr);
+}
+
+/* Append the key-less command 'cmd' to the output buffer, expecting
+ * 'replies' replies. */
+static void migrateSlotAppend(migrateSlotJob *job, sds cmd, int replies,
+                              int flip)
+{
+    migrateSlotKey *mk = (migrateSlotKey *)zcalloc(sizeof(*mk));
+
+    mk->replies = replies;
+    mk->bytes = sdslen(cmd);
+    mk->flip = flip;
+    job->pending->listAddNodeTail(mk);
+    job->outbuf = sdscatsds(job->outbuf,cmd);
+    job->inflight_bytes += mk->bytes;
+}
+
+/* The target of an ATOMIC migration took the slot: assign it locally as
+ * well and drop our keys, that the target has. */
+static void migrateSlotFlip(migrateSlotJob *job) {
+    clusterNode *n = clusterLookupNode(job->target);
+
+    job->state = MIGRATE_SLOT_DONE;
+    /* If the target was forgotten its epoch will still win. */
+    if (n == NULL || server.cluster->m_slots[job->slot] != myself) return;
+    delKeysInSlot(job->slot);
+    server.cluster->m_migrating_slots_to[job->slot] = NULL;
+    clusterUpdateOpenSlots();
+    clusterDelSlot(job->slot);
+    n->clusterAddSlot(job->slot);
+    clusterDoBeforeSleep(CLUSTER_TODO_SAVE_CONFIG|CLUSTER_TODO_UPDATE_STATE);
+    serverLog(LL_NOTICE,"Hash slot %d atomically migrated to %.40s",
+        job->slot, job->target);
+}
+
+/* The snapshot of an ATOMIC migration was sent: pause the clients, and once
+ * the stream of writes is acknowledged ask the target to take the slot. */
+static void migrateSlotCutover(migrateSlotJob *job) {
+    if (job->state == MIGRATE_SLOT_SNAPSHOT) {
+        job->pause_end = mstime()+job->timeout;
+        pauseClients(job->pause_end);
+        job->state = MIGRATE_SLOT_DRAIN;
+    }
+    if (job->state == MIGRATE_SLOT_DRAIN && job->pending->listLength() == 0) {
+        rioBufferIO cmd(sdsempty());
+
+        serverAssert(cmd.rioWriteBulkCount('*',5));
+        serverAssert(cmd.rioWriteBulkString("CLUSTER",7));
+        serverAssert(cmd.rioWriteBulkString("SETSLOT",7));
+        serverAssert(cmd.rioWriteBulkLongLong(job->slot));
+        serverAssert(cmd.rioWriteBulkString("NODE",4));
+        serverAssert(cmd.rioWriteBulkString(job->target,CLUSTER_NAMELEN));
+        migrateSlotAppend(job,cmd.m_ptr,1,1);
+        sdsfree(cmd.m_ptr);
+        job->state = MIGRATE_SLOT_FLIP;
+    }
+}
+
+/* Called by propagate(): stream to the ATOMIC migrations the writes to the
+ * keys of their slot already sent. The other keys of the slot written are
+ * queued, to be sent with the effect of the write. */
+void migrateSlotFeedCommand(struct redisCommand *cmd, int dbid, robj **argv,
+                            int argc)
+{
+    listNode *ln;
+
+    listIter li(server.migrate_slot_jobs);
+    while((ln = li.listNext())) {
+        migrateSlotJob *job = (migrateSlotJob *)ln->listNodeValue();
+        int *keys, numkeys, j, sent = 0;
+
+        if (!job->atomic || job->state == MIGRATE_SLOT_DONE ||
+            job->db->m_id != dbid) continue;
+
+        keys = getKeysFromCommand(cmd,argv,argc,&numkeys);
+        for (j = 0; j < numkeys; j++) {
+            robj *key = argv[keys[j]];
+            sds name;
+
+            if (!sdsEncodedObject(key)) continue;
+            name = (sds)key->ptr;
+            if ((int)keyHashSlot(name,sdslen(name)) != job->slot) continue;
+            if (job->sent->dictFind(name)) {
+                sent = 1;
+            } else if (!job->queued->dictFind(name)) {
+                job->queued->dictAdd(sdsdup(name),NULL);
+                job->batch->listAddNodeTail(
+                    createStringObject(name,sdslen(name)));
+            }
+        }
+        getKeysFreeResult(keys);
+        if (!sent) continue;
+
+        rioBufferIO proto(sdsnewlen(migrateAskingCmd,
+                                    sizeof(migrateAskingCmd)-1));
+        serverAssert(proto.rioWriteBulkCount('*',argc));
+        for (j = 0; j < argc; j++)
+            serverAssert(proto.rioWriteBulkObject(argv[j]));
+        migrateSlotAppend(job,proto.m_ptr,2,0);
+        sdsfree(proto.m_ptr);
+        /* Write errors are detected by the write handler or the timeout. */
+        if (job->connected)
+            server.el->aeCreateFileEvent(job->fd,AE_WRITABLE,
+                migrateSlotWriteHandler,job);
+    }
+}
+
+/* The target acknowledged all the commands of the key at the head of the
+ * pending list. */
+static void migrateSlotKeyDone(migrateSlotJob *job) {
+    listNode *ln = job->pending->listFirst();
+    migrateSlotKey *mk = (migrateSlotKey *)ln->listNodeValue();
+    robj *key = mk->key;
+
+    job->pending->listDelNode(ln);
+    job->inflight_bytes -= mk->bytes;
+    if (key == NULL) {
+        if (mk->flip) migrateSlotFlip(job);
+        zfree(mk);
+        return;
+    }
+    job->inflight->dictDelete(key->ptr);
+
+    if (mk->dirty) {
+        job->retry->listAddNodeTail(key);
+        zfree(mk);
+        return;
+    }
+    zfree(mk);
+
+    if (job->copy) {
+        if (!job->atomic) job->sent->dictAdd(sdsdup((sds)key->ptr),NULL);
+    } else if (job->db->m_dict->dictFind(key->ptr)) {
+        robj *argv[2];
+
+        dbDelete(job->db,key);
+        signalModifiedKey(job->db,key);
+        server.dirty++;
+
+        /* Propagate the deletion as MIGRATE does, rewritten as DEL. */
+        argv[0] = createStringObject("DEL",3);
+        argv[1] = key;
+        propagate(server.delCommand,job->db->m_id,argv,2,
+                  PROPAGATE_AOF|PROPAGATE_REPL);
+        decrRefCount(argv[0]);
+    }
+    job->moved++;
+    decrRefCount(key);
+}
+
+/* Return the length of the reply at the start of 'p', or 0 if it is not
+ * complete yet. */
+static size_t migrateSlotReplyLen(const char *p, size_t len) {
+    const char *eol = (const char *)memchr(p,'\n',len);
+    size_t used;
+    long long n;
+
+    if (eol == NULL) return 0;
+    used = eol-p+1;
+    if (p[0] == '$') {
+        n = strtoll(p+1,NULL,10);
+        if (n < 0) return used;
+        used += n+2;
+        return used <= len ? used : 0;
+    } else if (p[0] == '*') {
+        n = strtoll(p+1,NULL,10);
+        while (n-- > 0) {
+            size_t l = migrateSlotReplyLen(p+used,len-used);
+            if (l == 0) return 0;
+            used += l;
+        }
+    }
+    return used;
+}
+
+static void migrateSlotReadHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    migrateSlotJob *job = (migrateSlotJob *)privdata;
+    size_t qlen = sdslen(job->inbuf), pos = 0;
+    ssize_t nread;
+    UNUSED(el);
+    UNUSED(mask);
+
+    job->inbuf = sdsMakeRoomFor(job->inbuf,MIGRATE_SLOT_READ_LEN);
+    nread = read(fd,job->inbuf+qlen,MIGRATE_SLOT_READ_LEN);
+    if (nread == -1 && errno == EAGAIN) return;
+    if (nread <= 0) {
+        migrateSlotFinish(job,"IOERR error or timeout reading to target instance");
+        return;
+    }
+    sdsIncrLen(job->inbuf,nread);
+    job->lastio = mstime();
+
+    while (pos < sdslen(job->inbuf)) {
+        char *p = job->inbuf+pos;
+        size_t len = migrateSlotReplyLen(p,sdslen(job->inbuf)-pos);
+
+        if (len == 0) break;
+        if (job->pending->listLength() == 0) {
+            migrateSlotFinish(job,"ERR Unexpected reply from target instance");
+            return;
+        }
+        if (p[0] == '-') {
+            sds err = sdscatlen(sdsnew("ERR Target instance replied with error: "),
+                                p+1,len-3);
+            migrateSlotFinish(job,err);
+            sdsfree(err);
+            return;
+        }
+        migrateSlotKey *mk =
+            (migrateSlotKey *)job->pending->listFirst()->listNodeValue();
+        if (--mk->replies == 0) migrateSlotKeyDone(job);
+        pos += len;
+    }
+    sdsrange(job->inbuf,pos,-1);
+    migrateSlotFeed(job);
+}
+
+static void migrateSlotWriteHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    migrateSlotJob *job = (migrateSlotJob *)privdata;
+    ssize_t nwritten;
+    UNUSED(el);
+    UNUSED(mask);
+
+    nwritten = write(fd,job->outbuf+job->outpos,
+                     sdslen(job->outbuf)-job->outpos);
+    if (nwritten == -1 && errno == EAGAIN) return;
+    if (nwritten <= 0) {
+        migrateSlotFinish(job,"IOERR error or timeout writing to target instance");
+        return;
+    }
+    job->outpos += nwritten;
+    job->lastio = mstime();
+    if (job->outpos == sdslen(job->outbuf)) {
+        sdsclear(job->outbuf);
+        job->outpos = 0;
+        server.el->aeDeleteFileEvent(fd,AE_WRITABLE);
+    }
+}
+
+/* The non blocking connect with the target completed. */
+static void migrateSlotConnectHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    migrateSlotJob *job = (migrateSlotJob *)privdata;
+    int sockerr = 0;
+    socklen_t errlen = sizeof(sockerr);
+    UNUSED(el);
+    UNUSED(mask);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &sockerr, &errlen) == -1)
+        sockerr = errno;
+    if (sockerr) {
+        sds err = sdscatprintf(sdsempty(),
+            "ERR Can't connect to target node: %s", strerror(sockerr));
+        migrateSlotFinish(job,err);
+        sdsfree(err);
+        return;
+    }
+    server.el->aeDeleteFileEvent(fd,AE_WRITABLE);
+    if (server.el->aeCreateFileEvent(fd,AE_READABLE,
+            migrateSlotReadHandler,job) == AE_ERR)
+    {
+        migrateSlotFinish(job,"IOERR error or timeout connecting to the client");
+        return;
+    }
+    job->connected = 1;
+    job->lastio = mstime();
+    migrateSlotFeed(job);
+}
+
+/* Send keys until the in flight bytes limit is reached, and finish the job
+ * once all the keys of the slot were acknowledged. */
+static void migrateSlotFeed(migrateSlotJob *job) {
+    if (!job->connected) return;
+
+    while (1) {
+        robj *key;
+        int resend;
+
+        while (job->inflight_bytes < (size_t)server.cluster_migrate_inflight_bytes &&
+               (key = migrateSlotNextKey(job,&resend)) != NULL)
+        {
+            migrateSlotSendKey(job,key,resend);
+        }
+        if (job->retry->listLength() || job->batch->listLength() ||
+            !job->scan_done) break;
+        if (job->atomic && job->state != MIGRATE_SLOT_DONE) {
+            migrateSlotCutover(job);
+            break;
+        }
+        if (job->pending->listLength()) break;
+
+        /* Keys added to the slot after they were scanned: scan again. */
+        if (!job->copy && countKeysInSlot(job->slot)) {
+            job->cursor = 0;
+            job->scan_done = 0;
+            continue;
+        }
+        migrateSlotFinish(job,NULL);
+        return;
+    }
+
+    if (job->outpos < sdslen(job->outbuf) &&
+        server.el->aeCreateFileEvent(job->fd,AE_WRITABLE,
+            migrateSlotWriteHandler,job) == AE_ERR)
+    {
+        migrateSlotFinish(job,"IOERR error or timeout writing to target instance");
+    }
+}
+
+/* Fail the jobs that did not make progress in their timeout. */
+void migrateSlotCron() {
+    listNode *ln;
+    mstime_t now = mstime();
+
+    listIter li(server.migrate_slot_jobs);
+    while((ln = li.listNext())) {
+        migrateSlotJob *job = (migrateSlotJob *)ln->listNodeValue();
+
+        if (now - job->lastio > job->timeout)
+            migrateSlotFinish(job,job->connected ?
+                "IOERR error or timeout reading to target instance" :
+                "IOERR error or timeout connecting to the client");
+    }
+}
+
+/* Start the migration of 'slot' for MIGRATE ... SLOT, blocking the client. */
+void migrateSlotCommand(client *c, int slot, long dbid, long timeout,
+                        int copy, int replace, int atomic)
+{
+    clusterNode *target = NULL;
+    listNode *ln;
+    int fd;
+
+    if (!server.cluster_enabled) {
+        c->addReplyError("MIGRATE SLOT requires cluster support enabled");
+        return;
+    }
+    if (c->m_flags & (CLIENT_MULTI|CLIENT_LUA)) {
+        c->addReplyError("MIGRATE SLOT can't be called in MULTI or scripts");
+        return;
+    }
+    listIter li(server.migrate_slot_jobs);
+    while((ln = li.listNext())) {
+        migrateSlotJob *job = (migrateSlotJob *)ln->listNodeValue();
+        if (job->slot == slot) {
+            c->addReplyErrorFormat("Slot %d is already being migrated",slot);
+            return;
+        }
+    }
+    if (countKeysInSlot(slot) == 0) {
+        c->addReplySds(sdsnew("+NOKEY\r\n"));
+        return;
+    }
+    if (atomic) {
+        dictIterator di(server.cluster->m_nodes);
+        dictEntry *de;
+        int port = atoi((const char*)c->m_argv[2]->ptr);
+
+        while((de = di.dictNext()) != NULL) {
+            clusterNode *node = (clusterNode *)de->dictGetVal();
+            if (!strcasecmp(node->m_ip,(const char*)c->m_argv[1]->ptr) &&
+                node->m_port == port)
+            {
+                target = node;
+                break;
+            }
+        }
+        if (target == NULL || target == myself) {
+            c->addReplyError("MIGRATE SLOT ATOMIC target must be another "
+                             "node of the cluster");
+            return;
+        }
+        if (server.cluster->m_slots[slot] != myself) {
+            c->addReplyErrorFormat("I'm not the owner of hash slot %d",slot);
+            return;
+        }
+        /* The target has a copy of the keys until the slot flips. */
+        copy = 1;
+        replace = 1;
+    }
+
+    fd = anetTcpNonBlockConnect((char*)server.neterr, (char*)c->m_argv[1]->ptr,
+                                atoi((const char*)c->m_argv[2]->ptr));
+    if (fd == -1) {
+        c->addReplyErrorFormat("Can't connect to target node: %s",
+            server.neterr);
+        return;
+    }
+    anetEnableTcpNoDelay(server.neterr,fd);
+
+    migrateSlotJob *job = (migrateSlotJob *)zcalloc(sizeof(*job));
+    job->c = c;
+    job->db = c->m_cur_selected_db;
+    job->slot = slot;
+    job->dbid = dbid;
+    job->timeout = timeout;
+    job->copy = copy;
+    job->replace = replace;
+    job->atomic = atomic;
+    job->state = MIGRATE_SLOT_SNAPSHOT;
+    if (atomic) {
+        memcpy(job->target,target->m_name,CLUSTER_NAMELEN);
+        job->queued = dictCreate(&setDictType,NULL);
+    }
+    job->fd = fd;
+    job->batch = listCreate();
+    job->retry = listCreate();
+    job->pending = listCreate();
+    job->inflight = dictCreate(&slotKeysDictType,NULL);
+    job->sent = copy ? dictCreate(&setDictType,NULL) : NULL;
+    job->outbuf = sdsempty();
+    job->inbuf = sdsempty();
+    job->lastio = mstime();
+    server.migrate_slot_jobs->listAddNodeTail(job);
+
+    /* The SELECT reply is the first one. */
+    rioBufferIO cmd(sdsempty());
+    serverAssert(cmd.rioWriteBulkCount('*',2));
+    serverAssert(cmd.rioWriteBulkString("SELECT",6));
+    serverAssert(cmd.rioWriteBulkLongLong(dbid));
+    migrateSlotAppend(job,cmd.m_ptr,1,0);
+    sdsfree(cmd.m_ptr);
+
+    c->m_blocking_state.m_timeout = 0;
+    c->m_blocking_state.m_migrate_job = job;
+    blockClient(c,BLOCKED_MIGRATE);
+
+    if (server.el->aeCreateFileEvent(fd,AE_WRITABLE,
+            migrateSlotConnectHandler,job) == AE_ERR)
+    {
+        migrateSlotFinish(job,"IOERR error or timeout connecting to the client");
+    }
+}
+
 /* -----------------------------------------------------------------------------
  * Cluster functions related to serving / redirecting clients
  * -------------------------------------------------------------------------- */
@@ -5221,10 +6616,33 @@ clusterNode *getNodeByQuery(client *c, struct redisCommand *cmd, robj **argv, in
     multiState *ms, _ms;
     multiCmd mc;
     int i, slot = 0, migrating_slot = 0, importing_slot = 0, missing_keys = 0;
+    /* Shard channels are routed like keys, but they are not in the
+     * keyspace, and any node of the shard can serve them. */
+    int is_pubsubshard = cmd->proc == ssubscribeCommand ||
+                         cmd->proc == sunsubscribeCommand ||
+                         cmd->proc == spublishCommand;
 
     /* Set error code optimistically for the base case. */
     if (error_code) *error_code = CLUSTER_REDIR_NONE;
 
+    /* Fast path: a command with a single key, while no slot is migrating or
+     * importing, is served by the owner of the slot of the key, with no need
+     * to extract the keys or to check which ones we have. */
+    if (server.cluster->m_open_slots == 0 && cmd->proc != execCommand &&
+        cmd->firstkey > 0 && cmd->firstkey == cmd->lastkey &&
+        cmd->getkeys_proc == NULL && !(cmd->m_flags & CMD_MODULE_GETKEYS) &&
+        cmd->firstkey < argc)
+    {
+        firstkey = argv[cmd->firstkey];
+        slot = keyHashSlot((char*)firstkey->ptr,sdslen((sds)firstkey->ptr));
+        n = server.cluster->m_slots[slot];
+        if (n == NULL) {
+            if (error_code) *error_code = CLUSTER_REDIR_DOWN_UNBOUND;
+            return NULL;
+        }
+        goto route;
+    }
+
     /* We handle all the cases as if they were EXEC commands, so we have
      * a common code path for everything */
     if (cmd->proc == execCommand) {
@@ -5310,7 +6728,7 @@ clusterNode *getNodeByQuery(client *c, struct redisCommand *cmd, robj **argv, in
             }
 
             /* Migarting / Improrting slot? Count keys we don't have. */
-            if ((migrating_slot || importing_slot) &&
+            if ((migrating_slot || importing_slot) && !is_pubsubshard &&
                 lookupKeyRead(&server.db[0],thiskey) == NULL)
             {
                 missing_keys++;
@@ -5323,6 +6741,7 @@ clusterNode *getNodeByQuery(client *c, struct redisCommand *cmd, robj **argv, in
      * without redirections or errors in all the cases. */
     if (n == NULL) return myself;
 
+route:
     /* Cluster is globally down but we got keys? We can't serve the request. */
     if (server.cluster->m_state != CLUSTER_OK) {
         if (error_code) *error_code = CLUSTER_REDIR_DOWN_STATE;
@@ -5363,8 +6782,8 @@ clusterNode *getNodeByQuery(client *c, struct redisCommand *cmd, robj **argv, in
     /* Handle the read-only client case reading from a slave: if this
      * node is a slave and the request is about an hash slot our master
      * is serving, we can reply without redirection. */
-    if (c->m_flags & CLIENT_READONLY &&
-        cmd->m_flags & CMD_READONLY &&
+    if (((c->m_flags & CLIENT_READONLY && cmd->m_flags & CMD_READONLY) ||
+         is_pubsubshard) &&
         myself->nodeIsSlave() &&
         myself->m_slaveof == n)
     {
@@ -5420,7 +6839,10 @@ void clusterRedirectClient(client *c, clusterNode *n, int hashslot, int error_co
  * longer handles, the client is sent a redirection error, and the function
  * returns 1. Otherwise 0 is returned and no operation is performed. */
 int clusterRedirectBlockedClientIfNeeded(client *c) {
-    if (c->m_flags & CLIENT_BLOCKED && c->m_blocking_op_type == BLOCKED_LIST) {
+    if (c->m_flags & CLIENT_BLOCKED &&
+        (c->m_blocking_op_type == BLOCKED_LIST ||
+         c->m_blocking_op_type == BLOCKED_STREAM))
+    {
         dictEntry *de;
 
         /* If the cluster is down, unblock the client with the right error. */
@@ -21,6 +21,8 @@
 #define CLUSTER_FAIL_UNDO_TIME_ADD 10 /* Some additional time. */
 #define CLUSTER_FAILOVER_DELAY 5 /* Seconds */
 #define CLUSTER_DEFAULT_MIGRATION_BARRIER 1
+#define CLUSTER_DEFAULT_MIGRATE_INFLIGHT_BYTES (16*1024*1024)
+#define CLUSTER_DEFAULT_BUS_COMPACT 1
 #define CLUSTER_MF_TIMEOUT 5000 /* Milliseconds to do a manual failover. */
 #define CLUSTER_MF_PAUSE_MULT 2 /* Master pause manual failover mult. */
 #define CLUSTER_SLAVE_MIGRATION_DELAY 5000 /* Delay for slave migration. */
@@ -35,6 +37,7 @@
 #define CLUSTER_REDIR_DOWN_UNBOUND 6  /* -CLUSTERDOWN, unbound slot. */
 
 struct clusterNode;
+struct clusterMsgDataGossip;
 
 /* clusterLink encapsulates everything needed to talk with a remote node. */
 class clusterLink
@@ -50,6 +53,15 @@ public:
     sds m_sndbuf;                 /* Packet send buffer */
     sds m_rcvbuf;                 /* Packet reception buffer */
     clusterNode *m_node;   /* Node related to this link if any, or NULL */
+    int m_compact;                /* Peer accepts compact messages. */
+    unsigned char *m_slots_sent;  /* Slots of the last compact message sent. */
+    unsigned char *m_slots_rcvd;  /* Slots of the last compact message read. */
+    rax *m_gossip_ids;            /* Node name -> gossip index, sent side. */
+    clusterMsgDataGossip *m_gossip_sent; /* Last entry sent for every index. */
+    clusterMsgDataGossip *m_gossip_rcvd; /* Last entry read for every index. */
+    unsigned int m_gossip_sent_count;
+    unsigned int m_gossip_rcvd_count;
+    tlsHandshake *m_tls;          /* TLS handshake in progress, or NULL. */
 };
 
 /* Cluster node flags and macros. */
@@ -77,6 +89,7 @@ public:
 #define CLUSTER_TODO_UPDATE_STATE (1<<1)
 #define CLUSTER_TODO_SAVE_CONFIG (1<<2)
 #define CLUSTER_TODO_FSYNC_CONFIG (1<<3)
+#define CLUSTER_TODO_UPDATE_PUBSUBSHARD (1<<4)
 
 /* Message types.
  *
@@ -93,7 +106,8 @@ public:
 #define CLUSTERMSG_TYPE_FAILOVER_AUTH_ACK 6     /* Yes, you have my vote */
 #define CLUSTERMSG_TYPE_UPDATE 7        /* Another node slots configuration */
 #define CLUSTERMSG_TYPE_MFSTART 8       /* Pause clients for manual failover */
-#define CLUSTERMSG_TYPE_COUNT 9         /* Total number of message types. */
+#define CLUSTERMSG_TYPE_PUBLISHSHARD 9  /* Pub/Sub Publish shard propagation */
+#define CLUSTERMSG_TYPE_COUNT 10        /* Total number of message types. */
 
 /* This structure represent elements of node->fail_reports. */
 struct clusterNodeFailReport {
@@ -149,6 +163,8 @@ public:
     int m_cport;                  /* Latest known cluster port of this node. */
     clusterLink *m_link;          /* TCP/IP link with this node */
     list *m_fail_reports;         /* List of nodes signaling this as failing */
+    sds m_slots_info;             /* Slot ranges of CLUSTER NODES, cached
+                                     until the slots change, or NULL. */
 };
 
 struct clusterState {
@@ -161,8 +177,7 @@ struct clusterState {
     clusterNode *m_migrating_slots_to[CLUSTER_SLOTS];
     clusterNode *m_importing_slots_from[CLUSTER_SLOTS];
     clusterNode *m_slots[CLUSTER_SLOTS];
-    uint64_t m_slots_keys_count[CLUSTER_SLOTS];
-    rax *m_slots_to_keys;
+    int m_open_slots;       /* Slots in migrating or importing state. */
     /* The following fields are used to take the slave state on elections. */
     mstime_t m_failover_auth_time; /* Time of previous or next election. */
     int m_failover_auth_count;    /* Number of votes received so far. */
@@ -187,8 +202,11 @@ struct clusterState {
     /* Messages received and sent by type. */
     long long m_stats_bus_messages_sent[CLUSTERMSG_TYPE_COUNT];
     long long m_stats_bus_messages_received[CLUSTERMSG_TYPE_COUNT];
+    long long m_stats_bus_compact_sent; /* Messages sent in compact form. */
     long long m_stats_pfail_nodes;    /* Number of nodes in PFAIL status,
                                        excluding nodes without address. */
+    sds m_slots_reply;      /* CLUSTER SLOTS reply, cached until the cluster
+                               config changes, or NULL. */
 };
 
 /* Redis cluster messages header */
@@ -283,6 +301,7 @@ struct clusterMsg {
 #define CLUSTERMSG_FLAG0_PAUSED (1<<0) /* Master paused for manual failover. */
 #define CLUSTERMSG_FLAG0_FORCEACK (1<<1) /* Give ACK to AUTH_REQUEST even if
                                             master is up. */
+#define CLUSTERMSG_FLAG0_COMPACT (1<<2) /* Sender accepts compact messages. */
 
 /* ---------------------- API exported outside cluster.c -------------------- */
 clusterNode *getNodeByQuery(client *c, struct redisCommand *cmd, robj **argv, int argc, int *hashslot, int *ask);
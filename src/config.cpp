@@ -30,6 +30,12 @@
 
 #include "server.h"
 #include "cluster.h"
+#include "bio.h"
+#include "hotkeys.h"
+#include "trace.h"
+#include "memprefix.h"
+#include "allocstats.h"
+#include "placement.h"
 
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -51,6 +57,8 @@ configEnum maxmemory_policy_enum[] = {
     {"allkeys-lru",MAXMEMORY_ALLKEYS_LRU},
     {"allkeys-lfu",MAXMEMORY_ALLKEYS_LFU},
     {"allkeys-random",MAXMEMORY_ALLKEYS_RANDOM},
+    {"volatile-gdsf",MAXMEMORY_VOLATILE_GDSF},
+    {"allkeys-gdsf",MAXMEMORY_ALLKEYS_GDSF},
     {"noeviction",MAXMEMORY_NO_EVICTION},
     {NULL, 0}
 };
@@ -84,6 +92,45 @@ configEnum supervised_mode_enum[] = {
     {NULL, 0}
 };
 
+configEnum hash_function_enum[] = {
+    {"siphash", DICT_HASH_SIPHASH},
+    {"wyhash", DICT_HASH_WYHASH},
+    {NULL, 0}
+};
+
+configEnum list_node_container_enum[] = {
+    {"ziplist", QUICKLIST_NODE_CONTAINER_ZIPLIST},
+    {"listpack", QUICKLIST_NODE_CONTAINER_LISTPACK},
+    {NULL, 0}
+};
+
+configEnum list_node_container_conversion_enum[] = {
+    {"lazy", LIST_CONVERSION_LAZY},
+    {"background", LIST_CONVERSION_BACKGROUND},
+    {NULL, 0}
+};
+
+configEnum rdb_compression_codec_enum[] = {
+    {"lzf", RDB_ENC_LZF},
+    {"lz4", RDB_ENC_LZ4},
+    {"zstd", RDB_ENC_ZSTD},
+    {NULL, 0}
+};
+
+configEnum rdb_bypass_cache_enum[] = {
+    {"no", RDB_BYPASS_CACHE_NO},
+    {"fadvise", RDB_BYPASS_CACHE_FADVISE},
+    {"odirect", RDB_BYPASS_CACHE_ODIRECT},
+    {NULL, 0}
+};
+
+configEnum numa_bind_enum[] = {
+    {"no", NUMA_BIND_NO},
+    {"preferred", NUMA_BIND_PREFERRED},
+    {"bind", NUMA_BIND_STRICT},
+    {NULL, 0}
+};
+
 configEnum aof_fsync_enum[] = {
     {"everysec", AOF_FSYNC_EVERYSEC},
     {"always", AOF_FSYNC_ALWAYS},
@@ -221,6 +268,40 @@ void loadServerConfigFromString(char *config) {
             if (server.port < 0 || server.port > 65535) {
                 err = "Invalid port"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"metrics-port") && argc == 2) {
+            server.metrics_port = atoi(argv[1]);
+            if (server.metrics_port < 0 || server.metrics_port > 65535) {
+                err = "Invalid metrics port"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"tls-port") && argc == 2) {
+            server.tls_port = atoi(argv[1]);
+            if (server.tls_port < 0 || server.tls_port > 65535) {
+                err = "Invalid TLS port"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"tls-cert-file") && argc == 2) {
+            zfree(server.tls_cert_file);
+            server.tls_cert_file = zstrdup(argv[1]);
+        } else if (!strcasecmp(argv[0],"tls-key-file") && argc == 2) {
+            zfree(server.tls_key_file);
+            server.tls_key_file = zstrdup(argv[1]);
+        } else if (!strcasecmp(argv[0],"tls-ca-cert-file") && argc == 2) {
+            zfree(server.tls_ca_cert_file);
+            server.tls_ca_cert_file = zstrdup(argv[1]);
+        } else if (!strcasecmp(argv[0],"tls-replication") && argc == 2) {
+            if ((server.tls_replication = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"tls-cluster") && argc == 2) {
+            if ((server.tls_cluster = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"tls-handshake-threads") && argc == 2) {
+            server.tls_handshake_threads = atoi(argv[1]);
+            if (server.tls_handshake_threads < 1 ||
+                server.tls_handshake_threads > CONFIG_MAX_TLS_HANDSHAKE_THREADS)
+            {
+                err = "Invalid number of TLS handshake threads"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"tcp-backlog") && argc == 2) {
             server.tcp_backlog = atoi(argv[1]);
             if (server.tcp_backlog < 0) {
@@ -328,6 +409,31 @@ void loadServerConfigFromString(char *config) {
                 err = "maxmemory-samples must be 1 or greater";
                 goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"maxmemory-headroom") && argc == 2) {
+            server.maxmemory_headroom = atoi(argv[1]);
+            if (server.maxmemory_headroom < 0 || server.maxmemory_headroom > 50) {
+                err = "maxmemory-headroom must be between 0 and 50";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"maxmemory-headroom-budget-us") && argc == 2) {
+            server.maxmemory_headroom_budget_us = atoi(argv[1]);
+            if (server.maxmemory_headroom_budget_us < 1 || server.maxmemory_headroom_budget_us > 1000000) {
+                err = "maxmemory-headroom-budget-us must be between 1 and 1000000";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"tiering") && argc == 2) {
+            if ((server.tiering = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"tiering-dir") && argc == 2) {
+            zfree(server.tiering_dir);
+            server.tiering_dir = zstrdup(argv[1]);
+        } else if (!strcasecmp(argv[0],"tiering-max-size") && argc == 2) {
+            server.tiering_max_size = memtoll(argv[1],NULL);
+            if (server.tiering_max_size < 0) {
+                err = "tiering-max-size must be 0 or greater";
+                goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"lfu-log-factor") && argc == 2) {
             server.lfu_log_factor = atoi(argv[1]);
             if (server.lfu_log_factor < 0) {
@@ -365,12 +471,24 @@ void loadServerConfigFromString(char *config) {
             if ((server.repl_diskless_sync = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"repl-compression") && argc==2) {
+            if ((server.repl_compression = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"repl-diskless-sync-delay") && argc==2) {
             server.repl_diskless_sync_delay = atoi(argv[1]);
             if (server.repl_diskless_sync_delay < 0) {
                 err = "repl-diskless-sync-delay can't be negative";
                 goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"repl-diskless-resume-window") &&
+                   argc == 2)
+        {
+            server.repl_diskless_resume_window = atoi(argv[1]);
+            if (server.repl_diskless_resume_window < 0) {
+                err = "repl-diskless-resume-window can't be negative";
+                goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"repl-backlog-size") && argc == 2) {
             long long size = memtoll(argv[1],NULL);
             if (size <= 0) {
@@ -378,6 +496,12 @@ void loadServerConfigFromString(char *config) {
                 goto loaderr;
             }
             resizeReplicationBacklog(size);
+        } else if (!strcasecmp(argv[0],"repl-backlog-disk-size") && argc == 2) {
+            server.repl_backlog_disk_size = memtoll(argv[1],NULL);
+            if (server.repl_backlog_disk_size < 0) {
+                err = "repl-backlog-disk-size can't be negative";
+                goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"repl-backlog-ttl") && argc == 2) {
             server.repl_backlog_time_limit = atoi(argv[1]);
             if (server.repl_backlog_time_limit < 0) {
@@ -399,10 +523,63 @@ void loadServerConfigFromString(char *config) {
             if ((server.rdb_compression = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"rdb-compression-codec") && argc == 2) {
+            server.rdb_compression_codec =
+                configEnumGetValue(rdb_compression_codec_enum,argv[1]);
+
+            if (server.rdb_compression_codec == INT_MIN) {
+                err = "Invalid option for 'rdb-compression-codec'. "
+                    "Allowed values: 'lzf', 'lz4' or 'zstd'";
+                goto loaderr;
+            }
+            if (!rdbCompressionAvailable(server.rdb_compression_codec)) {
+                err = "This 'rdb-compression-codec' is not available: "
+                    "build Redis with USE_LZ4=yes or USE_ZSTD=yes";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"rdb-compress-chunks") && argc == 2) {
+            if ((server.rdb_compress_chunks = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"rdbchecksum") && argc == 2) {
             if ((server.rdb_checksum = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"rdb-save-bypass-cache") && argc == 2) {
+            server.rdb_save_bypass_cache =
+                configEnumGetValue(rdb_bypass_cache_enum,argv[1]);
+
+            if (server.rdb_save_bypass_cache == INT_MIN) {
+                err = "Invalid option for 'rdb-save-bypass-cache'. "
+                    "Allowed values: 'no', 'fadvise' or 'odirect'";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"rdb-load-mmap") && argc == 2) {
+            if ((server.rdb_load_mmap = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"lazy-loading") && argc == 2) {
+            if ((server.lazy_loading = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"rdb-save-forkless") && argc == 2) {
+            if ((server.rdb_save_forkless = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"rdb-load-threads") && argc == 2) {
+            server.rdb_load_threads = atoi(argv[1]);
+            if (server.rdb_load_threads < 1 ||
+                server.rdb_load_threads > RDB_LOAD_MAX_THREADS)
+            {
+                err = "Invalid number of RDB load threads"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"rdb-save-threads") && argc == 2) {
+            server.rdb_save_threads = atoi(argv[1]);
+            if (server.rdb_save_threads < 1 ||
+                server.rdb_save_threads > RDB_SAVE_MAX_THREADS)
+            {
+                err = "Invalid number of RDB save threads"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"activerehashing") && argc == 2) {
             if ((server.activerehashing = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
@@ -415,22 +592,119 @@ void loadServerConfigFromString(char *config) {
             if ((server.lazyfree_lazy_expire = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"active-expire-index") && argc == 2) {
+            if ((server.active_expire_index = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"keyspace-index") && argc == 2) {
+            if ((server.keyspace_index = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"lazyfree-lazy-server-del") && argc == 2){
             if ((server.lazyfree_lazy_server_del = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"lazyfree-auto-threshold") && argc == 2) {
+            server.lazyfree_auto_threshold = strtoll(argv[1],NULL,10);
+            if (server.lazyfree_auto_threshold < 0) {
+                err = "Invalid lazyfree-auto-threshold"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"keys-job-threshold") && argc == 2) {
+            server.keys_job_threshold = strtoll(argv[1],NULL,10);
+            if (server.keys_job_threshold < 0) {
+                err = "Invalid keys-job-threshold"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"bgread-threshold") && argc == 2) {
+            server.bgread_threshold = strtoll(argv[1],NULL,10);
+            if (server.bgread_threshold < 0) {
+                err = "Invalid bgread-threshold"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"reply-stream-threshold") && argc == 2) {
+            server.reply_stream_threshold = strtoll(argv[1],NULL,10);
+            if (server.reply_stream_threshold < 0) {
+                err = "Invalid reply-stream-threshold"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"lazyfree-threads") && argc == 2) {
+            server.lazyfree_threads = atoi(argv[1]);
+            if (server.lazyfree_threads < 1 ||
+                server.lazyfree_threads > BIO_MAX_THREADS_PER_OP)
+            {
+                err = "Invalid number of lazyfree threads"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"slave-lazy-flush") && argc == 2) {
             if ((server.repl_slave_lazy_flush = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"slave-fast-ack") && argc == 2) {
+            if ((server.slave_fast_ack = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"repl-async-load") && argc == 2) {
+            if ((server.repl_async_load = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"repl-diskless-load") && argc == 2) {
+            if ((server.repl_diskless_load = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"activedefrag") && argc == 2) {
             if ((server.active_defrag_enabled = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"huge-pages") && argc == 2) {
+            if ((server.huge_pages = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"transient-arena") && argc == 2) {
+            if ((server.transient_arena = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"daemonize") && argc == 2) {
             if ((server.daemonize = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"io-threads") && argc == 2) {
+            server.io_threads_num = atoi(argv[1]);
+            if (server.io_threads_num < 1 || server.io_threads_num > IO_THREADS_MAX_NUM) {
+                err = "Invalid number of io threads"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"io-threads-do-reads") && argc == 2) {
+            if ((server.io_threads_do_reads = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"slave-parallel-reads") && argc == 2) {
+            if ((server.slave_parallel_reads = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"io-threads-shards") && argc == 2) {
+            if ((server.io_threads_shards = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"tcp-listeners") && argc == 2) {
+            server.tcp_listeners = atoi(argv[1]);
+            if (server.tcp_listeners < 1 || server.tcp_listeners > CONFIG_MAX_TCP_LISTENERS) {
+                err = "Invalid number of TCP listeners"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"active-rehashing-budget-us") && argc == 2) {
+            server.active_rehashing_budget_us = atoi(argv[1]);
+            if (server.active_rehashing_budget_us < 0 || server.active_rehashing_budget_us > 1000000) {
+                err = "active-rehashing-budget-us must be between 0 and 1000000"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"busy-poll-us") && argc == 2) {
+            server.busy_poll_us = atoi(argv[1]);
+            if (server.busy_poll_us < 0 || server.busy_poll_us > 1000000) {
+                err = "busy-poll-us must be between 0 and 1000000"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"busy-poll-max-cpu") && argc == 2) {
+            server.busy_poll_max_cpu = atoi(argv[1]);
+            if (server.busy_poll_max_cpu < 1 || server.busy_poll_max_cpu > 100) {
+                err = "busy-poll-max-cpu must be between 1 and 100"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"busy-poll-socket-us") && argc == 2) {
+            server.busy_poll_socket_us = atoi(argv[1]);
+            if (server.busy_poll_socket_us < 0 || server.busy_poll_socket_us > 1000000) {
+                err = "busy-poll-socket-us must be between 0 and 1000000"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"hz") && argc == 2) {
             server.hz = atoi(argv[1]);
             if (server.hz < CONFIG_MIN_HZ) server.hz = CONFIG_MIN_HZ;
@@ -487,6 +761,22 @@ void loadServerConfigFromString(char *config) {
             if ((server.aof_use_rdb_preamble = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"aof-group-commit") && argc == 2) {
+            if ((server.aof_group_commit = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"aof-load-prefetch") && argc == 2) {
+            if ((server.aof_load_prefetch = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"aof-binary-format") && argc == 2) {
+            if ((server.aof_binary_format = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"aof-multi-part") && argc == 2) {
+            if ((server.aof_multi_part = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"requirepass") && argc == 2) {
             if (strlen(argv[1]) > CONFIG_AUTHPASS_MAX_LEN) {
                 err = "Password is longer than CONFIG_AUTHPASS_MAX_LEN";
@@ -496,6 +786,26 @@ void loadServerConfigFromString(char *config) {
         } else if (!strcasecmp(argv[0],"pidfile") && argc == 2) {
             zfree(server.pidfile);
             server.pidfile = zstrdup(argv[1]);
+        } else if ((!strcasecmp(argv[0],"server-cpulist") ||
+                    !strcasecmp(argv[0],"bio-cpulist") ||
+                    !strcasecmp(argv[0],"io-threads-cpulist")) && argc == 2)
+        {
+            char **cpulist = !strcasecmp(argv[0],"server-cpulist") ?
+                &server.server_cpulist : !strcasecmp(argv[0],"bio-cpulist") ?
+                &server.bio_cpulist : &server.io_threads_cpulist;
+            if (!cpuListIsValid(argv[1])) {
+                err = "Invalid CPU list, the format is like 0,2,4-7,16-31:2";
+                goto loaderr;
+            }
+            zfree(*cpulist);
+            *cpulist = zstrdup(argv[1]);
+        } else if (!strcasecmp(argv[0],"numa-bind") && argc == 2) {
+            server.numa_bind = configEnumGetValue(numa_bind_enum,argv[1]);
+            if (server.numa_bind == INT_MIN) {
+                err = "Invalid option for 'numa-bind'. "
+                    "Allowed values: 'no', 'preferred' or 'bind'";
+                goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"dbfilename") && argc == 2) {
             if (!pathIsBaseName(argv[1])) {
                 err = "dbfilename can't be a path, just a filename";
@@ -533,6 +843,24 @@ void loadServerConfigFromString(char *config) {
                 err = "active-defrag-cycle-max must be between 1 and 99";
                 goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"active-defrag-max-scan-fields") && argc == 2) {
+            server.active_defrag_max_scan_fields = strtoll(argv[1],NULL,10);
+            if (server.active_defrag_max_scan_fields < 1) {
+                err = "active-defrag-max-scan-fields must be 1 or greater";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"active-expire-cycle-min") && argc == 2) {
+            server.active_expire_cycle_min = atoi(argv[1]);
+            if (server.active_expire_cycle_min < 1 || server.active_expire_cycle_min > 99) {
+                err = "active-expire-cycle-min must be between 1 and 99";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"active-expire-cycle-max") && argc == 2) {
+            server.active_expire_cycle_max = atoi(argv[1]);
+            if (server.active_expire_cycle_max < 1 || server.active_expire_cycle_max > 99) {
+                err = "active-expire-cycle-max must be between 1 and 99";
+                goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"hash-max-ziplist-entries") && argc == 2) {
             server.hash_max_ziplist_entries = memtoll(argv[1], NULL);
         } else if (!strcasecmp(argv[0],"hash-max-ziplist-value") && argc == 2) {
@@ -547,12 +875,49 @@ void loadServerConfigFromString(char *config) {
             server.list_compress_depth = atoi(argv[1]);
         } else if (!strcasecmp(argv[0],"set-max-intset-entries") && argc == 2) {
             server.set_max_intset_entries = memtoll(argv[1], NULL);
+        } else if (!strcasecmp(argv[0],"set-algebra-threads") && argc == 2) {
+            server.set_algebra_threads = atoi(argv[1]);
+            if (server.set_algebra_threads < 1 ||
+                server.set_algebra_threads > SET_ALGEBRA_MAX_THREADS)
+            {
+                err = "Invalid number of set algebra threads"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"set-algebra-parallel-threshold") && argc == 2) {
+            server.set_algebra_parallel_threshold = memtoll(argv[1], NULL);
         } else if (!strcasecmp(argv[0],"zset-max-ziplist-entries") && argc == 2) {
             server.zset_max_ziplist_entries = memtoll(argv[1], NULL);
         } else if (!strcasecmp(argv[0],"zset-max-ziplist-value") && argc == 2) {
             server.zset_max_ziplist_value = memtoll(argv[1], NULL);
+        } else if (!strcasecmp(argv[0],"zset-max-skiplist-entries") && argc == 2) {
+            server.zset_max_skiplist_entries = memtoll(argv[1], NULL);
+        } else if (!strcasecmp(argv[0],"adaptive-encoding-hot-counter") &&
+                   argc == 2)
+        {
+            server.adaptive_encoding_hot_counter = strtoll(argv[1],NULL,10);
+            if (server.adaptive_encoding_hot_counter < 0 ||
+                server.adaptive_encoding_hot_counter > 255)
+            {
+                err = "Invalid adaptive-encoding-hot-counter"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"adaptive-encoding-cold-seconds") &&
+                   argc == 2)
+        {
+            server.adaptive_encoding_cold_seconds = strtoll(argv[1],NULL,10);
+            if (server.adaptive_encoding_cold_seconds < 0) {
+                err = "Invalid adaptive-encoding-cold-seconds"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"stream-node-max-bytes") && argc == 2) {
+            server.stream_node_max_bytes = memtoll(argv[1], NULL);
+        } else if (!strcasecmp(argv[0],"stream-node-max-entries") && argc == 2) {
+            if ((server.stream_node_max_entries = atoll(argv[1])) < 0) {
+                err = "Invalid stream-node-max-entries"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"hll-sparse-max-bytes") && argc == 2) {
             server.hll_sparse_max_bytes = memtoll(argv[1], NULL);
+        } else if (!strcasecmp(argv[0],"bitmap-chunked-min-bytes") && argc == 2) {
+            server.bitmap_chunked_min_bytes = memtoll(argv[1], NULL);
+        } else if (!strcasecmp(argv[0],"string-compression-min-bytes") && argc == 2) {
+            server.string_compression_min_bytes = memtoll(argv[1], NULL);
         } else if (!strcasecmp(argv[0],"rename-command") && argc == 3) {
             struct redisCommand *cmd = lookupCommand(argv[1]);
             int retval;
@@ -603,6 +968,10 @@ void loadServerConfigFromString(char *config) {
             {
                 err = "Invalid port"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"cluster-bus-compact") && argc == 2) {
+            if ((server.cluster_bus_compact = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"cluster-require-full-coverage") &&
                     argc == 2)
         {
@@ -623,6 +992,14 @@ void loadServerConfigFromString(char *config) {
                 err = "cluster migration barrier must zero or positive";
                 goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"cluster-migrate-inflight-bytes")
+                   && argc == 2)
+        {
+            server.cluster_migrate_inflight_bytes = memtoll(argv[1],NULL);
+            if (server.cluster_migrate_inflight_bytes <= 0) {
+                err = "cluster-migrate-inflight-bytes must be 1 or greater";
+                goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"cluster-slave-validity-factor")
                    && argc == 2)
         {
@@ -633,10 +1010,59 @@ void loadServerConfigFromString(char *config) {
             }
         } else if (!strcasecmp(argv[0],"lua-time-limit") && argc == 2) {
             server.lua_time_limit = strtoll(argv[1],NULL,10);
+        } else if (!strcasecmp(argv[0],"lua-parallel-scripts") && argc == 2) {
+            if ((server.lua_parallel_scripts = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"slowlog-log-slower-than") &&
                    argc == 2)
         {
             server.slowlog_log_slower_than = strtoll(argv[1],NULL,10);
+        } else if (!strcasecmp(argv[0],"hotkeys-top-k") && argc == 2) {
+            server.hotkeys_top_k = strtoll(argv[1],NULL,10);
+            if (server.hotkeys_top_k < 0 ||
+                server.hotkeys_top_k > HOTKEYS_MAX_TOP_K)
+            {
+                err = "Invalid hotkeys-top-k"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"trace-sample-rate") && argc == 2) {
+            server.trace_sample_rate = strtoll(argv[1],NULL,10);
+            if (server.trace_sample_rate < 0) {
+                err = "Invalid trace-sample-rate"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"trace-max-len") && argc == 2) {
+            server.trace_max_len = strtoll(argv[1],NULL,10);
+            if (server.trace_max_len < 1 ||
+                server.trace_max_len > TRACE_MAX_LEN)
+            {
+                err = "Invalid trace-max-len"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"memory-prefixes-scan-keys") &&
+                   argc == 2)
+        {
+            server.memory_prefixes_scan_keys = strtoll(argv[1],NULL,10);
+            if (server.memory_prefixes_scan_keys < 0) {
+                err = "Invalid memory-prefixes-scan-keys"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"memory-prefixes-delimiter") &&
+                   argc == 2)
+        {
+            if (argv[1][0] == '\0') {
+                err = "memory-prefixes-delimiter can't be empty"; goto loaderr;
+            }
+            zfree(server.memory_prefixes_delimiter);
+            server.memory_prefixes_delimiter = zstrdup(argv[1]);
+        } else if (!strcasecmp(argv[0],"alloc-profiler") && argc == 2) {
+            if ((server.alloc_profiler = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"tracking-table-max-keys") &&
+                   argc == 2)
+        {
+            server.tracking_table_max_keys = strtoll(argv[1],NULL,10);
+            if (server.tracking_table_max_keys < 0) {
+                err = "Invalid tracking-table-max-keys"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"latency-monitor-threshold") &&
                    argc == 2)
         {
@@ -713,6 +1139,35 @@ void loadServerConfigFromString(char *config) {
                     "Allowed values: 'upstart', 'systemd', 'auto', or 'no'";
                 goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"hash-function") && argc == 2) {
+            server.hash_function =
+                configEnumGetValue(hash_function_enum,argv[1]);
+
+            if (server.hash_function == INT_MIN) {
+                err = "Invalid option for 'hash-function'. "
+                    "Allowed values: 'siphash' or 'wyhash'";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"list-node-container") && argc == 2) {
+            server.list_node_container =
+                configEnumGetValue(list_node_container_enum,argv[1]);
+
+            if (server.list_node_container == INT_MIN) {
+                err = "Invalid option for 'list-node-container'. "
+                    "Allowed values: 'ziplist' or 'listpack'";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"list-node-container-conversion") &&
+                   argc == 2)
+        {
+            server.list_node_container_conversion =
+                configEnumGetValue(list_node_container_conversion_enum,argv[1]);
+
+            if (server.list_node_container_conversion == INT_MIN) {
+                err = "Invalid option for 'list-node-container-conversion'. "
+                    "Allowed values: 'lazy' or 'background'";
+                goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"loadmodule") && argc >= 2) {
             queueLoadModule(argv[1],&argv[2],argc-2);
         } else if (!strcasecmp(argv[0],"sentinel")) {
@@ -847,6 +1302,11 @@ void configSetCommand(client *c) {
     } config_set_special_field("masterauth") {
         zfree(server.masterauth);
         server.masterauth = ((char*)o->ptr)[0] ? zstrdup((const char *)o->ptr) : NULL;
+    } config_set_special_field("memory-prefixes-delimiter") {
+        if (((char*)o->ptr)[0] == '\0') goto badfmt;
+        zfree(server.memory_prefixes_delimiter);
+        server.memory_prefixes_delimiter = zstrdup((const char *)o->ptr);
+        memPrefixInit(1);
     } config_set_special_field("cluster-announce-ip") {
         zfree(server.cluster_announce_ip);
         server.cluster_announce_ip = ((char*)o->ptr)[0] ? zstrdup((const char *)o->ptr) : NULL;
@@ -987,18 +1447,34 @@ void configSetCommand(client *c) {
      * config_set_bool_field(name,var). */
     } config_set_bool_field(
       "rdbcompression", server.rdb_compression) {
+    } config_set_bool_field(
+      "rdb-compress-chunks", server.rdb_compress_chunks) {
+    } config_set_bool_field(
+      "rdb-load-mmap", server.rdb_load_mmap) {
+    } config_set_bool_field(
+      "rdb-save-forkless", server.rdb_save_forkless) {
     } config_set_bool_field(
       "repl-disable-tcp-nodelay",server.repl_disable_tcp_nodelay) {
     } config_set_bool_field(
       "repl-diskless-sync",server.repl_diskless_sync) {
+    } config_set_bool_field(
+      "repl-compression",server.repl_compression) {
     } config_set_bool_field(
       "cluster-require-full-coverage",server.cluster_require_full_coverage) {
+    } config_set_bool_field(
+      "cluster-bus-compact",server.cluster_bus_compact) {
     } config_set_bool_field(
       "aof-rewrite-incremental-fsync",server.aof_rewrite_incremental_fsync) {
     } config_set_bool_field(
       "aof-load-truncated",server.aof_load_truncated) {
     } config_set_bool_field(
       "aof-use-rdb-preamble",server.aof_use_rdb_preamble) {
+    } config_set_bool_field(
+      "aof-group-commit",server.aof_group_commit) {
+    } config_set_bool_field(
+      "aof-binary-format",server.aof_binary_format) {
+    } config_set_bool_field(
+      "aof-load-prefetch",server.aof_load_prefetch) {
     } config_set_bool_field(
       "slave-serve-stale-data",server.repl_serve_stale_data) {
     } config_set_bool_field(
@@ -1027,10 +1503,35 @@ void configSetCommand(client *c) {
       "lazyfree-lazy-expire",server.lazyfree_lazy_expire) {
     } config_set_bool_field(
       "lazyfree-lazy-server-del",server.lazyfree_lazy_server_del) {
+    } config_set_bool_field(
+      "active-expire-index",server.active_expire_index) {
+        expireIndexInit();
+    } config_set_bool_field(
+      "keyspace-index",server.keyspace_index) {
+        keyIndexInit();
+    } config_set_bool_field(
+      "io-threads-do-reads",server.io_threads_do_reads) {
+    } config_set_bool_field(
+      "slave-parallel-reads",server.slave_parallel_reads) {
+    } config_set_bool_field(
+      "lua-parallel-scripts",server.lua_parallel_scripts) {
+    } config_set_bool_field(
+      "io-threads-shards",server.io_threads_shards) {
     } config_set_bool_field(
       "slave-lazy-flush",server.repl_slave_lazy_flush) {
+    } config_set_bool_field(
+      "repl-async-load",server.repl_async_load) {
+    } config_set_bool_field(
+      "repl-diskless-load",server.repl_diskless_load) {
+    } config_set_bool_field(
+      "slave-fast-ack",server.slave_fast_ack) {
     } config_set_bool_field(
       "no-appendfsync-on-rewrite",server.aof_no_fsync_on_rewrite) {
+    } config_set_bool_field(
+      "tiering",server.tiering) {
+    } config_set_bool_field(
+      "alloc-profiler",server.alloc_profiler) {
+        allocStatsInit();
 
     /* Numerical fields.
      * config_set_numerical_field(name,var,min,max) */
@@ -1038,6 +1539,10 @@ void configSetCommand(client *c) {
       "tcp-keepalive",server.tcpkeepalive,0,LLONG_MAX) {
     } config_set_numerical_field(
       "maxmemory-samples",server.maxmemory_samples,1,LLONG_MAX) {
+    } config_set_numerical_field(
+      "maxmemory-headroom",server.maxmemory_headroom,0,50) {
+    } config_set_numerical_field(
+      "maxmemory-headroom-budget-us",server.maxmemory_headroom_budget_us,1,1000000) {
     } config_set_numerical_field(
       "lfu-log-factor",server.lfu_log_factor,0,LLONG_MAX) {
     } config_set_numerical_field(
@@ -1054,6 +1559,12 @@ void configSetCommand(client *c) {
       "active-defrag-cycle-min",server.active_defrag_cycle_min,1,99) {
     } config_set_numerical_field(
       "active-defrag-cycle-max",server.active_defrag_cycle_max,1,99) {
+    } config_set_numerical_field(
+      "active-defrag-max-scan-fields",server.active_defrag_max_scan_fields,1,LLONG_MAX) {
+    } config_set_numerical_field(
+      "active-expire-cycle-min",server.active_expire_cycle_min,1,99) {
+    } config_set_numerical_field(
+      "active-expire-cycle-max",server.active_expire_cycle_max,1,99) {
     } config_set_numerical_field(
       "auto-aof-rewrite-percentage",server.aof_rewrite_perc,0,LLONG_MAX){
     } config_set_numerical_field(
@@ -1066,12 +1577,30 @@ void configSetCommand(client *c) {
       "list-compress-depth",server.list_compress_depth,0,INT_MAX) {
     } config_set_numerical_field(
       "set-max-intset-entries",server.set_max_intset_entries,0,LLONG_MAX) {
+    } config_set_numerical_field(
+      "set-algebra-threads",server.set_algebra_threads,1,SET_ALGEBRA_MAX_THREADS) {
+    } config_set_numerical_field(
+      "set-algebra-parallel-threshold",server.set_algebra_parallel_threshold,0,LLONG_MAX) {
     } config_set_numerical_field(
       "zset-max-ziplist-entries",server.zset_max_ziplist_entries,0,LLONG_MAX) {
     } config_set_numerical_field(
       "zset-max-ziplist-value",server.zset_max_ziplist_value,0,LLONG_MAX) {
+    } config_set_numerical_field(
+      "zset-max-skiplist-entries",server.zset_max_skiplist_entries,0,LLONG_MAX) {
+    } config_set_numerical_field(
+      "adaptive-encoding-hot-counter",server.adaptive_encoding_hot_counter,0,255) {
+    } config_set_numerical_field(
+      "adaptive-encoding-cold-seconds",server.adaptive_encoding_cold_seconds,0,LLONG_MAX) {
+    } config_set_numerical_field(
+      "stream-node-max-bytes",server.stream_node_max_bytes,0,LLONG_MAX) {
+    } config_set_numerical_field(
+      "stream-node-max-entries",server.stream_node_max_entries,0,LLONG_MAX) {
     } config_set_numerical_field(
       "hll-sparse-max-bytes",server.hll_sparse_max_bytes,0,LLONG_MAX) {
+    } config_set_numerical_field(
+      "bitmap-chunked-min-bytes",server.bitmap_chunked_min_bytes,0,LLONG_MAX) {
+    } config_set_numerical_field(
+      "string-compression-min-bytes",server.string_compression_min_bytes,0,LLONG_MAX) {
     } config_set_numerical_field(
       "lua-time-limit",server.lua_time_limit,0,LLONG_MAX) {
     } config_set_numerical_field(
@@ -1082,14 +1611,42 @@ void configSetCommand(client *c) {
         server.slowlog_max_len = (unsigned)ll;
     } config_set_numerical_field(
       "latency-monitor-threshold",server.latency_monitor_threshold,0,LLONG_MAX){
+    } config_set_numerical_field(
+      "lazyfree-auto-threshold",server.lazyfree_auto_threshold,0,LLONG_MAX) {
+    } config_set_numerical_field(
+      "keys-job-threshold",server.keys_job_threshold,0,LLONG_MAX) {
+    } config_set_numerical_field(
+      "bgread-threshold",server.bgread_threshold,0,LLONG_MAX) {
+    } config_set_numerical_field(
+      "reply-stream-threshold",server.reply_stream_threshold,0,LLONG_MAX) {
+    } config_set_numerical_field(
+      "hotkeys-top-k",server.hotkeys_top_k,0,HOTKEYS_MAX_TOP_K) {
+        hotkeysInit();
+    } config_set_numerical_field(
+      "trace-sample-rate",server.trace_sample_rate,0,LLONG_MAX) {
+        traceInit();
+    } config_set_numerical_field(
+      "trace-max-len",server.trace_max_len,1,TRACE_MAX_LEN) {
+        traceInit();
+    } config_set_numerical_field(
+      "memory-prefixes-scan-keys",server.memory_prefixes_scan_keys,0,LLONG_MAX) {
+        memPrefixInit(0);
+    } config_set_numerical_field(
+      "tracking-table-max-keys",server.tracking_table_max_keys,0,LLONG_MAX) {
     } config_set_numerical_field(
       "repl-ping-slave-period",server.repl_ping_slave_period,1,LLONG_MAX) {
     } config_set_numerical_field(
       "repl-timeout",server.repl_timeout,1,LLONG_MAX) {
+    } config_set_numerical_field(
+      "rdb-load-threads",server.rdb_load_threads,1,RDB_LOAD_MAX_THREADS) {
+    } config_set_numerical_field(
+      "rdb-save-threads",server.rdb_save_threads,1,RDB_SAVE_MAX_THREADS) {
     } config_set_numerical_field(
       "repl-backlog-ttl",server.repl_backlog_time_limit,0,LLONG_MAX) {
     } config_set_numerical_field(
       "repl-diskless-sync-delay",server.repl_diskless_sync_delay,0,LLONG_MAX) {
+    } config_set_numerical_field(
+      "repl-diskless-resume-window",server.repl_diskless_resume_window,0,LLONG_MAX) {
     } config_set_numerical_field(
       "slave-priority",server.slave_priority,0,LLONG_MAX) {
     } config_set_numerical_field(
@@ -1110,6 +1667,16 @@ void configSetCommand(client *c) {
       "cluster-migration-barrier",server.cluster_migration_barrier,0,LLONG_MAX){
     } config_set_numerical_field(
       "cluster-slave-validity-factor",server.cluster_slave_validity_factor,0,LLONG_MAX) {
+    } config_set_numerical_field(
+      "active-rehashing-budget-us",server.active_rehashing_budget_us,0,1000000) {
+    } config_set_numerical_field(
+      "busy-poll-us",server.busy_poll_us,0,1000000) {
+        server.el->aeSetBusyPoll(server.busy_poll_us,server.busy_poll_max_cpu);
+    } config_set_numerical_field(
+      "busy-poll-max-cpu",server.busy_poll_max_cpu,1,100) {
+        server.el->aeSetBusyPoll(server.busy_poll_us,server.busy_poll_max_cpu);
+    } config_set_numerical_field(
+      "busy-poll-socket-us",server.busy_poll_socket_us,0,1000000) {
     } config_set_numerical_field(
       "hz",server.hz,0,LLONG_MAX) {
         /* Hz is more an hint from the user, so we accept values out of range
@@ -1132,10 +1699,16 @@ void configSetCommand(client *c) {
             }
             freeMemoryIfNeeded();
         }
+    } config_set_memory_field("tiering-max-size",server.tiering_max_size) {
     } config_set_memory_field("repl-backlog-size",ll) {
         resizeReplicationBacklog(ll);
+    } config_set_memory_field("repl-backlog-disk-size",server.repl_backlog_disk_size) {
+        replicationBacklogDiskTrim();
     } config_set_memory_field("auto-aof-rewrite-min-size",ll) {
         server.aof_rewrite_min_size = ll;
+    } config_set_memory_field("cluster-migrate-inflight-bytes",ll) {
+        if (ll == 0) goto badfmt;
+        server.cluster_migrate_inflight_bytes = ll;
 
     /* Enumeration fields.
      * config_set_enum_field(name,var,enum_var) */
@@ -1145,6 +1718,23 @@ void configSetCommand(client *c) {
       "maxmemory-policy",server.maxmemory_policy,maxmemory_policy_enum) {
     } config_set_enum_field(
       "appendfsync",server.aof_fsync,aof_fsync_enum) {
+    } config_set_enum_field(
+      "list-node-container",server.list_node_container,list_node_container_enum) {
+        /* Walk the keyspace again to convert the existing lists. */
+        server.list_conversion_pending = 1;
+        server.list_conversion_db = 0;
+        server.list_conversion_cursor = 0;
+    } config_set_enum_field(
+      "list-node-container-conversion",server.list_node_container_conversion,
+      list_node_container_conversion_enum) {
+    } config_set_enum_field(
+      "rdb-save-bypass-cache",server.rdb_save_bypass_cache,rdb_bypass_cache_enum) {
+    } config_set_special_field("rdb-compression-codec") {
+        int enumval = configEnumGetValue(rdb_compression_codec_enum,
+                                         (const char *)o->ptr);
+        if (enumval == INT_MIN || !rdbCompressionAvailable(enumval))
+            goto badfmt;
+        server.rdb_compression_codec = enumval;
 
     /* Everyhing else is an error... */
     } config_set_else {
@@ -1214,13 +1804,24 @@ void configGetCommand(client *c) {
     config_get_string_field("masterauth",server.masterauth);
     config_get_string_field("cluster-announce-ip",server.cluster_announce_ip);
     config_get_string_field("unixsocket",server.unixsocket);
+    config_get_string_field("tls-cert-file",server.tls_cert_file);
+    config_get_string_field("tls-key-file",server.tls_key_file);
+    config_get_string_field("tls-ca-cert-file",server.tls_ca_cert_file);
     config_get_string_field("logfile",server.logfile);
+    config_get_string_field("memory-prefixes-delimiter",server.memory_prefixes_delimiter);
     config_get_string_field("pidfile",server.pidfile);
+    config_get_string_field("server-cpulist",server.server_cpulist);
+    config_get_string_field("bio-cpulist",server.bio_cpulist);
+    config_get_string_field("io-threads-cpulist",server.io_threads_cpulist);
     config_get_string_field("slave-announce-ip",server.slave_announce_ip);
+    config_get_string_field("tiering-dir",server.tiering_dir);
 
     /* Numerical values */
     config_get_numerical_field("maxmemory",server.maxmemory);
     config_get_numerical_field("maxmemory-samples",server.maxmemory_samples);
+    config_get_numerical_field("maxmemory-headroom",server.maxmemory_headroom);
+    config_get_numerical_field("maxmemory-headroom-budget-us",server.maxmemory_headroom_budget_us);
+    config_get_numerical_field("tiering-max-size",server.tiering_max_size);
     config_get_numerical_field("lfu-log-factor",server.lfu_log_factor);
     config_get_numerical_field("lfu-decay-time",server.lfu_decay_time);
     config_get_numerical_field("timeout",server.maxidletime);
@@ -1229,6 +1830,9 @@ void configGetCommand(client *c) {
     config_get_numerical_field("active-defrag-ignore-bytes",server.active_defrag_ignore_bytes);
     config_get_numerical_field("active-defrag-cycle-min",server.active_defrag_cycle_min);
     config_get_numerical_field("active-defrag-cycle-max",server.active_defrag_cycle_max);
+    config_get_numerical_field("active-defrag-max-scan-fields",server.active_defrag_max_scan_fields);
+    config_get_numerical_field("active-expire-cycle-min",server.active_expire_cycle_min);
+    config_get_numerical_field("active-expire-cycle-max",server.active_expire_cycle_max);
     config_get_numerical_field("auto-aof-rewrite-percentage",
             server.aof_rewrite_perc);
     config_get_numerical_field("auto-aof-rewrite-min-size",
@@ -1243,12 +1847,30 @@ void configGetCommand(client *c) {
             server.list_compress_depth);
     config_get_numerical_field("set-max-intset-entries",
             server.set_max_intset_entries);
+    config_get_numerical_field("set-algebra-threads",
+            server.set_algebra_threads);
+    config_get_numerical_field("set-algebra-parallel-threshold",
+            server.set_algebra_parallel_threshold);
     config_get_numerical_field("zset-max-ziplist-entries",
             server.zset_max_ziplist_entries);
     config_get_numerical_field("zset-max-ziplist-value",
             server.zset_max_ziplist_value);
+    config_get_numerical_field("zset-max-skiplist-entries",
+            server.zset_max_skiplist_entries);
+    config_get_numerical_field("adaptive-encoding-hot-counter",
+            server.adaptive_encoding_hot_counter);
+    config_get_numerical_field("adaptive-encoding-cold-seconds",
+            server.adaptive_encoding_cold_seconds);
+    config_get_numerical_field("stream-node-max-bytes",
+            server.stream_node_max_bytes);
+    config_get_numerical_field("stream-node-max-entries",
+            server.stream_node_max_entries);
     config_get_numerical_field("hll-sparse-max-bytes",
             server.hll_sparse_max_bytes);
+    config_get_numerical_field("bitmap-chunked-min-bytes",
+            server.bitmap_chunked_min_bytes);
+    config_get_numerical_field("string-compression-min-bytes",
+            server.string_compression_min_bytes);
     config_get_numerical_field("lua-time-limit",server.lua_time_limit);
     config_get_numerical_field("slowlog-log-slower-than",
             server.slowlog_log_slower_than);
@@ -1256,15 +1878,27 @@ void configGetCommand(client *c) {
             server.latency_monitor_threshold);
     config_get_numerical_field("slowlog-max-len",
             server.slowlog_max_len);
+    config_get_numerical_field("hotkeys-top-k",server.hotkeys_top_k);
+    config_get_numerical_field("trace-sample-rate",server.trace_sample_rate);
+    config_get_numerical_field("trace-max-len",server.trace_max_len);
+    config_get_numerical_field("memory-prefixes-scan-keys",server.memory_prefixes_scan_keys);
+    config_get_numerical_field("tracking-table-max-keys",
+            server.tracking_table_max_keys);
     config_get_numerical_field("port",server.port);
+    config_get_numerical_field("tls-port",server.tls_port);
+    config_get_numerical_field("tls-handshake-threads",server.tls_handshake_threads);
     config_get_numerical_field("cluster-announce-port",server.cluster_announce_port);
     config_get_numerical_field("cluster-announce-bus-port",server.cluster_announce_bus_port);
     config_get_numerical_field("tcp-backlog",server.tcp_backlog);
+    config_get_numerical_field("metrics-port",server.metrics_port);
     config_get_numerical_field("databases",server.dbnum);
     config_get_numerical_field("repl-ping-slave-period",server.repl_ping_slave_period);
     config_get_numerical_field("repl-timeout",server.repl_timeout);
+    config_get_numerical_field("rdb-load-threads",server.rdb_load_threads);
+    config_get_numerical_field("rdb-save-threads",server.rdb_save_threads);
     config_get_numerical_field("repl-backlog-size",server.repl_backlog_size);
     config_get_numerical_field("repl-backlog-ttl",server.repl_backlog_time_limit);
+    config_get_numerical_field("repl-backlog-disk-size",server.repl_backlog_disk_size);
     config_get_numerical_field("maxclients",server.maxclients);
     config_get_numerical_field("watchdog-period",server.watchdog_period);
     config_get_numerical_field("slave-priority",server.slave_priority);
@@ -1274,13 +1908,28 @@ void configGetCommand(client *c) {
     config_get_numerical_field("hz",server.hz);
     config_get_numerical_field("cluster-node-timeout",server.cluster_node_timeout);
     config_get_numerical_field("cluster-migration-barrier",server.cluster_migration_barrier);
+    config_get_numerical_field("cluster-migrate-inflight-bytes",server.cluster_migrate_inflight_bytes);
     config_get_numerical_field("cluster-slave-validity-factor",server.cluster_slave_validity_factor);
     config_get_numerical_field("repl-diskless-sync-delay",server.repl_diskless_sync_delay);
+    config_get_numerical_field("repl-diskless-resume-window",server.repl_diskless_resume_window);
     config_get_numerical_field("tcp-keepalive",server.tcpkeepalive);
+    config_get_numerical_field("active-rehashing-budget-us",server.active_rehashing_budget_us);
+    config_get_numerical_field("busy-poll-us",server.busy_poll_us);
+    config_get_numerical_field("busy-poll-max-cpu",server.busy_poll_max_cpu);
+    config_get_numerical_field("busy-poll-socket-us",server.busy_poll_socket_us);
+    config_get_numerical_field("tcp-listeners",server.tcp_listeners);
+    config_get_numerical_field("io-threads",server.io_threads_num);
+    config_get_numerical_field("lazyfree-threads",server.lazyfree_threads);
+    config_get_numerical_field("lazyfree-auto-threshold",server.lazyfree_auto_threshold);
+    config_get_numerical_field("keys-job-threshold",server.keys_job_threshold);
+    config_get_numerical_field("bgread-threshold",server.bgread_threshold);
+    config_get_numerical_field("reply-stream-threshold",server.reply_stream_threshold);
 
     /* Bool (yes/no) values */
     config_get_bool_field("cluster-require-full-coverage",
             server.cluster_require_full_coverage);
+    config_get_bool_field("cluster-bus-compact",
+            server.cluster_bus_compact);
     config_get_bool_field("no-appendfsync-on-rewrite",
             server.aof_no_fsync_on_rewrite);
     config_get_bool_field("slave-serve-stale-data",
@@ -1290,29 +1939,65 @@ void configGetCommand(client *c) {
     config_get_bool_field("stop-writes-on-bgsave-error",
             server.stop_writes_on_bgsave_err);
     config_get_bool_field("daemonize", server.daemonize);
+    config_get_bool_field("tls-replication", server.tls_replication);
+    config_get_bool_field("tls-cluster", server.tls_cluster);
     config_get_bool_field("rdbcompression", server.rdb_compression);
+    config_get_bool_field("rdb-compress-chunks", server.rdb_compress_chunks);
+    config_get_bool_field("rdb-load-mmap", server.rdb_load_mmap);
+    config_get_bool_field("lazy-loading", server.lazy_loading);
+    config_get_bool_field("rdb-save-forkless", server.rdb_save_forkless);
     config_get_bool_field("rdbchecksum", server.rdb_checksum);
     config_get_bool_field("activerehashing", server.activerehashing);
     config_get_bool_field("activedefrag", server.active_defrag_enabled);
+    config_get_bool_field("huge-pages", server.huge_pages);
+    config_get_bool_field("transient-arena", server.transient_arena);
     config_get_bool_field("protected-mode", server.protected_mode);
     config_get_bool_field("repl-disable-tcp-nodelay",
             server.repl_disable_tcp_nodelay);
     config_get_bool_field("repl-diskless-sync",
             server.repl_diskless_sync);
+    config_get_bool_field("repl-compression",
+            server.repl_compression);
     config_get_bool_field("aof-rewrite-incremental-fsync",
             server.aof_rewrite_incremental_fsync);
     config_get_bool_field("aof-load-truncated",
             server.aof_load_truncated);
     config_get_bool_field("aof-use-rdb-preamble",
             server.aof_use_rdb_preamble);
+    config_get_bool_field("aof-multi-part",server.aof_multi_part);
+    config_get_bool_field("aof-group-commit",server.aof_group_commit);
+    config_get_bool_field("aof-binary-format",server.aof_binary_format);
+    config_get_bool_field("aof-load-prefetch",server.aof_load_prefetch);
     config_get_bool_field("lazyfree-lazy-eviction",
             server.lazyfree_lazy_eviction);
     config_get_bool_field("lazyfree-lazy-expire",
             server.lazyfree_lazy_expire);
     config_get_bool_field("lazyfree-lazy-server-del",
             server.lazyfree_lazy_server_del);
+    config_get_bool_field("tiering",
+            server.tiering);
+    config_get_bool_field("alloc-profiler",
+            server.alloc_profiler);
+    config_get_bool_field("active-expire-index",
+            server.active_expire_index);
+    config_get_bool_field("keyspace-index",
+            server.keyspace_index);
     config_get_bool_field("slave-lazy-flush",
             server.repl_slave_lazy_flush);
+    config_get_bool_field("repl-async-load",
+            server.repl_async_load);
+    config_get_bool_field("repl-diskless-load",
+            server.repl_diskless_load);
+    config_get_bool_field("slave-fast-ack",
+            server.slave_fast_ack);
+    config_get_bool_field("io-threads-do-reads",
+            server.io_threads_do_reads);
+    config_get_bool_field("slave-parallel-reads",
+            server.slave_parallel_reads);
+    config_get_bool_field("lua-parallel-scripts",
+            server.lua_parallel_scripts);
+    config_get_bool_field("io-threads-shards",
+            server.io_threads_shards);
 
     /* Enum values */
     config_get_enum_field("maxmemory-policy",
@@ -1321,8 +2006,21 @@ void configGetCommand(client *c) {
             server.verbosity,loglevel_enum);
     config_get_enum_field("supervised",
             server.supervised_mode,supervised_mode_enum);
+    config_get_enum_field("numa-bind",
+            server.numa_bind,numa_bind_enum);
+    config_get_enum_field("hash-function",
+            server.hash_function,hash_function_enum);
     config_get_enum_field("appendfsync",
             server.aof_fsync,aof_fsync_enum);
+    config_get_enum_field("list-node-container",
+            server.list_node_container,list_node_container_enum);
+    config_get_enum_field("list-node-container-conversion",
+            server.list_node_container_conversion,
+            list_node_container_conversion_enum);
+    config_get_enum_field("rdb-save-bypass-cache",
+            server.rdb_save_bypass_cache,rdb_bypass_cache_enum);
+    config_get_enum_field("rdb-compression-codec",
+            server.rdb_compression_codec,rdb_compression_codec_enum);
     config_get_enum_field("syslog-facility",
             server.syslog_facility,syslog_facility_enum);
 
@@ -1951,11 +2649,23 @@ int rewriteConfig(char *path) {
     rewriteConfigYesNoOption(state,"daemonize",server.daemonize,0);
     rewriteConfigStringOption(state,"pidfile",server.pidfile,CONFIG_DEFAULT_PID_FILE);
     rewriteConfigNumericalOption(state,"port",server.port,CONFIG_DEFAULT_SERVER_PORT);
+    rewriteConfigNumericalOption(state,"tls-port",server.tls_port,CONFIG_DEFAULT_TLS_PORT);
+    rewriteConfigStringOption(state,"tls-cert-file",server.tls_cert_file,NULL);
+    rewriteConfigStringOption(state,"tls-key-file",server.tls_key_file,NULL);
+    rewriteConfigStringOption(state,"tls-ca-cert-file",server.tls_ca_cert_file,NULL);
+    rewriteConfigYesNoOption(state,"tls-replication",server.tls_replication,CONFIG_DEFAULT_TLS_REPLICATION);
+    rewriteConfigYesNoOption(state,"tls-cluster",server.tls_cluster,CONFIG_DEFAULT_TLS_CLUSTER);
+    rewriteConfigNumericalOption(state,"tls-handshake-threads",server.tls_handshake_threads,CONFIG_DEFAULT_TLS_HANDSHAKE_THREADS);
     rewriteConfigNumericalOption(state,"cluster-announce-port",server.cluster_announce_port,CONFIG_DEFAULT_CLUSTER_ANNOUNCE_PORT);
     rewriteConfigNumericalOption(state,"cluster-announce-bus-port",server.cluster_announce_bus_port,CONFIG_DEFAULT_CLUSTER_ANNOUNCE_BUS_PORT);
     rewriteConfigNumericalOption(state,"tcp-backlog",server.tcp_backlog,CONFIG_DEFAULT_TCP_BACKLOG);
+    rewriteConfigNumericalOption(state,"metrics-port",server.metrics_port,CONFIG_DEFAULT_METRICS_PORT);
     rewriteConfigBindOption(state);
     rewriteConfigStringOption(state,"unixsocket",server.unixsocket,NULL);
+    rewriteConfigStringOption(state,"server-cpulist",server.server_cpulist,NULL);
+    rewriteConfigStringOption(state,"bio-cpulist",server.bio_cpulist,NULL);
+    rewriteConfigStringOption(state,"io-threads-cpulist",server.io_threads_cpulist,NULL);
+    rewriteConfigEnumOption(state,"numa-bind",server.numa_bind,numa_bind_enum,CONFIG_DEFAULT_NUMA_BIND);
     rewriteConfigOctalOption(state,"unixsocketperm",server.unixsocketperm,CONFIG_DEFAULT_UNIX_SOCKET_PERM);
     rewriteConfigNumericalOption(state,"timeout",server.maxidletime,CONFIG_DEFAULT_CLIENT_TIMEOUT);
     rewriteConfigNumericalOption(state,"tcp-keepalive",server.tcpkeepalive,CONFIG_DEFAULT_TCP_KEEPALIVE);
@@ -1969,7 +2679,15 @@ int rewriteConfig(char *path) {
     rewriteConfigNumericalOption(state,"databases",server.dbnum,CONFIG_DEFAULT_DBNUM);
     rewriteConfigYesNoOption(state,"stop-writes-on-bgsave-error",server.stop_writes_on_bgsave_err,CONFIG_DEFAULT_STOP_WRITES_ON_BGSAVE_ERROR);
     rewriteConfigYesNoOption(state,"rdbcompression",server.rdb_compression,CONFIG_DEFAULT_RDB_COMPRESSION);
+    rewriteConfigEnumOption(state,"rdb-compression-codec",server.rdb_compression_codec,rdb_compression_codec_enum,CONFIG_DEFAULT_RDB_COMPRESSION_CODEC);
+    rewriteConfigYesNoOption(state,"rdb-compress-chunks",server.rdb_compress_chunks,CONFIG_DEFAULT_RDB_COMPRESS_CHUNKS);
     rewriteConfigYesNoOption(state,"rdbchecksum",server.rdb_checksum,CONFIG_DEFAULT_RDB_CHECKSUM);
+    rewriteConfigNumericalOption(state,"rdb-load-threads",server.rdb_load_threads,CONFIG_DEFAULT_RDB_LOAD_THREADS);
+    rewriteConfigEnumOption(state,"rdb-save-bypass-cache",server.rdb_save_bypass_cache,rdb_bypass_cache_enum,CONFIG_DEFAULT_RDB_SAVE_BYPASS_CACHE);
+    rewriteConfigYesNoOption(state,"rdb-load-mmap",server.rdb_load_mmap,CONFIG_DEFAULT_RDB_LOAD_MMAP);
+    rewriteConfigYesNoOption(state,"lazy-loading",server.lazy_loading,CONFIG_DEFAULT_LAZY_LOADING);
+    rewriteConfigYesNoOption(state,"rdb-save-forkless",server.rdb_save_forkless,CONFIG_DEFAULT_RDB_SAVE_FORKLESS);
+    rewriteConfigNumericalOption(state,"rdb-save-threads",server.rdb_save_threads,CONFIG_DEFAULT_RDB_SAVE_THREADS);
     rewriteConfigStringOption(state,"dbfilename",server.rdb_filename,CONFIG_DEFAULT_RDB_FILENAME);
     rewriteConfigDirOption(state);
     rewriteConfigSlaveofOption(state);
@@ -1982,9 +2700,12 @@ int rewriteConfig(char *path) {
     rewriteConfigNumericalOption(state,"repl-timeout",server.repl_timeout,CONFIG_DEFAULT_REPL_TIMEOUT);
     rewriteConfigBytesOption(state,"repl-backlog-size",server.repl_backlog_size,CONFIG_DEFAULT_REPL_BACKLOG_SIZE);
     rewriteConfigBytesOption(state,"repl-backlog-ttl",server.repl_backlog_time_limit,CONFIG_DEFAULT_REPL_BACKLOG_TIME_LIMIT);
+    rewriteConfigBytesOption(state,"repl-backlog-disk-size",server.repl_backlog_disk_size,CONFIG_DEFAULT_REPL_BACKLOG_DISK_SIZE);
     rewriteConfigYesNoOption(state,"repl-disable-tcp-nodelay",server.repl_disable_tcp_nodelay,CONFIG_DEFAULT_REPL_DISABLE_TCP_NODELAY);
     rewriteConfigYesNoOption(state,"repl-diskless-sync",server.repl_diskless_sync,CONFIG_DEFAULT_REPL_DISKLESS_SYNC);
+    rewriteConfigYesNoOption(state,"repl-compression",server.repl_compression,CONFIG_DEFAULT_REPL_COMPRESSION);
     rewriteConfigNumericalOption(state,"repl-diskless-sync-delay",server.repl_diskless_sync_delay,CONFIG_DEFAULT_REPL_DISKLESS_SYNC_DELAY);
+    rewriteConfigNumericalOption(state,"repl-diskless-resume-window",server.repl_diskless_resume_window,CONFIG_DEFAULT_REPL_DISKLESS_RESUME_WINDOW);
     rewriteConfigNumericalOption(state,"slave-priority",server.slave_priority,CONFIG_DEFAULT_SLAVE_PRIORITY);
     rewriteConfigNumericalOption(state,"min-slaves-to-write",server.repl_min_slaves_to_write,CONFIG_DEFAULT_MIN_SLAVES_TO_WRITE);
     rewriteConfigNumericalOption(state,"min-slaves-max-lag",server.repl_min_slaves_max_lag,CONFIG_DEFAULT_MIN_SLAVES_MAX_LAG);
@@ -1993,6 +2714,11 @@ int rewriteConfig(char *path) {
     rewriteConfigBytesOption(state,"maxmemory",server.maxmemory,CONFIG_DEFAULT_MAXMEMORY);
     rewriteConfigEnumOption(state,"maxmemory-policy",server.maxmemory_policy,maxmemory_policy_enum,CONFIG_DEFAULT_MAXMEMORY_POLICY);
     rewriteConfigNumericalOption(state,"maxmemory-samples",server.maxmemory_samples,CONFIG_DEFAULT_MAXMEMORY_SAMPLES);
+    rewriteConfigNumericalOption(state,"maxmemory-headroom",server.maxmemory_headroom,CONFIG_DEFAULT_MAXMEMORY_HEADROOM);
+    rewriteConfigNumericalOption(state,"maxmemory-headroom-budget-us",server.maxmemory_headroom_budget_us,CONFIG_DEFAULT_MAXMEMORY_HEADROOM_BUDGET_US);
+    rewriteConfigYesNoOption(state,"tiering",server.tiering,CONFIG_DEFAULT_TIERING);
+    rewriteConfigStringOption(state,"tiering-dir",server.tiering_dir,CONFIG_DEFAULT_TIERING_DIR);
+    rewriteConfigBytesOption(state,"tiering-max-size",server.tiering_max_size,CONFIG_DEFAULT_TIERING_MAX_SIZE);
     rewriteConfigNumericalOption(state,"lfu-log-factor",server.lfu_log_factor,CONFIG_DEFAULT_LFU_LOG_FACTOR);
     rewriteConfigNumericalOption(state,"lfu-decay-time",server.lfu_decay_time,CONFIG_DEFAULT_LFU_DECAY_TIME);
     rewriteConfigNumericalOption(state,"active-defrag-threshold-lower",server.active_defrag_threshold_lower,CONFIG_DEFAULT_DEFRAG_THRESHOLD_LOWER);
@@ -2000,6 +2726,9 @@ int rewriteConfig(char *path) {
     rewriteConfigBytesOption(state,"active-defrag-ignore-bytes",server.active_defrag_ignore_bytes,CONFIG_DEFAULT_DEFRAG_IGNORE_BYTES);
     rewriteConfigNumericalOption(state,"active-defrag-cycle-min",server.active_defrag_cycle_min,CONFIG_DEFAULT_DEFRAG_CYCLE_MIN);
     rewriteConfigNumericalOption(state,"active-defrag-cycle-max",server.active_defrag_cycle_max,CONFIG_DEFAULT_DEFRAG_CYCLE_MAX);
+    rewriteConfigNumericalOption(state,"active-defrag-max-scan-fields",server.active_defrag_max_scan_fields,CONFIG_DEFAULT_DEFRAG_MAX_SCAN_FIELDS);
+    rewriteConfigNumericalOption(state,"active-expire-cycle-min",server.active_expire_cycle_min,CONFIG_DEFAULT_ACTIVE_EXPIRE_CYCLE_MIN);
+    rewriteConfigNumericalOption(state,"active-expire-cycle-max",server.active_expire_cycle_max,CONFIG_DEFAULT_ACTIVE_EXPIRE_CYCLE_MAX);
     rewriteConfigYesNoOption(state,"appendonly",server.aof_state != AOF_OFF,0);
     rewriteConfigStringOption(state,"appendfilename",server.aof_filename,CONFIG_DEFAULT_AOF_FILENAME);
     rewriteConfigEnumOption(state,"appendfsync",server.aof_fsync,aof_fsync_enum,CONFIG_DEFAULT_AOF_FSYNC);
@@ -2010,34 +2739,81 @@ int rewriteConfig(char *path) {
     rewriteConfigYesNoOption(state,"cluster-enabled",server.cluster_enabled,0);
     rewriteConfigStringOption(state,"cluster-config-file",server.cluster_configfile,CONFIG_DEFAULT_CLUSTER_CONFIG_FILE);
     rewriteConfigYesNoOption(state,"cluster-require-full-coverage",server.cluster_require_full_coverage,CLUSTER_DEFAULT_REQUIRE_FULL_COVERAGE);
+    rewriteConfigYesNoOption(state,"cluster-bus-compact",server.cluster_bus_compact,CLUSTER_DEFAULT_BUS_COMPACT);
     rewriteConfigNumericalOption(state,"cluster-node-timeout",server.cluster_node_timeout,CLUSTER_DEFAULT_NODE_TIMEOUT);
     rewriteConfigNumericalOption(state,"cluster-migration-barrier",server.cluster_migration_barrier,CLUSTER_DEFAULT_MIGRATION_BARRIER);
+    rewriteConfigBytesOption(state,"cluster-migrate-inflight-bytes",server.cluster_migrate_inflight_bytes,CLUSTER_DEFAULT_MIGRATE_INFLIGHT_BYTES);
     rewriteConfigNumericalOption(state,"cluster-slave-validity-factor",server.cluster_slave_validity_factor,CLUSTER_DEFAULT_SLAVE_VALIDITY);
     rewriteConfigNumericalOption(state,"slowlog-log-slower-than",server.slowlog_log_slower_than,CONFIG_DEFAULT_SLOWLOG_LOG_SLOWER_THAN);
     rewriteConfigNumericalOption(state,"latency-monitor-threshold",server.latency_monitor_threshold,CONFIG_DEFAULT_LATENCY_MONITOR_THRESHOLD);
     rewriteConfigNumericalOption(state,"slowlog-max-len",server.slowlog_max_len,CONFIG_DEFAULT_SLOWLOG_MAX_LEN);
+    rewriteConfigNumericalOption(state,"hotkeys-top-k",server.hotkeys_top_k,CONFIG_DEFAULT_HOTKEYS_TOP_K);
+    rewriteConfigNumericalOption(state,"trace-sample-rate",server.trace_sample_rate,CONFIG_DEFAULT_TRACE_SAMPLE_RATE);
+    rewriteConfigNumericalOption(state,"trace-max-len",server.trace_max_len,CONFIG_DEFAULT_TRACE_MAX_LEN);
+    rewriteConfigNumericalOption(state,"memory-prefixes-scan-keys",server.memory_prefixes_scan_keys,CONFIG_DEFAULT_MEMORY_PREFIXES_SCAN_KEYS);
+    rewriteConfigStringOption(state,"memory-prefixes-delimiter",server.memory_prefixes_delimiter,CONFIG_DEFAULT_MEMORY_PREFIXES_DELIMITER);
+    rewriteConfigYesNoOption(state,"alloc-profiler",server.alloc_profiler,CONFIG_DEFAULT_ALLOC_PROFILER);
+    rewriteConfigNumericalOption(state,"tracking-table-max-keys",server.tracking_table_max_keys,CONFIG_DEFAULT_TRACKING_TABLE_MAX_KEYS);
     rewriteConfigNotifykeyspaceeventsOption(state);
     rewriteConfigNumericalOption(state,"hash-max-ziplist-entries",server.hash_max_ziplist_entries,OBJ_HASH_MAX_ZIPLIST_ENTRIES);
     rewriteConfigNumericalOption(state,"hash-max-ziplist-value",server.hash_max_ziplist_value,OBJ_HASH_MAX_ZIPLIST_VALUE);
     rewriteConfigNumericalOption(state,"list-max-ziplist-size",server.list_max_ziplist_size,OBJ_LIST_MAX_ZIPLIST_SIZE);
     rewriteConfigNumericalOption(state,"list-compress-depth",server.list_compress_depth,OBJ_LIST_COMPRESS_DEPTH);
+    rewriteConfigEnumOption(state,"list-node-container",server.list_node_container,list_node_container_enum,OBJ_LIST_NODE_CONTAINER);
+    rewriteConfigEnumOption(state,"list-node-container-conversion",server.list_node_container_conversion,list_node_container_conversion_enum,OBJ_LIST_NODE_CONTAINER_CONVERSION);
     rewriteConfigNumericalOption(state,"set-max-intset-entries",server.set_max_intset_entries,OBJ_SET_MAX_INTSET_ENTRIES);
+    rewriteConfigNumericalOption(state,"set-algebra-threads",server.set_algebra_threads,CONFIG_DEFAULT_SET_ALGEBRA_THREADS);
+    rewriteConfigNumericalOption(state,"set-algebra-parallel-threshold",server.set_algebra_parallel_threshold,CONFIG_DEFAULT_SET_ALGEBRA_PARALLEL_THRESHOLD);
     rewriteConfigNumericalOption(state,"zset-max-ziplist-entries",server.zset_max_ziplist_entries,OBJ_ZSET_MAX_ZIPLIST_ENTRIES);
     rewriteConfigNumericalOption(state,"zset-max-ziplist-value",server.zset_max_ziplist_value,OBJ_ZSET_MAX_ZIPLIST_VALUE);
+    rewriteConfigNumericalOption(state,"zset-max-skiplist-entries",server.zset_max_skiplist_entries,OBJ_ZSET_MAX_SKIPLIST_ENTRIES);
+    rewriteConfigNumericalOption(state,"adaptive-encoding-hot-counter",server.adaptive_encoding_hot_counter,CONFIG_DEFAULT_ADAPTIVE_ENCODING_HOT_COUNTER);
+    rewriteConfigNumericalOption(state,"adaptive-encoding-cold-seconds",server.adaptive_encoding_cold_seconds,CONFIG_DEFAULT_ADAPTIVE_ENCODING_COLD_SECONDS);
+    rewriteConfigNumericalOption(state,"stream-node-max-bytes",server.stream_node_max_bytes,OBJ_STREAM_NODE_MAX_BYTES);
+    rewriteConfigNumericalOption(state,"stream-node-max-entries",server.stream_node_max_entries,OBJ_STREAM_NODE_MAX_ENTRIES);
     rewriteConfigNumericalOption(state,"hll-sparse-max-bytes",server.hll_sparse_max_bytes,CONFIG_DEFAULT_HLL_SPARSE_MAX_BYTES);
+    rewriteConfigNumericalOption(state,"bitmap-chunked-min-bytes",server.bitmap_chunked_min_bytes,CONFIG_DEFAULT_BITMAP_CHUNKED_MIN_BYTES);
+    rewriteConfigNumericalOption(state,"string-compression-min-bytes",server.string_compression_min_bytes,CONFIG_DEFAULT_STRING_COMPRESSION_MIN_BYTES);
     rewriteConfigYesNoOption(state,"activerehashing",server.activerehashing,CONFIG_DEFAULT_ACTIVE_REHASHING);
     rewriteConfigYesNoOption(state,"activedefrag",server.active_defrag_enabled,CONFIG_DEFAULT_ACTIVE_DEFRAG);
+    rewriteConfigYesNoOption(state,"huge-pages",server.huge_pages,CONFIG_DEFAULT_HUGE_PAGES);
+    rewriteConfigYesNoOption(state,"transient-arena",server.transient_arena,CONFIG_DEFAULT_TRANSIENT_ARENA);
     rewriteConfigYesNoOption(state,"protected-mode",server.protected_mode,CONFIG_DEFAULT_PROTECTED_MODE);
     rewriteConfigClientoutputbufferlimitOption(state);
     rewriteConfigNumericalOption(state,"hz",server.hz,CONFIG_DEFAULT_HZ);
     rewriteConfigYesNoOption(state,"aof-rewrite-incremental-fsync",server.aof_rewrite_incremental_fsync,CONFIG_DEFAULT_AOF_REWRITE_INCREMENTAL_FSYNC);
     rewriteConfigYesNoOption(state,"aof-load-truncated",server.aof_load_truncated,CONFIG_DEFAULT_AOF_LOAD_TRUNCATED);
     rewriteConfigYesNoOption(state,"aof-use-rdb-preamble",server.aof_use_rdb_preamble,CONFIG_DEFAULT_AOF_USE_RDB_PREAMBLE);
+    rewriteConfigYesNoOption(state,"aof-multi-part",server.aof_multi_part,CONFIG_DEFAULT_AOF_MULTI_PART);
+    rewriteConfigYesNoOption(state,"aof-group-commit",server.aof_group_commit,CONFIG_DEFAULT_AOF_GROUP_COMMIT);
+    rewriteConfigYesNoOption(state,"aof-binary-format",server.aof_binary_format,CONFIG_DEFAULT_AOF_BINARY_FORMAT);
+    rewriteConfigYesNoOption(state,"aof-load-prefetch",server.aof_load_prefetch,CONFIG_DEFAULT_AOF_LOAD_PREFETCH);
     rewriteConfigEnumOption(state,"supervised",server.supervised_mode,supervised_mode_enum,SUPERVISED_NONE);
+    rewriteConfigEnumOption(state,"hash-function",server.hash_function,hash_function_enum,CONFIG_DEFAULT_HASH_FUNCTION);
     rewriteConfigYesNoOption(state,"lazyfree-lazy-eviction",server.lazyfree_lazy_eviction,CONFIG_DEFAULT_LAZYFREE_LAZY_EVICTION);
     rewriteConfigYesNoOption(state,"lazyfree-lazy-expire",server.lazyfree_lazy_expire,CONFIG_DEFAULT_LAZYFREE_LAZY_EXPIRE);
     rewriteConfigYesNoOption(state,"lazyfree-lazy-server-del",server.lazyfree_lazy_server_del,CONFIG_DEFAULT_LAZYFREE_LAZY_SERVER_DEL);
+    rewriteConfigNumericalOption(state,"lazyfree-threads",server.lazyfree_threads,CONFIG_DEFAULT_LAZYFREE_THREADS);
+    rewriteConfigNumericalOption(state,"lazyfree-auto-threshold",server.lazyfree_auto_threshold,CONFIG_DEFAULT_LAZYFREE_AUTO_THRESHOLD);
+    rewriteConfigNumericalOption(state,"keys-job-threshold",server.keys_job_threshold,CONFIG_DEFAULT_KEYS_JOB_THRESHOLD);
+    rewriteConfigNumericalOption(state,"bgread-threshold",server.bgread_threshold,CONFIG_DEFAULT_BGREAD_THRESHOLD);
+    rewriteConfigNumericalOption(state,"reply-stream-threshold",server.reply_stream_threshold,CONFIG_DEFAULT_REPLY_STREAM_THRESHOLD);
+    rewriteConfigYesNoOption(state,"active-expire-index",server.active_expire_index,CONFIG_DEFAULT_ACTIVE_EXPIRE_INDEX);
+    rewriteConfigYesNoOption(state,"keyspace-index",server.keyspace_index,CONFIG_DEFAULT_KEYSPACE_INDEX);
     rewriteConfigYesNoOption(state,"slave-lazy-flush",server.repl_slave_lazy_flush,CONFIG_DEFAULT_SLAVE_LAZY_FLUSH);
+    rewriteConfigYesNoOption(state,"repl-async-load",server.repl_async_load,CONFIG_DEFAULT_REPL_ASYNC_LOAD);
+    rewriteConfigYesNoOption(state,"repl-diskless-load",server.repl_diskless_load,CONFIG_DEFAULT_REPL_DISKLESS_LOAD);
+    rewriteConfigYesNoOption(state,"slave-fast-ack",server.slave_fast_ack,CONFIG_DEFAULT_SLAVE_FAST_ACK);
+    rewriteConfigNumericalOption(state,"io-threads",server.io_threads_num,CONFIG_DEFAULT_IO_THREADS_NUM);
+    rewriteConfigYesNoOption(state,"io-threads-do-reads",server.io_threads_do_reads,CONFIG_DEFAULT_IO_THREADS_DO_READS);
+    rewriteConfigYesNoOption(state,"slave-parallel-reads",server.slave_parallel_reads,CONFIG_DEFAULT_SLAVE_PARALLEL_READS);
+    rewriteConfigYesNoOption(state,"lua-parallel-scripts",server.lua_parallel_scripts,CONFIG_DEFAULT_LUA_PARALLEL_SCRIPTS);
+    rewriteConfigYesNoOption(state,"io-threads-shards",server.io_threads_shards,CONFIG_DEFAULT_IO_THREADS_SHARDS);
+    rewriteConfigNumericalOption(state,"tcp-listeners",server.tcp_listeners,CONFIG_DEFAULT_TCP_LISTENERS);
+    rewriteConfigNumericalOption(state,"active-rehashing-budget-us",server.active_rehashing_budget_us,CONFIG_DEFAULT_ACTIVE_REHASHING_BUDGET_US);
+    rewriteConfigNumericalOption(state,"busy-poll-us",server.busy_poll_us,CONFIG_DEFAULT_BUSY_POLL_US);
+    rewriteConfigNumericalOption(state,"busy-poll-max-cpu",server.busy_poll_max_cpu,CONFIG_DEFAULT_BUSY_POLL_MAX_CPU);
+    rewriteConfigNumericalOption(state,"busy-poll-socket-us",server.busy_poll_socket_us,CONFIG_DEFAULT_BUSY_POLL_SOCKET_US);
 
     /* Rewrite Sentinel config if in Sentinel mode. */
     if (server.sentinel_mode) rewriteConfigSentinelOption(state);
@@ -56,6 +56,11 @@
 #define HAVE_PROC_SOMAXCONN 1
 #endif
 
+/* Test for sendfile() */
+#ifdef __linux__
+#define HAVE_SENDFILE 1
+#endif
+
 /* Test for task_info() */
 #if defined(__APPLE__)
 #define HAVE_TASKINFO 1
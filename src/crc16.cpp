@@ -79,10 +79,126 @@ static const uint16_t crc16tab[256]= {
     0x6e17,0x7e36,0x4e55,0x5e74,0x2e93,0x3eb2,0x0ed1,0x1ef0
 };
 
+/* Tables for the slice-by-8 implementation: crc16_slice[k][n] is the CRC
+ * of the byte n followed by k zero bytes, so that eight bytes of input are
+ * processed with eight independent lookups. They are derived from crc16tab
+ * when the program starts, before any thread can hash a key. */
+static uint16_t crc16_slice[8][256];
+
+static struct crc16SliceInit {
+    crc16SliceInit() {
+        for (int n = 0; n < 256; n++) crc16_slice[0][n] = crc16tab[n];
+        for (int k = 1; k < 8; k++) {
+            for (int n = 0; n < 256; n++) {
+                uint16_t crc = crc16_slice[k-1][n];
+                crc16_slice[k][n] = (crc<<8) ^ crc16tab[crc>>8];
+            }
+        }
+    }
+} crc16_slice_init;
+
+/* The byte at a time implementation. */
+static uint16_t crc16Bytes(uint16_t crc, const unsigned char *s, int len) {
+    for (int j = 0; j < len; j++)
+        crc = (crc<<8) ^ crc16tab[((crc>>8) ^ s[j])&0x00FF];
+    return crc;
+}
+
+/* Fold the eight bytes of 's' into 'crc'. */
+static inline uint16_t crc16Word(uint16_t crc, const unsigned char *s) {
+    return crc16_slice[7][s[0] ^ (crc>>8)] ^
+           crc16_slice[6][s[1] ^ (crc&0xff)] ^
+           crc16_slice[5][s[2]] ^
+           crc16_slice[4][s[3]] ^
+           crc16_slice[3][s[4]] ^
+           crc16_slice[2][s[5]] ^
+           crc16_slice[1][s[6]] ^
+           crc16_slice[0][s[7]];
+}
+
+/* Continue the CRC 'crc' of the previous bytes with the 'len' bytes of
+ * 'buf'. */
+uint16_t crc16Continue(uint16_t crc, const char *buf, int len) {
+    const unsigned char *s = (const unsigned char *)buf;
+
+    while (len >= 8) {
+        crc = crc16Word(crc,s);
+        s += 8;
+        len -= 8;
+    }
+    return crc16Bytes(crc,s,len);
+}
+
 uint16_t crc16(const char *buf, int len) {
-    int counter;
+    return crc16Continue(0,buf,len);
+}
+
+/* Return the CRC of the bytes of 'buf' before the first occurrence of 'c',
+ * setting '*pos' to its index, or to 'len' if 'c' is not there, in which
+ * case the CRC is the one of the whole buffer. The bytes are looked for and
+ * hashed in the same pass, eight at a time as long as none of them is 'c'. */
+uint16_t crc16UntilByte(const char *buf, int len, char c, int *pos) {
+    const unsigned char *s = (const unsigned char *)buf;
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t pattern = ones*(unsigned char)c;
     uint16_t crc = 0;
-    for (counter = 0; counter < len; counter++)
-            crc = (crc<<8) ^ crc16tab[((crc>>8) ^ *buf++)&0x00FF];
+    int j = 0;
+
+    while (j+8 <= len) {
+        uint64_t word;
+
+        memcpy(&word,s+j,8);
+        word ^= pattern;
+        /* Some byte of the word is 'c'? */
+        if ((word-ones) & ~word & (ones<<7)) break;
+        crc = crc16Word(crc,s+j);
+        j += 8;
+    }
+    for (; j < len; j++) {
+        if (s[j] == (unsigned char)c) break;
+        crc = (crc<<8) ^ crc16tab[((crc>>8) ^ s[j])&0x00FF];
+    }
+    *pos = j;
     return crc;
 }
+
+/* Test main */
+#ifdef REDIS_TEST
+#include <stdio.h>
+
+#define UNUSED(x) (void)(x)
+int crc16Test(int argc, char *argv[]) {
+    UNUSED(argc);
+    UNUSED(argv);
+    printf("31c3 == %04x\n", crc16("123456789",9));
+
+    /* The slice-by-8 implementation must match the byte at a time one for
+     * every alignment and length. */
+    unsigned char buf[256+8];
+    for (unsigned j = 0; j < sizeof(buf); j++) buf[j] = j*2654435761u >> 24;
+    for (int off = 0; off < 8; off++) {
+        for (int len = 0; len <= 256; len++) {
+            uint16_t expected = crc16Bytes(0,buf+off,len);
+            int pos;
+
+            if (crc16((char*)buf+off,len) != expected) {
+                printf("crc16 mismatch at offset %d, length %d\n",off,len);
+                return 1;
+            }
+            /* No '{' in the buffer: the fused scan hashes all of it. */
+            buf[off+len] = '{';
+            for (int k = off; k < off+len; k++)
+                if (buf[k] == '{') buf[k] = '|';
+            if (crc16UntilByte((char*)buf+off,len+1,'{',&pos) !=
+                crc16Bytes(0,buf+off,len) || pos != len)
+            {
+                printf("crc16UntilByte mismatch at offset %d, length %d\n",
+                    off,len);
+                return 1;
+            }
+        }
+    }
+    printf("slice-by-8 matches the byte at a time CRC\n");
+    return 0;
+}
+#endif
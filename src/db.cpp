@@ -30,10 +30,17 @@
 #include "server.h"
 #include "cluster.h"
 #include "atomicvar.h"
+#include "hotkeys.h"
+#include "snapshot.h"
+#include "lazyload.h"
+#include "bgread.h"
 
 #include <signal.h>
 #include <ctype.h>
 
+static int expireEntryIfNeeded(redisDb *db, robj *key, dictEntry **de);
+static void dbSetEntryExpire(redisDb *db, dictEntry *de, long long when);
+
 /*-----------------------------------------------------------------------------
  * C-level DB API
  *----------------------------------------------------------------------------*/
@@ -47,14 +54,41 @@ void updateLFU(robj *val) {
     val->lru = (LFUGetTimeInMinutes()<<8) | counter;
 }
 
-/* Low level key lookup API, not actually called directly from commands
- * implementations that should instead rely on lookupKeyRead(),
- * lookupKeyWrite() and lookupKeyReadWithFlags(). */
-robj *lookupKey(redisDb *db, robj *key, int flags) {
-    dictEntry *de = db->m_dict->dictFind(key->ptr);
+/* Like lookupKey(), for the entry 'de' of 'key' in db->m_dict, or NULL,
+ * already found by the caller. */
+static robj *lookupKeyEntry(redisDb *db, robj *key, dictEntry *de, int flags) {
     if (de) {
         robj *val = (robj *)de->dictGetVal();
 
+        /* The values indexed by lazy-loading are loaded on first access. */
+        if (val->encoding == OBJ_ENCODING_LAZY) lazyLoadValue(val);
+
+        /* Only the commands flagged with CMD_BITMAP handle the chunked
+         * encoding of bitmaps: the other ones get a plain string. */
+        client *c = executingClient();
+        if (val->encoding == OBJ_ENCODING_CHUNKED &&
+            !server.module_read_shared &&
+            !(c && c->m_cmd && c->m_cmd->m_flags & CMD_BITMAP))
+        {
+            decodeChunkedBitmapObject(val);
+        }
+
+        /* Likewise only the commands flagged with CMD_COMPRESSED read the
+         * compressed strings: for the other ones, like APPEND or SETRANGE,
+         * the string is decompressed for good. */
+        if (val->encoding == OBJ_ENCODING_COMPRESSED &&
+            !server.module_read_shared &&
+            !(c && c->m_cmd && c->m_cmd->m_flags & CMD_COMPRESSED))
+        {
+            decompressStringObject(val);
+        }
+
+        /* The I/O threads executing commands in parallel, and the modules
+         * threads holding the read lock, only read the dataset, see
+         * slave-parallel-reads. */
+        if (io_thread_current_client || server.module_read_shared)
+            flags |= LOOKUP_NOTOUCH;
+
         /* Update the access time for the ageing algorithm.
          * Don't do it if we have a saving child, as this will trigger
          * a copy on write madness. */
@@ -68,12 +102,30 @@ robj *lookupKey(redisDb *db, robj *key, int flags) {
                 val->lru = LRU_CLOCK();
             }
         }
+
+        /* Feed the hot keys tracker, see hotkeys.cpp. */
+        if (server.hotkeys && !(flags & LOOKUP_NOTOUCH) && !server.loading)
+            hotkeysTrack(server.hotkeys,db->m_id,(sds)key->ptr);
         return val;
     } else {
         return NULL;
     }
 }
 
+/* Low level key lookup API, not actually called directly from commands
+ * implementations that should instead rely on lookupKeyRead(),
+ * lookupKeyWrite() and lookupKeyReadWithFlags(). */
+robj *lookupKey(redisDb *db, robj *key, int flags) {
+    return lookupKeyEntry(db,key,db->m_dict->dictFind(key->ptr),flags);
+}
+
+/* Return 1 if the keys are looked up by a command flagged as write, also
+ * when it is called by a script. */
+static int lookupForWriteCommand(void) {
+    client *c = server.lua_caller ? server.lua_client : executingClient();
+    return c && c->m_cmd && c->m_cmd->m_flags & CMD_WRITE;
+}
+
 /* Lookup a key for read operations, or return NULL if the key is not found
  * in the specified DB.
  *
@@ -96,9 +148,16 @@ robj *lookupKey(redisDb *db, robj *key, int flags) {
  * correctly report a key is expired on slaves even if the master is lagging
  * expiring our key via DELs in the replication link. */
 robj *lookupKeyReadWithFlags(redisDb *db, robj *key, int flags) {
+    dictEntry *de;
     robj *val;
 
-    if (expireIfNeeded(db,key) == 1) {
+    /* Write commands may change the keys they read, like XREADGROUP. */
+    if (server.rdb_snapshot && lookupForWriteCommand())
+        snapshotPreserveKey(db,key);
+    /* The expire is stored in the entry of the key: a single lookup serves
+     * both the expire check and the value. */
+    de = db->m_dict->dictFind(key->ptr);
+    if (de && expireEntryIfNeeded(db,key,&de) == 1) {
         /* Key expired. If we are in the context of a master, expireIfNeeded()
          * returns 0 only when the key does not exist at all, so it's safe
          * to return NULL ASAP. */
@@ -116,19 +175,24 @@ robj *lookupKeyReadWithFlags(redisDb *db, robj *key, int flags) {
          * will say the key as non exisitng.
          *
          * Notably this covers GETs when slaves are used to scale reads. */
-        if (server.current_client &&
-            server.current_client != server.master &&
-            server.current_client->m_cmd &&
-            server.current_client->m_cmd->m_flags & CMD_READONLY)
+        client *c = executingClient();
+        if (c && c != server.master && c->m_cmd &&
+            c->m_cmd->m_flags & CMD_READONLY)
         {
             return NULL;
         }
     }
-    val = lookupKey(db,key,flags);
-    if (val == NULL)
+    val = lookupKeyEntry(db,key,de,flags);
+    if (val && val->type == OBJ_HASH && hashExpireFieldsIfNeeded(db,key,val))
+        val = NULL;
+    if (datasetReadShared()) {
+        if (val == NULL) atomicIncr(server.stat_keyspace_misses,1);
+        else atomicIncr(server.stat_keyspace_hits,1);
+    } else if (val == NULL) {
         server.stat_keyspace_misses++;
-    else
+    } else {
         server.stat_keyspace_hits++;
+    }
     return val;
 }
 
@@ -144,8 +208,18 @@ robj *lookupKeyRead(redisDb *db, robj *key) {
  * Returns the linked value object if the key exists or NULL if the key
  * does not exist in the specified DB. */
 robj *lookupKeyWrite(redisDb *db, robj *key) {
-    expireIfNeeded(db,key);
-    return lookupKey(db,key,LOOKUP_NONE);
+    robj *val;
+
+    if (server.rdb_snapshot) snapshotPreserveKey(db,key);
+    dictEntry *de = db->m_dict->dictFind(key->ptr);
+    if (de) expireEntryIfNeeded(db,key,&de);
+    val = lookupKeyEntry(db,key,de,LOOKUP_NONE);
+    /* The clients are blocked by processCommand() while the value is read
+     * in background, the other callers wait here. */
+    if (val && server.bgread_pinned) bgreadWaitValue(val);
+    if (val && val->type == OBJ_HASH && hashExpireFieldsIfNeeded(db,key,val))
+        return NULL;
+    return val;
 }
 
 robj *lookupKeyReadOrReply(client *c, robj *key, robj *reply) {
@@ -163,30 +237,79 @@ robj *lookupKeyWriteOrReply(client *c, robj *key, robj *reply) {
 }
 
 /* Add the key to the DB. It's up to the caller to increment the reference
- * counter of the value if needed.
+ * counter of the value if needed. The key name is copied inside the
+ * dictionary entry (see dbDictType).
  *
  * The program is aborted if the key already exists. */
-void dbAdd(redisDb *db, robj *key, robj *val) {
-    sds copy = sdsdup((sds)key->ptr);
-    int retval = db->m_dict->dictAdd(copy, val);
+dictEntry *dbAdd(redisDb *db, robj *key, robj *val) {
+    /* A fused value belongs to the entry of another key: store a copy. */
+    if (objectIsFused(val)) val = dupStringObject(val);
+    if (server.rdb_snapshot) snapshotNewKey(db,key);
+    dictEntry *de = db->m_dict->dictAddRaw(key->ptr,NULL);
 
-    serverAssertWithInfo(NULL,key,retval == DICT_OK);
-    if (val->type == OBJ_LIST) signalListAsReady(db, key);
-    if (server.cluster_enabled) slotToKeyAdd(key);
+    serverAssertWithInfo(NULL,key,de != NULL);
+    db->m_dict->dictSetVal(de,val);
+    if (val->type == OBJ_LIST) signalKeyAsReady(db, key);
+    if (val->type == OBJ_HASH) hashExpireIndexAdd(db,key,val);
+    if (server.cluster_enabled) slotToKeyAdd(db,(sds)de->dictGetKey());
+    if (db->m_keys_index) keyIndexAdd(db,(sds)de->dictGetKey());
+    return de;
  }
 
+/* Add the key to the DB with a copy of the EMBSTR encoded string 'val' stored
+ * in the same allocation of the dictionary entry and of the key name, so that
+ * a key costs a single allocation and reading it a single pointer chase.
+ * The caller retains its reference to 'val'. Returns the dictionary entry of
+ * the key if it was added this way, or NULL if 'val' is not suitable and
+ * nothing was done.
+ *
+ * The fused object can't outlive its entry, so its reference count is set to
+ * OBJ_SHARED_REFCOUNT, that makes incrRefCount() and decrRefCount() no-ops,
+ * and it is copied when it gets stored into another key (see dbAdd() and
+ * dbOverwrite()). Modifying commands already leave it alone since they
+ * only change in place objects with a single reference. When the key is
+ * overwritten the fused object is just left unused until the key is freed.
+ *
+ * The program is aborted if the key already exists. */
+dictEntry *dbAddFusedString(redisDb *db, robj *key, robj *val) {
+    if (val->type != OBJ_STRING || val->encoding != OBJ_ENCODING_EMBSTR)
+        return NULL;
+
+    size_t len = sdslen((sds)val->ptr);
+    if (server.rdb_snapshot) snapshotNewKey(db,key);
+    dictEntry *de = db->m_dict->dictAddRaw(key->ptr,NULL,
+                                           embeddedStringObjectSize(len));
+    serverAssertWithInfo(NULL,key,de != NULL);
+    robj *o = initEmbeddedStringObject(db->m_dict->dictGetEntryExtra(de),
+                                       (char*)val->ptr,len);
+    o->lru = val->lru;
+    o->refcount = OBJ_SHARED_REFCOUNT;
+    de->dictSetVal(o);
+    if (server.cluster_enabled) slotToKeyAdd(db,(sds)de->dictGetKey());
+    if (db->m_keys_index) keyIndexAdd(db,(sds)de->dictGetKey());
+    return de;
+}
+
 /* Overwrite an existing key with a new value. Incrementing the reference
  * count of the new value is up to the caller.
  * This function does not modify the expire time of the existing key.
+ * Returns the dictionary entry of the key.
  *
  * The program is aborted if the key was not already present. */
-void dbOverwrite(redisDb *db, robj *key, robj *val) {
+dictEntry *dbOverwrite(redisDb *db, robj *key, robj *val) {
+    if (server.rdb_snapshot) snapshotPreserveKey(db,key);
     dictEntry *de = db->m_dict->dictFind(key->ptr);
 
     serverAssertWithInfo(NULL,key,de != NULL);
+    if (objectIsFused(val)) val = dupStringObject(val);
+    robj* old = (robj*)de->dictGetVal();
+    int saved_lru = old->lru;
+    /* A huge old value is handed over to the lazyfree threads, leaving
+     * nothing to free to dictReplace(). */
+    if (old != val &&
+        lazyfreeFreeObjectIfNeeded(old,server.lazyfree_lazy_server_del))
+        de->dictSetVal(NULL);
     if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
-        robj* old = (robj*)de->dictGetVal();
-        int saved_lru = old->lru;
         db->m_dict->dictReplace(key->ptr, val);
         val->lru = saved_lru;
         /* LFU should be not only copied but also updated
@@ -195,6 +318,8 @@ void dbOverwrite(redisDb *db, robj *key, robj *val) {
     } else {
         db->m_dict->dictReplace(key->ptr, val);
     }
+    if (val->type == OBJ_HASH) hashExpireIndexAdd(db,key,val);
+    return de;
 }
 
 /* High level Set operation. This function can be used in order to set
@@ -206,20 +331,76 @@ void dbOverwrite(redisDb *db, robj *key, robj *val) {
  *
  * All the new keys in the database should be craeted via this interface. */
 void setKey(redisDb *db, robj *key, robj *val) {
+    dictEntry *de;
+
     if (lookupKeyWrite(db,key) == NULL) {
-        dbAdd(db,key,val);
+        if ((de = dbAddFusedString(db,key,val)) == NULL) {
+            de = dbAdd(db,key,val);
+            incrRefCount(val);
+        }
     } else {
-        dbOverwrite(db,key,val);
+        de = dbOverwrite(db,key,val);
+        incrRefCount(val);
     }
-    incrRefCount(val);
-    removeExpire(db,key);
+    dbRemoveEntryExpire(db,de);
     signalModifiedKey(db,key);
 }
 
+/* Like setKey() followed by setExpire(), used by SET with EX or PX, SETEX
+ * and MSETEX. The expire is stored in the entry the same call added or
+ * overwrote, instead of removing the old expire and then looking the key up
+ * again. */
+void setKeyWithExpire(client *c, redisDb *db, robj *key, robj *val, long long when) {
+    dictEntry *de;
+
+    if (lookupKeyWrite(db,key) == NULL) {
+        if ((de = dbAddFusedString(db,key,val)) == NULL) {
+            de = dbAdd(db,key,val);
+            incrRefCount(val);
+        }
+    } else {
+        de = dbOverwrite(db,key,val);
+        incrRefCount(val);
+    }
+    dbSetEntryExpire(db,de,when);
+    signalModifiedKey(db,key);
+
+    int writable_slave = server.masterhost && server.repl_slave_ro == 0;
+    if (c && writable_slave && !(c->m_flags & CLIENT_MASTER))
+        rememberSlaveKeyWithExpire(db,key);
+}
+
 int dbExists(redisDb *db, robj *key) {
     return db->m_dict->dictFind(key->ptr) != NULL;
 }
 
+/* Prefetch the dictionary memory needed to lookup up to DICT_PREFETCH_BATCH
+ * of the 'numkeys' keys keys[0], keys[step], keys[2*step], ... so that
+ * multi key commands don't stall on a cache miss for every key. The expires
+ * are in the entries of the main dictionary, so nothing else is needed. */
+void dbPrefetchKeys(redisDb *db, robj **keys, int numkeys, int step) {
+    void *batch[DICT_PREFETCH_BATCH];
+    int j, count = 0;
+
+    for (j = 0; j < numkeys && count < DICT_PREFETCH_BATCH; j += step)
+        batch[count++] = keys[j]->ptr;
+    db->m_dict->dictPrefetch(batch,count);
+}
+
+/* Like dbPrefetchKeys(), for up to DICT_PREFETCH_BATCH keys that are still
+ * raw strings, such as the arguments of the commands not yet parsed in the
+ * query buffer of a client. The main dictionary hashes its sds keys with
+ * dictGenHashFunction(), so the hashes are the same. */
+void dbPrefetchRawKeys(redisDb *db, const void **keys, const int *lens,
+                       int count)
+{
+    uint64_t hashes[DICT_PREFETCH_BATCH];
+
+    if (count > DICT_PREFETCH_BATCH) count = DICT_PREFETCH_BATCH;
+    dictGenHashFunctionBatch(keys,lens,count,hashes);
+    db->m_dict->dictPrefetchHashes(hashes,count);
+}
+
 /* Return a random key, in form of a Redis object.
  * If there are no keys, NULL is returned.
  *
@@ -236,7 +417,7 @@ robj *dbRandomKey(redisDb *db) {
 
         key = (sds)de->dictGetKey();
         keyobj = createStringObject(key,sdslen(key));
-        if (db->m_expires->dictFind(key)) {
+        if (dbGetEntryExpire(db,de) != -1) {
             if (expireIfNeeded(db,keyobj)) {
                 decrRefCount(keyobj);
                 continue; /* search for another key. This expired. */
@@ -246,13 +427,19 @@ robj *dbRandomKey(redisDb *db) {
     }
 }
 
-/* Delete a key, value, and associated expiration entry if any, from the DB */
+/* Delete a key, value, and associated expiration entry if any, from the DB.
+ * Unlike dbGenericDelete() the value is always freed right away, whatever
+ * its size, as eviction needs to account for the memory it frees. */
 int dbSyncDelete(redisDb *db, robj *key) {
-    /* Deleting an entry from the expires dict will not free the sds of
-     * the key, because it is shared with the main dictionary. */
-    if (db->m_expires->dictSize() > 0) db->m_expires->dictDelete(key->ptr);
-    if (db->m_dict->dictDelete(key->ptr) == DICT_OK) {
-        if (server.cluster_enabled) slotToKeyDel(key);
+    if (server.rdb_snapshot) snapshotPreserveKey(db,key);
+    dictEntry *de = db->m_dict->dictUnlink(key->ptr);
+    if (de) {
+        /* The expires and the slot dictionaries compare with the key of the
+         * entry: remove it from there before releasing the entry. */
+        dbRemoveEntryExpire(db,de);
+        if (server.cluster_enabled) slotToKeyDel(db,(sds)de->dictGetKey());
+        if (db->m_keys_index) keyIndexDel(db,(sds)de->dictGetKey());
+        db->m_dict->dictFreeUnlinkedEntry(de);
         return 1;
     } else {
         return 0;
@@ -262,8 +449,7 @@ int dbSyncDelete(redisDb *db, robj *key) {
 /* This is a wrapper whose behavior depends on the Redis lazy free
  * configuration. Deletes the key synchronously or asynchronously. */
 int dbDelete(redisDb *db, robj *key) {
-    return server.lazyfree_lazy_server_del ? dbAsyncDelete(db,key) :
-                                             dbSyncDelete(db,key);
+    return dbGenericDelete(db,key,server.lazyfree_lazy_server_del);
 }
 
 /* Prepare the string object stored at 'key' to be modified destructively
@@ -326,28 +512,107 @@ long long emptyDb(int dbnum, int flags, void(callback)(void*)) {
         errno = EINVAL;
         return -1;
     }
+    snapshotAbort("the keyspace was flushed");
 
     for (j = 0; j < server.dbnum; j++) {
         if (dbnum != -1 && dbnum != j) continue;
         removed += server.db[j].m_dict->dictSize();
-        if (async) {
+        /* Like the values past lazyfree-auto-threshold, big databases are
+         * freed in background anyway, unless the caller needs to serve
+         * events while the keys are freed. */
+        if (async || (callback == NULL && server.lazyfree_auto_threshold &&
+            server.db[j].m_dict->dictSize() >
+            (unsigned long)server.lazyfree_auto_threshold))
+        {
             emptyDbAsync(&server.db[j]);
+            if (server.cluster_enabled) slotToKeyFlushAsync(&server.db[j]);
         } else {
             server.db[j].m_dict->dictEmpty(callback);
             server.db[j].m_expires->dictEmpty(callback);
+            if (server.db[j].m_expires_index) {
+                raxFree(server.db[j].m_expires_index);
+                server.db[j].m_expires_index = raxNew();
+            }
+            if (server.db[j].m_keys_index) {
+                raxFree(server.db[j].m_keys_index);
+                server.db[j].m_keys_index = raxNew();
+            }
+            if (server.cluster_enabled) slotToKeyFlush(&server.db[j]);
         }
-    }
-    if (server.cluster_enabled) {
-        if (async) {
-            slotToKeyFlushAsync();
-        } else {
-            slotToKeyFlush();
-        }
+        decrRefCount(server.db[j].m_hexpires);
+        server.db[j].m_hexpires = createZsetListpackObject();
+        hllFlushUnionCache(&server.db[j]);
     }
     if (dbnum == -1) flushSlaveKeysWithExpireList();
     return removed;
 }
 
+/* Create an empty array of server.dbnum databases where a new dataset can
+ * be loaded while server.db is still served, see repl-async-load. */
+redisDb *initTempDb(void) {
+    redisDb *tempDb = (redisDb *)zmalloc(sizeof(redisDb)*server.dbnum);
+
+    for (int j = 0; j < server.dbnum; j++) {
+        new (tempDb + j) redisDb(j);
+        if (server.db[j].m_expires_index) tempDb[j].m_expires_index = raxNew();
+        if (server.db[j].m_keys_index) tempDb[j].m_keys_index = raxNew();
+    }
+    return tempDb;
+}
+
+/* Free an array created by initTempDb(), with its keys. With 'async' the
+ * keys are freed by the lazyfree threads. */
+void discardTempDb(redisDb *tempDb, int async) {
+    for (int j = 0; j < server.dbnum; j++) {
+        redisDb *db = tempDb+j;
+
+        if (async) emptyDbAsync(db);
+        dictRelease(db->m_dict);
+        dictRelease(db->m_expires);
+        if (db->m_expires_index) raxFree(db->m_expires_index);
+        if (db->m_keys_index) raxFree(db->m_keys_index);
+        decrRefCount(db->m_hexpires);
+        dictRelease(db->m_blocking_keys);
+        dictRelease(db->m_ready_keys);
+        dictRelease(db->m_watched_keys);
+        zfree(db->m_watched_filter);
+        dictRelease(db->m_hll_unions);
+        dictRelease(db->m_hll_versions);
+    }
+    zfree(tempDb);
+}
+
+/* Replace the keys of server.db with the ones loaded in 'tempDb', that gets
+ * the old ones in exchange. Like in dbSwapDatabases() the blocked and the
+ * watched keys stay with server.db: the watching clients are flagged as
+ * after a FLUSHALL, and the blocked ones are served if their keys appeared. */
+void swapMainDbWithTempDb(redisDb *tempDb) {
+    snapshotAbort("the keyspace was replaced");
+    signalFlushedDb(-1);
+    for (int j = 0; j < server.dbnum; j++) {
+        redisDb aux = server.db[j];
+        redisDb *db = server.db+j, *temp = tempDb+j;
+
+        db->m_dict = temp->m_dict;
+        db->m_expires = temp->m_expires;
+        db->m_expires_index = temp->m_expires_index;
+        db->m_keys_index = temp->m_keys_index;
+        db->m_hexpires = temp->m_hexpires;
+        db->m_avg_ttl = temp->m_avg_ttl;
+
+        temp->m_dict = aux.m_dict;
+        temp->m_expires = aux.m_expires;
+        temp->m_expires_index = aux.m_expires_index;
+        temp->m_keys_index = aux.m_keys_index;
+        temp->m_hexpires = aux.m_hexpires;
+        temp->m_avg_ttl = aux.m_avg_ttl;
+
+        scanDatabaseForReadyLists(db);
+        hllFlushUnionCache(db);
+    }
+    flushSlaveKeysWithExpireList();
+}
+
 int client::selectDb(int id) {
     if (id < 0 || id >= server.dbnum)
         return C_ERR;
@@ -366,10 +631,17 @@ int client::selectDb(int id) {
 
 void signalModifiedKey(redisDb *db, robj *key) {
     touchWatchedKey(db,key);
+    hllTouchKey(db,key);
+    if (server.migrate_slot_jobs->listLength())
+        migrateSlotKeyModified(db,key);
+    if (server.rdb_child_pid != -1 || server.aof_child_pid != -1)
+        childInfoTrackWrite(db,key);
+    trackingInvalidateKey(key);
 }
 
 void signalFlushedDb(int dbid) {
     touchWatchedKeysOnFlush(dbid);
+    trackingInvalidateKeysOnFlush(dbid);
 }
 
 /*-----------------------------------------------------------------------------
@@ -441,9 +713,10 @@ void delGenericCommand(client *c, int lazy) {
     int numdel = 0, j;
 
     for (j = 1; j < c->m_argc; j++) {
+        if ((j-1) % DICT_PREFETCH_BATCH == 0)
+            dbPrefetchKeys(c->m_cur_selected_db,c->m_argv+j,c->m_argc-j,1);
         expireIfNeeded(c->m_cur_selected_db,c->m_argv[j]);
-        int deleted  = lazy ? dbAsyncDelete(c->m_cur_selected_db,c->m_argv[j]) :
-                              dbSyncDelete(c->m_cur_selected_db,c->m_argv[j]);
+        int deleted = dbGenericDelete(c->m_cur_selected_db,c->m_argv[j],lazy);
         if (deleted) {
             signalModifiedKey(c->m_cur_selected_db,c->m_argv[j]);
             notifyKeyspaceEvent(NOTIFY_GENERIC,
@@ -470,6 +743,8 @@ void existsCommand(client *c) {
     int j;
 
     for (j = 1; j < c->m_argc; j++) {
+        if ((j-1) % DICT_PREFETCH_BATCH == 0)
+            dbPrefetchKeys(c->m_cur_selected_db,c->m_argv+j,c->m_argc-j,1);
         expireIfNeeded(c->m_cur_selected_db,c->m_argv[j]);
         if (dbExists(c->m_cur_selected_db,c->m_argv[j])) count++;
     }
@@ -506,20 +781,235 @@ void randomkeyCommand(client *c) {
     decrRefCount(key);
 }
 
+/* When keyspace-index is enabled the keys of every DB are also stored in
+ * lexicographic order in db->m_keys_index, a radix tree with no values, so
+ * that the keys with a given prefix, or in a given range, are found without
+ * visiting the whole keyspace: KEYS and SCAN use it when the pattern starts
+ * with a literal prefix, and KEYSRANGE returns the keys of a range. The cost
+ * is a copy of every key name in the tree, where the keys sharing a prefix
+ * share its nodes. */
+void keyIndexAdd(redisDb *db, sds key) {
+    raxInsert(db->m_keys_index,(unsigned char*)key,sdslen(key),NULL,NULL);
+}
+
+void keyIndexDel(redisDb *db, sds key) {
+    raxRemove(db->m_keys_index,(unsigned char*)key,sdslen(key),NULL);
+}
+
+/* Create or release the index of every DB according to keyspace-index.
+ * Called at startup and by CONFIG SET: enabling it indexes all the keys,
+ * which takes a time proportional to their number. */
+void keyIndexInit(void) {
+    for (int j = 0; j < server.dbnum; j++) {
+        redisDb *db = server.db+j;
+
+        if (server.keyspace_index && db->m_keys_index == NULL) {
+            dictIterator di(db->m_dict, 0);
+            dictEntry *de;
+
+            db->m_keys_index = raxNew();
+            while ((de = di.dictNext()) != NULL)
+                keyIndexAdd(db,(sds)de->dictGetKey());
+        } else if (!server.keyspace_index && db->m_keys_index) {
+            raxFree(db->m_keys_index);
+            db->m_keys_index = NULL;
+        }
+    }
+}
+
+/* Add to 'keys' the keys of the index starting with the literal prefix of
+ * the pattern and matching it. */
+static void keyIndexCollectPrefix(redisDb *db, stringmatchPattern *sp, list *keys) {
+    raxIterator ri;
+
+    raxStart(&ri,db->m_keys_index);
+    raxSeek(&ri,">=",(unsigned char*)sp->pattern,sp->prefixlen);
+    while (raxNext(&ri)) {
+        if (ri.key_len < (size_t)sp->prefixlen ||
+            memcmp(ri.key,sp->pattern,sp->prefixlen) != 0) break;
+        if (stringmatchCompiled(sp,(char*)ri.key,ri.key_len))
+            keys->listAddNodeTail(createStringObject((char*)ri.key,ri.key_len));
+    }
+    raxStop(&ri);
+}
+
+/* KEYS of a database bigger than keys-job-threshold runs as a job: the
+ * client is blocked while a time event walks the keys with dictScan(), a
+ * step of KEYS_JOB_STEP_US at a time, and the reply is sent at the end of
+ * the walk, since the number of keys comes first in the protocol. */
+typedef struct keysJob {
+    client *c;              /* Client blocked in KEYS. */
+    int dbid;
+    sds pattern;
+    stringmatchPattern sp;
+    unsigned long cursor;   /* dictScan() cursor of the keys of the DB. */
+    int scan_done;
+    list *batch;            /* Keys matched by the last scan step. */
+    dict *found;            /* Keys to reply, set of SDS strings. */
+} keysJob;
+
+/* Release the job, when the client is resumed, unblocked or freed. */
+static void keysJobFree(void *privdata) {
+    keysJob *job = (keysJob *)privdata;
+    listNode *ln;
+
+    listIter li(job->batch);
+    while((ln = li.listNext())) sdsfree((sds)ln->listNodeValue());
+    listRelease(job->batch);
+    dictRelease(job->found);
+    sdsfree(job->pattern);
+
+    ln = server.keys_jobs->listSearchKey(job);
+    serverAssert(ln != NULL);
+    server.keys_jobs->listDelNode(ln);
+    zfree(job);
+}
+
+/* Collect the matching keys of a dictScan() step. A key may be visited
+ * twice when the table is resized between two steps, so the keys already
+ * found are skipped. */
+static void keysJobScanCallback(void *privdata, const dictEntry *de) {
+    keysJob *job = (keysJob *)privdata;
+    sds key = (sds)de->dictGetKey();
+
+    if (!stringmatchCompiled(&job->sp,key,sdslen(key))) return;
+    if (job->found->dictFind(key)) return;
+    job->batch->listAddNodeTail(sdsdup(key));
+}
+
+/* Walk the keys until the deadline, in microseconds, or the end of the
+ * table. The keys are expired after each scan step, not from the callback,
+ * since deleting them would modify the table being scanned. */
+static void keysJobStep(keysJob *job, long long deadline) {
+    redisDb *db = server.db+job->dbid;
+    listNode *ln;
+    int steps = 0;
+
+    while (!job->scan_done) {
+        job->cursor = db->m_dict->dictScan(job->cursor,keysJobScanCallback,
+                                           NULL,job);
+        if (job->cursor == 0) job->scan_done = 1;
+
+        while ((ln = job->batch->listFirst()) != NULL) {
+            sds key = (sds)ln->listNodeValue();
+            robj keyobj;
+
+            initStaticStringObject(keyobj,key);
+            if (expireIfNeeded(db,&keyobj) == 0 &&
+                job->found->dictAdd(key,NULL) == DICT_OK)
+                key = NULL;
+            if (key) sdsfree(key);
+            job->batch->listDelNode(ln);
+        }
+        if ((++steps & 15) == 0 && ustime() >= deadline) break;
+    }
+}
+
+/* Continuation of KEYS: send the keys found to the client. */
+static void keysJobResume(client *c, void *privdata, int status) {
+    keysJob *job = (keysJob *)privdata;
+    dictEntry *de;
+    UNUSED(status);
+
+    c->addReplyMultiBulkLen(job->found->dictSize());
+    dictIterator di(job->found);
+    while((de = di.dictNext()) != NULL) {
+        sds key = (sds)de->dictGetKey();
+        c->addReplyBulkCBuffer(key,sdslen(key));
+    }
+}
+
+/* Time event running a step of every KEYS job, until none is left. */
+static int keysJobsTimeProc(aeEventLoop *el, long long id, void *clientData) {
+    listNode *ln;
+    UNUSED(el);
+    UNUSED(id);
+    UNUSED(clientData);
+
+    listIter li(server.keys_jobs);
+    while((ln = li.listNext())) {
+        keysJob *job = (keysJob *)ln->listNodeValue();
+
+        keysJobStep(job,ustime()+KEYS_JOB_STEP_US);
+        if (job->scan_done) resumeBlockedClient(job->c,CONTINUATION_DONE);
+    }
+    /* Run again in 1 millisecond, so that the other clients are served in
+     * between the steps. */
+    if (server.keys_jobs->listLength()) return 1;
+    server.keys_jobs_timer = -1;
+    return AE_NOMORE;
+}
+
+/* Block the client in KEYS, walking the keys as a job. */
+static void keysJobStart(client *c) {
+    sds pattern = (sds)c->m_argv[1]->ptr;
+    keysJob *job = (keysJob *)zcalloc(sizeof(*job));
+
+    job->c = c;
+    job->dbid = c->m_cur_selected_db->m_id;
+    job->pattern = sdsdup(pattern);
+    stringmatchCompile(&job->sp,job->pattern,sdslen(job->pattern),0);
+    job->batch = listCreate();
+    job->found = dictCreate(&setDictType,NULL);
+    server.keys_jobs->listAddNodeTail(job);
+
+    blockClientOnContinuation(c,0,keysJobResume,keysJobFree,job);
+
+    if (server.keys_jobs_timer == -1)
+        server.keys_jobs_timer =
+            server.el->aeCreateTimeEvent(0,keysJobsTimeProc,NULL,NULL);
+}
+
 void keysCommand(client *c) {
     dictEntry *de;
     sds pattern = (sds)c->m_argv[1]->ptr;
-    int plen = sdslen(pattern), allkeys;
+    stringmatchPattern sp;
     unsigned long numkeys = 0;
+
+    stringmatchCompile(&sp,pattern,sdslen(pattern),0);
+
+    /* Walking a big keyspace at once would block the other clients for
+     * as long: KEYS becomes a job, except where it can't block. */
+    if (server.keys_job_threshold &&
+        c->m_cur_selected_db->m_dict->dictSize() >
+            (unsigned long)server.keys_job_threshold &&
+        !(c->m_cur_selected_db->m_keys_index && sp.prefixlen > 0) &&
+        !(c->m_flags & (CLIENT_MULTI|CLIENT_LUA)))
+    {
+        keysJobStart(c);
+        return;
+    }
+
     void *replylen = c->addDeferredMultiBulkLength();
 
+    /* With a literal prefix the ordered index of the keys has them all
+     * together. The keys are collected first, since expiring them while
+     * iterating would modify the index. */
+    if (c->m_cur_selected_db->m_keys_index && sp.prefixlen > 0) {
+        list *keys = listCreate();
+        listNode *ln;
+
+        keyIndexCollectPrefix(c->m_cur_selected_db,&sp,keys);
+        while ((ln = keys->listFirst()) != NULL) {
+            robj *keyobj = (robj *)ln->listNodeValue();
+            if (expireIfNeeded(c->m_cur_selected_db,keyobj) == 0) {
+                c->addReplyBulk(keyobj);
+                numkeys++;
+            }
+            decrRefCount(keyobj);
+            keys->listDelNode(ln);
+        }
+        listRelease(keys);
+        c->setDeferredMultiBulkLength(replylen,numkeys);
+        return;
+    }
+
     dictIterator di(c->m_cur_selected_db->m_dict, 1);
-    allkeys = (pattern[0] == '*' && pattern[1] == '\0');
     while((de = di.dictNext()) != NULL) {
         sds key = (sds)de->dictGetKey();
         robj *keyobj;
 
-        if (allkeys || stringmatchlen(pattern,plen,key,sdslen(key),0)) {
+        if (stringmatchCompiled(&sp,key,sdslen(key))) {
             keyobj = createStringObject(key,sdslen(key));
             if (expireIfNeeded(c->m_cur_selected_db,keyobj) == 0) {
                 c->addReplyBulk(keyobj);
@@ -532,29 +1022,114 @@ void keysCommand(client *c) {
     c->setDeferredMultiBulkLength(replylen,numkeys);
 }
 
+/* KEYSRANGE min max [COUNT count]
+ *
+ * Return, in lexicographic order, the keys of the current DB in the range
+ * min..max, expressed like in ZRANGEBYLEX. Requires keyspace-index: deleting
+ * all the keys of a tenant, stored under a common prefix, is a matter of
+ * fetching them in batches of COUNT and unlinking them. Expired keys are
+ * skipped but not deleted, since the index can't be modified while it is
+ * iterated. */
+void keysrangeCommand(client *c) {
+    redisDb *db = c->m_cur_selected_db;
+    zlexrangespec range;
+    long count = -1;
+    unsigned long numkeys = 0;
+    long long now = mstime();
+    raxIterator ri;
+
+    if (db->m_keys_index == NULL) {
+        c->addReplyError("KEYSRANGE requires keyspace-index to be enabled");
+        return;
+    }
+    if (c->m_argc == 5 && !strcasecmp((const char*)c->m_argv[3]->ptr,"count")) {
+        if (getLongFromObjectOrReply(c,c->m_argv[4],&count,NULL) != C_OK)
+            return;
+        if (count < 0) count = -1;
+    } else if (c->m_argc != 3) {
+        c->addReply(shared.syntaxerr);
+        return;
+    }
+    if (zslParseLexRange(c->m_argv[1],c->m_argv[2],&range) != C_OK) {
+        c->addReplyError("min or max not valid string range item");
+        return;
+    }
+
+    void *replylen = c->addDeferredMultiBulkLength();
+    raxStart(&ri,db->m_keys_index);
+    if (range.min == shared.minstring)
+        raxSeek(&ri,"^",NULL,0);
+    else
+        raxSeek(&ri,range.minex ? ">" : ">=",(unsigned char*)range.min,
+                sdslen(range.min));
+    while (count != 0 && raxNext(&ri)) {
+        robj *keyobj = createStringObject((char*)ri.key,ri.key_len);
+        long long when;
+
+        if (!zslLexValueLteMax((sds)keyobj->ptr,&range)) {
+            decrRefCount(keyobj);
+            break;
+        }
+        when = getExpire(db,keyobj);
+        if (when == -1 || when > now) {
+            c->addReplyBulk(keyobj);
+            numkeys++;
+            if (count > 0) count--;
+        }
+        decrRefCount(keyobj);
+    }
+    raxStop(&ri);
+    zslFreeLexRange(&range);
+    c->setDeferredMultiBulkLength(replylen,numkeys);
+}
+
+/* Same as scanCallback(), for the elements of compressed bitmaps. */
+void scanRoaringCallback(void *privdata, int64_t value) {
+    list *keys = (list *)privdata;
+    keys->listAddNodeTail(createStringObjectFromLongLong(value));
+}
+
+/* Filters of the keys of a SCAN, applied by scanCallback() to the keys as
+ * they are visited, so that no object is created for the other keys. */
+struct scanFilter {
+    stringmatchPattern *pattern;    /* MATCH pattern, or NULL. */
+    const char *type;               /* TYPE name, or NULL. */
+};
+
 /* This callback is used by scanGenericCommand in order to collect elements
  * returned by the dictionary iterator into a list. */
 void scanCallback(void *privdata, const dictEntry *de) {
     void **pd = (void**) privdata;
     list *keys = (list *)pd[0];
     robj *o = (robj *)pd[1];
+    scanFilter *filter = (scanFilter *)pd[2];
     robj *key, *val = NULL;
 
     if (o == NULL) {
         sds sdskey = (sds)de->dictGetKey();
+        if (filter->pattern &&
+            !stringmatchCompiled(filter->pattern,sdskey,sdslen(sdskey)))
+            return;
+        if (filter->type &&
+            strcasecmp(filter->type,getObjectTypeName((robj *)de->dictGetVal())))
+            return;
         key = createStringObject(sdskey, sdslen(sdskey));
     } else if (o->type == OBJ_SET) {
         sds keysds = (sds)de->dictGetKey();
         key = createStringObject(keysds,sdslen(keysds));
     } else if (o->type == OBJ_HASH) {
         sds sdskey = (sds)de->dictGetKey();
-        sds sdsval = (sds)de->dictGetVal();
         key = createStringObject(sdskey,sdslen(sdskey));
-        val = createStringObject(sdsval,sdslen(sdsval));
+        if (hashDictValIsInt(de)) {
+            val = createStringObjectFromLongLong(hashDictValGetInt(de));
+        } else {
+            sds sdsval = (sds)de->dictGetVal();
+            val = createStringObject(sdsval,sdslen(sdsval));
+        }
     } else if (o->type == OBJ_ZSET) {
         sds sdskey = (sds)de->dictGetKey();
         key = createStringObject(sdskey,sdslen(sdskey));
-        val = createStringObjectFromLongDouble(*(double*)de->dictGetVal(),0);
+        val = createStringObjectFromLongDouble(zsetDictScore((zset*)o->ptr,de),0);
     } else {
         serverPanic("Type not handled in SCAN callback.");
     }
@@ -563,6 +1138,92 @@ void scanCallback(void *privdata, const dictEntry *de) {
     if (val) keys->listAddNodeTail( val);
 }
 
+/* SCAN of the keyspace with a pattern starting with a literal prefix walks
+ * the ordered index of the keys from the prefix instead of the hash table.
+ * The cursor of such an iteration has the SCAN_INDEX_CURSOR bit set, which
+ * a hash table cursor never has since it is lower than the table size, and
+ * stores the SCAN_INDEX_CURSOR_BYTES bytes following the prefix of the next
+ * key to visit. Keys longer than that are truncated in the cursor, so the
+ * next call may return again some of the keys of the previous one, which is
+ * allowed by the SCAN guarantees. */
+#define SCAN_INDEX_CURSOR ((unsigned long)1 << (sizeof(unsigned long)*8-2))
+#define SCAN_INDEX_CURSOR_BYTES ((int)sizeof(unsigned long)-1)
+
+static unsigned long keyIndexScanCursor(unsigned char *key, size_t len,
+                                        size_t prefixlen)
+{
+    unsigned long cursor = 0;
+
+    for (int j = 0; j < SCAN_INDEX_CURSOR_BYTES; j++) {
+        size_t pos = prefixlen+j;
+        cursor = (cursor << 8) | (pos < len ? key[pos] : 0);
+    }
+    return cursor;
+}
+
+/* Add to 'keys' up to 'count' keys of the index matching the filter,
+ * visiting at most ten times as many keys, and return the cursor of the
+ * next call, or 0 when the keys with the prefix are over. */
+static unsigned long keyIndexScan(redisDb *db, scanFilter *filter,
+                                  unsigned long cursor, long count, list *keys)
+{
+    stringmatchPattern *sp = filter->pattern;
+    size_t prefixlen = sp->prefixlen;
+    sds seek = sdsnewlen(sp->pattern,prefixlen);
+    unsigned long start = cursor & ~SCAN_INDEX_CURSOR;
+    int resume = cursor != 0;
+    long maxiterations = count*10;
+    long matched = 0;
+    raxIterator ri;
+
+    /* The trailing zero bytes of the cursor are padding of a shorter key,
+     * or part of the key: seeking without them is right in both cases. */
+    if (resume) {
+        unsigned char buf[sizeof(unsigned long)];
+        int len = SCAN_INDEX_CURSOR_BYTES;
+
+        for (int j = 0; j < len; j++)
+            buf[j] = (start >> (8*(len-1-j))) & 0xff;
+        while (len && buf[len-1] == 0) len--;
+        seek = sdscatlen(seek,buf,len);
+    }
+
+    cursor = 0;
+    raxStart(&ri,db->m_keys_index);
+    raxSeek(&ri,">=",(unsigned char*)seek,sdslen(seek));
+    while (raxNext(&ri)) {
+        if (ri.key_len < prefixlen ||
+            memcmp(ri.key,sp->pattern,prefixlen) != 0) break;
+
+        /* Stop only where the cursor moves forward, otherwise a call
+         * would resume from the same key forever. */
+        if (matched >= count || maxiterations <= 0) {
+            unsigned long next = keyIndexScanCursor(ri.key,ri.key_len,
+                                                    prefixlen);
+            if (!resume || next > start) {
+                cursor = SCAN_INDEX_CURSOR | next;
+                break;
+            }
+        }
+        maxiterations--;
+
+        if (!stringmatchCompiled(sp,(char*)ri.key,ri.key_len)) continue;
+        if (filter->type) {
+            sds key = sdsnewlen(ri.key,ri.key_len);
+            dictEntry *de = db->m_dict->dictFind(key);
+            sdsfree(key);
+            if (de == NULL ||
+                strcasecmp(filter->type,getObjectTypeName((robj *)de->dictGetVal())))
+                continue;
+        }
+        keys->listAddNodeTail(createStringObject((char*)ri.key,ri.key_len));
+        matched++;
+    }
+    raxStop(&ri);
+    sdsfree(seek);
+    return cursor;
+}
+
 /* Try to parse a SCAN cursor stored at object 'o':
  * if the cursor is valid, store it as unsigned integer into *cursor and
  * returns C_OK. Otherwise return C_ERR and send an error to the
@@ -598,8 +1259,9 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
     list *keys = listCreate();
     listNode *node, *nextnode;
     long count = 10;
-    sds pat = NULL;
-    int patlen = 0, use_pattern = 0;
+    stringmatchPattern sp;
+    int use_pattern = 0;
+    scanFilter filter = {NULL, NULL};
     dict *ht;
 
     /* Object must be NULL (to iterate keys names), or the type of the object
@@ -627,13 +1289,18 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
 
             i += 2;
         } else if (!strcasecmp((const char*)c->m_argv[i]->ptr, "match") && j >= 2) {
-            pat = (sds)c->m_argv[i+1]->ptr;
-            patlen = sdslen(pat);
+            sds pat = (sds)c->m_argv[i+1]->ptr;
+            stringmatchCompile(&sp,pat,sdslen(pat),0);
 
-            /* The pattern always matches if it is exactly "*", so it is
-             * equivalent to disabling it. */
-            use_pattern = !(pat[0] == '*' && patlen == 1);
+            /* A pattern that always matches, like "*", is equivalent to
+             * disabling it. */
+            use_pattern = sp.type != STRINGMATCH_ALL;
 
+            i += 2;
+        } else if (!strcasecmp((const char*)c->m_argv[i]->ptr, "type") &&
+                   o == NULL && j >= 2)
+        {
+            filter.type = (const char *)c->m_argv[i+1]->ptr;
             i += 2;
         } else {
             c->addReply(shared.syntaxerr);
@@ -643,11 +1310,12 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
 
     /* Step 2: Iterate the collection.
      *
-     * Note that if the object is encoded with a ziplist, intset, or any other
-     * representation that is not a hash table, we are sure that it is also
-     * composed of a small number of elements. So to avoid taking state we
-     * just return everything inside the object in a single call, setting the
-     * cursor to zero to signal the end of the iteration. */
+     * Note that if the object is encoded with a listpack, intset, or any other
+     * representation that is not a hash table or a compressed bitmap, we are
+     * sure that it is also composed of a small number of elements. So to
+     * avoid taking state we just return everything inside the object in a
+     * single call, setting the cursor to zero to signal the end of the
+     * iteration. */
 
     /* Handle the case of a hash table. */
     ht = NULL;
@@ -658,30 +1326,63 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
     } else if (o->type == OBJ_HASH && o->encoding == OBJ_ENCODING_HT) {
         ht = (dict *)o->ptr;
         count *= 2; /* We return key / value for this type. */
-    } else if (o->type == OBJ_ZSET && o->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (o->type == OBJ_ZSET && (o->encoding == OBJ_ENCODING_SKIPLIST ||
+                                       o->encoding == OBJ_ENCODING_BTREE))
+    {
         zset* zs = (zset*)o->ptr;
         ht = zs->_dict;
         count *= 2; /* We return key / value for this type. */
     }
 
+    /* A pattern with a literal prefix is served by the ordered index of the
+     * keys when there is one. A cursor of the index arriving when it can't
+     * be used, because it was disabled or the pattern changed, restarts the
+     * iteration. */
+    if (o == NULL && use_pattern && sp.prefixlen > 0 &&
+        c->m_cur_selected_db->m_keys_index &&
+        (cursor == 0 || (cursor & SCAN_INDEX_CURSOR)))
+    {
+        filter.pattern = &sp;
+        use_pattern = 0;
+        cursor = keyIndexScan(c->m_cur_selected_db,&filter,cursor,count,keys);
+        ht = NULL;
+    } else if (o == NULL && (cursor & SCAN_INDEX_CURSOR)) {
+        cursor = 0;
+    }
+
     if (ht) {
-        void *privdata[2];
+        void *privdata[3];
         /* We set the max number of iterations to ten times the specified
          * COUNT, so if the hash table is in a pathological state (very
          * sparsely populated) we avoid to block too much time at the cost
          * of returning no or very few elements. */
         long maxiterations = count*10;
 
-        /* We pass two pointers to the callback: the list to which it will
-         * add new elements, and the object containing the dictionary so that
-         * it is possible to fetch more data in a type-dependent way. */
+        /* We pass three pointers to the callback: the list to which it will
+         * add new elements, the object containing the dictionary so that
+         * it is possible to fetch more data in a type-dependent way, and
+         * the filters of the keys. When scanning the keyspace the MATCH
+         * pattern is checked there, so the iteration goes on until COUNT
+         * keys matched, or maxiterations buckets were visited. */
+        if (o == NULL && use_pattern) {
+            filter.pattern = &sp;
+            use_pattern = 0;
+        }
         privdata[0] = keys;
         privdata[1] = o;
+        privdata[2] = &filter;
         do {
             cursor = ht->dictScan(cursor, scanCallback, NULL, privdata);
         } while (cursor &&
               maxiterations-- &&
               keys->listLength() < (unsigned long)count);
+    } else if (o == NULL) {
+        /* Already iterated through the index of the keys. */
+    } else if (o->type == OBJ_SET && o->encoding == OBJ_ENCODING_ROARING) {
+        /* Compressed bitmaps can be big, they are scanned a few containers
+         * at a time using as cursor the key of the next container. */
+        cursor = ((roaring *)o->ptr)->roaringScan(cursor,count,
+                                                  scanRoaringCallback,keys);
     } else if (o->type == OBJ_SET) {
         int pos = 0;
         int64_t ll;
@@ -690,17 +1391,17 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
             keys->listAddNodeTail(createStringObjectFromLongLong(ll));
         cursor = 0;
     } else if (o->type == OBJ_HASH || o->type == OBJ_ZSET) {
-        unsigned char *p = (unsigned char *)ziplistIndex((unsigned char *)o->ptr,0);
+        unsigned char *p = lpFirst((unsigned char *)o->ptr);
         unsigned char *vstr;
         unsigned int vlen;
         long long vll;
 
         while(p) {
-            ziplistGet(p,&vstr,&vlen,&vll);
+            lpGetValue(p,&vstr,&vlen,&vll);
             keys->listAddNodeTail(
                 (vstr != NULL) ? createStringObject((char*)vstr,vlen) :
                                  createStringObjectFromLongLong(vll));
-            p = ziplistNext((unsigned char *)o->ptr,p);
+            p = lpNext((unsigned char *)o->ptr,p);
         }
         cursor = 0;
     } else {
@@ -717,7 +1418,7 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
         /* Filter element if it does not match the pattern. */
         if (!filter && use_pattern) {
             if (sdsEncodedObject(kobj)) {
-                if (!stringmatchlen(pat, patlen, (const char *)kobj->ptr, sdslen((sds)kobj->ptr), 0))
+                if (!stringmatchCompiled(&sp,(const char *)kobj->ptr,sdslen((sds)kobj->ptr)))
                     filter = 1;
             } else {
                 char buf[LONG_STR_SIZE];
@@ -725,7 +1426,7 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
 
                 serverAssert(kobj->encoding == OBJ_ENCODING_INT);
                 len = ll2string(buf,sizeof(buf),(long)kobj->ptr);
-                if (!stringmatchlen(pat, patlen, buf, len, 0)) filter = 1;
+                if (!stringmatchCompiled(&sp,buf,len)) filter = 1;
             }
         }
 
@@ -786,28 +1487,28 @@ void lastsaveCommand(client *c) {
     c->addReplyLongLong(server.lastsave);
 }
 
+/* Return the name of the type of 'o', as reported by TYPE. */
+char *getObjectTypeName(robj *o) {
+    switch(o->type) {
+    case OBJ_STRING: return "string";
+    case OBJ_LIST: return "list";
+    case OBJ_SET: return "set";
+    case OBJ_ZSET: return "zset";
+    case OBJ_HASH: return "hash";
+    case OBJ_STREAM: return "stream";
+    case OBJ_MODULE: {
+        moduleValue* mv = (moduleValue*)o->ptr;
+        return mv->m_type->m_name;
+    }
+    default: return "unknown";
+    }
+}
+
 void typeCommand(client *c) {
     robj *o;
-    char *type;
 
     o = lookupKeyReadWithFlags(c->m_cur_selected_db,c->m_argv[1],LOOKUP_NOTOUCH);
-    if (o == NULL) {
-        type = "none";
-    } else {
-        switch(o->type) {
-        case OBJ_STRING: type = "string"; break;
-        case OBJ_LIST: type = "list"; break;
-        case OBJ_SET: type = "set"; break;
-        case OBJ_ZSET: type = "zset"; break;
-        case OBJ_HASH: type = "hash"; break;
-        case OBJ_MODULE: {
-            moduleValue* mv = (moduleValue*)o->ptr;
-            type = mv->m_type->m_name;
-        }; break;
-        default: type = "unknown"; break;
-        }
-    }
-    c->addReplyStatus(type);
+    c->addReplyStatus(o == NULL ? "none" : getObjectTypeName(o));
 }
 
 void shutdownCommand(client *c) {
@@ -821,6 +1522,15 @@ void shutdownCommand(client *c) {
             flags |= SHUTDOWN_NOSAVE;
         } else if (!strcasecmp((const char*)c->m_argv[1]->ptr,"save")) {
             flags |= SHUTDOWN_SAVE;
+        } else if (!strcasecmp((const char*)c->m_argv[1]->ptr,"handoff")) {
+            /* Restart in place handing the dataset over, see handoff.cpp. */
+            if (server.loading || server.sentinel_mode) {
+                c->addReplyError("SHUTDOWN HANDOFF is not possible while loading or in Sentinel mode");
+                return;
+            }
+            restartServer(RESTART_SERVER_GRACEFULLY|RESTART_SERVER_HANDOFF,0);
+            c->addReplyError("Errors trying to SHUTDOWN HANDOFF. Check logs.");
+            return;
         } else {
             c->addReply(shared.syntaxerr);
             return;
@@ -943,18 +1653,18 @@ void moveCommand(client *c) {
     c->addReply(shared.cone);
 }
 
-/* Helper function for dbSwapDatabases(): scans the list of keys that have
- * one or more blocked clients for B[LR]POP or other list blocking commands
- * and signal the keys are ready if they are lists. See the comment where
- * the function is used for more info. */
+/* Helper function for dbSwapDatabases() and swapMainDbWithTempDb(): scans
+ * the list of keys that have one or more blocked clients for B[LR]POP, XREAD
+ * or other blocking commands and signal the keys are ready if they are lists
+ * or streams. See the comment where the function is used for more info. */
 void scanDatabaseForReadyLists(redisDb *db) {
     dictEntry *de;
     dictIterator di(db->m_blocking_keys, 1);
     while((de = di.dictNext()) != NULL) {
         robj *key = (robj *)de->dictGetKey();
         robj *value = lookupKey(db,key,LOOKUP_NOTOUCH);
-        if (value && value->type == OBJ_LIST)
-            signalListAsReady(db, key);
+        if (value && (value->type == OBJ_LIST || value->type == OBJ_STREAM))
+            signalKeyAsReady(db, key);
     }
 }
 
@@ -970,6 +1680,7 @@ int dbSwapDatabases(int id1, int id2) {
     if (id1 < 0 || id1 >= server.dbnum ||
         id2 < 0 || id2 >= server.dbnum) return C_ERR;
     if (id1 == id2) return C_OK;
+    snapshotAbort("databases swapped");
     redisDb aux = server.db[id1];
     redisDb *db1 = &server.db[id1], *db2 = &server.db[id2];
 
@@ -978,10 +1689,16 @@ int dbSwapDatabases(int id1, int id2) {
      * remain in the same DB they were. */
     db1->m_dict = db2->m_dict;
     db1->m_expires = db2->m_expires;
+    db1->m_expires_index = db2->m_expires_index;
+    db1->m_keys_index = db2->m_keys_index;
+    db1->m_hexpires = db2->m_hexpires;
     db1->m_avg_ttl = db2->m_avg_ttl;
 
     db2->m_dict = aux.m_dict;
     db2->m_expires = aux.m_expires;
+    db2->m_expires_index = aux.m_expires_index;
+    db2->m_keys_index = aux.m_keys_index;
+    db2->m_hexpires = aux.m_hexpires;
     db2->m_avg_ttl = aux.m_avg_ttl;
 
     /* Now we need to handle clients blocked on lists: as an effect
@@ -995,6 +1712,11 @@ int dbSwapDatabases(int id1, int id2) {
      * if needed. */
     scanDatabaseForReadyLists(db1);
     scanDatabaseForReadyLists(db2);
+
+    /* The cached PFCOUNT unions stay with the DB like the watched keys,
+     * but their keys now have other values. */
+    hllFlushUnionCache(db1);
+    hllFlushUnionCache(db2);
     return C_OK;
 }
 
@@ -1031,11 +1753,44 @@ void swapdbCommand(client *c) {
  * Expires API
  *----------------------------------------------------------------------------*/
 
+/* Store 'when' as the expire of the entry 'de' of db->m_dict, adding the
+ * entry to db->m_expires if the key was not volatile. */
+static void dbSetEntryExpire(redisDb *db, dictEntry *de, long long when) {
+    long long *slot = (long long*)db->m_dict->dictGetEntryMetadata(de);
+
+    if (*slot == 0) {
+        int retval = db->m_expires->dictAddEntry(de);
+        serverAssert(retval == DICT_OK);
+    } else if (db->m_expires_index) {
+        expireIndexDel(db,(sds)de->dictGetKey(),*slot);
+    }
+    /* Zero means no expire: the epoch is as expired as one millisecond
+     * later. */
+    *slot = when ? when : 1;
+    if (db->m_expires_index) expireIndexAdd(db,(sds)de->dictGetKey(),*slot);
+}
+
+/* Remove the expire of the entry 'de' of db->m_dict, if any, from
+ * db->m_expires and from the expire index. Returns 1 if the key had an
+ * expire, 0 otherwise. Must be called before the entry is released, since
+ * db->m_expires borrows it. */
+int dbRemoveEntryExpire(redisDb *db, dictEntry *de) {
+    long long *slot = (long long*)db->m_dict->dictGetEntryMetadata(de);
+
+    if (*slot == 0) return 0;
+    int retval = db->m_expires->dictDelete(de->dictGetKey());
+    serverAssert(retval == DICT_OK);
+    if (db->m_expires_index) expireIndexDel(db,(sds)de->dictGetKey(),*slot);
+    *slot = 0;
+    return 1;
+}
+
 int removeExpire(redisDb *db, robj *key) {
     /* An expire may only be removed if there is a corresponding entry in the
      * main dict. Otherwise, the key will never be freed. */
-    serverAssertWithInfo(NULL,key,db->m_dict->dictFind(key->ptr) != NULL);
-    return db->m_expires->dictDelete(key->ptr) == DICT_OK;
+    dictEntry *de = db->m_dict->dictFind(key->ptr);
+    serverAssertWithInfo(NULL,key,de != NULL);
+    return dbRemoveEntryExpire(db,de);
 }
 
 /* Set an expire to the specified key. If the expire is set in the context
@@ -1043,13 +1798,10 @@ int removeExpire(redisDb *db, robj *key) {
  * to NULL. The 'when' parameter is the absolute unix time in milliseconds
  * after which the key will no longer be considered valid. */
 void setExpire(client *c, redisDb *db, robj *key, long long when) {
-    dictEntry *kde, *de;
+    dictEntry *de = db->m_dict->dictFind(key->ptr);
 
-    /* Reuse the sds from the main dict in the expire dict */
-    kde = db->m_dict->dictFind(key->ptr);
-    serverAssertWithInfo(NULL,key,kde != NULL);
-    de = db->m_expires->dictAddOrFind(kde->dictGetKey());
-    de->dictSetSignedIntegerVal(when);
+    serverAssertWithInfo(NULL,key,de != NULL);
+    dbSetEntryExpire(db,de,when);
 
     int writable_slave = server.masterhost && server.repl_slave_ro == 0;
     if (c && writable_slave && !(c->m_flags & CLIENT_MASTER))
@@ -1063,12 +1815,8 @@ long long getExpire(redisDb *db, robj *key) {
 
     /* No expire? return ASAP */
     if (db->m_expires->dictSize() == 0 ||
-       (de = db->m_expires->dictFind(key->ptr)) == NULL) return -1;
-
-    /* The entry was found in the expire dict, this means it should also
-     * be present in the main dict (safety check). */
-    serverAssertWithInfo(NULL,key,db->m_dict->dictFind(key->ptr) != NULL);
-    return de->dictGetSignedIntegerVal();
+       (de = db->m_dict->dictFind(key->ptr)) == NULL) return -1;
+    return dbGetEntryExpire(db,de);
 }
 
 /* Propagate expires into slaves and the AOF file.
@@ -1078,7 +1826,10 @@ long long getExpire(redisDb *db, robj *key) {
  * This way the key expiry is centralized in one place, and since both
  * AOF and the master->slave link guarantee operation ordering, everything
  * will be consistent even if we allow write operations against expiring
- * keys. */
+ * keys.
+ *
+ * The clients caching the key (see tracking.cpp) are invalidated too, as
+ * the key is gone like after a DEL: this covers evicted keys as well. */
 void propagateExpire(redisDb *db, robj *key, int lazy) {
     robj *argv[2];
 
@@ -1090,13 +1841,24 @@ void propagateExpire(redisDb *db, robj *key, int lazy) {
     if (server.aof_state != AOF_OFF)
         feedAppendOnlyFile(server.delCommand,db->m_id,argv,2);
     replicationFeedSlaves(server.slaves,db->m_id,argv,2);
+    trackingInvalidateKey(key);
 
     decrRefCount(argv[0]);
     decrRefCount(argv[1]);
 }
 
 int expireIfNeeded(redisDb *db, robj *key) {
-    mstime_t when = getExpire(db,key);
+    dictEntry *de;
+
+    if (db->m_expires->dictSize() == 0 ||
+        (de = db->m_dict->dictFind(key->ptr)) == NULL) return 0;
+    return expireEntryIfNeeded(db,key,&de);
+}
+
+/* Like expireIfNeeded(), for the entry '*de' of 'key' the caller already
+ * found in db->m_dict, that is set to NULL if the key gets deleted. */
+static int expireEntryIfNeeded(redisDb *db, robj *key, dictEntry **de) {
+    mstime_t when = dbGetEntryExpire(db,*de);
     mstime_t now;
 
     if (when < 0) return 0; /* No expire for this key */
@@ -1120,6 +1882,11 @@ int expireIfNeeded(redisDb *db, robj *key) {
      * we think the key is expired at this time. */
     if (server.masterhost != NULL) return now > when;
 
+    /* The same when other threads may be reading the dataset in parallel,
+     * like the read only scripts of lua-parallel-scripts in a master: the
+     * key is reported as expired but deleted later. */
+    if (datasetReadShared()) return now > when;
+
     /* Return when this key has not expired */
     if (now <= when) return 0;
 
@@ -1128,8 +1895,8 @@ int expireIfNeeded(redisDb *db, robj *key) {
     propagateExpire(db,key,server.lazyfree_lazy_expire);
     notifyKeyspaceEvent(NOTIFY_EXPIRED,
         "expired",key,db->m_id);
-    return server.lazyfree_lazy_expire ? dbAsyncDelete(db,key) :
-                                         dbSyncDelete(db,key);
+    *de = NULL;
+    return dbGenericDelete(db,key,server.lazyfree_lazy_expire);
 }
 
 /* -----------------------------------------------------------------------------
@@ -1316,6 +2083,13 @@ int *migrateGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkey
                 num = argc-first;
                 break;
             }
+            /* The SLOT form has no key arguments. */
+            if (!strcasecmp((const char*)argv[i]->ptr,"slot") &&
+                sdslen((sds)argv[3]->ptr) == 0)
+            {
+                *numkeys = 0;
+                return NULL;
+            }
         }
     }
 
@@ -1363,87 +2137,135 @@ int *georadiusGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numk
     return keys;
 }
 
+/* XREAD [BLOCK <milliseconds>] [COUNT <count>]
+ *       STREAMS key_1 key_2 ... key_N ID_1 ID_2 ... ID_N */
+int *xreadGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys) {
+    int i, num = 0, *keys;
+    UNUSED(cmd);
+
+    /* Seek the STREAMS option, skipping the arguments of the other options
+     * that may be "STREAMS" themselves. */
+    int streams_pos = -1;
+    for (i = 1; i < argc; i++) {
+        char *arg = (char*)argv[i]->ptr;
+        if (!strcasecmp(arg, "block")) {
+            i++; /* Skip option argument. */
+        } else if (!strcasecmp(arg, "count")) {
+            i++; /* Skip option argument. */
+        } else if (!strcasecmp(arg, "group")) {
+            i += 2; /* Skip option argument. */
+        } else if (!strcasecmp(arg, "streams")) {
+            streams_pos = i;
+            break;
+        }
+    }
+    if (streams_pos != -1) num = argc - streams_pos - 1;
+
+    /* Syntax error. */
+    if (streams_pos == -1 || num % 2 != 0) {
+        *numkeys = 0;
+        return NULL;
+    }
+    num /= 2; /* We have half the keys as there are arguments because
+                 there are also the IDs, one per key. */
+
+    keys = (int*)zmalloc(sizeof(int) * num);
+    for (i = streams_pos+1; i < argc-num; i++) keys[i-streams_pos-1] = i;
+    *numkeys = num;
+    return keys;
+}
+
 /* Slot to Key API. This is used by Redis Cluster in order to obtain in
  * a fast way a key that belongs to a specified hash slot. This is useful
  * while rehashing the cluster and in other conditions when we need to
- * understand if we have keys for a given hash slot. */
-void slotToKeyUpdateKey(robj *key, int add) {
-    unsigned int hashslot = keyHashSlot((char*)key->ptr,sdslen((sds)key->ptr));
-    unsigned char buf[64];
-    unsigned char *indexed = buf;
-    size_t keylen = sdslen((sds)key->ptr);
-
-    server.cluster->m_slots_keys_count[hashslot] += add ? 1 : -1;
-    if (keylen+2 > 64) indexed = (unsigned char*)zmalloc(keylen+2);
-    indexed[0] = (hashslot >> 8) & 0xff;
-    indexed[1] = hashslot & 0xff;
-    memcpy(indexed+2,key->ptr,keylen);
-    if (add) {
-        raxInsert(server.cluster->m_slots_to_keys,indexed,keylen+2,NULL,NULL);
-    } else {
-        raxRemove(server.cluster->m_slots_to_keys,indexed,keylen+2,NULL);
-    }
-    if (indexed != buf) zfree(indexed);
+ * understand if we have keys for a given hash slot.
+ *
+ * Every hash slot has a dictionary of its keys, created when the first key
+ * is added, that references the same sds strings of the main dictionary, so
+ * the key names are not stored twice. 'key' is always the key stored in the
+ * main dictionary entry, and slotToKeyDel() must be called before the entry
+ * is released. */
+void slotToKeyAdd(redisDb *db, sds key) {
+    unsigned int hashslot = keyHashSlot(key,sdslen(key));
+
+    if (db->m_slots_to_keys == NULL)
+        db->m_slots_to_keys = (dict **)zcalloc(sizeof(dict*)*CLUSTER_SLOTS);
+    if (db->m_slots_to_keys[hashslot] == NULL)
+        db->m_slots_to_keys[hashslot] = dictCreate(&slotKeysDictType,NULL);
+    serverAssert(db->m_slots_to_keys[hashslot]->dictAdd(key,NULL) == DICT_OK);
 }
 
-void slotToKeyAdd(robj *key) {
-    slotToKeyUpdateKey(key,1);
+void slotToKeyDel(redisDb *db, sds key) {
+    unsigned int hashslot = keyHashSlot(key,sdslen(key));
+    dict *d = db->m_slots_to_keys ? db->m_slots_to_keys[hashslot] : NULL;
+
+    serverAssert(d && d->dictDelete(key) == DICT_OK);
+    /* Release the dictionaries of the slots left empty, unless iterated. */
+    if (d->dictSize() == 0 && d->m_iterators == 0) {
+        dictRelease(d);
+        db->m_slots_to_keys[hashslot] = NULL;
+    }
 }
 
-void slotToKeyDel(robj *key) {
-    slotToKeyUpdateKey(key,0);
+void slotToKeyFlush(redisDb *db) {
+    if (db->m_slots_to_keys == NULL) return;
+    for (int j = 0; j < CLUSTER_SLOTS; j++)
+        if (db->m_slots_to_keys[j]) dictRelease(db->m_slots_to_keys[j]);
+    zfree(db->m_slots_to_keys);
+    db->m_slots_to_keys = NULL;
 }
 
-void slotToKeyFlush() {
-    raxFree(server.cluster->m_slots_to_keys);
-    server.cluster->m_slots_to_keys = raxNew();
-    memset(server.cluster->m_slots_keys_count,0,
-           sizeof(server.cluster->m_slots_keys_count));
+/* Return the dictionary of the keys of a slot of the cluster DB, or NULL
+ * if there are no keys. */
+dict *slotKeysDict(unsigned int hashslot) {
+    redisDb *db = &server.db[0];
+    return db->m_slots_to_keys ? db->m_slots_to_keys[hashslot] : NULL;
 }
 
 /* Pupulate the specified array of objects with keys in the specified slot.
  * New objects are returned to represent keys, it's up to the caller to
  * decrement the reference count to release the keys names. */
 unsigned int getKeysInSlot(unsigned int hashslot, robj **keys, unsigned int count) {
-    raxIterator iter;
-    int j = 0;
-    unsigned char indexed[2];
-
-    indexed[0] = (hashslot >> 8) & 0xff;
-    indexed[1] = hashslot & 0xff;
-    raxStart(&iter,server.cluster->m_slots_to_keys);
-    raxSeek(&iter,">=",indexed,2);
-    while(count-- && raxNext(&iter)) {
-        if (iter.key[0] != indexed[0] || iter.key[1] != indexed[1]) break;
-        keys[j++] = createStringObject((char*)iter.key+2,iter.key_len-2);
-    }
-    raxStop(&iter);
+    dict *d = slotKeysDict(hashslot);
+    dictEntry *de;
+    unsigned int j = 0;
+
+    if (d == NULL) return 0;
+    dictIterator di(d);
+    while(j < count && (de = di.dictNext()) != NULL) {
+        sds key = (sds)de->dictGetKey();
+        keys[j++] = createStringObject(key,sdslen(key));
+    }
     return j;
 }
 
 /* Remove all the keys in the specified hash slot.
  * The number of removed items is returned. */
 unsigned int delKeysInSlot(unsigned int hashslot) {
-    raxIterator iter;
-    int j = 0;
-    unsigned char indexed[2];
-
-    indexed[0] = (hashslot >> 8) & 0xff;
-    indexed[1] = hashslot & 0xff;
-    raxStart(&iter,server.cluster->m_slots_to_keys);
-    while(server.cluster->m_slots_keys_count[hashslot]) {
-        raxSeek(&iter,">=",indexed,2);
-        raxNext(&iter);
-
-        robj *key = createStringObject((char*)iter.key+2,iter.key_len-2);
-        dbDelete(&server.db[0],key);
-        decrRefCount(key);
-        j++;
-    }
-    raxStop(&iter);
+    dict *d = slotKeysDict(hashslot);
+    dictEntry *de;
+    unsigned int j = 0;
+
+    if (d == NULL) return 0;
+    {
+        dictIterator di(d,1);
+        while((de = di.dictNext()) != NULL) {
+            sds key = (sds)de->dictGetKey();
+            robj *keyobj = createStringObject(key,sdslen(key));
+            dbDelete(&server.db[0],keyobj);
+            decrRefCount(keyobj);
+            j++;
+        }
+    }
+    /* Now that the iterator is released the empty dictionary can go. */
+    if (d->dictSize() == 0) {
+        dictRelease(d);
+        server.db[0].m_slots_to_keys[hashslot] = NULL;
+    }
     return j;
 }
 
 unsigned int countKeysInSlot(unsigned int hashslot) {
-    return server.cluster->m_slots_keys_count[hashslot];
+    dict *d = slotKeysDict(hashslot);
+    return d ? d->dictSize() : 0;
 }
@@ -40,6 +40,7 @@
 #include <ucontext.h>
 #include <fcntl.h>
 #include "bio.h"
+#include "lazyload.h"
 #include <unistd.h>
 #endif /* HAVE_BACKTRACE */
 
@@ -147,6 +148,7 @@ void computeDatasetDigest(unsigned char *final) {
             mixDigest(digest,key,sdslen(key));
 
             o = (robj *)de->dictGetVal();
+            if (o->encoding == OBJ_ENCODING_LAZY) lazyLoadValue(o);
 
             aux = htonl(o->type);
             mixDigest(digest,&aux,sizeof(aux));
@@ -173,7 +175,7 @@ void computeDatasetDigest(unsigned char *final) {
             } else if (o->type == OBJ_ZSET) {
                 unsigned char eledigest[20];
 
-                if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+                if (o->encoding == OBJ_ENCODING_LISTPACK) {
                     unsigned char* zl = (unsigned char*)o->ptr;
                     unsigned char *eptr, *sptr;
                     unsigned char *vstr;
@@ -181,13 +183,13 @@ void computeDatasetDigest(unsigned char *final) {
                     long long vll;
                     double score;
 
-                    eptr = ziplistIndex(zl,0);
+                    eptr = lpFirst(zl);
                     serverAssert(eptr != NULL);
-                    sptr = ziplistNext(zl,eptr);
+                    sptr = lpNext(zl,eptr);
                     serverAssert(sptr != NULL);
 
                     while (eptr != NULL) {
-                        serverAssert(ziplistGet(eptr,&vstr,&vlen,&vll));
+                        serverAssert(lpGetValue(eptr,&vstr,&vlen,&vll));
                         score = zzlGetScore(sptr);
 
                         memset(eledigest,0,20);
@@ -203,16 +205,18 @@ void computeDatasetDigest(unsigned char *final) {
                         xorDigest(digest,eledigest,20);
                         zzlNext(zl,&eptr,&sptr);
                     }
-                } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
+                } else if (o->encoding == OBJ_ENCODING_SKIPLIST ||
+                           o->encoding == OBJ_ENCODING_BTREE)
+                {
                     zset* zs = (zset*)o->ptr;
                     dictIterator di(zs->_dict);
                     dictEntry *de;
 
                     while((de = di.dictNext()) != NULL) {
                         sds sdsele = (sds)de->dictGetKey();
-                        double* score = (double*)de->dictGetVal();
+                        double score = zsetDictScore(zs,de);
 
-                        snprintf(buf,sizeof(buf),"%.17g",*score);
+                        snprintf(buf,sizeof(buf),"%.17g",score);
                         memset(eledigest,0,20);
                         mixDigest(eledigest,sdsele,sdslen(sdsele));
                         mixDigest(eledigest,buf,strlen(buf));
@@ -237,6 +241,27 @@ void computeDatasetDigest(unsigned char *final) {
                     xorDigest(digest,eledigest,20);
                 }
 
+            } else if (o->type == OBJ_STREAM) {
+                streamIterator si;
+                streamIteratorStart(&si,(stream *)o->ptr,NULL,NULL,0);
+                streamID id;
+                int64_t numfields;
+
+                while(streamIteratorGetID(&si,&id,&numfields)) {
+                    sds itemid = streamIDToSds(&id);
+                    mixDigest(digest,itemid,sdslen(itemid));
+                    sdsfree(itemid);
+
+                    while(numfields--) {
+                        unsigned char *field, *value;
+                        int64_t field_len, value_len;
+                        streamIteratorGetField(&si,&field,&value,
+                                               &field_len,&value_len);
+                        mixDigest(digest,field,field_len);
+                        mixDigest(digest,value,value_len);
+                    }
+                }
+                streamIteratorStop(&si);
             } else if (o->type == OBJ_MODULE) {
                 RedisModuleDigest md;
                 moduleValue* mv = (moduleValue*)o->ptr;
@@ -291,6 +316,8 @@ void debugCommand(client *c) {
         blen++; c->addReplyStatus(
         "ziplist <key> -- Show low level info about the ziplist encoding.");
         blen++; c->addReplyStatus(
+        "listpack <key> -- Show low level info about the listpack encoding.");
+        blen++; c->addReplyStatus(
         "populate <count> [prefix] [size] -- Create <count> string keys named key:<num>. If a prefix is specified is used instead of the 'key' prefix.");
         blen++; c->addReplyStatus(
         "digest   -- Outputs an hex signature representing the current DB content.");
@@ -351,7 +378,7 @@ void debugCommand(client *c) {
     } else if (!strcasecmp((const char*)c->m_argv[1]->ptr,"loadaof")) {
         if (server.aof_state == AOF_ON) flushAppendOnlyFile(1);
         emptyDb(-1,EMPTYDB_NO_FLAGS,NULL);
-        if (loadAppendOnlyFile(server.aof_filename) != C_OK) {
+        if (loadAppendOnlyFiles() != C_OK) {
             c->addReply(shared.err);
             return;
         }
@@ -368,9 +395,10 @@ void debugCommand(client *c) {
             return;
         }
         val = (robj *)de->dictGetVal();
+        if (val->encoding == OBJ_ENCODING_LAZY) lazyLoadValue(val);
         strenc = strEncoding(val->encoding);
 
-        char extra[138] = {0};
+        char extra[160] = {0};
         if (val->encoding == OBJ_ENCODING_QUICKLIST) {
             char *nextra = extra;
             int remaining = sizeof(extra);
@@ -393,6 +421,10 @@ void debugCommand(client *c) {
             used = snprintf(nextra, remaining, " ql_compressed:%d", compressed);
             nextra += used;
             remaining -= used;
+            /* Add number of hot nodes kept uncompressed */
+            used = snprintf(nextra, remaining, " ql_hot_nodes:%u", (unsigned)ql->m_hot_nodes);
+            nextra += used;
+            remaining -= used;
             /* Add total uncompressed size */
             unsigned long sz = 0;
             for (quicklistNode *node = ql->m_head_ql_node; node; node = node->m_next_ql_node) {
@@ -401,6 +433,12 @@ void debugCommand(client *c) {
             used = snprintf(nextra, remaining, " ql_uncompressed_size:%lu", sz);
             nextra += used;
             remaining -= used;
+            /* Add the container of the nodes */
+            used = snprintf(nextra, remaining, " ql_container:%s",
+                ql->m_container == QUICKLIST_NODE_CONTAINER_LISTPACK ?
+                "listpack" : "ziplist");
+            nextra += used;
+            remaining -= used;
         }
 
         c->addReplyStatusFormat(
@@ -430,7 +468,8 @@ void debugCommand(client *c) {
                 "val_sds_len:%lld, val_sds_avail:%lld, val_zmalloc: %lld",
                 (long long) sdslen(key),
                 (long long) sdsavail(key),
-                (long long) sdsZmallocSize(key),
+                (long long) (c->m_cur_selected_db->m_dict->dictHasEmbeddedKeys() ?
+                    sdsinplacesize(sdslen(key)) : sdsZmallocSize(key)),
                 (long long) sdslen((sds)val->ptr),
                 (long long) sdsavail((sds)val->ptr),
                 (long long) getStringObjectSdsUsedMemory(val));
@@ -447,6 +486,18 @@ void debugCommand(client *c) {
             ziplistRepr((unsigned char *)o->ptr);
             c->addReplyStatus("Ziplist structure printed on stdout");
         }
+    } else if (!strcasecmp((const char*)c->m_argv[1]->ptr,"listpack") && c->m_argc == 3) {
+        robj *o;
+
+        if ((o = objectCommandLookupOrReply(c,c->m_argv[2],shared.nokeyerr))
+                == NULL) return;
+
+        if (o->encoding != OBJ_ENCODING_LISTPACK) {
+            c->addReplyError("Not a listpack encoded object.");
+        } else {
+            lpRepr((unsigned char *)o->ptr);
+            c->addReplyStatus("Listpack structure printed on stdout");
+        }
     } else if (!strcasecmp((const char*)c->m_argv[1]->ptr,"populate") &&
                c->m_argc >= 3 && c->m_argc <= 5) {
         long keys, j;
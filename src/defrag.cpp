@@ -35,6 +35,8 @@
  */
 
 #include "server.h"
+#include "lazyload.h"
+#include "bgread.h"
 #include <time.h>
 #include <assert.h>
 #include <stddef.h>
@@ -125,7 +127,14 @@ robj *activeDefragStringOb(robj* ob, int *defragged) {
                 ret->ptr = (void*)((intptr_t)ret + ofs);
                 (*defragged)++;
             }
-        } else if (ob->encoding!=OBJ_ENCODING_INT) {
+        } else if (ob->encoding==OBJ_ENCODING_COMPRESSED) {
+            void *newptr = activeDefragAlloc(ob->ptr);
+            if (newptr) {
+                ob->ptr = newptr;
+                (*defragged)++;
+            }
+        } else if (ob->encoding!=OBJ_ENCODING_INT &&
+                   ob->encoding!=OBJ_ENCODING_CHUNKED) {
             serverPanic("Unknown string encoding");
         }
     }
@@ -269,6 +278,241 @@ dictEntry* replaceSateliteDictKeyPtrAndOrDefragDictEntry(dict *d, sds oldkey, sd
     return NULL;
 }
 
+/* Defrag helper for radix trees: the rax structure and its nodes are moved,
+ * and the data of the keys as well when 'data_cb' is not NULL (see
+ * raxRelocate()). Returns the rax, that may have a new address. */
+rax *defragRax(rax *r, void *(*data_cb)(void*,void*), void *privdata, int *defragged) {
+    rax *newr;
+    if ((newr = (rax*)activeDefragAlloc(r)))
+        (*defragged)++, r = newr;
+    *defragged += (int)raxRelocate(r, activeDefragAlloc, data_cb, privdata);
+    return r;
+}
+
+/* raxRelocate() data callback for the listpacks of a stream. */
+void *defragStreamListpack(void *lp, void *privdata) {
+    UNUSED(privdata);
+    return activeDefragAlloc(lp);
+}
+
+/* raxRelocate() data callback for the consumers of a consumer group. The
+ * consumers are not moved, since the NACKs reference them, but their name
+ * and their PEL nodes are. The NACKs are shared between the group and the
+ * consumer PELs, so they stay where they are as well. */
+void *defragStreamConsumer(void *data, void *privdata) {
+    streamConsumer *consumer = (streamConsumer*)data;
+    int *defragged = (int*)privdata;
+    sds newsds;
+    if ((newsds = activeDefragSds(consumer->name)))
+        (*defragged)++, consumer->name = newsds;
+    consumer->pel = defragRax(consumer->pel, NULL, NULL, defragged);
+    return NULL;
+}
+
+/* raxRelocate() data callback for the consumer groups of a stream. */
+void *defragStreamCG(void *data, void *privdata) {
+    streamCG *cg = (streamCG*)data, *newcg;
+    int *defragged = (int*)privdata;
+    if ((newcg = (streamCG*)activeDefragAlloc(cg))) cg = newcg;
+    cg->pel = defragRax(cg->pel, NULL, NULL, defragged);
+    cg->consumers = defragRax(cg->consumers, defragStreamConsumer, defragged, defragged);
+    return newcg;
+}
+
+/* Defrag a stream: the stream structure, the radix tree of the listpacks
+ * and the listpacks themselves, and the consumer groups. */
+void defragStream(robj *ob, int *defragged) {
+    stream *s = (stream*)ob->ptr, *news;
+    if ((news = (stream*)activeDefragAlloc(s)))
+        (*defragged)++, ob->ptr = s = news;
+    s->rax = defragRax(s->rax, defragStreamListpack, NULL, defragged);
+    if (s->cgroups)
+        s->cgroups = defragRax(s->cgroups, defragStreamCG, defragged, defragged);
+}
+
+/* Defrag a module value: the moduleValue wrapper is moved here, the value
+ * itself by the 'defrag' method of the module type, if it has one. */
+void defragModule(sds key, robj *ob, int *defragged) {
+    moduleValue *mv = (moduleValue*)ob->ptr, *newmv;
+    if ((newmv = (moduleValue*)activeDefragAlloc(mv)))
+        (*defragged)++, ob->ptr = mv = newmv;
+    if (mv->m_type->m_defrag) {
+        RedisModuleDefragCtx ctx = {0};
+        robj keyobj;
+        initStaticStringObject(keyobj, key);
+        mv->m_type->m_defrag(&ctx, &keyobj, &mv->m_value);
+        *defragged += (int)ctx.defragged;
+    }
+}
+
+void defragDictBucketCallback(void *privdata, dictEntry **bucketref);
+
+/* Defrag helper for quicklists: the quicklist struct, the nodes and their
+ * ziplists are moved, starting from the node at position '*cursor' (the
+ * quicklist struct only when starting from the head). With a non zero
+ * 'endtime' the work stops when the time is up, setting '*cursor' to the
+ * position where to continue, otherwise '*cursor' is set to 0 once the last
+ * node was processed. Returns a stat of how many pointers were moved. */
+int defragQuicklist(robj *ob, unsigned long *cursor, long long endtime) {
+    quicklist *ql = ob->ptr, *newql;
+    quicklistNode *node, *newnode;
+    unsigned char *newzl;
+    unsigned long pos = 0;
+    int defragged = 0, nodes_moved = 0;
+
+    if (*cursor == 0 && (newql = activeDefragAlloc(ql)))
+        defragged++, ob->ptr = ql = newql;
+    node = ql->head;
+    while (node && pos < *cursor) node = node->next, pos++;
+    while (node) {
+        if ((newnode = activeDefragAlloc(node))) {
+            if (newnode->prev)
+                newnode->prev->next = newnode;
+            else
+                ql->head = newnode;
+            if (newnode->next)
+                newnode->next->prev = newnode;
+            else
+                ql->tail = newnode;
+            node = newnode;
+            defragged++, nodes_moved++;
+        }
+        if ((newzl = activeDefragAlloc(node->zl)))
+            defragged++, node->zl = newzl;
+        node = node->next;
+        pos++;
+        if (endtime && node && !(pos % 16) && ustime() > endtime) break;
+    }
+    /* The node index references the nodes by address. */
+    if (nodes_moved) quicklistDropIndex(ql);
+    *cursor = node ? pos : 0;
+    return defragged;
+}
+
+/* Number of fields of a collection, or 0 for values that are defragged
+ * with a constant number of allocations. Keys with more fields than
+ * active-defrag-max-scan-fields are defragged incrementally. */
+long defragLaterFields(robj *ob) {
+    if (ob->type == OBJ_LIST && ob->encoding == OBJ_ENCODING_QUICKLIST)
+        return ((quicklist*)ob->ptr)->len;
+    if ((ob->type == OBJ_SET || ob->type == OBJ_HASH) && ob->encoding == OBJ_ENCODING_HT)
+        return ((dict*)ob->ptr)->dictSize();
+    if (ob->type == OBJ_ZSET && ob->encoding == OBJ_ENCODING_SKIPLIST)
+        return ((zset*)ob->ptr)->_dict->dictSize();
+    return 0;
+}
+
+/* Names of the large keys of the database being scanned that are left to
+ * defrag, and the cursor inside the first of them. */
+static list *defrag_later = NULL;
+static unsigned long defrag_later_cursor = 0;
+
+/* dictScan() callbacks defragging the elements of large values. */
+void defragLaterSetCallback(void *privdata, const dictEntry *de) {
+    dictEntry *e = (dictEntry*)de;
+    sds newsds;
+    UNUSED(privdata);
+    if ((newsds = activeDefragSds(e->key)))
+        server.stat_active_defrag_hits++, e->key = newsds;
+}
+
+void defragLaterHashCallback(void *privdata, const dictEntry *de) {
+    dictEntry *e = (dictEntry*)de;
+    sds newsds;
+    UNUSED(privdata);
+    if ((newsds = activeDefragSds(e->key)))
+        server.stat_active_defrag_hits++, e->key = newsds;
+    if (!hashDictValIsInt(e) && (newsds = activeDefragSds(e->v.val)))
+        server.stat_active_defrag_hits++, e->v.val = newsds;
+}
+
+void defragLaterZsetCallback(void *privdata, const dictEntry *de) {
+    zset *zs = privdata;
+    dictEntry *e = (dictEntry*)de;
+    sds sdsele = e->key, newsds;
+    double *newscore;
+    if ((newsds = activeDefragSds(sdsele)))
+        server.stat_active_defrag_hits++, e->key = newsds;
+    newscore = zslDefrag(zs->zsl, *(double*)e->v.val, sdsele, newsds);
+    if (newscore)
+        server.stat_active_defrag_hits++, e->v.val = newscore;
+}
+
+/* Scan the dict of a large value from '*cursor' until the scan is done
+ * (returning 0) or the time is up (returning 1). */
+int defragLaterDict(dict *d, dictScanFunction *fn, void *privdata, unsigned long *cursor, long long endtime) {
+    unsigned int iterations = 0;
+    do {
+        *cursor = d->dictScan(*cursor, fn, defragDictBucketCallback, privdata);
+        if (*cursor && ++iterations > 16) {
+            if (ustime() > endtime) return 1;
+            iterations = 0;
+        }
+    } while(*cursor);
+    return 0;
+}
+
+/* Defrag a slice of a large value, starting at '*cursor' (0 to start from
+ * the beginning, when the containers are moved as well). Returns 1 when the
+ * time is up before the whole value was processed, with '*cursor' set to
+ * where to continue, 0 otherwise. */
+int defragLaterItem(robj *ob, unsigned long *cursor, long long endtime) {
+    /* Resumed once the background read of the value completes. */
+    if (bgreadValueIsPinned(ob)) return 1;
+    if (ob->type == OBJ_LIST && ob->encoding == OBJ_ENCODING_QUICKLIST) {
+        server.stat_active_defrag_hits += defragQuicklist(ob, cursor, endtime);
+        return *cursor != 0;
+    } else if (ob->type == OBJ_SET && ob->encoding == OBJ_ENCODING_HT) {
+        if (*cursor == 0)
+            server.stat_active_defrag_hits += dictDefragTables((dict**)&ob->ptr);
+        return defragLaterDict(ob->ptr, defragLaterSetCallback, NULL, cursor, endtime);
+    } else if (ob->type == OBJ_HASH && ob->encoding == OBJ_ENCODING_HT) {
+        if (*cursor == 0)
+            server.stat_active_defrag_hits += dictDefragTables((dict**)&ob->ptr);
+        return defragLaterDict(ob->ptr, defragLaterHashCallback, NULL, cursor, endtime);
+    } else if (ob->type == OBJ_ZSET && ob->encoding == OBJ_ENCODING_SKIPLIST) {
+        zset *zs = (zset*)ob->ptr;
+        if (*cursor == 0) {
+            zset *newzs;
+            zskiplist *newzsl;
+            struct zskiplistNode *newheader;
+            if ((newzs = activeDefragAlloc(zs)))
+                server.stat_active_defrag_hits++, ob->ptr = zs = newzs;
+            if ((newzsl = activeDefragAlloc(zs->zsl)))
+                server.stat_active_defrag_hits++, zs->zsl = newzsl;
+            if ((newheader = activeDefragAlloc(zs->zsl->header)))
+                server.stat_active_defrag_hits++, zs->zsl->header = newheader;
+            server.stat_active_defrag_hits += dictDefragTables(&zs->_dict);
+        }
+        return defragLaterDict(zs->_dict, defragLaterZsetCallback, zs, cursor, endtime);
+    }
+    /* The key was replaced by a small value in the meantime. */
+    return 0;
+}
+
+/* Continue the defrag of the large keys found by the scan of 'db', until
+ * all of them are done (returning 0) or the time is up (returning 1). Keys
+ * deleted in the meantime are just skipped. */
+int defragLaterStep(redisDb *db, long long endtime) {
+    listNode *ln;
+    while (defrag_later && (ln = defrag_later->listFirst()) != NULL) {
+        sds key = (sds)ln->listNodeValue();
+        dictEntry *de = db->m_dict->dictFind(key);
+        if (de) {
+            robj *ob = (robj*)de->dictGetVal();
+            long long hits = server.stat_active_defrag_hits;
+            int more = defragLaterItem(ob, &defrag_later_cursor, endtime);
+            server.stat_active_defrag_type_hits[ob->type] += server.stat_active_defrag_hits - hits;
+            if (more) return 1;
+        }
+        sdsfree(key);
+        defrag_later->listDelNode(ln);
+        defrag_later_cursor = 0;
+        if (ustime() > endtime) return 1;
+    }
+    return 0;
+}
+
 /* for each key we scan in the main dict, this function will attempt to defrag
  * all the various pointers it has. Returns a stat of how many pointers were
  * moved. */
@@ -278,18 +522,21 @@ int defragKey(redisDb *db, dictEntry *de) {
     unsigned char *newzl;
     dict *d;
     int defragged = 0;
-    sds newsds;
+    sds newsds = NULL;
 
-    /* Try to defrag the key name. */
-    newsds = activeDefragSds(keysds);
-    if (newsds)
+    /* Try to defrag the key name. A key embedded in its entry is not an
+     * allocation of its own, it moves only with the entry. */
+    if (!db->m_dict->dictHasEmbeddedKeys() &&
+        (newsds = activeDefragSds(keysds)) != NULL)
         defragged++, de->key = newsds;
-    if (db->m_expires->dictSize()) {
-         /* Dirty code:
-          * I can't search in db->m_expires for that key after i already released
-          * the pointer it holds it won't be able to do the string compare */
-        unsigned int hash = dictGetHash(db->m_dict, de->key);
-        replaceSateliteDictKeyPtrAndOrDefragDictEntry(db->m_expires, keysds, newsds, hash, &defragged);
+    /* The entry is borrowed by db->m_expires: it has nothing of its own to
+     * update. */
+    if (db->m_slots_to_keys) {
+        /* The slot dictionary holds the same key pointer as well. */
+        sds cur = (sds)de->key;
+        dict *sd = db->m_slots_to_keys[keyHashSlot(cur,sdslen(cur))];
+        unsigned int hash = dictGetHash(sd, de->key);
+        replaceSateliteDictKeyPtrAndOrDefragDictEntry(sd, keysds, newsds, hash, &defragged);
     }
 
     /* Try to defrag robj and / or string value. */
@@ -299,31 +546,25 @@ int defragKey(redisDb *db, dictEntry *de) {
         ob = newob;
     }
 
+    /* The values not loaded yet by lazy-loading are in the RDB file. */
+    if (ob->encoding == OBJ_ENCODING_LAZY) return defragged;
+
+    /* A background read walks the value. */
+    if (bgreadValueIsPinned(ob)) return defragged;
+
+    /* Large collections are defragged later, a slice at a time, so that a
+     * single key can't exceed the time limit of the cycle. */
+    if (defragLaterFields(ob) > server.active_defrag_max_scan_fields) {
+        defrag_later->listAddNodeTail(sdsdup((sds)de->dictGetKey()));
+        return defragged;
+    }
+
     if (ob->type == OBJ_STRING) {
         /* Already handled in activeDefragStringOb. */
     } else if (ob->type == OBJ_LIST) {
         if (ob->encoding == OBJ_ENCODING_QUICKLIST) {
-            quicklist *ql = ob->ptr, *newql;
-            quicklistNode *node = ql->head, *newnode;
-            if ((newql = activeDefragAlloc(ql)))
-                defragged++, ob->ptr = ql = newql;
-            while (node) {
-                if ((newnode = activeDefragAlloc(node))) {
-                    if (newnode->prev)
-                        newnode->prev->next = newnode;
-                    else
-                        ql->head = newnode;
-                    if (newnode->next)
-                        newnode->next->prev = newnode;
-                    else
-                        ql->tail = newnode;
-                    node = newnode;
-                    defragged++;
-                }
-                if ((newzl = activeDefragAlloc(node->zl)))
-                    defragged++, node->zl = newzl;
-                node = node->next;
-            }
+            unsigned long cursor = 0;
+            defragged += defragQuicklist(ob, &cursor, 0);
         } else if (ob->encoding == OBJ_ENCODING_ZIPLIST) {
             if ((newzl = activeDefragAlloc(ob->ptr)))
                 defragged++, ob->ptr = newzl;
@@ -347,11 +588,17 @@ int defragKey(redisDb *db, dictEntry *de) {
             intset *newis = activeDefragAlloc(is);
             if (newis)
                 defragged++, ob->ptr = newis;
+        } else if (ob->encoding == OBJ_ENCODING_ROARING) {
+            /* Only the bitmap itself is moved, not its containers. */
+            roaring *r = ob->ptr;
+            roaring *newr = activeDefragAlloc(r);
+            if (newr)
+                defragged++, ob->ptr = newr;
         } else {
             serverPanic("Unknown set encoding");
         }
     } else if (ob->type == OBJ_ZSET) {
-        if (ob->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (ob->encoding == OBJ_ENCODING_LISTPACK) {
             if ((newzl = activeDefragAlloc(ob->ptr)))
                 defragged++, ob->ptr = newzl;
         } else if (ob->encoding == OBJ_ENCODING_SKIPLIST) {
@@ -380,11 +627,20 @@ int defragKey(redisDb *db, dictEntry *de) {
                 defragged += dictIterDefragEntry(di);
             }
             dictDefragTables(&zs->_dict);
+        } else if (ob->encoding == OBJ_ENCODING_BTREE) {
+            /* The elements are shared by the hash table and the tree leaves,
+             * that can't be looked up by address: only the zset and the hash
+             * table are moved. */
+            zset *zs = (zset*)ob->ptr;
+            zset *newzs;
+            if ((newzs = activeDefragAlloc(zs)))
+                defragged++, ob->ptr = zs = newzs;
+            dictDefragTables(&zs->_dict);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
     } else if (ob->type == OBJ_HASH) {
-        if (ob->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (ob->encoding == OBJ_ENCODING_LISTPACK) {
             if ((newzl = activeDefragAlloc(ob->ptr)))
                 defragged++, ob->ptr = newzl;
         } else if (ob->encoding == OBJ_ENCODING_HT) {
@@ -395,7 +651,7 @@ int defragKey(redisDb *db, dictEntry *de) {
                 if ((newsds = activeDefragSds(sdsele)))
                     defragged++, de->key = newsds;
                 sdsele = (sds)de->dictGetVal();
-                if ((newsds = activeDefragSds(sdsele)))
+                if (!hashDictValIsInt(de) && (newsds = activeDefragSds(sdsele)))
                     defragged++, de->v.val = newsds;
                 defragged += dictIterDefragEntry(di);
             }
@@ -404,9 +660,10 @@ int defragKey(redisDb *db, dictEntry *de) {
         } else {
             serverPanic("Unknown hash encoding");
         }
+    } else if (ob->type == OBJ_STREAM) {
+        defragStream(ob, &defragged);
     } else if (ob->type == OBJ_MODULE) {
-        /* Currently defragmenting modules private data types
-         * is not supported. */
+        defragModule((sds)de->dictGetKey(), ob, &defragged);
     } else {
         serverPanic("Unknown object type");
     }
@@ -416,7 +673,9 @@ int defragKey(redisDb *db, dictEntry *de) {
 /* Defrag scan callback for the main db dictionary. */
 void defragScanCallback(void *privdata, const dictEntry *de) {
     int defragged = defragKey((redisDb*)privdata, (dictEntry*)de);
+    robj *ob = (robj*)de->dictGetVal();
     server.stat_active_defrag_hits += defragged;
+    server.stat_active_defrag_type_hits[ob->type] += defragged;
     if(defragged)
         server.stat_active_defrag_key_hits++;
     else
@@ -443,9 +702,13 @@ void defragDictBucketCallback(void *privdata, dictEntry **bucketref) {
  * or not, a false detection can cause the defragmenter to waste a lot of CPU
  * without the possibility of getting any results. */
 float getAllocatorFragmentation(size_t *out_frag_bytes) {
-    size_t epoch = 1, allocated = 0, resident = 0, active = 0, sz = sizeof(size_t);
-    /* Update the statistics cached by mallctl. */
-    je_mallctl("epoch", &epoch, &sz, &epoch, sz);
+    size_t allocated = 0, resident = 0, active = 0, sz = sizeof(size_t);
+    size_t tr_allocated, tr_active, tr_resident;
+    /* The buffers of the clients, of the AOF and of the replication are in
+     * an arena of their own (see zmalloc_transient_begin()): they are not
+     * moved by the defragger, so their fragmentation is not counted. This
+     * also updates the statistics cached by mallctl. */
+    zmalloc_transient_stats(&tr_allocated, &tr_active, &tr_resident);
     /* Unlike RSS, this does not include RSS from shared libraries and other non
      * heap mappings. */
     je_mallctl("stats.resident", &resident, &sz, NULL, 0);
@@ -455,6 +718,11 @@ float getAllocatorFragmentation(size_t *out_frag_bytes) {
     /* Unlike zmalloc_used_memory, this matches the stats.resident by taking
      * into account all allocations done by this process (not only zmalloc). */
     je_mallctl("stats.allocated", &allocated, &sz, NULL, 0);
+    if (allocated > tr_allocated && active > tr_active && resident > tr_resident) {
+        allocated -= tr_allocated;
+        active -= tr_active;
+        resident -= tr_resident;
+    }
     float frag_pct = ((float)active / allocated)*100 - 100;
     size_t frag_bytes = active - allocated;
     float rss_pct = ((float)resident / allocated)*100 - 100;
@@ -524,8 +792,14 @@ void activeDefragCycle() {
     timelimit = 1000000*server.active_defrag_running/server.hz/100;
     if (timelimit <= 0) timelimit = 1;
 
+    if (!defrag_later) defrag_later = listCreate();
+
     do {
         if (!cursor) {
+            /* Finish the large keys of the database before moving on. */
+            if (db && defragLaterStep(db, start+timelimit))
+                return;
+
             /* Move on to next database, and stop if we reached the last one. */
             if (++current_db >= server.dbnum) {
                 long long now = ustime();
@@ -553,6 +827,10 @@ void activeDefragCycle() {
         }
 
         do {
+            /* Continue the large keys found so far first. */
+            if (defragLaterStep(db, start+timelimit))
+                return;
+
             cursor = db->m_dict->dictScan(cursor, defragScanCallback, defragDictBucketCallback, db);
             /* Once in 16 scan iterations, or 1000 pointer reallocations
              * (if we have a lot of pointers in one hash bucket), check if we
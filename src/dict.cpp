@@ -45,6 +45,7 @@
 
 #include "dict.h"
 #include "zmalloc.h"
+#include "sds.h"
 #ifndef DICT_BENCHMARK_MAIN
 #include "redisassert.h"
 #else
@@ -65,18 +66,48 @@ std::ofstream outer("/Users/shai/Desktop/redispp.out.txt", std::ios::app);
 static int dict_can_resize = 1;
 static unsigned int dict_force_resize_ratio = 5;
 
+/* Using dictPauseRehashing() / dictResumeRehashing() the lookups stop
+ * performing the incremental rehashing steps of all the dictionaries, so
+ * that different threads can read them at the same time while nobody
+ * modifies them. */
+static int dict_rehash_paused = 0;
+
+/* Function releasing the old table at the end of a rehashing, when it is at
+ * least dict_free_table_min_bytes, so that the caller can free big tables in
+ * another thread. See dictSetFreeTableCallback(). */
+static void (*dict_free_table_callback)(void *table) = NULL;
+static size_t dict_free_table_min_bytes = 0;
+
 /* -------------------------- private prototypes ---------------------------- */
 
 static int _dictExpandIfNeeded(dict *ht);
 static unsigned long _dictNextPower(unsigned long size);
 static int _dictKeyIndex(dict *ht, const void *key, unsigned int hash, dictEntry **existing);
+static unsigned long _dictOpenGroups(unsigned long size);
 
 /* -------------------------- hash functions -------------------------------- */
 
 static uint8_t dict_hash_function_seed[16];
+static int dict_hash_function = DICT_HASH_SIPHASH;
+static uint64_t dict_wyhash_seed;
+
+static uint64_t dictWyMix(uint64_t a, uint64_t b);
 
 void dictSetHashFunctionSeed(uint8_t *seed) {
+    uint64_t lo, hi;
+
     memcpy(dict_hash_function_seed,seed,sizeof(dict_hash_function_seed));
+    memcpy(&lo,seed,sizeof(lo));
+    memcpy(&hi,seed+sizeof(lo),sizeof(hi));
+    dict_wyhash_seed = dictWyMix(lo ^ 0xa0761d6478bd642fULL,
+                                 hi ^ 0xe7037ed1a0b428dbULL);
+}
+
+/* Select the function used by dictGenHashFunction(), one of DICT_HASH_*.
+ * This must be called before any dictionary using it is populated. The case
+ * insensitive hash is always SipHash. */
+void dictSetHashFunction(int func) {
+    dict_hash_function = func;
 }
 
 uint8_t *dictGetHashFunctionSeed() {
@@ -89,17 +120,133 @@ uint8_t *dictGetHashFunctionSeed() {
 uint64_t siphash(const uint8_t *in, const size_t inlen, const uint8_t *k);
 uint64_t siphash_nocase(const uint8_t *in, const size_t inlen, const uint8_t *k);
 
+/* A keyed hash in the style of wyhash: every 16 bytes of input are mixed
+ * with a single 64x64->128 bits multiplication, so it is several times faster
+ * than SipHash on short keys. It is not a cryptographic PRF like SipHash, so
+ * it offers a weaker protection against hash flooding attacks from clients
+ * able to observe the server timings. */
+static inline void dictWyMum(uint64_t *a, uint64_t *b) {
+#if defined(__SIZEOF_INT128__)
+    __uint128_t r = *a;
+    r *= *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha*hb, rm0 = ha*lb, rm1 = hb*la, rl = la*lb, t = rl+(rm0<<32);
+    uint64_t c = t < rl, lo, hi;
+    lo = t+(rm1<<32);
+    c += lo < t;
+    hi = rh+(rm0>>32)+(rm1>>32)+c;
+    *a = lo;
+    *b = hi;
+#endif
+}
+
+static uint64_t dictWyMix(uint64_t a, uint64_t b) {
+    dictWyMum(&a,&b);
+    return a^b;
+}
+
+static inline uint64_t dictWyRead8(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v,p,8);
+    return v;
+}
+
+static inline uint64_t dictWyRead4(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v,p,4);
+    return v;
+}
+
+static inline uint64_t dictWyHash(const uint8_t *p, size_t len) {
+    static const uint64_t s[4] = {0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL,
+                                  0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL};
+    uint64_t seed = dict_wyhash_seed, a, b;
+
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (dictWyRead4(p)<<32) | dictWyRead4(p+((len>>3)<<2));
+            b = (dictWyRead4(p+len-4)<<32) | dictWyRead4(p+len-4-((len>>3)<<2));
+        } else if (len > 0) {
+            a = ((uint64_t)p[0]<<16) | ((uint64_t)p[len>>1]<<8) | p[len-1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = dictWyMix(dictWyRead8(p)^s[1],dictWyRead8(p+8)^seed);
+                see1 = dictWyMix(dictWyRead8(p+16)^s[2],dictWyRead8(p+24)^see1);
+                see2 = dictWyMix(dictWyRead8(p+32)^s[3],dictWyRead8(p+40)^see2);
+                p += 48;
+                i -= 48;
+            } while(i > 48);
+            seed ^= see1^see2;
+        }
+        while(i > 16) {
+            seed = dictWyMix(dictWyRead8(p)^s[1],dictWyRead8(p+8)^seed);
+            i -= 16;
+            p += 16;
+        }
+        a = dictWyRead8(p+i-16);
+        b = dictWyRead8(p+i-8);
+    }
+    a ^= s[1];
+    b ^= seed;
+    dictWyMum(&a,&b);
+    return dictWyMix(a^s[0]^len,b^s[1]);
+}
+
 uint64_t dictGenHashFunction(const void *key, int len) {
+    if (dict_hash_function == DICT_HASH_WYHASH)
+        return dictWyHash((const uint8_t *)key,len);
     return siphash((const uint8_t *)key,len,(const uint8_t *)dict_hash_function_seed);
 }
 
+/* Hash 'count' keys at once, the same as calling dictGenHashFunction() for
+ * every key. The hash function is selected once for the whole batch, and
+ * the keys are hashed in a tight loop where the independent computations of
+ * successive keys can overlap in the CPU pipeline. */
+void dictGenHashFunctionBatch(const void **keys, const int *lens, int count,
+                              uint64_t *hashes)
+{
+    int j;
+
+    if (dict_hash_function == DICT_HASH_WYHASH) {
+        for (j = 0; j < count; j++)
+            hashes[j] = dictWyHash((const uint8_t *)keys[j],lens[j]);
+    } else {
+        for (j = 0; j < count; j++)
+            hashes[j] = siphash((const uint8_t *)keys[j],lens[j],
+                                (const uint8_t *)dict_hash_function_seed);
+    }
+}
+
 uint64_t dictGenCaseHashFunction(const unsigned char *buf, int len) {
     return siphash_nocase(buf,len,dict_hash_function_seed);
 }
 
-static dictEntry* dictEntryCreate(dictEntry *next_entry)
+/* 'extra' bytes are allocated after the entry and its metadata, for an
+ * embedded key. Entries of open addressing tables are never chained, so they
+ * are allocated without the m_next field, that is never accessed for them. */
+dictEntry* dict::_dictEntryCreate(dictEntry *next_entry, size_t extra)
 {
-    dictEntry *entry = new (zmalloc(sizeof(dictEntry))) dictEntry(next_entry);
+    size_t metadata = m_type->entryMetadataBytes;
+    dictEntry *entry;
+
+    if (dictIsOpen()) {
+        entry = (dictEntry*)zmalloc(DICT_OPEN_ENTRY_SIZE+metadata+extra);
+        entry->dictSetKey(NULL);
+        entry->dictSetVal(NULL);
+    } else {
+        entry = new (zmalloc(sizeof(dictEntry)+metadata+extra)) dictEntry(next_entry);
+    }
+    if (metadata) memset(dictGetEntryMetadata(entry),0,metadata);
     return entry;
 }
 
@@ -109,6 +256,16 @@ static void dictEntryRelease(dictEntry* in_to_release)
     zfree(in_to_release);
 }
 
+/* Release the key, the value and the entry itself, unless the entry is
+ * borrowed from another dictionary. */
+void dict::_dictFreeEntry(dictEntry *he)
+{
+    if (dictHasBorrowedEntries()) return;
+    dictFreeKey(he);
+    dictFreeVal(he);
+    dictEntryRelease(he);
+}
+
 dictEntry::dictEntry(dictEntry *next_entry)
 : m_key(NULL)
 , m_next(next_entry)
@@ -116,22 +273,81 @@ dictEntry::dictEntry(dictEntry *next_entry)
     v.val = NULL;
 }
 
+/* ----------------------- open addressing groups --------------------------- */
+
+/* Every byte of a group 'ctrl' word is handled in parallel inside a 64 bit
+ * register: these masks select the low bit and the high bit of the bytes
+ * holding the slot tags (the overflow byte excluded). */
+#define DICT_CTRL_LSB 0x0001010101010101ULL
+#define DICT_CTRL_MSB 0x0080808080808080ULL
+#define DICT_CTRL_OVERFLOW_SHIFT 56
+
+/* The tag stored for a key hash: the 7 most significant bits of the hash,
+ * while the least significant bits select the group. */
+static inline uint64_t dictTag(uint64_t hash) {
+    return (hash >> 57) | 0x80;
+}
+
+/* Return a mask with the high bit set in the bytes of the slots that may
+ * hold 'tag'. False positives are possible (only for used slots), so the
+ * keys must be compared anyway, but no match is ever missed. */
+static inline uint64_t dictGroupMatch(uint64_t ctrl, uint64_t tag) {
+    uint64_t x = ctrl ^ (tag * DICT_CTRL_LSB);
+    return (x - DICT_CTRL_LSB) & ~x & DICT_CTRL_MSB;
+}
+
+static inline uint64_t dictGroupUsed(uint64_t ctrl) {
+    return ctrl & DICT_CTRL_MSB;
+}
+
+static inline uint64_t dictGroupFree(uint64_t ctrl) {
+    return ~ctrl & DICT_CTRL_MSB;
+}
+
+static inline unsigned int dictGroupOverflow(uint64_t ctrl) {
+    return ctrl >> DICT_CTRL_OVERFLOW_SHIFT;
+}
+
+/* Return the slot of the first byte set in a mask returned by the above
+ * functions. */
+static inline int dictGroupFirstSlot(uint64_t mask) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(mask) >> 3;
+#else
+    int slot = 0;
+    while (!(mask & 0x80)) {
+        mask >>= 8;
+        slot++;
+    }
+    return slot;
+#endif
+}
+
 /* ----------------------------- API implementation ------------------------- */
 
-dictht::dictht(const unsigned long new_size)
+/* Create a table of 'new_size' buckets. When 'grouped' is true the buckets
+ * are open addressing groups of DICT_GROUP_SLOTS slots, and the size of the
+ * table is the total number of slots. */
+dictht::dictht(const unsigned long new_size, int grouped)
 {
     reset();
     if (new_size > 0)
     {
-        m_size = new_size;
         m_sizemask = new_size-1;
-        m_table = (dictEntry **)zcalloc(new_size*sizeof(dictEntry*));
+        if (grouped) {
+            m_size = new_size*DICT_GROUP_SLOTS;
+            m_groups = (dictGroup *)zcalloc(new_size*sizeof(dictGroup));
+        } else {
+            m_size = new_size;
+            m_table = (dictEntry **)zcalloc(new_size*sizeof(dictEntry*));
+        }
     }
 }
 
 dictht::dictht(dictht&& in_move_me)
 {
     m_table = in_move_me.m_table;
+    m_groups = in_move_me.m_groups;
     m_size = in_move_me.m_size;
     m_sizemask = in_move_me.m_sizemask;
     m_used = in_move_me.m_used;
@@ -142,6 +358,7 @@ dictht::dictht(dictht&& in_move_me)
 dictht& dictht::operator=(dictht&& in_move_me)
 {
     m_table = in_move_me.m_table;
+    m_groups = in_move_me.m_groups;
     m_size = in_move_me.m_size;
     m_sizemask = in_move_me.m_sizemask;
     m_used = in_move_me.m_used;
@@ -152,12 +369,13 @@ dictht& dictht::operator=(dictht&& in_move_me)
 
 dictht::~dictht()
 {
-    assert(m_table == NULL);
+    assert(empty());
 }
 
 void dictht::reset()
 {
     m_table = NULL;
+    m_groups = NULL;
     m_size = 0;
     m_sizemask = 0;
     m_used = 0;
@@ -167,7 +385,18 @@ void dictht::free_table()
 {
     if (NULL != m_table)
         zfree(m_table);
+    if (NULL != m_groups)
+        zfree(m_groups);
+    reset();
+}
+
+/* Return the table, which should be freed with zfree(), leaving this table
+ * empty. */
+void *dictht::release_table()
+{
+    void *table = peek_table();
     reset();
+    return table;
 }
 
 /* Create a new hash table */
@@ -179,6 +408,15 @@ dict *dictCreate(dictType *type,
     return d;
 }
 
+/* Create a dictionary whose dictType hashes and compares sds keys like
+ * dictSdsPolicy, see dictSpecialized. */
+sdsDict *sdsDictCreate(dictType *type, void *privDataPtr)
+{
+    void* d_mem = zmalloc(sizeof(sdsDict));
+    sdsDict *d = new (d_mem) sdsDict(type, privDataPtr);
+    return d;
+}
+
 dict::dict()
     : m_type(NULL)
     , m_privdata(NULL)
@@ -210,6 +448,22 @@ int dict::dictResize()
     return dictExpand(minimal);
 }
 
+/* Start shrinking the table if less than 1/DICT_HT_SHRINK_RATIO of the slots
+ * are used. The new table has about twice the slots needed, so that it is far
+ * from the thresholds of both a new shrink and an expansion. Nothing is done
+ * while resizing is disabled, or while rehashing or iterating. Returns
+ * DICT_OK if the shrink was started. */
+int dict::dictShrinkIfNeeded()
+{
+    unsigned long used = m_ht[0].used(), size = m_ht[0].size();
+
+    if (!dict_can_resize || dictIsRehashing() || m_iterators) return DICT_ERR;
+    if (size <= DICT_HT_INITIAL_SIZE || used*DICT_HT_SHRINK_RATIO >= size)
+        return DICT_ERR;
+    if (used < DICT_HT_INITIAL_SIZE/2) used = DICT_HT_INITIAL_SIZE/2;
+    return dictExpand(used*2);
+}
+
 /* Expand or create the hash table */
 int dict::dictExpand(unsigned long size)
 {
@@ -219,12 +473,15 @@ int dict::dictExpand(unsigned long size)
     if (dictIsRehashing() || m_ht[0].used() > size)
         return DICT_ERR;
 
-    /* Rehashing to the same table size is not useful. */
-    unsigned long realsize = _dictNextPower(size);
+    /* Rehashing to the same table size is not useful. Open addressing
+     * tables are sized in groups, with room for 'size' elements. */
+    unsigned long buckets = dictIsOpen() ? _dictOpenGroups(size) :
+                                           _dictNextPower(size);
+    unsigned long realsize = dictIsOpen() ? buckets*DICT_GROUP_SLOTS : buckets;
     if (realsize == m_ht[0].size()) return DICT_ERR;
 
     /* Allocate the new hash table and initialize all pointers to NULL */
-    dictht n(realsize); /* the new hash table */
+    dictht n(buckets,dictIsOpen()); /* the new hash table */
 
     /* Is this the first initialization? If so it's not really a rehashing
      * we just set the first hash table so that it can accept keys. */
@@ -256,7 +513,28 @@ int dict::dictRehash(int n)
     while(n-- && m_ht[0].used() != 0) {
         /* Note that rehashidx can't overflow as we are sure there are more
          * elements because ht[0].used != 0 */
-        assert(m_ht[0].size() > (unsigned long)m_rehashidx);
+        assert(m_ht[0].buckets() > (unsigned long)m_rehashidx);
+        if (dictIsOpen()) {
+            /* Move all the entries stored in this group, including the ones
+             * displaced here from previous groups. */
+            while(!dictGroupUsed(m_ht[0].group(m_rehashidx).ctrl)) {
+                m_rehashidx++;
+                if (--empty_visits == 0) return 1;
+            }
+            dictGroup *g = &m_ht[0].group(m_rehashidx);
+            uint64_t used = dictGroupUsed(g->ctrl);
+            while(used) {
+                dictEntry **ref = &g->slots[dictGroupFirstSlot(used)];
+                dictEntry *de = *ref;
+                uint64_t h = dictHashKey(de->m_key);
+
+                _dictOpenRemove(&m_ht[0],m_rehashidx,ref,h);
+                _dictOpenInsert(&m_ht[1],de,h);
+                used &= used-1;
+            }
+            m_rehashidx++;
+            continue;
+        }
         while(m_ht[0][m_rehashidx] == NULL) {
             m_rehashidx++;
             if (--empty_visits == 0) return 1;
@@ -281,7 +559,7 @@ int dict::dictRehash(int n)
 
     /* Check if we already rehashed the whole table... */
     if (m_ht[0].used() == 0) {
-        m_ht[0].free_table();
+        _dictReleaseTable(&m_ht[0]);
         m_ht[0] = std::move(m_ht[1]);
         m_rehashidx = -1;
         return 0;
@@ -310,6 +588,19 @@ int dictRehashMilliseconds(dict *d, int ms) {
     return rehashes;
 }
 
+/* Free the table left empty by a rehashing, possibly using the callback set
+ * with dictSetFreeTableCallback(). */
+void dict::_dictReleaseTable(dictht *ht)
+{
+    if (dict_free_table_callback &&
+        ht->table_bytes() >= dict_free_table_min_bytes)
+    {
+        dict_free_table_callback(ht->release_table());
+    } else {
+        ht->free_table();
+    }
+}
+
 /* This function performs just a step of rehashing, and only if there are
  * no safe iterators bound to our hash table. When we have iterators in the
  * middle of a rehashing we can't mess with the two hash tables otherwise
@@ -320,7 +611,7 @@ int dictRehashMilliseconds(dict *d, int ms) {
  * while it is actively used. */
 void dict::_dictRehashStep()
 {
-    if (m_iterators == 0)
+    if (m_iterators == 0 && !dict_rehash_paused)
         dictRehash(1);
 }
 
@@ -351,14 +642,45 @@ int dict::dictAdd(void *key, void *val)
  * with the existing entry if existing is not NULL.
  *
  * If key was added, the hash entry is returned to be manipulated by the caller.
+ *
+ * If 'extra' is not zero, that many bytes are reserved inside the allocation
+ * of the new entry, accessible with dictGetEntryExtra() and released with the
+ * entry: the caller can use them to store the value itself.
  */
-dictEntry* dict::dictAddRaw(void *key, dictEntry **existing)
+dictEntry* dict::dictAddRaw(void *key, dictEntry **existing, size_t extra)
 {
+    return _dictAddRawWith<dictTypePolicy>(key,existing,extra);
+}
+
+template <class Policy>
+dictEntry* dict::_dictAddRawWith(void *key, dictEntry **existing, size_t extra)
+{
+    /* Keep what follows the extra space aligned. */
+    extra = (extra + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
     if (dictIsRehashing()) _dictRehashStep();
+    if (dictIsOpen()) {
+        uint64_t h = Policy::hash(this,key);
+
+        if (existing) *existing = NULL;
+        if (_dictOpenReserve() == DICT_ERR)
+            return NULL;
+        for (int itable = 0; itable <= 1; itable++) {
+            dictEntry **ref = _dictOpenFind<Policy>(&m_ht[itable],key,h,NULL);
+            if (ref) {
+                if (existing) *existing = *ref;
+                return NULL;
+            }
+            if (!dictIsRehashing()) break;
+        }
+        dictEntry *entry = _dictEntryCreate(NULL,extra+_dictEmbeddedKeySize(key));
+        _dictOpenInsert(dictIsRehashing() ? &m_ht[1] : &m_ht[0],entry,h);
+        _dictInitKey(entry, key, extra);
+        return entry;
+    }
 
     /* Get the index of the new element, or -1 if
      * the element already exists. */
-    int index = _dictKeyIndex(key, dictHashKey(key), existing);
+    int index = _dictKeyIndex<Policy>(key, Policy::hash(this,key), existing);
     if (index == -1)
         return NULL;
 
@@ -367,15 +689,60 @@ dictEntry* dict::dictAddRaw(void *key, dictEntry **existing)
      * system it is more likely that recently added entries are accessed
      * more frequently. */
     dictht* _ht_ = dictIsRehashing() ? &(m_ht[1]) : &(m_ht[0]);
-    dictEntry* entry = dictEntryCreate((*_ht_)[index]);
+    dictEntry* entry = _dictEntryCreate((*_ht_)[index],extra+_dictEmbeddedKeySize(key));
     (*_ht_)[index] = entry;
     _ht_->used()++;
 
     /* Set the hash entry fields. */
-    dictSetKey(entry, key);
+    _dictInitKey(entry, key, extra);
     return entry;
 }
 
+/* Make room for one more entry in an open addressing dictionary. Unlike
+ * chains, an open addressing table can't grow past its size: if the new table
+ * gets close to full before the incremental rehashing is done, complete the
+ * rehashing now so that the table can be expanded again. */
+int dict::_dictOpenReserve()
+{
+    if (dictIsRehashing() && m_iterators == 0 &&
+        m_ht[1].used()*16 >= m_ht[1].size()*15)
+    {
+        while(dictRehash(100));
+    }
+    return _dictExpandIfNeeded();
+}
+
+/* Add the entry 'de' of another dictionary to a dictionary with borrowed
+ * entries (see DICT_TYPE_BORROWED_ENTRIES), indexed by its key. Returns
+ * DICT_ERR if the key is already there. */
+int dict::dictAddEntry(dictEntry *de)
+{
+    void *key = de->dictGetKey();
+    uint64_t h = dictHashKey(key);
+
+    assert(dictIsOpen() && dictHasBorrowedEntries());
+    if (dictIsRehashing()) _dictRehashStep();
+    if (_dictOpenReserve() == DICT_ERR) return DICT_ERR;
+    for (int itable = 0; itable <= 1; itable++) {
+        if (_dictOpenFind<dictTypePolicy>(&m_ht[itable],key,h,NULL))
+            return DICT_ERR;
+        if (!dictIsRehashing()) break;
+    }
+    _dictOpenInsert(dictIsRehashing() ? &m_ht[1] : &m_ht[0],de,h);
+    return DICT_OK;
+}
+
+/* Set the key of a new entry. When the dictType embeds the keys, a copy of
+ * 'key' is stored in the same allocation of the entry, after it and its
+ * 'extra' bytes, and the caller retains the ownership of 'key'. */
+void dict::_dictInitKey(dictEntry *entry, void *key, size_t extra)
+{
+    if (dictHasEmbeddedKeys())
+        entry->dictSetKey(m_type->keyEmbed((char*)entry+dictEntrySize()+extra, key));
+    else
+        dictSetKey(entry, key);
+}
+
 /* Add or Overwrite:
  * Add an element, discarding the old value if the key already exists.
  * Return 1 if the key was added from scratch, 0 if there was already an
@@ -398,7 +765,8 @@ int dict::dictReplace(void *key, void *val)
      * as the previous one. In this context, think to reference counting,
      * you want to increment (set), and then decrement (free), and not the
      * reverse. */
-    dictEntry auxentry = *existing;
+    dictEntry auxentry;
+    auxentry.v = existing->v; /* Open addressing entries have no m_next. */
     dictSetVal(existing, val);
     dictFreeVal(&auxentry);
     return 0;
@@ -420,30 +788,49 @@ dictEntry* dict::dictAddOrFind(void *key) {
 /* Search and remove an element. This is an helper function for
  * dictDelete() and dictUnlink(), please check the top comment
  * of those functions. */
-dictEntry* dict::dictGenericDelete(const void *key, int nofree) {
+template <class Policy>
+dictEntry* dict::_dictGenericDeleteWith(const void *key, int nofree) {
 
     if (m_ht[0].used() == 0 && m_ht[1].used() == 0) return NULL;
 
     if (dictIsRehashing()) _dictRehashStep();
-    unsigned int h = dictHashKey(key);
+    if (dictIsOpen()) {
+        uint64_t h = Policy::hash(this,key);
+
+        for (int itable = 0; itable <= 1; itable++) {
+            unsigned long gidx;
+            dictEntry **ref = _dictOpenFind<Policy>(&m_ht[itable],key,h,&gidx);
+            if (ref) {
+                dictEntry *he = *ref;
+                _dictOpenRemove(&m_ht[itable],gidx,ref,h);
+                if (!nofree) {
+                    _dictFreeEntry(he);
+                }
+                dictShrinkIfNeeded();
+                return he;
+            }
+            if (!dictIsRehashing()) break;
+        }
+        return NULL; /* not found */
+    }
+    unsigned int h = Policy::hash(this,key);
 
     for (int itable = 0; itable <= 1; itable++) {
         unsigned int idx = h & m_ht[itable].sizemask();
         dictEntry *he = m_ht[itable][idx];
         dictEntry *prevHe = NULL;
         while(he) {
-            if (key==he->m_key || dictCompareKeys(key, he->m_key)) {
+            if (key==he->m_key || Policy::compare(this, key, he->m_key)) {
                 /* Unlink the element from the list */
                 if (prevHe)
                     prevHe->m_next = he->m_next;
                 else
                     m_ht[itable][idx] = he->m_next;
                 if (!nofree) {
-                    dictFreeKey(he);
-                    dictFreeVal(he);
-                    dictEntryRelease(he);
+                    _dictFreeEntry(he);
                 }
                 m_ht[itable].used()--;
+                dictShrinkIfNeeded();
                 return he;
             }
             prevHe = he;
@@ -457,7 +844,7 @@ dictEntry* dict::dictGenericDelete(const void *key, int nofree) {
 /* Remove an element, returning DICT_OK on success or DICT_ERR if the
  * element was not found. */
 int dict::dictDelete(const void *key) {
-    return dictGenericDelete(key,0) ? DICT_OK : DICT_ERR;
+    return _dictGenericDeleteWith<dictTypePolicy>(key,0) ? DICT_OK : DICT_ERR;
 }
 
 /* Remove an element from the table, but without actually releasing
@@ -482,37 +869,52 @@ int dict::dictDelete(const void *key) {
  * dictFreeUnlinkedEntry(entry); // <- This does not need to lookup again.
  */
 dictEntry* dict::dictUnlink(const void *key) {
-    return dictGenericDelete(key,1);
+    return _dictGenericDeleteWith<dictTypePolicy>(key,1);
 }
 
 /* You need to call this function to really free the entry after a call
  * to dictUnlink(). It's safe to call this function with 'he' = NULL. */
 void dict::dictFreeUnlinkedEntry(dictEntry *he) {
     if (he == NULL) return;
-    dictFreeKey(he);
-    dictFreeVal(he);
-    dictEntryRelease(he);
+    _dictFreeEntry(he);
 }
 
 /* Destroy an entire dictionary */
+/* Free the elements of bucket 'i' of 'ht', returning how many they were.
+ * The bucket is left dangling: the caller fixes the counters and the
+ * table. */
+unsigned long dict::_dictClearBucket(dictht *ht, unsigned long i) {
+    unsigned long freed = 0;
+
+    if (dictIsOpen()) {
+        dictGroup *g = &ht->group(i);
+        uint64_t used = dictGroupUsed(g->ctrl);
+        while(used) {
+            dictEntry *he = g->slots[dictGroupFirstSlot(used)];
+            _dictFreeEntry(he);
+            freed++;
+            used &= used-1;
+        }
+        return freed;
+    }
+    dictEntry *he = (*ht)[i];
+    while(he) {
+        dictEntry *nextHe = he->m_next;
+        _dictFreeEntry(he);
+        freed++;
+        he = nextHe;
+    }
+    return freed;
+}
+
 int dict::_dictClear(dictht *ht, void(callback)(void *)) {
     unsigned long i;
 
     /* Free all the elements */
-    for (i = 0; i < ht->size() && ht->used() > 0; i++) {
+    for (i = 0; i < ht->buckets() && ht->used() > 0; i++) {
 
         if (callback && (i & 65535) == 0) callback(m_privdata);
-        dictEntry *he = (*ht)[i];
-
-        if ((he) == NULL) continue;
-        while(he) {
-            dictEntry *nextHe = he->m_next;
-            dictFreeKey(he);
-            dictFreeVal(he);
-            dictEntryRelease(he);
-            ht->used()--;
-            he = nextHe;
-        }
+        ht->used() -= _dictClearBucket(ht,i);
     }
     /* Free the table and the allocated cache structure */
     /*  and Re-initialize the table */
@@ -521,6 +923,30 @@ int dict::_dictClear(dictht *ht, void(callback)(void *)) {
     return DICT_OK; /* never fails */
 }
 
+/* Free the elements in the buckets from 'start' to 'end' (excluded) of
+ * both the tables, returning how many they were. Nothing else is modified,
+ * so that different threads can free disjoint ranges of a dictionary that
+ * nobody else uses: once all the ranges are done the dictionary must be
+ * released with dictReleaseCleared(). */
+unsigned long dict::dictClearBuckets(unsigned long start, unsigned long end) {
+    unsigned long freed = 0;
+
+    for (int table = 0; table <= 1; table++) {
+        dictht *ht = &m_ht[table];
+        unsigned long last = end < ht->buckets() ? end : ht->buckets();
+        for (unsigned long i = start; i < last; i++)
+            freed += _dictClearBucket(ht,i);
+    }
+    return freed;
+}
+
+/* Release a dictionary whose buckets were all freed by dictClearBuckets(). */
+void dictReleaseCleared(dict *d) {
+    d->m_ht[0].used() = 0;
+    d->m_ht[1].used() = 0;
+    dictRelease(d);
+}
+
 /* Clear & Release the hash table */
 void dictRelease(dict *d)
 {
@@ -532,12 +958,35 @@ dictEntry* dict::dictFind(const void *key)
 {
     if (m_ht[0].used() + m_ht[1].used() == 0) return NULL; /* dict is empty */
     if (dictIsRehashing()) _dictRehashStep();
-    uint64_t h = dictHashKey(key);
+    return dictFindReadOnly(key);
+}
+
+/* Like dictFind() but without performing a rehashing step, so that the
+ * dictionary is not modified and different threads can lookup the same
+ * dictionary at the same time, as long as nobody else modifies it. */
+dictEntry* dict::dictFindReadOnly(const void *key)
+{
+    return _dictFindWith<dictTypePolicy>(key);
+}
+
+template <class Policy>
+dictEntry* dict::_dictFindWith(const void *key)
+{
+    if (m_ht[0].used() + m_ht[1].used() == 0) return NULL; /* dict is empty */
+    uint64_t h = Policy::hash(this,key);
+    if (dictIsOpen()) {
+        for (int itable = 0; itable <= 1; itable++) {
+            dictEntry **ref = _dictOpenFind<Policy>(&m_ht[itable],key,h,NULL);
+            if (ref) return *ref;
+            if (!dictIsRehashing()) return NULL;
+        }
+        return NULL;
+    }
     for (uint64_t itable = 0; itable <= 1; itable++) {
         uint64_t idx = h & m_ht[itable].sizemask();
         dictEntry *he = m_ht[itable][idx];
         while(he) {
-            if (key==he->m_key || dictCompareKeys(key, he->m_key))
+            if (key==he->m_key || Policy::compare(this, key, he->m_key))
                 return he;
             he = he->m_next;
         }
@@ -546,6 +995,95 @@ dictEntry* dict::dictFind(const void *key)
     return NULL;
 }
 
+/* Issue software prefetches for the memory that looking up 'keys' is going
+ * to touch, so that the dependent cache misses of the lookups (bucket, then
+ * entry, then key and value) overlap instead of being serialized.
+ *
+ * All the hashes are computed first and the buckets prefetched, then the
+ * first entry of every bucket, then its key and value. Colliding entries
+ * after the first are not prefetched. The dictionary is not modified, and
+ * no rehashing step is performed. 'count' should not be greater than
+ * DICT_PREFETCH_BATCH. */
+void dict::dictPrefetch(void **keys, int count) {
+    uint64_t hashes[DICT_PREFETCH_BATCH];
+
+    if (dictSize() == 0) return;
+    if (count > DICT_PREFETCH_BATCH) count = DICT_PREFETCH_BATCH;
+    dictHashKeys(keys,count,hashes);
+    dictPrefetchHashes(hashes,count);
+}
+
+/* Like dictPrefetch(), for keys whose hashes were already computed by the
+ * caller, for instance keys that are not yet in the form the dictType
+ * expects. */
+void dict::dictPrefetchHashes(const uint64_t *hashes, int count) {
+    dictEntry **buckets[DICT_PREFETCH_BATCH*2];
+    int numbuckets = 0, j, t;
+
+    if (dictSize() == 0) return;
+    if (count > DICT_PREFETCH_BATCH) count = DICT_PREFETCH_BATCH;
+    if (dictIsOpen()) {
+        /* Same for open addressing, where the first slot matching the tag
+         * of the key takes the place of the first entry of the bucket. */
+        dictGroup *groups[DICT_PREFETCH_BATCH*2];
+        uint64_t tags[DICT_PREFETCH_BATCH*2];
+        dictEntry *entries[DICT_PREFETCH_BATCH*2];
+
+        for (j = 0; j < count; j++) {
+            uint64_t h = hashes[j];
+            for (t = 0; t <= 1; t++) {
+                if (m_ht[t].empty()) continue;
+                groups[numbuckets] = &m_ht[t].group(h & m_ht[t].sizemask());
+                tags[numbuckets] = dictTag(h);
+                dictPrefetchAddr(groups[numbuckets]);
+                numbuckets++;
+                if (!dictIsRehashing()) break;
+            }
+        }
+        for (j = 0; j < numbuckets; j++) {
+            uint64_t match = dictGroupMatch(groups[j]->ctrl,tags[j]);
+            entries[j] = match ? groups[j]->slots[dictGroupFirstSlot(match)] : NULL;
+            if (entries[j]) dictPrefetchAddr(entries[j]);
+        }
+        for (j = 0; j < numbuckets; j++) {
+            if (entries[j]) {
+                dictPrefetchAddr(entries[j]->m_key);
+                dictPrefetchAddr(entries[j]->v.val);
+            }
+        }
+        return;
+    }
+    for (j = 0; j < count; j++) {
+        uint64_t h = hashes[j];
+        for (t = 0; t <= 1; t++) {
+            if (m_ht[t].empty()) continue;
+            buckets[numbuckets] = &m_ht[t][h & m_ht[t].sizemask()];
+            dictPrefetchAddr(buckets[numbuckets]);
+            numbuckets++;
+            if (!dictIsRehashing()) break;
+        }
+    }
+    for (j = 0; j < numbuckets; j++)
+        if (*buckets[j]) dictPrefetchAddr(*buckets[j]);
+    for (j = 0; j < numbuckets; j++) {
+        dictEntry *he = *buckets[j];
+        if (he) {
+            dictPrefetchAddr(he->m_key);
+            dictPrefetchAddr(he->v.val);
+        }
+    }
+}
+
+/* Compute the hashes of 'count' keys, using the batch hash function of the
+ * dictType if there is one. */
+void dict::dictHashKeys(void **keys, int count, uint64_t *hashes) {
+    if (m_type->hashFunctionBatch) {
+        m_type->hashFunctionBatch(keys,count,hashes);
+    } else {
+        for (int j = 0; j < count; j++) hashes[j] = dictHashKey(keys[j]);
+    }
+}
+
 void* dict::dictFetchValue(const void *key) {
     dictEntry *he = dictFind(key);
     return he ? he->dictGetVal() : NULL;
@@ -605,6 +1143,41 @@ dictIterator *dictGetSafeIterator(dict *d) {
 
 dictEntry* dictIterator::dictNext()
 {
+    if (m_d->dictIsOpen()) {
+        dictht *ht = &m_d->m_ht[m_table];
+        if (m_index == -1 && m_table == 0) {
+            if (m_safe)
+                m_d->m_iterators++;
+            else
+                m_fingerprint = m_d->dictFingerprint();
+        }
+        /* Deleting the returned entry doesn't move the other entries, so
+         * the position of the next slot to check is all we need. */
+        while (1) {
+            if (m_index == -1 || m_slot >= DICT_GROUP_SLOTS) {
+                m_index++;
+                m_slot = 0;
+                if (m_index >= (long) ht->buckets()) {
+                    if (m_d->dictIsRehashing() && m_table == 0) {
+                        m_table++;
+                        m_index = 0;
+                        ht = &m_d->m_ht[1];
+                    } else {
+                        m_entry = NULL;
+                        return NULL;
+                    }
+                }
+            }
+            dictGroup *g = &ht->group(m_index);
+            while (m_slot < DICT_GROUP_SLOTS) {
+                int slot = m_slot++;
+                if ((g->ctrl >> (slot*8)) & 0x80) {
+                    m_entry = g->slots[slot];
+                    return m_entry;
+                }
+            }
+        }
+    }
     while (1) {
         if (m_entry == NULL) {
             dictht *ht = &m_d->m_ht[m_table];
@@ -653,6 +1226,29 @@ dictEntry* dict::dictGetRandomKey()
 
     if (this->dictSize() == 0) return NULL;
     if (dictIsRehashing()) _dictRehashStep();
+    if (dictIsOpen()) {
+        /* Pick a non empty group like a non empty bucket below, then a
+         * random used slot inside it. */
+        dictGroup *g;
+        unsigned long b0 = m_ht[0].buckets();
+        do {
+            if (dictIsRehashing()) {
+                h = m_rehashidx + (random() % (b0 + m_ht[1].buckets() -
+                                                m_rehashidx));
+                g = (h >= b0) ? &m_ht[1].group(h - b0) : &m_ht[0].group(h);
+            } else {
+                h = random() & m_ht[0].sizemask();
+                g = &m_ht[0].group(h);
+            }
+        } while(!dictGroupUsed(g->ctrl));
+
+        uint64_t used = dictGroupUsed(g->ctrl), m;
+        int numused = 0;
+        for (m = used; m; m &= m-1) numused++;
+        int slotele = random() % numused;
+        while(slotele--) used &= used-1;
+        return g->slots[dictGroupFirstSlot(used)];
+    }
     if (dictIsRehashing()) {
         do {
             /* We are sure there are no elements in indexes from 0
@@ -743,10 +1339,32 @@ unsigned int dict::dictGetSomeKeys(dictEntry **des, unsigned int count) {
                  * table, there will be no elements in both tables up to
                  * the current rehashing index, so we jump if possible.
                  * (this happens when going from big to small table). */
-                if (i >= m_ht[1].size()) i = m_rehashidx;
+                if (i >= m_ht[1].buckets()) i = m_rehashidx;
+                continue;
+            }
+            if (i >= m_ht[j].buckets()) continue; /* Out of range for this table. */
+            if (dictIsOpen()) {
+                dictGroup *g = &m_ht[j].group(i);
+                uint64_t used = dictGroupUsed(g->ctrl);
+
+                if (!used) {
+                    emptylen++;
+                    if (emptylen >= 5 && emptylen > count) {
+                        i = random() & maxsizemask;
+                        emptylen = 0;
+                    }
+                    continue;
+                }
+                emptylen = 0;
+                while (used) {
+                    *des = g->slots[dictGroupFirstSlot(used)];
+                    des++;
+                    used &= used-1;
+                    stored++;
+                    if (stored == count) return stored;
+                }
                 continue;
             }
-            if (i >= m_ht[j].size()) continue; /* Out of range for this table. */
             dictEntry *he = m_ht[j][i];
 
             /* Count contiguous empty buckets, and jump to other
@@ -876,7 +1494,6 @@ unsigned long dict::dictScan(unsigned long v, dictScanFunction *fn,
                        void *privdata)
 {
     dictht *t0, *t1;
-    const dictEntry *de;
     unsigned long m0, m1;
 
     if (this->dictSize() == 0) return 0;
@@ -886,13 +1503,7 @@ unsigned long dict::dictScan(unsigned long v, dictScanFunction *fn,
         m0 = t0->sizemask();
 
         /* Emit entries at cursor */
-        if (bucketfn) bucketfn(privdata, &(*t0)[v & m0]);
-        de = (*t0)[v & m0];
-        while (de) {
-            const dictEntry *next = de->m_next;
-            fn(privdata, de);
-            de = next;
-        }
+        _dictScanBucket(t0, v & m0, fn, bucketfn, privdata);
 
     } else {
         t0 = &m_ht[0];
@@ -908,25 +1519,13 @@ unsigned long dict::dictScan(unsigned long v, dictScanFunction *fn,
         m1 = t1->sizemask();
 
         /* Emit entries at cursor */
-        if (bucketfn) bucketfn(privdata, &(*t0)[v & m0]);
-        de = (*t0)[v & m0];
-        while (de) {
-            const dictEntry *next = de->m_next;
-            fn(privdata, de);
-            de = next;
-        }
+        _dictScanBucket(t0, v & m0, fn, bucketfn, privdata);
 
         /* Iterate over indices in larger table that are the expansion
          * of the index pointed to by the cursor in the smaller table */
         do {
             /* Emit entries at cursor */
-            if (bucketfn) bucketfn(privdata, &(*t1)[v & m1]);
-            de = (*t1)[v & m1];
-            while (de) {
-                const dictEntry *next = de->m_next;
-                fn(privdata, de);
-                de = next;
-            }
+            _dictScanBucket(t1, v & m1, fn, bucketfn, privdata);
 
             /* Increment bits not covered by the smaller mask */
             v = (((v | m0) + 1) & ~m0) | (v & m0);
@@ -947,8 +1546,157 @@ unsigned long dict::dictScan(unsigned long v, dictScanFunction *fn,
     return v;
 }
 
+/* Return 1 if a scan that returned the cursor 'v' already visited the bucket
+ * of 'key', that is, if the key was there it was already returned. The
+ * buckets visited are the ones with the reversed index lower than the
+ * reversed cursor, whatever the size of the table, as long as the table
+ * did not shrink since the scan started: see dictDisableResize(). A zero
+ * cursor is the start of the scan, not the end. */
+int dict::dictScanVisited(unsigned long v, const void *key)
+{
+    return rev(dictHashKey(key)) < rev(v);
+}
+
+/* Return the number of partitions the cursor space of dictScan() can be
+ * split into, that is the number of buckets of the smaller table. */
+unsigned long dict::dictScanMaxPartitions()
+{
+    unsigned long b0 = m_ht[0].buckets(), b1 = m_ht[1].buckets();
+
+    if (dictIsRehashing() && b1 < b0) return b1;
+    return b0;
+}
+
+/* Scan the partition 'partition' of the 'partitions' the cursor space of
+ * dictScan() is split into, where 'partitions' is a power of two not greater
+ * than dictScanMaxPartitions().
+ *
+ * The partition is made of the cursors having 'partition' as their lower
+ * bits. Since the reversed cursor increments the higher bits first, these
+ * cursors are a contiguous run of the cursor sequence starting at the
+ * cursor 'partition', and end when the increment carries into the lower
+ * bits. The partitions are disjoint and together visit every bucket once,
+ * so as long as the dictionary is not modified, different threads can scan
+ * different partitions at the same time: dictScan() never writes to the
+ * dictionary. */
+void dict::dictScanPartition(unsigned long partition, unsigned long partitions,
+                             dictScanFunction *fn, void *privdata)
+{
+    unsigned long mask = partitions-1, v = partition;
+
+    assert((partitions & mask) == 0 && partition < partitions);
+    do {
+        v = dictScan(v,fn,NULL,privdata);
+    } while (v != 0 && (v & mask) == partition);
+}
+
 /* ------------------------- private functions ------------------------------ */
 
+/* Emit the elements of the bucket 'idx' of 'ht' for dictScan().
+ *
+ * In open addressing tables the elements of a bucket are the ones whose hash
+ * selects the group 'idx', that may have been displaced to the following
+ * groups, so they are found following the probe sequence like a lookup
+ * does, and the cursor semantics of dictScan() are the same of chaining.
+ * The bucket callback is only called for chained tables. */
+void dict::_dictScanBucket(dictht *ht, unsigned long idx, dictScanFunction *fn,
+                           dictScanBucketFunction* bucketfn, void *privdata)
+{
+    if (!dictIsOpen()) {
+        if (bucketfn) bucketfn(privdata, &(*ht)[idx]);
+        const dictEntry *de = (*ht)[idx];
+        while (de) {
+            const dictEntry *next = de->m_next;
+            fn(privdata, de);
+            de = next;
+        }
+        return;
+    }
+
+    unsigned long mask = ht->sizemask(), g = idx, probes = 0;
+    while (1) {
+        dictGroup *grp = &ht->group(g);
+        uint64_t used = dictGroupUsed(grp->ctrl);
+        while (used) {
+            const dictEntry *de = grp->slots[dictGroupFirstSlot(used)];
+            used &= used-1;
+            if ((dictHashKey(de->m_key) & mask) == idx) fn(privdata, de);
+        }
+        if (dictGroupOverflow(grp->ctrl) == 0 || probes++ == mask) break;
+        g = (g+1) & mask;
+    }
+}
+
+/* Lookup 'key' in the open addressing table 'ht', returning the reference to
+ * the slot holding its entry or NULL if not found. If 'gidx' is not NULL it
+ * is set to the index of the group of the slot. */
+template <class Policy>
+dictEntry **dict::_dictOpenFind(dictht *ht, const void *key, uint64_t hash,
+                                unsigned long *gidx)
+{
+    if (ht->used() == 0) return NULL;
+
+    uint64_t tag = dictTag(hash);
+    unsigned long mask = ht->sizemask(), g = hash & mask, probes = 0;
+    while (1) {
+        dictGroup *grp = &ht->group(g);
+        uint64_t match = dictGroupMatch(grp->ctrl,tag);
+        while (match) {
+            dictEntry **ref = &grp->slots[dictGroupFirstSlot(match)];
+            if (key==(*ref)->m_key || Policy::compare(this, key, (*ref)->m_key)) {
+                if (gidx) *gidx = g;
+                return ref;
+            }
+            match &= match-1;
+        }
+        if (dictGroupOverflow(grp->ctrl) == 0 || probes++ == mask) return NULL;
+        g = (g+1) & mask;
+    }
+}
+
+/* Store 'de' into the first free slot of the probe sequence of 'hash',
+ * counting the overflow of every full group we pass. The key must not be
+ * already in the table. */
+void dict::_dictOpenInsert(dictht *ht, dictEntry *de, uint64_t hash)
+{
+    unsigned long mask = ht->sizemask(), g = hash & mask, probes = 0;
+    while (1) {
+        dictGroup *grp = &ht->group(g);
+        uint64_t freeslots = dictGroupFree(grp->ctrl);
+        if (freeslots) {
+            int slot = dictGroupFirstSlot(freeslots);
+            grp->ctrl |= dictTag(hash) << (slot*8);
+            grp->slots[slot] = de;
+            ht->used()++;
+            return;
+        }
+        if (dictGroupOverflow(grp->ctrl) < 255)
+            grp->ctrl += 1ULL << DICT_CTRL_OVERFLOW_SHIFT;
+        assert(probes++ < mask); /* The table is full. */
+        g = (g+1) & mask;
+    }
+}
+
+/* Clear the slot 'ref' of the group 'gidx', that holds an entry with the
+ * specified hash, and undo the overflow counting of its insertion. Counters
+ * that saturated are never decremented. */
+void dict::_dictOpenRemove(dictht *ht, unsigned long gidx, dictEntry **ref,
+                           uint64_t hash)
+{
+    unsigned long mask = ht->sizemask(), g;
+    dictGroup *grp = &ht->group(gidx);
+    int slot = ref - grp->slots;
+
+    grp->ctrl &= ~(0xffULL << (slot*8));
+    *ref = NULL;
+    ht->used()--;
+    for (g = hash & mask; g != gidx; g = (g+1) & mask) {
+        dictGroup *prev = &ht->group(g);
+        if (dictGroupOverflow(prev->ctrl) < 255)
+            prev->ctrl -= 1ULL << DICT_CTRL_OVERFLOW_SHIFT;
+    }
+}
+
 /* Expand the hash table if needed */
 int dict::_dictExpandIfNeeded()
 {
@@ -958,6 +1706,16 @@ int dict::_dictExpandIfNeeded()
     /* If the hash table is empty expand it to the initial size. */
     if (m_ht[0].size() == 0) return dictExpand(DICT_HT_INITIAL_SIZE);
 
+    /* Open addressing tables are kept at most 3/4 full, or 15/16 full when
+     * resizing is disabled, since they can't hold more elements than slots
+     * and probing gets longer as they fill up. */
+    if (dictIsOpen()) {
+        unsigned long used = m_ht[0].used(), size = m_ht[0].size();
+        if ((used*4 >= size*3 && dict_can_resize) || used*16 >= size*15)
+            return dictExpand(used*2);
+        return DICT_OK;
+    }
+
     /* If we reached the 1:1 ratio, and we are allowed to resize the hash
      * table (global setting) or we should avoid it but the ratio between
      * elements/buckets is over the "safe" threshold, we resize doubling
@@ -971,6 +1729,19 @@ int dict::_dictExpandIfNeeded()
     return DICT_OK;
 }
 
+/* Number of groups of an open addressing table with room for 'size'
+ * elements within the maximum 3/4 fill: a power of two as well. */
+static unsigned long _dictOpenGroups(unsigned long size)
+{
+    unsigned long groups = 1;
+
+    while (groups*DICT_GROUP_SLOTS/4*3 < size) {
+        if (groups >= LONG_MAX/DICT_GROUP_SLOTS/2) break;
+        groups *= 2;
+    }
+    return groups;
+}
+
 /* Our hash table capability is a power of two */
 static unsigned long _dictNextPower(unsigned long size)
 {
@@ -991,6 +1762,7 @@ static unsigned long _dictNextPower(unsigned long size)
  *
  * Note that if we are in the process of rehashing the hash table, the
  * index is always returned in the context of the second (new) hash table. */
+template <class Policy>
 int dict::_dictKeyIndex(const void *key, unsigned int hash, dictEntry **existing)
 {    
     unsigned int idx;
@@ -1004,7 +1776,7 @@ int dict::_dictKeyIndex(const void *key, unsigned int hash, dictEntry **existing
         /* Search if this slot does not already contain the given key */
         dictEntry *he = m_ht[itable][idx];
         while(he) {
-            if (key==he->m_key || dictCompareKeys(key, he->m_key)) {
+            if (key==he->m_key || Policy::compare(this, key, he->m_key)) {
                 if (existing) *existing = he;
                 return -1;
             }
@@ -1030,6 +1802,23 @@ void dictDisableResize() {
     dict_can_resize = 0;
 }
 
+void dictPauseRehashing() {
+    dict_rehash_paused = 1;
+}
+
+void dictResumeRehashing() {
+    dict_rehash_paused = 0;
+}
+
+/* Let 'callback' free the old tables of at least 'min_bytes' at the end of
+ * the rehashing, instead of calling zfree() synchronously. Freeing the table
+ * of a big dictionary may take several milliseconds. The callback is only
+ * called by dictRehash(), not when a dictionary is released or emptied. */
+void dictSetFreeTableCallback(void (*callback)(void *table), size_t min_bytes) {
+    dict_free_table_callback = callback;
+    dict_free_table_min_bytes = min_bytes;
+}
+
 unsigned int dict::dictGetHash(const void *key) {
     return dictHashKey(key);
 }
@@ -1042,6 +1831,27 @@ unsigned int dict::dictGetHash(const void *key) {
 dictEntry** dict::dictFindEntryRefByPtrAndHash(const void *oldptr, unsigned int hash) {
 
     if (m_ht[0].used() + m_ht[1].used() == 0) return NULL; /* dict is empty */
+    if (dictIsOpen()) {
+        /* Without the full hash we can't compare tags, so all the used
+         * slots of the probe sequence are checked. */
+        for (unsigned int itable = 0; itable <= 1; itable++) {
+            unsigned long mask = m_ht[itable].sizemask(), g = hash & mask;
+            unsigned long probes = 0;
+            while (1) {
+                dictGroup *grp = &m_ht[itable].group(g);
+                uint64_t used = dictGroupUsed(grp->ctrl);
+                while (used) {
+                    dictEntry **ref = &grp->slots[dictGroupFirstSlot(used)];
+                    if (oldptr==(*ref)->m_key) return ref;
+                    used &= used-1;
+                }
+                if (dictGroupOverflow(grp->ctrl) == 0 || probes++ == mask) break;
+                g = (g+1) & mask;
+            }
+            if (!dictIsRehashing()) return NULL;
+        }
+        return NULL;
+    }
     for (unsigned int itable = 0; itable <= 1; itable++) {
         unsigned int idx = hash & m_ht[itable].sizemask();
         dictEntry **heref = &m_ht[itable][idx];
@@ -1120,16 +1930,83 @@ size_t _dictGetStatsHt(char *buf, size_t bufsize, dictht *ht, int tableid) {
     return strlen(buf);
 }
 
+/* Like _dictGetStatsHt() for open addressing tables, where the interesting
+ * distribution is how many groups away from its own every entry is. */
+size_t _dictGetOpenStatsHt(dict *d, char *buf, size_t bufsize, dictht *ht, int tableid) {
+    unsigned long i, fullgroups = 0, overflowed = 0, maxprobe = 0;
+    unsigned long totprobe = 0;
+    unsigned long plvector[DICT_STATS_VECTLEN];
+    size_t l = 0;
+
+    if (ht->used() == 0) {
+        return snprintf(buf,bufsize,
+            "No stats available for empty dictionaries\n");
+    }
+
+    /* Compute stats. */
+    for (i = 0; i < DICT_STATS_VECTLEN; i++) plvector[i] = 0;
+    for (i = 0; i < ht->buckets(); i++) {
+        dictGroup *g = &ht->group(i);
+
+        if ((g->ctrl & 0x0080808080808080ULL) == 0x0080808080808080ULL)
+            fullgroups++;
+        if (g->ctrl >> 56) overflowed++;
+        for (int slot = 0; slot < DICT_GROUP_SLOTS; slot++) {
+            if (!((g->ctrl >> (slot*8)) & 0x80)) continue;
+            unsigned long home = d->dictHashKey(g->slots[slot]->dictGetKey()) &
+                                 ht->sizemask();
+            unsigned long probe = (i - home) & ht->sizemask();
+            plvector[(probe < DICT_STATS_VECTLEN) ? probe : (DICT_STATS_VECTLEN-1)]++;
+            if (probe > maxprobe) maxprobe = probe;
+            totprobe += probe;
+        }
+    }
+
+    /* Generate human readable stats. */
+    l += snprintf(buf+l,bufsize-l,
+        "Hash table %d stats (%s):\n"
+        " table size: %ld\n"
+        " number of elements: %ld\n"
+        " groups: %ld\n"
+        " full groups: %ld\n"
+        " overflowed groups: %ld\n"
+        " max probe length: %ld\n"
+        " avg probe length: %.02f\n"
+        " Probe length distribution:\n",
+        tableid, (tableid == 0) ? "main hash table" : "rehashing target",
+        ht->size(), ht->used(), ht->buckets(), fullgroups, overflowed,
+        maxprobe, (float)totprobe/ht->used());
+
+    for (i = 0; i < DICT_STATS_VECTLEN; i++) {
+        if (plvector[i] == 0) continue;
+        if (l >= bufsize) break;
+        l += snprintf(buf+l,bufsize-l,
+            "   %s%ld: %ld (%.02f%%)\n",
+            (i == DICT_STATS_VECTLEN-1)?">= ":"",
+            i, plvector[i], ((float)plvector[i]/ht->used())*100);
+    }
+
+    /* Unlike snprintf(), return the number of characters actually written. */
+    if (bufsize) buf[bufsize-1] = '\0';
+    return strlen(buf);
+}
+
 void dict::dictGetStats(char *buf, size_t bufsize) {
     size_t l;
     char *orig_buf = buf;
     size_t orig_bufsize = bufsize;
 
-    l = _dictGetStatsHt(buf,bufsize,&m_ht[0],0);
+    if (dictIsOpen())
+        l = _dictGetOpenStatsHt(this,buf,bufsize,&m_ht[0],0);
+    else
+        l = _dictGetStatsHt(buf,bufsize,&m_ht[0],0);
     buf += l;
     bufsize -= l;
     if (dictIsRehashing() && bufsize > 0) {
-        _dictGetStatsHt(buf,bufsize,&m_ht[1],1);
+        if (dictIsOpen())
+            _dictGetOpenStatsHt(this,buf,bufsize,&m_ht[1],1);
+        else
+            _dictGetStatsHt(buf,bufsize,&m_ht[1],1);
     }
     /* Make sure there is a NULL term at the end. */
     if (orig_bufsize) orig_buf[orig_bufsize-1] = '\0';
@@ -1140,6 +2017,7 @@ dictIterator::dictIterator(dict *in_d, int in_safe)
 , m_table(0)
 , m_index(-1)
 , m_safe(in_safe)
+, m_slot(0)
 , m_entry(NULL)
 , m_nextEntry(NULL)
 {
@@ -1169,6 +2047,27 @@ std::ostream& operator<<(std::ostream& os, dictht& out_me)
     return os;
 }
 
+/* ------------------------- Specialized lookups -----------------------------*/
+
+/* Like dictSdsHash() and dictSdsKeyCompare() in server.cpp, but defined
+ * here so that they get inlined in the lookup paths instantiated below. */
+uint64_t dictSdsPolicy::hash(dict *d, const void *key) {
+    DICT_NOTUSED(d);
+    return dictGenHashFunction((unsigned char*)key, sdslen((sds)key));
+}
+
+bool dictSdsPolicy::compare(dict *d, const void *key1, const void *key2) {
+    DICT_NOTUSED(d);
+    size_t l1 = sdslen((sds)key1), l2 = sdslen((sds)key2);
+    return l1 == l2 && memcmp(key1, key2, l1) == 0;
+}
+
+/* The dictSpecialized classes call these: every new policy needs its own
+ * instantiations here. */
+template dictEntry *dict::_dictFindWith<dictSdsPolicy>(const void *key);
+template dictEntry *dict::_dictAddRawWith<dictSdsPolicy>(void *key, dictEntry **existing, size_t extra);
+template dictEntry *dict::_dictGenericDeleteWith<dictSdsPolicy>(const void *key, int nofree);
+
 /* ------------------------------- Benchmark ---------------------------------*/
 
 #ifdef DICT_BENCHMARK_MAIN
@@ -1210,13 +2109,65 @@ dictType BenchmarkDictType = {
     printf(msg ": %ld items in %lld ms\n", count, elapsed); \
 } while(0);
 
-/* dict-benchmark [count] */
+/* Compare the hash functions on keys of a few typical lengths, hashing the
+ * keys one by one and in batches of DICT_PREFETCH_BATCH. */
+static void benchmarkHashFunctions(long count) {
+    static const int keylens[] = {8, 16, 32, 64};
+    static const char *names[] = {"siphash", "wyhash"};
+    const void *keys[DICT_PREFETCH_BATCH];
+    int lens[DICT_PREFETCH_BATCH];
+    uint64_t hashes[DICT_PREFETCH_BATCH], sum = 0;
+    char buf[DICT_PREFETCH_BATCH][64];
+    long long start, elapsed;
+    long j;
+
+    for (int k = 0; k < DICT_PREFETCH_BATCH; k++) {
+        for (int i = 0; i < 64; i++) buf[k][i] = 'a'+(k*7+i)%26;
+        keys[k] = buf[k];
+    }
+    for (int l = 0; l < 4; l++) {
+        for (int k = 0; k < DICT_PREFETCH_BATCH; k++) lens[k] = keylens[l];
+        for (int f = DICT_HASH_SIPHASH; f <= DICT_HASH_WYHASH; f++) {
+            dictSetHashFunction(f);
+            start = timeInMilliseconds();
+            for (j = 0; j < count; j++) {
+                buf[j%DICT_PREFETCH_BATCH][0] = (char)j;
+                sum += dictGenHashFunction(keys[j%DICT_PREFETCH_BATCH],lens[0]);
+            }
+            elapsed = timeInMilliseconds()-start;
+            printf("%s %d bytes keys: %ld hashes in %lld ms\n",
+                names[f], keylens[l], count, elapsed);
+
+            start = timeInMilliseconds();
+            for (j = 0; j < count; j += DICT_PREFETCH_BATCH) {
+                buf[0][0] = (char)j;
+                dictGenHashFunctionBatch(keys,lens,DICT_PREFETCH_BATCH,hashes);
+                sum += hashes[0]^hashes[DICT_PREFETCH_BATCH-1];
+            }
+            elapsed = timeInMilliseconds()-start;
+            printf("%s %d bytes keys (batched): %ld hashes in %lld ms\n",
+                names[f], keylens[l], count, elapsed);
+        }
+    }
+    dictSetHashFunction(DICT_HASH_SIPHASH);
+    printf("(checksum %llu)\n", (unsigned long long)sum);
+}
+
+/* dict-benchmark [count]
+ * dict-benchmark hash [count] */
 int main(int argc, char **argv) {
     long j;
     long long start, elapsed;
-    dict *_dict = dictCreate(&BenchmarkDictType,NULL);
+    dict *_dict;
     long count = 0;
 
+    if (argc >= 2 && !strcmp(argv[1],"hash")) {
+        count = argc == 3 ? strtol(argv[2],NULL,10) : 50000000;
+        benchmarkHashFunctions(count);
+        return 0;
+    }
+
+    _dict = dictCreate(&BenchmarkDictType,NULL);
     if (argc == 2) {
         count = strtol(argv[1],NULL,10);
     } else {
@@ -53,6 +53,7 @@
  */
 
 #include <stdint.h>
+#include <stddef.h>
 #include <assert.h>
 
 #ifndef __DICT_H
@@ -73,6 +74,7 @@ public:
 
     inline void*      key()  {return m_key;};
     inline dictEntry* next() {return m_next;}
+    static inline size_t unchainedSize() {return offsetof(dictEntry, m_next);}
 
 // previously macros
     inline void*    dictGetKey() const { return m_key; }
@@ -102,9 +104,23 @@ private:
         int64_t s64;
         double d;
     } v;
+    /* Entries of open addressing tables are allocated without this field,
+     * see DICT_OPEN_ENTRY_SIZE. */
     dictEntry *m_next;
 } ;
 
+/* Allocation size of the entries of open addressing dictionaries, that
+ * don't need the chaining pointer. */
+#define DICT_OPEN_ENTRY_SIZE (dictEntry::unchainedSize())
+
+/* dictType flags. */
+#define DICT_TYPE_OPEN_ADDRESSING (1<<0) /* Use grouped open addressing. */
+#define DICT_TYPE_EMBED_KEYS (1<<1) /* Copy keys inside the entries. */
+/* The entries belong to another open addressing dictionary, and are added
+ * with dictAddEntry(): they are never allocated nor released, and must be
+ * removed before the owner releases them. Requires open addressing. */
+#define DICT_TYPE_BORROWED_ENTRIES (1<<2)
+
 struct dictType
 {
     uint64_t (*hashFunction)(const void *key);
@@ -113,33 +129,64 @@ struct dictType
     int (*keyCompare)(void *privdata, const void *key1, const void *key2);
     void (*keyDestructor)(void *privdata, void *key);
     void (*valDestructor)(void *privdata, void *obj);
+    int flags; /* DICT_TYPE_* flags. */
+    /* With DICT_TYPE_EMBED_KEYS: the bytes needed to store a copy of the key,
+     * and the function storing it at 'buf' and returning the stored key.
+     * Embedded keys are released with their entry, so keyDestructor and
+     * keyDup should be NULL. */
+    size_t (*keyEmbedSize)(const void *key);
+    void *(*keyEmbed)(void *buf, const void *key);
+    /* Optional: hash many keys at once, like calling hashFunction for each. */
+    void (*hashFunctionBatch)(void **keys, int count, uint64_t *hashes);
+    /* Bytes reserved in every entry, right after its fixed part, for the
+     * caller: see dictGetEntryMetadata(). A multiple of the pointer size. */
+    size_t entryMetadataBytes;
 } ;
 
+/* Open addressing tables are arrays of groups, every group fits a cache line
+ * and holds up to DICT_GROUP_SLOTS entries. The low 7 bytes of 'ctrl' are
+ * the per slot tags: zero for an empty slot, otherwise 0x80 ORed with the 7
+ * most significant bits of the hash of the key. The most significant byte
+ * counts the entries that were displaced past this group because it was
+ * full (saturating at 255), so a lookup can stop at the first group with
+ * no overflow. */
+#define DICT_GROUP_SLOTS 7
+struct dictGroup
+{
+    uint64_t ctrl;
+    dictEntry *slots[DICT_GROUP_SLOTS];
+};
+
 /* This is our hash table structure. Every dictionary has two of this as we
  * implement incremental rehashing, for the old to the new table. */
 class dictht
 {
 public:
-    dictht(const unsigned long new_size = 0);
+    dictht(const unsigned long new_size = 0, int grouped = 0);
     dictht(dictht&& in_move_me);
     dictht& operator=(dictht&& in_move_me);
     ~dictht();
 
     void reset();
     void free_table();
+    void *release_table();
 
-    inline bool empty() const {return m_table == NULL;}
+    inline bool empty() const {return m_table == NULL && m_groups == NULL;}
     inline dictEntry*& operator[](const size_t ind)
     {
         return m_table[ind];
     }
+    inline dictGroup& group(const size_t ind) {return m_groups[ind];}
     inline unsigned long  size() const {return m_size;}
     inline unsigned long  sizemask() const {return m_sizemask;}
+    inline unsigned long  buckets() const {return empty() ? 0 : m_sizemask+1;}
     inline unsigned long& used() {return m_used;}
+    inline size_t table_bytes() const {return m_groups ? buckets()*sizeof(dictGroup) : buckets()*sizeof(dictEntry*);}
 
-    inline void* peek_table() {return (void*)m_table;} // for dict::dictFingerprint & debugging
+    inline void* peek_table() {return m_groups ? (void*)m_groups : (void*)m_table;} // for dict::dictFingerprint & debugging
 private:
     dictEntry **  m_table;
+    dictGroup *   m_groups; /* Used instead of m_table by open addressing. */
     unsigned long m_size;
     unsigned long m_sizemask;
     unsigned long m_used;
@@ -164,14 +211,20 @@ public:
 
     inline bool dictIsRehashing() { return m_rehashidx != -1;}
     int dictResize();
+    int dictShrinkIfNeeded();
     int dictExpand(unsigned long size);
     int dictRehash(int n);
     void _dictRehashStep(); // should be private?
     int dictAdd(void *key, void *val);
-    dictEntry* dictAddRaw(void *key, dictEntry **existing);
+    dictEntry* dictAddRaw(void *key, dictEntry **existing, size_t extra = 0);
     dictEntry* dictAddOrFind(void *key);
+    int dictAddEntry(dictEntry *de);
     dictEntry* dictUnlink(const void *key);
     dictEntry* dictFind(const void *key);
+    dictEntry* dictFindReadOnly(const void *key);
+    void dictPrefetch(void **keys, int count);
+    void dictPrefetchHashes(const uint64_t *hashes, int count);
+    void dictHashKeys(void **keys, int count, uint64_t *hashes);
     dictEntry* dictGetRandomKey();
     int dictReplace(void *key, void *val);
     int dictDelete(const void *key);
@@ -182,10 +235,17 @@ public:
     unsigned long dictScan(unsigned long v, dictScanFunction *fn,
                        dictScanBucketFunction* bucketfn,
                        void *privdata);
+    int dictScanVisited(unsigned long v, const void *key);
+    unsigned long dictScanMaxPartitions();
+    void dictScanPartition(unsigned long partition, unsigned long partitions,
+                           dictScanFunction *fn, void *privdata);
     void dictEmpty(void(callback)(void*));
     unsigned int dictGetHash(const void *key);
     dictEntry** dictFindEntryRefByPtrAndHash(const void *oldptr, unsigned int hash);
     void dictGetStats(char *buf, size_t bufsize);
+    unsigned long dictClearBuckets(unsigned long start, unsigned long end);
+    /* Buckets of the larger table, the range of dictClearBuckets(). */
+    inline unsigned long dictBuckets() { return m_ht[0].buckets() > m_ht[1].buckets() ? m_ht[0].buckets() : m_ht[1].buckets(); }
 
 // previously macros
     inline void dictFreeVal(dictEntry *entry)
@@ -227,11 +287,44 @@ public:
     inline uint64_t dictHashKey(const void* key) { return m_type->hashFunction(key);}
     inline unsigned long dictSlots() { return m_ht[0].size()+m_ht[1].size(); }
     inline unsigned long dictSize() { return m_ht[0].used()+m_ht[1].used(); }
+    inline bool dictIsOpen() const { return m_type && (m_type->flags & DICT_TYPE_OPEN_ADDRESSING); }
+    inline bool dictHasEmbeddedKeys() const { return m_type && (m_type->flags & DICT_TYPE_EMBED_KEYS); }
+    inline bool dictHasBorrowedEntries() const { return m_type && (m_type->flags & DICT_TYPE_BORROWED_ENTRIES); }
+    /* The extra space reserved by dictAddRaw() in the entry. */
+    inline void* dictGetEntryExtra(dictEntry *entry) const { return (char*)entry+dictEntrySize(); }
+    /* The entryMetadataBytes of the dictType, zeroed when the entry is
+     * created. */
+    inline void* dictGetEntryMetadata(const dictEntry *entry) const { return (char*)entry+_dictEntryBaseSize(); }
+    /* Memory used by every entry and by every slot of the tables. Borrowed
+     * entries are accounted by their owner. */
+    inline size_t dictEntrySize() const { return dictHasBorrowedEntries() ? 0 : _dictEntryBaseSize()+(m_type ? m_type->entryMetadataBytes : 0); }
+    inline size_t dictSlotSize() const { return dictIsOpen() ? sizeof(dictGroup)/DICT_GROUP_SLOTS : sizeof(dictEntry*); }
+    /* Fraction of the old table already rehashed, and memory of the old
+     * table that is allocated together with the new one while rehashing. */
+    inline double dictRehashProgress() { return dictIsRehashing() ? (double)m_rehashidx/m_ht[0].buckets() : 1; }
+    inline size_t dictRehashingMemory() { return dictIsRehashing() ? m_ht[0].size()*dictSlotSize() : 0; }
 //private:
-    int _dictKeyIndex(const void *key, unsigned int hash, dictEntry **existing);
+    /* The lookup paths, hashing and comparing the keys with 'Policy', see
+     * dictSpecialized. They are instantiated at the end of dict.cpp. */
+    template <class Policy> dictEntry *_dictFindWith(const void *key);
+    template <class Policy> dictEntry *_dictAddRawWith(void *key, dictEntry **existing, size_t extra);
+    template <class Policy> dictEntry *_dictGenericDeleteWith(const void *key, int nofree);
+    template <class Policy> int _dictKeyIndex(const void *key, unsigned int hash, dictEntry **existing);
     int _dictExpandIfNeeded();
-    dictEntry *dictGenericDelete(const void *key, int nofree);
+    void _dictReleaseTable(dictht *ht);
     int _dictClear(dictht *ht, void(callback)(void *));
+    unsigned long _dictClearBucket(dictht *ht, unsigned long i);
+    inline size_t _dictEmbeddedKeySize(const void *key) { return dictHasEmbeddedKeys() ? m_type->keyEmbedSize(key) : 0; }
+    inline size_t _dictEntryBaseSize() const { return dictIsOpen() ? DICT_OPEN_ENTRY_SIZE : sizeof(dictEntry); }
+    dictEntry *_dictEntryCreate(dictEntry *next_entry, size_t extra);
+    void _dictFreeEntry(dictEntry *he);
+    int _dictOpenReserve();
+    void _dictInitKey(dictEntry *entry, void *key, size_t extra);
+    void _dictScanBucket(dictht *ht, unsigned long idx, dictScanFunction *fn,
+                         dictScanBucketFunction* bucketfn, void *privdata);
+    template <class Policy> dictEntry **_dictOpenFind(dictht *ht, const void *key, uint64_t hash, unsigned long *gidx);
+    void _dictOpenInsert(dictht *ht, dictEntry *de, uint64_t hash);
+    void _dictOpenRemove(dictht *ht, unsigned long gidx, dictEntry **ref, uint64_t hash);
     
     dictType *m_type;
     void *m_privdata;
@@ -242,6 +335,74 @@ public:
 
 std::ostream& operator<<(std::ostream& os, dict& out_me);
 
+/* Lookup policies: how the lookup paths hash and compare the keys. The
+ * default one calls the functions of the dictType, the other ones are
+ * known at compile time, so that hashing and comparing are inlined in the
+ * probing loops instead of being indirect calls for every probed entry. */
+struct dictTypePolicy {
+    static inline uint64_t hash(dict *d, const void *key) { return d->dictHashKey(key); }
+    static inline bool compare(dict *d, const void *key1, const void *key2) { return d->dictCompareKeys(key1, key2); }
+};
+
+/* Keys are sds strings hashed and compared like dictSdsHash() and
+ * dictSdsKeyCompare() do. */
+struct dictSdsPolicy {
+    static uint64_t hash(dict *d, const void *key);
+    static bool compare(dict *d, const void *key1, const void *key2);
+};
+
+/* A dictionary whose dictType hashes and compares the keys like 'Policy'.
+ * The lookups, insertions and deletions called through a pointer to it use
+ * the specialized paths, while the dictType is still used for everything
+ * else (key and value dup and destructors, embedded keys, flags). It adds
+ * no state to dict: it is created with sdsDictCreate() or the like, released
+ * with dictRelease(), and can be passed wherever a dict is expected, where
+ * the dictType functions are called as usual. */
+template <class Policy>
+class dictSpecialized : public dict
+{
+public:
+    dictSpecialized(dictType *in_type, void *in_privDataPtr) : dict(in_type, in_privDataPtr) {}
+
+    inline dictEntry* dictFind(const void *key)
+    {
+        if (dictSize() == 0) return NULL;
+        if (dictIsRehashing()) _dictRehashStep();
+        return _dictFindWith<Policy>(key);
+    }
+    inline dictEntry* dictFindReadOnly(const void *key) { return _dictFindWith<Policy>(key); }
+    inline void* dictFetchValue(const void *key)
+    {
+        dictEntry *he = dictFind(key);
+        return he ? he->dictGetVal() : NULL;
+    }
+    inline dictEntry* dictAddRaw(void *key, dictEntry **existing, size_t extra = 0)
+    {
+        return _dictAddRawWith<Policy>(key, existing, extra);
+    }
+    inline int dictAdd(void *key, void *val)
+    {
+        dictEntry *entry = dictAddRaw(key, NULL);
+        if (!entry) return DICT_ERR;
+        dictSetVal(entry, val);
+        return DICT_OK;
+    }
+    inline dictEntry* dictAddOrFind(void *key)
+    {
+        dictEntry *existing;
+        dictEntry *entry = dictAddRaw(key, &existing);
+        return entry ? entry : existing;
+    }
+    inline dictEntry* dictUnlink(const void *key) { return _dictGenericDeleteWith<Policy>(key, 1); }
+    inline int dictDelete(const void *key)
+    {
+        return _dictGenericDeleteWith<Policy>(key, 0) ? DICT_OK : DICT_ERR;
+    }
+};
+
+/* The keyspace, the expires, and the set and hash values: sds keys. */
+typedef dictSpecialized<dictSdsPolicy> sdsDict;
+
 /* If safe is set to 1 this is a safe iterator, that means, you can call
  * dictAdd, dictFind, and other functions against the dictionary even while
  * iterating. Otherwise it is a non safe iterator, and only dictNext()
@@ -258,30 +419,59 @@ private:
     long m_index;
     int m_table;
     int m_safe;
+    int m_slot; /* Slot of m_entry inside its group, for open addressing. */
     dictEntry *m_entry;
     dictEntry *m_nextEntry;
     /* unsafe iterator fingerprint for misuse detection. */
     long long m_fingerprint;
 };
 
+/* Max number of keys dictPrefetch() should be called with: more prefetches in
+ * flight are likely to evict each other before being used. */
+#define DICT_PREFETCH_BATCH 16
+
+#if defined(__GNUC__)
+#define dictPrefetchAddr(addr) __builtin_prefetch(addr)
+#else
+#define dictPrefetchAddr(addr) ((void)(addr))
+#endif
+
+/* Functions dictGenHashFunction() can use, see dictSetHashFunction(). */
+#define DICT_HASH_SIPHASH 0
+#define DICT_HASH_WYHASH 1
+
 /* This is the initial size of every hash table */
 #define DICT_HT_INITIAL_SIZE     4
 
+/* A table is shrunk when less than 1/DICT_HT_SHRINK_RATIO of its slots are
+ * used, to a size where about 1/4 of the slots are used. Shrinking well below
+ * the fill that causes an expansion avoids resizing back and forth when the
+ * number of elements oscillates. */
+#define DICT_HT_SHRINK_RATIO     8
+
 /* ------------------------------- Macros ------------------------------------*/
 
 /* API */
 dict *dictCreate(dictType *type, void *privDataPtr);
+sdsDict *sdsDictCreate(dictType *type, void *privDataPtr);
 void dictRelease(dict *d);
+void dictReleaseCleared(dict *d);
 dictIterator *dictGetIterator(dict *d);
 dictIterator *dictGetSafeIterator(dict *d);
 void dictReleaseIterator(dictIterator *iter);
 uint64_t dictGenHashFunction(const void *key, int len);
+void dictGenHashFunctionBatch(const void **keys, const int *lens, int count,
+                              uint64_t *hashes);
 uint64_t dictGenCaseHashFunction(const unsigned char *buf, int len);
 void dictEnableResize();
 void dictDisableResize();
+void dictPauseRehashing();
+void dictResumeRehashing();
 
 int dictRehashMilliseconds(dict *d, int ms);
 void dictSetHashFunctionSeed(uint8_t *seed);
+void dictSetHashFunction(int func);
+void dictSetFreeTableCallback(void (*callback)(void *table), size_t min_bytes);
 uint8_t *dictGetHashFunctionSeed();
 
 /* Hash table types */
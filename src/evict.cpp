@@ -33,6 +33,7 @@
 #include "server.h"
 #include "bio.h"
 #include "atomicvar.h"
+#include "tier.h"
 
 /* ----------------------------------------------------------------------------
  * Data structures
@@ -159,32 +160,49 @@ void evictionPoolAlloc() {
  * idle time are on the left, and keys with the higher idle time on the
  * right. */
 
-void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, evictionPoolEntry *pool) {
+void evictionPoolPopulate(int dbid, dict *sampledict, evictionPoolEntry *pool) {
     int j, k, count;
     dictEntry *samples[server.maxmemory_samples];
+    robj *vals[server.maxmemory_samples];
 
     count = sampledict->dictGetSomeKeys(samples,server.maxmemory_samples);
+
+    /* Find the values of all the samples first, prefetching them, so that
+     * the cache misses on their headers, needed to estimate the idle time,
+     * overlap instead of being paid one after the other. The expires
+     * dictionary borrows the entries of the main one, so the samples have
+     * the values whatever dictionary we sample from. The TTL policy only
+     * needs the expire times, that are in the sampled entries. */
+    if (server.maxmemory_policy != MAXMEMORY_VOLATILE_TTL) {
+        for (j = 0; j < count; j++) {
+            vals[j] = (robj *)samples[j]->dictGetVal();
+            dictPrefetchAddr(vals[j]);
+        }
+    }
+
     for (j = 0; j < count; j++) {
         unsigned long long idle;
-        robj *o;
-        dictEntry *de;
-
-        de = samples[j];
+        robj *o = server.maxmemory_policy != MAXMEMORY_VOLATILE_TTL ?
+                  vals[j] : NULL;
+        dictEntry *de = samples[j];
         sds key = (sds)de->dictGetKey();
 
-        /* If the dictionary we are sampling from is not the main
-         * dictionary (but the expires one) we need to lookup the key
-         * again in the key dictionary to obtain the value object. */
-        if (server.maxmemory_policy != MAXMEMORY_VOLATILE_TTL) {
-            if (sampledict != keydict) de = keydict->dictFind(key);
-            o = (robj *)de->dictGetVal();
-        }
-
         /* Calculate the idle time according to the policy. This is called
          * idle just because the code initially handled LRU, but is in fact
          * just a score where an higher score means better candidate. */
         if (server.maxmemory_policy & MAXMEMORY_FLAG_LRU) {
             idle = estimateObjectIdleTime(o);
+        } else if (server.maxmemory_policy & MAXMEMORY_FLAG_SIZE) {
+            /* Greedy Dual Size Frequency: what a key is worth keeping is
+             * its frequency of access per byte, so we evict first the keys
+             * with the larger size per access, where the size is the
+             * estimated memory used by the key and its value, and the
+             * accesses are estimated from the decaying LFU counter, whose
+             * decay takes the place of the GDSF aging. */
+            size_t size = sdsAllocSize(key)+
+                          objectComputeSize(o,OBJ_COMPUTE_SIZE_DEF_SAMPLES);
+            idle = (unsigned long long)
+                ((double)size*(1<<20)/LFUEstimateAccesses(LFUDecrAndReturn(o)));
         } else if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
             /* When we use an LRU policy, we sort the keys by idle time
              * so that we expire keys starting from greater idle time.
@@ -196,7 +214,7 @@ void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, evictionPoo
             idle = 255-LFUDecrAndReturn(o);
         } else if (server.maxmemory_policy == MAXMEMORY_VOLATILE_TTL) {
             /* In this case the sooner the expire the better. */
-            idle = ULLONG_MAX - (long)de->dictGetVal();
+            idle = ULLONG_MAX - dbGetEntryExpire(server.db+dbid,de);
         } else {
             serverPanic("Unknown eviction policy in evictionPoolPopulate()");
         }
@@ -331,6 +349,15 @@ uint8_t LFULogIncr(uint8_t counter) {
  * This function is used in order to scan the dataset for the best object
  * to fit: as we check for the candidate, we incrementally decrement the
  * counter of the scanned objects if needed. */
+/* Estimate the number of accesses that brought the logarithmic counter to
+ * the value 'counter' from LFU_INIT_VAL, inverting LFULogIncr(): the i-th
+ * increment over LFU_INIT_VAL takes on average i*lfu_log_factor+1 accesses.
+ * The result is at least 1. */
+double LFUEstimateAccesses(unsigned long counter) {
+    double n = counter > LFU_INIT_VAL ? counter-LFU_INIT_VAL : 0;
+    return server.lfu_log_factor*n*(n-1)/2 + n + 1;
+}
+
 unsigned long LFUDecrAndReturn(robj *o) {
     unsigned long ldt = o->lru >> 8;
     unsigned long counter = o->lru & 255;
@@ -347,7 +374,8 @@ unsigned long LFUDecrAndReturn(robj *o) {
 
 /* We don't want to count AOF buffers and slaves output buffers as
  * used memory: the eviction should use mostly data size. This function
- * returns the sum of AOF and slaves buffer. */
+ * returns the sum of AOF and slaves buffer, the replication stream shared
+ * by the slaves being counted once. */
 size_t freeMemoryGetNotCountedMemory() {
     size_t overhead = 0;
     int slaves = server.slaves->listLength();
@@ -358,8 +386,10 @@ size_t freeMemoryGetNotCountedMemory() {
         listIter li(server.slaves);
         while((ln = li.listNext())) {
             client *slave = (client *)ln->listNodeValue();
-            overhead += slave->getClientOutputBufferMemoryUsage();
+            overhead += slave->getClientOwnOutputBufferMemoryUsage();
         }
+        overhead += server.repl_buffer->replBufferMemory()+
+                    server.repl_compress_buffer->replBufferMemory();
     }
     if (server.aof_state != AOF_OFF) {
         overhead += sdslen(server.aof_buf)+aofRewriteBufferSize();
@@ -367,21 +397,27 @@ size_t freeMemoryGetNotCountedMemory() {
     return overhead;
 }
 
-int freeMemoryIfNeeded() {
+/* Evict keys until the used memory is not greater than 'limit'. Values are
+ * released in the lazyfree thread if 'lazy' is true. If 'budget_us' is not
+ * zero, the function returns C_ERR after that many microseconds even if the
+ * limit was not reached, and never waits for the lazyfree thread. */
+static int freeMemoryUntil(size_t limit, long long budget_us, int lazy) {
     size_t mem_reported, mem_used, mem_tofree, mem_freed;
     mstime_t latency, eviction_latency;
-    long long delta;
+    long long delta, start = budget_us ? ustime() : 0;
     int slaves = server.slaves->listLength();
 
     /* When clients are paused the dataset should be static not just from the
      * POV of clients not being able to write, but also from the POV of
-     * expires and evictions of keys not being performed. */
-    if (clientsArePaused()) return C_OK;
+     * expires and evictions of keys not being performed. The same while
+     * a slave loads a new dataset aside the old one, see repl-async-load:
+     * evicting the keys about to be discarded would not help. */
+    if (clientsArePaused() || server.async_loading) return C_OK;
 
     /* Check if we are over the memory usage limit. If we are not, no need
      * to subtract the slaves output buffers. We can just return ASAP. */
     mem_reported = zmalloc_used_memory();
-    if (mem_reported <= server.maxmemory) return C_OK;
+    if (mem_reported <= limit) return C_OK;
 
     /* Remove the size of slaves output buffers and AOF buffer from the
      * count of used memory. */
@@ -390,10 +426,10 @@ int freeMemoryIfNeeded() {
     mem_used = (mem_used > overhead) ? mem_used-overhead : 0;
 
     /* Check if we are still over the memory limit. */
-    if (mem_used <= server.maxmemory) return C_OK;
+    if (mem_used <= limit) return C_OK;
 
     /* Compute how much memory we need to free. */
-    mem_tofree = mem_used - server.maxmemory;
+    mem_tofree = mem_used - limit;
     mem_freed = 0;
 
     if (server.maxmemory_policy == MAXMEMORY_NO_EVICTION)
@@ -402,7 +438,7 @@ int freeMemoryIfNeeded() {
     latencyStartMonitor(latency);
     while (mem_freed < mem_tofree) {
         int j, k, i, keys_freed = 0;
-        static int next_db = 0;
+        static int next_db = 0, next_pool_db = 0;
         sds bestkey = NULL;
         int bestdbid;
         redisDb *db;
@@ -418,14 +454,19 @@ int freeMemoryIfNeeded() {
                 unsigned long total_keys = 0, keys;
 
                 /* We don't want to make local-db choices when expiring keys,
-                 * so to start populate the eviction pool sampling keys from
-                 * every DB. */
+                 * however the pool keeps the best candidates of every DB
+                 * across rounds and calls: so every round samples just the
+                 * next DB having keys, in turn, instead of all of them. */
                 for (i = 0; i < server.dbnum; i++) {
-                    db = server.db+i;
+                    j = (next_pool_db+i) % server.dbnum;
+                    db = server.db+j;
                     _dict = (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) ?
                             db->m_dict : db->m_expires;
                     if ((keys = _dict->dictSize()) != 0) {
-                        evictionPoolPopulate(i, _dict, db->m_dict, pool);
+                        if (total_keys == 0) {
+                            evictionPoolPopulate(j, _dict, pool);
+                            next_pool_db = j+1;
+                        }
                         total_keys += keys;
                     }
                 }
@@ -484,8 +525,25 @@ int freeMemoryIfNeeded() {
         /* Finally remove the selected key. */
         if (bestkey) {
             db = server.db+bestdbid;
+
+            /* With tiering the value is moved to the tiering file and the
+             * key stays, so there is nothing to propagate. */
+            delta = (long long) zmalloc_used_memory();
+            if (tierStoreValue(db,bestkey)) {
+                mem_freed += delta - (long long) zmalloc_used_memory();
+                keys_freed++;
+                if (budget_us && mem_freed < mem_tofree &&
+                    ustime()-start >= budget_us)
+                {
+                    latencyEndMonitor(latency);
+                    latencyAddSampleIfNeeded("eviction-cycle",latency);
+                    return C_ERR;
+                }
+                continue;
+            }
+
             robj *keyobj = createStringObject(bestkey,sdslen(bestkey));
-            propagateExpire(db,keyobj,server.lazyfree_lazy_eviction);
+            propagateExpire(db,keyobj,lazy);
             /* We compute the amount of memory freed by db*Delete() alone.
              * It is possible that actually the memory needed to propagate
              * the DEL in AOF and replication link is greater than the one
@@ -496,7 +554,7 @@ int freeMemoryIfNeeded() {
              * we only care about memory used by the key space. */
             delta = (long long) zmalloc_used_memory();
             latencyStartMonitor(eviction_latency);
-            if (server.lazyfree_lazy_eviction)
+            if (lazy)
                 dbAsyncDelete(db,keyobj);
             else
                 dbSyncDelete(db,keyobj);
@@ -506,6 +564,7 @@ int freeMemoryIfNeeded() {
             delta -= (long long) zmalloc_used_memory();
             mem_freed += delta;
             server.stat_evictedkeys++;
+            if (budget_us) server.stat_evictedkeys_ahead++;
             notifyKeyspaceEvent(NOTIFY_EVICTED, "evicted",
                 keyobj, db->m_id);
             decrRefCount(keyobj);
@@ -524,14 +583,24 @@ int freeMemoryIfNeeded() {
              * memory, since the "mem_freed" amount is computed only
              * across the dbAsyncDelete() call, while the thread can
              * release the memory all the time. */
-            if (server.lazyfree_lazy_eviction && !(keys_freed % 16)) {
+            if (lazy && !(keys_freed % 16)) {
                 overhead = freeMemoryGetNotCountedMemory();
                 mem_used = zmalloc_used_memory();
                 mem_used = (mem_used > overhead) ? mem_used-overhead : 0;
-                if (mem_used <= server.maxmemory) {
+                if (mem_used <= limit) {
                     mem_freed = mem_tofree;
                 }
             }
+
+            /* Out of time? The eviction ahead of time goes on at the next
+             * event loop iteration. */
+            if (budget_us && !(keys_freed % 16) &&
+                mem_freed < mem_tofree && ustime()-start >= budget_us)
+            {
+                latencyEndMonitor(latency);
+                latencyAddSampleIfNeeded("eviction-cycle",latency);
+                return C_ERR;
+            }
         }
 
         if (!keys_freed) {
@@ -547,7 +616,9 @@ int freeMemoryIfNeeded() {
 cant_free:
     /* We are here if we are not able to reclaim memory. There is only one
      * last thing we can try: check if the lazyfree thread has jobs in queue
-     * and wait... */
+     * and wait... but not for the eviction ahead of time, that can just
+     * try again later. */
+    if (budget_us) return C_ERR;
     while(bioPendingJobsOfType(BIO_LAZY_FREE)) {
         if (((mem_reported - zmalloc_used_memory()) + mem_freed) >= mem_tofree)
             break;
@@ -556,3 +627,23 @@ cant_free:
     return C_ERR;
 }
 
+
+/* Evict keys if the used memory is over maxmemory, before a command that
+ * may use more memory is executed. */
+int freeMemoryIfNeeded() {
+    return freeMemoryUntil(server.maxmemory,0,server.lazyfree_lazy_eviction);
+}
+
+/* Evict keys ahead of time, keeping the used memory maxmemory-headroom
+ * percent below maxmemory, so that the writes only have to evict keys in
+ * freeMemoryIfNeeded() when the headroom is exhausted. Called at every event
+ * loop iteration: it spends at most maxmemory-headroom-budget-us there, and
+ * releases the values in the lazyfree thread. */
+void freeMemoryAheadOfTime(void) {
+    size_t limit;
+
+    if (!server.maxmemory || !server.maxmemory_headroom || server.loading ||
+        server.maxmemory_policy == MAXMEMORY_NO_EVICTION) return;
+    limit = server.maxmemory - server.maxmemory/100*server.maxmemory_headroom;
+    freeMemoryUntil(limit,server.maxmemory_headroom_budget_us,1);
+}
@@ -52,16 +52,13 @@
  * The parameter 'now' is the current time in milliseconds as is passed
  * to the function to avoid too many gettimeofday() syscalls. */
 int activeExpireCycleTryExpire(redisDb *db, dictEntry *de, long long now) {
-    long long t = de->dictGetSignedIntegerVal();
+    long long t = dbGetEntryExpire(db,de);
     if (now > t) {
         sds key = (sds)de->dictGetKey();
         robj *keyobj = createStringObject(key,sdslen(key));
 
         propagateExpire(db,keyobj,server.lazyfree_lazy_expire);
-        if (server.lazyfree_lazy_expire)
-            dbAsyncDelete(db,keyobj);
-        else
-            dbSyncDelete(db,keyobj);
+        dbGenericDelete(db,keyobj,server.lazyfree_lazy_expire);
         notifyKeyspaceEvent(NOTIFY_EXPIRED,
             "expired",keyobj,db->m_id);
         decrRefCount(keyobj);
@@ -72,6 +69,151 @@ int activeExpireCycleTryExpire(redisDb *db, dictEntry *de, long long now) {
     }
 }
 
+/* When active-expire-index is enabled the keys with an expire are also
+ * indexed in order of time by db->m_expires_index: a radix tree of the keys
+ * prefixed by their expire time, big endian, so that the active expire cycle
+ * pops exactly the keys that reached their TTL from the head of the tree,
+ * instead of sampling db->m_expires at random. The cost is a copy of every
+ * volatile key in the tree, where the keys expiring in the same millisecond
+ * share the prefix. */
+#define EXPIRE_INDEX_TIME_LEN 8
+
+/* Add or remove the index entry of 'key' expiring at 'when'. */
+static void expireIndexUpdate(redisDb *db, sds key, long long when, int add) {
+    unsigned char buf[256], *ele = buf;
+    size_t len = EXPIRE_INDEX_TIME_LEN+sdslen(key);
+    uint64_t t = (uint64_t)when ^ (1ULL<<63); /* Negative times first. */
+
+    if (len > sizeof(buf)) ele = (unsigned char *)zmalloc(len);
+    for (int j = 0; j < EXPIRE_INDEX_TIME_LEN; j++)
+        ele[j] = (unsigned char)(t >> (56-j*8));
+    memcpy(ele+EXPIRE_INDEX_TIME_LEN,key,sdslen(key));
+    if (add)
+        raxInsert(db->m_expires_index,ele,len,NULL,NULL);
+    else
+        raxRemove(db->m_expires_index,ele,len,NULL);
+    if (ele != buf) zfree(ele);
+}
+
+void expireIndexAdd(redisDb *db, sds key, long long when) {
+    expireIndexUpdate(db,key,when,1);
+}
+
+void expireIndexDel(redisDb *db, sds key, long long when) {
+    expireIndexUpdate(db,key,when,0);
+}
+
+/* Create or release the index of every DB according to active-expire-index.
+ * Called at startup and by CONFIG SET: enabling it indexes all the keys
+ * with an expire, which takes a time proportional to their number. */
+void expireIndexInit(void) {
+    for (int j = 0; j < server.dbnum; j++) {
+        redisDb *db = server.db+j;
+
+        if (server.active_expire_index && db->m_expires_index == NULL) {
+            dictIterator di(db->m_expires, 0);
+            dictEntry *de;
+
+            db->m_expires_index = raxNew();
+            while ((de = di.dictNext()) != NULL)
+                expireIndexAdd(db,(sds)de->dictGetKey(),
+                               dbGetEntryExpire(db,de));
+        } else if (!server.active_expire_index && db->m_expires_index) {
+            raxFree(db->m_expires_index);
+            db->m_expires_index = NULL;
+        }
+    }
+}
+
+/* Expire, in order of time, up to 'max' keys of the index that reached
+ * their TTL. Returns the number of keys expired, so that the caller can
+ * stop when it is less than 'max'. */
+unsigned long expireIndexCycle(redisDb *db, long long now, unsigned long max) {
+    unsigned long expired = 0;
+    raxIterator ri;
+
+    raxStart(&ri,db->m_expires_index);
+    while (expired < max) {
+        uint64_t t = 0;
+
+        /* Expiring a key removes it from the tree: seek the head again. */
+        raxSeek(&ri,"^",NULL,0);
+        if (!raxNext(&ri)) break;
+        for (int j = 0; j < EXPIRE_INDEX_TIME_LEN; j++) t = (t<<8)|ri.key[j];
+        if (now <= (long long)(t ^ (1ULL<<63))) break;
+
+        sds key = sdsnewlen(ri.key+EXPIRE_INDEX_TIME_LEN,
+                            ri.key_len-EXPIRE_INDEX_TIME_LEN);
+        dictEntry *de = db->m_expires->dictFind(key);
+        serverAssert(de != NULL);
+        int removed = activeExpireCycleTryExpire(db,de,now);
+        serverAssert(removed);
+        sdsfree(key);
+        expired++;
+    }
+    raxStop(&ri);
+    return expired;
+}
+
+/* Adaptive effort of the slow expire cycle. The CPU percentage it may use
+ * moves between active-expire-cycle-min and active-expire-cycle-max
+ * following the demand, that is the highest of:
+ *
+ * 1) The stale keys ratio: the running average of the part of the sampled
+ *    keys found expired, or with the expire index, of the part of the time
+ *    budget that was needed. It is reduced as the event loop lag grows,
+ *    that is, as serverCron() runs later than 1000/hz milliseconds after
+ *    the previous call, since then clients are waiting for us.
+ * 2) The memory pressure: how close the used memory is to maxmemory, where
+ *    reclaiming expired keys avoids evicting live ones.
+ *
+ * The effort goes up at once, but slowly down, so that a burst of expired
+ * keys is reclaimed quickly without oscillations. */
+#define EXPIRE_EFFORT_STALE_LOW 1.0     /* Stale keys % with no demand. */
+#define EXPIRE_EFFORT_STALE_HIGH 25.0   /* Stale keys % with full demand. */
+#define EXPIRE_EFFORT_MEM_LOW 0.75      /* maxmemory part with no demand. */
+#define EXPIRE_EFFORT_MEM_HIGH 0.95     /* maxmemory part with full demand. */
+
+static double expireEffortDemand(double x, double low, double high) {
+    if (x <= low) return 0;
+    if (x >= high) return 1;
+    return (x-low)/(high-low);
+}
+
+static void activeExpireUpdateEffort(void) {
+    static long long last_call = 0;
+    long long now = mstime(), period = 1000/server.hz;
+    double demand, target;
+
+    if (period <= 0) period = 1;
+    if (last_call) {
+        long long lag = now-last_call-period;
+        if (lag < 0) lag = 0;
+        server.stat_expire_loop_lag = (server.stat_expire_loop_lag*3+lag)/4;
+    }
+    last_call = now;
+
+    demand = expireEffortDemand(server.stat_expired_stale_perc,
+                                EXPIRE_EFFORT_STALE_LOW,
+                                EXPIRE_EFFORT_STALE_HIGH);
+    demand *= 1-expireEffortDemand(server.stat_expire_loop_lag,0,period);
+    if (server.maxmemory) {
+        size_t used = zmalloc_used_memory()-freeMemoryGetNotCountedMemory();
+        double mem = expireEffortDemand((double)used/server.maxmemory,
+                                        EXPIRE_EFFORT_MEM_LOW,
+                                        EXPIRE_EFFORT_MEM_HIGH);
+        if (mem > demand) demand = mem;
+    }
+
+    target = server.active_expire_cycle_min +
+             (server.active_expire_cycle_max-server.active_expire_cycle_min)*
+             demand;
+    if (target > server.active_expire_effort)
+        server.active_expire_effort = target;
+    else
+        server.active_expire_effort = (server.active_expire_effort*3+target)/4;
+}
+
 /* Try to expire a few timed out keys. The algorithm used is adaptive and
  * will use few CPU cycles if there are few expiring keys, otherwise
  * it will get more aggressive to avoid that too much memory is used by
@@ -92,7 +234,7 @@ int activeExpireCycleTryExpire(redisDb *db, dictEntry *de, long long now) {
  *
  * If type is ACTIVE_EXPIRE_CYCLE_SLOW, that normal expire cycle is
  * executed, where the time limit is a percentage of the REDIS_HZ period
- * as specified by the ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC define. */
+ * as computed by activeExpireUpdateEffort(). */
 
 void activeExpireCycle(int type) {
     /* This function has some global state in order to continue the work
@@ -104,6 +246,8 @@ void activeExpireCycle(int type) {
     int j, iteration = 0;
     int dbs_per_call = CRON_DBS_PER_CALL;
     long long start = ustime(), timelimit, elapsed;
+    long long sampled = 0, sampled_expired = 0;
+    int indexed = 0;
 
     /* When clients are paused the dataset should be static not just from the
      * POV of clients not being able to write, but also from the POV of
@@ -129,11 +273,12 @@ void activeExpireCycle(int type) {
     if (dbs_per_call > server.dbnum || timelimit_exit)
         dbs_per_call = server.dbnum;
 
-    /* We can use at max ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC percentage of CPU time
+    /* We can use at max server.active_expire_effort percentage of CPU time
      * per iteration. Since this function gets called with a frequency of
      * server.hz times per second, the following is the max amount of
      * microseconds we can spend in this function. */
-    timelimit = 1000000*ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC/server.hz/100;
+    if (type == ACTIVE_EXPIRE_CYCLE_SLOW) activeExpireUpdateEffort();
+    timelimit = (long long)(10000*server.active_expire_effort/server.hz);
     timelimit_exit = 0;
     if (timelimit <= 0) timelimit = 1;
 
@@ -149,6 +294,37 @@ void activeExpireCycle(int type) {
          * distribute the time evenly across DBs. */
         current_db++;
 
+        /* Reclaim the hash fields that reached their TTL first. They are
+         * found in order of time by the index of the hashes, so we go on
+         * as long as full batches of fields get expired. */
+        while (hashExpireIndexCycle(db,mstime(),
+                   ACTIVE_EXPIRE_CYCLE_FIELDS_PER_LOOP) ==
+               ACTIVE_EXPIRE_CYCLE_FIELDS_PER_LOOP)
+        {
+            if (ustime()-start > timelimit) {
+                timelimit_exit = 1;
+                break;
+            }
+        }
+        if (timelimit_exit) break;
+
+        /* With the index the keys that reached their TTL are found in order
+         * of time, so there is nothing to sample: go on as long as full
+         * batches of keys get expired. */
+        if (db->m_expires_index) {
+            indexed = 1;
+            while (expireIndexCycle(db,mstime(),
+                       ACTIVE_EXPIRE_CYCLE_INDEXED_PER_LOOP) ==
+                   ACTIVE_EXPIRE_CYCLE_INDEXED_PER_LOOP)
+            {
+                if (ustime()-start > timelimit) {
+                    timelimit_exit = 1;
+                    break;
+                }
+            }
+            continue;
+        }
+
         /* Continue to expire if at the end of the cycle more than 25%
          * of the keys were expired. */
         do {
@@ -185,7 +361,8 @@ void activeExpireCycle(int type) {
                 long long ttl;
 
                 if ((de = db->m_expires->dictGetRandomKey()) == NULL) break;
-                ttl = de->dictGetSignedIntegerVal()-now;
+                ttl = dbGetEntryExpire(db,de)-now;
+                sampled++;
                 if (activeExpireCycleTryExpire(db,de,now)) expired++;
                 if (ttl > 0) {
                     /* We want the average TTL of keys yet not expired. */
@@ -194,6 +371,8 @@ void activeExpireCycle(int type) {
                 }
             }
 
+            sampled_expired += expired;
+
             /* Update the average TTL stats for this database. */
             if (ttl_samples) {
                 long long avg_ttl = ttl_sum/ttl_samples;
@@ -222,6 +401,20 @@ void activeExpireCycle(int type) {
 
     elapsed = ustime()-start;
     latencyAddSampleIfNeeded("expire-cycle",elapsed/1000);
+    if (timelimit_exit) server.stat_expire_cycle_time_cap_reached++;
+
+    /* Update the stale keys ratio for activeExpireUpdateEffort(). With the
+     * expire index there are no misses to count, so the part of the time
+     * budget used tells how much stale keys there were instead. */
+    if (type == ACTIVE_EXPIRE_CYCLE_SLOW) {
+        double current = 0;
+
+        if (indexed) current = (double)elapsed*100/timelimit;
+        else if (sampled) current = (double)sampled_expired*100/sampled;
+        if (current > 100) current = 100;
+        server.stat_expired_stale_perc =
+            current*0.05 + server.stat_expired_stale_perc*0.95;
+    }
 }
 
 /*-----------------------------------------------------------------------------
@@ -408,8 +601,8 @@ void expireGenericCommand(client *c, long long basetime, int unit) {
     if (when <= mstime() && !server.loading && !server.masterhost) {
         robj *aux;
 
-        int deleted = server.lazyfree_lazy_expire ? dbAsyncDelete(c->m_cur_selected_db,key) :
-                                                    dbSyncDelete(c->m_cur_selected_db,key);
+        int deleted = dbGenericDelete(c->m_cur_selected_db,key,
+                                      server.lazyfree_lazy_expire);
         serverAssertWithInfo(c,key,deleted);
         server.dirty++;
 
@@ -64,7 +64,6 @@ geoArray::~geoArray()
 {
     for (size_t i = 0; i < m_used; i++)
         m_array[i].~geoPoint();
-    zfree(m_array);
 }
 
 /* Create a new array of geoPoints. */
@@ -78,8 +77,10 @@ geoArray *geoArrayCreate() {
  * it with data. */
 geoPoint& geoArray::geoArrayAppend() {
     if (m_used == m_buckets) {
+        size_t oldsize = sizeof(geoPoint)*m_buckets;
         m_buckets = (m_buckets == 0) ? 8 : m_buckets*2;
-        m_array = (geoPoint *)zrealloc(m_array,sizeof(geoPoint)*m_buckets);
+        m_array = (geoPoint *)zarena_realloc(m_array,oldsize,
+                                             sizeof(geoPoint)*m_buckets);
     }
     m_used++;
     return m_array[m_used-1];
@@ -195,53 +196,50 @@ void addReplyDoubleDistance(client *c, double d) {
 }
 
 /* Helper function for geoGetPointsInRange(): given a sorted set score
- * representing a point, and another point (the center of our search) and
- * a radius, appends this entry as a geoPoint into the specified geoArray
- * only if the point is within the search area.
+ * representing a point and the filter of the search, appends this entry as
+ * a geoPoint into the specified geoArray only if the point is within the
+ * search area.
  *
- * returns C_OK if the point is included, or REIDS_ERR if it is outside. */
-int geoArray::geoAppendIfWithinRadius(double lon, double lat, double radius, double score, sds member) {
+ * Returns the new point, or NULL if it is outside. The caller sets the
+ * member of the point, so that no member is copied for the points that
+ * are filtered out. */
+geoPoint *geoArray::geoAppendIfWithinRadius(const GeoHashRadiusFilter *f, double score) {
     double distance, xy[2];
 
-    if (!decodeGeohash(score,xy)) return C_ERR; /* Can't decode. */
-    /* Note that geohashGetDistanceIfInRadiusWGS84() takes arguments in
-     * reverse order: longitude first, latitude later. */
-    if (!geohashGetDistanceIfInRadiusWGS84(lon,lat, xy[0], xy[1],
-                                           radius, &distance))
-    {
-        return C_ERR;
-    }
+    if (!decodeGeohash(score,xy)) return NULL; /* Can't decode. */
+    if (!geohashGetDistanceIfInRadiusFilter(f, xy[0], xy[1], &distance))
+        return NULL;
 
     /* Append the new element. */
     geoPoint& gp = geoArrayAppend();
     gp.m_longitude = xy[0];
     gp.m_latitude = xy[1];
     gp.m_dist = distance;
-    gp.m_member = member;
+    gp.m_member = NULL;
     gp.m_score = score;
-    return C_OK;
+    return &gp;
 }
 
 /* Query a Redis sorted set to extract all the elements between 'min' and
  * 'max', appending them into the array of geoPoint structures 'gparray'.
  * The command returns the number of elements added to the array.
  *
- * Elements which are farest than 'radius' from the specified 'x' and 'y'
- * coordinates are not included.
+ * Elements which are farest than the radius of the filter 'f' from its
+ * center are not included.
  *
  * The ability of this function to append to an existing set of points is
  * important for good performances because querying by radius is performed
  * using multiple queries to the sorted set, that we later need to sort
  * via qsort. Similarly we need to be able to reject points outside the search
  * radius area ASAP in order to allocate and process more points than needed. */
-int geoArray::geoGetPointsInRange(robj *zobj, double min, double max, double lon, double lat, double radius) {
+int geoArray::geoGetPointsInRange(robj *zobj, double min, double max, const GeoHashRadiusFilter *f) {
     /* minex 0 = include min in range; maxex 1 = exclude max in range */
     /* That's: min <= val < max */
     zrangespec range = { .min = min, .max = max, .minex = 0, .maxex = 1 };
     size_t origincount = m_used;
-    sds member;
+    geoPoint *gp;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = (unsigned char *)zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr = NULL;
@@ -254,7 +252,7 @@ int geoArray::geoGetPointsInRange(robj *zobj, double min, double max, double lon
             return 0;
         }
 
-        sptr = ziplistNext(zl, eptr);
+        sptr = lpNext(zl, eptr);
         while (eptr) {
             score = zzlGetScore(sptr);
 
@@ -262,12 +260,13 @@ int geoArray::geoGetPointsInRange(robj *zobj, double min, double max, double lon
             if (!zslValueLteMax(score, &range))
                 break;
 
-            /* We know the element exists. ziplistGet should always succeed */
-            ziplistGet(eptr, &vstr, &vlen, &vlong);
-            member = (vstr == NULL) ? sdsfromlonglong(vlong) :
-                                      sdsnewlen(vstr,vlen);
-            if (geoAppendIfWithinRadius(lon,lat,radius,score,member)
-                == C_ERR) sdsfree(member);
+            if ((gp = geoAppendIfWithinRadius(f,score)) != NULL) {
+                /* We know the element exists. lpGetValue should always
+                 * succeed */
+                lpGetValue(eptr, &vstr, &vlen, &vlong);
+                gp->m_member = (vstr == NULL) ? sdsfromlonglong(vlong) :
+                                                sdsnewlen(vstr,vlen);
+            }
             zzlNext(zl, &eptr, &sptr);
         }
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
@@ -281,16 +280,30 @@ int geoArray::geoGetPointsInRange(robj *zobj, double min, double max, double lon
         }
 
         while (ln) {
-            sds ele = ln->ele;
             /* Abort when the node is no longer in range. */
             if (!zslValueLteMax(ln->score, &range))
                 break;
 
-            ele = sdsdup(ele);
-            if (geoAppendIfWithinRadius(lon,lat,radius,ln->score,ele)
-                == C_ERR) sdsfree(ele);
+            if ((gp = geoAppendIfWithinRadius(f,ln->score)) != NULL)
+                gp->m_member = sdsdup(ln->ele);
             ln = ln->level[0].forward;
         }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zbtree *zbt = ((zset *)zobj->ptr)->zbt;
+        zbtCursor cur;
+        int valid = zbt->zbtFirstInRange(&range,&cur);
+
+        /* Same as the skiplist case, nothing in range means no results. */
+        while (valid) {
+            double score = zbtCursorScore(&cur);
+            /* Abort when the element is no longer in range. */
+            if (!zslValueLteMax(score, &range))
+                break;
+
+            if ((gp = geoAppendIfWithinRadius(f,score)) != NULL)
+                gp->m_member = sdsdup(zbtCursorEle(&cur));
+            valid = zbtNext(&cur);
+        }
     }
     return m_used - origincount;
 }
@@ -324,21 +337,152 @@ void scoresOfGeoHashBox(GeoHashBits hash, GeoHashFix52Bits *min, GeoHashFix52Bit
     *max = geohashAlign52Bits(hash);
 }
 
-/* Obtain all members between the min/max of this geohash bounding box.
- * Populate a geoArray of GeoPoints by calling geoGetPointsInRange().
- * Return the number of points added to the array. */
-int geoArray::membersOfGeoHashBox(robj *zobj, const GeoHashBits& hash, double lon, double lat, double radius) {
+/* A cell of the covering of the search area: the scores of its points, in
+ * the range min (inclusive), max (exclusive), and the distance from the
+ * center of the search of its nearest point. */
+struct geoCell {
     GeoHashFix52Bits min, max;
+    double dist;
+};
+
+/* Every one of the nine boxes returned by geohashGetAreasByRadius() is
+ * split in up to 4^GEO_COVER_REFINE_STEPS cells, and only the cells that
+ * intersect the search circle are queried. */
+#define GEO_COVER_REFINE_STEPS 2
+#define GEO_COVER_MAX_CELLS (9 << (2*GEO_COVER_REFINE_STEPS))
+#define GEO_COVER_MARGIN 1.0 /* Meters of slack of the cells distance. */
+/* Largest COUNT for which the nearest cells are searched first. */
+#define GEO_COUNT_NEAREST_MAX 4096
+
+/* Append to 'cells' the cells of the geohash box 'box' that may contain
+ * points in the radius of 'f', splitting it 'depth' more times. */
+static void geoCoverBox(geoCell *cells, int *numcells, GeoHashBits box,
+                        int depth, const GeoHashRadiusFilter *f)
+{
+    GeoHashRange long_range, lat_range;
+    GeoHashArea area;
+    double dist;
+
+    geohashGetCoordRange(&long_range,&lat_range);
+    geohashDecode(long_range,lat_range,box,&area);
+    dist = geohashGetAreaMinDistance(f->longitude,f->latitude,&area);
+    if (dist > f->radius + GEO_COVER_MARGIN) return;
+
+    if (depth == 0 || box.step >= GEO_STEP_MAX) {
+        geoCell *cell = cells + (*numcells)++;
+        scoresOfGeoHashBox(box,&cell->min,&cell->max);
+        cell->dist = dist;
+        return;
+    }
+    /* The four sub cells share the prefix of the box. */
+    for (uint64_t k = 0; k < 4; k++) {
+        GeoHashBits child = { .bits = (box.bits << 2) | k,
+                              .step = (uint8_t)(box.step + 1) };
+        geoCoverBox(cells,numcells,child,depth-1,f);
+    }
+}
+
+static int geoCellCompareMin(const void *a, const void *b) {
+    const geoCell *ca = (const geoCell *)a, *cb = (const geoCell *)b;
+    if (ca->min == cb->min) return 0;
+    return ca->min < cb->min ? -1 : 1;
+}
+
+static int geoCellCompareDist(const void *a, const void *b) {
+    const geoCell *ca = (const geoCell *)a, *cb = (const geoCell *)b;
+    if (ca->dist == cb->dist) return 0;
+    return ca->dist < cb->dist ? -1 : 1;
+}
+
+/* Sort the cells by score and merge the ones that overlap, that happens
+ * when a huge radius is used and adjacent neighbors are the same box. If
+ * 'adjacent' is true the contiguous cells are merged as well, so that they
+ * are fetched with a single range query. Returns the new number of cells. */
+static int geoMergeCells(geoCell *cells, int numcells, int adjacent) {
+    int i, j = 0;
+
+    if (numcells == 0) return 0;
+    qsort(cells,numcells,sizeof(geoCell),geoCellCompareMin);
+    for (i = 1; i < numcells; i++) {
+        if (cells[i].min < cells[j].max ||
+            (adjacent && cells[i].min == cells[j].max))
+        {
+            if (cells[i].max > cells[j].max) cells[j].max = cells[i].max;
+            if (cells[i].dist < cells[j].dist) cells[j].dist = cells[i].dist;
+        } else {
+            cells[++j] = cells[i];
+        }
+    }
+    return j+1;
+}
+
+/* Sift down the root of the max-heap 'heap' of 'len' distances. */
+static void geoDistHeapSiftDown(double *heap, long len) {
+    long i = 0;
+
+    while (1) {
+        long child = i*2+1;
+        if (child >= len) break;
+        if (child+1 < len && heap[child+1] > heap[child]) child++;
+        if (heap[i] >= heap[child]) break;
+        double tmp = heap[i];
+        heap[i] = heap[child];
+        heap[child] = tmp;
+        i = child;
+    }
+}
 
-    scoresOfGeoHashBox(hash,&min,&max);
-    return geoGetPointsInRange(zobj, min, max, lon, lat, radius);
+/* Add the points of 'cells' in the radius of 'f' when only the 'count'
+ * nearest are needed. The cells are visited nearest first, and as soon as
+ * 'count' points were found the radius shrinks to the distance of the
+ * farthest of them, so that the cells farther than that are never queried.
+ * 'best' is a max-heap of the distances of the nearest points so far.
+ * Return the number of points added to the array. */
+int geoArray::membersOfNearestCells(robj *zobj, geoCell *cells, int numcells, GeoHashRadiusFilter *f, long count) {
+    double *best = (double *)zmalloc(sizeof(double)*count);
+    long numbest = 0;
+    int i, added = 0;
+
+    qsort(cells,numcells,sizeof(geoCell),geoCellCompareDist);
+    for (i = 0; i < numcells; i++) {
+        if (numbest == count && cells[i].dist > f->radius + GEO_COVER_MARGIN)
+            break;
+
+        size_t first = m_used;
+        added += geoGetPointsInRange(zobj,cells[i].min,cells[i].max,f);
+        for (size_t j = first; j < m_used; j++) {
+            double d = m_array[j].m_dist;
+            if (numbest < count) {
+                /* Sift up the new distance. */
+                long k = numbest++;
+                while (k > 0 && best[(k-1)/2] < d) {
+                    best[k] = best[(k-1)/2];
+                    k = (k-1)/2;
+                }
+                best[k] = d;
+            } else if (d < best[0]) {
+                best[0] = d;
+                geoDistHeapSiftDown(best,numbest);
+            }
+        }
+        if (numbest == count && best[0] < f->radius)
+            geohashInitRadiusFilter(f,f->longitude,f->latitude,best[0]);
+    }
+    zfree(best);
+    return added;
 }
 
-/* Search all eight neighbors + self geohash box */
-int geoArray::membersOfAllNeighbors(robj *zobj, const GeoHashRadius& n, double lon, double lat, double radius) {
+/* Search the points in the radius inside the eight neighbors + self geohash
+ * box. Only the parts of the boxes that intersect the search circle are
+ * queried, merged in as few ranges of scores as possible. When 'count' is
+ * non zero only the 'count' nearest points are needed: the array may have
+ * more points than that, but not necessarily every point in the radius.
+ * Return the number of points added to the array. */
+int geoArray::membersOfRadius(robj *zobj, const GeoHashRadius& n, double lon, double lat, double radius, long count) {
     GeoHashBits neighbors[9];
-    unsigned int i, count = 0, last_processed = 0;
-    int debugmsg = 0;
+    geoCell cells[GEO_COVER_MAX_CELLS];
+    GeoHashRadiusFilter f;
+    int i, numcells = 0, added = 0;
 
     neighbors[0] = n.hash;
     neighbors[1] = n.neighbors.north;
@@ -350,46 +494,21 @@ int geoArray::membersOfAllNeighbors(robj *zobj, const GeoHashRadius& n, double l
     neighbors[7] = n.neighbors.south_east;
     neighbors[8] = n.neighbors.south_west;
 
-    /* For each neighbor (*and* our own hashbox), get all the matching
-     * members and add them to the potential result list. */
-    for (i = 0; i < sizeof(neighbors) / sizeof(*neighbors); i++) {
-        if (HASHISZERO(neighbors[i])) {
-            if (debugmsg) D("neighbors[%d] is zero",i);
-            continue;
-        }
-
-        /* Debugging info. */
-        if (debugmsg) {
-            GeoHashRange long_range, lat_range;
-            geohashGetCoordRange(&long_range,&lat_range);
-            GeoHashArea myarea = {{0}};
-            geohashDecode(long_range, lat_range, neighbors[i], &myarea);
-
-            /* Dump center square. */
-            D("neighbors[%d]:\n",i);
-            D("area.longitude.min: %f\n", myarea.longitude.min);
-            D("area.longitude.max: %f\n", myarea.longitude.max);
-            D("area.latitude.min: %f\n", myarea.latitude.min);
-            D("area.latitude.max: %f\n", myarea.latitude.max);
-            D("\n");
-        }
+    geohashInitRadiusFilter(&f,lon,lat,radius);
+    for (i = 0; i < 9; i++) {
+        if (HASHISZERO(neighbors[i])) continue;
+        geoCoverBox(cells,&numcells,neighbors[i],GEO_COVER_REFINE_STEPS,&f);
+    }
 
-        /* When a huge Radius (in the 5000 km range or more) is used,
-         * adjacent neighbors can be the same, leading to duplicated
-         * elements. Skip every range which is the same as the one
-         * processed previously. */
-        if (last_processed &&
-            neighbors[i].bits == neighbors[last_processed].bits &&
-            neighbors[i].step == neighbors[last_processed].step)
-        {
-            if (debugmsg)
-                D("Skipping processing of %d, same as previous\n",i);
-            continue;
-        }
-        count += membersOfGeoHashBox(zobj, neighbors[i], lon, lat, radius);
-        last_processed = i;
+    if (count > 0 && count <= GEO_COUNT_NEAREST_MAX) {
+        numcells = geoMergeCells(cells,numcells,0);
+        return membersOfNearestCells(zobj,cells,numcells,&f,count);
     }
-    return count;
+
+    numcells = geoMergeCells(cells,numcells,1);
+    for (i = 0; i < numcells; i++)
+        added += geoGetPointsInRange(zobj,cells[i].min,cells[i].max,&f);
+    return added;
 }
 
 /* Sort comparators for qsort() */
@@ -438,40 +557,62 @@ void geoaddCommand(client *c) {
     }
 
     int elements = (c->m_argc - 2) / 3;
-    int argc = 2+elements*2; /* ZADD key score ele ... */
-    robj **argv = (robj **)zcalloc(argc*sizeof(robj*));
-    argv[0] = createRawStringObject("zadd",4);
-    argv[1] = c->m_argv[1]; /* key */
-    incrRefCount(argv[1]);
-
-    /* Create the argument vector to call ZADD in order to add all
-     * the score,value pairs to the requested zset, where score is actually
-     * an encoded version of lat,long. */
-    int i;
-    for (i = 0; i < elements; i++) {
+    robj *key = c->m_argv[1];
+    robj *zobj;
+    int j, added = 0, updated = 0;
+
+    /* Turn the coordinates into the scores of the elements first, so that
+     * the command either adds all of them or none. A score is actually an
+     * encoded version of lat,long. */
+    double *scores = (double *)zmalloc(sizeof(double)*elements);
+    for (j = 0; j < elements; j++) {
         double xy[2];
 
-        if (extractLongLatOrReply(c, (c->m_argv+2)+(i*3),xy) == C_ERR) {
-            for (i = 0; i < argc; i++)
-                if (argv[i]) decrRefCount(argv[i]);
-            zfree(argv);
+        if (extractLongLatOrReply(c, (c->m_argv+2)+(j*3),xy) == C_ERR) {
+            zfree(scores);
             return;
         }
 
-        /* Turn the coordinates into the score of the element. */
         GeoHashBits hash;
         geohashEncodeWGS84(xy[0], xy[1], GEO_STEP_MAX, &hash);
-        GeoHashFix52Bits bits = geohashAlign52Bits(hash);
-        robj *score = createObject(OBJ_STRING, sdsfromlonglong(bits));
-        robj *val = c->m_argv[2 + i * 3 + 2];
-        argv[2+i*2] = score;
-        argv[3+i*2] = val;
-        incrRefCount(val);
+        scores[j] = (double)geohashAlign52Bits(hash);
     }
 
-    /* Finally call ZADD that will do the work for us. */
-    c->replaceClientCommandVector(argc,argv);
-    zaddCommand(c);
+    /* Add the elements to the zset directly, like ZADD would, without
+     * building its argument vector. A batch that doesn't fit in a listpack
+     * creates the skiplist at once instead of converting it. */
+    zobj = lookupKeyWrite(c->m_cur_selected_db,key);
+    if (zobj == NULL) {
+        if (server.zset_max_ziplist_entries < (size_t)elements ||
+            server.zset_max_ziplist_value <
+                sdslen((sds)c->m_argv[4]->ptr))
+        {
+            zobj = createZsetObject();
+        } else {
+            zobj = createZsetListpackObject();
+        }
+        dbAdd(c->m_cur_selected_db,key,zobj);
+    } else if (zobj->type != OBJ_ZSET) {
+        zfree(scores);
+        c->addReply(shared.wrongtypeerr);
+        return;
+    }
+
+    for (j = 0; j < elements; j++) {
+        int retflags = ZADD_NONE;
+        sds ele = (sds)c->m_argv[2+j*3+2]->ptr;
+
+        zsetAdd(zobj, scores[j], ele, &retflags, NULL);
+        if (retflags & ZADD_ADDED) added++;
+        if (retflags & ZADD_UPDATED) updated++;
+    }
+    zfree(scores);
+    server.dirty += added+updated;
+    c->addReplyLongLong(added);
+    if (added || updated) {
+        signalModifiedKey(c->m_cur_selected_db,key);
+        notifyKeyspaceEvent(NOTIFY_ZSET,"zadd",key,c->m_cur_selected_db->m_id);
+    }
 }
 
 #define RADIUS_COORDS (1<<0)    /* Search around coordinates. */
@@ -583,7 +724,8 @@ void georadiusGeneric(client *c, int flags) {
 
     /* Search the zset for all matching points */
     geoArray ga;
-    ga.membersOfAllNeighbors(zobj, georadius, xy[0], xy[1], radius_meters);
+    ga.membersOfRadius(zobj, georadius, xy[0], xy[1], radius_meters,
+                       sort == SORT_ASC ? count : 0);
 
     /* If no matching results, the user gets an empty reply. */
     if (ga.used() == 0 && storekey == NULL) {
@@ -668,7 +810,8 @@ void georadiusGeneric(client *c, int flags) {
         }
 
         if (returned_items) {
-            zsetConvertToZiplistIfNeeded(zobj,maxelelen);
+            zsetConvertToListpackIfNeeded(zobj,maxelelen);
+            zsetConvertToBtreeIfNeeded(zobj);
             setKey(c->m_cur_selected_db,storekey,zobj);
             decrRefCount(zobj);
             notifyKeyspaceEvent(NOTIFY_LIST,"georadiusstore",storekey,
@@ -5,6 +5,8 @@
 
 struct GeoHashBits;
 struct GeoHashRadius;
+struct GeoHashRadiusFilter;
+struct geoCell;
 
 /* Structures used inside geo.c in order to represent points and array of
  * points on the earth. */
@@ -31,7 +33,7 @@ public:
     geoArray();
     ~geoArray();
 
-    int membersOfAllNeighbors(robj *zobj, const GeoHashRadius& n, double lon, double lat, double radius);
+    int membersOfRadius(robj *zobj, const GeoHashRadius& n, double lon, double lat, double radius, long count);
 
     inline size_t used() const {return m_used;}
     inline geoPoint& operator[](const size_t index) {return *(m_array+index);}
@@ -40,9 +42,9 @@ public:
 
 private:
     geoPoint& geoArrayAppend();
-    int geoAppendIfWithinRadius(double lon, double lat, double radius, double score, sds member);
-    int geoGetPointsInRange(robj *zobj, double min, double max, double lon, double lat, double radius);
-    int membersOfGeoHashBox(robj *zobj, const GeoHashBits& hash, double lon, double lat, double radius);
+    geoPoint *geoAppendIfWithinRadius(const GeoHashRadiusFilter *f, double score);
+    int geoGetPointsInRange(robj *zobj, double min, double max, const GeoHashRadiusFilter *f);
+    int membersOfNearestCells(robj *zobj, geoCell *cells, int numcells, GeoHashRadiusFilter *f, long count);
 
     geoPoint *m_array;
     size_t m_buckets;
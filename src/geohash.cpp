@@ -49,7 +49,7 @@
  * x and y must initially be less than 2**32 (65536).
  * From:  https://graphics.stanford.edu/~seander/bithacks.html#InterleaveBMN
  */
-static inline uint64_t interleave64(uint32_t xlo, uint32_t ylo) {
+static inline uint64_t interleave64Scalar(uint32_t xlo, uint32_t ylo) {
     static const uint64_t B[] = {0x5555555555555555ULL, 0x3333333333333333ULL,
                                  0x0F0F0F0F0F0F0F0FULL, 0x00FF00FF00FF00FFULL,
                                  0x0000FFFF0000FFFFULL};
@@ -79,7 +79,7 @@ static inline uint64_t interleave64(uint32_t xlo, uint32_t ylo) {
 /* reverse the interleave process
  * derived from http://stackoverflow.com/questions/4909263
  */
-static inline uint64_t deinterleave64(uint64_t interleaved) {
+static inline uint64_t deinterleave64Scalar(uint64_t interleaved) {
     static const uint64_t B[] = {0x5555555555555555ULL, 0x3333333333333333ULL,
                                  0x0F0F0F0F0F0F0F0FULL, 0x00FF00FF00FF00FFULL,
                                  0x0000FFFF0000FFFFULL, 0x00000000FFFFFFFFULL};
@@ -109,6 +109,52 @@ static inline uint64_t deinterleave64(uint64_t interleaved) {
     return x | (y << 32);
 }
 
+/* With BMI2 the interleave is a single PDEP per coordinate, and the
+ * reverse a single PEXT, selected at runtime like the kernels of
+ * bitkernel.cpp. Zen 1 and Zen 2 execute PDEP and PEXT in microcode,
+ * slower than the magic numbers above, so they keep the scalar version. */
+#if defined(__x86_64__) && \
+    (defined(__clang__) ? (__clang_major__ >= 9) : (__GNUC__ >= 9))
+#define HAVE_GEOHASH_BMI2 1
+#include <immintrin.h>
+
+#define GEOHASH_EVEN_BITS 0x5555555555555555ULL
+#define GEOHASH_ODD_BITS 0xAAAAAAAAAAAAAAAAULL
+
+__attribute__((target("bmi2")))
+static uint64_t interleave64Bmi2(uint32_t xlo, uint32_t ylo) {
+    return _pdep_u64(xlo,GEOHASH_EVEN_BITS) | _pdep_u64(ylo,GEOHASH_ODD_BITS);
+}
+
+__attribute__((target("bmi2")))
+static uint64_t deinterleave64Bmi2(uint64_t interleaved) {
+    return _pext_u64(interleaved,GEOHASH_EVEN_BITS) |
+           (_pext_u64(interleaved,GEOHASH_ODD_BITS) << 32);
+}
+
+static int geohashHaveFastBmi2(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("bmi2") &&
+           !__builtin_cpu_is("znver1") && !__builtin_cpu_is("znver2");
+}
+#endif
+
+static inline uint64_t interleave64(uint32_t xlo, uint32_t ylo) {
+#ifdef HAVE_GEOHASH_BMI2
+    static int bmi2 = geohashHaveFastBmi2();
+    if (bmi2) return interleave64Bmi2(xlo,ylo);
+#endif
+    return interleave64Scalar(xlo,ylo);
+}
+
+static inline uint64_t deinterleave64(uint64_t interleaved) {
+#ifdef HAVE_GEOHASH_BMI2
+    static int bmi2 = geohashHaveFastBmi2();
+    if (bmi2) return deinterleave64Bmi2(interleaved);
+#endif
+    return deinterleave64Scalar(interleaved);
+}
+
 void geohashGetCoordRange(GeoHashRange *long_range, GeoHashRange *lat_range) {
     /* These are constraints from EPSG:900913 / EPSG:3785 / OSGEO:41001 */
     /* We can't geocode at the north/south pole. */
@@ -233,3 +233,91 @@ int geohashGetDistanceIfInRadiusWGS84(double x1, double y1, double x2,
                                       double *distance) {
     return geohashGetDistanceIfInRadius(x1, y1, x2, y2, radius, distance);
 }
+
+/* Prepare the filter of a radius search around 'longitude','latitude'. The
+ * bounds have a small margin so that the rounding errors never reject a
+ * point that geohashGetDistanceIfInRadius() would accept. */
+void geohashInitRadiusFilter(GeoHashRadiusFilter *f, double longitude,
+                             double latitude, double radius_meters) {
+    double half = radius_meters / EARTH_RADIUS_IN_METERS / 2;
+
+    f->longitude = longitude;
+    f->latitude = latitude;
+    f->radius = radius_meters;
+    f->lon_rad = deg_rad(longitude);
+    f->lat_rad = deg_rad(latitude);
+    f->cos_lat = cos(f->lat_rad);
+    /* The distance is never shorter than the one along the meridian. */
+    f->max_dlat = rad_deg(half * 2) * (1 + 1e-9) + 1e-9;
+    if (half < M_PI / 2) {
+        double s = sin(half);
+        f->max_hav = s * s * (1 + 1e-9) + 1e-18;
+    } else {
+        f->max_hav = 2; /* Every point of the globe is in the radius. */
+    }
+}
+
+/* Same as geohashGetDistanceIfInRadius() with the center of the filter as
+ * first point, and the same arithmetic, so that the distance is exactly
+ * the same, but most of the points outside of the radius are rejected by
+ * the cheap latitude check or before the asin() and sqrt(). */
+int geohashGetDistanceIfInRadiusFilter(const GeoHashRadiusFilter *f,
+                                       double x2, double y2,
+                                       double *distance) {
+    double lat2r, u, v, a;
+
+    if (fabs(y2 - f->latitude) > f->max_dlat) return 0;
+    lat2r = deg_rad(y2);
+    u = sin((lat2r - f->lat_rad) / 2);
+    v = sin((deg_rad(x2) - f->lon_rad) / 2);
+    a = u * u + f->cos_lat * cos(lat2r) * v * v;
+    if (a > f->max_hav) return 0;
+    *distance = 2.0 * EARTH_RADIUS_IN_METERS * asin(sqrt(a));
+    if (*distance > f->radius) return 0;
+    return 1;
+}
+
+/* Return the distance between the point and the nearest point of the
+ * meridian 'mlon' between the latitudes 'latmin' and 'latmax'. */
+static double geohashGetDistanceToMeridian(double lon, double lat, double mlon,
+                                           double latmin, double latmax) {
+    double best, d, dlon = deg_rad(mlon - lon);
+
+    best = geohashGetDistance(lon, lat, mlon, latmin);
+    d = geohashGetDistance(lon, lat, mlon, latmax);
+    if (d < best) best = d;
+    /* In the hemisphere of the point the distance from the meridian has a
+     * single minimum, where tan(lat') = tan(lat) / cos(dlon). */
+    if (cos(dlon) > 0) {
+        double latc = rad_deg(atan(tan(deg_rad(lat)) / cos(dlon)));
+        if (latc > latmin && latc < latmax) {
+            d = geohashGetDistance(lon, lat, mlon, latc);
+            if (d < best) best = d;
+        }
+    }
+    return best;
+}
+
+/* Return the distance between the point and the nearest point of 'area',
+ * zero if the point is inside it. Used in order to discard the cells of a
+ * radius search that can't contain any point in the radius. */
+double geohashGetAreaMinDistance(double longitude, double latitude,
+                                 const GeoHashArea *area) {
+    double d1, d2;
+
+    if (longitude >= area->longitude.min && longitude <= area->longitude.max) {
+        if (latitude < area->latitude.min)
+            return deg_rad(area->latitude.min - latitude) *
+                   EARTH_RADIUS_IN_METERS;
+        if (latitude > area->latitude.max)
+            return deg_rad(latitude - area->latitude.max) *
+                   EARTH_RADIUS_IN_METERS;
+        return 0;
+    }
+    /* Otherwise the nearest point is on one of the two meridian edges. */
+    d1 = geohashGetDistanceToMeridian(longitude, latitude, area->longitude.min,
+                                      area->latitude.min, area->latitude.max);
+    d2 = geohashGetDistanceToMeridian(longitude, latitude, area->longitude.max,
+                                      area->latitude.min, area->latitude.max);
+    return d1 < d2 ? d1 : d2;
+}
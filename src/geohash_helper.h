@@ -41,6 +41,17 @@
 typedef uint64_t GeoHashFix52Bits;
 typedef uint64_t GeoHashVarBits;
 
+/* The terms of a radius search that don't depend on the candidate point,
+ * computed once by geohashInitRadiusFilter(). Both 'max_dlat' (degrees) and
+ * 'max_hav' (haversine term) only reject points that are surely outside of
+ * the radius, without the need of the trigonometry of the full distance. */
+struct GeoHashRadiusFilter {
+    double longitude, latitude, radius;
+    double lon_rad, lat_rad, cos_lat;
+    double max_dlat;
+    double max_hav;
+};
+
 struct GeoHashRadius{
     GeoHashBits hash;
     GeoHashArea area;
@@ -66,5 +77,12 @@ int geohashGetDistanceIfInRadius(double x1, double y1,
 int geohashGetDistanceIfInRadiusWGS84(double x1, double y1, double x2,
                                       double y2, double radius,
                                       double *distance);
+void geohashInitRadiusFilter(GeoHashRadiusFilter *f, double longitude,
+                             double latitude, double radius_meters);
+int geohashGetDistanceIfInRadiusFilter(const GeoHashRadiusFilter *f,
+                                       double x2, double y2,
+                                       double *distance);
+double geohashGetAreaMinDistance(double longitude, double latitude,
+                                 const GeoHashArea *area);
 
 #endif /* GEOHASH_HELPER_HPP_ */
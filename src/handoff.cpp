@@ -0,0 +1,156 @@
+/* Dataset handoff across restarts.
+ *
+ * Upgrading the executable of a big instance used to require saving the
+ * dataset on disk and loading it again, that takes minutes. SHUTDOWN
+ * HANDOFF restarts the server in place instead (see restartServer(), the
+ * new executable must be at the same path as the old one), and hands the
+ * dataset over to the new process through a pipe:
+ *
+ * 1. A child is forked before the shutdown. It closes every descriptor but
+ *    the write end of the pipe, so that the listening sockets are free for
+ *    the new process and the clients are disconnected, signals that with a
+ *    byte, and then writes the dataset in the RDB format (without the LZF
+ *    compression, that only costs CPU here) to the pipe.
+ * 2. The parent waits for that byte, shuts down without saving, and
+ *    executes the new executable keeping the read end of the pipe open.
+ *    The descriptor and the pid of the child are passed in the environment
+ *    variable REDIS_HANDOFF.
+ * 3. The new process, instead of loading the RDB or the AOF, loads the
+ *    dataset from the pipe as it is written, and reaps the child.
+ *
+ * No file is written nor read: the time of the restart is the time of the
+ * serialization, running in parallel with the loading. Since the dataset is
+ * not saved, if the handoff fails the new process loads the RDB or AOF on
+ * disk, that is up to date only with AOF enabled.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "handoff.h"
+#include "tier.h"
+#include <sys/wait.h>
+#include <fcntl.h>
+
+/* Fork the child writing the dataset to a pipe. Returns the read end of the
+ * pipe, once the child closed the listening sockets, and sets '*childpid',
+ * or -1 on error. */
+int handoffStart(pid_t *childpid) {
+    int pipefds[2];
+    pid_t pid;
+    char ready;
+
+    if (pipe(pipefds) == -1) {
+        serverLog(LL_WARNING,"Can't create the handoff pipe: %s",
+            strerror(errno));
+        return -1;
+    }
+    if ((pid = fork()) == 0) {
+        rdbSaveInfo rsi, *rsiptr;
+        int error = 0, retval;
+        FILE *fp;
+
+        /* Child */
+        for (int j = 3; j < (int)server.maxclients + 1024; j++) {
+            if (j != pipefds[1] && !tierIsFile(j) && fcntl(j,F_GETFD) != -1)
+                close(j);
+        }
+        redisSetProcTitle((char*)"redis-handoff");
+        ready = '+';
+        if (write(pipefds[1],&ready,1) != 1) exitFromChild(1);
+
+        server.rdb_compression = 0;
+        rsiptr = rdbPopulateSaveInfo(&rsi);
+        if ((fp = fdopen(pipefds[1],"w")) == NULL) exitFromChild(1);
+        setvbuf(fp,NULL,_IOFBF,PROTO_IOBUF_LEN*64);
+        rioFileIO rdb(fp);
+        retval = rdbSaveRio(&rdb,&error,RDB_SAVE_NONE,rsiptr);
+        if (fclose(fp) == EOF) retval = C_ERR;
+        exitFromChild(retval == C_OK ? 0 : 1);
+    }
+
+    /* Parent */
+    close(pipefds[1]);
+    if (pid == -1) {
+        serverLog(LL_WARNING,"Can't fork the handoff child: %s",
+            strerror(errno));
+        close(pipefds[0]);
+        return -1;
+    }
+    if (read(pipefds[0],&ready,1) != 1) {
+        serverLog(LL_WARNING,"The handoff child failed to start.");
+        kill(pid,SIGKILL);
+        waitpid(pid,NULL,0);
+        close(pipefds[0]);
+        return -1;
+    }
+    serverLog(LL_NOTICE,"Handing the dataset over with the child %ld.",
+        (long)pid);
+    *childpid = pid;
+    return pipefds[0];
+}
+
+/* Called at startup in place of loading the data from disk: if this
+ * process was executed by SHUTDOWN HANDOFF, load the dataset from the
+ * handoff pipe. Returns C_OK if the dataset was loaded, otherwise C_ERR,
+ * with the databases empty. */
+int handoffLoad(rdbSaveInfo *rsi) {
+    char *handoff = getenv(HANDOFF_ENV);
+    int fd, status = 0, retval;
+    long pid;
+    FILE *fp;
+
+    if (handoff == NULL) return C_ERR;
+    if (sscanf(handoff,"%d:%ld",&fd,&pid) != 2 || (fp = fdopen(fd,"r")) == NULL) {
+        serverLog(LL_WARNING,"Invalid %s environment variable.", HANDOFF_ENV);
+        unsetenv(HANDOFF_ENV);
+        return C_ERR;
+    }
+    /* Don't pass it to the processes we may execute. */
+    unsetenv(HANDOFF_ENV);
+
+    startLoading(fp);
+    rioFileIO rdb(fp);
+    retval = rdbLoadRio(&rdb,rsi);
+    fclose(fp);
+    stopLoading();
+    if (waitpid((pid_t)pid,&status,0) == -1 ||
+        !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        retval = C_ERR;
+    }
+    if (retval != C_OK) {
+        serverLog(LL_WARNING,"The handoff of the dataset failed, loading it from disk.");
+        emptyDb(-1,EMPTYDB_NO_FLAGS,NULL);
+        return C_ERR;
+    }
+    if (server.aof_state == AOF_ON) aofLoadManifest();
+    return C_OK;
+}
@@ -0,0 +1,255 @@
+/* Hot keys tracking.
+ *
+ * Every key hit by lookupKey() is counted in a count-min sketch, that gives
+ * for any key an estimation of its accesses that can only be greater than
+ * the real number, and by a small amount with high probability. The keys
+ * with the greatest estimations are kept in a min-heap of hotkeys-top-k
+ * entries: a key enters the heap only when its estimation is greater than
+ * the heap minimum, so the cold keys never cost more than the sketch update.
+ *
+ * The counters are halved every HOTKEYS_DECAY_PERIOD milliseconds, so that
+ * the keys that are no longer accessed leave the top.
+ *
+ * Unlike redis-cli --hotkeys this works with any maxmemory policy and does
+ * not need to scan the keyspace: the HOTKEYS command just returns the heap.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "hotkeys.h"
+
+/* -----------------------------------------------------------------------------
+ * Top keys min-heap
+ * -------------------------------------------------------------------------- */
+
+static void hotkeysSwap(hotkeysTracker *ht, size_t a, size_t b) {
+    hotkeyEntry tmp = ht->heap[a];
+    ht->heap[a] = ht->heap[b];
+    ht->heap[b] = tmp;
+}
+
+/* Move the entry 'i' towards the leaves, after its count was incremented. */
+static void hotkeysSiftDown(hotkeysTracker *ht, size_t i) {
+    while (1) {
+        size_t min = i, l = i*2+1, r = i*2+2;
+
+        if (l < ht->size && ht->heap[l].count < ht->heap[min].count) min = l;
+        if (r < ht->size && ht->heap[r].count < ht->heap[min].count) min = r;
+        if (min == i) break;
+        hotkeysSwap(ht,i,min);
+        i = min;
+    }
+}
+
+/* Move the entry 'i' towards the root, after it was appended. */
+static void hotkeysSiftUp(hotkeysTracker *ht, size_t i) {
+    while (i) {
+        size_t parent = (i-1)/2;
+
+        if (ht->heap[parent].count <= ht->heap[i].count) break;
+        hotkeysSwap(ht,i,parent);
+        i = parent;
+    }
+}
+
+/* -----------------------------------------------------------------------------
+ * Tracker API
+ * -------------------------------------------------------------------------- */
+
+static hotkeysTracker *hotkeysCreate(size_t k) {
+    hotkeysTracker *ht = (hotkeysTracker *)zcalloc(sizeof(*ht));
+
+    ht->heap = (hotkeyEntry *)zmalloc(sizeof(hotkeyEntry)*k);
+    ht->k = k;
+    ht->last_decay = mstime();
+    return ht;
+}
+
+static void hotkeysFree(hotkeysTracker *ht) {
+    for (size_t j = 0; j < ht->size; j++) sdsfree(ht->heap[j].key);
+    zfree(ht->heap);
+    zfree(ht);
+}
+
+/* Create the tracker according to hotkeys-top-k, dropping what the
+ * previous one collected. Called at startup, by CONFIG SET and by
+ * HOTKEYS RESET. */
+void hotkeysInit(void) {
+    if (server.hotkeys) hotkeysFree(server.hotkeys);
+    server.hotkeys = server.hotkeys_top_k ?
+                     hotkeysCreate(server.hotkeys_top_k) : NULL;
+}
+
+/* Count an access to 'key' of the DB 'dbid'. */
+void hotkeysTrack(hotkeysTracker *ht, int dbid, sds key) {
+    size_t len = sdslen(key);
+    uint64_t hash = dictGenHashFunction(key,len) ^
+                    ((uint64_t)dbid * 0x9e3779b97f4a7c15ULL);
+    uint32_t h1 = (uint32_t)hash, h2 = (uint32_t)(hash >> 32) | 1;
+    uint32_t *cells[HOTKEYS_CMS_DEPTH];
+    uint32_t count = UINT32_MAX;
+
+    /* The rows indexes are derived from the two halves of a single hash:
+     * h1 + i*h2 is as good as independent hash functions for the sketch. */
+    for (int i = 0; i < HOTKEYS_CMS_DEPTH; i++) {
+        cells[i] = &ht->cms[i][(h1 + i*h2) & (HOTKEYS_CMS_WIDTH-1)];
+        if (*cells[i] < count) count = *cells[i];
+    }
+    if (count == UINT32_MAX) return; /* Saturated until the next decay. */
+
+    /* Conservative update: the estimation is the minimum of the counters,
+     * so only the ones below the new estimation need to be raised. This
+     * reduces the overestimation caused by collisions a lot. */
+    count++;
+    for (int i = 0; i < HOTKEYS_CMS_DEPTH; i++)
+        if (*cells[i] < count) *cells[i] = count;
+
+    /* Not hot enough to enter the top keys? The key can't be already there
+     * with a smaller count, since its count was the estimation the last
+     * time it was accessed, that is smaller than the current one. */
+    if (ht->size == ht->k && count <= ht->heap[0].count) return;
+
+    /* Update the entry if the key is already among the top ones. */
+    for (size_t j = 0; j < ht->size; j++) {
+        hotkeyEntry *he = ht->heap+j;
+        if (he->hash == hash && he->dbid == dbid &&
+            sdslen(he->key) == len && memcmp(he->key,key,len) == 0)
+        {
+            he->count = count;
+            hotkeysSiftDown(ht,j);
+            return;
+        }
+    }
+
+    /* Add it, replacing the coldest key if the heap is full. */
+    hotkeyEntry he = {sdsnewlen(key,len), dbid, hash, count};
+    if (ht->size < ht->k) {
+        ht->heap[ht->size++] = he;
+        hotkeysSiftUp(ht,ht->size-1);
+    } else {
+        sdsfree(ht->heap[0].key);
+        ht->heap[0] = he;
+        hotkeysSiftDown(ht,0);
+    }
+}
+
+/* Halve all the counters every HOTKEYS_DECAY_PERIOD milliseconds. The top
+ * keys counts are halved as well, which preserves the heap order. Called
+ * by serverCron(). */
+void hotkeysCron(void) {
+    hotkeysTracker *ht = server.hotkeys;
+
+    if (ht == NULL || server.mstime - ht->last_decay < HOTKEYS_DECAY_PERIOD)
+        return;
+    ht->last_decay = server.mstime;
+    for (int i = 0; i < HOTKEYS_CMS_DEPTH; i++)
+        for (int j = 0; j < HOTKEYS_CMS_WIDTH; j++) ht->cms[i][j] >>= 1;
+    for (size_t j = 0; j < ht->size; j++) ht->heap[j].count >>= 1;
+}
+
+static int hotkeysCompareCountDesc(const void *a, const void *b) {
+    uint32_t ca = (*(hotkeyEntry * const *)a)->count;
+    uint32_t cb = (*(hotkeyEntry * const *)b)->count;
+    return (ca < cb) - (ca > cb);
+}
+
+/* Return a zmalloc'ed array with the pointers to the tracked keys, hottest
+ * first, setting 'count' to its length. */
+hotkeyEntry **hotkeysGetTop(hotkeysTracker *ht, size_t *count) {
+    hotkeyEntry **top = (hotkeyEntry **)zmalloc(sizeof(hotkeyEntry*)*
+                                                (ht->size ? ht->size : 1));
+
+    for (size_t j = 0; j < ht->size; j++) top[j] = ht->heap+j;
+    qsort(top,ht->size,sizeof(hotkeyEntry*),hotkeysCompareCountDesc);
+    *count = ht->size;
+    return top;
+}
+
+/* -----------------------------------------------------------------------------
+ * HOTKEYS command
+ * -------------------------------------------------------------------------- */
+
+/* HOTKEYS [COUNT <count>]
+ * HOTKEYS RESET
+ * HOTKEYS HELP
+ *
+ * Reply with the hottest keys, hottest first, as [key, db, count] triples,
+ * where count is the estimated number of recent accesses. */
+void hotkeysCommand(client *c) {
+    long count = -1;
+    size_t tracked;
+
+    if (c->m_argc == 2 && !strcasecmp((const char*)c->m_argv[1]->ptr,"help")) {
+        void *blenp = c->addDeferredMultiBulkLength();
+        int blen = 0;
+        blen++; c->addReplyStatus(
+        "HOTKEYS [COUNT <count>] -- Return the hottest keys as key, db and estimated recent accesses.");
+        blen++; c->addReplyStatus(
+        "HOTKEYS RESET -- Forget the accesses counted so far.");
+        c->setDeferredMultiBulkLength(blenp,blen);
+        return;
+    }
+
+    if (server.hotkeys == NULL) {
+        c->addReplyError("Hot keys tracking is disabled: set hotkeys-top-k "
+                         "to enable it");
+        return;
+    }
+
+    if (c->m_argc == 2 && !strcasecmp((const char*)c->m_argv[1]->ptr,"reset")) {
+        hotkeysInit();
+        c->addReply(shared.ok);
+        return;
+    } else if (c->m_argc == 3 &&
+               !strcasecmp((const char*)c->m_argv[1]->ptr,"count"))
+    {
+        if (getLongFromObjectOrReply(c,c->m_argv[2],&count,NULL) != C_OK)
+            return;
+        if (count < 0) {
+            c->addReplyError("COUNT can't be negative");
+            return;
+        }
+    } else if (c->m_argc != 1) {
+        c->addReply(shared.syntaxerr);
+        return;
+    }
+
+    hotkeyEntry **top = hotkeysGetTop(server.hotkeys,&tracked);
+    if (count < 0 || (size_t)count > tracked) count = tracked;
+    c->addReplyMultiBulkLen(count);
+    for (long j = 0; j < count; j++) {
+        c->addReplyMultiBulkLen(3);
+        c->addReplyBulkCBuffer(top[j]->key,sdslen(top[j]->key));
+        c->addReplyLongLong(top[j]->dbid);
+        c->addReplyLongLong(top[j]->count);
+    }
+    zfree(top);
+}
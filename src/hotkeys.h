@@ -0,0 +1,75 @@
+/* hotkeys.h -- hot keys tracking API header file
+ * See hotkeys.cpp for more information.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __HOTKEYS_H
+#define __HOTKEYS_H
+
+/* Count-min sketch geometry: the width must be a power of two. With 4 rows
+ * of 4096 counters a key is overestimated by more than 0.07% of all the
+ * tracked accesses with a probability of about 2%. */
+#define HOTKEYS_CMS_DEPTH 4
+#define HOTKEYS_CMS_WIDTH 4096
+#define HOTKEYS_MAX_TOP_K 1024      /* Max value of hotkeys-top-k. */
+#define HOTKEYS_DECAY_PERIOD 10000  /* Halve all the counters every 10 sec. */
+#define HOTKEYS_INFO_KEYS 5         /* Top keys reported by INFO. */
+
+/* A key among the top ones. */
+struct hotkeyEntry {
+    sds key;
+    int dbid;
+    uint64_t hash;      /* Hash of the key and DB, see hotkeysTrack(). */
+    uint32_t count;     /* Estimated accesses, decayed over time. */
+};
+
+/* Keys accesses are counted by a count-min sketch, and the top K keys by
+ * estimated accesses are kept in a min-heap, so that a key access costs
+ * a few counters updates, plus a scan of the heap only when the key is
+ * hot enough to enter it. */
+struct hotkeysTracker {
+    uint32_t cms[HOTKEYS_CMS_DEPTH][HOTKEYS_CMS_WIDTH];
+    hotkeyEntry *heap;  /* Min-heap ordered by count. */
+    size_t size;        /* Entries in the heap. */
+    size_t k;           /* Max entries in the heap. */
+    mstime_t last_decay;
+};
+
+/* Exported API */
+void hotkeysInit(void);
+void hotkeysTrack(hotkeysTracker *ht, int dbid, sds key);
+void hotkeysCron(void);
+hotkeyEntry **hotkeysGetTop(hotkeysTracker *ht, size_t *count);
+
+/* Exported commands */
+void hotkeysCommand(client *c);
+
+#endif
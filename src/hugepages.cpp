@@ -0,0 +1,148 @@
+/* Transparent huge pages for the keyspace.
+ *
+ * With huge pages a TLB entry maps 2MB instead of 4KB, that for the random
+ * accesses of the lookups in a large dataset saves most of the TLB misses.
+ * Redis warns against THP because of fork(): while the child is saving, a
+ * write to a huge page copies the whole 2MB page, and the latency spikes.
+ * With huge-pages enabled:
+ *
+ * - The main thread, that allocates the keyspace, is bound to a jemalloc
+ *   arena of its own, whose chunk hooks madvise(MADV_HUGEPAGE) the chunks
+ *   (2MB, huge page aligned) as they are mapped. The other threads keep
+ *   allocating from the default arenas with normal pages, so the buffers
+ *   of the I/O threads and of the background jobs stay small.
+ * - BGSAVE always takes fork-less snapshots (see snapshot.cpp), so saving
+ *   doesn't copy the huge pages. AOF rewrites and the full syncs of the
+ *   slaves still fork.
+ *
+ * The kernel must have THP set to 'madvise' (or 'always'). INFO memory
+ * reports the chunks hinted and the AnonHugePages of the process, that is
+ * the memory actually backed by huge pages.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "hugepages.h"
+#include "atomicvar.h"
+#include <sys/mman.h>
+
+static int hugepages_active = 0;
+static size_t hugepages_chunks = 0;     /* Chunks hinted so far. */
+static size_t hugepages_bytes = 0;      /* Bytes of the hinted chunks mapped. */
+
+#if defined(USE_JEMALLOC) && defined(__linux__) && defined(MADV_HUGEPAGE)
+
+static chunk_hooks_t default_hooks;
+
+/* Chunk hooks of the keyspace arena: the chunks are mapped by the default
+ * hooks, and hinted to be backed by huge pages. The chunks can be freed by
+ * any thread, so the counters are atomic. */
+static void *hugePagesChunkAlloc(void *new_addr, size_t size, size_t alignment, bool *zero, bool *commit, unsigned arena_ind) {
+    void *chunk = default_hooks.alloc(new_addr,size,alignment,zero,commit,arena_ind);
+    if (chunk && madvise(chunk,size,MADV_HUGEPAGE) == 0) {
+        atomicIncr(hugepages_chunks,1);
+        atomicIncr(hugepages_bytes,size);
+    }
+    return chunk;
+}
+
+static bool hugePagesChunkDalloc(void *chunk, size_t size, bool committed, unsigned arena_ind) {
+    bool err = default_hooks.dalloc(chunk,size,committed,arena_ind);
+    if (!err) atomicDecr(hugepages_bytes,size);
+    return err;
+}
+
+/* Called at startup, before the databases are created: when huge-pages
+ * is enabled create the keyspace arena and bind the main thread to it. */
+void hugePagesInit() {
+    unsigned arena;
+    size_t sz = sizeof(arena), hsz = sizeof(default_hooks);
+    chunk_hooks_t hooks;
+    char name[64];
+
+    if (!server.huge_pages) return;
+    if (!THPIsEnabled()) {
+        serverLog(LL_WARNING,"huge-pages is enabled but Transparent Huge Pages are disabled in the kernel: run 'echo madvise > /sys/kernel/mm/transparent_hugepage/enabled' as root to use it.");
+        return;
+    }
+    if (je_mallctl("arenas.extend",&arena,&sz,NULL,0) ||
+        je_mallctl("arena.0.chunk_hooks",&default_hooks,&hsz,NULL,0))
+    {
+        serverLog(LL_WARNING,"huge-pages: unable to create the keyspace arena.");
+        return;
+    }
+    hooks = default_hooks;
+    hooks.alloc = hugePagesChunkAlloc;
+    hooks.dalloc = hugePagesChunkDalloc;
+    snprintf(name,sizeof(name),"arena.%u.chunk_hooks",arena);
+    if (je_mallctl(name,NULL,NULL,&hooks,sizeof(hooks)) ||
+        je_mallctl("thread.arena",NULL,NULL,&arena,sizeof(arena)))
+    {
+        serverLog(LL_WARNING,"huge-pages: unable to set up the keyspace arena.");
+        return;
+    }
+    hugepages_active = 1;
+    serverLog(LL_NOTICE,"The keyspace is allocated from jemalloc arena %u, backed by transparent huge pages. BGSAVE will not fork.", arena);
+}
+
+#else
+
+void hugePagesInit() {
+    if (server.huge_pages)
+        serverLog(LL_WARNING,"huge-pages requires jemalloc on Linux, ignoring it.");
+}
+
+#endif
+
+/* Return 1 if the keyspace is backed by huge pages. */
+int hugePagesActive() {
+    return hugepages_active;
+}
+
+/* Append the huge pages fields of INFO memory. The AnonHugePages are read
+ * from /proc/self/smaps, so only when huge-pages is active. */
+sds genHugePagesInfoString(sds info) {
+    size_t chunks, bytes, anon = 0;
+
+    atomicGet(hugepages_chunks,chunks);
+    atomicGet(hugepages_bytes,bytes);
+    if (hugepages_active)
+        anon = zmalloc_get_smap_bytes_by_field((char*)"AnonHugePages:",-1);
+    return sdscatprintf(info,
+        "huge_pages:%d\r\n"
+        "huge_pages_chunks:%zu\r\n"
+        "huge_pages_hinted_bytes:%zu\r\n"
+        "huge_pages_anon_bytes:%zu\r\n"
+        "huge_pages_rss_perc:%.2f%%\r\n",
+        hugepages_active, chunks, bytes, anon,
+        server.resident_set_size ?
+            (double)anon*100/server.resident_set_size : 0);
+}
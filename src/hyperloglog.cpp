@@ -501,6 +501,192 @@ int hllDenseAdd(uint8_t *registers, unsigned char *ele, size_t elesize) {
     }
 }
 
+/* ====================== Dense registers kernels ========================
+ * With 6 bits registers every 3 bytes of the dense representation hold 4
+ * registers, and 12 bytes hold 16. The following kernels unpack the dense
+ * registers into an array of uint8_t registers (the HLL_RAW encoding),
+ * merge them into such an array computing the MAX, and pack the array
+ * back, processing the registers in groups of 4 instead of one at a time.
+ * When the CPU supports AVX2 the groups are expanded 32 at a time with a
+ * byte shuffle, selected at runtime like the kernels of bitkernel.cpp. */
+
+#if defined(__x86_64__) && (defined(__clang__) || __GNUC__ >= 5)
+#define HAVE_HLL_AVX2 1
+#include <immintrin.h>
+#endif
+
+/* The kernels work on the default layout of 6 bits registers, in groups
+ * of 32 registers. */
+#define HLL_KERNELS (HLL_BITS == 6 && HLL_REGISTERS % 32 == 0)
+
+static void hllDenseToRawScalar(uint8_t *raw, const uint8_t *registers,
+                                int start)
+{
+    const uint8_t *p = registers + start/4*3;
+    int j;
+
+    for (j = start; j < HLL_REGISTERS; j += 4) {
+        uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+        raw[j] = v & 63;
+        raw[j+1] = (v >> 6) & 63;
+        raw[j+2] = (v >> 12) & 63;
+        raw[j+3] = v >> 18;
+        p += 3;
+    }
+}
+
+static void hllDenseMaxScalar(uint8_t *max, const uint8_t *registers,
+                              int start)
+{
+    const uint8_t *p = registers + start/4*3;
+    int j;
+
+    for (j = start; j < HLL_REGISTERS; j += 4) {
+        uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+        uint8_t r0 = v & 63, r1 = (v >> 6) & 63, r2 = (v >> 12) & 63,
+                r3 = v >> 18;
+        if (r0 > max[j]) max[j] = r0;
+        if (r1 > max[j+1]) max[j+1] = r1;
+        if (r2 > max[j+2]) max[j+2] = r2;
+        if (r3 > max[j+3]) max[j+3] = r3;
+        p += 3;
+    }
+}
+
+static void hllRawToDenseScalar(uint8_t *registers, const uint8_t *raw,
+                                int start)
+{
+    uint8_t *p = registers + start/4*3;
+    int j;
+
+    for (j = start; j < HLL_REGISTERS; j += 4) {
+        uint32_t v = raw[j] | (raw[j+1] << 6) | (raw[j+2] << 12) |
+                     (raw[j+3] << 18);
+        p[0] = v;
+        p[1] = v >> 8;
+        p[2] = v >> 16;
+        p += 3;
+    }
+}
+
+#ifdef HAVE_HLL_AVX2
+#define HLL_AVX2 __attribute__((target("avx2")))
+
+/* Expand the 24 bytes at 'p' into 32 registers, one per byte. Every 128
+ * bits lane loads 16 bytes, of which 12 are used, so 4 bytes are read
+ * after the 24 ones: the caller must make sure they exist. */
+HLL_AVX2 static inline __m256i hllUnpack32Avx2(const uint8_t *p) {
+    const __m256i shuf = _mm256_setr_epi8(
+        0,1,2,-1,3,4,5,-1,6,7,8,-1,9,10,11,-1,
+        0,1,2,-1,3,4,5,-1,6,7,8,-1,9,10,11,-1);
+    const __m256i mask = _mm256_set1_epi32(63);
+    __m256i x = _mm256_inserti128_si256(_mm256_castsi128_si256(
+        _mm_loadu_si128((const __m128i*)p)),
+        _mm_loadu_si128((const __m128i*)(p+12)),1);
+
+    /* Every 32 bits word gets 3 bytes, holding 4 registers: move the
+     * register k to the byte k of the word. */
+    x = _mm256_shuffle_epi8(x,shuf);
+    return _mm256_or_si256(
+        _mm256_or_si256(_mm256_and_si256(x,mask),
+            _mm256_and_si256(_mm256_slli_epi32(x,2),_mm256_slli_epi32(mask,8))),
+        _mm256_or_si256(
+            _mm256_and_si256(_mm256_slli_epi32(x,4),_mm256_slli_epi32(mask,16)),
+            _mm256_and_si256(_mm256_slli_epi32(x,6),_mm256_slli_epi32(mask,24))));
+}
+
+/* The last group of 32 registers is left to the scalar kernels, so that
+ * the loads never go past the end of the dense registers. */
+HLL_AVX2 static void hllDenseToRawAvx2(uint8_t *raw, const uint8_t *registers) {
+    int j;
+
+    for (j = 0; j < HLL_REGISTERS-32; j += 32)
+        _mm256_storeu_si256((__m256i*)(raw+j),
+            hllUnpack32Avx2(registers+j/4*3));
+    hllDenseToRawScalar(raw,registers,j);
+}
+
+HLL_AVX2 static void hllDenseMaxAvx2(uint8_t *max, const uint8_t *registers) {
+    int j;
+
+    for (j = 0; j < HLL_REGISTERS-32; j += 32) {
+        __m256i m = _mm256_loadu_si256((const __m256i*)(max+j));
+        m = _mm256_max_epu8(m,hllUnpack32Avx2(registers+j/4*3));
+        _mm256_storeu_si256((__m256i*)(max+j),m);
+    }
+    hllDenseMaxScalar(max,registers,j);
+}
+
+/* Pack 32 registers at a time: every 32 bits word of 4 registers becomes
+ * 24 bits, then the 12 bytes of every lane are made contiguous. Every lane
+ * stores 16 bytes, the 4 in excess being overwritten by the next store. */
+HLL_AVX2 static void hllRawToDenseAvx2(uint8_t *registers, const uint8_t *raw) {
+    const __m256i shuf = _mm256_setr_epi8(
+        0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1,
+        0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1);
+    const __m256i mask = _mm256_set1_epi32(63);
+    int j;
+
+    for (j = 0; j < HLL_REGISTERS-32; j += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(raw+j));
+        x = _mm256_or_si256(
+            _mm256_or_si256(_mm256_and_si256(x,mask),
+                _mm256_and_si256(_mm256_srli_epi32(x,2),_mm256_slli_epi32(mask,6))),
+            _mm256_or_si256(
+                _mm256_and_si256(_mm256_srli_epi32(x,4),_mm256_slli_epi32(mask,12)),
+                _mm256_and_si256(_mm256_srli_epi32(x,6),_mm256_slli_epi32(mask,18))));
+        x = _mm256_shuffle_epi8(x,shuf);
+        _mm_storeu_si128((__m128i*)(registers+j/4*3),_mm256_castsi256_si128(x));
+        _mm_storeu_si128((__m128i*)(registers+j/4*3+12),
+            _mm256_extracti128_si256(x,1));
+    }
+    hllRawToDenseScalar(registers,raw,j);
+}
+
+static int hllHaveAvx2(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+/* Unpack the dense 'registers' into the HLL_REGISTERS bytes of 'raw'. */
+void hllDenseToRaw(uint8_t *raw, const uint8_t *registers) {
+#ifdef HAVE_HLL_AVX2
+    static int avx2 = hllHaveAvx2();
+    if (avx2) {
+        hllDenseToRawAvx2(raw,registers);
+        return;
+    }
+#endif
+    hllDenseToRawScalar(raw,registers,0);
+}
+
+/* Set every max[i] to MAX(max[i],registers[i]) for the dense 'registers'. */
+void hllDenseMax(uint8_t *max, const uint8_t *registers) {
+#ifdef HAVE_HLL_AVX2
+    static int avx2 = hllHaveAvx2();
+    if (avx2) {
+        hllDenseMaxAvx2(max,registers);
+        return;
+    }
+#endif
+    hllDenseMaxScalar(max,registers,0);
+}
+
+/* Pack the HLL_REGISTERS bytes of 'raw' into the dense 'registers'. */
+void hllRawToDense(uint8_t *registers, const uint8_t *raw) {
+#ifdef HAVE_HLL_AVX2
+    static int avx2 = hllHaveAvx2();
+    if (avx2) {
+        hllRawToDenseAvx2(registers,raw);
+        return;
+    }
+#endif
+    hllRawToDenseScalar(registers,raw,0);
+}
+
+double hllRawSum(uint8_t *registers, double *PE, int *ezp);
+
 /* Compute SUM(2^-reg) in the dense representation.
  * PE is an array with a pre-computer table of values 2^-reg indexed by reg.
  * As a side effect the integer pointed by 'ezp' is set to the number
@@ -511,38 +697,13 @@ double hllDenseSum(uint8_t *registers, double *PE, int *ezp) {
 
     /* Redis default is to use 16384 registers 6 bits each. The code works
      * with other values by modifying the defines, but for our target value
-     * we take a faster path with unrolled loops. */
-    if (HLL_REGISTERS == 16384 && HLL_BITS == 6) {
-        uint8_t *r = registers;
-        unsigned long r0, r1, r2, r3, r4, r5, r6, r7, r8, r9,
-                      r10, r11, r12, r13, r14, r15;
-        for (j = 0; j < 1024; j++) {
-            /* Handle 16 registers per iteration. */
-            r0 = r[0] & 63; if (r0 == 0) ez++;
-            r1 = (r[0] >> 6 | r[1] << 2) & 63; if (r1 == 0) ez++;
-            r2 = (r[1] >> 4 | r[2] << 4) & 63; if (r2 == 0) ez++;
-            r3 = (r[2] >> 2) & 63; if (r3 == 0) ez++;
-            r4 = r[3] & 63; if (r4 == 0) ez++;
-            r5 = (r[3] >> 6 | r[4] << 2) & 63; if (r5 == 0) ez++;
-            r6 = (r[4] >> 4 | r[5] << 4) & 63; if (r6 == 0) ez++;
-            r7 = (r[5] >> 2) & 63; if (r7 == 0) ez++;
-            r8 = r[6] & 63; if (r8 == 0) ez++;
-            r9 = (r[6] >> 6 | r[7] << 2) & 63; if (r9 == 0) ez++;
-            r10 = (r[7] >> 4 | r[8] << 4) & 63; if (r10 == 0) ez++;
-            r11 = (r[8] >> 2) & 63; if (r11 == 0) ez++;
-            r12 = r[9] & 63; if (r12 == 0) ez++;
-            r13 = (r[9] >> 6 | r[10] << 2) & 63; if (r13 == 0) ez++;
-            r14 = (r[10] >> 4 | r[11] << 4) & 63; if (r14 == 0) ez++;
-            r15 = (r[11] >> 2) & 63; if (r15 == 0) ez++;
-
-            /* Additional parens will allow the compiler to optimize the
-             * code more with a loss of precision that is not very relevant
-             * here (floating point math is not commutative!). */
-            E += (PE[r0] + PE[r1]) + (PE[r2] + PE[r3]) + (PE[r4] + PE[r5]) +
-                 (PE[r6] + PE[r7]) + (PE[r8] + PE[r9]) + (PE[r10] + PE[r11]) +
-                 (PE[r12] + PE[r13]) + (PE[r14] + PE[r15]);
-            r += 12;
-        }
+     * we take a faster path unpacking the registers with the kernels above
+     * and summing the raw registers. */
+    if (HLL_KERNELS) {
+        uint8_t raw[HLL_REGISTERS];
+
+        hllDenseToRaw(raw,registers);
+        return hllRawSum(raw,PE,ezp);
     } else {
         for (j = 0; j < HLL_REGISTERS; j++) {
             unsigned long reg;
@@ -938,24 +1099,35 @@ double hllSparseSum(uint8_t *sparse, int sparselen, double *PE, int *ezp, int *i
 double hllRawSum(uint8_t *registers, double *PE, int *ezp) {
     double E = 0;
     int j, ez = 0;
-    uint64_t *word = (uint64_t*) registers;
-    uint8_t *bytes;
-
+    uint64_t word;
+    uint8_t *bytes = registers;
+
+    /* Instead of summing 2^(-reg) register by register, build the histogram
+     * of the register values and sum 2^(-val) * count once per value. The
+     * histogram is split in 4 interleaved ones so that consecutive equal
+     * registers don't wait for each other's increment. */
+    int reghisto[4][HLL_REGISTER_MAX+1];
+    memset(reghisto,0,sizeof(reghisto));
     for (j = 0; j < HLL_REGISTERS/8; j++) {
-        if (*word == 0) {
+        memcpy(&word,bytes,sizeof(word));
+        if (word == 0) {
             ez += 8;
         } else {
-            bytes = (uint8_t*) word;
-            if (bytes[0]) E += PE[bytes[0]]; else ez++;
-            if (bytes[1]) E += PE[bytes[1]]; else ez++;
-            if (bytes[2]) E += PE[bytes[2]]; else ez++;
-            if (bytes[3]) E += PE[bytes[3]]; else ez++;
-            if (bytes[4]) E += PE[bytes[4]]; else ez++;
-            if (bytes[5]) E += PE[bytes[5]]; else ez++;
-            if (bytes[6]) E += PE[bytes[6]]; else ez++;
-            if (bytes[7]) E += PE[bytes[7]]; else ez++;
+            reghisto[0][bytes[0]]++;
+            reghisto[1][bytes[1]]++;
+            reghisto[2][bytes[2]]++;
+            reghisto[3][bytes[3]]++;
+            reghisto[0][bytes[4]]++;
+            reghisto[1][bytes[5]]++;
+            reghisto[2][bytes[6]]++;
+            reghisto[3][bytes[7]]++;
         }
-        word++;
+        bytes += 8;
+    }
+    ez += reghisto[0][0]+reghisto[1][0]+reghisto[2][0]+reghisto[3][0];
+    for (j = HLL_REGISTER_MAX; j > 0; j--) {
+        int count = reghisto[0][j]+reghisto[1][j]+reghisto[2][j]+reghisto[3][j];
+        if (count) E += PE[j]*count;
     }
     E += ez; /* 2^(-reg[j]) is 1 when m is 0, add it 'ez' times for every
                 zero register in the HLL. */
@@ -1044,7 +1216,9 @@ int hllMerge(uint8_t *max, robj *hll) {
     hllhdr*hdr = (hllhdr*)hll->ptr;
     int i;
 
-    if (hdr->encoding == HLL_DENSE) {
+    if (hdr->encoding == HLL_DENSE && HLL_KERNELS) {
+        hllDenseMax(max,hdr->registers);
+    } else if (hdr->encoding == HLL_DENSE) {
         uint8_t val;
 
         for (i = 0; i < HLL_REGISTERS; i++) {
@@ -1192,6 +1366,158 @@ void pfaddCommand(client *c) {
     c->addReply( updated ? shared.cone : shared.czero);
 }
 
+/* ========================= PFCOUNT union cache ===========================
+ * The cardinality computed by PFCOUNT with multiple keys is cached in the
+ * DB, by the list of keys, so that polling the same union again is cheap
+ * until one of its HLLs changes.
+ *
+ * Every key of a cached union is tracked in the m_hll_versions dict of the
+ * DB with a version, that signalModifiedKey() increments calling
+ * hllTouchKey(), like it touches the WATCHed keys. A cached union is used
+ * only if all its keys still have the version, and the value, seen when it
+ * was computed: the value is compared as well since keys deleted because
+ * expired or evicted are not signaled. */
+
+#define HLL_UNION_CACHE_MAX 1024 /* Max cached unions for every DB. */
+
+struct hllKeyVersion {
+    uint64_t version;
+    long refcount;      /* Number of cached unions with this key. */
+};
+
+struct hllUnion {
+    uint64_t card;      /* Cached cardinality. */
+    int numkeys;
+    robj **keys;
+    robj **vals;        /* Values of the keys, NULL if missing. Only compared,
+                           never dereferenced. */
+    uint64_t *versions; /* Versions of the keys. */
+};
+
+/* Return the name of the union of the keys of the PFCOUNT 'c': the keys
+ * prefixed by their length. */
+static sds hllUnionName(client *c) {
+    sds name = sdsempty();
+    int j;
+
+    for (j = 1; j < c->m_argc; j++) {
+        robj *key = getDecodedObject(c->m_argv[j]);
+        uint32_t len = sdslen((sds)key->ptr);
+        name = sdscatlen(name,&len,sizeof(len));
+        name = sdscatsds(name,(sds)key->ptr);
+        decrRefCount(key);
+    }
+    return name;
+}
+
+/* Free the union 'u' and release its keys in the versions dict. */
+static void hllUnionRelease(redisDb *db, hllUnion *u) {
+    int j;
+
+    for (j = 0; j < u->numkeys; j++) {
+        hllKeyVersion *v =
+            (hllKeyVersion *)db->m_hll_versions->dictFetchValue(u->keys[j]);
+        if (--v->refcount == 0) db->m_hll_versions->dictDelete(u->keys[j]);
+        decrRefCount(u->keys[j]);
+    }
+    zfree(u->keys);
+    zfree(u->vals);
+    zfree(u->versions);
+    zfree(u);
+}
+
+static void hllUnionDelete(redisDb *db, sds name) {
+    hllUnion *u = (hllUnion *)db->m_hll_unions->dictFetchValue(name);
+
+    if (u == NULL) return;
+    hllUnionRelease(db,u);
+    db->m_hll_unions->dictDelete(name);
+}
+
+/* Return the cached union of the keys of the PFCOUNT 'c' named 'name', if
+ * it exists and is still valid, otherwise NULL. */
+static hllUnion *hllUnionLookup(client *c, sds name) {
+    redisDb *db = c->m_cur_selected_db;
+    hllUnion *u = (hllUnion *)db->m_hll_unions->dictFetchValue(name);
+    int j;
+
+    if (u == NULL) return NULL;
+    for (j = 0; j < u->numkeys; j++) {
+        hllKeyVersion *v =
+            (hllKeyVersion *)db->m_hll_versions->dictFetchValue(u->keys[j]);
+        if (lookupKeyRead(db,c->m_argv[j+1]) != u->vals[j] ||
+            v->version != u->versions[j])
+        {
+            hllUnionDelete(db,name);
+            return NULL;
+        }
+    }
+    return u;
+}
+
+/* Cache the cardinality 'card' of the union of the keys of the PFCOUNT
+ * 'c', taking the ownership of its 'name' and of the array 'vals' of the
+ * values the keys were looked up to. */
+static void hllUnionStore(client *c, sds name, uint64_t card, robj **vals) {
+    redisDb *db = c->m_cur_selected_db;
+    hllUnion *u = (hllUnion *)zmalloc(sizeof(*u));
+    int j;
+
+    /* Make room evicting a random union. */
+    if (db->m_hll_unions->dictSize() >= HLL_UNION_CACHE_MAX) {
+        dictEntry *de = db->m_hll_unions->dictGetRandomKey();
+        hllUnionDelete(db,(sds)de->dictGetKey());
+    }
+
+    u->card = card;
+    u->numkeys = c->m_argc-1;
+    u->keys = (robj **)zmalloc(sizeof(robj*)*u->numkeys);
+    u->vals = vals;
+    u->versions = (uint64_t *)zmalloc(sizeof(uint64_t)*u->numkeys);
+    for (j = 0; j < u->numkeys; j++) {
+        robj *key = c->m_argv[j+1];
+        hllKeyVersion *v =
+            (hllKeyVersion *)db->m_hll_versions->dictFetchValue(key);
+
+        if (v == NULL) {
+            v = (hllKeyVersion *)zmalloc(sizeof(*v));
+            v->version = 0;
+            v->refcount = 0;
+            incrRefCount(key);
+            db->m_hll_versions->dictAdd(key,v);
+        }
+        v->refcount++;
+        incrRefCount(key);
+        u->keys[j] = key;
+        u->versions[j] = v->version;
+    }
+    db->m_hll_unions->dictAdd(name,u);
+}
+
+/* Called by signalModifiedKey(): the cached unions with 'key' are no
+ * longer valid. */
+void hllTouchKey(redisDb *db, robj *key) {
+    hllKeyVersion *v;
+
+    if (db->m_hll_versions->dictSize() == 0) return;
+    v = (hllKeyVersion *)db->m_hll_versions->dictFetchValue(key);
+    if (v) v->version++;
+}
+
+/* Drop all the cached unions of 'db', when it is flushed or swapped. */
+void hllFlushUnionCache(redisDb *db) {
+    dictEntry *de;
+
+    if (db->m_hll_unions->dictSize() == 0) return;
+    {
+        dictIterator di(db->m_hll_unions);
+        while((de = di.dictNext()) != NULL)
+            hllUnionRelease(db,(hllUnion *)de->dictGetVal());
+    }
+    db->m_hll_unions->dictEmpty(NULL);
+    serverAssert(db->m_hll_versions->dictSize() == 0);
+}
+
 /* PFCOUNT var -> approximated cardinality of set. */
 void pfcountCommand(client *c) {
     robj *o;
@@ -1204,8 +1530,19 @@ void pfcountCommand(client *c) {
      * the cardinality of the merge of the N HLLs specified. */
     if (c->m_argc > 2) {
         uint8_t max[HLL_HDR_SIZE+HLL_REGISTERS], *registers;
+        sds name = hllUnionName(c);
+        robj **vals;
+        hllUnion *u;
         int j;
 
+        /* Reply from the cache if none of the keys changed. */
+        if ((u = hllUnionLookup(c,name)) != NULL) {
+            c->addReplyLongLong(u->card);
+            sdsfree(name);
+            return;
+        }
+        vals = (robj **)zmalloc(sizeof(robj*)*(c->m_argc-1));
+
         /* Compute an HLL with M[i] = MAX(M[i]_j). */
         memset(max,0,sizeof(max));
         hdr = (hllhdr*) max;
@@ -1214,19 +1551,28 @@ void pfcountCommand(client *c) {
         for (j = 1; j < c->m_argc; j++) {
             /* Check type and size. */
             robj *o = lookupKeyRead(c->m_cur_selected_db,c->m_argv[j]);
+            vals[j-1] = o;
             if (o == NULL) continue; /* Assume empty HLL for non existing var.*/
-            if (isHLLObjectOrReply(c,o) != C_OK) return;
+            if (isHLLObjectOrReply(c,o) != C_OK) {
+                sdsfree(name);
+                zfree(vals);
+                return;
+            }
 
             /* Merge with this HLL with our 'max' HHL by setting max[i]
              * to MAX(max[i],hll[i]). */
             if (hllMerge(registers,o) == C_ERR) {
                 c->addReplySds(sdsnew(invalid_hll_err));
+                sdsfree(name);
+                zfree(vals);
                 return;
             }
         }
 
         /* Compute cardinality of the resulting set. */
-        c->addReplyLongLong(hllCount(hdr,NULL));
+        card = hllCount(hdr,NULL);
+        hllUnionStore(c,name,card,vals);
+        c->addReplyLongLong(card);
         return;
     }
 
@@ -1330,8 +1676,12 @@ void pfmergeCommand(client *c) {
     /* Write the resulting HLL to the destination HLL registers and
      * invalidate the cached value. */
     hdr = (hllhdr*)o->ptr;
-    for (j = 0; j < HLL_REGISTERS; j++) {
-        HLL_DENSE_SET_REGISTER(hdr->registers,j,max[j]);
+    if (HLL_KERNELS) {
+        hllRawToDense(hdr->registers,max);
+    } else {
+        for (j = 0; j < HLL_REGISTERS; j++) {
+            HLL_DENSE_SET_REGISTER(hdr->registers,j,max[j]);
+        }
     }
     HLL_INVALIDATE_CACHE(hdr);
 
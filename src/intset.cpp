@@ -114,14 +114,181 @@ intset *intset::intsetResize(intset *is, uint32_t len) {
     return is;
 }
 
+/* On little endian hosts the contents of the intset can be accessed as an
+ * array of int16_t, int32_t or int64_t, so that searches and intersections
+ * can run on the plain array with the integer type of the encoding. */
+#if (BYTE_ORDER == LITTLE_ENDIAN)
+#define INTSET_TYPED_ACCESS 1
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/* Binary search ends when the window of elements that may contain the value
+ * is this small: the window is then scanned with no branch at all, a few
+ * vector compares when AVX2 is available. */
+#define INTSET_SEARCH_WINDOW 16
+
+/* Intersections switch from a merge of the two arrays to a search of every
+ * element of the small set in the big one when the big set has this number
+ * of times the elements of the small one. */
+#define INTSET_GALLOP_RATIO 32
+
+/* Return the number of elements of p[0..n-1] smaller than v. */
+template <typename T>
+static inline uint32_t intsetCountLess(const T *p, uint32_t n, T v) {
+    uint32_t count = 0;
+    for (uint32_t j = 0; j < n; j++) count += p[j] < v;
+    return count;
+}
+
+/* Return 1 if p[0..n-1] contains v. */
+template <typename T>
+static inline int intsetBlockHas(const T *p, uint32_t n, T v) {
+    int found = 0;
+    for (uint32_t j = 0; j < n; j++) found |= p[j] == v;
+    return found;
+}
+
+#if defined(__AVX2__)
+template <>
+inline uint32_t intsetCountLess<int16_t>(const int16_t *p, uint32_t n, int16_t v) {
+    __m256i vv = _mm256_set1_epi16(v);
+    uint32_t count = 0, j = 0;
+    for (; j+16 <= n; j += 16) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(p+j));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpgt_epi16(vv,x));
+        count += __builtin_popcount(mask) >> 1;
+    }
+    for (; j < n; j++) count += p[j] < v;
+    return count;
+}
+
+template <>
+inline uint32_t intsetCountLess<int32_t>(const int32_t *p, uint32_t n, int32_t v) {
+    __m256i vv = _mm256_set1_epi32(v);
+    uint32_t count = 0, j = 0;
+    for (; j+8 <= n; j += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(p+j));
+        count += __builtin_popcount(_mm256_movemask_ps(
+                    _mm256_castsi256_ps(_mm256_cmpgt_epi32(vv,x))));
+    }
+    for (; j < n; j++) count += p[j] < v;
+    return count;
+}
+
+template <>
+inline uint32_t intsetCountLess<int64_t>(const int64_t *p, uint32_t n, int64_t v) {
+    __m256i vv = _mm256_set1_epi64x(v);
+    uint32_t count = 0, j = 0;
+    for (; j+4 <= n; j += 4) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(p+j));
+        count += __builtin_popcount(_mm256_movemask_pd(
+                    _mm256_castsi256_pd(_mm256_cmpgt_epi64(vv,x))));
+    }
+    for (; j < n; j++) count += p[j] < v;
+    return count;
+}
+
+/* The blocks are always a whole vector: 32 bytes. */
+template <>
+inline int intsetBlockHas<int16_t>(const int16_t *p, uint32_t n, int16_t v) {
+    (void)n;
+    __m256i x = _mm256_loadu_si256((const __m256i*)p);
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi16(x,_mm256_set1_epi16(v))) != 0;
+}
+
+template <>
+inline int intsetBlockHas<int32_t>(const int32_t *p, uint32_t n, int32_t v) {
+    (void)n;
+    __m256i x = _mm256_loadu_si256((const __m256i*)p);
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi32(x,_mm256_set1_epi32(v))) != 0;
+}
+
+template <>
+inline int intsetBlockHas<int64_t>(const int64_t *p, uint32_t n, int64_t v) {
+    (void)n;
+    __m256i x = _mm256_loadu_si256((const __m256i*)p);
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi64(x,_mm256_set1_epi64x(v))) != 0;
+}
+#endif
+
+/* Return the position of the first element of a[0..len-1] that is not
+ * smaller than v. The halving steps compile to conditional moves, so the
+ * search does not pay for the mispredicted branches of a classic binary
+ * search, half of the comparisons of which go either way. */
+template <typename T>
+static inline uint32_t intsetLowerBound(const T *a, uint32_t len, T v) {
+    const T *base = a;
+    uint32_t n = len;
+
+    while (n > INTSET_SEARCH_WINDOW) {
+        uint32_t half = n/2;
+        base = (base[half] < v) ? base+half : base;
+        n -= half;
+    }
+    return (base-a) + intsetCountLess(base,n,v);
+}
+
+/* Store in dst the elements of both a[0..m-1] and b[0..n-1] in ascending
+ * order, returning their number. The caller passes the smaller array as 'a'
+ * and makes room in dst for m elements. */
+template <typename A, typename B, typename R>
+static uint32_t intsetIntersectArrays(const A *a, uint32_t m,
+                                      const B *b, uint32_t n, R *dst)
+{
+    uint32_t i = 0, j = 0, k = 0;
+
+    if (m == 0 || n == 0) return 0;
+
+    /* Very different sizes: look up every element of 'a' in what is left of
+     * 'b'. Elements of 'a' in the range of 'b' fit in the type of 'b'. */
+    if (n/m >= INTSET_GALLOP_RATIO) {
+        int64_t last = b[n-1];
+        for (; i < m && j < n; i++) {
+            int64_t x = a[i];
+            if (x > last) break;
+            if (x < b[j]) continue;
+            j += intsetLowerBound(b+j,n-j,(B)x);
+            if (b[j] == x) dst[k++] = (R)x;
+        }
+        return k;
+    }
+
+#if defined(__AVX2__)
+    /* Same element size: skip 'b' one vector at a time, comparing every
+     * element of 'a' with the whole vector that may contain it. */
+    if (sizeof(A) == sizeof(B)) {
+        const uint32_t lanes = 32/sizeof(B);
+        while (i < m && j+lanes <= n) {
+            B x = (B)a[i];
+            if (b[j+lanes-1] < x) {
+                j += lanes;
+                continue;
+            }
+            if (intsetBlockHas(b+j,lanes,x)) dst[k++] = (R)x;
+            i++;
+        }
+    }
+#endif
+
+    /* Merge with no unpredictable branch: the store is undone by not moving
+     * 'k' when the two elements are different. */
+    while (i < m && j < n) {
+        int64_t x = a[i], y = b[j];
+        dst[k] = (R)x;
+        k += (x == y);
+        i += (x <= y);
+        j += (y <= x);
+    }
+    return k;
+}
+#endif
+
 /* Search for the position of "value". Return 1 when the value was found and
  * sets "pos" to the position of the value within the intset. Return 0 when
  * the value is not present in the intset and sets "pos" to the position
  * where "value" can be inserted. */
 uint8_t intset::intsetSearch(int64_t value, uint32_t *pos) {
-    int min = 0, max = intrev32ifbe(length)-1, mid = -1;
-    int64_t cur = -1;
-
     /* The value can never be found when the set is empty */
     if (intrev32ifbe(length) == 0) {
         if (pos) *pos = 0;
@@ -138,6 +305,23 @@ uint8_t intset::intsetSearch(int64_t value, uint32_t *pos) {
         }
     }
 
+#ifdef INTSET_TYPED_ACCESS
+    /* The value is in the range of the set, so it fits its encoding and
+     * the lower bound is a valid position. */
+    uint32_t len = intrev32ifbe(length), lb;
+    uint8_t enc = intrev32ifbe(encoding);
+    if (enc == INTSET_ENC_INT64)
+        lb = intsetLowerBound((const int64_t*)contents,len,(int64_t)value);
+    else if (enc == INTSET_ENC_INT32)
+        lb = intsetLowerBound((const int32_t*)contents,len,(int32_t)value);
+    else
+        lb = intsetLowerBound((const int16_t*)contents,len,(int16_t)value);
+    if (pos) *pos = lb;
+    return _intsetGet(lb) == value;
+#else
+    int min = 0, max = intrev32ifbe(length)-1, mid = -1;
+    int64_t cur = -1;
+
     while(max >= min) {
         mid = ((unsigned int)min + (unsigned int)max) >> 1;
         cur = _intsetGet(mid);
@@ -157,6 +341,7 @@ uint8_t intset::intsetSearch(int64_t value, uint32_t *pos) {
         if (pos) *pos = min;
         return 0;
     }
+#endif
 }
 
 /* Upgrades the intset to a larger encoding and inserts the given integer. */
@@ -262,6 +447,65 @@ uint8_t intset::intsetFind(int64_t value) {
     return valenc <= intrev32ifbe(encoding) && intsetSearch(value,NULL);
 }
 
+/* Return a new intset with the elements that are in both 'a' and 'b'. */
+intset *intset::intsetIntersect(intset *a, intset *b) {
+    if (intrev32ifbe(a->length) > intrev32ifbe(b->length)) {
+        intset *t = a; a = b; b = t;
+    }
+
+    uint32_t m = intrev32ifbe(a->length), n = intrev32ifbe(b->length), k = 0;
+    uint8_t aenc = intrev32ifbe(a->encoding), benc = intrev32ifbe(b->encoding);
+
+    /* The common elements fit the smaller of the two encodings. */
+    intset *is = intset::intsetNew();
+    is->encoding = intrev32ifbe(aenc < benc ? aenc : benc);
+    is = intset::intsetResize(is,m);
+
+#ifdef INTSET_TYPED_ACCESS
+#define INTSET_INTERSECT_B(A,R) do { \
+    if (benc == INTSET_ENC_INT64) \
+        k = intsetIntersectArrays((const A*)a->contents,m, \
+                (const int64_t*)b->contents,n,(R*)is->contents); \
+    else if (benc == INTSET_ENC_INT32) \
+        k = intsetIntersectArrays((const A*)a->contents,m, \
+                (const int32_t*)b->contents,n,(R*)is->contents); \
+    else \
+        k = intsetIntersectArrays((const A*)a->contents,m, \
+                (const int16_t*)b->contents,n,(R*)is->contents); \
+} while(0)
+
+    uint8_t enc = intrev32ifbe(is->encoding);
+    if (aenc == INTSET_ENC_INT64) {
+        if (enc == INTSET_ENC_INT64) INTSET_INTERSECT_B(int64_t,int64_t);
+        else if (enc == INTSET_ENC_INT32) INTSET_INTERSECT_B(int64_t,int32_t);
+        else INTSET_INTERSECT_B(int64_t,int16_t);
+    } else if (aenc == INTSET_ENC_INT32) {
+        if (enc == INTSET_ENC_INT32) INTSET_INTERSECT_B(int32_t,int32_t);
+        else INTSET_INTERSECT_B(int32_t,int16_t);
+    } else {
+        INTSET_INTERSECT_B(int16_t,int16_t);
+    }
+#undef INTSET_INTERSECT_B
+#else
+    uint32_t i = 0, j = 0;
+    while (i < m && j < n) {
+        int64_t x = a->_intsetGet(i), y = b->_intsetGet(j);
+        if (x < y) {
+            i++;
+        } else if (x > y) {
+            j++;
+        } else {
+            is->_intsetSet(k++,x);
+            i++;
+            j++;
+        }
+    }
+#endif
+
+    is->length = intrev32ifbe(k);
+    return intset::intsetResize(is,k);
+}
+
 /* Return random member */
 int64_t intset::intsetRandom() {
     return _intsetGet(rand()%intrev32ifbe(length));
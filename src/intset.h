@@ -48,6 +48,7 @@ public:
     static intset *intsetAdd(intset *is, int64_t value, uint8_t *success);
     static intset *intsetRemove(intset *is, int64_t value, int *success);
     static intset *intsetResize(intset *is, uint32_t len);
+    static intset *intsetIntersect(intset *a, intset *b);
 
 private:
     int64_t _intsetGetEncoded(int pos, uint8_t enc);
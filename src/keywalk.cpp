@@ -0,0 +1,106 @@
+/* Parallel walk of the keyspace.
+ *
+ * The cursor space of dictScan() is split into partitions (see
+ * dictScanPartition()) that a few threads scan at the same time, calling a
+ * function for every key. The walk is meant for read only analysis jobs,
+ * such as computing memory and key size statistics, that would take much
+ * longer if performed with a single thread or with SCAN from a client.
+ *
+ * The caller must make sure the keyspace is not modified during the walk:
+ * the main thread waits for the walk to complete, and a forked child can
+ * walk its copy of the dataset. The walk function must not touch anything
+ * shared between the threads other than in a read only way: no lookupKey(),
+ * that updates the access time of the object, no dictFind(), that performs
+ * rehashing steps, and no changes to the refcount of objects.
+ */
+
+#include "server.h"
+#include "atomicvar.h"
+#include <pthread.h>
+
+/* Every thread scans about this number of partitions, taking the next one
+ * when done with the previous, so that the threads finish at about the same
+ * time even if the keys are not evenly distributed. */
+#define KEYSPACE_WALK_PARTITIONS_PER_THREAD 16
+
+struct keyspaceWalkJob {
+    dict *d;
+    unsigned long partitions;
+    unsigned long next;         /* Next partition to scan. */
+    keyspaceWalkFunction *fn;
+};
+
+struct keyspaceWalkThread {
+    keyspaceWalkJob *job;
+    void *privdata;
+};
+
+static void keyspaceWalkScanCallback(void *privdata, const dictEntry *de) {
+    keyspaceWalkThread *t = (keyspaceWalkThread *)privdata;
+    t->job->fn(t->privdata,(sds)de->dictGetKey(),(robj *)de->dictGetVal());
+}
+
+static void *keyspaceWalkThreadMain(void *arg) {
+    keyspaceWalkThread *t = (keyspaceWalkThread *)arg;
+    keyspaceWalkJob *job = t->job;
+    unsigned long partition;
+
+    while(1) {
+        atomicGetIncr(job->next,partition,1);
+        if (partition >= job->partitions) break;
+        job->d->dictScanPartition(partition,job->partitions,
+                                  keyspaceWalkScanCallback,t);
+    }
+    return NULL;
+}
+
+/* Call 'fn' for every key of 'db' using up to 'numthreads' threads, the
+ * calling thread included. The keys scanned by the thread 'j' are passed to
+ * 'fn' together with privdata[j], so that every thread can accumulate its
+ * results without any locking. The function returns when all the keys were
+ * visited. Returns the number of threads actually used, always at least one
+ * since if no thread can be created the caller does all the work. */
+int keyspaceWalk(redisDb *db, int numthreads, keyspaceWalkFunction *fn,
+                 void **privdata)
+{
+    keyspaceWalkJob job;
+    keyspaceWalkThread threads[KEYSPACE_WALK_MAX_THREADS];
+    pthread_t tids[KEYSPACE_WALK_MAX_THREADS];
+    unsigned long maxpart = db->m_dict->dictScanMaxPartitions();
+    int created = 0, j;
+
+    if (numthreads < 1) numthreads = 1;
+    if (numthreads > KEYSPACE_WALK_MAX_THREADS)
+        numthreads = KEYSPACE_WALK_MAX_THREADS;
+
+    job.d = db->m_dict;
+    job.fn = fn;
+    job.next = 0;
+    job.partitions = 1;
+    while (job.partitions < (unsigned long)numthreads*
+                            KEYSPACE_WALK_PARTITIONS_PER_THREAD &&
+           job.partitions*2 <= maxpart)
+    {
+        job.partitions *= 2;
+    }
+    if (job.partitions < (unsigned long)numthreads)
+        numthreads = (int)job.partitions;
+    if (db->m_dict->dictSize() == 0) return 1;
+
+    for (j = 0; j < numthreads; j++) {
+        threads[j].job = &job;
+        threads[j].privdata = privdata[j];
+    }
+    for (j = 1; j < numthreads; j++) {
+        if (pthread_create(&tids[j-1],NULL,keyspaceWalkThreadMain,
+                           &threads[j]) != 0)
+        {
+            serverLog(LL_WARNING,"Can't create keyspace walk thread: %s", strerror(errno));
+            break;
+        }
+        created++;
+    }
+    keyspaceWalkThreadMain(&threads[0]);
+    for (j = 0; j < created; j++) pthread_join(tids[j],NULL);
+    return created+1;
+}
@@ -34,6 +34,8 @@
  */
 
 #include "server.h"
+#include "hugepages.h"
+#include <math.h>
 
 /* Dictionary type for latency events. */
 int dictStringKeyCompare(void *privdata, const void *key1, const void *key2) {
@@ -375,8 +377,8 @@ sds createLatencyReport() {
         report = sdscatlen(report,"\n",1);
     }
 
-    /* Add non event based advices. */
-    if (THPGetAnonHugePagesSize() > 0) {
+    /* Add non event based advices. Huge pages are wanted with huge-pages. */
+    if (!hugePagesActive() && THPGetAnonHugePagesSize() > 0) {
         advise_disable_thp = 1;
         advices++;
     }
@@ -466,6 +468,72 @@ sds createLatencyReport() {
     return report;
 }
 
+/* ------------------------- Latency histograms ---------------------------- */
+
+/* Return the bucket of the latency histograms counting 'usec'. */
+int latencyHistIndex(long long usec) {
+    int bits;
+
+    if (usec < 8) return usec < 0 ? 0 : usec;
+    bits = 63-__builtin_clzll(usec);
+    if (bits > 40) return LATENCY_HIST_LEN-1;
+    return 8+(bits-3)*4+((usec >> (bits-2)) & 3);
+}
+
+/* The highest value counted by the bucket 'idx'. */
+long long latencyHistValue(int idx) {
+    int bits, sub;
+
+    if (idx < 8) return idx;
+    bits = (idx-8)/4+3;
+    sub = (idx-8)%4;
+    return ((long long)(4+sub+1) << (bits-2))-1;
+}
+
+/* Return the 'perc' percentile of the 'count' samples of the histogram
+ * 'buckets', whose highest sample is 'max'. */
+long long latencyHistPercentile(const uint32_t *buckets, long long count,
+                                long long max, double perc)
+{
+    long long rank = (long long)ceil(count*perc/100), seen = 0;
+    int j;
+
+    if (count == 0) return 0;
+    for (j = 0; j < LATENCY_HIST_LEN; j++) {
+        seen += buckets[j];
+        if (seen >= rank) break;
+    }
+    if (j == LATENCY_HIST_LEN) return max;
+    long long value = latencyHistValue(j);
+    return value < max ? value : max;
+}
+
+void latencyHistogramAdd(struct latencyHistogram *h, long long usec) {
+    h->count++;
+    if (usec > h->max) h->max = usec;
+    h->buckets[latencyHistIndex(usec)]++;
+}
+
+/* Append to 'info' the percentiles of the commands latency, for the INFO
+ * latencystats section. */
+sds genLatencyStatsInfoString(sds info) {
+    dictEntry *de;
+    dictIterator di(server.commands, 1);
+
+    while((de = di.dictNext()) != NULL) {
+        struct redisCommand *cmd = (struct redisCommand *)de->dictGetVal();
+        struct latencyHistogram *h = cmd->latency_hist;
+        if (h == NULL || h->count == 0) continue;
+        info = sdscatprintf(info,
+            "latency_percentiles_usec_%s:p50=%lld,p99=%lld,p99.9=%lld\r\n",
+            cmd->name,
+            latencyHistPercentile(h->buckets,h->count,h->max,50),
+            latencyHistPercentile(h->buckets,h->count,h->max,99),
+            latencyHistPercentile(h->buckets,h->count,h->max,99.9));
+    }
+    return info;
+}
+
 /* ---------------------- Latency command implementation -------------------- */
 
 /* latencyCommand() helper to produce a time-delay reply for all the samples
@@ -551,12 +619,45 @@ sds latencyCommandGenSparkeline(char *event, latencyTimeSeries *ts) {
     return graph;
 }
 
+/* latencyCommand() helper for LATENCY HISTOGRAM: reply with the calls,
+ * the percentiles and the non empty buckets of the histogram of 'cmd',
+ * as pairs of the bucket upper bound in microseconds and the cumulative
+ * count of the calls taking up to that time. */
+void latencyCommandReplyWithHistogram(client *c, struct redisCommand *cmd) {
+    struct latencyHistogram *h = cmd->latency_hist;
+
+    c->addReplyBulkCString(cmd->name);
+    c->addReplyMultiBulkLen(10);
+    c->addReplyBulkCString("calls");
+    c->addReplyLongLong(h->count);
+    c->addReplyBulkCString("p50");
+    c->addReplyLongLong(latencyHistPercentile(h->buckets,h->count,h->max,50));
+    c->addReplyBulkCString("p99");
+    c->addReplyLongLong(latencyHistPercentile(h->buckets,h->count,h->max,99));
+    c->addReplyBulkCString("p99.9");
+    c->addReplyLongLong(latencyHistPercentile(h->buckets,h->count,h->max,99.9));
+    c->addReplyBulkCString("histogram_usec");
+
+    void *replylen = c->addDeferredMultiBulkLength();
+    long long seen = 0;
+    int buckets = 0;
+    for (int j = 0; j < LATENCY_HIST_LEN; j++) {
+        if (h->buckets[j] == 0) continue;
+        seen += h->buckets[j];
+        c->addReplyLongLong(latencyHistValue(j));
+        c->addReplyLongLong(seen);
+        buckets++;
+    }
+    c->setDeferredMultiBulkLength(replylen,buckets*2);
+}
+
 /* LATENCY command implementations.
  *
  * LATENCY SAMPLES: return time-latency samples for the specified event.
  * LATENCY LATEST: return the latest latency for all the events classes.
  * LATENCY DOCTOR: returns an human readable analysis of instance latency.
  * LATENCY GRAPH: provide an ASCII graph of the latency of the specified event.
+ * LATENCY HISTOGRAM [command ...]: the latency histograms of the commands.
  */
 void latencyCommand(client *c) {
     latencyTimeSeries *ts;
@@ -589,6 +690,31 @@ void latencyCommand(client *c) {
 
         c->addReplyBulkCBuffer(report,sdslen(report));
         sdsfree(report);
+    } else if (!strcasecmp((const char*)c->m_argv[1]->ptr,"histogram")) {
+        /* LATENCY HISTOGRAM [command ...] */
+        void *replylen = c->addDeferredMultiBulkLength();
+        int j, commands = 0;
+
+        if (c->m_argc == 2) {
+            dictEntry *de;
+            dictIterator di(server.commands, 1);
+            while((de = di.dictNext()) != NULL) {
+                struct redisCommand *cmd = (struct redisCommand *)de->dictGetVal();
+                if (cmd->latency_hist == NULL || cmd->latency_hist->count == 0)
+                    continue;
+                latencyCommandReplyWithHistogram(c,cmd);
+                commands++;
+            }
+        } else {
+            for (j = 2; j < c->m_argc; j++) {
+                struct redisCommand *cmd = lookupCommand((sds)c->m_argv[j]->ptr);
+                if (cmd == NULL || cmd->latency_hist == NULL ||
+                    cmd->latency_hist->count == 0) continue;
+                latencyCommandReplyWithHistogram(c,cmd);
+                commands++;
+            }
+        }
+        c->setDeferredMultiBulkLength(replylen,commands*2);
     } else if (!strcasecmp((const char*)c->m_argv[1]->ptr,"reset") && c->m_argc >= 2) {
         /* LATENCY RESET */
         if (c->m_argc == 2) {
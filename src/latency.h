@@ -61,9 +61,23 @@ struct latencyStats {
     time_t period;          /* Number of seconds since first event and now. */
 };
 
+/* Log-linear histogram of latencies in microseconds: one bucket for every
+ * value from 0 to 7, then 4 buckets per power of two, so that the error of
+ * the reported percentiles is below 25%, up to 2^41 microseconds. */
+#define LATENCY_HIST_LEN 160
+struct latencyHistogram {
+    long long count;    /* Number of samples. */
+    long long max;      /* Max sample, to clamp the last bucket. */
+    uint32_t buckets[LATENCY_HIST_LEN];
+};
+
 void latencyMonitorInit();
 void latencyAddSample(char *event, mstime_t latency);
 int THPIsEnabled();
+int latencyHistIndex(long long usec);
+long long latencyHistValue(int idx);
+long long latencyHistPercentile(const uint32_t *buckets, long long count, long long max, double perc);
+void latencyHistogramAdd(struct latencyHistogram *h, long long usec);
 
 /* Latency monitoring macros. */
 
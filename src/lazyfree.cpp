@@ -2,9 +2,24 @@
 #include "bio.h"
 #include "atomicvar.h"
 #include "cluster.h"
+#include "snapshot.h"
 
 static size_t lazyfree_objects = 0;
+static size_t lazyfreed_objects = 0;
 pthread_mutex_t lazyfree_objects_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t lazyfreed_objects_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Huge databases are freed in chunks of this many buckets, every one a low
+ * priority job, so that all the lazyfree threads can work on them while the
+ * other jobs are still served. */
+#define LAZYFREE_CHUNK_BUCKETS 65536
+
+/* A database freed in chunks. The last chunk to complete releases it. */
+struct lazyfreeDatabase {
+    dict *ht1, *ht2;
+    pthread_mutex_t mutex;
+    unsigned long chunks_left;  /* Chunk jobs not completed yet. */
+};
 
 /* Return the number of currently pending objects to free. */
 size_t lazyfreeGetPendingObjectsCount() {
@@ -13,6 +28,87 @@ size_t lazyfreeGetPendingObjectsCount() {
     return aux;
 }
 
+/* Return the number of objects freed by the lazyfree threads since the
+ * start or the last CONFIG RESETSTAT. */
+size_t lazyfreeGetFreedObjectsCount() {
+    size_t aux;
+    atomicGet(lazyfreed_objects,aux);
+    return aux;
+}
+
+void lazyfreeResetStats() {
+    atomicSet(lazyfreed_objects,0);
+}
+
+/* Called by the lazyfree threads once 'count' objects are released. */
+static void lazyfreeDoneObjects(size_t count) {
+    atomicDecr(lazyfree_objects,count);
+    atomicIncr(lazyfreed_objects,count);
+}
+
+/* Release objects from the lazyfree thread. It's just decrRefCount()
+ * updating the count of objects to release. */
+static void lazyfreeFreeObject(void *args[]) {
+    robj *o = (robj *) args[0];
+    decrRefCount(o);
+    lazyfreeDoneObjects(1);
+}
+
+/* Release a database from the lazyfree thread. The two dictionaries are
+ * the ones which were substituted with fresh ones in the main thread when
+ * the database was logically deleted, and the expire and key indexes go
+ * along with the expires and keys tables, see emptyDbAsync(). */
+static void lazyfreeFreeDatabase(void *args[]) {
+    dict *ht1 = (dict *) args[0];
+    dict *ht2 = (dict *) args[1];
+    size_t numkeys = ht1->dictSize();
+
+    if (ht1->m_privdata) raxFree((rax *)ht1->m_privdata);
+    dictRelease(ht1);
+    if (ht2->m_privdata) raxFree((rax *)ht2->m_privdata);
+    dictRelease(ht2);
+    lazyfreeDoneObjects(numkeys);
+}
+
+/* Free a range of buckets of a database freed in chunks. */
+static void lazyfreeFreeDatabaseChunk(void *args[]) {
+    lazyfreeDatabase *ld = (lazyfreeDatabase *) args[0];
+    unsigned long start = (unsigned long) args[1];
+    unsigned long end = start+LAZYFREE_CHUNK_BUCKETS, left;
+
+    lazyfreeDoneObjects(ld->ht1->dictClearBuckets(start,end));
+    ld->ht2->dictClearBuckets(start,end);
+
+    pthread_mutex_lock(&ld->mutex);
+    left = --ld->chunks_left;
+    pthread_mutex_unlock(&ld->mutex);
+    if (left) return;
+
+    if (ld->ht1->m_privdata) raxFree((rax *)ld->ht1->m_privdata);
+    dictReleaseCleared(ld->ht1);
+    if (ld->ht2->m_privdata) raxFree((rax *)ld->ht2->m_privdata);
+    dictReleaseCleared(ld->ht2);
+    pthread_mutex_destroy(&ld->mutex);
+    zfree(ld);
+}
+
+/* Release the old table of a rehashed dictionary. */
+static void lazyfreeFreeOldTable(void *args[]) {
+    zfree(args[0]);
+    lazyfreeDoneObjects(1);
+}
+
+/* Release the dictionaries mapping Redis Cluster slots to keys in the
+ * lazyfree thread. The keys belong to the main dictionary, so only the
+ * tables are freed here. */
+static void lazyfreeFreeSlotsMap(void *args[]) {
+    dict **slots = (dict **) args[0];
+    for (int j = 0; j < CLUSTER_SLOTS; j++)
+        if (slots[j]) dictRelease(slots[j]);
+    zfree(slots);
+    lazyfreeDoneObjects(1);
+}
+
 /* Return the amount of work needed in order to free an object.
  * The return value is not always the actual number of allocations the
  * object is compoesd of, but a number proportional to it.
@@ -30,107 +126,138 @@ size_t lazyfreeGetPendingObjectsCount() {
  * representing the list. */
 size_t lazyfreeGetFreeEffort(robj *obj)
 {
-    if (obj->type == OBJ_LIST) {
+    if (obj->encoding == OBJ_ENCODING_LAZY) {
+        return (size_t)1; /* Not loaded yet, see lazy-loading. */
+    } else if (obj->type == OBJ_LIST) {
         quicklist *ql = (quicklist *)obj->ptr;
         return (size_t)ql->m_num_ql_nodes;
     } else if (obj->type == OBJ_SET && obj->encoding == OBJ_ENCODING_HT) {
         dict *ht = (dict *)obj->ptr;
         return (size_t)ht->dictSize();
+    } else if (obj->type == OBJ_SET && obj->encoding == OBJ_ENCODING_ROARING) {
+        /* The containers are few, but as big as their elements. */
+        roaring *r = (roaring *)obj->ptr;
+        return (size_t)r->roaringLen();
     } else if (obj->type == OBJ_ZSET && obj->encoding == OBJ_ENCODING_SKIPLIST){
         zset *zs = (zset *)obj->ptr;
         return (size_t)zs->zsl->length();
+    } else if (obj->type == OBJ_ZSET && obj->encoding == OBJ_ENCODING_BTREE){
+        zset *zs = (zset *)obj->ptr;
+        return (size_t)zs->zbt->length();
     } else if (obj->type == OBJ_HASH && obj->encoding == OBJ_ENCODING_HT) {
         dict *ht = (dict *)obj->ptr;
         return (size_t)ht->dictSize();
+    } else if (obj->type == OBJ_STREAM) {
+        stream *s = (stream *)obj->ptr;
+        return (size_t)s->rax->numele; /* One listpack per node. */
     } else {
         return (size_t)1; /* Everything else is a single allocation. */
     }
 }
 
-/* Delete a key, value, and associated expiration entry if any, from the DB.
- * If there are enough allocations to free the value object may be put into
- * a lazy free list instead of being freed synchronously. The lazy free list
- * will be reclaimed in a different bio.c thread. */
+/* If the value is composed of a few allocations, to free in a lazy way
+ * is actually just slower... So under a certain limit we just free
+ * the object synchronously. */
 #define LAZYFREE_THRESHOLD 64
-int dbAsyncDelete(redisDb *db, robj *key) {
-    /* Deleting an entry from the expires dict will not free the sds of
-     * the key, because it is shared with the main dictionary. */
-    if (db->m_expires->dictSize() > 0) db->m_expires->dictDelete(key->ptr);
 
-    /* If the value is composed of a few allocations, to free in a lazy way
-     * is actually just slower... So under a certain limit we just free
-     * the object synchronously. */
+/* Hand 'val', a value removed from the keyspace, over to the lazyfree
+ * threads if releasing it is too much work: past LAZYFREE_THRESHOLD if
+ * 'lazy' is set, past lazyfree-auto-threshold otherwise, so that no command
+ * stalls freeing a huge value even without the lazyfree options. Return 1
+ * if the value was handed over, so the caller must forget it, 0 if the
+ * caller has to free it as usual. */
+int lazyfreeFreeObjectIfNeeded(robj *val, int lazy) {
+    size_t threshold = lazy ? LAZYFREE_THRESHOLD :
+                              (size_t)server.lazyfree_auto_threshold;
+
+    /* A shared value is only released when the last reference goes. */
+    if (threshold == 0 || val->refcount != 1) return 0;
+    if (lazyfreeGetFreeEffort(val) <= threshold) return 0;
+    atomicIncr(lazyfree_objects,1);
+    bioCreateLazyFreeJob(lazyfreeFreeObject,0,1,val);
+    return 1;
+}
+
+/* Delete a key, value, and associated expiration entry if any, from the DB.
+ * If there are enough allocations to free the value object may be put into
+ * a lazy free list instead of being freed synchronously, see
+ * lazyfreeFreeObjectIfNeeded(). The lazy free list will be reclaimed in a
+ * different bio.c thread. */
+int dbGenericDelete(redisDb *db, robj *key, int lazy) {
+    if (server.rdb_snapshot) snapshotPreserveKey(db,key);
     dictEntry *de = db->m_dict->dictUnlink(key->ptr);
-    if (de) {
-        robj* val = (robj*)de->dictGetVal();
-        size_t free_effort = lazyfreeGetFreeEffort(val);
-
-        /* If releasing the object is too much work, let's put it into the
-         * lazy free list. */
-        if (free_effort > LAZYFREE_THRESHOLD) {
-            atomicIncr(lazyfree_objects,1);
-            bioCreateBackgroundJob(BIO_LAZY_FREE,val,NULL,NULL);
-            db->m_dict->dictSetVal(de,NULL);
-        }
-    }
+    if (de == NULL) return 0;
+
+    /* The expires dictionary borrows the entry: remove it from there before
+     * releasing the entry. */
+    dbRemoveEntryExpire(db,de);
 
     /* Release the key-val pair, or just the key if we set the val
      * field to NULL in order to lazy free it later. */
-    if (de) {
-        db->m_dict->dictFreeUnlinkedEntry(de);
-        if (server.cluster_enabled) slotToKeyDel(key);
-        return 1;
-    } else {
-        return 0;
-    }
+    if (lazyfreeFreeObjectIfNeeded((robj*)de->dictGetVal(),lazy))
+        db->m_dict->dictSetVal(de,NULL);
+    if (server.cluster_enabled) slotToKeyDel(db,(sds)de->dictGetKey());
+    if (db->m_keys_index) keyIndexDel(db,(sds)de->dictGetKey());
+    db->m_dict->dictFreeUnlinkedEntry(de);
+    return 1;
+}
+
+int dbAsyncDelete(redisDb *db, robj *key) {
+    return dbGenericDelete(db,key,1);
 }
 
 /* Empty a Redis DB asynchronously. What the function does actually is to
  * create a new empty set of hash tables and scheduling the old ones for
- * lazy freeing. */
+ * lazy freeing. Huge tables are split in chunks of buckets freed by
+ * separate jobs. */
 void emptyDbAsync(redisDb *db) {
     dict *oldht1 = db->m_dict, *oldht2 = db->m_expires;
-    db->m_dict = dictCreate(&dbDictType,NULL);
-    db->m_expires = dictCreate(&keyptrDictType,NULL);
+    db->m_dict = sdsDictCreate(&dbDictType,NULL);
+    db->m_expires = sdsDictCreate(&keyptrDictType,NULL);
+
+    /* The expire index goes along with the old expires table, in its
+     * private data, see lazyfreeFreeDatabase(). */
+    if (db->m_expires_index) {
+        oldht2->m_privdata = db->m_expires_index;
+        db->m_expires_index = raxNew();
+    }
+    if (db->m_keys_index) {
+        oldht1->m_privdata = db->m_keys_index;
+        db->m_keys_index = raxNew();
+    }
     atomicIncr(lazyfree_objects,oldht1->dictSize());
-    bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,oldht1,oldht2);
-}
 
-/* Empty the slots-keys map of Redis CLuster by creating a new empty one
- * and scheduiling the old for lazy freeing. */
-void slotToKeyFlushAsync() {
-    rax *old = server.cluster->m_slots_to_keys;
+    unsigned long buckets = oldht1->dictBuckets();
+    if (oldht2->dictBuckets() > buckets) buckets = oldht2->dictBuckets();
+    if (buckets <= LAZYFREE_CHUNK_BUCKETS) {
+        bioCreateLazyFreeJob(lazyfreeFreeDatabase,0,2,oldht1,oldht2);
+        return;
+    }
 
-    server.cluster->m_slots_to_keys = raxNew();
-    memset(server.cluster->m_slots_keys_count,0,
-           sizeof(server.cluster->m_slots_keys_count));
-    atomicIncr(lazyfree_objects,old->numele);
-    bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,NULL,old);
+    lazyfreeDatabase *ld = (lazyfreeDatabase*)zmalloc(sizeof(*ld));
+    ld->ht1 = oldht1;
+    ld->ht2 = oldht2;
+    pthread_mutex_init(&ld->mutex,NULL);
+    ld->chunks_left = (buckets+LAZYFREE_CHUNK_BUCKETS-1)/LAZYFREE_CHUNK_BUCKETS;
+    for (unsigned long start = 0; start < buckets; start += LAZYFREE_CHUNK_BUCKETS)
+        bioCreateLazyFreeJob(lazyfreeFreeDatabaseChunk,BIO_JOB_LOW_PRIORITY,
+                             2,ld,(void*)start);
 }
 
-/* Release objects from the lazyfree thread. It's just decrRefCount()
- * updating the count of objects to release. */
-void lazyfreeFreeObjectFromBioThread(robj *o) {
-    decrRefCount(o);
-    atomicDecr(lazyfree_objects,1);
-}
+/* Empty the slots-keys dictionaries of Redis Cluster, scheduling the old
+ * ones for lazy freeing. They are created again as keys are added. */
+void slotToKeyFlushAsync(redisDb *db) {
+    dict **old = db->m_slots_to_keys;
 
-/* Release a database from the lazyfree thread. The 'db' pointer is the
- * database which was substituted with a fresh one in the main thread
- * when the database was logically deleted. 'sl' is a skiplist used by
- * Redis Cluster in order to take the hash slots -> keys mapping. This
- * may be NULL if Redis Cluster is disabled. */
-void lazyfreeFreeDatabaseFromBioThread(dict *ht1, dict *ht2) {
-    size_t numkeys = ht1->dictSize();
-    dictRelease(ht1);
-    dictRelease(ht2);
-    atomicDecr(lazyfree_objects,numkeys);
+    if (old == NULL) return;
+    db->m_slots_to_keys = NULL;
+    atomicIncr(lazyfree_objects,1);
+    bioCreateLazyFreeJob(lazyfreeFreeSlotsMap,0,1,old);
 }
 
-/* Release the skiplist mapping Redis Cluster keys to slots in the
- * lazyfree thread. */
-void lazyfreeFreeSlotsMapFromBioThread(rax *rt) {
-    size_t len = rt->numele;
-    raxFree(rt);
-    atomicDecr(lazyfree_objects,len);
+/* Free the old table of a dictionary that finished rehashing in the lazyfree
+ * thread. This is the callback set with dictSetFreeTableCallback(). */
+void lazyfreeFreeTable(void *table) {
+    atomicIncr(lazyfree_objects,1);
+    bioCreateLazyFreeJob(lazyfreeFreeOldTable,0,1,table);
 }
@@ -0,0 +1,316 @@
+/* Lazy loading of the RDB file at startup.
+ *
+ * Loading a big RDB file takes minutes, and the clients can't be served
+ * meanwhile. With lazy-loading the file loaded at startup is only indexed:
+ * it is mapped in memory (see rioMmapIO) and read just as much as needed to
+ * find the keys, that are added to the databases with their expire times,
+ * while their values are placeholders of the OBJ_ENCODING_LAZY encoding
+ * referencing the value in the mapped file.
+ *
+ * - lookupKey() loads the value the first time the key is accessed,
+ *   converting the placeholder in place, so that the object keeps its
+ *   LRU/LFU data and the references to it.
+ * - The few code paths accessing the values without lookupKey(), like the
+ *   RDB and AOF serialization or DEBUG DIGEST, load them as well. Freeing a
+ *   placeholder just forgets it.
+ * - serverCron() loads the values not accessed yet in the background, using
+ *   at most LAZY_CPU_PERCENT of the time of the main thread. The databases
+ *   are scanned collecting LAZY_BATCH placeholders at a time, that are
+ *   loaded sorted by offset, so that the file is read mostly in order.
+ *
+ * The file is unmapped when no placeholder is left. Indexing still reads the
+ * whole file, since the RDB format doesn't store the length of the values,
+ * but that is just reading lengths and skipping payloads, without
+ * decompressing strings or allocating the objects. The values of module
+ * types and the chunks of rdb-save-threads are loaded while indexing.
+ *
+ * The values moved to the tiering file by tier.cpp are placeholders as well,
+ * flagged LAZY_TIERED, that this file loads in the same way when accessed.
+ *
+ * The values can be loaded by other threads than the main one, the threads
+ * of rdb-save-threads and the module threads reading the dataset: the
+ * conversion of the placeholders is serialized by a mutex.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "lazyload.h"
+#include "tier.h"
+#include "atomicvar.h"
+#include <sys/stat.h>
+
+static struct {
+    rioMmapIO *map;                 /* The RDB file, NULL if released. */
+    int indexing;                   /* The file is being indexed. */
+    unsigned long long pending;     /* Placeholders not loaded yet. */
+    unsigned long long loaded;      /* Values loaded from the file. */
+    int dbid;                       /* DB scanned by lazyLoadCron(). */
+    unsigned long cursor;
+    pthread_mutex_t mutex;
+} lazy = {NULL,0,0,0,0,0,PTHREAD_MUTEX_INITIALIZER};
+
+/* The type of the objects loaded from values of type 'rdbtype'. */
+static int lazyObjectType(int rdbtype) {
+    switch(rdbtype) {
+    case RDB_TYPE_STRING:
+        return OBJ_STRING;
+    case RDB_TYPE_LIST:
+    case RDB_TYPE_LIST_ZIPLIST:
+    case RDB_TYPE_LIST_QUICKLIST:
+    case RDB_TYPE_LIST_QUICKLIST_2:
+        return OBJ_LIST;
+    case RDB_TYPE_SET:
+    case RDB_TYPE_SET_INTSET:
+    case RDB_TYPE_SET_ROARING:
+        return OBJ_SET;
+    case RDB_TYPE_ZSET:
+    case RDB_TYPE_ZSET_2:
+    case RDB_TYPE_ZSET_ZIPLIST:
+    case RDB_TYPE_ZSET_LISTPACK:
+        return OBJ_ZSET;
+    case RDB_TYPE_STREAM_LISTPACKS:
+        return OBJ_STREAM;
+    default:
+        return OBJ_HASH;
+    }
+}
+
+/* Release the file once all the values were loaded. */
+static void lazyLoadRelease() {
+    delete lazy.map;
+    lazy.map = NULL;
+    serverLog(LL_NOTICE,"Lazy loading finished: %llu values loaded.",
+        lazy.loaded);
+}
+
+/* Index the RDB file 'filename' as rdbLoad() would load it, but leaving the
+ * values in the file. The file is loaded as usual if it can't be mapped. */
+int lazyLoadRdb(char *filename, rdbSaveInfo *rsi) {
+    struct stat sb;
+    FILE *fp;
+    int retval;
+
+    if ((fp = fopen(filename,"r")) == NULL) return C_ERR;
+    rioMmapIO *map = new rioMmapIO(fileno(fp));
+    if (!map->rioMmapIsValid() || fstat(fileno(fp),&sb) == -1 ||
+        (uintmax_t)sb.st_size > (UINTPTR_MAX >> LAZY_TYPE_BITS))
+    {
+        serverLog(LL_WARNING,"The RDB file can't be mapped: lazy-loading "
+                             "disabled, loading the whole file.");
+        delete map;
+        fclose(fp);
+        return rdbLoad(filename,rsi);
+    }
+
+    startLoading(fp);
+    lazy.map = map;
+    lazy.indexing = 1;
+    retval = rdbLoadRio(map,rsi);
+    lazy.indexing = 0;
+    fclose(fp);
+    stopLoading();
+
+    map->rioMmapRandomAccess();
+    serverLog(LL_NOTICE,"RDB file indexed: %llu values will be loaded lazily.",
+        lazy.pending);
+    if (lazy.pending == 0) lazyLoadRelease();
+    return retval;
+}
+
+/* Return non zero while rdbLoadRio() should index the values. */
+int lazyLoadIndexing() {
+    return lazy.indexing;
+}
+
+/* Skip the value of type 'rdbtype' the file is positioned at, returning the
+ * placeholder referencing it, or NULL on short read. */
+robj *lazyLoadCreateObject(rio *rdb, int rdbtype) {
+    uintptr_t offset = rdb->rioTell();
+
+    if (rdbSkipObject(rdb,rdbtype) == -1) return NULL;
+    robj *o = createObject(lazyObjectType(rdbtype),
+                           (void*)((offset << LAZY_TYPE_BITS) | rdbtype));
+    o->encoding = OBJ_ENCODING_LAZY;
+    lazy.pending++;
+    return o;
+}
+
+/* Convert the placeholder 'o' into the object 'val', if it still references
+ * 'ref'. The embedded strings can't be moved to another object, and the
+ * shared integers are just copied. The pointer is set before the encoding,
+ * that the other threads check without the mutex. Must be called with the
+ * mutex locked. */
+static int lazyLoadConvertLocked(robj *o, uintptr_t ref, robj *val) {
+    if (o->encoding != OBJ_ENCODING_LAZY || (uintptr_t)o->ptr != ref)
+        return 0;
+    if (val->type == OBJ_STRING && val->encoding == OBJ_ENCODING_EMBSTR) {
+        o->ptr = sdsnewlen(val->ptr,sdslen((sds)val->ptr));
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        o->encoding = OBJ_ENCODING_RAW;
+        decrRefCount(val);
+    } else {
+        o->ptr = val->ptr;
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        o->encoding = val->encoding;
+        if (val->refcount != OBJ_SHARED_REFCOUNT) zfree(val);
+    }
+    return 1;
+}
+
+/* Load the value of the placeholder 'o', converting it in place into the
+ * object loaded. Nothing is done if another thread already loaded it. */
+void lazyLoadValue(robj *o) {
+    pthread_mutex_lock(&lazy.mutex);
+    if (o->encoding == OBJ_ENCODING_LAZY) {
+        uintptr_t ref = (uintptr_t)o->ptr;
+        robj *val;
+
+        if (ref & LAZY_TIERED) {
+            val = tierLoadValue(ref);
+        } else {
+            rioMmapIO rdb(*lazy.map, ref >> LAZY_TYPE_BITS);
+            if ((val = rdbLoadObject(ref & LAZY_RDBTYPE_MASK,&rdb)) == NULL) {
+                serverLog(LL_WARNING,"Can't load the value at offset %llu "
+                    "of the lazily loaded RDB file, that was modified after "
+                    "it was indexed. Exiting.",
+                    (unsigned long long)(ref >> LAZY_TYPE_BITS));
+                exit(1);
+            }
+            atomicDecr(lazy.pending,1);
+            atomicIncr(lazy.loaded,1);
+        }
+        lazyLoadConvertLocked(o,ref,val);
+    }
+    pthread_mutex_unlock(&lazy.mutex);
+}
+
+/* Convert the placeholder 'o' into 'val', a value loaded elsewhere, if it
+ * still references 'ref'. Returns 0 if it doesn't: 'val' is not used. */
+int lazyLoadConvert(robj *o, uintptr_t ref, robj *val) {
+    pthread_mutex_lock(&lazy.mutex);
+    int converted = lazyLoadConvertLocked(o,ref,val);
+    pthread_mutex_unlock(&lazy.mutex);
+    return converted;
+}
+
+/* Make the placeholder 'o' reference 'newref' if it still references 'ref',
+ * returning 0 if it doesn't. */
+int lazyLoadMove(robj *o, uintptr_t ref, uintptr_t newref) {
+    int moved = 0;
+
+    pthread_mutex_lock(&lazy.mutex);
+    if (o->encoding == OBJ_ENCODING_LAZY && (uintptr_t)o->ptr == ref) {
+        o->ptr = (void*)newref;
+        moved = 1;
+    }
+    pthread_mutex_unlock(&lazy.mutex);
+    return moved;
+}
+
+/* Called by decrRefCount() freeing a placeholder. */
+void lazyLoadFreeObject(robj *o) {
+    uintptr_t ref = (uintptr_t)o->ptr;
+
+    if (ref & LAZY_TIERED) tierFreeValue(ref);
+    else atomicDecr(lazy.pending,1);
+}
+
+struct lazyLoadBatch {
+    robj *objects[LAZY_BATCH];
+    int count;
+};
+
+static void lazyLoadScanCallback(void *privdata, const dictEntry *de) {
+    lazyLoadBatch *batch = (lazyLoadBatch *)privdata;
+    robj *o = (robj *)de->dictGetVal();
+
+    /* Values missed when the batch is full are found by the next pass. */
+    if (o->encoding == OBJ_ENCODING_LAZY && !lazyIsTiered(o) &&
+        batch->count < LAZY_BATCH)
+        batch->objects[batch->count++] = o;
+}
+
+static int lazyLoadCompareOffsets(const void *a, const void *b) {
+    uintptr_t ra = (uintptr_t)(*(robj **)a)->ptr;
+    uintptr_t rb = (uintptr_t)(*(robj **)b)->ptr;
+    return (ra > rb) - (ra < rb);
+}
+
+/* Load in the background the values not accessed yet, called by
+ * serverCron(). Like the active defrag, it pauses while a child is saving,
+ * so that the pages of the parent are not copied. */
+void lazyLoadCron() {
+    static lazyLoadBatch batch;
+    unsigned long long pending;
+    long long start, timelimit;
+
+    if (lazy.map == NULL) return;
+    atomicGet(lazy.pending,pending);
+    if (pending == 0) {
+        lazyLoadRelease();
+        return;
+    }
+    if (server.rdb_child_pid != -1 || server.aof_child_pid != -1) return;
+
+    start = ustime();
+    timelimit = 1000000*LAZY_CPU_PERCENT/server.hz/100;
+    if (timelimit <= 0) timelimit = 1;
+    do {
+        batch.count = 0;
+        do {
+            redisDb *db = server.db+lazy.dbid;
+            lazy.cursor = db->m_dict->dictScan(lazy.cursor,
+                lazyLoadScanCallback, NULL, &batch);
+            if (lazy.cursor == 0) {
+                lazy.dbid = (lazy.dbid+1) % server.dbnum;
+                if (lazy.dbid == 0) break; /* Full pass. */
+            }
+        } while (batch.count < LAZY_BATCH);
+
+        qsort(batch.objects,batch.count,sizeof(robj*),lazyLoadCompareOffsets);
+        for (int j = 0; j < batch.count; j++)
+            lazyLoadValue(batch.objects[j]);
+    } while (batch.count && ustime()-start < timelimit);
+}
+
+sds genLazyLoadInfoString(sds info) {
+    unsigned long long pending, loaded;
+
+    atomicGet(lazy.pending,pending);
+    atomicGet(lazy.loaded,loaded);
+    return sdscatprintf(info,
+        "lazy_loading:%d\r\n"
+        "lazy_loading_pending_keys:%llu\r\n"
+        "lazy_loading_loaded_keys:%llu\r\n",
+        lazy.map != NULL,
+        lazy.map ? pending : 0,
+        loaded);
+}
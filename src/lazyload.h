@@ -0,0 +1,58 @@
+/* lazyload.h -- lazy loading of the RDB file at startup, header file.
+ * See lazyload.cpp for more information.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __LAZYLOAD_H
+#define __LAZYLOAD_H
+
+/* The lazy values reference the RDB type and the offset of the value in
+ * the file: (offset << LAZY_TYPE_BITS) | flags | rdbtype. The values moved
+ * to the tiering file (see tier.cpp) are lazy values as well. */
+#define LAZY_TYPE_BITS 8
+#define LAZY_RDBTYPE_MASK 0x1f
+#define LAZY_TIERED (1<<7)    /* In the tiering file, not in the RDB file. */
+#define LAZY_TIER_GEN (1<<6)  /* Generation of the tiering file. */
+#define lazyIsTiered(o) ((uintptr_t)(o)->ptr & LAZY_TIERED)
+#define LAZY_CPU_PERCENT 25   /* Main thread time used to load the values. */
+#define LAZY_BATCH 1024       /* Values collected and loaded in file order. */
+
+int lazyLoadRdb(char *filename, rdbSaveInfo *rsi);
+int lazyLoadIndexing();
+robj *lazyLoadCreateObject(rio *rdb, int rdbtype);
+void lazyLoadValue(robj *o);
+int lazyLoadConvert(robj *o, uintptr_t ref, robj *val);
+int lazyLoadMove(robj *o, uintptr_t ref, uintptr_t newref);
+void lazyLoadFreeObject(robj *o);
+void lazyLoadCron();
+sds genLazyLoadInfoString(sds info);
+
+#endif
@@ -204,7 +204,7 @@ int lpStringToInt64(const char *s, unsigned long slen, int64_t *value) {
 /* Create a new, empty listpack.
  * On success the new listpack is returned, otherwise an error is returned. */
 unsigned char *lpNew() {
-    unsigned char *lp = lp_malloc(LP_HDR_SIZE+1);
+    unsigned char *lp = (unsigned char *)lp_malloc(LP_HDR_SIZE+1);
     if (lp == NULL) return NULL;
     lpSetTotalBytes(lp,LP_HDR_SIZE+1);
     lpSetNumElements(lp,0);
@@ -657,7 +657,7 @@ unsigned char *lpInsert(unsigned char *lp, unsigned char *ele, uint32_t size, un
 
     /* Realloc before: we need more room. */
     if (new_listpack_bytes > old_listpack_bytes) {
-        if ((lp = lp_realloc(lp,new_listpack_bytes)) == NULL) return NULL;
+        if ((lp = (unsigned char *)lp_realloc(lp,new_listpack_bytes)) == NULL) return NULL;
         dst = lp + poff;
     }
 
@@ -674,7 +674,7 @@ unsigned char *lpInsert(unsigned char *lp, unsigned char *ele, uint32_t size, un
 
     /* Realloc after: we need to free space. */
     if (new_listpack_bytes < old_listpack_bytes) {
-        if ((lp = lp_realloc(lp,new_listpack_bytes)) == NULL) return NULL;
+        if ((lp = (unsigned char *)lp_realloc(lp,new_listpack_bytes)) == NULL) return NULL;
         dst = lp + poff;
     }
 
@@ -781,3 +781,187 @@ unsigned char *lpSeek(unsigned char *lp, long index) {
     }
 }
 
+
+/* Insert the specified element 'ele' of length 'len' at the head of the
+ * listpack. Like lpAppend() the return value is the same as lpInsert(). */
+unsigned char *lpPrepend(unsigned char *lp, unsigned char *ele, uint32_t size) {
+    unsigned char *p = lpFirst(lp);
+    if (p == NULL) return lpAppend(lp,ele,size);
+    return lpInsert(lp,ele,size,p,LP_BEFORE,NULL);
+}
+
+/* Delete 'num' consecutive elements starting at the zero-based (or negative,
+ * see lpSeek()) 'index', with a single memmove and reallocation. If there
+ * are less than 'num' elements after 'index' all of them are deleted.
+ * Returns the resulting listpack. */
+unsigned char *lpDeleteRange(unsigned char *lp, long index, unsigned long num) {
+    uint32_t bytes = lpGetTotalBytes(lp);
+    uint32_t numele = lpGetNumElements(lp);
+    unsigned long deleted = 0;
+    unsigned char *p, *q;
+
+    if (num == 0 || (p = lpSeek(lp,index)) == NULL) return lp;
+    q = p;
+    while (deleted < num && q[0] != LP_EOF) {
+        q = lpSkip(q);
+        deleted++;
+    }
+
+    /* Move the tail, EOF byte included, over the deleted elements. */
+    memmove(p,q,(lp+bytes)-q);
+    bytes -= q-p;
+    lpSetTotalBytes(lp,bytes);
+    if (numele != LP_HDR_NUMELE_UNKNOWN)
+        lpSetNumElements(lp,numele-deleted);
+    return (unsigned char *)lp_realloc(lp,bytes);
+}
+
+/* Get the element pointed by 'p' with the same calling convention of
+ * ziplistGet(): if the element is a string '*sval' is set to point to it,
+ * inside the listpack, and '*slen' to its length, otherwise '*sval' is set
+ * to NULL and '*lval' to the integer value. Returns 0 if 'p' is NULL,
+ * otherwise 1. */
+int lpGetValue(unsigned char *p, unsigned char **sval, unsigned int *slen, long long *lval) {
+    int64_t count;
+
+    if (p == NULL) return 0;
+    *sval = lpGet(p,&count,NULL);
+    if (*sval)
+        *slen = (unsigned int)count;
+    else
+        *lval = count;
+    return 1;
+}
+
+/* Return 1 if the element pointed by 'p' is equal to the string 's' of
+ * length 'slen', otherwise 0. Integer encoded elements are compared by
+ * value, so "10" matches an element stored as integer 10. */
+int lpCompare(unsigned char *p, unsigned char *s, uint32_t slen) {
+    unsigned char *value;
+    int64_t count, sval;
+
+    if (p[0] == LP_EOF) return 0;
+    value = lpGet(p,&count,NULL);
+    if (value) return count == slen && memcmp(value,s,slen) == 0;
+    return lpStringToInt64((const char*)s,slen,&sval) && sval == count;
+}
+
+/* Find the element equal to the string 's' of length 'slen' starting the
+ * search at 'p'. After every compared element 'skip' elements are skipped,
+ * so that only the fields of a field/value listpack are compared.
+ * Returns the pointer to the element found, or NULL. */
+unsigned char *lpFind(unsigned char *lp, unsigned char *p, unsigned char *s, uint32_t slen, unsigned int skip) {
+    unsigned int skipcnt = 0;
+    int sencoding = 0; /* 0: not tried yet, 1: integer, 2: not an integer. */
+    int64_t sval = 0;
+
+    while (p) {
+        if (skipcnt == 0) {
+            int64_t count;
+            unsigned char *value = lpGet(p,&count,NULL);
+
+            if (value) {
+                if (count == slen && memcmp(value,s,slen) == 0) return p;
+            } else {
+                /* Convert the searched string to an integer only once, the
+                 * first time an integer encoded element is found. */
+                if (sencoding == 0)
+                    sencoding = lpStringToInt64((const char*)s,slen,&sval) ?
+                                1 : 2;
+                if (sencoding == 1 && count == sval) return p;
+            }
+            skipcnt = skip;
+        } else {
+            skipcnt--;
+        }
+        p = lpNext(lp,p);
+    }
+    return NULL;
+}
+
+/* Print a human readable representation of the listpack on stdout, used
+ * by DEBUG LISTPACK. */
+void lpRepr(unsigned char *lp) {
+    unsigned char *p, *vstr;
+    int64_t vlen;
+    int index = 0;
+
+    printf("{total bytes %u} {num entries %u}\n",
+        lpGetTotalBytes(lp), lpLength(lp));
+    p = lpFirst(lp);
+    while(p) {
+        uint32_t encsize = lpCurrentEncodedSize(p);
+        unsigned long backlen = lpEncodeBacklen(NULL,encsize);
+
+        printf(
+            "{\n"
+                "\taddr 0x%08lx,\n"
+                "\tindex %2d,\n"
+                "\toffset %5lu,\n"
+                "\tencoded len: %5u,\n"
+                "\tbacklen: %2lu,\n",
+            (long unsigned)p,
+            index,
+            (unsigned long) (p-lp),
+            encsize,
+            backlen);
+        vstr = lpGet(p,&vlen,NULL);
+        if (vstr) {
+            printf("\t[str]");
+            if (vlen > 40) {
+                if (fwrite(vstr,40,1,stdout) == 0) perror("fwrite");
+                printf("...");
+            } else {
+                if (vlen && fwrite(vstr,vlen,1,stdout) == 0) perror("fwrite");
+            }
+        } else {
+            printf("\t[int]%lld", (long long) vlen);
+        }
+        printf("\n}\n");
+        p = lpNext(lp,p);
+        index++;
+    }
+    printf("{end}\n\n");
+}
+
+/* Merge the listpacks '*first' and '*second' appending the elements of
+ * '*second' to the ones of '*first'. To move as few bytes as possible the
+ * bigger listpack is reallocated and the other one is freed: the pointer
+ * of the freed listpack is set to NULL and the other one to the merged
+ * listpack, that is also returned. Returns NULL without changing anything
+ * if the merge is not possible. */
+unsigned char *lpMerge(unsigned char **first, unsigned char **second) {
+    if (first == NULL || *first == NULL || second == NULL || *second == NULL)
+        return NULL;
+    if (*first == *second) return NULL;
+
+    unsigned char *a = *first, *b = *second, *target;
+    uint32_t abytes = lpGetTotalBytes(a), bbytes = lpGetTotalBytes(b);
+    uint32_t anum = lpGetNumElements(a), bnum = lpGetNumElements(b);
+    uint64_t num, bytes = (uint64_t)abytes+bbytes-LP_HDR_SIZE-1;
+    int append = abytes >= bbytes;
+
+    if (bytes > UINT32_MAX) return NULL;
+    if (append) {
+        /* Overwrite the EOF of 'a' with the elements and EOF of 'b'. */
+        target = (unsigned char *)lp_realloc(a,bytes);
+        memcpy(target+abytes-1,b+LP_HDR_SIZE,bbytes-LP_HDR_SIZE);
+        lp_free(b);
+    } else {
+        /* Make room for the elements of 'a' before the ones of 'b'. */
+        target = (unsigned char *)lp_realloc(b,bytes);
+        memmove(target+abytes-1,target+LP_HDR_SIZE,bbytes-LP_HDR_SIZE);
+        memcpy(target+LP_HDR_SIZE,a+LP_HDR_SIZE,abytes-LP_HDR_SIZE-1);
+        lp_free(a);
+    }
+
+    num = (uint64_t)anum+bnum;
+    if (anum == LP_HDR_NUMELE_UNKNOWN || bnum == LP_HDR_NUMELE_UNKNOWN ||
+        num >= LP_HDR_NUMELE_UNKNOWN)
+        num = LP_HDR_NUMELE_UNKNOWN;
+    lpSetTotalBytes(target,bytes);
+    lpSetNumElements(target,num);
+    *first = append ? target : NULL;
+    *second = append ? NULL : target;
+    return target;
+}
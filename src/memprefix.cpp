@@ -0,0 +1,276 @@
+/* Keyspace memory profiler by key prefix.
+ *
+ * MEMORY USAGE reports the memory of a single key, and redis-cli --bigkeys
+ * the biggest key of every type, but neither tells which key prefixes, that
+ * is often which tenants or applications, own the memory. When
+ * memory-prefixes-scan-keys is not zero serverCron() walks all the databases
+ * with dictScan(), scanning about that many keys every call, and accounts
+ * every key to the part of its name before memory-prefixes-delimiter: the
+ * number of keys, their estimated memory and how many expire within a
+ * minute, an hour, a day or later.
+ *
+ * Since the walk is incremental the keys modified while it is in progress
+ * may be accounted with their old or new value, or, rarely, twice: the
+ * figures are estimates, like the ones of MEMORY USAGE. MEMORY PREFIXES
+ * reports the last complete walk, or the walk in progress before the first
+ * one completes.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "memprefix.h"
+
+static memPrefixProfile *memPrefixCreateProfile(void) {
+    memPrefixProfile *profile = (memPrefixProfile *)zcalloc(sizeof(*profile));
+    profile->prefixes = raxNew();
+    profile->start_time = mstime();
+    return profile;
+}
+
+static void memPrefixFreeProfile(memPrefixProfile *profile) {
+    if (profile == NULL) return;
+    raxFreeWithCallback(profile->prefixes,zfree);
+    zfree(profile);
+}
+
+static void memPrefixFreeProfiler(memPrefixProfiler *p) {
+    memPrefixFreeProfile(p->current);
+    memPrefixFreeProfile(p->last);
+    zfree(p);
+}
+
+/* Create the profiler if memory-prefixes-scan-keys is not zero, or release
+ * it otherwise. With 'reset' the results collected so far are discarded,
+ * since they were accounted with a different delimiter. */
+void memPrefixInit(int reset) {
+    memPrefixProfiler *p = server.memprefix;
+
+    if (p && (reset || server.memory_prefixes_scan_keys == 0)) {
+        memPrefixFreeProfiler(p);
+        server.memprefix = p = NULL;
+    }
+    if (p == NULL && server.memory_prefixes_scan_keys) {
+        p = (memPrefixProfiler *)zcalloc(sizeof(*p));
+        p->current = memPrefixCreateProfile();
+        server.memprefix = p;
+    }
+}
+
+static void memPrefixAccount(memPrefixStats *stats, size_t bytes, int ttl) {
+    stats->keys++;
+    stats->bytes += bytes;
+    stats->ttl[ttl]++;
+}
+
+/* Account the key of the dict entry 'de' of the DB being walked. */
+static void memPrefixScanCallback(void *privdata, const dictEntry *de) {
+    memPrefixProfiler *p = (memPrefixProfiler *)privdata;
+    memPrefixProfile *profile = p->current;
+    redisDb *db = server.db+p->dbid;
+    sds key = (sds)de->dictGetKey();
+    robj *val = (robj *)de->dictGetVal();
+    const char *delim = server.memory_prefixes_delimiter;
+    size_t bytes, keylen = sdslen(key);
+    mstime_t when;
+    int ttl = MEMPREFIX_TTL_NONE;
+    char *sep;
+
+    bytes = sdsAllocSize(key)+db->m_dict->dictEntrySize()+
+            objectComputeSize(val,OBJ_COMPUTE_SIZE_DEF_SAMPLES);
+    if ((when = dbGetEntryExpire(db,de)) != -1) {
+        mstime_t left = when-mstime();
+        bytes += db->m_expires->dictSlotSize();
+        if (left < 60*1000) ttl = MEMPREFIX_TTL_MINUTE;
+        else if (left < 3600*1000) ttl = MEMPREFIX_TTL_HOUR;
+        else if (left < 86400*1000) ttl = MEMPREFIX_TTL_DAY;
+        else ttl = MEMPREFIX_TTL_LATER;
+    }
+    profile->keys++;
+
+    sep = (char*)memmem(key,keylen,delim,strlen(delim));
+    if (sep == NULL) {
+        memPrefixAccount(&profile->noprefix,bytes,ttl);
+        return;
+    }
+
+    size_t prefixlen = sep-key;
+    void *stats = raxFind(profile->prefixes,(unsigned char*)key,prefixlen);
+    if (stats == raxNotFound) {
+        if (profile->prefixes->numele >= MEMPREFIX_MAX_PREFIXES) {
+            memPrefixAccount(&profile->other,bytes,ttl);
+            return;
+        }
+        stats = zcalloc(sizeof(memPrefixStats));
+        raxInsert(profile->prefixes,(unsigned char*)key,prefixlen,stats,NULL);
+    }
+    memPrefixAccount((memPrefixStats *)stats,bytes,ttl);
+}
+
+/* Called by serverCron(): scan about memory-prefixes-scan-keys keys, moving
+ * to the next DB when the walk of the current one completes. After the last
+ * DB the walk in progress becomes the one reported by MEMORY PREFIXES. */
+void memPrefixCron(void) {
+    memPrefixProfiler *p = server.memprefix;
+    long long budget = server.memory_prefixes_scan_keys;
+
+    if (p == NULL) return;
+    while (budget > 0) {
+        redisDb *db = server.db+p->dbid;
+        unsigned long long scanned = p->current->keys;
+
+        if (db->m_dict->dictSize()) {
+            p->cursor = db->m_dict->dictScan(p->cursor,memPrefixScanCallback,
+                                             NULL,p);
+        } else {
+            p->cursor = 0;
+        }
+        /* Empty buckets and DBs cost something too. */
+        scanned = p->current->keys-scanned;
+        budget -= scanned ? scanned : 1;
+        if (p->cursor != 0) continue;
+
+        if (++p->dbid == server.dbnum) {
+            p->current->end_time = mstime();
+            memPrefixFreeProfile(p->last);
+            p->last = p->current;
+            p->current = memPrefixCreateProfile();
+            p->dbid = 0;
+            p->walks++;
+            break;
+        }
+    }
+}
+
+static void addReplyMemPrefixStats(client *c, memPrefixStats *stats) {
+    c->addReplyMultiBulkLen(14);
+    c->addReplyBulkCString("keys");
+    c->addReplyLongLong(stats->keys);
+    c->addReplyBulkCString("bytes");
+    c->addReplyLongLong(stats->bytes);
+    c->addReplyBulkCString("ttl.none");
+    c->addReplyLongLong(stats->ttl[MEMPREFIX_TTL_NONE]);
+    c->addReplyBulkCString("ttl.1m");
+    c->addReplyLongLong(stats->ttl[MEMPREFIX_TTL_MINUTE]);
+    c->addReplyBulkCString("ttl.1h");
+    c->addReplyLongLong(stats->ttl[MEMPREFIX_TTL_HOUR]);
+    c->addReplyBulkCString("ttl.1d");
+    c->addReplyLongLong(stats->ttl[MEMPREFIX_TTL_DAY]);
+    c->addReplyBulkCString("ttl.later");
+    c->addReplyLongLong(stats->ttl[MEMPREFIX_TTL_LATER]);
+}
+
+/* A prefix of the reply of MEMORY PREFIXES. */
+struct memPrefixReplyEntry {
+    sds prefix;
+    memPrefixStats *stats;
+};
+
+static int memPrefixCompareBytes(const void *a, const void *b) {
+    const memPrefixReplyEntry *ea = (const memPrefixReplyEntry *)a,
+                              *eb = (const memPrefixReplyEntry *)b;
+    if (ea->stats->bytes == eb->stats->bytes) return 0;
+    return ea->stats->bytes > eb->stats->bytes ? -1 : 1;
+}
+
+/* MEMORY PREFIXES [COUNT <count>]
+ *
+ * Report the walk completed last, or the one in progress if none completed
+ * yet: whether the walk is complete, the age of its end in milliseconds, the
+ * keys scanned, and the statistics of the 'count' prefixes using the most
+ * memory, of the keys without a prefix and of the keys of the prefixes that
+ * were not tracked since they were too many. */
+void memoryPrefixesCommand(client *c) {
+    memPrefixProfiler *p = server.memprefix;
+    long long count = MEMPREFIX_DEFAULT_COUNT;
+    memPrefixProfile *profile;
+    memPrefixReplyEntry *entries;
+    size_t n = 0;
+
+    for (int j = 2; j < c->m_argc; j++) {
+        if (!strcasecmp((const char*)c->m_argv[j]->ptr,"count") &&
+            j+1 < c->m_argc)
+        {
+            if (getLongLongFromObjectOrReply(c,c->m_argv[j+1],&count,NULL)
+                 == C_ERR) return;
+            if (count < 1) {
+                c->addReplyError("COUNT must be > 0");
+                return;
+            }
+            j++;
+        } else {
+            c->addReply(shared.syntaxerr);
+            return;
+        }
+    }
+    if (p == NULL) {
+        c->addReplyError("The memory profiler is disabled, "
+                         "set memory-prefixes-scan-keys to enable it");
+        return;
+    }
+
+    profile = p->last ? p->last : p->current;
+    entries = (memPrefixReplyEntry *)zmalloc(sizeof(*entries)*
+                                    (profile->prefixes->numele+1));
+    raxIterator ri;
+    raxStart(&ri,profile->prefixes);
+    raxSeek(&ri,"^",NULL,0);
+    while (raxNext(&ri)) {
+        entries[n].prefix = sdsnewlen(ri.key,ri.key_len);
+        entries[n].stats = (memPrefixStats *)ri.data;
+        n++;
+    }
+    raxStop(&ri);
+    qsort(entries,n,sizeof(*entries),memPrefixCompareBytes);
+
+    size_t reply = n < (size_t)count ? n : (size_t)count;
+    c->addReplyMultiBulkLen(14);
+    c->addReplyBulkCString("complete");
+    c->addReplyLongLong(profile->end_time != 0);
+    c->addReplyBulkCString("age.ms");
+    c->addReplyLongLong(profile->end_time ? mstime()-profile->end_time : 0);
+    c->addReplyBulkCString("walks");
+    c->addReplyLongLong(p->walks);
+    c->addReplyBulkCString("keys");
+    c->addReplyLongLong(profile->keys);
+    c->addReplyBulkCString("prefixes");
+    c->addReplyMultiBulkLen(reply*2);
+    for (size_t j = 0; j < reply; j++) {
+        c->addReplyBulkCBuffer(entries[j].prefix,sdslen(entries[j].prefix));
+        addReplyMemPrefixStats(c,entries[j].stats);
+    }
+    c->addReplyBulkCString("no.prefix");
+    addReplyMemPrefixStats(c,&profile->noprefix);
+    c->addReplyBulkCString("other");
+    addReplyMemPrefixStats(c,&profile->other);
+
+    for (size_t j = 0; j < n; j++) sdsfree(entries[j].prefix);
+    zfree(entries);
+}
@@ -0,0 +1,78 @@
+/* memprefix.h -- keyspace memory profiler by key prefix API header file
+ * See memprefix.cpp for more information.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __MEMPREFIX_H
+#define __MEMPREFIX_H
+
+#define MEMPREFIX_MAX_PREFIXES 4096 /* The keys of more prefixes are "other". */
+#define MEMPREFIX_DEFAULT_COUNT 10  /* Prefixes returned by MEMORY PREFIXES. */
+
+/* Keys accounted by TTL: without TTL, expiring within a minute, an hour,
+ * a day, and later. */
+#define MEMPREFIX_TTL_NONE 0
+#define MEMPREFIX_TTL_MINUTE 1
+#define MEMPREFIX_TTL_HOUR 2
+#define MEMPREFIX_TTL_DAY 3
+#define MEMPREFIX_TTL_LATER 4
+#define MEMPREFIX_TTL_BUCKETS 5
+
+struct memPrefixStats {
+    unsigned long long keys;
+    unsigned long long bytes;       /* Estimated memory used by the keys. */
+    unsigned long long ttl[MEMPREFIX_TTL_BUCKETS];
+};
+
+/* The result of a walk of all the databases. */
+struct memPrefixProfile {
+    rax *prefixes;                  /* Prefix -> memPrefixStats. */
+    memPrefixStats noprefix;        /* Keys without the delimiter. */
+    memPrefixStats other;           /* Keys of the prefixes over the limit. */
+    unsigned long long keys;        /* Keys scanned. */
+    mstime_t start_time;
+    mstime_t end_time;              /* Zero while the walk is in progress. */
+};
+
+struct memPrefixProfiler {
+    memPrefixProfile *current;      /* Walk in progress. */
+    memPrefixProfile *last;         /* Last complete walk, or NULL. */
+    int dbid;                       /* DB scanned by the walk in progress. */
+    unsigned long cursor;           /* dictScan() cursor of the DB. */
+    unsigned long long walks;       /* Walks completed. */
+};
+
+/* Exported API */
+void memPrefixInit(int reset);
+void memPrefixCron(void);
+void memoryPrefixesCommand(client *c);
+
+#endif
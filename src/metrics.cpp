@@ -0,0 +1,326 @@
+/* Metrics endpoint.
+ *
+ * With metrics-port set, a thread serves on that port a Prometheus text
+ * format page with the main counters of INFO, the calls and the latency
+ * histogram of every command, the latency monitor events and the keys of
+ * every DB. The page is built by the main thread once per second and
+ * published to the thread, that only ever copies it: scraping the metrics,
+ * however often and by however many agents, never goes through the command
+ * path nor competes with the clients for the main thread.
+ *
+ * The server does not speak HTTP beyond what scrapers need: a GET request
+ * of / or /metrics is answered with the page and the connection is closed.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "latency.h"
+#include "placement.h"
+#include <pthread.h>
+#include <sys/socket.h>
+
+#define METRICS_REQUEST_MAX 4096    /* Bytes of the request we read. */
+#define METRICS_IO_TIMEOUT 1        /* Seconds to read or write a scrape. */
+
+/* Upper bounds, in microseconds, of the buckets of the command latency
+ * histograms: they match bucket bounds of struct latencyHistogram, that
+ * end at 2^n-1, so that the cumulative counts are exact. */
+static const int metricsHistBits[] = {4,6,8,10,12,14,16,18,20,22};
+
+static pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+static sds metrics_page = NULL;    /* Last page published, or NULL. */
+
+/* -----------------------------------------------------------------------------
+ * Page generation (main thread)
+ * -------------------------------------------------------------------------- */
+
+static sds metricsHeader(sds s, const char *name, const char *type,
+                         const char *help)
+{
+    return sdscatprintf(s,"# HELP %s %s\n# TYPE %s %s\n",name,help,name,type);
+}
+
+static sds metricsAdd(sds s, const char *name, const char *type,
+                      const char *help, long long value)
+{
+    s = metricsHeader(s,name,type,help);
+    return sdscatprintf(s,"%s %lld\n",name,value);
+}
+
+/* Append the latency histogram 'h' of the command 'name'. */
+static sds metricsAddHistogram(sds s, const char *name,
+                               struct latencyHistogram *h, long long usec)
+{
+    long long seen = 0;
+    int idx = 0;
+
+    for (size_t j = 0; j < sizeof(metricsHistBits)/sizeof(int); j++) {
+        long long bound = (1LL << metricsHistBits[j])-1;
+
+        while (h && idx < LATENCY_HIST_LEN && latencyHistValue(idx) <= bound)
+            seen += h->buckets[idx++];
+        s = sdscatprintf(s,
+            "redis_command_duration_seconds_bucket{cmd=\"%s\",le=\"%.6f\"} %lld\n",
+            name,(double)bound/1000000,seen);
+    }
+    s = sdscatprintf(s,
+        "redis_command_duration_seconds_bucket{cmd=\"%s\",le=\"+Inf\"} %lld\n"
+        "redis_command_duration_seconds_sum{cmd=\"%s\"} %.6f\n"
+        "redis_command_duration_seconds_count{cmd=\"%s\"} %lld\n",
+        name,h ? h->count : 0,name,(double)usec/1000000,name,
+        h ? h->count : 0);
+    return s;
+}
+
+static sds metricsGenPage(void) {
+    sds s = sdsempty();
+    dictEntry *de;
+    int j;
+
+    s = metricsAdd(s,"redis_uptime_seconds","gauge",
+        "Seconds since the server started.",
+        (long long)(server.unixtime-server.stat_starttime));
+    s = metricsAdd(s,"redis_connected_clients","gauge",
+        "Connected clients, not counting the slaves.",
+        server.clients->listLength()-server.slaves->listLength());
+    s = metricsAdd(s,"redis_connected_slaves","gauge",
+        "Connected slaves.",server.slaves->listLength());
+    s = metricsAdd(s,"redis_blocked_clients","gauge",
+        "Clients blocked in a blocking command.",
+        server.bpop_blocked_clients);
+    s = metricsAdd(s,"redis_memory_used_bytes","gauge",
+        "Memory allocated by the server.",zmalloc_used_memory());
+    s = metricsAdd(s,"redis_memory_rss_bytes","gauge",
+        "Resident set size of the process.",server.resident_set_size);
+    s = metricsAdd(s,"redis_memory_peak_bytes","gauge",
+        "Peak of the memory allocated by the server.",
+        server.stat_peak_memory);
+    s = metricsAdd(s,"redis_memory_max_bytes","gauge",
+        "The maxmemory setting, 0 if none.",server.maxmemory);
+    s = metricsAdd(s,"redis_commands_processed_total","counter",
+        "Commands processed.",server.stat_numcommands);
+    s = metricsAdd(s,"redis_connections_received_total","counter",
+        "Connections accepted.",server.stat_numconnections);
+    s = metricsAdd(s,"redis_rejected_connections_total","counter",
+        "Connections rejected because of maxclients.",
+        server.stat_rejected_conn);
+    s = metricsAdd(s,"redis_net_input_bytes_total","counter",
+        "Bytes read from the network.",server.stat_net_input_bytes);
+    s = metricsAdd(s,"redis_net_output_bytes_total","counter",
+        "Bytes written to the network.",server.stat_net_output_bytes);
+    s = metricsAdd(s,"redis_expired_keys_total","counter",
+        "Keys expired.",server.stat_expiredkeys);
+    s = metricsAdd(s,"redis_evicted_keys_total","counter",
+        "Keys evicted because of maxmemory.",server.stat_evictedkeys);
+    s = metricsAdd(s,"redis_keyspace_hits_total","counter",
+        "Successful lookups of keys.",server.stat_keyspace_hits);
+    s = metricsAdd(s,"redis_keyspace_misses_total","counter",
+        "Failed lookups of keys.",server.stat_keyspace_misses);
+
+    s = metricsHeader(s,"redis_db_keys","gauge","Keys of the DB.");
+    for (j = 0; j < server.dbnum; j++) {
+        unsigned long keys = server.db[j].m_dict->dictSize();
+        if (keys) s = sdscatprintf(s,"redis_db_keys{db=\"%d\"} %lu\n",j,keys);
+    }
+    s = metricsHeader(s,"redis_db_keys_expiring","gauge",
+        "Keys of the DB with an expire.");
+    for (j = 0; j < server.dbnum; j++) {
+        unsigned long keys = server.db[j].m_expires->dictSize();
+        if (server.db[j].m_dict->dictSize())
+            s = sdscatprintf(s,"redis_db_keys_expiring{db=\"%d\"} %lu\n",
+                             j,keys);
+    }
+
+    s = metricsHeader(s,"redis_command_calls_total","counter",
+        "Calls of the command.");
+    {
+        dictIterator di(server.commands);
+        while((de = di.dictNext()) != NULL) {
+            struct redisCommand *c = (struct redisCommand *)de->dictGetVal();
+            if (!c->calls) continue;
+            s = sdscatprintf(s,"redis_command_calls_total{cmd=\"%s\"} %lld\n",
+                             c->name,c->calls);
+        }
+    }
+    s = metricsHeader(s,"redis_command_duration_seconds","histogram",
+        "Execution time of the command.");
+    {
+        dictIterator di(server.commands);
+        while((de = di.dictNext()) != NULL) {
+            struct redisCommand *c = (struct redisCommand *)de->dictGetVal();
+            if (!c->calls) continue;
+            s = metricsAddHistogram(s,c->name,c->latency_hist,c->microseconds);
+        }
+    }
+
+    s = metricsHeader(s,"redis_latency_spike_last_milliseconds","gauge",
+        "Latest spike of the latency monitor event.");
+    {
+        dictIterator di(server.latency_events);
+        while((de = di.dictNext()) != NULL) {
+            latencyTimeSeries *ts = (latencyTimeSeries *)de->dictGetVal();
+            int last = (ts->idx+LATENCY_TS_LEN-1) % LATENCY_TS_LEN;
+            s = sdscatprintf(s,
+                "redis_latency_spike_last_milliseconds{event=\"%s\"} %u\n",
+                (char *)de->dictGetKey(),ts->samples[last].latency);
+        }
+    }
+    s = metricsHeader(s,"redis_latency_spike_max_milliseconds","gauge",
+        "Highest spike of the latency monitor event.");
+    {
+        dictIterator di(server.latency_events);
+        while((de = di.dictNext()) != NULL) {
+            latencyTimeSeries *ts = (latencyTimeSeries *)de->dictGetVal();
+            s = sdscatprintf(s,
+                "redis_latency_spike_max_milliseconds{event=\"%s\"} %u\n",
+                (char *)de->dictGetKey(),ts->max);
+        }
+    }
+    return s;
+}
+
+/* Called by serverCron() once per second: publish a new page. */
+void metricsCron(void) {
+    if (server.metrics_fd == -1) return;
+
+    sds page = metricsGenPage();
+    pthread_mutex_lock(&metrics_mutex);
+    sds old = metrics_page;
+    metrics_page = page;
+    pthread_mutex_unlock(&metrics_mutex);
+    sdsfree(old);
+}
+
+/* -----------------------------------------------------------------------------
+ * Scrapes (metrics thread)
+ * -------------------------------------------------------------------------- */
+
+static int metricsWriteAll(int fd, const char *buf, size_t len) {
+    while (len) {
+        ssize_t nwritten = write(fd,buf,len);
+        if (nwritten <= 0) {
+            if (nwritten == -1 && errno == EINTR) continue;
+            return -1;
+        }
+        buf += nwritten;
+        len -= nwritten;
+    }
+    return 0;
+}
+
+static void metricsServe(int fd) {
+    char req[METRICS_REQUEST_MAX+1];
+    size_t len = 0;
+    struct timeval tv = {METRICS_IO_TIMEOUT,0};
+
+    setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+    setsockopt(fd,SOL_SOCKET,SO_SNDTIMEO,&tv,sizeof(tv));
+
+    /* Read the request line and the headers. */
+    while (len < METRICS_REQUEST_MAX) {
+        ssize_t nread = read(fd,req+len,METRICS_REQUEST_MAX-len);
+        if (nread <= 0) {
+            if (nread == -1 && errno == EINTR) continue;
+            return;
+        }
+        len += nread;
+        req[len] = '\0';
+        if (strstr(req,"\r\n\r\n") || strstr(req,"\n\n")) break;
+    }
+    req[len] = '\0';
+
+    const char *status = "200 OK";
+    sds body = NULL;
+    if (strncmp(req,"GET ",4) != 0) {
+        status = "405 Method Not Allowed";
+    } else if (strncmp(req+4,"/ ",2) != 0 &&
+               strncmp(req+4,"/metrics ",9) != 0 &&
+               strncmp(req+4,"/metrics?",9) != 0)
+    {
+        status = "404 Not Found";
+    } else {
+        pthread_mutex_lock(&metrics_mutex);
+        if (metrics_page) body = sdsdup(metrics_page);
+        pthread_mutex_unlock(&metrics_mutex);
+        if (body == NULL) status = "503 Service Unavailable";
+    }
+    if (body == NULL) body = sdscatfmt(sdsempty(),"%s\n",status);
+
+    sds reply = sdscatprintf(sdsempty(),
+        "HTTP/1.0 %s\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: close\r\n\r\n",status,sdslen(body));
+    reply = sdscatsds(reply,body);
+    metricsWriteAll(fd,reply,sdslen(reply));
+    sdsfree(reply);
+    sdsfree(body);
+}
+
+static void *metricsThreadMain(void *arg) {
+    UNUSED(arg);
+    setcpuaffinity(server.bio_cpulist);
+    while(1) {
+        int fd = accept(server.metrics_fd,NULL,NULL);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EBADF || errno == EINVAL) break; /* Closed. */
+            usleep(10000); /* Out of file descriptors: retry later. */
+            continue;
+        }
+        metricsServe(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/* Listen to metrics-port, if set, and start the thread serving it. */
+void metricsInit(void) {
+    char err[ANET_ERR_LEN];
+    pthread_t tid;
+
+    server.metrics_fd = -1;
+    if (server.metrics_port == 0) return;
+
+    server.metrics_fd = anetTcpServer(err,server.metrics_port,
+                                      NET_FIRST_BIND_ADDR,server.tcp_backlog);
+    if (server.metrics_fd == ANET_ERR) {
+        serverLog(LL_WARNING,"Could not create the metrics socket on port %d: %s",
+            server.metrics_port,err);
+        exit(1);
+    }
+    metricsCron(); /* Don't serve 503s until the first cron run. */
+    if (pthread_create(&tid,NULL,metricsThreadMain,NULL) != 0) {
+        serverLog(LL_WARNING,"Fatal: Can't initialize the metrics thread.");
+        exit(1);
+    }
+    serverLog(LL_NOTICE,"Serving the metrics on port %d.",server.metrics_port);
+}
@@ -0,0 +1,384 @@
+/* Micro benchmarks of the core data structures.
+ *
+ * A server built with REDIS_TEST defined (see "make microbench") runs them
+ * with "redis-server benchmark <name>|all [count]". Every benchmark times
+ * 'count' operations against dict, sds, ziplist, listpack, quicklist,
+ * intset, rax, skiplist or HyperLogLog, and reports the nanoseconds and the
+ * zmalloc() allocations per operation, so that changes to the encodings can
+ * be compared with numbers. The inputs are generated from a fixed seed, so
+ * that two runs perform exactly the same operations.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "intset.h"
+#include "listpack.h"
+#include <time.h>
+
+#ifdef REDIS_TEST
+
+int hllAdd(robj *o, unsigned char *ele, size_t elesize);
+uint64_t hllCount(struct hllhdr *hdr, int *invalid);
+robj *createHLLObject();
+
+#define MICROBENCH_DEFAULT_COUNT 100000
+#define MICROBENCH_BLOB_ENTRIES 512 /* Entries of a ziplist or listpack. */
+
+/* A benchmark in progress, see benchStart() and benchEnd(). */
+struct benchRun {
+    const char *name;
+    long ops;
+    long long start;    /* Nanoseconds. */
+    size_t allocs;
+};
+
+static long long benchNanoseconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (long long)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+
+static void benchStart(benchRun *b, const char *name, long ops) {
+    b->name = name;
+    b->ops = ops;
+    b->allocs = zmalloc_allocations();
+    b->start = benchNanoseconds();
+}
+
+static void benchEnd(benchRun *b) {
+    long long elapsed = benchNanoseconds()-b->start;
+    size_t allocs = zmalloc_allocations()-b->allocs;
+
+    printf("%-24s %10ld ops %10.1f ns/op %8.2f allocs/op\n", b->name, b->ops,
+        (double)elapsed/b->ops, (double)allocs/b->ops);
+}
+
+/* Keys "key:<n>" for n in 0..count-1, in random order. */
+static sds *benchCreateKeys(long count) {
+    sds *keys = (sds *)zmalloc(sizeof(sds)*count);
+
+    for (long j = 0; j < count; j++) keys[j] = sdscatfmt(sdsempty(),"key:%I",(long long)j);
+    for (long j = count-1; j > 0; j--) {
+        long k = rand() % (j+1);
+        sds tmp = keys[j];
+        keys[j] = keys[k];
+        keys[k] = tmp;
+    }
+    return keys;
+}
+
+static void benchFreeKeys(sds *keys, long count) {
+    for (long j = 0; j < count; j++) sdsfree(keys[j]);
+    zfree(keys);
+}
+
+static void benchScanCallback(void *privdata, const dictEntry *de) {
+    UNUSED(de);
+    (*(long *)privdata)++;
+}
+
+static void benchDict(long count) {
+    sds *keys = benchCreateKeys(count), *lookup = benchCreateKeys(count);
+    sdsDict *d = sdsDictCreate(&setDictType,NULL);
+    unsigned long cursor = 0;
+    long scanned = 0;
+    benchRun b;
+
+    benchStart(&b,"dict-add",count);
+    for (long j = 0; j < count; j++) d->dictAdd(sdsdup(keys[j]),NULL);
+    benchEnd(&b);
+    while (d->dictIsRehashing()) d->dictRehash(100);
+
+    /* Through the dictType functions, and specialized for sds keys. */
+    benchStart(&b,"dict-find",count);
+    for (long j = 0; j < count; j++)
+        serverAssert(static_cast<dict*>(d)->dictFind(lookup[j]));
+    benchEnd(&b);
+
+    benchStart(&b,"dict-find-sds",count);
+    for (long j = 0; j < count; j++) serverAssert(d->dictFind(lookup[j]));
+    benchEnd(&b);
+
+    benchStart(&b,"dict-rehash",count);
+    d->dictExpand(d->dictSize()*4);
+    while (d->dictIsRehashing()) d->dictRehash(100);
+    benchEnd(&b);
+
+    benchStart(&b,"dict-scan",count);
+    do {
+        cursor = d->dictScan(cursor,benchScanCallback,NULL,&scanned);
+    } while (cursor);
+    benchEnd(&b);
+
+    benchStart(&b,"dict-delete",count);
+    for (long j = 0; j < count; j++) d->dictDelete(lookup[j]);
+    benchEnd(&b);
+
+    dictRelease(d);
+    benchFreeKeys(keys,count);
+    benchFreeKeys(lookup,count);
+}
+
+static void benchSds(long count) {
+    sds s = sdsempty();
+    benchRun b;
+
+    benchStart(&b,"sds-new-free",count);
+    for (long j = 0; j < count; j++) sdsfree(sdsnew("a short string"));
+    benchEnd(&b);
+
+    benchStart(&b,"sds-fromlonglong",count);
+    for (long j = 0; j < count; j++) sdsfree(sdsfromlonglong(j));
+    benchEnd(&b);
+
+    benchStart(&b,"sds-catlen",count);
+    for (long j = 0; j < count; j++) s = sdscatlen(s,"0123456789abcdef",16);
+    benchEnd(&b);
+    sdsfree(s);
+}
+
+/* Ziplists and listpacks grow with a realloc() for every entry, so they are
+ * benchmarked as many blobs of MICROBENCH_BLOB_ENTRIES entries. */
+static void benchZiplist(long count) {
+    long blobs = count/MICROBENCH_BLOB_ENTRIES+1;
+    unsigned char **zl = (unsigned char **)zmalloc(sizeof(unsigned char *)*blobs);
+    long ops = blobs*MICROBENCH_BLOB_ENTRIES;
+    char buf[32];
+    benchRun b;
+
+    benchStart(&b,"ziplist-push",ops);
+    for (long j = 0; j < blobs; j++) {
+        zl[j] = ziplistNew();
+        for (int k = 0; k < MICROBENCH_BLOB_ENTRIES; k++) {
+            int len = snprintf(buf,sizeof(buf),"element:%d",k);
+            zl[j] = ziplistPush(zl[j],(unsigned char*)buf,len,ZIPLIST_TAIL);
+        }
+    }
+    benchEnd(&b);
+
+    benchStart(&b,"ziplist-index",ops);
+    for (long j = 0; j < ops; j++)
+        serverAssert(ziplistIndex(zl[j%blobs],rand()%MICROBENCH_BLOB_ENTRIES));
+    benchEnd(&b);
+
+    benchStart(&b,"ziplist-find",ops);
+    for (long j = 0; j < ops; j++) {
+        int len = snprintf(buf,sizeof(buf),"element:%d",
+                           (int)(rand()%MICROBENCH_BLOB_ENTRIES));
+        unsigned char *head = ziplistIndex(zl[j%blobs],0);
+        serverAssert(ziplistFind(head,(unsigned char*)buf,len,0));
+    }
+    benchEnd(&b);
+
+    for (long j = 0; j < blobs; j++) zfree(zl[j]);
+    zfree(zl);
+}
+
+static void benchListpack(long count) {
+    long blobs = count/MICROBENCH_BLOB_ENTRIES+1;
+    unsigned char **lp = (unsigned char **)zmalloc(sizeof(unsigned char *)*blobs);
+    long ops = blobs*MICROBENCH_BLOB_ENTRIES;
+    char buf[32];
+    benchRun b;
+
+    benchStart(&b,"listpack-append",ops);
+    for (long j = 0; j < blobs; j++) {
+        lp[j] = lpNew();
+        for (int k = 0; k < MICROBENCH_BLOB_ENTRIES; k++) {
+            int len = snprintf(buf,sizeof(buf),"element:%d",k);
+            lp[j] = lpAppend(lp[j],(unsigned char*)buf,len);
+        }
+    }
+    benchEnd(&b);
+
+    benchStart(&b,"listpack-seek",ops);
+    for (long j = 0; j < ops; j++)
+        serverAssert(lpSeek(lp[j%blobs],rand()%MICROBENCH_BLOB_ENTRIES));
+    benchEnd(&b);
+
+    benchStart(&b,"listpack-iterate",ops);
+    for (long j = 0; j < blobs; j++) {
+        unsigned char *p = lpFirst(lp[j]);
+        while (p) p = lpNext(lp[j],p);
+    }
+    benchEnd(&b);
+
+    for (long j = 0; j < blobs; j++) lpFree(lp[j]);
+    zfree(lp);
+}
+
+static void benchQuicklist(long count) {
+    quicklist *ql = quicklistCreate();
+    char buf[32];
+    benchRun b;
+
+    benchStart(&b,"quicklist-push",count);
+    for (long j = 0; j < count; j++) {
+        int len = snprintf(buf,sizeof(buf),"element:%ld",j);
+        quicklistPushTail(ql,buf,len);
+    }
+    benchEnd(&b);
+
+    benchStart(&b,"quicklist-index",count);
+    for (long j = 0; j < count; j++) {
+        quicklistEntry entry;
+        serverAssert(entry.quicklistIndex(ql,rand()%count));
+    }
+    benchEnd(&b);
+    quicklistRelease(ql);
+}
+
+static void benchIntset(long count) {
+    intset *is = intset::intsetNew();
+    benchRun b;
+
+    benchStart(&b,"intset-add",count);
+    for (long j = 0; j < count; j++)
+        is = intset::intsetAdd(is,rand()%(count*4),NULL);
+    benchEnd(&b);
+
+    benchStart(&b,"intset-find",count);
+    for (long j = 0; j < count; j++) is->intsetFind(rand()%(count*4));
+    benchEnd(&b);
+    zfree(is);
+}
+
+static void benchRax(long count) {
+    sds *keys = benchCreateKeys(count);
+    rax *r = raxNew();
+    benchRun b;
+
+    benchStart(&b,"rax-insert",count);
+    for (long j = 0; j < count; j++)
+        raxInsert(r,(unsigned char*)keys[j],sdslen(keys[j]),NULL,NULL);
+    benchEnd(&b);
+
+    benchStart(&b,"rax-find",count);
+    for (long j = 0; j < count; j++) {
+        sds key = keys[rand()%count];
+        serverAssert(raxFind(r,(unsigned char*)key,sdslen(key)) != raxNotFound);
+    }
+    benchEnd(&b);
+
+    benchStart(&b,"rax-remove",count);
+    for (long j = 0; j < count; j++)
+        raxRemove(r,(unsigned char*)keys[j],sdslen(keys[j]),NULL);
+    benchEnd(&b);
+
+    raxFree(r);
+    benchFreeKeys(keys,count);
+}
+
+static void benchSkiplist(long count) {
+    sds *keys = benchCreateKeys(count);
+    double *scores = (double *)zmalloc(sizeof(double)*count);
+    zskiplist *zsl = zslCreate();
+    benchRun b;
+
+    for (long j = 0; j < count; j++) scores[j] = rand()%(count*4);
+
+    benchStart(&b,"skiplist-insert",count);
+    for (long j = 0; j < count; j++) zsl->zslInsert(scores[j],sdsdup(keys[j]));
+    benchEnd(&b);
+
+    benchStart(&b,"skiplist-rank",count);
+    for (long j = 0; j < count; j++) {
+        long k = rand()%count;
+        serverAssert(zsl->zslGetRank(scores[k],keys[k]));
+    }
+    benchEnd(&b);
+
+    benchStart(&b,"skiplist-delete",count);
+    for (long j = 0; j < count; j++) zsl->zslDelete(scores[j],keys[j],NULL);
+    benchEnd(&b);
+
+    zslFree(zsl);
+    zfree(scores);
+    benchFreeKeys(keys,count);
+}
+
+static void benchHyperLogLog(long count) {
+    robj *o = createHLLObject();
+    long counts = count/100+1;
+    uint64_t card = 0;
+    int invalid = 0;
+    benchRun b;
+
+    benchStart(&b,"hll-add",count);
+    for (long j = 0; j < count; j++) hllAdd(o,(unsigned char*)&j,sizeof(j));
+    benchEnd(&b);
+
+    benchStart(&b,"hll-count",counts);
+    for (long j = 0; j < counts; j++) card += hllCount((struct hllhdr*)o->ptr,&invalid);
+    benchEnd(&b);
+    serverAssert(!invalid && card);
+    decrRefCount(o);
+}
+
+static struct {
+    const char *name;
+    void (*proc)(long count);
+} benchTable[] = {
+    {"dict",benchDict},
+    {"sds",benchSds},
+    {"ziplist",benchZiplist},
+    {"listpack",benchListpack},
+    {"quicklist",benchQuicklist},
+    {"intset",benchIntset},
+    {"rax",benchRax},
+    {"skiplist",benchSkiplist},
+    {"hll",benchHyperLogLog},
+};
+
+/* redis-server benchmark <name>|all [count] */
+int microbenchMain(int argc, char **argv) {
+    long count = argc >= 4 ? strtol(argv[3],NULL,10) : MICROBENCH_DEFAULT_COUNT;
+    int found = 0;
+
+    if (count <= 0) {
+        fprintf(stderr,"The count must be positive\n");
+        return 1;
+    }
+    for (size_t j = 0; j < sizeof(benchTable)/sizeof(benchTable[0]); j++) {
+        if (strcasecmp(argv[2],"all") && strcasecmp(argv[2],benchTable[j].name))
+            continue;
+        srand(1);
+        benchTable[j].proc(count);
+        found = 1;
+    }
+    if (!found) {
+        fprintf(stderr,"Unknown benchmark '%s'\n", argv[2]);
+        return 1;
+    }
+    return 0;
+}
+
+#endif
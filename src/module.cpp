@@ -29,6 +29,7 @@
 
 #include "server.h"
 #include "cluster.h"
+#include "atomicvar.h"
 #include <dlfcn.h>
 
 #define REDISMODULE_CORE 1
@@ -48,6 +49,8 @@ struct RedisModule
     int m_ver;        /* Module version. We use just progressive integers. */
     int m_apiver;     /* Module API version as requested during initialization.*/
     list *m_types;    /* Module data types. */
+    list *m_filters;  /* Command filters registered by the module. */
+    int m_in_call;    /* RM_Call() nesting level. */
 };
 
 static dict *modules; /* Hash table of modules. SDS -> RedisModule ptr.*/
@@ -143,8 +146,14 @@ struct RedisModuleKey {
     uint32_t zstart;        /* Start pos for positional ranges. */
     uint32_t zend;          /* End pos for positional ranges. */
     void *zcurrent;         /* Zset iterator current node. */
+    zbtCursor zcursor;      /* Current element of B+tree encoded zsets,
+                               zcurrent points to it. */
     int zer;                /* Zset iterator end reached flag
                                (true if end was reached). */
+
+    /* Integer encoded elements formatted by the direct access API, see
+     * RM_HashGetPtr() and RM_ValueForEach(). */
+    char numbuf[2][LONG_STR_SIZE];
 };
 typedef struct RedisModuleKey RedisModuleKey;
 
@@ -158,6 +167,49 @@ typedef struct RedisModuleKey RedisModuleKey;
  * a Redis module. */
 typedef int (*RedisModuleCmdFunc) (RedisModuleCtx *ctx, void **argv, int argc);
 
+/* Callback of RM_ValueForEach(), called for every element of a value. */
+typedef int (*RedisModuleElementCallback)(RedisModuleKey *key, const char *ele, size_t elelen, const char *value, size_t valuelen, void *privdata);
+
+/* Function pointer type of the callbacks subscribed to the keyspace events
+ * with RM_SubscribeToKeyspaceEvents(). */
+typedef int (*RedisModuleNotificationFunc)(RedisModuleCtx *ctx, int type, const char *event, RedisModuleString *key);
+
+/* Module timers and event loop callbacks. */
+typedef uint64_t RedisModuleTimerID;
+typedef void (*RedisModuleTimerProc)(RedisModuleCtx *ctx, void *data);
+typedef void (*RedisModuleEventLoopFunc)(RedisModuleCtx *ctx, int fd, void *user_data, int mask);
+
+/* A command filter, called for every command before it is looked up. */
+typedef struct RedisModuleCommandFilterCtx {
+    robj **argv;
+    int argc;
+} RedisModuleCommandFilterCtx;
+
+typedef void (*RedisModuleCommandFilterFunc)(RedisModuleCommandFilterCtx *filter);
+
+typedef struct RedisModuleCommandFilter {
+    RedisModule *module;                /* The module that registered it. */
+    RedisModuleCommandFilterFunc callback;
+    int flags;                          /* REDISMODULE_CMDFILTER_* flags. */
+} RedisModuleCommandFilter;
+
+/* Registered filters, in registration order. */
+static list *moduleCommandFilters;
+
+/* A keyspace events subscriber. */
+typedef struct RedisModuleKeyspaceSubscriber {
+    RedisModule *module;
+    RedisModuleNotificationFunc notify_callback;
+    int event_mask;     /* NOTIFY_* classes the subscriber is interested to. */
+    int active;         /* Set while the callback runs, to avoid recursion. */
+} RedisModuleKeyspaceSubscriber;
+
+static list *moduleKeyspaceSubscribers;
+
+/* The fake client, selecting the DB of the event, used by the contexts
+ * passed to the keyspace callbacks. */
+static client *moduleKeyspaceSubscribersClient;
+
 /* This struct holds the information about a command registered by a module.*/
 struct RedisModuleCommandProxy {
     RedisModule *module;
@@ -211,9 +263,20 @@ struct RedisModuleBlockedClient {
 static pthread_mutex_t moduleUnblockedClientsMutex = PTHREAD_MUTEX_INITIALIZER;
 static list *moduleUnblockedClients;
 
-/* We need a mutex that is unlocked / relocked in beforeSleep() in order to
- * allow thread safe contexts to execute commands at a safe moment. */
-static pthread_mutex_t moduleGIL = PTHREAD_MUTEX_INITIALIZER;
+/* We need a lock that is unlocked / relocked in beforeSleep() in order to
+ * allow thread safe contexts to execute commands at a safe moment. It is a
+ * read-write lock: the threads only reading the dataset can hold it at the
+ * same time, see RM_ThreadSafeContextReadLock(). The main thread takes it
+ * for writing, and is given the precedence over new readers. */
+static pthread_rwlock_t moduleGIL;
+static int moduleGILWritersWaiting = 0; /* Threads waiting for the write
+                                           lock, see RM_ThreadSafeContextYield(). */
+
+/* How the calling thread holds the GIL, if it is a modules thread. */
+#define MODULE_GIL_NONE 0
+#define MODULE_GIL_READ 1
+#define MODULE_GIL_WRITE 2
+static __thread int moduleGILMode = MODULE_GIL_NONE;
 
 /* --------------------------------------------------------------------------
  * Prototypes
@@ -226,6 +289,7 @@ robj **moduleCreateArgvFromUserFormat(const char *cmdname, const char *fmt, int
 void moduleReplicateMultiIfNeeded(RedisModuleCtx *ctx);
 void RM_ZsetRangeStop(RedisModuleKey *kp);
 static void zsetKeyReset(RedisModuleKey *key);
+int moduleThreadHoldsReadLock(void);
 
 /* --------------------------------------------------------------------------
  * Heap allocation raw functions
@@ -352,7 +416,7 @@ int moduleCreateEmptyKey(RedisModuleKey *key, int type) {
                             server.list_compress_depth);
         break;
     case REDISMODULE_KEYTYPE_ZSET:
-        obj = createZsetZiplistObject();
+        obj = createZsetListpackObject();
         break;
     case REDISMODULE_KEYTYPE_HASH:
         obj = createHashObject();
@@ -638,6 +702,9 @@ int RM_CreateCommand(RedisModuleCtx *ctx, const char *name, RedisModuleCmdFunc c
     cp->rediscmd->keystep = keystep;
     cp->rediscmd->microseconds = 0;
     cp->rediscmd->calls = 0;
+    cp->rediscmd->aof_id = 0;
+    cp->rediscmd->aof_epoch = 0;
+    cp->rediscmd->latency_hist = NULL;
     server.commands->dictAdd(sdsdup(cmdname),cp->rediscmd);
     server.orig_commands->dictAdd(sdsdup(cmdname),cp->rediscmd);
     return REDISMODULE_OK;
@@ -656,6 +723,8 @@ void RM_SetModuleAttribs(RedisModuleCtx *ctx, const char *name, int ver, int api
     module->m_ver = ver;
     module->m_apiver = apiver;
     module->m_types = listCreate();
+    module->m_filters = listCreate();
+    module->m_in_call = 0;
     ctx->module = module;
 }
 
@@ -764,10 +833,13 @@ void autoMemoryCollect(RedisModuleCtx *ctx) {
  * with RedisModule_FreeString(), unless automatic memory is enabled.
  *
  * The string is created by copying the `len` bytes starting
- * at `ptr`. No reference is retained to the passed buffer. */
+ * at `ptr`. No reference is retained to the passed buffer.
+ *
+ * The context may be NULL, for instance to create the arguments passed
+ * to RM_CommandFilterArgInsert() by the command filters. */
 RedisModuleString *RM_CreateString(RedisModuleCtx *ctx, const char *ptr, size_t len) {
     RedisModuleString *o = createStringObject(ptr,len);
-    autoMemoryAdd(ctx,REDISMODULE_AM_STRING,o);
+    if (ctx) autoMemoryAdd(ctx,REDISMODULE_AM_STRING,o);
     return o;
 }
 
@@ -1544,10 +1616,15 @@ char *RM_StringDMA(RedisModuleKey *key, size_t *len, int mode) {
 
     if (key->value->type != OBJ_STRING) return NULL;
 
-    /* For write access, and even for read access if the object is encoded,
-     * we unshare the string (that has the side effect of decoding it). */
-    if ((mode & REDISMODULE_WRITE) || key->value->encoding != OBJ_ENCODING_RAW)
+    /* For write access, and for read access if the object is not an sds
+     * string, we unshare the string (that has the side effect of decoding
+     * it). Embedded strings are sds strings too: they can be read in place
+     * without copying them. */
+    if ((mode & REDISMODULE_WRITE) || !sdsEncodedObject(key->value)) {
+        /* The threads sharing the dataset for reads can't convert it. */
+        if (moduleThreadHoldsReadLock()) return NULL;
         key->value = dbUnshareStringValue(key->db, key->key, key->value);
+    }
 
     *len = sdslen((sds)key->value->ptr);
     return (char *)key->value->ptr;
@@ -1821,7 +1898,7 @@ int zsetInitScoreRange(RedisModuleKey *key, double min, double max, int minex, i
     zrs->minex = minex;
     zrs->maxex = maxex;
 
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         key->zcurrent = first ? zzlFirstInRange((unsigned char *)key->value->ptr,zrs) :
                                 zzlLastInRange((unsigned char *)key->value->ptr,zrs);
     } else if (key->value->encoding == OBJ_ENCODING_SKIPLIST) {
@@ -1829,6 +1906,11 @@ int zsetInitScoreRange(RedisModuleKey *key, double min, double max, int minex, i
         zskiplist *zsl = zs->zsl;
         key->zcurrent = first ? zsl->zslFirstInRange(zrs) :
                                 zsl->zslLastInRange(zrs);
+    } else if (key->value->encoding == OBJ_ENCODING_BTREE) {
+        zbtree *zbt = ((zset *)key->value->ptr)->zbt;
+        int found = first ? zbt->zbtFirstInRange(zrs,&key->zcursor) :
+                            zbt->zbtLastInRange(zrs,&key->zcursor);
+        key->zcurrent = found ? &key->zcursor : NULL;
     } else {
         serverPanic("Unsupported zset encoding");
     }
@@ -1885,7 +1967,7 @@ int zsetInitLexRange(RedisModuleKey *key, RedisModuleString *min, RedisModuleStr
      * otherwise we don't want the zlexrangespec to be freed. */
     key->ztype = REDISMODULE_ZSET_RANGE_LEX;
 
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         key->zcurrent = first ? zzlFirstInLexRange((unsigned char *)key->value->ptr,zlrs) :
                                 zzlLastInLexRange((unsigned char *)key->value->ptr,zlrs);
     } else if (key->value->encoding == OBJ_ENCODING_SKIPLIST) {
@@ -1893,6 +1975,11 @@ int zsetInitLexRange(RedisModuleKey *key, RedisModuleString *min, RedisModuleStr
         zskiplist *zsl = zs->zsl;
         key->zcurrent = first ? zsl->zslFirstInLexRange(zlrs) :
                                 zsl->zslLastInLexRange(zlrs);
+    } else if (key->value->encoding == OBJ_ENCODING_BTREE) {
+        zbtree *zbt = ((zset *)key->value->ptr)->zbt;
+        int found = first ? zbt->zbtFirstInLexRange(zlrs,&key->zcursor) :
+                            zbt->zbtLastInLexRange(zlrs,&key->zcursor);
+        key->zcurrent = found ? &key->zcursor : NULL;
     } else {
         serverPanic("Unsupported zset encoding");
     }
@@ -1930,12 +2017,12 @@ RedisModuleString *RM_ZsetRangeCurrentElement(RedisModuleKey *key, double *score
     RedisModuleString *str;
 
     if (key->zcurrent == NULL) return NULL;
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *eptr, *sptr;
         eptr = (unsigned char *)key->zcurrent;
-        sds ele = ziplistGetObject(eptr);
+        sds ele = lpGetObject(eptr);
         if (score) {
-            sptr = ziplistNext((unsigned char *)key->value->ptr,eptr);
+            sptr = lpNext((unsigned char *)key->value->ptr,eptr);
             *score = zzlGetScore(sptr);
         }
         str = createObject(OBJ_STRING,ele);
@@ -1943,6 +2030,10 @@ RedisModuleString *RM_ZsetRangeCurrentElement(RedisModuleKey *key, double *score
         zskiplistNode *ln = (zskiplistNode *)key->zcurrent;
         if (score) *score = ln->score;
         str = createStringObject(ln->ele,sdslen(ln->ele));
+    } else if (key->value->encoding == OBJ_ENCODING_BTREE) {
+        sds ele = zbtCursorEle(&key->zcursor);
+        if (score) *score = zbtCursorScore(&key->zcursor);
+        str = createStringObject(ele,sdslen(ele));
     } else {
         serverPanic("Unsupported zset encoding");
     }
@@ -1956,12 +2047,12 @@ RedisModuleString *RM_ZsetRangeCurrentElement(RedisModuleKey *key, double *score
 int RM_ZsetRangeNext(RedisModuleKey *key) {
     if (!key->ztype || !key->zcurrent) return 0; /* No active iterator. */
 
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = (unsigned char *)key->value->ptr;
         unsigned char *eptr = (unsigned char *)key->zcurrent;
         unsigned char *next;
-        next = ziplistNext(zl,eptr); /* Skip element. */
-        if (next) next = ziplistNext(zl,next); /* Skip score. */
+        next = lpNext(zl,eptr); /* Skip element. */
+        if (next) next = lpNext(zl,next); /* Skip score. */
         if (next == NULL) {
             key->zer = 1;
             return 0;
@@ -1971,7 +2062,7 @@ int RM_ZsetRangeNext(RedisModuleKey *key) {
                 /* Fetch the next element score for the
                  * range check. */
                 unsigned char *saved_next = next;
-                next = ziplistNext(zl,next); /* Skip next element. */
+                next = lpNext(zl,next); /* Skip next element. */
                 double score = zzlGetScore(next); /* Obtain the next score. */
                 if (!zslValueLteMax(score,&key->zrs)) {
                     key->zer = 1;
@@ -2009,6 +2100,27 @@ int RM_ZsetRangeNext(RedisModuleKey *key) {
             key->zcurrent = next;
             return 1;
         }
+    } else if (key->value->encoding == OBJ_ENCODING_BTREE) {
+        zbtCursor next = key->zcursor;
+        if (!zbtNext(&next)) {
+            key->zer = 1;
+            return 0;
+        } else {
+            /* Are we still within the range? */
+            if (key->ztype == REDISMODULE_ZSET_RANGE_SCORE &&
+                !zslValueLteMax(zbtCursorScore(&next),&key->zrs))
+            {
+                key->zer = 1;
+                return 0;
+            } else if (key->ztype == REDISMODULE_ZSET_RANGE_LEX) {
+                if (!zslLexValueLteMax(zbtCursorEle(&next),&key->zlrs)) {
+                    key->zer = 1;
+                    return 0;
+                }
+            }
+            key->zcursor = next;
+            return 1;
+        }
     } else {
         serverPanic("Unsupported zset encoding");
     }
@@ -2020,12 +2132,12 @@ int RM_ZsetRangeNext(RedisModuleKey *key) {
 int RM_ZsetRangePrev(RedisModuleKey *key) {
     if (!key->ztype || !key->zcurrent) return 0; /* No active iterator. */
 
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = (unsigned char *)key->value->ptr;
         unsigned char *eptr = (unsigned char *)key->zcurrent;
         unsigned char *prev;
-        prev = ziplistPrev(zl,eptr); /* Go back to previous score. */
-        if (prev) prev = ziplistPrev(zl,prev); /* Back to previous ele. */
+        prev = lpPrev(zl,eptr); /* Go back to previous score. */
+        if (prev) prev = lpPrev(zl,prev); /* Back to previous ele. */
         if (prev == NULL) {
             key->zer = 1;
             return 0;
@@ -2035,7 +2147,7 @@ int RM_ZsetRangePrev(RedisModuleKey *key) {
                 /* Fetch the previous element score for the
                  * range check. */
                 unsigned char *saved_prev = prev;
-                prev = ziplistNext(zl,prev); /* Skip element to get the score.*/
+                prev = lpNext(zl,prev); /* Skip element to get the score.*/
                 double score = zzlGetScore(prev); /* Obtain the prev score. */
                 if (!zslValueGteMin(score,&key->zrs)) {
                     key->zer = 1;
@@ -2073,6 +2185,27 @@ int RM_ZsetRangePrev(RedisModuleKey *key) {
             key->zcurrent = prev;
             return 1;
         }
+    } else if (key->value->encoding == OBJ_ENCODING_BTREE) {
+        zbtCursor prev = key->zcursor;
+        if (!zbtPrev(&prev)) {
+            key->zer = 1;
+            return 0;
+        } else {
+            /* Are we still within the range? */
+            if (key->ztype == REDISMODULE_ZSET_RANGE_SCORE &&
+                !zslValueGteMin(zbtCursorScore(&prev),&key->zrs))
+            {
+                key->zer = 1;
+                return 0;
+            } else if (key->ztype == REDISMODULE_ZSET_RANGE_LEX) {
+                if (!zslLexValueGteMin(zbtCursorEle(&prev),&key->zlrs)) {
+                    key->zer = 1;
+                    return 0;
+                }
+            }
+            key->zcursor = prev;
+            return 1;
+        }
     } else {
         serverPanic("Unsupported zset encoding");
     }
@@ -2280,6 +2413,123 @@ int RM_HashGet(RedisModuleKey *key, int flags, ...) {
     return REDISMODULE_OK;
 }
 
+/* --------------------------------------------------------------------------
+ * Direct read only access to aggregate values
+ * -------------------------------------------------------------------------- */
+
+/* Return the string form of an element, given as returned by the type
+ * iterators: a string pointer, or an integer when 'vstr' is NULL. Integers
+ * are formatted in the buffer 'slot' of the key. */
+static const char *moduleKeyElementPtr(RedisModuleKey *key, int slot, unsigned char *vstr, size_t vlen, long long vll, size_t *len) {
+    if (vstr) {
+        *len = vlen;
+        return (const char*)vstr;
+    }
+    *len = ll2string(key->numbuf[slot],sizeof(key->numbuf[slot]),vll);
+    return key->numbuf[slot];
+}
+
+/* Return a pointer to the value of the hash field, without copying it into
+ * a RedisModuleString as RM_HashGet() does. The length of the value is
+ * returned by reference in '*len'. NULL is returned if the key is empty, is
+ * not an hash, or the field does not exist.
+ *
+ * The pointer refers to the value stored in the hash and must only be
+ * accessed in a read-only fashion. The string is not null terminated. It
+ * stays valid until the key is modified or closed, or until the next call
+ * of RM_HashGetPtr() or RM_ValueForEach() with the same key, since values
+ * stored as integers are formatted in a buffer of the key. */
+const char *RM_HashGetPtr(RedisModuleKey *key, RedisModuleString *field, size_t *len) {
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vll;
+
+    if (key->value == NULL || key->value->type != OBJ_HASH) return NULL;
+    if (hashTypeGetValue(key->value,(sds)field->ptr,&vstr,&vlen,&vll) == C_ERR)
+        return NULL;
+    return moduleKeyElementPtr(key,1,vstr,vlen,vll,len);
+}
+
+/* Call 'fn' for every element of the list, set or hash stored at the key,
+ * passing pointers to the elements as they are stored in the value, so no
+ * RedisModuleString is created while iterating, whatever the encoding of the
+ * value is. The callback prototype is:
+ *
+ *      int callback(RedisModuleKey *key, const char *ele, size_t elelen,
+ *                   const char *value, size_t valuelen, void *privdata);
+ *
+ * For hashes 'ele' is the field and 'value' its value, for lists (from the
+ * head to the tail) and sets 'value' is NULL. The strings are not null
+ * terminated and are only valid during the callback, that must not modify
+ * the key. The iteration continues as long as the callback returns
+ * REDISMODULE_OK.
+ *
+ * This is an example summing the values of an hash:
+ *
+ *      int sum(RedisModuleKey *key, const char *ele, size_t elelen,
+ *              const char *value, size_t valuelen, void *privdata)
+ *      {
+ *          long long *total = privdata;
+ *          *total += strtoll(value,NULL,10);
+ *          return REDISMODULE_OK;
+ *      }
+ *
+ *      long long total = 0;
+ *      RedisModule_ValueForEach(key,sum,&total);
+ *
+ * The function returns REDISMODULE_ERR if the key is not a list, set or
+ * hash, otherwise REDISMODULE_OK, even if the callback stopped the
+ * iteration. Nothing is called for empty keys. */
+int RM_ValueForEach(RedisModuleKey *key, RedisModuleElementCallback fn, void *privdata) {
+    robj *o = key->value;
+    const char *ele, *value;
+    size_t elelen, valuelen;
+
+    if (o == NULL) return REDISMODULE_OK;
+    if (o->type == OBJ_HASH) {
+        hashTypeIterator hi(o);
+        while (hi.hashTypeNext() != C_ERR) {
+            unsigned char *vstr;
+            unsigned int vlen;
+            long long vll;
+
+            hi.hashTypeCurrentObject(OBJ_HASH_KEY,&vstr,&vlen,&vll);
+            ele = moduleKeyElementPtr(key,0,vstr,vlen,vll,&elelen);
+            hi.hashTypeCurrentObject(OBJ_HASH_VALUE,&vstr,&vlen,&vll);
+            value = moduleKeyElementPtr(key,1,vstr,vlen,vll,&valuelen);
+            if (fn(key,ele,elelen,value,valuelen,privdata) != REDISMODULE_OK)
+                break;
+        }
+    } else if (o->type == OBJ_SET) {
+        setTypeIterator si(o);
+        sds sdsele;
+        int64_t llele;
+        int encoding;
+
+        while ((encoding = si.setTypeNext(&sdsele,&llele)) != -1) {
+            if (encoding == OBJ_ENCODING_HT)
+                ele = moduleKeyElementPtr(key,0,(unsigned char*)sdsele,
+                                          sdslen(sdsele),0,&elelen);
+            else
+                ele = moduleKeyElementPtr(key,0,NULL,0,llele,&elelen);
+            if (fn(key,ele,elelen,NULL,0,privdata) != REDISMODULE_OK) break;
+        }
+    } else if (o->type == OBJ_LIST) {
+        listTypeIterator li(o,0,LIST_TAIL);
+        listTypeEntry entry;
+
+        while (li.listTypeNext(&entry)) {
+            quicklistEntry *qe = &entry.m_ql_entry;
+            ele = moduleKeyElementPtr(key,0,qe->m_value,qe->m_size,
+                                      qe->m_longval,&elelen);
+            if (fn(key,ele,elelen,NULL,0,privdata) != REDISMODULE_OK) break;
+        }
+    } else {
+        return REDISMODULE_ERR;
+    }
+    return REDISMODULE_OK;
+}
+
 /* --------------------------------------------------------------------------
  * Redis <-> Modules generic Call() API
  * -------------------------------------------------------------------------- */
@@ -2609,6 +2859,21 @@ RedisModuleCallReply *RM_Call(RedisModuleCtx *ctx, const char *cmdname, const ch
      * we can free it normally. */
     if (argv == NULL) goto cleanup;
 
+    /* The filters may rewrite the command, so look it up again. The filters
+     * flagged NOSELF skip the commands of the module they belong to. */
+    if (moduleHasCommandFilters()) {
+        if (ctx->module) ctx->module->m_in_call++;
+        moduleCallCommandFilters(c);
+        if (ctx->module) ctx->module->m_in_call--;
+        cmd = c->m_cmd = c->m_last_cmd = lookupCommand((sds)c->m_argv[0]->ptr);
+        if (!cmd) {
+            errno = EINVAL;
+            goto cleanup;
+        }
+        argv = c->m_argv;
+        argc = c->m_argc;
+    }
+
     /* Basic arity checks. */
     if ((cmd->arity > 0 && cmd->arity != argc) || (argc < -cmd->arity)) {
         errno = EINVAL;
@@ -2888,6 +3153,7 @@ moduleType *RM_CreateDataType(RedisModuleCtx *ctx, const char *name, int encver,
         moduleTypeMemUsageFunc mem_usage;
         moduleTypeDigestFunc digest;
         moduleTypeFreeFunc free;
+        moduleTypeDefragFunc defrag;
     } *tms = (struct typemethods*) typemethods_ptr;
 
     moduleType *mt = (moduleType *)zcalloc(sizeof(*mt));
@@ -2899,6 +3165,7 @@ moduleType *RM_CreateDataType(RedisModuleCtx *ctx, const char *name, int encver,
     mt->m_mem_usage = tms->mem_usage;
     mt->m_digest = tms->digest;
     mt->m_free = tms->free;
+    if (typemethods_version >= 2) mt->m_defrag = tms->defrag;
     memcpy(mt->m_name,name,sizeof(mt->m_name));
     ctx->module->m_types->listAddNodeTail(mt);
     return mt;
@@ -3230,6 +3497,27 @@ void RM_DigestEndSequence(RedisModuleDigest *md) {
     memset(md->o,0,sizeof(md->o));
 }
 
+/* --------------------------------------------------------------------------
+ * Active defragmentation API for modules data types
+ * -------------------------------------------------------------------------- */
+
+/* Called by the 'defrag' method of module types, for every allocation of
+ * the value the method wants to defragment. If the allocation was moved the
+ * new pointer is returned, and the old one is no longer valid: the module
+ * should update its references to it. Otherwise NULL is returned and the
+ * allocation is unchanged. */
+void *RM_DefragAlloc(RedisModuleDefragCtx *ctx, void *ptr) {
+#ifdef HAVE_DEFRAG
+    void *newptr = activeDefragAlloc(ptr);
+    if (newptr) ctx->defragged++;
+    return newptr;
+#else
+    UNUSED(ctx);
+    UNUSED(ptr);
+    return NULL;
+#endif
+}
+
 /* --------------------------------------------------------------------------
  * AOF API for modules data types
  * -------------------------------------------------------------------------- */
@@ -3639,24 +3927,632 @@ void RM_FreeThreadSafeContext(RedisModuleCtx *ctx) {
 
 /* Acquire the server lock before executing a thread safe API call.
  * This is not needed for `RedisModule_Reply*` calls when there is
- * a blocked client connected to the thread safe context. */
+ * a blocked client connected to the thread safe context.
+ *
+ * The lock is exclusive: the thread runs alone with the main thread
+ * sleeping, and can use all the modules APIs. */
 void RM_ThreadSafeContextLock(RedisModuleCtx *ctx) {
     DICT_NOTUSED(ctx);
     moduleAcquireGIL();
+    /* The main thread is sleeping with the dataset shared for reads: while
+     * we hold the lock for writing nobody else can access it. */
+    server.module_read_shared = 0;
+    dictResumeRehashing();
+    moduleGILMode = MODULE_GIL_WRITE;
+}
+
+/* Acquire the server lock only to read the dataset. Unlike
+ * RM_ThreadSafeContextLock() the threads holding the read lock run in
+ * parallel, so several threads can perform long read only scans of the
+ * keyspace at the same time, while the main thread is sleeping.
+ *
+ * While holding the read lock the thread must only read the dataset:
+ * RM_OpenKey() with REDISMODULE_READ, RM_KeyType(), RM_ValueLength(),
+ * RM_StringDMA() for reading, RM_HashGetPtr(), RM_ValueForEach() and the
+ * sorted set iterators. RM_Call(), the reply functions and whatever
+ * modifies keys are not allowed. In this mode the keys lookups don't
+ * update the access time of the keys, don't delete the expired keys
+ * (they are just reported as missing), and the dictionaries are not
+ * incrementally rehashed. RM_StringDMA() returns NULL for the strings it
+ * would have to convert, such as integer encoded strings.
+ *
+ * The main thread waits for the readers to release the lock when it
+ * wakes up, so long scans should call RM_ThreadSafeContextYield() from
+ * time to time. The lock is released with RM_ThreadSafeContextUnlock(). */
+void RM_ThreadSafeContextReadLock(RedisModuleCtx *ctx) {
+    DICT_NOTUSED(ctx);
+    pthread_rwlock_rdlock(&moduleGIL);
+    moduleGILMode = MODULE_GIL_READ;
 }
 
-/* Release the server lock after a thread safe API call was executed. */
+/* Release the server lock after a thread safe API call was executed,
+ * whether it was acquired for reading or for writing. */
 void RM_ThreadSafeContextUnlock(RedisModuleCtx *ctx) {
     DICT_NOTUSED(ctx);
-    moduleReleaseGIL();
+    if (moduleGILMode == MODULE_GIL_WRITE) {
+        /* Hand the dataset back to the readers, see moduleReleaseGIL(). */
+        server.module_read_shared = 1;
+        dictPauseRehashing();
+    }
+    moduleGILMode = MODULE_GIL_NONE;
+    pthread_rwlock_unlock(&moduleGIL);
 }
 
+/* Called from time to time by the threads holding the server lock, at a
+ * point where they can release it: if the main thread (or another thread)
+ * is waiting for the lock for writing, it is released and acquired again,
+ * in the same mode, after the writer is done. Returns 1 if the lock was
+ * released, in that case the keys opened before must be opened again,
+ * since the dataset may have changed, otherwise 0 is returned. */
+int RM_ThreadSafeContextYield(RedisModuleCtx *ctx) {
+    int waiting, mode = moduleGILMode;
+
+    atomicGet(moduleGILWritersWaiting,waiting);
+    if (!waiting || mode == MODULE_GIL_NONE) return 0;
+    RM_ThreadSafeContextUnlock(ctx);
+    if (mode == MODULE_GIL_READ)
+        RM_ThreadSafeContextReadLock(ctx);
+    else
+        RM_ThreadSafeContextLock(ctx);
+    return 1;
+}
+
+/* Return true if the calling thread holds the server lock for reading. */
+int moduleThreadHoldsReadLock(void) {
+    return moduleGILMode == MODULE_GIL_READ;
+}
+
+/* Acquire the lock for writing, this is also used by the main thread when
+ * it wakes up. */
 void moduleAcquireGIL() {
-    pthread_mutex_lock(&moduleGIL);
+    atomicIncr(moduleGILWritersWaiting,1);
+    pthread_rwlock_wrlock(&moduleGIL);
+    atomicDecr(moduleGILWritersWaiting,1);
 }
 
 void moduleReleaseGIL() {
-    pthread_mutex_unlock(&moduleGIL);
+    pthread_rwlock_unlock(&moduleGIL);
+}
+
+/* The main thread releases the lock before sleeping, sharing the dataset
+ * with the modules threads: the ones holding the read lock may access it
+ * at the same time, so from now on the lookups don't modify the dataset,
+ * the references counts are updated atomically and the dictionaries are
+ * not rehashed, like when the I/O threads execute commands. */
+void moduleReleaseGILBeforeSleep(void) {
+    server.module_read_shared = 1;
+    dictPauseRehashing();
+    moduleReleaseGIL();
+}
+
+void moduleAcquireGILAfterSleep(void) {
+    moduleAcquireGIL();
+    server.module_read_shared = 0;
+    dictResumeRehashing();
+}
+
+/* --------------------------------------------------------------------------
+ * Modules Keyspace Notifications API
+ * -------------------------------------------------------------------------- */
+
+/* Subscribe to the keyspace events of the classes in 'types', a bitwise OR
+ * of REDISMODULE_NOTIFY_* flags: 'callback' is called for every event of
+ * such classes, with a context whose DB is the one of the key, the class
+ * of the event, the event name and the key.
+ *
+ * The callbacks are plain C calls performed by notifyKeyspaceEvent(),
+ * executed even when the notify-keyspace-events option is off: the events
+ * are not formatted into Pub/Sub channels and published, so this is much
+ * faster than subscribing to the keyspace notifications with RM_Call().
+ *
+ * The callback runs synchronously inside the command generating the event,
+ * so it must be fast. The events generated by the callback itself, for
+ * instance writing keys via RM_Call(), are not delivered again to it.
+ *
+ * The callback return value is currently ignored. Returns REDISMODULE_OK. */
+int RM_SubscribeToKeyspaceEvents(RedisModuleCtx *ctx, int types, RedisModuleNotificationFunc callback) {
+    RedisModuleKeyspaceSubscriber *sub = (RedisModuleKeyspaceSubscriber *)zmalloc(sizeof(*sub));
+    sub->module = ctx->module;
+    sub->event_mask = types;
+    sub->notify_callback = callback;
+    sub->active = 0;
+    moduleKeyspaceSubscribers->listAddNodeTail(sub);
+    return REDISMODULE_OK;
+}
+
+/* Called by notifyKeyspaceEvent() for every event, before the Pub/Sub
+ * notifications are checked: dispatch it to the modules subscribed to
+ * its class. */
+void moduleNotifyKeyspaceEvent(int type, const char *event, robj *key, int dbid) {
+    if (moduleKeyspaceSubscribers->listLength() == 0) return;
+
+    /* Created on first use, since the modules are initialized before the
+     * server is. */
+    if (moduleKeyspaceSubscribersClient == NULL) {
+        moduleKeyspaceSubscribersClient = createClient(-1);
+        moduleKeyspaceSubscribersClient->m_flags |= CLIENT_MODULE;
+    }
+
+    listIter li(moduleKeyspaceSubscribers);
+    listNode *ln;
+    while((ln = li.listNext())) {
+        RedisModuleKeyspaceSubscriber *sub = (RedisModuleKeyspaceSubscriber *)ln->listNodeValue();
+        /* Only the matching classes, and never while the callback is
+         * already handling an event generated by itself. */
+        if (!(sub->event_mask & type) || sub->active) continue;
+
+        RedisModuleCtx ctx = REDISMODULE_CTX_INIT;
+        ctx.module = sub->module;
+        ctx._client = moduleKeyspaceSubscribersClient;
+        ctx._client->selectDb(dbid);
+
+        sub->active = 1;
+        sub->notify_callback(&ctx,type,event,key);
+        sub->active = 0;
+        moduleFreeContext(&ctx);
+    }
+}
+
+/* Remove all the keyspace events subscriptions of the module, on unload. */
+void moduleUnsubscribeNotifications(RedisModule *module) {
+    listIter li(moduleKeyspaceSubscribers);
+    listNode *ln;
+    while((ln = li.listNext())) {
+        RedisModuleKeyspaceSubscriber *sub = (RedisModuleKeyspaceSubscriber *)ln->listNodeValue();
+        if (sub->module == module) {
+            moduleKeyspaceSubscribers->listDelNode(ln);
+            zfree(sub);
+        }
+    }
+}
+
+/* --------------------------------------------------------------------------
+ * Modules Command Filters API
+ * -------------------------------------------------------------------------- */
+
+/* Register a command filter: 'callback' is called by processCommand() for
+ * every command received by the clients, before the command is looked up,
+ * so that the filter can inspect and rewrite its arguments, including the
+ * command name, with the RM_CommandFilterArg*() functions. The filters
+ * are also called for the commands executed by the modules via RM_Call(),
+ * unless 'flags' contains REDISMODULE_CMDFILTER_NOSELF: in this case the
+ * commands called by the module registering the filter are not filtered,
+ * so that a filter can execute the original command from a module command.
+ *
+ * The filters are called in registration order, and must be fast: every
+ * command pays for them. Returns the filter handle, to unregister it with
+ * RM_UnregisterCommandFilter(). */
+RedisModuleCommandFilter *RM_RegisterCommandFilter(RedisModuleCtx *ctx, RedisModuleCommandFilterFunc callback, int flags) {
+    RedisModuleCommandFilter *filter = (RedisModuleCommandFilter *)zmalloc(sizeof(*filter));
+    filter->module = ctx->module;
+    filter->callback = callback;
+    filter->flags = flags;
+
+    moduleCommandFilters->listAddNodeTail(filter);
+    ctx->module->m_filters->listAddNodeTail(filter);
+    return filter;
+}
+
+/* Unregister a command filter registered by the calling module. Returns
+ * REDISMODULE_ERR if the filter belongs to another module. */
+int RM_UnregisterCommandFilter(RedisModuleCtx *ctx, RedisModuleCommandFilter *filter) {
+    listNode *ln;
+
+    if (filter->module != ctx->module) return REDISMODULE_ERR;
+
+    ln = moduleCommandFilters->listSearchKey(filter);
+    if (!ln) return REDISMODULE_ERR;
+    moduleCommandFilters->listDelNode(ln);
+
+    ln = ctx->module->m_filters->listSearchKey(filter);
+    if (ln) ctx->module->m_filters->listDelNode(ln);
+
+    zfree(filter);
+    return REDISMODULE_OK;
+}
+
+/* Return 1 if there are command filters registered. The commands of the
+ * clients can't be executed by the I/O threads in this case, since the
+ * filters must see them first. */
+int moduleHasCommandFilters(void) {
+    return moduleCommandFilters->listLength() != 0;
+}
+
+/* Call the registered filters on the arguments of the client, that may be
+ * rewritten. At least the command name is left in place by the filters. */
+void moduleCallCommandFilters(client *c) {
+    if (moduleCommandFilters->listLength() == 0) return;
+
+    RedisModuleCommandFilterCtx filter = { c->m_argv, c->m_argc };
+
+    listIter li(moduleCommandFilters);
+    listNode *ln;
+    while((ln = li.listNext())) {
+        RedisModuleCommandFilter *f = (RedisModuleCommandFilter *)ln->listNodeValue();
+        if ((f->flags & REDISMODULE_CMDFILTER_NOSELF) && f->module->m_in_call)
+            continue;
+        f->callback(&filter);
+    }
+
+    /* The filters may have reallocated the vector: it has at least the
+     * slots of the arguments. */
+    c->m_argv_len = filter.argc;
+    c->m_argv = filter.argv;
+    c->m_argc = filter.argc;
+}
+
+/* Remove all the filters of the module, on unload. */
+void moduleUnregisterFilters(RedisModule *module) {
+    listIter li(module->m_filters);
+    listNode *ln;
+    while((ln = li.listNext())) {
+        RedisModuleCommandFilter *filter = (RedisModuleCommandFilter *)ln->listNodeValue();
+        listNode *fn = moduleCommandFilters->listSearchKey(filter);
+        if (fn) moduleCommandFilters->listDelNode(fn);
+        module->m_filters->listDelNode(ln);
+        zfree(filter);
+    }
+}
+
+/* Return the number of arguments of the filtered command, including the
+ * command name. */
+int RM_CommandFilterArgsCount(RedisModuleCommandFilterCtx *filter) {
+    return filter->argc;
+}
+
+/* Return the argument at 'pos' of the filtered command, 0 being the
+ * command name, or NULL if 'pos' is out of range. */
+const RedisModuleString *RM_CommandFilterArgGet(RedisModuleCommandFilterCtx *filter, int pos) {
+    if (pos < 0 || pos >= filter->argc) return NULL;
+    return filter->argv[pos];
+}
+
+/* Insert 'arg' at 'pos' in the arguments of the filtered command, shifting
+ * the following arguments. The command takes ownership of 'arg', that must
+ * not be freed, nor be an automatically managed string. The command name
+ * can't be moved: 'pos' must be at least 1. */
+int RM_CommandFilterArgInsert(RedisModuleCommandFilterCtx *filter, int pos, RedisModuleString *arg) {
+    if (pos < 1 || pos > filter->argc) return REDISMODULE_ERR;
+
+    filter->argv = (robj **)zrealloc(filter->argv,(filter->argc+1)*sizeof(robj *));
+    memmove(filter->argv+pos+1,filter->argv+pos,(filter->argc-pos)*sizeof(robj *));
+    filter->argv[pos] = arg;
+    filter->argc++;
+    return REDISMODULE_OK;
+}
+
+/* Replace the argument at 'pos' of the filtered command with 'arg', with
+ * the same ownership rules of RM_CommandFilterArgInsert(). The previous
+ * argument is released. */
+int RM_CommandFilterArgReplace(RedisModuleCommandFilterCtx *filter, int pos, RedisModuleString *arg) {
+    if (pos < 0 || pos >= filter->argc) return REDISMODULE_ERR;
+
+    decrRefCount(filter->argv[pos]);
+    filter->argv[pos] = arg;
+    return REDISMODULE_OK;
+}
+
+/* Remove the argument at 'pos' of the filtered command, shifting the
+ * following arguments. The command name can't be removed. */
+int RM_CommandFilterArgDelete(RedisModuleCommandFilterCtx *filter, int pos) {
+    if (pos < 1 || pos >= filter->argc) return REDISMODULE_ERR;
+
+    decrRefCount(filter->argv[pos]);
+    memmove(filter->argv+pos,filter->argv+pos+1,(filter->argc-pos-1)*sizeof(robj *));
+    filter->argc--;
+    return REDISMODULE_OK;
+}
+
+/* --------------------------------------------------------------------------
+ * Modules Timers API
+ *
+ * Module timers are time events of the server event loop, so creating and
+ * stopping them is O(log(N)) in the number of timers and they don't need
+ * any thread or polling to fire: the callback is called by the main
+ * thread, in the context of the DB selected when the timer was created.
+ * -------------------------------------------------------------------------- */
+
+typedef struct RedisModuleTimer {
+    RedisModule *module;                /* Module reference. */
+    RedisModuleTimerProc callback;      /* The callback to invoke on expire. */
+    void *data;                         /* Private data for the callback. */
+    int dbid;                           /* Database number selected by the
+                                           original client. */
+    mstime_t when;                      /* Unix time in ms of the expire. */
+} RedisModuleTimer;
+
+/* The timers by ID, as big endian 64 bit integers. */
+static rax *Timers;
+
+/* The fake client used by the contexts of the timers and the event loop
+ * callbacks, created on first use. */
+static client *moduleTimersClient;
+
+static void moduleEncodeTimerID(RedisModuleTimerID id, unsigned char *key) {
+    for (int j = 7; j >= 0; j--) {
+        key[j] = id & 0xff;
+        id >>= 8;
+    }
+}
+
+/* Return a context for a callback of 'module', called by the main thread
+ * from the event loop, with the DB 'dbid' selected. */
+static void moduleInitEventLoopContext(RedisModuleCtx *ctx, RedisModule *module, int dbid) {
+    if (moduleTimersClient == NULL) {
+        moduleTimersClient = createClient(-1);
+        moduleTimersClient->m_flags |= CLIENT_MODULE;
+    }
+    ctx->module = module;
+    ctx->_client = moduleTimersClient;
+    ctx->_client->selectDb(dbid);
+}
+
+int moduleTimerHandler(aeEventLoop *eventLoop, long long id, void *clientData) {
+    UNUSED(eventLoop);
+    RedisModuleTimer *timer = (RedisModuleTimer *)clientData;
+    unsigned char key[8];
+
+    /* Remove the timer before calling it, so that the callback is free
+     * to create new timers, and RM_StopTimer() fails for this one. */
+    moduleEncodeTimerID(id,key);
+    raxRemove(Timers,key,sizeof(key),NULL);
+
+    RedisModuleCtx ctx = REDISMODULE_CTX_INIT;
+    moduleInitEventLoopContext(&ctx,timer->module,timer->dbid);
+    timer->callback(&ctx,timer->data);
+    moduleHandlePropagationAfterCommandCallback(&ctx);
+    moduleFreeContext(&ctx);
+    zfree(timer);
+    return AE_NOMORE;
+}
+
+/* Create a new timer that will fire after `period` milliseconds, and will
+ * call the specified function using `data` as argument. The returned timer
+ * ID can be used to get information from the timer or to stop it before it
+ * fires. The timer fires just once: to fire it periodically the callback
+ * should create a new timer. */
+RedisModuleTimerID RM_CreateTimer(RedisModuleCtx *ctx, mstime_t period, RedisModuleTimerProc callback, void *data) {
+    RedisModuleTimer *timer = (RedisModuleTimer *)zmalloc(sizeof(*timer));
+    timer->module = ctx->module;
+    timer->callback = callback;
+    timer->data = data;
+    timer->dbid = ctx->_client ? ctx->_client->m_cur_selected_db->m_id : 0;
+    timer->when = mstime()+period;
+
+    long long id = server.el->aeCreateTimeEvent(period,moduleTimerHandler,
+                                                timer,NULL);
+    if (id == AE_ERR) {
+        zfree(timer);
+        return 0;
+    }
+
+    unsigned char key[8];
+    moduleEncodeTimerID(id,key);
+    raxInsert(Timers,key,sizeof(key),timer,NULL);
+    return (RedisModuleTimerID)id;
+}
+
+/* Lookup a timer of the calling module by ID. */
+static RedisModuleTimer *moduleLookupTimer(RedisModuleCtx *ctx, RedisModuleTimerID id) {
+    unsigned char key[8];
+    moduleEncodeTimerID(id,key);
+    void *timer = raxFind(Timers,key,sizeof(key));
+    if (timer == raxNotFound) return NULL;
+    if (((RedisModuleTimer *)timer)->module != ctx->module) return NULL;
+    return (RedisModuleTimer *)timer;
+}
+
+/* Stop a timer, returns REDISMODULE_OK if the timer was found, belonged to
+ * the calling module, and was stopped, otherwise REDISMODULE_ERR is
+ * returned. If not NULL, the data pointer is set to the value of the data
+ * argument when the timer was created. */
+int RM_StopTimer(RedisModuleCtx *ctx, RedisModuleTimerID id, void **data) {
+    RedisModuleTimer *timer = moduleLookupTimer(ctx,id);
+    if (timer == NULL) return REDISMODULE_ERR;
+
+    unsigned char key[8];
+    moduleEncodeTimerID(id,key);
+    raxRemove(Timers,key,sizeof(key),NULL);
+    server.el->aeDeleteTimeEvent((long long)id);
+    if (data) *data = timer->data;
+    zfree(timer);
+    return REDISMODULE_OK;
+}
+
+/* Obtain information about a timer: its remaining time before firing
+ * (in milliseconds), and the private data pointer associated with the
+ * timer. If the timer specified does not exist or belongs to a different
+ * module no information is returned and the function returns
+ * REDISMODULE_ERR, otherwise REDISMODULE_OK is returned. The arguments
+ * remaining or data can be NULL if the caller does not need certain
+ * information. */
+int RM_GetTimerInfo(RedisModuleCtx *ctx, RedisModuleTimerID id, uint64_t *remaining, void **data) {
+    RedisModuleTimer *timer = moduleLookupTimer(ctx,id);
+    if (timer == NULL) return REDISMODULE_ERR;
+
+    if (remaining) {
+        mstime_t rem = timer->when - mstime();
+        *remaining = rem < 0 ? 0 : rem;
+    }
+    if (data) *data = timer->data;
+    return REDISMODULE_OK;
+}
+
+/* Stop all the timers of the module, on unload. */
+void moduleStopTimers(RedisModule *module) {
+    raxIterator ri;
+    raxStart(&ri,Timers);
+    raxSeek(&ri,"^",NULL,0);
+    while(raxNext(&ri)) {
+        RedisModuleTimer *timer = (RedisModuleTimer *)ri.data;
+        if (timer->module != module) continue;
+
+        long long id = 0;
+        for (size_t j = 0; j < ri.key_len; j++) id = (id << 8) | ri.key[j];
+        raxRemove(Timers,ri.key,ri.key_len,NULL);
+        raxSeek(&ri,">",ri.key,ri.key_len);
+        server.el->aeDeleteTimeEvent(id);
+        zfree(timer);
+    }
+    raxStop(&ri);
+}
+
+/* --------------------------------------------------------------------------
+ * Modules Event Loop API
+ *
+ * The modules can register their own file descriptors in the server event
+ * loop, to perform asynchronous I/O from the main thread: the callbacks
+ * are called with the dataset locked, so no thread and no thread safe
+ * context is needed to access it.
+ * -------------------------------------------------------------------------- */
+
+typedef struct RedisModuleEventLoopData {
+    RedisModule *module;
+    int fd;
+    RedisModuleEventLoopFunc rFunc;
+    RedisModuleEventLoopFunc wFunc;
+    void *user_data;
+} RedisModuleEventLoopData;
+
+/* All the registered file descriptors, to release them on unload. */
+static list *moduleEventLoopFds;
+
+static void moduleEventLoopCall(RedisModuleEventLoopData *data, RedisModuleEventLoopFunc func, int mask) {
+    RedisModuleCtx ctx = REDISMODULE_CTX_INIT;
+    moduleInitEventLoopContext(&ctx,data->module,0);
+    func(&ctx,data->fd,data->user_data,mask);
+    moduleHandlePropagationAfterCommandCallback(&ctx);
+    moduleFreeContext(&ctx);
+}
+
+/* Two different handlers, since the event loop does not call the same
+ * handler twice when the descriptor is both readable and writable. */
+static void moduleEventLoopReadable(aeEventLoop *el, int fd, void *clientData, int mask) {
+    UNUSED(el);
+    UNUSED(fd);
+    UNUSED(mask);
+    RedisModuleEventLoopData *data = (RedisModuleEventLoopData *)clientData;
+    moduleEventLoopCall(data,data->rFunc,REDISMODULE_EVENTLOOP_READABLE);
+}
+
+static void moduleEventLoopWritable(aeEventLoop *el, int fd, void *clientData, int mask) {
+    UNUSED(el);
+    UNUSED(fd);
+    UNUSED(mask);
+    RedisModuleEventLoopData *data = (RedisModuleEventLoopData *)clientData;
+    moduleEventLoopCall(data,data->wFunc,REDISMODULE_EVENTLOOP_WRITABLE);
+}
+
+/* Add a pipe / socket event to the event loop: 'func' is called with the
+ * file descriptor, 'user_data' and the event mask when 'fd' is readable
+ * or writable, as specified by 'mask', REDISMODULE_EVENTLOOP_READABLE,
+ * REDISMODULE_EVENTLOOP_WRITABLE or both. Only one user data pointer is
+ * associated to a file descriptor: the last registration wins.
+ *
+ * On success REDISMODULE_OK is returned, otherwise REDISMODULE_ERR is
+ * returned and errno is set to ERANGE if 'fd' is negative or exceeds the
+ * event loop size, EINVAL if the arguments are invalid, or EBUSY if the
+ * file descriptor is used by the server or by another module. */
+int RM_EventLoopAdd(RedisModuleCtx *ctx, int fd, int mask, RedisModuleEventLoopFunc func, void *user_data) {
+    if (fd < 0 || fd >= server.el->aeGetSetSize()) {
+        errno = ERANGE;
+        return REDISMODULE_ERR;
+    }
+    if (!func || mask & ~(REDISMODULE_EVENTLOOP_READABLE |
+                          REDISMODULE_EVENTLOOP_WRITABLE) || mask == 0) {
+        errno = EINVAL;
+        return REDISMODULE_ERR;
+    }
+
+    RedisModuleEventLoopData *data = (RedisModuleEventLoopData *)server.el->aeGetFileClientData(fd);
+    if (server.el->aeGetFileEvents(fd) != AE_NONE) {
+        /* The descriptor must be one of ours already. */
+        listNode *ln = data ? moduleEventLoopFds->listSearchKey(data) : NULL;
+        if (!ln || data->module != ctx->module) {
+            errno = EBUSY;
+            return REDISMODULE_ERR;
+        }
+    } else {
+        data = (RedisModuleEventLoopData *)zcalloc(sizeof(*data));
+        data->module = ctx->module;
+        data->fd = fd;
+        moduleEventLoopFds->listAddNodeTail(data);
+    }
+
+    data->user_data = user_data;
+    int retval = AE_OK;
+    if (mask & REDISMODULE_EVENTLOOP_READABLE) {
+        data->rFunc = func;
+        retval = server.el->aeCreateFileEvent(fd,AE_READABLE,
+                                              moduleEventLoopReadable,data);
+    }
+    if (retval == AE_OK && mask & REDISMODULE_EVENTLOOP_WRITABLE) {
+        data->wFunc = func;
+        retval = server.el->aeCreateFileEvent(fd,AE_WRITABLE,
+                                              moduleEventLoopWritable,data);
+    }
+
+    if (retval == AE_ERR) {
+        if (server.el->aeGetFileEvents(fd) == AE_NONE) {
+            moduleEventLoopFds->listDelNode(moduleEventLoopFds->listSearchKey(data));
+            zfree(data);
+        }
+        errno = EINVAL;
+        return REDISMODULE_ERR;
+    }
+    return REDISMODULE_OK;
+}
+
+/* Release the registration data of 'fd' when no event is left for it. */
+static void moduleEventLoopRelease(RedisModuleEventLoopData *data) {
+    if (server.el->aeGetFileEvents(data->fd) != AE_NONE) return;
+    listNode *ln = moduleEventLoopFds->listSearchKey(data);
+    if (ln) moduleEventLoopFds->listDelNode(ln);
+    zfree(data);
+}
+
+/* Delete the events of 'mask' registered by the module for 'fd'. Returns
+ * REDISMODULE_ERR, with errno set to ERANGE or EINVAL, if 'fd' or 'mask'
+ * are out of range, and to ENOENT if the module did not register 'fd'. */
+int RM_EventLoopDel(RedisModuleCtx *ctx, int fd, int mask) {
+    if (fd < 0 || fd >= server.el->aeGetSetSize()) {
+        errno = ERANGE;
+        return REDISMODULE_ERR;
+    }
+    if (mask & ~(REDISMODULE_EVENTLOOP_READABLE |
+                 REDISMODULE_EVENTLOOP_WRITABLE) || mask == 0) {
+        errno = EINVAL;
+        return REDISMODULE_ERR;
+    }
+
+    RedisModuleEventLoopData *data = (RedisModuleEventLoopData *)server.el->aeGetFileClientData(fd);
+    if (!data || !moduleEventLoopFds->listSearchKey(data) ||
+        data->module != ctx->module)
+    {
+        errno = ENOENT;
+        return REDISMODULE_ERR;
+    }
+
+    int aemask = 0;
+    if (mask & REDISMODULE_EVENTLOOP_READABLE) aemask |= AE_READABLE;
+    if (mask & REDISMODULE_EVENTLOOP_WRITABLE) aemask |= AE_WRITABLE;
+    server.el->aeDeleteFileEvent(fd,aemask);
+    moduleEventLoopRelease(data);
+    return REDISMODULE_OK;
+}
+
+/* Remove all the file descriptors of the module from the event loop, on
+ * unload. */
+void moduleEventLoopDelModule(RedisModule *module) {
+    listIter li(moduleEventLoopFds);
+    listNode *ln;
+    while((ln = li.listNext())) {
+        RedisModuleEventLoopData *data = (RedisModuleEventLoopData *)ln->listNodeValue();
+        if (data->module != module) continue;
+        server.el->aeDeleteFileEvent(data->fd,AE_READABLE|AE_WRITABLE);
+        moduleEventLoopFds->listDelNode(ln);
+        zfree(data);
+    }
 }
 
 /* --------------------------------------------------------------------------
@@ -3696,6 +4592,10 @@ void moduleRegisterCoreAPI();
 
 void moduleInitModulesSystem() {
     moduleUnblockedClients = listCreate();
+    moduleCommandFilters = listCreate();
+    moduleKeyspaceSubscribers = listCreate();
+    Timers = raxNew();
+    moduleEventLoopFds = listCreate();
 
     server.loadmodule_queue = listCreate();
     modules = dictCreate(&modulesDictType,NULL);
@@ -3712,8 +4612,17 @@ void moduleInitModulesSystem() {
     anetNonBlock(NULL,server.module_blocked_pipe[1]);
 
     /* Our thread-safe contexts GIL must start with already locked:
-     * it is just unlocked when it's safe. */
-    pthread_mutex_lock(&moduleGIL);
+     * it is just unlocked when it's safe. The main thread must not starve
+     * waiting for the readers: new readers wait for the queued writers. */
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+    pthread_rwlockattr_setkind_np(&attr,
+        PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&moduleGIL,&attr);
+    pthread_rwlockattr_destroy(&attr);
+    pthread_rwlock_wrlock(&moduleGIL);
 }
 
 /* Load all the modules in the server.loadmodule_queue list, which is
@@ -3744,6 +4653,7 @@ void moduleLoadFromQueue() {
 
 void moduleFreeModuleStructure(RedisModule *module) {
     listRelease(module->m_types);
+    listRelease(module->m_filters);
     sdsfree(module->m_name);
     zfree(module);
 }
@@ -3762,6 +4672,7 @@ void moduleUnregisterCommands(RedisModule *module) {
                 server.commands->dictDelete(cmdname);
                 server.orig_commands->dictDelete(cmdname);
                 sdsfree(cmdname);
+                zfree(cp->rediscmd->latency_hist);
                 zfree(cp->rediscmd);
                 zfree(cp);
             }
@@ -3828,7 +4739,11 @@ int moduleUnload(sds name) {
 
     moduleUnregisterCommands(module);
 
-    /* Unregister all the hooks. TODO: Yet no hooks support here. */
+    /* Unregister all the hooks. */
+    moduleUnregisterFilters(module);
+    moduleUnsubscribeNotifications(module);
+    moduleStopTimers(module);
+    moduleEventLoopDelModule(module);
 
     /* Unload the dynamic library. */
     if (dlclose(module->m_handle) == -1) {
@@ -3981,6 +4896,8 @@ void moduleRegisterCoreAPI() {
     REGISTER_API(ZsetRangeEndReached);
     REGISTER_API(HashSet);
     REGISTER_API(HashGet);
+    REGISTER_API(HashGetPtr);
+    REGISTER_API(ValueForEach);
     REGISTER_API(IsKeysPositionRequest);
     REGISTER_API(KeyAtPos);
     REGISTER_API(GetClientId);
@@ -4020,7 +4937,23 @@ void moduleRegisterCoreAPI() {
     REGISTER_API(FreeThreadSafeContext);
     REGISTER_API(ThreadSafeContextLock);
     REGISTER_API(ThreadSafeContextUnlock);
+    REGISTER_API(ThreadSafeContextReadLock);
+    REGISTER_API(ThreadSafeContextYield);
     REGISTER_API(DigestAddStringBuffer);
     REGISTER_API(DigestAddLongLong);
     REGISTER_API(DigestEndSequence);
+    REGISTER_API(DefragAlloc);
+    REGISTER_API(SubscribeToKeyspaceEvents);
+    REGISTER_API(RegisterCommandFilter);
+    REGISTER_API(UnregisterCommandFilter);
+    REGISTER_API(CommandFilterArgsCount);
+    REGISTER_API(CommandFilterArgGet);
+    REGISTER_API(CommandFilterArgInsert);
+    REGISTER_API(CommandFilterArgReplace);
+    REGISTER_API(CommandFilterArgDelete);
+    REGISTER_API(CreateTimer);
+    REGISTER_API(StopTimer);
+    REGISTER_API(GetTimerInfo);
+    REGISTER_API(EventLoopAdd);
+    REGISTER_API(EventLoopDel);
 }
@@ -32,6 +32,7 @@
 
 #include "../redismodule.h"
 #include <string.h>
+#include <stdlib.h>
 
 /* --------------------------------- Helpers -------------------------------- */
 
@@ -120,6 +121,145 @@ int TestStringPrintf(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     return REDISMODULE_OK;
 }
 
+/* Add the number in the element, or in the value for hashes, to the sum
+ * at 'privdata'. */
+static int TestValueSum(RedisModuleKey *key, const char *ele, size_t elelen,
+                        const char *value, size_t valuelen, void *privdata)
+{
+    REDISMODULE_NOT_USED(key);
+    long long *sum = privdata;
+    const char *num = value ? value : ele;
+    size_t len = value ? valuelen : elelen;
+    char buf[32];
+
+    if (len >= sizeof(buf)) return REDISMODULE_ERR;
+    memcpy(buf,num,len);
+    buf[len] = '\0';
+    *sum += strtoll(buf,NULL,10);
+    return REDISMODULE_OK;
+}
+
+/* TEST.VALUE.FOREACH -- Test direct access to the elements of values. */
+int TestValueForEach(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+
+    RedisModule_AutoMemory(ctx);
+    const char *names[] = {"hash","list","set"};
+    RedisModule_Call(ctx,"hmset","ccccccc","hash","a","1","b","20","c","300");
+    RedisModule_Call(ctx,"rpush","cccc","list","1","20","300");
+    RedisModule_Call(ctx,"sadd","cccc","set","1","20","300");
+
+    for (int j = 0; j < 3; j++) {
+        RedisModuleString *keyname = RedisModule_CreateString(ctx,names[j],
+                                                              strlen(names[j]));
+        RedisModuleKey *key = RedisModule_OpenKey(ctx,keyname,REDISMODULE_READ);
+        long long sum = 0;
+        RedisModule_ValueForEach(key,TestValueSum,&sum);
+        if (sum != 321) {
+            RedisModule_CloseKey(key);
+            RedisModule_ReplyWithError(ctx,"ERR wrong sum of the elements");
+            return REDISMODULE_OK;
+        }
+        if (j == 0) {
+            size_t len;
+            RedisModuleString *field = RedisModule_CreateString(ctx,"b",1);
+            const char *ptr = RedisModule_HashGetPtr(key,field,&len);
+            if (ptr == NULL || len != 2 || memcmp(ptr,"20",2) != 0) {
+                RedisModule_CloseKey(key);
+                RedisModule_ReplyWithError(ctx,"ERR wrong hash field value");
+                return REDISMODULE_OK;
+            }
+        }
+        RedisModule_CloseKey(key);
+    }
+    RedisModule_Call(ctx,"del","ccc","hash","list","set");
+    RedisModule_ReplyWithSimpleString(ctx,"OK");
+    return REDISMODULE_OK;
+}
+
+/* The string keyspace events seen by TestNotifyCallback(). */
+static long long string_events = 0;
+
+int TestNotifyCallback(RedisModuleCtx *ctx, int type, const char *event, RedisModuleString *key) {
+    REDISMODULE_NOT_USED(ctx);
+    REDISMODULE_NOT_USED(event);
+    REDISMODULE_NOT_USED(key);
+    if (type == REDISMODULE_NOTIFY_STRING) string_events++;
+    return REDISMODULE_OK;
+}
+
+/* TEST.NOTIFICATIONS -- Test the keyspace events callbacks. */
+int TestNotifications(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+
+    long long before = string_events;
+    RedisModule_Call(ctx,"set","cc","notify","1");
+    RedisModule_Call(ctx,"incr","c","notify");
+    RedisModule_Call(ctx,"del","c","notify");
+    if (string_events - before != 2) {
+        RedisModule_ReplyWithError(ctx,"ERR wrong number of string events");
+        return REDISMODULE_OK;
+    }
+    RedisModule_ReplyWithSimpleString(ctx,"OK");
+    return REDISMODULE_OK;
+}
+
+/* Rewrite "TEST.FILTERED <arg>" into "ECHO <arg> filtered". */
+void TestCommandFilter(RedisModuleCommandFilterCtx *filter) {
+    size_t len;
+    const char *cmd = RedisModule_StringPtrLen(
+        RedisModule_CommandFilterArgGet(filter,0),&len);
+    if (len != 13 || strncasecmp(cmd,"test.filtered",13) != 0) return;
+    if (RedisModule_CommandFilterArgsCount(filter) != 2) return;
+
+    RedisModule_CommandFilterArgReplace(filter,0,
+        RedisModule_CreateString(NULL,"echo",4));
+    RedisModule_CommandFilterArgInsert(filter,2,
+        RedisModule_CreateString(NULL,"filtered",8));
+    RedisModule_CommandFilterArgDelete(filter,2);
+}
+
+/* TEST.FILTERED -- Only called if the command filter did not rewrite it. */
+int TestFiltered(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+    RedisModule_ReplyWithError(ctx,"ERR the command was not filtered");
+    return REDISMODULE_OK;
+}
+
+void TestTimerHandler(RedisModuleCtx *ctx, void *data) {
+    REDISMODULE_NOT_USED(ctx);
+    REDISMODULE_NOT_USED(data);
+}
+
+/* TEST.TIMER -- Test the creation, inspection and removal of timers. */
+int TestTimer(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+
+    static int mydata;
+    uint64_t remaining;
+    void *data;
+    RedisModuleTimerID id = RedisModule_CreateTimer(ctx,10000,
+                                                    TestTimerHandler,&mydata);
+    if (RedisModule_GetTimerInfo(ctx,id,&remaining,&data) == REDISMODULE_ERR ||
+        remaining > 10000 || data != &mydata)
+    {
+        RedisModule_ReplyWithError(ctx,"ERR wrong timer info");
+        return REDISMODULE_OK;
+    }
+    if (RedisModule_StopTimer(ctx,id,&data) == REDISMODULE_ERR ||
+        data != &mydata ||
+        RedisModule_StopTimer(ctx,id,NULL) == REDISMODULE_OK)
+    {
+        RedisModule_ReplyWithError(ctx,"ERR the timer was not stopped");
+        return REDISMODULE_OK;
+    }
+    RedisModule_ReplyWithSimpleString(ctx,"OK");
+    return REDISMODULE_OK;
+}
 
 /* TEST.CTXFLAGS -- Test GetContextFlags. */
 int TestCtxFlags(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
@@ -275,6 +415,18 @@ int TestIt(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     T("test.string.printf", "cc", "foo", "bar");
     if (!TestAssertStringReply(ctx,reply,"Got 3 args. argv[1]: foo, argv[2]: bar",38)) goto fail;
 
+    T("test.value.foreach","");
+    if (!TestAssertStringReply(ctx,reply,"OK",2)) goto fail;
+
+    T("test.notifications","");
+    if (!TestAssertStringReply(ctx,reply,"OK",2)) goto fail;
+
+    T("test.filtered","c","foo");
+    if (!TestAssertStringReply(ctx,reply,"foo",3)) goto fail;
+
+    T("test.timer","");
+    if (!TestAssertStringReply(ctx,reply,"OK",2)) goto fail;
+
     RedisModule_ReplyWithSimpleString(ctx,"ALL TESTS PASSED");
     return REDISMODULE_OK;
 
@@ -307,6 +459,27 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
         TestStringPrintf,"write deny-oom",1,1,1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
 
+    if (RedisModule_CreateCommand(ctx,"test.value.foreach",
+        TestValueForEach,"write deny-oom",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"test.notifications",
+        TestNotifications,"write deny-oom",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"test.filtered",
+        TestFiltered,"readonly",0,0,0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"test.timer",
+        TestTimer,"readonly",0,0,0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    RedisModule_SubscribeToKeyspaceEvents(ctx,REDISMODULE_NOTIFY_STRING,
+        TestNotifyCallback);
+    if (RedisModule_RegisterCommandFilter(ctx,TestCommandFilter,0) == NULL)
+        return REDISMODULE_ERR;
+
     if (RedisModule_CreateCommand(ctx,"test.ctxflags",
         TestCtxFlags,"readonly",1,1,1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
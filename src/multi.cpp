@@ -109,10 +109,87 @@ void execCommandPropagateMulti(client *c) {
     decrRefCount(multistring);
 }
 
+/* While EXEC runs the queued commands, propagate() collects the commands
+ * to send to the AOF and the slaves in server.exec_propagate, so that the
+ * whole transaction is appended to the AOF buffer and to the replication
+ * stream at once by execFlushPropagation(), instead of once per command.
+ *
+ * Adjacent commands of the same variadic kind against the same key, like
+ * the HSETs of a bulk writer, are propagated as a single command with all
+ * the arguments: the effect of the merged command is the same, since they
+ * would be executed one after the other anyway. */
+#define EXEC_PROPAGATE_MERGE_MAX_ARGC 1024
+
+/* Return true if the command can be merged with the last collected one. */
+static int execCanMerge(redisOp *last, struct redisCommand *cmd, int dbid,
+                        robj **argv, int argc, int target)
+{
+    if (last->cmd != cmd || last->dbid != dbid || last->target != target)
+        return 0;
+    if (cmd->proc != hsetCommand && cmd->proc != hdelCommand &&
+        cmd->proc != saddCommand && cmd->proc != sremCommand &&
+        cmd->proc != rpushCommand && cmd->proc != lpushCommand)
+        return 0;
+    if (last->argc+argc-2 > EXEC_PROPAGATE_MERGE_MAX_ARGC) return 0;
+    return equalStringObjects(last->argv[1],argv[1]);
+}
+
+void execPropagate(struct redisCommand *cmd, int dbid, robj **argv, int argc,
+                   int target)
+{
+    redisOpArray *oa = &server.exec_propagate;
+    robj **argvcopy;
+    int j;
+
+    if (oa->numops &&
+        execCanMerge(oa->ops+oa->numops-1,cmd,dbid,argv,argc,target))
+    {
+        redisOp *last = oa->ops+oa->numops-1;
+
+        last->argv = (robj **)zrealloc(last->argv,
+            sizeof(robj*)*(last->argc+argc-2));
+        for (j = 2; j < argc; j++) {
+            last->argv[last->argc++] = argv[j];
+            incrRefCount(argv[j]);
+        }
+        return;
+    }
+
+    argvcopy = (robj **)zmalloc(sizeof(robj*)*argc);
+    for (j = 0; j < argc; j++) {
+        argvcopy[j] = argv[j];
+        incrRefCount(argv[j]);
+    }
+    redisOpArrayAppend(oa,cmd,dbid,argvcopy,argc,target);
+}
+
+/* Send to the AOF and to the slaves the commands collected so far. */
+void execFlushPropagation(void) {
+    redisOpArray *oa = &server.exec_propagate;
+    sds buf = NULL;
+    int j;
+
+    if (oa->numops == 0) return;
+    if (server.aof_state != AOF_OFF) {
+        buf = sdsempty();
+        for (j = 0; j < oa->numops; j++) {
+            redisOp *op = oa->ops+j;
+            if (op->target & PROPAGATE_AOF)
+                buf = catAppendOnlyCommand(buf,op->cmd,op->dbid,op->argv,
+                                           op->argc);
+        }
+        if (sdslen(buf)) feedAppendOnlyFileBuffer(buf);
+        sdsfree(buf);
+    }
+    replicationFeedSlavesOps(server.slaves,oa->ops,oa->numops);
+    redisOpArrayFree(oa);
+    redisOpArrayInit(oa);
+}
+
 void execCommand(client *c) {
     int j;
     robj **orig_argv;
-    int orig_argc;
+    int orig_argc, orig_argv_len;
     struct redisCommand *orig_cmd;
     int must_propagate = 0; /* Need to propagate MULTI/EXEC to AOF / slaves? */
     int was_master = server.masterhost == NULL;
@@ -138,14 +215,22 @@ void execCommand(client *c) {
     /* Exec all the queued commands */
     c->unwatchAllKeys(); /* Unwatch ASAP otherwise we'll waste CPU cycles */
     orig_argv = c->m_argv;
+    orig_argv_len = c->m_argv_len;
     orig_argc = c->m_argc;
     orig_cmd = c->m_cmd;
     c->addReplyMultiBulkLen(c->m_multi_exec_state.m_count);
+    server.exec_propagate_batch = 1;
     for (j = 0; j < c->m_multi_exec_state.m_count; j++) {
         c->m_argc = c->m_multi_exec_state.m_commands[j].argc;
         c->m_argv = c->m_multi_exec_state.m_commands[j].argv;
+        c->m_argv_len = c->m_argc;
         c->m_cmd = c->m_multi_exec_state.m_commands[j].cmd;
 
+        /* Administrative commands may change how the commands are
+         * propagated, for instance turning this master into a slave:
+         * what was collected so far is propagated before calling them. */
+        if (c->m_cmd->m_flags & CMD_ADMIN) execFlushPropagation();
+
         /* Propagate a MULTI request once we encounter the first command which
          * is not readonly nor an administrative one.
          * This way we'll deliver the MULTI/..../EXEC block as a whole and
@@ -164,12 +249,24 @@ void execCommand(client *c) {
         c->m_multi_exec_state.m_commands[j].cmd = c->m_cmd;
     }
     c->m_argv = orig_argv;
+    c->m_argv_len = orig_argv_len;
     c->m_argc = orig_argc;
     c->m_cmd = orig_cmd;
     c->discardTransaction();
 
     /* Make sure the EXEC command will be propagated as well if MULTI
-     * was already propagated. */
+     * was already propagated: it is added to the block of the transaction
+     * here, instead of being propagated by call() after it. */
+    if (must_propagate) {
+        robj *execstring = createStringObject("EXEC",4);
+        propagate(server.execCommand,c->m_cur_selected_db->m_id,&execstring,1,
+                  PROPAGATE_AOF|PROPAGATE_REPL);
+        decrRefCount(execstring);
+        preventCommandPropagation(c);
+    }
+    execFlushPropagation();
+    server.exec_propagate_batch = 0;
+
     if (must_propagate) {
         int is_master = server.masterhost == NULL;
         server.dirty++;
@@ -211,6 +308,59 @@ struct watchedKey {
     redisDb *db;
 };
 
+/* Every DB keeps a counting filter of its watched keys, so that the
+ * touchWatchedKey() call performed for every modified key can tell that the
+ * key is not watched without hashing it with the dict hash function and
+ * walking a m_watched_keys bucket: on write heavy instances where WATCH is
+ * only used from time to time almost every call stops at the filter.
+ *
+ * The filter is an array of counters, every watched key incrementing the
+ * counters of its two slots. Since the counters are decremented when the
+ * key is no longer watched the filter never needs to be rebuilt, and a key
+ * having a zero counter in any of its slots is not watched for sure. */
+#define WATCHED_FILTER_SLOTS 1024 /* Must be a power of two. */
+
+/* Cheap fingerprint of the key used to index the filter: the length and
+ * the last bytes of the key, where keys sharing a prefix usually differ. */
+static inline uint32_t watchedFilterHash(robj *key) {
+    const unsigned char *p = (const unsigned char *)key->ptr;
+    size_t len = sdslen((sds)key->ptr);
+    size_t start = len > 16 ? len-16 : 0;
+    uint32_t h = 2166136261u ^ (uint32_t)len;
+
+    for (size_t j = start; j < len; j++) {
+        h ^= p[j];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static inline uint32_t watchedFilterSlot(uint32_t h, int which) {
+    if (which) h = (h >> 16) | (h << 16);
+    return h & (WATCHED_FILTER_SLOTS-1);
+}
+
+/* Add or remove (incr is 1 or -1) a key of m_watched_keys to the filter. */
+static void watchedFilterUpdate(redisDb *db, robj *key, int incr) {
+    uint32_t h = watchedFilterHash(key);
+
+    if (db->m_watched_filter == NULL)
+        db->m_watched_filter = (uint32_t *)
+            zcalloc(sizeof(uint32_t)*WATCHED_FILTER_SLOTS);
+    db->m_watched_filter[watchedFilterSlot(h,0)] += incr;
+    db->m_watched_filter[watchedFilterSlot(h,1)] += incr;
+}
+
+/* Return 0 if the key is surely not watched in this DB. */
+static inline int watchedFilterMayContain(redisDb *db, robj *key) {
+    uint32_t h;
+
+    if (db->m_watched_filter == NULL) return 0;
+    h = watchedFilterHash(key);
+    return db->m_watched_filter[watchedFilterSlot(h,0)] &&
+           db->m_watched_filter[watchedFilterSlot(h,1)];
+}
+
 /* Watch for the specified key */
 void watchForKey(client *c, robj *key) {
     list *clients = NULL;
@@ -230,6 +380,7 @@ void watchForKey(client *c, robj *key) {
         clients = listCreate();
         c->m_cur_selected_db->m_watched_keys->dictAdd(key,clients);
         incrRefCount(key);
+        watchedFilterUpdate(c->m_cur_selected_db,key,1);
     }
     clients->listAddNodeTail(c);
     /* Add the new key to the list of keys watched by this client */
@@ -255,8 +406,10 @@ void client::unwatchAllKeys() {
         serverAssertWithInfo(this,NULL,clients != NULL);
         clients->listDelNode(clients->listSearchKey(this));
         /* Kill the entry at all if this was the only client */
-        if (clients->listLength() == 0)
+        if (clients->listLength() == 0) {
+            watchedFilterUpdate(wk->db,wk->key,-1);
             wk->db->m_watched_keys->dictDelete( wk->key);
+        }
         /* Remove this watched key from the client->watched list */
         m_watched_keys->listDelNode(ln);
         decrRefCount(wk->key);
@@ -271,6 +424,7 @@ void touchWatchedKey(redisDb *db, robj *key) {
     listNode *ln;
 
     if (db->m_watched_keys->dictSize() == 0) return;
+    if (!watchedFilterMayContain(db,key)) return;
     clients = (list *)db->m_watched_keys->dictFetchValue(key);
     if (!clients) return;
 
@@ -29,9 +29,27 @@
 
 #include "server.h"
 #include "atomicvar.h"
+#include "replframe.h"
+#include "slowlog.h"
+#include "placement.h"
+#include "cluster.h"
 #include <sys/uio.h>
+#include <poll.h>
 #include <math.h>
 #include <ctype.h>
+#include <atomic>
+
+#if defined(__x86_64__) && defined(__SSE2__)
+#define HAVE_PROTO_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define HAVE_PROTO_NEON 1
+#include <arm_neon.h>
+#endif
+
+static void freeClientOrAsync(client *c);
 
 /* Return the size consumed from the allocator, for the specified SDS string,
  * including internal fragmentation. This function is used in order to compute
@@ -52,13 +70,106 @@ size_t getStringObjectSdsUsedMemory(robj *o) {
     }
 }
 
+/* Nodes of the client reply list are sds strings, with the exception of
+ * reference nodes, used to send large sds encoded values, or large ranges
+ * of them, without copying them into the output buffers: the node just
+ * holds a reference to the object and the range to send, and
+ * writeToClient() sends the string directly from the object.
+ *
+ * A reference node is recognized by the byte preceding the pointer stored
+ * in the list, that for sds strings is the flags byte: for references the
+ * type bits are set to REPLY_REF_TYPE, that is not a valid sds type. Only
+ * replyNodeLen() and replyNodeBuf() should be used to access reply list
+ * nodes that may be references. */
+#define REPLY_REF_TYPE SDS_TYPE_MASK
+
+struct clientReplyRef {
+    robj *obj;
+    size_t offset;          /* Range of the object string to send. */
+    size_t len;
+    unsigned char flags;    /* Always REPLY_REF_TYPE. */
+    char node[];            /* Address stored in the reply list. */
+};
+
+static inline int replyNodeIsRef(const void *o) {
+    return o && (((const unsigned char*)o)[-1] & SDS_TYPE_MASK) == REPLY_REF_TYPE;
+}
+
+static inline clientReplyRef *replyNodeRef(const void *o) {
+    return (clientReplyRef*)((const char*)o-offsetof(clientReplyRef,node));
+}
+
+static void *createReplyRef(robj *obj, size_t offset, size_t len) {
+    clientReplyRef *ref = (clientReplyRef *)zmalloc(sizeof(*ref));
+
+    incrRefCount(obj);
+    ref->obj = obj;
+    ref->offset = offset;
+    ref->len = len;
+    ref->flags = REPLY_REF_TYPE;
+    return ref->node;
+}
+
+static inline size_t replyNodeLen(const void *o) {
+    return replyNodeIsRef(o) ? replyNodeRef(o)->len : sdslen((sds)o);
+}
+
+static inline const char *replyNodeBuf(const void *o) {
+    if (!replyNodeIsRef(o)) return (const char*)o;
+    clientReplyRef *ref = replyNodeRef(o);
+    return (const char*)ref->obj->ptr+ref->offset;
+}
+
+/* The sds nodes of the reply list are mostly blocks of REPLY_BLOCK_LEN bytes,
+ * whose allocation is exactly PROTO_REPLY_CHUNK_BYTES, filled completely
+ * before the next one is added: appending to the reply never reallocates,
+ * and a long reply is written with iovecs of the same size. The blocks of
+ * the replies written to the sockets are kept in a per thread free list,
+ * so that the next replies reuse them instead of allocating new ones. */
+#define REPLY_BLOCK_LEN (PROTO_REPLY_CHUNK_BYTES-sizeof(struct sdshdr16)-1)
+#define REPLY_BLOCK_FREELIST_MAX 64 /* 1MB of blocks per thread. */
+
+static __thread sds reply_block_freelist[REPLY_BLOCK_FREELIST_MAX];
+static __thread int reply_block_freelist_len = 0;
+
+static sds createReplyBlock(void) {
+    if (reply_block_freelist_len)
+        return reply_block_freelist[--reply_block_freelist_len];
+    zmalloc_transient_begin();
+    sds block = sdsnewlen(NULL,REPLY_BLOCK_LEN);
+    zmalloc_transient_end();
+    sdsclear(block);
+    return block;
+}
+
+static int ioThreadDeferDecrRefCount(robj *o);
+
 /* Client.reply list dup and free methods. */
 void *dupClientReplyValue(void *o) {
+    if (replyNodeIsRef(o)) {
+        clientReplyRef *ref = replyNodeRef(o);
+        return createReplyRef(ref->obj,ref->offset,ref->len);
+    }
     return sdsdup((sds)o);
 }
 
 void freeClientReplyValue(void *o) {
+    if (replyNodeIsRef(o)) {
+        clientReplyRef *ref = replyNodeRef(o);
+        if (!ioThreadDeferDecrRefCount(ref->obj)) decrRefCount(ref->obj);
+        zfree(ref);
+        return;
+    }
+    if (o && sdsalloc((sds)o) == REPLY_BLOCK_LEN &&
+        reply_block_freelist_len < REPLY_BLOCK_FREELIST_MAX)
+    {
+        sdsclear((sds)o);
+        reply_block_freelist[reply_block_freelist_len++] = (sds)o;
+        return;
+    }
+    zmalloc_transient_begin();
     sdsfree((sds)o);
+    zmalloc_transient_end();
 }
 
 int listMatchObjects(void *a, void *b) {
@@ -66,10 +177,23 @@ int listMatchObjects(void *a, void *b) {
 }
 blockingState::blockingState()
 : m_timeout(0)
-, m_keys(dictCreate(&objectKeyPointerValueDictType,NULL))
+, m_in_timeout_table(0)
+, m_keys(dictCreate(&objectKeyHeapPointerValueDictType,NULL))
 , m_target(NULL)
+, m_xread_count(0)
+, m_xread_group(NULL)
+, m_xread_consumer(NULL)
+, m_xread_group_noack(0)
 , m_num_replicas(0)
 , m_replication_offset()
+, m_migrate_job(NULL)
+, m_resume(NULL)
+, m_resume_free(NULL)
+, m_resume_privdata(NULL)
+, m_produce(NULL)
+, m_tier_reads(0)
+, m_bgread_waits(0)
+, m_rerun(0)
 , m_module_blocked_handle(NULL)
 {}
 
@@ -85,6 +209,8 @@ client *createClient(int fd) {
         anetEnableTcpNoDelay(NULL,fd);
         if (server.tcpkeepalive)
             anetKeepAlive(NULL,fd,server.tcpkeepalive);
+        if (server.busy_poll_socket_us)
+            anetBusyPoll(NULL,fd,server.busy_poll_socket_us);
         if (server.el->aeCreateFileEvent(fd,AE_READABLE,
             readQueryFromClient, client_mem) == AE_ERR)
         {
@@ -98,24 +224,40 @@ client *createClient(int fd) {
     atomicGetIncr(server.next_client_id, client_id, 1);
     client *c = new (client_mem) client(client_id, fd);
     c->selectDb(0);
-    if (fd != -1)
+    if (fd != -1) {
         server.clients->listAddNodeTail(c);
+        raxInsert(server.clients_index,(unsigned char*)&client_id,
+                  sizeof(client_id),c,NULL);
+    }
     return c;
 }
 
+/* Return the active client with the specified ID, or NULL if there is no
+ * such client. */
+client *lookupClientByID(uint64_t id) {
+    void *c = raxFind(server.clients_index,(unsigned char*)&id,sizeof(id));
+    return c == raxNotFound ? NULL : (client *)c;
+}
+
 client::client(uint64_t in_client_id, int in_fd)
  : m_client_id(in_client_id)
  , m_fd(in_fd)
+ , m_shm(NULL)
  , m_client_name(NULL)
  , m_response_buff_pos(0)
  , m_query_buf(sdsempty())
  , m_pending_query_buf(sdsempty())
  , m_query_buf_peak(0)
+ , m_cron_memory_usage(0)
+ , m_query_buf_shared(0)
  , m_req_protocol_type(0)
  , m_argc(0)
  , m_argv(NULL)
+ , m_argv_len(0)
  , m_cmd(NULL)
  , m_last_cmd(NULL)
+ , m_thread_cmd_duration(0)
+ , m_thread_shard(-1)
  , m_multi_bulk_len(0)
  , m_bulk_len(-1)
  , m_already_sent_len(0)
@@ -125,28 +267,46 @@ client::client(uint64_t in_client_id, int in_fd)
  , m_authenticated(0)
  , m_replication_state(REPL_STATE_NONE)
  , m_repl_put_online_on_ack(0)
+ , m_replication_db_chunk(0)
  , m_applied_replication_offset(0)
  , m_read_replication_offset(0)
  , m_replication_ack_off(0)
  , m_replication_ack_time(0)
  , m_slave_listening_port(0)
  , m_slave_capabilities(SLAVE_CAPA_NONE)
+ , m_resume_offset(-1)
+ , m_repl_compress(0)
+ , m_repl_frames(sdsempty())
+ , m_repl_cursor()
+ , m_repl_disk_ranges(NULL)
  , m_reply(listCreate())
+ , m_reply_builder(NULL)
  , m_reply_bytes(0)
  , m_obuf_soft_limit_reached_time(0)
  , m_blocking_op_type(BLOCKED_NONE)
  , m_blocking_state()
  , m_last_write_global_replication_offset(0)
+ , m_aof_commit_seq(0)
  , m_watched_keys(listCreate())
  , m_pubsub_channels(dictCreate(&objectKeyPointerValueDictType,NULL))
  , m_pubsub_patterns(listCreate())
+ , m_pubsubshard_channels(dictCreate(&objectKeyPointerValueDictType,NULL))
+ , m_tracking_flags(0)
+ , m_client_tracking_redirection(0)
+ , m_client_tracking_prefixes(NULL)
  , m_cached_peer_id(NULL)
+ , m_stat_commands(0)
+ , m_stat_cmd_usec(0)
+ , m_stat_net_input_bytes(0)
+ , m_stat_net_output_bytes(0)
 {
     m_reply->listSetFreeMethod(freeClientReplyValue);
     m_reply->listSetDupMethod(dupClientReplyValue);
     m_slave_ip[0] = '\0';
+    m_resume_mark[0] = '\0';
     m_pubsub_patterns->listSetFreeMethod(decrRefCountVoid);
     m_pubsub_patterns->listSetMatchMethod(listMatchObjects);
+    memset(m_argv_cache,0,sizeof(m_argv_cache));
    initClientMultiState(this);
 }
 /* This function is called every time we are going to transmit new data
@@ -192,6 +352,7 @@ int client::prepareClientToWrite() {
      * receive writes at this stage. */
     if (!this->clientHasPendingReplies() &&
         !(m_flags & CLIENT_PENDING_WRITE) &&
+        !(m_flags & CLIENT_PENDING_READ) &&
         (m_replication_state == REPL_STATE_NONE ||
          (m_replication_state == SLAVE_STATE_ONLINE && !m_repl_put_online_on_ack)))
     {
@@ -233,31 +394,29 @@ int client::_addReplyToBuffer(const char *s, size_t len) {
     return C_OK;
 }
 
+/* Add to the reply list a reference node to 'len' bytes at 'offset' of the
+ * RAW encoded object 'o'. Clients without a socket can't use references,
+ * since their reply list is consumed directly as a list of sds strings by
+ * the scripting and modules code: C_ERR is returned for them, and nothing
+ * is added. */
+int client::_addReplyRefToList(robj *o, size_t offset, size_t len) {
+    if (m_fd <= 0 || (m_flags & (CLIENT_LUA|CLIENT_MODULE))) return C_ERR;
+    m_reply->listAddNodeTail(createReplyRef(o,offset,len));
+    m_reply_bytes += len;
+    asyncCloseClientOnOutputBufferLimitReached();
+    return C_OK;
+}
+
 void client::_addReplyObjectToList(robj *o) {
     if (m_flags & CLIENT_CLOSE_AFTER_REPLY)
         return;
 
-    if (m_reply->listLength() == 0) {
-        sds s = sdsdup((sds)o->ptr);
-        m_reply->listAddNodeTail(s);
-        m_reply_bytes += sdslen(s);
-    } else {
-        listNode *ln = m_reply->listLast();
-        sds tail = (sds)ln->listNodeValue();
-
-        /* Append to this object when possible. If tail == NULL it was
-         * set via addDeferredMultiBulkLength(). */
-        if (tail && sdslen(tail)+sdslen((sds)o->ptr) <= PROTO_REPLY_CHUNK_BYTES) {
-            tail = sdscatsds(tail,(sds)o->ptr);
-            ln->SetNodeValue(tail);
-            m_reply_bytes += sdslen((sds)o->ptr);
-        } else {
-            sds s = sdsdup((sds)o->ptr);
-            m_reply->listAddNodeTail(s);
-            m_reply_bytes += sdslen(s);
-        }
-    }
-    asyncCloseClientOnOutputBufferLimitReached();
+    /* Large values are referenced instead of copied. */
+    if (o->encoding == OBJ_ENCODING_RAW &&
+        sdslen((sds)o->ptr) >= PROTO_REPLY_REF_MIN_BYTES &&
+        _addReplyRefToList(o,0,sdslen((sds)o->ptr)) == C_OK) return;
+
+    _addReplyStringToList((const char*)o->ptr,sdslen((sds)o->ptr));
 }
 
 /* This method takes responsibility over the sds. When it is no longer
@@ -268,50 +427,43 @@ void client::_addReplySdsToList(sds s) {
         return;
     }
 
-    if (m_reply->listLength() == 0) {
-        m_reply->listAddNodeTail(s);
-        m_reply_bytes += sdslen(s);
-    } else {
-        listNode *ln = m_reply->listLast();
-        sds tail = (sds)ln->listNodeValue();
-
-        /* Append to this object when possible. If tail == NULL it was
-         * set via addDeferredMultiBulkLength(). */
-        if (tail && sdslen(tail)+sdslen(s) <= PROTO_REPLY_CHUNK_BYTES) {
-            tail = sdscatsds(tail,s);
-            ln->SetNodeValue(tail);
-            m_reply_bytes += sdslen(s);
-            sdsfree(s);
-        } else {
-            m_reply->listAddNodeTail(s);
-            m_reply_bytes += sdslen(s);
-        }
+    /* Strings bigger than a block are linked as they are, the others are
+     * copied into the reply blocks. */
+    if (sdslen(s) <= REPLY_BLOCK_LEN) {
+        _addReplyStringToList(s,sdslen(s));
+        sdsfree(s);
+        return;
     }
+    m_reply->listAddNodeTail(s);
+    m_reply_bytes += sdslen(s);
     asyncCloseClientOnOutputBufferLimitReached();
 }
 
 void client::_addReplyStringToList(const char *s, size_t len) {
     if (m_flags & CLIENT_CLOSE_AFTER_REPLY) return;
-
-    if (m_reply->listLength() == 0) {
-        sds node = sdsnewlen(s,len);
-        m_reply->listAddNodeTail(node);
-        m_reply_bytes += len;
-    } else {
-        listNode *ln = m_reply->listLast();
-        sds tail = (sds)ln->listNodeValue();
-
-        /* Append to this object when possible. If tail == NULL it was
-         * set via addDeferredMultiBulkLength(). */
-        if (tail && sdslen(tail)+len <= PROTO_REPLY_CHUNK_BYTES) {
-            tail = sdscatlen(tail,s,len);
-            ln->SetNodeValue(tail);
-            m_reply_bytes += len;
-        } else {
-            sds node = sdsnewlen(s,len);
-            m_reply->listAddNodeTail(node);
-            m_reply_bytes += len;
-        }
+    m_reply_bytes += len;
+
+    /* Fill the free space of the tail node first. If tail == NULL it was
+     * set via addDeferredMultiBulkLength(). */
+    listNode *ln = m_reply->listLast();
+    sds tail = ln ? (sds)ln->listNodeValue() : NULL;
+    if (tail && !replyNodeIsRef(tail)) {
+        size_t n = sdsavail(tail) < len ? sdsavail(tail) : len;
+        memcpy(tail+sdslen(tail),s,n);
+        sdsIncrLen(tail,n);
+        s += n;
+        len -= n;
+    }
+
+    /* Then add as many blocks as needed. */
+    while (len) {
+        sds block = createReplyBlock();
+        size_t n = len < REPLY_BLOCK_LEN ? len : REPLY_BLOCK_LEN;
+        memcpy(block,s,n);
+        sdsIncrLen(block,n);
+        m_reply->listAddNodeTail(block);
+        s += n;
+        len -= n;
     }
     asyncCloseClientOnOutputBufferLimitReached();
 }
@@ -322,6 +474,16 @@ void client::_addReplyStringToList(const char *s, size_t len) {
  * -------------------------------------------------------------------------- */
 
 void client::addReply(robj *obj) {
+    if (m_reply_builder) {
+        if (sdsEncodedObject(obj)) {
+            m_reply_builder->replyRaw((const char*)obj->ptr,sdslen((sds)obj->ptr));
+        } else {
+            char buf[32];
+            int len = ll2string(buf,sizeof(buf),(long)obj->ptr);
+            m_reply_builder->replyRaw(buf,len);
+        }
+        return;
+    }
     if (prepareClientToWrite() != C_OK)
         return;
 
@@ -359,6 +521,11 @@ void client::addReply(robj *obj) {
 }
 
 void client::addReplySds(sds s) {
+    if (m_reply_builder) {
+        m_reply_builder->replyRaw(s,sdslen(s));
+        sdsfree(s);
+        return;
+    }
     if (prepareClientToWrite() != C_OK) {
         /* The caller expects the sds to be free'd. */
         sdsfree(s);
@@ -381,6 +548,10 @@ void client::addReplySds(sds s) {
  * _addReplyStringToList() if we fail to extend the existing tail object
  * in the list of objects. */
 void client::addReplyString(const char *s, size_t len) {
+    if (m_reply_builder) {
+        m_reply_builder->replyRaw(s,len);
+        return;
+    }
     if (prepareClientToWrite() != C_OK)
         return;
     if (_addReplyToBuffer(s,len) != C_OK)
@@ -438,6 +609,7 @@ void* client::addDeferredMultiBulkLength() {
     /* Note that we install the write event here even if the object is not
      * ready to be sent, since we are sure that before returning to the
      * event loop setDeferredMultiBulkLength() will be called. */
+    if (m_reply_builder) return m_reply_builder->replyDeferredArray();
     if (prepareClientToWrite() != C_OK)
         return NULL;
     m_reply->listAddNodeTail(NULL); /* NULL is our placeholder. */
@@ -453,6 +625,10 @@ void client::setDeferredMultiBulkLength(void *node, long length) {
      * we return NULL in addDeferredMultiBulkLength() */
     if (node == NULL)
         return;
+    if (m_reply_builder) {
+        m_reply_builder->replyDeferredArrayLen(node,length);
+        return;
+    }
 
     len = sdscatprintf(sdsnewlen("*",1),"%ld\r\n",length);
     ln->SetNodeValue(len);
@@ -460,8 +636,9 @@ void client::setDeferredMultiBulkLength(void *node, long length) {
     if (ln->listNextNode() != NULL) {
         next = (sds)ln->listNextNode()->listNodeValue();
 
-        /* Only glue when the next node is non-NULL (an sds in this case) */
-        if (next != NULL) {
+        /* Only glue when the next node is non-NULL and not a reference (an
+         * sds in this case) */
+        if (next != NULL && !replyNodeIsRef(next)) {
             len = sdscatsds(len,next);
             m_reply->listDelNode(ln->listNextNode());
             ln->SetNodeValue(len);
@@ -480,9 +657,19 @@ void client::addReplyDouble(double d) {
         /* Libc in odd systems (Hi Solaris!) will format infinite in a
          * different way, so better to handle it in an explicit way. */
         addReplyBulkCString(d > 0 ? "inf" : "-inf");
+    } else if (m_reply_builder) {
+        dlen = d2string(dbuf,sizeof(dbuf),d);
+        m_reply_builder->replyBulk(dbuf,dlen);
     } else {
-        dlen = snprintf(dbuf,sizeof(dbuf),"%.17g",d);
-        slen = snprintf(sbuf,sizeof(sbuf),"$%d\r\n%s\r\n",dlen,dbuf);
+        dlen = d2string(dbuf,sizeof(dbuf),d);
+        sbuf[0] = '$';
+        slen = 1+ll2string(sbuf+1,sizeof(sbuf)-1,dlen);
+        sbuf[slen++] = '\r';
+        sbuf[slen++] = '\n';
+        memcpy(sbuf+slen,dbuf,dlen);
+        slen += dlen;
+        sbuf[slen++] = '\r';
+        sbuf[slen++] = '\n';
         addReplyString(sbuf,slen);
     }
 }
@@ -521,7 +708,9 @@ void client::addReplyLongLongWithPrefix(long long ll, char prefix) {
 }
 
 void client::addReplyLongLong(long long ll) {
-    if (ll == 0)
+    if (m_reply_builder)
+        m_reply_builder->replyLongLong(ll);
+    else if (ll == 0)
         addReply(shared.czero);
     else if (ll == 1)
         addReply(shared.cone);
@@ -530,7 +719,9 @@ void client::addReplyLongLong(long long ll) {
 }
 
 void client::addReplyMultiBulkLen(long length) {
-    if (length < OBJ_SHARED_BULKHDR_LEN)
+    if (m_reply_builder)
+        m_reply_builder->replyArray(length);
+    else if (length < OBJ_SHARED_BULKHDR_LEN)
         addReply(shared.mbulkhdr[length]);
     else
         addReplyLongLongWithPrefix(length,'*');
@@ -564,6 +755,16 @@ void client::addReplyBulkLen(robj *obj) {
 
 /* Add a Redis Object as a bulk reply */
 void client::addReplyBulk(robj *obj) {
+    if (m_reply_builder) {
+        if (sdsEncodedObject(obj)) {
+            m_reply_builder->replyBulk((const char*)obj->ptr,sdslen((sds)obj->ptr));
+        } else {
+            char buf[32];
+            int len = ll2string(buf,sizeof(buf),(long)obj->ptr);
+            m_reply_builder->replyBulk(buf,len);
+        }
+        return;
+    }
     addReplyBulkLen(obj);
     addReply(obj);
     addReply(shared.crlf);
@@ -571,13 +772,57 @@ void client::addReplyBulk(robj *obj) {
 
 /* Add a C buffer as bulk reply */
 void client::addReplyBulkCBuffer(const void *p, size_t len) {
+    if (m_reply_builder) {
+        m_reply_builder->replyBulk((const char *)p,len);
+        return;
+    }
     addReplyLongLongWithPrefix(len,'$');
     addReplyString((const char *)p,len);
     addReply(shared.crlf);
 }
 
+/* Add 'len' bytes at 'offset' of the sds encoded object 'o' as bulk reply.
+ * Large ranges of RAW encoded objects are referenced instead of copied, so
+ * the object can't be modified in place until the reply is sent: writes
+ * must unshare it first, see dbUnshareStringValue(). */
+void client::addReplyBulkObjectRange(robj *o, size_t offset, size_t len) {
+    if (o->encoding != OBJ_ENCODING_RAW || len < PROTO_REPLY_REF_MIN_BYTES ||
+        m_reply_builder)
+    {
+        addReplyBulkCBuffer((const char*)o->ptr+offset,len);
+        return;
+    }
+    if (prepareClientToWrite() != C_OK) return;
+    addReplyLongLongWithPrefix(len,'$');
+    if (!(m_flags & CLIENT_CLOSE_AFTER_REPLY) &&
+        _addReplyRefToList(o,offset,len) != C_OK)
+        _addReplyStringToList((const char*)o->ptr+offset,len);
+    addReply(shared.crlf);
+}
+
+/* Add the protocol stored in the sds encoded object 'o', that is sent as it
+ * is to many clients, like a PUBLISH message. Unless it is small, the clients
+ * share the object with a reference node instead of copying it into their
+ * output buffers, so it must not be modified after the call. */
+void client::addReplyShared(robj *o) {
+    size_t len = sdslen((sds)o->ptr);
+
+    if (m_reply_builder || len < PROTO_REPLY_SHARED_MIN_BYTES) {
+        addReply(o);
+        return;
+    }
+    if (prepareClientToWrite() != C_OK) return;
+    if (m_flags & CLIENT_CLOSE_AFTER_REPLY) return;
+    if (_addReplyRefToList(o,0,len) != C_OK) _addReplyObjectToList(o);
+}
+
 /* Add sds to reply (takes ownership of sds and frees it) */
 void client::addReplyBulkSds(sds s)  {
+    if (m_reply_builder) {
+        m_reply_builder->replyBulk(s,sdslen(s));
+        sdsfree(s);
+        return;
+    }
     addReplyLongLongWithPrefix(sdslen(s),'$');
     addReplySds(s);
     addReply(shared.crlf);
@@ -610,12 +855,18 @@ void copyClientOutputBuffer(client *dst, client *src) {
     memcpy(dst->m_response_buff,src->m_response_buff,src->m_response_buff_pos);
     dst->m_response_buff_pos = src->m_response_buff_pos;
     dst->m_reply_bytes = src->m_reply_bytes;
+    if (dst->m_repl_cursor.buf)
+        dst->m_repl_cursor.buf->replBufferDetach(&dst->m_repl_cursor);
+    if (src->m_repl_cursor.buf)
+        src->m_repl_cursor.buf->replBufferCopy(&dst->m_repl_cursor,
+                                               &src->m_repl_cursor);
 }
 
 /* Return true if the specified client has pending reply buffers to write to
- * the socket. */
+ * the socket, or, for slaves, replication stream still to send. */
 int client::clientHasPendingReplies() {
-    return m_response_buff_pos || m_reply->listLength();
+    return m_response_buff_pos || m_reply->listLength() ||
+           replBuffer::replBufferPending(&m_repl_cursor);
 }
 
 #define MAX_ACCEPTS_PER_CALL 1000
@@ -728,14 +979,209 @@ void acceptUnixHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
     }
 }
 
+/* The client is created only once the TLS handshake, performed by the
+ * TLS handshake threads, succeeded. */
+static void acceptTLSHandshakeDone(int fd, int ok, void *privdata) {
+    char *ip = (char*)privdata;
+
+    if (ok) acceptCommonHandler(fd,0,ip);
+    else close(fd);
+    zfree(ip);
+}
+
+void acceptTLSHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    int cport, cfd, max = MAX_ACCEPTS_PER_CALL;
+    char cip[NET_IP_STR_LEN];
+    UNUSED(el);
+    UNUSED(mask);
+    UNUSED(privdata);
+
+    while(max--) {
+        char *ip;
+
+        cfd = anetTcpAccept(server.neterr, fd, cip, sizeof(cip), &cport);
+        if (cfd == ANET_ERR) {
+            if (errno != EWOULDBLOCK)
+                serverLog(LL_WARNING,
+                    "Accepting client connection: %s", server.neterr);
+            return;
+        }
+        serverLog(LL_VERBOSE,"Accepted TLS %s:%d", cip, cport);
+        ip = zstrdup(cip);
+        if (tlsStartHandshake(cfd,TLS_ACCEPT,acceptTLSHandshakeDone,ip) == NULL) {
+            serverLog(LL_WARNING,"Can't start the TLS handshake: %s",
+                strerror(errno));
+            zfree(ip);
+            close(cfd);
+        }
+    }
+}
+
+/* ==========================================================================
+ * Accept threads
+ *
+ * With tcp-listeners greater than one every bind address gets several
+ * SO_REUSEPORT listening sockets, the kernel spreads the incoming
+ * connections among them, and every socket is served by its own thread
+ * calling accept(2). The accepted file descriptors are queued, and the main
+ * thread, woken up by a pipe, creates the clients calling
+ * acceptCommonHandler(): clients are only ever created by the main thread.
+ * ========================================================================== */
+
+typedef struct acceptedConn {
+    int fd;
+    int port;
+    char ip[NET_IP_STR_LEN];
+} acceptedConn;
+
+static pthread_mutex_t accept_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static list *accept_queue;  /* acceptedConn waiting for acceptCommonHandler(). */
+static int accept_pipe[2];  /* Wakes up the main thread when the queue
+                               becomes non empty. */
+
+static void *acceptThreadMain(void *arg) {
+    int fd = (int)(long)arg;
+    char err[ANET_ERR_LEN];
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while(1) {
+        int cfd, cport;
+        char cip[NET_IP_STR_LEN];
+
+        if (poll(&pfd,1,-1) == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (pfd.revents & POLLNVAL) break; /* Listening socket closed. */
+
+        while((cfd = anetTcpAccept(err,fd,cip,sizeof(cip),&cport)) != ANET_ERR) {
+            acceptedConn *ac = (acceptedConn *)zmalloc(sizeof(*ac));
+            int wakeup;
+
+            ac->fd = cfd;
+            ac->port = cport;
+            memcpy(ac->ip,cip,sizeof(cip));
+            pthread_mutex_lock(&accept_queue_mutex);
+            accept_queue->listAddNodeTail(ac);
+            wakeup = accept_queue->listLength() == 1;
+            pthread_mutex_unlock(&accept_queue_mutex);
+            if (wakeup && write(accept_pipe[1],"x",1) == -1) {
+                /* The pipe is full: the main thread is already going to
+                 * drain the queue. */
+            }
+        }
+        if (errno != EWOULDBLOCK)
+            serverLog(LL_WARNING,"Accepting client connection: %s", err);
+    }
+    return NULL;
+}
+
+/* Main thread side: create the clients for the connections accepted by the
+ * accept threads. */
+static void acceptQueueHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    char buf[128];
+    list *queue;
+    UNUSED(el);
+    UNUSED(mask);
+    UNUSED(privdata);
+
+    while (read(fd,buf,sizeof(buf)) == sizeof(buf));
+
+    pthread_mutex_lock(&accept_queue_mutex);
+    queue = accept_queue;
+    accept_queue = listCreate();
+    pthread_mutex_unlock(&accept_queue_mutex);
+
+    while (queue->listLength()) {
+        listNode *ln = queue->listFirst();
+        acceptedConn *ac = (acceptedConn *)ln->listNodeValue();
+
+        serverLog(LL_VERBOSE,"Accepted %s:%d", ac->ip, ac->port);
+        acceptCommonHandler(ac->fd,0,ac->ip);
+        zfree(ac);
+        queue->listDelNode(ln);
+    }
+    listRelease(queue);
+}
+
+void initAcceptThreads(void) {
+    int j;
+
+    accept_queue = listCreate();
+    if (pipe(accept_pipe) == -1) {
+        serverLog(LL_WARNING,"Can't create the accept threads pipe: %s",
+            strerror(errno));
+        exit(1);
+    }
+    anetNonBlock(NULL,accept_pipe[0]);
+    anetNonBlock(NULL,accept_pipe[1]);
+    if (server.el->aeCreateFileEvent(accept_pipe[0], AE_READABLE,
+        acceptQueueHandler,NULL) == AE_ERR)
+    {
+        serverPanic("Unrecoverable error creating the accept threads pipe "
+                    "file event.");
+    }
+
+    for (j = 0; j < server.ipfd_count; j++) {
+        pthread_t tid;
+        if (pthread_create(&tid,NULL,acceptThreadMain,(void*)(long)server.ipfd[j]) != 0) {
+            serverLog(LL_WARNING,"Fatal: Can't initialize accept threads.");
+            exit(1);
+        }
+    }
+}
+
 void client::freeClientArgv() {
     int j;
-    for (j = 0; j < m_argc; j++)
-        decrRefCount(m_argv[j]);
+    for (j = 0; j < m_argc; j++) {
+        robj *o = m_argv[j];
+
+        /* Keep the small arguments that the command did not retain, so that
+         * the next command can reuse them instead of allocating new ones.
+         * Like the objects cached by the Lua client, they must be SDS
+         * encoded, and with refcount = 1 (we must be the only owner). */
+        if (j < PROTO_ARGV_CACHE_SIZE &&
+            o->refcount == 1 &&
+            (o->encoding == OBJ_ENCODING_RAW ||
+             o->encoding == OBJ_ENCODING_EMBSTR) &&
+            sdsalloc((sds)o->ptr) <= PROTO_ARGV_CACHE_MAX_LEN &&
+            !datasetReadShared())
+        {
+            if (m_argv_cache[j]) decrRefCount(m_argv_cache[j]);
+            m_argv_cache[j] = o;
+        } else {
+            decrRefCount(o);
+        }
+    }
     m_argc = 0;
     m_cmd = NULL;
 }
 
+/* Create the string object of the argument 'j' of the command being parsed,
+ * reusing the argument cached by freeClientArgv() at the same position if
+ * it is big enough: usually the command name, the key and the value of the
+ * commands of a client have similar sizes every time. */
+robj *client::createArgvObject(int j, const char *ptr, size_t len) {
+    robj *o = j < PROTO_ARGV_CACHE_SIZE ? m_argv_cache[j] : NULL;
+
+    if (o == NULL || sdsalloc((sds)o->ptr) < len)
+        return createStringObject(ptr,len);
+
+    sds s = (sds)o->ptr;
+    m_argv_cache[j] = NULL;
+    memcpy(s,ptr,len);
+    s[len] = '\0';
+    sdssetlen(s,len);
+    if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
+        o->lru = (LFUGetTimeInMinutes()<<8) | LFU_INIT_VAL;
+    } else {
+        o->lru = LRU_CLOCK();
+    }
+    return o;
+}
+
 /* Close all the slaves connections. This is useful in chained replication
  * when we resync with our own master and want to force all our slaves to
  * resync with us as well. */
@@ -755,6 +1201,11 @@ void client::unlinkClient() {
     if (server.current_client == this)
         server.current_client = NULL;
 
+    /* The memory of the client is no longer accounted: clientsCron() won't
+     * visit it anymore. */
+    server.stat_clients_normal_memory -= m_cron_memory_usage;
+    m_cron_memory_usage = 0;
+
     /* Certain operations must be done only if the client has an active socket.
      * If the client was already unlinked or if it's a "fake client" the
      * fd is already set to -1. */
@@ -763,6 +1214,8 @@ void client::unlinkClient() {
         listNode* ln = server.clients->listSearchKey(this);
         serverAssert(ln != NULL);
         server.clients->listDelNode(ln);
+        raxRemove(server.clients_index,(unsigned char*)&m_client_id,
+                  sizeof(m_client_id),NULL);
 
         /* Unregister async I/O handlers and close the socket. */
         server.el->aeDeleteFileEvent(m_fd,AE_READABLE);
@@ -770,6 +1223,10 @@ void client::unlinkClient() {
         close(m_fd);
         m_fd = -1;
     }
+    if (m_shm) {
+        shmFreeConn(m_shm);
+        m_shm = NULL;
+    }
 
     /* Remove from the list of pending writes if needed. */
     if (m_flags & CLIENT_PENDING_WRITE) {
@@ -779,6 +1236,22 @@ void client::unlinkClient() {
         m_flags &= ~CLIENT_PENDING_WRITE;
     }
 
+    /* Remove from the list of clients waiting for the AOF group commit. */
+    if (m_flags & CLIENT_AOF_COMMIT_WAIT) {
+        listNode* ln = server.clients_waiting_aof->listSearchKey(this);
+        serverAssert(ln != NULL);
+        server.clients_waiting_aof->listDelNode(ln);
+        m_flags &= ~CLIENT_AOF_COMMIT_WAIT;
+    }
+
+    /* Remove from the list of pending reads if needed. */
+    if (m_flags & CLIENT_PENDING_READ) {
+        listNode* ln = server.clients_pending_read->listSearchKey(this);
+        serverAssert(ln != NULL);
+        server.clients_pending_read->listDelNode(ln);
+        m_flags &= ~CLIENT_PENDING_READ;
+    }
+
     /* When client was just unblocked because of a blocking operation,
      * remove it from the list of unblocked clients. */
     if (m_flags & CLIENT_UNBLOCKED) {
@@ -822,8 +1295,9 @@ client::~client()
     }
 
     /* Free the query buffer */
-    sdsfree(m_query_buf);
+    freeClientQueryBuffer(this);
     sdsfree(m_pending_query_buf);
+    sdsfree(m_repl_frames);
     m_query_buf = NULL;
 
     /* Deallocate structures used to block on blocking ops. */
@@ -838,11 +1312,18 @@ client::~client()
     /* Unsubscribe from all the pubsub channels */
     pubsubUnsubscribeAllChannels(0);
     pubsubUnsubscribeAllPatterns(0);
+    pubsubUnsubscribeAllChannels(0,1);
     dictRelease(m_pubsub_channels);
     listRelease(m_pubsub_patterns);
+    dictRelease(m_pubsubshard_channels);
+
+    /* Stop the keys tracking, see tracking.cpp. */
+    disableTracking(this);
 
     /* Free data structures. */
     listRelease(m_reply);
+    if (m_repl_cursor.buf) m_repl_cursor.buf->replBufferDetach(&m_repl_cursor);
+    replicationBacklogDiskClose(this);
     freeClientArgv();
 
     /* Unlink the client: this will close the socket, remove the I/O
@@ -888,6 +1369,8 @@ client::~client()
     if (m_client_name)
         decrRefCount(m_client_name);
     zfree(m_argv);
+    for (int j = 0; j < PROTO_ARGV_CACHE_SIZE; j++)
+        if (m_argv_cache[j]) decrRefCount(m_argv_cache[j]);
     freeClientMultiState(this);
     sdsfree(m_cached_peer_id);
 }
@@ -895,12 +1378,24 @@ client::~client()
 /* Schedule a client to free it at a safe time in the serverCron() function.
  * This function is useful when we need to terminate a client but we are in
  * a context where calling freeClient() is not possible, because the client
- * should be valid for the continuation of the flow of the program. */
+ * should be valid for the continuation of the flow of the program.
+ *
+ * When I/O threads are enabled this may be called from an I/O thread, so
+ * the queue is protected by a mutex in that case. */
+static pthread_mutex_t async_free_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 void freeClientAsync(client *c) {
     if (c->m_flags & CLIENT_CLOSE_ASAP || c->m_flags & CLIENT_LUA)
         return;
-    c->m_flags |= CLIENT_CLOSE_ASAP;
-    server.clients_to_close->listAddNodeTail(c);
+    if (server.io_threads_num == 1) {
+        c->m_flags |= CLIENT_CLOSE_ASAP;
+        server.clients_to_close->listAddNodeTail(c);
+    } else {
+        pthread_mutex_lock(&async_free_queue_mutex);
+        c->m_flags |= CLIENT_CLOSE_ASAP;
+        server.clients_to_close->listAddNodeTail(c);
+        pthread_mutex_unlock(&async_free_queue_mutex);
+    }
 }
 
 void freeClientsInAsyncFreeQueue() {
@@ -914,51 +1409,114 @@ void freeClientsInAsyncFreeQueue() {
     }
 }
 
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif
+
 /* Write data in output buffers to client. Return C_OK if the client
- * is still valid after the call, C_ERR if it was freed. */
+ * is still valid after the call, C_ERR if it was freed.
+ *
+ * The static buffer and as many reply list nodes as fit in IOV_MAX are
+ * gathered into a single writev() call, so that a long reply list is
+ * flushed with a few system calls instead of one per node. */
 int writeToClient(int fd, client *c, int handler_installed) {
     ssize_t nwritten = 0, totwritten = 0;
     size_t objlen;
-    sds o;
+    void *o;
 
     while(c->clientHasPendingReplies()) {
+        struct iovec iov[IOV_MAX];
+        int iovcnt = 0;
+        size_t iovbytes = 0, offset = c->m_already_sent_len;
+        listNode *ln = c->m_reply->listFirst();
+
         if (c->m_response_buff_pos > 0) {
-            nwritten = write(fd,c->m_response_buff+c->m_already_sent_len,c->m_response_buff_pos-c->m_already_sent_len);
-            if (nwritten <= 0) break;
-            c->m_already_sent_len += nwritten;
-            totwritten += nwritten;
-
-            /* If the buffer was sent, set bufpos to zero to continue with
-             * the remainder of the reply. */
-            if ((int)c->m_already_sent_len == c->m_response_buff_pos) {
-                c->m_response_buff_pos = 0;
-                c->m_already_sent_len = 0;
+            iov[iovcnt].iov_base = c->m_response_buff+offset;
+            iov[iovcnt].iov_len = c->m_response_buff_pos-offset;
+            iovbytes += iov[iovcnt].iov_len;
+            iovcnt++;
+            offset = 0;
+        }
+        while (ln && iovcnt < IOV_MAX && iovbytes < NET_MAX_WRITES_PER_EVENT) {
+            o = ln->listNodeValue();
+            objlen = replyNodeLen(o);
+            if (objlen > offset) {
+                iov[iovcnt].iov_base = (char*)replyNodeBuf(o)+offset;
+                iov[iovcnt].iov_len = objlen-offset;
+                iovbytes += iov[iovcnt].iov_len;
+                iovcnt++;
             }
-        } else {
-            o = (sds)c->m_reply->listFirst()->listNodeValue();
-            objlen = sdslen(o);
-
-            if (objlen == 0) {
+            offset = 0;
+            ln = ln->listNextNode();
+        }
+        /* Slaves send the shared replication stream after their own
+         * replies. */
+        if (ln == NULL && c->m_repl_cursor.buf)
+            iovcnt = replBuffer::replBufferIov(&c->m_repl_cursor,iov,iovcnt,
+                IOV_MAX,&iovbytes,NET_MAX_WRITES_PER_EVENT);
+
+        if (iovcnt == 0) {
+            /* Only empty objects left in the list. */
+            while (c->m_reply->listLength() &&
+                   replyNodeLen(c->m_reply->listFirst()->listNodeValue()) == 0)
                 c->m_reply->listDelNode(c->m_reply->listFirst());
-                continue;
-            }
-
-            nwritten = write(fd, o + c->m_already_sent_len, objlen - c->m_already_sent_len);
-            if (nwritten <= 0) break;
-            c->m_already_sent_len += nwritten;
-            totwritten += nwritten;
+            continue;
+        }
 
-            /* If we fully sent the object on head go to the next one */
-            if (c->m_already_sent_len == objlen) {
-                c->m_reply->listDelNode(c->m_reply->listFirst());
+        nwritten = c->m_shm ? shmWritev(c->m_shm,iov,iovcnt) :
+                              writev(fd,iov,iovcnt);
+        if (nwritten <= 0) break;
+        totwritten += nwritten;
+        atomicIncr(server.stat_writev_calls, 1);
+        atomicIncr(server.stat_writev_iovecs, iovcnt);
+        atomicIncr(server.stat_writev_bytes, nwritten);
+
+        /* Consume what was written: first the static buffer, then the
+         * objects on the head of the reply list, then the replication
+         * stream. */
+        size_t remaining = nwritten;
+        if (c->m_response_buff_pos > 0) {
+            size_t buflen = c->m_response_buff_pos-c->m_already_sent_len;
+            if (remaining < buflen) {
+                c->m_already_sent_len += remaining;
+                remaining = 0;
+            } else {
+                /* If the buffer was sent, set bufpos to zero to continue
+                 * with the remainder of the reply. */
+                remaining -= buflen;
+                c->m_response_buff_pos = 0;
                 c->m_already_sent_len = 0;
-                c->m_reply_bytes -= objlen;
-                /* If there are no longer objects in the list, we expect
-                 * the count of reply bytes to be exactly zero. */
-                if (c->m_reply->listLength() == 0)
-                    serverAssert(c->m_reply_bytes == 0);
             }
         }
+        while (c->m_response_buff_pos == 0 && c->m_reply->listLength()) {
+            o = c->m_reply->listFirst()->listNodeValue();
+            objlen = replyNodeLen(o);
+            if (remaining < objlen-c->m_already_sent_len) {
+                c->m_already_sent_len += remaining;
+                remaining = 0;
+                break;
+            }
+
+            /* We fully sent the object on head: go to the next one */
+            remaining -= objlen-c->m_already_sent_len;
+            c->m_reply->listDelNode(c->m_reply->listFirst());
+            c->m_already_sent_len = 0;
+            c->m_reply_bytes -= objlen;
+            /* If there are no longer objects in the list, we expect
+             * the count of reply bytes to be exactly zero. */
+            if (c->m_reply->listLength() == 0)
+                serverAssert(c->m_reply_bytes == 0);
+            if (remaining == 0 && objlen) break;
+        }
+        if (remaining) {
+            serverAssert(c->m_response_buff_pos == 0 &&
+                         c->m_reply->listLength() == 0);
+            replBuffer::replBufferAdvance(&c->m_repl_cursor,remaining);
+        }
+
+        /* A short write means the socket buffer is full. */
+        if ((size_t)nwritten < iovbytes) break;
+
         /* Note that we avoid to send more than NET_MAX_WRITES_PER_EVENT
          * bytes, in a single threaded server it's a good idea to serve
          * other clients as well, even if a very large request comes from
@@ -971,14 +1529,15 @@ int writeToClient(int fd, client *c, int handler_installed) {
             (server.maxmemory == 0 ||
              zmalloc_used_memory() < server.maxmemory)) break;
     }
-    server.stat_net_output_bytes += totwritten;
+    atomicIncr(server.stat_net_output_bytes, totwritten);
+    c->m_stat_net_output_bytes += totwritten;
     if (nwritten == -1) {
         if (errno == EAGAIN) {
             nwritten = 0;
         } else {
             serverLog(LL_VERBOSE,
                 "Error writing to client: %s", strerror(errno));
-            freeClient(c);
+            freeClientOrAsync(c);
             return C_ERR;
         }
     }
@@ -995,18 +1554,60 @@ int writeToClient(int fd, client *c, int handler_installed) {
 
         /* Close connection after entire reply has been sent. */
         if (c->m_flags & CLIENT_CLOSE_AFTER_REPLY) {
-            freeClient(c);
+            freeClientOrAsync(c);
             return C_ERR;
         }
     }
     return C_OK;
 }
 
+/* No-op continuation of the clients suspended by startReplyProducer():
+ * their reply is complete once they are resumed. */
+static void replyProducerResume(client *c, void *privdata, int status) {
+    UNUSED(c);
+    UNUSED(privdata);
+    UNUSED(status);
+}
+
+/* Suspend 'c' while 'produce' appends its reply a part at a time, as the
+ * output buffer of the client drains below PROTO_REPLY_PRODUCER_BYTES, so
+ * that replying a huge collection doesn't need to buffer it all. The
+ * command replies something first, such as the length of the array, so
+ * the first part is produced when the client is written to, out of the
+ * command. Once 'produce' returns 0 the client is resumed, and
+ * 'free_privdata' releases 'privdata', as when the client is freed
+ * before. */
+void startReplyProducer(client *c, replyProducerProc *produce,
+                        clientResumeFreeProc *free_privdata, void *privdata)
+{
+    blockClientOnContinuation(c,0,replyProducerResume,free_privdata,privdata);
+    c->m_blocking_state.m_produce = produce;
+}
+
+/* Append the next part of the reply of the client suspended by
+ * startReplyProducer(), if the previous one is almost sent. Called in the
+ * main thread before and after writing to the client. */
+void produceClientReply(client *c) {
+    if (!(c->m_flags & CLIENT_BLOCKED) ||
+        c->m_blocking_op_type != BLOCKED_CONTINUATION ||
+        c->m_blocking_state.m_produce == NULL ||
+        c->getClientOutputBufferMemoryUsage() >= PROTO_REPLY_PRODUCER_BYTES)
+        return;
+    if (!c->m_blocking_state.m_produce(c,c->m_blocking_state.m_resume_privdata))
+        resumeBlockedClient(c,CONTINUATION_DONE);
+}
+
 /* Write event handler. Just send data to the client. */
 void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
     UNUSED(el);
     UNUSED(mask);
-    writeToClient(fd,(client*)privdata,1);
+    client *c = (client*)privdata;
+
+    if (aofClientMustWaitCommit(c)) {
+        aofHoldClientReplies(c);
+        return;
+    }
+    if (writeToClient(fd,c,1) == C_OK) produceClientReply(c);
 }
 
 /* This function is called just before entering the event loop, in the hope
@@ -1023,12 +1624,20 @@ int handleClientsWithPendingWrites() {
         c->m_flags &= ~CLIENT_PENDING_WRITE;
         server.clients_pending_write->listDelNode(ln);
 
+        /* The last write of the client is not yet in the AOF on disk. */
+        if (aofClientMustWaitCommit(c)) {
+            aofHoldClientReplies(c);
+            continue;
+        }
+
         /* Try to write buffers to the client socket. */
+        produceClientReply(c);
         if (writeToClient(c->m_fd,c,0) == C_ERR) continue;
 
         /* If there is nothing left, do nothing. Otherwise install
-         * the write handler. */
-        if (c->clientHasPendingReplies() &&
+         * the write handler. Clients using shared memory are written
+         * again when they signal they made room in the ring. */
+        if (c->clientHasPendingReplies() && !c->m_shm &&
             server.el->aeCreateFileEvent(c->m_fd, AE_WRITABLE,
                 sendReplyToClient, c) == AE_ERR)
         {
@@ -1076,7 +1685,7 @@ int client::processInlineBuffer() {
     size_t querylen;
 
     /* Search for end of line */
-    newline = strchr(m_query_buf,'\n');
+    newline = (char*)memchr(m_query_buf,'\n',sdslen((sds)m_query_buf));
 
     /* Nothing to do without a \r\n */
     if (newline == NULL) {
@@ -1115,6 +1724,7 @@ int client::processInlineBuffer() {
     if (argc) {
         if (m_argv) zfree(m_argv);
         m_argv = (robj **)zmalloc(sizeof(robj*)*argc);
+        m_argv_len = argc;
     }
 
     /* Create redis objects for all arguments. */
@@ -1160,6 +1770,172 @@ void client::setProtocolError(const char *errstr, int pos) {
     sdsrange(m_query_buf,pos,-1);
 }
 
+/* Classify the 16 bytes at 'p' with a single vector compare for the '\r'
+ * and one for the digits. Returns the number of digits preceding the first
+ * '\r', or -1 if there is no '\r' or something else comes before it. SSE2
+ * and NEON are part of the base x86-64 and AArch64 instruction sets, so no
+ * runtime dispatch is needed. */
+#if defined(HAVE_PROTO_SSE2) || defined(HAVE_PROTO_NEON)
+static int protoScanCount16(const char *p) {
+#ifdef HAVE_PROTO_SSE2
+    __m128i v = _mm_loadu_si128((const __m128i*)p);
+    __m128i d = _mm_sub_epi8(v,_mm_set1_epi8('0'));
+    unsigned int cr = _mm_movemask_epi8(_mm_cmpeq_epi8(v,_mm_set1_epi8('\r')));
+    unsigned int digits = _mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_min_epu8(d,_mm_set1_epi8(9)),d));
+    int i;
+
+    if (cr == 0) return -1;
+    i = __builtin_ctz(cr);
+    if ((digits & ((1u<<i)-1)) != (1u<<i)-1) return -1;
+    return i;
+#else
+    /* NEON has no movemask: narrowing every 16 bit lane by 4 bits leaves
+     * a 64 bit mask with a nibble per byte. */
+    uint8x16_t v = vld1q_u8((const uint8_t*)p);
+    uint8x16_t cr = vceqq_u8(v,vdupq_n_u8('\r'));
+    uint8x16_t other = vmvnq_u8(vcleq_u8(vsubq_u8(v,vdupq_n_u8('0')),
+                                         vdupq_n_u8(9)));
+    uint64_t crmask = vget_lane_u64(vreinterpret_u64_u8(
+        vshrn_n_u16(vreinterpretq_u16_u8(cr),4)),0);
+    uint64_t othermask = vget_lane_u64(vreinterpret_u64_u8(
+        vshrn_n_u16(vreinterpretq_u16_u8(other),4)),0);
+    int i;
+
+    if (crmask == 0) return -1;
+    i = __builtin_ctzll(crmask)/4;
+    if (i && (othermask << (64-i*4))) return -1;
+    return i;
+#endif
+}
+#endif
+
+/* Parse the "<count>\r" part of a "*<count>\r\n" or "$<count>\r\n" header
+ * starting at 'p' (just after the type byte), where 'len' bytes are
+ * available. The common case of a short positive count is parsed while
+ * looking for the '\r', in a single pass over the header, that is a single
+ * vector scan when 16 bytes are available; anything else is handed to
+ * string2ll() so that validation stays exactly the same.
+ *
+ * Returns a pointer to the '\r' terminating the count, or NULL if the
+ * buffer does not contain it yet. '*ok' is set to 1 and '*ll' to the count
+ * if it is valid, otherwise '*ok' is set to 0. */
+static const char *parseProtoCount(const char *p, size_t len, long long *ll, int *ok) {
+    const char *end = p+len, *s = p;
+    long long v = 0;
+
+#if defined(HAVE_PROTO_SSE2) || defined(HAVE_PROTO_NEON)
+    if (len >= 16 && *s != '0') {
+        int digits = protoScanCount16(p);
+        if (digits > 0) {
+            for (s = p; s < p+digits; s++) v = v*10+(*s-'0');
+            *ll = v;
+            *ok = 1;
+            return s;
+        }
+    }
+#endif
+
+    /* Up to 18 digits can't overflow a long long. */
+    if (s < end && *s >= '1' && *s <= '9') {
+        while (s < end && s-p < 18 && *s >= '0' && *s <= '9') {
+            v = v*10+(*s-'0');
+            s++;
+        }
+        if (s < end && *s == '\r') {
+            *ll = v;
+            *ok = 1;
+            return s;
+        }
+    }
+    s = (const char*)memchr(s,'\r',end-s);
+    if (s == NULL) return NULL;
+    *ok = string2ll(p,s-p,ll);
+    return s;
+}
+
+/* Parse in a tight loop the bulk arguments of the current multibulk
+ * command that are already complete in the query buffer starting at 'pos',
+ * without going through the state kept in m_bulk_len for the arguments
+ * that span several reads. It stops at the first argument that is not
+ * complete, is big enough to get the buffer of its own (see
+ * PROTO_MBULK_BIG_ARG) or is malformed, leaving it to the general loop of
+ * processMultibulkBuffer() that also reports the protocol errors. Returns
+ * the position after the parsed arguments. */
+int client::processBulkBatch(int pos) {
+    const char *buf = m_query_buf;
+    size_t qblen = sdslen((sds)m_query_buf);
+    const char *newline;
+    long long ll;
+    int ok;
+
+    while (m_multi_bulk_len && qblen-pos > 4 && buf[pos] == '$') {
+        newline = parseProtoCount(buf+pos+1,qblen-pos-1,&ll,&ok);
+        if (newline == NULL || !ok || ll < 0 || ll >= PROTO_MBULK_BIG_ARG)
+            break;
+        size_t hdrlen = newline-(buf+pos)+2;
+        if (qblen-pos < hdrlen+ll+2) break;
+        m_argv[m_argc] = createArgvObject(m_argc,buf+pos+hdrlen,ll);
+        m_argc++;
+        m_multi_bulk_len--;
+        pos += hdrlen+ll+2;
+    }
+    return pos;
+}
+
+/* Scan the complete multibulk commands pipelined at the start of the query
+ * buffer 'buf', up to DICT_PREFETCH_BATCH of them, and prefetch in 'db' the
+ * first key of every command, so that executing them one after the other
+ * doesn't stall on the cache misses of every lookup. Nothing is parsed for
+ * real, and the scan stops at anything unusual (an inline command, a big
+ * argument, a malformed or incomplete command), since processInputBuffer()
+ * handles that as usual. Returns the number of commands scanned. */
+static int prefetchPipelinedKeys(redisDb *db, const char *buf, size_t len) {
+    const void *keys[DICT_PREFETCH_BATCH];
+    int lens[DICT_PREFETCH_BATCH];
+    int numcmds = 0, numkeys = 0, ok;
+    size_t pos = 0;
+    long long argc, ll;
+
+    while (numcmds < DICT_PREFETCH_BATCH && len-pos > 4 && buf[pos] == '*') {
+        const char *newline = parseProtoCount(buf+pos+1,len-pos-1,&argc,&ok);
+        if (newline == NULL || !ok || argc <= 0 || argc > 1024*1024) break;
+        if (newline+2 > buf+len) break;
+        pos = newline-buf+2;
+
+        struct redisCommand *cmd = NULL;
+        const char *key = NULL;
+        int keylen = 0;
+        long long j;
+        for (j = 0; j < argc; j++) {
+            if (len-pos < 4 || buf[pos] != '$') break;
+            newline = parseProtoCount(buf+pos+1,len-pos-1,&ll,&ok);
+            if (newline == NULL || !ok || ll < 0 || ll >= PROTO_MBULK_BIG_ARG)
+                break;
+            size_t hdrlen = newline-(buf+pos)+2;
+            if (len-pos < hdrlen+ll+2) break;
+            if (j == 0) {
+                cmd = lookupCommandByBuffer(buf+pos+hdrlen,ll);
+            } else if (cmd && j == cmd->firstkey) {
+                key = buf+pos+hdrlen;
+                keylen = ll;
+            }
+            pos += hdrlen+ll+2;
+        }
+        if (j < argc) break;
+        if (key) {
+            keys[numkeys] = key;
+            lens[numkeys] = keylen;
+            numkeys++;
+        }
+        numcmds++;
+    }
+
+    /* A single command is looked up right away: nothing to overlap. */
+    if (numcmds > 1 && numkeys) dbPrefetchRawKeys(db,keys,lens,numkeys);
+    return numcmds;
+}
+
 /* Process the query buffer for client 'c', setting up the client argument
  * vector for command execution. Returns C_OK if after running the function
  * the client has a well-formed ready to be processed command, otherwise
@@ -1181,7 +1957,9 @@ int client::processMultibulkBuffer() {
         serverAssertWithInfo(this,NULL,m_argc == 0);
 
         /* Multi bulk length cannot be read without a \r\n */
-        newline = strchr(m_query_buf,'\r');
+        serverAssertWithInfo(this,NULL,m_query_buf[0] == '*');
+        newline = (char*)parseProtoCount(m_query_buf+1,
+                                         sdslen((sds)m_query_buf)-1,&ll,&ok);
         if (newline == NULL) {
             if (sdslen((sds)m_query_buf) > PROTO_INLINE_MAX_SIZE) {
                 addReplyError("Protocol error: too big mbulk count string");
@@ -1195,9 +1973,7 @@ int client::processMultibulkBuffer() {
             return C_ERR;
 
         /* We know for sure there is a whole line since newline != NULL,
-         * so go ahead and find out the multi bulk length. */
-        serverAssertWithInfo(this,NULL,m_query_buf[0] == '*');
-        ok = string2ll(m_query_buf+1,newline-(m_query_buf+1),&ll);
+         * and the multi bulk length was already parsed. */
         if (!ok || ll > 1024*1024) {
             addReplyError("Protocol error: invalid multibulk length");
             setProtocolError("invalid mbulk count", pos);
@@ -1212,17 +1988,35 @@ int client::processMultibulkBuffer() {
 
         m_multi_bulk_len = ll;
 
-        /* Setup argv array on client structure */
-        if (m_argv)
+        /* Setup argv array on client structure, reusing the array of the
+         * previous command if big enough, but not too big to keep. */
+        if (m_argv_len < m_multi_bulk_len ||
+            m_argv_len > PROTO_ARGV_KEEP_MAX)
+        {
             zfree(m_argv);
-        m_argv = (robj **)zmalloc(sizeof(robj*)*m_multi_bulk_len);
+            m_argv = (robj **)zmalloc(sizeof(robj*)*m_multi_bulk_len);
+            m_argv_len = m_multi_bulk_len;
+        }
     }
 
     serverAssertWithInfo(this,NULL,m_multi_bulk_len > 0);
+    if (m_bulk_len == -1) pos = processBulkBatch(pos);
     while(m_multi_bulk_len) {
         /* Read bulk length if unknown */
         if (m_bulk_len == -1) {
-            newline = strchr(m_query_buf+pos,'\r');
+            size_t qblen = sdslen((sds)m_query_buf);
+
+            if (pos == (int)qblen) break;
+            if (m_query_buf[pos] != '$') {
+                addReplyErrorFormat(
+                    "Protocol error: expected '$', got '%c'",
+                    m_query_buf[pos]);
+                setProtocolError("expected $ but got something else", pos);
+                return C_ERR;
+            }
+
+            newline = (char*)parseProtoCount(m_query_buf+pos+1,
+                                             qblen-pos-1,&ll,&ok);
             if (newline == NULL) {
                 if (sdslen((sds)m_query_buf) > PROTO_INLINE_MAX_SIZE) {
                     addReplyError(
@@ -1237,15 +2031,6 @@ int client::processMultibulkBuffer() {
             if (newline-m_query_buf > ((signed)sdslen((sds)m_query_buf)-2))
                 break;
 
-            if (m_query_buf[pos] != '$') {
-                addReplyErrorFormat(
-                    "Protocol error: expected '$', got '%c'",
-                    m_query_buf[pos]);
-                setProtocolError("expected $ but got something else", pos);
-                return C_ERR;
-            }
-
-            ok = string2ll(m_query_buf+pos+1,newline-(m_query_buf+pos+1),&ll);
             if (!ok || ll < 0 || ll > 512*1024*1024) {
                 addReplyError("Protocol error: invalid bulk length");
                 setProtocolError("invalid bulk length", pos);
@@ -1283,6 +2068,9 @@ int client::processMultibulkBuffer() {
                 m_bulk_len >= PROTO_MBULK_BIG_ARG &&
                 (signed) sdslen((sds)m_query_buf) == m_bulk_len+2)
             {
+                /* The buffer now belongs to the object: if it was borrowed
+                 * from the pool, the pool will allocate a new one. */
+                m_query_buf_shared = 0;
                 m_argv[m_argc++] = createObject(OBJ_STRING,m_query_buf);
                 sdsIncrLen(m_query_buf,-2); /* remove CRLF */
                 /* Assume that if we saw a fat argument we'll see another one
@@ -1291,8 +2079,9 @@ int client::processMultibulkBuffer() {
                 sdsclear(m_query_buf);
                 pos = 0;
             } else {
-                m_argv[m_argc++] =
-                    createStringObject(m_query_buf+pos,m_bulk_len);
+                m_argv[m_argc] =
+                    createArgvObject(m_argc,m_query_buf+pos,m_bulk_len);
+                m_argc++;
                 pos += m_bulk_len+2;
             }
             m_bulk_len = -1;
@@ -1315,13 +2104,24 @@ int client::processMultibulkBuffer() {
 /* This function is called every time, in the client structure 'c', there is
  * more query buffer to process, because we read more data from the socket
  * or because a client was blocked and later reactivated, so there could be
- * pending query buffer, already representing a full command, to process. */
-void client::processInputBuffer() {
-    server.current_client = this;
+ * pending query buffer, already representing a full command, to process.
+ * Returns C_ERR if the client was freed while executing its commands, so
+ * that the caller knows it must not touch it anymore, C_OK otherwise. */
+int client::processInputBuffer() {
+    /* When called from an I/O thread we only parse the buffer: the command
+     * is executed later by the main thread, see CLIENT_PENDING_COMMAND. */
+    int io_thread_read = m_flags & CLIENT_PENDING_READ;
+    /* Commands ahead in the buffer whose keys were already prefetched. */
+    int prefetched = 0;
+
+    if (!io_thread_read) server.current_client = this;
     /* Keep processing while there is something in the input buffer */
     while(sdslen((sds)m_query_buf)) {
-        /* Return if clients are paused. */
-        if (!(m_flags & CLIENT_SLAVE) && clientsArePaused()) break;
+        /* Return if clients are paused. I/O threads can't call
+         * clientsArePaused() since it may modify the server state. */
+        if (io_thread_read) {
+            if (server.clients_paused) break;
+        } else if (!(m_flags & CLIENT_SLAVE) && clientsArePaused()) break;
 
         /* Immediately abort if the client is in the middle of something. */
         if (m_flags & CLIENT_BLOCKED) break;
@@ -1345,6 +2145,12 @@ void client::processInputBuffer() {
         if (m_req_protocol_type == PROTO_REQ_INLINE) {
             if (processInlineBuffer() != C_OK) break;
         } else if (m_req_protocol_type == PROTO_REQ_MULTIBULK) {
+            /* At the start of a batch of pipelined commands prefetch their
+             * keys, only in the main thread that is going to execute them. */
+            if (!io_thread_read && prefetched == 0 && m_multi_bulk_len == 0)
+                prefetched = prefetchPipelinedKeys(m_cur_selected_db,
+                    m_query_buf,sdslen((sds)m_query_buf));
+            if (prefetched) prefetched--;
             if (processMultibulkBuffer() != C_OK) break;
         } else {
             serverPanic("Unknown request type");
@@ -1354,28 +2160,123 @@ void client::processInputBuffer() {
         if (m_argc == 0) {
             resetClient();
         } else {
-            /* Only reset the client when the command was executed. */
-            if (processCommand(this) == C_OK) {
-                if (m_flags & CLIENT_MASTER && !(m_flags & CLIENT_MULTI)) {
-                    /* Update the applied replication offset of our master. */
-                    m_applied_replication_offset = m_read_replication_offset - sdslen((sds)m_query_buf);
-                }
-
-                /* Don't reset the client structure for clients blocked in a
-                 * module blocking command, so that the reply callback will
-                 * still be able to access the client argv and argc field.
-                 * The client will be reset in unblockClientFromModule(). */
-                if (!(m_flags & CLIENT_BLOCKED) || m_blocking_op_type != BLOCKED_MODULE)
-                    resetClient();
-            }
-            /* freeMemoryIfNeeded may flush slave output buffers. This may
-             * result into a slave, that may be the active client, to be
-             * freed. */
-            if (server.current_client == NULL)
+            /* If we are in the context of an I/O thread, we can't really
+             * execute the command here. All we can do is to flag the client
+             * as one that needs to process the command. */
+            if (io_thread_read) {
+                m_flags |= CLIENT_PENDING_COMMAND;
                 break;
+            }
+
+            if (processCommandAndResetClient() == C_ERR)
+                return C_ERR;
+        }
+    }
+    if (!io_thread_read) server.current_client = NULL;
+    return C_OK;
+}
+
+/* Execute the command already parsed into the client argument vector, and
+ * reset the client to be ready for the next command if it was executed.
+ * Returns C_ERR if the client was freed as a side effect of the command
+ * execution, C_OK otherwise. */
+int client::processCommandAndResetClient() {
+    server.current_client = this;
+    /* Only reset the client when the command was executed. */
+    if (processCommand(this) == C_OK) {
+        if (m_flags & CLIENT_MASTER && !(m_flags & CLIENT_MULTI)) {
+            /* Update the applied replication offset of our master. */
+            m_applied_replication_offset = m_read_replication_offset - sdslen((sds)m_query_buf);
         }
+
+        /* Don't reset the client structure for clients blocked in a
+         * module blocking command, so that the reply callback will
+         * still be able to access the client argv and argc field.
+         * The client will be reset in unblockClientFromModule(). The
+         * clients waiting for the tiering file or a background read
+         * execute the command later. */
+        if (!(m_flags & CLIENT_BLOCKED) ||
+            (m_blocking_op_type != BLOCKED_MODULE &&
+             m_blocking_op_type != BLOCKED_TIER &&
+             m_blocking_op_type != BLOCKED_BGREAD))
+            resetClient();
+    }
+    /* freeMemoryIfNeeded may flush slave output buffers. This may
+     * result into a slave, that may be the active client, to be
+     * freed. */
+    return server.current_client == NULL ? C_ERR : C_OK;
+}
+
+/* Shared query buffers.
+ *
+ * Most clients are idle most of the time, or send commands that are
+ * consumed completely by a single read, so there is no reason for every
+ * client to own a PROTO_IOBUF_LEN query buffer. When a client with an empty
+ * query buffer becomes readable, it borrows the query buffer of the thread
+ * serving it (the main thread or an I/O thread), and gives it back once the
+ * read data has been processed. Only the part of an incomplete command is
+ * copied to a private buffer of the exact size. */
+static __thread sds thread_shared_qb = NULL;
+
+/* Buffers that grew bigger than this while borrowed are not returned to
+ * the pool, so that a single huge request does not pin memory. */
+#define PROTO_SHARED_QB_MAX_SIZE (PROTO_IOBUF_LEN*2)
+
+static void borrowSharedQueryBuffer(client *c) {
+    if (c->m_query_buf_shared || sdslen(c->m_query_buf) ||
+        c->m_flags & CLIENT_MASTER ||
+        c->m_bulk_len >= PROTO_MBULK_BIG_ARG) return;
+
+    if (thread_shared_qb) {
+        atomicIncr(server.stat_qbuf_pool_hits, 1);
+    } else {
+        atomicIncr(server.stat_qbuf_pool_misses, 1);
+        zmalloc_transient_begin();
+        thread_shared_qb = sdsnewlen(NULL,PROTO_IOBUF_LEN);
+        zmalloc_transient_end();
+        sdsclear(thread_shared_qb);
+    }
+    zmalloc_transient_begin();
+    sdsfree(c->m_query_buf);
+    zmalloc_transient_end();
+    c->m_query_buf = thread_shared_qb;
+    c->m_query_buf_shared = 1;
+    thread_shared_qb = NULL;
+}
+
+/* Give the buffer back to the pool of the calling thread, or just release
+ * it if the pool is already full or the buffer grew too much. */
+static void releaseSharedQueryBuffer(sds qb) {
+    if (thread_shared_qb == NULL && sdsAllocSize(qb) <= PROTO_SHARED_QB_MAX_SIZE) {
+        sdsclear(qb);
+        thread_shared_qb = qb;
+    } else {
+        zmalloc_transient_begin();
+        sdsfree(qb);
+        zmalloc_transient_end();
+    }
+}
+
+static void returnSharedQueryBuffer(client *c) {
+    sds qb = c->m_query_buf;
+
+    if (!c->m_query_buf_shared) return;
+    zmalloc_transient_begin();
+    c->m_query_buf = sdsnewlen(qb,sdslen(qb));
+    zmalloc_transient_end();
+    c->m_query_buf_shared = 0;
+    releaseSharedQueryBuffer(qb);
+}
+
+void freeClientQueryBuffer(client *c) {
+    if (c->m_query_buf_shared) {
+        releaseSharedQueryBuffer(c->m_query_buf);
+    } else {
+        zmalloc_transient_begin();
+        sdsfree(c->m_query_buf);
+        zmalloc_transient_end();
     }
-    server.current_client = NULL;
+    c->m_query_buf_shared = 0;
 }
 
 void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
@@ -1384,6 +2285,10 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
 
     client *c = (client*) privdata;
 
+    /* Check if we want to read from the client later when exiting from
+     * the event loop. This is the case if threaded I/O is enabled. */
+    if (postponeClientRead(c)) return;
+
     size_t read_len = PROTO_IOBUF_LEN;
     /* If this is a multi bulk request, and we are processing a bulk reply
      * that is large enough, try to maximize the probability that the query
@@ -1400,23 +2305,53 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
             read_len = remaining;
     }
 
+    borrowSharedQueryBuffer(c);
     size_t qblen = sdslen(c->m_query_buf);
     if (c->m_query_buf_peak < qblen) c->m_query_buf_peak = qblen;
+    /* A buffer holding just a big argument becomes the argument itself, see
+     * processMultibulkBuffer(), so it is not a transient allocation. */
+    int transient = c->m_bulk_len < PROTO_MBULK_BIG_ARG;
+    if (transient) zmalloc_transient_begin();
     c->m_query_buf = sdsMakeRoomFor(c->m_query_buf, read_len);
-    ssize_t nread = read(fd, c->m_query_buf+qblen, read_len);
+    if (transient) zmalloc_transient_end();
+    ssize_t nread = c->m_shm ? shmRead(c->m_shm, c->m_query_buf+qblen, read_len) :
+                               read(fd, c->m_query_buf+qblen, read_len);
+    ssize_t netread = nread;
     if (nread == -1) {
         if (errno == EAGAIN) {
+            returnSharedQueryBuffer(c);
             return;
         } else {
             serverLog(LL_VERBOSE, "Reading from client: %s",strerror(errno));
-            freeClient(c);
+            freeClientOrAsync(c);
             return;
         }
     } else if (nread == 0) {
         serverLog(LL_VERBOSE, "Client closed connection");
-        freeClient(c);
+        freeClientOrAsync(c);
         return;
     } else if (c->m_flags & CLIENT_MASTER) {
+        if (c->m_repl_compress) {
+            /* The master sends LZF frames: what we read is replaced by the
+             * data of the frames completed by it, that is what the rest of
+             * the replication code sees, offsets included. */
+            c->m_repl_frames = sdscatlen(c->m_repl_frames,
+                                         c->m_query_buf+qblen,nread);
+            if (replFrameDecode(&c->m_repl_frames,&c->m_query_buf) == -1) {
+                serverLog(LL_WARNING,"Corrupted frame in the compressed "
+                                     "replication stream from master");
+                freeClientOrAsync(c);
+                return;
+            }
+            nread = sdslen(c->m_query_buf)-qblen;
+            sdsIncrLen(c->m_query_buf,-nread);
+            c->m_last_interaction_time = server.unixtime;
+            if (nread == 0) {
+                atomicIncr(server.stat_net_input_bytes, netread);
+                c->m_stat_net_input_bytes += netread;
+                return;
+            }
+        }
         /* Append the query buffer to the pending (not applied) buffer
          * of the master. We'll use this buffer later in order to have a
          * copy of the string applied by the last command executed. */
@@ -1427,7 +2362,8 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
     sdsIncrLen(c->m_query_buf,nread);
     c->m_last_interaction_time = server.unixtime;
     if (c->m_flags & CLIENT_MASTER) c->m_read_replication_offset += nread;
-    server.stat_net_input_bytes += nread;
+    atomicIncr(server.stat_net_input_bytes, netread);
+    c->m_stat_net_input_bytes += netread;
     if (sdslen(c->m_query_buf) > server.client_max_querybuf_len) {
         sds ci = c->catClientInfoString(sdsempty()), bytes = sdsempty();
 
@@ -1435,7 +2371,7 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
         serverLog(LL_WARNING,"Closing client that reached max query buffer length: %s (qbuf initial bytes: %s)", ci, bytes);
         sdsfree(ci);
         sdsfree(bytes);
-        freeClient(c);
+        freeClientOrAsync(c);
         return;
     }
 
@@ -1446,7 +2382,9 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
      * corresponding part of the replication stream, will be propagated to
      * the sub-slaves and to the replication backlog. */
     if (!(c->m_flags & CLIENT_MASTER)) {
-        c->processInputBuffer();
+        /* The client may be freed while executing its commands: in that
+         * case the shared buffer was already released. */
+        if (c->processInputBuffer() == C_OK) returnSharedQueryBuffer(c);
     } else {
         size_t prev_offset = c->m_applied_replication_offset;
         c->processInputBuffer();
@@ -1459,25 +2397,6 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
     }
 }
 
-void getClientsMaxBuffers(unsigned long *longest_output_list,
-                          unsigned long *biggest_input_buffer) {
-    client *c;
-    listNode *ln;
-    unsigned long lol = 0, bib = 0;
-
-    listIter li(server.clients);
-    while ((ln = li.listNext()) != NULL) {
-        c = (client *)ln->listNodeValue();
-
-        if (c->m_reply->listLength() > lol)
-            lol = c->m_reply->listLength();
-        if (sdslen(c->m_query_buf) > bib)
-            bib = sdslen(c->m_query_buf);
-    }
-    *longest_output_list = lol;
-    *biggest_input_buffer = bib;
-}
-
 /* A Redis "Peer ID" is a colon separated ip:port pair.
  * For IPv4 it's in the form x.y.z.k:port, example: "127.0.0.1:1234".
  * For IPv6 addresses we use [] around the IP part, like in "[::1]:1234".
@@ -1535,6 +2454,9 @@ sds client::catClientInfoString(sds s) {
     if (m_flags & CLIENT_CLOSE_ASAP) *p++ = 'A';
     if (m_flags & CLIENT_UNIX_SOCKET) *p++ = 'U';
     if (m_flags & CLIENT_READONLY) *p++ = 'r';
+    if (m_tracking_flags & CLIENT_TRACKING) *p++ = 't';
+    if (m_tracking_flags & CLIENT_TRACKING_BROKEN_REDIR) *p++ = 'R';
+    if (m_tracking_flags & CLIENT_TRACKING_BCAST) *p++ = 'B';
     if (p == flags) *p++ = 'N';
     *p++ = '\0';
 
@@ -1544,7 +2466,7 @@ sds client::catClientInfoString(sds s) {
     if (emask & AE_WRITABLE) *p++ = 'w';
     *p = '\0';
     return sdscatfmt(s,
-        "id=%U addr=%s fd=%i name=%s age=%I idle=%I flags=%s db=%i sub=%i psub=%i multi=%i qbuf=%U qbuf-free=%U obl=%U oll=%U omem=%U events=%s cmd=%s",
+        "id=%U addr=%s fd=%i name=%s age=%I idle=%I flags=%s db=%i sub=%i psub=%i ssub=%i multi=%i qbuf=%U qbuf-free=%U obl=%U oll=%U omem=%U events=%s cmd=%s tot-cmds=%U tot-usec=%U tot-net-in=%U tot-net-out=%U",
         (unsigned long long) m_client_id,
         getClientPeerId(),
         m_fd,
@@ -1555,6 +2477,7 @@ sds client::catClientInfoString(sds s) {
         m_cur_selected_db->m_id,
         (int) m_pubsub_channels->dictSize(),
         (int) m_pubsub_patterns->listLength(),
+        (int) m_pubsubshard_channels->dictSize(),
         (m_flags & CLIENT_MULTI) ? m_multi_exec_state.m_count : -1,
         (unsigned long long) sdslen(m_query_buf),
         (unsigned long long) sdsavail(m_query_buf),
@@ -1562,7 +2485,90 @@ sds client::catClientInfoString(sds s) {
         (unsigned long long) m_reply->listLength(),
         (unsigned long long) getClientOutputBufferMemoryUsage(),
         events,
-        m_last_cmd ? m_last_cmd->name : "NULL");
+        m_last_cmd ? m_last_cmd->name : "NULL",
+        m_stat_commands,
+        m_stat_cmd_usec,
+        m_stat_net_input_bytes,
+        m_stat_net_output_bytes);
+}
+
+/* Client and value of the metric selected by CLIENT TOP. */
+struct clientTopEntry {
+    client *c;
+    unsigned long long value;
+};
+
+static int clientTopCompare(const void *a, const void *b) {
+    const clientTopEntry *ea = (const clientTopEntry *)a,
+                         *eb = (const clientTopEntry *)b;
+    if (ea->value == eb->value) return 0;
+    return ea->value > eb->value ? -1 : 1;
+}
+
+/* CLIENT TOP [CPU|COMMANDS|NET-IN|NET-OUT] [COUNT <count>]
+ *
+ * Reply with the clients that consumed the most of the selected resource
+ * (CPU by default) since they connected, as an array of
+ * [id, addr, name, value] entries sorted by decreasing value. */
+static void clientTopCommand(client *c) {
+    int metric = 0; /* 0 = cpu, 1 = commands, 2 = net-in, 3 = net-out. */
+    long count = 10;
+
+    for (int j = 2; j < c->m_argc; j++) {
+        const char *opt = (const char*)c->m_argv[j]->ptr;
+        int moreargs = j+1 < c->m_argc;
+
+        if (!strcasecmp(opt,"cpu")) {
+            metric = 0;
+        } else if (!strcasecmp(opt,"commands")) {
+            metric = 1;
+        } else if (!strcasecmp(opt,"net-in")) {
+            metric = 2;
+        } else if (!strcasecmp(opt,"net-out")) {
+            metric = 3;
+        } else if (!strcasecmp(opt,"count") && moreargs) {
+            if (getLongFromObjectOrReply(c,c->m_argv[j+1],&count,NULL) != C_OK)
+                return;
+            if (count <= 0) {
+                c->addReplyError("COUNT must be > 0");
+                return;
+            }
+            j++;
+        } else {
+            c->addReply(shared.syntaxerr);
+            return;
+        }
+    }
+
+    unsigned long numclients = server.clients->listLength(), n = 0;
+    clientTopEntry *entries = (clientTopEntry *)zmalloc(sizeof(clientTopEntry)*(numclients+1));
+    listIter li(server.clients);
+    listNode *ln;
+    while ((ln = li.listNext()) != NULL) {
+        client *_client = (client *)ln->listNodeValue();
+        entries[n].c = _client;
+        switch(metric) {
+        case 0: entries[n].value = _client->m_stat_cmd_usec; break;
+        case 1: entries[n].value = _client->m_stat_commands; break;
+        case 2: entries[n].value = _client->m_stat_net_input_bytes; break;
+        default: entries[n].value = _client->m_stat_net_output_bytes; break;
+        }
+        n++;
+    }
+    qsort(entries,n,sizeof(clientTopEntry),clientTopCompare);
+    if ((unsigned long)count < n) n = count;
+
+    c->addReplyMultiBulkLen(n);
+    for (unsigned long j = 0; j < n; j++) {
+        client *_client = entries[j].c;
+        c->addReplyMultiBulkLen(4);
+        c->addReplyLongLong(_client->m_client_id);
+        c->addReplyBulkCString(_client->getClientPeerId());
+        c->addReplyBulkCString(_client->m_client_name ?
+                               (char*)_client->m_client_name->ptr : "");
+        c->addReplyLongLong(entries[j].value);
+    }
+    zfree(entries);
 }
 
 sds getAllClientsInfoString() {
@@ -1587,6 +2593,16 @@ void clientCommand(client *c) {
         sds o = getAllClientsInfoString();
         c->addReplyBulkCBuffer(o,sdslen(o));
         sdsfree(o);
+    } else if (!strcasecmp((const char*)c->m_argv[1]->ptr,"id") && c->m_argc == 2) {
+        /* CLIENT ID */
+        c->addReplyLongLong(c->m_client_id);
+    } else if (!strcasecmp((const char*)c->m_argv[1]->ptr,"shm") && c->m_argc == 3) {
+        /* CLIENT SHM <ring-size> */
+        long long size;
+
+        if (getLongLongFromObjectOrReply(c,c->m_argv[2],&size,NULL) != C_OK)
+            return;
+        clientShmCommand(c,size);
     } else if (!strcasecmp((const char*)c->m_argv[1]->ptr,"reply") && c->m_argc == 3) {
         /* CLIENT REPLY ON|OFF|SKIP */
         if (!strcasecmp((const char*)c->m_argv[2]->ptr,"on")) {
@@ -1728,8 +2744,108 @@ void clientCommand(client *c) {
                                         != C_OK) return;
         pauseClients(duration);
         c->addReply(shared.ok);
+    } else if (!strcasecmp((const char*)c->m_argv[1]->ptr,"tracking") && c->m_argc >= 3) {
+        /* CLIENT TRACKING (on|off) [REDIRECT <id>] [BCAST] [PREFIX <p>] ...
+         *                          [NOLOOP] */
+        long long redir = 0;
+        int options = 0;
+        robj **prefix = NULL;
+        size_t numprefix = 0;
+
+        /* Parse the options. */
+        for (int j = 3; j < c->m_argc; j++) {
+            int moreargs = (c->m_argc-1) - j;
+
+            if (!strcasecmp((const char*)c->m_argv[j]->ptr,"redirect") && moreargs) {
+                j++;
+                if (getLongLongFromObjectOrReply(c,c->m_argv[j],&redir,NULL) !=
+                    C_OK)
+                {
+                    zfree(prefix);
+                    return;
+                }
+                /* We will require the client with the specified ID to exist
+                 * right now, even if it is possible that it gets disconnected
+                 * later. Still a valid sanity check. */
+                if (lookupClientByID(redir) == NULL) {
+                    c->addReplyError("The client ID you want redirect to "
+                                     "does not exist");
+                    zfree(prefix);
+                    return;
+                }
+            } else if (!strcasecmp((const char*)c->m_argv[j]->ptr,"bcast")) {
+                options |= CLIENT_TRACKING_BCAST;
+            } else if (!strcasecmp((const char*)c->m_argv[j]->ptr,"noloop")) {
+                options |= CLIENT_TRACKING_NOLOOP;
+            } else if (!strcasecmp((const char*)c->m_argv[j]->ptr,"prefix") && moreargs) {
+                j++;
+                prefix = (robj **)zrealloc(prefix,sizeof(robj*)*(numprefix+1));
+                prefix[numprefix++] = c->m_argv[j];
+            } else {
+                zfree(prefix);
+                c->addReply(shared.syntaxerr);
+                return;
+            }
+        }
+
+        /* Options are ok: enable or disable the tracking for this client. */
+        if (!strcasecmp((const char*)c->m_argv[2]->ptr,"on")) {
+            /* Before enabling tracking, make sure options are compatible
+             * among each other and with the current state of the client. */
+            if (!(options & CLIENT_TRACKING_BCAST) && numprefix) {
+                c->addReplyError(
+                    "PREFIX option requires BCAST mode to be enabled");
+                zfree(prefix);
+                return;
+            }
+            if (redir == 0) {
+                c->addReplyError(
+                    "Invalidation messages are sent as Pub/Sub messages of "
+                    "the __redis__:invalidate channel: the REDIRECT option "
+                    "is required");
+                zfree(prefix);
+                return;
+            }
+            if (c->m_tracking_flags & CLIENT_TRACKING) {
+                int oldbcast = !!(c->m_tracking_flags & CLIENT_TRACKING_BCAST);
+                int newbcast = !!(options & CLIENT_TRACKING_BCAST);
+                if (oldbcast != newbcast) {
+                    c->addReplyError(
+                    "You can't switch BCAST mode on/off before disabling "
+                    "tracking for this client, and then re-enabling it with "
+                    "a different mode.");
+                    zfree(prefix);
+                    return;
+                }
+            }
+            if (options & CLIENT_TRACKING_BCAST &&
+                checkPrefixCollisionsOrReply(c,prefix,numprefix) != C_OK)
+            {
+                zfree(prefix);
+                return;
+            }
+            enableTracking(c,redir,options,prefix,numprefix);
+        } else if (!strcasecmp((const char*)c->m_argv[2]->ptr,"off")) {
+            disableTracking(c);
+        } else {
+            zfree(prefix);
+            c->addReply(shared.syntaxerr);
+            return;
+        }
+        zfree(prefix);
+        c->addReply(shared.ok);
+    } else if (!strcasecmp((const char*)c->m_argv[1]->ptr,"getredir") && c->m_argc == 2) {
+        /* CLIENT GETREDIR */
+        if (c->m_tracking_flags & CLIENT_TRACKING) {
+            c->addReplyLongLong(c->m_client_tracking_redirection);
+        } else {
+            c->addReplyLongLong(-1);
+        }
+    } else if (!strcasecmp((const char*)c->m_argv[1]->ptr,"top")) {
+        /* CLIENT TOP [CPU|COMMANDS|NET-IN|NET-OUT] [COUNT <count>] */
+        clientTopCommand(c);
     } else {
-        c->addReplyError( "Syntax error, try CLIENT (LIST | KILL | GETNAME | SETNAME | PAUSE | REPLY)");
+        c->addReplyError( "Syntax error, try CLIENT (LIST | KILL | GETNAME | SETNAME | PAUSE | REPLY | ID | TRACKING | GETREDIR | TOP | SHM)");
     }
 }
 
@@ -1777,6 +2893,7 @@ void client::rewriteClientCommandVector(int argc, ...) {
     zfree(m_argv);
     /* Replace argv and argc with our new versions. */
     m_argv = argv;
+    m_argv_len = argc;
     m_argc = argc;
     m_cmd = lookupCommandOrOriginal((sds)m_argv[0]->ptr);
     serverAssertWithInfo(this,NULL,m_cmd != NULL);
@@ -1788,6 +2905,7 @@ void client::replaceClientCommandVector(int argc, robj **argv) {
     freeClientArgv();
     zfree(m_argv);
     m_argv = argv;
+    m_argv_len = argc;
     m_argc = argc;
     m_cmd = lookupCommandOrOriginal((sds)m_argv[0]->ptr);
     serverAssertWithInfo(this,NULL,m_cmd != NULL);
@@ -1809,6 +2927,7 @@ void client::rewriteClientCommandArgument(int i, robj *newval) {
 
     if (i >= m_argc) {
         m_argv = (robj **)zrealloc(m_argv,sizeof(robj*)*(i+1));
+        m_argv_len = i+1;
         m_argc = i+1;
         m_argv[i] = NULL;
     }
@@ -1833,12 +2952,21 @@ void client::rewriteClientCommandArgument(int i, robj *newval) {
  * The function returns the total sum of the length of all the objects
  * stored in the output list, plus the memory used to allocate every
  * list node. The static reply buffer is not taken into account since it
- * is allocated anyway.
+ * is allocated anyway. For slaves, the replication stream they still have
+ * to send is added as well.
  *
  * Note: this function is very fast so can be called as many time as
  * the caller wishes. The main usage of this function currently is
  * enforcing the client output length limits. */
 unsigned long client::getClientOutputBufferMemoryUsage() {
+    return getClientOwnOutputBufferMemoryUsage() +
+           replBuffer::replBufferPending(&m_repl_cursor);
+}
+
+/* Like getClientOutputBufferMemoryUsage(), but without the part of the
+ * replication stream a slave still has to send, that is shared with the
+ * other slaves: this is what the client buffers actually use. */
+unsigned long client::getClientOwnOutputBufferMemoryUsage() {
     unsigned long list_item_size = sizeof(listNode)+5;
     /* The +5 above means we assume an sds16 hdr, may not be true
      * but is not going to be a problem. */
@@ -1939,7 +3067,8 @@ int client::checkClientOutputBufferLimits() {
  * lower level functions pushing data inside the client output buffers. */
 void client::asyncCloseClientOnOutputBufferLimitReached() {
     serverAssert(m_reply_bytes < SIZE_MAX-(1024*64));
-    if (m_reply_bytes == 0 || m_flags & CLIENT_CLOSE_ASAP)
+    if ((m_reply_bytes == 0 && !replBuffer::replBufferPending(&m_repl_cursor)) ||
+        m_flags & CLIENT_CLOSE_ASAP)
         return;
     if (checkClientOutputBufferLimits()) {
         sds client = catClientInfoString(sdsempty());
@@ -2040,9 +3169,13 @@ int clientsArePaused() {
  * write, close sequence needed to serve a client.
  *
  * The function returns the total number of events processed. */
+static int ProcessingEventsWhileBlocked = 0;
+
 int processEventsWhileBlocked() {
     int iterations = 4; /* See the function top-comment. */
     int count = 0;
+
+    ProcessingEventsWhileBlocked = 1;
     while (iterations--) {
         int events = 0;
         events += server.el->aeProcessEvents(AE_FILE_EVENTS|AE_DONT_WAIT);
@@ -2050,5 +3183,550 @@ int processEventsWhileBlocked() {
         if (!events) break;
         count += events;
     }
+    ProcessingEventsWhileBlocked = 0;
     return count;
 }
+
+/* ==========================================================================
+ * Threaded I/O
+ *
+ * When io-threads is greater than one, the main thread distributes the
+ * clients having pending writes (and, if io-threads-do-reads is enabled,
+ * the clients having pending reads) among a set of I/O threads before going
+ * to sleep. The threads only perform the write(2) / read(2) calls and the
+ * query buffer parsing: commands are always executed by the main thread,
+ * and the main thread busy waits for the threads to finish their job, so
+ * nothing else ever touches the clients while they are being served.
+ *
+ * The only exception are the slaves with slave-parallel-reads enabled: after
+ * a threaded read pass, the read only commands just parsed are executed by
+ * the threads as well, in a further pass. The dataset is only read during
+ * this pass, while the main thread waits, and only modified by the main
+ * thread between the passes, when it applies the stream of the master, so
+ * the passes work as the shared side of a readers/writer lock.
+ *
+ * With lua-parallel-scripts the same pass also executes the read only scripts
+ * of EVAL_RO and EVALSHA_RO, in masters as well: such scripts can only read
+ * the keys they declare, so they are checked like the commands, and every
+ * thread runs them in its own Lua interpreter, see scripting.cpp.
+ * ========================================================================== */
+
+#define IO_THREADS_OP_IDLE 0
+#define IO_THREADS_OP_READ 1
+#define IO_THREADS_OP_WRITE 2
+#define IO_THREADS_OP_EXEC 3
+
+static pthread_t io_threads[IO_THREADS_MAX_NUM];
+static pthread_mutex_t io_threads_mutex[IO_THREADS_MAX_NUM];
+static std::atomic<unsigned long> io_threads_pending[IO_THREADS_MAX_NUM];
+static int io_threads_active;  /* Are the threads currently spinning waiting
+                                  I/O? */
+static int io_threads_op;      /* IO_THREADS_OP_* the threads are performing. */
+
+/* This is the list of clients each thread will serve when threaded I/O is
+ * used. We spawn io_threads_num-1 threads, since one is the main thread
+ * itself. */
+static list *io_threads_list[IO_THREADS_MAX_NUM];
+
+/* The clients whose command is executed by the next IO_THREADS_OP_EXEC pass,
+ * and the client the calling thread is executing in that pass. */
+static list *io_threads_exec_list;
+__thread client *io_thread_current_client = NULL;
+
+/* The objects referenced by the reply nodes written during a threaded write
+ * pass, by thread. The same value may be referenced by the replies of
+ * clients served by other threads, so its refcount is only decremented by
+ * the main thread once the pass is done, see ioThreadsReleaseReplyRefs(). */
+static list *io_threads_reply_refs[IO_THREADS_MAX_NUM];
+static __thread long io_thread_id = 0;
+
+/* Commands executed by each thread in the IO_THREADS_OP_EXEC passes, the
+ * main thread being the thread 0. Every thread only writes its own slot,
+ * the main thread reads them once the pass is done. */
+static long long io_threads_commands[IO_THREADS_MAX_NUM];
+
+/* Append the io_threads_commands counters to 's' as "0=<n>,1=<n>,...". */
+sds catIOThreadsCommands(sds s) {
+    for (int j = 0; j < server.io_threads_num; j++)
+        s = sdscatprintf(s,"%s%d=%lld",j ? "," : "",j,io_threads_commands[j]);
+    return s;
+}
+
+void resetIOThreadsCommands(void) {
+    memset(io_threads_commands,0,sizeof(io_threads_commands));
+}
+
+/* Called when the reply node referencing 'o' is released: returns 1 if the
+ * reference is released later by the main thread, otherwise 0. */
+static int ioThreadDeferDecrRefCount(robj *o) {
+    if (io_threads_op != IO_THREADS_OP_WRITE) return 0;
+    io_threads_reply_refs[io_thread_id]->listAddNodeTail(o);
+    return 1;
+}
+
+/* Release the references collected by ioThreadDeferDecrRefCount(). */
+static void ioThreadsReleaseReplyRefs(void) {
+    for (int j = 0; j < server.io_threads_num; j++)
+        io_threads_reply_refs[j]->listEmpty();
+}
+
+/* While a threaded read or write pass is in progress clients can't be
+ * released synchronously, since the main thread is still iterating the
+ * lists referencing them, and the I/O threads can't free clients at all. */
+static void freeClientOrAsync(client *c) {
+    if (io_threads_op != IO_THREADS_OP_IDLE)
+        freeClientAsync(c);
+    else
+        freeClient(c);
+}
+
+/* Execute the command of 'c', selected by clientCanExecuteInThread(), in
+ * the calling thread. What call() does besides running the command is left
+ * to the main thread, see ioThreadCommandDone(). */
+static void ioThreadExecuteCommand(client *c) {
+    size_t arena_mark = zarena_mark();
+    long long start = ustime();
+
+    io_thread_current_client = c;
+    c->m_cmd->proc(c);
+    io_thread_current_client = NULL;
+    c->m_thread_cmd_duration = ustime()-start;
+    io_threads_commands[io_thread_id]++;
+    zarena_release(arena_mark);
+}
+
+static void *IOThreadMain(void *myid) {
+    /* The ID is the thread number (from 0 to server.io_threads_num-1), and is
+     * used by the thread to just manipulate a single sub-array of clients. */
+    long id = (long)myid;
+
+    io_thread_id = id;
+    setcpuaffinity(server.io_threads_cpulist);
+    while(1) {
+        /* Wait for start */
+        for (int j = 0; j < 1000000; j++) {
+            if (io_threads_pending[id] != 0) break;
+        }
+
+        /* Give the main thread a chance to stop this thread. */
+        if (io_threads_pending[id] == 0) {
+            pthread_mutex_lock(&io_threads_mutex[id]);
+            pthread_mutex_unlock(&io_threads_mutex[id]);
+            continue;
+        }
+
+        serverAssert(io_threads_pending[id] != 0);
+
+        /* Process: note that the main thread will never touch our list
+         * before we drop the pending count to 0. */
+        listNode *ln;
+        listIter li(io_threads_list[id]);
+        while((ln = li.listNext())) {
+            client *c = (client *)ln->listNodeValue();
+            if (io_threads_op == IO_THREADS_OP_WRITE) {
+                writeToClient(c->m_fd,c,0);
+            } else if (io_threads_op == IO_THREADS_OP_READ) {
+                readQueryFromClient(server.el,c->m_fd,c,0);
+            } else if (io_threads_op == IO_THREADS_OP_EXEC) {
+                ioThreadExecuteCommand(c);
+            } else {
+                serverPanic("io_threads_op value is unknown");
+            }
+        }
+        io_threads_list[id]->listEmpty();
+        io_threads_pending[id] = 0;
+    }
+    return NULL;
+}
+
+/* Initialize the data structures needed for threaded I/O. */
+void initThreadedIO() {
+    io_threads_active = 0; /* We start with threads not active. */
+    io_threads_op = IO_THREADS_OP_IDLE;
+
+    /* Don't spawn any thread if the user selected a single thread:
+     * we'll handle I/O directly from the main thread. */
+    if (server.io_threads_num == 1) return;
+
+    if (server.io_threads_num > IO_THREADS_MAX_NUM) {
+        serverLog(LL_WARNING,"Fatal: too many I/O threads configured. "
+                             "The maximum number is %d.", IO_THREADS_MAX_NUM);
+        exit(1);
+    }
+
+    io_threads_exec_list = listCreate();
+
+    /* Spawn and initialize the I/O threads. */
+    for (int i = 0; i < server.io_threads_num; i++) {
+        /* Things we do for all the threads including the main thread. */
+        io_threads_list[i] = listCreate();
+        io_threads_reply_refs[i] = listCreate();
+        io_threads_reply_refs[i]->listSetFreeMethod(decrRefCountVoid);
+        if (i == 0) continue; /* Thread 0 is the main thread. */
+
+        /* Things we do only for the additional threads. */
+        pthread_t tid;
+        pthread_mutex_init(&io_threads_mutex[i],NULL);
+        io_threads_pending[i] = 0;
+        pthread_mutex_lock(&io_threads_mutex[i]); /* Thread will be stopped. */
+        if (pthread_create(&tid,NULL,IOThreadMain,(void*)(long)i) != 0) {
+            serverLog(LL_WARNING,"Fatal: Can't initialize IO thread.");
+            exit(1);
+        }
+        io_threads[i] = tid;
+    }
+}
+
+static void startThreadedIO() {
+    serverAssert(io_threads_active == 0);
+    for (int j = 1; j < server.io_threads_num; j++)
+        pthread_mutex_unlock(&io_threads_mutex[j]);
+    io_threads_active = 1;
+}
+
+static void stopThreadedIO() {
+    /* We may have still clients with pending reads when this function
+     * is called: handle them before stopping the threads. */
+    handleClientsWithPendingReadsUsingThreads();
+    serverAssert(io_threads_active == 1);
+    for (int j = 1; j < server.io_threads_num; j++)
+        pthread_mutex_lock(&io_threads_mutex[j]);
+    io_threads_active = 0;
+}
+
+/* This function checks if there are not enough pending clients to justify
+ * taking the I/O threads active: in that case I/O threads are stopped if
+ * currently active. We track the pending writes as a measure of clients
+ * we need to handle in parallel, however the I/O threading is disabled
+ * globally for reads as well if we have too little pending clients.
+ *
+ * The function returns 0 if the I/O threading should be used because there
+ * are enough active threads, otherwise 1 is returned and the I/O threads
+ * could be possibly stopped (if already active) as a side effect. */
+int stopThreadedIOIfNeeded() {
+    int pending = server.clients_pending_write->listLength();
+
+    /* Return ASAP if I/O threads are disabled (single threaded mode). */
+    if (server.io_threads_num == 1) return 1;
+
+    if (pending < (server.io_threads_num*2)) {
+        if (io_threads_active) stopThreadedIO();
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+/* Assign the clients in 'clients' to the I/O threads round robin, or the
+ * commands to execute to the thread owning the slot of their key with
+ * io-threads-shards, run the requested operation in parallel (the main
+ * thread handles the first sub-list itself) and wait for all the threads to
+ * be done. */
+static void runThreadedIOPass(list *clients, int op) {
+    listNode *ln;
+    int item_id = 0;
+
+    listIter li(clients);
+    while((ln = li.listNext())) {
+        client *c = (client *)ln->listNodeValue();
+        int target_id = item_id % server.io_threads_num;
+        if (op == IO_THREADS_OP_EXEC && c->m_thread_shard != -1)
+            target_id = c->m_thread_shard;
+        io_threads_list[target_id]->listAddNodeTail(c);
+        item_id++;
+    }
+
+    /* Give the start condition to the waiting threads, by setting the
+     * start condition atomic var. */
+    io_threads_op = op;
+    for (int j = 1; j < server.io_threads_num; j++) {
+        unsigned long count = io_threads_list[j]->listLength();
+        io_threads_pending[j] = count;
+    }
+
+    /* Also use the main thread to process a slice of clients. */
+    listIter li0(io_threads_list[0]);
+    while((ln = li0.listNext())) {
+        client *c = (client *)ln->listNodeValue();
+        if (op == IO_THREADS_OP_WRITE)
+            writeToClient(c->m_fd,c,0);
+        else if (op == IO_THREADS_OP_READ)
+            readQueryFromClient(server.el,c->m_fd,c,0);
+        else
+            ioThreadExecuteCommand(c);
+    }
+    io_threads_list[0]->listEmpty();
+
+    /* Wait for all the other threads to end their work. */
+    while(1) {
+        unsigned long pending = 0;
+        for (int j = 1; j < server.io_threads_num; j++)
+            pending += io_threads_pending[j];
+        if (pending == 0) break;
+    }
+    io_threads_op = IO_THREADS_OP_IDLE;
+}
+
+/* Threaded version of handleClientsWithPendingWrites(), called from
+ * beforeSleep(). Falls back to the single threaded implementation when
+ * there are too few clients to serve. */
+int handleClientsWithPendingWritesUsingThreads() {
+    int processed = server.clients_pending_write->listLength();
+    if (processed == 0) return 0; /* Return ASAP if there are no clients. */
+
+    /* If I/O threads are disabled or we have few clients to serve, don't
+     * use I/O threads, but the boring synchronous code. */
+    if (server.io_threads_num == 1 || stopThreadedIOIfNeeded()) {
+        return handleClientsWithPendingWrites();
+    }
+
+    /* Start threads if needed. */
+    if (!io_threads_active) startThreadedIO();
+
+    /* Clients scheduled to be closed don't need their replies, and the
+     * clients waiting for the AOF group commit can't have them yet. */
+    listNode *ln;
+    listIter li(server.clients_pending_write);
+    while((ln = li.listNext())) {
+        client *c = (client *)ln->listNodeValue();
+        c->m_flags &= ~CLIENT_PENDING_WRITE;
+        if (c->m_flags & CLIENT_CLOSE_ASAP) {
+            server.clients_pending_write->listDelNode(ln);
+        } else if (aofClientMustWaitCommit(c)) {
+            aofHoldClientReplies(c);
+            server.clients_pending_write->listDelNode(ln);
+        } else {
+            produceClientReply(c);
+        }
+    }
+    if (server.clients_pending_write->listLength() == 0) return processed;
+
+    runThreadedIOPass(server.clients_pending_write,IO_THREADS_OP_WRITE);
+    ioThreadsReleaseReplyRefs();
+
+    /* Run the list of clients again to install the write handler where
+     * needed. */
+    listIter li2(server.clients_pending_write);
+    while((ln = li2.listNext())) {
+        client *c = (client *)ln->listNodeValue();
+
+        /* Install the write handler if there are pending writes in some
+         * of the clients. */
+        if (!(c->m_flags & CLIENT_CLOSE_ASAP) &&
+            c->clientHasPendingReplies() && !c->m_shm &&
+            server.el->aeCreateFileEvent(c->m_fd, AE_WRITABLE,
+                sendReplyToClient, c) == AE_ERR)
+        {
+            freeClientAsync(c);
+        }
+    }
+    server.clients_pending_write->listEmpty();
+
+    server.stat_io_writes_processed += processed;
+    return processed;
+}
+
+/* Return 1 if we want to handle the client read later using threaded I/O.
+ * This is called by the readable handler of the event loop.
+ * As a side effect of calling this function the client is put in the
+ * pending read clients and flagged as such. */
+int postponeClientRead(client *c) {
+    if (io_threads_active &&
+        server.io_threads_do_reads &&
+        !ProcessingEventsWhileBlocked &&
+        !(c->m_flags & (CLIENT_MASTER|CLIENT_SLAVE|CLIENT_PENDING_READ)))
+    {
+        c->m_flags |= CLIENT_PENDING_READ;
+        server.clients_pending_read->listAddNodeHead(c);
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+/* Return 1 if the read only commands can be executed by the I/O threads,
+ * see slave-parallel-reads and lua-parallel-scripts: nothing prevents the
+ * main thread from executing the commands of the normal clients right away. */
+static int ioThreadsCanExecuteCommands(void) {
+    return ((server.slave_parallel_reads && server.masterhost) ||
+            server.lua_parallel_scripts) &&
+           (server.masterhost == NULL ||
+            server.repl_state == REPL_STATE_CONNECTED ||
+            server.repl_serve_stale_data) &&
+           !server.loading &&
+           !server.async_loading &&
+           !server.lua_timedout &&
+           !server.cluster_enabled &&
+           server.monitors->listLength() == 0 &&
+           !moduleHasCommandFilters() &&
+           !clientsArePaused();
+}
+
+/* Return 1 if 'cmd' is a read only command the I/O threads can execute, also
+ * from the read only scripts: it only reads the keys it declares, and none
+ * of the globals of the server. */
+int commandCanExecuteInThread(struct redisCommand *cmd) {
+    if (!(cmd->m_flags & CMD_READONLY) ||
+        cmd->m_flags & (CMD_WRITE|CMD_ADMIN|CMD_MODULE) ||
+        cmd->firstkey == 0) return 0;
+    /* PFCOUNT caches the cardinality in the HLL, XREAD can block, and TOUCH
+     * only exists to update the access time, that the threads don't do. */
+    return cmd->proc != pfcountCommand &&
+           cmd->proc != xreadCommand &&
+           cmd->proc != touchCommand;
+}
+
+/* Return 1 if the command parsed by the last threaded read of 'c' can be
+ * executed by the I/O threads: a read only command, or read only script,
+ * that processCommand() would execute with no other check, and that does not
+ * modify the keys it reads, as the chunked bitmaps read by the commands not
+ * handling them and the compressed lists do. Sets the command of the client
+ * on success. */
+static int clientCanExecuteInThread(client *c) {
+    if (!(c->m_flags & CLIENT_PENDING_COMMAND) ||
+        c->m_flags & (CLIENT_CLOSE_ASAP|CLIENT_CLOSE_AFTER_REPLY|
+                      CLIENT_MULTI|CLIENT_PUBSUB|CLIENT_BLOCKED|
+                      CLIENT_LUA_DEBUG) ||
+        (server.requirepass && !c->m_authenticated)) return 0;
+
+    struct redisCommand *cmd = lookupCommand((sds)c->m_argv[0]->ptr);
+    if (cmd == NULL ||
+        (cmd->arity > 0 && cmd->arity != c->m_argc) ||
+        c->m_argc < -cmd->arity) return 0;
+    if (luaIsReadOnlyScript(cmd)) {
+        if (!server.lua_parallel_scripts) return 0;
+    } else if (!server.slave_parallel_reads || !server.masterhost ||
+               !commandCanExecuteInThread(cmd)) {
+        return 0;
+    }
+
+    int numkeys, ok = 1;
+    int *keys = getKeysFromCommand(cmd,c->m_argv,c->m_argc,&numkeys);
+    c->m_thread_shard = -1;
+    if (server.io_threads_shards && numkeys) {
+        sds key = (sds)c->m_argv[keys[0]]->ptr;
+        c->m_thread_shard = (int)((long)keyHashSlot(key,sdslen(key))*
+                                  server.io_threads_num/CLUSTER_SLOTS);
+    }
+    for (int j = 0; ok && j < numkeys; j++) {
+        dictEntry *de =
+            c->m_cur_selected_db->m_dict->dictFind(c->m_argv[keys[j]]->ptr);
+        robj *o = de ? (robj *)de->dictGetVal() : NULL;
+
+        if (o && (o->encoding == OBJ_ENCODING_CHUNKED ||
+                  o->encoding == OBJ_ENCODING_LAZY ||
+                  (o->encoding == OBJ_ENCODING_COMPRESSED &&
+                   !(cmd->m_flags & CMD_COMPRESSED)) ||
+                  (o->type == OBJ_LIST && server.list_compress_depth)))
+            ok = 0;
+    }
+    getKeysFreeResult(keys);
+    if (ok) c->m_cmd = c->m_last_cmd = cmd;
+    return ok;
+}
+
+/* Do in the main thread what call() does after running the command of 'c',
+ * executed by ioThreadExecuteCommand(), and reset the client for the next
+ * command. */
+static void ioThreadCommandDone(client *c) {
+    long long duration = c->m_thread_cmd_duration;
+    const char *latency_event = (c->m_cmd->m_flags & CMD_FAST) ?
+                                "fast-command" : "command";
+
+    latencyAddSampleIfNeeded(latency_event,duration/1000);
+    slowlogPushEntryIfNeeded(c,c->m_argv,c->m_argc,duration);
+    c->m_last_cmd->microseconds += duration;
+    c->m_last_cmd->calls++;
+    if (c->m_last_cmd->latency_hist == NULL)
+        c->m_last_cmd->latency_hist = (struct latencyHistogram *)zcalloc(sizeof(struct latencyHistogram));
+    latencyHistogramAdd(c->m_last_cmd->latency_hist,duration);
+    c->m_stat_commands++;
+    c->m_stat_cmd_usec += duration;
+    server.stat_numcommands++;
+    server.stat_io_commands_processed++;
+    if ((c->m_tracking_flags & (CLIENT_TRACKING|CLIENT_TRACKING_BCAST)) ==
+        CLIENT_TRACKING) trackingRememberKeys(c,c);
+    if (luaIsReadOnlyScript(c->m_cmd)) luaThreadScriptDone(c,duration);
+    c->m_flags &= ~CLIENT_PENDING_COMMAND;
+    c->resetClient();
+}
+
+/* Execute the commands of the pending read clients that can be executed by
+ * the I/O threads. The clients are still flagged CLIENT_PENDING_READ, so
+ * that the replies are queued without scheduling the clients for writing,
+ * and the incremental rehashing of the dictionaries is paused, so that the
+ * lookups don't modify them. */
+static void executeCommandsUsingThreads(void) {
+    listNode *ln;
+    listIter li(server.clients_pending_read);
+    while((ln = li.listNext())) {
+        client *c = (client *)ln->listNodeValue();
+        if (clientCanExecuteInThread(c))
+            io_threads_exec_list->listAddNodeTail(c);
+    }
+    if (io_threads_exec_list->listLength() == 0) return;
+
+    dictPauseRehashing();
+    server.io_threads_exec_active = 1;
+    runThreadedIOPass(io_threads_exec_list,IO_THREADS_OP_EXEC);
+    server.io_threads_exec_active = 0;
+    dictResumeRehashing();
+
+    listIter li2(io_threads_exec_list);
+    while((ln = li2.listNext()))
+        ioThreadCommandDone((client *)ln->listNodeValue());
+    io_threads_exec_list->listEmpty();
+}
+
+/* When threaded I/O is also enabled for the reading + parsing side, the
+ * readable handler will just put normal clients into a queue of clients to
+ * process (instead of serving them synchronously). This function runs
+ * the queue using the I/O threads, and process them in order to accumulate
+ * the reads in the buffers, and also parse the first command available
+ * rendering it in the client structures. */
+int handleClientsWithPendingReadsUsingThreads() {
+    if (!io_threads_active || !server.io_threads_do_reads) return 0;
+    int processed = server.clients_pending_read->listLength();
+    if (processed == 0) return 0;
+
+    runThreadedIOPass(server.clients_pending_read,IO_THREADS_OP_READ);
+    if (ioThreadsCanExecuteCommands()) executeCommandsUsingThreads();
+
+    /* Run the list of clients again to process the new buffers. */
+    while(server.clients_pending_read->listLength()) {
+        listNode *ln = server.clients_pending_read->listFirst();
+        client *c = (client *)ln->listNodeValue();
+        c->m_flags &= ~CLIENT_PENDING_READ;
+        server.clients_pending_read->listDelNode(ln);
+
+        /* Replies queued by the I/O thread (protocol errors) could not
+         * schedule the client for writing: do it now. */
+        if (!(c->m_flags & CLIENT_PENDING_WRITE) &&
+            c->clientHasPendingReplies())
+        {
+            c->m_flags |= CLIENT_PENDING_WRITE;
+            server.clients_pending_write->listAddNodeHead(c);
+        }
+
+        if (c->m_flags & CLIENT_CLOSE_ASAP) {
+            c->m_flags &= ~CLIENT_PENDING_COMMAND;
+            continue;
+        }
+
+        if (c->m_flags & CLIENT_PENDING_COMMAND) {
+            c->m_flags &= ~CLIENT_PENDING_COMMAND;
+            int retval = c->processCommandAndResetClient();
+            server.current_client = NULL;
+            if (retval == C_ERR) {
+                /* If the client is no longer valid, we avoid
+                 * processing the client later. So we just go
+                 * to the next. */
+                continue;
+            }
+        }
+        c->processInputBuffer();
+    }
+
+    server.stat_io_reads_processed += processed;
+    return processed;
+}
@@ -52,6 +52,7 @@ int keyspaceEventsStringToFlags(const char *classes) {
         case 'z': flags |= NOTIFY_ZSET; break;
         case 'x': flags |= NOTIFY_EXPIRED; break;
         case 'e': flags |= NOTIFY_EVICTED; break;
+        case 't': flags |= NOTIFY_STREAM; break;
         case 'K': flags |= NOTIFY_KEYSPACE; break;
         case 'E': flags |= NOTIFY_KEYEVENT; break;
         default: return -1;
@@ -79,12 +80,36 @@ sds keyspaceEventsFlagsToString(int flags) {
         if (flags & NOTIFY_ZSET) res = sdscatlen(res,"z",1);
         if (flags & NOTIFY_EXPIRED) res = sdscatlen(res,"x",1);
         if (flags & NOTIFY_EVICTED) res = sdscatlen(res,"e",1);
+        if (flags & NOTIFY_STREAM) res = sdscatlen(res,"t",1);
     }
     if (flags & NOTIFY_KEYSPACE) res = sdscatlen(res,"K",1);
     if (flags & NOTIFY_KEYEVENT) res = sdscatlen(res,"E",1);
     return res;
 }
 
+/* Return the channel made of the header "__keyspace@<db>__:", or
+ * "__keyevent@<db>__:" if 'keyevent' is true, followed by 'suffix'. The
+ * headers of every DB are formatted once and the channel is allocated with
+ * its final size. */
+static robj *notifyChannel(int keyevent, int dbid, const char *suffix, size_t len) {
+    static sds *headers = NULL;
+    sds header, chan;
+
+    if (headers == NULL)
+        headers = (sds *)zcalloc(sizeof(sds)*server.dbnum*2);
+    header = headers[dbid*2+keyevent];
+    if (header == NULL) {
+        header = sdscatprintf(sdsempty(),"__key%s@%d__:",
+                              keyevent ? "event" : "space",dbid);
+        headers[dbid*2+keyevent] = header;
+    }
+
+    chan = sdsnewlen(NULL,sdslen(header)+len);
+    memcpy(chan,header,sdslen(header));
+    memcpy(chan+sdslen(header),suffix,len);
+    return createObject(OBJ_STRING,chan);
+}
+
 /* The API provided to the rest of the Redis core is a simple function:
  *
  * notifyKeyspaceEvent(char *event, robj *key, int dbid);
@@ -93,38 +118,35 @@ sds keyspaceEventsFlagsToString(int flags) {
  * 'key' is a Redis object representing the key name.
  * 'dbid' is the database ID where the key lives.  */
 void notifyKeyspaceEvent(int type, const char *event, robj *key, int dbid) {
-    sds chan;
     robj *chanobj, *eventobj;
-    int len = -1;
-    char buf[24];
+    size_t eventlen;
+
+    /* The modules subscribed to the keyspace events are called directly,
+     * whatever the notify-keyspace-events option is. */
+    moduleNotifyKeyspaceEvent(type, event, key, dbid);
 
     /* If notifications for this class of events are off, return ASAP. */
     if (!(server.notify_keyspace_events & type)) return;
 
-    eventobj = createStringObject(event,strlen(event));
+    /* The same if no channel or pattern can receive them: building the
+     * messages would be wasted work. */
+    if (server.pubsub_keyspace_subscriptions == 0) return;
+
+    eventlen = strlen(event);
 
     /* __keyspace@<db>__:<key> <event> notifications. */
     if (server.notify_keyspace_events & NOTIFY_KEYSPACE) {
-        chan = sdsnewlen("__keyspace@",11);
-        len = ll2string(buf,sizeof(buf),dbid);
-        chan = sdscatlen(chan, buf, len);
-        chan = sdscatlen(chan, "__:", 3);
-        chan = sdscatsds(chan, (const sds)key->ptr);
-        chanobj = createObject(OBJ_STRING, chan);
+        eventobj = createStringObject(event,eventlen);
+        chanobj = notifyChannel(0,dbid,(const char*)key->ptr,sdslen((sds)key->ptr));
         pubsubPublishMessage(chanobj, eventobj);
         decrRefCount(chanobj);
+        decrRefCount(eventobj);
     }
 
     /* __keyevente@<db>__:<event> <key> notifications. */
     if (server.notify_keyspace_events & NOTIFY_KEYEVENT) {
-        chan = sdsnewlen("__keyevent@",11);
-        if (len == -1) len = ll2string(buf,sizeof(buf),dbid);
-        chan = sdscatlen(chan, buf, len);
-        chan = sdscatlen(chan, "__:", 3);
-        chan = sdscatsds(chan, (const sds)eventobj->ptr);
-        chanobj = createObject(OBJ_STRING, chan);
+        chanobj = notifyChannel(1,dbid,event,eventlen);
         pubsubPublishMessage(chanobj, key);
         decrRefCount(chanobj);
     }
-    decrRefCount(eventobj);
 }
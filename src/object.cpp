@@ -29,6 +29,11 @@
  */
 
 #include "server.h"
+#include "cluster.h"
+#include "atomicvar.h"
+#include "memprefix.h"
+#include "allocstats.h"
+#include "lazyload.h"
 #include <math.h>
 #include <ctype.h>
 
@@ -82,7 +87,18 @@ robj *createRawStringObject(const char *ptr, size_t len) {
  * an object where the sds string is actually an unmodifiable string
  * allocated in the same chunk as the object itself. */
 robj *createEmbeddedStringObject(const char *ptr, size_t len) {
-    robj* o = (robj*)zmalloc(sizeof(robj)+sizeof(struct sdshdr8)+len+1);
+    return initEmbeddedStringObject(zmalloc(embeddedStringObjectSize(len)),ptr,len);
+}
+
+/* Bytes used by an OBJ_ENCODING_EMBSTR object of 'len' bytes. */
+size_t embeddedStringObjectSize(size_t len) {
+    return sizeof(robj)+sizeof(struct sdshdr8)+len+1;
+}
+
+/* Like createEmbeddedStringObject() but the object is created in the memory
+ * pointed by 'buf', of at least embeddedStringObjectSize(len) bytes. */
+robj *initEmbeddedStringObject(void *buf, const char *ptr, size_t len) {
+    robj* o = (robj*)buf;
     struct sdshdr8 *sh = (struct sdshdr8 *)(o+1);
 
     o->type = OBJ_STRING;
@@ -173,6 +189,14 @@ robj *dupStringObject(const robj *o) {
         d->encoding = OBJ_ENCODING_INT;
         d->ptr = o->ptr;
         return d;
+    case OBJ_ENCODING_CHUNKED:
+        return createChunkedBitmapObject(
+            chunkedBitmap::chunkedBitmapDup((const chunkedBitmap *)o->ptr));
+    case OBJ_ENCODING_COMPRESSED: {
+        const compressedString *cs = (const compressedString *)o->ptr;
+        return createCompressedStringObject(cs->codec,cs->data,cs->clen,
+                                            cs->len);
+    }
     default:
         serverPanic("Wrong encoding.");
         break;
@@ -181,6 +205,7 @@ robj *dupStringObject(const robj *o) {
 
 robj *createQuicklistObject() {
     quicklist *l = quicklistCreate();
+    quicklistSetContainer(l,server.list_node_container);
     robj *o = createObject(OBJ_LIST,l);
     o->encoding = OBJ_ENCODING_QUICKLIST;
     return o;
@@ -194,7 +219,7 @@ robj *createZiplistObject() {
 }
 
 robj *createSetObject() {
-    dict *d = dictCreate(&setDictType,NULL);
+    dict *d = sdsDictCreate(&setDictType,NULL);
     robj *o = createObject(OBJ_SET,d);
     o->encoding = OBJ_ENCODING_HT;
     return o;
@@ -207,10 +232,135 @@ robj *createIntsetObject() {
     return o;
 }
 
+robj *createRoaringSetObject(roaring *r) {
+    robj *o = createObject(OBJ_SET,r);
+    o->encoding = OBJ_ENCODING_ROARING;
+    return o;
+}
+
+/* Create a string object with the chunked encoding, see chunkedbitmap.h. */
+robj *createChunkedBitmapObject(chunkedBitmap *cb) {
+    robj *o = createObject(OBJ_STRING,cb);
+    o->encoding = OBJ_ENCODING_CHUNKED;
+    return o;
+}
+
+/* Return the plain string represented by a chunked bitmap object. */
+sds chunkedBitmapObjectToSds(const robj *o) {
+    const chunkedBitmap *cb = (const chunkedBitmap *)o->ptr;
+    sds s = sdsnewlen(NULL,cb->chunkedBitmapLen());
+
+    cb->chunkedBitmapRead(0,(unsigned char *)s,cb->chunkedBitmapLen());
+    return s;
+}
+
+/* Convert in place a chunked bitmap object into a RAW encoded string, for
+ * the commands that don't handle the chunked encoding. */
+void decodeChunkedBitmapObject(robj *o) {
+    serverAssert(o->type == OBJ_STRING && o->encoding == OBJ_ENCODING_CHUNKED);
+    sds s = chunkedBitmapObjectToSds(o);
+    chunkedBitmapFree((chunkedBitmap *)o->ptr);
+    o->ptr = s;
+    o->encoding = OBJ_ENCODING_RAW;
+}
+
+/* Convert in place a RAW string into the chunked encoding, zero padding it
+ * to 'len' bytes, if 'len' is at least bitmap-chunked-min-bytes and no more
+ * than half of the resulting chunks have some bit set. Return non zero if
+ * the object was converted. */
+int tryChunkedBitmapEncoding(robj *o, size_t len) {
+    if (o->type != OBJ_STRING || o->encoding != OBJ_ENCODING_RAW ||
+        o->refcount != 1 || server.bitmap_chunked_min_bytes == 0 ||
+        len < server.bitmap_chunked_min_bytes) return 0;
+
+    const unsigned char *s = (const unsigned char *)o->ptr;
+    size_t curlen = sdslen((sds)o->ptr);
+    size_t numchunks = (len+CHUNKED_BITMAP_CHUNK_BYTES-1)/CHUNKED_BITMAP_CHUNK_BYTES;
+    if (curlen > len ||
+        chunkedBitmap::chunkedBitmapCountChunks(s,curlen)*2 > numchunks) return 0;
+
+    chunkedBitmap *cb = chunkedBitmap::chunkedBitmapFromBuffer(s,curlen);
+    cb->chunkedBitmapGrow(len);
+    sdsfree((sds)o->ptr);
+    o->ptr = cb;
+    o->encoding = OBJ_ENCODING_CHUNKED;
+    return 1;
+}
+
+/* Create a string object with the compressed encoding, of the 'len' bytes
+ * compressed into the 'clen' bytes of 'c' with the RDB_ENC_* 'codec'. */
+robj *createCompressedStringObject(int codec, const void *c, size_t clen,
+                                   size_t len)
+{
+    compressedString *cs =
+        (compressedString *)zmalloc(sizeof(compressedString)+clen);
+    cs->len = len;
+    cs->clen = clen;
+    cs->codec = codec;
+    memcpy(cs->data,c,clen);
+    robj *o = createObject(OBJ_STRING,cs);
+    o->encoding = OBJ_ENCODING_COMPRESSED;
+    return o;
+}
+
+/* Return the plain string represented by a compressed string object. */
+sds compressedStringObjectToSds(const robj *o) {
+    const compressedString *cs = (const compressedString *)o->ptr;
+    sds s = sdsnewlen(NULL,cs->len);
+
+    if (!rdbDecompress(cs->codec,cs->data,cs->clen,s,cs->len))
+        serverPanic("Corrupted %s compressed string",
+                    rdbCompressionName(cs->codec));
+    return s;
+}
+
+/* Convert in place a compressed string object into a RAW encoded string,
+ * for the commands that don't handle the compressed encoding. */
+void decompressStringObject(robj *o) {
+    serverAssert(o->type == OBJ_STRING &&
+                 o->encoding == OBJ_ENCODING_COMPRESSED);
+    sds s = compressedStringObjectToSds(o);
+    zfree(o->ptr);
+    o->ptr = s;
+    o->encoding = OBJ_ENCODING_RAW;
+}
+
+/* Return non zero if a string of 'len' bytes compressed into 'clen' bytes
+ * is worth keeping compressed: decompressing it on every read is only
+ * paid back by saving at least a quarter of the memory. */
+int stringCompressionWorthIt(size_t len, size_t clen) {
+    return server.string_compression_min_bytes &&
+           len >= server.string_compression_min_bytes &&
+           clen <= len-len/4;
+}
+
+/* Return a new string object with the compressed encoding, with the value
+ * of the RAW or EMBSTR string 'o' compressed with the rdb-compression-codec,
+ * if 'o' is at least string-compression-min-bytes long and compresses well
+ * enough, otherwise NULL. 'o' itself is never converted, since it is
+ * usually also an argument of the command, propagated as it is. */
+robj *tryStringCompression(robj *o) {
+    if (o->type != OBJ_STRING || !sdsEncodedObject(o)) return NULL;
+
+    size_t len = sdslen((sds)o->ptr);
+    if (server.string_compression_min_bytes == 0 ||
+        len < server.string_compression_min_bytes) return NULL;
+
+    /* Whatever fits in 'outlen' is worth it, see stringCompressionWorthIt(). */
+    size_t outlen = len-len/4;
+    void *out = zmalloc(outlen);
+    size_t clen = rdbCompress(server.rdb_compression_codec,o->ptr,len,
+                              out,outlen);
+    robj *c = clen ? createCompressedStringObject(
+        server.rdb_compression_codec,out,clen,len) : NULL;
+    zfree(out);
+    return c;
+}
+
 robj *createHashObject() {
-    unsigned char *zl = ziplistNew();
+    unsigned char *zl = lpNew();
     robj *o = createObject(OBJ_HASH, zl);
-    o->encoding = OBJ_ENCODING_ZIPLIST;
+    o->encoding = OBJ_ENCODING_LISTPACK;
     return o;
 }
 
@@ -220,15 +370,35 @@ robj *createZsetObject() {
 
     zs->_dict = dictCreate(&zsetDictType,NULL);
     zs->zsl = zslCreate();
+    zs->zbt = NULL;
     o = createObject(OBJ_ZSET,zs);
     o->encoding = OBJ_ENCODING_SKIPLIST;
     return o;
 }
 
-robj *createZsetZiplistObject() {
-    unsigned char *zl = ziplistNew();
+robj *createZsetBtreeObject() {
+    zset* zs = (zset*)zmalloc(sizeof(*zs));
+    robj *o;
+
+    zs->_dict = dictCreate(&zsetDictType,NULL);
+    zs->zsl = NULL;
+    zs->zbt = zbtCreate();
+    o = createObject(OBJ_ZSET,zs);
+    o->encoding = OBJ_ENCODING_BTREE;
+    return o;
+}
+
+robj *createZsetListpackObject() {
+    unsigned char *zl = lpNew();
     robj *o = createObject(OBJ_ZSET,zl);
-    o->encoding = OBJ_ENCODING_ZIPLIST;
+    o->encoding = OBJ_ENCODING_LISTPACK;
+    return o;
+}
+
+robj *createStreamObject() {
+    stream *s = streamNew();
+    robj *o = createObject(OBJ_STREAM,s);
+    o->encoding = OBJ_ENCODING_STREAM;
     return o;
 }
 
@@ -242,6 +412,10 @@ robj *createModuleObject(moduleType *mt, void *value) {
 void freeStringObject(robj *o) {
     if (o->encoding == OBJ_ENCODING_RAW) {
         sdsfree((sds)o->ptr);
+    } else if (o->encoding == OBJ_ENCODING_CHUNKED) {
+        chunkedBitmapFree((chunkedBitmap *)o->ptr);
+    } else if (o->encoding == OBJ_ENCODING_COMPRESSED) {
+        zfree(o->ptr);
     }
 }
 
@@ -261,6 +435,9 @@ void freeSetObject(robj *o) {
     case OBJ_ENCODING_INTSET:
         zfree(o->ptr);
         break;
+    case OBJ_ENCODING_ROARING:
+        roaringFree((roaring*) o->ptr);
+        break;
     default:
         serverPanic("Unknown set encoding type");
     }
@@ -275,8 +452,14 @@ void freeZsetObject(robj *o) {
         zslFree(zs->zsl);
         zfree(zs);
         break;
-    case OBJ_ENCODING_ZIPLIST:
-        zfree(o->ptr);
+    case OBJ_ENCODING_BTREE:
+        zs = (zset *)o->ptr;
+        dictRelease(zs->_dict);
+        zbtFree(zs->zbt);
+        zfree(zs);
+        break;
+    case OBJ_ENCODING_LISTPACK:
+        lpFree((unsigned char *)o->ptr);
         break;
     default:
         serverPanic("Unknown sorted set encoding");
@@ -286,10 +469,11 @@ void freeZsetObject(robj *o) {
 void freeHashObject(robj *o) {
     switch (o->encoding) {
     case OBJ_ENCODING_HT:
+        hashTypeFreeFieldExpires(o);
         dictRelease((dict*) o->ptr);
         break;
-    case OBJ_ENCODING_ZIPLIST:
-        zfree(o->ptr);
+    case OBJ_ENCODING_LISTPACK:
+        lpFree((unsigned char *)o->ptr);
         break;
     default:
         serverPanic("Unknown hash encoding type");
@@ -297,27 +481,54 @@ void freeHashObject(robj *o) {
     }
 }
 
+void freeStreamObject(robj *o) {
+    freeStream((stream *)o->ptr);
+}
+
 void freeModuleObject(robj *o) {
     moduleValue* mv = (moduleValue*)o->ptr;
     mv->m_type->m_free(mv->m_value);
     zfree(mv);
 }
 
+/* While the I/O threads execute read only commands, or the modules threads
+ * read the dataset, the objects of the dataset can be referenced by several
+ * threads at the same time, so the reference counts are updated atomically,
+ * see slave-parallel-reads. */
 void incrRefCount(robj *o) {
-    if (o->refcount != OBJ_SHARED_REFCOUNT) o->refcount++;
+    if (o->refcount == OBJ_SHARED_REFCOUNT) return;
+    if (datasetReadShared()) atomicIncr(o->refcount,1);
+    else o->refcount++;
+}
+
+/* Free the value of the object 'o', but not the object itself. */
+void freeObjectValue(robj *o) {
+    if (o->encoding == OBJ_ENCODING_LAZY) {
+        lazyLoadFreeObject(o);
+        return;
+    }
+    switch(o->type) {
+    case OBJ_STRING: freeStringObject(o); break;
+    case OBJ_LIST: freeListObject(o); break;
+    case OBJ_SET: freeSetObject(o); break;
+    case OBJ_ZSET: freeZsetObject(o); break;
+    case OBJ_HASH: freeHashObject(o); break;
+    case OBJ_MODULE: freeModuleObject(o); break;
+    case OBJ_STREAM: freeStreamObject(o); break;
+    default: serverPanic("Unknown object type"); break;
+    }
 }
 
 void decrRefCount(robj *o) {
+    /* The thread releasing the last reference frees the object. */
+    if (datasetReadShared() && o->refcount != OBJ_SHARED_REFCOUNT) {
+        int left = atomicDecr(o->refcount,1);
+        if (left < 0) serverPanic("decrRefCount against refcount <= 0");
+        if (left > 0) return;
+        o->refcount = 1;
+    }
     if (o->refcount == 1) {
-        switch(o->type) {
-        case OBJ_STRING: freeStringObject(o); break;
-        case OBJ_LIST: freeListObject(o); break;
-        case OBJ_SET: freeSetObject(o); break;
-        case OBJ_ZSET: freeZsetObject(o); break;
-        case OBJ_HASH: freeHashObject(o); break;
-        case OBJ_MODULE: freeModuleObject(o); break;
-        default: serverPanic("Unknown object type"); break;
-        }
+        freeObjectValue(o);
         zfree(o);
     } else {
         if (o->refcount <= 0) serverPanic("decrRefCount against refcount <= 0");
@@ -465,6 +676,10 @@ robj *getDecodedObject(robj *o) {
         ll2string(buf,32,(long)o->ptr);
         dec = createStringObject(buf,strlen(buf));
         return dec;
+    } else if (o->type == OBJ_STRING && o->encoding == OBJ_ENCODING_CHUNKED) {
+        return createObject(OBJ_STRING,chunkedBitmapObjectToSds(o));
+    } else if (o->type == OBJ_STRING && o->encoding == OBJ_ENCODING_COMPRESSED) {
+        return createObject(OBJ_STRING,compressedStringObjectToSds(o));
     } else {
         serverPanic("Unknown encoding type");
     }
@@ -542,6 +757,10 @@ size_t stringObjectLen(robj *o) {
     serverAssertWithInfo(NULL,o,o->type == OBJ_STRING);
     if (sdsEncodedObject(o)) {
         return sdslen((sds)o->ptr);
+    } else if (o->encoding == OBJ_ENCODING_CHUNKED) {
+        return ((chunkedBitmap *)o->ptr)->chunkedBitmapLen();
+    } else if (o->encoding == OBJ_ENCODING_COMPRESSED) {
+        return ((compressedString *)o->ptr)->len;
     } else {
         return sdigits10((long)o->ptr);
     }
@@ -687,26 +906,116 @@ char *strEncoding(int encoding) {
     case OBJ_ENCODING_HT: return "hashtable";
     case OBJ_ENCODING_QUICKLIST: return "quicklist";
     case OBJ_ENCODING_ZIPLIST: return "ziplist";
+    case OBJ_ENCODING_LISTPACK: return "listpack";
     case OBJ_ENCODING_INTSET: return "intset";
     case OBJ_ENCODING_SKIPLIST: return "skiplist";
+    case OBJ_ENCODING_BTREE: return "btree";
+    case OBJ_ENCODING_ROARING: return "roaring";
+    case OBJ_ENCODING_CHUNKED: return "chunked";
+    case OBJ_ENCODING_COMPRESSED: return "compressed";
+    case OBJ_ENCODING_STREAM: return "stream";
+    case OBJ_ENCODING_LAZY: return "lazy";
     case OBJ_ENCODING_EMBSTR: return "embstr";
     default: return "unknown";
     }
 }
 
+/* ============================ Adaptive encoding ============================ */
+
+/* Return the max number of entries of the compact encoding (listpack or
+ * intset) of 'o', given the configured one. Every insert in a compact
+ * encoding is O(N), so keys whose LFU counter reaches
+ * adaptive-encoding-hot-counter switch to the hash table earlier. */
+size_t objectCompactMaxEntries(robj *o, size_t max) {
+    if (server.adaptive_encoding_hot_counter == 0 ||
+        !(server.maxmemory_policy & MAXMEMORY_FLAG_LFU)) return max;
+    if (LFUDecrAndReturn(o) < (unsigned long)server.adaptive_encoding_hot_counter)
+        return max;
+    return max/ADAPTIVE_ENCODING_HOT_DIVISOR;
+}
+
+/* Seconds elapsed since the last access of 'o', with the resolution of the
+ * access time kept by the current maxmemory-policy. */
+static unsigned long long objectIdleSeconds(robj *o) {
+    if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU)
+        return (unsigned long long)LFUTimeElapsed(o->lru >> 8)*60;
+    return estimateObjectIdleTime(o)/1000;
+}
+
+/* dictScan() callback of adaptiveEncodingCron(): convert a cold collection
+ * back to its compact encoding when it fits. */
+static void adaptiveEncodingScanCallback(void *privdata, const dictEntry *de) {
+    long *scanned = (long *)privdata;
+    robj *o = (robj *)de->dictGetVal();
+
+    (*scanned)++;
+    /* Shared values, and the ones read in background, are left as they
+     * are. */
+    if (o->refcount != 1) return;
+    switch (o->type) {
+    case OBJ_HASH:
+        if (o->encoding != OBJ_ENCODING_HT) return;
+        break;
+    case OBJ_ZSET:
+        if (o->encoding != OBJ_ENCODING_SKIPLIST) return;
+        break;
+    case OBJ_SET:
+        if (o->encoding != OBJ_ENCODING_ROARING) return;
+        break;
+    default:
+        return;
+    }
+    if (objectIdleSeconds(o) < (unsigned long long)server.adaptive_encoding_cold_seconds)
+        return;
+
+    if (o->type == OBJ_HASH) {
+        hashTypeCompactIfNeeded(o);
+    } else if (o->type == OBJ_ZSET) {
+        zsetCompactIfNeeded(o);
+    } else if (((roaring *)o->ptr)->roaringLen() <= server.set_max_intset_entries) {
+        setTypeConvert(o,OBJ_ENCODING_INTSET);
+    }
+}
+
+/* Called by serverCron() when adaptive-encoding-cold-seconds is set: walk
+ * the keyspace ADAPTIVE_ENCODING_KEYS_PER_CALL keys at a time, converting
+ * back to a listpack or an intset the hashes, sorted sets and sets that
+ * shrank within the *-max-*-entries limits, or that left their compact
+ * encoding because they were hot, once nobody accessed them for that long. */
+void adaptiveEncodingCron(void) {
+    long budget = ADAPTIVE_ENCODING_KEYS_PER_CALL;
+
+    while (budget > 0) {
+        redisDb *db = server.db+server.adaptive_encoding_db;
+        long scanned = 0;
+
+        if (db->m_dict->dictSize()) {
+            server.adaptive_encoding_cursor =
+                db->m_dict->dictScan(server.adaptive_encoding_cursor,
+                                     adaptiveEncodingScanCallback,NULL,&scanned);
+        } else {
+            server.adaptive_encoding_cursor = 0;
+        }
+        /* Empty buckets and DBs cost something too. */
+        budget -= scanned ? scanned : 1;
+        if (server.adaptive_encoding_cursor != 0) continue;
+        server.adaptive_encoding_db = (server.adaptive_encoding_db+1) % server.dbnum;
+    }
+}
+
 /* =========================== Memory introspection ========================== */
 
 /* Returns the size in bytes consumed by the key's value in RAM.
  * Note that the returned value is just an approximation, especially in the
  * case of aggregated data types where only "sample_size" elements
  * are checked and averaged to estimate the total size. */
-#define OBJ_COMPUTE_SIZE_DEF_SAMPLES 5 /* Default sample size. */
 size_t objectComputeSize(robj *o, size_t sample_size) {
     sds ele, ele2;
     dict *d;
     struct dictEntry *de;
     size_t asize = 0, elesize = 0, samples = 0;
 
+    if (o->encoding == OBJ_ENCODING_LAZY) return sizeof(*o);
     if (o->type == OBJ_STRING) {
         if(o->encoding == OBJ_ENCODING_INT) {
             asize = sizeof(*o);
@@ -714,6 +1023,11 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
             asize = sdsAllocSize((sds)o->ptr)+sizeof(*o);
         } else if(o->encoding == OBJ_ENCODING_EMBSTR) {
             asize = sdslen((sds)o->ptr)+2+sizeof(*o);
+        } else if(o->encoding == OBJ_ENCODING_CHUNKED) {
+            asize = sizeof(*o)+sizeof(chunkedBitmap)+
+                    ((chunkedBitmap *)o->ptr)->allocSize();
+        } else if(o->encoding == OBJ_ENCODING_COMPRESSED) {
+            asize = sizeof(*o)+zmalloc_size(o->ptr);
         } else {
             serverPanic("Unknown string encoding");
         }
@@ -723,7 +1037,7 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
             quicklistNode *node = ql->m_head_ql_node;
             asize = sizeof(*o)+sizeof(quicklist);
             do {
-                elesize += sizeof(quicklistNode)+ziplistBlobLen((unsigned char *)node->m_ql_LZF);
+                elesize += sizeof(quicklistNode)+node->m_zip_list_size;
                 samples++;
             } while ((node = node->m_next_ql_node) && samples < sample_size);
             asize += (double)elesize/samples*listTypeLength(o);
@@ -746,12 +1060,14 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
         } else if (o->encoding == OBJ_ENCODING_INTSET) {
             intset *is = (intset *)o->ptr;
             asize = sizeof(*o)+is->intsetBlobLen();
+        } else if (o->encoding == OBJ_ENCODING_ROARING) {
+            asize = sizeof(*o)+((roaring *)o->ptr)->allocSize();
         } else {
             serverPanic("Unknown set encoding");
         }
     } else if (o->type == OBJ_ZSET) {
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            asize = sizeof(*o)+(ziplistBlobLen((unsigned char *)o->ptr));
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            asize = sizeof(*o)+(lpBytes((unsigned char *)o->ptr));
         } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
             d = ((zset*)o->ptr)->_dict;
             zskiplist *zsl = ((zset*)o->ptr)->zsl;
@@ -764,20 +1080,37 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
                 znode = znode->level[0].forward;
             }
             if (samples) asize += (double)elesize/samples*d->dictSize();
+        } else if (o->encoding == OBJ_ENCODING_BTREE) {
+            zset *zs = (zset*)o->ptr;
+            zbtCursor c;
+            int more = zs->zbt->zbtFirst(&c);
+            d = zs->_dict;
+            asize = sizeof(*o)+sizeof(zset)+sizeof(zbtree)+zs->zbt->allocSize()+
+                    (sizeof(struct dictEntry*)*d->dictSlots());
+            while(more && samples < sample_size) {
+                elesize += sdsAllocSize(zbtCursorEle(&c));
+                elesize += sizeof(struct dictEntry);
+                samples++;
+                more = zbtNext(&c);
+            }
+            if (samples) asize += (double)elesize/samples*d->dictSize();
         } else {
             serverPanic("Unknown sorted set encoding");
         }
     } else if (o->type == OBJ_HASH) {
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            asize = sizeof(*o)+(ziplistBlobLen((unsigned char *)o->ptr));
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            asize = sizeof(*o)+(lpBytes((unsigned char *)o->ptr));
         } else if (o->encoding == OBJ_ENCODING_HT) {
             d = (dict *)o->ptr;
             dictIterator di(d);
             asize = sizeof(*o)+sizeof(dict)+(sizeof(struct dictEntry*)*d->dictSlots());
             while((de = di.dictNext()) != NULL && samples < sample_size) {
                 ele = (sds)de->dictGetKey();
-                ele2 = (sds)de->dictGetVal();
-                elesize += sdsAllocSize(ele) + sdsAllocSize(ele2);
+                elesize += sdsAllocSize(ele);
+                if (!hashDictValIsInt(de)) {
+                    ele2 = (sds)de->dictGetVal();
+                    elesize += sdsAllocSize(ele2);
+                }
                 elesize += sizeof(struct dictEntry);
                 samples++;
             }
@@ -786,6 +1119,22 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
         } else {
             serverPanic("Unknown hash encoding");
         }
+    } else if (o->type == OBJ_STREAM) {
+        stream *s = (stream *)o->ptr;
+        raxIterator ri;
+        asize = sizeof(*o)+sizeof(*s)+sizeof(rax);
+        asize += s->rax->numnodes*sizeof(raxNode);
+
+        /* Sample the first listpacks, and use their average size for all
+         * the nodes of the radix tree. */
+        raxStart(&ri,s->rax);
+        raxSeek(&ri,"^",NULL,0);
+        while(samples < sample_size && raxNext(&ri)) {
+            elesize += lpBytes((unsigned char *)ri.data);
+            samples++;
+        }
+        raxStop(&ri);
+        if (samples) asize += (double)elesize/samples*s->rax->numele;
     } else if (o->type == OBJ_MODULE) {
         moduleValue* mv = (moduleValue*)o->ptr;
         moduleType *mt = mv->m_type;
@@ -836,28 +1185,18 @@ struct redisMemOverhead *getMemoryOverheadData() {
         listIter li(server.slaves);
         while((ln = li.listNext())) {
             client *c = (client *)ln->listNodeValue();
-            mem += c->getClientOutputBufferMemoryUsage();
+            mem += c->getClientOwnOutputBufferMemoryUsage();
             mem += sdsAllocSize(c->m_query_buf);
             mem += sizeof(client);
         }
+        mem += server.repl_buffer->replBufferMemory()+
+               server.repl_compress_buffer->replBufferMemory();
     }
     mh->clients_slaves = mem;
     mem_total+=mem;
 
-    mem = 0;
-    if (server.clients->listLength()) {
-        listNode *ln;
-
-        listIter li(server.clients);
-        while((ln = li.listNext())) {
-            client *c = (client *)ln->listNodeValue();
-            if (c->m_flags & CLIENT_SLAVE)
-                continue;
-            mem += c->getClientOutputBufferMemoryUsage();
-            mem += sdsAllocSize(c->m_query_buf);
-            mem += sizeof(client);
-        }
-    }
+    /* Kept up to date by clientsCron(), not to walk all the clients. */
+    mem = server.stat_clients_normal_memory;
     mh->clients_normal = mem;
     mem_total+=mem;
 
@@ -878,14 +1217,24 @@ struct redisMemOverhead *getMemoryOverheadData() {
         mh->db = (redisMemOverhead::redisMemOverhead_db*)zrealloc(mh->db,sizeof(mh->db[0])*(mh->num_dbs+1));
         mh->db[mh->num_dbs].dbid = j;
 
-        mem = db->m_dict->dictSize() * sizeof(dictEntry) +
-              db->m_dict->dictSlots() * sizeof(dictEntry*) +
+        mem = db->m_dict->dictSize() * db->m_dict->dictEntrySize() +
+              db->m_dict->dictSlots() * db->m_dict->dictSlotSize() +
               db->m_dict->dictSize() * sizeof(robj);
+        if (db->m_slots_to_keys) {
+            /* The per slot dictionaries of the keys in cluster mode. */
+            mem += sizeof(dict*)*CLUSTER_SLOTS;
+            for (int k = 0; k < CLUSTER_SLOTS; k++) {
+                dict *d = db->m_slots_to_keys[k];
+                if (d == NULL) continue;
+                mem += sizeof(dict) + d->dictSize() * d->dictEntrySize() +
+                       d->dictSlots() * d->dictSlotSize();
+            }
+        }
         mh->db[mh->num_dbs].overhead_ht_main = mem;
         mem_total+=mem;
 
-        mem = db->m_expires->dictSize() * sizeof(dictEntry) +
-              db->m_expires->dictSlots() * sizeof(dictEntry*);
+        mem = db->m_expires->dictSize() * db->m_expires->dictEntrySize() +
+              db->m_expires->dictSlots() * db->m_expires->dictSlotSize();
         mh->db[mh->num_dbs].overhead_ht_expires = mem;
         mem_total+=mem;
 
@@ -1060,6 +1409,187 @@ void objectCommand(client *c) {
     }
 }
 
+/* Statistics a thread collects about the keys it scans. The histogram counts
+ * the keys by memory usage, the bucket 'j' counting the keys using less than
+ * 2^j bytes, but not less than 2^(j-1). */
+#define KEYSPACE_STATS_TYPES (OBJ_STREAM+1)
+#define KEYSPACE_STATS_HISTOGRAM_LEN 48
+
+struct keyspaceStats {
+    size_t samples;
+    size_t entry_size;                  /* Memory used by the dict entry. */
+    unsigned long long keys[KEYSPACE_STATS_TYPES];
+    unsigned long long elements[KEYSPACE_STATS_TYPES];
+    unsigned long long memory[KEYSPACE_STATS_TYPES];
+    sds biggest[KEYSPACE_STATS_TYPES];  /* Key with the most elements. */
+    unsigned long long biggest_elements[KEYSPACE_STATS_TYPES];
+    unsigned long long histogram[KEYSPACE_STATS_HISTOGRAM_LEN];
+};
+
+static const char *keyspaceStatsTypeName(int type) {
+    switch(type) {
+    case OBJ_STRING: return "string";
+    case OBJ_LIST: return "list";
+    case OBJ_SET: return "set";
+    case OBJ_ZSET: return "zset";
+    case OBJ_HASH: return "hash";
+    case OBJ_MODULE: return "module";
+    case OBJ_STREAM: return "stream";
+    default: return "unknown";
+    }
+}
+
+/* Number of elements of a key, as redis-cli --bigkeys reports it: the length
+ * of strings and the cardinality of aggregate types. */
+static unsigned long long keyspaceStatsElements(robj *o) {
+    switch(o->type) {
+    case OBJ_STRING: return stringObjectLen(o);
+    case OBJ_LIST: return listTypeLength(o);
+    case OBJ_SET: return setTypeSize(o);
+    case OBJ_ZSET: return zsetLength(o);
+    case OBJ_HASH: return hashTypeLength(o);
+    case OBJ_STREAM: return ((stream *)o->ptr)->length;
+    default: return 0;
+    }
+}
+
+static void keyspaceStatsCallback(void *privdata, sds key, robj *val) {
+    keyspaceStats *ks = (keyspaceStats *)privdata;
+    int type = val->type;
+    unsigned long long elements;
+    size_t usage;
+    int bucket = 0;
+
+    if (type >= KEYSPACE_STATS_TYPES) return;
+    if (val->encoding == OBJ_ENCODING_LAZY) lazyLoadValue(val);
+    elements = keyspaceStatsElements(val);
+
+    /* The memory usage callback of module types may not be thread safe. */
+    usage = sdsAllocSize(key)+ks->entry_size;
+    if (type != OBJ_MODULE) usage += objectComputeSize(val,ks->samples);
+
+    ks->keys[type]++;
+    ks->elements[type] += elements;
+    ks->memory[type] += usage;
+    if (ks->biggest[type] == NULL || elements > ks->biggest_elements[type]) {
+        sdsfree(ks->biggest[type]);
+        ks->biggest[type] = sdsdup(key);
+        ks->biggest_elements[type] = elements;
+    }
+    while (bucket < KEYSPACE_STATS_HISTOGRAM_LEN-1 && (usage >> bucket))
+        bucket++;
+    ks->histogram[bucket]++;
+}
+
+/* MEMORY KEYSPACE [THREADS <count>] [SAMPLES <count>]
+ *
+ * Walk the current database with a few threads and report, for every type,
+ * the number of keys, of elements and the memory used, and the key with the
+ * most elements, plus an histogram of the memory used by the keys. The
+ * server is blocked while the keys are scanned, just faster than it would be
+ * with a single thread. */
+static void memoryKeyspaceCommand(client *c) {
+    long long threads = KEYSPACE_WALK_DEFAULT_THREADS;
+    long long samples = OBJ_COMPUTE_SIZE_DEF_SAMPLES;
+    keyspaceStats *stats;
+    void *privdata[KEYSPACE_WALK_MAX_THREADS];
+    long long start = ustime();
+    int j, t, used, types = 0, hbuckets = 0;
+
+    for (j = 2; j < c->m_argc; j++) {
+        if (!strcasecmp((const char*)c->m_argv[j]->ptr,"threads") &&
+            j+1 < c->m_argc)
+        {
+            if (getLongLongFromObjectOrReply(c,c->m_argv[j+1],&threads,NULL)
+                 == C_ERR) return;
+            if (threads < 1 || threads > KEYSPACE_WALK_MAX_THREADS) {
+                c->addReplyErrorFormat("THREADS must be between 1 and %d",
+                    KEYSPACE_WALK_MAX_THREADS);
+                return;
+            }
+            j++;
+        } else if (!strcasecmp((const char*)c->m_argv[j]->ptr,"samples") &&
+                   j+1 < c->m_argc)
+        {
+            if (getLongLongFromObjectOrReply(c,c->m_argv[j+1],&samples,NULL)
+                 == C_ERR) return;
+            if (samples < 0) {
+                c->addReply(shared.syntaxerr);
+                return;
+            }
+            if (samples == 0) samples = LLONG_MAX;
+            j++;
+        } else {
+            c->addReply(shared.syntaxerr);
+            return;
+        }
+    }
+
+    stats = (keyspaceStats *)zcalloc(sizeof(keyspaceStats)*threads);
+    for (j = 0; j < threads; j++) {
+        stats[j].samples = samples;
+        stats[j].entry_size = c->m_cur_selected_db->m_dict->dictEntrySize();
+        privdata[j] = &stats[j];
+    }
+    used = keyspaceWalk(c->m_cur_selected_db,threads,keyspaceStatsCallback,
+                        privdata);
+
+    /* Merge the statistics of all the threads into the first. */
+    for (j = 1; j < threads; j++) {
+        for (t = 0; t < KEYSPACE_STATS_TYPES; t++) {
+            stats[0].keys[t] += stats[j].keys[t];
+            stats[0].elements[t] += stats[j].elements[t];
+            stats[0].memory[t] += stats[j].memory[t];
+            if (stats[j].biggest[t] &&
+                (stats[0].biggest[t] == NULL ||
+                 stats[j].biggest_elements[t] > stats[0].biggest_elements[t]))
+            {
+                sdsfree(stats[0].biggest[t]);
+                stats[0].biggest[t] = stats[j].biggest[t];
+                stats[0].biggest_elements[t] = stats[j].biggest_elements[t];
+                stats[j].biggest[t] = NULL;
+            }
+            sdsfree(stats[j].biggest[t]);
+        }
+        for (t = 0; t < KEYSPACE_STATS_HISTOGRAM_LEN; t++)
+            stats[0].histogram[t] += stats[j].histogram[t];
+    }
+    for (t = 0; t < KEYSPACE_STATS_TYPES; t++)
+        if (stats[0].keys[t]) types++;
+    for (t = 0; t < KEYSPACE_STATS_HISTOGRAM_LEN; t++)
+        if (stats[0].histogram[t]) hbuckets++;
+
+    c->addReplyMultiBulkLen((3+types)*2);
+    c->addReplyBulkCString("threads");
+    c->addReplyLongLong(used);
+    c->addReplyBulkCString("time.us");
+    c->addReplyLongLong(ustime()-start);
+    for (t = 0; t < KEYSPACE_STATS_TYPES; t++) {
+        if (stats[0].keys[t] == 0) continue;
+        c->addReplyBulkCString(keyspaceStatsTypeName(t));
+        c->addReplyMultiBulkLen(10);
+        c->addReplyBulkCString("keys");
+        c->addReplyLongLong(stats[0].keys[t]);
+        c->addReplyBulkCString("elements");
+        c->addReplyLongLong(stats[0].elements[t]);
+        c->addReplyBulkCString("bytes");
+        c->addReplyLongLong(stats[0].memory[t]);
+        c->addReplyBulkCString("biggest.key");
+        c->addReplyBulkCBuffer(stats[0].biggest[t],sdslen(stats[0].biggest[t]));
+        c->addReplyBulkCString("biggest.elements");
+        c->addReplyLongLong(stats[0].biggest_elements[t]);
+        sdsfree(stats[0].biggest[t]);
+    }
+    c->addReplyBulkCString("histogram.bytes");
+    c->addReplyMultiBulkLen(hbuckets*2);
+    for (t = 0; t < KEYSPACE_STATS_HISTOGRAM_LEN; t++) {
+        if (stats[0].histogram[t] == 0) continue;
+        c->addReplyLongLong(1LL << t);
+        c->addReplyLongLong(stats[0].histogram[t]);
+    }
+    zfree(stats);
+}
+
 /* The memory command will eventually be a complete interface for the
  * memory introspection capabilities of Redis.
  *
@@ -1090,7 +1620,7 @@ void memoryCommand(client *c) {
                 == NULL) return;
         size_t usage = objectComputeSize(o,samples);
         usage += sdsAllocSize((sds)c->m_argv[2]->ptr);
-        usage += sizeof(dictEntry);
+        usage += c->m_cur_selected_db->m_dict->dictEntrySize();
         c->addReplyLongLong(usage);
     } else if (!strcasecmp((const char*)c->m_argv[1]->ptr,"stats") && c->m_argc == 2) {
         struct redisMemOverhead *mh = getMemoryOverheadData();
@@ -1153,6 +1683,12 @@ void memoryCommand(client *c) {
         c->addReplyDouble(mh->fragmentation);
 
         freeMemoryOverheadData(mh);
+    } else if (!strcasecmp((const char*)c->m_argv[1]->ptr,"keyspace")) {
+        memoryKeyspaceCommand(c);
+    } else if (!strcasecmp((const char*)c->m_argv[1]->ptr,"prefixes")) {
+        memoryPrefixesCommand(c);
+    } else if (!strcasecmp((const char*)c->m_argv[1]->ptr,"allocstats")) {
+        memoryAllocStatsCommand(c);
     } else if (!strcasecmp((const char*)c->m_argv[1]->ptr,"malloc-stats") && c->m_argc == 2) {
 #if defined(USE_JEMALLOC)
         sds info = sdsempty();
@@ -1182,7 +1718,7 @@ void memoryCommand(client *c) {
         /* Nothing to do for other allocators. */
 #endif
     } else if (!strcasecmp((const char*)c->m_argv[1]->ptr,"help") && c->m_argc == 2) {
-        c->addReplyMultiBulkLen(5);
+        c->addReplyMultiBulkLen(8);
         c->addReplyBulkCString(
 "MEMORY DOCTOR                        - Outputs memory problems report");
         c->addReplyBulkCString(
@@ -1190,6 +1726,12 @@ void memoryCommand(client *c) {
         c->addReplyBulkCString(
 "MEMORY STATS                         - Show memory usage details");
         c->addReplyBulkCString(
+"MEMORY KEYSPACE [THREADS <count>]    - Memory and size stats of all the keys");
+        c->addReplyBulkCString(
+"MEMORY PREFIXES [COUNT <count>]      - Memory used by the top key prefixes");
+        c->addReplyBulkCString(
+"MEMORY ALLOCSTATS [COUNT <c>|RESET]  - Allocations by command and call site");
+        c->addReplyBulkCString(
 "MEMORY PURGE                         - Ask the allocator to release memory");
         c->addReplyBulkCString(
 "MEMORY MALLOC-STATS                  - Show allocator internal stats");
@@ -0,0 +1,222 @@
+/* CPU and NUMA placement of the threads.
+ *
+ * On hosts running several instances, and with more than one socket, the
+ * scheduler moves the threads of an instance across the sockets, and the
+ * memory ends up on whatever node the thread that touched it first was
+ * running on: most of the accesses to the dataset then cross the socket
+ * interconnect. The server-cpulist, bio-cpulist and io-threads-cpulist
+ * options pin the main thread, the background jobs threads (bio.cpp) and
+ * the I/O threads to a list of CPUs, in the "0,2,4-7,16-31:2" format (the
+ * optional ":n" is the step of a range). The threads not listed inherit the
+ * CPUs of the main thread.
+ *
+ * With numa-bind 'preferred' or 'bind' the memory of the process is
+ * allocated from the NUMA nodes of the CPUs of the main thread, using
+ * set_mempolicy(2): 'preferred' allocates from the first of them when
+ * possible and falls back to the other nodes, 'bind' only allocates from
+ * them. The policy is set at startup before the threads are created, so
+ * that all of them inherit it.
+ *
+ * Both are Linux only: elsewhere the options are accepted and ignored.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "placement.h"
+
+#ifdef __linux__
+#include <sched.h>
+#include <dirent.h>
+#include <ctype.h>
+#include <sys/syscall.h>
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#define MPOL_BIND 2
+#endif
+
+#define PLACEMENT_MAX_NODES 64
+
+static unsigned long numa_nodemask = 0;     /* Nodes the memory is bound to. */
+
+/* Parse a list of CPUs in the "0,2,4-7,16-31:2" format into 'set'. Returns
+ * C_ERR on syntax errors, CPUs out of range, or an empty list. */
+static int parseCpuList(const char *cpulist, cpu_set_t *set) {
+    const char *p = cpulist;
+    char *end;
+
+    CPU_ZERO(set);
+    while (*p) {
+        long first, last, step = 1;
+
+        first = last = strtol(p,&end,10);
+        if (end == p || first < 0) return C_ERR;
+        p = end;
+        if (*p == '-') {
+            last = strtol(++p,&end,10);
+            if (end == p || last < first) return C_ERR;
+            p = end;
+            if (*p == ':') {
+                step = strtol(++p,&end,10);
+                if (end == p || step < 1) return C_ERR;
+                p = end;
+            }
+        }
+        if (last >= CPU_SETSIZE) return C_ERR;
+        for (long cpu = first; cpu <= last; cpu += step) CPU_SET(cpu,set);
+        if (*p == ',' && p[1] != '\0') p++;
+        else if (*p) return C_ERR;
+    }
+    return CPU_COUNT(set) ? C_OK : C_ERR;
+}
+
+int cpuListIsValid(const char *cpulist) {
+    cpu_set_t set;
+    return parseCpuList(cpulist,&set) == C_OK;
+}
+
+/* Pin the calling thread to the CPUs of 'cpulist', if not NULL. */
+void setcpuaffinity(const char *cpulist) {
+    cpu_set_t set;
+
+    if (cpulist == NULL) return;
+    if (parseCpuList(cpulist,&set) == C_ERR ||
+        sched_setaffinity(0,sizeof(set),&set) == -1)
+    {
+        serverLog(LL_WARNING,"Unable to set the CPU affinity to '%s': %s",
+            cpulist, strerror(errno));
+    }
+}
+
+/* Return the NUMA node of 'cpu', looking for the nodeN link in its sysfs
+ * directory, or -1 if unknown (or not a NUMA system). */
+static int cpuNumaNode(int cpu) {
+    char path[64];
+    struct dirent *de;
+    DIR *dir;
+    int node = -1;
+
+    snprintf(path,sizeof(path),"/sys/devices/system/cpu/cpu%d",cpu);
+    if ((dir = opendir(path)) == NULL) return -1;
+    while ((de = readdir(dir)) != NULL) {
+        if (!strncmp(de->d_name,"node",4) && isdigit(de->d_name[4])) {
+            node = atoi(de->d_name+4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+/* Called at startup, before the threads are created: pin the main thread
+ * and bind the memory to the NUMA nodes of its CPUs. */
+void placementInit() {
+    unsigned long mask = 0;
+    cpu_set_t set;
+
+    setcpuaffinity(server.server_cpulist);
+    if (server.numa_bind == NUMA_BIND_NO) return;
+    if (sched_getaffinity(0,sizeof(set),&set) == -1) return;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu,&set)) continue;
+        int node = cpuNumaNode(cpu);
+        if (node >= 0 && node < PLACEMENT_MAX_NODES) mask |= 1UL<<node;
+    }
+    if (mask == 0) {
+        serverLog(LL_WARNING,"numa-bind: unable to find the NUMA nodes of the server CPUs.");
+        return;
+    }
+    /* The preferred policy takes a single node. */
+    if (server.numa_bind == NUMA_BIND_PREFERRED) mask &= -mask;
+    if (syscall(SYS_set_mempolicy,
+                server.numa_bind == NUMA_BIND_STRICT ? MPOL_BIND : MPOL_PREFERRED,
+                &mask, PLACEMENT_MAX_NODES+1) == -1)
+    {
+        serverLog(LL_WARNING,"numa-bind: set_mempolicy() failed: %s",
+            strerror(errno));
+        return;
+    }
+    numa_nodemask = mask;
+}
+
+/* Append the placement fields of INFO server: the configured CPU lists, the
+ * NUMA nodes the memory is bound to, and where the main thread runs. */
+sds genPlacementInfoString(sds info) {
+    static const char *bind_names[] = {"no","preferred","bind"};
+    unsigned int cpu = 0, node = 0;
+    sds nodes = sdsempty();
+
+    for (int j = 0; j < PLACEMENT_MAX_NODES; j++) {
+        if (numa_nodemask & (1UL<<j))
+            nodes = sdscatprintf(nodes,"%s%d",sdslen(nodes) ? "," : "",j);
+    }
+    if (syscall(SYS_getcpu,&cpu,&node,NULL) == -1) cpu = node = 0;
+    info = sdscatprintf(info,
+        "server_cpulist:%s\r\n"
+        "bio_cpulist:%s\r\n"
+        "io_threads_cpulist:%s\r\n"
+        "numa_bind:%s\r\n"
+        "numa_nodes_bound:%s\r\n"
+        "main_thread_cpu:%u\r\n"
+        "main_thread_numa_node:%u\r\n",
+        server.server_cpulist ? server.server_cpulist : "",
+        server.bio_cpulist ? server.bio_cpulist : "",
+        server.io_threads_cpulist ? server.io_threads_cpulist : "",
+        bind_names[server.numa_bind],
+        nodes, cpu, node);
+    sdsfree(nodes);
+    return info;
+}
+
+#else
+
+int cpuListIsValid(const char *cpulist) {
+    UNUSED(cpulist);
+    return 1;
+}
+
+void setcpuaffinity(const char *cpulist) {
+    UNUSED(cpulist);
+}
+
+void placementInit() {
+    if (server.server_cpulist || server.bio_cpulist ||
+        server.io_threads_cpulist || server.numa_bind != NUMA_BIND_NO)
+    {
+        serverLog(LL_WARNING,"CPU affinity and NUMA binding are only supported on Linux, ignoring them.");
+    }
+}
+
+sds genPlacementInfoString(sds info) {
+    return info;
+}
+
+#endif
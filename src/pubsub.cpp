@@ -48,29 +48,108 @@ int listMatchPubsubPattern(void *a, void *b) {
            (equalStringObjects(pa->pattern,pb->pattern));
 }
 
+/* Return the length of the literal prefix of a pattern, that is, the part
+ * before the first special char. */
+static size_t pubsubPatternPrefixLen(sds pattern) {
+    size_t len = sdslen(pattern), j;
+
+    for (j = 0; j < len; j++) {
+        char c = pattern[j];
+        if (c == '*' || c == '?' || c == '[' || c == '\\') break;
+    }
+    return j;
+}
+
+/* Return true if a channel named 'p' may be the one of a keyspace
+ * notification, "__keyspace@..." or "__keyevent@...". When 'prefix' is true
+ * 'p' is the literal prefix of a pattern, that may match such a channel
+ * if it is itself a prefix of it. */
+static int pubsubIsKeyspaceChannel(const char *p, size_t len, int prefix) {
+    const char *headers[2] = {"__keyspace@","__keyevent@"};
+
+    for (int j = 0; j < 2; j++) {
+        if (len >= 11) {
+            if (memcmp(p,headers[j],11) == 0) return 1;
+        } else if (prefix && memcmp(p,headers[j],len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Add the pattern to server.pubsub_patterns_index, so that PUBLISH only
+ * inspects the patterns whose literal prefix is a prefix of the channel. */
+static void pubsubIndexPattern(pubsubPattern *pat) {
+    sds p = (sds)pat->pattern->ptr;
+    size_t plen = pubsubPatternPrefixLen(p);
+    list *l = (list *)raxFind(server.pubsub_patterns_index,(unsigned char*)p,plen);
+
+    if (l == raxNotFound) {
+        l = listCreate();
+        raxInsert(server.pubsub_patterns_index,(unsigned char*)p,plen,l,NULL);
+    }
+    l->listAddNodeTail(pat);
+    if (pubsubIsKeyspaceChannel(p,plen,1))
+        server.pubsub_keyspace_subscriptions++;
+}
+
+static void pubsubUnindexPattern(pubsubPattern *pat) {
+    sds p = (sds)pat->pattern->ptr;
+    size_t plen = pubsubPatternPrefixLen(p);
+    list *l = (list *)raxFind(server.pubsub_patterns_index,(unsigned char*)p,plen);
+    listNode *ln;
+
+    serverAssert(l != raxNotFound);
+    ln = l->listSearchKey(pat);
+    serverAssert(ln != NULL);
+    l->listDelNode(ln);
+    if (pubsubIsKeyspaceChannel(p,plen,1))
+        server.pubsub_keyspace_subscriptions--;
+    if (l->listLength() == 0) {
+        raxRemove(server.pubsub_patterns_index,(unsigned char*)p,plen,NULL);
+        listRelease(l);
+    }
+}
+
 /* Return the number of channels + patterns a client is subscribed to. */
 int clientSubscriptionsCount(client *c) {
     return c->m_pubsub_channels->dictSize()+
-           c->m_pubsub_patterns->listLength();
+           c->m_pubsub_patterns->listLength()+
+           c->m_pubsubshard_channels->dictSize();
 }
 
-/* Subscribe a client to a channel. Returns 1 if the operation succeeded, or
- * 0 if the client was already subscribed to that channel. */
-int pubsubSubscribeChannel(client *c, robj *channel) {
+/* Return the subscriptions count reported to the client by the (un)subscribe
+ * replies: shard channels are counted on their own, like in the cluster they
+ * live in a different namespace. */
+static long pubsubReplyCount(client *c, int shard) {
+    if (shard) return c->m_pubsubshard_channels->dictSize();
+    return c->m_pubsub_channels->dictSize()+c->m_pubsub_patterns->listLength();
+}
+
+/* Subscribe a client to a channel, or to a shard channel if 'shard' is
+ * true. Returns 1 if the operation succeeded, or 0 if the client was already
+ * subscribed to that channel. */
+int pubsubSubscribeChannel(client *c, robj *channel, int shard) {
+    dict *channels = shard ? server.pubsubshard_channels : server.pubsub_channels;
+    dict *cchannels = shard ? c->m_pubsubshard_channels : c->m_pubsub_channels;
     dictEntry *de;
     list *clients = NULL;
     int retval = 0;
 
     /* Add the channel to the client -> channels hash table */
-    if (c->m_pubsub_channels->dictAdd(channel,NULL) == DICT_OK) {
+    if (cchannels->dictAdd(channel,NULL) == DICT_OK) {
         retval = 1;
         incrRefCount(channel);
         /* Add the client to the channel -> list of clients hash table */
-        de = server.pubsub_channels->dictFind(channel);
+        de = channels->dictFind(channel);
         if (de == NULL) {
             clients = listCreate();
-            server.pubsub_channels->dictAdd(channel,clients);
+            channels->dictAdd(channel,clients);
             incrRefCount(channel);
+            if (!shard && sdsEncodedObject(channel) &&
+                pubsubIsKeyspaceChannel((const char*)channel->ptr,
+                                        sdslen((sds)channel->ptr),0))
+                server.pubsub_keyspace_subscriptions++;
         } else {
             clients = (list *)de->dictGetVal();
         }
@@ -78,15 +157,18 @@ int pubsubSubscribeChannel(client *c, robj *channel) {
     }
     /* Notify the client */
     c->addReply(shared.mbulkhdr[3]);
-    c->addReply(shared.subscribebulk);
+    c->addReply(shard ? shared.ssubscribebulk : shared.subscribebulk);
     c->addReplyBulk(channel);
-    c->addReplyLongLong(clientSubscriptionsCount(c));
+    c->addReplyLongLong(pubsubReplyCount(c,shard));
     return retval;
 }
 
-/* Unsubscribe a client from a channel. Returns 1 if the operation succeeded, or
- * 0 if the client was not subscribed to the specified channel. */
-int client::pubsubUnsubscribeChannel(robj *channel, int notify) {
+/* Unsubscribe a client from a channel, or from a shard channel if 'shard'
+ * is true. Returns 1 if the operation succeeded, or 0 if the client was not
+ * subscribed to the specified channel. */
+int client::pubsubUnsubscribeChannel(robj *channel, int notify, int shard) {
+    dict *channels = shard ? server.pubsubshard_channels : server.pubsub_channels;
+    dict *cchannels = shard ? m_pubsubshard_channels : m_pubsub_channels;
     dictEntry *de;
     list *clients;
     listNode *ln;
@@ -95,10 +177,10 @@ int client::pubsubUnsubscribeChannel(robj *channel, int notify) {
     /* Remove the channel from the client -> channels hash table */
     incrRefCount(channel); /* channel may be just a pointer to the same object
                             we have in the hash tables. Protect it... */
-    if (m_pubsub_channels->dictDelete(channel) == DICT_OK) {
+    if (cchannels->dictDelete(channel) == DICT_OK) {
         retval = 1;
         /* Remove the client from the channel -> clients list hash table */
-        de = server.pubsub_channels->dictFind(channel);
+        de = channels->dictFind(channel);
         serverAssertWithInfo(this,NULL,de != NULL);
         clients = (list *)de->dictGetVal();
         ln = clients->listSearchKey(this);
@@ -108,16 +190,19 @@ int client::pubsubUnsubscribeChannel(robj *channel, int notify) {
             /* Free the list and associated hash entry at all if this was
              * the latest client, so that it will be possible to abuse
              * Redis PUBSUB creating millions of channels. */
-            server.pubsub_channels->dictDelete(channel);
+            channels->dictDelete(channel);
+            if (!shard && sdsEncodedObject(channel) &&
+                pubsubIsKeyspaceChannel((const char*)channel->ptr,
+                                        sdslen((sds)channel->ptr),0))
+                server.pubsub_keyspace_subscriptions--;
         }
     }
     /* Notify the client */
     if (notify) {
         addReply(shared.mbulkhdr[3]);
-        addReply(shared.unsubscribebulk);
+        addReply(shard ? shared.sunsubscribebulk : shared.unsubscribebulk);
         addReplyBulk(channel);
-        addReplyLongLong(m_pubsub_channels->dictSize()+
-                       m_pubsub_patterns->listLength());
+        addReplyLongLong(pubsubReplyCount(this,shard));
 
     }
     decrRefCount(channel); /* it is finally safe to release it */
@@ -136,13 +221,19 @@ int pubsubSubscribePattern(client *c, robj *pattern) {
         pat = (pubsubPattern *)zmalloc(sizeof(*pat));
         pat->pattern = getDecodedObject(pattern);
         pat->client = c;
+        {
+            sds p = (sds)pat->pattern->ptr;
+            size_t plen = pubsubPatternPrefixLen(p);
+            stringmatchCompile(&pat->match,p+plen,sdslen(p)-plen,0);
+        }
         server.pubsub_patterns->listAddNodeTail(pat);
+        pubsubIndexPattern(pat);
     }
     /* Notify the client */
     c->addReply(shared.mbulkhdr[3]);
     c->addReply(shared.psubscribebulk);
     c->addReplyBulk(pattern);
-    c->addReplyLongLong(clientSubscriptionsCount(c));
+    c->addReplyLongLong(pubsubReplyCount(c,0));
     return retval;
 }
 
@@ -160,6 +251,7 @@ int client::pubsubUnsubscribePattern(robj *pattern, int notify) {
         pat.client = this;
         pat.pattern = pattern;
         ln = server.pubsub_patterns->listSearchKey(&pat);
+        pubsubUnindexPattern((pubsubPattern *)ln->listNodeValue());
         server.pubsub_patterns->listDelNode(ln);
     }
     /* Notify the client */
@@ -176,23 +268,22 @@ int client::pubsubUnsubscribePattern(robj *pattern, int notify) {
 
 /* Unsubscribe from all the channels. Return the number of channels the
  * client was subscribed to. */
-int client::pubsubUnsubscribeAllChannels(int notify) {
+int client::pubsubUnsubscribeAllChannels(int notify, int shard) {
     dictEntry *de;
     int count = 0;
 
-    dictIterator di(m_pubsub_channels, 1);
+    dictIterator di(shard ? m_pubsubshard_channels : m_pubsub_channels, 1);
     while((de = di.dictNext()) != NULL) {
         robj *channel = (robj *)de->dictGetKey();
 
-        count += pubsubUnsubscribeChannel(channel,notify);
+        count += pubsubUnsubscribeChannel(channel,notify,shard);
     }
     /* We were subscribed to nothing? Still reply to the client. */
     if (notify && count == 0) {
         addReply(shared.mbulkhdr[3]);
-        addReply(shared.unsubscribebulk);
+        addReply(shard ? shared.sunsubscribebulk : shared.unsubscribebulk);
         addReply(shared.nullbulk);
-        addReplyLongLong(m_pubsub_channels->dictSize()+
-                       m_pubsub_patterns->listLength());
+        addReplyLongLong(pubsubReplyCount(this,shard));
     }
 
     return count;
@@ -221,14 +312,69 @@ int client::pubsubUnsubscribeAllPatterns(int notify) {
     return count;
 }
 
+struct pubsubPublishState {
+    robj *channel;      /* Decoded channel name. */
+    robj *tail;         /* Channel and message bulks, shared by receivers. */
+    int receivers;
+};
+
+/* Create the part of the "message" and "pmessage" replies that is the same
+ * for every receiver, that is, the channel and the message bulks. It is
+ * built once and sent with addReplyShared(), so the payload is not copied
+ * once per subscriber. */
+static robj *pubsubCreateMessageTail(robj *channel, robj *message) {
+    message = getDecodedObject(message);
+    size_t clen = sdslen((sds)channel->ptr), mlen = sdslen((sds)message->ptr);
+    sds s = sdsMakeRoomFor(sdsempty(),clen+mlen+2*(LONG_STR_SIZE+5));
+
+    s = sdscatfmt(s,"$%U\r\n",(unsigned long long)clen);
+    s = sdscatlen(s,channel->ptr,clen);
+    s = sdscatfmt(s,"\r\n$%U\r\n",(unsigned long long)mlen);
+    s = sdscatlen(s,message->ptr,mlen);
+    s = sdscatlen(s,"\r\n",2);
+    decrRefCount(message);
+    return createObject(OBJ_STRING,s);
+}
+
+/* raxFindPrefixes() callback: send the message to the clients of the
+ * patterns with a literal prefix of 'prefixlen' bytes that the channel
+ * starts with, so only the rest of the patterns needs to be matched. */
+static void pubsubPublishToPatterns(void *data, size_t prefixlen, void *privdata) {
+    pubsubPublishState *state = (pubsubPublishState *)privdata;
+    sds channel = (sds)state->channel->ptr;
+    list *l = (list *)data;
+    listNode *ln;
+
+    listIter li(l);
+    while ((ln = li.listNext()) != NULL) {
+        pubsubPattern *pat = (pubsubPattern *)ln->listNodeValue();
+
+        /* The pattern was compiled without the prefix, see
+         * pubsubSubscribePattern(). */
+        if (stringmatchCompiled(&pat->match,channel+prefixlen,
+                                sdslen(channel)-prefixlen)) {
+            pat->client->addReply(shared.mbulkhdr[4]);
+            pat->client->addReply(shared.pmessagebulk);
+            pat->client->addReplyBulk(pat->pattern);
+            pat->client->addReplyShared(state->tail);
+            state->receivers++;
+        }
+    }
+}
+
 /* Publish a message */
 int pubsubPublishMessage(robj *channel, robj *message) {
-    int receivers = 0;
+    pubsubPublishState state;
     dictEntry *de;
-    listNode *ln;
 
-    /* Send to clients listening for that channel */
     de = server.pubsub_channels->dictFind(channel);
+    if (de == NULL && server.pubsub_patterns->listLength() == 0) return 0;
+
+    state.channel = getDecodedObject(channel);
+    state.tail = pubsubCreateMessageTail(state.channel,message);
+    state.receivers = 0;
+
+    /* Send to clients listening for that channel */
     if (de) {
         list* _list = (list*)de->dictGetVal();
         listNode *ln;
@@ -239,35 +385,66 @@ int pubsubPublishMessage(robj *channel, robj *message) {
 
             c->addReply(shared.mbulkhdr[3]);
             c->addReply(shared.messagebulk);
-            c->addReplyBulk(channel);
-            c->addReplyBulk(message);
-            receivers++;
+            c->addReplyShared(state.tail);
+            state.receivers++;
         }
     }
     /* Send to clients listening to matching channels */
     if (server.pubsub_patterns->listLength()) {
-        listIter li(server.pubsub_patterns);
-        channel = getDecodedObject(channel);
-        while ((ln = li.listNext()) != NULL) {
-            pubsubPattern *pat = (pubsubPattern *)ln->listNodeValue();
-
-            if (stringmatchlen((char*)pat->pattern->ptr,
-                                sdslen((sds)pat->pattern->ptr),
-                                (char*)channel->ptr,
-                                sdslen((sds)channel->ptr),0)) {
-                pat->client->addReply(shared.mbulkhdr[4]);
-                pat->client->addReply(shared.pmessagebulk);
-                pat->client->addReplyBulk(pat->pattern);
-                pat->client->addReplyBulk(channel);
-                pat->client->addReplyBulk(message);
-                receivers++;
-            }
-        }
-        decrRefCount(channel);
+        raxFindPrefixes(server.pubsub_patterns_index,
+                        (unsigned char*)state.channel->ptr,
+                        sdslen((sds)state.channel->ptr),
+                        pubsubPublishToPatterns,&state);
     }
+    decrRefCount(state.channel);
+    decrRefCount(state.tail);
+    return state.receivers;
+}
+
+/* Publish a message to the clients subscribed to the shard channel. Shard
+ * channels don't match patterns. */
+int pubsubPublishShardMessage(robj *channel, robj *message) {
+    dictEntry *de = server.pubsubshard_channels->dictFind(channel);
+    int receivers = 0;
+    robj *tail;
+    listNode *ln;
+
+    if (de == NULL) return 0;
+    channel = getDecodedObject(channel);
+    tail = pubsubCreateMessageTail(channel,message);
+
+    listIter li((list*)de->dictGetVal());
+    while ((ln = li.listNext()) != NULL) {
+        client *c = (client *)ln->listNodeValue();
+
+        c->addReply(shared.mbulkhdr[3]);
+        c->addReply(shared.smessagebulk);
+        c->addReplyShared(tail);
+        receivers++;
+    }
+    decrRefCount(channel);
+    decrRefCount(tail);
     return receivers;
 }
 
+/* Unsubscribe all the clients subscribed to the shard channel, notifying
+ * them. Used in cluster mode when the slot of the channel is no longer
+ * served by the shard of this node. */
+void pubsubShardUnsubscribeAllClients(robj *channel) {
+    list *clients;
+
+    incrRefCount(channel); /* Freed with the last subscription. */
+    while ((clients = (list *)server.pubsubshard_channels->dictFetchValue(channel))
+           != NULL)
+    {
+        client *c = (client *)clients->listFirst()->listNodeValue();
+
+        c->pubsubUnsubscribeChannel(channel,1,1);
+        if (clientSubscriptionsCount(c) == 0) c->m_flags &= ~CLIENT_PUBSUB;
+    }
+    decrRefCount(channel);
+}
+
 /*-----------------------------------------------------------------------------
  * Pubsub commands implementation
  *----------------------------------------------------------------------------*/
@@ -276,7 +453,7 @@ void subscribeCommand(client *c) {
     int j;
 
     for (j = 1; j < c->m_argc; j++)
-        pubsubSubscribeChannel(c,c->m_argv[j]);
+        pubsubSubscribeChannel(c,c->m_argv[j],0);
     c->m_flags |= CLIENT_PUBSUB;
 }
 
@@ -312,6 +489,39 @@ void punsubscribeCommand(client *c) {
     if (clientSubscriptionsCount(c) == 0) c->m_flags &= ~CLIENT_PUBSUB;
 }
 
+void ssubscribeCommand(client *c) {
+    int j;
+
+    for (j = 1; j < c->m_argc; j++)
+        pubsubSubscribeChannel(c,c->m_argv[j],1);
+    c->m_flags |= CLIENT_PUBSUB;
+}
+
+void sunsubscribeCommand(client *c) {
+    if (c->m_argc == 1) {
+        c->pubsubUnsubscribeAllChannels(1,1);
+    } else {
+        int j;
+
+        for (j = 1; j < c->m_argc; j++)
+            c->pubsubUnsubscribeChannel(c->m_argv[j],1,1);
+    }
+    if (clientSubscriptionsCount(c) == 0) c->m_flags &= ~CLIENT_PUBSUB;
+}
+
+/* SPUBLISH shardchannel message
+ *
+ * In cluster mode the message is only sent to the nodes of the shard serving
+ * the slot of the channel, instead of the whole cluster. */
+void spublishCommand(client *c) {
+    int receivers = pubsubPublishShardMessage(c->m_argv[1],c->m_argv[2]);
+    if (server.cluster_enabled)
+        clusterPropagatePublishShard(c->m_argv[1],c->m_argv[2]);
+    else
+        forceCommandPropagation(c,PROPAGATE_REPL);
+    c->addReplyLongLong(receivers);
+}
+
 void publishCommand(client *c) {
     int receivers = pubsubPublishMessage(c->m_argv[1],c->m_argv[2]);
     if (server.cluster_enabled)
@@ -323,36 +533,49 @@ void publishCommand(client *c) {
 
 /* PUBSUB command for Pub/Sub introspection. */
 void pubsubCommand(client *c) {
-    if (!strcasecmp((const char*)c->m_argv[1]->ptr,"channels") &&
+    int shard = !strcasecmp((const char*)c->m_argv[1]->ptr,"shardchannels") ||
+                !strcasecmp((const char*)c->m_argv[1]->ptr,"shardnumsub");
+
+    if ((!strcasecmp((const char*)c->m_argv[1]->ptr,"channels") ||
+         !strcasecmp((const char*)c->m_argv[1]->ptr,"shardchannels")) &&
         (c->m_argc == 2 || c->m_argc ==3))
     {
-        /* PUBSUB CHANNELS [<pattern>] */
+        /* PUBSUB CHANNELS [<pattern>]
+         * PUBSUB SHARDCHANNELS [<pattern>] */
         sds pat = (c->m_argc == 2) ? NULL : (sds)c->m_argv[2]->ptr;
-        dictIterator di(server.pubsub_channels);
+        dictIterator di(shard ? server.pubsubshard_channels :
+                                server.pubsub_channels);
         dictEntry *de;
+        stringmatchPattern sp;
         long mblen = 0;
         void *replylen;
 
+        if (pat) stringmatchCompile(&sp,pat,sdslen(pat),0);
         replylen = c->addDeferredMultiBulkLength();
         while((de = di.dictNext()) != NULL) {
             robj *cobj = (robj *)de->dictGetKey();
             sds channel = (sds)cobj->ptr;
 
-            if (!pat || stringmatchlen(pat, sdslen(pat),
-                                       channel, sdslen(channel),0))
+            if (!pat || stringmatchCompiled(&sp,channel,sdslen(channel)))
             {
                 c->addReplyBulk(cobj);
                 mblen++;
             }
         }
         c->setDeferredMultiBulkLength(replylen,mblen);
-    } else if (!strcasecmp((const char*)c->m_argv[1]->ptr,"numsub") && c->m_argc >= 2) {
-        /* PUBSUB NUMSUB [Channel_1 ... Channel_N] */
+    } else if ((!strcasecmp((const char*)c->m_argv[1]->ptr,"numsub") ||
+                !strcasecmp((const char*)c->m_argv[1]->ptr,"shardnumsub")) &&
+               c->m_argc >= 2)
+    {
+        /* PUBSUB NUMSUB [Channel_1 ... Channel_N]
+         * PUBSUB SHARDNUMSUB [Channel_1 ... Channel_N] */
+        dict *channels = shard ? server.pubsubshard_channels :
+                                 server.pubsub_channels;
         int j;
 
         c->addReplyMultiBulkLen((c->m_argc-2)*2);
         for (j = 2; j < c->m_argc; j++) {
-            list *l = (list *)server.pubsub_channels->dictFetchValue(c->m_argv[j]);
+            list *l = (list *)channels->dictFetchValue(c->m_argv[j]);
 
             c->addReplyBulk(c->m_argv[j]);
             c->addReplyLongLong(l ? l->listLength() : 0);
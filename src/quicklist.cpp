@@ -34,6 +34,7 @@
 #include "quicklist.h"
 #include "zmalloc.h"
 #include "ziplist.h"
+#include "listpack.h"
 #include "util.h" /* for ll2string */
 #include "lzf.h"
 
@@ -108,9 +109,171 @@ quicklist *quicklistCreate() {
     quicklist->m_count_total_entries = 0;
     quicklist->m_compress_depth = 0;
     quicklist->m_fill_factor = -2;
+    quicklist->m_container = QUICKLIST_NODE_CONTAINER_ZIPLIST;
+    quicklist->m_hot_nodes = 0;
+    quicklist->m_index = NULL;
     return quicklist;
 }
 
+/* ---------------------------------------------------------------------------
+ * Node index
+ *
+ * Finding the node holding the entry at a given position normally walks the
+ * nodes from the head or the tail, so LINDEX, LSET, LRANGE and LTRIM in the
+ * middle of a list of N nodes are O(N). Lists with at least
+ * QUICKLIST_INDEX_MIN_NODES nodes get an index of their nodes with a Fenwick
+ * tree of their entry counts when an entry is looked up by position, so the
+ * lookup is O(log N).
+ *
+ * Pushes and pops, that only change the head and the tail nodes or add and
+ * remove nodes at the ends, update the index in O(log N). Other changes
+ * just drop it, and it is built again by the next lookup.
+ * ------------------------------------------------------------------------ */
+
+#define QUICKLIST_INDEX_MIN_NODES 64
+
+static void quicklistIndexFree(const quicklist *in_ql) {
+    quicklistNodeIndex *idx = in_ql->m_index;
+
+    if (idx == NULL) return;
+    zfree(idx->m_nodes);
+    zfree(idx->m_counts);
+    zfree(idx->m_tree);
+    zfree(idx);
+    in_ql->m_index = NULL;
+}
+
+/* Drop the index after a change in the middle of the list. */
+#define quicklistIndexInvalidate(_ql) quicklistIndexFree(_ql)
+
+/* Drop the index, for callers that relocate the nodes (active defrag). */
+void quicklistDropIndex(quicklist *in_ql) {
+    quicklistIndexInvalidate(in_ql);
+}
+
+static void quicklistIndexBuild(const quicklist *in_ql) {
+    quicklistNodeIndex *idx = (quicklistNodeIndex *)zmalloc(sizeof(*idx));
+    unsigned long j, n = in_ql->m_num_ql_nodes;
+    quicklistNode *node;
+
+    /* Room for as many nodes again, half at every end. */
+    idx->m_capacity = n*2;
+    idx->m_lo = n/2;
+    idx->m_hi = idx->m_lo+n;
+    idx->m_nodes = (quicklistNode **)zcalloc(sizeof(quicklistNode*)*idx->m_capacity);
+    idx->m_counts = (unsigned long *)zcalloc(sizeof(unsigned long)*idx->m_capacity);
+    idx->m_tree = (unsigned long *)zcalloc(sizeof(unsigned long)*(idx->m_capacity+1));
+
+    for (node = in_ql->m_head_ql_node, j = idx->m_lo; node;
+         node = node->m_next_ql_node, j++)
+    {
+        idx->m_nodes[j] = node;
+        idx->m_counts[j] = node->m_item_count;
+    }
+
+    /* Build the Fenwick tree in O(N): every slot adds its partial sum to
+     * its parent. */
+    for (j = 1; j <= idx->m_capacity; j++) {
+        unsigned long parent = j + (j & -j);
+
+        idx->m_tree[j] += idx->m_counts[j-1];
+        if (parent <= idx->m_capacity) idx->m_tree[parent] += idx->m_tree[j];
+    }
+    in_ql->m_index = idx;
+}
+
+static void quicklistIndexAdd(quicklistNodeIndex *idx, unsigned long slot,
+                              long delta) {
+    idx->m_counts[slot] += delta;
+    for (slot++; slot <= idx->m_capacity; slot += slot & -slot)
+        idx->m_tree[slot] += delta;
+}
+
+/* The entries of 'node' changed by 'delta'. */
+static void quicklistIndexNodeCount(const quicklist *in_ql,
+                                    const quicklistNode *node, long delta) {
+    quicklistNodeIndex *idx = in_ql->m_index;
+
+    if (idx == NULL) return;
+    if (node == idx->m_nodes[idx->m_lo])
+        quicklistIndexAdd(idx,idx->m_lo,delta);
+    else if (node == idx->m_nodes[idx->m_hi-1])
+        quicklistIndexAdd(idx,idx->m_hi-1,delta);
+    else
+        quicklistIndexInvalidate(in_ql);
+}
+
+/* 'node' was linked to the quicklist. */
+static void quicklistIndexNodeAdded(const quicklist *in_ql,
+                                    quicklistNode *node) {
+    quicklistNodeIndex *idx = in_ql->m_index;
+    unsigned long slot;
+
+    if (idx == NULL) return;
+    if (node == in_ql->m_head_ql_node && idx->m_lo > 0) {
+        slot = --idx->m_lo;
+    } else if (node == in_ql->m_tail_ql_node && idx->m_hi < idx->m_capacity) {
+        slot = idx->m_hi++;
+    } else {
+        quicklistIndexInvalidate(in_ql);
+        return;
+    }
+    idx->m_nodes[slot] = node;
+    quicklistIndexAdd(idx,slot,node->m_item_count);
+}
+
+/* 'node' is about to be unlinked from the quicklist. */
+static void quicklistIndexNodeRemoved(const quicklist *in_ql,
+                                      const quicklistNode *node) {
+    quicklistNodeIndex *idx = in_ql->m_index;
+    unsigned long slot;
+
+    if (idx == NULL) return;
+    if (idx->m_hi-idx->m_lo == 1) {
+        quicklistIndexInvalidate(in_ql);
+        return;
+    }
+    if (node == idx->m_nodes[idx->m_lo]) {
+        slot = idx->m_lo++;
+    } else if (node == idx->m_nodes[idx->m_hi-1]) {
+        slot = --idx->m_hi;
+    } else {
+        quicklistIndexInvalidate(in_ql);
+        return;
+    }
+    idx->m_nodes[slot] = NULL;
+    quicklistIndexAdd(idx,slot,-(long)idx->m_counts[slot]);
+}
+
+/* Find the node holding the entry at the 0-based position 'index' counting
+ * from the head, setting '*accum' to the number of entries of the nodes
+ * before it. Returns NULL if the quicklist is too short to have an index. */
+static quicklistNode *quicklistIndexFind(const quicklist *in_ql,
+                                         unsigned long long index,
+                                         unsigned long long *accum) {
+    quicklistNodeIndex *idx;
+    unsigned long pos = 0, bit = 1;
+
+    if (in_ql->m_num_ql_nodes < QUICKLIST_INDEX_MIN_NODES) return NULL;
+    if (in_ql->m_index == NULL) quicklistIndexBuild(in_ql);
+    idx = in_ql->m_index;
+
+    /* Descend the Fenwick tree to the last slot 'pos' (1-based) so that
+     * the first 'pos' slots hold no more than 'index' entries: the entry
+     * is in the next one. */
+    while (bit*2 <= idx->m_capacity) bit *= 2;
+    *accum = 0;
+    for (; bit; bit /= 2) {
+        if (pos+bit <= idx->m_capacity &&
+            *accum + idx->m_tree[pos+bit] <= index)
+        {
+            pos += bit;
+            *accum += idx->m_tree[pos];
+        }
+    }
+    return idx->m_nodes[pos];
+}
+
 #define COMPRESS_MAX (1 << 16)
 void quicklistSetCompressDepth(quicklist *in_ql, int in_depth) {
     if (in_depth > COMPRESS_MAX) {
@@ -143,9 +306,10 @@ quicklist *quicklistNew(int in_fill, int in_compress) {
     return quicklist;
 }
 
-REDIS_STATIC quicklistNode *quicklistCreateNode() {
+REDIS_STATIC quicklistNode *quicklistCreateNode(int in_container) {
     void* node_mem = zmalloc(sizeof(quicklistNode));
     quicklistNode *node = new (node_mem)quicklistNode();
+    node->m_container = in_container;
     return node;
 }
 
@@ -159,6 +323,148 @@ quicklistNode::quicklistNode()
      m_encoding = QUICKLIST_NODE_ENCODING_RAW;
      m_container = QUICKLIST_NODE_CONTAINER_ZIPLIST;
      m_recompress = 0;
+     m_incompressible = 0;
+     m_hot = 0;
+     m_hits = 0;
+}
+
+/* Node container operations.
+ *
+ * The entries of a node are stored in a ziplist or in a listpack depending
+ * on node->m_container. The functions below implement the few operations
+ * the quicklist needs on an uncompressed node with the ziplist semantics
+ * for both containers: deleting the last entry leaves the entry pointer at
+ * the end of the container, where getting or moving to the next entry
+ * fails. */
+#define nodeIsListpack(n) ((n)->m_container == QUICKLIST_NODE_CONTAINER_LISTPACK)
+
+REDIS_STATIC unsigned char *_quicklistContainerNew(int in_container) {
+    if (in_container == QUICKLIST_NODE_CONTAINER_LISTPACK) return lpNew();
+    return ziplistNew();
+}
+
+/* True if 'p' is the EOF byte of the listpack 'lp'. */
+#define lpAtEnd(lp, p) ((p) == (lp) + lpBytes(lp) - 1)
+
+REDIS_STATIC size_t _quicklistNodeBytes(const quicklistNode *node) {
+    if (nodeIsListpack(node)) return lpBytes(node->m_ql_LZF);
+    return ziplistBlobLen(node->m_ql_LZF);
+}
+
+REDIS_STATIC unsigned int _quicklistNodeLen(const quicklistNode *node) {
+    if (nodeIsListpack(node)) return lpLength(node->m_ql_LZF);
+    return ziplistLen(node->m_ql_LZF);
+}
+
+REDIS_STATIC void _quicklistNodePush(quicklistNode *node, void *value,
+                                     const size_t sz, int where) {
+    if (nodeIsListpack(node)) {
+        if (where == QUICKLIST_HEAD)
+            node->m_ql_LZF = lpPrepend(node->m_ql_LZF, (unsigned char *)value, sz);
+        else
+            node->m_ql_LZF = lpAppend(node->m_ql_LZF, (unsigned char *)value, sz);
+    } else {
+        node->m_ql_LZF = ziplistPush(node->m_ql_LZF, (unsigned char *)value, sz,
+                                     where == QUICKLIST_HEAD ? ZIPLIST_HEAD : ZIPLIST_TAIL);
+    }
+}
+
+REDIS_STATIC unsigned char *_quicklistNodeIndex(const quicklistNode *node, long index) {
+    if (nodeIsListpack(node)) return lpSeek(node->m_ql_LZF, index);
+    return ziplistIndex(node->m_ql_LZF, index);
+}
+
+REDIS_STATIC unsigned char *_quicklistNodeNext(const quicklistNode *node, unsigned char *p) {
+    if (nodeIsListpack(node)) {
+        if (lpAtEnd(node->m_ql_LZF, p)) return NULL;
+        return lpNext(node->m_ql_LZF, p);
+    }
+    return ziplistNext(node->m_ql_LZF, p);
+}
+
+REDIS_STATIC unsigned char *_quicklistNodePrev(const quicklistNode *node, unsigned char *p) {
+    if (nodeIsListpack(node)) return lpPrev(node->m_ql_LZF, p);
+    return ziplistPrev(node->m_ql_LZF, p);
+}
+
+REDIS_STATIC int _quicklistNodeGet(const quicklistNode *node, unsigned char *p,
+                                   unsigned char **vstr, unsigned int *vlen,
+                                   long long *vlong) {
+    if (nodeIsListpack(node)) {
+        if (p == NULL || lpAtEnd(node->m_ql_LZF, p)) return 0;
+        return lpGetValue(p, vstr, vlen, vlong);
+    }
+    return ziplistGet(p, vstr, vlen, vlong);
+}
+
+/* Delete the entry at '*p', setting '*p' to the entry that follows. */
+REDIS_STATIC void _quicklistNodeDelete(quicklistNode *node, unsigned char **p) {
+    if (nodeIsListpack(node)) {
+        node->m_ql_LZF = lpDelete(node->m_ql_LZF, *p, p);
+        if (*p == NULL) *p = node->m_ql_LZF + lpBytes(node->m_ql_LZF) - 1;
+    } else {
+        node->m_ql_LZF = ziplistDelete(node->m_ql_LZF, p);
+    }
+}
+
+/* Delete 'num' entries starting at 'index', a negative 'num' deletes up to
+ * the end of the node. */
+REDIS_STATIC void _quicklistNodeDeleteRange(quicklistNode *node, long index, long num) {
+    if (nodeIsListpack(node))
+        node->m_ql_LZF = lpDeleteRange(node->m_ql_LZF, index, (unsigned long)num);
+    else
+        node->m_ql_LZF = ziplistDeleteRange(node->m_ql_LZF, index, (unsigned int)num);
+}
+
+/* Insert 'value' before the entry at 'p', that can be the end of the
+ * container in order to append. */
+REDIS_STATIC void _quicklistNodeInsert(quicklistNode *node, unsigned char *p,
+                                       void *value, const size_t sz) {
+    if (nodeIsListpack(node))
+        node->m_ql_LZF = lpInsert(node->m_ql_LZF, (unsigned char *)value, sz, p, LP_BEFORE, NULL);
+    else
+        node->m_ql_LZF = ziplistInsert(node->m_ql_LZF, p, (unsigned char *)value, sz);
+}
+
+/* Replace the entry at 'p' with 'value'. */
+REDIS_STATIC void _quicklistNodeReplace(quicklistNode *node, unsigned char *p,
+                                        void *value, const size_t sz) {
+    if (nodeIsListpack(node)) {
+        node->m_ql_LZF = lpInsert(node->m_ql_LZF, (unsigned char *)value, sz, p, LP_REPLACE, NULL);
+    } else {
+        node->m_ql_LZF = ziplistDelete(node->m_ql_LZF, &p);
+        node->m_ql_LZF = ziplistInsert(node->m_ql_LZF, p, (unsigned char *)value, sz);
+    }
+}
+
+/* Convert the uncompressed 'node' to 'container' moving its entries one by
+ * one into a new container. */
+REDIS_STATIC void _quicklistNodeConvert(quicklistNode *node, int in_container) {
+    if (node->m_container == in_container)
+        return;
+
+    quicklistNode dst;
+    dst.m_container = in_container;
+    dst.m_ql_LZF = _quicklistContainerNew(in_container);
+
+    unsigned char *value;
+    unsigned int sz;
+    long long longval;
+    char longstr[32] = {0};
+    unsigned char *p = _quicklistNodeIndex(node, 0);
+    while (_quicklistNodeGet(node, p, &value, &sz, &longval)) {
+        if (!value) {
+            sz = ll2string(longstr, sizeof(longstr), longval);
+            value = (unsigned char *)longstr;
+        }
+        _quicklistNodePush(&dst, value, sz, QUICKLIST_TAIL);
+        p = _quicklistNodeNext(node, p);
+    }
+    zfree(node->m_ql_LZF);
+    node->m_ql_LZF = dst.m_ql_LZF;
+    node->m_container = in_container;
+    node->m_zip_list_size = _quicklistNodeBytes(node);
+    node->m_incompressible = 0;
 }
 
 /* Return cached quicklist count */
@@ -182,6 +488,7 @@ void quicklistRelease(quicklist *in_ql) {
         in_ql->m_num_ql_nodes--;
         current = next;
     }
+    quicklistIndexFree(in_ql);
     zfree(in_ql);
 }
 
@@ -194,10 +501,25 @@ int quicklistNode::__quicklistCompressNode()
     m_attempted_compress = 1;
 #endif
 
+    /* The node is not decompressed for use anymore, even if it can't be
+     * compressed below: a flag left set would compress it later when it may
+     * have become the head or the tail of the list. */
+    m_recompress = 0;
+
+    /* The head and the tail are accessed directly by pushes and pops, so
+     * they are never compressed. */
+    if (!m_prev_ql_node || !m_next_ql_node)
+        return 0;
+
     /* Don't bother compressing small values */
     if (m_zip_list_size < MIN_COMPRESS_BYTES)
         return 0;
 
+    /* Don't try again content that didn't compress, see
+     * quicklistNodeUpdateSz(). */
+    if (m_incompressible)
+        return 0;
+
     quicklistLZF *lzf = (quicklistLZF *)zmalloc(sizeof(*lzf) + m_zip_list_size);
 
     /* Cancel if compression fails or doesn't compress small enough */
@@ -206,21 +528,27 @@ int quicklistNode::__quicklistCompressNode()
         lzf->m_LZF_size + MIN_COMPRESS_IMPROVE >= m_zip_list_size) {
         /* lzf_compress aborts/rejects compression if value not compressable. */
         zfree(lzf);
+        m_incompressible = 1;
         return 0;
     }
     lzf = (quicklistLZF *)zrealloc(lzf, sizeof(*lzf) + lzf->m_LZF_size);
     zfree(m_ql_LZF);
     m_ql_LZF = (unsigned char *)lzf;
     m_encoding = QUICKLIST_NODE_ENCODING_LZF;
-    m_recompress = 0;
     return 1;
 }
 
-/* Compress only uncompressed nodes. */
-void quicklist::quicklistCompressNode(quicklistNode* in_node)
+/* Compress only uncompressed nodes. A hot node compressed here is not
+ * hot anymore. */
+void quicklist::quicklistCompressNode(const quicklist *in_ql, quicklistNode* in_node)
 {
     if (in_node && in_node->m_encoding == QUICKLIST_NODE_ENCODING_RAW)
     {
+        if (in_node->m_hot) {
+            in_node->m_hot = 0;
+            in_node->m_hits = 0;
+            in_ql->m_hot_nodes--;
+        }
         in_node->__quicklistCompressNode();
     }
 }
@@ -263,6 +591,8 @@ void quicklist::quicklistDecompressNodeForUse(quicklistNode* in_node)
     {
         in_node->__quicklistDecompressNode();
         in_node->m_recompress = 1;
+        if (in_node->m_hits < 15)
+            in_node->m_hits++;
     }
 }
 
@@ -341,19 +671,40 @@ REDIS_STATIC void __quicklistCompress(const quicklist *in_ql, quicklistNode *in_
     }
 
     if (!in_depth)
-        quicklist::quicklistCompressNode(in_node);
+        quicklist::quicklistCompressNode(in_ql, in_node);
 
     if (depth > 2) {
         /* At this point, forward and reverse are one node beyond depth */
-        quicklist::quicklistCompressNode(forward);
-        quicklist::quicklistCompressNode(reverse);
+        quicklist::quicklistCompressNode(in_ql, forward);
+        quicklist::quicklistCompressNode(in_ql, reverse);
+    }
+}
+
+/* Compress again 'node' after a use that decompressed it, unless it was
+ * decompressed for use QUICKLIST_HOT_HITS times: such a node is kept
+ * decompressed as long as the list has less than QUICKLIST_HOT_NODES hot
+ * nodes, so repeated LRANGE or LINDEX of the middle of a list don't pay for
+ * a decompression every time. A hot node keeps 'm_recompress' set and is
+ * compressed again, and not hot anymore, by the next compression pass that
+ * reaches it through __quicklistCompress(). */
+REDIS_STATIC void __quicklistRecompressAfterUse(const quicklist *in_ql,
+                                                quicklistNode *in_node)
+{
+    if (!in_node->m_hot && in_node->m_hits >= QUICKLIST_HOT_HITS &&
+        in_ql->m_hot_nodes < QUICKLIST_HOT_NODES &&
+        in_node->m_prev_ql_node && in_node->m_next_ql_node)
+    {
+        in_node->m_hot = 1;
+        in_ql->m_hot_nodes++;
     }
+    if (!in_node->m_hot)
+        quicklist::quicklistCompressNode(in_ql, in_node);
 }
 
 #define quicklistCompress(_ql, _node)                                          \
     do {                                                                       \
         if ((_node)->m_recompress)                                               \
-            quicklist::quicklistCompressNode((_node));                                    \
+            __quicklistRecompressAfterUse((_ql), (_node));                     \
         else                                                                   \
             __quicklistCompress((_ql), (_node));                               \
     } while (0)
@@ -362,7 +713,7 @@ REDIS_STATIC void __quicklistCompress(const quicklist *in_ql, quicklistNode *in_
 #define quicklistRecompressOnly(_ql, _node)                                    \
     do {                                                                       \
         if ((_node)->m_recompress)                                               \
-            quicklist::quicklistCompressNode((_node));                                    \
+            __quicklistRecompressAfterUse((_ql), (_node));                     \
     } while (0)
 
 /* Insert 'new_node' after 'old_node' if 'after' is 1.
@@ -402,6 +753,7 @@ REDIS_STATIC void __quicklistInsertNode(quicklist *quicklist,
         quicklistCompress(quicklist, old_node);
 
     quicklist->m_num_ql_nodes++;
+    quicklistIndexNodeAdded(quicklist, new_node);
 }
 
 /* Wrappers for node inserting around existing node. */
@@ -443,19 +795,37 @@ REDIS_STATIC int _quicklistNodeAllowInsert(const quicklistNode *node,
         return 0;
 
     int ziplist_overhead;
-    /* size of previous offset */
-    if (sz < 254)
-        ziplist_overhead = 1;
-    else
-        ziplist_overhead = 5;
-
-    /* size of forward offset */
-    if (sz < 64)
-        ziplist_overhead += 1;
-    else if (likely(sz < 16384))
-        ziplist_overhead += 2;
-    else
-        ziplist_overhead += 5;
+    if (nodeIsListpack(node)) {
+        /* size of the encoding header */
+        if (sz < 64)
+            ziplist_overhead = 1;
+        else if (likely(sz < 4096))
+            ziplist_overhead = 2;
+        else
+            ziplist_overhead = 5;
+
+        /* size of the backlen, that also covers the header */
+        if (sz + ziplist_overhead < 128)
+            ziplist_overhead += 1;
+        else if (likely(sz + ziplist_overhead < 16384))
+            ziplist_overhead += 2;
+        else
+            ziplist_overhead += 5;
+    } else {
+        /* size of previous offset */
+        if (sz < 254)
+            ziplist_overhead = 1;
+        else
+            ziplist_overhead = 5;
+
+        /* size of forward offset */
+        if (sz < 64)
+            ziplist_overhead += 1;
+        else if (likely(sz < 16384))
+            ziplist_overhead += 2;
+        else
+            ziplist_overhead += 5;
+    }
 
     /* new_sz overestimates if 'sz' encodes to an integer type */
     unsigned int new_sz = node->m_zip_list_size + sz + ziplist_overhead;
@@ -475,9 +845,10 @@ REDIS_STATIC int _quicklistNodeAllowMerge(const quicklistNode *a,
     if (!a || !b)
         return 0;
 
-    /* approximate merged ziplist size (- 11 to remove one ziplist
-     * header/trailer) */
-    unsigned int merge_sz = a->m_zip_list_size + b->m_zip_list_size - 11;
+    /* approximate merged size (- 11 to remove one ziplist header/trailer,
+     * - 7 for a listpack) */
+    unsigned int merge_sz = a->m_zip_list_size + b->m_zip_list_size -
+                            (nodeIsListpack(a) ? 7 : 11);
     if (likely(_quicklistNodeSizeMeetsOptimizationRequirement(merge_sz, fill)))
         return 1;
     else if (!sizeMeetsSafetyLimit(merge_sz))
@@ -490,7 +861,8 @@ REDIS_STATIC int _quicklistNodeAllowMerge(const quicklistNode *a,
 
 #define quicklistNodeUpdateSz(node)                                            \
     do {                                                                       \
-        (node)->m_zip_list_size = ziplistBlobLen((unsigned char *)(node)->m_ql_LZF);                               \
+        (node)->m_zip_list_size = _quicklistNodeBytes(node);                    \
+        (node)->m_incompressible = 0;                                          \
     } while (0)
 
 /* Add new entry to head node of quicklist.
@@ -501,18 +873,19 @@ int quicklistPushHead(quicklist *in_ql, void *in_value, const size_t in_size) {
     quicklistNode *orig_head = in_ql->m_head_ql_node;
     if (likely(
             _quicklistNodeAllowInsert(in_ql->m_head_ql_node, in_ql->m_fill_factor, in_size))) {
-        in_ql->m_head_ql_node->m_ql_LZF =
-            ziplistPush((unsigned char *)in_ql->m_head_ql_node->m_ql_LZF, (unsigned char *)in_value, in_size, ZIPLIST_HEAD);
+        _quicklistNodePush(in_ql->m_head_ql_node, in_value, in_size, QUICKLIST_HEAD);
         quicklistNodeUpdateSz(in_ql->m_head_ql_node);
     } else {
-        quicklistNode *node = quicklistCreateNode();
-        node->m_ql_LZF = ziplistPush((unsigned char *)ziplistNew(), (unsigned char *)in_value, in_size, ZIPLIST_HEAD);
+        quicklistNode *node = quicklistCreateNode(in_ql->m_container);
+        node->m_ql_LZF = _quicklistContainerNew(node->m_container);
+        _quicklistNodePush(node, in_value, in_size, QUICKLIST_HEAD);
 
         quicklistNodeUpdateSz(node);
         _quicklistInsertNodeBefore(in_ql, in_ql->m_head_ql_node, node);
     }
     in_ql->m_count_total_entries++;
     in_ql->m_head_ql_node->m_item_count++;
+    quicklistIndexNodeCount(in_ql, in_ql->m_head_ql_node, 1);
     return (orig_head != in_ql->m_head_ql_node);
 }
 
@@ -524,18 +897,19 @@ int quicklistPushTail(quicklist *in_ql, void *in_value, const size_t in_size) {
     quicklistNode *orig_tail = in_ql->m_tail_ql_node;
     if (likely(
             _quicklistNodeAllowInsert(in_ql->m_tail_ql_node, in_ql->m_fill_factor, in_size))) {
-        in_ql->m_tail_ql_node->m_ql_LZF =
-            ziplistPush((unsigned char *)in_ql->m_tail_ql_node->m_ql_LZF, (unsigned char *)in_value, in_size, ZIPLIST_TAIL);
+        _quicklistNodePush(in_ql->m_tail_ql_node, in_value, in_size, QUICKLIST_TAIL);
         quicklistNodeUpdateSz(in_ql->m_tail_ql_node);
     } else {
-        quicklistNode *node = quicklistCreateNode();
-        node->m_ql_LZF = ziplistPush((unsigned char *)ziplistNew(), (unsigned char *)in_value, in_size, ZIPLIST_TAIL);
+        quicklistNode *node = quicklistCreateNode(in_ql->m_container);
+        node->m_ql_LZF = _quicklistContainerNew(node->m_container);
+        _quicklistNodePush(node, in_value, in_size, QUICKLIST_TAIL);
 
         quicklistNodeUpdateSz(node);
         _quicklistInsertNodeAfter(in_ql, in_ql->m_tail_ql_node, node);
     }
     in_ql->m_count_total_entries++;
     in_ql->m_tail_ql_node->m_item_count++;
+    quicklistIndexNodeCount(in_ql, in_ql->m_tail_ql_node, 1);
     return (orig_tail != in_ql->m_tail_ql_node);
 }
 
@@ -544,7 +918,7 @@ int quicklistPushTail(quicklist *in_ql, void *in_value, const size_t in_size) {
  * to be retrieved later. */
 void quicklistAppendZiplist(quicklist *in_ql, unsigned char *in_ziplist)
 {
-    quicklistNode *node = quicklistCreateNode();
+    quicklistNode *node = quicklistCreateNode(QUICKLIST_NODE_CONTAINER_ZIPLIST);
 
     node->m_ql_LZF = in_ziplist;
     node->m_item_count = ziplistLen(node->m_ql_LZF);
@@ -554,6 +928,38 @@ void quicklistAppendZiplist(quicklist *in_ql, unsigned char *in_ziplist)
     in_ql->m_count_total_entries += node->m_item_count;
 }
 
+/* Create new node consisting of a pre-formed listpack, the listpack
+ * counterpart of quicklistAppendZiplist(). */
+void quicklistAppendListpack(quicklist *in_ql, unsigned char *in_listpack)
+{
+    quicklistNode *node = quicklistCreateNode(QUICKLIST_NODE_CONTAINER_LISTPACK);
+
+    node->m_ql_LZF = in_listpack;
+    node->m_item_count = lpLength(node->m_ql_LZF);
+    node->m_zip_list_size = lpBytes(in_listpack);
+
+    _quicklistInsertNodeAfter(in_ql, in_ql->m_tail_ql_node, node);
+    in_ql->m_count_total_entries += node->m_item_count;
+}
+
+/* Set the container used by the nodes of 'quicklist', converting the
+ * existing nodes when needed. The nodes are decompressed one at a time
+ * for the conversion and compressed again according to the list
+ * compress depth. */
+void quicklistSetContainer(quicklist *in_ql, int in_container)
+{
+    in_ql->m_container = in_container;
+    quicklistNode *node = in_ql->m_head_ql_node;
+    while (node) {
+        if (node->m_container != in_container) {
+            quicklist::quicklistDecompressNodeForUse(node);
+            _quicklistNodeConvert(node, in_container);
+            quicklistRecompressOnly(in_ql, node);
+        }
+        node = node->m_next_ql_node;
+    }
+}
+
 /* Append all values of ziplist 'zl' individually into 'quicklist'.
  *
  * This allows us to restore old RDB ziplists into new quicklists
@@ -600,6 +1006,7 @@ quicklist *quicklistCreateFromZiplist(int in_fill, int in_compress,
 
 REDIS_STATIC void __quicklistDelNode(quicklist *quicklist,
                                      quicklistNode *node) {
+    quicklistIndexNodeRemoved(quicklist, node);
     if (node->m_next_ql_node)
         node->m_next_ql_node->m_prev_ql_node = node->m_prev_ql_node;
     if (node->m_prev_ql_node)
@@ -613,15 +1020,19 @@ REDIS_STATIC void __quicklistDelNode(quicklist *quicklist,
         quicklist->m_head_ql_node = node->m_next_ql_node;
     }
 
+    /* Update the length first, so that __quicklistCompress() knows the
+     * exact number of nodes left. */
+    quicklist->m_num_ql_nodes--;
+    quicklist->m_count_total_entries -= node->m_item_count;
+
     /* If we deleted a node within our compress depth, we
      * now have compressed nodes needing to be decompressed. */
     __quicklistCompress(quicklist, NULL);
 
-    quicklist->m_count_total_entries -= node->m_item_count;
-
+    if (node->m_hot)
+        quicklist->m_hot_nodes--;
     zfree(node->m_ql_LZF);
     zfree(node);
-    quicklist->m_num_ql_nodes--;
 }
 
 /* Delete one entry from list given the node for the entry and a pointer
@@ -637,8 +1048,9 @@ REDIS_STATIC int quicklistDelIndex(quicklist *quicklist, quicklistNode *node,
 {
     int gone = 0;
 
-    node->m_ql_LZF = ziplistDelete(node->m_ql_LZF, p);
+    _quicklistNodeDelete(node, p);
     node->m_item_count--;
+    quicklistIndexNodeCount(quicklist, node, -1);
     if (node->m_item_count == 0) {
         gone = 1;
         __quicklistDelNode(quicklist, node);
@@ -658,6 +1070,7 @@ void quicklistIter::quicklistDelEntry(quicklistEntry *in_entry)
 {
     quicklistNode *prev = in_entry->m_node->m_prev_ql_node;
     quicklistNode *next = in_entry->m_node->m_next_ql_node;
+    quicklistIndexInvalidate(in_entry->m_quicklist);
     int deleted_node = quicklistDelIndex((quicklist *)in_entry->m_quicklist,
                                          in_entry->m_node, &in_entry->m_zip_list);
 
@@ -693,8 +1106,7 @@ int quicklistReplaceAtIndex(quicklist *in_ql, long in_index, void *in_data, int
     quicklistEntry entry;
     if (likely(entry.quicklistIndex(in_ql, in_index))) {
         /* quicklistIndex provides an uncompressed node */
-        entry.m_node->m_ql_LZF = ziplistDelete(entry.m_node->m_ql_LZF, &entry.m_zip_list);
-        entry.m_node->m_ql_LZF = ziplistInsert((unsigned char*)entry.m_node->m_ql_LZF, (unsigned char*)entry.m_zip_list, (unsigned char*)in_data, in_size);
+        _quicklistNodeReplace(entry.m_node, entry.m_zip_list, in_data, in_size);
         quicklistNodeUpdateSz(entry.m_node);
         quicklistCompress(in_ql, entry.m_node);
         return 1;
@@ -722,9 +1134,17 @@ REDIS_STATIC quicklistNode *_quicklistZiplistMerge(quicklist *in_ql,
 {
     D("Requested merge (a,b) (%u, %u)", in_a->m_item_count, in_b->m_item_count);
 
+    quicklistIndexInvalidate(in_ql);
     quicklist::quicklistDecompressNode(in_a);
     quicklist::quicklistDecompressNode(in_b);
-    if ((ziplistMerge(&in_a->m_ql_LZF, &in_b->m_ql_LZF))) {
+    if (in_a->m_container != in_b->m_container)
+        _quicklistNodeConvert(in_b, in_a->m_container);
+    unsigned char *merged;
+    if (nodeIsListpack(in_a))
+        merged = lpMerge(&in_a->m_ql_LZF, &in_b->m_ql_LZF);
+    else
+        merged = ziplistMerge(&in_a->m_ql_LZF, &in_b->m_ql_LZF);
+    if (merged) {
         /* We merged ziplists! Now remove the unused quicklistNode. */
         quicklistNode *keep = NULL, *nokeep = NULL;
         if (!in_a->m_ql_LZF) {
@@ -734,8 +1154,10 @@ REDIS_STATIC quicklistNode *_quicklistZiplistMerge(quicklist *in_ql,
             nokeep = in_b;
             keep = in_a;
         }
-        keep->m_item_count = ziplistLen(keep->m_ql_LZF);
+        keep->m_item_count = _quicklistNodeLen(keep);
         quicklistNodeUpdateSz(keep);
+        keep->m_recompress = 0; /* Prevent 'keep' from being recompressed if
+                                 * it becomes head or tail after merging. */
 
         nokeep->m_item_count = 0;
         __quicklistDelNode(in_ql, nokeep);
@@ -823,7 +1245,7 @@ REDIS_STATIC quicklistNode *_quicklistSplitNode(quicklistNode *in_node, int in_o
 {
     size_t zl_sz = in_node->m_zip_list_size;
 
-    quicklistNode *new_node = quicklistCreateNode();
+    quicklistNode *new_node = quicklistCreateNode(in_node->m_container);
     new_node->m_ql_LZF = (unsigned char*)zmalloc(zl_sz);
 
     /* Copy original ziplist so we can split it */
@@ -838,12 +1260,12 @@ REDIS_STATIC quicklistNode *_quicklistSplitNode(quicklistNode *in_node, int in_o
     D("After %d (%d); ranges: [%d, %d], [%d, %d]", in_after, in_offset, orig_start,
       orig_extent, new_start, new_extent);
 
-    in_node->m_ql_LZF = ziplistDeleteRange(in_node->m_ql_LZF, orig_start, orig_extent);
-    in_node->m_item_count = ziplistLen(in_node->m_ql_LZF);
+    _quicklistNodeDeleteRange(in_node, orig_start, orig_extent);
+    in_node->m_item_count = _quicklistNodeLen(in_node);
     quicklistNodeUpdateSz(in_node);
 
-    new_node->m_ql_LZF = ziplistDeleteRange(new_node->m_ql_LZF, new_start, new_extent);
-    new_node->m_item_count = ziplistLen(new_node->m_ql_LZF);
+    _quicklistNodeDeleteRange(new_node, new_start, new_extent);
+    new_node->m_item_count = _quicklistNodeLen(new_node);
     quicklistNodeUpdateSz(new_node);
 
     D("After split lengths: orig (%d), new (%d)", in_node->m_item_count, new_node->m_item_count);
@@ -862,11 +1284,14 @@ REDIS_STATIC void _quicklistInsert(quicklist *in_ql, quicklistEntry *in_entry,
     quicklistNode *node = in_entry->m_node;
     quicklistNode *new_node = NULL;
 
+    quicklistIndexInvalidate(in_ql);
+
     if (!node) {
         /* we have no reference node, so let's create only node in the list */
         D("No node given!");
-        new_node = quicklistCreateNode();
-        new_node->m_ql_LZF = ziplistPush((unsigned char *)ziplistNew(), (unsigned char *)in_value, in_size, ZIPLIST_HEAD);
+        new_node = quicklistCreateNode(in_ql->m_container);
+        new_node->m_ql_LZF = _quicklistContainerNew(new_node->m_container);
+        _quicklistNodePush(new_node, in_value, in_size, QUICKLIST_HEAD);
         __quicklistInsertNode(in_ql, NULL, new_node, in_after);
         new_node->m_item_count++;
         in_ql->m_count_total_entries++;
@@ -902,11 +1327,11 @@ REDIS_STATIC void _quicklistInsert(quicklist *in_ql, quicklistEntry *in_entry,
     if (!full && in_after) {
         D("Not full, inserting after current position.");
         quicklist::quicklistDecompressNodeForUse(node);
-        unsigned char *next = ziplistNext(node->m_ql_LZF, in_entry->m_zip_list);
+        unsigned char *next = _quicklistNodeNext(node, in_entry->m_zip_list);
         if (next == NULL) {
-            node->m_ql_LZF = ziplistPush((unsigned char *)node->m_ql_LZF, (unsigned char *)in_value, in_size, ZIPLIST_TAIL);
+            _quicklistNodePush(node, in_value, in_size, QUICKLIST_TAIL);
         } else {
-            node->m_ql_LZF = ziplistInsert((unsigned char*)node->m_ql_LZF, (unsigned char*)next,  (unsigned char*)in_value, in_size);
+            _quicklistNodeInsert(node, next, in_value, in_size);
         }
         node->m_item_count++;
         quicklistNodeUpdateSz(node);
@@ -914,7 +1339,7 @@ REDIS_STATIC void _quicklistInsert(quicklist *in_ql, quicklistEntry *in_entry,
     } else if (!full && !in_after) {
         D("Not full, inserting before current position.");
         quicklist::quicklistDecompressNodeForUse(node);
-        node->m_ql_LZF = ziplistInsert((unsigned char*)node->m_ql_LZF, (unsigned char*)in_entry->m_zip_list,  (unsigned char*)in_value, (unsigned int)in_size);
+        _quicklistNodeInsert(node, in_entry->m_zip_list, in_value, in_size);
         node->m_item_count++;
         quicklistNodeUpdateSz(node);
         quicklistRecompressOnly(in_ql, node);
@@ -924,7 +1349,7 @@ REDIS_STATIC void _quicklistInsert(quicklist *in_ql, quicklistEntry *in_entry,
         D("Full and tail, but next isn't full; inserting next node head");
         new_node = node->m_next_ql_node;
         quicklist::quicklistDecompressNodeForUse(new_node);
-        new_node->m_ql_LZF = ziplistPush((unsigned char *)new_node->m_ql_LZF, (unsigned char *)in_value, in_size, ZIPLIST_HEAD);
+        _quicklistNodePush(new_node, in_value, in_size, QUICKLIST_HEAD);
         new_node->m_item_count++;
         quicklistNodeUpdateSz(new_node);
         quicklistRecompressOnly(in_ql, new_node);
@@ -934,7 +1359,7 @@ REDIS_STATIC void _quicklistInsert(quicklist *in_ql, quicklistEntry *in_entry,
         D("Full and head, but prev isn't full, inserting prev node tail");
         new_node = node->m_prev_ql_node;
         quicklist::quicklistDecompressNodeForUse(new_node);
-        new_node->m_ql_LZF = ziplistPush((unsigned char *)new_node->m_ql_LZF, (unsigned char *)in_value, in_size, ZIPLIST_TAIL);
+        _quicklistNodePush(new_node, in_value, in_size, QUICKLIST_TAIL);
         new_node->m_item_count++;
         quicklistNodeUpdateSz(new_node);
         quicklistRecompressOnly(in_ql, new_node);
@@ -943,8 +1368,9 @@ REDIS_STATIC void _quicklistInsert(quicklist *in_ql, quicklistEntry *in_entry,
         /* If we are: full, and our prev/next is full, then:
          *   - create new node and attach to quicklist */
         D("\tprovisioning new node...");
-        new_node = quicklistCreateNode();
-        new_node->m_ql_LZF = ziplistPush((unsigned char *)ziplistNew(), (unsigned char *)in_value, in_size, ZIPLIST_HEAD);
+        new_node = quicklistCreateNode(in_ql->m_container);
+        new_node->m_ql_LZF = _quicklistContainerNew(new_node->m_container);
+        _quicklistNodePush(new_node, in_value, in_size, QUICKLIST_HEAD);
         new_node->m_item_count++;
         quicklistNodeUpdateSz(new_node);
         __quicklistInsertNode(in_ql, node, new_node, in_after);
@@ -954,8 +1380,8 @@ REDIS_STATIC void _quicklistInsert(quicklist *in_ql, quicklistEntry *in_entry,
         D("\tsplitting node...");
         quicklist::quicklistDecompressNodeForUse(node);
         new_node = _quicklistSplitNode(node, in_entry->m_offset, in_after);
-        new_node->m_ql_LZF = ziplistPush((unsigned char *)new_node->m_ql_LZF, (unsigned char *)in_value, in_size,
-                                   in_after ? ZIPLIST_HEAD : ZIPLIST_TAIL);
+        _quicklistNodePush(new_node, in_value, in_size,
+                           in_after ? QUICKLIST_HEAD : QUICKLIST_TAIL);
         new_node->m_item_count++;
         quicklistNodeUpdateSz(new_node);
         __quicklistInsertNode(in_ql, node, new_node, in_after);
@@ -1005,6 +1431,7 @@ int quicklistDelRange(quicklist *in_ql, const long in_start,
     D("Quicklist delete request for start %ld, count %ld, extent: %ld", in_start,
       in_count, extent);
     quicklistNode *node = entry.m_node;
+    quicklistIndexInvalidate(in_ql);
 
     /* iterate over next nodes until everything is deleted. */
     while (extent) {
@@ -1017,7 +1444,7 @@ int quicklistDelRange(quicklist *in_ql, const long in_start,
              * can just delete the entire node without ziplist math. */
             delete_entire_node = 1;
             del = node->m_item_count;
-        } else if (entry.m_offset >= 0 && extent >= node->m_item_count) {
+        } else if (entry.m_offset >= 0 && extent + entry.m_offset >= node->m_item_count) {
             /* If deleting more nodes after this one, calculate delete based
              * on size of current node. */
             del = node->m_item_count - entry.m_offset;
@@ -1048,7 +1475,7 @@ int quicklistDelRange(quicklist *in_ql, const long in_start,
             __quicklistDelNode(in_ql, node);
         } else {
             quicklist::quicklistDecompressNodeForUse(node);
-            node->m_ql_LZF = ziplistDeleteRange(node->m_ql_LZF, entry.m_offset, del);
+            _quicklistNodeDeleteRange(node, entry.m_offset, del);
             quicklistNodeUpdateSz(node);
             node->m_item_count -= del;
             in_ql->m_count_total_entries -= del;
@@ -1066,10 +1493,13 @@ int quicklistDelRange(quicklist *in_ql, const long in_start,
     return 1;
 }
 
-/* Passthrough to ziplistCompare() */
-int quicklistCompare(unsigned char *in_p1, unsigned char *in_p2, int in_p2_len)
+/* Compare the element of 'entry' with the string 'p2' of length 'p2_len'
+ * using the container of the entry node. */
+int quicklistCompare(const quicklistEntry *in_entry, unsigned char *in_p2, int in_p2_len)
 {
-    return ziplistCompare(in_p1, in_p2, in_p2_len);
+    if (nodeIsListpack(in_entry->m_node))
+        return lpCompare(in_entry->m_zip_list, in_p2, in_p2_len);
+    return ziplistCompare(in_entry->m_zip_list, in_p2, in_p2_len);
 }
 
 /* Returns a quicklist iterator 'iter'. After the initialization every
@@ -1166,24 +1596,19 @@ int quicklistIter::quicklistNext(quicklistEntry& entry)
         return 0;
     }
 
-    unsigned char *(*nextFn)(unsigned char *, unsigned char *) = NULL;
-    int offset_update = 0;
-
     if (!m_zip_list) {
         /* If !zi, use current index. */
         quicklist::quicklistDecompressNodeForUse(m_current);
-        m_zip_list = ziplistIndex(m_current->m_ql_LZF, m_offset);
+        m_zip_list = _quicklistNodeIndex(m_current, m_offset);
     } else {
         /* else, use existing iterator offset and get prev/next as necessary. */
         if (m_direction == AL_START_HEAD) {
-            nextFn = ziplistNext;
-            offset_update = 1;
+            m_zip_list = _quicklistNodeNext(m_current, m_zip_list);
+            m_offset += 1;
         } else if (m_direction == AL_START_TAIL) {
-            nextFn = ziplistPrev;
-            offset_update = -1;
+            m_zip_list = _quicklistNodePrev(m_current, m_zip_list);
+            m_offset -= 1;
         }
-        m_zip_list = nextFn(m_current->m_ql_LZF, m_zip_list);
-        m_offset += offset_update;
     }
 
     entry.m_zip_list = m_zip_list;
@@ -1191,7 +1616,7 @@ int quicklistIter::quicklistNext(quicklistEntry& entry)
 
     if (m_zip_list) {
         /* Populate value from existing ziplist position */
-        ziplistGet(entry.m_zip_list, &entry.m_value, &entry.m_size, &entry.m_longval);
+        _quicklistNodeGet(m_current, entry.m_zip_list, &entry.m_value, &entry.m_size, &entry.m_longval);
         return 1;
     } else {
        /* We ran out of ziplist entries.
@@ -1213,6 +1638,36 @@ int quicklistIter::quicklistNext(quicklistEntry& entry)
     }
 }
 
+/* Forget the position inside the current node, so that it can be
+ * compressed and decompressed again before the next call to
+ * quicklistNext(), that returns the element following the last one
+ * returned. The list must not be modified meanwhile. */
+void quicklistIter::quicklistSuspend()
+{
+    if (!m_current || !m_zip_list) return;
+
+    long count = m_current->m_item_count;
+    long offset = m_offset < 0 ? count+m_offset : m_offset;
+
+    quicklistCompress(m_quicklist, m_current);
+    m_zip_list = NULL;
+    if (m_direction == AL_START_HEAD) {
+        if (++offset < count) {
+            m_offset = offset;
+        } else {
+            m_current = m_current->m_next_ql_node;
+            m_offset = 0;
+        }
+    } else {
+        if (--offset >= 0) {
+            m_offset = offset;
+        } else {
+            m_current = m_current->m_prev_ql_node;
+            m_offset = -1;
+        }
+    }
+}
+
 /* Duplicate the quicklist.
  * On success a copy of the original quicklist is returned.
  *
@@ -1223,10 +1678,11 @@ quicklist *quicklistDup(quicklist *in_orig) {
     quicklist *copy;
 
     copy = quicklistNew(in_orig->m_fill_factor, in_orig->m_compress_depth);
+    copy->m_container = in_orig->m_container;
 
     for (quicklistNode *current = in_orig->m_head_ql_node; current;
          current = current->m_next_ql_node) {
-        quicklistNode *node = quicklistCreateNode();
+        quicklistNode *node = quicklistCreateNode(current->m_container);
 
         if (current->m_encoding == QUICKLIST_NODE_ENCODING_LZF) {
             quicklistLZF *lzf = (quicklistLZF *)current->m_ql_LZF;
@@ -1279,6 +1735,18 @@ int quicklistEntry::quicklistIndex(const quicklist *in_ql, const long long idx)
     if (index >= in_ql->m_count_total_entries)
         return 0;
 
+    /* Long lists find the node with their index, see quicklistIndexFind(),
+     * that counts from the head. */
+    if ((n = quicklistIndexFind(in_ql, forward ? index :
+                                in_ql->m_count_total_entries-1-index,
+                                &accum)) != NULL)
+    {
+        if (!forward)
+            accum = in_ql->m_count_total_entries-accum-n->m_item_count;
+    } else {
+        n = forward ? in_ql->m_head_ql_node : in_ql->m_tail_ql_node;
+    }
+
     while (likely(n)) {
         if ((accum + n->m_item_count) > index) {
             break;
@@ -1307,8 +1775,8 @@ int quicklistEntry::quicklistIndex(const quicklist *in_ql, const long long idx)
     }
 
     quicklist::quicklistDecompressNodeForUse(m_node);
-    m_zip_list = ziplistIndex(m_node->m_ql_LZF, m_offset);
-    ziplistGet(m_zip_list, &m_value, &m_size, &m_longval);
+    m_zip_list = _quicklistNodeIndex(m_node, m_offset);
+    _quicklistNodeGet(m_node, m_zip_list, &m_value, &m_size, &m_longval);
     /* The caller will use our result, so we don't re-compress here.
      * The caller can recompress or delete the node as needed. */
     return 1;
@@ -1325,12 +1793,12 @@ void quicklistRotate(quicklist *in_ql) {
         return;
 
     /* First, get the tail entry */
-    unsigned char *p = ziplistIndex(in_ql->m_tail_ql_node->m_ql_LZF, -1);
+    unsigned char *p = _quicklistNodeIndex(in_ql->m_tail_ql_node, -1);
     unsigned char *value;
     long long longval;
     unsigned int sz;
     char longstr[32] = {0};
-    ziplistGet(p, &value, &sz, &longval);
+    _quicklistNodeGet(in_ql->m_tail_ql_node, p, &value, &sz, &longval);
 
     /* If value found is NULL, then ziplistGet populated longval instead */
     if (!value) {
@@ -1346,7 +1814,7 @@ void quicklistRotate(quicklist *in_ql) {
      * tail ziplist and PushHead() could have reallocated our single ziplist,
      * which would make our pre-existing 'p' unusable. */
     if (in_ql->m_num_ql_nodes == 1) {
-        p = ziplistIndex(in_ql->m_tail_ql_node->m_ql_LZF, -1);
+        p = _quicklistNodeIndex(in_ql->m_tail_ql_node, -1);
     }
 
     /* Remove tail entry. */
@@ -1390,8 +1858,8 @@ int quicklistPopCustom(quicklist *in_ql, int in_where, unsigned char **in_data,
         return 0;
     }
 
-    p = ziplistIndex(node->m_ql_LZF, pos);
-    if (ziplistGet(p, &vstr, &vlen, &vlong)) {
+    p = _quicklistNodeIndex(node, pos);
+    if (_quicklistNodeGet(node, p, &vstr, &vlen, &vlong)) {
         if (vstr) {
             if (in_data)
                 *in_data = (unsigned char *)in_saver(vstr, vlen);
@@ -1650,6 +2118,45 @@ static char *genstr(char *prefix, int i) {
 }
 
 /* main test, but callable from other files */
+/* Compare the push, index and pop throughput of the two node containers
+ * with 'count' small string elements at the default fill factor. */
+static void quicklistBenchmarkContainers(int count) {
+    int containers[] = {QUICKLIST_NODE_CONTAINER_ZIPLIST,
+                        QUICKLIST_NODE_CONTAINER_LISTPACK};
+    const char *names[] = {"ziplist", "listpack"};
+
+    for (int c = 0; c < 2; c++) {
+        quicklist *ql = quicklistNew(-2, 0);
+        quicklistSetContainer(ql, containers[c]);
+
+        long long start = ustime();
+        for (int i = 0; i < count; i++) {
+            char *s = genstr("hello", i);
+            quicklistPushTail(ql, s, strlen(s));
+        }
+        long long push = ustime() - start;
+
+        start = ustime();
+        for (int i = 0; i < count; i++) {
+            quicklistEntry entry;
+            entry.quicklistIndex(ql, (i * 7919LL) % count);
+        }
+        long long index = ustime() - start;
+
+        start = ustime();
+        unsigned char *data;
+        unsigned int sz;
+        long long lv;
+        while (quicklistPop(ql, QUICKLIST_HEAD, &data, &sz, &lv))
+            zfree(data);
+        long long pop = ustime() - start;
+
+        printf("%-8s %d elements: push %lld us, index %lld us, pop %lld us\n",
+               names[c], count, push, index, pop);
+        quicklistRelease(ql);
+    }
+}
+
 int quicklistTest(int argc, char *argv[]) {
     UNUSED(argc);
     UNUSED(argv);
@@ -2670,6 +3177,9 @@ int quicklistTest(int argc, char *argv[]) {
     printf("Compressions: %0.2f seconds.\n", (float)(stop - start) / 1000);
     printf("\n");
 
+    quicklistBenchmarkContainers(100000);
+    printf("\n");
+
     if (!err)
         printf("ALL TESTS PASSED!\n");
     else
@@ -33,14 +33,17 @@
 
 /* Node, quicklist, and Iterator are the only data structures used currently. */
 
-/* quicklistNode is a 32 byte struct describing a ziplist for a quicklist.
- * We use bit fields keep the quicklistNode at 32 bytes.
+/* quicklistNode is a 32 byte struct describing a ziplist or a listpack for a
+ * quicklist. We use bit fields keep the quicklistNode at 32 bytes.
  * m_count_items: 16 bits, max 65536 (max zl bytes is 65k, so max count actually < 32k).
  * encoding: 2 bits, RAW=1, LZF=2.
- * m_container: 2 bits, NONE=1, ZIPLIST=2.
+ * m_container: 2 bits, NONE=1, ZIPLIST=2, LISTPACK=3.
  * m_recompress: 1 bit, bool, true if node is temporary decompressed for usage.
  * m_attempted_compress: 1 bit, boolean, used for verifying during testing.
- * m_extra: 12 bits, free for future use; pads out the remainder of 32 bits */
+ * m_incompressible: 1 bit, bool, true if LZF failed on the current content.
+ * m_hot: 1 bit, bool, true if kept decompressed as a hot node.
+ * m_hits: 4 bits, times the node was decompressed for use, saturating.
+ * m_extra: 4 bits, free for future use; pads out the remainder of 32 bits */
 class quicklistNode
 {
 public:
@@ -55,10 +58,13 @@ public:
     unsigned int m_zip_list_size;             /* ziplist size in bytes */
     unsigned int m_item_count : 16;     /* count of items in ziplist */
     unsigned int m_encoding : 2;   /* RAW==1 or LZF==2 */
-    unsigned int m_container : 2;  /* NONE==1 or ZIPLIST==2 */
+    unsigned int m_container : 2;  /* NONE==1, ZIPLIST==2 or LISTPACK==3 */
     unsigned int m_recompress : 1; /* was this node previous compressed? */
     unsigned int m_attempted_compress : 1; /* node can't compress; too small */
-    unsigned int m_extra : 10; /* more bits to steal for future usage */
+    unsigned int m_incompressible : 1; /* LZF failed, until next change */
+    unsigned int m_hot : 1;        /* kept decompressed, see m_hot_nodes */
+    unsigned int m_hits : 4;       /* decompressions for use, saturating */
+    unsigned int m_extra : 4; /* more bits to steal for future usage */
 };
 
 /* quicklistLZF is a 4+N byte struct holding 'sz' followed by 'compressed'.
@@ -72,18 +78,36 @@ struct quicklistLZF
     char m_compressed[];
 };
 
-/* quicklist is a 40 byte struct (on 64-bit systems) describing a quicklist.
+/* Index of the nodes of a long quicklist, see quicklistIndexFind(). The
+ * nodes are in order in 'm_nodes[m_lo..m_hi-1]', with free slots at both
+ * ends for the nodes created by pushes, and 'm_tree' is a Fenwick tree of
+ * the number of entries of every slot. */
+struct quicklistNodeIndex
+{
+    quicklistNode **m_nodes;
+    unsigned long *m_counts;    /* Entries of every slot. */
+    unsigned long *m_tree;      /* 1-based Fenwick tree of 'm_counts'. */
+    unsigned long m_capacity;
+    unsigned long m_lo, m_hi;
+};
+
+/* quicklist is a 48 byte struct (on 64-bit systems) describing a quicklist.
  * 'm_count_total_entries' is the number of total entries.
  * 'm_num_ql_nodes' is the number of quicklist nodes.
  * 'compress' is: -1 if compression disabled, otherwise it's the number
  *                of quicklistNodes to leave uncompressed at ends of quicklist.
- * 'm_fill_factor' is the user-requested (or default) fill factor. */
+ * 'm_fill_factor' is the user-requested (or default) fill factor.
+ * 'm_container' is the container of all the nodes, ZIPLIST or LISTPACK.
+ * 'm_hot_nodes' is the number of interior nodes accessed often enough to be
+ *               kept decompressed, at most QUICKLIST_HOT_NODES.
+ * 'm_index' is the node index of long quicklists, built when an entry is
+ *           looked up by position, or NULL. */
 class quicklist
 {
 public:
     static void quicklistDecompressNode(quicklistNode* in_node);
     static void quicklistDecompressNodeForUse(quicklistNode* in_node);
-    static void quicklistCompressNode(quicklistNode* in_node);
+    static void quicklistCompressNode(const quicklist *in_ql, quicklistNode* in_node);
 
     quicklistNode *m_head_ql_node;
     quicklistNode *m_tail_ql_node;
@@ -91,6 +115,9 @@ public:
     unsigned long m_num_ql_nodes;          /* number of quicklistNodes */
     int m_fill_factor : 16;              /* fill factor for individual nodes */
     unsigned int m_compress_depth : 16; /* depth of end nodes not to compress;0=off */
+    int m_container : 16;               /* container of every node */
+    mutable unsigned int m_hot_nodes : 16; /* nodes kept decompressed */
+    mutable quicklistNodeIndex *m_index; /* NULL when not built or stale */
 };
 
 class quicklistEntry;
@@ -101,6 +128,7 @@ public:
     quicklistIter(const quicklist *in_ql, int in_direction);
     ~quicklistIter();
     int quicklistNext(quicklistEntry& entry);
+    void quicklistSuspend();
     void quicklistDelEntry(quicklistEntry *in_entry);
 
 private:
@@ -142,6 +170,12 @@ public:
 /* quicklist container formats */
 #define QUICKLIST_NODE_CONTAINER_NONE 1
 #define QUICKLIST_NODE_CONTAINER_ZIPLIST 2
+#define QUICKLIST_NODE_CONTAINER_LISTPACK 3
+
+/* An interior node decompressed for use QUICKLIST_HOT_HITS times is kept
+ * decompressed after use, for at most QUICKLIST_HOT_NODES nodes per list. */
+#define QUICKLIST_HOT_HITS 4
+#define QUICKLIST_HOT_NODES 8
 
 #define quicklistNodeIsCompressed(node)                                        \
     ((node)->m_encoding == QUICKLIST_NODE_ENCODING_LZF)
@@ -152,11 +186,14 @@ quicklist *quicklistNew(int in_fill, int in_compress);
 void quicklistSetCompressDepth(quicklist *in_ql, int in_depth);
 void quicklistSetFill(quicklist *in_ql, int in_fill);
 void quicklistSetOptions(quicklist *in_ql, int in_fill, int in_depth);
+void quicklistSetContainer(quicklist *in_ql, int in_container);
 void quicklistRelease(quicklist *in_ql);
+void quicklistDropIndex(quicklist *in_ql);
 int quicklistPushHead(quicklist *in_ql, void *in_value, const size_t in_size);
 int quicklistPushTail(quicklist *in_ql, void *in_value, const size_t in_size);
 void quicklistPush(quicklist *in_ql, void *in_value, const size_t in_size, int in_where);
 void quicklistAppendZiplist(quicklist *in_ql, unsigned char *in_ziplist);
+void quicklistAppendListpack(quicklist *in_ql, unsigned char *in_listpack);
 quicklist *quicklistAppendValuesFromZiplist(quicklist *in_ql, unsigned char *in_ziplist);
 quicklist *quicklistCreateFromZiplist(int in_fill, int in_compress, unsigned char *in_ziplist);
 void quicklistInsertAfter(quicklist *in_ql, quicklistEntry *in_node, void *in_value, const size_t in_size);
@@ -176,7 +213,7 @@ int quicklistPopCustom(quicklist *in_ql, int in_where, unsigned char **in_data,
 int quicklistPop(quicklist *in_ql, int in_where, unsigned char **in_data,
                  unsigned int *in_size, long long *in_slong);
 unsigned long quicklistCount(const quicklist *in_ql);
-int quicklistCompare(unsigned char *in_p1, unsigned char *in_p2, int in_p2_len);
+int quicklistCompare(const quicklistEntry *in_entry, unsigned char *in_p2, int in_p2_len);
 size_t quicklistGetLzf(const quicklistNode *in_node, void **in_data);
 
 #ifdef REDIS_TEST
@@ -65,7 +65,9 @@
 		return (v);
 #define HI_BIT	(1L << (2 * N - 1))
 
-static uint32_t x[3] = { X0, X1, X2 }, a[3] = { A0, A1, A2 }, c = C;
+/* Every thread has its own sequence, so that the read only scripts executed
+ * by the I/O threads, see lua-parallel-scripts, don't share the state. */
+static __thread uint32_t x[3] = { X0, X1, X2 }, a[3] = { A0, A1, A2 }, c = C;
 static void next();
 
 int32_t redisLrand48() {
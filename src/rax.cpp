@@ -42,6 +42,13 @@
 
 #include rax_malloc_INCLUDE
 
+/* The children of the nodes with many edges are searched 16 bytes at a
+ * time with SSE2, that every x86_64 CPU has. */
+#if defined(__SSE2__)
+#define HAVE_RAX_SSE2 1
+#include <emmintrin.h>
+#endif
+
 /* This is a special pointer that is guaranteed to never have the same value
  * of a radix tree node. It's used in order to report "not found" error without
  * requiring the function to have multiple return values. */
@@ -174,12 +181,67 @@ rax *raxNew() {
     (((n)->iskey && !(n)->isnull)*sizeof(void*)) \
 )
 
+/* Resize the node 'n' to 'newlen' bytes. Nodes grow and shrink by one edge
+ * at a time, so when the allocator can tell the real size of an allocation,
+ * that is rounded to its size class, the node is left where it is if it
+ * still fits. It is shrunk only when it would use less than half of the
+ * allocation, so that adding and removing a child does not realloc back
+ * and forth. On out of memory NULL is returned and 'n' is still valid. */
+static raxNode *raxResizeNode(raxNode *n, size_t newlen) {
+#ifdef rax_malloc_size
+    size_t alloclen = rax_malloc_size(n);
+    if (newlen <= alloclen && newlen*2 > alloclen) return n;
+#endif
+    return (raxNode *)rax_realloc(n,newlen);
+}
+
+/* Return the index of the edge 'c' among the 'size' edges 'v' of a non
+ * compressed node, or 'size' if there is no such edge. */
+static inline int raxFindEdge(unsigned char *v, int size, unsigned char c) {
+    int j = 0;
+
+#if defined(HAVE_RAX_SSE2)
+    __m128i needle = _mm_set1_epi8((char)c);
+    for (; j+16 <= size; j += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(v+j));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk,needle));
+        if (mask) return j+__builtin_ctz(mask);
+    }
+#endif
+    for (; j < size; j++) {
+        if (v[j] == c) break;
+    }
+    return j;
+}
+
+/* Return the position of the first of the 'size' sorted edges 'v' greater
+ * than 'c', that is where an edge 'c' should be inserted. */
+static inline int raxEdgeInsertPos(unsigned char *v, int size, unsigned char c) {
+    int j = 0;
+
+#if defined(HAVE_RAX_SSE2)
+    /* SSE2 only compares signed bytes: flipping the sign bit of both
+     * sides gives the unsigned order. */
+    __m128i bias = _mm_set1_epi8((char)0x80);
+    __m128i needle = _mm_set1_epi8((char)(c^0x80));
+    for (; j+16 <= size; j += 16) {
+        __m128i chunk = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(v+j)),bias);
+        int mask = _mm_movemask_epi8(_mm_cmpgt_epi8(chunk,needle));
+        if (mask) return j+__builtin_ctz(mask);
+    }
+#endif
+    for (; j < size; j++) {
+        if (v[j] > c) break;
+    }
+    return j;
+}
+
 /* realloc the node to make room for auxiliary data in order
  * to store an item in that node. On out of memory NULL is returned. */
 raxNode *raxReallocForData(raxNode *n, void *data) {
     if (data == NULL) return n; /* No reallocation needed, setting isnull=1 */
     size_t curlen = raxNodeCurrentLength(n);
-    return (raxNode *)rax_realloc(n,curlen+sizeof(void*));
+    return raxResizeNode(n,curlen+sizeof(void*));
 }
 
 /* Set the node auxiliary data to the specified pointer. */
@@ -228,7 +290,7 @@ raxNode *raxAddChild(raxNode *n, unsigned char c, raxNode **childptr, raxNode **
     /* Make space in the original node. */
     if (n->iskey) curlen += sizeof(void*);
     newlen = curlen+sizeof(raxNode*)+1; /* Add 1 char and 1 pointer. */
-    raxNode *newn = (raxNode *)rax_realloc(n,newlen);
+    raxNode *newn = raxResizeNode(n,newlen);
     if (newn == NULL) {
         rax_free(child);
         return NULL;
@@ -243,10 +305,7 @@ raxNode *raxAddChild(raxNode *n, unsigned char c, raxNode **childptr, raxNode **
      *
      * Let's find where to insert the new child in order to make sure
      * it is inserted in-place lexicographically. */
-    int pos;
-    for (pos = 0; pos < n->size; pos++) {
-        if (n->data[pos] > c) break;
-    }
+    int pos = raxEdgeInsertPos(n->data,n->size,c);
 
     /* Now, if present, move auxiliary data pointer at the end
      * so that we can mess with the other data without overwriting it.
@@ -326,7 +385,7 @@ raxNode *raxCompressNode(raxNode *n, unsigned char *s, size_t len, raxNode **chi
         data = raxGetData(n); /* To restore it later. */
         if (!n->isnull) newsize += sizeof(void*);
     }
-    raxNode *newn = (raxNode *)rax_realloc(n,newsize);
+    raxNode *newn = raxResizeNode(n,newsize);
     if (newn == NULL) {
         rax_free(*child);
         return NULL;
@@ -376,12 +435,11 @@ static inline size_t raxLowWalk(rax *rax, unsigned char *s, size_t len, raxNode
             }
             if (j != h->size) break;
         } else {
-            /* Even when h->size is large, linear scan provides good
-             * performances compared to other approaches that are in theory
-             * more sounding, like performing a binary search. */
-            for (j = 0; j < h->size; j++) {
-                if (v[j] == s[i]) break;
-            }
+            /* Even when h->size is large, a linear scan, that is vectorized
+             * for the wide nodes, provides good performances compared to
+             * other approaches that are in theory more sounding, like
+             * performing a binary search. */
+            j = raxFindEdge(v,h->size,s[i]);
             if (j == h->size) break;
             i++;
         }
@@ -806,6 +864,40 @@ void *raxFind(rax *rax, unsigned char *s, size_t len) {
     return raxGetData(h);
 }
 
+/* Call 'callback' for every key of the rax that is a prefix of the string
+ * 's' of size 'len', including the empty key and 's' itself, in order of
+ * increasing length. The callback receives the data associated with the key,
+ * the key length and 'privdata'. The cost only depends on 'len', not on the
+ * number of keys. Returns the number of keys found. */
+size_t raxFindPrefixes(rax *rax, unsigned char *s, size_t len, void (*callback)(void *data, size_t keylen, void *privdata), void *privdata) {
+    raxNode *h = rax->head;
+    size_t i = 0, found = 0;
+
+    while(1) {
+        if (h->iskey) {
+            callback(raxGetData(h),i,privdata);
+            found++;
+        }
+        if (h->size == 0 || i == len) break;
+
+        raxNode **children = raxNodeFirstChildPtr(h);
+        size_t j = 0;
+        if (h->iscompr) {
+            /* Keys never end in the middle of a compressed node. */
+            if (h->size > len-i || memcmp(h->data,s+i,h->size) != 0) break;
+            i += h->size;
+        } else {
+            for (j = 0; j < h->size; j++) {
+                if (h->data[j] == s[i]) break;
+            }
+            if (j == h->size) break;
+            i++;
+        }
+        memcpy(&h,children+j,sizeof(h));
+    }
+    return found;
+}
+
 /* Return the memory address where the 'parent' node stores the specified
  * 'child' pointer, so that the caller can update the pointer with another
  * one if needed. The function assumes it will find a match, otherwise the
@@ -872,14 +964,15 @@ raxNode *raxRemoveChild(raxNode *parent, raxNode *child) {
     memmove(((char*)cp)-1,cp,(parent->size-taillen-1)*sizeof(raxNode**));
 
     /* Move the remaining "tail" pointer at the right position as well. */
-    memmove(((char*)c)-1,c+1,taillen*sizeof(raxNode**)+parent->iskey*sizeof(void*));
+    memmove(((char*)c)-1,c+1,taillen*sizeof(raxNode**)+
+            (parent->iskey && !parent->isnull)*sizeof(void*));
 
     /* 4. Update size. */
     parent->size--;
 
     /* realloc the node according to the theoretical memory usage, to free
      * data if we are over-allocating right now. */
-    raxNode *newnode = (raxNode *)rax_realloc(parent,raxNodeCurrentLength(parent));
+    raxNode *newnode = raxResizeNode(parent,raxNodeCurrentLength(parent));
     if (newnode) {
         debugnode("raxRemoveChild after", newnode);
     }
@@ -1091,27 +1184,188 @@ int raxRemove(rax *rax, unsigned char *s, size_t len, void **old) {
 
 /* This is the core of raxFree(): performs a depth-first scan of the
  * tree and releases all the nodes found. */
-void raxRecursiveFree(rax *rax, raxNode *n) {
+void raxRecursiveFree(rax *rax, raxNode *n, void (*free_callback)(void*)) {
     int numchildren = n->iscompr ? 1 : n->size;
     raxNode **cp = raxNodeLastChildPtr(n);
     while(numchildren--) {
         raxNode *child;
         memcpy(&child,cp,sizeof(child));
-        raxRecursiveFree(rax,child);
+        raxRecursiveFree(rax,child,free_callback);
         cp--;
     }
     debugnode("free depth-first",n);
+    if (free_callback && n->iskey && !n->isnull)
+        free_callback(raxGetData(n));
     rax_free(n);
     rax->numnodes--;
 }
 
-/* Free a whole radix tree. */
-void raxFree(rax *rax) {
-    raxRecursiveFree(rax,rax->head);
+/* Free a whole radix tree, calling the specified callback in order to
+ * free the auxiliary data. */
+void raxFreeWithCallback(rax *rax, void (*free_callback)(void*)) {
+    raxRecursiveFree(rax,rax->head,free_callback);
     assert(rax->numnodes == 0);
     rax_free(rax);
 }
 
+/* Free a whole radix tree. */
+void raxFree(rax *rax) {
+    raxFreeWithCallback(rax,NULL);
+}
+
+/* This is the core of raxNewFromSorted(): build the node reached by the
+ * first 'depth' bytes of the sorted keys from 'lo' to 'hi' (excluded), that
+ * all share them, and the nodes below it. The nodes are the same that
+ * inserting the keys one after the other would create, but every node is
+ * allocated once with its final size. On out of memory NULL is returned. */
+static raxNode *raxBuildNode(rax *rax, unsigned char **keys, size_t *lens,
+                             void **data, size_t lo, size_t hi, size_t depth)
+{
+    int iskey = 0;
+    void *keydata = NULL;
+    raxNode *n, *child;
+
+    /* Being sorted, only the first key can end here. */
+    if (lo < hi && lens[lo] == depth) {
+        iskey = 1;
+        keydata = data ? data[lo] : NULL;
+        lo++;
+    }
+
+    /* The bytes all the keys share become a compressed node. */
+    size_t common = 0;
+    if (lo < hi) {
+        size_t minlen = lens[lo] < lens[hi-1] ? lens[lo] : lens[hi-1];
+        while (depth+common < minlen && common < RAX_NODE_MAX_SIZE &&
+               keys[lo][depth+common] == keys[hi-1][depth+common]) common++;
+    }
+
+    if (lo == hi) {
+        n = raxNewNode(0,iskey && keydata);
+        if (n == NULL) return NULL;
+    } else if (common > 1) {
+        size_t nodesize = sizeof(raxNode)+common+sizeof(raxNode*);
+        if (iskey && keydata) nodesize += sizeof(void*);
+        n = (raxNode *)rax_malloc(nodesize);
+        if (n == NULL) return NULL;
+        n->iskey = 0;
+        n->isnull = 0;
+        n->iscompr = 1;
+        n->size = common;
+        memcpy(n->data,keys[lo]+depth,common);
+        child = raxBuildNode(rax,keys,lens,data,lo,hi,depth+common);
+        if (child == NULL) {
+            rax_free(n);
+            return NULL;
+        }
+        memcpy(raxNodeFirstChildPtr(n),&child,sizeof(child));
+    } else {
+        /* One child for every distinct byte at 'depth': the keys with the
+         * same byte are contiguous. */
+        size_t children = 0, j, start;
+        for (j = lo; j < hi; j++)
+            if (j == lo || keys[j][depth] != keys[j-1][depth]) children++;
+
+        n = raxNewNode(children,iskey && keydata);
+        if (n == NULL) return NULL;
+        raxNode **cp = raxNodeFirstChildPtr(n);
+        int pos = 0;
+        for (start = lo; start < hi; start = j) {
+            for (j = start+1; j < hi && keys[j][depth] == keys[start][depth]; j++);
+            child = raxBuildNode(rax,keys,lens,data,start,j,depth+1);
+            if (child == NULL) {
+                while (pos--) {
+                    memcpy(&child,cp+pos,sizeof(child));
+                    raxRecursiveFree(rax,child,NULL);
+                }
+                rax_free(n);
+                return NULL;
+            }
+            n->data[pos] = keys[start][depth];
+            memcpy(cp+pos,&child,sizeof(child));
+            pos++;
+        }
+    }
+    if (iskey) raxSetData(n,keydata);
+    rax->numnodes++;
+    return n;
+}
+
+/* Create a radix tree with the 'count' keys 'keys' of lengths 'lens',
+ * that must be sorted in ascending order without duplicates, associating
+ * with every key the element of the same index of 'data', or NULL if
+ * 'data' is NULL. This is much faster than inserting the keys one after
+ * the other, since every node is allocated once instead of being split and
+ * reallocated: it is used when loading from RDB the structures that are
+ * serialized in the order of their keys.
+ *
+ * If the keys are not sorted NULL is returned and errno is set to EINVAL.
+ * On out of memory NULL is returned and errno is set to ENOMEM. */
+rax *raxNewFromSorted(unsigned char **keys, size_t *lens, void **data, size_t count) {
+    for (size_t j = 1; j < count; j++) {
+        size_t minlen = lens[j-1] < lens[j] ? lens[j-1] : lens[j];
+        int cmp = memcmp(keys[j-1],keys[j],minlen);
+        if (cmp > 0 || (cmp == 0 && lens[j-1] >= lens[j])) {
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+
+    rax *_rax = (rax *)rax_malloc(sizeof(rax));
+    if (_rax == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    _rax->numele = count;
+    _rax->numnodes = 0;
+    _rax->head = raxBuildNode(_rax,keys,lens,data,0,count,0);
+    if (_rax->head == NULL) {
+        rax_free(_rax);
+        errno = ENOMEM;
+        return NULL;
+    }
+    errno = 0;
+    return _rax;
+}
+
+/* This is the core of raxRelocate(): performs a depth-first scan of the
+ * tree starting at the node referenced by 'link', updating the references
+ * to the nodes and to the data the callbacks relocated. */
+uint64_t raxRecursiveRelocate(raxNode **link, void *(*node_callback)(void*), void *(*data_callback)(void*,void*), void *privdata) {
+    raxNode *n, *newn;
+    uint64_t moved = 0;
+    memcpy(&n,link,sizeof(n));
+    if ((newn = (raxNode*)node_callback(n)) != NULL) {
+        memcpy(link,&newn,sizeof(newn));
+        n = newn;
+        moved++;
+    }
+    if (data_callback && n->iskey && !n->isnull) {
+        void *newdata = data_callback(raxGetData(n),privdata);
+        if (newdata) {
+            raxSetData(n,newdata);
+            moved++;
+        }
+    }
+    int numchildren = n->iscompr ? 1 : n->size;
+    raxNode **cp = raxNodeFirstChildPtr(n);
+    while(numchildren--) {
+        moved += raxRecursiveRelocate(cp,node_callback,data_callback,privdata);
+        cp++;
+    }
+    return moved;
+}
+
+/* Call 'node_callback' for every node of the radix tree, and 'data_callback'
+ * (if not NULL) for the data associated with every key. When a callback
+ * returns a non NULL pointer the node or the data was moved to the new
+ * address, and the tree is updated to reference it. This is used by the
+ * active defragmentation to relocate the allocations of a tree without
+ * rebuilding it. Returns the number of references updated. */
+uint64_t raxRelocate(rax *rax, void *(*node_callback)(void*), void *(*data_callback)(void*,void*), void *privdata) {
+    return raxRecursiveRelocate(&rax->head,node_callback,data_callback,privdata);
+}
+
 /* ------------------------------- Iterator --------------------------------- */
 
 /* Initialize a Rax iterator. This call should be performed a single time
@@ -1410,6 +1664,7 @@ int raxSeek(raxIterator *it, const char *op, unsigned char *ele, size_t len) {
         it->node = it->rt->head;
         if (!raxSeekGreatest(it)) return 0;
         assert(it->node->iskey);
+        it->data = raxGetData(it->node);
         return 1;
     }
 
@@ -1428,6 +1683,7 @@ int raxSeek(raxIterator *it, const char *op, unsigned char *ele, size_t len) {
         /* We found our node, since the key matches and we have an
          * "equal" condition. */
         if (!raxIteratorAddChars(it,ele,len)) return 0; /* OOM. */
+        it->data = raxGetData(it->node);
     } else if (lt || gt) {
         /* Exact key not found or eq flag not set. We have to set as current
          * key the one represented by the node we stopped at, and perform
@@ -1500,6 +1756,7 @@ int raxSeek(raxIterator *it, const char *op, unsigned char *ele, size_t len) {
                  * the previous sub-tree. */
                 if (nodechar < keychar) {
                     if (!raxSeekGreatest(it)) return 0;
+                    it->data = raxGetData(it->node);
                 } else {
                     if (!raxIteratorAddChars(it,it->node->data,it->node->size))
                         return 0;
@@ -1579,6 +1836,7 @@ int raxRandomWalk(raxIterator *it, size_t steps) {
     if (steps == 0) {
         size_t fle = floor(log(it->rt->numele));
         fle *= 2;
+        if (fle == 0) fle = 1;
         steps = 1 + rand() % fle;
     }
 
@@ -144,10 +144,14 @@ extern void *raxNotFound;
 
 /* Exported API. */
 rax *raxNew();
+rax *raxNewFromSorted(unsigned char **keys, size_t *lens, void **data, size_t count);
 int raxInsert(rax *rax, unsigned char *s, size_t len, void *data, void **old);
 int raxRemove(rax *rax, unsigned char *s, size_t len, void **old);
 void *raxFind(rax *rax, unsigned char *s, size_t len);
+size_t raxFindPrefixes(rax *rax, unsigned char *s, size_t len, void (*callback)(void *data, size_t keylen, void *privdata), void *privdata);
 void raxFree(rax *rax);
+void raxFreeWithCallback(rax *rax, void (*free_callback)(void*));
+uint64_t raxRelocate(rax *rax, void *(*node_callback)(void*), void *(*data_callback)(void*,void*), void *privdata);
 void raxStart(raxIterator *it, rax *rt);
 int raxSeek(raxIterator *it, const char *op, unsigned char *ele, size_t len);
 int raxNext(raxIterator *it);
@@ -41,4 +41,9 @@
 #define rax_malloc zmalloc
 #define rax_realloc zrealloc
 #define rax_free zfree
+/* Only when the allocator reports the usable size: zmalloc_size() would
+ * otherwise include the size prefix of zmalloc(). */
+#ifdef HAVE_MALLOC_SIZE
+#define rax_malloc_size zmalloc_size
+#endif
 #endif
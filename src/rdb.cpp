@@ -31,6 +31,10 @@
 #include "lzf.h"    /* LZF compression library */
 #include "zipmap.h"
 #include "endianconv.h"
+#include "snapshot.h"
+#include "hugepages.h"
+#include "lazyload.h"
+#include "tier.h"
 
 #include <math.h>
 #include <sys/types.h>
@@ -40,12 +44,21 @@
 #include <arpa/inet.h>
 #include <sys/stat.h>
 #include <sys/param.h>
+#include <fcntl.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #define rdbExitReportCorruptRDB(...) rdbCheckThenExit(__LINE__,__VA_ARGS__)
 
 extern int rdbCheckMode;
 void rdbCheckError(const char *fmt, ...);
 void rdbCheckSetError(const char *fmt, ...);
+void rdbCheckCountCompressedString(uint64_t clen, uint64_t len);
 
 void rdbCheckThenExit(int linenum, char *reason, ...) {
     va_list ap;
@@ -288,13 +301,102 @@ int rdbTryIntegerEncoding(char *s, size_t len, unsigned char *enc) {
     return rdbEncodeInteger(value,enc);
 }
 
-ssize_t rdbSaveLzfBlob(rio *rdb, void *data, size_t compress_len,
-                       size_t original_len) {
+/* -----------------------------------------------------------------------------
+ * Compression codecs
+ *
+ * Strings, and the chunks of rdb-compress-chunks, are compressed with the
+ * codec of rdb-compression-codec, identified by its RDB_ENC_* value. LZF is
+ * always available, LZ4 and zstd only when Redis is built with USE_LZ4=yes
+ * and USE_ZSTD=yes, linking the system libraries.
+ * -------------------------------------------------------------------------- */
+
+#define RDB_ZSTD_LEVEL 1    /* Levels above 3 are too slow for a BGSAVE. */
+
+/* Set in the rdb-save-threads filling chunks that are compressed as a
+ * whole, whose strings are not worth compressing one by one. */
+static __thread int rdb_save_plain_strings = 0;
+
+/* Return non zero if this Redis can compress and decompress with 'enc'. */
+int rdbCompressionAvailable(int enc) {
+    switch(enc) {
+    case RDB_ENC_LZF: return 1;
+#ifdef HAVE_LZ4
+    case RDB_ENC_LZ4: return 1;
+#endif
+#ifdef HAVE_ZSTD
+    case RDB_ENC_ZSTD: return 1;
+#endif
+    default: return 0;
+    }
+}
+
+const char *rdbCompressionName(int enc) {
+    switch(enc) {
+    case RDB_ENC_LZF: return "lzf";
+    case RDB_ENC_LZ4: return "lz4";
+    case RDB_ENC_ZSTD: return "zstd";
+    default: return "unknown";
+    }
+}
+
+/* Compress the 'len' bytes of 's' into 'out' with the codec 'enc'. Returns
+ * the compressed length, or 0 if it does not fit in 'outlen' bytes. */
+size_t rdbCompress(int enc, const void *s, size_t len, void *out,
+                   size_t outlen)
+{
+    switch(enc) {
+    case RDB_ENC_LZF:
+        return lzf_compress(s,len,out,outlen);
+#ifdef HAVE_LZ4
+    case RDB_ENC_LZ4: {
+        if (len > LZ4_MAX_INPUT_SIZE) return 0;
+        if (outlen > INT_MAX) outlen = INT_MAX;
+        int n = LZ4_compress_default((const char*)s,(char*)out,len,outlen);
+        return n > 0 ? n : 0;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case RDB_ENC_ZSTD: {
+        size_t n = ZSTD_compress(out,outlen,s,len,RDB_ZSTD_LEVEL);
+        return ZSTD_isError(n) ? 0 : n;
+    }
+#endif
+    default:
+        return 0;
+    }
+}
+
+/* Decompress the 'clen' bytes of 'c', compressed with 'enc', into 'out'.
+ * Returns 1 if they decompressed to exactly 'len' bytes, otherwise 0. */
+int rdbDecompress(int enc, const void *c, size_t clen, void *out, size_t len) {
+    switch(enc) {
+    case RDB_ENC_LZF:
+        return lzf_decompress(c,clen,out,len) == len;
+#ifdef HAVE_LZ4
+    case RDB_ENC_LZ4:
+        if (clen > INT_MAX || len > INT_MAX) return 0;
+        return LZ4_decompress_safe((const char*)c,(char*)out,clen,len) ==
+               (int)len;
+#endif
+#ifdef HAVE_ZSTD
+    case RDB_ENC_ZSTD: {
+        size_t n = ZSTD_decompress(out,len,c,clen);
+        return !ZSTD_isError(n) && n == len;
+    }
+#endif
+    default:
+        return 0;
+    }
+}
+
+/* Save a blob compressed with 'enc' as a specially encoded string. */
+ssize_t rdbSaveCompressedBlob(rio *rdb, int enc, void *data,
+                              size_t compress_len, size_t original_len) {
     unsigned char byte;
     ssize_t n, nwritten = 0;
 
     /* Data compressed! Let's save it on disk */
-    byte = (RDB_ENCVAL<<6)|RDB_ENC_LZF;
+    byte = (RDB_ENCVAL<<6)|enc;
     if ((n = rdbWriteRaw(rdb,&byte,1)) == -1) goto writeerr;
     nwritten += n;
 
@@ -313,7 +415,16 @@ writeerr:
     return -1;
 }
 
-ssize_t rdbSaveLzfStringObject(rio *rdb, unsigned char *s, size_t len) {
+ssize_t rdbSaveLzfBlob(rio *rdb, void *data, size_t compress_len,
+                       size_t original_len) {
+    return rdbSaveCompressedBlob(rdb,RDB_ENC_LZF,data,compress_len,
+                                 original_len);
+}
+
+/* Save the string compressed with the rdb-compression-codec. Returns 0 if
+ * it does not compress, so that it is saved verbatim. */
+ssize_t rdbSaveCompressedStringObject(rio *rdb, unsigned char *s, size_t len) {
+    int enc = server.rdb_compression_codec;
     size_t comprlen, outlen;
     void *out;
 
@@ -321,20 +432,21 @@ ssize_t rdbSaveLzfStringObject(rio *rdb, unsigned char *s, size_t len) {
     if (len <= 4) return 0;
     outlen = len-4;
     if ((out = zmalloc(outlen+1)) == NULL) return 0;
-    comprlen = lzf_compress(s, len, out, outlen);
+    comprlen = rdbCompress(enc, s, len, out, outlen);
     if (comprlen == 0) {
         zfree(out);
         return 0;
     }
-    ssize_t nwritten = rdbSaveLzfBlob(rdb, out, comprlen, len);
+    ssize_t nwritten = rdbSaveCompressedBlob(rdb, enc, out, comprlen, len);
     zfree(out);
     return nwritten;
 }
 
-/* Load an LZF compressed string in RDB format. The returned value
+/* Load a string compressed with 'enc' in RDB format. The returned value
  * changes according to 'flags'. For more info check the
  * rdbGenericLoadStringObject() function. */
-void *rdbLoadLzfStringObject(rio *rdb, int flags, size_t *lenptr) {
+void *rdbLoadCompressedStringObject(rio *rdb, int enc, int flags,
+                                    size_t *lenptr) {
     int plain = flags & RDB_LOAD_PLAIN;
     int sds = flags & RDB_LOAD_SDS;
     uint64_t len, clen;
@@ -345,6 +457,18 @@ void *rdbLoadLzfStringObject(rio *rdb, int flags, size_t *lenptr) {
     if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
     if ((c = (unsigned char *)zmalloc(clen)) == NULL) goto err;
 
+    /* Load the compressed representation. */
+    if (rdb->rioRead(c,clen) == 0) goto err;
+
+    /* Keep it as it is when it is worth a compressed string object. */
+    if ((flags & RDB_LOAD_COMPRESSED) && !plain && !sds && !rdbCheckMode &&
+        stringCompressionWorthIt(len,clen))
+    {
+        robj *o = createCompressedStringObject(enc,c,clen,len);
+        zfree(c);
+        return o;
+    }
+
     /* Allocate our target according to the uncompressed size. */
     if (plain) {
         val = (char *)zmalloc(len);
@@ -353,13 +477,15 @@ void *rdbLoadLzfStringObject(rio *rdb, int flags, size_t *lenptr) {
         val = sdsnewlen(NULL,len);
     }
 
-    /* Load the compressed representation and uncompress it to target. */
-    if (rdb->rioRead(c,clen) == 0) goto err;
-    if (lzf_decompress(c,clen,val,len) == 0) {
-        if (rdbCheckMode) rdbCheckSetError("Invalid LZF compressed string");
+    /* Uncompress it to target. */
+    if (!rdbDecompress(enc,c,clen,val,len)) {
+        if (rdbCheckMode)
+            rdbCheckSetError("Invalid %s compressed string",
+                rdbCompressionName(enc));
         goto err;
     }
     zfree(c);
+    if (rdbCheckMode) rdbCheckCountCompressedString(clen,len);
 
     if (plain || sds) {
         return val;
@@ -390,10 +516,11 @@ ssize_t rdbSaveRawString(rio *rdb, unsigned char *s, size_t len) {
         }
     }
 
-    /* Try LZF compression - under 20 bytes it's unable to compress even
-     * aaaaaaaaaaaaaaaaaa so skip it */
-    if (server.rdb_compression && len > 20) {
-        n = rdbSaveLzfStringObject(rdb,s,len);
+    /* Try compression - under 20 bytes it's unable to compress even
+     * aaaaaaaaaaaaaaaaaa so skip it. The keys of compressed chunks are
+     * compressed as a whole instead. */
+    if (server.rdb_compression && !rdb_save_plain_strings && len > 20) {
+        n = rdbSaveCompressedStringObject(rdb,s,len);
         if (n == -1) return -1;
         if (n > 0) return n;
         /* Return value of 0 means data can't be compressed, save the old way */
@@ -434,6 +561,24 @@ int rdbSaveStringObject(rio *rdb, robj *obj) {
      * object is already integer encoded. */
     if (obj->encoding == OBJ_ENCODING_INT) {
         return rdbSaveLongLongAsStringObject(rdb,(long)obj->ptr);
+    } else if (obj->encoding == OBJ_ENCODING_CHUNKED) {
+        /* Chunked bitmaps are saved as plain strings: the zero runs are
+         * well compressed by LZF anyway. */
+        sds s = chunkedBitmapObjectToSds(obj);
+        int n = rdbSaveRawString((rio*)rdb,(unsigned char *)s,sdslen(s));
+        sdsfree(s);
+        return n;
+    } else if (obj->encoding == OBJ_ENCODING_COMPRESSED) {
+        /* Compressed strings are saved as they are, unless the strings
+         * should not be compressed at all. */
+        compressedString *cs = (compressedString *)obj->ptr;
+        if (server.rdb_compression && !rdb_save_plain_strings)
+            return rdbSaveCompressedBlob(rdb,cs->codec,cs->data,cs->clen,
+                                         cs->len);
+        sds s = compressedStringObjectToSds(obj);
+        int n = rdbSaveRawString((rio*)rdb,(unsigned char *)s,sdslen(s));
+        sdsfree(s);
+        return n;
     } else {
         serverAssertWithInfo(NULL,obj,sdsEncodedObject(obj));
         return rdbSaveRawString((rio*)rdb,(unsigned char *)obj->ptr,sdslen((sds)(sds)obj->ptr));
@@ -450,6 +595,10 @@ int rdbSaveStringObject(rio *rdb, robj *obj) {
  * RDB_LOAD_PLAIN: Return a plain string allocated with zmalloc()
  *                 instead of a Redis object with an sds in it.
  * RDB_LOAD_SDS: Return an SDS string instead of a Redis object.
+ * RDB_LOAD_COMPRESSED: Return a Redis object with the compressed encoding
+ *                      for a compressed string that is worth it, see
+ *                      string-compression-min-bytes, instead of
+ *                      decompressing it.
  *
  * On I/O error NULL is returned.
  */
@@ -468,7 +617,13 @@ void *rdbGenericLoadStringObject(rio *rdb, int flags, size_t *lenptr) {
         case RDB_ENC_INT32:
             return rdbLoadIntegerObject(rdb,len,flags,lenptr);
         case RDB_ENC_LZF:
-            return rdbLoadLzfStringObject(rdb,flags,lenptr);
+        case RDB_ENC_LZ4:
+        case RDB_ENC_ZSTD:
+            if (!rdbCompressionAvailable(len))
+                rdbExitReportCorruptRDB("RDB string compressed with %s, "
+                    "that this Redis was built without",
+                    rdbCompressionName(len));
+            return rdbLoadCompressedStringObject(rdb,len,flags,lenptr);
         default:
             rdbExitReportCorruptRDB("Unknown RDB string encoding type %d",len);
         }
@@ -524,23 +679,9 @@ int rdbSaveDoubleValue(rio *rdb, double val) {
         len = 1;
         buf[0] = (val < 0) ? 255 : 254;
     } else {
-#if (DBL_MANT_DIG >= 52) && (LLONG_MAX == 0x7fffffffffffffffLL)
-        /* Check if the float is in a safe range to be casted into a
-         * long long. We are assuming that long long is 64 bit here.
-         * Also we are assuming that there are no implementations around where
-         * double has precision < 52 bit.
-         *
-         * Under this assumptions we test if a double is inside an interval
-         * where casting to long long is safe. Then using two castings we
-         * make sure the decimal part is zero. If all this is true we use
-         * integer printing function that is much faster. */
-        double min = -4503599627370495; /* (2^52)-1 */
-        double max = 4503599627370496; /* -(2^52) */
-        if (val > min && val < max && val == ((double)((long long)val)))
-            ll2string((char*)buf+1,sizeof(buf)-1,(long long)val);
-        else
-#endif
-            snprintf((char*)buf+1,sizeof(buf)-1,"%.17g",val);
+        /* d2string() emits digits that load back to the same double,
+         * short ones in practice, and integral values as plain integers. */
+        d2string((char*)buf+1,sizeof(buf)-1,val);
         buf[0] = strlen((char*)buf+1);
         len = buf[0]+1;
     }
@@ -598,35 +739,52 @@ int rdbLoadBinaryFloatValue(rio *rdb, float *val) {
 
 /* Save the object type of object "o". */
 int rdbSaveObjectType(rio *rdb, robj *o) {
+    /* The values in the tiering file are copied as they are, the lazy values
+     * of the RDB file are loaded. */
+    if (o->encoding == OBJ_ENCODING_LAZY) {
+        if (lazyIsTiered(o))
+            return rdbSaveType(rdb,(uintptr_t)o->ptr & LAZY_RDBTYPE_MASK);
+        lazyLoadValue(o);
+    }
     switch (o->type) {
     case OBJ_STRING:
         return rdbSaveType(rdb,RDB_TYPE_STRING);
     case OBJ_LIST:
-        if (o->encoding == OBJ_ENCODING_QUICKLIST)
+        if (o->encoding == OBJ_ENCODING_QUICKLIST) {
+            quicklist *ql = (quicklist *)o->ptr;
+            if (ql->m_container == QUICKLIST_NODE_CONTAINER_LISTPACK)
+                return rdbSaveType(rdb,RDB_TYPE_LIST_QUICKLIST_2);
             return rdbSaveType(rdb,RDB_TYPE_LIST_QUICKLIST);
+        }
         else
             serverPanic("Unknown list encoding");
     case OBJ_SET:
         if (o->encoding == OBJ_ENCODING_INTSET)
             return rdbSaveType(rdb,RDB_TYPE_SET_INTSET);
+        else if (o->encoding == OBJ_ENCODING_ROARING)
+            return rdbSaveType(rdb,RDB_TYPE_SET_ROARING);
         else if (o->encoding == OBJ_ENCODING_HT)
             return rdbSaveType(rdb,RDB_TYPE_SET);
         else
             serverPanic("Unknown set encoding");
     case OBJ_ZSET:
-        if (o->encoding == OBJ_ENCODING_ZIPLIST)
-            return rdbSaveType(rdb,RDB_TYPE_ZSET_ZIPLIST);
-        else if (o->encoding == OBJ_ENCODING_SKIPLIST)
+        if (o->encoding == OBJ_ENCODING_LISTPACK)
+            return rdbSaveType(rdb,RDB_TYPE_ZSET_LISTPACK);
+        else if (o->encoding == OBJ_ENCODING_SKIPLIST ||
+                 o->encoding == OBJ_ENCODING_BTREE)
             return rdbSaveType(rdb,RDB_TYPE_ZSET_2);
         else
             serverPanic("Unknown sorted set encoding");
     case OBJ_HASH:
-        if (o->encoding == OBJ_ENCODING_ZIPLIST)
-            return rdbSaveType(rdb,RDB_TYPE_HASH_ZIPLIST);
+        if (o->encoding == OBJ_ENCODING_LISTPACK)
+            return rdbSaveType(rdb,RDB_TYPE_HASH_LISTPACK);
         else if (o->encoding == OBJ_ENCODING_HT)
-            return rdbSaveType(rdb,RDB_TYPE_HASH);
+            return rdbSaveType(rdb,hashTypeFieldExpires(o) ?
+                                   RDB_TYPE_HASH_TTL : RDB_TYPE_HASH);
         else
             serverPanic("Unknown hash encoding");
+    case OBJ_STREAM:
+        return rdbSaveType(rdb,RDB_TYPE_STREAM_LISTPACKS);
     case OBJ_MODULE:
         return rdbSaveType(rdb,RDB_TYPE_MODULE_2);
     default:
@@ -644,10 +802,94 @@ int rdbLoadObjectType(rio *rdb) {
     return type;
 }
 
+/* This helper function serializes a consumer group Pending Entries List (PEL)
+ * into the RDB file. The 'nacks' argument tells the function if also persist
+ * the informations about the not acknowledged message, or if to persist
+ * just the IDs: this is useful because for the global consumer group PEL
+ * we serialized the NACKs as well, but when serializing the local consumer
+ * PELs we just add the ID, that will be resolved inside the global PEL to
+ * put a reference to the same structure. */
+static ssize_t rdbSaveStreamPEL(rio *rdb, rax *pel, int nacks) {
+    ssize_t n = 0, nwritten = 0;
+
+    /* Number of entries in the PEL. */
+    if ((n = rdbSaveLen(rdb,pel->numele)) == -1) return -1;
+    nwritten += n;
+
+    /* Save each entry. */
+    raxIterator ri;
+    raxStart(&ri,pel);
+    raxSeek(&ri,"^",NULL,0);
+    while(raxNext(&ri)) {
+        /* We store IDs in raw form as 128 big big endian numbers, like
+         * they are inside the radix tree key. */
+        if ((n = rdbWriteRaw(rdb,ri.key,sizeof(streamID))) == -1) break;
+        nwritten += n;
+
+        if (nacks) {
+            streamNACK *nack = (streamNACK *)ri.data;
+            if ((n = rdbSaveMillisecondTime(rdb,nack->delivery_time)) == -1)
+                break;
+            nwritten += n;
+            if ((n = rdbSaveLen(rdb,nack->delivery_count)) == -1) break;
+            nwritten += n;
+            /* We don't save the consumer name: we'll save the pending IDs
+             * for each consumer in the consumer PEL, and resolve the consumer
+             * at loading time. */
+        }
+    }
+    raxStop(&ri);
+    if (n == -1) return -1;
+    return nwritten;
+}
+
+/* Serialize the consumers of a stream consumer group into the RDB. Helper
+ * function for the stream data type serialization. What we do here is to
+ * persist the consumer metadata, and it's PEL, for each consumer. */
+static ssize_t rdbSaveStreamConsumers(rio *rdb, streamCG *cg) {
+    ssize_t n = 0, nwritten = 0;
+
+    /* Number of consumers in this consumer group. */
+    if ((n = rdbSaveLen(rdb,cg->consumers->numele)) == -1) return -1;
+    nwritten += n;
+
+    /* Save each consumer. */
+    raxIterator ri;
+    raxStart(&ri,cg->consumers);
+    raxSeek(&ri,"^",NULL,0);
+    while(raxNext(&ri)) {
+        streamConsumer *consumer = (streamConsumer *)ri.data;
+
+        /* Consumer name. */
+        if ((n = rdbSaveRawString(rdb,ri.key,ri.key_len)) == -1) break;
+        nwritten += n;
+
+        /* Last seen time. */
+        if ((n = rdbSaveMillisecondTime(rdb,consumer->seen_time)) == -1)
+            break;
+        nwritten += n;
+
+        /* Consumer PEL, without the ACKs (see last parameter of the function
+         * passed with value of 0), at loading time we'll lookup the ID
+         * in the consumer group global PEL and will put a reference in the
+         * consumer local PEL. */
+        if ((n = rdbSaveStreamPEL(rdb,consumer->pel,0)) == -1) break;
+        nwritten += n;
+    }
+    raxStop(&ri);
+    if (n == -1) return -1;
+    return nwritten;
+}
+
 /* Save a Redis object. Returns -1 on error, number of bytes written on success. */
 ssize_t rdbSaveObject(rio *rdb, robj *o) {
     ssize_t n = 0, nwritten = 0;
 
+    if (o->encoding == OBJ_ENCODING_LAZY) {
+        if (lazyIsTiered(o)) return tierSaveValue(rdb,o);
+        lazyLoadValue(o);
+    }
+
     if (o->type == OBJ_STRING) {
         /* Save a string value */
         if ((n = rdbSaveStringObject(rdb,o)) == -1) return -1;
@@ -698,13 +940,33 @@ ssize_t rdbSaveObject(rio *rdb, robj *o) {
 
             if ((n = rdbSaveRawString(rdb,(unsigned char *)o->ptr,l)) == -1) return -1;
             nwritten += n;
+        } else if (o->encoding == OBJ_ENCODING_ROARING) {
+            roaring *r = (roaring *)o->ptr;
+            unsigned char buf[ROARING_CONTAINER_MAX_BYTES];
+
+            /* Every container is saved as its key, its number of elements
+             * and its array or bitmap. */
+            if ((n = rdbSaveLen(rdb,r->roaringContainers())) == -1) return -1;
+            nwritten += n;
+            for (uint32_t i = 0; i < r->roaringContainers(); i++) {
+                uint64_t key;
+                uint32_t card;
+                size_t l = r->roaringGetContainer(i,&key,&card,buf);
+
+                if ((n = rdbSaveLen(rdb,key)) == -1) return -1;
+                nwritten += n;
+                if ((n = rdbSaveLen(rdb,card)) == -1) return -1;
+                nwritten += n;
+                if ((n = rdbSaveRawString(rdb,buf,l)) == -1) return -1;
+                nwritten += n;
+            }
         } else {
             serverPanic("Unknown set encoding");
         }
     } else if (o->type == OBJ_ZSET) {
         /* Save a sorted set value */
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            size_t l = ziplistBlobLen((unsigned char*)o->ptr);
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            size_t l = lpBytes((unsigned char*)o->ptr);
 
             if ((n = rdbSaveRawString(rdb,(unsigned char *)o->ptr,l)) == -1) return -1;
             nwritten += n;
@@ -735,13 +997,38 @@ ssize_t rdbSaveObject(rio *rdb, robj *o) {
                 nwritten += n;
                 zn = zn->backward;
             }
+        } else if (o->encoding == OBJ_ENCODING_BTREE) {
+            zbtree *zbt = ((zset*)o->ptr)->zbt;
+            zbtCursor cur;
+            int valid;
+
+            if ((n = rdbSaveLen(rdb, zbt->length())) == -1)
+                return -1;
+            nwritten += n;
+
+            /* Same order used for the skiplist, so that the elements are
+             * always prepended to the first leaf when loading. */
+            valid = zbt->zbtLast(&cur);
+            while (valid) {
+                sds ele = zbtCursorEle(&cur);
+                if ((n = rdbSaveRawString(rdb,
+                    (unsigned char*)ele,sdslen(ele))) == -1)
+                {
+                    return -1;
+                }
+                nwritten += n;
+                if ((n = rdbSaveBinaryDoubleValue(rdb,zbtCursorScore(&cur))) == -1)
+                    return -1;
+                nwritten += n;
+                valid = zbtPrev(&cur);
+            }
         } else {
             serverPanic("Unknown sorted set encoding");
         }
     } else if (o->type == OBJ_HASH) {
         /* Save a hash value */
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            size_t l = ziplistBlobLen((unsigned char*)o->ptr);
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            size_t l = lpBytes((unsigned char*)o->ptr);
 
             if ((n = rdbSaveRawString(rdb,(unsigned char *)o->ptr,l)) == -1) return -1;
             nwritten += n;
@@ -755,19 +1042,114 @@ ssize_t rdbSaveObject(rio *rdb, robj *o) {
 
             while((de = di.dictNext()) != NULL) {
                 sds field = (sds)de->dictGetKey();
-                sds value = (sds)de->dictGetVal();
 
                 if ((n = rdbSaveRawString(rdb,(unsigned char*)field,
                         sdslen(field))) == -1) return -1;
                 nwritten += n;
-                if ((n = rdbSaveRawString(rdb,(unsigned char*)value,
-                        sdslen(value))) == -1) return -1;
+                if (hashDictValIsInt(de)) {
+                    n = rdbSaveLongLongAsStringObject(rdb,hashDictValGetInt(de));
+                } else {
+                    sds value = (sds)de->dictGetVal();
+                    n = rdbSaveRawString(rdb,(unsigned char*)value,sdslen(value));
+                }
+                if (n == -1) return -1;
                 nwritten += n;
             }
+
+            /* Then the fields that have a TTL, see RDB_TYPE_HASH_TTL. */
+            if (hashTypeFieldExpires(o)) {
+                zskiplistPair *pairs;
+                unsigned long count = hashTypeGetFieldExpires(o,&pairs), j;
+
+                if ((n = rdbSaveLen(rdb,count)) != -1) {
+                    nwritten += n;
+                    for (j = 0; j < count; j++) {
+                        if ((n = rdbSaveRawString(rdb,(unsigned char*)pairs[j].ele,
+                                sdslen(pairs[j].ele))) == -1) break;
+                        nwritten += n;
+                        if ((n = rdbSaveMillisecondTime(rdb,
+                                (long long)pairs[j].score)) == -1) break;
+                        nwritten += n;
+                    }
+                }
+                for (j = 0; j < count; j++) sdsfree(pairs[j].ele);
+                zfree(pairs);
+                if (n == -1) return -1;
+            }
         } else {
             serverPanic("Unknown hash encoding");
         }
 
+    } else if (o->type == OBJ_STREAM) {
+        /* Store how many listpacks we have inside the radix tree. */
+        stream *s = (stream *)o->ptr;
+        rax *rax = s->rax;
+        if ((n = rdbSaveLen(rdb,rax->numele)) == -1) return -1;
+        nwritten += n;
+
+        /* Serialize all the listpacks inside the radix tree as they are,
+         * when loading back, we'll use the first entry of each listpack
+         * to insert it back into the radix tree. */
+        raxIterator ri;
+        raxStart(&ri,rax);
+        raxSeek(&ri,"^",NULL,0);
+        while (raxNext(&ri)) {
+            unsigned char *lp = (unsigned char *)ri.data;
+            size_t lp_bytes = lpBytes(lp);
+            if ((n = rdbSaveRawString(rdb,ri.key,ri.key_len)) == -1) break;
+            nwritten += n;
+            if ((n = rdbSaveRawString(rdb,lp,lp_bytes)) == -1) break;
+            nwritten += n;
+        }
+        raxStop(&ri);
+        if (n == -1) return -1;
+
+        /* Save the number of elements inside the stream. We cannot obtain
+         * this easily later, since our macro nodes should be checked for
+         * number of items: not a great CPU / space tradeoff. */
+        if ((n = rdbSaveLen(rdb,s->length)) == -1) return -1;
+        nwritten += n;
+        /* Save the last entry ID. */
+        if ((n = rdbSaveLen(rdb,s->last_id.ms)) == -1) return -1;
+        nwritten += n;
+        if ((n = rdbSaveLen(rdb,s->last_id.seq)) == -1) return -1;
+        nwritten += n;
+
+        /* The consumer groups and their clients are part of the stream
+         * type, so serialize every consumer group. */
+        size_t num_cgroups = s->cgroups ? s->cgroups->numele : 0;
+        if ((n = rdbSaveLen(rdb,num_cgroups)) == -1) return -1;
+        nwritten += n;
+
+        if (num_cgroups) {
+            /* Serialize each consumer group. */
+            raxStart(&ri,s->cgroups);
+            raxSeek(&ri,"^",NULL,0);
+            while(raxNext(&ri)) {
+                streamCG *cg = (streamCG *)ri.data;
+
+                /* Save the group name. */
+                if ((n = rdbSaveRawString(rdb,ri.key,ri.key_len)) == -1)
+                    break;
+                nwritten += n;
+
+                /* Last ID. */
+                if ((n = rdbSaveLen(rdb,cg->last_id.ms)) == -1) break;
+                nwritten += n;
+                if ((n = rdbSaveLen(rdb,cg->last_id.seq)) == -1) break;
+                nwritten += n;
+
+                /* Save the global PEL. */
+                if ((n = rdbSaveStreamPEL(rdb,cg->pel,1)) == -1) break;
+                nwritten += n;
+
+                /* Save the consumers of this group. */
+                if ((n = rdbSaveStreamConsumers(rdb,cg)) == -1) break;
+                nwritten += n;
+            }
+            raxStop(&ri);
+            if (n == -1) return -1;
+        }
     } else if (o->type == OBJ_MODULE) {
         /* Save a module-specific value. */
         moduleValue* mv = (moduleValue*)o->ptr;
@@ -874,6 +1256,189 @@ int rdbSaveInfoAuxFields(rio *rdb, int flags, rdbSaveInfo *rsi) {
     return 1;
 }
 
+/* -----------------------------------------------------------------------------
+ * Parallel saving
+ *
+ * With rdb-save-threads greater than one, the keys of every database are
+ * serialized by that many threads walking different partitions of the
+ * dictionary (see keyspaceWalk()). Every thread fills its own buffer and
+ * writes it as an RDB_OPCODE_CHUNK when full, holding the lock of the
+ * output stream only for the write, so the compression and the encoding
+ * of the values proceed in parallel. With rdb-compress-chunks the chunks are
+ * compressed as a whole, as RDB_OPCODE_CHUNK_COMPRESSED, instead of string
+ * by string: the many small values that are too short to be compressed on
+ * their own are compressed as well. Module values are saved afterwards by
+ * the calling thread, since modules can't be called from the others.
+ * -------------------------------------------------------------------------- */
+
+struct rdbSaveJob {
+    rio *rdb;
+    redisDb *db;
+    int flags;
+    int compress;           /* RDB_ENC_* codec of the chunks, or 0. */
+    long long now;
+    size_t *processed;      /* See AOF_READ_DIFF_INTERVAL_BYTES. */
+    pthread_mutex_t mutex;  /* Serializes the writes to 'rdb'. */
+    int failed;             /* A write failed with errno 'error'. */
+    int error;
+};
+
+struct rdbSaveThread {
+    rdbSaveJob *job;
+    sds buf;                /* Keys of the chunk being filled. */
+    unsigned long keys;     /* Keys in 'buf'. */
+    unsigned long modules;  /* Module values left to the calling thread. */
+};
+
+/* Write a chunk of 'keys' keys of the database 'dbid', that are the 'len'
+ * bytes of 'data', or their 'rawlen' bytes compressed with 'enc' if it is
+ * not zero. Returns -1 on write errors. */
+int rdbSaveChunk(rio *rdb, int dbid, unsigned long keys, int enc,
+                        void *data, size_t len, size_t rawlen)
+{
+    int type = enc ? RDB_OPCODE_CHUNK_COMPRESSED : RDB_OPCODE_CHUNK;
+
+    if (rdbSaveType(rdb,type) == -1 ||
+        rdbSaveLen(rdb,dbid) == -1 ||
+        rdbSaveLen(rdb,keys) == -1) return -1;
+    if (enc && (rdbSaveType(rdb,enc) == -1 ||
+                rdbSaveLen(rdb,rawlen) == -1)) return -1;
+    if (rdbSaveLen(rdb,len) == -1 ||
+        rdbWriteRaw(rdb,data,len) == -1) return -1;
+    return 0;
+}
+
+/* Append a key to the chunk '*buf', with its strings left uncompressed if
+ * 'plain' is set, since the chunk will be compressed as a whole. Returns 1
+ * if the key was saved, 0 if it was already expired at the time 'now'. */
+int rdbSaveChunkRecord(sds *buf, robj *key, robj *val, long long expire,
+                       long long now, int plain)
+{
+    int saved;
+
+    /* Writing to a buffer never fails. */
+    rioBufferIO rdb(*buf);
+    rdb_save_plain_strings = plain;
+    saved = rdbSaveKeyValuePair(&rdb,key,val,expire,now);
+    rdb_save_plain_strings = 0;
+    *buf = rdb.m_ptr;
+    return saved == 1;
+}
+
+/* Write the chunk of a thread to the output stream and empty it. */
+static void rdbSaveFlushChunk(rdbSaveThread *t) {
+    rdbSaveJob *job = t->job;
+    rio *rdb = job->rdb;
+    size_t len = sdslen(t->buf), clen = 0;
+    void *cbuf = NULL;
+
+    if (t->keys == 0) return;
+    /* Compress before taking the lock, in parallel with the others. */
+    if (job->compress && len > 20) {
+        cbuf = zmalloc(len);
+        clen = rdbCompress(job->compress,t->buf,len,cbuf,len-4);
+    }
+    pthread_mutex_lock(&job->mutex);
+    if (job->failed) {
+        /* Nothing more is written after an error. */
+    } else if ((clen ? rdbSaveChunk(rdb,job->db->m_id,t->keys,job->compress,
+                                    cbuf,clen,len) :
+                       rdbSaveChunk(rdb,job->db->m_id,t->keys,0,
+                                    t->buf,len,len)) == -1)
+    {
+        job->failed = 1;
+        job->error = errno;
+    } else if (job->flags & RDB_SAVE_AOF_PREAMBLE &&
+               rdb->m_processed_bytes > *job->processed+AOF_READ_DIFF_INTERVAL_BYTES)
+    {
+        *job->processed = rdb->m_processed_bytes;
+        aofReadDiffFromParent();
+    }
+    pthread_mutex_unlock(&job->mutex);
+    zfree(cbuf);
+    sdsclear(t->buf);
+    t->keys = 0;
+}
+
+/* The keyspaceWalk() callback serializing a key into the chunk of the
+ * thread. Only read only accesses to the dataset are possible here. */
+static void rdbSaveChunkKey(void *privdata, sds keystr, robj *o) {
+    rdbSaveThread *t = (rdbSaveThread *)privdata;
+    rdbSaveJob *job = t->job;
+    long long expire = -1;
+    dictEntry *de;
+    robj key;
+
+    if (o->type == OBJ_MODULE) {
+        t->modules++;
+        return;
+    }
+    if (job->db->m_expires->dictSize() &&
+        (de = job->db->m_dict->dictFindReadOnly(keystr)) != NULL)
+        expire = dbGetEntryExpire(job->db,de);
+    initStaticStringObject(key,keystr);
+    if (rdbSaveChunkRecord(&t->buf,&key,o,expire,job->now,job->compress != 0))
+        t->keys++;
+    if (t->keys == RDB_CHUNK_MAX_KEYS || sdslen(t->buf) >= RDB_CHUNK_BYTES)
+        rdbSaveFlushChunk(t);
+}
+
+/* Save the keys of 'db' as chunks written by rdb-save-threads threads.
+ * Returns -1 on write errors, with errno set, 0 otherwise. */
+static int rdbSaveDbParallel(rio *rdb, redisDb *db, int flags, long long now,
+                             size_t *processed)
+{
+    rdbSaveJob job;
+    rdbSaveThread threads[RDB_SAVE_MAX_THREADS];
+    void *privdata[RDB_SAVE_MAX_THREADS];
+    int numthreads = server.rdb_save_threads, j;
+    unsigned long modules = 0;
+
+    job.rdb = rdb;
+    job.db = db;
+    job.flags = flags;
+    job.compress = server.rdb_compression && server.rdb_compress_chunks ?
+                   server.rdb_compression_codec : 0;
+    job.now = now;
+    job.processed = processed;
+    pthread_mutex_init(&job.mutex,NULL);
+    job.failed = 0;
+    job.error = 0;
+    for (j = 0; j < numthreads; j++) {
+        threads[j].job = &job;
+        threads[j].buf = sdsempty();
+        threads[j].keys = 0;
+        threads[j].modules = 0;
+        privdata[j] = &threads[j];
+    }
+
+    keyspaceWalk(db,numthreads,rdbSaveChunkKey,privdata);
+    for (j = 0; j < numthreads; j++) {
+        rdbSaveFlushChunk(&threads[j]);
+        sdsfree(threads[j].buf);
+        modules += threads[j].modules;
+    }
+    pthread_mutex_destroy(&job.mutex);
+    if (job.failed) {
+        errno = job.error;
+        return -1;
+    }
+    if (modules == 0) return 0;
+
+    dictIterator di(db->m_dict, 1);
+    dictEntry *de;
+    while((de = di.dictNext()) != NULL) {
+        robj *o = (robj*)de->dictGetVal();
+        robj key;
+
+        if (o->type != OBJ_MODULE) continue;
+        initStaticStringObject(key,(sds)de->dictGetKey());
+        if (rdbSaveKeyValuePair(rdb,&key,o,getExpire(db,&key),now) == -1)
+            return -1;
+    }
+    return 0;
+}
+
 /* Produces a dump of the database in RDB format sending it to the specified
  * Redis I/O channel. On success C_OK is returned, otherwise C_ERR
  * is returned and part of the output, or all the output, can be
@@ -923,6 +1488,12 @@ int rdbSaveRio(rio *rdb, int *error, int flags, rdbSaveInfo *rsi) {
         if (rdbSaveLen(rdb,db_size) == -1) goto werr;
         if (rdbSaveLen(rdb,expires_size) == -1) goto werr;
 
+        if (server.rdb_save_threads > 1) {
+            if (rdbSaveDbParallel(rdb,db,flags,now,&processed) == -1)
+                goto werr;
+            continue;
+        }
+
         /* Iterate this DB writing every entry */
         dictIterator di(d, 1);
         while((de = di.dictNext()) != NULL) {
@@ -934,6 +1505,7 @@ int rdbSaveRio(rio *rdb, int *error, int flags, rdbSaveInfo *rsi) {
             initStaticStringObject(key,keystr);
             expire = getExpire(db,&key);
             if (rdbSaveKeyValuePair(rdb,&key,o,expire,now) == -1) goto werr;
+            sendChildCowInfoIfNeeded();
 
             /* When this RDB is produced as part of an AOF rewrite, move
              * accumulated diff from parent to child while rewriting in
@@ -973,6 +1545,23 @@ int rdbSaveRio(rio *rdb, int *error, int flags, rdbSaveInfo *rsi) {
         }
     }
 
+    /* The functions are part of the dataset, and are always saved, as
+     * "<name> <body>". */
+    if (server.lua_functions->dictSize()) {
+        dictIterator di(server.lua_functions);
+        while((de = di.dictNext()) != NULL) {
+            sds name = (sds)de->dictGetKey();
+            robj *body = ((luaFunction *)de->dictGetVal())->body;
+            sds val = sdscatlen(sdsdup(name)," ",1);
+            int retval;
+
+            val = sdscatlen(val,body->ptr,sdslen((sds)body->ptr));
+            retval = rdbSaveAuxField(rdb,(void*)"lua-function",12,val,sdslen(val));
+            sdsfree(val);
+            if (retval == -1) goto werr;
+        }
+    }
+
     /* EOF opcode */
     if (rdbSaveType(rdb,RDB_OPCODE_EOF) == -1) goto werr;
 
@@ -1014,16 +1603,37 @@ werr: /* Write error. */
     return C_ERR;
 }
 
+/* Open the file to save the RDB into for rioDirectIO, according to
+ * rdb-save-bypass-cache. Filesystems not supporting O_DIRECT fall back to
+ * dropping the written pages from the cache. */
+int rdbOpenBypassingCache(char *filename) {
+    int flags = O_WRONLY|O_CREAT|O_TRUNC, fd;
+
+#ifdef O_DIRECT
+    if (server.rdb_save_bypass_cache == RDB_BYPASS_CACHE_ODIRECT) {
+        if ((fd = open(filename,flags|O_DIRECT,0644)) != -1) return fd;
+        if (errno != EINVAL) return -1;
+        serverLog(LL_NOTICE,"O_DIRECT not supported writing the RDB file, "
+                            "using fadvise() instead");
+    }
+#endif
+    return open(filename,flags,0644);
+}
+
 /* Save the DB on disk. Return C_ERR on error, C_OK on success. */
 int rdbSave(char *filename, rdbSaveInfo *rsi) {
     char tmpfile[256];
     char cwd[MAXPATHLEN]; /* Current working dir path for error messages. */
-    FILE *fp;
+    FILE *fp = NULL;
+    int fd = -1;
     int error = 0;
 
     snprintf(tmpfile,256,"temp-%d.rdb", (int) getpid());
-    fp = fopen(tmpfile,"w");
-    if (!fp) {
+    if (server.rdb_save_bypass_cache != RDB_BYPASS_CACHE_NO)
+        fd = rdbOpenBypassingCache(tmpfile);
+    else
+        fp = fopen(tmpfile,"w");
+    if (!fp && fd == -1) {
         char *cwdp = getcwd(cwd,MAXPATHLEN);
         serverLog(LL_WARNING,
             "Failed opening the RDB file %s (in server root dir %s) "
@@ -1034,16 +1644,33 @@ int rdbSave(char *filename, rdbSaveInfo *rsi) {
         return C_ERR;
     }
 
-    rioFileIO rdb(fp);
-    if (rdbSaveRio(&rdb,&error,RDB_SAVE_NONE,rsi) == C_ERR) {
-        errno = error;
-        goto werr;
-    }
+    if (fp) {
+        rioFileIO rdb(fp);
+        if (rdbSaveRio(&rdb,&error,RDB_SAVE_NONE,rsi) == C_ERR) {
+            errno = error;
+            goto werr;
+        }
 
-    /* Make sure data will not remain on the OS's output buffers */
-    if (fflush(fp) == EOF) goto werr;
-    if (fsync(fileno(fp)) == -1) goto werr;
-    if (fclose(fp) == EOF) goto werr;
+        /* Make sure data will not remain on the OS's output buffers */
+        if (fflush(fp) == EOF) goto werr;
+        if (fsync(fileno(fp)) == -1) goto werr;
+        if (fclose(fp) == EOF) {
+            fp = NULL;
+            goto werr;
+        }
+    } else {
+        rioDirectIO rdb(fd);
+        if (rdbSaveRio(&rdb,&error,RDB_SAVE_NONE,rsi) == C_ERR) {
+            errno = error;
+            goto werr;
+        }
+        if (rdb.rioFlush() == 0) goto werr;
+        if (fsync(fd) == -1) goto werr;
+        if (close(fd) == -1) {
+            fd = -1;
+            goto werr;
+        }
+    }
 
     /* Use RENAME to make sure the DB file is changed atomically only
      * if the generate DB file is ok. */
@@ -1068,7 +1695,8 @@ int rdbSave(char *filename, rdbSaveInfo *rsi) {
 
 werr:
     serverLog(LL_WARNING,"Write error saving DB on disk: %s", strerror(errno));
-    fclose(fp);
+    if (fp) fclose(fp);
+    if (fd != -1) close(fd);
     unlink(tmpfile);
     return C_ERR;
 }
@@ -1089,6 +1717,7 @@ int rdbSaveBackground(char *filename, rdbSaveInfo *rsi) {
 
         /* Child */
         closeListeningSockets(0);
+        childInfoStartReports();
         redisSetProcTitle("redis-rdb-bgsave");
         retval = rdbSave(filename,rsi);
         if (retval == C_OK) {
@@ -1126,6 +1755,16 @@ int rdbSaveBackground(char *filename, rdbSaveInfo *rsi) {
     return C_OK; /* unreached */
 }
 
+/* Start a BGSAVE on disk, in a child process or with rdb-save-forkless (or
+ * huge-pages, see hugepages.cpp) in this process, see snapshot.cpp. The
+ * full syncs of the slaves always use rdbSaveBackground(), since they are
+ * served when the child exits. */
+int rdbStartBackgroundSave(char *filename, rdbSaveInfo *rsi) {
+    if (server.rdb_save_forkless || hugePagesActive())
+        return snapshotStart(filename,rsi);
+    return rdbSaveBackground(filename,rsi);
+}
+
 void rdbRemoveTempFile(pid_t childpid) {
     char tmpfile[256];
 
@@ -1172,6 +1811,75 @@ robj *rdbLoadCheckModuleValue(rio *rdb, char *modulename) {
     return createStringObject("module-dummy-value",18);
 }
 
+/* Hashes and sorted sets saved by older versions are ziplist encoded: build
+ * a listpack with the same elements and free the ziplist. */
+static unsigned char *rdbConvertZiplistToListpack(unsigned char *zl) {
+    unsigned char *lp = lpNew();
+    unsigned char *p = ziplistIndex(zl,0);
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vll;
+    char buf[LONG_STR_SIZE];
+
+    while (ziplistGet(p,&vstr,&vlen,&vll)) {
+        if (vstr == NULL) {
+            vlen = ll2string(buf,sizeof(buf),vll);
+            vstr = (unsigned char*)buf;
+        }
+        lp = lpAppend(lp,vstr,vlen);
+        p = ziplistNext(zl,p);
+    }
+    zfree(zl);
+    return lp;
+}
+
+/* The radix trees of the streams, that are keyed by stream ID, are saved in
+ * the order of their keys: while loading, the IDs and the associated data
+ * are collected here, so that the tree can be built at once with
+ * raxNewFromSorted() instead of inserting one ID after the other. */
+struct rdbStreamIDs {
+    unsigned char *ids;     /* sizeof(streamID) bytes for every entry. */
+    void **data;
+    size_t count, size;
+};
+
+static void rdbStreamIDsAdd(rdbStreamIDs *s, unsigned char *id, void *data) {
+    if (s->count == s->size) {
+        s->size = s->size ? s->size*2 : 16;
+        s->ids = (unsigned char *)zrealloc(s->ids,s->size*sizeof(streamID));
+        s->data = (void **)zrealloc(s->data,s->size*sizeof(void*));
+    }
+    memcpy(s->ids+s->count*sizeof(streamID),id,sizeof(streamID));
+    s->data[s->count++] = data;
+}
+
+static void rdbStreamIDsFree(rdbStreamIDs *s) {
+    zfree(s->ids);
+    zfree(s->data);
+}
+
+/* Replace the empty tree '*r' with one made of the collected IDs and
+ * release them. Returns C_ERR if the IDs are not sorted or have
+ * duplicates, leaving '*r' as it is. */
+static int rdbStreamIDsToRax(rdbStreamIDs *s, rax **r) {
+    unsigned char **keys = (unsigned char **)zmalloc(sizeof(unsigned char*)*(s->count+1));
+    size_t *lens = (size_t *)zmalloc(sizeof(size_t)*(s->count+1));
+
+    for (size_t j = 0; j < s->count; j++) {
+        keys[j] = s->ids+j*sizeof(streamID);
+        lens[j] = sizeof(streamID);
+    }
+    rax *built = (*r)->numele ? NULL :
+                 raxNewFromSorted(keys,lens,s->data,s->count);
+    zfree(keys);
+    zfree(lens);
+    rdbStreamIDsFree(s);
+    if (built == NULL) return C_ERR;
+    raxFree(*r);
+    *r = built;
+    return C_OK;
+}
+
 /* Load a Redis object of the specified type from the specified file.
  * On success a newly allocated object is returned, otherwise NULL. */
 robj *rdbLoadObject(int rdbtype, rio *rdb) {
@@ -1180,9 +1888,20 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
     unsigned int i;
 
     if (rdbtype == RDB_TYPE_STRING) {
-        /* Read string value */
-        if ((o = rdbLoadEncodedStringObject(rdb)) == NULL) return NULL;
-        o = tryObjectEncoding(o);
+        /* Read string value, compressed strings are kept compressed. */
+        if ((o = (robj *)rdbGenericLoadStringObject(rdb,
+                 RDB_LOAD_ENC|RDB_LOAD_COMPRESSED,NULL)) == NULL) return NULL;
+        if (o->encoding != OBJ_ENCODING_COMPRESSED) {
+            robj *c;
+
+            o = tryObjectEncoding(o);
+            if (!tryChunkedBitmapEncoding(o,stringObjectLen(o)) &&
+                (c = tryStringCompression(o)) != NULL)
+            {
+                decrRefCount(o);
+                o = c;
+            }
+        }
     } else if (rdbtype == RDB_TYPE_LIST) {
         /* Read list value */
         if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
@@ -1204,13 +1923,11 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
         /* Read Set value */
         if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
 
-        /* Use a regular set when there are too many entries. */
+        /* Use a compressed bitmap when there are too many entries for an
+         * intset, it is converted to a regular set at the first element
+         * that is not an integer. */
         if (len > server.set_max_intset_entries) {
-            o = createSetObject();
-            /* It's faster to expand the dict to the right size asap in order
-             * to avoid rehashing */
-            if (len > DICT_HT_INITIAL_SIZE)
-                ((dict *)o->ptr)->dictExpand(len);
+            o = createRoaringSetObject(roaringCreate());
         } else {
             o = createIntsetObject();
         }
@@ -1223,10 +1940,15 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
             if ((sdsele = (sds)rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL))
                 == NULL) return NULL;
 
-            if (o->encoding == OBJ_ENCODING_INTSET) {
+            if (o->encoding == OBJ_ENCODING_INTSET ||
+                o->encoding == OBJ_ENCODING_ROARING)
+            {
                 /* Fetch integer value from element. */
                 if (isSdsRepresentableAsLongLong(sdsele,&llval) == C_OK) {
-                    o->ptr = intset::intsetAdd((intset *)o->ptr,llval,NULL);
+                    if (o->encoding == OBJ_ENCODING_INTSET)
+                        o->ptr = intset::intsetAdd((intset *)o->ptr,llval,NULL);
+                    else
+                        ((roaring *)o->ptr)->roaringAdd(llval);
                 } else {
                     setTypeConvert(o,OBJ_ENCODING_HT);
                     ((dict *)o->ptr)->dictExpand(len);
@@ -1241,21 +1963,51 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
                 sdsfree(sdsele);
             }
         }
+    } else if (rdbtype == RDB_TYPE_SET_ROARING) {
+        uint64_t containers, key, card;
+        roaring *r = roaringCreate();
+
+        o = createRoaringSetObject(r);
+        if ((containers = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
+        while (containers--) {
+            size_t l;
+            unsigned char *buf;
+
+            if ((key = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
+            if ((card = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
+            if ((buf = (unsigned char *)
+                 rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,&l)) == NULL)
+                return NULL;
+            if (card > UINT32_MAX ||
+                !r->roaringAppendContainer(key,(uint32_t)card,buf,l))
+                rdbExitReportCorruptRDB("Invalid compressed bitmap container");
+            zfree(buf);
+        }
+        if (r->roaringLen() == 0)
+            rdbExitReportCorruptRDB("Empty compressed bitmap");
     } else if (rdbtype == RDB_TYPE_ZSET_2 || rdbtype == RDB_TYPE_ZSET) {
         /* Read list/set value. */
         uint64_t zsetlen;
         size_t maxelelen = 0;
         zset *zs;
+        zskiplistPair *pairs = NULL;
+        unsigned long count = 0, capacity = 0;
+        int order = 0; /* -1 descending, 1 ascending, 0 unsorted. */
 
         if ((zsetlen = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
-        o = createZsetObject();
+        if (zsetlen > server.zset_max_skiplist_entries)
+            o = createZsetBtreeObject();
+        else
+            o = createZsetObject();
         zs = (zset *)o->ptr;
 
-        /* Load every single element of the sorted set. */
+        /* Load every single element of the sorted set. The elements of a
+         * skiplist are collected in order to bulk load it at the end:
+         * they are saved from the greatest to the smallest, but any order
+         * is accepted. */
         while(zsetlen--) {
             sds sdsele;
             double score;
-            zskiplistNode *znode;
 
             if ((sdsele = (sds)rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL))
                 == NULL) return NULL;
@@ -1269,15 +2021,46 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
             /* Don't care about integer-encoded strings. */
             if (sdslen(sdsele) > maxelelen) maxelelen = sdslen(sdsele);
 
-            znode = zs->zsl->zslInsert(score,sdsele);
-            zs->_dict->dictAdd(sdsele,&znode->score);
+            if (zs->zbt) {
+                zs->zbt->zbtInsert(score,sdsele);
+                zs->_dict->dictAddRaw(sdsele,NULL)->dictSetDoubleVal(score);
+                continue;
+            }
+            if (count == capacity) {
+                capacity = capacity ? capacity*2 : 64;
+                pairs = (zskiplistPair *)
+                    zrealloc(pairs,sizeof(zskiplistPair)*capacity);
+            }
+            pairs[count].score = score;
+            pairs[count].ele = sdsele;
+            if (count) {
+                int cmp = zslPairCompare(&pairs[count],&pairs[count-1]);
+                int dir = cmp < 0 ? -1 : 1;
+                if (count == 1) order = dir;
+                else if (order != dir) order = 0;
+            }
+            count++;
         }
+        if (count) {
+            if (order == -1) {
+                for (unsigned long j = 0; j < count/2; j++) {
+                    zskiplistPair tmp = pairs[j];
+                    pairs[j] = pairs[count-1-j];
+                    pairs[count-1-j] = tmp;
+                }
+            } else if (order == 0) {
+                qsort(pairs,count,sizeof(zskiplistPair),zslPairCompare);
+            }
+            if (zsetLoadSortedPairs(zs,pairs,count) != C_OK)
+                rdbExitReportCorruptRDB("Duplicated sorted set element");
+        }
+        zfree(pairs);
 
         /* Convert *after* loading, since sorted sets are not stored ordered. */
         if (zsetLength(o) <= server.zset_max_ziplist_entries &&
             maxelelen <= server.zset_max_ziplist_value)
-                zsetConvert(o,OBJ_ENCODING_ZIPLIST);
-    } else if (rdbtype == RDB_TYPE_HASH) {
+                zsetConvert(o,OBJ_ENCODING_LISTPACK);
+    } else if (rdbtype == RDB_TYPE_HASH || rdbtype == RDB_TYPE_HASH_TTL) {
         uint64_t len;
         int ret;
         sds field, value;
@@ -1291,8 +2074,8 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
         if (len > server.hash_max_ziplist_entries)
             hashTypeConvert(o, OBJ_ENCODING_HT);
 
-        /* Load every field and value into the ziplist */
-        while (o->encoding == OBJ_ENCODING_ZIPLIST && len > 0) {
+        /* Load every field and value into the listpack */
+        while (o->encoding == OBJ_ENCODING_LISTPACK && len > 0) {
             len--;
             /* Load raw strings */
             if ((field = (sds)rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL))
@@ -1300,11 +2083,11 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
             if ((value = (sds)rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL))
                 == NULL) return NULL;
 
-            /* Add pair to ziplist */
-            o->ptr = ziplistPush((unsigned char *)o->ptr, (unsigned char*)field,
-                    sdslen(field), ZIPLIST_TAIL);
-            o->ptr = ziplistPush((unsigned char *)o->ptr, (unsigned char*)value,
-                    sdslen(value), ZIPLIST_TAIL);
+            /* Add pair to listpack */
+            o->ptr = lpAppend((unsigned char *)o->ptr, (unsigned char*)field,
+                    sdslen(field));
+            o->ptr = lpAppend((unsigned char *)o->ptr, (unsigned char*)value,
+                    sdslen(value));
 
             /* Convert to hash table if size threshold is exceeded */
             if (sdslen(field) > server.hash_max_ziplist_value ||
@@ -1337,26 +2120,60 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
 
         /* All pairs should be read by now */
         serverAssert(len == 0);
-    } else if (rdbtype == RDB_TYPE_LIST_QUICKLIST) {
+
+        /* Load the expire time of the fields that have one. */
+        if (rdbtype == RDB_TYPE_HASH_TTL) {
+            long long when;
+
+            if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
+            while (len--) {
+                if ((field = (sds)rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL))
+                    == NULL) return NULL;
+                if ((when = rdbLoadMillisecondTime(rdb)) == -1) return NULL;
+                if (!hashTypeExists(o,field))
+                    rdbExitReportCorruptRDB("TTL of a missing hash field");
+                hashTypeSetFieldExpire(o,field,when);
+                sdsfree(field);
+            }
+        }
+    } else if (rdbtype == RDB_TYPE_LIST_QUICKLIST ||
+               rdbtype == RDB_TYPE_LIST_QUICKLIST_2)
+    {
         if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
         o = createQuicklistObject();
-        quicklistSetOptions((quicklist *)o->ptr, server.list_max_ziplist_size,
+        quicklist *ql = (quicklist *)o->ptr;
+        quicklistSetOptions(ql, server.list_max_ziplist_size,
                             server.list_compress_depth);
+        quicklistSetContainer(ql, rdbtype == RDB_TYPE_LIST_QUICKLIST_2 ?
+                                  QUICKLIST_NODE_CONTAINER_LISTPACK :
+                                  QUICKLIST_NODE_CONTAINER_ZIPLIST);
 
         while (len--) {
+            size_t encoded_len;
             unsigned char *zl =
-                (unsigned char *)rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,NULL);
+                (unsigned char *)rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,&encoded_len);
             if (zl == NULL) return NULL;
-            quicklistAppendZiplist((quicklist *)o->ptr, zl);
+            if (rdbtype == RDB_TYPE_LIST_QUICKLIST_2) {
+                if (lpBytes(zl) != encoded_len)
+                    rdbExitReportCorruptRDB("Listpack length mismatch");
+                quicklistAppendListpack(ql, zl);
+            } else {
+                quicklistAppendZiplist(ql, zl);
+            }
         }
+        /* Convert the nodes if the file was saved with the other container. */
+        quicklistSetContainer(ql, server.list_node_container);
     } else if (rdbtype == RDB_TYPE_HASH_ZIPMAP  ||
                rdbtype == RDB_TYPE_LIST_ZIPLIST ||
                rdbtype == RDB_TYPE_SET_INTSET   ||
                rdbtype == RDB_TYPE_ZSET_ZIPLIST ||
-               rdbtype == RDB_TYPE_HASH_ZIPLIST)
+               rdbtype == RDB_TYPE_HASH_ZIPLIST ||
+               rdbtype == RDB_TYPE_ZSET_LISTPACK ||
+               rdbtype == RDB_TYPE_HASH_LISTPACK)
     {
+        size_t encoded_len;
         unsigned char *encoded =
-            (unsigned char *)rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,NULL);
+            (unsigned char *)rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,&encoded_len);
         if (encoded == NULL) return NULL;
         o = createObject(OBJ_STRING,encoded); /* Obj type fixed below. */
 
@@ -1368,10 +2185,10 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
          * converted. */
         switch(rdbtype) {
             case RDB_TYPE_HASH_ZIPMAP:
-                /* Convert to ziplist encoded hash. This must be deprecated
+                /* Convert to listpack encoded hash. This must be deprecated
                  * when loading dumps created by Redis 2.4 gets deprecated. */
                 {
-                    unsigned char *zl = (unsigned char *)ziplistNew();
+                    unsigned char *zl = lpNew();
                     unsigned char *zi = (unsigned char *)zipmapRewind((unsigned char *)o->ptr);
                     unsigned char *fstr, *vstr;
                     unsigned int flen, vlen;
@@ -1380,14 +2197,14 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
                     while ((zi = zipmapNext(zi, &fstr, &flen, &vstr, &vlen)) != NULL) {
                         if (flen > maxlen) maxlen = flen;
                         if (vlen > maxlen) maxlen = vlen;
-                        zl = ziplistPush(zl, fstr, flen, ZIPLIST_TAIL);
-                        zl = ziplistPush(zl, vstr, vlen, ZIPLIST_TAIL);
+                        zl = lpAppend(zl, fstr, flen);
+                        zl = lpAppend(zl, vstr, vlen);
                     }
 
                     zfree(o->ptr);
                     o->ptr = zl;
                     o->type = OBJ_HASH;
-                    o->encoding = OBJ_ENCODING_ZIPLIST;
+                    o->encoding = OBJ_ENCODING_LISTPACK;
 
                     if (hashTypeLength(o) > server.hash_max_ziplist_entries ||
                         maxlen > server.hash_max_ziplist_value)
@@ -1405,17 +2222,28 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
                 o->type = OBJ_SET;
                 o->encoding = OBJ_ENCODING_INTSET;
                 if (((intset *)o->ptr)->intsetLen() > server.set_max_intset_entries)
-                    setTypeConvert(o,OBJ_ENCODING_HT);
+                    setTypeConvert(o,OBJ_ENCODING_ROARING);
                 break;
             case RDB_TYPE_ZSET_ZIPLIST:
+            case RDB_TYPE_ZSET_LISTPACK:
+                if (rdbtype == RDB_TYPE_ZSET_ZIPLIST)
+                    o->ptr = rdbConvertZiplistToListpack((unsigned char *)o->ptr);
+                else if (lpBytes((unsigned char *)o->ptr) != encoded_len)
+                    rdbExitReportCorruptRDB("Listpack length mismatch");
                 o->type = OBJ_ZSET;
-                o->encoding = OBJ_ENCODING_ZIPLIST;
+                o->encoding = OBJ_ENCODING_LISTPACK;
                 if (zsetLength(o) > server.zset_max_ziplist_entries)
                     zsetConvert(o,OBJ_ENCODING_SKIPLIST);
+                zsetConvertToBtreeIfNeeded(o);
                 break;
             case RDB_TYPE_HASH_ZIPLIST:
+            case RDB_TYPE_HASH_LISTPACK:
+                if (rdbtype == RDB_TYPE_HASH_ZIPLIST)
+                    o->ptr = rdbConvertZiplistToListpack((unsigned char *)o->ptr);
+                else if (lpBytes((unsigned char *)o->ptr) != encoded_len)
+                    rdbExitReportCorruptRDB("Listpack length mismatch");
                 o->type = OBJ_HASH;
-                o->encoding = OBJ_ENCODING_ZIPLIST;
+                o->encoding = OBJ_ENCODING_LISTPACK;
                 if (hashTypeLength(o) > server.hash_max_ziplist_entries)
                     hashTypeConvert(o, OBJ_ENCODING_HT);
                 break;
@@ -1423,6 +2251,138 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
                 rdbExitReportCorruptRDB("Unknown RDB encoding type %d",rdbtype);
                 break;
         }
+    } else if (rdbtype == RDB_TYPE_STREAM_LISTPACKS) {
+        uint64_t listpacks;
+        stream *s;
+
+        o = createStreamObject();
+        s = (stream *)o->ptr;
+        if ((listpacks = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
+        rdbStreamIDs nodes = {NULL,NULL,0,0};
+        while(listpacks--) {
+            /* Get the master ID, the one we'll use as key of the radix tree
+             * node: the entries inside the listpack itself are delta-encoded
+             * relatively to this ID. */
+            sds nodekey = (sds)rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL);
+            if (nodekey == NULL) {
+                rdbStreamIDsFree(&nodes);
+                return NULL;
+            }
+            if (sdslen(nodekey) != sizeof(streamID)) {
+                rdbExitReportCorruptRDB("Stream node key entry is not the "
+                                        "size of a stream ID");
+            }
+            /* Load the listpack. */
+            unsigned char *lp = (unsigned char *)
+                rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,NULL);
+            if (lp == NULL) {
+                sdsfree(nodekey);
+                rdbStreamIDsFree(&nodes);
+                return NULL;
+            }
+            if (lpFirst(lp) == NULL) {
+                /* Serialized listpacks should never be empty, since on
+                 * deletion we should remove the radix tree key if the
+                 * resulting listpack is empty. */
+                rdbExitReportCorruptRDB("Empty listpack inside stream");
+            }
+
+            /* The radix tree is built once all the keys are loaded. */
+            rdbStreamIDsAdd(&nodes,(unsigned char*)nodekey,lp);
+            sdsfree(nodekey);
+        }
+        if (rdbStreamIDsToRax(&nodes,&s->rax) == C_ERR)
+            rdbExitReportCorruptRDB("Listpack re-added with existing key");
+        /* Load total number of items inside the stream, and the last
+         * entry ID, whose parts may be UINT64_MAX, that is RDB_LENERR. */
+        if ((s->length = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
+        if (rdbLoadLenByRef(rdb,NULL,&s->last_id.ms) == -1 ||
+            rdbLoadLenByRef(rdb,NULL,&s->last_id.seq) == -1) return NULL;
+
+        /* Load the consumer groups. */
+        uint64_t cgroups_count = rdbLoadLen(rdb,NULL);
+        if (cgroups_count == RDB_LENERR) return NULL;
+        while(cgroups_count--) {
+            /* Get the consumer group name and ID. We can then create the
+             * consumer group ASAP and populate its structure as
+             * we read more data. */
+            streamID cg_id;
+            sds cgname = (sds)rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL);
+            if (cgname == NULL) return NULL;
+            if (rdbLoadLenByRef(rdb,NULL,&cg_id.ms) == -1 ||
+                rdbLoadLenByRef(rdb,NULL,&cg_id.seq) == -1) return NULL;
+            streamCG *cgroup = streamCreateCG(s,cgname,sdslen(cgname),&cg_id);
+            if (cgroup == NULL)
+                rdbExitReportCorruptRDB("Duplicated consumer group name %s",
+                                        cgname);
+            sdsfree(cgname);
+
+            /* Load the global PEL for this consumer group, however we'll
+             * not yet populate the NACK structures with the message
+             * owner, since consumers for this group and their messages will
+             * be read as a next step. So for now leave them not resolved
+             * and later populate it. */
+            uint64_t pel_size = rdbLoadLen(rdb,NULL);
+            if (pel_size == RDB_LENERR) return NULL;
+            rdbStreamIDs pel = {NULL,NULL,0,0};
+            while(pel_size--) {
+                unsigned char rawid[sizeof(streamID)];
+                if (rdb->rioRead(rawid,sizeof(rawid)) == 0) {
+                    rdbStreamIDsFree(&pel);
+                    return NULL;
+                }
+                streamNACK *nack = streamCreateNACK(NULL);
+                nack->delivery_time = rdbLoadMillisecondTime(rdb);
+                rdbStreamIDsAdd(&pel,rawid,nack);
+                if (rdbLoadLenByRef(rdb,NULL,&nack->delivery_count) == -1) {
+                    rdbStreamIDsFree(&pel);
+                    return NULL;
+                }
+            }
+            if (rdbStreamIDsToRax(&pel,&cgroup->pel) == C_ERR)
+                rdbExitReportCorruptRDB("Duplicated gobal PEL entry "
+                                        "loading stream consumer group");
+
+            /* Now that we loaded our global PEL, we need to load the
+             * consumers and their local PELs. */
+            uint64_t consumers_num = rdbLoadLen(rdb,NULL);
+            if (consumers_num == RDB_LENERR) return NULL;
+            while(consumers_num--) {
+                sds cname = (sds)rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL);
+                if (cname == NULL) return NULL;
+                streamConsumer *consumer = streamLookupConsumer(cgroup,cname,1);
+                sdsfree(cname);
+                consumer->seen_time = rdbLoadMillisecondTime(rdb);
+
+                /* Load the PEL about entries owned by this specific
+                 * consumer. */
+                pel_size = rdbLoadLen(rdb,NULL);
+                if (pel_size == RDB_LENERR) return NULL;
+                rdbStreamIDs cpel = {NULL,NULL,0,0};
+                while(pel_size--) {
+                    unsigned char rawid[sizeof(streamID)];
+                    if (rdb->rioRead(rawid,sizeof(rawid)) == 0) {
+                        rdbStreamIDsFree(&cpel);
+                        return NULL;
+                    }
+                    streamNACK *nack = (streamNACK *)
+                        raxFind(cgroup->pel,rawid,sizeof(rawid));
+                    if (nack == raxNotFound)
+                        rdbExitReportCorruptRDB("Consumer entry not found in "
+                                                "group global PEL");
+
+                    /* Set the NACK consumer, that was left to NULL when
+                     * loading the global PEL. Then set the same shared
+                     * NACK structure also in the consumer-specific PEL. */
+                    nack->consumer = consumer;
+                    rdbStreamIDsAdd(&cpel,rawid,nack);
+                }
+                if (rdbStreamIDsToRax(&cpel,&consumer->pel) == C_ERR)
+                    rdbExitReportCorruptRDB("Duplicated consumer PEL entry "
+                                            " loading a stream consumer "
+                                            "group");
+            }
+        }
     } else if (rdbtype == RDB_TYPE_MODULE || rdbtype == RDB_TYPE_MODULE_2) {
         uint64_t moduleid = rdbLoadLen(rdb,NULL);
         moduleType *mt = moduleTypeLookupModuleByID(moduleid);
@@ -1470,13 +2430,26 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
 /* Mark that we are loading in the global state and setup the fields
  * needed to provide loading stats. */
 void startLoading(FILE *fp) {
+    startLoadingStats(fp);
+    server.loading = 1;
+}
+
+/* Like startLoading() for a dataset loaded aside while the old one is
+ * still served, see repl-async-load: the server is not flagged as loading,
+ * so that the read only commands are not refused. */
+void startAsyncLoading(FILE *fp) {
+    startLoadingStats(fp);
+    server.async_loading = 1;
+}
+
+/* Setup the fields needed to provide loading stats. 'fp' is NULL when the
+ * data is not loaded from a file, so its size is unknown. */
+void startLoadingStats(FILE *fp) {
     struct stat sb;
 
-    /* Load the DB */
-    server.loading = 1;
     server.loading_start_time = time(NULL);
     server.loading_loaded_bytes = 0;
-    if (fstat(fileno(fp), &sb) == -1) {
+    if (fp == NULL || fstat(fileno(fp), &sb) == -1) {
         server.loading_total_bytes = 0;
     } else {
         server.loading_total_bytes = sb.st_size;
@@ -1493,6 +2466,7 @@ void loadingProgress(off_t pos) {
 /* Loading finished */
 void stopLoading() {
     server.loading = 0;
+    server.async_loading = 0;
 }
 
 /* Track loading progress in order to serve client's from time to time
@@ -1514,14 +2488,451 @@ void rdbLoadProgressCallback(rio *r, const void *buf, size_t len) {
     }
 }
 
+/* -----------------------------------------------------------------------------
+ * Parallel loading
+ *
+ * With rdb-load-threads greater than one, rdbLoadRio() works as a pipeline.
+ * The main thread reads the records from the stream and copies the raw
+ * bytes of their keys and values in batches, without decoding them: this is
+ * just reading lengths and payloads. The batches are decoded by the loader
+ * threads, that decompress the strings and build the objects, and come back
+ * to the main thread that adds the keys to the databases, that are already
+ * sized after the RDB_OPCODE_RESIZEDB hints. Module values are loaded by the
+ * main thread itself, since modules can't be called from other threads.
+ *
+ * The RDB_OPCODE_CHUNK records of files saved with rdb-save-threads are
+ * already framed: they become batches as they are, decompressed by the
+ * loader threads in the case of RDB_OPCODE_CHUNK_COMPRESSED.
+ * -------------------------------------------------------------------------- */
+
+#define RDB_LOAD_BATCH_RECORDS RDB_CHUNK_MAX_KEYS
+#define RDB_LOAD_BATCH_BYTES (1024*1024)
+#define RDB_LOAD_INFLIGHT_PER_THREAD 4 /* Batches queued or being decoded. */
+
+struct rdbLoadRecord {
+    int type;
+    redisDb *db;
+    long long expiretime;
+    robj *key, *val;        /* Set by the loader thread. */
+};
+
+struct rdbLoadBatch {
+    sds raw;                /* Keys and values of the records, in order. */
+    int count;
+    int failed;             /* A record could not be decoded. */
+    redisDb *chunkdb;       /* Not NULL for RDB_OPCODE_CHUNK batches, whose
+                               records have their type and expire time in
+                               'raw' as well. */
+    int codec;              /* RDB_ENC_* codec of compressed chunks, or 0. */
+    size_t rawlen;          /* Decompressed length of compressed chunks. */
+    rdbLoadRecord records[RDB_LOAD_BATCH_RECORDS];
+};
+
+struct rdbLoadPipeline {
+    pthread_t threads[RDB_LOAD_MAX_THREADS];
+    int numthreads;
+    pthread_mutex_t mutex;
+    pthread_cond_t todo_cond;   /* Signaled when a batch is queued. */
+    pthread_cond_t done_cond;   /* Signaled when a batch is decoded. */
+    list *todo, *done;
+    int inflight;               /* Batches not back to the main thread. */
+    int exiting;
+};
+
+/* The batch the raw bytes read from the stream are copied to, if any. */
+static rdbLoadBatch *rdb_framing = NULL;
+
+static void rdbFrameProgressCallback(rio *r, const void *buf, size_t len) {
+    rdbLoadProgressCallback(r,buf,len);
+    if (rdb_framing)
+        rdb_framing->raw = sdscatlen(rdb_framing->raw,buf,len);
+}
+
+/* Read 'len' bytes of payload straight into the batch being framed, or
+ * just skip them if no batch is being framed, see rdbSkipObject(). */
+static int rdbFramePayload(rio *rdb, size_t len) {
+    rdbLoadBatch *b = rdb_framing;
+    int retval = 0;
+
+    if (len == 0) return 0;
+    if (b == NULL) {
+        char buf[4096];
+        while (len) {
+            size_t chunk = len < sizeof(buf) ? len : sizeof(buf);
+            if (rdb->rioRead(buf,chunk) == 0) return -1;
+            len -= chunk;
+        }
+        return 0;
+    }
+    b->raw = sdsMakeRoomFor(b->raw,len);
+    rdb_framing = NULL;
+    if (rdb->rioRead(b->raw+sdslen(b->raw),len) == 0) retval = -1;
+    else sdsIncrLen(b->raw,len);
+    rdb_framing = b;
+    return retval;
+}
+
+static int rdbFrameLen(rio *rdb, uint64_t *len) {
+    return rdbLoadLenByRef(rdb,NULL,len);
+}
+
+/* Frame a string as rdbGenericLoadStringObject() would read it. */
+static int rdbFrameString(rio *rdb) {
+    int isencoded;
+    uint64_t len, clen;
+
+    if (rdbLoadLenByRef(rdb,&isencoded,&len) == -1) return -1;
+    if (!isencoded) return rdbFramePayload(rdb,len);
+    switch(len) {
+    case RDB_ENC_INT8: return rdbFramePayload(rdb,1);
+    case RDB_ENC_INT16: return rdbFramePayload(rdb,2);
+    case RDB_ENC_INT32: return rdbFramePayload(rdb,4);
+    case RDB_ENC_LZF:
+    case RDB_ENC_LZ4:
+    case RDB_ENC_ZSTD:
+        if (rdbFrameLen(rdb,&clen) == -1 || rdbFrameLen(rdb,&len) == -1)
+            return -1;
+        return rdbFramePayload(rdb,clen);
+    default:
+        rdbExitReportCorruptRDB("Unknown RDB string encoding type %d",len);
+        return -1; /* Never reached. */
+    }
+}
+
+/* Frame the serialized stream consumer groups, see rdbLoadObject(). */
+static int rdbFrameStreamGroups(rio *rdb) {
+    uint64_t cgroups, pel, consumers, aux;
+
+    if (rdbFrameLen(rdb,&cgroups) == -1) return -1;
+    while (cgroups--) {
+        if (rdbFrameString(rdb) == -1 ||
+            rdbFrameLen(rdb,&aux) == -1 || rdbFrameLen(rdb,&aux) == -1 ||
+            rdbFrameLen(rdb,&pel) == -1) return -1;
+        while (pel--) {
+            /* Entry ID, delivery time and count. */
+            if (rdbFramePayload(rdb,sizeof(streamID)+8) == -1 ||
+                rdbFrameLen(rdb,&aux) == -1) return -1;
+        }
+        if (rdbFrameLen(rdb,&consumers) == -1) return -1;
+        while (consumers--) {
+            if (rdbFrameString(rdb) == -1 ||
+                rdbFramePayload(rdb,8) == -1 ||
+                rdbFrameLen(rdb,&pel) == -1) return -1;
+            if (rdbFramePayload(rdb,pel*sizeof(streamID)) == -1) return -1;
+        }
+    }
+    return 0;
+}
+
+/* Copy the serialized value of type 'rdbtype' into the batch being framed
+ * without decoding it. Returns 0 on success, -1 on short read. Module
+ * values can't be framed since only the module knows their format. */
+static int rdbFrameObject(rio *rdb, int rdbtype) {
+    uint64_t len, aux;
+    double score;
+
+    if (rdbtype == RDB_TYPE_STRING ||
+        rdbtype == RDB_TYPE_HASH_ZIPMAP ||
+        rdbtype == RDB_TYPE_LIST_ZIPLIST ||
+        rdbtype == RDB_TYPE_SET_INTSET ||
+        rdbtype == RDB_TYPE_ZSET_ZIPLIST ||
+        rdbtype == RDB_TYPE_HASH_ZIPLIST ||
+        rdbtype == RDB_TYPE_ZSET_LISTPACK ||
+        rdbtype == RDB_TYPE_HASH_LISTPACK)
+    {
+        return rdbFrameString(rdb);
+    } else if (rdbtype == RDB_TYPE_LIST || rdbtype == RDB_TYPE_SET ||
+               rdbtype == RDB_TYPE_LIST_QUICKLIST ||
+               rdbtype == RDB_TYPE_LIST_QUICKLIST_2)
+    {
+        if (rdbFrameLen(rdb,&len) == -1) return -1;
+        while (len--) if (rdbFrameString(rdb) == -1) return -1;
+    } else if (rdbtype == RDB_TYPE_SET_ROARING) {
+        if (rdbFrameLen(rdb,&len) == -1) return -1;
+        while (len--) {
+            if (rdbFrameLen(rdb,&aux) == -1 || rdbFrameLen(rdb,&aux) == -1 ||
+                rdbFrameString(rdb) == -1) return -1;
+        }
+    } else if (rdbtype == RDB_TYPE_ZSET_2 || rdbtype == RDB_TYPE_ZSET) {
+        if (rdbFrameLen(rdb,&len) == -1) return -1;
+        while (len--) {
+            if (rdbFrameString(rdb) == -1) return -1;
+            if (rdbtype == RDB_TYPE_ZSET_2) {
+                if (rdbFramePayload(rdb,sizeof(double)) == -1) return -1;
+            } else {
+                if (rdbLoadDoubleValue(rdb,&score) == -1) return -1;
+            }
+        }
+    } else if (rdbtype == RDB_TYPE_HASH || rdbtype == RDB_TYPE_HASH_TTL) {
+        if (rdbFrameLen(rdb,&len) == -1) return -1;
+        while (len--) {
+            if (rdbFrameString(rdb) == -1 || rdbFrameString(rdb) == -1)
+                return -1;
+        }
+        if (rdbtype == RDB_TYPE_HASH_TTL) {
+            if (rdbFrameLen(rdb,&len) == -1) return -1;
+            while (len--) {
+                if (rdbFrameString(rdb) == -1 ||
+                    rdbFramePayload(rdb,8) == -1) return -1;
+            }
+        }
+    } else if (rdbtype == RDB_TYPE_STREAM_LISTPACKS) {
+        if (rdbFrameLen(rdb,&len) == -1) return -1;
+        while (len--) {
+            if (rdbFrameString(rdb) == -1 || rdbFrameString(rdb) == -1)
+                return -1;
+        }
+        /* Length and last ID. */
+        if (rdbFrameLen(rdb,&aux) == -1 || rdbFrameLen(rdb,&aux) == -1 ||
+            rdbFrameLen(rdb,&aux) == -1) return -1;
+        return rdbFrameStreamGroups(rdb);
+    } else {
+        rdbExitReportCorruptRDB("Unknown RDB encoding type %d",rdbtype);
+    }
+    return 0;
+}
+
+/* Skip the serialized value of type 'rdbtype' without decoding it. Returns
+ * 0 on success, -1 on short read. Used by lazy-loading to index the file. */
+int rdbSkipObject(rio *rdb, int rdbtype) {
+    serverAssert(rdb_framing == NULL);
+    return rdbFrameObject(rdb,rdbtype);
+}
+
+static rdbLoadBatch *rdbLoadBatchCreate(void) {
+    rdbLoadBatch *b = (rdbLoadBatch*)zmalloc(sizeof(*b));
+
+    b->raw = sdsempty();
+    b->count = 0;
+    b->failed = 0;
+    b->chunkdb = NULL;
+    b->codec = 0;
+    b->rawlen = 0;
+    return b;
+}
+
+/* Read the expire time and the type of a record of a chunk. Module values
+ * are never saved in chunks. */
+static int rdbLoadChunkRecordHeader(rio *rdb, rdbLoadRecord *r, redisDb *db) {
+    r->db = db;
+    r->expiretime = -1;
+    if ((r->type = rdbLoadType(rdb)) == -1) return -1;
+    if (r->type == RDB_OPCODE_EXPIRETIME_MS) {
+        if ((r->expiretime = rdbLoadMillisecondTime(rdb)) == -1) return -1;
+        if ((r->type = rdbLoadType(rdb)) == -1) return -1;
+    }
+    if (!rdbIsObjectType(r->type) || r->type == RDB_TYPE_MODULE ||
+        r->type == RDB_TYPE_MODULE_2) return -1;
+    return 0;
+}
+
+/* Decode the keys and values of a batch, in a loader thread. */
+static void rdbLoadDecodeBatch(rdbLoadBatch *b) {
+    if (b->codec) {
+        sds raw = sdsnewlen(NULL,b->rawlen);
+        if (!rdbDecompress(b->codec,b->raw,sdslen(b->raw),raw,b->rawlen)) {
+            sdsclear(raw);
+            b->count = 0;
+            b->failed = 1;
+        }
+        sdsfree(b->raw);
+        b->raw = raw;
+    }
+
+    rioBufferIO rdb(b->raw);
+
+    for (int j = 0; j < b->count; j++) {
+        rdbLoadRecord *r = &b->records[j];
+        if (b->chunkdb && rdbLoadChunkRecordHeader(&rdb,r,b->chunkdb) == -1) {
+            b->count = j;
+            b->failed = 1;
+            break;
+        }
+        r->key = rdbLoadStringObject(&rdb);
+        r->val = r->key ? rdbLoadObject(r->type,&rdb) : NULL;
+        if (r->val == NULL) {
+            if (r->key) decrRefCount(r->key);
+            b->count = j;
+            b->failed = 1;
+            break;
+        }
+    }
+    /* A chunk must contain exactly the records it declares. */
+    if (b->chunkdb && (size_t)rdb.rioTell() != sdslen(b->raw)) b->failed = 1;
+    sdsfree(b->raw);
+    b->raw = NULL;
+}
+
+static void *rdbLoadThreadMain(void *arg) {
+    rdbLoadPipeline *p = (rdbLoadPipeline*)arg;
+    sigset_t sigset;
+
+    /* Only the main thread receives the watchdog signal. */
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+    pthread_mutex_lock(&p->mutex);
+    while(1) {
+        if (p->todo->listLength() == 0) {
+            if (p->exiting) break;
+            pthread_cond_wait(&p->todo_cond,&p->mutex);
+            continue;
+        }
+        listNode *ln = p->todo->listFirst();
+        rdbLoadBatch *b = (rdbLoadBatch*)ln->listNodeValue();
+        p->todo->listDelNode(ln);
+        pthread_mutex_unlock(&p->mutex);
+
+        rdbLoadDecodeBatch(b);
+
+        pthread_mutex_lock(&p->mutex);
+        p->done->listAddNodeTail(b);
+        pthread_cond_signal(&p->done_cond);
+    }
+    pthread_mutex_unlock(&p->mutex);
+    return NULL;
+}
+
+static rdbLoadPipeline *rdbLoadPipelineCreate(int numthreads) {
+    rdbLoadPipeline *p = (rdbLoadPipeline*)zmalloc(sizeof(*p));
+
+    pthread_mutex_init(&p->mutex,NULL);
+    pthread_cond_init(&p->todo_cond,NULL);
+    pthread_cond_init(&p->done_cond,NULL);
+    p->todo = listCreate();
+    p->done = listCreate();
+    p->inflight = 0;
+    p->exiting = 0;
+    p->numthreads = 0;
+    while (p->numthreads < numthreads) {
+        if (pthread_create(&p->threads[p->numthreads],NULL,
+                           rdbLoadThreadMain,p) != 0) break;
+        p->numthreads++;
+    }
+    if (p->numthreads < numthreads)
+        serverLog(LL_WARNING,"Can't create RDB loader threads: %s. "
+            "Loading with %d threads.", strerror(errno), p->numthreads);
+    return p;
+}
+
+/* Stop the loader threads. All the batches must be collected already. */
+static void rdbLoadPipelineRelease(rdbLoadPipeline *p) {
+    pthread_mutex_lock(&p->mutex);
+    p->exiting = 1;
+    pthread_cond_broadcast(&p->todo_cond);
+    pthread_mutex_unlock(&p->mutex);
+    for (int j = 0; j < p->numthreads; j++) pthread_join(p->threads[j],NULL);
+    listRelease(p->todo);
+    listRelease(p->done);
+    pthread_mutex_destroy(&p->mutex);
+    pthread_cond_destroy(&p->todo_cond);
+    pthread_cond_destroy(&p->done_cond);
+    zfree(p);
+}
+
+/* Add a key loaded from the RDB file to 'db', taking the references of
+ * 'key' and 'val'. */
+static void rdbLoadInsertKey(redisDb *db, robj *key, robj *val,
+                             long long expiretime, long long now)
+{
+    /* Check if the key already expired. This function is used when loading
+     * an RDB file from disk, either at startup, or when an RDB was
+     * received from the master. In the latter case, the master is
+     * responsible for key expiry. If we would expire keys here, the
+     * snapshot taken by the master may not be reflected on the slave. */
+    if (server.masterhost == NULL && expiretime != -1 && expiretime < now) {
+        decrRefCount(key);
+        decrRefCount(val);
+        return;
+    }
+    /* Add the new object in the hash table */
+    if (dbAddFusedString(db,key,val))
+        decrRefCount(val);
+    else
+        dbAdd(db,key,val);
+
+    /* Set the expire time if needed */
+    if (expiretime != -1) setExpire(NULL,db,key,expiretime);
+
+    decrRefCount(key);
+}
+
+/* Add the keys of a decoded batch to the databases and free it. Returns
+ * C_ERR if some record could not be decoded. */
+static int rdbLoadInsertBatch(rdbLoadBatch *b, long long now) {
+    int retval = b->failed ? C_ERR : C_OK;
+
+    for (int j = 0; j < b->count; j++) {
+        rdbLoadRecord *r = &b->records[j];
+        rdbLoadInsertKey(r->db,r->key,r->val,r->expiretime,now);
+    }
+    zfree(b);
+    return retval;
+}
+
+/* Queue a framed batch for decoding. Without loader threads it is decoded
+ * right away. */
+static void rdbLoadPipelineSubmit(rdbLoadPipeline *p, rdbLoadBatch *b) {
+    pthread_mutex_lock(&p->mutex);
+    p->inflight++;
+    if (p->numthreads) {
+        p->todo->listAddNodeTail(b);
+        pthread_cond_signal(&p->todo_cond);
+    } else {
+        pthread_mutex_unlock(&p->mutex);
+        rdbLoadDecodeBatch(b);
+        pthread_mutex_lock(&p->mutex);
+        p->done->listAddNodeTail(b);
+    }
+    pthread_mutex_unlock(&p->mutex);
+}
+
+/* Add to the databases the keys of the decoded batches, waiting until no
+ * more than 'maxinflight' batches are still queued or being decoded, so
+ * that the memory used by the raw batches stays bounded. Returns C_ERR if
+ * some record could not be decoded. */
+static int rdbLoadPipelineCollect(rdbLoadPipeline *p, int maxinflight,
+                                  long long now)
+{
+    int retval = C_OK;
+
+    pthread_mutex_lock(&p->mutex);
+    while(1) {
+        while (p->done->listLength() == 0 && p->inflight > maxinflight)
+            pthread_cond_wait(&p->done_cond,&p->mutex);
+        if (p->done->listLength() == 0) break;
+
+        listNode *ln = p->done->listFirst();
+        rdbLoadBatch *b = (rdbLoadBatch*)ln->listNodeValue();
+        p->done->listDelNode(ln);
+        p->inflight--;
+        pthread_mutex_unlock(&p->mutex);
+
+        if (rdbLoadInsertBatch(b,now) == C_ERR) retval = C_ERR;
+
+        pthread_mutex_lock(&p->mutex);
+    }
+    pthread_mutex_unlock(&p->mutex);
+    return retval;
+}
+
 /* Load an RDB file from the rio stream 'rdb'. On success C_OK is returned,
  * otherwise C_ERR is returned and 'errno' is set accordingly. */
 int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi) {
+    return rdbLoadRioInto(rdb,rsi,server.db);
+}
+
+/* Like rdbLoadRio() but the keys are added to the array of server.dbnum
+ * databases 'dbarray' instead of server.db. */
+int rdbLoadRioInto(rio *rdb, rdbSaveInfo *rsi, redisDb *dbarray) {
     uint64_t dbid;
     int type, rdbver;
-    redisDb *db = server.db+0;
+    redisDb *db = dbarray+0;
     char buf[1024];
     long long expiretime, now = mstime();
+    rdbLoadPipeline *pipeline = NULL;
+    rdbLoadBatch *batch = NULL;
 
     rdb->m_update_cksum_func = rdbLoadProgressCallback;
     rdb->m_max_processing_chunk = server.loading_process_events_interval_bytes;
@@ -1538,6 +2949,10 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi) {
         errno = EINVAL;
         return C_ERR;
     }
+    if (server.rdb_load_threads > 1 && !lazyLoadIndexing()) {
+        pipeline = rdbLoadPipelineCreate(server.rdb_load_threads);
+        rdb->m_update_cksum_func = rdbFrameProgressCallback;
+    }
 
     while(1) {
         robj *key, *val;
@@ -1577,7 +2992,7 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi) {
                     "databases. Exiting\n", server.dbnum);
                 exit(1);
             }
-            db = server.db+dbid;
+            db = dbarray+dbid;
             continue; /* Read type again. */
         } else if (type == RDB_OPCODE_RESIZEDB) {
             /* RESIZEDB: Hint about the size of the keys in the currently
@@ -1590,6 +3005,46 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi) {
             db->m_dict->dictExpand(db_size);
             db->m_expires->dictExpand(expires_size);
             continue; /* Read type again. */
+        } else if (type == RDB_OPCODE_CHUNK ||
+                   type == RDB_OPCODE_CHUNK_COMPRESSED) {
+            /* CHUNK: keys that can be decoded on their own, saved by the
+             * rdb-save-threads. They go to the loader threads as they are. */
+            uint64_t chunkdb, count, len, rawlen = 0;
+            int codec = 0;
+            if ((chunkdb = rdbLoadLen(rdb,NULL)) == RDB_LENERR ||
+                (count = rdbLoadLen(rdb,NULL)) == RDB_LENERR) goto eoferr;
+            if (type == RDB_OPCODE_CHUNK_COMPRESSED) {
+                if ((codec = rdbLoadType(rdb)) == -1 ||
+                    (rawlen = rdbLoadLen(rdb,NULL)) == RDB_LENERR)
+                    goto eoferr;
+                if (!rdbCompressionAvailable(codec))
+                    rdbExitReportCorruptRDB("RDB chunk compressed with %s, "
+                        "that this Redis was built without",
+                        rdbCompressionName(codec));
+            }
+            if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) goto eoferr;
+            if (chunkdb >= (unsigned)server.dbnum ||
+                count > RDB_LOAD_BATCH_RECORDS)
+                rdbExitReportCorruptRDB("Invalid RDB chunk header");
+
+            rdbLoadBatch *chunk = rdbLoadBatchCreate();
+            chunk->chunkdb = dbarray+chunkdb;
+            chunk->count = count;
+            chunk->codec = codec;
+            chunk->rawlen = rawlen;
+            chunk->raw = sdsMakeRoomFor(chunk->raw,len);
+            if (len && rdb->rioRead(chunk->raw,len) == 0) goto eoferr;
+            sdsIncrLen(chunk->raw,len);
+            if (pipeline) {
+                rdbLoadPipelineSubmit(pipeline,chunk);
+                if (rdbLoadPipelineCollect(pipeline,
+                        pipeline->numthreads*RDB_LOAD_INFLIGHT_PER_THREAD,
+                        now) == C_ERR) goto eoferr;
+            } else {
+                rdbLoadDecodeBatch(chunk);
+                if (rdbLoadInsertBatch(chunk,now) == C_ERR) goto eoferr;
+            }
+            continue; /* Read type again. */
         } else if (type == RDB_OPCODE_AUX) {
             /* AUX: generic string-string fields. Use to add state to RDB
              * which is backward compatible. Implementations of RDB loading
@@ -1623,6 +3078,25 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi) {
                         "Can't load Lua script from RDB file! "
                         "BODY: %s", auxval->ptr);
                 }
+            } else if (!strcasecmp((const char*)auxkey->ptr,"lua-function")) {
+                sds val = (sds)auxval->ptr;
+                char *space = (char *)memchr(val,' ',sdslen(val));
+                sds name;
+                robj *body;
+                int retval;
+
+                if (space == NULL)
+                    rdbExitReportCorruptRDB("Malformed Lua function in RDB");
+                name = sdsnewlen(val,space-val);
+                body = createStringObject(space+1,sdslen(val)-(space-val)-1);
+                retval = luaFunctionCreate(NULL,name,body,1);
+                if (retval == C_ERR) {
+                    rdbExitReportCorruptRDB(
+                        "Can't load Lua function from RDB file! "
+                        "NAME: %s", name);
+                }
+                sdsfree(name);
+                decrRefCount(body);
             } else {
                 /* We ignore fields we don't understand, as by AUX field
                  * contract. */
@@ -1635,27 +3109,48 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi) {
             continue; /* Read type again. */
         }
 
-        /* Read key */
-        if ((key = rdbLoadStringObject(rdb)) == NULL) goto eoferr;
-        /* Read value */
-        if ((val = rdbLoadObject(type,rdb)) == NULL) goto eoferr;
-        /* Check if the key already expired. This function is used when loading
-         * an RDB file from disk, either at startup, or when an RDB was
-         * received from the master. In the latter case, the master is
-         * responsible for key expiry. If we would expire keys here, the
-         * snapshot taken by the master may not be reflected on the slave. */
-        if (server.masterhost == NULL && expiretime != -1 && expiretime < now) {
-            decrRefCount(key);
-            decrRefCount(val);
+        /* Frame the key and the value for the loader threads. */
+        if (pipeline && type != RDB_TYPE_MODULE && type != RDB_TYPE_MODULE_2) {
+            if (batch == NULL) batch = rdbLoadBatchCreate();
+            rdbLoadRecord *r = &batch->records[batch->count++];
+            r->type = type;
+            r->db = db;
+            r->expiretime = expiretime;
+
+            rdb_framing = batch;
+            int framed = rdbFrameString(rdb) != -1 &&
+                         rdbFrameObject(rdb,type) != -1;
+            rdb_framing = NULL;
+            if (!framed) goto eoferr;
+
+            if (batch->count == RDB_LOAD_BATCH_RECORDS ||
+                sdslen(batch->raw) >= RDB_LOAD_BATCH_BYTES)
+            {
+                rdbLoadPipelineSubmit(pipeline,batch);
+                batch = NULL;
+                if (rdbLoadPipelineCollect(pipeline,
+                        pipeline->numthreads*RDB_LOAD_INFLIGHT_PER_THREAD,
+                        now) == C_ERR) goto eoferr;
+            }
             continue;
         }
-        /* Add the new object in the hash table */
-        dbAdd(db,key,val);
-
-        /* Set the expire time if needed */
-        if (expiretime != -1) setExpire(NULL,db,key,expiretime);
 
-        decrRefCount(key);
+        /* Read key */
+        if ((key = rdbLoadStringObject(rdb)) == NULL) goto eoferr;
+        /* Read value, or just index it, see lazy-loading. */
+        if (lazyLoadIndexing() &&
+            type != RDB_TYPE_MODULE && type != RDB_TYPE_MODULE_2)
+        {
+            if ((val = lazyLoadCreateObject(rdb,type)) == NULL) goto eoferr;
+        } else {
+            if ((val = rdbLoadObject(type,rdb)) == NULL) goto eoferr;
+        }
+        rdbLoadInsertKey(db,key,val,expiretime,now);
+    }
+    if (pipeline) {
+        if (batch) rdbLoadPipelineSubmit(pipeline,batch);
+        if (rdbLoadPipelineCollect(pipeline,0,now) == C_ERR) goto eoferr;
+        rdbLoadPipelineRelease(pipeline);
     }
     /* Verify the checksum if RDB version is >= 5 */
     if (rdbver >= 5 && server.rdb_checksum) {
@@ -1673,6 +3168,13 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi) {
     return C_OK;
 
 eoferr: /* unexpected end of file is handled here with a fatal exit */
+    if (rdb->m_flags & RIO_FLAG_READ_ERROR) {
+        /* The connection the RDB is read from failed: the data is not
+         * corrupted, the caller handles the error. */
+        serverLog(LL_WARNING,"Short read loading DB from the network: %s",
+            strerror(errno));
+        return C_ERR;
+    }
     serverLog(LL_WARNING,"Short read or OOM loading DB. Unrecoverable error, aborting now.");
     rdbExitReportCorruptRDB("Unexpected EOF reading RDB file");
     return C_ERR; /* Just to avoid warning */
@@ -1686,14 +3188,28 @@ eoferr: /* unexpected end of file is handled here with a fatal exit */
  * If you pass an 'rsi' structure initialied with RDB_SAVE_OPTION_INIT, the
  * loading code will fiil the information fields in the structure. */
 int rdbLoad(char *filename, rdbSaveInfo *rsi) {
+    return rdbLoadInto(filename,rsi,server.db);
+}
+
+/* Like rdbLoad() but the keys are added to 'dbarray'. When it is not
+ * server.db the clients keep being served from server.db meanwhile, see
+ * startAsyncLoading(). */
+int rdbLoadInto(char *filename, rdbSaveInfo *rsi, redisDb *dbarray) {
     FILE *fp;
     int retval;
 
     if ((fp = fopen(filename,"r")) == NULL) return C_ERR;
-    startLoading(fp);
+    if (dbarray == server.db) startLoading(fp);
+    else startAsyncLoading(fp);
 
-    rioFileIO rdb(fp);
-    retval = rdbLoadRio(&rdb, rsi);
+    /* Read the file from a mapping if possible, see rdb-load-mmap. */
+    rioMmapIO mapped(server.rdb_load_mmap ? fileno(fp) : -1);
+    if (mapped.rioMmapIsValid()) {
+        retval = rdbLoadRioInto(&mapped, rsi, dbarray);
+    } else {
+        rioFileIO rdb(fp);
+        retval = rdbLoadRioInto(&rdb, rsi, dbarray);
+    }
     fclose(fp);
     stopLoading();
     return retval;
@@ -1825,6 +3341,7 @@ void backgroundSaveDoneHandlerSocket(int exitcode, int bysignal) {
     }
     zfree(ok_slaves);
 
+    replicationSpoolDone(!bysignal && exitcode == 0);
     updateSlavesWaitingBgsave((!bysignal && exitcode == 0) ? C_OK : C_ERR, RDB_CHILD_TYPE_SOCKET);
 }
 
@@ -1846,9 +3363,9 @@ void backgroundSaveDoneHandler(int exitcode, int bysignal) {
 /* Spawn an RDB child that writes the RDB to the sockets of the slaves
  * that are currently in SLAVE_STATE_WAIT_BGSAVE_START state. */
 int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
-    int *fds;
+    int *fds, *compress;
     uint64_t *clientids;
-    int numfds;
+    int numfds, spoolfd;
     listNode *ln;
     pid_t childpid;
     long long start;
@@ -1864,8 +3381,11 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
     server.rdb_pipe_write_result_to_parent = pipefds[1];
 
     /* Collect the file descriptors of the slaves we want to transfer
-     * the RDB to, which are i WAIT_BGSAVE_START state. */
-    fds = (int *)zmalloc(sizeof(int)*server.slaves->listLength());
+     * the RDB to, which are i WAIT_BGSAVE_START state. One more slot is
+     * used by the spool that allows to resume interrupted transfers. */
+    fds = (int *)zmalloc(sizeof(int)*(server.slaves->listLength()+1));
+    /* And which of them get the RDB payload as LZF frames. */
+    compress = (int *)zmalloc(sizeof(int)*(server.slaves->listLength()+1));
     /* We also allocate an array of corresponding client IDs. This will
      * be useful for the child process in order to build the report
      * (sent via unix pipe) that will be sent to the parent. */
@@ -1878,6 +3398,7 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
 
         if (slave->m_replication_state == SLAVE_STATE_WAIT_BGSAVE_START) {
             clientids[numfds] = slave->m_client_id;
+            compress[numfds] = slave->m_repl_compress;
             fds[numfds++] = slave->m_fd;
             replicationSetupSlaveForFullResync(slave,getPsyncInitialOffset());
             /* Put the socket in blocking mode to simplify RDB transfer.
@@ -1887,6 +3408,10 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
             anetSendTimeout(NULL,slave->m_fd,server.repl_timeout*1000);
         }
     }
+    if ((spoolfd = replicationSpoolCreate()) != -1) {
+        fds[numfds] = spoolfd;
+        compress[numfds] = 0;
+    }
 
     /* Create the child process. */
     openChildInfoPipe();
@@ -1894,16 +3419,30 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
     if ((childpid = fork()) == 0) {
         /* Child */
         int retval;
-        rioFdsetIO slave_sockets(fds,numfds);
+        rioFdsetIO slave_sockets(fds,numfds+(spoolfd != -1));
 
+        /* The $EOF:<mark> header is sent as it is. */
+        slave_sockets.rioFdsetSetCompression(compress,5+RDB_EOF_MARK_SIZE+2);
         zfree(fds);
+        zfree(compress);
 
         closeListeningSockets(0);
+        childInfoStartReports();
         redisSetProcTitle("redis-rdb-to-slaves");
 
         retval = rdbSaveRioWithEOFMark(&slave_sockets,NULL,rsi);
         if (retval == C_OK && slave_sockets.rioFlush() == 0)
             retval = C_ERR;
+        /* A spool that failed, even just because the disk is full, is
+         * emptied so that the parent will never resume from it. */
+        if (spoolfd != -1 &&
+            (retval != C_OK || slave_sockets.m_state[numfds] != 0 ||
+             fsync(spoolfd) == -1))
+        {
+            if (ftruncate(spoolfd,0) == -1)
+                serverLog(LL_WARNING,"Can't empty the failed spool: %s",
+                    strerror(errno));
+        }
 
         if (retval == C_OK) {
             size_t private_dirty = zmalloc_get_private_dirty(-1);
@@ -1983,6 +3522,7 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
             close(pipefds[0]);
             close(pipefds[1]);
             closeChildInfoPipe();
+            replicationSpoolDiscard();
         } else {
             server.stat_fork_time = ustime()-start;
             server.stat_fork_rate = (double) zmalloc_used_memory() * 1000000 / server.stat_fork_time / (1024*1024*1024); /* GB per second. */
@@ -1995,8 +3535,10 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
             server.rdb_child_type = RDB_CHILD_TYPE_SOCKET;
             updateDictResizePolicy();
         }
+        if (spoolfd != -1) close(spoolfd);
         zfree(clientids);
         zfree(fds);
+        zfree(compress);
         return (childpid == -1) ? C_ERR : C_OK;
     }
     return C_OK; /* Unreached. */
@@ -2034,7 +3576,7 @@ void bgsaveCommand(client *c) {
     rdbSaveInfo rsi, *rsiptr;
     rsiptr = rdbPopulateSaveInfo(&rsi);
 
-    if (server.rdb_child_pid != -1) {
+    if (server.rdb_child_pid != -1 || server.rdb_snapshot) {
         c->addReplyError("Background save already in progress");
     } else if (server.aof_child_pid != -1) {
         if (schedule) {
@@ -2046,7 +3588,7 @@ void bgsaveCommand(client *c) {
                 "Use BGSAVE SCHEDULE in order to schedule a BGSAVE whenever "
                 "possible.");
         }
-    } else if (rdbSaveBackground(server.rdb_filename,rsiptr) == C_OK) {
+    } else if (rdbStartBackgroundSave(server.rdb_filename,rsiptr) == C_OK) {
         c->addReplyStatus("Background saving started");
     } else {
         c->addReply(shared.err);
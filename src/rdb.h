@@ -38,7 +38,7 @@
 
 /* The current RDB version. When the format changes in a way that is no longer
  * backward compatible this number gets incremented. */
-#define RDB_VERSION 8
+#define RDB_VERSION 9
 
 /* Defines related to the dump file format. To store 32 bits lengths for short
  * keys requires a lot of space, so we check the most significant 2 bits of
@@ -68,6 +68,8 @@
 #define RDB_ENC_INT16 1       /* 16 bit signed integer */
 #define RDB_ENC_INT32 2       /* 32 bit signed integer */
 #define RDB_ENC_LZF 3         /* string compressed with FASTLZ */
+#define RDB_ENC_LZ4 4         /* string compressed with LZ4 */
+#define RDB_ENC_ZSTD 5        /* string compressed with zstd */
 
 /* Dup object types to RDB object types. Only reason is readability (are we
  * dealing with RDB types or with in-memory object types?). */
@@ -89,12 +91,20 @@
 #define RDB_TYPE_ZSET_ZIPLIST  12
 #define RDB_TYPE_HASH_ZIPLIST  13
 #define RDB_TYPE_LIST_QUICKLIST 14
+#define RDB_TYPE_STREAM_LISTPACKS 15 /* Radix tree of listpacks. */
+#define RDB_TYPE_HASH_LISTPACK 16
+#define RDB_TYPE_ZSET_LISTPACK 17
+#define RDB_TYPE_LIST_QUICKLIST_2 18 /* Quicklist of listpacks. */
+#define RDB_TYPE_SET_ROARING 19 /* Containers of a compressed bitmap. */
+#define RDB_TYPE_HASH_TTL 20 /* Hash followed by the TTLs of its fields. */
 /* NOTE: WHEN ADDING NEW RDB TYPE, UPDATE rdbIsObjectType() BELOW */
 
 /* Test if a type is an object type. */
-#define rdbIsObjectType(t) ((t >= 0 && t <= 7) || (t >= 9 && t <= 14))
+#define rdbIsObjectType(t) ((t >= 0 && t <= 7) || (t >= 9 && t <= 20))
 
 /* Special RDB opcodes (saved/loaded with rdbSaveType/rdbLoadType). */
+#define RDB_OPCODE_CHUNK_COMPRESSED 248
+#define RDB_OPCODE_CHUNK      249
 #define RDB_OPCODE_AUX        250
 #define RDB_OPCODE_RESIZEDB   251
 #define RDB_OPCODE_EXPIRETIME_MS 252
@@ -102,6 +112,15 @@
 #define RDB_OPCODE_SELECTDB   254
 #define RDB_OPCODE_EOF        255
 
+/* A CHUNK is a run of up to RDB_CHUNK_MAX_KEYS keys of a database, saved
+ * by one of the rdb-save-threads, that can be decoded independently of the
+ * rest of the file: [CHUNK][dbid][keys][len][len bytes of keys], where the
+ * keys are in the usual [expire][type][key][value] format. A compressed
+ * chunk is [CHUNK_COMPRESSED][dbid][keys][codec][rawlen][len][len bytes],
+ * where the bytes are the keys compressed with the RDB_ENC_* 'codec'. */
+#define RDB_CHUNK_MAX_KEYS 1024
+#define RDB_CHUNK_BYTES (1024*1024)   /* Chunks are flushed past this size. */
+
 /* Module serialized values sub opcodes */
 #define RDB_MODULE_OPCODE_EOF   0   /* End of module value. */
 #define RDB_MODULE_OPCODE_SINT  1   /* Signed integer. */
@@ -115,6 +134,7 @@
 #define RDB_LOAD_ENC    (1<<0)
 #define RDB_LOAD_PLAIN  (1<<1)
 #define RDB_LOAD_SDS    (1<<2)
+#define RDB_LOAD_COMPRESSED (1<<3)
 
 #define RDB_SAVE_NONE 0
 #define RDB_SAVE_AOF_PREAMBLE (1<<0)
@@ -129,24 +149,37 @@ int rdbLoadLenByRef(rio *rdb, int *isencoded, uint64_t *lenptr);
 int rdbSaveObjectType(rio *rdb, robj *o);
 int rdbLoadObjectType(rio *rdb);
 int rdbLoad(char *filename, rdbSaveInfo *rsi);
+int rdbLoadInto(char *filename, rdbSaveInfo *rsi, redisDb *dbarray);
 int rdbSaveBackground(char *filename, rdbSaveInfo *rsi);
+int rdbStartBackgroundSave(char *filename, rdbSaveInfo *rsi);
 int rdbSaveToSlavesSockets(rdbSaveInfo *rsi);
 void rdbRemoveTempFile(pid_t childpid);
 int rdbSave(char *filename, rdbSaveInfo *rsi);
+int rdbOpenBypassingCache(char *filename);
 ssize_t rdbSaveObject(rio *rdb, robj *o);
 size_t rdbSavedObjectLen(robj *o);
 robj *rdbLoadObject(int type, rio *rdb);
+int rdbSkipObject(rio *rdb, int rdbtype);
 void backgroundSaveDoneHandler(int exitcode, int bysignal);
 int rdbSaveKeyValuePair(rio *rdb, robj *key, robj *val, long long expiretime, long long now);
+int rdbSaveInfoAuxFields(rio *rdb, int flags, rdbSaveInfo *rsi);
+int rdbSaveAuxField(rio *rdb, void *key, size_t keylen, void *val, size_t vallen);
+int rdbSaveChunk(rio *rdb, int dbid, unsigned long keys, int enc, void *data, size_t len, size_t rawlen);
+int rdbSaveChunkRecord(sds *buf, robj *key, robj *val, long long expire, long long now, int plain);
 robj *rdbLoadStringObject(rio *rdb);
 int rdbSaveStringObject(rio *rdb, robj *obj);
 ssize_t rdbSaveRawString(rio *rdb, unsigned char *s, size_t len);
 void *rdbGenericLoadStringObject(rio *rdb, int flags, size_t *lenptr);
+int rdbCompressionAvailable(int enc);
+const char *rdbCompressionName(int enc);
+size_t rdbCompress(int enc, const void *s, size_t len, void *out, size_t outlen);
+int rdbDecompress(int enc, const void *c, size_t clen, void *out, size_t len);
 int rdbSaveBinaryDoubleValue(rio *rdb, double val);
 int rdbLoadBinaryDoubleValue(rio *rdb, double *val);
 int rdbSaveBinaryFloatValue(rio *rdb, float val);
 int rdbLoadBinaryFloatValue(rio *rdb, float *val);
 int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi);
+int rdbLoadRioInto(rio *rdb, rdbSaveInfo *rsi, redisDb *dbarray);
 rdbSaveInfo *rdbPopulateSaveInfo(rdbSaveInfo *rsi);
 
 #endif
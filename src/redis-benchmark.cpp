@@ -39,15 +39,115 @@
 #include <sys/time.h>
 #include <signal.h>
 #include <assert.h>
+#include <math.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include <sds.h> /* Use hiredis sds. */
 #include "ae.h"
 #include "hiredis.h"
 #include "adlist.h"
 #include "zmalloc.h"
+#include "atomicvar.h"
 
 #define UNUSED(V) ((void) V)
 #define RANDPTR_INITIAL_SIZE 8
+#define CLUSTER_SLOTS 16384
+#define CLUSTER_TAG "{tag}" /* Replaced by a hash tag of the client node. */
+#define CLUSTER_TAG_LEN 5
+#define MAX_THREADS 500
+#define ZIPF_ZETA_EXACT 10000000 /* Terms of the zeta sum computed exactly. */
+
+uint16_t crc16(const char *buf, int len);
+
+/* HDR style histogram of the latencies in microseconds. The values below
+ * 128 have a bucket each, then every power of two range is split in 64
+ * buckets, so that every value is reported with an error below 1.6%, with
+ * a fixed size and O(1) recording. Values of 2^36 microseconds or more are
+ * counted in the last bucket. */
+#define LATENCY_HIST_SUB_BITS 7
+#define LATENCY_HIST_HALF (1<<(LATENCY_HIST_SUB_BITS-1))
+#define LATENCY_HIST_MAX_BITS 36
+#define LATENCY_HIST_SIZE \
+    ((LATENCY_HIST_MAX_BITS-LATENCY_HIST_SUB_BITS+2)*LATENCY_HIST_HALF)
+
+struct latencyHistogram {
+    long long count;
+    long long total;        /* Sum of the values, for the average. */
+    long long min;
+    long long max;
+    long long counts[LATENCY_HIST_SIZE];
+};
+
+/* Stats of a cluster node, one for every histogram of the benchmark. */
+struct _nodeStats {
+    latencyHistogram hist;
+    int redirects;          /* MOVED and ASK errors received. */
+};
+
+/* A master of the cluster, with the slots it serves and its own stats. */
+struct _clusterNode {
+    char *ip;
+    int port;
+    int *slots;             /* Slots served that have a hash tag. */
+    int numslots;
+    _nodeStats *stats;
+};
+typedef _clusterNode* pnode;
+
+/* A thread running the event loop of a part of the clients. */
+struct _benchmarkThread {
+    int index;
+    pthread_t thread;
+    aeEventLoop *el;
+};
+typedef _benchmarkThread* pthreadinfo;
+
+/* Distributions of the keys of a workload. */
+#define KEYDIST_UNIFORM 0
+#define KEYDIST_ZIPFIAN 1
+#define KEYDIST_HOTSPOT 2
+
+/* Distributions of the value sizes of a workload. */
+#define VALDIST_FIXED 0
+#define VALDIST_UNIFORM 1
+#define VALDIST_WEIGHTED 2
+
+/* A command of a workload, sent for 'weight' parts of the requests. */
+struct _workloadCommand {
+    sds *argv;
+    int argc;
+    long long weight;
+    sds name;               /* The command line, for the report. */
+    latencyHistogram *hist; /* One per thread, as config.hist. */
+};
+typedef _workloadCommand* pworkcmd;
+
+/* A workload loaded from the --workload file. */
+struct _workload {
+    sds name;
+    pworkcmd commands;
+    int numcommands;
+    long long totweight;
+    long long keyspace;
+    int keydist;
+    double zipf_theta;      /* Zipfian: skew, and the constants of the */
+    double zipf_alpha;      /* generator of Gray et al. "Quickly generating */
+    double zipf_zetan;      /* billion-record synthetic databases". */
+    double zipf_eta;
+    double zipf_half;
+    double hot_keys;        /* Hotspot: fraction of the keys that get */
+    double hot_ops;         /* 'hot_ops' of the requests. */
+    int valdist;
+    long long val_min;      /* Fixed or uniform value sizes. */
+    long long val_max;
+    long long *val_sizes;   /* Weighted value sizes. */
+    long long *val_weights;
+    int numvals;
+    long long val_totweight;
+    char *data;             /* 'val_max' bytes to take the values from. */
+};
+typedef _workload* pworkload;
 
 static struct _config {
     aeEventLoop *el;
@@ -68,7 +168,6 @@ static struct _config {
     int showerrors;
     long long start;
     long long totlatency;
-    long long *latency;
     const char *title;
     list *clients;
     int quiet;
@@ -79,9 +178,31 @@ static struct _config {
     sds dbnumstr;
     char *tests;
     char *auth;
+    int cluster_mode;
+    pnode *cluster_nodes;
+    int cluster_node_count;
+    int cluster_next_node;  /* Node of the next client, round robin. */
+    int num_threads;
+    pthreadinfo *threads;
+    /* One histogram per thread, or just one without threads: the threads
+     * never share a histogram, and they are merged for the report. */
+    latencyHistogram *hist;
+    int numhist;
+    int json;
+    char *workload_file;
+    pworkload workload;
+    double rate;            /* Target requests per second, 0 for no limit. */
+    long long start_us;
+    pthread_mutex_t liveclients_mutex; /* Also protects 'clients'. */
+    pthread_mutex_t requests_issued_mutex;
+    pthread_mutex_t requests_finished_mutex;
 };
 _config config;
 
+/* A three characters hash tag for every slot, that routes the keys
+ * containing it, as {xyz}, to the slot. Slots without a tag have "". */
+static char slot_tags[CLUSTER_SLOTS][4];
+
 struct _client {
     redisContext *context;
     sds obuf;
@@ -96,12 +217,27 @@ struct _client {
                                such as auth and select are prefixed to the pipeline of
                                benchmark commands and discarded after the first send. */
     int prefixlen;          /* Size in bytes of the pending prefix commands */
+    pnode node;             /* Cluster node the client is connected to. */
+    char **tagptr;          /* Pointers to the {tag} strings inside the buffer */
+    size_t taglen;          /* Number of pointers in client->tagptr */
+    int thread_id;          /* Thread running the client, -1 without threads */
+    uint64_t rng;           /* State of the random generator of the workload */
+    int *cmds;              /* Workload command of every pipelined request */
+    long long due;          /* Time the next request is due, with a rate */
+    long long timer_id;     /* Timer waiting for 'due', or -1 */
+    int waiting;            /* The request was built and waited for 'due' */
 };
 typedef _client* pclient;
 
+#define CLIENT_GET_EVENTLOOP(c) \
+    ((c)->thread_id >= 0 ? config.threads[(c)->thread_id]->el : config.el)
+#define CLIENT_HIST_ID(c) ((c)->thread_id >= 0 ? (c)->thread_id : 0)
+
 /* Prototypes */
 static void writeHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 static void createMissingClients(pclient c);
+static pclient createClient(char *cmd, size_t len, pclient from, int thread_id);
+int showThroughput(struct aeEventLoop *eventLoop, long long id, void *clientData);
 
 /* Implementation */
 static long long ustime() {
@@ -124,18 +260,83 @@ static long long mstime() {
     return mst;
 }
 
+static void latencyHistogramReset(latencyHistogram *h) {
+    memset(h,0,sizeof(*h));
+}
+
+static int latencyHistogramIndex(long long us) {
+    int shift;
+
+    if (us < 2*LATENCY_HIST_HALF) return us;
+    if (us >= 1LL<<LATENCY_HIST_MAX_BITS) us = (1LL<<LATENCY_HIST_MAX_BITS)-1;
+    shift = (63-__builtin_clzll(us)) - (LATENCY_HIST_SUB_BITS-1);
+    return shift*LATENCY_HIST_HALF + (us >> shift);
+}
+
+/* The highest value counted in the bucket 'idx'. */
+static long long latencyHistogramValue(int idx) {
+    int shift;
+
+    if (idx < 2*LATENCY_HIST_HALF) return idx;
+    shift = idx/LATENCY_HIST_HALF - 1;
+    return ((long long)(idx-shift*LATENCY_HIST_HALF) << shift) +
+           (1LL<<shift) - 1;
+}
+
+static void latencyHistogramRecord(latencyHistogram *h, long long us) {
+    if (us < 0) us = 0;
+    h->counts[latencyHistogramIndex(us)]++;
+    if (h->count == 0 || us < h->min) h->min = us;
+    if (us > h->max) h->max = us;
+    h->count++;
+    h->total += us;
+}
+
+static void latencyHistogramMerge(latencyHistogram *dst, latencyHistogram *src) {
+    int j;
+
+    if (src->count == 0) return;
+    for (j = 0; j < LATENCY_HIST_SIZE; j++) dst->counts[j] += src->counts[j];
+    if (dst->count == 0 || src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+    dst->count += src->count;
+    dst->total += src->total;
+}
+
+/* Return the latency in microseconds below which there are 'perc' percent
+ * of the values. */
+static long long latencyHistogramPercentile(latencyHistogram *h, double perc) {
+    long long target = (long long)ceil(perc*h->count/100), seen = 0;
+    int j;
+
+    if (h->count == 0) return 0;
+    if (target < 1) target = 1;
+    for (j = 0; j < LATENCY_HIST_SIZE; j++) {
+        seen += h->counts[j];
+        if (seen >= target) break;
+    }
+    long long value = latencyHistogramValue(j);
+    return value < h->max ? value : h->max;
+}
+
 static void freeClient(pclient c) {
+    aeEventLoop *el = CLIENT_GET_EVENTLOOP(c);
     listNode *ln;
-    config.el->aeDeleteFileEvent(c->context->fd,AE_WRITABLE);
-    config.el->aeDeleteFileEvent(c->context->fd,AE_READABLE);
+    el->aeDeleteFileEvent(c->context->fd,AE_WRITABLE);
+    el->aeDeleteFileEvent(c->context->fd,AE_READABLE);
+    if (c->timer_id != -1) el->aeDeleteTimeEvent(c->timer_id);
     redisFree(c->context);
     sdsfree(c->obuf);
     zfree(c->randptr);
+    zfree(c->tagptr);
+    zfree(c->cmds);
     zfree(c);
+    if (config.num_threads) pthread_mutex_lock(&config.liveclients_mutex);
     config.liveclients--;
     ln = config.clients->listSearchKey(c);
     assert(ln != NULL);
     config.clients->listDelNode(ln);
+    if (config.num_threads) pthread_mutex_unlock(&config.liveclients_mutex);
 }
 
 static void freeAllClients() {
@@ -149,9 +350,10 @@ static void freeAllClients() {
 }
 
 static void resetClient(pclient c) {
-    config.el->aeDeleteFileEvent(c->context->fd,AE_WRITABLE);
-    config.el->aeDeleteFileEvent(c->context->fd,AE_READABLE);
-    config.el->aeCreateFileEvent(c->context->fd,AE_WRITABLE,writeHandler,c);
+    aeEventLoop *el = CLIENT_GET_EVENTLOOP(c);
+    el->aeDeleteFileEvent(c->context->fd,AE_WRITABLE);
+    el->aeDeleteFileEvent(c->context->fd,AE_READABLE);
+    el->aeCreateFileEvent(c->context->fd,AE_WRITABLE,writeHandler,c);
     c->written = 0;
     c->pending = config.pipeline;
 }
@@ -172,18 +374,215 @@ static void randomizeClientKey(pclient c) {
     }
 }
 
+/* Route the keys of the next request of 'c' to a random slot of its node. */
+static void setClusterKeyHashTag(pclient c) {
+    int slot = c->node->slots[random() % c->node->numslots];
+    size_t i;
+
+    for (i = 0; i < c->taglen; i++) memcpy(c->tagptr[i]+1,slot_tags[slot],3);
+}
+
+/* The workloads use a xorshift64* generator per client, that is fast and
+ * does not lock like random() when the clients run in many threads. */
+static uint64_t clientRandom(pclient c) {
+    c->rng ^= c->rng >> 12;
+    c->rng ^= c->rng << 25;
+    c->rng ^= c->rng >> 27;
+    return c->rng * 2685821657736338717ULL;
+}
+
+/* Return a random number in [0,1). */
+static double clientRandomDouble(pclient c) {
+    return (clientRandom(c) >> 11) * (1.0/9007199254740992.0);
+}
+
+/* Return the key of the next workload request, from 0 to keyspace-1. */
+static long long workloadPickKey(pclient c) {
+    pworkload w = config.workload;
+    long long n = w->keyspace;
+
+    if (w->keydist == KEYDIST_ZIPFIAN) {
+        double u = clientRandomDouble(c), uz = u*w->zipf_zetan;
+        long long rank;
+        uint64_t h = 14695981039346656037ULL;
+        int j;
+
+        if (uz < 1) rank = 0;
+        else if (uz < 1+w->zipf_half) rank = 1;
+        else rank = (long long)(n*pow(w->zipf_eta*u-w->zipf_eta+1,
+                                      w->zipf_alpha));
+        if (rank >= n) rank = n-1;
+        /* Scatter the popular ranks in the keyspace with FNV-1a, otherwise
+         * the hottest keys would all be the first ones. */
+        for (j = 0; j < 8; j++) {
+            h ^= (rank >> (j*8)) & 0xff;
+            h *= 1099511628211ULL;
+        }
+        return h % n;
+    } else if (w->keydist == KEYDIST_HOTSPOT) {
+        long long hot = (long long)(n*w->hot_keys);
+
+        if (hot < 1) hot = 1;
+        if (hot >= n || clientRandomDouble(c) < w->hot_ops)
+            return clientRandom(c) % hot;
+        return hot + clientRandom(c) % (n-hot);
+    }
+    return clientRandom(c) % n;
+}
+
+/* Return the size of the value of the next workload request. */
+static long long workloadPickValueSize(pclient c) {
+    pworkload w = config.workload;
+
+    if (w->valdist == VALDIST_UNIFORM) {
+        return w->val_min + clientRandom(c) % (w->val_max-w->val_min+1);
+    } else if (w->valdist == VALDIST_WEIGHTED) {
+        long long r = clientRandom(c) % w->val_totweight;
+        int j;
+
+        for (j = 0; j < w->numvals-1; j++) {
+            if (r < w->val_weights[j]) break;
+            r -= w->val_weights[j];
+        }
+        return w->val_sizes[j];
+    }
+    return w->val_min;
+}
+
+/* Return the index of the command of the next workload request. */
+static int workloadPickCommand(pclient c) {
+    pworkload w = config.workload;
+    long long r = clientRandom(c) % w->totweight;
+    int j;
+
+    for (j = 0; j < w->numcommands-1; j++) {
+        if (r < w->commands[j].weight) break;
+        r -= w->commands[j].weight;
+    }
+    return j;
+}
+
+#define PLACEHOLDER_IS(p,end,s) \
+    ((end)-(p) >= (long)sizeof(s)-1 && !memcmp(p,s,sizeof(s)-1))
+
+/* Return a new string with 'arg' of a workload command, expanding __key__
+ * to 'key', __value__ to 'vlen' bytes, __rand_int__ to a uniform random
+ * key, and {tag} to the hash tag of 'slot' if not -1. */
+static sds workloadExpandArg(pclient c, sds arg, long long key,
+                             long long vlen, int slot)
+{
+    const char *p = arg, *end = arg+sdslen(arg);
+    sds s = sdsempty();
+
+    while (p < end) {
+        const char *q = p;
+
+        while (q < end && *q != '_' && *q != '{') q++;
+        s = sdscatlen(s,p,q-p);
+        p = q;
+        if (p == end) break;
+        if (PLACEHOLDER_IS(p,end,"__key__")) {
+            s = sdscatprintf(s,"%012lld",key);
+            p += 7;
+        } else if (PLACEHOLDER_IS(p,end,"__value__")) {
+            s = sdscatlen(s,config.workload->data,vlen);
+            p += 9;
+        } else if (PLACEHOLDER_IS(p,end,"__rand_int__")) {
+            s = sdscatprintf(s,"%012lld",
+                (long long)(clientRandom(c) % config.workload->keyspace));
+            p += 12;
+        } else if (slot != -1 && PLACEHOLDER_IS(p,end,CLUSTER_TAG)) {
+            s = sdscatprintf(s,"{%s}",slot_tags[slot]);
+            p += CLUSTER_TAG_LEN;
+        } else {
+            s = sdscatlen(s,p++,1);
+        }
+    }
+    return s;
+}
+
+/* Replace the requests in the buffer of 'c' with the next 'pipeline'
+ * requests of the workload. */
+static void workloadBuildRequests(pclient c) {
+    pworkload w = config.workload;
+    int j, k;
+
+    sdssetlen(c->obuf,c->prefixlen);
+    c->obuf[c->prefixlen] = '\0';
+    for (j = 0; j < config.pipeline; j++) {
+        int id = workloadPickCommand(c);
+        pworkcmd wc = w->commands+id;
+        long long key = workloadPickKey(c);
+        long long vlen = workloadPickValueSize(c);
+        int slot = c->node ?
+                   c->node->slots[clientRandom(c) % c->node->numslots] : -1;
+        sds *argv = (sds *)zmalloc(sizeof(sds)*wc->argc);
+        size_t *lens = (size_t *)zmalloc(sizeof(size_t)*wc->argc);
+        char *cmd;
+        int len;
+
+        for (k = 0; k < wc->argc; k++) {
+            argv[k] = workloadExpandArg(c,wc->argv[k],key,vlen,slot);
+            lens[k] = sdslen(argv[k]);
+        }
+        len = redisFormatCommandArgv(&cmd,wc->argc,(const char **)argv,lens);
+        c->obuf = sdscatlen(c->obuf,cmd,len);
+        free(cmd);
+        for (k = 0; k < wc->argc; k++) sdsfree(argv[k]);
+        zfree(argv);
+        zfree(lens);
+        c->cmds[j] = id;
+    }
+}
+
+static int requestDue(aeEventLoop *el, long long id, void *privdata) {
+    pclient c = (pclient)privdata;
+    UNUSED(id);
+
+    c->timer_id = -1;
+    c->waiting = 1;
+    el->aeCreateFileEvent(c->context->fd,AE_WRITABLE,writeHandler,c);
+    return AE_NOMORE;
+}
+
+/* With a target rate the benchmark runs in open loop: the request 'n' is
+ * due at a fixed time since the start, whatever the latency of the
+ * previous ones. If it is not due yet, wait for it with a timer and return
+ * 1. If instead the client is late, because its previous requests took
+ * too long, the latency is taken since the due time: otherwise a stall of
+ * the server would only delay the requests sent after it, and would be
+ * hidden from the latencies (coordinated omission). */
+static int scheduleRequest(pclient c, aeEventLoop *el, int n) {
+    c->due = config.start_us +
+             (long long)((double)n*config.pipeline*1000000/config.rate);
+    if (c->due-c->start >= 1000) {
+        el->aeDeleteFileEvent(c->context->fd,AE_WRITABLE);
+        c->timer_id = el->aeCreateTimeEvent((c->due-c->start)/1000,
+                                            requestDue,c,NULL);
+        return 1;
+    }
+    if (c->due < c->start) c->start = c->due;
+    return 0;
+}
+
 static void clientDone(pclient c) {
-    if (config.requests_finished == config.requests) {
+    int requests_finished;
+
+    atomicGet(config.requests_finished,requests_finished);
+    if (requests_finished >= config.requests) {
+        aeEventLoop *el = CLIENT_GET_EVENTLOOP(c);
+
+        /* The other threads stop in showThroughput(), so take the time
+         * now. */
+        if (config.totlatency == 0) config.totlatency = mstime()-config.start;
         freeClient(c);
-        config.el->aeStop();
+        el->aeStop();
         return;
     }
     if (config.keepalive) {
         resetClient(c);
     } else {
-        config.liveclients--;
-        createMissingClients(c);
-        config.liveclients++;
+        createClient(NULL,0,c,c->thread_id);
         freeClient(c);
     }
 }
@@ -215,6 +614,14 @@ static void readHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
                     exit(1);
                 }
 
+                if (c->node &&
+                    ((redisReply *)reply)->type == REDIS_REPLY_ERROR &&
+                    (!strncmp(((redisReply *)reply)->str,"MOVED ",6) ||
+                     !strncmp(((redisReply *)reply)->str,"ASK ",4)))
+                {
+                    c->node->stats[CLIENT_HIST_ID(c)].redirects++;
+                }
+
                 if (config.showerrors) {
                     static time_t lasterr_time = 0;
                     time_t now = time(NULL);
@@ -238,13 +645,28 @@ static void readHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
                         * we need to randomize. */
                         for (j = 0; j < c->randlen; j++)
                             c->randptr[j] -= c->prefixlen;
+                        for (j = 0; j < c->taglen; j++)
+                            c->tagptr[j] -= c->prefixlen;
                         c->prefixlen = 0;
                     }
                     continue;
                 }
 
-                if (config.requests_finished < config.requests)
-                    config.latency[config.requests_finished++] = c->latency;
+                int requests_finished;
+                atomicGetIncr(config.requests_finished,requests_finished,1);
+                if (requests_finished < config.requests) {
+                    int id = CLIENT_HIST_ID(c);
+
+                    latencyHistogramRecord(config.hist+id,c->latency);
+                    if (c->node)
+                        latencyHistogramRecord(&c->node->stats[id].hist,
+                                               c->latency);
+                    if (c->cmds) {
+                        pworkcmd wc = config.workload->commands+
+                                      c->cmds[config.pipeline-c->pending];
+                        latencyHistogramRecord(wc->hist+id,c->latency);
+                    }
+                }
                 c->pending--;
                 if (c->pending == 0) {
                     clientDone(c);
@@ -259,22 +681,32 @@ static void readHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
 
 static void writeHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
     pclient c = (pclient)privdata;
-    UNUSED(el);
     UNUSED(fd);
     UNUSED(mask);
 
     /* Initialize request when nothing was written. */
-    if (c->written == 0) {
+    if (c->written == 0 && c->waiting) {
+        /* The due time of the request came: the timer fires up to a
+         * millisecond early, so take the earliest of the two. */
+        c->waiting = 0;
+        c->start = ustime();
+        if (c->due < c->start) c->start = c->due;
+    } else if (c->written == 0) {
         /* Enforce upper bound to number of requests. */
-        if (config.requests_issued++ >= config.requests) {
+        int requests_issued;
+        atomicGetIncr(config.requests_issued,requests_issued,1);
+        if (requests_issued >= config.requests) {
             freeClient(c);
             return;
         }
 
         /* Really initialize: randomize keys and set start time. */
         if (config.randomkeys) randomizeClientKey(c);
+        if (c->taglen) setClusterKeyHashTag(c);
+        if (config.workload) workloadBuildRequests(c);
         c->start = ustime();
         c->latency = -1;
+        if (config.rate > 0 && scheduleRequest(c,el,requests_issued)) return;
     }
 
     if (sdslen(c->obuf) > c->written) {
@@ -288,8 +720,8 @@ static void writeHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
         }
         c->written += nwritten;
         if (sdslen(c->obuf) == c->written) {
-            config.el->aeDeleteFileEvent(c->context->fd,AE_WRITABLE);
-            config.el->aeCreateFileEvent(c->context->fd,AE_READABLE,readHandler,c);
+            el->aeDeleteFileEvent(c->context->fd,AE_WRITABLE);
+            el->aeCreateFileEvent(c->context->fd,AE_READABLE,readHandler,c);
         }
     }
 }
@@ -314,20 +746,43 @@ static void writeHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
  * 2) The offsets of the __rand_int__ elements inside the command line, used
  *    for arguments randomization.
  *
- * Even when cloning another client, prefix commands are applied if needed.*/
-static pclient createClient(char *cmd, size_t len, pclient from) {
+ * Even when cloning another client, prefix commands are applied if needed.
+ *
+ * The client is served by the event loop of the thread 'thread_id', or by
+ * the main one if it is -1. */
+static pclient createClient(char *cmd, size_t len, pclient from, int thread_id) {
     int j;
     pclient c = (pclient)zmalloc(sizeof(struct _client));
+    const char *ip = config.hostip;
+    int port = config.hostport;
+
+    /* In cluster mode the clients are spread among the masters. */
+    c->node = NULL;
+    c->thread_id = thread_id;
+    c->rng = ((uint64_t)random() << 32 | random()) | 1;
+    c->cmds = NULL;
+    if (config.workload)
+        c->cmds = (int *)zmalloc(sizeof(int)*config.pipeline);
+    c->timer_id = -1;
+    c->waiting = 0;
+    if (config.cluster_mode) {
+        if (config.num_threads) pthread_mutex_lock(&config.liveclients_mutex);
+        c->node = config.cluster_nodes[config.cluster_next_node++ %
+                                       config.cluster_node_count];
+        if (config.num_threads) pthread_mutex_unlock(&config.liveclients_mutex);
+        ip = c->node->ip;
+        port = c->node->port;
+    }
 
-    if (config.hostsocket == NULL) {
-        c->context = redisConnectNonBlock(config.hostip,config.hostport);
+    if (config.hostsocket == NULL || config.cluster_mode) {
+        c->context = redisConnectNonBlock(ip,port);
     } else {
         c->context = redisConnectUnixNonBlock(config.hostsocket);
     }
     if (c->context->err) {
         fprintf(stderr,"Could not connect to Redis at ");
-        if (config.hostsocket == NULL)
-            fprintf(stderr,"%s:%d: %s\n",config.hostip,config.hostport,c->context->errstr);
+        if (config.hostsocket == NULL || config.cluster_mode)
+            fprintf(stderr,"%s:%d: %s\n",ip,port,c->context->errstr);
         else
             fprintf(stderr,"%s: %s\n",config.hostsocket,c->context->errstr);
         exit(1);
@@ -405,18 +860,50 @@ static pclient createClient(char *cmd, size_t len, pclient from) {
             }
         }
     }
+
+    /* Find the hash tags to set to a slot of the node of the client. */
+    c->tagptr = NULL;
+    c->taglen = 0;
+    if (config.cluster_mode) {
+        if (from) {
+            c->taglen = from->taglen;
+            c->tagptr = (char **)zmalloc(sizeof(char*)*(c->taglen+1));
+            for (j = 0; j < (int)c->taglen; j++) {
+                c->tagptr[j] = c->obuf + (from->tagptr[j]-from->obuf);
+                c->tagptr[j] += c->prefixlen - from->prefixlen;
+            }
+        } else {
+            char *p = c->obuf;
+
+            while ((p = strstr(p,CLUSTER_TAG)) != NULL) {
+                c->tagptr = (char **)zrealloc(c->tagptr,
+                    sizeof(char*)*(c->taglen+1));
+                c->tagptr[c->taglen++] = p;
+                p += CLUSTER_TAG_LEN;
+            }
+        }
+    }
     if (config.idlemode == 0)
-        config.el->aeCreateFileEvent(c->context->fd,AE_WRITABLE,writeHandler,c);
+        CLIENT_GET_EVENTLOOP(c)->aeCreateFileEvent(c->context->fd,AE_WRITABLE,
+                                                   writeHandler,c);
+    if (config.num_threads) pthread_mutex_lock(&config.liveclients_mutex);
     config.clients->listAddNodeTail(c);
     config.liveclients++;
+    if (config.num_threads) pthread_mutex_unlock(&config.liveclients_mutex);
     return c;
 }
 
+/* Create the clients missing to reach the configured number, cloning 'c',
+ * spread among the threads. Only called before the threads are started. */
 static void createMissingClients(pclient c) {
     int n = 0;
 
     while(config.liveclients < config.numclients) {
-        createClient(NULL,0,c);
+        int thread_id = -1;
+
+        if (config.num_threads)
+            thread_id = config.liveclients % config.num_threads;
+        createClient(NULL,0,c,thread_id);
 
         /* Listen backlog is quite limited on most systems */
         if (++n > 64) {
@@ -426,54 +913,573 @@ static void createMissingClients(pclient c) {
     }
 }
 
-static int compareLatency(const void *a, const void *b) {
-    return (*(long long*)a)-(*(long long*)b);
+/* The percentiles shown by the reports. */
+static const double report_percentiles[] = {50,99,99.9,99.99};
+static const char *report_percentile_names[] = {"p50","p99","p99.9","p99.99"};
+#define REPORT_PERCENTILES 4
+
+/* Merge the histograms of 'node', setting the redirections in '*redirects'. */
+static void mergeNodeStats(pnode node, latencyHistogram *h, int *redirects) {
+    int j;
+
+    latencyHistogramReset(h);
+    *redirects = 0;
+    for (j = 0; j < config.numhist; j++) {
+        latencyHistogramMerge(h,&node->stats[j].hist);
+        *redirects += node->stats[j].redirects;
+    }
+}
+
+static float requestsPerSecond(long long requests) {
+    return (float)requests/((float)config.totlatency/1000);
 }
 
-static void showLatencyReport() {
-    int i, curlat = 0;
-    float perc, reqpersec;
+/* Print 'h' as the "key":value JSON fields of its latencies. */
+static void printJsonLatencies(latencyHistogram *h) {
+    int j;
+
+    printf("\"avg_latency_ms\":%.3f,\"min_latency_ms\":%.3f",
+        h->count ? (double)h->total/h->count/1000 : 0, (double)h->min/1000);
+    for (j = 0; j < REPORT_PERCENTILES; j++)
+        printf(",\"%s_latency_ms\":%.3f", report_percentile_names[j],
+            (double)latencyHistogramPercentile(h,report_percentiles[j])/1000);
+    printf(",\"max_latency_ms\":%.3f", (double)h->max/1000);
+}
+
+/* Print 's' as a JSON string. */
+static void printJsonString(const char *s) {
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') printf("\\%c",*s);
+        else if ((unsigned char)*s < 0x20) printf("\\u%04x",*s);
+        else putchar(*s);
+    }
+    putchar('"');
+}
+
+/* Print the percentiles of 'h' as CSV fields. */
+static void printCsvLatencies(latencyHistogram *h) {
+    int j;
 
-    reqpersec = (float)config.requests_finished/((float)config.totlatency/1000);
-    if (!config.quiet && !config.csv) {
+    for (j = 0; j < REPORT_PERCENTILES; j++)
+        printf(",\"%.3f\"",
+            (double)latencyHistogramPercentile(h,report_percentiles[j])/1000);
+    printf("\n");
+}
+
+/* Show the throughput and the latency of every node of the cluster. */
+static void showClusterNodesReport() {
+    latencyHistogram *h = (latencyHistogram *)zmalloc(sizeof(*h));
+    int j, k, redirects;
+
+    printf("  Per node (%d masters):\n", config.cluster_node_count);
+    for (j = 0; j < config.cluster_node_count; j++) {
+        pnode node = config.cluster_nodes[j];
+
+        mergeNodeStats(node,h,&redirects);
+        printf("  %s:%d: %lld requests, %.2f requests per second, "
+               "latency avg %.3f",
+            node->ip, node->port, h->count, requestsPerSecond(h->count),
+            h->count ? (float)h->total/h->count/1000 : 0);
+        for (k = 0; k < REPORT_PERCENTILES; k++)
+            printf(" %s %.3f", report_percentile_names[k],
+                (float)latencyHistogramPercentile(h,report_percentiles[k])/1000);
+        printf(" max %.3f milliseconds, %d redirections\n",
+            (float)h->max/1000, redirects);
+    }
+    printf("\n");
+    zfree(h);
+}
+
+/* Merge the histograms of the workload command 'wc'. */
+static void mergeCommandStats(pworkcmd wc, latencyHistogram *h) {
+    int j;
+
+    latencyHistogramReset(h);
+    for (j = 0; j < config.numhist; j++) latencyHistogramMerge(h,wc->hist+j);
+}
+
+/* Show the throughput and the latency of every command of the workload. */
+static void showWorkloadCommandsReport() {
+    latencyHistogram *h = (latencyHistogram *)zmalloc(sizeof(*h));
+    int j, k;
+
+    printf("  Per command:\n");
+    for (j = 0; j < config.workload->numcommands; j++) {
+        pworkcmd wc = config.workload->commands+j;
+
+        mergeCommandStats(wc,h);
+        printf("  %s: %lld requests, %.2f requests per second, "
+               "latency avg %.3f",
+            wc->name, h->count, requestsPerSecond(h->count),
+            h->count ? (float)h->total/h->count/1000 : 0);
+        for (k = 0; k < REPORT_PERCENTILES; k++)
+            printf(" %s %.3f", report_percentile_names[k],
+                (float)latencyHistogramPercentile(h,report_percentiles[k])/1000);
+        printf(" max %.3f milliseconds\n", (float)h->max/1000);
+    }
+    printf("\n");
+    zfree(h);
+}
+
+static void showLatencyReport() {
+    static const double perc[] = {0,50,75,90,95,99,99.9,99.99,100};
+    latencyHistogram *h = (latencyHistogram *)zmalloc(sizeof(*h));
+    int i, redirects;
+    float reqpersec;
+
+    latencyHistogramReset(h);
+    for (i = 0; i < config.numhist; i++)
+        latencyHistogramMerge(h,config.hist+i);
+    if (config.requests_finished > config.requests)
+        config.requests_finished = config.requests;
+    reqpersec = requestsPerSecond(config.requests_finished);
+
+    if (!config.quiet && !config.csv && !config.json) {
         printf("====== %s ======\n", config.title);
         printf("  %d requests completed in %.2f seconds\n", config.requests_finished,
             (float)config.totlatency/1000);
         printf("  %d parallel clients\n", config.numclients);
-        printf("  %d bytes payload\n", config.datasize);
+        if (config.num_threads)
+            printf("  %d threads\n", config.num_threads);
+        if (config.workload)
+            printf("  %d commands in the workload\n",
+                config.workload->numcommands);
+        else
+            printf("  %d bytes payload\n", config.datasize);
+        if (config.rate > 0)
+            printf("  open loop at %.2f requests per second\n", config.rate);
         printf("  keep alive: %d\n", config.keepalive);
         printf("\n");
 
-        qsort(config.latency,config.requests,sizeof(long long),compareLatency);
-        for (i = 0; i < config.requests; i++) {
-            if (config.latency[i]/1000 != curlat || i == (config.requests-1)) {
-                curlat = config.latency[i]/1000;
-                perc = ((float)(i+1)*100)/config.requests;
-                printf("%.2f%% <= %d milliseconds\n", perc, curlat);
-            }
+        printf("Latency by percentile distribution:\n");
+        for (i = 0; i < (int)(sizeof(perc)/sizeof(perc[0])); i++) {
+            long long lat = perc[i] == 0 ? h->min :
+                            latencyHistogramPercentile(h,perc[i]);
+            printf("%.3f%% <= %.3f milliseconds\n", perc[i], (float)lat/1000);
         }
+        printf("\n");
+        printf("Latency summary: avg %.3f min %.3f",
+            h->count ? (float)h->total/h->count/1000 : 0, (float)h->min/1000);
+        for (i = 0; i < REPORT_PERCENTILES; i++)
+            printf(" %s %.3f", report_percentile_names[i],
+                (float)latencyHistogramPercentile(h,report_percentiles[i])/1000);
+        printf(" max %.3f milliseconds\n", (float)h->max/1000);
         printf("%.2f requests per second\n\n", reqpersec);
+        if (config.cluster_mode) showClusterNodesReport();
+        if (config.workload) showWorkloadCommandsReport();
     } else if (config.csv) {
-        printf("\"%s\",\"%.2f\"\n", config.title, reqpersec);
+        printf("\"%s\",\"%.2f\"", config.title, reqpersec);
+        printCsvLatencies(h);
+        for (i = 0; i < config.cluster_node_count; i++) {
+            pnode node = config.cluster_nodes[i];
+
+            mergeNodeStats(node,h,&redirects);
+            printf("\"%s %s:%d\",\"%.2f\"", config.title, node->ip,
+                node->port, requestsPerSecond(h->count));
+            printCsvLatencies(h);
+        }
+        for (i = 0; config.workload && i < config.workload->numcommands; i++) {
+            pworkcmd wc = config.workload->commands+i;
+
+            mergeCommandStats(wc,h);
+            printf("\"%s %s\",\"%.2f\"", config.title, wc->name,
+                requestsPerSecond(h->count));
+            printCsvLatencies(h);
+        }
+    } else if (config.json) {
+        /* A JSON object per line, for every test. */
+        printf("{\"test\":");
+        printJsonString(config.title);
+        printf(",\"requests\":%d,\"rps\":%.2f,", config.requests_finished,
+            reqpersec);
+        printJsonLatencies(h);
+        if (config.cluster_mode) {
+            printf(",\"nodes\":[");
+            for (i = 0; i < config.cluster_node_count; i++) {
+                pnode node = config.cluster_nodes[i];
+
+                mergeNodeStats(node,h,&redirects);
+                printf("%s{\"node\":\"%s:%d\",\"requests\":%lld,"
+                       "\"rps\":%.2f,\"redirections\":%d,",
+                    i ? "," : "", node->ip, node->port, h->count,
+                    requestsPerSecond(h->count), redirects);
+                printJsonLatencies(h);
+                printf("}");
+            }
+            printf("]");
+        }
+        if (config.workload) {
+            printf(",\"commands\":[");
+            for (i = 0; i < config.workload->numcommands; i++) {
+                pworkcmd wc = config.workload->commands+i;
+
+                mergeCommandStats(wc,h);
+                printf("%s{\"command\":", i ? "," : "");
+                printJsonString(wc->name);
+                printf(",\"requests\":%lld,\"rps\":%.2f,", h->count,
+                    requestsPerSecond(h->count));
+                printJsonLatencies(h);
+                printf("}");
+            }
+            printf("]");
+        }
+        printf("}\n");
     } else {
-        printf("%s: %.2f requests per second\n", config.title, reqpersec);
+        printf("%s: %.2f requests per second, p50=%.3f msec\n", config.title,
+            reqpersec, (float)latencyHistogramPercentile(h,50)/1000);
+    }
+    zfree(h);
+}
+
+static void *execBenchmarkThread(void *ptr) {
+    pthreadinfo thread = (pthreadinfo)ptr;
+
+    thread->el->aeMain();
+    return NULL;
+}
+
+static void initBenchmarkThreads() {
+    int i;
+
+    config.threads = (pthreadinfo *)zmalloc(sizeof(pthreadinfo)*config.num_threads);
+    for (i = 0; i < config.num_threads; i++) {
+        pthreadinfo thread = (pthreadinfo)zmalloc(sizeof(*thread));
+
+        thread->index = i;
+        thread->el = aeCreateEventLoop(1024*10);
+        thread->el->aeCreateTimeEvent(1,showThroughput,thread,NULL);
+        config.threads[i] = thread;
+    }
+}
+
+static void startBenchmarkThreads() {
+    int i;
+
+    for (i = 0; i < config.num_threads; i++) {
+        pthreadinfo thread = config.threads[i];
+
+        if (pthread_create(&thread->thread,NULL,execBenchmarkThread,thread)) {
+            fprintf(stderr,"FATAL: Failed to start thread %d.\n",i);
+            exit(1);
+        }
     }
+    for (i = 0; i < config.num_threads; i++)
+        pthread_join(config.threads[i]->thread,NULL);
+}
+
+static void freeBenchmarkThreads() {
+    int i;
+
+    for (i = 0; i < config.num_threads; i++) {
+        aeDeleteEventLoop(config.threads[i]->el);
+        zfree(config.threads[i]);
+    }
+    zfree(config.threads);
+    config.threads = NULL;
 }
 
 static void benchmark(char *title, char *cmd, int len) {
+    int j, k;
+
     config.title = title;
     config.requests_issued = 0;
     config.requests_finished = 0;
+    config.totlatency = 0;
+    for (j = 0; j < config.numhist; j++)
+        latencyHistogramReset(config.hist+j);
+    for (j = 0; j < config.cluster_node_count; j++) {
+        for (k = 0; k < config.numhist; k++) {
+            latencyHistogramReset(&config.cluster_nodes[j]->stats[k].hist);
+            config.cluster_nodes[j]->stats[k].redirects = 0;
+        }
+    }
+    config.cluster_next_node = 0;
+    for (j = 0; config.workload && j < config.workload->numcommands; j++) {
+        for (k = 0; k < config.numhist; k++)
+            latencyHistogramReset(config.workload->commands[j].hist+k);
+    }
 
-    pclient c = createClient(cmd,len,NULL);
+    if (config.num_threads) initBenchmarkThreads();
+    pclient c = createClient(cmd,len,NULL,config.num_threads ? 0 : -1);
     createMissingClients(c);
 
     config.start = mstime();
-    config.el->aeMain();
-    config.totlatency = mstime()-config.start;
+    config.start_us = ustime();
+    if (config.num_threads) startBenchmarkThreads();
+    else config.el->aeMain();
+    if (config.totlatency == 0) config.totlatency = mstime()-config.start;
 
     showLatencyReport();
     freeAllClients();
+    if (config.num_threads) freeBenchmarkThreads();
+}
+
+/* Fill slot_tags with the first three characters tag found for every slot. */
+static void computeSlotTags() {
+    static const char charset[] =
+        "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+    int n = sizeof(charset)-1, a, b, c;
+
+    memset(slot_tags,0,sizeof(slot_tags));
+    for (a = 0; a < n; a++) {
+        for (b = 0; b < n; b++) {
+            for (c = 0; c < n; c++) {
+                char tag[3] = {charset[a],charset[b],charset[c]};
+                int slot = crc16(tag,3) & (CLUSTER_SLOTS-1);
+
+                if (slot_tags[slot][0] == '\0') memcpy(slot_tags[slot],tag,3);
+            }
+        }
+    }
+}
+
+/* Load the masters and their slots from the CLUSTER SLOTS output of the
+ * node specified by -h and -p. */
+static void fetchClusterConfiguration() {
+    redisContext *ctx = redisConnect(config.hostip,config.hostport);
+    redisReply *reply = NULL;
+    size_t i, j;
+
+    if (ctx == NULL || ctx->err) {
+        fprintf(stderr,"Could not connect to Redis at %s:%d: %s\n",
+            config.hostip,config.hostport,ctx ? ctx->errstr : "out of memory");
+        exit(1);
+    }
+    if (config.auth) {
+        reply = (redisReply *)redisCommand(ctx,"AUTH %s",config.auth);
+        if (reply) freeReplyObject(reply);
+    }
+    reply = (redisReply *)redisCommand(ctx,"CLUSTER SLOTS");
+    if (reply == NULL || reply->type != REDIS_REPLY_ARRAY) {
+        fprintf(stderr,"Cluster mode requires a Redis Cluster node: %s\n",
+            reply && reply->type == REDIS_REPLY_ERROR ? reply->str :
+                                                      ctx->errstr);
+        exit(1);
+    }
+    computeSlotTags();
+
+    for (i = 0; i < reply->elements; i++) {
+        redisReply *r = reply->element[i];
+        redisReply *master;
+        const char *ip;
+        pnode node = NULL;
+        int port, slot;
+
+        if (r->elements < 3) continue;
+        master = r->element[2];
+        /* An empty address is the one of the node we asked. */
+        ip = master->element[0]->len ? master->element[0]->str : config.hostip;
+        port = (int)master->element[1]->integer;
+        for (j = 0; j < (size_t)config.cluster_node_count; j++) {
+            pnode n = config.cluster_nodes[j];
+            if (n->port == port && !strcmp(n->ip,ip)) node = n;
+        }
+        if (node == NULL) {
+            node = (pnode)zmalloc(sizeof(*node));
+            memset(node,0,sizeof(*node));
+            node->ip = strdup(ip);
+            node->port = port;
+            node->slots = (int *)zmalloc(sizeof(int)*CLUSTER_SLOTS);
+            node->stats = (_nodeStats *)zcalloc(sizeof(_nodeStats)*config.numhist);
+            config.cluster_nodes = (pnode *)zrealloc(config.cluster_nodes,
+                sizeof(pnode)*(config.cluster_node_count+1));
+            config.cluster_nodes[config.cluster_node_count++] = node;
+        }
+        for (slot = (int)r->element[0]->integer;
+             slot <= (int)r->element[1]->integer; slot++)
+        {
+            if (slot_tags[slot][0]) node->slots[node->numslots++] = slot;
+        }
+    }
+    freeReplyObject(reply);
+    redisFree(ctx);
+
+    if (config.cluster_node_count == 0) {
+        fprintf(stderr,"No slot is assigned in the cluster.\n");
+        exit(1);
+    }
+    for (j = 0; j < (size_t)config.cluster_node_count; j++) {
+        if (config.cluster_nodes[j]->numslots == 0) {
+            fprintf(stderr,"No hash tag found for the slots of %s:%d.\n",
+                config.cluster_nodes[j]->ip,config.cluster_nodes[j]->port);
+            exit(1);
+        }
+    }
+    /* Every node needs at least a client. */
+    if (config.numclients < config.cluster_node_count)
+        config.numclients = config.cluster_node_count;
+    if (!config.quiet && !config.csv && !config.json)
+        printf("Cluster has %d master nodes\n\n",config.cluster_node_count);
+}
+
+/* Return the zeta sum of 'n' terms with exponent 'theta'. */
+static double zeta(long long n, double theta) {
+    long long j, m = n < ZIPF_ZETA_EXACT ? n : ZIPF_ZETA_EXACT;
+    double sum = 0;
+
+    for (j = 1; j <= m; j++) sum += pow((double)j,-theta);
+    /* Past the exact terms the sum is close enough to its integral. */
+    if (n > m) sum += (pow((double)n,1-theta)-pow((double)m,1-theta))/(1-theta);
+    return sum;
+}
+
+static void workloadError(const char *filename, int linenum, const char *err) {
+    fprintf(stderr,"Bad workload file %s at line %d: %s\n",
+        filename, linenum, err);
+    exit(1);
+}
+
+/* Load the workload described in 'filename', one directive per line:
+ *
+ * name <text>                  Title of the benchmark in the report.
+ * command <weight> <arg> ...   A command, sent for <weight> parts of the
+ *                              requests. __key__ is replaced by a key of
+ *                              the key distribution, __value__ by a value
+ *                              of the value distribution.
+ * keyspace <n>                 Keys from 0 to n-1 (default -r, or 1000000).
+ * keys uniform                 Every key is equally likely (default).
+ * keys zipfian <theta>         Zipfian popularity of skew 0 < theta < 1.
+ * keys hotspot <keys> <ops>    The <keys> fraction of the keyspace gets the
+ *                              <ops> fraction of the requests.
+ * values fixed <size>          The -d size (default).
+ * values uniform <min> <max>   Sizes from min to max, equally likely.
+ * values weighted <size>:<weight> ...
+ * rate <requests per second>   Open loop at the target rate, if --rate is
+ *                              not given. */
+static void loadWorkload(const char *filename) {
+    pworkload w = (pworkload)zcalloc(sizeof(*w));
+    FILE *fp = fopen(filename,"r");
+    char buf[1024*16];
+    int linenum = 0, j;
+
+    if (fp == NULL) {
+        fprintf(stderr,"Can't open the workload file %s: %s\n",
+            filename, strerror(errno));
+        exit(1);
+    }
+    w->name = sdsnew("WORKLOAD");
+    w->keyspace = config.randomkeys_keyspacelen ?
+                  config.randomkeys_keyspacelen : 1000000;
+    w->keydist = KEYDIST_UNIFORM;
+    w->valdist = VALDIST_FIXED;
+    w->val_min = w->val_max = config.datasize;
+    while (fgets(buf,sizeof(buf),fp) != NULL) {
+        sds line = sdstrim(sdsnew(buf)," \t\r\n");
+        sds *argv;
+        int argc;
+
+        linenum++;
+        if (line[0] == '#' || line[0] == '\0') {
+            sdsfree(line);
+            continue;
+        }
+        argv = sdssplitargs(line,&argc);
+        sdsfree(line);
+        if (argv == NULL) workloadError(filename,linenum,"unbalanced quotes");
+        sdstolower(argv[0]);
+        if (!strcmp(argv[0],"name") && argc >= 2) {
+            sdsfree(w->name);
+            w->name = sdsjoinsds(argv+1,argc-1," ",1);
+        } else if (!strcmp(argv[0],"command") && argc >= 3) {
+            pworkcmd wc;
+
+            w->commands = (pworkcmd)zrealloc(w->commands,
+                sizeof(*w->commands)*(w->numcommands+1));
+            wc = w->commands+w->numcommands++;
+            wc->weight = strtoll(argv[1],NULL,10);
+            if (wc->weight <= 0)
+                workloadError(filename,linenum,"the weight must be positive");
+            w->totweight += wc->weight;
+            wc->argc = argc-2;
+            wc->argv = (sds *)zmalloc(sizeof(sds)*wc->argc);
+            for (j = 0; j < wc->argc; j++) wc->argv[j] = sdsdup(argv[j+2]);
+            wc->name = sdsjoinsds(wc->argv,wc->argc," ",1);
+            wc->hist = (latencyHistogram *)zmalloc(sizeof(latencyHistogram)*
+                                                   config.numhist);
+        } else if (!strcmp(argv[0],"keyspace") && argc == 2) {
+            w->keyspace = strtoll(argv[1],NULL,10);
+            if (w->keyspace < 1)
+                workloadError(filename,linenum,"the keyspace must be positive");
+        } else if (!strcmp(argv[0],"keys") && argc >= 2) {
+            if (!strcasecmp(argv[1],"uniform") && argc == 2) {
+                w->keydist = KEYDIST_UNIFORM;
+            } else if (!strcasecmp(argv[1],"zipfian") && argc == 3) {
+                w->keydist = KEYDIST_ZIPFIAN;
+                w->zipf_theta = strtod(argv[2],NULL);
+                if (w->zipf_theta <= 0 || w->zipf_theta >= 1)
+                    workloadError(filename,linenum,
+                        "the zipfian theta must be between 0 and 1");
+            } else if (!strcasecmp(argv[1],"hotspot") && argc == 4) {
+                w->keydist = KEYDIST_HOTSPOT;
+                w->hot_keys = strtod(argv[2],NULL);
+                w->hot_ops = strtod(argv[3],NULL);
+                if (w->hot_keys <= 0 || w->hot_keys > 1 ||
+                    w->hot_ops < 0 || w->hot_ops > 1)
+                    workloadError(filename,linenum,
+                        "the hotspot fractions must be between 0 and 1");
+            } else {
+                workloadError(filename,linenum,"unknown key distribution");
+            }
+        } else if (!strcmp(argv[0],"values") && argc >= 2) {
+            if (!strcasecmp(argv[1],"fixed") && argc == 3) {
+                w->valdist = VALDIST_FIXED;
+                w->val_min = w->val_max = strtoll(argv[2],NULL,10);
+            } else if (!strcasecmp(argv[1],"uniform") && argc == 4) {
+                w->valdist = VALDIST_UNIFORM;
+                w->val_min = strtoll(argv[2],NULL,10);
+                w->val_max = strtoll(argv[3],NULL,10);
+            } else if (!strcasecmp(argv[1],"weighted") && argc >= 3) {
+                w->valdist = VALDIST_WEIGHTED;
+                w->numvals = argc-2;
+                w->val_sizes = (long long *)zmalloc(sizeof(long long)*w->numvals);
+                w->val_weights = (long long *)zmalloc(sizeof(long long)*w->numvals);
+                w->val_min = LLONG_MAX;
+                w->val_max = 0;
+                for (j = 0; j < w->numvals; j++) {
+                    char *colon = strchr(argv[j+2],':');
+
+                    if (colon == NULL)
+                        workloadError(filename,linenum,
+                            "the weighted sizes are <size>:<weight>");
+                    w->val_sizes[j] = strtoll(argv[j+2],NULL,10);
+                    w->val_weights[j] = strtoll(colon+1,NULL,10);
+                    if (w->val_weights[j] <= 0)
+                        workloadError(filename,linenum,
+                            "the weight must be positive");
+                    w->val_totweight += w->val_weights[j];
+                    if (w->val_sizes[j] < w->val_min) w->val_min = w->val_sizes[j];
+                    if (w->val_sizes[j] > w->val_max) w->val_max = w->val_sizes[j];
+                }
+            } else {
+                workloadError(filename,linenum,"unknown value distribution");
+            }
+            if (w->val_min < 0 || w->val_min > w->val_max ||
+                w->val_max > 1024*1024*1024)
+                workloadError(filename,linenum,"invalid value sizes");
+        } else if (!strcmp(argv[0],"rate") && argc == 2) {
+            if (config.rate == 0) config.rate = strtod(argv[1],NULL);
+        } else {
+            workloadError(filename,linenum,"unknown directive or wrong arguments");
+        }
+        sdsfreesplitres(argv,argc);
+    }
+    fclose(fp);
+    if (w->numcommands == 0) workloadError(filename,linenum,"no commands");
+
+    if (w->keydist == KEYDIST_ZIPFIAN) {
+        double theta = w->zipf_theta;
+
+        w->zipf_zetan = zeta(w->keyspace,theta);
+        w->zipf_alpha = 1/(1-theta);
+        w->zipf_eta = (1-pow(2.0/w->keyspace,1-theta))/
+                      (1-zeta(2,theta)/w->zipf_zetan);
+        w->zipf_half = pow(0.5,theta);
+    }
+    w->data = (char *)zmalloc(w->val_max+1);
+    memset(w->data,'x',w->val_max);
+    w->data[w->val_max] = '\0';
+    config.workload = w;
 }
 
 /* Returns number of consumed options. */
@@ -546,6 +1552,27 @@ int parseOptions(int argc, const char **argv) {
             if (lastarg) goto invalid;
             config.dbnum = atoi(argv[++i]);
             config.dbnumstr = sdsfromlonglong(config.dbnum);
+        } else if (!strcmp(argv[i],"--cluster")) {
+            config.cluster_mode = 1;
+        } else if (!strcmp(argv[i],"--threads")) {
+            if (lastarg) goto invalid;
+            config.num_threads = atoi(argv[++i]);
+            if (config.num_threads > MAX_THREADS) {
+                printf("WARNING: too many threads, limiting threads to %d.\n",
+                    MAX_THREADS);
+                config.num_threads = MAX_THREADS;
+            } else if (config.num_threads < 0) {
+                config.num_threads = 0;
+            }
+        } else if (!strcmp(argv[i],"--json")) {
+            config.json = 1;
+        } else if (!strcmp(argv[i],"--workload")) {
+            if (lastarg) goto invalid;
+            config.workload_file = strdup(argv[++i]);
+        } else if (!strcmp(argv[i],"--rate")) {
+            if (lastarg) goto invalid;
+            config.rate = atof(argv[++i]);
+            if (config.rate < 0) config.rate = 0;
         } else if (!strcmp(argv[i],"--help")) {
             exit_status = 0;
             goto usage;
@@ -585,11 +1612,37 @@ usage:
 " -e                 If server replies with errors, show them on stdout.\n"
 "                    (no more than 1 error per second is displayed)\n"
 " -q                 Quiet. Just show query/sec values\n"
-" --csv              Output in CSV format\n"
+" --csv              Output in CSV format, with the p50, p99, p99.9 and\n"
+"                    p99.99 latencies in milliseconds after the rps.\n"
+" --json             Output a JSON object for every test, with the rps and\n"
+"                    the latencies in milliseconds.\n"
+" --threads <num>    Run the clients in <num> threads, each with its own\n"
+"                    event loop (default 0, all in the main thread).\n"
+" --rate <qps>       Open loop: send the requests at the target rate, taking\n"
+"                    the latency of the late ones since they were due, so\n"
+"                    that the server stalls are not hidden.\n"
+" --workload <file>  Run the workload described in <file> instead of the\n"
+"                    tests. A line per directive, # for comments:\n"
+"                      name <text>\n"
+"                      command <weight> <arg> [<arg> ...]\n"
+"                        __key__ and __value__ in an argument are replaced\n"
+"                        by a key and a value of the distributions below.\n"
+"                      keyspace <n>  (default -r, or 1000000)\n"
+"                      keys uniform | zipfian <theta> | hotspot <keys> <ops>\n"
+"                        (hotspot: the <keys> fraction of the keyspace gets\n"
+"                        the <ops> fraction of the requests)\n"
+"                      values fixed <size> | uniform <min> <max> |\n"
+"                             weighted <size>:<weight> [...]  (default -d)\n"
+"                      rate <qps>  (as --rate)\n"
 " -l                 Loop. Run the tests forever\n"
 " -t <tests>         Only run the comma separated list of tests. The test\n"
 "                    names are the same as the ones produced as output.\n"
-" -I                 Idle mode. Just open N idle connections and wait.\n\n"
+" -I                 Idle mode. Just open N idle connections and wait.\n"
+" --cluster          Cluster mode. The clients are spread among the masters\n"
+"                    reported by CLUSTER SLOTS of the -h/-p node, and {tag}\n"
+"                    inside an argument is replaced by a hash tag of a slot\n"
+"                    of the node of the client. The default tests use it in\n"
+"                    their keys. Stats are also reported per node.\n\n"
 "Examples:\n\n"
 " Run the benchmark with the default configuration against 127.0.0.1:6379:\n"
 "   $ redis-benchmark\n\n"
@@ -603,29 +1656,46 @@ usage:
 "   $ redis-benchmark -r 10000 -n 10000 eval 'return redis.call(\"ping\")' 0\n\n"
 " Fill a list with 10000 random elements:\n"
 "   $ redis-benchmark -r 10000 -n 10000 lpush mylist __rand_int__\n\n"
+" Run a cache workload at 50000 requests per second, with the file:\n"
+"     keyspace 1000000\n"
+"     keys zipfian 0.99\n"
+"     values weighted 100:80 1000:15 10000:5\n"
+"     command 90 GET key:__key__\n"
+"     command 10 SET key:__key__ __value__\n"
+"   $ redis-benchmark --workload cache.txt --rate 50000 -n 1000000\n\n"
 " On user specified command lines __rand_int__ is replaced with a random integer\n"
 " with a range of values selected by the -r option.\n"
     );
     exit(exit_status);
 }
 
+/* Show the progress. With threads, every thread runs it in its own event
+ * loop to stop once all the requests are done, and only the first one
+ * shows the progress. */
 int showThroughput(struct aeEventLoop *eventLoop, long long id, void *clientData) {
-    UNUSED(eventLoop);
+    pthreadinfo thread = (pthreadinfo)clientData;
+    int liveclients, requests_finished;
     UNUSED(id);
-    UNUSED(clientData);
 
-    if (config.liveclients == 0) {
+    atomicGet(config.liveclients,liveclients);
+    atomicGet(config.requests_finished,requests_finished);
+    if (config.num_threads && requests_finished >= config.requests) {
+        eventLoop->aeStop();
+        return AE_NOMORE;
+    }
+    if (liveclients == 0 && requests_finished < config.requests) {
         fprintf(stderr,"All clients disconnected... aborting.\n");
         exit(1);
     }
-    if (config.csv) return 250;
+    if (config.csv || config.json) return 250;
+    if (thread && thread->index != 0) return 250;
     if (config.idlemode == 1) {
-        printf("clients: %d\r", config.liveclients);
+        printf("clients: %d\r", liveclients);
         fflush(stdout);
 	return 250;
     }
     float dt = (float)(mstime()-config.start)/1000.0;
-    float rps = (float)config.requests_finished/dt;
+    float rps = (float)requests_finished/dt;
     printf("%s: %.2f\r", config.title, rps);
     fflush(stdout);
     return 250; /* every 250ms */
@@ -671,7 +1741,6 @@ int main(int argc, const char **argv) {
     config.csv = 0;
     config.loop = 0;
     config.idlemode = 0;
-    config.latency = NULL;
     config.clients = listCreate();
     config.hostip = "127.0.0.1";
     config.hostport = 6379;
@@ -679,12 +1748,45 @@ int main(int argc, const char **argv) {
     config.tests = NULL;
     config.dbnum = 0;
     config.auth = NULL;
+    config.cluster_mode = 0;
+    config.cluster_nodes = NULL;
+    config.cluster_node_count = 0;
+    config.cluster_next_node = 0;
+    config.num_threads = 0;
+    config.threads = NULL;
+    config.json = 0;
+    config.workload_file = NULL;
+    config.workload = NULL;
+    config.rate = 0;
+    pthread_mutex_init(&config.liveclients_mutex,NULL);
+    pthread_mutex_init(&config.requests_issued_mutex,NULL);
+    pthread_mutex_init(&config.requests_finished_mutex,NULL);
 
     i = parseOptions(argc,argv);
     argc -= i;
     argv += i;
 
-    config.latency = (long long *)zmalloc(sizeof(long long)*config.requests);
+    /* The idle mode just keeps the connections open. */
+    if (config.idlemode) config.num_threads = 0;
+    config.numhist = config.num_threads ? config.num_threads : 1;
+    config.hist = (latencyHistogram *)zmalloc(sizeof(latencyHistogram)*config.numhist);
+
+    if (config.cluster_mode) {
+        if (config.dbnum != 0) {
+            fprintf(stderr,"Cluster mode only supports the database 0.\n");
+            exit(1);
+        }
+        fetchClusterConfiguration();
+    }
+    /* The keys of the default tests contain a hash tag in cluster mode. */
+    const char *tag = config.cluster_mode ? CLUSTER_TAG : "";
+
+    if (config.csv) {
+        printf("\"test\",\"rps\"");
+        for (i = 0; i < REPORT_PERCENTILES; i++)
+            printf(",\"%s_latency_ms\"", report_percentile_names[i]);
+        printf("\n");
+    }
 
     if (config.keepalive == 0) {
         printf("WARNING: keepalive disabled, you probably need 'echo 1 > /proc/sys/net/ipv4/tcp_tw_reuse' for Linux and 'sudo sysctl -w net.inet.tcp.msl=1000' for Mac OS X in order to use a lot of clients/requests\n");
@@ -692,12 +1794,26 @@ int main(int argc, const char **argv) {
 
     if (config.idlemode) {
         printf("Creating %d idle connections and waiting forever (Ctrl+C when done)\n", config.numclients);
-        c = createClient("",0,NULL); /* will never receive a reply */
+        c = createClient("",0,NULL,-1); /* will never receive a reply */
         createMissingClients(c);
         config.el->aeMain();
         /* and will wait for every */
     }
 
+    /* Run the workload instead of the tests. */
+    if (config.workload_file) {
+        if (argc) {
+            fprintf(stderr,"A command line can't be used with --workload.\n");
+            exit(1);
+        }
+        loadWorkload(config.workload_file);
+        do {
+            benchmark(config.workload->name,(char*)"",0);
+        } while(config.loop);
+
+        return 0;
+    }
+
     /* Run benchmark with command in the remainder of the arguments. */
     if (argc) {
         sds title = sdsnew(argv[0]);
@@ -731,63 +1847,63 @@ int main(int argc, const char **argv) {
         }
 
         if (test_is_selected("set")) {
-            len = redisFormatCommand(&cmd,"SET key:__rand_int__ %s",data);
+            len = redisFormatCommand(&cmd,"SET key%s:__rand_int__ %s",tag,data);
             benchmark("SET",cmd,len);
             free(cmd);
         }
 
         if (test_is_selected("get")) {
-            len = redisFormatCommand(&cmd,"GET key:__rand_int__");
+            len = redisFormatCommand(&cmd,"GET key%s:__rand_int__",tag);
             benchmark("GET",cmd,len);
             free(cmd);
         }
 
         if (test_is_selected("incr")) {
-            len = redisFormatCommand(&cmd,"INCR counter:__rand_int__");
+            len = redisFormatCommand(&cmd,"INCR counter%s:__rand_int__",tag);
             benchmark("INCR",cmd,len);
             free(cmd);
         }
 
         if (test_is_selected("lpush")) {
-            len = redisFormatCommand(&cmd,"LPUSH mylist %s",data);
+            len = redisFormatCommand(&cmd,"LPUSH mylist%s %s",tag,data);
             benchmark("LPUSH",cmd,len);
             free(cmd);
         }
 
         if (test_is_selected("rpush")) {
-            len = redisFormatCommand(&cmd,"RPUSH mylist %s",data);
+            len = redisFormatCommand(&cmd,"RPUSH mylist%s %s",tag,data);
             benchmark("RPUSH",cmd,len);
             free(cmd);
         }
 
         if (test_is_selected("lpop")) {
-            len = redisFormatCommand(&cmd,"LPOP mylist");
+            len = redisFormatCommand(&cmd,"LPOP mylist%s",tag);
             benchmark("LPOP",cmd,len);
             free(cmd);
         }
 
         if (test_is_selected("rpop")) {
-            len = redisFormatCommand(&cmd,"RPOP mylist");
+            len = redisFormatCommand(&cmd,"RPOP mylist%s",tag);
             benchmark("RPOP",cmd,len);
             free(cmd);
         }
 
         if (test_is_selected("sadd")) {
             len = redisFormatCommand(&cmd,
-                "SADD myset element:__rand_int__");
+                "SADD myset%s element:__rand_int__",tag);
             benchmark("SADD",cmd,len);
             free(cmd);
         }
 
         if (test_is_selected("hset")) {
             len = redisFormatCommand(&cmd,
-                "HSET myset:__rand_int__ element:__rand_int__ %s",data);
+                "HSET myset%s:__rand_int__ element:__rand_int__ %s",tag,data);
             benchmark("HSET",cmd,len);
             free(cmd);
         }
 
         if (test_is_selected("spop")) {
-            len = redisFormatCommand(&cmd,"SPOP myset");
+            len = redisFormatCommand(&cmd,"SPOP myset%s",tag);
             benchmark("SPOP",cmd,len);
             free(cmd);
         }
@@ -798,31 +1914,31 @@ int main(int argc, const char **argv) {
             test_is_selected("lrange_500") ||
             test_is_selected("lrange_600"))
         {
-            len = redisFormatCommand(&cmd,"LPUSH mylist %s",data);
+            len = redisFormatCommand(&cmd,"LPUSH mylist%s %s",tag,data);
             benchmark("LPUSH (needed to benchmark LRANGE)",cmd,len);
             free(cmd);
         }
 
         if (test_is_selected("lrange") || test_is_selected("lrange_100")) {
-            len = redisFormatCommand(&cmd,"LRANGE mylist 0 99");
+            len = redisFormatCommand(&cmd,"LRANGE mylist%s 0 99",tag);
             benchmark("LRANGE_100 (first 100 elements)",cmd,len);
             free(cmd);
         }
 
         if (test_is_selected("lrange") || test_is_selected("lrange_300")) {
-            len = redisFormatCommand(&cmd,"LRANGE mylist 0 299");
+            len = redisFormatCommand(&cmd,"LRANGE mylist%s 0 299",tag);
             benchmark("LRANGE_300 (first 300 elements)",cmd,len);
             free(cmd);
         }
 
         if (test_is_selected("lrange") || test_is_selected("lrange_500")) {
-            len = redisFormatCommand(&cmd,"LRANGE mylist 0 449");
+            len = redisFormatCommand(&cmd,"LRANGE mylist%s 0 449",tag);
             benchmark("LRANGE_500 (first 450 elements)",cmd,len);
             free(cmd);
         }
 
         if (test_is_selected("lrange") || test_is_selected("lrange_600")) {
-            len = redisFormatCommand(&cmd,"LRANGE mylist 0 599");
+            len = redisFormatCommand(&cmd,"LRANGE mylist%s 0 599",tag);
             benchmark("LRANGE_600 (first 600 elements)",cmd,len);
             free(cmd);
         }
@@ -831,7 +1947,8 @@ int main(int argc, const char **argv) {
             const char *argv[21];
             argv[0] = "MSET";
             for (i = 1; i < 21; i += 2) {
-                argv[i] = "key:__rand_int__";
+                argv[i] = config.cluster_mode ? "key{tag}:__rand_int__" :
+                                                "key:__rand_int__";
                 argv[i+1] = data;
             }
             len = redisFormatCommandArgv(&cmd,21,argv,NULL);
@@ -839,7 +1956,7 @@ int main(int argc, const char **argv) {
             free(cmd);
         }
 
-        if (!config.csv) printf("\n");
+        if (!config.csv && !config.json) printf("\n");
     } while(config.loop);
 
     return 0;
@@ -0,0 +1,554 @@
+/* redis-build-rdb builds an RDB file offline from a list of commands, so
+ * that big datasets can be produced by batch jobs and loaded at startup
+ * instead of being replayed against a running server.
+ *
+ * The input is a sequence of write commands in one of three formats:
+ *
+ * - resp: the Redis protocol, like the one sent with redis-cli --pipe.
+ * - csv:  a command per line, its arguments separated by commas, quoted
+ *         with double quotes when they contain commas, quotes or newlines.
+ * - json: a command per line, as a JSON array of strings or numbers.
+ *
+ * The supported commands are SET, HSET, HMSET, RPUSH, LPUSH, SADD, ZADD,
+ * EXPIRE, PEXPIRE, EXPIREAT, PEXPIREAT and SELECT. The values are built in
+ * memory with the same type functions the commands use, so the fields of a
+ * key are grouped whatever their order in the input, and the small values
+ * get the compact encodings (listpack, intset) right away according to the
+ * *-max-ziplist-* limits. The file is then written by rdbSave(), so the
+ * options of a configuration file passed with --config apply: for instance
+ * rdb-save-threads writes the file in chunks that rdb-load-threads loads in
+ * parallel, and rdb-compress-chunks compresses them.
+ *
+ * The program is part of the Redis executable like redis-check-rdb, and
+ * runs when it is called as redis-build-rdb.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "rdb.h"
+
+#include <math.h>
+
+void createSharedObjects();
+
+#define BUILD_FORMAT_RESP 0
+#define BUILD_FORMAT_CSV 1
+#define BUILD_FORMAT_JSON 2
+
+static struct buildState {
+    FILE *fp;
+    const char *filename;   /* Input file, for the error messages. */
+    int format;             /* BUILD_FORMAT_* */
+    long long line;         /* Current line of the input. */
+    sds *argv;              /* Arguments of the last command read. */
+    int argc;
+    int argv_size;
+    sds line_buf;           /* Line being parsed in the json format. */
+    redisDb *db;            /* Database selected with SELECT. */
+    long long commands;     /* Commands applied. */
+    long long now;          /* Base time of the relative expires. */
+} build;
+
+static void buildError(const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap,fmt);
+    fprintf(stderr,"%s:%lld: ",build.filename,build.line);
+    vfprintf(stderr,fmt,ap);
+    fprintf(stderr,"\n");
+    va_end(ap);
+    exit(1);
+}
+
+static void buildAddArg(sds arg) {
+    if (build.argc == build.argv_size) {
+        build.argv_size = build.argv_size ? build.argv_size*2 : 16;
+        build.argv = (sds*)zrealloc(build.argv,sizeof(sds)*build.argv_size);
+    }
+    build.argv[build.argc++] = arg;
+}
+
+static void buildResetArgs() {
+    for (int j = 0; j < build.argc; j++) sdsfree(build.argv[j]);
+    build.argc = 0;
+}
+
+/* Read a line into '*line', without the trailing CRLF or LF. Returns 0 at
+ * the end of the input. */
+static int buildReadLine(sds *line) {
+    int c;
+
+    sdsclear(*line);
+    while ((c = getc_unlocked(build.fp)) != EOF && c != '\n')
+        *line = sdscatlen(*line,&c,1);
+    if (c == EOF && sdslen(*line) == 0) return 0;
+    if (sdslen(*line) && (*line)[sdslen(*line)-1] == '\r')
+        sdsrange(*line,0,-2);
+    build.line++;
+    return 1;
+}
+
+/* Read a command in the Redis protocol. Returns 0 at the end of the input,
+ * 1 otherwise, with the arguments in build.argv. */
+static int buildReadResp() {
+    long long argc, len;
+
+    do {
+        if (!buildReadLine(&build.line_buf)) return 0;
+    } while (sdslen(build.line_buf) == 0);
+    if (build.line_buf[0] != '*' ||
+        !string2ll(build.line_buf+1,sdslen(build.line_buf)-1,&argc) ||
+        argc < 1)
+    {
+        buildError("Expected '*<count>', got '%s'",build.line_buf);
+    }
+    while (argc--) {
+        if (!buildReadLine(&build.line_buf)) buildError("Unexpected EOF");
+        if (build.line_buf[0] != '$' ||
+            !string2ll(build.line_buf+1,sdslen(build.line_buf)-1,&len) ||
+            len < 0)
+        {
+            buildError("Expected '$<length>', got '%s'",build.line_buf);
+        }
+        sds arg = sdsnewlen(NULL,len);
+        if ((len && fread(arg,len,1,build.fp) != 1) ||
+            getc_unlocked(build.fp) != '\r' || getc_unlocked(build.fp) != '\n')
+        {
+            sdsfree(arg);
+            buildError("Truncated argument");
+        }
+        build.line++;
+        buildAddArg(arg);
+    }
+    return 1;
+}
+
+/* Read a command as a line of comma separated values. The quoted values
+ * may contain commas, newlines, and quotes written twice. */
+static int buildReadCsv() {
+    sds arg = sdsempty();
+    int c, quoted = 0, fields = 0, start = 1;
+
+    while (1) {
+        c = getc_unlocked(build.fp);
+        if (quoted) {
+            if (c == EOF) buildError("Unterminated quoted value");
+            if (c == '"') {
+                if ((c = getc_unlocked(build.fp)) != '"') {
+                    quoted = 0;
+                    ungetc(c,build.fp);
+                    continue;
+                }
+            } else if (c == '\n') {
+                build.line++;
+            }
+            arg = sdscatlen(arg,&c,1);
+        } else if (c == '"' && start) {
+            quoted = 1;
+            start = 0;
+        } else if (c == ',') {
+            buildAddArg(arg);
+            arg = sdsempty();
+            fields++;
+            start = 1;
+        } else if (c == '\n' || c == EOF) {
+            if (sdslen(arg) && arg[sdslen(arg)-1] == '\r') sdsrange(arg,0,-2);
+            if (c == '\n') build.line++;
+            if (fields || sdslen(arg)) {
+                buildAddArg(arg);
+                return 1;
+            }
+            if (c == EOF) {
+                sdsfree(arg);
+                return 0;
+            }
+            /* Skip the empty lines. */
+            start = 1;
+        } else {
+            arg = sdscatlen(arg,&c,1);
+            start = 0;
+        }
+    }
+}
+
+/* Append the UTF-8 encoding of the code point 'cp' to 'arg'. */
+static sds buildCatUtf8(sds arg, unsigned long cp) {
+    unsigned char buf[4];
+    int len;
+
+    if (cp < 0x80) {
+        buf[0] = cp;
+        len = 1;
+    } else if (cp < 0x800) {
+        buf[0] = 0xc0 | (cp >> 6);
+        buf[1] = 0x80 | (cp & 0x3f);
+        len = 2;
+    } else if (cp < 0x10000) {
+        buf[0] = 0xe0 | (cp >> 12);
+        buf[1] = 0x80 | ((cp >> 6) & 0x3f);
+        buf[2] = 0x80 | (cp & 0x3f);
+        len = 3;
+    } else {
+        buf[0] = 0xf0 | (cp >> 18);
+        buf[1] = 0x80 | ((cp >> 12) & 0x3f);
+        buf[2] = 0x80 | ((cp >> 6) & 0x3f);
+        buf[3] = 0x80 | (cp & 0x3f);
+        len = 4;
+    }
+    return sdscatlen(arg,buf,len);
+}
+
+/* Parse the 4 hex digits at 'p'. Returns -1 if they are not valid. */
+static long buildParseHex4(const char *p) {
+    long cp = 0;
+
+    for (int j = 0; j < 4; j++) {
+        int d = p[j];
+        if (d >= '0' && d <= '9') d -= '0';
+        else if (d >= 'a' && d <= 'f') d -= 'a'-10;
+        else if (d >= 'A' && d <= 'F') d -= 'A'-10;
+        else return -1;
+        cp = (cp << 4) | d;
+    }
+    return cp;
+}
+
+/* Read a command as a line holding a JSON array of strings and numbers,
+ * the numbers being taken as they are written. */
+static int buildReadJson() {
+    const char *p, *end;
+
+    do {
+        if (!buildReadLine(&build.line_buf)) return 0;
+        p = build.line_buf;
+        end = p+sdslen(build.line_buf);
+        while (p < end && isspace(*p)) p++;
+    } while (p == end);
+
+    if (*p++ != '[') buildError("Expected a JSON array");
+    while (1) {
+        sds arg;
+
+        while (p < end && isspace(*p)) p++;
+        if (p < end && *p == ']' && build.argc == 0) break;
+        if (p == end) buildError("Unterminated JSON array");
+        if (*p == '"') {
+            arg = sdsempty();
+            p++;
+            while (p < end && *p != '"') {
+                const char *s = p;
+
+                while (p < end && *p != '"' && *p != '\\') p++;
+                arg = sdscatlen(arg,s,p-s);
+                if (p == end || *p == '"') break;
+                if (++p == end) break;
+                switch(*p++) {
+                case 'n': arg = sdscatlen(arg,"\n",1); break;
+                case 'r': arg = sdscatlen(arg,"\r",1); break;
+                case 't': arg = sdscatlen(arg,"\t",1); break;
+                case 'b': arg = sdscatlen(arg,"\b",1); break;
+                case 'f': arg = sdscatlen(arg,"\f",1); break;
+                case 'u': {
+                    long cp = end-p >= 4 ? buildParseHex4(p) : -1, lo;
+
+                    if (cp == -1) buildError("Invalid \\u escape");
+                    p += 4;
+                    /* A surrogate pair encodes a code point above 0xFFFF. */
+                    if (cp >= 0xd800 && cp <= 0xdbff && end-p >= 6 &&
+                        p[0] == '\\' && p[1] == 'u' &&
+                        (lo = buildParseHex4(p+2)) >= 0xdc00 && lo <= 0xdfff)
+                    {
+                        cp = 0x10000+((cp-0xd800) << 10)+(lo-0xdc00);
+                        p += 6;
+                    }
+                    arg = buildCatUtf8(arg,cp);
+                    break;
+                }
+                default: arg = sdscatlen(arg,p-1,1); break;
+                }
+            }
+            if (p == end) {
+                sdsfree(arg);
+                buildError("Unterminated JSON string");
+            }
+            p++;
+        } else {
+            const char *s = p;
+
+            while (p < end && *p != ',' && *p != ']' && !isspace(*p)) p++;
+            arg = sdsnewlen(s,p-s);
+        }
+        buildAddArg(arg);
+        while (p < end && isspace(*p)) p++;
+        if (p < end && *p == ']') break;
+        if (p == end || *p++ != ',') buildError("Expected ',' or ']'");
+    }
+    if (build.argc == 0) buildError("Empty command");
+    return 1;
+}
+
+static int buildReadCommand() {
+    buildResetArgs();
+    switch(build.format) {
+    case BUILD_FORMAT_CSV: return buildReadCsv();
+    case BUILD_FORMAT_JSON: return buildReadJson();
+    default: return buildReadResp();
+    }
+}
+
+/* Return the value of 'key', creating it with 'create' if it does not exist
+ * yet. Types different from 'type' are an error like in the server. */
+static robj *buildLookupOrCreate(robj *key, int type, robj *(*create)(sds),
+                                 sds arg)
+{
+    dictEntry *de = build.db->m_dict->dictFind(key->ptr);
+    robj *o;
+
+    if (de) {
+        o = (robj*)de->dictGetVal();
+        if (o->type != type)
+            buildError("WRONGTYPE %s holds a value of another type",
+                (char*)key->ptr);
+        return o;
+    }
+    o = create(arg);
+    dbAdd(build.db,key,o);
+    return o;
+}
+
+static robj *buildCreateHash(sds arg) {
+    UNUSED(arg);
+    return createHashObject();
+}
+
+static robj *buildCreateList(sds arg) {
+    robj *o = createQuicklistObject();
+
+    UNUSED(arg);
+    quicklistSetOptions((quicklist*)o->ptr,server.list_max_ziplist_size,
+                        server.list_compress_depth);
+    return o;
+}
+
+static robj *buildCreateZset(sds arg) {
+    if (server.zset_max_ziplist_entries == 0 ||
+        server.zset_max_ziplist_value < sdslen(arg))
+        return createZsetObject();
+    return createZsetListpackObject();
+}
+
+static long long buildParseInteger(sds arg) {
+    long long value;
+
+    if (!string2ll(arg,sdslen(arg),&value))
+        buildError("Value is not an integer: '%s'",arg);
+    return value;
+}
+
+static void buildArity(const char *name, int min, int even) {
+    if (build.argc < min || (even && build.argc % 2 != min % 2))
+        buildError("Wrong number of arguments for %s",name);
+}
+
+/* Apply the command in build.argv to the current database. */
+static void buildApplyCommand() {
+    sds *argv = build.argv;
+    const char *name = argv[0];
+    robj key, *o;
+    int j;
+
+    if (!strcasecmp(name,"select")) {
+        buildArity(name,2,0);
+        long long id = buildParseInteger(argv[1]);
+        if (id < 0 || id >= server.dbnum)
+            buildError("DB index is out of range");
+        build.db = server.db+id;
+        return;
+    }
+
+    if (build.argc < 2) buildError("Wrong number of arguments for %s",name);
+    initStaticStringObject(key,argv[1]);
+
+    if (!strcasecmp(name,"set")) {
+        long long expire = -1;
+
+        buildArity(name,3,0);
+        for (j = 3; j < build.argc; j++) {
+            if (j+1 < build.argc && !strcasecmp(argv[j],"ex"))
+                expire = build.now+buildParseInteger(argv[++j])*1000;
+            else if (j+1 < build.argc && !strcasecmp(argv[j],"px"))
+                expire = build.now+buildParseInteger(argv[++j]);
+            else
+                buildError("Unsupported SET option '%s'",argv[j]);
+        }
+        dbSyncDelete(build.db,&key);
+        o = tryObjectEncoding(createStringObject(argv[2],sdslen(argv[2])));
+        dbAdd(build.db,&key,o);
+        if (expire != -1) setExpire(NULL,build.db,&key,expire);
+    } else if (!strcasecmp(name,"hset") || !strcasecmp(name,"hmset")) {
+        buildArity(name,4,1);
+        o = buildLookupOrCreate(&key,OBJ_HASH,buildCreateHash,NULL);
+        for (j = 2; j < build.argc; j++) {
+            if (o->encoding == OBJ_ENCODING_LISTPACK &&
+                sdslen(argv[j]) > server.hash_max_ziplist_value)
+                hashTypeConvert(o,OBJ_ENCODING_HT);
+        }
+        for (j = 2; j < build.argc; j += 2)
+            hashTypeSet(o,argv[j],argv[j+1],HASH_SET_COPY);
+    } else if (!strcasecmp(name,"rpush") || !strcasecmp(name,"lpush")) {
+        int where = name[0] == 'r' || name[0] == 'R' ? LIST_TAIL : LIST_HEAD;
+
+        buildArity(name,3,0);
+        o = buildLookupOrCreate(&key,OBJ_LIST,buildCreateList,NULL);
+        for (j = 2; j < build.argc; j++) {
+            robj *ele = createStringObject(argv[j],sdslen(argv[j]));
+            listTypePush(o,ele,where);
+            decrRefCount(ele);
+        }
+    } else if (!strcasecmp(name,"sadd")) {
+        buildArity(name,3,0);
+        o = buildLookupOrCreate(&key,OBJ_SET,setTypeCreate,argv[2]);
+        for (j = 2; j < build.argc; j++) setTypeAdd(o,argv[j]);
+    } else if (!strcasecmp(name,"zadd")) {
+        buildArity(name,4,1);
+        o = buildLookupOrCreate(&key,OBJ_ZSET,buildCreateZset,argv[3]);
+        for (j = 2; j < build.argc; j += 2) {
+            char *eptr;
+            double score = strtod(argv[j],&eptr);
+            int flags = ZADD_NONE;
+
+            if (sdslen(argv[j]) == 0 || *eptr != '\0' || isnan(score))
+                buildError("Value is not a valid float: '%s'",argv[j]);
+            zsetAdd(o,score,argv[j+1],&flags,NULL);
+        }
+    } else if (!strcasecmp(name,"expire") || !strcasecmp(name,"pexpire") ||
+               !strcasecmp(name,"expireat") || !strcasecmp(name,"pexpireat"))
+    {
+        int ms = name[0] == 'p' || name[0] == 'P';
+        int at = name[strlen(name)-2] == 'a' || name[strlen(name)-2] == 'A';
+        long long when;
+
+        buildArity(name,3,0);
+        when = buildParseInteger(argv[2]);
+        if (!ms) when *= 1000;
+        if (!at) when += build.now;
+        /* Like the server, the expire of a missing key is ignored. */
+        if (build.db->m_dict->dictFind(key.ptr))
+            setExpire(NULL,build.db,&key,when);
+    } else {
+        buildError("Unsupported command '%s'",name);
+    }
+}
+
+static void buildUsage(char *progname) {
+    fprintf(stderr,
+"Usage: %s [--format resp|csv|json] [--config <file>] [--threads <n>]\n"
+"       <rdb-file-name> [<input-file> ...]\n\n"
+"Builds an RDB file from the commands in the input files, or in the\n"
+"standard input with no files or with '-'. The options of the configuration\n"
+"file are used for the encodings and the RDB format: --threads overrides\n"
+"its rdb-save-threads.\n", progname);
+    exit(1);
+}
+
+int redis_build_rdb_main(int argc, char **argv) {
+    char *configfile = NULL, *output;
+    int threads = 0, j;
+    long long keys = 0;
+
+    build.format = BUILD_FORMAT_RESP;
+    for (j = 1; j < argc && argv[j][0] == '-' && argv[j][1] == '-'; j++) {
+        int lastarg = j == argc-1;
+
+        if (!strcmp(argv[j],"--format") && !lastarg) {
+            j++;
+            if (!strcmp(argv[j],"resp")) build.format = BUILD_FORMAT_RESP;
+            else if (!strcmp(argv[j],"csv")) build.format = BUILD_FORMAT_CSV;
+            else if (!strcmp(argv[j],"json")) build.format = BUILD_FORMAT_JSON;
+            else buildUsage(argv[0]);
+        } else if (!strcmp(argv[j],"--config") && !lastarg) {
+            configfile = argv[++j];
+        } else if (!strcmp(argv[j],"--threads") && !lastarg) {
+            threads = atoi(argv[++j]);
+            if (threads < 1 || threads > RDB_SAVE_MAX_THREADS)
+                buildUsage(argv[0]);
+        } else {
+            buildUsage(argv[0]);
+        }
+    }
+    if (j == argc) buildUsage(argv[0]);
+    output = argv[j++];
+
+    if (configfile) loadServerConfig(configfile,NULL);
+    if (threads) server.rdb_save_threads = threads;
+    /* The slots of the keys are computed again at loading time. */
+    server.cluster_enabled = 0;
+    createSharedObjects();
+    server.db = (redisDb *)zmalloc(sizeof(redisDb)*server.dbnum);
+    for (int id = 0; id < server.dbnum; id++) new (server.db + id) redisDb(id);
+    server.lua_scripts = dictCreate(&shaScriptObjectDictType,NULL);
+    server.lua_functions = dictCreate(&luaFunctionDictType,NULL);
+    build.db = server.db;
+    build.line_buf = sdsempty();
+    build.now = mstime();
+
+    do {
+        if (j == argc || !strcmp(argv[j],"-")) {
+            build.fp = stdin;
+            build.filename = "stdin";
+        } else if ((build.fp = fopen(argv[j],"r")) == NULL) {
+            fprintf(stderr,"Can't open %s: %s\n",argv[j],strerror(errno));
+            exit(1);
+        } else {
+            build.filename = argv[j];
+        }
+        build.line = 0;
+        while (buildReadCommand()) {
+            buildApplyCommand();
+            build.commands++;
+        }
+        if (ferror(build.fp)) {
+            fprintf(stderr,"Error reading %s: %s\n",build.filename,
+                strerror(errno));
+            exit(1);
+        }
+        if (build.fp != stdin) fclose(build.fp);
+    } while (++j < argc);
+
+    for (j = 0; j < server.dbnum; j++) keys += server.db[j].m_dict->dictSize();
+    if (rdbSave(output,NULL) != C_OK) {
+        fprintf(stderr,"Error writing %s: %s\n",output,strerror(errno));
+        exit(1);
+    }
+    printf("%lld commands, %lld keys written to %s\n",build.commands,keys,
+        output);
+    exit(0);
+}
@@ -97,14 +97,99 @@ int readArgc(FILE *fp, long *target) {
     return readLong(fp,'*',target);
 }
 
+int readVarint(FILE *fp, uint64_t *target) {
+    epos = ftello(fp);
+    if (!aofReadBinaryVarint(fp,target)) {
+        ERROR("Expected a varint");
+        return 0;
+    }
+    return 1;
+}
+
+/* Check a binary record, see AOF_BINARY_CMD. The names bound to the IDs are
+ * kept in 'names' to follow MULTI and EXEC. */
+int processBinaryRecord(FILE *fp, int type, sds **names, uint64_t *numnames,
+                        int *multi)
+{
+    uint64_t id, argc, len, v;
+
+    if (!readVarint(fp,&id)) return 0;
+    if (type == AOF_BINARY_DEF) {
+        if (!readVarint(fp,&len)) return 0;
+        if (id == 0 || len > PROTO_INLINE_MAX_SIZE) {
+            ERROR("Invalid command binding");
+            return 0;
+        }
+        sds name = sdsnewlen(NULL,len);
+        if (!readBytes(fp,name,len)) {
+            sdsfree(name);
+            return 0;
+        }
+        if (id >= *numnames) {
+            *names = (sds*)zrealloc(*names,sizeof(sds)*(id+1));
+            memset(*names+*numnames,0,sizeof(sds)*(id+1-*numnames));
+            *numnames = id+1;
+        }
+        sdsfree((*names)[id]);
+        (*names)[id] = name;
+        return 1;
+    }
+
+    if (id >= *numnames || (*names)[id] == NULL) {
+        ERROR("Command ID %llu is not bound",(unsigned long long)id);
+        return 0;
+    }
+    if (strcasecmp((*names)[id],"multi") == 0) {
+        if ((*multi)++) {
+            ERROR("Unexpected MULTI");
+            return 0;
+        }
+    } else if (strcasecmp((*names)[id],"exec") == 0) {
+        if (--(*multi)) {
+            ERROR("Unexpected EXEC");
+            return 0;
+        }
+    }
+    if (!readVarint(fp,&argc)) return 0;
+    while (argc--) {
+        epos = ftello(fp);
+        int argtype = getc(fp);
+        if (argtype == AOF_BINARY_ARG_INT) {
+            if (!readVarint(fp,&v)) return 0;
+        } else if (argtype == AOF_BINARY_ARG_STR) {
+            if (!readVarint(fp,&len)) return 0;
+            if (len > 512ull*1024*1024) {
+                ERROR("Argument of %llu bytes",(unsigned long long)len);
+                return 0;
+            }
+            char *arg = (char*)zmalloc(len+1);
+            int ok = readBytes(fp,arg,len);
+            zfree(arg);
+            if (!ok) return 0;
+        } else {
+            ERROR("Unknown argument type %d",argtype);
+            return 0;
+        }
+    }
+    return 1;
+}
+
 off_t process(FILE *fp) {
     long argc;
     off_t pos = 0;
-    int i, multi = 0;
+    int i, multi = 0, type;
     char *str;
+    sds *names = NULL;
+    uint64_t numnames = 0;
 
     while(1) {
         if (!multi) pos = ftello(fp);
+        type = getc(fp);
+        if (type == AOF_BINARY_DEF || type == AOF_BINARY_CMD) {
+            if (!processBinaryRecord(fp,type,&names,&numnames,&multi)) break;
+            continue;
+        }
+        if (type != EOF) ungetc(type,fp);
         if (!readArgc(fp, &argc)) break;
 
         for (i = 0; i < argc; i++) {
@@ -132,6 +217,9 @@ off_t process(FILE *fp) {
         }
     }
 
+    for (uint64_t j = 0; j < numnames; j++) sdsfree(names[j]);
+    zfree(names);
+
     if (feof(fp) && multi && strlen(error) == 0) {
         ERROR("Reached EOF before reading EXEC for MULTI");
     }
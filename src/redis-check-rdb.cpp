@@ -37,18 +37,46 @@ void rdbLoadProgressCallback(rio *r, const void *buf, size_t len);
 long long rdbLoadMillisecondTime(rio *rdb);
 int rdbCheckMode = 0;
 
+#define RDB_CHECK_TYPES 21          /* RDB types up to RDB_TYPE_HASH_TTL. */
+#define RDB_CHECK_BIGGEST_KEYS 10
+
+struct rdbCheckBigKey {
+    sds key;
+    int type;
+    uint64_t bytes;                 /* Serialized size of key and value. */
+};
+
+/* Statistics about the keys checked. The parallel check collects them per
+ * chunk and merges them at the end. */
+struct rdbCheckStats {
+    unsigned long keys;             /* Number of keys processed. */
+    unsigned long expires;          /* Number of keys with an expire. */
+    unsigned long already_expired;  /* Number of keys already expired. */
+    unsigned long long type_keys[RDB_CHECK_TYPES];
+    unsigned long long type_bytes[RDB_CHECK_TYPES];
+    unsigned long long chunks, compressed_chunks;
+    unsigned long long chunk_bytes, chunk_raw_bytes;
+    unsigned long long compressed_strings;
+    unsigned long long string_bytes, string_raw_bytes;
+    rdbCheckBigKey biggest[RDB_CHECK_BIGGEST_KEYS]; /* Biggest first. */
+    int numbiggest;
+};
+
 struct {
     rio *rio;
     robj *key;                      /* Current key we are reading. */
     int key_type;                   /* Current key type if != -1. */
-    unsigned long keys;             /* Number of keys processed. */
-    unsigned long expires;          /* Number of keys with an expire. */
-    unsigned long already_expired;  /* Number of keys already expired. */
+    rdbCheckStats stats;
+    int show_stats;                 /* --stats: report rdbstate.stats. */
+    int threads;                    /* --threads: chunks checked in parallel. */
     int doing;                      /* The state while reading the RDB. */
     int error_set;                  /* True if error is populated. */
     char error[1024];
 } rdbstate;
 
+/* The statistics updated by the thread, for the code in rdb.c. */
+static __thread rdbCheckStats *rdb_check_thread_stats = NULL;
+
 /* At every loading step try to remember what we were about to do, so that
  * we can log this information when an error is encountered. */
 #define RDB_CHECK_DOING_START 0
@@ -85,14 +113,141 @@ char *rdb_type_string[] = {
     "set-intset",
     "zset-ziplist",
     "hash-ziplist",
-    "quicklist"
+    "quicklist",
+    "stream",
+    "hash-listpack",
+    "zset-listpack",
+    "quicklist-listpack",
+    "set-roaring",
+    "hash-ttl"
 };
 
 /* Show a few stats collected into 'rdbstate' */
 void rdbShowGenericInfo() {
-    printf("[info] %lu keys read\n", rdbstate.keys);
-    printf("[info] %lu expires\n", rdbstate.expires);
-    printf("[info] %lu already expired\n", rdbstate.already_expired);
+    printf("[info] %lu keys read\n", rdbstate.stats.keys);
+    printf("[info] %lu expires\n", rdbstate.stats.expires);
+    printf("[info] %lu already expired\n", rdbstate.stats.already_expired);
+}
+
+/* Name of the data type stored with the RDB type 'type'. */
+static const char *rdbCheckDataType(int type) {
+    switch(type) {
+    case RDB_TYPE_STRING: return "string";
+    case RDB_TYPE_LIST: case RDB_TYPE_LIST_ZIPLIST:
+    case RDB_TYPE_LIST_QUICKLIST: case RDB_TYPE_LIST_QUICKLIST_2:
+        return "list";
+    case RDB_TYPE_SET: case RDB_TYPE_SET_INTSET: case RDB_TYPE_SET_ROARING:
+        return "set";
+    case RDB_TYPE_ZSET: case RDB_TYPE_ZSET_2: case RDB_TYPE_ZSET_ZIPLIST:
+    case RDB_TYPE_ZSET_LISTPACK:
+        return "zset";
+    case RDB_TYPE_HASH: case RDB_TYPE_HASH_ZIPMAP: case RDB_TYPE_HASH_ZIPLIST:
+    case RDB_TYPE_HASH_LISTPACK: case RDB_TYPE_HASH_TTL:
+        return "hash";
+    case RDB_TYPE_STREAM_LISTPACKS: return "stream";
+    default: return "module";
+    }
+}
+
+/* Remember 'key' among the biggest ones if it is. */
+static void rdbCheckTrackBigKey(rdbCheckStats *st, const char *key,
+                                size_t keylen, int type, uint64_t bytes)
+{
+    int j = st->numbiggest;
+
+    if (j == RDB_CHECK_BIGGEST_KEYS) {
+        if (bytes <= st->biggest[j-1].bytes) return;
+        sdsfree(st->biggest[--j].key);
+    } else {
+        st->numbiggest++;
+    }
+    while (j > 0 && st->biggest[j-1].bytes < bytes) {
+        st->biggest[j] = st->biggest[j-1];
+        j--;
+    }
+    st->biggest[j].key = sdsnewlen(key,keylen);
+    st->biggest[j].type = type;
+    st->biggest[j].bytes = bytes;
+}
+
+/* Account a key of RDB type 'type' that took 'bytes' in the file. */
+static void rdbCheckCountKey(rdbCheckStats *st, robj *key, int type,
+                             long long expiretime, long long now,
+                             uint64_t bytes)
+{
+    st->keys++;
+    if (expiretime != -1) st->expires++;
+    if (server.masterhost == NULL && expiretime != -1 && expiretime < now)
+        st->already_expired++;
+    if (!rdbstate.show_stats) return;
+    st->type_keys[type] += 1;
+    st->type_bytes[type] += bytes;
+    rdbCheckTrackBigKey(st,(char*)key->ptr,sdslen((sds)key->ptr),type,bytes);
+}
+
+/* Called by rdb.c for every compressed string object loaded. */
+void rdbCheckCountCompressedString(uint64_t clen, uint64_t len) {
+    rdbCheckStats *st = rdb_check_thread_stats;
+
+    if (st == NULL) return;
+    st->compressed_strings++;
+    st->string_bytes += clen;
+    st->string_raw_bytes += len;
+}
+
+/* Add the statistics of 'src' to 'dst', consuming the keys of 'src'. */
+static void rdbCheckMergeStats(rdbCheckStats *dst, rdbCheckStats *src) {
+    dst->keys += src->keys;
+    dst->expires += src->expires;
+    dst->already_expired += src->already_expired;
+    for (int j = 0; j < RDB_CHECK_TYPES; j++) {
+        dst->type_keys[j] += src->type_keys[j];
+        dst->type_bytes[j] += src->type_bytes[j];
+    }
+    dst->chunks += src->chunks;
+    dst->compressed_chunks += src->compressed_chunks;
+    dst->chunk_bytes += src->chunk_bytes;
+    dst->chunk_raw_bytes += src->chunk_raw_bytes;
+    dst->compressed_strings += src->compressed_strings;
+    dst->string_bytes += src->string_bytes;
+    dst->string_raw_bytes += src->string_raw_bytes;
+    for (int j = 0; j < src->numbiggest; j++) {
+        rdbCheckBigKey *bk = src->biggest+j;
+        rdbCheckTrackBigKey(dst,bk->key,sdslen(bk->key),bk->type,bk->bytes);
+        sdsfree(bk->key);
+    }
+    src->numbiggest = 0;
+}
+
+/* Print the statistics requested with --stats. */
+static void rdbShowStats(rdbCheckStats *st) {
+    static const char *datatypes[] = {"string","list","set","zset","hash",
+                                      "stream","module"};
+
+    for (unsigned j = 0; j < sizeof(datatypes)/sizeof(char*); j++) {
+        unsigned long long keys = 0, bytes = 0;
+        for (int t = 0; t < RDB_CHECK_TYPES; t++) {
+            if (strcmp(rdbCheckDataType(t),datatypes[j])) continue;
+            keys += st->type_keys[t];
+            bytes += st->type_bytes[t];
+        }
+        if (keys) printf("[stats] type %s: %llu keys, %llu bytes\n",
+                         datatypes[j],keys,bytes);
+    }
+    for (int t = 0; t < RDB_CHECK_TYPES; t++) {
+        if (st->type_keys[t] == 0) continue;
+        printf("[stats] encoding %s: %llu keys, %llu bytes\n",
+            rdb_type_string[t],st->type_keys[t],st->type_bytes[t]);
+    }
+    printf("[stats] %llu chunks, %llu compressed: %llu bytes for %llu raw\n",
+        st->chunks,st->compressed_chunks,st->chunk_bytes,st->chunk_raw_bytes);
+    printf("[stats] %llu compressed strings: %llu bytes for %llu raw\n",
+        st->compressed_strings,st->string_bytes,st->string_raw_bytes);
+    for (int j = 0; j < st->numbiggest; j++) {
+        printf("[stats] biggest key #%d: '%s' (%s, %llu bytes)\n",
+            j+1,st->biggest[j].key,rdb_type_string[st->biggest[j].type],
+            (unsigned long long)st->biggest[j].bytes);
+    }
 }
 
 /* Called on RDB errors. Provides details about the RDB and the offset
@@ -172,6 +327,229 @@ void rdbCheckSetupSignals() {
     sigaction(SIGILL, &act, NULL);
 }
 
+/* Check the 'count' keys of an RDB_OPCODE_CHUNK. Returns 1 if they are
+ * sane and fill exactly the chunk, otherwise 0. Only if 'verbose' is true
+ * the state is tracked in rdbstate and the errors are reported, since the
+ * parallel check calls this from several threads. */
+static int rdbCheckChunk(sds raw, uint64_t count, long long now,
+                         rdbCheckStats *st, int verbose)
+{
+    rioBufferIO chunk(raw);
+
+#define CHUNK_DOING(d) do { if (verbose) rdbstate.doing = (d); } while(0)
+    while (count--) {
+        long long expiretime = -1;
+        size_t start = chunk.m_processed_bytes;
+        int type;
+        robj *key, *val;
+
+        CHUNK_DOING(RDB_CHECK_DOING_READ_TYPE);
+        if ((type = rdbLoadType(&chunk)) == -1) goto eoferr;
+        if (type == RDB_OPCODE_EXPIRETIME_MS) {
+            CHUNK_DOING(RDB_CHECK_DOING_READ_EXPIRE);
+            if ((expiretime = rdbLoadMillisecondTime(&chunk)) == -1)
+                goto eoferr;
+            CHUNK_DOING(RDB_CHECK_DOING_READ_TYPE);
+            if ((type = rdbLoadType(&chunk)) == -1) goto eoferr;
+        }
+        if (!rdbIsObjectType(type)) {
+            if (verbose) rdbCheckError("Invalid object type in chunk: %d", type);
+            return 0;
+        }
+        if (verbose) rdbstate.key_type = type;
+        CHUNK_DOING(RDB_CHECK_DOING_READ_KEY);
+        if ((key = rdbLoadStringObject(&chunk)) == NULL) goto eoferr;
+        if (verbose) rdbstate.key = key;
+        CHUNK_DOING(RDB_CHECK_DOING_READ_OBJECT_VALUE);
+        if ((val = rdbLoadObject(type,&chunk)) == NULL) {
+            decrRefCount(key);
+            goto eoferr;
+        }
+        rdbCheckCountKey(st,key,type,expiretime,now,
+                         chunk.m_processed_bytes-start);
+        if (verbose) {
+            rdbstate.key = NULL;
+            rdbstate.key_type = -1;
+        }
+        decrRefCount(key);
+        decrRefCount(val);
+    }
+#undef CHUNK_DOING
+    if ((size_t)chunk.rioTell() != sdslen(raw)) {
+        if (verbose) rdbCheckError("Chunk length does not match its keys");
+        return 0;
+    }
+    return 1;
+
+eoferr:
+    if (verbose) {
+        rdbstate.key = NULL;
+        rdbCheckError("Unexpected end of chunk");
+    }
+    return 0;
+}
+
+/* With --threads the chunks are decompressed and checked by a pool of
+ * threads while the file is read, and checksummed, by the main thread. */
+#define RDB_CHECK_MAX_THREADS 64
+
+struct rdbCheckJob {
+    sds raw;                    /* On disk chunk, then the plain one. */
+    int codec;                  /* Compression codec, 0 if plain. */
+    uint64_t rawlen;            /* Length once decompressed. */
+    uint64_t count;             /* Keys in the chunk. */
+    unsigned long long offset;  /* File offset of the chunk. */
+    int failed;                 /* 1 bad keys, 2 bad compressed data. */
+    rdbCheckStats stats;
+};
+
+struct rdbCheckPool {
+    pthread_t threads[RDB_CHECK_MAX_THREADS];
+    int numthreads;
+    pthread_mutex_t mutex;
+    pthread_cond_t todo_cond;
+    pthread_cond_t done_cond;
+    list *todo;
+    list *failed;               /* Jobs that failed, kept to report them. */
+    int inflight;               /* Jobs queued or being checked. */
+    int exiting;
+    long long now;
+    rdbCheckStats stats;        /* Merged stats of the good chunks. */
+};
+
+static int rdbCheckPoolRelease(rdbCheckPool *pool);
+
+static void *rdbCheckThreadMain(void *arg) {
+    rdbCheckPool *pool = (rdbCheckPool*)arg;
+
+    pthread_mutex_lock(&pool->mutex);
+    while(1) {
+        if (pool->todo->listLength() == 0) {
+            if (pool->exiting) break;
+            pthread_cond_wait(&pool->todo_cond,&pool->mutex);
+            continue;
+        }
+        listNode *ln = pool->todo->listFirst();
+        rdbCheckJob *job = (rdbCheckJob*)ln->listNodeValue();
+        pool->todo->listDelNode(ln);
+        pthread_mutex_unlock(&pool->mutex);
+
+        rdb_check_thread_stats = &job->stats;
+        if (job->codec) {
+            sds plain = sdsnewlen(NULL,job->rawlen);
+            if (rdbDecompress(job->codec,job->raw,sdslen(job->raw),plain,
+                              job->rawlen))
+            {
+                sdsfree(job->raw);
+                job->raw = plain;
+            } else {
+                sdsfree(plain);
+                job->failed = 2;
+            }
+        }
+        if (!job->failed &&
+            !rdbCheckChunk(job->raw,job->count,pool->now,&job->stats,0))
+            job->failed = 1;
+
+        pthread_mutex_lock(&pool->mutex);
+        if (job->failed) {
+            pool->failed->listAddNodeTail(job);
+        } else {
+            rdbCheckMergeStats(&pool->stats,&job->stats);
+            sdsfree(job->raw);
+            zfree(job);
+        }
+        pool->inflight--;
+        pthread_cond_signal(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+static rdbCheckPool *rdbCheckPoolCreate(int numthreads, long long now) {
+    rdbCheckPool *pool = (rdbCheckPool*)zcalloc(sizeof(*pool));
+
+    pthread_mutex_init(&pool->mutex,NULL);
+    pthread_cond_init(&pool->todo_cond,NULL);
+    pthread_cond_init(&pool->done_cond,NULL);
+    pool->todo = listCreate();
+    pool->failed = listCreate();
+    pool->now = now;
+    while (pool->numthreads < numthreads) {
+        if (pthread_create(&pool->threads[pool->numthreads],NULL,
+                           rdbCheckThreadMain,pool) != 0) break;
+        pool->numthreads++;
+    }
+    if (pool->numthreads == 0) {
+        rdbCheckInfo("Can't create the check threads, checking serially");
+        rdbCheckPoolRelease(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+/* Queue a chunk, waiting if too many are already in memory. */
+static void rdbCheckPoolSubmit(rdbCheckPool *pool, rdbCheckJob *job) {
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->inflight >= pool->numthreads*4)
+        pthread_cond_wait(&pool->done_cond,&pool->mutex);
+    pool->todo->listAddNodeTail(job);
+    pool->inflight++;
+    pthread_cond_signal(&pool->todo_cond);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Wait for all the chunks and stop the threads. Returns 1 if all the chunks
+ * are sane, otherwise the first bad one is checked again by this thread to
+ * report the error in detail, and 0 is returned. */
+static int rdbCheckPoolRelease(rdbCheckPool *pool) {
+    rdbCheckJob *bad = NULL;
+    listNode *ln;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->inflight) pthread_cond_wait(&pool->done_cond,&pool->mutex);
+    pool->exiting = 1;
+    pthread_cond_broadcast(&pool->todo_cond);
+    pthread_mutex_unlock(&pool->mutex);
+    for (int j = 0; j < pool->numthreads; j++)
+        pthread_join(pool->threads[j],NULL);
+    rdbCheckMergeStats(&rdbstate.stats,&pool->stats);
+
+    listIter li(pool->failed);
+    while((ln = li.listNext())) {
+        rdbCheckJob *job = (rdbCheckJob*)ln->listNodeValue();
+        if (bad == NULL || job->offset < bad->offset) bad = job;
+    }
+    if (bad) {
+        rdbCheckStats st;
+
+        rdbCheckInfo("Checking again the bad chunk at offset %llu",
+                     bad->offset);
+        memset(&st,0,sizeof(st));
+        if (bad->failed == 2)
+            rdbCheckError("Invalid %s compressed chunk",
+                          rdbCompressionName(bad->codec));
+        else
+            rdbCheckChunk(bad->raw,bad->count,pool->now,&st,1);
+        rdbCheckMergeStats(&rdbstate.stats,&st);
+    }
+    listIter li2(pool->failed);
+    while((ln = li2.listNext())) {
+        rdbCheckJob *job = (rdbCheckJob*)ln->listNodeValue();
+        rdbCheckStats *st = &job->stats;
+        for (int j = 0; j < st->numbiggest; j++) sdsfree(st->biggest[j].key);
+        sdsfree(job->raw);
+        zfree(job);
+    }
+    listRelease(pool->todo);
+    listRelease(pool->failed);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->todo_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    zfree(pool);
+    return bad == NULL;
+}
+
 /* Check the specified RDB file. Return 0 if the RDB looks sane, otherwise
  * 1 is returned.
  * The file is specified as a filename in 'rdbfilename' if 'fp' is not NULL,
@@ -183,6 +561,7 @@ int redis_check_rdb(char *rdbfilename, FILE *fp)
     char buf[1024];
     long long expiretime, now = mstime();
     static rioFileIO rdb; /* Pointed by global struct riostate. */
+    rdbCheckPool *pool = NULL;
 
     int closefile = (fp == NULL);
     if (fp == NULL && (fp = fopen(rdbfilename,"r")) == NULL) return 1;
@@ -204,8 +583,11 @@ int redis_check_rdb(char *rdbfilename, FILE *fp)
     }
 
     startLoading(fp);
+    rdb_check_thread_stats = &rdbstate.stats;
+    if (rdbstate.threads > 1) pool = rdbCheckPoolCreate(rdbstate.threads,now);
     while(1) {
         robj *key, *val;
+        size_t keystart;
         expiretime = -1;
 
         /* Read type. */
@@ -253,6 +635,61 @@ int redis_check_rdb(char *rdbfilename, FILE *fp)
             if ((expires_size = rdbLoadLen(&rdb,NULL)) == RDB_LENERR)
                 goto eoferr;
             continue; /* Read type again. */
+        } else if (type == RDB_OPCODE_CHUNK ||
+                   type == RDB_OPCODE_CHUNK_COMPRESSED) {
+            /* CHUNK: keys saved by the rdb-save-threads, checked in turn. */
+            uint64_t chunkdb, count, len, rawlen = 0;
+            int codec = 0;
+            rdbstate.doing = RDB_CHECK_DOING_READ_LEN;
+            if ((chunkdb = rdbLoadLen(&rdb,NULL)) == RDB_LENERR ||
+                (count = rdbLoadLen(&rdb,NULL)) == RDB_LENERR) goto eoferr;
+            if (type == RDB_OPCODE_CHUNK_COMPRESSED) {
+                if ((codec = rdbLoadType(&rdb)) == -1 ||
+                    (rawlen = rdbLoadLen(&rdb,NULL)) == RDB_LENERR)
+                    goto eoferr;
+                if (!rdbCompressionAvailable(codec)) {
+                    rdbCheckError("Chunk compressed with %s, that this "
+                                  "build does not support",
+                                  rdbCompressionName(codec));
+                    goto err;
+                }
+            }
+            if ((len = rdbLoadLen(&rdb,NULL)) == RDB_LENERR) goto eoferr;
+            sds raw = sdsnewlen(NULL,len);
+            if (len && rdb.rioRead(raw,len) == 0) {
+                sdsfree(raw);
+                goto eoferr;
+            }
+            rdbstate.stats.chunks++;
+            rdbstate.stats.chunk_bytes += len;
+            rdbstate.stats.chunk_raw_bytes += codec ? rawlen : len;
+            if (codec) rdbstate.stats.compressed_chunks++;
+            if (pool) {
+                rdbCheckJob *job = (rdbCheckJob*)zcalloc(sizeof(*job));
+                job->raw = raw;
+                job->codec = codec;
+                job->rawlen = rawlen;
+                job->count = count;
+                job->offset = rdb.m_processed_bytes-len;
+                rdbCheckPoolSubmit(pool,job);
+                continue; /* Read type again. */
+            }
+            if (codec) {
+                sds plain = sdsnewlen(NULL,rawlen);
+                if (!rdbDecompress(codec,raw,len,plain,rawlen)) {
+                    rdbCheckError("Invalid %s compressed chunk",
+                                  rdbCompressionName(codec));
+                    sdsfree(plain);
+                    sdsfree(raw);
+                    goto err;
+                }
+                sdsfree(raw);
+                raw = plain;
+            }
+            int valid = rdbCheckChunk(raw,count,now,&rdbstate.stats,1);
+            sdsfree(raw);
+            if (!valid) goto err;
+            continue; /* Read type again. */
         } else if (type == RDB_OPCODE_AUX) {
             /* AUX: generic string-string fields. Use to add state to RDB
              * which is backward compatible. Implementations of RDB loading
@@ -279,25 +716,31 @@ int redis_check_rdb(char *rdbfilename, FILE *fp)
 
         /* Read key */
         rdbstate.doing = RDB_CHECK_DOING_READ_KEY;
+        keystart = rdb.m_processed_bytes;
         if ((key = rdbLoadStringObject(&rdb)) == NULL) goto eoferr;
         rdbstate.key = key;
-        rdbstate.keys++;
         /* Read value */
         rdbstate.doing = RDB_CHECK_DOING_READ_OBJECT_VALUE;
         if ((val = rdbLoadObject(type,&rdb)) == NULL) goto eoferr;
-        /* Check if the key already expired. This function is used when loading
+        /* Count the keys already expired. This function is used when loading
          * an RDB file from disk, either at startup, or when an RDB was
          * received from the master. In the latter case, the master is
          * responsible for key expiry. If we would expire keys here, the
          * snapshot taken by the master may not be reflected on the slave. */
-        if (server.masterhost == NULL && expiretime != -1 && expiretime < now)
-            rdbstate.already_expired++;
-        if (expiretime != -1) rdbstate.expires++;
+        rdbCheckCountKey(&rdbstate.stats,key,type,expiretime,now,
+                         rdb.m_processed_bytes-keystart);
         rdbstate.key = NULL;
         decrRefCount(key);
         decrRefCount(val);
         rdbstate.key_type = -1;
     }
+    /* The chunks checked by the threads come before the checksum. */
+    if (pool) {
+        int valid = rdbCheckPoolRelease(pool);
+        pool = NULL;
+        if (!valid) goto err;
+    }
+
     /* Verify the checksum if RDB version is >= 5 */
     if (rdbver >= 5 && server.rdb_checksum) {
         uint64_t cksum, expected = rdb.m_checksum;
@@ -326,6 +769,7 @@ eoferr: /* unexpected end of file is handled here with a fatal exit */
         rdbCheckError("Unexpected EOF reading RDB file");
     }
 err:
+    if (pool) rdbCheckPoolRelease(pool);
     if (closefile)
         fclose(fp);
     return 1;
@@ -344,9 +788,32 @@ err:
  * Otherwise if called with a non NULL fp, the function returns C_OK or
  * C_ERR depending on the success or failure. */
 int redis_check_rdb_main(int argc, char **argv, FILE *fp) {
-    if (argc != 2 && fp == NULL) {
-        fprintf(stderr, "Usage: %s <rdb-file-name>\n", argv[0]);
-        exit(1);
+    char *filename = argv[1];
+
+    /* Options are only accepted as a standalone executable: with 'fp' the
+     * arguments are the ones of redis-check-aof. */
+    rdbstate.show_stats = 0;
+    rdbstate.threads = 1;
+    if (fp == NULL) {
+        int j;
+
+        for (j = 1; j < argc-1; j++) {
+            if (!strcmp(argv[j],"--stats")) {
+                rdbstate.show_stats = 1;
+            } else if (!strcmp(argv[j],"--threads") && j+1 < argc-1) {
+                rdbstate.threads = atoi(argv[++j]);
+                if (rdbstate.threads < 1 ||
+                    rdbstate.threads > RDB_CHECK_MAX_THREADS) break;
+            } else {
+                break;
+            }
+        }
+        if (argc < 2 || j != argc-1) {
+            fprintf(stderr, "Usage: %s [--stats] [--threads <n>] "
+                            "<rdb-file-name>\n", argv[0]);
+            exit(1);
+        }
+        filename = argv[argc-1];
     }
     /* In order to call the loading functions we need to create the shared
      * integer objects, however since this function may be called from
@@ -355,12 +822,13 @@ int redis_check_rdb_main(int argc, char **argv, FILE *fp) {
         createSharedObjects();
     server.loading_process_events_interval_bytes = 0;
     rdbCheckMode = 1;
-    rdbCheckInfo("Checking RDB file %s", argv[1]);
+    rdbCheckInfo("Checking RDB file %s", filename);
     rdbCheckSetupSignals();
-    int retval = redis_check_rdb(argv[1], fp);
+    int retval = redis_check_rdb(filename, fp);
     if (retval == 0) {
         rdbCheckInfo("\\o/ RDB looks OK! \\o/");
         rdbShowGenericInfo();
+        if (rdbstate.show_stats) rdbShowStats(&rdbstate.stats);
     }
     if (fp)
         return (retval == 0) ? C_OK : C_ERR;
@@ -45,6 +45,8 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <math.h>
+#include <pthread.h>
+#include <poll.h>
 
 #include <hiredis.h>
 #include <sds.h> /* use sds.h from hiredis, so that only one set of sds functions will be present in the binary */
@@ -61,6 +63,7 @@
 #define OUTPUT_CSV 2
 #define REDIS_CLI_KEEPALIVE_INTERVAL 15 /* seconds */
 #define REDIS_CLI_DEFAULT_PIPE_TIMEOUT 30 /* seconds */
+#define REDIS_CLI_DEFAULT_SCAN_COUNT 100
 #define REDIS_CLI_HISTFILE_ENV "REDISCLI_HISTFILE"
 #define REDIS_CLI_HISTFILE_DEFAULT ".rediscli_history"
 #define REDIS_CLI_RCFILE_ENV "REDISCLI_RCFILE"
@@ -99,6 +102,7 @@ static struct config {
     int slave_mode;
     int pipe_mode;
     int pipe_timeout;
+    int pipe_jobs;
     int getrdb_mode;
     int stat_mode;
     int scan_mode;
@@ -107,6 +111,9 @@ static struct config {
     char *pattern;
     char *rdb_filename;
     int bigkeys;
+    int memkeys;
+    int scan_jobs;
+    int scan_count;
     int hotkeys;
     int stdinarg; /* get last arg from stdin. (-x option) */
     char *auth;
@@ -131,6 +138,7 @@ static void usage();
 static void slaveMode();
 char *redisGitSHA1();
 char *redisGitDirty();
+uint16_t crc16(const char *buf, int len);
 static int cliConnect(int force);
 
 /*------------------------------------------------------------------------------
@@ -567,11 +575,11 @@ static void freeHintsCallback(void *ptr) {
  *--------------------------------------------------------------------------- */
 
 /* Send AUTH command to the server */
-static int cliAuth() {
+static int cliAuth(redisContext *c) {
     redisReply *reply;
     if (config.auth == NULL) return REDIS_OK;
 
-    reply = (redisReply *)redisCommand(context,"AUTH %s",config.auth);
+    reply = (redisReply *)redisCommand(c,"AUTH %s",config.auth);
     if (reply != NULL) {
         freeReplyObject(reply);
         return REDIS_OK;
@@ -580,11 +588,11 @@ static int cliAuth() {
 }
 
 /* Send SELECT dbnum to the server */
-static int cliSelect() {
+static int cliSelect(redisContext *c) {
     redisReply *reply;
     if (config.dbnum == 0) return REDIS_OK;
 
-    reply = (redisReply *)redisCommand(context,"SELECT %d",config.dbnum);
+    reply = (redisReply *)redisCommand(c,"SELECT %d",config.dbnum);
     if (reply != NULL) {
         int result = REDIS_OK;
         if (reply->type == REDIS_REPLY_ERROR) result = REDIS_ERR;
@@ -626,9 +634,9 @@ static int cliConnect(int force) {
         anetKeepAlive(NULL, context->fd, REDIS_CLI_KEEPALIVE_INTERVAL);
 
         /* Do AUTH and select the right DB. */
-        if (cliAuth() != REDIS_OK)
+        if (cliAuth(context) != REDIS_OK)
             return REDIS_ERR;
-        if (cliSelect() != REDIS_OK)
+        if (cliSelect(context) != REDIS_OK)
             return REDIS_ERR;
     }
     return REDIS_OK;
@@ -1012,7 +1020,7 @@ static int cliSendCommand(int argc, char **argv, int repeat) {
                 config.dbnum = atoi(argv[1]);
                 cliRefreshPrompt();
             } else if (!strcasecmp(command,"auth") && argc == 2) {
-                cliSelect();
+                cliSelect(context);
             }
         }
         if (config.interval) usleep(config.interval);
@@ -1128,8 +1136,17 @@ static int parseOptions(int argc, char **argv) {
             config.pipe_mode = 1;
         } else if (!strcmp(argv[i],"--pipe-timeout") && !lastarg) {
             config.pipe_timeout = atoi(argv[++i]);
+        } else if (!strcmp(argv[i],"--pipe-jobs") && !lastarg) {
+            config.pipe_jobs = atoi(argv[++i]);
         } else if (!strcmp(argv[i],"--bigkeys")) {
             config.bigkeys = 1;
+        } else if (!strcmp(argv[i],"--memkeys")) {
+            config.bigkeys = 1;
+            config.memkeys = 1;
+        } else if (!strcmp(argv[i],"--scan-jobs") && !lastarg) {
+            config.scan_jobs = atoi(argv[++i]);
+        } else if (!strcmp(argv[i],"--scan-count") && !lastarg) {
+            config.scan_count = atoi(argv[++i]);
         } else if (!strcmp(argv[i],"--hotkeys")) {
             config.hotkeys = 1;
         } else if (!strcmp(argv[i],"--eval") && !lastarg) {
@@ -1231,8 +1248,20 @@ static void usage() {
 "  --pipe-timeout <n> In --pipe mode, abort with error if after sending all data.\n"
 "                     no reply is received within <n> seconds.\n"
 "                     Default timeout: %d. Use 0 to wait forever.\n"
+"  --pipe-jobs <n>    In --pipe mode, send the commands over <n> connections,\n"
+"                     routing them by the hash slot of their key. With -c the\n"
+"                     commands go to the masters serving the slots, <n>\n"
+"                     connections each. Default: 1.\n"
 "  --bigkeys          Sample Redis keys looking for big keys.\n"
+"  --memkeys          Sample Redis keys looking for keys using a lot of memory.\n"
+"  --scan-jobs <n>    With --bigkeys and --memkeys, scan big keyspaces with <n>\n"
+"                     connections in parallel, each scanning parts of the\n"
+"                     keyspace. Default: 1.\n"
+"  --scan-count <n>   With --bigkeys and --memkeys, the COUNT of the SCAN\n"
+"                     commands, that is the keys pipelined in a batch.\n"
+"                     Default: %d.\n"
 "  --hotkeys          Sample Redis keys looking for hot keys.\n"
+"                     Uses HOTKEYS if the server tracks them, otherwise\n"
 "                     only works when maxmemory-policy is *lfu.\n"
 "  --scan             List all keys using the SCAN command.\n"
 "  --pattern <pat>    Useful with --scan to specify a SCAN pattern.\n"
@@ -1260,7 +1289,7 @@ static void usage() {
 "Type \"help\" in interactive mode for information on available commands\n"
 "and settings.\n"
 "\n",
-        version, REDIS_CLI_DEFAULT_PIPE_TIMEOUT);
+        version, REDIS_CLI_DEFAULT_PIPE_TIMEOUT, REDIS_CLI_DEFAULT_SCAN_COUNT);
     sdsfree(version);
     exit(1);
 }
@@ -1908,157 +1937,430 @@ static void getRDB() {
  * Bulk import (pipe) mode
  *--------------------------------------------------------------------------- */
 
+/* The protocol read from stdin is split in commands and sent over
+ * config.pipe_jobs connections, or as many connections to every master with
+ * -c. The commands are routed by the hash slot of their first argument after
+ * the command name, so that the commands about the same key are executed in
+ * order. The commands without arguments, and the inline commands, go to the
+ * first connection. The completion is detected sending an ECHO with a random
+ * payload on every connection once stdin is consumed. */
 #define PIPEMODE_WRITE_LOOP_MAX_BYTES (128*1024)
-static void pipeMode() {
-    int fd = context->fd;
-    long long errors = 0, replies = 0, obuf_len = 0, obuf_pos = 0;
-    char ibuf[1024*16], obuf[1024*16]; /* Input and output buffers */
+#define PIPEMODE_READ_BYTES (1024*1024)     /* Read from stdin at once. */
+#define PIPEMODE_OBUF_MAX (64*1024*1024)    /* Stop reading stdin above. */
+#define PIPEMODE_CHECKPOINTS 64             /* Latency samples in flight. */
+#define PIPEMODE_CLUSTER_SLOTS 16384
+
+typedef struct pipeConn {
+    redisContext *context;
+    int fd;
+    redisReader *reader;
+    sds obuf;                   /* Protocol to send. */
+    size_t obuf_pos;            /* Bytes of obuf already sent. */
+    long long queued;           /* Commands queued. */
+    long long replies;          /* Replies received, but the final ECHO. */
+    int done;                   /* The final ECHO reply was received. */
+    /* Latency checkpoints: the time the first 'seq' commands were sent. */
+    long long ck_seq[PIPEMODE_CHECKPOINTS];
+    long long ck_time[PIPEMODE_CHECKPOINTS];
+    int ck_first, ck_count;
+} pipeConn;
+
+static struct pipeState {
+    pipeConn *conns;
+    int numconns;
+    int jobs;                   /* Connections per node. */
+    int slot_node[PIPEMODE_CLUSTER_SLOTS]; /* Node serving the slot, -1. */
+    long long pending;          /* Bytes queued and not sent. */
+    long long errors;
+    char magic[20];             /* Payload of the final ECHO. */
+    /* Stats since the last progress line. */
+    long long latency_sum, latency_max, latency_samples;
+} pipestate;
+
+static unsigned int pipeKeyHashSlot(const char *key, int keylen) {
+    int s, e; /* start-end indexes of { and } */
+
+    for (s = 0; s < keylen; s++)
+        if (key[s] == '{') break;
+
+    /* No '{' ? Hash the whole key. This is the base case. */
+    if (s == keylen) return crc16(key,keylen) & (PIPEMODE_CLUSTER_SLOTS-1);
+
+    /* '{' found? Check if we have the corresponding '}'. */
+    for (e = s+1; e < keylen; e++)
+        if (key[e] == '}') break;
+
+    /* No '}' or nothing betweeen {} ? Hash the whole key. */
+    if (e == keylen || e == s+1)
+        return crc16(key,keylen) & (PIPEMODE_CLUSTER_SLOTS-1);
+
+    /* If we are here there is both a { and a } on its right. Hash
+     * what is in the middle between { and }. */
+    return crc16(key+s+1,e-s-1) & (PIPEMODE_CLUSTER_SLOTS-1);
+}
+
+/* Open 'pipestate.jobs' connections to the node, in non blocking mode. */
+static void pipeConnectNode(const char *ip, int port) {
     char aneterr[ANET_ERR_LEN];
-    redisReader *reader = redisReaderCreate();
+
+    pipestate.conns = (pipeConn*)zrealloc(pipestate.conns,
+        sizeof(pipeConn)*(pipestate.numconns+pipestate.jobs));
+    for (int j = 0; j < pipestate.jobs; j++) {
+        pipeConn *c = pipestate.conns+pipestate.numconns++;
+        memset(c,0,sizeof(*c));
+
+        if (ip == NULL && config.hostsocket != NULL)
+            c->context = redisConnectUnix(config.hostsocket);
+        else
+            c->context = redisConnect(ip ? ip : config.hostip,
+                                      ip ? port : config.hostport);
+        if (c->context == NULL || c->context->err ||
+            cliAuth(c->context) != REDIS_OK ||
+            (!config.cluster_mode && cliSelect(c->context) != REDIS_OK))
+        {
+            fprintf(stderr, "Could not connect to Redis at %s:%d: %s\n",
+                ip ? ip : config.hostip, ip ? port : config.hostport,
+                c->context ? c->context->errstr : "out of memory");
+            exit(1);
+        }
+        c->fd = c->context->fd;
+        if (anetNonBlock(aneterr,c->fd) == ANET_ERR) {
+            fprintf(stderr, "Can't set the socket in non blocking mode: %s\n",
+                aneterr);
+            exit(1);
+        }
+        c->reader = redisReaderCreate();
+        c->obuf = sdsempty();
+    }
+}
+
+/* Connect to the masters serving the slots in CLUSTER SLOTS. */
+static void pipeConnectCluster() {
+    redisReply *reply = (redisReply *)redisCommand(context,"CLUSTER SLOTS");
+    sds *nodes = NULL;
+    int numnodes = 0;
+
+    if (reply == NULL || reply->type != REDIS_REPLY_ARRAY) {
+        fprintf(stderr, "Can't get the cluster slots: %s\n",
+            reply && reply->type == REDIS_REPLY_ERROR ? reply->str :
+            "I/O error");
+        exit(1);
+    }
+    for (size_t i = 0; i < reply->elements; i++) {
+        redisReply *r = reply->element[i];
+        if (r->type != REDIS_REPLY_ARRAY || r->elements < 3) continue;
+        redisReply *master = r->element[2];
+        sds name = sdscatprintf(sdsempty(),"%s:%lld",
+            master->element[0]->str, master->element[1]->integer);
+        int node;
+
+        for (node = 0; node < numnodes; node++)
+            if (!strcmp(nodes[node],name)) break;
+        if (node == numnodes) {
+            nodes = (sds*)zrealloc(nodes,sizeof(sds)*(numnodes+1));
+            nodes[numnodes++] = sdsdup(name);
+            pipeConnectNode(master->element[0]->str,
+                (int)master->element[1]->integer);
+        }
+        sdsfree(name);
+        for (long long slot = r->element[0]->integer;
+             slot <= r->element[1]->integer; slot++)
+            pipestate.slot_node[slot] = node;
+    }
+    printf("Sending to %d masters with %d connections each.\n", numnodes,
+        pipestate.jobs);
+    for (int node = 0; node < numnodes; node++) sdsfree(nodes[node]);
+    zfree(nodes);
+    freeReplyObject(reply);
+}
+
+/* Return the length of the command at 'p' if it is complete, otherwise 0.
+ * Sets '*key' to its first argument after the command name, NULL if none.
+ * The inline commands, and anything else not starting with '*', are taken
+ * a line at a time. */
+static size_t pipeParseCommand(const char *p, size_t len, const char **key,
+                               size_t *keylen)
+{
+    const char *end = p+len, *q, *nl;
+    long long argc;
+
+    *key = NULL;
+    if ((nl = (const char*)memchr(p,'\n',len)) == NULL) return 0;
+    if (p[0] != '*') return nl-p+1;
+    argc = strtoll(p+1,NULL,10);
+    q = nl+1;
+    for (long long j = 0; j < argc; j++) {
+        long long blen;
+
+        if (q == end) return 0;
+        if (*q != '$') {
+            fprintf(stderr, "Invalid protocol in the input: "
+                "expected '$', got '%c'\n", *q);
+            exit(1);
+        }
+        if ((nl = (const char*)memchr(q,'\n',end-q)) == NULL) return 0;
+        blen = strtoll(q+1,NULL,10);
+        q = nl+1;
+        if (end-q < blen+2) return 0;
+        if (j == 1) {
+            *key = q;
+            *keylen = blen;
+        }
+        q += blen+2;
+    }
+    return q-p;
+}
+
+static pipeConn *pipeRoute(const char *key, size_t keylen) {
+    int slot, node;
+
+    if (key == NULL || pipestate.numconns == 1) return pipestate.conns;
+    slot = pipeKeyHashSlot(key,keylen);
+    node = config.cluster_mode ? pipestate.slot_node[slot] : 0;
+    if (node == -1) return pipestate.conns; /* The server replies -MOVED. */
+    return pipestate.conns+node*pipestate.jobs+slot%pipestate.jobs;
+}
+
+static void pipeQueue(pipeConn *c, const char *buf, size_t len) {
+    c->obuf = sdscatlen(c->obuf,buf,len);
+    pipestate.pending += len;
+}
+
+/* Read from stdin, queueing the complete commands. Returns 1 at EOF. */
+static int pipeReadInput(sds *ibuf) {
+    size_t len = sdslen(*ibuf), pos = 0, cmdlen, keylen = 0;
+    const char *key;
+    ssize_t nread;
+
+    *ibuf = sdsMakeRoomFor(*ibuf,PIPEMODE_READ_BYTES);
+    nread = read(STDIN_FILENO,*ibuf+len,PIPEMODE_READ_BYTES);
+    if (nread == -1) {
+        if (errno == EINTR) return 0;
+        fprintf(stderr, "Error reading from stdin: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (nread == 0) {
+        /* A truncated command is sent as it is, the server will complain.
+         * The ECHO sequence starts with a "\r\n" so that if there is garbage
+         * in the protocol we read from stdin, the ECHO will likely still be
+         * properly formatted. CRLF is ignored by Redis, so it has no
+         * effects. */
+        char echo[] =
+        "\r\n*2\r\n$4\r\nECHO\r\n$20\r\n01234567890123456789\r\n";
+
+        if (len) pipeQueue(pipestate.conns,*ibuf,len);
+        sdsclear(*ibuf);
+        for (int j = 0; j < 20; j++)
+            pipestate.magic[j] = rand() & 0xff;
+        memcpy(echo+21,pipestate.magic,20);
+        for (int j = 0; j < pipestate.numconns; j++)
+            pipeQueue(pipestate.conns+j,echo,sizeof(echo)-1);
+        printf("All data transferred. Waiting for the last reply...\n");
+        return 1;
+    }
+    sdsIncrLen(*ibuf,nread);
+    len += nread;
+
+    while ((cmdlen = pipeParseCommand(*ibuf+pos,len-pos,&key,&keylen))) {
+        pipeConn *c = pipeRoute(key,keylen);
+        pipeQueue(c,*ibuf+pos,cmdlen);
+        if ((*ibuf)[pos] == '*') c->queued++;
+        pos += cmdlen;
+    }
+    sdsrange(*ibuf,pos,-1);
+    return 0;
+}
+
+static void pipeWrite(pipeConn *c) {
+    ssize_t loop_nwritten = 0;
+
+    while (c->obuf_pos < sdslen(c->obuf) &&
+           loop_nwritten <= PIPEMODE_WRITE_LOOP_MAX_BYTES*8)
+    {
+        ssize_t nwritten = write(c->fd,c->obuf+c->obuf_pos,
+                                 sdslen(c->obuf)-c->obuf_pos);
+        if (nwritten == -1) {
+            if (errno == EAGAIN || errno == EINTR) break;
+            fprintf(stderr, "Error writing to the server: %s\n",
+                strerror(errno));
+            exit(1);
+        }
+        c->obuf_pos += nwritten;
+        pipestate.pending -= nwritten;
+        loop_nwritten += nwritten;
+    }
+    if (c->obuf_pos == sdslen(c->obuf)) {
+        sdsclear(c->obuf);
+        c->obuf_pos = 0;
+        /* All the commands queued were sent now: their replies measure the
+         * latency. */
+        int last = (c->ck_first+c->ck_count-1) % PIPEMODE_CHECKPOINTS;
+        if (c->ck_count < PIPEMODE_CHECKPOINTS &&
+            (c->ck_count == 0 || c->ck_seq[last] != c->queued))
+        {
+            int slot = (c->ck_first+c->ck_count) % PIPEMODE_CHECKPOINTS;
+            c->ck_seq[slot] = c->queued;
+            c->ck_time[slot] = ustime();
+            c->ck_count++;
+        }
+    } else if (c->obuf_pos >= PIPEMODE_READ_BYTES) {
+        sdsrange(c->obuf,c->obuf_pos,-1);
+        c->obuf_pos = 0;
+    }
+}
+
+static void pipeReadReplies(pipeConn *c, int eof) {
+    char ibuf[1024*16];
     redisReply *reply;
+    ssize_t nread;
+
+    /* Read from socket and feed the hiredis reader. */
+    do {
+        nread = read(c->fd,ibuf,sizeof(ibuf));
+        if (nread == -1 && errno != EAGAIN && errno != EINTR) {
+            fprintf(stderr, "Error reading from the server: %s\n",
+                strerror(errno));
+            exit(1);
+        }
+        if (nread == 0) {
+            fprintf(stderr, "Connection closed by the server\n");
+            exit(1);
+        }
+        if (nread > 0) redisReaderFeed(c->reader,ibuf,nread);
+    } while(nread > 0);
+
+    /* Consume replies. */
+    do {
+        if (redisReaderGetReply(c->reader,(void**)&reply) == REDIS_ERR) {
+            fprintf(stderr, "Error reading replies from server\n");
+            exit(1);
+        }
+        if (reply) {
+            if (reply->type == REDIS_REPLY_ERROR) {
+                fprintf(stderr,"%s\n", reply->str);
+                pipestate.errors++;
+            } else if (eof && reply->type == REDIS_REPLY_STRING &&
+                              reply->len == 20 &&
+                              memcmp(reply->str,pipestate.magic,20) == 0)
+            {
+                /* This is the reply to our final ECHO command: everything
+                 * was received from the server. */
+                c->done = 1;
+                c->replies--;
+            }
+            c->replies++;
+            freeReplyObject(reply);
+        }
+    } while(reply);
+
+    /* Sample the latency of the commands sent at the checkpoints. */
+    while (c->ck_count && c->replies >= c->ck_seq[c->ck_first]) {
+        long long latency = ustime()-c->ck_time[c->ck_first];
+        pipestate.latency_sum += latency;
+        pipestate.latency_samples++;
+        if (latency > pipestate.latency_max)
+            pipestate.latency_max = latency;
+        c->ck_first = (c->ck_first+1) % PIPEMODE_CHECKPOINTS;
+        c->ck_count--;
+    }
+}
+
+static void pipeMode() {
+    sds ibuf = sdsempty();
+    struct pollfd *pfds;
     int eof = 0; /* True once we consumed all the standard input. */
     int done = 0;
-    char magic[20]; /* Special reply we recognize. */
+    long long replies = 0, start = ustime(), last_progress = start;
+    long long last_replies = 0;
     time_t last_read_time = time(NULL);
 
     srand(time(NULL));
 
-    /* Use non blocking I/O. */
-    if (anetNonBlock(aneterr,fd) == ANET_ERR) {
-        fprintf(stderr, "Can't set the socket in non blocking mode: %s\n",
-            aneterr);
-        exit(1);
-    }
+    pipestate.jobs = config.pipe_jobs > 0 ? config.pipe_jobs : 1;
+    for (int j = 0; j < PIPEMODE_CLUSTER_SLOTS; j++)
+        pipestate.slot_node[j] = -1;
+    if (config.cluster_mode)
+        pipeConnectCluster();
+    else
+        pipeConnectNode(NULL,0);
+    pfds = (struct pollfd*)zmalloc(sizeof(*pfds)*pipestate.numconns);
 
     /* Transfer raw protocol and read replies from the server at the same
      * time. */
     while(!done) {
-        int mask = AE_READABLE;
+        long long now;
 
-        if (!eof || obuf_len != 0) mask |= AE_WRITABLE;
-        mask = aeWait(fd,mask,1000);
+        /* Read more input while the output buffers have room. */
+        if (!eof && pipestate.pending < PIPEMODE_OBUF_MAX)
+            eof = pipeReadInput(&ibuf);
 
-        /* Handle the readable state: we can read replies from the server. */
-        if (mask & AE_READABLE) {
-            ssize_t nread;
+        for (int j = 0; j < pipestate.numconns; j++) {
+            pipeConn *c = pipestate.conns+j;
+            pfds[j].fd = c->fd;
+            pfds[j].events = POLLIN;
+            if (c->obuf_pos < sdslen(c->obuf)) pfds[j].events |= POLLOUT;
+        }
+        if (poll(pfds,pipestate.numconns,
+                 !eof && pipestate.pending < PIPEMODE_OBUF_MAX ? 0 : 1000)
+            == -1 && errno != EINTR)
+        {
+            fprintf(stderr, "poll() failed: %s\n", strerror(errno));
+            exit(1);
+        }
 
-            /* Read from socket and feed the hiredis reader. */
-            do {
-                nread = read(fd,ibuf,sizeof(ibuf));
-                if (nread == -1 && errno != EAGAIN && errno != EINTR) {
-                    fprintf(stderr, "Error reading from the server: %s\n",
-                        strerror(errno));
-                    exit(1);
-                }
-                if (nread > 0) {
-                    redisReaderFeed(reader,ibuf,nread);
-                    last_read_time = time(NULL);
-                }
-            } while(nread > 0);
+        done = 1;
+        replies = 0;
+        for (int j = 0; j < pipestate.numconns; j++) {
+            pipeConn *c = pipestate.conns+j;
 
-            /* Consume replies. */
-            do {
-                if (redisReaderGetReply(reader,(void**)&reply) == REDIS_ERR) {
-                    fprintf(stderr, "Error reading replies from server\n");
-                    exit(1);
-                }
-                if (reply) {
-                    if (reply->type == REDIS_REPLY_ERROR) {
-                        fprintf(stderr,"%s\n", reply->str);
-                        errors++;
-                    } else if (eof && reply->type == REDIS_REPLY_STRING &&
-                                      reply->len == 20) {
-                        /* Check if this is the reply to our final ECHO
-                         * command. If so everything was received
-                         * from the server. */
-                        if (memcmp(reply->str,magic,20) == 0) {
-                            printf("Last reply received from server.\n");
-                            done = 1;
-                            replies--;
-                        }
-                    }
-                    replies++;
-                    freeReplyObject(reply);
-                }
-            } while(reply);
-        }
-
-        /* Handle the writable state: we can send protocol to the server. */
-        if (mask & AE_WRITABLE) {
-            ssize_t loop_nwritten = 0;
-
-            while(1) {
-                /* Transfer current buffer to server. */
-                if (obuf_len != 0) {
-                    ssize_t nwritten = write(fd,obuf+obuf_pos,obuf_len);
-
-                    if (nwritten == -1) {
-                        if (errno != EAGAIN && errno != EINTR) {
-                            fprintf(stderr, "Error writing to the server: %s\n",
-                                strerror(errno));
-                            exit(1);
-                        } else {
-                            nwritten = 0;
-                        }
-                    }
-                    obuf_len -= nwritten;
-                    obuf_pos += nwritten;
-                    loop_nwritten += nwritten;
-                    if (obuf_len != 0) break; /* Can't accept more data. */
-                }
-                /* If buffer is empty, load from stdin. */
-                if (obuf_len == 0 && !eof) {
-                    ssize_t nread = read(STDIN_FILENO,obuf,sizeof(obuf));
-
-                    if (nread == 0) {
-                        /* The ECHO sequence starts with a "\r\n" so that if there
-                         * is garbage in the protocol we read from stdin, the ECHO
-                         * will likely still be properly formatted.
-                         * CRLF is ignored by Redis, so it has no effects. */
-                        char echo[] =
-                        "\r\n*2\r\n$4\r\nECHO\r\n$20\r\n01234567890123456789\r\n";
-                        int j;
-
-                        eof = 1;
-                        /* Everything transferred, so we queue a special
-                         * ECHO command that we can match in the replies
-                         * to make sure everything was read from the server. */
-                        for (j = 0; j < 20; j++)
-                            magic[j] = rand() & 0xff;
-                        memcpy(echo+21,magic,20);
-                        memcpy(obuf,echo,sizeof(echo)-1);
-                        obuf_len = sizeof(echo)-1;
-                        obuf_pos = 0;
-                        printf("All data transferred. Waiting for the last reply...\n");
-                    } else if (nread == -1) {
-                        fprintf(stderr, "Error reading from stdin: %s\n",
-                            strerror(errno));
-                        exit(1);
-                    } else {
-                        obuf_len = nread;
-                        obuf_pos = 0;
-                    }
-                }
-                if ((obuf_len == 0 && eof) ||
-                    loop_nwritten > PIPEMODE_WRITE_LOOP_MAX_BYTES) break;
+            /* Handle the readable state: we can read replies from the
+             * server. */
+            if (pfds[j].revents & (POLLIN|POLLHUP|POLLERR)) {
+                pipeReadReplies(c,eof);
+                last_read_time = time(NULL);
             }
+            /* Handle the writable state: we can send protocol to the
+             * server. */
+            if (pfds[j].revents & POLLOUT) pipeWrite(c);
+            replies += c->replies;
+            if (!c->done) done = 0;
+        }
+
+        /* Progress once a second for the transfers lasting more. */
+        now = ustime();
+        if (now-last_progress >= 1000000) {
+            long long sent = 0;
+            for (int j = 0; j < pipestate.numconns; j++)
+                sent += pipestate.conns[j].queued;
+            printf("%lld commands sent, %lld replies (%.0f replies/sec), "
+                "latency avg %.2f ms, max %.2f ms\n", sent, replies,
+                (double)(replies-last_replies)*1000000/(now-last_progress),
+                pipestate.latency_samples ?
+                    (double)pipestate.latency_sum/pipestate.latency_samples/1000 : 0,
+                (double)pipestate.latency_max/1000);
+            fflush(stdout);
+            last_progress = now;
+            last_replies = replies;
+            pipestate.latency_sum = 0;
+            pipestate.latency_max = 0;
+            pipestate.latency_samples = 0;
         }
 
         /* Handle timeout, that is, we reached EOF, and we are not getting
          * replies from the server for a few seconds, nor the final ECHO is
          * received. */
-        if (eof && config.pipe_timeout > 0 &&
+        if (eof && !done && config.pipe_timeout > 0 &&
             time(NULL)-last_read_time > config.pipe_timeout)
         {
             fprintf(stderr,"No replies for %d seconds: exiting.\n",
                 config.pipe_timeout);
-            errors++;
+            pipestate.errors++;
             break;
         }
     }
-    redisReaderFree(reader);
-    printf("errors: %lld, replies: %lld\n", errors, replies);
-    if (errors)
+    if (done) printf("Last reply received from server.\n");
+    printf("errors: %lld, replies: %lld\n", pipestate.errors, replies);
+    if (pipestate.errors)
         exit(1);
     else
         exit(0);
@@ -2073,10 +2375,16 @@ static void pipeMode() {
 #define TYPE_SET    2
 #define TYPE_HASH   3
 #define TYPE_ZSET   4
-#define TYPE_NONE   5
+#define TYPE_STREAM 5
+#define TYPE_NONE   6
 
-static redisReply *sendScan(unsigned long long *it) {
-    redisReply *reply = (redisReply *)redisCommand(context, "SCAN %llu", *it);
+/* Send SCAN, with the COUNT option unless 'count' is 0. */
+static redisReply *sendScan(redisContext *c, unsigned long long *it,
+                            int count)
+{
+    redisReply *reply = count ?
+        (redisReply *)redisCommand(c, "SCAN %llu COUNT %d", *it, count) :
+        (redisReply *)redisCommand(c, "SCAN %llu", *it);
 
     /* Handle any error conditions */
     if(reply == NULL) {
@@ -2132,6 +2440,8 @@ static int toIntType(char *key, char *type) {
         return TYPE_HASH;
     } else if(!strcmp(type, "zset")) {
         return TYPE_ZSET;
+    } else if(!strcmp(type, "stream")) {
+        return TYPE_STREAM;
     } else if(!strcmp(type, "none")) {
         return TYPE_NONE;
     } else {
@@ -2140,20 +2450,20 @@ static int toIntType(char *key, char *type) {
     }
 }
 
-static void getKeyTypes(redisReply *keys, int *types) {
+static void getKeyTypes(redisContext *c, redisReply *keys, int *types) {
     redisReply *reply;
     unsigned int i;
 
     /* Pipeline TYPE commands */
     for(i=0;i<keys->elements;i++) {
-        redisAppendCommand(context, "TYPE %s", keys->element[i]->str);
+        redisAppendCommand(c, "TYPE %s", keys->element[i]->str);
     }
 
     /* Retrieve types */
     for(i=0;i<keys->elements;i++) {
-        if(redisGetReply(context, (void**)&reply)!=REDIS_OK) {
+        if(redisGetReply(c, (void**)&reply)!=REDIS_OK) {
             fprintf(stderr, "Error getting type for key '%s' (%d: %s)\n",
-                keys->element[i]->str, context->err, context->errstr);
+                keys->element[i]->str, c->err, c->errstr);
             exit(1);
         } else if(reply->type != REDIS_REPLY_STATUS) {
             if(reply->type == REDIS_REPLY_ERROR) {
@@ -2171,11 +2481,13 @@ static void getKeyTypes(redisReply *keys, int *types) {
     }
 }
 
-static void getKeySizes(redisReply *keys, int *types,
+/* Get the sizes of the keys, the number of items, or the bytes of memory
+ * used with --memkeys. */
+static void getKeySizes(redisContext *c, redisReply *keys, int *types,
                         unsigned long long *sizes)
 {
     redisReply *reply;
-    char *sizecmds[] = {"STRLEN","LLEN","SCARD","HLEN","ZCARD"};
+    const char *sizecmds[] = {"STRLEN","LLEN","SCARD","HLEN","ZCARD","XLEN"};
     unsigned int i;
 
     /* Pipeline size commands */
@@ -2184,8 +2496,11 @@ static void getKeySizes(redisReply *keys, int *types,
         if(types[i]==TYPE_NONE)
             continue;
 
-        redisAppendCommand(context, "%s %s", sizecmds[types[i]],
-            keys->element[i]->str);
+        if (config.memkeys)
+            redisAppendCommand(c, "MEMORY USAGE %s", keys->element[i]->str);
+        else
+            redisAppendCommand(c, "%s %s", sizecmds[types[i]],
+                keys->element[i]->str);
     }
 
     /* Retreive sizes */
@@ -2197,16 +2512,17 @@ static void getKeySizes(redisReply *keys, int *types,
         }
 
         /* Retreive size */
-        if(redisGetReply(context, (void**)&reply)!=REDIS_OK) {
+        if(redisGetReply(c, (void**)&reply)!=REDIS_OK) {
             fprintf(stderr, "Error getting size for key '%s' (%d: %s)\n",
-                keys->element[i]->str, context->err, context->errstr);
+                keys->element[i]->str, c->err, c->errstr);
             exit(1);
         } else if(reply->type != REDIS_REPLY_INTEGER) {
             /* Theoretically the key could have been removed and
              * added as a different type between TYPE and SIZE */
             fprintf(stderr,
                 "Warning:  %s on '%s' failed (may have changed type)\n",
-                 sizecmds[types[i]], keys->element[i]->str);
+                 config.memkeys ? "MEMORY USAGE" : sizecmds[types[i]],
+                 keys->element[i]->str);
             sizes[i] = 0;
         } else {
             sizes[i] = reply->integer;
@@ -2216,116 +2532,224 @@ static void getKeySizes(redisReply *keys, int *types,
     }
 }
 
-static void findBigKeys() {
-    unsigned long long biggest[5] = {0}, counts[5] = {0}, totalsize[5] = {0};
-    unsigned long long sampled = 0, total_keys, totlen=0, *sizes=NULL, it=0;
-    sds maxkeys[5] = {0};
-    const char *name_of_type[] = {"string","list","set","hash","zset"};
-    const char *typeunit[] = {"bytes","items","members","fields","members"};
-    redisReply *reply, *keys;
-    unsigned int arrsize=0, i;
-    int type, *types=NULL;
-    double pct;
-
-    /* Total keys pre scanning */
-    total_keys = getDbSize();
-
-    /* Status message */
-    printf("\n# Scanning the entire keyspace to find biggest keys as well as\n");
-    printf("# average sizes per key type.  You can use -i 0.1 to sleep 0.1 sec\n");
-    printf("# per 100 SCAN commands (not usually needed).\n\n");
+/* The keyspace is scanned by config.scan_jobs connections in parallel. The
+ * SCAN cursor space is split in parts, a power of two, each scanned from its
+ * own cursor: since the server increments the cursor starting from its high
+ * bits, the cursors of a part all have the same low bits, so a part starting
+ * at the bits 'p' reversed is done when the low bits of the cursor change.
+ * This holds as long as the hash table has more buckets than the parts,
+ * that is why big keyspaces only are split. */
+#define BIGKEYS_PARTS_PER_JOB 16
+#define BIGKEYS_KEYS_PER_PART 1024
+#define BIGKEYS_BUCKETS 65      /* Power of two buckets of the sizes. */
+
+static const char *name_of_type[] = {"string","list","set","hash","zset",
+                                     "stream"};
+static const char *typeunit[] = {"bytes","items","members","fields","members",
+                                 "entries"};
+
+static struct bigKeysState {
+    pthread_mutex_t mutex;
+    int parts;                  /* Parts of the cursor space. */
+    int next_part;              /* Next part to scan. */
+    unsigned long long total_keys, sampled, totlen;
+    unsigned long long biggest[TYPE_NONE], counts[TYPE_NONE];
+    unsigned long long totalsize[TYPE_NONE];
+    unsigned long long dist[TYPE_NONE][BIGKEYS_BUCKETS]; /* Sizes 0, 1, 2-3,
+                                                            4-7 and so on. */
+    sds maxkeys[TYPE_NONE];
+} bigkeys;
+
+static int sizeBucket(unsigned long long size) {
+    int b = 0;
+    while (size) {
+        size >>= 1;
+        b++;
+    }
+    return b;
+}
+
+/* Account the keys of a batch, under the mutex. */
+static void bigKeysUpdate(redisReply *keys, int *types,
+                          unsigned long long *sizes)
+{
+    unsigned int i;
+    int type;
 
-    /* New up sds strings to keep track of overall biggest per type */
-    for(i=0;i<TYPE_NONE; i++) {
-        maxkeys[i] = sdsempty();
-        if(!maxkeys[i]) {
-            fprintf(stderr, "Failed to allocate memory for largest key names!\n");
-            exit(1);
-        }
-    }
+    pthread_mutex_lock(&bigkeys.mutex);
+    for(i=0;i<keys->elements;i++) {
+        if((type = types[i]) == TYPE_NONE)
+            continue;
 
-    /* SCAN loop */
-    do {
         /* Calculate approximate percentage completion */
-        pct = 100 * (double)sampled/total_keys;
-
-        /* Grab some keys and point to the keys array */
-        reply = sendScan(&it);
-        keys  = reply->element[1];
+        double pct = 100 * (double)bigkeys.sampled/bigkeys.total_keys;
 
-        /* Reallocate our type and size array if we need to */
-        if(keys->elements > arrsize) {
-            types = (int*)zrealloc(types, sizeof(int)*keys->elements);
-            sizes = (unsigned long long*)zrealloc(sizes, sizeof(unsigned long long)*keys->elements);
+        bigkeys.totalsize[type] += sizes[i];
+        bigkeys.counts[type]++;
+        bigkeys.dist[type][sizeBucket(sizes[i])]++;
+        bigkeys.totlen += keys->element[i]->len;
+        bigkeys.sampled++;
 
-            if(!types || !sizes) {
-                fprintf(stderr, "Failed to allocate storage for keys!\n");
+        if(bigkeys.biggest[type]<sizes[i]) {
+            printf(
+               "[%05.2f%%] Biggest %-6s found so far '%s' with %llu %s\n",
+               pct, name_of_type[type], keys->element[i]->str, sizes[i],
+               config.memkeys ? "bytes" : typeunit[type]);
+
+            /* Keep track of biggest key name for this type */
+            bigkeys.maxkeys[type] = sdscpy(bigkeys.maxkeys[type],
+                keys->element[i]->str);
+            if(!bigkeys.maxkeys[type]) {
+                fprintf(stderr, "Failed to allocate memory for key!\n");
                 exit(1);
             }
 
-            arrsize = keys->elements;
+            /* Keep track of the biggest size for this type */
+            bigkeys.biggest[type] = sizes[i];
         }
 
-        /* Retreive types and then sizes */
-        getKeyTypes(keys, types);
-        getKeySizes(keys, types, sizes);
-
-        /* Now update our stats */
-        for(i=0;i<keys->elements;i++) {
-            if((type = types[i]) == TYPE_NONE)
-                continue;
+        /* Update overall progress */
+        if(bigkeys.sampled % 1000000 == 0) {
+            printf("[%05.2f%%] Sampled %llu keys so far\n", pct,
+                bigkeys.sampled);
+        }
+    }
+    pthread_mutex_unlock(&bigkeys.mutex);
+}
 
-            totalsize[type] += sizes[i];
-            counts[type]++;
-            totlen += keys->element[i]->len;
-            sampled++;
+/* Connect a scanning connection other than the main one. */
+static redisContext *bigKeysConnect() {
+    redisContext *c = config.hostsocket == NULL ?
+        redisConnect(config.hostip,config.hostport) :
+        redisConnectUnix(config.hostsocket);
 
-            if(biggest[type]<sizes[i]) {
-                printf(
-                   "[%05.2f%%] Biggest %-6s found so far '%s' with %llu %s\n",
-                   pct, name_of_type[type], keys->element[i]->str, sizes[i],
-                   typeunit[type]);
-
-                /* Keep track of biggest key name for this type */
-                maxkeys[type] = sdscpy(maxkeys[type], keys->element[i]->str);
-                if(!maxkeys[type]) {
-                    fprintf(stderr, "Failed to allocate memory for key!\n");
-                    exit(1);
-                }
+    if (c == NULL || c->err || cliAuth(c) != REDIS_OK ||
+        cliSelect(c) != REDIS_OK)
+    {
+        fprintf(stderr, "Could not open a scanning connection: %s\n",
+            c ? c->errstr : "out of memory");
+        exit(1);
+    }
+    anetKeepAlive(NULL, c->fd, REDIS_CLI_KEEPALIVE_INTERVAL);
+    return c;
+}
 
-                /* Keep track of the biggest size for this type */
-                biggest[type] = sizes[i];
-            }
+/* Scan the parts of the cursor space with the connection 'arg' until no
+ * part is left. */
+static void *bigKeysWorker(void *arg) {
+    redisContext *c = (redisContext *)arg;
+    unsigned long long mask = bigkeys.parts-1, *sizes = NULL, scans = 0;
+    unsigned int arrsize = 0;
+    int *types = NULL, bits = 0, part;
 
-            /* Update overall progress */
-            if(sampled % 1000000 == 0) {
-                printf("[%05.2f%%] Sampled %llu keys so far\n", pct, sampled);
+    while ((1 << bits) < bigkeys.parts) bits++;
+    while (1) {
+        unsigned long long start = 0, it;
+
+        pthread_mutex_lock(&bigkeys.mutex);
+        part = bigkeys.next_part < bigkeys.parts ? bigkeys.next_part++ : -1;
+        pthread_mutex_unlock(&bigkeys.mutex);
+        if (part == -1) break;
+
+        /* The first cursor of the part is its number with the bits
+         * reversed. */
+        for (int j = 0; j < bits; j++)
+            start |= (unsigned long long)((part >> j) & 1) << (bits-1-j);
+        it = start;
+        do {
+            /* Grab some keys and point to the keys array */
+            redisReply *reply = sendScan(c, &it, config.scan_count);
+            redisReply *keys = reply->element[1];
+
+            /* Reallocate our type and size array if we need to */
+            if(keys->elements > arrsize) {
+                types = (int*)zrealloc(types, sizeof(int)*keys->elements);
+                sizes = (unsigned long long*)zrealloc(sizes,
+                    sizeof(unsigned long long)*keys->elements);
+                arrsize = keys->elements;
             }
-        }
 
-        /* Sleep if we've been directed to do so */
-        if(sampled && (sampled %100) == 0 && config.interval) {
-            usleep(config.interval);
-        }
+            /* Retreive types and then sizes, pipelining the batch */
+            getKeyTypes(c, keys, types);
+            getKeySizes(c, keys, types, sizes);
+            bigKeysUpdate(keys, types, sizes);
+            freeReplyObject(reply);
 
-        freeReplyObject(reply);
-    } while(it != 0);
+            /* Sleep if we've been directed to do so */
+            if(++scans % 100 == 0 && config.interval) {
+                usleep(config.interval);
+            }
+        } while (it != 0 && (it & mask) == start);
+    }
 
     if(types) zfree(types);
     if(sizes) zfree(sizes);
+    return NULL;
+}
+
+static void findBigKeys() {
+    pthread_t *threads;
+    int jobs = config.scan_jobs > 0 ? config.scan_jobs : 1;
+    unsigned int i;
+
+    /* Total keys pre scanning */
+    bigkeys.total_keys = getDbSize();
+
+    /* Split the keyspace in parts only if it is big enough. */
+    bigkeys.parts = 1;
+    while (jobs > 1 && bigkeys.parts < jobs*BIGKEYS_PARTS_PER_JOB &&
+           (unsigned long long)bigkeys.parts*2*BIGKEYS_KEYS_PER_PART <=
+           bigkeys.total_keys)
+        bigkeys.parts *= 2;
+    pthread_mutex_init(&bigkeys.mutex,NULL);
+
+    /* Status message */
+    printf("\n# Scanning the entire keyspace to find biggest keys as well as\n");
+    printf("# average sizes per key type.  You can use -i 0.1 to sleep 0.1 sec\n");
+    printf("# per 100 SCAN commands (not usually needed).\n");
+    if (jobs > 1)
+        printf("# %d connections scanning %d parts of the keyspace.\n",
+            jobs, bigkeys.parts);
+    printf("\n");
+
+    /* New up sds strings to keep track of overall biggest per type */
+    for(i=0;i<TYPE_NONE; i++) {
+        bigkeys.maxkeys[i] = sdsempty();
+        if(!bigkeys.maxkeys[i]) {
+            fprintf(stderr, "Failed to allocate memory for largest key names!\n");
+            exit(1);
+        }
+    }
+
+    /* The main connection scans as well. */
+    if (jobs > bigkeys.parts) jobs = bigkeys.parts;
+    threads = (pthread_t*)zmalloc(sizeof(pthread_t)*jobs);
+    for (int j = 1; j < jobs; j++) {
+        if (pthread_create(&threads[j],NULL,bigKeysWorker,
+                           bigKeysConnect()) != 0)
+        {
+            fprintf(stderr, "Can't create the scanning threads\n");
+            exit(1);
+        }
+    }
+    bigKeysWorker(context);
+    for (int j = 1; j < jobs; j++) pthread_join(threads[j],NULL);
+    zfree(threads);
 
     /* We're done */
     printf("\n-------- summary -------\n\n");
 
-    printf("Sampled %llu keys in the keyspace!\n", sampled);
+    printf("Sampled %llu keys in the keyspace!\n", bigkeys.sampled);
     printf("Total key length in bytes is %llu (avg len %.2f)\n\n",
-       totlen, totlen ? (double)totlen/sampled : 0);
+       bigkeys.totlen,
+       bigkeys.totlen ? (double)bigkeys.totlen/bigkeys.sampled : 0);
 
     /* Output the biggest keys we found, for types we did find */
     for(i=0;i<TYPE_NONE;i++) {
-        if(sdslen(maxkeys[i])>0) {
-            printf("Biggest %6s found '%s' has %llu %s\n", name_of_type[i], maxkeys[i],
-               biggest[i], typeunit[i]);
+        if(sdslen(bigkeys.maxkeys[i])>0) {
+            printf("Biggest %6s found '%s' has %llu %s\n", name_of_type[i],
+               bigkeys.maxkeys[i], bigkeys.biggest[i],
+               config.memkeys ? "bytes" : typeunit[i]);
         }
     }
 
@@ -2333,14 +2757,36 @@ static void findBigKeys() {
 
     for(i=0;i<TYPE_NONE;i++) {
         printf("%llu %ss with %llu %s (%05.2f%% of keys, avg size %.2f)\n",
-           counts[i], name_of_type[i], totalsize[i], typeunit[i],
-           sampled ? 100 * (double)counts[i]/sampled : 0,
-           counts[i] ? (double)totalsize[i]/counts[i] : 0);
+           bigkeys.counts[i], name_of_type[i], bigkeys.totalsize[i],
+           config.memkeys ? "bytes" : typeunit[i],
+           bigkeys.sampled ?
+               100 * (double)bigkeys.counts[i]/bigkeys.sampled : 0,
+           bigkeys.counts[i] ?
+               (double)bigkeys.totalsize[i]/bigkeys.counts[i] : 0);
+    }
+
+    /* Size distribution of the types we did find */
+    for(i=0;i<TYPE_NONE;i++) {
+        if(bigkeys.counts[i] == 0) continue;
+        printf("\n%s size distribution (%s):\n", name_of_type[i],
+            config.memkeys ? "bytes" : typeunit[i]);
+        for (int b = 0; b < BIGKEYS_BUCKETS; b++) {
+            char range[64];
+
+            if (bigkeys.dist[i][b] == 0) continue;
+            if (b <= 1)
+                snprintf(range,sizeof(range),"%d",b);
+            else
+                snprintf(range,sizeof(range),"%llu-%llu",1ULL<<(b-1),
+                    b == 64 ? ULLONG_MAX : (1ULL<<b)-1);
+            printf("  %-44s %12llu (%05.2f%%)\n", range, bigkeys.dist[i][b],
+                100 * (double)bigkeys.dist[i][b]/bigkeys.counts[i]);
+        }
     }
 
     /* Free sds strings containing max keys */
     for(i=0;i<TYPE_NONE;i++) {
-        sdsfree(maxkeys[i]);
+        sdsfree(bigkeys.maxkeys[i]);
     }
 
     /* Success! */
@@ -2377,6 +2823,36 @@ static void getKeyFreqs(redisReply *keys, unsigned long long *freqs) {
     }
 }
 
+/* Print the hot keys tracked by the server with the HOTKEYS command.
+ * Return 0 if the server doesn't support it or the tracking is disabled,
+ * so that the caller can fall back to scanning the keyspace. */
+static int findHotKeysTracked() {
+    redisReply *reply = (redisReply *)redisCommand(context, "HOTKEYS");
+    size_t i;
+
+    if (reply == NULL) {
+        fprintf(stderr, "\nI/O error\n");
+        exit(1);
+    } else if (reply->type != REDIS_REPLY_ARRAY) {
+        freeReplyObject(reply);
+        return 0;
+    }
+
+    printf("\n# Hot keys tracked by the server, with the estimated number\n");
+    printf("# of recent accesses. No need to scan the keyspace.\n");
+    printf("\n-------- summary -------\n\n");
+    for (i = 0; i < reply->elements; i++) {
+        redisReply *e = reply->element[i];
+        if (e->type != REDIS_REPLY_ARRAY || e->elements != 3) continue;
+        printf("hot key found with counter: %lld\tkeyname: %s\tdb: %lld\n",
+            e->element[2]->integer, e->element[0]->str,
+            e->element[1]->integer);
+    }
+    if (reply->elements == 0) printf("No hot keys tracked so far.\n");
+    freeReplyObject(reply);
+    return 1;
+}
+
 #define HOTKEYS_SAMPLE 16
 static void findHotKeys() {
     redisReply *keys, *reply;
@@ -2386,6 +2862,10 @@ static void findHotKeys() {
     unsigned int arrsize = 0, i, k;
     double pct;
 
+    /* Ask the server first: it tracks the hot keys itself unless the
+     * tracking is disabled. */
+    if (findHotKeysTracked()) exit(0);
+
     /* Total keys pre scanning */
     total_keys = getDbSize();
 
@@ -2400,7 +2880,7 @@ static void findHotKeys() {
         pct = 100 * (double)sampled/total_keys;
 
         /* Grab some keys and point to the keys array */
-        reply = sendScan(&it);
+        reply = sendScan(context, &it, 0);
         keys  = reply->element[1];
 
         /* Reallocate our freqs array if we need to */
@@ -2846,7 +3326,11 @@ int main(int argc, char **argv) {
     config.rdb_filename = NULL;
     config.pipe_mode = 0;
     config.pipe_timeout = REDIS_CLI_DEFAULT_PIPE_TIMEOUT;
+    config.pipe_jobs = 1;
     config.bigkeys = 0;
+    config.memkeys = 0;
+    config.scan_jobs = 1;
+    config.scan_count = REDIS_CLI_DEFAULT_SCAN_COUNT;
     config.hotkeys = 0;
     config.stdinarg = 0;
     config.auth = NULL;
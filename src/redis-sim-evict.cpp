@@ -0,0 +1,319 @@
+/* redis-sim-evict replays a trace of key accesses captured with the sampled
+ * commands tracer (see trace.cpp and utils/lru/trace-capture.tcl) against an
+ * in memory dataset limited to a given maxmemory, once for every eviction
+ * policy and maxmemory-samples value to compare, and reports the hit ratio
+ * of the reads and the CPU time spent per evicted key.
+ *
+ * Nothing is modeled: the accesses go through lookupKey(), dbAdd() and
+ * dbOverwrite(), so the LRU clock and the LFU counters are updated by the
+ * server code (LFULogIncr(), LFUDecrAndReturn()), and the keys are evicted
+ * by freeMemoryIfNeeded() and evictionPoolPopulate() with the memory used by
+ * the real objects. The clocks follow the times recorded in the trace, so a
+ * trace of hours replays in seconds with the same LRU idle times and LFU
+ * decay periods.
+ *
+ * The commands flagged as writes store a value as big as their arguments
+ * minus the command name and the key; the reads hit if the key exists, and
+ * otherwise store a value as big as their reply, like a cache filled on
+ * misses. The trace records no TTL, so only the allkeys-* policies apply.
+ *
+ * The program is part of the Redis executable like redis-check-rdb, and
+ * runs when it is called as redis-sim-evict.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "trace.h"
+
+#include <time.h>
+
+void createSharedObjects();
+void loadServerConfigFromString(char *config);
+
+#define SIM_DEFAULT_POLICIES "allkeys-lru,allkeys-lfu,allkeys-gdsf,allkeys-random"
+#define SIM_DEFAULT_SAMPLES "1,3,5,10"
+#define SIM_DEFAULT_VALUE_SIZE 64
+
+/* A key access of the trace. */
+struct simAccess {
+    uint64_t time;      /* Unix time in microseconds. */
+    robj *key;
+    size_t size;        /* Length of the value stored by the access. */
+    uint16_t dbid;
+    int write;
+};
+
+static struct simState {
+    simAccess *trace;
+    size_t len;
+    size_t size;
+    long long reads;        /* Accesses that are not writes. */
+    long long skipped;      /* Records of commands without keys. */
+    long long value_size;   /* Value length when the trace has none. */
+} sim;
+
+/* The results of the replay of the trace with a policy. */
+struct simResult {
+    long long hits;
+    long long evicted;
+    long long evict_ns;     /* CPU time spent evicting keys. */
+};
+
+static void simUsage(char *progname) {
+    fprintf(stderr,
+"Usage: %s --maxmemory <bytes> [--policies <p1,p2,...>]\n"
+"       [--samples <n1,n2,...>] [--value-size <bytes>] [--config <file>]\n"
+"       <trace-file> [<trace-file> ...]\n\n"
+"Replays the key accesses of the trace files, made of the records returned\n"
+"by TRACE FETCH, with every allkeys-* policy in --policies (default\n"
+"%s) and every maxmemory-samples\n"
+"value in --samples (default %s), reporting the hit ratio of the\n"
+"reads and the CPU time per eviction. --maxmemory is the memory available\n"
+"to the keys, --value-size the length of the values stored by the reads\n"
+"whose reply size is unknown (default %d). The options of the configuration\n"
+"file apply, for instance lfu-log-factor and lfu-decay-time.\n",
+        progname, SIM_DEFAULT_POLICIES, SIM_DEFAULT_SAMPLES,
+        SIM_DEFAULT_VALUE_SIZE);
+    exit(1);
+}
+
+/* Append the accesses of the trace file 'filename' to sim.trace. Records of
+ * commands without keys, or unknown to this server, are skipped. */
+static void simLoadTrace(const char *filename) {
+    FILE *fp;
+    sds buf = sdsempty();
+    char chunk[16*1024];
+    size_t nread, off = 0;
+
+    if ((fp = fopen(filename,"r")) == NULL) {
+        fprintf(stderr,"Can't open %s: %s\n",filename,strerror(errno));
+        exit(1);
+    }
+    while ((nread = fread(chunk,1,sizeof(chunk),fp)) > 0)
+        buf = sdscatlen(buf,chunk,nread);
+    if (ferror(fp)) {
+        fprintf(stderr,"Error reading %s: %s\n",filename,strerror(errno));
+        exit(1);
+    }
+    fclose(fp);
+
+    while (off < sdslen(buf)) {
+        unsigned char *p = (unsigned char*)buf+off;
+        uint64_t u64[5];
+        uint32_t u32[2];
+        uint16_t u16[3];
+
+        if (sdslen(buf)-off < TRACE_RECORD_HDR_LEN) break;
+        for (int j = 0; j < 5; j++, p += 8) {
+            memcpy(&u64[j],p,8);
+            memrev64ifbe(&u64[j]);
+        }
+        for (int j = 0; j < 2; j++, p += 4) {
+            memcpy(&u32[j],p,4);
+            memrev32ifbe(&u32[j]);
+        }
+        for (int j = 0; j < 3; j++, p += 2) {
+            memcpy(&u16[j],p,2);
+            memrev16ifbe(&u16[j]);
+        }
+        uint16_t dbid = u16[0], cmdlen = u16[1], keylen = u16[2];
+        if (sdslen(buf)-off < (size_t)TRACE_RECORD_HDR_LEN+cmdlen+keylen)
+            break;
+        off += TRACE_RECORD_HDR_LEN+cmdlen+keylen;
+
+        sds name = sdsnewlen(p,cmdlen);
+        struct redisCommand *cmd = lookupCommand(name);
+        sdsfree(name);
+        if (cmd == NULL || cmd->firstkey == 0 || keylen == 0) {
+            sim.skipped++;
+            continue;
+        }
+
+        if (sim.len == sim.size) {
+            sim.size = sim.size ? sim.size*2 : 1024;
+            sim.trace = (simAccess *)zrealloc(sim.trace,
+                                              sizeof(simAccess)*sim.size);
+        }
+        simAccess *a = sim.trace+sim.len++;
+        uint64_t arg_bytes = u64[3], reply_bytes = u64[4];
+        a->time = u64[1];
+        a->key = createStringObject((char*)p+cmdlen,keylen);
+        a->dbid = dbid % server.dbnum;
+        a->write = (cmd->m_flags & CMD_WRITE) != 0;
+        if (a->write) {
+            a->size = arg_bytes > (uint64_t)cmdlen+keylen ?
+                      arg_bytes-cmdlen-keylen : 1;
+        } else {
+            /* A null reply is "$-1\r\n": the reply size of a missing key
+             * tells nothing about the value. */
+            a->size = reply_bytes > 5 ? reply_bytes : sim.value_size;
+            sim.reads++;
+        }
+    }
+    if (off != sdslen(buf))
+        fprintf(stderr,"Truncated record at offset %zu of %s, ignored\n",
+            off,filename);
+    sdsfree(buf);
+}
+
+static long long simCpuNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID,&ts);
+    return (long long)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+
+/* Replay the trace from an empty dataset with the given policy and samples,
+ * the keys being allowed to use 'maxmemory' bytes. */
+static void simRun(const char *policy, int samples, long long maxmemory,
+                   simResult *res)
+{
+    sds config = sdscatprintf(sdsempty(),
+        "maxmemory-policy %s\nmaxmemory-samples %d\n", policy, samples);
+
+    server.maxmemory = 0;
+    emptyDb(-1,EMPTYDB_NO_FLAGS,NULL);
+    loadServerConfigFromString(config);
+    sdsfree(config);
+    memset(res,0,sizeof(*res));
+    server.stat_evictedkeys = 0;
+    /* The memory used before the replay, the trace included, is not
+     * available to the keys. */
+    server.maxmemory = zmalloc_used_memory()+maxmemory;
+
+    for (size_t j = 0; j < sim.len; j++) {
+        simAccess *a = sim.trace+j;
+        redisDb *db = server.db+a->dbid;
+
+        server.unixtime = a->time/1000000;
+        server.mstime = a->time/1000;
+        server.lruclock = (server.mstime/LRU_CLOCK_RESOLUTION) & LRU_CLOCK_MAX;
+
+        robj *val = lookupKey(db,a->key,LOOKUP_NONE);
+        if (!a->write && val) {
+            res->hits++;
+            continue;
+        }
+
+        /* Like processCommand() before a command that may use memory. */
+        if (zmalloc_used_memory() > server.maxmemory) {
+            long long start = simCpuNs();
+            freeMemoryIfNeeded();
+            res->evict_ns += simCpuNs()-start;
+        }
+        robj *o = createStringObject(NULL,a->size);
+        if (val)
+            dbOverwrite(db,a->key,o);
+        else
+            dbAdd(db,a->key,o);
+    }
+    res->evicted = server.stat_evictedkeys;
+}
+
+int redis_sim_evict_main(int argc, char **argv) {
+    char *configfile = NULL;
+    const char *policies = SIM_DEFAULT_POLICIES, *samples = SIM_DEFAULT_SAMPLES;
+    long long maxmemory = 0;
+    int j, err, numpolicies, numsamples;
+
+    sim.value_size = SIM_DEFAULT_VALUE_SIZE;
+    for (j = 1; j < argc && argv[j][0] == '-' && argv[j][1] == '-'; j++) {
+        int lastarg = j == argc-1;
+
+        if (!strcmp(argv[j],"--maxmemory") && !lastarg) {
+            maxmemory = memtoll(argv[++j],&err);
+            if (err || maxmemory <= 0) simUsage(argv[0]);
+        } else if (!strcmp(argv[j],"--policies") && !lastarg) {
+            policies = argv[++j];
+        } else if (!strcmp(argv[j],"--samples") && !lastarg) {
+            samples = argv[++j];
+        } else if (!strcmp(argv[j],"--value-size") && !lastarg) {
+            sim.value_size = memtoll(argv[++j],&err);
+            if (err || sim.value_size <= 0) simUsage(argv[0]);
+        } else if (!strcmp(argv[j],"--config") && !lastarg) {
+            configfile = argv[++j];
+        } else {
+            simUsage(argv[0]);
+        }
+    }
+    if (j == argc || maxmemory == 0) simUsage(argv[0]);
+
+    if (configfile) loadServerConfig(configfile,NULL);
+    /* Everything is freed synchronously: there are no bio threads. */
+    server.lazyfree_lazy_eviction = 0;
+    server.lazyfree_lazy_server_del = 0;
+    server.lazyfree_auto_threshold = 0;
+    server.cluster_enabled = 0;
+    server.tiering = 0;
+    createSharedObjects();
+    server.db = (redisDb *)zmalloc(sizeof(redisDb)*server.dbnum);
+    for (int id = 0; id < server.dbnum; id++) new (server.db + id) redisDb(id);
+    server.slaves = listCreate();
+    evictionPoolAlloc();
+
+    for (; j < argc; j++) simLoadTrace(argv[j]);
+    if (sim.len == 0) {
+        fprintf(stderr,"No key accesses in the trace\n");
+        exit(1);
+    }
+
+    sds *policyv = sdssplitlen(policies,strlen(policies),",",1,&numpolicies);
+    sds *samplesv = sdssplitlen(samples,strlen(samples),",",1,&numsamples);
+    printf("%zu accesses (%lld reads), %lld records without keys skipped, "
+           "%lld bytes for the keys\n\n",
+           sim.len, sim.reads, sim.skipped, maxmemory);
+    printf("%-16s %7s %8s %10s %12s\n",
+           "policy","samples","hits","evicted","ns/eviction");
+    for (int p = 0; p < numpolicies; p++) {
+        if (strncmp(policyv[p],"allkeys-",8)) {
+            fprintf(stderr,"Policy %s skipped: the trace has no TTLs\n",
+                policyv[p]);
+            continue;
+        }
+        for (int s = 0; s < numsamples; s++) {
+            simResult res;
+
+            simRun(policyv[p],atoi(samplesv[s]),maxmemory,&res);
+            printf("%-16s %7s %7.2f%% %10lld %12.1f\n",
+                policyv[p],
+                server.maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM ?
+                    "-" : samplesv[s],
+                sim.reads ? (double)res.hits*100/sim.reads : 0,
+                res.evicted,
+                res.evicted ? (double)res.evict_ns/res.evicted : 0);
+            fflush(stdout);
+            /* The samples don't matter picking random keys. */
+            if (server.maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM) break;
+        }
+    }
+    sdsfreesplitres(policyv,numpolicies);
+    sdsfreesplitres(samplesv,numsamples);
+    exit(0);
+}
@@ -0,0 +1,201 @@
+/* Replication buffer shared by the slaves, see replbuffer.h.
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "replbuffer.h"
+#include "zmalloc.h"
+#include <string.h>
+#include <new>
+
+replBuffer::replBuffer()
+: m_head(NULL)
+, m_tail(NULL)
+, m_end(0)
+, m_readers(0)
+, m_blocks(0)
+, m_mem(0)
+{
+}
+
+replBuffer::~replBuffer()
+{
+    zmalloc_transient_begin();
+    while (m_head) {
+        replBufBlock *next = m_head->next;
+        zfree(m_head);
+        m_head = next;
+    }
+    zmalloc_transient_end();
+}
+
+replBuffer *replBufferCreate(void) {
+    void *mem = zmalloc(sizeof(replBuffer));
+    return new (mem) replBuffer;
+}
+
+void replBufferFree(replBuffer *rb) {
+    rb->~replBuffer();
+    zfree(rb);
+}
+
+/* Add to the tail an empty block of 'size' bytes. */
+replBufBlock *replBuffer::replBufferNewBlock(size_t size) {
+    zmalloc_transient_begin();
+    void *mem = zmalloc(sizeof(replBufBlock)+size);
+    zmalloc_transient_end();
+    replBufBlock *b = new (mem) replBufBlock;
+
+    b->refcount = 0;
+    b->next = NULL;
+    b->start = m_end;
+    b->size = size;
+    b->used = 0;
+    if (m_tail) m_tail->next = b;
+    else m_head = b;
+    m_tail = b;
+    m_blocks++;
+    m_mem += sizeof(replBufBlock)+size;
+    return b;
+}
+
+/* Append 'len' bytes to the stream. Nothing is stored when there are no
+ * cursors to read them. */
+void replBuffer::replBufferAppend(const void *p, size_t len) {
+    const char *s = (const char *)p;
+
+    if (m_readers == 0) {
+        m_end += len;
+        return;
+    }
+    replBufferTrim();
+    while (len) {
+        replBufBlock *b = m_tail;
+        if (b == NULL || b->used == b->size)
+            b = replBufferNewBlock(len > REPL_BUFFER_BLOCK_BYTES ?
+                                   len : REPL_BUFFER_BLOCK_BYTES);
+
+        size_t n = b->size-b->used < len ? b->size-b->used : len;
+        memcpy(b->buf+b->used,s,n);
+        b->used += n;
+        m_end += n;
+        s += n;
+        len -= n;
+    }
+}
+
+/* Attach 'cur' at the end of the stream: it will read what is appended
+ * from now on. */
+void replBuffer::replBufferAttach(replBufCursor *cur) {
+    replBufBlock *b = m_tail ? m_tail : replBufferNewBlock(REPL_BUFFER_BLOCK_BYTES);
+
+    b->refcount++;
+    cur->buf = this;
+    cur->block = b;
+    cur->pos = b->used;
+    m_readers++;
+}
+
+/* Attach 'dst' at the same position of 'src'. */
+void replBuffer::replBufferCopy(replBufCursor *dst, const replBufCursor *src) {
+    src->block->refcount++;
+    *dst = *src;
+    m_readers++;
+}
+
+void replBuffer::replBufferDetach(replBufCursor *cur) {
+    cur->block->refcount--;
+    cur->buf = NULL;
+    cur->block = NULL;
+    cur->pos = 0;
+    m_readers--;
+    replBufferTrim();
+}
+
+/* Release the blocks on the head no cursor points to. */
+void replBuffer::replBufferTrim() {
+    while (m_head && m_head->refcount == 0) {
+        replBufBlock *next = m_head->next;
+        m_mem -= sizeof(replBufBlock)+m_head->size;
+        m_blocks--;
+        zmalloc_transient_begin();
+        zfree(m_head);
+        zmalloc_transient_end();
+        m_head = next;
+    }
+    if (m_head == NULL) m_tail = NULL;
+}
+
+/* Bytes of the stream 'cur' still has to send. */
+size_t replBuffer::replBufferPending(const replBufCursor *cur) {
+    if (cur->buf == NULL) return 0;
+    return cur->buf->m_end-(cur->block->start+cur->pos);
+}
+
+/* Add to 'iov', that already has 'iovcnt' entries, the pending bytes of
+ * 'cur', up to 'maxcnt' entries or until '*bytes', that is incremented by
+ * the bytes added, reaches 'maxbytes'. Return the new number of entries. */
+int replBuffer::replBufferIov(const replBufCursor *cur, struct iovec *iov,
+                              int iovcnt, int maxcnt, size_t *bytes,
+                              size_t maxbytes)
+{
+    replBufBlock *b = cur->block;
+    size_t pos = cur->pos;
+
+    while (b && iovcnt < maxcnt && *bytes < maxbytes) {
+        if (b->used > pos) {
+            iov[iovcnt].iov_base = b->buf+pos;
+            iov[iovcnt].iov_len = b->used-pos;
+            *bytes += iov[iovcnt].iov_len;
+            iovcnt++;
+        }
+        pos = 0;
+        b = b->next;
+    }
+    return iovcnt;
+}
+
+/* Move 'cur' forward by 'len' sent bytes. A cursor at the end of a block
+ * moves to the next one as soon as it exists, so that the block can be
+ * released. */
+void replBuffer::replBufferAdvance(replBufCursor *cur, size_t len) {
+    while (len || (cur->pos == cur->block->used && cur->block->next)) {
+        if (cur->pos == cur->block->used) {
+            replBufBlock *next = cur->block->next;
+            next->refcount++;
+            cur->block->refcount--;
+            cur->block = next;
+            cur->pos = 0;
+            continue;
+        }
+        size_t n = cur->block->used-cur->pos < len ?
+                   cur->block->used-cur->pos : len;
+        cur->pos += n;
+        len -= n;
+    }
+}
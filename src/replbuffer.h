@@ -0,0 +1,77 @@
+/* Replication buffer shared by the slaves.
+ *
+ * The replication stream is appended once to a chain of blocks, and every
+ * slave receiving it holds a cursor into the chain instead of a copy of the
+ * stream in its own output buffer: the memory used is the part of the
+ * stream not yet sent to the slowest slave, whatever the number of slaves.
+ *
+ * A block counts the cursors pointing inside it. Cursors only move forward
+ * and new ones start at the tail, so the blocks on the head that are not
+ * referenced can't be reached anymore, and replBufferTrim() releases them.
+ * The counts are atomic since cursors are moved by writeToClient(), that
+ * may run in the I/O threads, while the chain itself is only modified by
+ * the main thread when the I/O threads are idle. */
+
+#ifndef __REPLBUFFER_H
+#define __REPLBUFFER_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include <atomic>
+
+#define REPL_BUFFER_BLOCK_BYTES (16*1024)
+
+struct replBufBlock {
+    std::atomic<int> refcount;  /* Cursors pointing inside the block. */
+    replBufBlock *next;
+    long long start;            /* Offset in the chain of the first byte. */
+    size_t size;                /* Allocated and used bytes of 'buf'. */
+    size_t used;
+    char buf[];
+};
+
+class replBuffer;
+
+struct replBufCursor {
+    replBuffer *buf;            /* NULL if not attached. */
+    replBufBlock *block;
+    size_t pos;                 /* Next byte to send in 'block'. */
+};
+
+class replBuffer
+{
+public:
+    replBuffer();
+    ~replBuffer();
+
+    void replBufferAppend(const void *p, size_t len);
+    void replBufferAttach(replBufCursor *cur);
+    void replBufferCopy(replBufCursor *dst, const replBufCursor *src);
+    void replBufferDetach(replBufCursor *cur);
+    void replBufferTrim();
+
+    static size_t replBufferPending(const replBufCursor *cur);
+    static int replBufferIov(const replBufCursor *cur, struct iovec *iov,
+                             int iovcnt, int maxcnt, size_t *bytes,
+                             size_t maxbytes);
+    static void replBufferAdvance(replBufCursor *cur, size_t len);
+
+    inline int replBufferReaders() const {return m_readers;}
+    inline size_t replBufferBlocks() const {return m_blocks;}
+    inline size_t replBufferMemory() const {return m_mem;}
+
+private:
+    replBufBlock *replBufferNewBlock(size_t size);
+
+    replBufBlock *m_head;
+    replBufBlock *m_tail;
+    long long m_end;            /* Bytes appended since the creation. */
+    int m_readers;              /* Attached cursors. */
+    size_t m_blocks;
+    size_t m_mem;               /* Allocated bytes, blocks headers included. */
+};
+
+replBuffer *replBufferCreate(void);
+void replBufferFree(replBuffer *rb);
+
+#endif
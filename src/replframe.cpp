@@ -0,0 +1,106 @@
+/* Framing of the LZF compressed replication stream, see replframe.h.
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "replframe.h"
+#include "lzf.h"
+#include "endianconv.h"
+#include <stdint.h>
+#include <string.h>
+
+/* Append to 's' the frames encoding the 'len' bytes at 'p'. */
+sds replFrameEncode(sds s, const void *p, size_t len) {
+    const unsigned char *data = (const unsigned char *)p;
+
+    while (len) {
+        uint32_t n = len < REPL_FRAME_BLOCK ? len : REPL_FRAME_BLOCK;
+        uint32_t plen, rawlen = intrev32ifbe(n);
+        unsigned char *hdr;
+
+        s = sdsMakeRoomFor(s,REPL_FRAME_HDR_LEN+n);
+        hdr = (unsigned char *)s+sdslen(s);
+        plen = n > 4 ? lzf_compress(data,n,hdr+REPL_FRAME_HDR_LEN,n-1) : 0;
+        if (plen == 0) {
+            hdr[0] = REPL_FRAME_RAW;
+            memcpy(hdr+REPL_FRAME_HDR_LEN,data,n);
+            plen = n;
+        } else {
+            hdr[0] = REPL_FRAME_LZF;
+        }
+        memcpy(hdr+1,&rawlen,4);
+        sdsIncrLen(s,REPL_FRAME_HDR_LEN+plen);
+        plen = intrev32ifbe(plen);
+        memcpy(hdr+5,&plen,4);
+        data += n;
+        len -= n;
+    }
+    return s;
+}
+
+/* Decode the complete frames at the start of '*frames', appending their
+ * data to '*out' and removing them from '*frames', so that it is left with
+ * the start of the next frame, if any. Return -1 if a frame is corrupted,
+ * otherwise 0. */
+int replFrameDecode(sds *frames, sds *out) {
+    const unsigned char *p = (const unsigned char *)*frames;
+    size_t pos = 0, len = sdslen(*frames);
+    int retval = 0;
+
+    while (len-pos >= REPL_FRAME_HDR_LEN) {
+        uint32_t rawlen, plen;
+
+        memcpy(&rawlen,p+pos+1,4);
+        memcpy(&plen,p+pos+5,4);
+        rawlen = intrev32ifbe(rawlen);
+        plen = intrev32ifbe(plen);
+        if (rawlen > REPL_FRAME_BLOCK ||
+            (p[pos] == REPL_FRAME_RAW && plen != rawlen) ||
+            (p[pos] == REPL_FRAME_LZF && plen >= rawlen) ||
+            p[pos] > REPL_FRAME_LZF)
+        {
+            retval = -1;
+            break;
+        }
+        if (len-pos-REPL_FRAME_HDR_LEN < plen) break;
+
+        *out = sdsMakeRoomFor(*out,rawlen);
+        if (p[pos] == REPL_FRAME_RAW) {
+            memcpy(*out+sdslen(*out),p+pos+REPL_FRAME_HDR_LEN,rawlen);
+        } else if (lzf_decompress(p+pos+REPL_FRAME_HDR_LEN,plen,
+                                  *out+sdslen(*out),rawlen) != rawlen)
+        {
+            retval = -1;
+            break;
+        }
+        sdsIncrLen(*out,rawlen);
+        pos += REPL_FRAME_HDR_LEN+plen;
+    }
+    sdsrange(*frames,pos,-1);
+    return retval;
+}
@@ -0,0 +1,28 @@
+/* Framing of the LZF compressed replication stream.
+ *
+ * When a slave advertises "capa lzf" and the master has repl-compression
+ * enabled, what the master sends after the PSYNC reply (the payload of a
+ * streamed RDB and the stream of commands) is split in frames:
+ *
+ * <type:1> <raw len:4> <payload len:4> <payload>
+ *
+ * The lengths are little endian. The payload is the LZF compressed data,
+ * or the data itself for REPL_FRAME_RAW frames, used when LZF is not able
+ * to make it smaller. A frame holds at most REPL_FRAME_BLOCK bytes of
+ * data, so that the receiver can bound its buffers. */
+
+#ifndef __REPLFRAME_H
+#define __REPLFRAME_H
+
+#include <stddef.h>
+#include "sds.h"
+
+#define REPL_FRAME_RAW 0
+#define REPL_FRAME_LZF 1
+#define REPL_FRAME_HDR_LEN 9
+#define REPL_FRAME_BLOCK (64*1024)
+
+sds replFrameEncode(sds s, const void *p, size_t len);
+int replFrameDecode(sds *frames, sds *out);
+
+#endif
@@ -30,18 +30,29 @@
 
 
 #include "server.h"
+#include "replframe.h"
 
 #include <sys/time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
 
 void replicationDiscardCachedMaster();
 void replicationResurrectCachedMaster(int newfd);
 void replicationSendAck();
 void putSlaveOnline(client *slave);
+void sendBulkToSlave(aeEventLoop *el, int fd, void *privdata, int mask);
 int cancelReplicationHandshake();
+void replicationDiscardResumeState();
+int replicationCanResume();
+void syncWithMaster(aeEventLoop *el, int fd, void *privdata, int mask);
+
+/* TLS handshake with the master in progress, see tls-replication. */
+static tlsHandshake *repl_tls_handshake = NULL;
 
 /* --------------------------- Utility functions ---------------------------- */
 
@@ -75,9 +86,15 @@ char* client::replicationGetSlaveName() {
 
 /* ---------------------------------- MASTER -------------------------------- */
 
+void replicationBacklogDiskReset();
+int replicationBacklogDiskSpill(long long upto);
+
 void createReplicationBacklog() {
     serverAssert(server.repl_backlog == NULL);
+    replicationBacklogDiskReset();
+    zmalloc_transient_begin();
     server.repl_backlog = (char *)zmalloc(server.repl_backlog_size);
+    zmalloc_transient_end();
     server.repl_backlog_histlen = 0;
     server.repl_backlog_idx = 0;
 
@@ -100,13 +117,19 @@ void resizeReplicationBacklog(long long newsize) {
 
     server.repl_backlog_size = newsize;
     if (server.repl_backlog != NULL) {
+        /* The history on disk stays valid if it is followed by all the
+         * data we are going to discard. */
+        if (server.repl_backlog_disk_size)
+            replicationBacklogDiskSpill(server.master_repl_offset+1);
         /* What we actually do is to flush the old buffer and realloc a new
          * empty one. It will refill with new data incrementally.
          * The reason is that copying a few gigabytes adds latency and even
          * worse often we need to alloc additional space before freeing the
          * old buffer. */
+        zmalloc_transient_begin();
         zfree(server.repl_backlog);
         server.repl_backlog = (char *)zmalloc(server.repl_backlog_size);
+        zmalloc_transient_end();
         server.repl_backlog_histlen = 0;
         server.repl_backlog_idx = 0;
         /* Next byte we have is... the next since the buffer is empty. */
@@ -116,8 +139,284 @@ void resizeReplicationBacklog(long long newsize) {
 
 void freeReplicationBacklog() {
     serverAssert(server.slaves->listLength() == 0);
+    zmalloc_transient_begin();
     zfree(server.repl_backlog);
+    zmalloc_transient_end();
     server.repl_backlog = NULL;
+    replicationBacklogDiskReset();
+}
+
+/* ------------------------- Disk backed backlog -----------------------------
+ * With repl-backlog-disk-size set, the bytes about to be overwritten in the
+ * circular backlog are first appended to segment files on disk, so that the
+ * history available for partial resynchronizations is made of the disk
+ * segments followed by the memory backlog:
+ *
+ * [repl_backlog_disk_off ... disk end) [repl_backlog_off ... master offset]
+ *
+ * The disk end is never before repl_backlog_off. Spilling is done ahead,
+ * REPL_BACKLOG_SPILL_BYTES at a time, so that most writes don't need a
+ * system call. Segments are unlinked as soon as created: each one is just
+ * an open descriptor, that slaves reading it dup(), and the oldest is closed
+ * when the history exceeds the configured size. The part of a PSYNC on disk
+ * is sent by sendBacklogToSlave() with sendfile(), before the memory part
+ * queued in the slave output buffer. */
+
+#define REPL_BACKLOG_SPILL_BYTES (1024*1024)
+#define REPL_BACKLOG_DISK_SEGMENTS 8
+#define REPL_BACKLOG_DISK_MIN_SEGMENT (64*1024)
+
+struct replBacklogSegment {
+    int fd;
+    long long off;      /* Replication offset of the first byte. */
+    long long len;
+};
+
+/* Part of a segment a slave still has to receive. */
+struct replBacklogRange {
+    int fd;             /* dup() of the segment descriptor. */
+    off_t off;
+    off_t len;
+};
+
+static long long replicationBacklogDiskEnd() {
+    return server.repl_backlog_disk_off+server.repl_backlog_disk_histlen;
+}
+
+static void replicationBacklogDiskDropOldest() {
+    listNode *ln = server.repl_backlog_segments->listFirst();
+    replBacklogSegment *seg = (replBacklogSegment *)ln->listNodeValue();
+
+    server.repl_backlog_disk_off += seg->len;
+    server.repl_backlog_disk_histlen -= seg->len;
+    close(seg->fd);
+    zfree(seg);
+    server.repl_backlog_segments->listDelNode(ln);
+}
+
+/* Drop all the history on disk. */
+void replicationBacklogDiskReset() {
+    while (server.repl_backlog_segments->listLength())
+        replicationBacklogDiskDropOldest();
+    server.repl_backlog_disk_off = 0;
+    server.repl_backlog_disk_histlen = 0;
+}
+
+/* Drop the oldest segments while the history on disk is bigger than
+ * repl-backlog-disk-size, always keeping the one being written. */
+void replicationBacklogDiskTrim() {
+    if (server.repl_backlog_disk_size == 0) {
+        replicationBacklogDiskReset();
+        return;
+    }
+    while (server.repl_backlog_segments->listLength() > 1 &&
+           server.repl_backlog_disk_histlen > server.repl_backlog_disk_size)
+        replicationBacklogDiskDropOldest();
+}
+
+/* Append 'len' bytes to the history on disk, returns C_ERR on error. */
+static int replicationBacklogDiskWrite(const char *p, size_t len) {
+    static long long segid = 0;
+    long long segsize = server.repl_backlog_disk_size/REPL_BACKLOG_DISK_SEGMENTS;
+
+    if (segsize < REPL_BACKLOG_DISK_MIN_SEGMENT)
+        segsize = REPL_BACKLOG_DISK_MIN_SEGMENT;
+    while (len) {
+        listNode *ln = server.repl_backlog_segments->listLast();
+        replBacklogSegment *seg = ln ? (replBacklogSegment *)ln->listNodeValue() : NULL;
+
+        if (seg == NULL || seg->len >= segsize) {
+            char path[64];
+            int fd;
+
+            snprintf(path,sizeof(path),"temp-backlog-%d-%lld.seg",
+                (int) getpid(), segid++);
+            if ((fd = open(path,O_RDWR|O_CREAT|O_EXCL,0644)) == -1) {
+                serverLog(LL_WARNING,"Opening the backlog segment %s: %s",
+                    path, strerror(errno));
+                return C_ERR;
+            }
+            unlink(path);
+            seg = (replBacklogSegment *)zmalloc(sizeof(*seg));
+            seg->fd = fd;
+            seg->off = replicationBacklogDiskEnd();
+            seg->len = 0;
+            server.repl_backlog_segments->listAddNodeTail(seg);
+        }
+
+        size_t n = (size_t)(segsize-seg->len) < len ? segsize-seg->len : len;
+        ssize_t nwritten = write(seg->fd,p,n);
+        if (nwritten != (ssize_t)n) {
+            serverLog(LL_WARNING,"Writing the backlog to disk: %s",
+                nwritten == -1 ? strerror(errno) : "short write");
+            return C_ERR;
+        }
+        seg->len += n;
+        server.repl_backlog_disk_histlen += n;
+        p += n;
+        len -= n;
+    }
+    replicationBacklogDiskTrim();
+    return C_OK;
+}
+
+/* Write to disk the bytes of the memory backlog up to the replication
+ * offset 'upto', excluded. On error the history on disk is dropped and
+ * C_ERR is returned. */
+int replicationBacklogDiskSpill(long long upto) {
+    long long end, first;
+
+    if (server.repl_backlog_segments->listLength() == 0 ||
+        replicationBacklogDiskEnd() < server.repl_backlog_off)
+    {
+        /* Empty, or not contiguous with the memory: start again. */
+        replicationBacklogDiskReset();
+        server.repl_backlog_disk_off = server.repl_backlog_off;
+    }
+    end = replicationBacklogDiskEnd();
+    if (upto > server.repl_backlog_off+server.repl_backlog_histlen)
+        upto = server.repl_backlog_off+server.repl_backlog_histlen;
+
+    /* Index of the repl_backlog_off byte, as in addReplyReplicationBacklog(). */
+    first = (server.repl_backlog_idx +
+            (server.repl_backlog_size-server.repl_backlog_histlen)) %
+            server.repl_backlog_size;
+    while (end < upto) {
+        long long j = (first + (end-server.repl_backlog_off)) %
+                      server.repl_backlog_size;
+        long long thislen = server.repl_backlog_size-j;
+        if (thislen > upto-end) thislen = upto-end;
+
+        if (replicationBacklogDiskWrite(server.repl_backlog+j,thislen) == C_ERR) {
+            serverLog(LL_WARNING,"Dropping the backlog saved on disk");
+            replicationBacklogDiskReset();
+            return C_ERR;
+        }
+        end += thislen;
+    }
+    return C_OK;
+}
+
+/* Called by feedReplicationBacklog() before adding 'len' bytes to the memory
+ * backlog: the bytes that are going to be overwritten, and the new bytes that
+ * don't fit in the backlog at all, are saved to disk. */
+static void replicationBacklogDiskFeed(const char *p, size_t len) {
+    long long evict = server.repl_backlog_histlen+len-server.repl_backlog_size;
+
+    if (evict <= 0) return;
+    if (evict > server.repl_backlog_histlen) {
+        if (replicationBacklogDiskSpill(server.master_repl_offset+1) == C_OK &&
+            replicationBacklogDiskWrite(p,evict-server.repl_backlog_histlen) == C_ERR)
+        {
+            serverLog(LL_WARNING,"Dropping the backlog saved on disk");
+            replicationBacklogDiskReset();
+        }
+        return;
+    }
+    if (server.repl_backlog_segments->listLength() &&
+        replicationBacklogDiskEnd() >= server.repl_backlog_off+evict) return;
+
+    /* Spill ahead, so that the next writes don't need to. */
+    long long upto = server.repl_backlog_off+evict;
+    if (upto < server.repl_backlog_off+REPL_BACKLOG_SPILL_BYTES)
+        upto = server.repl_backlog_off+REPL_BACKLOG_SPILL_BYTES;
+    replicationBacklogDiskSpill(upto);
+}
+
+/* Return the replication offset of the first byte of the history, on disk
+ * or in memory. */
+long long replicationBacklogFirstByte() {
+    if (server.repl_backlog_disk_histlen &&
+        replicationBacklogDiskEnd() >= server.repl_backlog_off)
+        return server.repl_backlog_disk_off;
+    return server.repl_backlog_off;
+}
+
+/* Prepare the slave 'c' to receive the history on disk from 'offset' to
+ * the start of the memory backlog, taking a reference to the segments. */
+static int replicationBacklogDiskOpen(client *c, long long offset) {
+    listNode *ln;
+
+    c->m_repl_disk_ranges = listCreate();
+    listIter li(server.repl_backlog_segments);
+    while((ln = li.listNext())) {
+        replBacklogSegment *seg = (replBacklogSegment *)ln->listNodeValue();
+        long long start = seg->off > offset ? seg->off : offset;
+        long long end = seg->off+seg->len;
+
+        if (end > server.repl_backlog_off) end = server.repl_backlog_off;
+        if (start >= end) continue;
+
+        replBacklogRange *r = (replBacklogRange *)zmalloc(sizeof(*r));
+        r->off = start-seg->off;
+        r->len = end-start;
+        if ((r->fd = dup(seg->fd)) == -1) {
+            zfree(r);
+            replicationBacklogDiskClose(c);
+            return C_ERR;
+        }
+        c->m_repl_disk_ranges->listAddNodeTail(r);
+    }
+    return C_OK;
+}
+
+/* Release the references of 'c' to the history on disk. */
+void replicationBacklogDiskClose(client *c) {
+    listNode *ln;
+
+    if (c->m_repl_disk_ranges == NULL) return;
+    listIter li(c->m_repl_disk_ranges);
+    while((ln = li.listNext())) {
+        replBacklogRange *r = (replBacklogRange *)ln->listNodeValue();
+        close(r->fd);
+        zfree(r);
+    }
+    listRelease(c->m_repl_disk_ranges);
+    c->m_repl_disk_ranges = NULL;
+}
+
+/* Write handler sending to a slave the history on disk of its partial
+ * resynchronization. When done the slave is put online, and sends the rest
+ * from its output buffer. */
+void sendBacklogToSlave(aeEventLoop *el, int fd, void *privdata, int mask) {
+    client *slave = (client *)privdata;
+    UNUSED(el);
+    UNUSED(mask);
+    replBacklogRange *r = (replBacklogRange *)
+        slave->m_repl_disk_ranges->listFirst()->listNodeValue();
+    size_t count = r->len < NET_MAX_WRITES_PER_EVENT ?
+                   r->len : NET_MAX_WRITES_PER_EVENT;
+    ssize_t nwritten;
+
+#ifdef HAVE_SENDFILE
+    off_t off = r->off;
+    nwritten = sendfile(fd,r->fd,&off,count);
+#else
+    char buf[PROTO_IOBUF_LEN];
+    if (count > sizeof(buf)) count = sizeof(buf);
+    nwritten = pread(r->fd,buf,count,r->off);
+    if (nwritten > 0) nwritten = write(fd,buf,nwritten);
+#endif
+    if (nwritten <= 0) {
+        if (nwritten == -1 && errno == EAGAIN) return;
+        serverLog(LL_WARNING,"Error sending the backlog to slave %s: %s",
+            slave->replicationGetSlaveName(),
+            nwritten == 0 ? "premature EOF" : strerror(errno));
+        freeClient(slave);
+        return;
+    }
+    server.stat_net_output_bytes += nwritten;
+    r->off += nwritten;
+    r->len -= nwritten;
+    if (r->len) return;
+
+    close(r->fd);
+    zfree(r);
+    slave->m_repl_disk_ranges->listDelNode(slave->m_repl_disk_ranges->listFirst());
+    if (slave->m_repl_disk_ranges->listLength()) return;
+    replicationBacklogDiskClose(slave);
+    server.el->aeDeleteFileEvent(slave->m_fd,AE_WRITABLE);
+    putSlaveOnline(slave);
 }
 
 /* Add data to the replication backlog.
@@ -127,6 +426,8 @@ void freeReplicationBacklog() {
 void feedReplicationBacklog(void *ptr, size_t len) {
     unsigned char *p = (unsigned char *)ptr;
 
+    if (server.repl_backlog_disk_size)
+        replicationBacklogDiskFeed((const char *)p,len);
     server.master_repl_offset += len;
 
     /* This is a circular buffer, so write as much data we can at every
@@ -149,9 +450,20 @@ void feedReplicationBacklog(void *ptr, size_t len) {
                               server.repl_backlog_histlen + 1;
 }
 
-/* Wrapper for feedReplicationBacklog() that takes Redis string objects
+/* Add data to the replication stream: to the backlog, to the buffer read
+ * by the slaves, and to the stream of the current event loop iteration that
+ * replicationFlushCompressedStream() will send to the slaves that receive
+ * it LZF framed. */
+void feedReplicationStream(void *ptr, size_t len) {
+    feedReplicationBacklog(ptr,len);
+    server.repl_buffer->replBufferAppend(ptr,len);
+    if (server.repl_compress_slaves)
+        server.repl_compress_buf = sdscatlen(server.repl_compress_buf,ptr,len);
+}
+
+/* Wrapper for feedReplicationStream() that takes Redis string objects
  * as input. */
-void feedReplicationBacklogWithObject(robj *o) {
+void feedReplicationStreamWithObject(robj *o) {
     char llstr[LONG_STR_SIZE];
     void *p;
     size_t len;
@@ -163,7 +475,53 @@ void feedReplicationBacklogWithObject(robj *o) {
         len = sdslen((sds)o->ptr);
         p = o->ptr;
     }
-    feedReplicationBacklog(p,len);
+    feedReplicationStream(p,len);
+}
+
+/* Attach the slave to the end of the replication stream shared by the
+ * slaves, the framed one if it receives it LZF framed: from now on it sends
+ * what is fed to the stream after its own output buffer. */
+void client::replicationAttachBuffer() {
+    if (m_repl_cursor.buf) return;
+    replBuffer *rb = m_repl_compress ? server.repl_compress_buffer :
+                                       server.repl_buffer;
+    rb->replBufferAttach(&m_repl_cursor);
+}
+
+void client::replicationPrepareBufferWrite() {
+    prepareClientToWrite();
+}
+
+void client::replicationCheckBufferLimits() {
+    asyncCloseClientOnOutputBufferLimitReached();
+}
+
+/* Before appending to 'rb', schedule the write of the slaves reading it,
+ * as addReply() does before adding to the output buffer. */
+static void replicationPrepareSlavesToWrite(list *slaves, replBuffer *rb) {
+    listNode *ln;
+
+    if (rb->replBufferReaders() == 0) return;
+    listIter li(slaves);
+    while((ln = li.listNext())) {
+        client *slave = (client *)ln->listNodeValue();
+        if (slave->m_repl_cursor.buf == rb)
+            slave->replicationPrepareBufferWrite();
+    }
+}
+
+/* After appending to 'rb', close the slaves reading it that are now over
+ * their output buffer limits. */
+static void replicationCheckSlavesLimits(list *slaves, replBuffer *rb) {
+    listNode *ln;
+
+    if (rb->replBufferReaders() == 0) return;
+    listIter li(slaves);
+    while((ln = li.listNext())) {
+        client *slave = (client *)ln->listNodeValue();
+        if (slave->m_repl_cursor.buf == rb)
+            slave->replicationCheckBufferLimits();
+    }
 }
 
 /* Propagate write commands to slaves, and populate the replication backlog
@@ -172,7 +530,6 @@ void feedReplicationBacklogWithObject(robj *o) {
  * stream. Instead if the instance is a slave and has sub-slaves attached,
  * we use replicationFeedSlavesFromMaster() */
 void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
-    listNode *ln;
     int j, len;
     char llstr[LONG_STR_SIZE];
 
@@ -190,6 +547,11 @@ void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
     /* We can't have slaves attached and no backlog. */
     serverAssert(!(slaves->listLength() != 0 && server.repl_backlog == NULL));
 
+    /* The slaves will get the command from the stream they share, that is
+     * fed together with the backlog. Slaves still waiting for BGSAVE to
+     * start, and the ones that will get the framed stream, don't read it. */
+    replicationPrepareSlavesToWrite(slaves,server.repl_buffer);
+
     /* Send SELECT command to every slave if needed. */
     if (server.slaveseldb != dictid) {
         robj *selectcmd;
@@ -207,23 +569,15 @@ void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
                 dictid_len, llstr));
         }
 
-        /* Add the SELECT command into the backlog. */
-        if (server.repl_backlog) feedReplicationBacklogWithObject(selectcmd);
-
-        /* Send it to slaves. */
-        listIter li(slaves);
-        while((ln = li.listNext())) {
-            client *slave = (client *)ln->listNodeValue();
-            if (slave->m_replication_state == SLAVE_STATE_WAIT_BGSAVE_START)continue;
-                slave->addReply(selectcmd);
-        }
+        /* Add the SELECT command into the stream. */
+        if (server.repl_backlog) feedReplicationStreamWithObject(selectcmd);
 
         if (dictid < 0 || dictid >= PROTO_SHARED_SELECT_CMDS)
             decrRefCount(selectcmd);
     }
     server.slaveseldb = dictid;
 
-    /* Write the command to the replication backlog if any. */
+    /* Write the command to the replication stream if any. */
     if (server.repl_backlog) {
         char aux[LONG_STR_SIZE+3];
 
@@ -232,7 +586,7 @@ void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
         len = ll2string(aux+1,sizeof(aux)-1,argc);
         aux[len+1] = '\r';
         aux[len+2] = '\n';
-        feedReplicationBacklog(aux,len+3);
+        feedReplicationStream(aux,len+3);
 
         for (j = 0; j < argc; j++) {
             long objlen = stringObjectLen(argv[j]);
@@ -244,40 +598,66 @@ void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
             len = ll2string(aux+1,sizeof(aux)-1,objlen);
             aux[len+1] = '\r';
             aux[len+2] = '\n';
-            feedReplicationBacklog(aux,len+3);
-            feedReplicationBacklogWithObject(argv[j]);
-            feedReplicationBacklog(aux+len+1,2);
+            feedReplicationStream(aux,len+3);
+            feedReplicationStreamWithObject(argv[j]);
+            feedReplicationStream(aux+len+1,2);
         }
     }
+    replicationCheckSlavesLimits(slaves,server.repl_buffer);
+}
 
-    /* Write the command to every slave. */
-    listIter li(slaves);
-    while((ln = li.listNext())) {
-        client *slave = (client *)ln->listNodeValue();
+/* Like replicationFeedSlaves() for the operations of 'ops' having the
+ * PROPAGATE_REPL target, that are fed to the replication stream with a
+ * single append. Used to propagate the commands of a transaction, see
+ * execFlushPropagation(). */
+void replicationFeedSlavesOps(list *slaves, redisOp *ops, int numops) {
+    char aux[LONG_STR_SIZE+3];
+    sds buf;
+    int j, k, len;
 
-        /* Don't feed slaves that are still waiting for BGSAVE to start */
-        if (slave->m_replication_state == SLAVE_STATE_WAIT_BGSAVE_START) continue;
+    if (server.masterhost != NULL) return;
+    if (server.repl_backlog == NULL && slaves->listLength() == 0) return;
+    serverAssert(!(slaves->listLength() != 0 && server.repl_backlog == NULL));
 
-        /* Feed slaves that are waiting for the initial SYNC (so these commands
-         * are queued in the output buffer until the initial SYNC completes),
-         * or are already in sync with the master. */
+    buf = sdsempty();
+    for (j = 0; j < numops; j++) {
+        redisOp *op = ops+j;
 
-        /* Add the multi bulk length. */
-        slave->addReplyMultiBulkLen(argc);
+        if (!(op->target & PROPAGATE_REPL)) continue;
+        if (server.slaveseldb != op->dbid) {
+            len = ll2string(aux,sizeof(aux),op->dbid);
+            buf = sdscatprintf(buf,"*2\r\n$6\r\nSELECT\r\n$%d\r\n%s\r\n",
+                len,aux);
+            server.slaveseldb = op->dbid;
+        }
+        buf = sdscatprintf(buf,"*%d\r\n",op->argc);
+        for (k = 0; k < op->argc; k++) {
+            robj *o = op->argv[k];
+
+            if (o->encoding == OBJ_ENCODING_INT) {
+                len = ll2string(aux,sizeof(aux),(long)o->ptr);
+                buf = sdscatprintf(buf,"$%d\r\n",len);
+                buf = sdscatlen(buf,aux,len);
+            } else {
+                buf = sdscatprintf(buf,"$%zu\r\n",sdslen((sds)o->ptr));
+                buf = sdscatlen(buf,o->ptr,sdslen((sds)o->ptr));
+            }
+            buf = sdscatlen(buf,"\r\n",2);
+        }
+    }
 
-        /* Finally any additional argument that was not stored inside the
-         * static buffer if any (from j to argc). */
-        for (j = 0; j < argc; j++)
-            slave->addReplyBulk(argv[j]);
+    if (sdslen(buf) && server.repl_backlog) {
+        replicationPrepareSlavesToWrite(slaves,server.repl_buffer);
+        feedReplicationStream(buf,sdslen(buf));
+        replicationCheckSlavesLimits(slaves,server.repl_buffer);
     }
+    sdsfree(buf);
 }
 
 /* This function is used in order to proxy what we receive from our master
  * to our sub-slaves. */
 #include <ctype.h>
 void replicationFeedSlavesFromMasterStream(list *slaves, char *buf, size_t buflen) {
-    listNode *ln;
-
     /* Debugging: this is handy to see the stream sent from master
      * to slaves. Disabled with if(0). */
     if (0) {
@@ -288,15 +668,43 @@ void replicationFeedSlavesFromMasterStream(list *slaves, char *buf, size_t bufle
         printf("\n");
     }
 
-    if (server.repl_backlog) feedReplicationBacklog(buf,buflen);
-    listIter li(slaves);
+    replicationPrepareSlavesToWrite(slaves,server.repl_buffer);
+    if (server.repl_backlog) feedReplicationStream(buf,buflen);
+    replicationCheckSlavesLimits(slaves,server.repl_buffer);
+}
+
+/* Send the slaves that receive the LZF framed stream what was added to
+ * the replication stream since the last call. The data is compressed once,
+ * into the buffer they share. This is called before sleeping, so a frame
+ * holds the writes of a whole event loop iteration, and every time the set
+ * of slaves receiving the stream changes, so that a new slave never gets
+ * the writes performed before it was attached. */
+void replicationFlushCompressedStream() {
+    listNode *ln;
+    int slaves = 0;
+    sds frames;
+
+    listIter li(server.slaves);
     while((ln = li.listNext())) {
         client *slave = (client *)ln->listNodeValue();
-
-        /* Don't feed slaves that are still waiting for BGSAVE to start */
-        if (slave->m_replication_state == SLAVE_STATE_WAIT_BGSAVE_START) continue;
-        slave->addReplyString(buf,buflen);
+        if (slave->m_repl_compress) slaves++;
+    }
+    server.repl_compress_slaves = slaves;
+    if (sdslen(server.repl_compress_buf) == 0) return;
+    if (slaves == 0) {
+        sdsclear(server.repl_compress_buf);
+        return;
     }
+
+    frames = replFrameEncode(sdsempty(),server.repl_compress_buf,
+                             sdslen(server.repl_compress_buf));
+    server.stat_repl_compress_in += sdslen(server.repl_compress_buf);
+    server.stat_repl_compress_out += sdslen(frames);
+    replicationPrepareSlavesToWrite(server.slaves,server.repl_compress_buffer);
+    server.repl_compress_buffer->replBufferAppend(frames,sdslen(frames));
+    replicationCheckSlavesLimits(server.slaves,server.repl_compress_buffer);
+    sdsfree(frames);
+    sdsclear(server.repl_compress_buf);
 }
 
 void replicationFeedMonitors(client *c, list *monitors, int dictid, robj **argv, int argc) {
@@ -338,15 +746,23 @@ void replicationFeedMonitors(client *c, list *monitors, int dictid, robj **argv,
 }
 
 /* Feed the slave 'c' with the replication backlog starting from the
- * specified 'offset' up to the end of the backlog. */
+ * specified 'offset' up to the end of the backlog. If 'offset' is before
+ * the memory backlog, the history on disk up to it was already prepared
+ * with replicationBacklogDiskOpen(), and is sent by sendBacklogToSlave():
+ * here only the memory backlog is queued, but the returned length is the
+ * total. */
 long long addReplyReplicationBacklog(client *c, long long offset) {
-    long long j, skip, len;
+    long long j, skip, len, disklen = 0;
 
     serverLog(LL_DEBUG, "[PSYNC] Slave request offset: %lld", offset);
 
+    if (offset < server.repl_backlog_off) {
+        disklen = server.repl_backlog_off-offset;
+        offset = server.repl_backlog_off;
+    }
     if (server.repl_backlog_histlen == 0) {
         serverLog(LL_DEBUG, "[PSYNC] Backlog history len is zero");
-        return 0;
+        return disklen;
     }
 
     serverLog(LL_DEBUG, "[PSYNC] Backlog size: %lld",
@@ -382,11 +798,15 @@ long long addReplyReplicationBacklog(client *c, long long offset) {
             (server.repl_backlog_size - j) : len;
 
         serverLog(LL_DEBUG, "[PSYNC] addReply() length: %lld", thislen);
-        c->addReplySds(sdsnewlen(server.repl_backlog + j, thislen));
+        if (c->m_repl_compress)
+            c->addReplySds(replFrameEncode(sdsempty(),
+                server.repl_backlog + j, thislen));
+        else
+            c->addReplySds(sdsnewlen(server.repl_backlog + j, thislen));
         len -= thislen;
         j = 0;
     }
-    return server.repl_backlog_histlen - skip;
+    return disklen + server.repl_backlog_histlen - skip;
 }
 
 /* Return the offset to provide as reply to the PSYNC command received
@@ -417,8 +837,10 @@ int replicationSetupSlaveForFullResync(client *slave, long long offset) {
     char buf[128];
     int buflen;
 
+    replicationFlushCompressedStream();
     slave->m_psync_initial_offset = offset;
     slave->m_replication_state = SLAVE_STATE_WAIT_BGSAVE_END;
+    slave->replicationAttachBuffer();
     /* We are going to accumulate the incremental changes for this
      * slave as well. Set slaveseldb to -1 in order to force to re-emit
      * a SELECT statement in the replication stream. */
@@ -427,8 +849,9 @@ int replicationSetupSlaveForFullResync(client *slave, long long offset) {
     /* Don't send this reply to slaves that approached us with
      * the old SYNC command. */
     if (!(slave->m_flags & CLIENT_PRE_PSYNC)) {
-        buflen = snprintf(buf,sizeof(buf),"+FULLRESYNC %s %lld\r\n",
-                          server.replid,offset);
+        buflen = snprintf(buf,sizeof(buf),"+FULLRESYNC %s %lld%s\r\n",
+                          server.replid,offset,
+                          slave->m_repl_compress ? " LZF" : "");
         if (write(slave->m_fd,buf,buflen) != buflen) {
             freeClientAsync(slave);
             return C_ERR;
@@ -487,7 +910,7 @@ int masterTryPartialResynchronization(client *c) {
 
     /* We still have the data our slave is asking for? */
     if (!server.repl_backlog ||
-        psync_offset < server.repl_backlog_off ||
+        psync_offset < replicationBacklogFirstByte() ||
         psync_offset > (server.repl_backlog_off + server.repl_backlog_histlen))
     {
         serverLog(LL_NOTICE,
@@ -499,12 +922,30 @@ int masterTryPartialResynchronization(client *c) {
         goto need_full_resync;
     }
 
+    /* The older part of the history may be on disk. It is sent as it was
+     * saved, so this slave will not get the stream framed. */
+    if (psync_offset < server.repl_backlog_off) {
+        if (replicationBacklogDiskOpen(c,psync_offset) == C_ERR) {
+            serverLog(LL_WARNING,"Unable to partial resync with slave %s: "
+                "can't access the backlog on disk: %s",
+                c->replicationGetSlaveName(), strerror(errno));
+            goto need_full_resync;
+        }
+        c->m_repl_compress = 0;
+        c->m_replication_db_fd = -1;
+        c->m_replication_db_preamble = NULL;
+    }
+
     /* If we reached this point, we are able to perform a partial resync:
      * 1) Set client state to make it a slave.
      * 2) Inform the client we can continue with +CONTINUE
-     * 3) Send the backlog data (from the offset to the end) to the slave. */
+     * 3) Send the backlog data (from the offset to the end) to the slave.
+     *
+     * A slave receiving history from disk waits in the SEND_BULK state,
+     * as for the RDB file, so that its output buffer is sent later. */
     c->m_flags |= CLIENT_SLAVE;
-    c->m_replication_state = SLAVE_STATE_ONLINE;
+    c->m_replication_state = c->m_repl_disk_ranges ? SLAVE_STATE_SEND_BULK :
+                                                     SLAVE_STATE_ONLINE;
     c->m_replication_ack_time = server.unixtime;
     c->m_repl_put_online_on_ack = 0;
     server.slaves->listAddNodeTail(c);
@@ -512,7 +953,8 @@ int masterTryPartialResynchronization(client *c) {
      * new commands at this stage. But we are sure the socket send buffer is
      * empty so this write will never fail actually. */
     if (c->m_slave_capabilities & SLAVE_CAPA_PSYNC2) {
-        buflen = snprintf(buf,sizeof(buf),"+CONTINUE %s\r\n", server.replid);
+        buflen = snprintf(buf,sizeof(buf),"+CONTINUE %s%s\r\n", server.replid,
+                          c->m_repl_compress ? " LZF" : "");
     } else {
         buflen = snprintf(buf,sizeof(buf),"+CONTINUE\r\n");
     }
@@ -521,6 +963,14 @@ int masterTryPartialResynchronization(client *c) {
         return C_OK;
     }
     psync_len = addReplyReplicationBacklog(c,psync_offset);
+    c->replicationAttachBuffer();
+    if (c->m_repl_disk_ranges &&
+        server.el->aeCreateFileEvent(c->m_fd,AE_WRITABLE,sendBacklogToSlave,c)
+        == AE_ERR)
+    {
+        freeClientAsync(c);
+        return C_OK;
+    }
     serverLog(LL_NOTICE,
         "Partial resynchronization request from %s accepted. Sending %lld bytes of backlog starting from offset %lld.",
             c->replicationGetSlaveName(),
@@ -540,6 +990,153 @@ need_full_resync:
     return C_ERR;
 }
 
+/* ----------------------- Resumable diskless transfers ----------------------
+ * With repl-diskless-resume-window set, the child streaming the RDB to the
+ * slaves also writes the very same stream ($EOF:<mark>\r\n<rdb><mark>) into a
+ * spool file, that is kept for the configured window after the transfer
+ * ended. A slave that lost the link in the middle of the transfer keeps
+ * the part it received, and when it reconnects sends, after its
+ * capabilities:
+ *
+ * REPLCONF rdb-resume <mark> rdb-resume-offset <bytes received>
+ *
+ * If the spool is still the one of that transfer and the backlog still has
+ * the writes performed since the RDB was produced, PSYNC is replied with
+ * +RESUME, followed by the $EOF:<mark> header, the rest of the spool from
+ * the slave offset, and the backlog. Otherwise the usual full resync is
+ * performed.
+ * --------------------------------------------------------------------------*/
+
+#define REPL_SPOOL_HEADER_LEN (5+RDB_EOF_MARK_SIZE+2)
+
+/* Remove the spool of the last diskless transfer, if any. */
+void replicationSpoolDiscard() {
+    if (server.repl_spool_file == NULL) return;
+    unlink(server.repl_spool_file);
+    zfree(server.repl_spool_file);
+    server.repl_spool_file = NULL;
+    server.repl_spool_size = -1;
+}
+
+/* Called by rdbSaveToSlavesSockets() before forking: return the fd of a new
+ * spool for the transfer that is going to start, or -1 if transfers can't
+ * be resumed. The slaves being served were already setup for the full
+ * resync, so we know the replication ID and offset they received. */
+int replicationSpoolCreate() {
+    char spoolfile[256];
+    int fd;
+
+    replicationSpoolDiscard();
+    if (server.repl_diskless_resume_window == 0) return -1;
+    snprintf(spoolfile,sizeof(spoolfile),"temp-spool-%d.rdb",(int) getpid());
+    if ((fd = open(spoolfile,O_WRONLY|O_CREAT|O_TRUNC,0644)) == -1) {
+        serverLog(LL_WARNING,"Can't create the spool to resume the diskless "
+                             "transfer: %s", strerror(errno));
+        return -1;
+    }
+    server.repl_spool_file = zstrdup(spoolfile);
+    memcpy(server.repl_spool_replid,server.replid,sizeof(server.replid));
+    server.repl_spool_offset = getPsyncInitialOffset();
+    server.repl_spool_size = -1;
+    return fd;
+}
+
+/* Called when the diskless transfer child terminated: the spool can be
+ * used to resume the transfer only if the child wrote the whole stream. */
+void replicationSpoolDone(int ok) {
+    struct redis_stat sb;
+
+    if (server.repl_spool_file == NULL) return;
+    if (!ok || redis_stat(server.repl_spool_file,&sb) == -1 ||
+        sb.st_size <= REPL_SPOOL_HEADER_LEN)
+    {
+        replicationSpoolDiscard();
+        return;
+    }
+    server.repl_spool_size = sb.st_size;
+    server.repl_spool_time = server.unixtime;
+    serverLog(LL_NOTICE,"Diskless transfer spooled (%lld bytes), it can be "
+        "resumed for %d seconds", (long long) server.repl_spool_size,
+        server.repl_diskless_resume_window);
+}
+
+/* Try to resume the diskless transfer the slave asked about with REPLCONF
+ * rdb-resume. Return C_OK if the request was handled, C_ERR if a full
+ * resync is needed. */
+int masterTryRdbResume(client *c) {
+    char header[REPL_SPOOL_HEADER_LEN];
+    long long offset = server.repl_spool_offset+1;
+    int fd;
+
+    if (server.repl_spool_file == NULL) return C_ERR;
+    if ((fd = open(server.repl_spool_file,O_RDONLY)) == -1) return C_ERR;
+    if (read(fd,header,sizeof(header)) != sizeof(header) ||
+        memcmp(header+5,c->m_resume_mark,RDB_EOF_MARK_SIZE) != 0)
+    {
+        serverLog(LL_NOTICE,"Diskless transfer resume not accepted: the "
+            "transfer of slave %s is not the last one",
+            c->replicationGetSlaveName());
+        close(fd);
+        return C_ERR;
+    }
+
+    /* The child is still writing the spool: it is the right transfer but
+     * the slave has to wait for it to complete. */
+    if (server.repl_spool_size == -1) {
+        close(fd);
+        c->addReplySds(sdsnew("-RESUMEWAIT Diskless transfer still in progress\r\n"));
+        return C_OK;
+    }
+
+    if (strcmp(server.repl_spool_replid,server.replid) ||
+        c->m_resume_offset > server.repl_spool_size-REPL_SPOOL_HEADER_LEN ||
+        !server.repl_backlog ||
+        offset < server.repl_backlog_off ||
+        offset > (server.repl_backlog_off + server.repl_backlog_histlen))
+    {
+        serverLog(LL_NOTICE,"Diskless transfer resume not accepted: the "
+            "replication ID changed or the backlog lacks the writes since "
+            "the transfer of slave %s started", c->replicationGetSlaveName());
+        close(fd);
+        return C_ERR;
+    }
+
+    /* Setup the slave as one that is receiving the RDB file from disk,
+     * with the accumulated writes being the backlog since the RDB was
+     * produced. The spool has the stream as it was sent to the slaves that
+     * don't get it framed, so this slave will not get it framed either. */
+    c->m_repl_compress = 0;
+    c->m_flags |= CLIENT_SLAVE;
+    c->m_replication_state = SLAVE_STATE_SEND_BULK;
+    c->m_psync_initial_offset = server.repl_spool_offset;
+    c->m_replication_db_fd = fd;
+    c->m_replication_db_file_offset = REPL_SPOOL_HEADER_LEN+c->m_resume_offset;
+    c->m_replication_db_file_size = server.repl_spool_size;
+    c->m_replication_db_preamble = sdsnewlen(header,sizeof(header));
+    server.slaves->listAddNodeTail(c);
+    if (server.repl_disable_tcp_nodelay)
+        anetDisableTcpNoDelay(NULL, c->m_fd); /* Non critical if it fails. */
+
+    /* As for +CONTINUE the socket send buffer is empty. */
+    if (write(c->m_fd,"+RESUME\r\n",9) != 9) {
+        freeClientAsync(c);
+        return C_OK;
+    }
+    addReplyReplicationBacklog(c,offset);
+    c->replicationAttachBuffer();
+    if (server.el->aeCreateFileEvent(c->m_fd,AE_WRITABLE,sendBulkToSlave,c)
+        == AE_ERR)
+    {
+        freeClientAsync(c);
+        return C_OK;
+    }
+    serverLog(LL_NOTICE,"Resuming the diskless transfer of slave %s from "
+        "byte %lld of %lld", c->replicationGetSlaveName(),
+        c->m_resume_offset,
+        (long long) server.repl_spool_size-REPL_SPOOL_HEADER_LEN);
+    return C_OK;
+}
+
 /* Start a BGSAVE for replication goals, which is, selecting the disk or
  * socket target depending on the configuration, and making sure that
  * the script cache is flushed before to start.
@@ -644,6 +1241,17 @@ void syncCommand(client *c) {
     serverLog(LL_NOTICE,"Slave %s asks for synchronization",
         c->replicationGetSlaveName());
 
+    /* The stream of the slaves attached so far is not for this one. */
+    replicationFlushCompressedStream();
+    if (server.repl_compression &&
+        !strcasecmp((const char*)c->m_argv[0]->ptr,"psync") &&
+        (c->m_slave_capabilities & SLAVE_CAPA_LZF) &&
+        (c->m_slave_capabilities & SLAVE_CAPA_PSYNC2))
+    {
+        c->m_repl_compress = 1;
+        server.repl_compress_slaves++;
+    }
+
     /* Try a partial resynchronization if this is a PSYNC command.
      * If it fails, we continue with usual full resynchronization, however
      * when this happens masterTryPartialResynchronization() already
@@ -666,6 +1274,13 @@ void syncCommand(client *c) {
              * resync. */
             if (master_replid[0] != '?') server.stat_sync_partial_err++;
         }
+
+        /* A slave interrupted in the middle of a diskless transfer may be
+         * able to get just the rest of it. */
+        if (c->m_resume_offset != -1 && masterTryRdbResume(c) == C_OK) {
+            if (c->m_flags & CLIENT_SLAVE) server.stat_sync_resume_ok++;
+            return;
+        }
     } else {
         /* If a slave uses SYNC, we are dealing with an old implementation
          * of the replication protocol (like redis-cli --slave). Flag the client
@@ -711,8 +1326,11 @@ void syncCommand(client *c) {
             if (slave->m_replication_state == SLAVE_STATE_WAIT_BGSAVE_END) break;
         }
         /* To attach this slave, we check that it has at least all the
-         * capabilities of the slave that triggered the current BGSAVE. */
-        if (ln && ((c->m_slave_capabilities & slave->m_slave_capabilities) == slave->m_slave_capabilities)) {
+         * capabilities of the slave that triggered the current BGSAVE,
+         * and gets the stream framed or not as that one. */
+        if (ln && ((c->m_slave_capabilities & slave->m_slave_capabilities) == slave->m_slave_capabilities) &&
+            c->m_repl_compress == slave->m_repl_compress)
+        {
             /* Perfect, the server is already registering differences for
              * another slave. Set the right state, and copy the buffer. */
             copyClientOutputBuffer(c, slave);
@@ -803,6 +1421,30 @@ void replconfCommand(client *c) {
                 c->m_slave_capabilities |= SLAVE_CAPA_EOF;
             else if (!strcasecmp((const char*)c->m_argv[j+1]->ptr,"psync2"))
                 c->m_slave_capabilities |= SLAVE_CAPA_PSYNC2;
+            else if (!strcasecmp((const char*)c->m_argv[j+1]->ptr,"lzf"))
+                c->m_slave_capabilities |= SLAVE_CAPA_LZF;
+        } else if (!strcasecmp((const char*)c->m_argv[j]->ptr,"rdb-resume")) {
+            /* The diskless transfer the slave wants to resume, identified
+             * by its EOF mark, see masterTryRdbResume(). */
+            sds mark = (sds)c->m_argv[j+1]->ptr;
+            if (sdslen(mark) != RDB_EOF_MARK_SIZE) {
+                c->addReplyError("Invalid diskless transfer mark");
+                return;
+            }
+            memcpy(c->m_resume_mark,mark,RDB_EOF_MARK_SIZE+1);
+        } else if (!strcasecmp((const char*)c->m_argv[j]->ptr,
+                               "rdb-resume-offset"))
+        {
+            long long offset;
+
+            if ((getLongLongFromObjectOrReply(c,c->m_argv[j+1],
+                    &offset,NULL) != C_OK))
+                return;
+            if (offset < 0 || c->m_resume_mark[0] == '\0') {
+                c->addReplyError("Invalid diskless transfer offset");
+                return;
+            }
+            c->m_resume_offset = offset;
         } else if (!strcasecmp((const char*)c->m_argv[j]->ptr,"ack")) {
             /* REPLCONF ACK is used by slave to inform the master the amount
              * of replication stream that it processed so far. It is an
@@ -812,8 +1454,10 @@ void replconfCommand(client *c) {
             if (!(c->m_flags & CLIENT_SLAVE)) return;
             if ((getLongLongFromObject(c->m_argv[j+1], &offset) != C_OK))
                 return;
-            if (offset > c->m_replication_ack_off)
+            if (offset > c->m_replication_ack_off) {
                 c->m_replication_ack_off = offset;
+                server.slaves_acks_changed = 1;
+            }
             c->m_replication_ack_time = server.unixtime;
             /* If this was a diskless replication, we need to really put
              * the slave online when the first ACK is received (which
@@ -851,6 +1495,7 @@ void replconfCommand(client *c) {
 void putSlaveOnline(client *slave) {
     slave->m_replication_state = SLAVE_STATE_ONLINE;
     slave->m_repl_put_online_on_ack = 0;
+    server.slaves_acks_changed = 1;
     slave->m_replication_ack_time = server.unixtime; /* Prevent false timeout. */
     if (server.el->aeCreateFileEvent(slave->m_fd, AE_WRITABLE,
         sendReplyToClient, slave) == AE_ERR) {
@@ -867,7 +1512,6 @@ void sendBulkToSlave(aeEventLoop *el, int fd, void *privdata, int mask) {
     client *slave = (client *)privdata;
     UNUSED(el);
     UNUSED(mask);
-    char buf[PROTO_IOBUF_LEN];
     ssize_t nwritten, buflen;
 
     /* Before sending the RDB file, we send the preamble as configured by the
@@ -892,23 +1536,53 @@ void sendBulkToSlave(aeEventLoop *el, int fd, void *privdata, int mask) {
         }
     }
 
-    /* If the preamble was already transfered, send the RDB bulk data. */
-    lseek(slave->m_replication_db_fd,slave->m_replication_db_file_offset,SEEK_SET);
-    buflen = read(slave->m_replication_db_fd,buf,PROTO_IOBUF_LEN);
+    /* If the preamble was already transfered, send the RDB bulk data.
+     * The amount sent per event adapts to the slave link: it doubles while
+     * the socket takes it all, up to REPL_BULK_MAX_CHUNK, and halves on
+     * short writes, so that fast slaves get the file in a few big writes
+     * while slow ones don't hold the event loop. */
+    if (slave->m_replication_db_chunk == 0)
+        slave->m_replication_db_chunk = PROTO_IOBUF_LEN;
+    buflen = slave->m_replication_db_file_size-slave->m_replication_db_file_offset;
+    if (buflen > (ssize_t)slave->m_replication_db_chunk)
+        buflen = slave->m_replication_db_chunk;
+#ifdef HAVE_SENDFILE
+    off_t off = slave->m_replication_db_file_offset;
+    nwritten = sendfile(fd,slave->m_replication_db_fd,&off,buflen);
+    if (nwritten == 0) {
+        serverLog(LL_WARNING,"Read error sending DB to slave: premature EOF");
+        freeClient(slave);
+        return;
+    }
+#else
+    char buf[PROTO_IOBUF_LEN];
+    if (buflen > (ssize_t)sizeof(buf)) buflen = sizeof(buf);
+    buflen = pread(slave->m_replication_db_fd,buf,buflen,
+                   slave->m_replication_db_file_offset);
     if (buflen <= 0) {
         serverLog(LL_WARNING,"Read error sending DB to slave: %s",
             (buflen == 0) ? "premature EOF" : strerror(errno));
         freeClient(slave);
         return;
     }
-    if ((nwritten = write(fd,buf,buflen)) == -1) {
+    nwritten = write(fd,buf,buflen);
+#endif
+    if (nwritten == -1) {
         if (errno != EAGAIN) {
             serverLog(LL_WARNING,"Write error sending DB to slave: %s",
                 strerror(errno));
             freeClient(slave);
+        } else if (slave->m_replication_db_chunk > PROTO_IOBUF_LEN) {
+            slave->m_replication_db_chunk /= 2;
         }
         return;
     }
+    if (nwritten == buflen) {
+        if (slave->m_replication_db_chunk < REPL_BULK_MAX_CHUNK)
+            slave->m_replication_db_chunk *= 2;
+    } else if (slave->m_replication_db_chunk > PROTO_IOBUF_LEN) {
+        slave->m_replication_db_chunk /= 2;
+    }
     slave->m_replication_db_file_offset += nwritten;
     server.stat_net_output_bytes += nwritten;
     if (slave->m_replication_db_file_offset == slave->m_replication_db_file_size) {
@@ -1075,6 +1749,7 @@ void replicationCreateMasterClient(int fd, int dbid) {
     server.master->m_authenticated = 1;
     server.master->m_applied_replication_offset = server.master_initial_offset;
     server.master->m_read_replication_offset = server.master->m_applied_replication_offset;
+    server.master->m_repl_compress = server.master_compress;
     memcpy(server.master->m_master_replication_id, server.master_replid,
         sizeof(server.master_replid));
     /* If master offset is set to -1, this master is old and is not
@@ -1099,6 +1774,122 @@ void restartAOF() {
 
 /* Asynchronously read the SYNC payload we receive from a master */
 #define REPL_MAX_WRITTEN_BEFORE_FSYNC (1024*1024*8) /* 8 MB */
+/* Final setup of the connected slave <- master link, once the RDB sent by
+ * the master for a full resynchronization was loaded. */
+static void replicationFinishFullSync(rdbSaveInfo *rsi, int aof_is_enabled) {
+    replicationCreateMasterClient(server.repl_transfer_s,rsi->repl_stream_db);
+    server.repl_state = REPL_STATE_CONNECTED;
+    /* After a full resynchroniziation we use the replication ID and
+     * offset of the master. The secondary ID / offset are cleared since
+     * we are starting a new history. */
+    memcpy(server.replid,server.master->m_master_replication_id,sizeof(server.replid));
+    server.master_repl_offset = server.master->m_applied_replication_offset;
+    clearReplicationId2();
+    /* Let's create the replication backlog if needed. Slaves need to
+     * accumulate the backlog regardless of the fact they have sub-slaves
+     * or not, in order to behave correctly if they are promoted to
+     * masters after a failover. */
+    if (server.repl_backlog == NULL) createReplicationBacklog();
+
+    serverLog(LL_NOTICE, "MASTER <-> SLAVE sync: Finished with success");
+    /* Restart the AOF subsystem now that we finished the sync. This
+     * will trigger an AOF rewrite, and when done will start appending
+     * to the new file. */
+    if (aof_is_enabled) restartAOF();
+}
+
+/* Load the RDB sent by the master straight from the socket, instead of
+ * writing it to a temp file to load it from disk, see repl-diskless-load.
+ * 'eofmark' is the mark terminating the payload, or NULL when its size is
+ * server.repl_transfer_size. The load is synchronous as from disk: the
+ * master socket is read with the timeout of the replication link. */
+static void readSyncBulkPayloadFromSocket(int fd, const char *eofmark) {
+    int aof_is_enabled = server.aof_state != AOF_OFF;
+    /* See readSyncBulkPayload() about repl-async-load. */
+    int async_load = server.repl_async_load &&
+                     server.repl_serve_stale_data &&
+                     !server.cluster_enabled;
+    redisDb *tempDb = NULL;
+    rdbSaveInfo rsi = RDB_SAVE_INFO_INIT;
+    int retval;
+
+    /* Nothing is kept on disk to resume the transfer. */
+    server.repl_transfer_resumable = 0;
+    if (aof_is_enabled) stopAppendOnly();
+    if (async_load) {
+        tempDb = initTempDb();
+    } else {
+        serverLog(LL_NOTICE, "MASTER <-> SLAVE sync: Flushing old data");
+        signalFlushedDb(-1);
+        emptyDb(
+            -1,
+            server.repl_slave_lazy_flush ? EMPTYDB_ASYNC : EMPTYDB_NO_FLAGS,
+            replicationEmptyDbCallback);
+    }
+    server.el->aeDeleteFileEvent(fd,AE_READABLE);
+    serverLog(LL_NOTICE, "MASTER <-> SLAVE sync: Loading DB in memory from "
+        "the socket%s", async_load ? ", serving the old data meanwhile" : "");
+    luaFunctionsFlush();
+
+    {
+        rioConnIO rdb(fd,eofmark ? -1 : server.repl_transfer_size,
+                      eofmark && server.master_compress,
+                      (long long)server.repl_timeout*1000);
+        char mark[CONFIG_RUN_ID_SIZE];
+
+        if (async_load) startAsyncLoading(NULL);
+        else startLoading(NULL);
+        if (!eofmark) server.loading_total_bytes = server.repl_transfer_size;
+        retval = rdbLoadRioInto(&rdb,&rsi,async_load ? tempDb : server.db);
+        stopLoading();
+
+        /* The payload must end with the RDB: the EOF mark follows it, and
+         * the master sends nothing else until we acknowledge it. */
+        if (retval == C_OK && eofmark &&
+            (rdb.rioRead(mark,sizeof(mark)) == 0 ||
+             memcmp(mark,eofmark,CONFIG_RUN_ID_SIZE) != 0))
+        {
+            serverLog(LL_WARNING,"Missing the EOF mark after the RDB "
+                                 "received from MASTER");
+            retval = C_ERR;
+        }
+        if (retval == C_OK && (rdb.rioConnPending() ||
+            (!eofmark && rdb.rioTell() != server.repl_transfer_size)))
+        {
+            serverLog(LL_WARNING,"Unexpected data after the RDB received "
+                                 "from MASTER");
+            retval = C_ERR;
+        }
+    }
+
+    if (retval != C_OK) {
+        serverLog(LL_WARNING,"Failed trying to load the MASTER "
+                             "synchronization DB from the socket");
+        /* Don't keep a partially loaded data set. */
+        if (tempDb) {
+            discardTempDb(tempDb,server.repl_slave_lazy_flush);
+        } else {
+            emptyDb(-1,
+                server.repl_slave_lazy_flush ? EMPTYDB_ASYNC : EMPTYDB_NO_FLAGS,
+                replicationEmptyDbCallback);
+        }
+        cancelReplicationHandshake();
+        if (aof_is_enabled) restartAOF();
+        return;
+    }
+    if (tempDb) {
+        serverLog(LL_NOTICE, "MASTER <-> SLAVE sync: Replacing the old data");
+        swapMainDbWithTempDb(tempDb);
+        discardTempDb(tempDb,server.repl_slave_lazy_flush);
+    }
+
+    /* The temp file was never written. */
+    close(server.repl_transfer_fd);
+    unlink(server.repl_transfer_tmpfile);
+    zfree(server.repl_transfer_tmpfile);
+    replicationFinishFullSync(&rsi,aof_is_enabled);
+}
+
 void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
     char buf[4096];
     ssize_t nread, readlen;
@@ -1112,6 +1903,10 @@ void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
     static char eofmark[CONFIG_RUN_ID_SIZE];
     static char lastbytes[CONFIG_RUN_ID_SIZE];
     static int usemark = 0;
+    /* Frames not yet decoded and data decoded, when the master sends the
+     * streamed RDB as LZF frames. */
+    static sds frames = NULL, rawdata = NULL;
+    char *data = buf;
     
     int eof_reached = 0;
 
@@ -1155,11 +1950,48 @@ void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
             usemark = 1;
             memcpy(eofmark,buf+5,CONFIG_RUN_ID_SIZE);
             memset(lastbytes,0,CONFIG_RUN_ID_SIZE);
+            if (frames == NULL) {
+                frames = sdsempty();
+                rawdata = sdsempty();
+            }
+            sdsclear(frames);
             /* Set any repl_transfer_size to avoid entering this code path
              * at the next call. */
             server.repl_transfer_size = 0;
-            serverLog(LL_NOTICE,
-                "MASTER <-> SLAVE sync: receiving streamed RDB from master");
+            if (server.repl_transfer_read) {
+                /* Resumed transfer: the master sent again the header of the
+                 * transfer, that must be the one we have the first part of,
+                 * and the last bytes we got may be part of the mark. */
+                off_t n = server.repl_transfer_read < CONFIG_RUN_ID_SIZE ?
+                          server.repl_transfer_read : CONFIG_RUN_ID_SIZE;
+
+                if (memcmp(eofmark,server.repl_resume_mark,
+                           CONFIG_RUN_ID_SIZE) != 0 ||
+                    pread(server.repl_transfer_fd,lastbytes+CONFIG_RUN_ID_SIZE-n,
+                          n,server.repl_transfer_read-n) != n)
+                {
+                    serverLog(LL_WARNING,"MASTER resumed a streamed RDB "
+                        "different from the one we received");
+                    server.repl_transfer_resumable = 0;
+                    goto error;
+                }
+                serverLog(LL_NOTICE,
+                    "MASTER <-> SLAVE sync: resuming streamed RDB from master "
+                    "at byte %lld", (long long) server.repl_transfer_read);
+            } else {
+                memcpy(server.repl_resume_mark,eofmark,CONFIG_RUN_ID_SIZE);
+                server.repl_resume_mark[CONFIG_RUN_ID_SIZE] = '\0';
+                memcpy(server.repl_resume_replid,server.master_replid,
+                       sizeof(server.master_replid));
+                server.repl_resume_initial_offset = server.master_initial_offset;
+                serverLog(LL_NOTICE,
+                    "MASTER <-> SLAVE sync: receiving streamed RDB from master");
+            }
+            /* Only a PSYNC full resync can be resumed, since the master needs
+             * the offset of the RDB to send the writes that followed it. */
+            server.repl_transfer_resumable =
+                server.repl_diskless_resume_window &&
+                server.master_initial_offset != -1;
         } else {
             usemark = 0;
             server.repl_transfer_size = strtol(buf+1,NULL,10);
@@ -1167,6 +1999,11 @@ void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
                 "MASTER <-> SLAVE sync: receiving %lld bytes from master",
                 (long long) server.repl_transfer_size);
         }
+
+        /* With repl-diskless-load the RDB is loaded while it is received.
+         * A resumed transfer continues the temp file instead. */
+        if (server.repl_diskless_load && server.repl_transfer_read == 0)
+            readSyncBulkPayloadFromSocket(fd,usemark ? eofmark : NULL);
         return;
     }
 
@@ -1187,23 +2024,39 @@ void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
     }
     server.stat_net_input_bytes += nread;
 
+    /* With LZF frames what follows is about the data of the frames that
+     * what we read completed, if any. */
+    if (usemark && server.master_compress) {
+        frames = sdscatlen(frames,buf,nread);
+        sdsclear(rawdata);
+        if (replFrameDecode(&frames,&rawdata) == -1) {
+            serverLog(LL_WARNING,"Corrupted frame in the streamed RDB "
+                                 "received from MASTER");
+            goto error;
+        }
+        server.repl_transfer_lastio = server.unixtime;
+        if (sdslen(rawdata) == 0) return;
+        data = rawdata;
+        nread = sdslen(rawdata);
+    }
+
     /* When a mark is used, we want to detect EOF asap in order to avoid
      * writing the EOF mark into the file... */
 
     if (usemark) {
         /* Update the last bytes array, and check if it matches our delimiter.*/
         if (nread >= CONFIG_RUN_ID_SIZE) {
-            memcpy(lastbytes,buf+nread-CONFIG_RUN_ID_SIZE,CONFIG_RUN_ID_SIZE);
+            memcpy(lastbytes,data+nread-CONFIG_RUN_ID_SIZE,CONFIG_RUN_ID_SIZE);
         } else {
             int rem = CONFIG_RUN_ID_SIZE-nread;
             memmove(lastbytes,lastbytes+nread,rem);
-            memcpy(lastbytes+rem,buf,nread);
+            memcpy(lastbytes+rem,data,nread);
         }
         if (memcmp(lastbytes,eofmark,CONFIG_RUN_ID_SIZE) == 0) eof_reached = 1;
     }
 
     server.repl_transfer_lastio = server.unixtime;
-    if (write(server.repl_transfer_fd,buf,nread) != nread) {
+    if (write(server.repl_transfer_fd,data,nread) != nread) {
         serverLog(LL_WARNING,"Write error or short write writing to the DB dump file needed for MASTER <-> SLAVE synchronization: %s", strerror(errno));
         goto error;
     }
@@ -1240,58 +2093,62 @@ void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
 
     if (eof_reached) {
         int aof_is_enabled = server.aof_state != AOF_OFF;
-
+        /* With repl-async-load the new dataset is loaded aside, while the
+         * clients keep reading the old one, and replaces it at the end. */
+        int async_load = server.repl_async_load &&
+                         server.repl_serve_stale_data &&
+                         !server.cluster_enabled;
+        redisDb *tempDb = NULL;
+
+        server.repl_transfer_resumable = 0;
         if (rename(server.repl_transfer_tmpfile,server.rdb_filename) == -1) {
             serverLog(LL_WARNING,"Failed trying to rename the temp DB into dump.rdb in MASTER <-> SLAVE synchronization: %s", strerror(errno));
             cancelReplicationHandshake();
             return;
         }
-        serverLog(LL_NOTICE, "MASTER <-> SLAVE sync: Flushing old data");
         /* We need to stop any AOFRW fork before flusing and parsing
          * RDB, otherwise we'll create a copy-on-write disaster. */
         if(aof_is_enabled) stopAppendOnly();
-        signalFlushedDb(-1);
-        emptyDb(
-            -1,
-            server.repl_slave_lazy_flush ? EMPTYDB_ASYNC : EMPTYDB_NO_FLAGS,
-            replicationEmptyDbCallback);
+        if (async_load) {
+            tempDb = initTempDb();
+        } else {
+            serverLog(LL_NOTICE, "MASTER <-> SLAVE sync: Flushing old data");
+            signalFlushedDb(-1);
+            emptyDb(
+                -1,
+                server.repl_slave_lazy_flush ? EMPTYDB_ASYNC : EMPTYDB_NO_FLAGS,
+                replicationEmptyDbCallback);
+        }
         /* Before loading the DB into memory we need to delete the readable
          * handler, otherwise it will get called recursively since
          * rdbLoad() will call the event loop to process events from time to
          * time for non blocking loading. */
         server.el->aeDeleteFileEvent(server.repl_transfer_s,AE_READABLE);
-        serverLog(LL_NOTICE, "MASTER <-> SLAVE sync: Loading DB in memory");
+        serverLog(LL_NOTICE, "MASTER <-> SLAVE sync: Loading DB in memory%s",
+            async_load ? ", serving the old data meanwhile" : "");
         rdbSaveInfo rsi = RDB_SAVE_INFO_INIT;
-        if (rdbLoad(server.rdb_filename,&rsi) != C_OK) {
+        /* The functions of the master replace ours, as the data. */
+        luaFunctionsFlush();
+        if (rdbLoadInto(server.rdb_filename,&rsi,
+                        async_load ? tempDb : server.db) != C_OK)
+        {
             serverLog(LL_WARNING,"Failed trying to load the MASTER synchronization DB from disk");
+            if (tempDb) discardTempDb(tempDb,server.repl_slave_lazy_flush);
             cancelReplicationHandshake();
             /* Re-enable the AOF if we disabled it earlier, in order to restore
              * the original configuration. */
             if (aof_is_enabled) restartAOF();
             return;
         }
+        if (tempDb) {
+            serverLog(LL_NOTICE, "MASTER <-> SLAVE sync: Replacing the old data");
+            swapMainDbWithTempDb(tempDb);
+            discardTempDb(tempDb,server.repl_slave_lazy_flush);
+        }
         /* Final setup of the connected slave <- master link */
         zfree(server.repl_transfer_tmpfile);
         close(server.repl_transfer_fd);
-        replicationCreateMasterClient(server.repl_transfer_s,rsi.repl_stream_db);
-        server.repl_state = REPL_STATE_CONNECTED;
-        /* After a full resynchroniziation we use the replication ID and
-         * offset of the master. The secondary ID / offset are cleared since
-         * we are starting a new history. */
-        memcpy(server.replid,server.master->m_master_replication_id,sizeof(server.replid));
-        server.master_repl_offset = server.master->m_applied_replication_offset;
-        clearReplicationId2();
-        /* Let's create the replication backlog if needed. Slaves need to
-         * accumulate the backlog regardless of the fact they have sub-slaves
-         * or not, in order to behave correctly if they are promoted to
-         * masters after a failover. */
-        if (server.repl_backlog == NULL) createReplicationBacklog();
-
-        serverLog(LL_NOTICE, "MASTER <-> SLAVE sync: Finished with success");
-        /* Restart the AOF subsystem now that we finished the sync. This
-         * will trigger an AOF rewrite, and when done will start appending
-         * to the new file. */
-        if (aof_is_enabled) restartAOF();
+        replicationFinishFullSync(&rsi,aof_is_enabled);
     }
     return;
 
@@ -1394,6 +2251,7 @@ char *sendSynchronousCommand(int flags, int fd, ...) {
  * PSYNC_WRITE_ERROR: There was an error writing the command to the socket.
  * PSYNC_WAIT_REPLY: Call again the function with read_reply set to 1.
  * PSYNC_TRY_LATER: Master is currently in a transient error condition.
+ * PSYNC_RESUME: The master resumes the interrupted diskless transfer.
  *
  * Notable side effects:
  *
@@ -1410,6 +2268,7 @@ char *sendSynchronousCommand(int flags, int fd, ...) {
 #define PSYNC_FULLRESYNC 3
 #define PSYNC_NOT_SUPPORTED 4
 #define PSYNC_TRY_LATER 5
+#define PSYNC_RESUME 6
 int slaveTryPartialResynchronization(int fd, int read_reply) {
     char *psync_replid;
     char psync_offset[32];
@@ -1423,6 +2282,7 @@ int slaveTryPartialResynchronization(int fd, int read_reply) {
          * right value, so that this information will be propagated to the
          * client structure representing the master into server.master. */
         server.master_initial_offset = -1;
+        server.master_compress = 0;
 
         if (server.cached_master) {
             psync_replid = server.cached_master->m_master_replication_id;
@@ -1476,19 +2336,41 @@ int slaveTryPartialResynchronization(int fd, int read_reply) {
              * replid to make sure next PSYNCs will fail. */
             memset(server.master_replid,0,CONFIG_RUN_ID_SIZE+1);
         } else {
+            char *end;
+
             memcpy(server.master_replid, replid, offset-replid-1);
             server.master_replid[CONFIG_RUN_ID_SIZE] = '\0';
-            server.master_initial_offset = strtoll(offset,NULL,10);
-            serverLog(LL_NOTICE,"Full resync from master: %s:%lld",
+            server.master_initial_offset = strtoll(offset,&end,10);
+            server.master_compress = !strcmp(end," LZF");
+            serverLog(LL_NOTICE,"Full resync from master: %s:%lld%s",
                 server.master_replid,
-                server.master_initial_offset);
+                server.master_initial_offset,
+                server.master_compress ? " (LZF framed)" : "");
         }
-        /* We are going to full resync, discard the cached master structure. */
+        /* We are going to full resync, discard the cached master structure
+         * and any interrupted transfer we were not able to resume. */
         replicationDiscardCachedMaster();
+        replicationDiscardResumeState();
         sdsfree(reply);
         return PSYNC_FULLRESYNC;
     }
 
+    if (!strncmp(reply,"+RESUME",7)) {
+        /* The master is going to send the rest of the interrupted diskless
+         * transfer: the replication ID and offset are the ones of its
+         * +FULLRESYNC reply. */
+        memcpy(server.master_replid,server.repl_resume_replid,
+               sizeof(server.master_replid));
+        server.master_initial_offset = server.repl_resume_initial_offset;
+        server.master_compress = 0;
+        serverLog(LL_NOTICE,"Resuming the full resync from master: %s:%lld",
+            server.master_replid,
+            server.master_initial_offset);
+        replicationDiscardCachedMaster();
+        sdsfree(reply);
+        return PSYNC_RESUME;
+    }
+
     if (!strncmp(reply,"+CONTINUE",9)) {
         /* Partial resync was accepted. */
         serverLog(LL_NOTICE,
@@ -1500,8 +2382,10 @@ int slaveTryPartialResynchronization(int fd, int read_reply) {
          * that our sub-slaves will be able to PSYNC with us after a
          * disconnection. */
         char *start = reply+10;
-        char *end = reply+9;
-        while(end[0] != '\r' && end[0] != '\n' && end[0] != '\0') end++;
+        char *end = reply[9] == ' ' ? reply+10 : reply+9;
+        while(end[0] != '\r' && end[0] != '\n' && end[0] != '\0' &&
+              end[0] != ' ') end++;
+        server.master_compress = !strcmp(end," LZF");
         if (end-start == CONFIG_RUN_ID_SIZE) {
             char _new[CONFIG_RUN_ID_SIZE+1];
             memcpy(_new,start,CONFIG_RUN_ID_SIZE);
@@ -1545,7 +2429,8 @@ int slaveTryPartialResynchronization(int fd, int read_reply) {
      * return PSYNC_TRY_LATER if we believe this is a transient error. */
 
     if (!strncmp(reply,"-NOMASTERLINK",13) ||
-        !strncmp(reply,"-LOADING",8))
+        !strncmp(reply,"-LOADING",8) ||
+        !strncmp(reply,"-RESUMEWAIT",11))
     {
         serverLog(LL_NOTICE,
             "Master is currently unable to PSYNC "
@@ -1568,11 +2453,41 @@ int slaveTryPartialResynchronization(int fd, int read_reply) {
     return PSYNC_NOT_SUPPORTED;
 }
 
+/* The TLS handshake with the master is done: the socket can now be used
+ * as a plain one, resume the replication handshake from the PING. */
+static void replicationTLSHandshakeDone(int fd, int ok, void *privdata) {
+    char *err;
+    UNUSED(privdata);
+
+    repl_tls_handshake = NULL;
+    if (!ok) {
+        serverLog(LL_WARNING,"TLS handshake with MASTER failed");
+        cancelReplicationHandshake();
+        return;
+    }
+    if (server.el->aeCreateFileEvent(fd,AE_READABLE,syncWithMaster,NULL) ==
+            AE_ERR)
+    {
+        serverLog(LL_WARNING,"Can't create readable event for SYNC");
+        cancelReplicationHandshake();
+        return;
+    }
+    server.repl_transfer_lastio = server.unixtime;
+    server.repl_state = REPL_STATE_RECEIVE_PONG;
+    err = sendSynchronousCommand(SYNC_CMD_WRITE,fd,"PING",NULL);
+    if (err) {
+        serverLog(LL_WARNING,"Sending command to master in replication handshake: %s", err);
+        sdsfree(err);
+        cancelReplicationHandshake();
+    }
+}
+
 /* This handler fires when the non blocking connect was able to
  * establish a connection with the master. */
 void syncWithMaster(aeEventLoop *el, int fd, void *privdata, int mask) {
     char tmpfile[256], *err = NULL;
     int dfd = -1, maxtries = 5;
+    off_t resumed = 0;
     int sockerr = 0, psync_result;
     socklen_t errlen = sizeof(sockerr);
     UNUSED(el);
@@ -1599,6 +2514,18 @@ void syncWithMaster(aeEventLoop *el, int fd, void *privdata, int mask) {
     /* Send a PING to check the master is able to reply without errors. */
     if (server.repl_state == REPL_STATE_CONNECTING) {
         serverLog(LL_NOTICE,"Non blocking connect for SYNC fired the event.");
+        /* With tls-replication no event is installed until the TLS
+         * handshake threads are done with the socket. */
+        if (server.tls_replication) {
+            server.el->aeDeleteFileEvent(fd,AE_READABLE|AE_WRITABLE);
+            repl_tls_handshake = tlsStartHandshake(fd,TLS_CONNECT,
+                replicationTLSHandshakeDone,NULL);
+            if (repl_tls_handshake == NULL) {
+                serverLog(LL_WARNING,"Can't start the TLS handshake with MASTER");
+                goto error;
+            }
+            return;
+        }
         /* Delete the writable event so that the readable event remains
          * registered and we can wait for the PONG reply. */
         server.el->aeDeleteFileEvent(fd,AE_WRITABLE);
@@ -1720,11 +2647,24 @@ void syncWithMaster(aeEventLoop *el, int fd, void *privdata, int mask) {
      *
      * EOF: supports EOF-style RDB transfer for diskless replication.
      * PSYNC2: supports PSYNC v2, so understands +CONTINUE <new repl ID>.
+ * LZF: can decode the LZF framed stream, see replframe.h.
      *
      * The master will ignore capabilities it does not understand. */
     if (server.repl_state == REPL_STATE_SEND_CAPA) {
-        err = sendSynchronousCommand(SYNC_CMD_WRITE,fd,"REPLCONF",
-                "capa","eof","capa","psync2",NULL);
+        if (replicationCanResume()) {
+            /* The resume options go last: masters not understanding them
+             * reply with an error, but then they already got our
+             * capabilities. */
+            sds offset = sdsfromlonglong(server.repl_resume_read);
+            err = sendSynchronousCommand(SYNC_CMD_WRITE,fd,"REPLCONF",
+                    "capa","eof","capa","psync2","capa","lzf",
+                    "rdb-resume",server.repl_resume_mark,
+                    "rdb-resume-offset",offset,NULL);
+            sdsfree(offset);
+        } else {
+            err = sendSynchronousCommand(SYNC_CMD_WRITE,fd,"REPLCONF",
+                    "capa","eof","capa","psync2","capa","lzf",NULL);
+        }
         if (err) goto write_error;
         sdsfree(err);
         server.repl_state = REPL_STATE_RECEIVE_CAPA;
@@ -1802,13 +2742,28 @@ void syncWithMaster(aeEventLoop *el, int fd, void *privdata, int mask) {
         }
     }
 
-    /* Prepare a suitable temp file for bulk transfer */
-    while(maxtries--) {
-        snprintf(tmpfile,256,
-            "temp-%d.%ld.rdb",(int)server.unixtime,(long int)getpid());
-        dfd = open(tmpfile,O_CREAT|O_WRONLY|O_EXCL,0644);
-        if (dfd != -1) break;
-        sleep(1);
+    /* Prepare a suitable temp file for bulk transfer, or continue to write
+     * the one of the transfer we are resuming, dropping what was written
+     * after the last byte we counted. */
+    if (psync_result == PSYNC_RESUME) {
+        snprintf(tmpfile,256,"%s",server.repl_resume_tmpfile);
+        dfd = open(tmpfile,O_RDWR);
+        if (dfd != -1 &&
+            (ftruncate(dfd,server.repl_resume_read) == -1 ||
+             lseek(dfd,0,SEEK_END) == -1))
+        {
+            close(dfd);
+            dfd = -1;
+        }
+        resumed = server.repl_resume_read;
+    } else {
+        while(maxtries--) {
+            snprintf(tmpfile,256,
+                "temp-%d.%ld.rdb",(int)server.unixtime,(long int)getpid());
+            dfd = open(tmpfile,O_CREAT|O_WRONLY|O_EXCL,0644);
+            if (dfd != -1) break;
+            sleep(1);
+        }
     }
     if (dfd == -1) {
         serverLog(LL_WARNING,"Opening the temp file needed for MASTER <-> SLAVE synchronization: %s",strerror(errno));
@@ -1827,11 +2782,17 @@ void syncWithMaster(aeEventLoop *el, int fd, void *privdata, int mask) {
 
     server.repl_state = REPL_STATE_TRANSFER;
     server.repl_transfer_size = -1;
-    server.repl_transfer_read = 0;
-    server.repl_transfer_last_fsync_off = 0;
+    server.repl_transfer_read = resumed;
+    server.repl_transfer_last_fsync_off = resumed;
     server.repl_transfer_fd = dfd;
     server.repl_transfer_lastio = server.unixtime;
     server.repl_transfer_tmpfile = zstrdup(tmpfile);
+    server.repl_transfer_resumable = 0;
+    if (psync_result == PSYNC_RESUME) {
+        /* The temp file is now the one of the transfer. */
+        zfree(server.repl_resume_tmpfile);
+        server.repl_resume_tmpfile = NULL;
+    }
     return;
 
 error:
@@ -1880,6 +2841,10 @@ int connectWithMaster() {
 void undoConnectWithMaster() {
     int fd = server.repl_transfer_s;
 
+    if (repl_tls_handshake) {
+        tlsCancelHandshake(repl_tls_handshake);
+        repl_tls_handshake = NULL;
+    }
     server.el->aeDeleteFileEvent(fd,AE_READABLE|AE_WRITABLE);
     close(fd);
     server.repl_transfer_s = -1;
@@ -1892,8 +2857,36 @@ void replicationAbortSyncTransfer() {
     serverAssert(server.repl_state == REPL_STATE_TRANSFER);
     undoConnectWithMaster();
     close(server.repl_transfer_fd);
-    unlink(server.repl_transfer_tmpfile);
-    zfree(server.repl_transfer_tmpfile);
+    if (server.repl_transfer_resumable && server.repl_transfer_read) {
+        /* Keep what we received of the diskless transfer: we may be able to
+         * resume it if we reconnect within the window. */
+        replicationDiscardResumeState();
+        server.repl_resume_tmpfile = server.repl_transfer_tmpfile;
+        server.repl_resume_read = server.repl_transfer_read;
+        server.repl_resume_since = server.unixtime;
+        serverLog(LL_NOTICE,"Keeping the %lld bytes received of the streamed "
+            "RDB to resume the transfer", (long long) server.repl_resume_read);
+    } else {
+        unlink(server.repl_transfer_tmpfile);
+        zfree(server.repl_transfer_tmpfile);
+    }
+    server.repl_transfer_resumable = 0;
+}
+
+/* Remove the interrupted diskless transfer we kept to resume it. */
+void replicationDiscardResumeState() {
+    if (server.repl_resume_tmpfile == NULL) return;
+    unlink(server.repl_resume_tmpfile);
+    zfree(server.repl_resume_tmpfile);
+    server.repl_resume_tmpfile = NULL;
+}
+
+/* Return 1 if there is an interrupted diskless transfer we can try to
+ * resume instead of starting a new full resync. */
+int replicationCanResume() {
+    return server.repl_resume_tmpfile != NULL &&
+           server.unixtime - server.repl_resume_since <=
+           server.repl_diskless_resume_window;
 }
 
 /* This function aborts a non blocking replication attempt if there is one
@@ -1955,6 +2948,7 @@ void replicationUnsetMaster() {
     if (server.master) freeClient(server.master);
     replicationDiscardCachedMaster();
     cancelReplicationHandshake();
+    replicationDiscardResumeState();
     /* Disconnecting all the slaves is required: we need to inform slaves
      * of the replication ID change (see shiftReplicationId() call). However
      * the slaves will be able to partially resync with us, so it will be
@@ -2091,6 +3085,19 @@ void replicationSendAck() {
         c->addReplyBulkCString("ACK");
         c->addReplyBulkLongLong(c->m_applied_replication_offset);
         c->m_flags &= ~CLIENT_MASTER_FORCE_REPLY;
+        server.repl_ack_sent_off = c->m_applied_replication_offset;
+    }
+}
+
+/* With slave-fast-ack, called before returning to the event loop in order
+ * to send an ACK to the master if we applied some of its stream since the
+ * last one, so that the clients of the master blocked in WAIT don't have to
+ * wait for the next REPLCONF GETACK to be answered. */
+void replicationSendAckIfNeeded() {
+    if (server.master &&
+        server.master->m_applied_replication_offset != server.repl_ack_sent_off)
+    {
+        replicationSendAck();
     }
 }
 
@@ -2127,6 +3134,7 @@ void client::replicationCacheMaster() {
      * pending outputs to the master. */
     sdsclear(server.master->m_query_buf);
     sdsclear(server.master->m_pending_query_buf);
+    sdsclear(server.master->m_repl_frames);
     server.master->m_read_replication_offset = server.master->m_applied_replication_offset;
     if (m_flags & CLIENT_MULTI)
         discardTransaction();
@@ -2199,10 +3207,13 @@ void replicationResurrectCachedMaster(int newfd) {
     server.master->m_flags &= ~(CLIENT_CLOSE_AFTER_REPLY|CLIENT_CLOSE_ASAP);
     server.master->m_authenticated = 1;
     server.master->m_last_interaction_time = server.unixtime;
+    server.master->m_repl_compress = server.master_compress;
     server.repl_state = REPL_STATE_CONNECTED;
 
     /* Re-add to the list of clients. */
     server.clients->listAddNodeTail(server.master);
+    raxInsert(server.clients_index,(unsigned char*)&server.master->m_client_id,
+              sizeof(server.master->m_client_id),server.master,NULL);
     if (server.el->aeCreateFileEvent(newfd, AE_READABLE,
                           readQueryFromClient, server.master)) {
         serverLog(LL_WARNING,"Error resurrecting the cached master, impossible to add the readable handler: %s", strerror(errno));
@@ -2378,6 +3389,24 @@ int replicationCountAcksByOffset(long long offset) {
     return count;
 }
 
+/* The clients blocked in WAIT are indexed by server.clients_waiting_acks, a
+ * radix tree whose keys are the replication offset the client waits for
+ * followed by the client ID, both big endian. This way the ACKs unblock the
+ * clients in order of offset, and the scan stops at the first offset that
+ * no slave reached yet, instead of checking every waiting client at every
+ * ACK. */
+#define WAIT_KEY_LEN 16
+
+static void waitingAcksKey(client *c, unsigned char *key) {
+    uint64_t offset = (uint64_t)c->m_blocking_state.m_replication_offset;
+    uint64_t id = c->m_client_id;
+
+    for (int j = 0; j < 8; j++) {
+        key[j] = (unsigned char)(offset >> (56-j*8));
+        key[8+j] = (unsigned char)(id >> (56-j*8));
+    }
+}
+
 /* WAIT for N replicas to acknowledge the processing of our latest
  * write command (and all the previous commands). */
 void waitCommand(client *c) {
@@ -2403,12 +3432,14 @@ void waitCommand(client *c) {
         return;
     }
 
-    /* Otherwise block the client and put it into our list of clients
+    /* Otherwise block the client and put it into our index of clients
      * waiting for ack from slaves. */
+    unsigned char key[WAIT_KEY_LEN];
     c->m_blocking_state.m_timeout = timeout;
     c->m_blocking_state.m_replication_offset = offset;
     c->m_blocking_state.m_num_replicas = numreplicas;
-    server.clients_waiting_acks->listAddNodeTail(c);
+    waitingAcksKey(c,key);
+    raxInsert(server.clients_waiting_acks,key,sizeof(key),c,NULL);
     blockClient(c,BLOCKED_WAIT);
 
     /* Make sure that the server will send an ACK request to all the slaves
@@ -2421,43 +3452,64 @@ void waitCommand(client *c) {
  * waiting for replica acks. Never call it directly, call unblockClient()
  * instead. */
 void unblockClientWaitingReplicas(client *c) {
-    listNode *ln = server.clients_waiting_acks->listSearchKey(c);
-    serverAssert(ln != NULL);
-    server.clients_waiting_acks->listDelNode(ln);
+    unsigned char key[WAIT_KEY_LEN];
+
+    waitingAcksKey(c,key);
+    int removed = raxRemove(server.clients_waiting_acks,key,sizeof(key),NULL);
+    serverAssert(removed);
+}
+
+static int compareAckOffsets(const void *a, const void *b) {
+    long long oa = *(const long long *)a, ob = *(const long long *)b;
+    return oa < ob ? -1 : (oa > ob);
 }
 
 /* Check if there are clients blocked in WAIT that can be unblocked since
- * we received enough ACKs from slaves. */
+ * we received enough ACKs from slaves. Called before returning to the event
+ * loop when some ACK advanced, so that all the ACKs of an iteration are
+ * processed at once. */
 void processClientsWaitingReplicas() {
-    long long last_offset = 0;
-    int last_num_replicas = 0;
-
+    server.slaves_acks_changed = 0;
+    if (server.clients_waiting_acks->numele == 0) return;
+
+    /* The offsets acknowledged by the online slaves, in ascending order:
+     * the slaves that reached the offset of a client are the ones from
+     * 'first' on, and 'first' only moves forward along the index. */
+    long long *acks = (long long *)
+        zmalloc(sizeof(long long)*(server.slaves->listLength()+1));
+    int numacks = 0, first = 0;
     listNode *ln;
-
-    listIter li(server.clients_waiting_acks);
+    listIter li(server.slaves);
     while((ln = li.listNext())) {
-        client *c = (client *)ln->listNodeValue();
-
-        /* Every time we find a client that is satisfied for a given
-         * offset and number of replicas, we remember it so the next client
-         * may be unblocked without calling replicationCountAcksByOffset()
-         * if the requested offset / replicas were equal or less. */
-        if (last_offset && last_offset > c->m_blocking_state.m_replication_offset &&
-                           last_num_replicas > c->m_blocking_state.m_num_replicas)
-        {
-            c->unblockClient();
-            c->addReplyLongLong(last_num_replicas);
-        } else {
-            int num_replicas = replicationCountAcksByOffset(c->m_blocking_state.m_replication_offset);
+        client *slave = (client *)ln->listNodeValue();
+        if (slave->m_replication_state == SLAVE_STATE_ONLINE)
+            acks[numacks++] = slave->m_replication_ack_off;
+    }
+    qsort(acks,numacks,sizeof(long long),compareAckOffsets);
 
-            if (num_replicas >= c->m_blocking_state.m_num_replicas) {
-                last_offset = c->m_blocking_state.m_replication_offset;
-                last_num_replicas = num_replicas;
-                c->unblockClient();
-                c->addReplyLongLong(num_replicas);
-            }
+    raxIterator ri;
+    raxStart(&ri,server.clients_waiting_acks);
+    raxSeek(&ri,"^",NULL,0);
+    while(raxNext(&ri)) {
+        client *c = (client *)ri.data;
+
+        while (first < numacks &&
+               acks[first] < c->m_blocking_state.m_replication_offset) first++;
+        if (first == numacks) break; /* No slave reached this offset. */
+
+        int num_replicas = numacks-first;
+        if (num_replicas >= c->m_blocking_state.m_num_replicas) {
+            unsigned char key[WAIT_KEY_LEN];
+
+            memcpy(key,ri.key,sizeof(key));
+            c->unblockClient();
+            c->addReplyLongLong(num_replicas);
+            /* The client was removed from the tree: seek again. */
+            raxSeek(&ri,">",key,sizeof(key));
         }
     }
+    raxStop(&ri);
+    zfree(acks);
 }
 
 /* Return the slave replication offset for this instance, that is
@@ -2512,6 +3564,19 @@ void replicationCron() {
         freeClient(server.master);
     }
 
+    /* Interrupted diskless transfers that can no longer be resumed? */
+    if (server.repl_resume_tmpfile && !replicationCanResume()) {
+        serverLog(LL_NOTICE,"Removing the interrupted streamed RDB: "
+                            "the resume window expired");
+        replicationDiscardResumeState();
+    }
+    if (server.repl_spool_file && server.repl_spool_size != -1 &&
+        server.unixtime - server.repl_spool_time >
+        server.repl_diskless_resume_window)
+    {
+        replicationSpoolDiscard();
+    }
+
     /* Check if we should connect to a MASTER */
     if (server.repl_state == REPL_STATE_CONNECT) {
         serverLog(LL_NOTICE,"Connecting to MASTER %s:%d",
@@ -2594,6 +3659,11 @@ void replicationCron() {
         }
     }
 
+    /* Release the blocks of the shared stream already sent to all the
+     * slaves, in case no new write did it in the meantime. */
+    server.repl_buffer->replBufferTrim();
+    server.repl_compress_buffer->replBufferTrim();
+
     /* If this is a master without attached slaves and there is a replication
      * backlog active, in order to reclaim memory we can free it after some
      * (configured) time. Note that this cannot be done for slaves: slaves
@@ -49,11 +49,16 @@
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
 #include "rio.h"
 #include "util.h"
 #include "crc64.h"
 #include "config.h"
 #include "server.h"
+#include "replframe.h"
 
 /* ------------------------- Buffer I/O implementation ----------------------- */
 
@@ -132,6 +137,314 @@ rioFileIO::rioFileIO(FILE* in_fp)
 {
 }
 
+/* ---------------------- Memory mapped file implementation ------------------ */
+
+/* Returns 1 or 0 for success/failure. */
+size_t rioMmapIO::rioReadSelf(void *buf, size_t len)
+{
+    if (m_size-m_pos < len)
+        return (size_t)0; /* Short read: the file is truncated. */
+    memcpy(buf, m_map + m_pos, len);
+    m_pos += len;
+    rioMmapAdvise();
+    return (size_t)1;
+}
+
+/* The mapping is read only. */
+size_t rioMmapIO::rioWriteSelf(const void *buf, size_t len)
+{
+    UNUSED(buf);
+    UNUSED(len);
+    return (size_t)0;
+}
+
+off_t rioMmapIO::rioTellSelf()
+{
+    return m_pos;
+}
+
+/* Keep the read ahead window in front of the read position, and drop the
+ * pages behind it, once every half window. */
+void rioMmapIO::rioMmapAdvise()
+{
+    static size_t page = 0;
+
+    if (m_view) return;
+    if (page == 0) page = sysconf(_SC_PAGESIZE);
+    if (m_advised < m_size && m_pos+RIO_MMAP_WINDOW/2 >= m_advised) {
+        size_t start = m_advised & ~(page-1);
+        size_t end = m_pos+RIO_MMAP_WINDOW;
+
+        if (end > m_size) end = m_size;
+        madvise(m_map+start, end-start, MADV_WILLNEED);
+        m_advised = end;
+    }
+    if (m_pos >= m_released+RIO_MMAP_WINDOW/2) {
+        size_t end = m_pos & ~(page-1);
+
+        madvise(m_map+m_released, end-m_released, MADV_DONTNEED);
+        m_released = end;
+    }
+}
+
+rioMmapIO::rioMmapIO(int fd)
+: rio()
+, m_map(NULL)
+, m_size((size_t)0)
+, m_pos((size_t)0)
+, m_advised((size_t)0)
+, m_released((size_t)0)
+, m_view(0)
+{
+    struct stat sb;
+    void *map;
+
+    if (fd == -1 || fstat(fd,&sb) == -1 || sb.st_size == 0 ||
+        (uint64_t)sb.st_size > SIZE_MAX) return;
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return;
+    m_map = (char*)map;
+    m_size = sb.st_size;
+    madvise(m_map, m_size, MADV_SEQUENTIAL);
+    rioMmapAdvise();
+}
+
+/* A view of the mapping 'map' reading from the offset 'pos', used to load
+ * single values of the file at random offsets. The view doesn't own the
+ * mapping and doesn't advise the kernel. */
+rioMmapIO::rioMmapIO(const rioMmapIO &map, size_t pos)
+: rio()
+, m_map(map.m_map)
+, m_size(map.m_size)
+, m_pos(pos)
+, m_advised(map.m_size)
+, m_released((size_t)0)
+, m_view(1)
+{
+}
+
+rioMmapIO::~rioMmapIO()
+{
+    if (m_map && !m_view) munmap(m_map, m_size);
+}
+
+/* The file was read sequentially and will be read by views at random
+ * offsets from now on: go back to the default read ahead of the kernel. */
+void rioMmapIO::rioMmapRandomAccess()
+{
+    madvise(m_map, m_size, MADV_NORMAL);
+    m_advised = m_size;
+    m_released = m_pos;
+}
+
+/* ------------------------ Direct file implementation ----------------------- */
+
+/* Write the buffer to the file. Returns 1 or 0 for success/failure. */
+int rioDirectIO::rioDirectWriteBuffer()
+{
+    size_t nwritten = 0;
+
+    while (nwritten < m_used) {
+        ssize_t n = write(m_fd, m_buf+nwritten, m_used-nwritten);
+        if (n == -1 && errno == EINTR) continue;
+#ifdef O_DIRECT
+        if (n == -1 && errno == EINVAL && m_odirect) {
+            /* The remaining part is not aligned anymore, after a short
+             * write or for the tail of the file: go on without O_DIRECT. */
+            fcntl(m_fd, F_SETFL, fcntl(m_fd,F_GETFL) & ~O_DIRECT);
+            m_odirect = 0;
+            continue;
+        }
+#endif
+        if (n <= 0) return 0;
+        nwritten += n;
+    }
+
+    if (!m_odirect) {
+        /* Start writing back this buffer, wait for the previous one, that
+         * was started on the last call, and drop it from the cache. */
+#ifdef HAVE_SYNC_FILE_RANGE
+        sync_file_range(m_fd, m_written, m_used, SYNC_FILE_RANGE_WRITE);
+#endif
+        if (m_written > m_dropped) {
+            rdb_fsync_range(m_fd, m_dropped, m_written-m_dropped);
+#ifdef POSIX_FADV_DONTNEED
+            posix_fadvise(m_fd, m_dropped, m_written-m_dropped,
+                          POSIX_FADV_DONTNEED);
+#endif
+            m_dropped = m_written;
+        }
+    }
+    m_written += m_used;
+    m_used = 0;
+    return 1;
+}
+
+/* Returns 1 or 0 for success/failure. */
+size_t rioDirectIO::rioWriteSelf(const void *buf, size_t len)
+{
+    while (len) {
+        size_t n = RIO_DIRECT_BUFFER-m_used;
+
+        if (n > len) n = len;
+        memcpy(m_buf+m_used, buf, n);
+        m_used += n;
+        buf = (const char*)buf + n;
+        len -= n;
+        if (m_used == RIO_DIRECT_BUFFER && rioDirectWriteBuffer() == 0)
+            return (size_t)0;
+    }
+    return (size_t)1;
+}
+
+/* The target is write only. */
+size_t rioDirectIO::rioReadSelf(void *buf, size_t len)
+{
+    UNUSED(buf);
+    UNUSED(len);
+    return (size_t)0;
+}
+
+off_t rioDirectIO::rioTellSelf()
+{
+    return m_written+m_used;
+}
+
+/* Write the buffered tail of the file. The caller still has to fsync(). */
+int rioDirectIO::rioFlushSelf()
+{
+    return m_used ? rioDirectWriteBuffer() : 1;
+}
+
+rioDirectIO::rioDirectIO(int fd)
+: rio()
+, m_fd(fd)
+, m_odirect(0)
+, m_alloc(zmalloc(RIO_DIRECT_BUFFER+RIO_DIRECT_ALIGN))
+, m_buf(NULL)
+, m_used((size_t)0)
+, m_written((off_t)0)
+, m_dropped((off_t)0)
+{
+#ifdef O_DIRECT
+    m_odirect = (fcntl(fd,F_GETFL) & O_DIRECT) != 0;
+#endif
+    m_buf = (char*)(((uintptr_t)m_alloc+RIO_DIRECT_ALIGN-1) &
+                    ~(uintptr_t)(RIO_DIRECT_ALIGN-1));
+}
+
+rioDirectIO::~rioDirectIO()
+{
+    zfree(m_alloc);
+}
+
+/* ---------------------- Replication socket implementation ------------------ */
+
+/* Read more data from the socket into the buffer, waiting for it if needed.
+ * Returns 1 on success, 0 on error, timeout or end of the payload. */
+int rioConnIO::rioConnFill()
+{
+    char buf[RIO_CONN_READ_LEN];
+
+    if (m_bufpos == sdslen(m_buf)) {
+        sdsclear(m_buf);
+        m_bufpos = 0;
+    }
+    while(1) {
+        size_t readlen = sizeof(buf);
+        ssize_t nread;
+
+        if (m_limit != -1) {
+            if (m_read == m_limit) return 0;
+            if (m_limit-m_read < (off_t)readlen) readlen = m_limit-m_read;
+        }
+        nread = read(m_fd,buf,readlen);
+        if (nread == 0) return 0;
+        if (nread == -1) {
+            if (errno != EAGAIN) return 0;
+            if (aeWait(m_fd,AE_READABLE,m_timeout) <= 0) {
+                errno = ETIMEDOUT;
+                return 0;
+            }
+            continue;
+        }
+        m_read += nread;
+        server.stat_net_input_bytes += nread;
+        server.repl_transfer_lastio = server.unixtime;
+
+        if (m_frames == NULL) {
+            m_buf = sdscatlen(m_buf,buf,nread);
+            return 1;
+        }
+        size_t before = sdslen(m_buf);
+        m_frames = sdscatlen(m_frames,buf,nread);
+        if (replFrameDecode(&m_frames,&m_buf) == -1) return 0;
+        if (sdslen(m_buf) != before) return 1;
+    }
+}
+
+/* Returns 1 or 0 for success/failure. */
+size_t rioConnIO::rioReadSelf(void *buf, size_t len)
+{
+    char *p = (char*) buf;
+
+    while(len) {
+        size_t avail = sdslen(m_buf)-m_bufpos;
+
+        if (avail == 0) {
+            if (!rioConnFill()) {
+                m_flags |= RIO_FLAG_READ_ERROR;
+                return (size_t)0;
+            }
+            continue;
+        }
+        if (avail > len) avail = len;
+        memcpy(p,m_buf+m_bufpos,avail);
+        m_bufpos += avail;
+        m_pos += avail;
+        p += avail;
+        len -= avail;
+    }
+    return (size_t)1;
+}
+
+/* Returns 1 or 0 for success/failure. */
+size_t rioConnIO::rioWriteSelf(const void *buf, size_t len)
+{
+    UNUSED(buf);
+    UNUSED(len);
+    return (size_t)0; /* Error, this target does not support writing. */
+}
+
+/* Returns read position in the payload. */
+off_t rioConnIO::rioTellSelf()
+{
+    return m_pos;
+}
+
+size_t rioConnIO::rioConnPending() const
+{
+    return sdslen(m_buf)-m_bufpos + (m_frames ? sdslen(m_frames) : 0);
+}
+
+rioConnIO::rioConnIO(int fd, off_t limit, int framed, long long timeout)
+: rio()
+, m_fd(fd)
+, m_limit(limit)
+, m_read((off_t)0)
+, m_pos((off_t)0)
+, m_buf(sdsempty())
+, m_bufpos((size_t)0)
+, m_frames(framed ? sdsempty() : NULL)
+, m_timeout(timeout)
+{}
+
+rioConnIO::~rioConnIO()
+{
+    sdsfree(m_buf);
+    sdsfree(m_frames);
+}
+
 /* ------------------- File descriptors set implementation ------------------- */
 
 /* Returns 1 or 0 for success/failure.
@@ -140,45 +453,70 @@ rioFileIO::rioFileIO(FILE* in_fp)
  *
  * When buf is NULL and len is 0, the function performs a flush operation
  * if there is some pending buffer, so this function is also used in order
- * to implement rioFdsetFlush(). */
+ * to implement rioFdsetFlush().
+ *
+ * The fds set with rioFdsetSetCompression() get the same data as LZF
+ * frames, that are encoded once for all of them at every flush. */
 size_t rioFdsetIO::rioWriteSelf(const void *buf, size_t len)
 {
     ssize_t retval;
     int j;
-    unsigned char *p = (unsigned char*) buf;
+    unsigned char *p = (unsigned char*) buf, *zp = NULL;
+    size_t zlen = 0;
     int doflush = (buf == NULL && len == 0);
 
     /* To start we always append to our buffer. If it gets larger than
-     * a given size, we actually write to the sockets. */
+     * a given size, we actually write to the sockets. Frames are better
+     * compressed when bigger, so we buffer more when compressing. */
     if (len) {
         m_buf = sdscatlen(m_buf,buf,len);
         len = 0; /* Prevent entering the while below if we don't flush. */
-        if (sdslen(m_buf) > PROTO_IOBUF_LEN) doflush = 1;
+        if (sdslen(m_buf) > (m_compress ? REPL_FRAME_BLOCK : PROTO_IOBUF_LEN))
+            doflush = 1;
     }
 
     if (doflush) {
         p = (unsigned char*) m_buf;
         len = sdslen(m_buf);
+        if (m_compress && len) {
+            size_t plain = 0;
+
+            if (m_pos < m_compress_from) {
+                plain = m_compress_from-m_pos;
+                if (plain > len) plain = len;
+            }
+            sdsclear(m_frames);
+            m_frames = sdscatlen(m_frames,p,plain);
+            m_frames = replFrameEncode(m_frames,p+plain,len-plain);
+            zp = (unsigned char*) m_frames;
+            zlen = sdslen(m_frames);
+        }
     }
+    m_pos += len;
 
     /* Write in little chunks so that when there are big writes we
      * parallelize while the kernel is sending data in background to
      * the TCP socket. */
-    while(len) {
+    while(len || zlen) {
         size_t count = len < 1024 ? len : 1024;
+        size_t zcount = zlen < 1024 ? zlen : 1024;
         int broken = 0;
         for (j = 0; j < m_numfds; j++) {
+            int framed = m_compress && m_compress[j];
+            unsigned char *src = framed ? zp : p;
+            size_t srclen = framed ? zcount : count;
+
             if (m_state[j] != 0) {
                 /* Skip FDs already in error. */
                 broken++;
                 continue;
             }
 
-            /* Make sure to write 'count' bytes to the socket regardless
+            /* Make sure to write 'srclen' bytes to the socket regardless
              * of short writes. */
             size_t nwritten = 0;
-            while(nwritten != count) {
-                retval = write(m_fds[j],p+nwritten,count-nwritten);
+            while(nwritten != srclen) {
+                retval = write(m_fds[j],src+nwritten,srclen-nwritten);
                 if (retval <= 0) {
                     /* With blocking sockets, which is the sole user of this
                      * rio target, EWOULDBLOCK is returned only because of
@@ -190,7 +528,7 @@ size_t rioFdsetIO::rioWriteSelf(const void *buf, size_t len)
                 nwritten += retval;
             }
 
-            if (nwritten != count) {
+            if (nwritten != srclen) {
                 /* Mark this FD as broken. */
                 m_state[j] = errno;
                 if (m_state[j] == 0)
@@ -202,7 +540,8 @@ size_t rioFdsetIO::rioWriteSelf(const void *buf, size_t len)
 
         p += count;
         len -= count;
-        m_pos += count;
+        if (zp) zp += zcount;
+        zlen -= zcount;
     }
 
     if (doflush)
@@ -246,6 +585,9 @@ rioFdsetIO::rioFdsetIO(int *fds, int numfds)
     m_numfds = numfds;
     m_pos = 0;
     m_buf = sdsempty();
+    m_compress = NULL;
+    m_compress_from = 0;
+    m_frames = NULL;
 }
 
 /* release the rio stream. */
@@ -253,7 +595,23 @@ rioFdsetIO::~rioFdsetIO()
 {
     zfree(m_fds);
     zfree(m_state);
+    zfree(m_compress);
     sdsfree(m_buf);
+    sdsfree(m_frames);
+}
+
+/* Send LZF frames to the fds with a non zero flag in 'compress', after the
+ * first 'from' bytes that are sent to them as they are. */
+void rioFdsetIO::rioFdsetSetCompression(const int *compress, off_t from)
+{
+    int j;
+
+    for (j = 0; j < m_numfds; j++) if (compress[j]) break;
+    if (j == m_numfds) return;
+    m_compress = (int *)zmalloc(sizeof(int)*m_numfds);
+    memcpy(m_compress, compress, sizeof(int)*m_numfds);
+    m_compress_from = from;
+    m_frames = sdsempty();
 }
 
 /* ---------------------------- Generic functions ---------------------------- */
@@ -323,6 +681,6 @@ size_t rio::rioWriteBulkLongLong(long long l)
 size_t rio::rioWriteBulkDouble(double d)
 {
     char dbuf[128];
-    unsigned int dlen = snprintf(dbuf, sizeof(dbuf), "%.17g", d);
+    unsigned int dlen = d2string(dbuf, sizeof(dbuf), d);
     return rioWriteBulkString(dbuf, dlen);
 }
@@ -36,6 +36,10 @@
 #include <stdint.h>
 #include "sds.h"
 
+/* A read failed because of the source, not because the data is truncated:
+ * set by the targets reading from the network. */
+#define RIO_FLAG_READ_ERROR (1<<0)
+
 struct redisObject;
 class rio
 {
@@ -45,6 +49,7 @@ public:
     , m_checksum((size_t)0)              /* current checksum */
     , m_processed_bytes((size_t)0)       /* bytes read or written */
     , m_max_processing_chunk((size_t)0)  /* read/write chunk size */
+    , m_flags(0)
     {}
 
     inline size_t rioWrite(const void *buf, size_t len);
@@ -76,6 +81,9 @@ public:
     /* maximum single read or write chunk size */
     size_t m_max_processing_chunk;
 
+    /* RIO_FLAG_... */
+    int m_flags;
+
 protected:
     /* Backend functions.
      * Since this functions do not tolerate short writes or reads the return
@@ -148,6 +156,71 @@ protected:
     off_t m_autosync; /* fsync after 'autosync' bytes written. */
 };
 
+/* Read only memory mapped file, used to load RDB files. The reads copy the
+ * bytes straight from the mapped pages, without going through the stdio
+ * buffers of rioFileIO. The kernel is asked to read a window of
+ * RIO_MMAP_WINDOW bytes ahead of the read position, and the pages already
+ * read are dropped, so that the mapping doesn't grow the RSS while loading. */
+#define RIO_MMAP_WINDOW (16*1024*1024)
+
+class rioMmapIO : public rio
+{
+public:
+    rioMmapIO(int fd);
+    rioMmapIO(const rioMmapIO &map, size_t pos);
+    ~rioMmapIO();
+
+    /* Zero if the file could not be mapped: rioFileIO must be used. */
+    inline int rioMmapIsValid() const {return m_map != NULL;}
+    void rioMmapRandomAccess();
+
+protected:
+    virtual size_t rioReadSelf(void *buf, size_t len);
+    virtual size_t rioWriteSelf(const void *buf, size_t len);
+    virtual off_t rioTellSelf();
+
+    void rioMmapAdvise();
+
+    char *m_map;
+    size_t m_size;
+    size_t m_pos;
+    size_t m_advised;   /* Read ahead was requested up to this offset. */
+    size_t m_released;  /* The pages before this offset were dropped. */
+    int m_view;         /* Reads another mapping, see lazy-loading. */
+};
+
+/* Write only file descriptor target for snapshots that should not fill the
+ * page cache. The data is collected in a buffer of RIO_DIRECT_BUFFER bytes,
+ * aligned to RIO_DIRECT_ALIGN, that is written as a whole. If the file was
+ * opened with O_DIRECT the writes bypass the page cache, otherwise every
+ * buffer is flushed to disk while the next one is filled and then dropped
+ * from the page cache with POSIX_FADV_DONTNEED. */
+#define RIO_DIRECT_BUFFER (4*1024*1024)
+#define RIO_DIRECT_ALIGN 4096
+
+class rioDirectIO : public rio
+{
+public:
+    rioDirectIO(int fd);
+    ~rioDirectIO();
+
+protected:
+    virtual size_t rioReadSelf(void *buf, size_t len);
+    virtual size_t rioWriteSelf(const void *buf, size_t len);
+    virtual off_t rioTellSelf();
+    virtual int rioFlushSelf();
+
+    int rioDirectWriteBuffer();
+
+    int m_fd;
+    int m_odirect;      /* The file is open with O_DIRECT. */
+    void *m_alloc;      /* Allocation 'm_buf' is aligned inside. */
+    char *m_buf;
+    size_t m_used;      /* Bytes of 'm_buf' to write. */
+    off_t m_written;    /* Bytes written to the file. */
+    off_t m_dropped;    /* Bytes dropped from the page cache. */
+};
+
 /* In-memory buffer target. */
 class rioBufferIO : public rio
 {
@@ -164,6 +237,39 @@ protected:
     off_t m_pos;
 };
 
+/* Read only target reading the RDB sent by the master straight from the
+ * replication socket, see repl-diskless-load. The socket is non blocking,
+ * so the reads wait up to 'timeout' milliseconds for more data. 'limit' is
+ * the size of the payload, so that nothing after it is read, or -1 when
+ * the payload is terminated by an EOF mark. With 'framed' the master sends
+ * LZF frames, that are decoded in the buffer. */
+#define RIO_CONN_READ_LEN (16*1024)
+
+class rioConnIO : public rio
+{
+public:
+    rioConnIO(int fd, off_t limit, int framed, long long timeout);
+    ~rioConnIO();
+
+    /* Bytes read from the socket but not consumed. */
+    size_t rioConnPending() const;
+
+protected:
+    virtual size_t rioReadSelf(void *buf, size_t len);
+    virtual size_t rioWriteSelf(const void *buf, size_t len);
+    virtual off_t rioTellSelf();
+
+    int rioConnFill();
+
+    int m_fd;
+    off_t m_limit;      /* Bytes to read from the socket, or -1. */
+    off_t m_read;       /* Bytes read from the socket. */
+    off_t m_pos;        /* Bytes consumed. */
+    sds m_buf;
+    size_t m_bufpos;    /* Bytes of 'm_buf' already consumed. */
+    sds m_frames;       /* Frames not yet decoded, or NULL. */
+    long long m_timeout;
+};
 
 class rioFdsetIO : public rio
 {
@@ -171,6 +277,8 @@ public:
     rioFdsetIO(int *fds, int numfds);
     ~rioFdsetIO();
 
+    void rioFdsetSetCompression(const int *compress, off_t from);
+
     int* m_state;     /* Error state of each fd. 0 (if ok) or errno. */
 
 protected:
@@ -183,6 +291,9 @@ protected:
     int  m_numfds;
     off_t m_pos;
     sds m_buf;
+    int* m_compress;  /* Fds getting LZF frames, or NULL if none. */
+    off_t m_compress_from; /* Bytes sent as they are before the frames. */
+    sds m_frames;     /* Frames encoding the buffer being flushed. */
 };
 
 
@@ -0,0 +1,712 @@
+/* Compressed bitmap implementation for big sets of integers, see roaring.h.
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "roaring.h"
+#include "zmalloc.h"
+#include "endianconv.h"
+#include <new>
+
+/* Values are stored with the sign bit flipped, so that the unsigned order of
+ * keys and low bits is the signed order of the values. */
+#define ROARING_SIGN (1ULL<<63)
+#define ROARING_KEY_MAX ((1ULL<<48)-1)
+
+static inline uint64_t roaringKey(int64_t v) {
+    return ((uint64_t)v ^ ROARING_SIGN) >> 16;
+}
+
+static inline uint16_t roaringLow(int64_t v) {
+    return (uint16_t)((uint64_t)v & 0xffff);
+}
+
+static inline int64_t roaringValue(uint64_t key, uint16_t low) {
+    return (int64_t)(((key << 16) | low) ^ ROARING_SIGN);
+}
+
+/* ----------------------------- Containers -------------------------------- */
+
+static inline int containerIsBitmap(const roaringContainer *c) {
+    return c->card > ROARING_ARRAY_MAX;
+}
+
+static inline uint16_t *containerValues(roaringContainer *c) {
+    return (uint16_t *)c->data;
+}
+
+static inline const uint16_t *containerValues(const roaringContainer *c) {
+    return (const uint16_t *)c->data;
+}
+
+static inline size_t containerBytes(const roaringContainer *c) {
+    return sizeof(*c) + (containerIsBitmap(c) ? ROARING_CONTAINER_MAX_BYTES :
+                                                c->capacity*sizeof(uint16_t));
+}
+
+static roaringContainer *containerCreateArray(uint32_t capacity) {
+    roaringContainer *c = (roaringContainer *)
+        zmalloc(sizeof(*c)+capacity*sizeof(uint16_t));
+    c->card = 0;
+    c->capacity = capacity;
+    return c;
+}
+
+/* Position of the first value of the array not smaller than 'low'. */
+static inline uint32_t containerLowerBound(const uint16_t *v, uint32_t n,
+                                           uint16_t low)
+{
+    const uint16_t *base = v;
+
+    while (n > 1) {
+        uint32_t half = n/2;
+        base = (base[half] < low) ? base+half : base;
+        n -= half;
+    }
+    return (base-v) + (n == 1 && *base < low);
+}
+
+static uint32_t wordsToValues(const uint64_t *words, uint16_t *out) {
+    uint32_t n = 0;
+
+    for (uint32_t i = 0; i < ROARING_BITMAP_WORDS; i++) {
+        uint64_t w = words[i];
+        while (w) {
+            out[n++] = (uint16_t)(i*64 + __builtin_ctzll(w));
+            w &= w-1;
+        }
+    }
+    return n;
+}
+
+/* Containers holding the given values / bits, or NULL if there are none. */
+static roaringContainer *containerFromValues(const uint16_t *v, uint32_t n) {
+    if (n == 0) return NULL;
+    roaringContainer *c = containerCreateArray(n);
+    memcpy(containerValues(c),v,n*sizeof(uint16_t));
+    c->card = n;
+    return c;
+}
+
+static roaringContainer *containerFromWords(const uint64_t *words) {
+    uint32_t card = 0;
+
+    for (uint32_t i = 0; i < ROARING_BITMAP_WORDS; i++)
+        card += __builtin_popcountll(words[i]);
+    if (card == 0) return NULL;
+    if (card <= ROARING_ARRAY_MAX) {
+        roaringContainer *c = containerCreateArray(card);
+        c->card = wordsToValues(words,containerValues(c));
+        return c;
+    }
+    roaringContainer *c = (roaringContainer *)
+        zmalloc(sizeof(*c)+ROARING_CONTAINER_MAX_BYTES);
+    memcpy(c->data,words,ROARING_CONTAINER_MAX_BYTES);
+    c->card = card;
+    c->capacity = 0;
+    return c;
+}
+
+static roaringContainer *containerDup(const roaringContainer *c) {
+    if (containerIsBitmap(c)) return containerFromWords(c->data);
+    return containerFromValues(containerValues(c),c->card);
+}
+
+static void containerToWords(const roaringContainer *c, uint64_t *words) {
+    if (containerIsBitmap(c)) {
+        memcpy(words,c->data,ROARING_CONTAINER_MAX_BYTES);
+    } else {
+        const uint16_t *v = containerValues(c);
+        memset(words,0,ROARING_CONTAINER_MAX_BYTES);
+        for (uint32_t i = 0; i < c->card; i++)
+            words[v[i]>>6] |= 1ULL << (v[i]&63);
+    }
+}
+
+static int containerContains(const roaringContainer *c, uint16_t low) {
+    if (containerIsBitmap(c))
+        return (c->data[low>>6] >> (low&63)) & 1;
+    const uint16_t *v = containerValues(c);
+    uint32_t pos = containerLowerBound(v,c->card,low);
+    return pos < c->card && v[pos] == low;
+}
+
+/* Add 'low' to the container, that may be reallocated or turned into a
+ * bitmap. Return 1 if the value was added, 0 if it was already there. */
+static int containerAdd(roaringContainer **cp, uint16_t low, size_t *alloc) {
+    roaringContainer *c = *cp;
+
+    if (containerIsBitmap(c)) {
+        uint64_t bit = 1ULL << (low&63);
+        if (c->data[low>>6] & bit) return 0;
+        c->data[low>>6] |= bit;
+        c->card++;
+        return 1;
+    }
+
+    uint16_t *v = containerValues(c);
+    uint32_t pos = containerLowerBound(v,c->card,low);
+    if (pos < c->card && v[pos] == low) return 0;
+
+    *alloc -= containerBytes(c);
+    if (c->card == ROARING_ARRAY_MAX) {
+        uint64_t words[ROARING_BITMAP_WORDS];
+        containerToWords(c,words);
+        words[low>>6] |= 1ULL << (low&63);
+        zfree(c);
+        c = containerFromWords(words);
+    } else {
+        if (c->card == c->capacity) {
+            c->capacity = c->capacity ? c->capacity*2 : 4;
+            if (c->capacity > ROARING_ARRAY_MAX) c->capacity = ROARING_ARRAY_MAX;
+            c = (roaringContainer *)
+                zrealloc(c,sizeof(*c)+c->capacity*sizeof(uint16_t));
+            v = containerValues(c);
+        }
+        memmove(v+pos+1,v+pos,(c->card-pos)*sizeof(uint16_t));
+        v[pos] = low;
+        c->card++;
+    }
+    *alloc += containerBytes(c);
+    *cp = c;
+    return 1;
+}
+
+/* Remove 'low' from the container, that may be reallocated or turned into
+ * an array. Return 1 if the value was removed, 0 if it was not there. */
+static int containerRemove(roaringContainer **cp, uint16_t low, size_t *alloc) {
+    roaringContainer *c = *cp;
+
+    if (containerIsBitmap(c)) {
+        uint64_t bit = 1ULL << (low&63);
+        if (!(c->data[low>>6] & bit)) return 0;
+        c->data[low>>6] &= ~bit;
+        if (c->card-1 > ROARING_ARRAY_MAX) {
+            c->card--;
+            return 1;
+        }
+        *alloc -= containerBytes(c);
+        *cp = containerFromWords(c->data);
+        zfree(c);
+        *alloc += containerBytes(*cp);
+        return 1;
+    }
+
+    uint16_t *v = containerValues(c);
+    uint32_t pos = containerLowerBound(v,c->card,low);
+    if (pos == c->card || v[pos] != low) return 0;
+    memmove(v+pos,v+pos+1,(c->card-pos-1)*sizeof(uint16_t));
+    c->card--;
+
+    /* Give memory back when the array is mostly empty. */
+    if (c->capacity >= 8 && c->card <= c->capacity/4) {
+        *alloc -= containerBytes(c);
+        c->capacity /= 2;
+        c = (roaringContainer *)
+            zrealloc(c,sizeof(*c)+c->capacity*sizeof(uint16_t));
+        *alloc += containerBytes(c);
+        *cp = c;
+    }
+    return 1;
+}
+
+/* Value of the container with the given rank, starting from zero. */
+static uint16_t containerSelect(const roaringContainer *c, uint32_t rank) {
+    if (!containerIsBitmap(c)) return containerValues(c)[rank];
+
+    uint32_t i = 0;
+    while (1) {
+        uint32_t bits = __builtin_popcountll(c->data[i]);
+        if (rank < bits) break;
+        rank -= bits;
+        i++;
+    }
+    uint64_t w = c->data[i];
+    while (rank--) w &= w-1;
+    return (uint16_t)(i*64 + __builtin_ctzll(w));
+}
+
+static roaringContainer *containerAnd(const roaringContainer *a,
+                                      const roaringContainer *b)
+{
+    if (containerIsBitmap(a) && containerIsBitmap(b)) {
+        uint64_t words[ROARING_BITMAP_WORDS];
+        for (uint32_t i = 0; i < ROARING_BITMAP_WORDS; i++)
+            words[i] = a->data[i] & b->data[i];
+        return containerFromWords(words);
+    }
+
+    uint16_t out[ROARING_ARRAY_MAX];
+    uint32_t n = 0;
+    if (containerIsBitmap(a)) {
+        const roaringContainer *t = a; a = b; b = t;
+    }
+    const uint16_t *va = containerValues(a);
+    if (containerIsBitmap(b)) {
+        for (uint32_t i = 0; i < a->card; i++) {
+            out[n] = va[i];
+            n += (b->data[va[i]>>6] >> (va[i]&63)) & 1;
+        }
+    } else {
+        /* Merge with no unpredictable branch, see intsetIntersect(). */
+        const uint16_t *vb = containerValues(b);
+        uint32_t i = 0, j = 0;
+        while (i < a->card && j < b->card) {
+            uint16_t x = va[i], y = vb[j];
+            out[n] = x;
+            n += (x == y);
+            i += (x <= y);
+            j += (y <= x);
+        }
+    }
+    return containerFromValues(out,n);
+}
+
+static roaringContainer *containerOr(const roaringContainer *a,
+                                     const roaringContainer *b)
+{
+    if (!containerIsBitmap(a) && !containerIsBitmap(b) &&
+        a->card+b->card <= ROARING_ARRAY_MAX)
+    {
+        uint16_t out[ROARING_ARRAY_MAX];
+        const uint16_t *va = containerValues(a), *vb = containerValues(b);
+        uint32_t i = 0, j = 0, n = 0;
+        while (i < a->card && j < b->card) {
+            uint16_t x = va[i], y = vb[j];
+            out[n++] = (x <= y) ? x : y;
+            i += (x <= y);
+            j += (y <= x);
+        }
+        while (i < a->card) out[n++] = va[i++];
+        while (j < b->card) out[n++] = vb[j++];
+        return containerFromValues(out,n);
+    }
+
+    uint64_t words[ROARING_BITMAP_WORDS];
+    if (!containerIsBitmap(a)) {
+        const roaringContainer *t = a; a = b; b = t;
+    }
+    containerToWords(a,words);
+    if (containerIsBitmap(b)) {
+        for (uint32_t i = 0; i < ROARING_BITMAP_WORDS; i++)
+            words[i] |= b->data[i];
+    } else {
+        const uint16_t *vb = containerValues(b);
+        for (uint32_t i = 0; i < b->card; i++)
+            words[vb[i]>>6] |= 1ULL << (vb[i]&63);
+    }
+    return containerFromWords(words);
+}
+
+static roaringContainer *containerAndNot(const roaringContainer *a,
+                                         const roaringContainer *b)
+{
+    if (containerIsBitmap(a)) {
+        uint64_t words[ROARING_BITMAP_WORDS];
+        memcpy(words,a->data,ROARING_CONTAINER_MAX_BYTES);
+        if (containerIsBitmap(b)) {
+            for (uint32_t i = 0; i < ROARING_BITMAP_WORDS; i++)
+                words[i] &= ~b->data[i];
+        } else {
+            const uint16_t *vb = containerValues(b);
+            for (uint32_t i = 0; i < b->card; i++)
+                words[vb[i]>>6] &= ~(1ULL << (vb[i]&63));
+        }
+        return containerFromWords(words);
+    }
+
+    uint16_t out[ROARING_ARRAY_MAX];
+    const uint16_t *va = containerValues(a);
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < a->card; i++) {
+        out[n] = va[i];
+        n += !containerContains(b,va[i]);
+    }
+    return containerFromValues(out,n);
+}
+
+/* ------------------------------- Bitmaps --------------------------------- */
+
+roaring *roaringCreate(void) {
+    roaring *r = new (zmalloc(sizeof(roaring))) roaring;
+    return r;
+}
+
+void roaringFree(roaring *r) {
+    r->~roaring();
+    zfree(r);
+}
+
+roaring::roaring()
+: m_keys(NULL)
+, m_containers(NULL)
+, m_counts(NULL)
+, m_counts_valid(0)
+, m_count(0)
+, m_capacity(0)
+, m_card(0)
+, m_alloc_size(sizeof(roaring))
+{
+}
+
+roaring::~roaring()
+{
+    for (uint32_t i = 0; i < m_count; i++) zfree(m_containers[i]);
+    zfree(m_keys);
+    zfree(m_containers);
+    zfree(m_counts);
+}
+
+/* Bytes used for every container slot of the arrays of the bitmap. */
+#define ROARING_SLOT_BYTES (sizeof(uint64_t)+sizeof(roaringContainer*)+sizeof(uint64_t))
+
+void roaring::roaringGrow() {
+    uint32_t capacity = m_capacity ? m_capacity*2 : 4;
+
+    m_keys = (uint64_t *)zrealloc(m_keys,capacity*sizeof(uint64_t));
+    m_containers = (roaringContainer **)
+        zrealloc(m_containers,capacity*sizeof(roaringContainer*));
+    m_counts = (uint64_t *)zrealloc(m_counts,(capacity+1)*sizeof(uint64_t));
+    m_alloc_size += (capacity-m_capacity)*ROARING_SLOT_BYTES;
+    if (m_capacity == 0) m_alloc_size += sizeof(uint64_t);
+    m_capacity = capacity;
+}
+
+/* Return 1 if there is a container with the given key, storing its position
+ * in *pos, otherwise return 0 and store in *pos where it should be inserted. */
+int roaring::roaringSearchKey(uint64_t key, uint32_t *pos) const {
+    uint32_t lo = 0, hi = m_count;
+
+    /* Appending at the end is the common case of growing IDs. */
+    if (m_count && m_keys[m_count-1] < key) {
+        *pos = m_count;
+        return 0;
+    }
+    while (lo < hi) {
+        uint32_t mid = (lo+hi)/2;
+        if (m_keys[mid] < key) lo = mid+1;
+        else hi = mid;
+    }
+    *pos = lo;
+    return lo < m_count && m_keys[lo] == key;
+}
+
+void roaring::roaringInsertContainer(uint32_t pos, uint64_t key, roaringContainer *c) {
+    if (m_count == m_capacity) roaringGrow();
+    memmove(m_keys+pos+1,m_keys+pos,(m_count-pos)*sizeof(uint64_t));
+    memmove(m_containers+pos+1,m_containers+pos,
+            (m_count-pos)*sizeof(roaringContainer*));
+    m_keys[pos] = key;
+    m_containers[pos] = c;
+    m_count++;
+    m_card += c->card;
+    m_alloc_size += containerBytes(c);
+    m_counts_valid = 0;
+}
+
+void roaring::roaringDeleteContainer(uint32_t pos) {
+    roaringContainer *c = m_containers[pos];
+
+    m_card -= c->card;
+    m_alloc_size -= containerBytes(c);
+    zfree(c);
+    memmove(m_keys+pos,m_keys+pos+1,(m_count-pos-1)*sizeof(uint64_t));
+    memmove(m_containers+pos,m_containers+pos+1,
+            (m_count-pos-1)*sizeof(roaringContainer*));
+    m_count--;
+    m_counts_valid = 0;
+}
+
+void roaring::roaringAppend(uint64_t key, roaringContainer *c) {
+    roaringInsertContainer(m_count,key,c);
+}
+
+/* Build the Fenwick tree of the sizes of the containers in O(N). */
+void roaring::roaringBuildCounts() {
+    for (uint32_t i = 1; i <= m_count; i++) m_counts[i] = m_containers[i-1]->card;
+    for (uint32_t i = 1; i <= m_count; i++) {
+        uint32_t parent = i + (i & -i);
+        if (parent <= m_count) m_counts[parent] += m_counts[i];
+    }
+    m_counts_valid = 1;
+}
+
+void roaring::roaringUpdateCounts(uint32_t pos, int64_t delta) {
+    if (!m_counts_valid) return;
+    for (uint32_t i = pos+1; i <= m_count; i += i & -i)
+        m_counts[i] += (uint64_t)delta;
+}
+
+/* Add the value, returning 1 if it was added, 0 if it was already there. */
+int roaring::roaringAdd(int64_t value) {
+    uint64_t key = roaringKey(value);
+    uint16_t low = roaringLow(value);
+    uint32_t pos;
+
+    if (!roaringSearchKey(key,&pos)) {
+        roaringContainer *c = containerCreateArray(4);
+        containerValues(c)[0] = low;
+        c->card = 1;
+        roaringInsertContainer(pos,key,c);
+        return 1;
+    }
+    if (!containerAdd(&m_containers[pos],low,&m_alloc_size)) return 0;
+    m_card++;
+    roaringUpdateCounts(pos,1);
+    return 1;
+}
+
+/* Remove the value, returning 1 if it was removed, 0 if it was not there. */
+int roaring::roaringRemove(int64_t value) {
+    uint32_t pos;
+
+    if (!roaringSearchKey(roaringKey(value),&pos)) return 0;
+    if (!containerRemove(&m_containers[pos],roaringLow(value),&m_alloc_size))
+        return 0;
+    m_card--;
+    if (m_containers[pos]->card == 0) {
+        roaringDeleteContainer(pos);
+    } else {
+        roaringUpdateCounts(pos,-1);
+    }
+    return 1;
+}
+
+int roaring::roaringContains(int64_t value) const {
+    uint32_t pos;
+
+    if (!roaringSearchKey(roaringKey(value),&pos)) return 0;
+    return containerContains(m_containers[pos],roaringLow(value));
+}
+
+/* Return a random element of a non empty bitmap. */
+int64_t roaring::roaringRandom() {
+    uint64_t rank = (((uint64_t)rand() << 31) ^ (uint64_t)rand()) % m_card;
+    uint32_t pos = 0, step = 1;
+
+    if (!m_counts_valid) roaringBuildCounts();
+    while (step*2 <= m_count) step *= 2;
+    for (; step; step /= 2) {
+        if (pos+step <= m_count && m_counts[pos+step] <= rank) {
+            pos += step;
+            rank -= m_counts[pos];
+        }
+    }
+    return roaringValue(m_keys[pos],containerSelect(m_containers[pos],rank));
+}
+
+void roaring::roaringInitIterator(roaringIterator *it) const {
+    it->container = 0;
+    it->pos = 0;
+}
+
+/* Store in *value the next element, in ascending order. Return 0 when there
+ * are no more elements. */
+int roaring::roaringNext(roaringIterator *it, int64_t *value) const {
+    while (it->container < m_count) {
+        const roaringContainer *c = m_containers[it->container];
+
+        if (!containerIsBitmap(c)) {
+            if (it->pos < c->card) {
+                *value = roaringValue(m_keys[it->container],
+                                      containerValues(c)[it->pos++]);
+                return 1;
+            }
+        } else if (it->pos < ROARING_BITMAP_WORDS*64) {
+            uint32_t i = it->pos >> 6;
+            uint64_t w = c->data[i] & (~0ULL << (it->pos & 63));
+            while (w == 0 && ++i < ROARING_BITMAP_WORDS) w = c->data[i];
+            if (w) {
+                uint32_t bit = i*64 + __builtin_ctzll(w);
+                it->pos = bit+1;
+                *value = roaringValue(m_keys[it->container],(uint16_t)bit);
+                return 1;
+            }
+        }
+        it->container++;
+        it->pos = 0;
+    }
+    return 0;
+}
+
+/* Call 'fn' for all the elements of the containers starting from the first
+ * one with a key not smaller than 'cursor', until at least 'count' elements
+ * were reported. Return the cursor to continue from, or 0 when all the
+ * containers were visited. Keys don't change when other containers are
+ * created or removed, so all the elements that are in the bitmap for the
+ * whole scan are reported. */
+uint64_t roaring::roaringScan(uint64_t cursor, unsigned long count,
+                              roaringScanFunction *fn, void *privdata) const
+{
+    roaringIterator it;
+    unsigned long reported = 0;
+    int64_t value;
+
+    roaringSearchKey(cursor,&it.container);
+    it.pos = 0;
+    while (it.container < m_count && reported < count) {
+        uint32_t container = it.container;
+        while (it.container == container && roaringNext(&it,&value)) {
+            fn(privdata,value);
+            reported++;
+        }
+    }
+    return it.container < m_count ? m_keys[it.container] : 0;
+}
+
+roaring *roaring::roaringDup(const roaring *r) {
+    roaring *dup = roaringCreate();
+
+    for (uint32_t i = 0; i < r->m_count; i++)
+        dup->roaringAppend(r->m_keys[i],containerDup(r->m_containers[i]));
+    return dup;
+}
+
+/* The set operations merge the sorted arrays of keys, combining the
+ * containers with the same key. */
+roaring *roaring::roaringIntersect(const roaring *a, const roaring *b) {
+    roaring *r = roaringCreate();
+    uint32_t i = 0, j = 0;
+
+    while (i < a->m_count && j < b->m_count) {
+        if (a->m_keys[i] < b->m_keys[j]) {
+            i++;
+        } else if (a->m_keys[i] > b->m_keys[j]) {
+            j++;
+        } else {
+            roaringContainer *c = containerAnd(a->m_containers[i],
+                                               b->m_containers[j]);
+            if (c) r->roaringAppend(a->m_keys[i],c);
+            i++;
+            j++;
+        }
+    }
+    return r;
+}
+
+roaring *roaring::roaringUnion(const roaring *a, const roaring *b) {
+    roaring *r = roaringCreate();
+    uint32_t i = 0, j = 0;
+
+    while (i < a->m_count || j < b->m_count) {
+        if (j == b->m_count ||
+            (i < a->m_count && a->m_keys[i] < b->m_keys[j]))
+        {
+            r->roaringAppend(a->m_keys[i],containerDup(a->m_containers[i]));
+            i++;
+        } else if (i == a->m_count || b->m_keys[j] < a->m_keys[i]) {
+            r->roaringAppend(b->m_keys[j],containerDup(b->m_containers[j]));
+            j++;
+        } else {
+            r->roaringAppend(a->m_keys[i],containerOr(a->m_containers[i],
+                                                      b->m_containers[j]));
+            i++;
+            j++;
+        }
+    }
+    return r;
+}
+
+roaring *roaring::roaringDifference(const roaring *a, const roaring *b) {
+    roaring *r = roaringCreate();
+    uint32_t j = 0;
+
+    for (uint32_t i = 0; i < a->m_count; i++) {
+        while (j < b->m_count && b->m_keys[j] < a->m_keys[i]) j++;
+        roaringContainer *c;
+        if (j < b->m_count && b->m_keys[j] == a->m_keys[i])
+            c = containerAndNot(a->m_containers[i],b->m_containers[j]);
+        else
+            c = containerDup(a->m_containers[i]);
+        if (c) r->roaringAppend(a->m_keys[i],c);
+    }
+    return r;
+}
+
+/* Store in 'buf', that has room for ROARING_CONTAINER_MAX_BYTES, the values
+ * of the container 'i' in little endian, returning their length in bytes. */
+size_t roaring::roaringGetContainer(uint32_t i, uint64_t *key, uint32_t *card,
+                                    unsigned char *buf) const
+{
+    const roaringContainer *c = m_containers[i];
+    size_t len;
+
+    *key = m_keys[i];
+    *card = c->card;
+    if (containerIsBitmap(c)) {
+        len = ROARING_CONTAINER_MAX_BYTES;
+        memcpy(buf,c->data,len);
+        for (uint32_t j = 0; j < ROARING_BITMAP_WORDS; j++)
+            memrev64ifbe(((uint64_t*)buf)+j);
+    } else {
+        len = c->card*sizeof(uint16_t);
+        memcpy(buf,c->data,len);
+        for (uint32_t j = 0; j < c->card; j++)
+            memrev16ifbe(((uint16_t*)buf)+j);
+    }
+    return len;
+}
+
+/* Append a container serialized by roaringGetContainer(). The keys must be
+ * appended in ascending order. Return 0 if the container is not valid, in
+ * which case the bitmap is left as it was. */
+int roaring::roaringAppendContainer(uint64_t key, uint32_t card,
+                                    const unsigned char *buf, size_t len)
+{
+    roaringContainer *c;
+
+    if (key > ROARING_KEY_MAX || (m_count && key <= m_keys[m_count-1]))
+        return 0;
+    if (card == 0 || card > ROARING_BITMAP_WORDS*64) return 0;
+
+    if (card > ROARING_ARRAY_MAX) {
+        uint64_t words[ROARING_BITMAP_WORDS];
+        if (len != ROARING_CONTAINER_MAX_BYTES) return 0;
+        memcpy(words,buf,len);
+        for (uint32_t j = 0; j < ROARING_BITMAP_WORDS; j++)
+            memrev64ifbe(words+j);
+        c = containerFromWords(words);
+    } else {
+        uint16_t values[ROARING_ARRAY_MAX];
+        if (len != card*sizeof(uint16_t)) return 0;
+        memcpy(values,buf,len);
+        for (uint32_t j = 0; j < card; j++) {
+            memrev16ifbe(values+j);
+            if (j && values[j] <= values[j-1]) return 0;
+        }
+        c = containerFromValues(values,card);
+    }
+    if (c == NULL || c->card != card) {
+        zfree(c);
+        return 0;
+    }
+    roaringAppend(key,c);
+    return 1;
+}
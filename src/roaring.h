@@ -0,0 +1,94 @@
+/* Compressed bitmap of 64 bit signed integers, in the style of the Roaring
+ * bitmaps, used by the sets of integers that are too big to be intsets.
+ *
+ * The integers are split by their high 48 bits, the key of a container that
+ * stores the low 16 bits of the values sharing that key. A container holding
+ * up to ROARING_ARRAY_MAX values is a sorted array of uint16_t, a container
+ * with more values is a bitmap of 65536 bits, so a container never takes
+ * more than 8k. The containers are kept in an array sorted by key, so that
+ * the set operations are merges of the key arrays, performed container by
+ * container with word wide AND / OR / AND NOT when both sides are bitmaps.
+ *
+ * Dense sets, such as sets of user IDs, take from 2 bytes to 1 bit per
+ * element, instead of the hundred or so bytes of a hash table of strings. */
+
+#ifndef __ROARING_H
+#define __ROARING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ROARING_ARRAY_MAX 4096          /* More values make it a bitmap. */
+#define ROARING_BITMAP_WORDS 1024       /* 65536 bits. */
+#define ROARING_CONTAINER_MAX_BYTES (ROARING_BITMAP_WORDS*8)
+
+struct roaringContainer {
+    uint32_t card;      /* Number of values, a bitmap if > ROARING_ARRAY_MAX. */
+    uint32_t capacity;  /* Values that fit the array of array containers. */
+    uint64_t data[];    /* uint16_t values, or ROARING_BITMAP_WORDS words. */
+};
+
+/* Position of the next value to return. It is valid only until the bitmap
+ * is modified. */
+struct roaringIterator {
+    uint32_t container;
+    uint32_t pos;       /* Index in the array, or bit of the bitmap. */
+};
+
+typedef void roaringScanFunction(void *privdata, int64_t value);
+
+class roaring
+{
+public:
+    roaring();
+    ~roaring();
+
+    int roaringAdd(int64_t value);
+    int roaringRemove(int64_t value);
+    int roaringContains(int64_t value) const;
+    int64_t roaringRandom();
+    void roaringInitIterator(roaringIterator *it) const;
+    int roaringNext(roaringIterator *it, int64_t *value) const;
+    uint64_t roaringScan(uint64_t cursor, unsigned long count,
+                         roaringScanFunction *fn, void *privdata) const;
+
+    static roaring *roaringDup(const roaring *r);
+    static roaring *roaringIntersect(const roaring *a, const roaring *b);
+    static roaring *roaringUnion(const roaring *a, const roaring *b);
+    static roaring *roaringDifference(const roaring *a, const roaring *b);
+
+    /* Serialization, one container at a time, values in little endian. */
+    size_t roaringGetContainer(uint32_t i, uint64_t *key, uint32_t *card,
+                               unsigned char *buf) const;
+    int roaringAppendContainer(uint64_t key, uint32_t card,
+                               const unsigned char *buf, size_t len);
+
+    inline uint64_t roaringLen() const {return m_card;}
+    inline uint32_t roaringContainers() const {return m_count;}
+    inline size_t allocSize() const {return m_alloc_size;}
+
+private:
+    int roaringSearchKey(uint64_t key, uint32_t *pos) const;
+    void roaringInsertContainer(uint32_t pos, uint64_t key, roaringContainer *c);
+    void roaringDeleteContainer(uint32_t pos);
+    void roaringAppend(uint64_t key, roaringContainer *c);
+    void roaringGrow();
+    void roaringBuildCounts();
+    void roaringUpdateCounts(uint32_t pos, int64_t delta);
+
+    uint64_t *m_keys;                   /* High 48 bits, sorted. */
+    roaringContainer **m_containers;
+    uint64_t *m_counts;   /* Fenwick tree of the container sizes, so that a
+                             random element is found in O(log N). */
+    int m_counts_valid;   /* Zero if the containers changed since it was
+                             built. */
+    uint32_t m_count;                   /* Containers in use. */
+    uint32_t m_capacity;                /* Containers allocated. */
+    uint64_t m_card;                    /* Number of elements. */
+    size_t m_alloc_size;                /* Bytes allocated. */
+};
+
+roaring *roaringCreate(void);
+void roaringFree(roaring *r);
+
+#endif
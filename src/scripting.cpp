@@ -53,6 +53,15 @@ void luaLdbLineHook(lua_State *lua, lua_Debug *ar);
 void ldbLog(sds entry);
 void ldbLogRedisReply(char *reply);
 sds ldbCatStackValue(sds s, lua_State *lua, int idx);
+int luaFunctionCompile(client *c, lua_State *lua, robj *body);
+void scriptStatsRecordCommand(scriptStats *stats, struct redisCommand *cmd,
+                              long long usec);
+static int luaThreadRedisCommand(lua_State *lua, int raise_error);
+static void luaRegisterRedisApi(lua_State *lua);
+static int luaDefineFunction(client *c, lua_State *lua, const char *funcname,
+                             robj *body);
+static int luaGetNumKeys(client *c, long long *numkeys);
+static void evalThreadGenericCommand(client *c, int evalsha);
 
 /* Debugger shared state is stored inside this global structure. */
 #define LDB_BREAKPOINTS_MAX 64  /* Max number of breakpoints. */
@@ -200,6 +209,184 @@ char *redisProtocolToLuaType_MultiBulk(lua_State *lua, char *reply) {
     return p;
 }
 
+/* Builds the Lua value of the reply of a command called by redis.call()
+ * directly, with the same conversion as redisProtocolToLuaType(), see
+ * replyBuilder. The arrays being built stay on the Lua stack, each with a
+ * frame counting the elements it still waits for. Only the first reply of
+ * the command is kept. */
+class luaReplyBuilder : public replyBuilder {
+public:
+    luaReplyBuilder()
+    : m_lua(NULL), m_frames(NULL), m_numframes(0), m_maxframes(0),
+      m_pending(NULL), m_done(0), m_type(0) {}
+
+    void reset(lua_State *lua) {
+        if (m_pending == NULL) m_pending = sdsempty();
+        sdsclear(m_pending);
+        m_lua = lua;
+        m_numframes = 0;
+        m_done = 0;
+        m_type = 0;
+    }
+    /* True once the whole reply was pushed on the Lua stack. */
+    int isDone() const { return m_done; }
+    /* The protocol type of the reply, as its first byte, with 'N' for the
+     * null array. */
+    char replyType() const { return m_type; }
+
+    virtual void replyBulk(const char *s, size_t len) {
+        if (m_done) return;
+        if (m_numframes == 0) m_type = '$';
+        lua_checkstack(m_lua,2);
+        lua_pushlstring(m_lua,s,len);
+        valueDone();
+    }
+    virtual void replyLongLong(long long ll) {
+        if (m_done) return;
+        if (m_numframes == 0) m_type = ':';
+        lua_checkstack(m_lua,2);
+        lua_pushnumber(m_lua,(lua_Number)ll);
+        valueDone();
+    }
+    virtual void replyArray(long len) {
+        if (m_done) return;
+        if (m_numframes == 0) m_type = len == -1 ? 'N' : '*';
+        lua_checkstack(m_lua,2);
+        if (len == -1) {
+            lua_pushboolean(m_lua,0);
+            valueDone();
+            return;
+        }
+        lua_newtable(m_lua);
+        if (len == 0) valueDone();
+        else pushFrame(len);
+    }
+    virtual void *replyDeferredArray() {
+        if (m_done) return NULL;
+        if (m_numframes == 0) m_type = '*';
+        lua_checkstack(m_lua,2);
+        lua_newtable(m_lua);
+        pushFrame(-1);
+        return (void*)(long)m_numframes;
+    }
+    virtual void replyDeferredArrayLen(void *handle, long len) {
+        UNUSED(len);
+        if (m_done) return;
+        /* The elements were all added, so it is the innermost array. */
+        serverAssert((long)handle == m_numframes);
+        m_numframes--;
+        valueDone();
+    }
+    virtual void replyRaw(const char *s, size_t len) {
+        if (m_done) return;
+        if (sdslen(m_pending) == 0) {
+            size_t used = parse(s,len);
+            if (used < len && !m_done)
+                m_pending = sdscatlen(m_pending,s+used,len-used);
+        } else {
+            m_pending = sdscatlen(m_pending,s,len);
+            sdsrange(m_pending,parse(m_pending,sdslen(m_pending)),-1);
+        }
+    }
+
+private:
+    struct frame {
+        long remaining;     /* Elements still missing, -1 if deferred. */
+        int index;          /* Lua index of the next element. */
+    };
+
+    void pushFrame(long len) {
+        if (m_numframes == m_maxframes) {
+            m_maxframes = m_maxframes ? m_maxframes*2 : 8;
+            m_frames = (frame *)zrealloc(m_frames,sizeof(frame)*m_maxframes);
+        }
+        m_frames[m_numframes].remaining = len;
+        m_frames[m_numframes].index = 1;
+        m_numframes++;
+    }
+
+    /* Add the value on the top of the stack to the innermost array, closing
+     * the arrays completed by it. */
+    void valueDone() {
+        while (m_numframes) {
+            frame *f = m_frames+m_numframes-1;
+
+            lua_rawseti(m_lua,-2,f->index++);
+            if (f->remaining == -1 || --f->remaining) return;
+            m_numframes--;
+        }
+        m_done = 1;
+    }
+
+    void pushField(const char *field, const char *s, size_t len) {
+        lua_checkstack(m_lua,3);
+        lua_newtable(m_lua);
+        lua_pushstring(m_lua,field);
+        lua_pushlstring(m_lua,s,len);
+        lua_settable(m_lua,-3);
+        valueDone();
+    }
+
+    /* Push the complete replies in the 'len' bytes of protocol 'buf',
+     * returning the bytes used. */
+    size_t parse(const char *buf, size_t len) {
+        size_t pos = 0;
+
+        while (pos < len && !m_done) {
+            const char *p = buf+pos;
+            const char *nl = (const char *)memchr(p,'\n',len-pos);
+            size_t used, linelen;
+            long long ll = 0;
+
+            if (nl == NULL) break;
+            used = nl-p+1;
+            linelen = used >= 3 ? used-3 : 0; /* Without type and CRLF. */
+            switch(*p) {
+            case '+':
+            case '-':
+                if (m_numframes == 0) m_type = *p;
+                pushField(*p == '+' ? "ok" : "err",p+1,linelen);
+                break;
+            case ':':
+                string2ll(p+1,linelen,&ll);
+                replyLongLong(ll);
+                break;
+            case '$':
+                string2ll(p+1,linelen,&ll);
+                if (ll < 0) {
+                    if (m_numframes == 0) m_type = '$';
+                    lua_checkstack(m_lua,2);
+                    lua_pushboolean(m_lua,0);
+                    valueDone();
+                    break;
+                }
+                if (len-pos < used+ll+2) return pos;
+                replyBulk(nl+1,ll);
+                used += ll+2;
+                break;
+            case '*':
+                string2ll(p+1,linelen,&ll);
+                replyArray(ll);
+                break;
+            default:
+                return len; /* Not protocol, discarded. */
+            }
+            pos += used;
+        }
+        return pos;
+    }
+
+    lua_State *m_lua;
+    frame *m_frames;
+    int m_numframes;
+    int m_maxframes;
+    sds m_pending;          /* Protocol of a reply not complete yet. */
+    int m_done;
+    char m_type;
+};
+
+static luaReplyBuilder luaReplyToLua;
+
 /* This function is used in order to push an error on the Lua stack in the
  * format used by redis.pcall to return errors, which is a lua table
  * with a single "err" field set to the error string. Note that this
@@ -343,6 +530,59 @@ void luaReplyToRedisReply(client *c, lua_State *lua) {
  * Lua redis.* functions implementations.
  * ------------------------------------------------------------------------- */
 
+/* Check the command 'cmd', called with the arguments of 'c' by the read only
+ * script of 'caller', see EVAL_RO: only the read only commands the I/O
+ * threads can execute are allowed, and only against the keys the caller
+ * passed to the script. Otherwise C_ERR is returned after pushing the error
+ * on the Lua stack. */
+static int luaCheckReadOnlyScriptCommand(lua_State *lua, client *caller,
+                                         client *c, struct redisCommand *cmd)
+{
+    long long numkeys = 0;
+    int j, k, n, *keys, undeclared = 0;
+
+    if (!commandCanExecuteInThread(cmd)) {
+        luaPushError(lua,
+            "Only read only commands accessing the keys of the script are "
+            "allowed from read only scripts");
+        return C_ERR;
+    }
+
+    /* The number of keys was already validated by the caller. */
+    string2ll((const char*)caller->m_argv[2]->ptr,
+              sdslen((sds)caller->m_argv[2]->ptr),&numkeys);
+    keys = getKeysFromCommand(cmd,c->m_argv,c->m_argc,&n);
+    for (j = 0; j < n && !undeclared; j++) {
+        sds key = (sds)c->m_argv[keys[j]]->ptr;
+
+        for (k = 0; k < numkeys; k++)
+            if (sdscmp(key,(sds)caller->m_argv[3+k]->ptr) == 0) break;
+        if (k == numkeys) undeclared = 1;
+    }
+    getKeysFreeResult(keys);
+    if (undeclared) {
+        luaPushError(lua,
+            "Read only script attempted to access a key not declared in KEYS");
+        return C_ERR;
+    }
+    return C_OK;
+}
+
+/* Run the command set in the Lua client, profiling it in the stats of the
+ * running script. */
+static void luaRunCommand(client *c, int call_flags) {
+    struct redisCommand *cmd = c->m_cmd;
+    long long start;
+
+    if (server.lua_cur_stats == NULL) {
+        call(c,call_flags);
+        return;
+    }
+    start = ustime();
+    call(c,call_flags);
+    scriptStatsRecordCommand(server.lua_cur_stats,cmd,ustime()-start);
+}
+
 #define LUA_CMD_OBJCACHE_SIZE 32
 #define LUA_CMD_OBJCACHE_MAX_LEN 64
 int luaRedisGenericCommand(lua_State *lua, int raise_error) {
@@ -360,6 +600,11 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
     
     int call_flags = CMD_CALL_SLOWLOG | CMD_CALL_STATS;
 
+    /* The read only scripts executed by the I/O threads have their own
+     * interpreter and fake client. */
+    if (io_thread_current_client)
+        return luaThreadRedisCommand(lua,raise_error);
+
     /* Reflect MULTI state */
     if (server.lua_multi_emitted || (server.lua_caller->m_flags & CLIENT_MULTI)) {
         c->m_flags |= CLIENT_MULTI;
@@ -488,6 +733,12 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
         goto cleanup;
     }
 
+    /* The read only scripts follow the rules of the I/O threads also when
+     * they are executed by the main thread, so that they behave the same. */
+    if (luaIsReadOnlyScript(server.lua_caller->m_cmd) &&
+        luaCheckReadOnlyScriptCommand(lua,server.lua_caller,c,cmd) == C_ERR)
+        goto cleanup;
+
     /* Write commands are forbidden against read-only slaves, or if a
      * command marked as non-deterministic was already called in the context
      * of this script. */
@@ -567,7 +818,27 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
         if (server.lua_repl & PROPAGATE_REPL)
             call_flags |= CMD_CALL_PROPAGATE_REPL;
     }
-    call(c,call_flags);
+    /* Unless the debugger logs the replies, the Lua value of the reply is
+     * built directly by the reply functions. */
+    if (!(ldb.active && ldb.step)) {
+        luaReplyToLua.reset(lua);
+        c->m_reply_builder = &luaReplyToLua;
+        luaRunCommand(c,call_flags);
+        c->m_reply_builder = NULL;
+        if (!luaReplyToLua.isDone()) {
+            lua_settop(lua,argc);
+            lua_pushboolean(lua,0);
+        }
+        if (raise_error && luaReplyToLua.replyType() != '-') raise_error = 0;
+
+        /* Sort the output array if needed, as below. */
+        if ((cmd->m_flags & CMD_SORT_FOR_SCRIPT) &&
+            (server.lua_replicate_commands == 0) &&
+            luaReplyToLua.replyType() == '*')
+                luaSortArray(lua);
+        goto cleanup;
+    }
+    luaRunCommand(c,call_flags);
 
     /* Convert the result of the Redis command into a suitable Lua type.
      * The first thing we need is to create a single string from the client
@@ -713,7 +984,10 @@ int luaRedisStatusReplyCommand(lua_State *lua) {
  * already started to write, returns false and stick to whole scripts
  * replication, which is our default. */
 int luaRedisReplicateCommandsCommand(lua_State *lua) {
-    if (server.lua_write_dirty) {
+    /* The read only scripts of the I/O threads never replicate anything. */
+    if (io_thread_current_client) {
+        lua_pushboolean(lua,1);
+    } else if (server.lua_write_dirty) {
         lua_pushboolean(lua,0);
     } else {
         server.lua_replicate_commands = 1;
@@ -766,6 +1040,7 @@ int luaRedisSetReplCommand(lua_State *lua) {
     int argc = lua_gettop(lua);
     int flags;
 
+    if (io_thread_current_client) return 0; /* Read only, nothing to set. */
     if (server.lua_replicate_commands == 0) {
         lua_pushstring(lua, "You can set the replication behavior only after turning on single commands replication with redis.replicate_commands().");
         return lua_error(lua);
@@ -835,7 +1110,9 @@ extern "C" {
 LUALIB_API int (luaopen_cjson) (lua_State *L);
 LUALIB_API int (luaopen_struct) (lua_State *L);
 LUALIB_API int (luaopen_cmsgpack) (lua_State *L);
-LUALIB_API int (luaopen_bit) (lua_State *L);
+#ifndef USE_LUAJIT
+LUALIB_API int (luaopen_bit) (lua_State *L); /* Built in LuaJIT. */
+#endif
 #ifdef __cplusplus
 }
 #endif
@@ -923,6 +1200,8 @@ void scriptingInit(int setup) {
         server.lua_caller = NULL;
         server.lua_timedout = 0;
         server.lua_always_replicate_commands = 0; /* Only DEBUG can change it.*/
+        server.lua_script_stats = dictCreate(&scriptStatsDictType,NULL);
+        server.lua_cur_stats = NULL;
         ldbInit();
     }
 
@@ -934,6 +1213,45 @@ void scriptingInit(int setup) {
      * as EVAL, so we need to remember the associated script. */
     server.lua_scripts = dictCreate(&shaScriptObjectDictType,NULL);
 
+    /* The functions are not part of the script cache, SCRIPT FLUSH keeps
+     * them. */
+    if (setup) server.lua_functions = dictCreate(&luaFunctionDictType,NULL);
+
+    luaRegisterRedisApi(lua);
+
+    /* Create the (non connected) client that we use to execute Redis commands
+     * inside the Lua interpreter.
+     * Note: there is no need to create it again when this function is called
+     * by scriptingReset(). */
+    if (server.lua_client == NULL) {
+        server.lua_client = createClient(-1);
+        server.lua_client->m_flags |= CLIENT_LUA;
+    }
+
+    /* Lua beginners often don't use "local", this is likely to introduce
+     * subtle bugs in their code. To prevent problems we protect accesses
+     * to global variables. */
+    scriptingEnableGlobalsProtection(lua);
+
+    /* Compile again the functions in the new interpreter when resetting. */
+    if (!setup) {
+        dictIterator di(server.lua_functions);
+        dictEntry *de;
+
+        while((de = di.dictNext()) != NULL) {
+            luaFunction *f = (luaFunction *)de->dictGetVal();
+            f->ref = luaFunctionCompile(NULL,lua,f->body);
+            serverAssert(f->ref != LUA_NOREF);
+        }
+    }
+
+    server.lua = lua;
+}
+
+/* Register the redis.* API, and the helper functions, in the interpreter
+ * 'lua'. Used for the interpreter of the server as well as for the ones of
+ * the I/O threads. */
+static void luaRegisterRedisApi(lua_State *lua) {
     /* Register the redis commands table and fields */
     lua_newtable(lua);
 
@@ -1065,22 +1383,6 @@ void scriptingInit(int setup) {
         luaL_loadbuffer(lua,errh_func,strlen(errh_func),"@err_handler_def");
         lua_pcall(lua,0,0,0);
     }
-
-    /* Create the (non connected) client that we use to execute Redis commands
-     * inside the Lua interpreter.
-     * Note: there is no need to create it again when this function is called
-     * by scriptingReset(). */
-    if (server.lua_client == NULL) {
-        server.lua_client = createClient(-1);
-        server.lua_client->m_flags |= CLIENT_LUA;
-    }
-
-    /* Lua beginners often don't use "local", this is likely to introduce
-     * subtle bugs in their code. To prevent problems we protect accesses
-     * to global variables. */
-    scriptingEnableGlobalsProtection(lua);
-
-    server.lua = lua;
 }
 
 /* Release resources related to Lua scripting.
@@ -1093,6 +1395,7 @@ void scriptingRelease() {
 void scriptingReset() {
     scriptingRelease();
     scriptingInit(0);
+    server.lua_scripts_epoch++;
 }
 
 /* Set an array of Redis String Objects as a Lua array (table) stored into a
@@ -1185,6 +1488,26 @@ sds luaCreateFunction(client *c, lua_State *lua, robj *body) {
         sdsfree(sha);
         return (sds)de->dictGetKey();
     }
+    if (luaDefineFunction(c,lua,funcname,body) == C_ERR) {
+        sdsfree(sha);
+        return NULL;
+    }
+
+    /* We also save a SHA1 -> Original script map in a dictionary
+     * so that we can replicate / write in the AOF all the
+     * EVALSHA commands as EVAL using the original script. */
+    int retval = server.lua_scripts->dictAdd(sha,body);
+    serverAssertWithInfo(c ? c : server.lua_client,NULL,retval == DICT_OK);
+    incrRefCount(body);
+    return sha;
+}
+
+/* Define in 'lua' the function 'funcname' with the specified body, without
+ * adding it to the scripts of the server. Returns C_ERR, after replying to
+ * 'c' if not NULL, if the body can't be compiled or executed. */
+static int luaDefineFunction(client *c, lua_State *lua, const char *funcname,
+                             robj *body)
+{
     sds funcdef = sdsempty();
     funcdef = sdscat(funcdef,"function ");
     funcdef = sdscatlen(funcdef,funcname,42);
@@ -1199,9 +1522,8 @@ sds luaCreateFunction(client *c, lua_State *lua, robj *body) {
                 lua_tostring(lua,-1));
         }
         lua_pop(lua,1);
-        sdsfree(sha);
         sdsfree(funcdef);
-        return NULL;
+        return C_ERR;
     }
     sdsfree(funcdef);
 
@@ -1211,17 +1533,221 @@ sds luaCreateFunction(client *c, lua_State *lua, robj *body) {
                 lua_tostring(lua,-1));
         }
         lua_pop(lua,1);
-        sdsfree(sha);
-        return NULL;
+        return C_ERR;
     }
+    return C_OK;
+}
+
+/* ---------------------------------------------------------------------------
+ * Script execution profiles, reported by SCRIPT STATS.
+ * ------------------------------------------------------------------------- */
+
+/* Return the stats of the script with SHA1 'name', or of the function
+ * 'name' if 'is_function' is true, creating them if needed. */
+scriptStats *scriptStatsGet(const char *name, size_t len, int is_function) {
+    static sds key = NULL; /* Reused for the lookups. */
+    dictEntry *de;
+    scriptStats *stats;
+
+    if (key == NULL) key = sdsempty();
+    sdsclear(key);
+    /* The function names are prefixed, so they can't clash with a SHA1. */
+    if (is_function) key = sdscatlen(key,"f:",2);
+    key = sdscatlen(key,name,len);
+    if ((de = server.lua_script_stats->dictFind(key)) != NULL)
+        return (scriptStats *)de->dictGetVal();
+
+    stats = (scriptStats *)zcalloc(sizeof(*stats));
+    stats->is_function = is_function;
+    server.lua_script_stats->dictAdd(sdsdup(key),stats);
+    return stats;
+}
+
+void scriptStatsRecord(scriptStats *stats, long long usec) {
+    stats->calls++;
+    stats->usec += usec;
+    if (usec > stats->max_usec) stats->max_usec = usec;
+    stats->hist[latencyHistIndex(usec)]++;
+}
+
+/* Count a redis.call() of 'cmd' that took 'usec' in the running script. */
+void scriptStatsRecordCommand(scriptStats *stats, struct redisCommand *cmd,
+                              long long usec)
+{
+    scriptCommandStats *cs;
+    int j;
+
+    for (j = 0; j < stats->numcommands; j++)
+        if (stats->commands[j].cmd == cmd) break;
+    if (j == stats->numcommands) {
+        stats->commands = (scriptCommandStats *)zrealloc(stats->commands,
+            sizeof(scriptCommandStats)*(stats->numcommands+1));
+        cs = stats->commands+stats->numcommands++;
+        cs->cmd = cmd;
+        cs->calls = 0;
+        cs->usec = 0;
+    }
+    cs = stats->commands+j;
+    cs->calls++;
+    cs->usec += usec;
+}
+
+/* Return the 'perc' percentile of the execution times of 'stats'. */
+static long long scriptStatsPercentile(scriptStats *stats, double perc) {
+    return latencyHistPercentile(stats->hist,stats->calls,stats->max_usec,perc);
+}
+
+static int scriptStatsCompare(const void *a, const void *b) {
+    scriptStats *sa = (scriptStats *)(*(dictEntry **)a)->dictGetVal();
+    scriptStats *sb = (scriptStats *)(*(dictEntry **)b)->dictGetVal();
+
+    if (sa->usec == sb->usec) return 0;
+    return sa->usec > sb->usec ? -1 : 1;
+}
+
+/* Reply to SCRIPT STATS with the stats of every script and function, the
+ * ones taking more time first. */
+static void scriptStatsReply(client *c) {
+    unsigned long numstats = server.lua_script_stats->dictSize(), j;
+    dictEntry **entries = (dictEntry **)zmalloc(sizeof(dictEntry*)*(numstats+1));
+    dictIterator di(server.lua_script_stats);
+    dictEntry *de;
+    int k;
+
+    j = 0;
+    while((de = di.dictNext()) != NULL) entries[j++] = de;
+    qsort(entries,numstats,sizeof(dictEntry*),scriptStatsCompare);
+
+    c->addReplyMultiBulkLen(numstats);
+    for (j = 0; j < numstats; j++) {
+        sds name = (sds)entries[j]->dictGetKey();
+        scriptStats *stats = (scriptStats *)entries[j]->dictGetVal();
+
+        c->addReplyMultiBulkLen(14);
+        c->addReplyBulkCString(stats->is_function ? "function" : "sha");
+        if (stats->is_function)
+            c->addReplyBulkCBuffer(name+2,sdslen(name)-2);
+        else
+            c->addReplyBulkCBuffer(name,sdslen(name));
+        c->addReplyBulkCString("calls");
+        c->addReplyLongLong(stats->calls);
+        c->addReplyBulkCString("usec");
+        c->addReplyLongLong(stats->usec);
+        c->addReplyBulkCString("usec_per_call");
+        c->addReplyLongLong(stats->calls ? stats->usec/stats->calls : 0);
+        c->addReplyBulkCString("p99_usec");
+        c->addReplyLongLong(scriptStatsPercentile(stats,99));
+        c->addReplyBulkCString("max_usec");
+        c->addReplyLongLong(stats->max_usec);
+        c->addReplyBulkCString("commands");
+        c->addReplyMultiBulkLen(stats->numcommands);
+        for (k = 0; k < stats->numcommands; k++) {
+            scriptCommandStats *cs = stats->commands+k;
+
+            c->addReplyMultiBulkLen(5);
+            c->addReplyBulkCString(cs->cmd->name);
+            c->addReplyBulkCString("calls");
+            c->addReplyLongLong(cs->calls);
+            c->addReplyBulkCString("usec");
+            c->addReplyLongLong(cs->usec);
+        }
+    }
+    zfree(entries);
+}
+
+/* Compile the body of a function of FUNCTION LOAD, returning its reference
+ * in the Lua registry. On error LUA_NOREF is returned, and the error is
+ * sent to 'c' if not NULL. The body is wrapped as the one of EVAL, but in
+ * an anonymous function that is never stored in the globals. */
+int luaFunctionCompile(client *c, lua_State *lua, robj *body) {
+    sds funcdef = sdsnew("return function() ");
+    funcdef = sdscatlen(funcdef,body->ptr,sdslen((sds)body->ptr));
+    funcdef = sdscatlen(funcdef,"\nend",4);
+
+    if (luaL_loadbuffer(lua,funcdef,sdslen(funcdef),"@user_function")) {
+        if (c != NULL) {
+            c->addReplyErrorFormat(
+                "Error compiling function: %s",lua_tostring(lua,-1));
+        }
+        lua_pop(lua,1);
+        sdsfree(funcdef);
+        return LUA_NOREF;
+    }
+    sdsfree(funcdef);
+
+    if (lua_pcall(lua,0,1,0)) {
+        if (c != NULL) {
+            c->addReplyErrorFormat("Error creating function: %s",
+                lua_tostring(lua,-1));
+        }
+        lua_pop(lua,1);
+        return LUA_NOREF;
+    }
+    return luaL_ref(lua,LUA_REGISTRYINDEX);
+}
+
+/* Return true if 'name' can be the name of a function. */
+static int luaFunctionValidName(sds name) {
+    size_t j, len = sdslen(name);
+
+    if (len == 0 || len > 128) return 0;
+    for (j = 0; j < len; j++) {
+        char ch = name[j];
+        if (!isalnum((unsigned char)ch) && ch != '_') return 0;
+    }
+    return 1;
+}
+
+/* Compile and add the function 'name' with 'body', replacing the function
+ * with the same name only if 'replace' is true. Return C_ERR, replying with
+ * the error to 'c' if not NULL, if the name is taken or not valid, or if
+ * the body does not compile. */
+int luaFunctionCreate(client *c, sds name, robj *body, int replace) {
+    dictEntry *de = server.lua_functions->dictFind(name);
+    int ref;
+
+    if (!luaFunctionValidName(name)) {
+        if (c) c->addReplyError("Function names can only contain letters, "
+                                "digits and underscores");
+        return C_ERR;
+    }
+    if (de && !replace) {
+        if (c) c->addReplyError("Function already exists, use REPLACE");
+        return C_ERR;
+    }
+    if ((ref = luaFunctionCompile(c,server.lua,body)) == LUA_NOREF)
+        return C_ERR;
 
-    /* We also save a SHA1 -> Original script map in a dictionary
-     * so that we can replicate / write in the AOF all the
-     * EVALSHA commands as EVAL using the original script. */
-    int retval = server.lua_scripts->dictAdd(sha,body);
-    serverAssertWithInfo(c ? c : server.lua_client,NULL,retval == DICT_OK);
     incrRefCount(body);
-    return sha;
+    if (de) {
+        luaFunction *f = (luaFunction *)de->dictGetVal();
+        luaL_unref(server.lua,LUA_REGISTRYINDEX,f->ref);
+        decrRefCount(f->body);
+        f->body = body;
+        f->ref = ref;
+    } else {
+        luaFunction *f = (luaFunction *)zmalloc(sizeof(*f));
+        f->body = body;
+        f->ref = ref;
+        server.lua_functions->dictAdd(sdsdup(name),f);
+    }
+    return C_OK;
+}
+
+/* Delete all the functions. */
+void luaFunctionsFlush() {
+    /* The iterator is released before emptying the dict, since it checks
+     * that the dict was not modified while iterating. */
+    {
+        dictIterator di(server.lua_functions);
+        dictEntry *de;
+
+        while((de = di.dictNext()) != NULL) {
+            luaFunction *f = (luaFunction *)de->dictGetVal();
+            luaL_unref(server.lua,LUA_REGISTRYINDEX,f->ref);
+        }
+    }
+    server.lua_functions->dictEmpty(NULL);
 }
 
 /* This is the Lua script "count" hook that we use to detect scripts timeout. */
@@ -1249,12 +1775,10 @@ void luaMaskCountHook(lua_State *lua, lua_Debug *ar) {
     }
 }
 
-void evalGenericCommand(client *c, int evalsha) {
-    lua_State *lua = server.lua;
-    char funcname[43];
-    long long numkeys;
-    int delhook = 0, err;
-
+/* Reset the state of the script about to run for EVAL, EVALSHA or FCALL,
+ * and validate the number of keys, that is stored in '*numkeys'. Return
+ * C_ERR after replying with an error if it is not valid. */
+static int luaPrepareCall(client *c, long long *numkeys) {
     /* When we replicate whole scripts, we want the same PRNG sequence at
      * every call so that our PRNG is not affected by external state. */
     redisSrand48(0);
@@ -1272,64 +1796,34 @@ void evalGenericCommand(client *c, int evalsha) {
     server.lua_replicate_commands = server.lua_always_replicate_commands;
     server.lua_multi_emitted = 0;
     server.lua_repl = PROPAGATE_AOF|PROPAGATE_REPL;
+    return luaGetNumKeys(c,numkeys);
+}
 
-    /* Get the number of arguments that are keys */
-    if (getLongLongFromObjectOrReply(c,c->m_argv[2],&numkeys,NULL) != C_OK)
-        return;
-    if (numkeys > (c->m_argc - 3)) {
+/* Validate the number of keys of the EVAL, EVALSHA or FCALL call of 'c', that
+ * is stored in '*numkeys'. Return C_ERR after replying with an error if it is
+ * not valid. */
+static int luaGetNumKeys(client *c, long long *numkeys) {
+    if (getLongLongFromObjectOrReply(c,c->m_argv[2],numkeys,NULL) != C_OK)
+        return C_ERR;
+    if (*numkeys > (c->m_argc - 3)) {
         c->addReplyError("Number of keys can't be greater than number of args");
-        return;
-    } else if (numkeys < 0) {
+        return C_ERR;
+    } else if (*numkeys < 0) {
         c->addReplyError("Number of keys can't be negative");
-        return;
-    }
-
-    /* We obtain the script SHA1, then check if this function is already
-     * defined into the Lua state */
-    funcname[0] = 'f';
-    funcname[1] = '_';
-    if (!evalsha) {
-        /* Hash the code if this is an EVAL call */
-        sha1hex(funcname+2, (char *)c->m_argv[1]->ptr,sdslen((sds)c->m_argv[1]->ptr));
-    } else {
-        /* We already have the SHA if it is a EVALSHA */
-        int j;
-        char *sha = (char *)c->m_argv[1]->ptr;
-
-        /* Convert to lowercase. We don't use tolower since the function
-         * managed to always show up in the profiler output consuming
-         * a non trivial amount of time. */
-        for (j = 0; j < 40; j++)
-            funcname[j+2] = (sha[j] >= 'A' && sha[j] <= 'Z') ?
-                sha[j]+('a'-'A') : sha[j];
-        funcname[42] = '\0';
+        return C_ERR;
     }
+    return C_OK;
+}
 
-    /* Push the pcall error handler function on the stack. */
-    lua_getglobal(lua, "__redis__err__handler");
-
-    /* Try to lookup the Lua function */
-    lua_getglobal(lua, funcname);
-    if (lua_isnil(lua,-1)) {
-        lua_pop(lua,1); /* remove the nil from the stack */
-        /* Function not defined... let's define it if we have the
-         * body of the function. If this is an EVALSHA call we can just
-         * return an error. */
-        if (evalsha) {
-            lua_pop(lua,1); /* remove the error handler from the stack. */
-            c->addReply( shared.noscripterr);
-            return;
-        }
-        if (luaCreateFunction(c,lua,c->m_argv[1]) == NULL) {
-            lua_pop(lua,1); /* remove the error handler from the stack. */
-            /* The error is sent to the client by luaCreateFunction()
-             * itself when it returns NULL. */
-            return;
-        }
-        /* Now the following is guaranteed to return non nil */
-        lua_getglobal(lua, funcname);
-        serverAssert(!lua_isnil(lua,-1));
-    }
+/* Call the function on the top of the Lua stack, above the error handler,
+ * with the keys and arguments of 'c' after its numkeys argument, sending
+ * the reply to 'c'. Both the function and the error handler are removed
+ * from the stack. */
+static void luaCallFunction(client *c, lua_State *lua, long long numkeys,
+                            const char *funcname, scriptStats *stats)
+{
+    int delhook = 0, err;
+    long long start;
 
     /* Populate the argv and keys table accordingly to the arguments that
      * EVAL received. */
@@ -1362,7 +1856,11 @@ void evalGenericCommand(client *c, int evalsha) {
     /* At this point whether this script was never seen before or if it was
      * already defined, we can call it. We have zero arguments and expect
      * a single return value. */
+    server.lua_cur_stats = stats;
+    start = ustime();
     err = lua_pcall(lua,0,1,-2);
+    scriptStatsRecord(stats,ustime()-start);
+    server.lua_cur_stats = NULL;
 
     /* Perform some cleanup that we need to do both on error and success. */
     if (delhook) lua_sethook(lua,NULL,0,0); /* Disable hook */
@@ -1415,6 +1913,69 @@ void evalGenericCommand(client *c, int evalsha) {
             decrRefCount(propargv[0]);
         }
     }
+}
+
+/* Set 'funcname' to the name of the Lua function of the script called by
+ * the EVAL or EVALSHA command of 'c': f_<hex sha1 sum>. */
+static void luaScriptFunctionName(client *c, int evalsha, char *funcname) {
+    funcname[0] = 'f';
+    funcname[1] = '_';
+    if (!evalsha) {
+        /* Hash the code if this is an EVAL call */
+        sha1hex(funcname+2, (char *)c->m_argv[1]->ptr,sdslen((sds)c->m_argv[1]->ptr));
+    } else {
+        /* We already have the SHA if it is a EVALSHA */
+        int j;
+        char *sha = (char *)c->m_argv[1]->ptr;
+
+        /* Convert to lowercase. We don't use tolower since the function
+         * managed to always show up in the profiler output consuming
+         * a non trivial amount of time. */
+        for (j = 0; j < 40; j++)
+            funcname[j+2] = (sha[j] >= 'A' && sha[j] <= 'Z') ?
+                sha[j]+('a'-'A') : sha[j];
+        funcname[42] = '\0';
+    }
+}
+
+void evalGenericCommand(client *c, int evalsha) {
+    lua_State *lua = server.lua;
+    char funcname[43];
+    long long numkeys;
+
+    if (luaPrepareCall(c,&numkeys) != C_OK) return;
+
+    /* We obtain the script SHA1, then check if this function is already
+     * defined into the Lua state */
+    luaScriptFunctionName(c,evalsha,funcname);
+
+    /* Push the pcall error handler function on the stack. */
+    lua_getglobal(lua, "__redis__err__handler");
+
+    /* Try to lookup the Lua function */
+    lua_getglobal(lua, funcname);
+    if (lua_isnil(lua,-1)) {
+        lua_pop(lua,1); /* remove the nil from the stack */
+        /* Function not defined... let's define it if we have the
+         * body of the function. If this is an EVALSHA call we can just
+         * return an error. */
+        if (evalsha) {
+            lua_pop(lua,1); /* remove the error handler from the stack. */
+            c->addReply( shared.noscripterr);
+            return;
+        }
+        if (luaCreateFunction(c,lua,c->m_argv[1]) == NULL) {
+            lua_pop(lua,1); /* remove the error handler from the stack. */
+            /* The error is sent to the client by luaCreateFunction()
+             * itself when it returns NULL. */
+            return;
+        }
+        /* Now the following is guaranteed to return non nil */
+        lua_getglobal(lua, funcname);
+        serverAssert(!lua_isnil(lua,-1));
+    }
+
+    luaCallFunction(c,lua,numkeys,funcname,scriptStatsGet(funcname+2,40,0));
 
     /* EVALSHA should be propagated to Slave and AOF file as full EVAL, unless
      * we are sure that the script was already in the context of all the
@@ -1425,8 +1986,12 @@ void evalGenericCommand(client *c, int evalsha) {
      *
      * For repliation, everytime a new slave attaches to the master, we need to
      * flush our cache of scripts that can be replicated as EVALSHA, while
-     * for AOF we need to do so every time we rewrite the AOF file. */
-    if (evalsha && !server.lua_replicate_commands) {
+     * for AOF we need to do so every time we rewrite the AOF file.
+     *
+     * The read only scripts are never propagated. */
+    if (evalsha && !server.lua_replicate_commands &&
+        !luaIsReadOnlyScript(c->m_cmd))
+    {
         if (!replicationScriptCacheExists((sds)c->m_argv[1]->ptr)) {
             /* This script is not in our script cache, replicate it as
              * EVAL, then add it into the script cache, as from now on
@@ -1467,9 +2032,278 @@ void evalShaCommand(client *c) {
     }
 }
 
+/* EVAL_RO and EVALSHA_RO: as EVAL and EVALSHA, but the script can only call
+ * read only commands against the keys it declares, so that it can also be
+ * executed by the I/O threads, see lua-parallel-scripts. */
+void evalRoCommand(client *c) {
+    if (io_thread_current_client)
+        evalThreadGenericCommand(c,0);
+    else
+        evalCommand(c);
+}
+
+void evalShaRoCommand(client *c) {
+    if (!io_thread_current_client) {
+        evalShaCommand(c);
+    } else if (sdslen((sds)c->m_argv[1]->ptr) != 40) {
+        c->addReply(shared.noscripterr);
+    } else {
+        evalThreadGenericCommand(c,1);
+    }
+}
+
+int luaIsReadOnlyScript(struct redisCommand *cmd) {
+    return cmd->proc == evalRoCommand || cmd->proc == evalShaRoCommand;
+}
+
+/* ---------------------------------------------------------------------------
+ * Read only scripts executed by the I/O threads, see lua-parallel-scripts.
+ *
+ * Only EVAL_RO and EVALSHA_RO are executed here. EVAL and EVALSHA, that may
+ * write, are always executed by the main thread: there are no per-key locks,
+ * the threads only run while the main thread waits for the parallel reads
+ * pass, and the dataset is not modified at all meanwhile.
+ * ------------------------------------------------------------------------- */
+
+/* Every I/O thread has its own interpreter, with the same redis.* API as
+ * server.lua, and its own fake client. The scripts are compiled in the
+ * interpreter the first time the thread runs them, and the interpreter is
+ * created again when SCRIPT FLUSH changes server.lua_scripts_epoch. */
+typedef struct luaThreadState {
+    lua_State *lua;
+    client *c;              /* The "fake client" of the thread. */
+    long long epoch;        /* server.lua_scripts_epoch of the interpreter. */
+    mstime_t time_start;    /* Start time of the running script. */
+    long gc_count;
+} luaThreadState;
+
+static __thread luaThreadState *lua_thread_state = NULL;
+
+static luaThreadState *luaThreadStateGet(void) {
+    luaThreadState *lts = lua_thread_state;
+
+    if (lts == NULL) {
+        lts = (luaThreadState *)zcalloc(sizeof(*lts));
+        lts->c = createClient(-1);
+        lts->c->m_flags |= CLIENT_LUA;
+        lua_thread_state = lts;
+    }
+    if (lts->lua && lts->epoch != server.lua_scripts_epoch) {
+        lua_close(lts->lua);
+        lts->lua = NULL;
+    }
+    if (lts->lua == NULL) {
+        lts->lua = lua_open();
+        luaLoadLibraries(lts->lua);
+        luaRemoveUnsupportedFunctions(lts->lua);
+        luaRegisterRedisApi(lts->lua);
+        scriptingEnableGlobalsProtection(lts->lua);
+        lts->epoch = server.lua_scripts_epoch;
+    }
+    return lts;
+}
+
+/* SCRIPT KILL can't be served while the threads execute the scripts, so the
+ * scripts running for more than lua-time-limit are aborted instead. */
+static void luaThreadMaskCountHook(lua_State *lua, lua_Debug *ar) {
+    UNUSED(ar);
+
+    if (mstime() - lua_thread_state->time_start >= server.lua_time_limit) {
+        lua_pushstring(lua,"Read only script executed by an I/O thread "
+                           "aborted after lua-time-limit milliseconds");
+        lua_error(lua);
+    }
+}
+
+/* redis.call() and redis.pcall() of the scripts executed by the I/O threads.
+ * Like luaRedisGenericCommand(), but the command is checked by
+ * luaCheckReadOnlyScriptCommand() and just executed: what call() does besides
+ * is left out, as for the commands the threads execute. */
+static int luaThreadRedisCommand(lua_State *lua, int raise_error) {
+    int j, argc = lua_gettop(lua);
+    client *caller = io_thread_current_client;
+    client *c = lua_thread_state->c;
+    struct redisCommand *cmd;
+    size_t arena_mark;
+    robj **argv;
+    sds reply;
+
+    if (argc == 0) {
+        luaPushError(lua,
+            "Please specify at least one argument for redis.call()");
+        return raise_error ? luaRaiseError(lua) : 1;
+    }
+
+    /* Build the arguments vector */
+    argv = (robj **)zmalloc(sizeof(robj*)*argc);
+    for (j = 0; j < argc; j++) {
+        char *obj_s;
+        size_t obj_len;
+        char dbuf[64];
+
+        if (lua_type(lua,j+1) == LUA_TNUMBER) {
+            lua_Number num = lua_tonumber(lua,j+1);
+
+            obj_len = snprintf(dbuf,sizeof(dbuf),"%.17g",(double)num);
+            obj_s = dbuf;
+        } else {
+            obj_s = (char*)lua_tolstring(lua,j+1,&obj_len);
+            if (obj_s == NULL) break; /* Not a string. */
+        }
+        argv[j] = createStringObject(obj_s, obj_len);
+    }
+    if (j != argc) {
+        while (j--) decrRefCount(argv[j]);
+        zfree(argv);
+        luaPushError(lua,
+            "Lua redis() command arguments must be strings or integers");
+        return raise_error ? luaRaiseError(lua) : 1;
+    }
+    c->m_argv = argv;
+    c->m_argc = argc;
+
+    /* Command lookup and checks */
+    cmd = lookupCommand((char*)argv[0]->ptr);
+    if (!cmd || ((cmd->arity > 0 && cmd->arity != argc) ||
+                   (argc < -cmd->arity)))
+    {
+        if (cmd)
+            luaPushError(lua,
+                "Wrong number of args calling Redis command From Lua script");
+        else
+            luaPushError(lua,"Unknown Redis command called from Lua script");
+        goto cleanup;
+    }
+    if (cmd->m_flags & CMD_NOSCRIPT) {
+        luaPushError(lua, "This Redis command is not allowed from scripts");
+        goto cleanup;
+    }
+    if (luaCheckReadOnlyScriptCommand(lua,caller,c,cmd) == C_ERR)
+        goto cleanup;
+    c->m_cmd = c->m_last_cmd = cmd;
+
+    /* Run the command as the client of the thread. */
+    arena_mark = zarena_mark();
+    io_thread_current_client = c;
+    cmd->proc(c);
+    io_thread_current_client = caller;
+    zarena_release(arena_mark);
+
+    /* Convert the reply into a Lua value, as luaRedisGenericCommand() does
+     * when the reply builder is not used. */
+    reply = sdsnewlen(c->m_response_buff,c->m_response_buff_pos);
+    c->m_response_buff_pos = 0;
+    while(c->m_reply->listLength()) {
+        sds o = (sds)c->m_reply->listFirst()->listNodeValue();
+
+        reply = sdscatsds(reply,o);
+        c->m_reply->listDelNode(c->m_reply->listFirst());
+    }
+    c->m_reply_bytes = 0;
+    if (raise_error && reply[0] != '-') raise_error = 0;
+    redisProtocolToLuaType(lua,reply);
+    if ((cmd->m_flags & CMD_SORT_FOR_SCRIPT) &&
+        (reply[0] == '*' && reply[1] != '-'))
+            luaSortArray(lua);
+    sdsfree(reply);
+
+cleanup:
+    for (j = 0; j < c->m_argc; j++) decrRefCount(c->m_argv[j]);
+    zfree(c->m_argv);
+    c->m_argv = NULL;
+    c->m_argc = 0;
+
+    if (raise_error) return luaRaiseError(lua);
+    return 1;
+}
+
+/* EVAL_RO and EVALSHA_RO executed by an I/O thread, in the interpreter of the
+ * thread. A script not yet compiled there is taken from the body of EVAL_RO,
+ * or from the scripts of the server for EVALSHA_RO: the scripts only sent by
+ * EVAL_RO are added to the server by the main thread after the pass, see
+ * luaThreadScriptDone(). */
+static void evalThreadGenericCommand(client *c, int evalsha) {
+    luaThreadState *lts = luaThreadStateGet();
+    lua_State *lua = lts->lua;
+    char funcname[43];
+    long long numkeys;
+    int delhook = 0, err;
+
+    if (luaGetNumKeys(c,&numkeys) != C_OK) return;
+    redisSrand48(0);
+    luaScriptFunctionName(c,evalsha,funcname);
+
+    /* Push the pcall error handler and the function on the stack. */
+    lua_getglobal(lua, "__redis__err__handler");
+    lua_getglobal(lua, funcname);
+    if (lua_isnil(lua,-1)) {
+        robj *body = evalsha ?
+            (robj *)server.lua_scripts->dictFetchValue(c->m_argv[1]->ptr) :
+            c->m_argv[1];
+
+        lua_pop(lua,1); /* remove the nil from the stack */
+        if (body == NULL) {
+            lua_pop(lua,1); /* remove the error handler from the stack. */
+            c->addReply(shared.noscripterr);
+            return;
+        }
+        if (luaDefineFunction(c,lua,funcname,body) == C_ERR) {
+            lua_pop(lua,1); /* remove the error handler from the stack. */
+            return;
+        }
+        lua_getglobal(lua, funcname);
+        serverAssert(!lua_isnil(lua,-1));
+    }
+
+    luaSetGlobalArray(lua,"KEYS",c->m_argv+3,numkeys);
+    luaSetGlobalArray(lua,"ARGV",c->m_argv+3+numkeys,c->m_argc-3-numkeys);
+    lts->c->selectDb(c->m_cur_selected_db->m_id);
+
+    lts->time_start = mstime();
+    if (server.lua_time_limit > 0) {
+        lua_sethook(lua,luaThreadMaskCountHook,LUA_MASKCOUNT,100000);
+        delhook = 1;
+    }
+    err = lua_pcall(lua,0,1,-2);
+    if (delhook) lua_sethook(lua,NULL,0,0); /* Disable hook */
+
+    if (++lts->gc_count == LUA_GC_CYCLE_PERIOD) {
+        lua_gc(lua,LUA_GCSTEP,LUA_GC_CYCLE_PERIOD);
+        lts->gc_count = 0;
+    }
+
+    if (err) {
+        c->addReplyErrorFormat("Error running script (call to %s): %s\n",
+            funcname, lua_tostring(lua,-1));
+        lua_pop(lua,2); /* Consume the Lua reply and remove error handler. */
+    } else {
+        luaReplyToRedisReply(c,lua); /* Convert and consume the reply. */
+        lua_pop(lua,1); /* Remove the error handler. */
+    }
+}
+
+/* Called by the main thread after an I/O thread executed the read only
+ * script of 'c' in 'duration' microseconds: add to the scripts of the server
+ * the ones only known by the thread, and record the script stats. */
+void luaThreadScriptDone(client *c, long long duration) {
+    int evalsha = c->m_cmd->proc == evalShaRoCommand;
+    char funcname[43];
+
+    if (evalsha && sdslen((sds)c->m_argv[1]->ptr) != 40) return;
+    luaScriptFunctionName(c,evalsha,funcname);
+
+    sds sha = sdsnewlen(funcname+2,40);
+    if (!evalsha && server.lua_scripts->dictFind(sha) == NULL)
+        luaCreateFunction(NULL,server.lua,c->m_argv[1]);
+    if (server.lua_scripts->dictFind(sha) != NULL)
+        scriptStatsRecord(scriptStatsGet(funcname+2,40,0),duration);
+    sdsfree(sha);
+}
+
 void scriptCommand(client *c) {
     if (c->m_argc == 2 && !strcasecmp((const char*)c->m_argv[1]->ptr,"flush")) {
         scriptingReset();
+        server.lua_script_stats->dictEmpty(NULL);
         c->addReply(shared.ok);
         replicationScriptCacheFlush();
         server.dirty++; /* Propagating this command is a good idea. */
@@ -1488,6 +2322,12 @@ void scriptCommand(client *c) {
         if (sha == NULL) return; /* The error was sent by luaCreateFunction(). */
         c->addReplyBulkCBuffer(sha,40);
         forceCommandPropagation(c,PROPAGATE_REPL|PROPAGATE_AOF);
+    } else if (c->m_argc == 2 && !strcasecmp((const char*)c->m_argv[1]->ptr,"stats")) {
+        scriptStatsReply(c);
+    } else if (c->m_argc == 3 && !strcasecmp((const char*)c->m_argv[1]->ptr,"stats") &&
+               !strcasecmp((const char*)c->m_argv[2]->ptr,"reset")) {
+        server.lua_script_stats->dictEmpty(NULL);
+        c->addReply(shared.ok);
     } else if (c->m_argc == 2 && !strcasecmp((const char*)c->m_argv[1]->ptr,"kill")) {
         if (server.lua_caller == NULL) {
             c->addReplySds(sdsnew("-NOTBUSY No scripts in execution right now.\r\n"));
@@ -1520,6 +2360,88 @@ void scriptCommand(client *c) {
     }
 }
 
+/* FUNCTION LOAD [REPLACE] <name> <body>
+ * FUNCTION DELETE <name>
+ * FUNCTION LIST
+ * FUNCTION FLUSH
+ *
+ * The functions are part of the dataset: they are saved in the RDB and the
+ * AOF, and propagated to the slaves. */
+void functionCommand(client *c) {
+    const char *sub = (const char*)c->m_argv[1]->ptr;
+
+    if ((c->m_argc == 4 || c->m_argc == 5) && !strcasecmp(sub,"load")) {
+        int replace = c->m_argc == 5;
+
+        if (replace && strcasecmp((const char*)c->m_argv[2]->ptr,"replace")) {
+            c->addReply(shared.syntaxerr);
+            return;
+        }
+        if (luaFunctionCreate(c,(sds)c->m_argv[c->m_argc-2]->ptr,
+                              c->m_argv[c->m_argc-1],replace) == C_ERR)
+            return; /* The error was sent by luaFunctionCreate(). */
+        c->addReply(shared.ok);
+        server.dirty++;
+    } else if (c->m_argc == 3 && !strcasecmp(sub,"delete")) {
+        dictEntry *de = server.lua_functions->dictFind(c->m_argv[2]->ptr);
+
+        if (de == NULL) {
+            c->addReplyError("No such function");
+            return;
+        }
+        luaL_unref(server.lua,LUA_REGISTRYINDEX,
+                   ((luaFunction *)de->dictGetVal())->ref);
+        server.lua_functions->dictDelete(c->m_argv[2]->ptr);
+        c->addReply(shared.ok);
+        server.dirty++;
+    } else if (c->m_argc == 2 && !strcasecmp(sub,"list")) {
+        dictIterator di(server.lua_functions);
+        dictEntry *de;
+
+        c->addReplyMultiBulkLen(server.lua_functions->dictSize());
+        while((de = di.dictNext()) != NULL) {
+            sds name = (sds)de->dictGetKey();
+
+            c->addReplyMultiBulkLen(2);
+            c->addReplyBulkCBuffer(name,sdslen(name));
+            c->addReplyBulk(((luaFunction *)de->dictGetVal())->body);
+        }
+    } else if (c->m_argc == 2 && !strcasecmp(sub,"flush")) {
+        luaFunctionsFlush();
+        c->addReply(shared.ok);
+        server.dirty++;
+    } else {
+        c->addReplyError("Unknown FUNCTION subcommand or wrong # of args.");
+    }
+}
+
+/* FCALL <name> <numkeys> [key ...] [arg ...]
+ *
+ * As EVAL, but calling a function of FUNCTION LOAD by its name. */
+void fcallCommand(client *c) {
+    lua_State *lua = server.lua;
+    long long numkeys;
+    dictEntry *de;
+
+    if (c->m_flags & CLIENT_LUA_DEBUG) {
+        c->addReplyError("Please use EVAL instead of FCALL for debugging");
+        return;
+    }
+    if (luaPrepareCall(c,&numkeys) != C_OK) return;
+    if ((de = server.lua_functions->dictFind(c->m_argv[1]->ptr)) == NULL) {
+        c->addReplySds(sdsnew("-NOSCRIPT No matching function. "
+                              "Please use FUNCTION LOAD.\r\n"));
+        return;
+    }
+
+    /* Push the pcall error handler, and the function from the registry. */
+    lua_getglobal(lua, "__redis__err__handler");
+    lua_rawgeti(lua,LUA_REGISTRYINDEX,((luaFunction *)de->dictGetVal())->ref);
+    luaCallFunction(c,lua,numkeys,(const char*)c->m_argv[1]->ptr,
+        scriptStatsGet((const char*)de->dictGetKey(),
+                       sdslen((sds)de->dictGetKey()),1));
+}
+
 /* ---------------------------------------------------------------------------
  * LDB: Redis Lua debugging facilities
  * ------------------------------------------------------------------------- */
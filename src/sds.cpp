@@ -39,6 +39,13 @@
 #include "sds.h"
 #include "sdsalloc.h"
 
+/* The case conversion and sdscatrepr() scan the string 16 bytes at a time
+ * with SSE2, that every x86_64 CPU has. */
+#if defined(__SSE2__)
+#define HAVE_SDS_SSE2 1
+#include <emmintrin.h>
+#endif
+
 static inline int sdsHdrSize(char type) {
     switch(type&SDS_TYPE_MASK) {
         case SDS_TYPE_5:
@@ -82,7 +89,30 @@ static inline char sdsReqType(size_t string_size) {
  * end of the string. However the string is binary safe and can contain
  * \0 characters in the middle, as the length is stored in the sds header. */
 sds sdsnewlen(const void *init, size_t initlen) {
-    void *sh;
+    size_t size = sdsinplacesize(initlen);
+    void *sh = s_malloc(size);
+
+    if (sh == NULL) return NULL;
+    if (!init)
+        memset(sh, 0, size);
+    return sdsnewinplace(sh, init, initlen);
+}
+
+/* Return the number of bytes sdsnewinplace() needs to store a string of
+ * 'initlen' bytes. */
+size_t sdsinplacesize(size_t initlen) {
+    char type = sdsReqType(initlen);
+    if (type == SDS_TYPE_5 && initlen == 0) type = SDS_TYPE_8;
+    return sdsHdrSize(type)+initlen+1;
+}
+
+/* Like sdsnewlen(), but the string is created in the memory pointed by 'buf',
+ * whose size must be at least sdsinplacesize(initlen), instead of being
+ * allocated. The string belongs to the owner of 'buf': it must not be freed
+ * or modified in ways that may reallocate it. This is used in order to store
+ * a string inside another allocation, like the keys of the dictionary
+ * entries of the keyspace. */
+sds sdsnewinplace(void *sh, const void *init, size_t initlen) {
     sds s;
     char type = sdsReqType(initlen);
     /* Empty strings are usually created in order to append. Use type 8
@@ -91,10 +121,6 @@ sds sdsnewlen(const void *init, size_t initlen) {
     int hdrlen = sdsHdrSize(type);
     unsigned char *fp; /* flags pointer. */
 
-    sh = s_malloc(hdrlen+initlen+1);
-    if (!init)
-        memset(sh, 0, hdrlen+initlen+1);
-    if (sh == NULL) return NULL;
     s = (char*)sh+hdrlen;
     fp = ((unsigned char*)s)-1;
     switch(type) {
@@ -752,16 +778,37 @@ void sdsrange(sds s, int start, int end) {
 
 /* Apply tolower() to every character of the sds string 's'. */
 void sdstolower(sds s) {
-    int len = sdslen(s), j;
-
-    for (j = 0; j < len; j++) s[j] = tolower(s[j]);
+    int len = sdslen(s), j = 0;
+
+#if defined(HAVE_SDS_SSE2)
+    /* The server runs with the "C" locale for LC_CTYPE, so only the ASCII
+     * letters change case: add 0x20 to the bytes from 'A' to 'Z'. Bytes
+     * over 0x7f are negative for the signed compares, so never in range. */
+    const __m128i lo = _mm_set1_epi8('A'-1), hi = _mm_set1_epi8('Z'+1);
+    const __m128i bit = _mm_set1_epi8(0x20);
+    for (; j+16 <= len; j += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(s+j));
+        __m128i m = _mm_and_si128(_mm_cmpgt_epi8(x,lo),_mm_cmplt_epi8(x,hi));
+        _mm_storeu_si128((__m128i*)(s+j),_mm_or_si128(x,_mm_and_si128(m,bit)));
+    }
+#endif
+    for (; j < len; j++) s[j] = tolower(s[j]);
 }
 
 /* Apply toupper() to every character of the sds string 's'. */
 void sdstoupper(sds s) {
-    int len = sdslen(s), j;
-
-    for (j = 0; j < len; j++) s[j] = toupper(s[j]);
+    int len = sdslen(s), j = 0;
+
+#if defined(HAVE_SDS_SSE2)
+    const __m128i lo = _mm_set1_epi8('a'-1), hi = _mm_set1_epi8('z'+1);
+    const __m128i bit = _mm_set1_epi8(0x20);
+    for (; j+16 <= len; j += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(s+j));
+        __m128i m = _mm_and_si128(_mm_cmpgt_epi8(x,lo),_mm_cmplt_epi8(x,hi));
+        _mm_storeu_si128((__m128i*)(s+j),_mm_andnot_si128(_mm_and_si128(m,bit),x));
+    }
+#endif
+    for (; j < len; j++) s[j] = toupper(s[j]);
 }
 
 /* Compare two sds strings s1 and s2 with memcmp().
@@ -804,7 +851,8 @@ int sdscmp(const sds s1, const sds s2) {
  * same function but for zero-terminated strings.
  */
 sds *sdssplitlen(const char *s, int len, const char *sep, int seplen, int *count) {
-    int elements = 0, slots = 5, start = 0, j;
+    int elements = 0, slots = 5, start = 0;
+    const char *found;
     sds *tokens;
 
     if (seplen < 1 || len < 0) return NULL;
@@ -816,7 +864,15 @@ sds *sdssplitlen(const char *s, int len, const char *sep, int seplen, int *count
         *count = 0;
         return tokens;
     }
-    for (j = 0; j < (len-(seplen-1)); j++) {
+    /* Search the separators with memchr() / memmem(), that the C library
+     * implements comparing many bytes at a time. */
+    while (1) {
+        if (seplen == 1)
+            found = (const char *)memchr(s+start,sep[0],len-start);
+        else
+            found = (const char *)memmem(s+start,len-start,sep,seplen);
+        if (found == NULL) break;
+
         /* make sure there is room for the next element and the final one */
         if (slots < elements+2) {
             sds *newtokens;
@@ -826,14 +882,10 @@ sds *sdssplitlen(const char *s, int len, const char *sep, int seplen, int *count
             if (newtokens == NULL) goto cleanup;
             tokens = newtokens;
         }
-        /* search the separator */
-        if ((seplen == 1 && *(s+j) == sep[0]) || (memcmp(s+j,sep,seplen) == 0)) {
-            tokens[elements] = sdsnewlen(s+start,j-start);
-            if (tokens[elements] == NULL) goto cleanup;
-            elements++;
-            start = j+seplen;
-            j = j+seplen-1; /* skip the separator */
-        }
+        tokens[elements] = sdsnewlen(s+start,found-(s+start));
+        if (tokens[elements] == NULL) goto cleanup;
+        elements++;
+        start = (found-s)+seplen; /* skip the separator */
     }
     /* Add the final element. We are sure there is room in the tokens array. */
     tokens[elements] = sdsnewlen(s+start,len-start);
@@ -866,13 +918,47 @@ void sdsfreesplitres(sds *tokens, int count) {
  *
  * After the call, the modified sds string is no longer valid and all the
  * references must be substituted with the new pointer returned by the call. */
+/* Return the length of the prefix of 'p' made of printable characters that
+ * sdscatrepr() does not need to escape. */
+static size_t sdsReprPlainLen(const char *p, size_t len) {
+    size_t j = 0;
+
+#if defined(HAVE_SDS_SSE2)
+    const __m128i lo = _mm_set1_epi8(0x1f), hi = _mm_set1_epi8(0x7f);
+    const __m128i quote = _mm_set1_epi8('"'), bslash = _mm_set1_epi8('\\');
+    for (; j+16 <= len; j += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(p+j));
+        __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(x,lo),_mm_cmplt_epi8(x,hi));
+        __m128i esc = _mm_or_si128(_mm_cmpeq_epi8(x,quote),
+                                   _mm_cmpeq_epi8(x,bslash));
+        unsigned mask = _mm_movemask_epi8(_mm_andnot_si128(esc,ok));
+        if (mask != 0xffff) return j+__builtin_ctz(~mask);
+    }
+#endif
+    while (j < len && p[j] != '"' && p[j] != '\\' && isprint(p[j])) j++;
+    return j;
+}
+
 sds sdscatrepr(sds s, const char *p, size_t len) {
+    char buf[4];
+
     s = sdscatlen(s,"\"",1);
-    while(len--) {
+    while(len) {
+        /* Append the characters that need no escaping in a single step. */
+        size_t plain = sdsReprPlainLen(p,len);
+        if (plain) {
+            s = sdscatlen(s,p,plain);
+            p += plain;
+            len -= plain;
+            continue;
+        }
+        len--;
         switch(*p) {
         case '\\':
         case '"':
-            s = sdscatprintf(s,"\\%c",*p);
+            buf[0] = '\\';
+            buf[1] = *p;
+            s = sdscatlen(s,buf,2);
             break;
         case '\n': s = sdscatlen(s,"\\n",2); break;
         case '\r': s = sdscatlen(s,"\\r",2); break;
@@ -880,10 +966,11 @@ sds sdscatrepr(sds s, const char *p, size_t len) {
         case '\a': s = sdscatlen(s,"\\a",2); break;
         case '\b': s = sdscatlen(s,"\\b",2); break;
         default:
-            if (isprint(*p))
-                s = sdscatprintf(s,"%c",*p);
-            else
-                s = sdscatprintf(s,"\\x%02x",(unsigned char)*p);
+            buf[0] = '\\';
+            buf[1] = 'x';
+            buf[2] = "0123456789abcdef"[(unsigned char)*p >> 4];
+            buf[3] = "0123456789abcdef"[(unsigned char)*p & 15];
+            s = sdscatlen(s,buf,4);
             break;
         }
         p++;
@@ -232,6 +232,8 @@ inline void sdssetalloc(sds s, size_t newlen) {
 }
 
 sds sdsnewlen(const void *init, size_t initlen);
+size_t sdsinplacesize(size_t initlen);
+sds sdsnewinplace(void *buf, const void *init, size_t initlen);
 sds sdsnew(const char *init);
 sds sdsempty();
 sds sdsdup(const sds s);
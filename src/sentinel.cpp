@@ -37,6 +37,7 @@
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <math.h>
 
 extern char **environ;
 
@@ -84,6 +85,14 @@ struct sentinelAddr {
 #define SENTINEL_MAX_PENDING_COMMANDS 100
 #define SENTINEL_ELECTION_TIMEOUT 10000
 #define SENTINEL_MAX_DESYNC 1000
+#define SENTINEL_PINGS_PER_DOWN_AFTER 4  /* Pings in down-after-milliseconds. */
+#define SENTINEL_MIN_PING_PERIOD 20
+#define SENTINEL_RTT_MIN_SAMPLES 8  /* Before using the RTT statistics. */
+#define SENTINEL_PHI_MIN_STDDEV 5   /* Milliseconds. */
+#define SENTINEL_DEFAULT_PHI_THRESHOLD 0 /* Disabled. */
+#define SENTINEL_WHEEL_SLOTS 512
+#define SENTINEL_WHEEL_RESOLUTION 10    /* Milliseconds per wheel slot. */
+#define SENTINEL_HELLO_BATCH_MAX (64*1024) /* Hello batch bytes to flush. */
 
 /* Failover machine different states. */
 #define SENTINEL_FAILOVER_STATE_NONE 0  /* No failover in progress. */
@@ -158,6 +167,14 @@ struct instanceLink {
                                  if the link is idle and must be reconnected. */
     mstime_t last_reconn_time;  /* Last reconnection attempt performed when
                                    the link was down. */
+    sds hello_batch;        /* Hello messages to send to this Sentinel with
+                               a single PUBLISH, or NULL. */
+    /* Round trip time of the pings, as in TCP (RFC 6298): the smoothed
+     * average and mean deviation, in microseconds. */
+    long long act_ping_time_us; /* Like act_ping_time, in microseconds. */
+    long long rtt_avg;
+    long long rtt_var;
+    long long rtt_samples;
 };
 
 struct sentinelRedisInstance {
@@ -176,7 +193,12 @@ struct sentinelRedisInstance {
     mstime_t s_down_since_time; /* Subjectively down since time. */
     mstime_t o_down_since_time; /* Objectively down since time. */
     mstime_t down_after_period; /* Consider it down after that period. */
+    double phi_threshold;   /* Suspicion level phi needed, besides the
+                               down_after_period, to consider it down, or 0
+                               to rely on the down_after_period alone. See
+                               sentinelPhi(). */
     mstime_t info_refresh;  /* Time at which we received INFO output from it. */
+    mstime_t info_sent_time; /* Time at which we sent the last INFO. */
 
     /* Role and the first time we observed it.
      * This is useful in order to delay replacing what the instance reports
@@ -222,6 +244,11 @@ struct sentinelRedisInstance {
     char *notification_script;
     char *client_reconfig_script;
     sds info; /* cached INFO output */
+
+    /* Master specific: scheduling in the wheel, see sentinelWheelSchedule(). */
+    listNode *wheel_node;   /* Node in sentinel.wheel[wheel_slot], or NULL. */
+    int wheel_slot;
+    mstime_t wheel_due;     /* Time to handle the master again. */
 };
 
 /* Main state. */
@@ -241,6 +268,9 @@ struct sentinelState {
     int announce_port;  /* Port that is gossiped to other sentinels if
                            non zero. */
     unsigned long simfailure_flags; /* Failures simulation. */
+    list *wheel[SENTINEL_WHEEL_SLOTS]; /* Masters by time to handle them. */
+    mstime_t wheel_time;    /* Time of the next wheel slot to process. */
+    list *hello_links;      /* Links having a hello_batch to send. */
 } sentinel;
 
 /* A script execution job. */
@@ -373,6 +403,9 @@ char *sentinelVoteLeader(sentinelRedisInstance *master, uint64_t req_epoch, char
 void sentinelFlushConfig();
 void sentinelGenerateInitialMonitorEvents();
 int sentinelSendPing(sentinelRedisInstance *ri);
+void sentinelWheelSchedule(sentinelRedisInstance *master, mstime_t when);
+void sentinelWakeMaster(sentinelRedisInstance *ri);
+void sentinelFlushHelloBatch(instanceLink *link);
 int sentinelForceHelloUpdateForMaster(sentinelRedisInstance *master);
 sentinelRedisInstance *getSentinelRedisInstanceByAddrAndRunID(dict *instances, char *ip, int port, char *runid);
 void sentinelSimFailureCrash();
@@ -469,6 +502,9 @@ void initSentinel() {
     sentinel.announce_port = 0;
     sentinel.simfailure_flags = SENTINEL_SIMFAILURE_NONE;
     memset(sentinel.myid,0,sizeof(sentinel.myid));
+    for (j = 0; j < SENTINEL_WHEEL_SLOTS; j++) sentinel.wheel[j] = listCreate();
+    sentinel.wheel_time = mstime();
+    sentinel.hello_links = listCreate();
 }
 
 /* This function gets called when the server is in Sentinel mode, started,
@@ -936,9 +972,14 @@ instanceLink *createInstanceLink() {
      * This is useful to detect a timeout in case we'll not be able to connect
      * with the node at all. */
     link->act_ping_time = mstime();
+    link->act_ping_time_us = 0;
     link->last_ping_time = 0;
     link->last_avail_time = mstime();
     link->last_pong_time = mstime();
+    link->rtt_avg = 0;
+    link->rtt_var = 0;
+    link->rtt_samples = 0;
+    link->hello_batch = NULL;
     return link;
 }
 
@@ -992,6 +1033,11 @@ instanceLink *releaseInstanceLink(instanceLink *link, sentinelRedisInstance *ri)
 
     instanceLinkCloseConnection(link,link->cc);
     instanceLinkCloseConnection(link,link->pc);
+    if (link->hello_batch) {
+        sentinel.hello_links->listDelNode(
+            sentinel.hello_links->listSearchKey(link));
+        sdsfree(link->hello_batch);
+    }
     zfree(link);
     return NULL;
 }
@@ -1184,6 +1230,8 @@ sentinelRedisInstance *createSentinelRedisInstance(char *name, int flags, char *
     ri->o_down_since_time = 0;
     ri->down_after_period = master ? master->down_after_period :
                             SENTINEL_DEFAULT_DOWN_AFTER;
+    ri->phi_threshold = master ? master->phi_threshold :
+                        SENTINEL_DEFAULT_PHI_THRESHOLD;
     ri->master_link_down_time = 0;
     ri->auth_pass = NULL;
     ri->slave_priority = SENTINEL_DEFAULT_SLAVE_PRIORITY;
@@ -1198,6 +1246,7 @@ sentinelRedisInstance *createSentinelRedisInstance(char *name, int flags, char *
     ri->master = master;
     ri->slaves = dictCreate(&instancesDictType,NULL);
     ri->info_refresh = 0;
+    ri->info_sent_time = 0;
 
     /* Failover state. */
     ri->leader = NULL;
@@ -1212,6 +1261,9 @@ sentinelRedisInstance *createSentinelRedisInstance(char *name, int flags, char *
     ri->notification_script = NULL;
     ri->client_reconfig_script = NULL;
     ri->info = NULL;
+    ri->wheel_node = NULL;
+    ri->wheel_slot = 0;
+    ri->wheel_due = 0;
 
     /* Role */
     ri->role_reported = ri->m_flags & (SRI_MASTER|SRI_SLAVE);
@@ -1220,6 +1272,7 @@ sentinelRedisInstance *createSentinelRedisInstance(char *name, int flags, char *
 
     /* Add into the right table. */
     table->dictAdd(ri->name, ri);
+    if (flags & SRI_MASTER) sentinelWheelSchedule(ri,mstime());
     return ri;
 }
 
@@ -1249,6 +1302,7 @@ void releaseSentinelRedisInstance(sentinelRedisInstance *ri) {
     /* Clear state into the master if needed. */
     if ((ri->m_flags & SRI_SLAVE) && (ri->m_flags & SRI_PROMOTED) && ri->master)
         ri->master->promoted_slave = NULL;
+    if (ri->wheel_node) sentinel.wheel[ri->wheel_slot]->listDelNode(ri->wheel_node);
 
     zfree(ri);
 }
@@ -1404,11 +1458,14 @@ void sentinelResetMaster(sentinelRedisInstance *ri, int flags) {
     ri->runid = NULL;
     ri->slave_master_host = NULL;
     ri->link->act_ping_time = mstime();
+    ri->link->act_ping_time_us = 0;
     ri->link->last_ping_time = 0;
     ri->link->last_avail_time = mstime();
     ri->link->last_pong_time = mstime();
+    ri->link->rtt_samples = 0;
     ri->role_reported_time = mstime();
     ri->role_reported = SRI_MASTER;
+    sentinelWakeMaster(ri);
     if (flags & SENTINEL_GENERATE_EVENT)
         sentinelEvent(LL_WARNING,"+reset-master",ri,"%@");
 }
@@ -1527,8 +1584,9 @@ sentinelAddr *sentinelGetCurrentMasterAddress(sentinelRedisInstance *master) {
     }
 }
 
-/* This function sets the down_after_period field value in 'master' to all
- * the slaves and sentinel instances connected to this master. */
+/* This function sets the down_after_period and phi_threshold field values in
+ * 'master' to all the slaves and sentinel instances connected to this
+ * master. */
 void sentinelPropagateDownAfterPeriod(sentinelRedisInstance *master) {
     dictEntry *de;
     int j;
@@ -1539,6 +1597,7 @@ void sentinelPropagateDownAfterPeriod(sentinelRedisInstance *master) {
         while((de = di.dictNext()) != NULL) {
             sentinelRedisInstance* ri = (sentinelRedisInstance*)de->dictGetVal();
             ri->down_after_period = master->down_after_period;
+            ri->phi_threshold = master->phi_threshold;
         }
     }
 }
@@ -1576,6 +1635,14 @@ char *sentinelHandleConfiguration(char **argv, int argc) {
         if (ri->down_after_period <= 0)
             return "negative or zero time parameter.";
         sentinelPropagateDownAfterPeriod(ri);
+    } else if (!strcasecmp(argv[0],"phi-threshold") && argc == 3) {
+        /* phi-threshold <name> <phi> */
+        ri = sentinelGetMasterByName(argv[1]);
+        if (!ri) return "No such master with specified name.";
+        ri->phi_threshold = atof(argv[2]);
+        if (ri->phi_threshold < 0)
+            return "negative phi threshold.";
+        sentinelPropagateDownAfterPeriod(ri);
     } else if (!strcasecmp(argv[0],"failover-timeout") && argc == 3) {
         /* failover-timeout <name> <milliseconds> */
         ri = sentinelGetMasterByName(argv[1]);
@@ -1708,6 +1775,14 @@ void rewriteConfigSentinelOption(struct rewriteConfigState *state) {
                 rewriteConfigRewriteLine(state,"sentinel",line,1);
             }
 
+            /* sentinel phi-threshold */
+            if (master->phi_threshold != SENTINEL_DEFAULT_PHI_THRESHOLD) {
+                line = sdscatprintf(sdsempty(),
+                    "sentinel phi-threshold %s %.17g",
+                    master->name, master->phi_threshold);
+                rewriteConfigRewriteLine(state,"sentinel",line,1);
+            }
+
             /* sentinel failover-timeout */
             if (master->failover_timeout != SENTINEL_DEFAULT_FAILOVER_TIMEOUT) {
                 line = sdscatprintf(sdsempty(),
@@ -2243,6 +2318,60 @@ void sentinelDiscardReplyCallback(redisAsyncContext *c, void *reply, void *privd
     if (link) link->pending_commands--;
 }
 
+/* Account the round trip time 'rtt' of a ping, in microseconds, with the
+ * same gains TCP uses: 1/8 for the average and 1/4 for the deviation. */
+void sentinelUpdateRTT(instanceLink *link, long long rtt) {
+    if (link->rtt_samples++ == 0) {
+        link->rtt_avg = rtt;
+        link->rtt_var = rtt/2;
+    } else {
+        link->rtt_var += (llabs(rtt-link->rtt_avg)-link->rtt_var)/4;
+        link->rtt_avg += (rtt-link->rtt_avg)/8;
+    }
+}
+
+/* Return the suspicion level phi that the instance is down after waiting
+ * 'elapsed' milliseconds for the reply to a ping, as in the phi accrual
+ * failure detector: phi is -log10 of the probability that a reply would
+ * still arrive that late, the round trip times following a normal
+ * distribution with the link average and deviation. A phi of 1 means a 10%
+ * chance of being wrong suspecting the instance, 2 a 1% chance, and so
+ * forth. The distribution is approximated with a logistic function.
+ *
+ * Until enough round trips are measured a huge phi is returned, so that
+ * only the down_after_period applies. */
+double sentinelPhi(instanceLink *link, mstime_t elapsed) {
+    double mean, stddev, y, e, p;
+
+    if (link->rtt_samples < SENTINEL_RTT_MIN_SAMPLES) return HUGE_VAL;
+    mean = (double)link->rtt_avg/1000;
+    stddev = (double)link->rtt_var/1000;
+    if (stddev < SENTINEL_PHI_MIN_STDDEV) stddev = SENTINEL_PHI_MIN_STDDEV;
+    y = (elapsed-mean)/stddev;
+    e = exp(-y*(1.5976+0.070566*y*y));
+    p = elapsed > mean ? e/(1.0+e) : 1.0-1.0/(1.0+e);
+    return p > 0 ? -log10(p) : HUGE_VAL;
+}
+
+/* Return the ping period of the instance. We ping instances every time the
+ * last received pong is older than the ping period, that fits a few pings
+ * in the 'down-after-milliseconds' time, so that a single slow reply does
+ * not make the instance look down, and is at most a second. However it is
+ * not shorter than a few round trip times, since pinging faster than the
+ * instance is able to reply only adds pending pings. */
+mstime_t sentinelPingPeriod(sentinelRedisInstance *ri) {
+    mstime_t period = ri->down_after_period/SENTINEL_PINGS_PER_DOWN_AFTER;
+    instanceLink *link = ri->link;
+
+    if (link->rtt_samples >= SENTINEL_RTT_MIN_SAMPLES) {
+        mstime_t rtt = (link->rtt_avg+link->rtt_var*4)/1000;
+        if (period < rtt) period = rtt;
+    }
+    if (period < SENTINEL_MIN_PING_PERIOD) period = SENTINEL_MIN_PING_PERIOD;
+    if (period > SENTINEL_PING_PERIOD) period = SENTINEL_PING_PERIOD;
+    return period;
+}
+
 void sentinelPingReplyCallback(redisAsyncContext *c, void *reply, void *privdata) {
     sentinelRedisInstance *ri = (sentinelRedisInstance *)privdata;
     instanceLink *link = (instanceLink *)c->data;
@@ -2261,7 +2390,12 @@ void sentinelPingReplyCallback(redisAsyncContext *c, void *reply, void *privdata
             strncmp(r->str,"MASTERDOWN",10) == 0)
         {
             link->last_avail_time = mstime();
+            if (link->act_ping_time_us)
+                sentinelUpdateRTT(link,ustime()-link->act_ping_time_us);
             link->act_ping_time = 0; /* Flag the pong as received. */
+            link->act_ping_time_us = 0;
+            /* Clear the SDOWN state without waiting the next check. */
+            if (ri->m_flags & SRI_S_DOWN) sentinelWakeMaster(ri);
         } else {
             /* Send a SCRIPT KILL command if the instance appears to be
              * down because of a busy script. */
@@ -2453,6 +2587,7 @@ int sentinelSendHello(sentinelRedisInstance *ri) {
     int announce_port;
     sentinelRedisInstance *master = (ri->m_flags & SRI_MASTER) ? ri : ri->master;
     sentinelAddr *master_addr = sentinelGetCurrentMasterAddress(master);
+    instanceLink *link = ri->link;
 
     if (ri->link->disconnected) return C_ERR;
 
@@ -2477,6 +2612,29 @@ int sentinelSendHello(sentinelRedisInstance *ri) {
         /* --- */
         master->name,master_addr->ip,master_addr->port,
         (unsigned long long) master->config_epoch);
+
+    /* The hello messages for the other Sentinels are batched: the link to
+     * a Sentinel is shared by all the masters it monitors with us, and the
+     * messages about all of them are sent with a single PUBLISH, one per
+     * line, when the timer handler returns. The reply is not checked, and
+     * the message is sent again after the publish period anyway. */
+    if (ri->m_flags & SRI_SENTINEL) {
+        if (link->hello_batch == NULL) {
+            link->hello_batch = sdsempty();
+            sentinel.hello_links->listAddNodeTail(link);
+        } else {
+            link->hello_batch = sdscatlen(link->hello_batch,"\n",1);
+        }
+        link->hello_batch = sdscat(link->hello_batch,payload);
+        ri->last_pub_time = mstime();
+        if (sdslen(link->hello_batch) >= SENTINEL_HELLO_BATCH_MAX) {
+            sentinel.hello_links->listDelNode(
+                sentinel.hello_links->listSearchKey(link));
+            sentinelFlushHelloBatch(link);
+        }
+        return C_OK;
+    }
+
     retval = redisAsyncCommand(ri->link->cc,
         sentinelPublishReplyCallback, ri, "PUBLISH %s %s",
             SENTINEL_HELLO_CHANNEL,payload);
@@ -2485,6 +2643,29 @@ int sentinelSendHello(sentinelRedisInstance *ri) {
     return C_OK;
 }
 
+/* Send the hello messages batched for the Sentinel of 'link'. The caller
+ * removes the link from sentinel.hello_links. */
+void sentinelFlushHelloBatch(instanceLink *link) {
+    if (!link->disconnected &&
+        redisAsyncCommand(link->cc,sentinelDiscardReplyCallback,NULL,
+            "PUBLISH %s %b",SENTINEL_HELLO_CHANNEL,link->hello_batch,
+            sdslen(link->hello_batch)) == C_OK)
+    {
+        link->pending_commands++;
+    }
+    sdsfree(link->hello_batch);
+    link->hello_batch = NULL;
+}
+
+void sentinelFlushHelloBatches() {
+    listNode *ln;
+
+    while ((ln = sentinel.hello_links->listFirst()) != NULL) {
+        sentinelFlushHelloBatch((instanceLink*)ln->listNodeValue());
+        sentinel.hello_links->listDelNode(ln);
+    }
+}
+
 /* Reset last_pub_time in all the instances in the specified dictionary
  * in order to force the delivery of an Hello update ASAP. */
 void sentinelForceHelloUpdateDictOfRedisInstances(dict *instances) {
@@ -2512,6 +2693,7 @@ int sentinelForceHelloUpdateForMaster(sentinelRedisInstance *master) {
         master->last_pub_time -= (SENTINEL_PUBLISH_PERIOD+1);
     sentinelForceHelloUpdateDictOfRedisInstances(master->sentinels);
     sentinelForceHelloUpdateDictOfRedisInstances(master->slaves);
+    sentinelWakeMaster(master);
     return C_OK;
 }
 
@@ -2529,8 +2711,10 @@ int sentinelSendPing(sentinelRedisInstance *ri) {
         /* We update the active ping time only if we received the pong for
          * the previous ping, otherwise we are technically waiting since the
          * first ping that did not received a reply. */
-        if (ri->link->act_ping_time == 0)
+        if (ri->link->act_ping_time == 0) {
             ri->link->act_ping_time = ri->link->last_ping_time;
+            ri->link->act_ping_time_us = ustime();
+        }
         return 1;
     } else {
         return 0;
@@ -2573,26 +2757,32 @@ void sentinelSendPeriodicCommands(sentinelRedisInstance *ri) {
     } else {
         info_period = SENTINEL_INFO_PERIOD;
     }
-
-    /* We ping instances every time the last received pong is older than
-     * the configured 'down-after-milliseconds' time, but every second
-     * anyway if 'down-after-milliseconds' is greater than 1 second. */
-    ping_period = ri->down_after_period;
-    if (ping_period > SENTINEL_PING_PERIOD) ping_period = SENTINEL_PING_PERIOD;
-
+    ping_period = sentinelPingPeriod(ri);
+
+    /* The PING, INFO and hello messages are scheduled independently, so
+     * that refreshing INFO does not delay the PING of the instance. The
+     * PING goes first, so that its round trip time does not include the
+     * time to produce the INFO reply. While waiting for the INFO reply it
+     * is sent again at most once every ping period. */
+    if ((now - ri->link->last_pong_time) > ping_period &&
+        (now - ri->link->last_ping_time) > ping_period/2) {
+        /* Send PING to all the three kinds of instances. */
+        sentinelSendPing(ri);
+    }
     if ((ri->m_flags & SRI_SENTINEL) == 0 &&
         (ri->info_refresh == 0 ||
-        (now - ri->info_refresh) > info_period))
+        (now - ri->info_refresh) > info_period) &&
+        (now - ri->info_sent_time) > ping_period)
     {
         /* Send INFO to masters and slaves, not sentinels. */
         retval = redisAsyncCommand(ri->link->cc,
             sentinelInfoReplyCallback, ri, "INFO");
-        if (retval == C_OK) ri->link->pending_commands++;
-    } else if ((now - ri->link->last_pong_time) > ping_period &&
-               (now - ri->link->last_ping_time) > ping_period/2) {
-        /* Send PING to all the three kinds of instances. */
-        sentinelSendPing(ri);
-    } else if ((now - ri->last_pub_time) > SENTINEL_PUBLISH_PERIOD) {
+        if (retval == C_OK) {
+            ri->link->pending_commands++;
+            ri->info_sent_time = now;
+        }
+    }
+    if ((now - ri->last_pub_time) > SENTINEL_PUBLISH_PERIOD) {
         /* PUBLISH hello messages to all the three kinds of instances. */
         sentinelSendHello(ri);
     }
@@ -2699,6 +2889,24 @@ void addReplySentinelRedisInstance(client *c, sentinelRedisInstance *ri) {
     c->addReplyBulkLongLong(ri->down_after_period);
     fields++;
 
+    if (ri->phi_threshold > 0) {
+        c->addReplyBulkCString("phi-threshold");
+        c->addReplyDouble(ri->phi_threshold);
+        fields++;
+    }
+
+    c->addReplyBulkCString("ping-period");
+    c->addReplyBulkLongLong(sentinelPingPeriod(ri));
+    fields++;
+
+    c->addReplyBulkCString("round-trip-time-us");
+    c->addReplyBulkLongLong(ri->link->rtt_avg);
+    fields++;
+
+    c->addReplyBulkCString("round-trip-jitter-us");
+    c->addReplyBulkLongLong(ri->link->rtt_var);
+    fields++;
+
     /* Masters and Slaves */
     if (ri->m_flags & (SRI_MASTER|SRI_SLAVE)) {
         c->addReplyBulkCString("info-refresh");
@@ -2976,6 +3184,7 @@ void sentinelCommand(client *c) {
             ri->name);
         sentinelStartFailover(ri);
         ri->m_flags |= SRI_FORCE_FAILOVER;
+        sentinelWakeMaster(ri);
         c->addReply(shared.ok);
     } else if (!strcasecmp((const char*)c->m_argv[1]->ptr,"pending-scripts")) {
         /* SENTINEL PENDING-SCRIPTS */
@@ -3282,6 +3491,14 @@ void sentinelSetCommand(client *c) {
             ri->down_after_period = ll;
             sentinelPropagateDownAfterPeriod(ri);
             changes++;
+        } else if (!strcasecmp(option,"phi-threshold")) {
+            /* phi-threshold <phi> */
+            long double phi;
+            if (getLongDoubleFromObject(o,&phi) == C_ERR || phi < 0)
+                goto badfmt;
+            ri->phi_threshold = phi;
+            sentinelPropagateDownAfterPeriod(ri);
+            changes++;
         } else if (!strcasecmp(option,"failover-timeout")) {
             /* failover-timeout <milliseconds> */
             if (getLongLongFromObject(o,&ll) == C_ERR || ll <= 0)
@@ -3358,7 +3575,15 @@ void sentinelPublishCommand(client *c) {
         c->addReplyError( "Only HELLO messages are accepted by Sentinel instances.");
         return;
     }
-    sentinelProcessHelloMessage((char*)c->m_argv[2]->ptr,sdslen((sds)c->m_argv[2]->ptr));
+    /* The hello messages batched by a Sentinel are one per line. */
+    sds hello = (sds)c->m_argv[2]->ptr;
+    char *p = hello, *end = hello+sdslen(hello);
+    while (p < end) {
+        char *nl = (char*)memchr(p,'\n',end-p);
+        if (nl == NULL) nl = end;
+        sentinelProcessHelloMessage(p,nl-p);
+        p = nl+1;
+    }
     c->addReplyLongLong(1);
 }
 
@@ -3367,11 +3592,19 @@ void sentinelPublishCommand(client *c) {
 /* Is this instance down from our point of view? */
 void sentinelCheckSubjectivelyDown(sentinelRedisInstance *ri) {
     mstime_t elapsed = 0;
+    int suspected = 1;
 
-    if (ri->link->act_ping_time)
+    if (ri->link->act_ping_time) {
         elapsed = mstime() - ri->link->act_ping_time;
-    else if (ri->link->disconnected)
+        /* With a phi threshold a reply late for the down_after_period is
+         * not enough: it must also be late for the round trip times the
+         * link usually has, so that a short down_after_period does not
+         * flag instances that are just slow or far away. */
+        if (ri->phi_threshold > 0 && ri->link->act_ping_time_us)
+            suspected = sentinelPhi(ri->link,elapsed) >= ri->phi_threshold;
+    } else if (ri->link->disconnected) {
         elapsed = mstime() - ri->link->last_avail_time;
+    }
 
     /* Check if we are in need for a reconnection of one of the
      * links, because we are detecting low activity.
@@ -3406,11 +3639,12 @@ void sentinelCheckSubjectivelyDown(sentinelRedisInstance *ri) {
 
     /* Update the SDOWN flag. We believe the instance is SDOWN if:
      *
-     * 1) It is not replying.
+     * 1) It is not replying, and with a phi threshold, the suspicion level
+     *    reached it.
      * 2) We believe it is a master, it reports to be a slave for enough time
      *    to meet the down_after_period, plus enough time to get two times
      *    INFO report from the instance. */
-    if (elapsed > ri->down_after_period ||
+    if ((elapsed > ri->down_after_period && suspected) ||
         (ri->m_flags & SRI_MASTER &&
          ri->role_reported == SRI_SLAVE &&
          mstime() - ri->role_reported_time >
@@ -4224,28 +4458,158 @@ void sentinelHandleRedisInstance(sentinelRedisInstance *ri) {
     }
 }
 
-/* Perform scheduled operations for all the instances in the dictionary.
- * Recursively call the function against dictionaries of slaves. */
+/* Perform scheduled operations for all the slaves or Sentinels in the
+ * dictionary. The masters are handled by sentinelHandleMaster(). */
 void sentinelHandleDictOfRedisInstances(dict *instances) {
     dictEntry *de;
-    sentinelRedisInstance *switch_to_promoted = NULL;
 
-    /* There are a number of things we need to perform against every master. */
     dictIterator di(instances);
     while((de = di.dictNext()) != NULL) {
         sentinelRedisInstance* ri = (sentinelRedisInstance*)de->dictGetVal();
-
         sentinelHandleRedisInstance(ri);
-        if (ri->m_flags & SRI_MASTER) {
-            sentinelHandleDictOfRedisInstances(ri->slaves);
-            sentinelHandleDictOfRedisInstances(ri->sentinels);
-            if (ri->failover_state == SENTINEL_FAILOVER_STATE_UPDATE_CONFIG) {
-                switch_to_promoted = ri;
-            }
+    }
+}
+
+/* ============================ Scheduling wheel ============================
+ * The masters are not handled at every timer tick: every master, with its
+ * slaves and Sentinels, is handled again only when something is due, that
+ * is, the next PING or hello message, or the time one of them would be
+ * down if a pending PING is not answered. The masters are kept in a timing
+ * wheel of SENTINEL_WHEEL_SLOTS lists, by the time they are due, so that a
+ * tick only visits the masters due since the previous one, and thousands
+ * of healthy masters cost about one visit per ping period instead of one
+ * per tick.
+ *
+ * The masters that are down or failing over are handled at every tick, and
+ * every master at least every SENTINEL_PING_PERIOD milliseconds, since
+ * the INFO and hello messages received may change what is due. A master is
+ * woken up with sentinelWakeMaster() when an event needs it handled ASAP.
+ * -------------------------------------------------------------------------- */
+
+/* Schedule 'master' to be handled at the time 'when', unless it is already
+ * scheduled earlier. */
+void sentinelWheelSchedule(sentinelRedisInstance *master, mstime_t when) {
+    int slot;
+
+    if (master->wheel_node) {
+        if (master->wheel_due <= when) return;
+        sentinel.wheel[master->wheel_slot]->listDelNode(master->wheel_node);
+    }
+    /* Times already past go in the next slot processed. */
+    slot = ((when > sentinel.wheel_time ? when : sentinel.wheel_time) /
+            SENTINEL_WHEEL_RESOLUTION) % SENTINEL_WHEEL_SLOTS;
+    sentinel.wheel[slot]->listAddNodeTail(master);
+    master->wheel_node = sentinel.wheel[slot]->listLast();
+    master->wheel_slot = slot;
+    master->wheel_due = when;
+}
+
+/* Handle the master of the instance at the next tick. */
+void sentinelWakeMaster(sentinelRedisInstance *ri) {
+    sentinelWheelSchedule((ri->m_flags & SRI_MASTER) ? ri : ri->master,
+                          mstime());
+}
+
+/* Return the time the instance is due to be handled again, at most 'next',
+ * ignoring what was already due at 'now' and handled. */
+mstime_t sentinelInstanceNextCheck(sentinelRedisInstance *ri, mstime_t now,
+                                   mstime_t next)
+{
+    instanceLink *link = ri->link;
+    mstime_t ping_period = sentinelPingPeriod(ri), due[4];
+    int j, count = 0;
+
+    if (link->disconnected) {
+        due[count++] = link->last_reconn_time+SENTINEL_PING_PERIOD;
+    } else {
+        mstime_t ping = link->last_pong_time+ping_period;
+        if (ping < link->last_ping_time+ping_period/2)
+            ping = link->last_ping_time+ping_period/2;
+        due[count++] = ping+1;
+        due[count++] = ri->last_pub_time+SENTINEL_PUBLISH_PERIOD+1;
+    }
+    /* The time it is down, or its command link is closed, if the pending
+     * PING is not answered. With a phi threshold the suspicion is checked
+     * at every tick after the down_after_period. */
+    if (link->act_ping_time && !(ri->m_flags & SRI_S_DOWN)) {
+        mstime_t down = link->act_ping_time+ri->down_after_period+1;
+        if (down <= now && ri->phi_threshold > 0) return now;
+        due[count++] = down;
+        due[count++] = link->act_ping_time+ri->down_after_period/2+1;
+    }
+    for (j = 0; j < count; j++) {
+        if (due[j] > now && due[j] < next) next = due[j];
+    }
+    return next;
+}
+
+/* Return the time 'master' is due to be handled again. */
+mstime_t sentinelMasterNextCheck(sentinelRedisInstance *master) {
+    mstime_t now = mstime(), next = now+SENTINEL_PING_PERIOD;
+    dict *d[] = {master->slaves, master->sentinels, NULL};
+    dictEntry *de;
+
+    if (sentinel.tilt ||
+        master->m_flags & (SRI_S_DOWN|SRI_O_DOWN|SRI_FAILOVER_IN_PROGRESS))
+        return now;
+    next = sentinelInstanceNextCheck(master,now,next);
+    for (int j = 0; d[j]; j++) {
+        dictIterator di(d[j]);
+        while((de = di.dictNext()) != NULL) {
+            sentinelRedisInstance *ri = (sentinelRedisInstance*)de->dictGetVal();
+            next = sentinelInstanceNextCheck(ri,now,next);
         }
     }
-    if (switch_to_promoted)
-        sentinelFailoverSwitchToPromotedSlave(switch_to_promoted);
+    return next;
+}
+
+/* Handle the master, its slaves and Sentinels. */
+void sentinelHandleMaster(sentinelRedisInstance *master) {
+    sentinelHandleRedisInstance(master);
+    sentinelHandleDictOfRedisInstances(master->slaves);
+    sentinelHandleDictOfRedisInstances(master->sentinels);
+    if (master->failover_state == SENTINEL_FAILOVER_STATE_UPDATE_CONFIG)
+        sentinelFailoverSwitchToPromotedSlave(master);
+}
+
+/* Handle the masters due since the last call, visiting the wheel slots of
+ * the time elapsed. */
+void sentinelHandleWheel() {
+    mstime_t now = mstime();
+    list *due = listCreate();
+    listNode *ln;
+    int visited = 0;
+
+    if (sentinel.wheel_time > now) /* The clock moved backward. */
+        sentinel.wheel_time = now - now % SENTINEL_WHEEL_RESOLUTION;
+    while (1) {
+        list *l = sentinel.wheel[(sentinel.wheel_time /
+                  SENTINEL_WHEEL_RESOLUTION) % SENTINEL_WHEEL_SLOTS];
+
+        listIter li(l);
+        while ((ln = li.listNext()) != NULL) {
+            sentinelRedisInstance *ri = (sentinelRedisInstance*)ln->listNodeValue();
+            if (ri->wheel_due > now) continue; /* Due in a later lap. */
+            l->listDelNode(ln);
+            ri->wheel_node = NULL;
+            due->listAddNodeTail(ri);
+        }
+        /* The slot of the current time is visited again at the next tick. */
+        if (sentinel.wheel_time+SENTINEL_WHEEL_RESOLUTION > now) break;
+        sentinel.wheel_time += SENTINEL_WHEEL_RESOLUTION;
+        if (++visited == SENTINEL_WHEEL_SLOTS) {
+            sentinel.wheel_time = now - now % SENTINEL_WHEEL_RESOLUTION;
+            break;
+        }
+    }
+
+    listIter li(due);
+    while ((ln = li.listNext()) != NULL) {
+        sentinelRedisInstance *master = (sentinelRedisInstance*)ln->listNodeValue();
+        sentinelHandleMaster(master);
+        sentinelWheelSchedule(master,sentinelMasterNextCheck(master));
+    }
+    listRelease(due);
 }
 
 /* This function checks if we need to enter the TITL mode.
@@ -4279,9 +4643,29 @@ void sentinelCheckTiltCondition() {
     sentinel.previous_time = mstime();
 }
 
+/* Return the timer frequency for the shortest down-after-milliseconds of
+ * the monitored masters. */
+int sentinelTimerBaseHz() {
+    mstime_t min_down_after = SENTINEL_DEFAULT_DOWN_AFTER;
+    dictEntry *de;
+    int hz;
+
+    dictIterator di(sentinel.masters);
+    while((de = di.dictNext()) != NULL) {
+        sentinelRedisInstance *ri = (sentinelRedisInstance*)de->dictGetVal();
+        if (ri->down_after_period < min_down_after)
+            min_down_after = ri->down_after_period;
+    }
+    hz = 10000/min_down_after;
+    if (hz < CONFIG_DEFAULT_HZ) hz = CONFIG_DEFAULT_HZ;
+    if (hz > CONFIG_MAX_HZ/2) hz = CONFIG_MAX_HZ/2;
+    return hz;
+}
+
 void sentinelTimer() {
     sentinelCheckTiltCondition();
-    sentinelHandleDictOfRedisInstances(sentinel.masters);
+    sentinelHandleWheel();
+    sentinelFlushHelloBatches();
     sentinelRunPendingScripts();
     sentinelCollectTerminatedScripts();
     sentinelKillTimedoutScripts();
@@ -4291,7 +4675,12 @@ void sentinelTimer() {
      * This non-determinism avoids that Sentinels started at the same time
      * exactly continue to stay synchronized asking to be voted at the
      * same time again and again (resulting in nobody likely winning the
-     * election because of split brain voting). */
-    server.hz = CONFIG_DEFAULT_HZ + rand() % CONFIG_DEFAULT_HZ;
+     * election because of split brain voting).
+     *
+     * The frequency is raised with a short down-after-milliseconds, so
+     * that the instances are checked about ten times in that period: the
+     * sub second periods are not otherwise detected in time. */
+    server.hz = sentinelTimerBaseHz();
+    server.hz += rand() % server.hz;
 }
 
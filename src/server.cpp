@@ -32,6 +32,17 @@
 #include "slowlog.h"
 #include "bio.h"
 #include "latency.h"
+#include "hotkeys.h"
+#include "trace.h"
+#include "memprefix.h"
+#include "allocstats.h"
+#include "hugepages.h"
+#include "placement.h"
+#include "handoff.h"
+#include "lazyload.h"
+#include "tier.h"
+#include "bgread.h"
+#include "snapshot.h"
 #include "atomicvar.h"
 
 #include <time.h>
@@ -127,28 +138,34 @@ volatile unsigned long lru_clock; /* Server global current LRU time. */
  *    its execution as long as the kernel scheduler is giving us time.
  *    Note that commands that may trigger a DEL as a side effect (like SET)
  *    are not fast commands.
+ * B: Bitmap aware command: it accepts string values with the chunked
+ *    encoding, that are converted to plain strings for the other commands
+ *    when they look them up.
+ * Z: Compressed strings aware command: it accepts string values with the
+ *    compressed encoding, that are decompressed in place for the other
+ *    commands when they look them up.
  */
 struct redisCommand redisCommandTable[] = {
     {"module",moduleCommand,-2,"as",0,NULL,1,1,1,0,0},
-    {"get",getCommand,2,"rF",0,NULL,1,1,1,0,0},
-    {"set",setCommand,-3,"wm",0,NULL,1,1,1,0,0},
-    {"setnx",setnxCommand,3,"wmF",0,NULL,1,1,1,0,0},
-    {"setex",setexCommand,4,"wm",0,NULL,1,1,1,0,0},
-    {"psetex",psetexCommand,4,"wm",0,NULL,1,1,1,0,0},
+    {"get",getCommand,2,"rFBZ",0,NULL,1,1,1,0,0},
+    {"set",setCommand,-3,"wmZ",0,NULL,1,1,1,0,0},
+    {"setnx",setnxCommand,3,"wmFZ",0,NULL,1,1,1,0,0},
+    {"setex",setexCommand,4,"wmZ",0,NULL,1,1,1,0,0},
+    {"psetex",psetexCommand,4,"wmZ",0,NULL,1,1,1,0,0},
     {"append",appendCommand,3,"wm",0,NULL,1,1,1,0,0},
-    {"strlen",strlenCommand,2,"rF",0,NULL,1,1,1,0,0},
+    {"strlen",strlenCommand,2,"rFBZ",0,NULL,1,1,1,0,0},
     {"del",delCommand,-2,"w",0,NULL,1,-1,1,0,0},
     {"unlink",unlinkCommand,-2,"wF",0,NULL,1,-1,1,0,0},
-    {"exists",existsCommand,-2,"rF",0,NULL,1,-1,1,0,0},
-    {"setbit",setbitCommand,4,"wm",0,NULL,1,1,1,0,0},
-    {"getbit",getbitCommand,3,"rF",0,NULL,1,1,1,0,0},
-    {"bitfield",bitfieldCommand,-2,"wm",0,NULL,1,1,1,0,0},
-    {"setrange",setrangeCommand,4,"wm",0,NULL,1,1,1,0,0},
-    {"getrange",getrangeCommand,4,"r",0,NULL,1,1,1,0,0},
-    {"substr",getrangeCommand,4,"r",0,NULL,1,1,1,0,0},
+    {"exists",existsCommand,-2,"rFBZ",0,NULL,1,-1,1,0,0},
+    {"setbit",setbitCommand,4,"wmB",0,NULL,1,1,1,0,0},
+    {"getbit",getbitCommand,3,"rFB",0,NULL,1,1,1,0,0},
+    {"bitfield",bitfieldCommand,-2,"wmB",0,NULL,1,1,1,0,0},
+    {"setrange",setrangeCommand,4,"wmB",0,NULL,1,1,1,0,0},
+    {"getrange",getrangeCommand,4,"rB",0,NULL,1,1,1,0,0},
+    {"substr",getrangeCommand,4,"rB",0,NULL,1,1,1,0,0},
     {"incr",incrCommand,2,"wmF",0,NULL,1,1,1,0,0},
     {"decr",decrCommand,2,"wmF",0,NULL,1,1,1,0,0},
-    {"mget",mgetCommand,-2,"rF",0,NULL,1,-1,1,0,0},
+    {"mget",mgetCommand,-2,"rFZ",0,NULL,1,-1,1,0,0},
     {"rpush",rpushCommand,-3,"wmF",0,NULL,1,1,1,0,0},
     {"lpush",lpushCommand,-3,"wmF",0,NULL,1,1,1,0,0},
     {"rpushx",rpushxCommand,-3,"wmF",0,NULL,1,1,1,0,0},
@@ -217,24 +234,35 @@ struct redisCommand redisCommandTable[] = {
     {"hgetall",hgetallCommand,2,"r",0,NULL,1,1,1,0,0},
     {"hexists",hexistsCommand,3,"rF",0,NULL,1,1,1,0,0},
     {"hscan",hscanCommand,-3,"rR",0,NULL,1,1,1,0,0},
+    {"hexpire",hexpireCommand,-6,"wF",0,NULL,1,1,1,0,0},
+    {"hpexpire",hpexpireCommand,-6,"wF",0,NULL,1,1,1,0,0},
+    {"hexpireat",hexpireatCommand,-6,"wF",0,NULL,1,1,1,0,0},
+    {"hpexpireat",hpexpireatCommand,-6,"wF",0,NULL,1,1,1,0,0},
+    {"httl",httlCommand,-5,"rF",0,NULL,1,1,1,0,0},
+    {"hpttl",hpttlCommand,-5,"rF",0,NULL,1,1,1,0,0},
+    {"hexpiretime",hexpiretimeCommand,-5,"rF",0,NULL,1,1,1,0,0},
+    {"hpexpiretime",hpexpiretimeCommand,-5,"rF",0,NULL,1,1,1,0,0},
+    {"hpersist",hpersistCommand,-5,"wF",0,NULL,1,1,1,0,0},
     {"incrby",incrbyCommand,3,"wmF",0,NULL,1,1,1,0,0},
     {"decrby",decrbyCommand,3,"wmF",0,NULL,1,1,1,0,0},
     {"incrbyfloat",incrbyfloatCommand,3,"wmF",0,NULL,1,1,1,0,0},
-    {"getset",getsetCommand,3,"wm",0,NULL,1,1,1,0,0},
-    {"mset",msetCommand,-3,"wm",0,NULL,1,-1,2,0,0},
-    {"msetnx",msetnxCommand,-3,"wm",0,NULL,1,-1,2,0,0},
+    {"getset",getsetCommand,3,"wmZ",0,NULL,1,1,1,0,0},
+    {"mset",msetCommand,-3,"wmZ",0,NULL,1,-1,2,0,0},
+    {"msetnx",msetnxCommand,-3,"wmZ",0,NULL,1,-1,2,0,0},
+    {"msetex",msetexCommand,-4,"wmZ",0,NULL,2,-1,2,0,0},
     {"randomkey",randomkeyCommand,1,"rR",0,NULL,0,0,0,0,0},
     {"select",selectCommand,2,"lF",0,NULL,0,0,0,0,0},
     {"swapdb",swapdbCommand,3,"wF",0,NULL,0,0,0,0,0},
-    {"move",moveCommand,3,"wF",0,NULL,1,1,1,0,0},
-    {"rename",renameCommand,3,"w",0,NULL,1,2,1,0,0},
-    {"renamenx",renamenxCommand,3,"wF",0,NULL,1,2,1,0,0},
-    {"expire",expireCommand,3,"wF",0,NULL,1,1,1,0,0},
-    {"expireat",expireatCommand,3,"wF",0,NULL,1,1,1,0,0},
-    {"pexpire",pexpireCommand,3,"wF",0,NULL,1,1,1,0,0},
-    {"pexpireat",pexpireatCommand,3,"wF",0,NULL,1,1,1,0,0},
+    {"move",moveCommand,3,"wFBZ",0,NULL,1,1,1,0,0},
+    {"rename",renameCommand,3,"wBZ",0,NULL,1,2,1,0,0},
+    {"renamenx",renamenxCommand,3,"wFBZ",0,NULL,1,2,1,0,0},
+    {"expire",expireCommand,3,"wFBZ",0,NULL,1,1,1,0,0},
+    {"expireat",expireatCommand,3,"wFBZ",0,NULL,1,1,1,0,0},
+    {"pexpire",pexpireCommand,3,"wFBZ",0,NULL,1,1,1,0,0},
+    {"pexpireat",pexpireatCommand,3,"wFBZ",0,NULL,1,1,1,0,0},
     {"keys",keysCommand,2,"rS",0,NULL,0,0,0,0,0},
     {"scan",scanCommand,-2,"rR",0,NULL,0,0,0,0,0},
+    {"keysrange",keysrangeCommand,-3,"r",0,NULL,0,0,0,0,0},
     {"dbsize",dbsizeCommand,1,"rF",0,NULL,0,0,0,0,0},
     {"auth",authCommand,2,"sltF",0,NULL,0,0,0,0,0},
     {"ping",pingCommand,-1,"tF",0,NULL,0,0,0,0,0},
@@ -244,7 +272,7 @@ struct redisCommand redisCommandTable[] = {
     {"bgrewriteaof",bgrewriteaofCommand,1,"a",0,NULL,0,0,0,0,0},
     {"shutdown",shutdownCommand,-1,"alt",0,NULL,0,0,0,0,0},
     {"lastsave",lastsaveCommand,1,"RF",0,NULL,0,0,0,0,0},
-    {"type",typeCommand,2,"rF",0,NULL,1,1,1,0,0},
+    {"type",typeCommand,2,"rFBZ",0,NULL,1,1,1,0,0},
     {"multi",multiCommand,1,"sF",0,NULL,0,0,0,0,0},
     {"exec",execCommand,1,"sM",0,NULL,0,0,0,0,0},
     {"discard",discardCommand,1,"sF",0,NULL,0,0,0,0,0},
@@ -256,41 +284,48 @@ struct redisCommand redisCommandTable[] = {
     {"sort",sortCommand,-2,"wm",0,sortGetKeys,1,1,1,0,0},
     {"info",infoCommand,-1,"lt",0,NULL,0,0,0,0,0},
     {"monitor",monitorCommand,1,"as",0,NULL,0,0,0,0,0},
-    {"ttl",ttlCommand,2,"rF",0,NULL,1,1,1,0,0},
-    {"touch",touchCommand,-2,"rF",0,NULL,1,1,1,0,0},
-    {"pttl",pttlCommand,2,"rF",0,NULL,1,1,1,0,0},
-    {"persist",persistCommand,2,"wF",0,NULL,1,1,1,0,0},
+    {"ttl",ttlCommand,2,"rFBZ",0,NULL,1,1,1,0,0},
+    {"touch",touchCommand,-2,"rFBZ",0,NULL,1,1,1,0,0},
+    {"pttl",pttlCommand,2,"rFBZ",0,NULL,1,1,1,0,0},
+    {"persist",persistCommand,2,"wFBZ",0,NULL,1,1,1,0,0},
     {"slaveof",slaveofCommand,3,"ast",0,NULL,0,0,0,0,0},
     {"role",roleCommand,1,"lst",0,NULL,0,0,0,0,0},
-    {"debug",debugCommand,-1,"as",0,NULL,0,0,0,0,0},
+    {"debug",debugCommand,-1,"asBZ",0,NULL,0,0,0,0,0},
     {"config",configCommand,-2,"lat",0,NULL,0,0,0,0,0},
     {"subscribe",subscribeCommand,-2,"pslt",0,NULL,0,0,0,0,0},
     {"unsubscribe",unsubscribeCommand,-1,"pslt",0,NULL,0,0,0,0,0},
     {"psubscribe",psubscribeCommand,-2,"pslt",0,NULL,0,0,0,0,0},
     {"punsubscribe",punsubscribeCommand,-1,"pslt",0,NULL,0,0,0,0,0},
     {"publish",publishCommand,3,"pltF",0,NULL,0,0,0,0,0},
+    {"ssubscribe",ssubscribeCommand,-2,"pslt",0,NULL,1,-1,1,0,0},
+    {"sunsubscribe",sunsubscribeCommand,-1,"pslt",0,NULL,1,-1,1,0,0},
+    {"spublish",spublishCommand,3,"pltF",0,NULL,1,1,1,0,0},
     {"pubsub",pubsubCommand,-2,"pltR",0,NULL,0,0,0,0,0},
     {"watch",watchCommand,-2,"sF",0,NULL,1,-1,1,0,0},
     {"unwatch",unwatchCommand,1,"sF",0,NULL,0,0,0,0,0},
     {"cluster",clusterCommand,-2,"a",0,NULL,0,0,0,0,0},
     {"restore",restoreCommand,-4,"wm",0,NULL,1,1,1,0,0},
     {"restore-asking",restoreCommand,-4,"wmk",0,NULL,1,1,1,0,0},
-    {"migrate",migrateCommand,-6,"w",0,migrateGetKeys,0,0,0,0,0},
+    {"migrate",migrateCommand,-6,"wBZ",0,migrateGetKeys,0,0,0,0,0},
     {"asking",askingCommand,1,"F",0,NULL,0,0,0,0,0},
     {"readonly",readonlyCommand,1,"F",0,NULL,0,0,0,0,0},
     {"readwrite",readwriteCommand,1,"F",0,NULL,0,0,0,0,0},
-    {"dump",dumpCommand,2,"r",0,NULL,1,1,1,0,0},
-    {"object",objectCommand,-2,"r",0,NULL,2,2,2,0,0},
-    {"memory",memoryCommand,-2,"r",0,NULL,0,0,0,0,0},
+    {"dump",dumpCommand,2,"rBZ",0,NULL,1,1,1,0,0},
+    {"object",objectCommand,-2,"rBZ",0,NULL,2,2,2,0,0},
+    {"memory",memoryCommand,-2,"rBZ",0,NULL,0,0,0,0,0},
     {"client",clientCommand,-2,"as",0,NULL,0,0,0,0,0},
     {"eval",evalCommand,-3,"s",0,evalGetKeys,0,0,0,0,0},
     {"evalsha",evalShaCommand,-3,"s",0,evalGetKeys,0,0,0,0,0},
+    {"eval_ro",evalRoCommand,-3,"rs",0,evalGetKeys,0,0,0,0,0},
+    {"evalsha_ro",evalShaRoCommand,-3,"rs",0,evalGetKeys,0,0,0,0,0},
     {"slowlog",slowlogCommand,-2,"a",0,NULL,0,0,0,0,0},
     {"script",scriptCommand,-2,"s",0,NULL,0,0,0,0,0},
+    {"function",functionCommand,-2,"s",0,NULL,0,0,0,0,0},
+    {"fcall",fcallCommand,-3,"s",0,evalGetKeys,0,0,0,0,0},
     {"time",timeCommand,1,"RF",0,NULL,0,0,0,0,0},
-    {"bitop",bitopCommand,-4,"wm",0,NULL,2,-1,1,0,0},
-    {"bitcount",bitcountCommand,-2,"r",0,NULL,1,1,1,0,0},
-    {"bitpos",bitposCommand,-3,"r",0,NULL,1,1,1,0,0},
+    {"bitop",bitopCommand,-4,"wmB",0,NULL,2,-1,1,0,0},
+    {"bitcount",bitcountCommand,-2,"rB",0,NULL,1,1,1,0,0},
+    {"bitpos",bitposCommand,-3,"rB",0,NULL,1,1,1,0,0},
     {"wait",waitCommand,3,"s",0,NULL,0,0,0,0,0},
     {"command",commandCommand,0,"lt",0,NULL,0,0,0,0,0},
     {"geoadd",geoaddCommand,-5,"wm",0,NULL,1,1,1,0,0},
@@ -306,9 +341,28 @@ struct redisCommand redisCommandTable[] = {
     {"pfcount",pfcountCommand,-2,"r",0,NULL,1,-1,1,0,0},
     {"pfmerge",pfmergeCommand,-2,"wm",0,NULL,1,-1,1,0,0},
     {"pfdebug",pfdebugCommand,-3,"w",0,NULL,0,0,0,0,0},
+    {"bf.add",bfaddCommand,3,"wmF",0,NULL,1,1,1,0,0},
+    {"bf.madd",bfmaddCommand,-3,"wm",0,NULL,1,1,1,0,0},
+    {"bf.exists",bfexistsCommand,3,"rF",0,NULL,1,1,1,0,0},
+    {"bf.mexists",bfmexistsCommand,-3,"r",0,NULL,1,1,1,0,0},
+    {"ts.add",tsaddCommand,4,"wmF",0,NULL,1,1,1,0,0},
+    {"ts.range",tsrangeCommand,-4,"r",0,NULL,1,1,1,0,0},
+    {"ts.get",tsgetCommand,2,"rF",0,NULL,1,1,1,0,0},
+    {"xadd",xaddCommand,-5,"wmF",0,NULL,1,1,1,0,0},
+    {"xrange",xrangeCommand,-4,"r",0,NULL,1,1,1,0,0},
+    {"xrevrange",xrevrangeCommand,-4,"r",0,NULL,1,1,1,0,0},
+    {"xlen",xlenCommand,2,"rF",0,NULL,1,1,1,0,0},
+    {"xread",xreadCommand,-3,"rs",0,xreadGetKeys,1,1,1,0,0},
+    {"xreadgroup",xreadCommand,-7,"ws",0,xreadGetKeys,1,1,1,0,0},
+    {"xgroup",xgroupCommand,-2,"wm",0,NULL,2,2,1,0,0},
+    {"xack",xackCommand,-4,"wF",0,NULL,1,1,1,0,0},
+    {"xpending",xpendingCommand,-3,"rR",0,NULL,1,1,1,0,0},
+    {"xclaim",xclaimCommand,-6,"wF",0,NULL,1,1,1,0,0},
     {"post",securityWarningCommand,-1,"lt",0,NULL,0,0,0,0,0},
     {"host:",securityWarningCommand,-1,"lt",0,NULL,0,0,0,0,0},
-    {"latency",latencyCommand,-2,"aslt",0,NULL,0,0,0,0,0}
+    {"latency",latencyCommand,-2,"aslt",0,NULL,0,0,0,0,0},
+    {"hotkeys",hotkeysCommand,-1,"aRt",0,NULL,0,0,0,0,0},
+    {"trace",traceCommand,-2,"aslt",0,NULL,0,0,0,0,0}
 };
 
 /*============================ Utility functions ============================ */
@@ -476,6 +530,24 @@ void dictObjectDestructor(void *privdata, void *val)
     decrRefCount((robj *)val);
 }
 
+/* The registry reference is released by the caller, or with the whole Lua
+ * interpreter. */
+void dictLuaFunctionDestructor(void *privdata, void *val)
+{
+    DICT_NOTUSED(privdata);
+
+    decrRefCount(((luaFunction *)val)->body);
+    zfree(val);
+}
+
+void dictScriptStatsDestructor(void *privdata, void *val)
+{
+    DICT_NOTUSED(privdata);
+
+    zfree(((scriptStats *)val)->commands);
+    zfree(val);
+}
+
 void dictSdsDestructor(void *privdata, void *val)
 {
     DICT_NOTUSED(privdata);
@@ -483,6 +555,25 @@ void dictSdsDestructor(void *privdata, void *val)
     sdsfree((sds)val);
 }
 
+/* Hash values are sds strings, or integers stored in place of the pointer. */
+void dictHashValDestructor(void *privdata, void *val)
+{
+    DICT_NOTUSED(privdata);
+
+    if ((uintptr_t)val & HASH_INT_VAL_FLAG) return;
+    sdsfree((sds)val);
+}
+
+size_t dictSdsEmbedSize(const void *key)
+{
+    return sdsinplacesize(sdslen((sds)key));
+}
+
+void *dictSdsEmbed(void *buf, const void *key)
+{
+    return sdsnewinplace(buf,key,sdslen((sds)key));
+}
+
 int dictObjKeyCompare(void *privdata, const void *key1,
         const void *key2)
 {
@@ -500,6 +591,19 @@ uint64_t dictSdsHash(const void *key) {
     return dictGenHashFunction((unsigned char*)key, sdslen((char*)key));
 }
 
+void dictSdsHashBatch(void **keys, int count, uint64_t *hashes) {
+    int lens[DICT_PREFETCH_BATCH];
+
+    while (count > 0) {
+        int batch = count > DICT_PREFETCH_BATCH ? DICT_PREFETCH_BATCH : count;
+        for (int j = 0; j < batch; j++) lens[j] = sdslen((sds)keys[j]);
+        dictGenHashFunctionBatch((const void **)keys,lens,batch,hashes);
+        keys += batch;
+        hashes += batch;
+        count -= batch;
+    }
+}
+
 uint64_t dictSdsCaseHash(const void *key) {
     return dictGenCaseHashFunction((unsigned char*)key, sdslen((char*)key));
 }
@@ -556,6 +660,17 @@ dictType objectKeyPointerValueDictType = {
     NULL                       /* val destructor */
 };
 
+/* Like objectKeyPointerValueDictType(), but values can be destroyed, if
+ * not NULL, calling zfree(). */
+dictType objectKeyHeapPointerValueDictType = {
+    dictEncObjHash,            /* hash function */
+    NULL,                      /* key dup */
+    NULL,                      /* val dup */
+    dictEncObjKeyCompare,      /* key compare */
+    dictObjectDestructor,      /* key destructor */
+    dictVanillaFree            /* val destructor */
+};
+
 /* Set dictionary type. Keys are SDS strings, values are ot used. */
 dictType setDictType = {
     dictSdsHash,               /* hash function */
@@ -577,13 +692,21 @@ dictType zsetDictType = {
 };
 
 /* Db->_dict, keys are sds strings, vals are Redis objects. */
+/* Keys are embedded in the entries, so that adding a key takes a single
+ * allocation and a lookup doesn't need to access another cache line for the
+ * key string. */
 dictType dbDictType = {
     dictSdsHash,                /* hash function */
     NULL,                       /* key dup */
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
-    dictSdsDestructor,          /* key destructor */
-    dictObjectDestructor   /* val destructor */
+    NULL,                       /* key destructor */
+    dictObjectDestructor,       /* val destructor */
+    DICT_TYPE_OPEN_ADDRESSING|DICT_TYPE_EMBED_KEYS, /* flags */
+    dictSdsEmbedSize,           /* embedded key size */
+    dictSdsEmbed,               /* embed key */
+    dictSdsHashBatch,           /* batch hash function */
+    sizeof(long long)           /* entry metadata: the expire, see setExpire() */
 };
 
 /* server.lua_scripts sha (as sds string) -> scripts (as robj) cache. */
@@ -596,14 +719,38 @@ dictType shaScriptObjectDictType = {
     dictObjectDestructor        /* val destructor */
 };
 
-/* Db->expires */
+/* server.lua_functions name (as sds string) -> luaFunction. */
+dictType luaFunctionDictType = {
+    dictSdsCaseHash,            /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCaseCompare,      /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    dictLuaFunctionDestructor   /* val destructor */
+};
+
+/* server.lua_script_stats SHA1 or function (as sds string) -> scriptStats. */
+dictType scriptStatsDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    dictScriptStatsDestructor   /* val destructor */
+};
+
+/* Db->expires: the entries of the keys with an expire, borrowed from db->dict. */
 dictType keyptrDictType = {
     dictSdsHash,                /* hash function */
     NULL,                       /* key dup */
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
     NULL,                       /* key destructor */
-    NULL                        /* val destructor */
+    NULL,                       /* val destructor */
+    DICT_TYPE_OPEN_ADDRESSING|DICT_TYPE_BORROWED_ENTRIES, /* flags */
+    NULL,                       /* embedded key size */
+    NULL,                       /* embed key */
+    dictSdsHashBatch            /* batch hash function */
 };
 
 /* Command table. sds string -> command struct pointer. */
@@ -616,14 +763,26 @@ dictType commandTableDictType = {
     NULL                        /* val destructor */
 };
 
-/* Hash type hash table (note that small hashes are represented with ziplists) */
+/* Hash type hash table (note that small hashes are represented with listpacks) */
 dictType hashDictType = {
     dictSdsHash,                /* hash function */
     NULL,                       /* key dup */
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
     dictSdsDestructor,          /* key destructor */
-    dictSdsDestructor           /* val destructor */
+    dictHashValDestructor       /* val destructor */
+};
+
+/* Db->_slots_to_keys, the keys of a cluster hash slot. The keys are the same
+ * sds strings of the main dictionary, values are not used. */
+dictType slotKeysDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    NULL,                       /* key destructor */
+    NULL,                       /* val destructor */
+    DICT_TYPE_OPEN_ADDRESSING   /* flags */
 };
 
 /* Keylist hash table type has unencoded redis objects as keys and
@@ -638,6 +797,28 @@ dictType keylistDictType = {
     dictListDestructor          /* val destructor */
 };
 
+/* Keys of the cached PFCOUNT unions, as unencoded redis objects, to their
+ * version (a zmalloc'ed hllKeyVersion). */
+dictType hllVersionsDictType = {
+    dictObjHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictObjKeyCompare,          /* key compare */
+    dictObjectDestructor,       /* key destructor */
+    dictVanillaFree             /* val destructor */
+};
+
+/* Cached PFCOUNT unions, by the sds of their list of keys. The values are
+ * released by hyperloglog.cpp, since they reference the versions dict. */
+dictType hllUnionsDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    NULL                        /* val destructor */
+};
+
 /* Cluster nodes hash table, mapping nodes addresses 1.2.3.4:6379 to
  * clusterNode structures. */
 dictType clusterNodesDictType = {
@@ -704,13 +885,13 @@ int htNeedsResize(dict *dict) {
             (used*100/size < HASHTABLE_MIN_FILL));
 }
 
-/* If the percentage of used slots in the HT reaches HASHTABLE_MIN_FILL
- * we resize the hash table to save memory */
+/* The keyspace tables are shrunk as keys are deleted, see
+ * dictShrinkIfNeeded(), but not while resizing is disabled because of a child
+ * process, or while the table is iterated. Here we catch the tables that
+ * were left oversized this way. */
 void tryResizeHashTables(int dbid) {
-    if (htNeedsResize(server.db[dbid].m_dict))
-        server.db[dbid].m_dict->dictResize();
-    if (htNeedsResize(server.db[dbid].m_expires))
-        server.db[dbid].m_expires->dictResize();
+    server.db[dbid].m_dict->dictShrinkIfNeeded();
+    server.db[dbid].m_expires->dictShrinkIfNeeded();
 }
 
 /* Our hash table implementation performs rehashing incrementally while
@@ -734,6 +915,39 @@ int incrementallyRehash(int dbid) {
     return 0;
 }
 
+/* Perform incremental rehashing for up to server.active_rehashing_budget_us
+ * microseconds, called at every event loop iteration. The time is spent on
+ * the largest dictionary being rehashed first, since it is the one using most
+ * memory for the two tables, moving to the next one when it is done.
+ *
+ * Like in databasesCron(), nothing is done while there is a child saving
+ * the DB, to avoid copy-on-write of the pages touched by rehashing. */
+void rehashDictsWithBudget(void) {
+    long long start;
+    int j;
+
+    if (!server.activerehashing || server.active_rehashing_budget_us == 0 ||
+        server.rdb_child_pid != -1 || server.aof_child_pid != -1) return;
+
+    start = ustime();
+    while(1) {
+        dict *target = NULL;
+
+        for (j = 0; j < server.dbnum; j++) {
+            dict *d = server.db[j].m_dict;
+            dict *e = server.db[j].m_expires;
+
+            if (d->dictIsRehashing() &&
+                (!target || d->dictSize() > target->dictSize())) target = d;
+            if (e->dictIsRehashing() &&
+                (!target || e->dictSize() > target->dictSize())) target = e;
+        }
+        if (target == NULL) break;
+        target->dictRehash(100);
+        if (ustime()-start >= server.active_rehashing_budget_us) break;
+    }
+}
+
 /* This function is called once a background process of some kind terminates,
  * as we want to avoid resizing the hash tables when there is a child in order
  * to play well with copy-on-write (otherwise when a resize happens lots of
@@ -741,7 +955,10 @@ int incrementallyRehash(int dbid) {
  * for dict.c to resize the hash tables accordingly to the fact we have o not
  * running childs. */
 void updateDictResizePolicy() {
-    if (server.rdb_child_pid == -1 && server.aof_child_pid == -1)
+    /* The fork-less snapshot relies on the tables not shrinking as well,
+     * see snapshot.cpp. */
+    if (server.rdb_child_pid == -1 && server.aof_child_pid == -1 &&
+        server.rdb_snapshot == NULL)
         dictEnableResize();
     else
         dictDisableResize();
@@ -794,15 +1011,9 @@ int clientsCronHandleTimeout(client *c, mstime_t now_ms) {
         freeClient(c);
         return 1;
     } else if (c->m_flags & CLIENT_BLOCKED) {
-        /* Blocked OPS timeout is handled with milliseconds resolution.
-         * However note that the actual resolution is limited by
-         * server.hz. */
-
-        if (c->m_blocking_state.m_timeout != 0 && c->m_blocking_state.m_timeout < now_ms) {
-            /* Handle blocking operation specific timeout. */
-            replyToBlockedClientTimedOut(c);
-            c->unblockClient();
-        } else if (server.cluster_enabled) {
+        /* The timeouts of the blocked operations are handled, with
+         * milliseconds resolution, by blockedClientsTimeoutProc(). */
+        if (server.cluster_enabled) {
             /* Cluster: handle unblock & redirect of clients blocked
              * into keys no longer served by this server. */
             if (clusterRedirectBlockedClientIfNeeded(c))
@@ -829,7 +1040,10 @@ int clientsCronResizeQueryBuffer(client *c) {
     {
         /* Only resize the query buffer if it is actually wasting space. */
         if (sdsavail(c->m_query_buf) > 1024) {
+            int transient = c->m_bulk_len < PROTO_MBULK_BIG_ARG;
+            if (transient) zmalloc_transient_begin();
             c->m_query_buf = sdsRemoveFreeSpace(c->m_query_buf);
+            if (transient) zmalloc_transient_end();
         }
     }
     /* Reset the peak again to capture the peak memory usage in the next
@@ -838,6 +1052,57 @@ int clientsCronResizeQueryBuffer(client *c) {
     return 0;
 }
 
+/* INFO reports the longest reply list and the biggest query buffer of the
+ * clients, and the memory used by them: instead of walking all the clients
+ * on every INFO, the cron records the largest values it saw during each of
+ * the last CLIENTS_PEAK_MEM_USAGE_SLOTS seconds, and keeps the memory of
+ * every client in server.stat_clients_normal_memory as of its last visit.
+ * Since the cron visits all the clients every second, the figures are at
+ * most a second old. */
+#define CLIENTS_PEAK_MEM_USAGE_SLOTS 8
+static unsigned long ClientsPeakOutputList[CLIENTS_PEAK_MEM_USAGE_SLOTS];
+static unsigned long ClientsPeakInputBuffer[CLIENTS_PEAK_MEM_USAGE_SLOTS];
+
+int clientsCronTrackExpansiveClients(client *c) {
+    int slot = server.unixtime % CLIENTS_PEAK_MEM_USAGE_SLOTS;
+    unsigned long lol = c->m_reply->listLength();
+    unsigned long bib = sdslen(c->m_query_buf);
+
+    if (lol > ClientsPeakOutputList[slot]) ClientsPeakOutputList[slot] = lol;
+    if (bib > ClientsPeakInputBuffer[slot]) ClientsPeakInputBuffer[slot] = bib;
+    return 0;
+}
+
+int clientsCronTrackClientsMemUsage(client *c) {
+    size_t mem = 0;
+
+    /* The slaves are a few, and accounted by getMemoryOverheadData(). */
+    if (!(c->m_flags & CLIENT_SLAVE)) {
+        mem += c->getClientOutputBufferMemoryUsage();
+        mem += sdsAllocSize(c->m_query_buf);
+        mem += sizeof(client);
+    }
+    server.stat_clients_normal_memory -= c->m_cron_memory_usage;
+    server.stat_clients_normal_memory += mem;
+    c->m_cron_memory_usage = mem;
+    return 0;
+}
+
+/* Return the largest values recorded by clientsCronTrackExpansiveClients()
+ * in the last seconds. */
+void getExpansiveClientsInfo(unsigned long *longest_output_list,
+                             unsigned long *biggest_input_buffer)
+{
+    unsigned long lol = 0, bib = 0;
+
+    for (int j = 0; j < CLIENTS_PEAK_MEM_USAGE_SLOTS; j++) {
+        if (ClientsPeakOutputList[j] > lol) lol = ClientsPeakOutputList[j];
+        if (ClientsPeakInputBuffer[j] > bib) bib = ClientsPeakInputBuffer[j];
+    }
+    *longest_output_list = lol;
+    *biggest_input_buffer = bib;
+}
+
 #define CLIENTS_CRON_MIN_ITERATIONS 5
 void clientsCron() {
     /* Make sure to process at least numclients/server.hz of clients
@@ -855,6 +1120,11 @@ void clientsCron() {
         iterations = (numclients < CLIENTS_CRON_MIN_ITERATIONS) ?
                      numclients : CLIENTS_CRON_MIN_ITERATIONS;
 
+    /* Start recording the next second of peaks on a clean slot. */
+    int zeroidx = (server.unixtime+1) % CLIENTS_PEAK_MEM_USAGE_SLOTS;
+    ClientsPeakOutputList[zeroidx] = 0;
+    ClientsPeakInputBuffer[zeroidx] = 0;
+
     while(server.clients->listLength() && iterations--) {
         /* Rotate the list, take the current head, process.
          * This way if the client must be removed from the list it's the
@@ -866,7 +1136,9 @@ void clientsCron() {
          * The protocol is that they return non-zero if the client was
          * terminated. */
         if (clientsCronHandleTimeout(c,now)) continue;
+        if (clientsCronTrackExpansiveClients(c)) continue;
         if (clientsCronResizeQueryBuffer(c)) continue;
+        if (clientsCronTrackClientsMemUsage(c)) continue;
     }
 }
 
@@ -874,17 +1146,44 @@ void clientsCron() {
  * incrementally in Redis databases, such as active key expiring, resizing,
  * rehashing. */
 void databasesCron() {
+    long long start;
+
     /* Expire keys by random sampling. Not required for slaves
      * as master will synthesize DELs for us. */
     if (server.active_expire_enabled && server.masterhost == NULL) {
+        elPhaseStart(start);
         activeExpireCycle(ACTIVE_EXPIRE_CYCLE_SLOW);
+        elPhaseEnd(EL_PHASE_ACTIVE_EXPIRE,start);
     } else if (server.masterhost != NULL) {
         expireSlaveKeys();
     }
 
     /* Defrag keys gradually. */
-    if (server.active_defrag_enabled)
+    if (server.active_defrag_enabled) {
+        elPhaseStart(start);
         activeDefragCycle();
+        elPhaseEnd(EL_PHASE_ACTIVE_DEFRAG,start);
+    }
+
+    /* Account some more keys to their prefix, see MEMORY PREFIXES. */
+    if (server.memprefix) memPrefixCron();
+
+    /* Convert some more lists to the current list-node-container. Like
+     * rehashing this writes to a lot of pages, so it waits for the
+     * children saving the DB. */
+    if (server.list_conversion_pending &&
+        server.list_node_container_conversion == LIST_CONVERSION_BACKGROUND &&
+        server.rdb_child_pid == -1 && server.aof_child_pid == -1)
+    {
+        listContainerConversionCron();
+    }
+
+    /* Compact some more cold collections, see adaptive-encoding-*. */
+    if (server.adaptive_encoding_cold_seconds &&
+        server.rdb_child_pid == -1 && server.aof_child_pid == -1)
+    {
+        adaptiveEncodingCron();
+    }
 
     /* Perform hash tables rehashing if needed, but only if there are no
      * other processes saving the DB on disk. Otherwise rehashing is bad
@@ -907,8 +1206,9 @@ void databasesCron() {
             resize_db++;
         }
 
-        /* Rehash */
-        if (server.activerehashing) {
+        /* Rehash, unless it is performed with a time budget in
+         * beforeSleep(). */
+        if (server.activerehashing && server.active_rehashing_budget_us == 0) {
             for (j = 0; j < dbs_per_call; j++) {
                 int work_done = incrementallyRehash(rehash_db);
                 if (work_done) {
@@ -956,10 +1256,13 @@ void updateCachedTime() {
 
 int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     int j;
+    long long cron_start, start;
     UNUSED(eventLoop);
     UNUSED(id);
     UNUSED(clientData);
 
+    elPhaseStart(cron_start);
+
     /* Software watchdog: deliver the SIGALRM that will reach the signal
      * handler if we don't return here fast enough. */
     if (server.watchdog_period) watchdogScheduleSignal(server.watchdog_period);
@@ -973,6 +1276,12 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
                 server.stat_net_input_bytes);
         trackInstantaneousMetric(STATS_METRIC_NET_OUTPUT,
                 server.stat_net_output_bytes);
+        trackInstantaneousMetric(STATS_METRIC_LAZYFREED,
+                lazyfreeGetFreedObjectsCount());
+        trackInstantaneousMetric(STATS_METRIC_CLUSTER_BUS_INPUT,
+                server.stat_cluster_bus_input_bytes);
+        trackInstantaneousMetric(STATS_METRIC_CLUSTER_BUS_OUTPUT,
+                server.stat_cluster_bus_output_bytes);
     }
 
     /* We have just LRU_BITS bits per object for LRU information.
@@ -1031,10 +1340,23 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     }
 
     /* We need to do a few operations on clients asynchronously. */
+    elPhaseStart(start);
     clientsCron();
+    elPhaseEnd(EL_PHASE_CLIENTS_CRON,start);
 
     /* Handle background operations on Redis databases. */
+    elPhaseStart(start);
     databasesCron();
+    elPhaseEnd(EL_PHASE_DATABASES_CRON,start);
+
+    /* Walk the keyspace for the fork-less BGSAVE in progress, if any. */
+    snapshotCron();
+
+    /* Load the values left in the RDB file by lazy-loading, if any. */
+    lazyLoadCron();
+
+    /* Reclaim the space of the tiering file. */
+    tierCron();
 
     /* Start a scheduled AOF rewrite if this was requested by the user while
      * a BGSAVE was in progress. */
@@ -1048,6 +1370,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     if (server.rdb_child_pid != -1 || server.aof_child_pid != -1 ||
         ldbPendingChildren())
     {
+        receiveChildInfo(); /* Copy on write reported during the save. */
         int statloc;
         pid_t pid;
 
@@ -1089,7 +1412,8 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
              * the given amount of seconds, and if the latest bgsave was
              * successful or if, in case of an error, at least
              * CONFIG_BGSAVE_RETRY_DELAY seconds already elapsed. */
-            if (server.dirty >= sp->changes &&
+            if (server.rdb_snapshot == NULL &&
+                server.dirty >= sp->changes &&
                 server.unixtime-server.lastsave > sp->seconds &&
                 (server.unixtime-server.lastbgsave_try >
                  CONFIG_BGSAVE_RETRY_DELAY ||
@@ -1099,7 +1423,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
                     sp->changes, (int)sp->seconds);
                 rdbSaveInfo rsi, *rsiptr;
                 rsiptr = rdbPopulateSaveInfo(&rsi);
-                rdbSaveBackground(server.rdb_filename,rsiptr);
+                rdbStartBackgroundSave(server.rdb_filename,rsiptr);
                 break;
             }
          }
@@ -1140,13 +1464,24 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     /* Clear the paused clients flag if needed. */
     clientsArePaused(); /* Don't check return value, just use the side effect.*/
 
+    /* Stop the I/O threads if we don't have enough pending work. */
+    stopThreadedIOIfNeeded();
+
     /* Replication cron function -- used to reconnect to master,
      * detect transfer failures, start background RDB transfers and so forth. */
-    run_with_period(1000) replicationCron();
+    run_with_period(1000) {
+        elPhaseStart(start);
+        replicationCron();
+        elPhaseEnd(EL_PHASE_REPLICATION_CRON,start);
+    }
 
     /* Run the Redis Cluster cron. */
     run_with_period(100) {
-        if (server.cluster_enabled) clusterCron();
+        if (server.cluster_enabled) {
+            elPhaseStart(start);
+            clusterCron();
+            elPhaseEnd(EL_PHASE_CLUSTER_CRON,start);
+        }
     }
 
     /* Run the Sentinel timer if we are in sentinel mode. */
@@ -1159,6 +1494,18 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
         migrateCloseTimedoutSockets();
     }
 
+    /* Fail the MIGRATE ... SLOT jobs that timed out. */
+    migrateSlotCron();
+
+    /* Decay the hot keys counters. */
+    run_with_period(1000) hotkeysCron();
+
+    /* Publish a new page of the metrics endpoint. */
+    run_with_period(1000) metricsCron();
+
+    /* Keep the client side caching tracking table under its limit. */
+    trackingLimitUsedSlots();
+
     /* Start a scheduled BGSAVE if the corresponding flag is set. This is
      * useful when we are forced to postpone a BGSAVE because an AOF
      * rewrite is in progress.
@@ -1167,17 +1514,18 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
      * make sure when refactoring this file to keep this order. This is useful
      * because we want to give priority to RDB savings for replication. */
     if (server.rdb_child_pid == -1 && server.aof_child_pid == -1 &&
-        server.rdb_bgsave_scheduled &&
+        server.rdb_snapshot == NULL && server.rdb_bgsave_scheduled &&
         (server.unixtime-server.lastbgsave_try > CONFIG_BGSAVE_RETRY_DELAY ||
          server.lastbgsave_status == C_OK))
     {
         rdbSaveInfo rsi, *rsiptr;
         rsiptr = rdbPopulateSaveInfo(&rsi);
-        if (rdbSaveBackground(server.rdb_filename,rsiptr) == C_OK)
+        if (rdbStartBackgroundSave(server.rdb_filename,rsiptr) == C_OK)
             server.rdb_bgsave_scheduled = 0;
     }
 
     server.cronloops++;
+    elPhaseEnd(EL_PHASE_SERVER_CRON,cron_start);
     return 1000/server.hz;
 }
 
@@ -1185,8 +1533,19 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
  * main loop of the event driven library, that is, before to sleep
  * for ready file descriptors. */
 void beforeSleep(struct aeEventLoop *eventLoop) {
+    long long start;
     UNUSED(eventLoop);
 
+    /* Account the processing of the events since we woke up, then the time
+     * spent here. */
+    elPhaseStart(start);
+    if (server.el_events_start)
+        elPhaseRecord(EL_PHASE_PROCESS_EVENTS,start-server.el_events_start);
+
+    /* Handle the clients whose reads were postponed in order to serve them
+     * using the I/O threads. */
+    handleClientsWithPendingReadsUsingThreads();
+
     /* Call the Redis Cluster before sleep function. Note that this function
      * may change the state of Redis Cluster (from ok to fail or vice versa),
      * so it's a good idea to call it before serving the unblocked clients
@@ -1195,8 +1554,12 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
 
     /* Run a fast expire cycle (the called function will return
      * ASAP if a fast cycle is not needed). */
-    if (server.active_expire_enabled && server.masterhost == NULL)
+    if (server.active_expire_enabled && server.masterhost == NULL) {
+        long long expire_start;
+        elPhaseStart(expire_start);
         activeExpireCycle(ACTIVE_EXPIRE_CYCLE_FAST);
+        elPhaseEnd(EL_PHASE_ACTIVE_EXPIRE,expire_start);
+    }
 
     /* Send all the slaves an ACK request if at least one client blocked
      * during the previous event loop iteration. */
@@ -1213,10 +1576,13 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
         server.get_ack_from_slaves = 0;
     }
 
-    /* Unblock all the clients blocked for synchronous replication
-     * in WAIT. */
-    if (server.clients_waiting_acks->listLength())
-        processClientsWaitingReplicas();
+    /* Unblock the clients blocked for synchronous replication in WAIT
+     * that the ACKs received during this iteration satisfy. */
+    if (server.slaves_acks_changed) processClientsWaitingReplicas();
+
+    /* Acknowledge the stream of our master applied during this
+     * iteration, see slave-fast-ack. */
+    if (server.slave_fast_ack) replicationSendAckIfNeeded();
 
     /* Check if there are clients unblocked by modules that implement
      * blocking commands. */
@@ -1226,16 +1592,31 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
     if (server.unblocked_clients->listLength())
         processUnblockedClients();
 
+    /* Send the invalidation messages to the clients in BCAST mode. */
+    trackingBroadcastInvalidationMessages();
+
+    /* Evict keys ahead of time to keep the maxmemory headroom. */
+    freeMemoryAheadOfTime();
+
+    /* Spend the incremental rehashing time budget. */
+    rehashDictsWithBudget();
+
     /* Write the AOF buffer on disk */
     flushAppendOnlyFile(0);
 
+    /* Send the slaves the stream of this iteration, LZF framed once for
+     * all of them. */
+    replicationFlushCompressedStream();
+
     /* Handle writes with pending output buffers. */
-    handleClientsWithPendingWrites();
+    handleClientsWithPendingWritesUsingThreads();
+
+    elPhaseEnd(EL_PHASE_BEFORE_SLEEP,start);
 
     /* Before we are going to sleep, let the threads access the dataset by
      * releasing the GIL. Redis main thread will not touch anything at this
      * time. */
-    if (moduleCount()) moduleReleaseGIL();
+    if (moduleCount()) moduleReleaseGILBeforeSleep();
 }
 
 /* This function is called immadiately after the event loop multiplexing
@@ -1243,7 +1624,37 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
  * the different events callbacks. */
 void afterSleep(struct aeEventLoop *eventLoop) {
     UNUSED(eventLoop);
-    if (moduleCount()) moduleAcquireGIL();
+    if (moduleCount()) moduleAcquireGILAfterSleep();
+    server.el_events_start = ustime();
+}
+
+/* The main thread phases, in the EL_PHASE_* order, with the name of their
+ * latency event. */
+static struct {
+    const char *name;
+    const char *latency_event;
+} elPhaseTable[EL_PHASE_COUNT] = {
+    {"process_events", "process-events"},
+    {"before_sleep", "before-sleep"},
+    {"server_cron", "server-cron"},
+    {"clients_cron", "clients-cron"},
+    {"databases_cron", "databases-cron"},
+    {"active_expire", NULL}, /* Already reported as expire-cycle. */
+    {"active_defrag", "active-defrag-cycle"},
+    {"cluster_cron", "cluster-cron"},
+    {"replication_cron", "replication-cron"}
+};
+
+/* Account a run of 'usec' microseconds of the main thread phase 'phase',
+ * reported by INFO eventloop, and as a latency event when it is above
+ * the latency monitor threshold. */
+void elPhaseRecord(int phase, long long usec) {
+    server.el_phase[phase].calls++;
+    server.el_phase[phase].usec += usec;
+    if (usec > server.el_phase[phase].max_usec)
+        server.el_phase[phase].max_usec = usec;
+    if (elPhaseTable[phase].latency_event)
+        latencyAddSampleIfNeeded(elPhaseTable[phase].latency_event,usec/1000);
 }
 
 /* =========================== Server initialization ======================== */
@@ -1316,6 +1727,9 @@ void createSharedObjects() {
     shared.unsubscribebulk = createStringObject("$11\r\nunsubscribe\r\n",18);
     shared.psubscribebulk = createStringObject("$10\r\npsubscribe\r\n",17);
     shared.punsubscribebulk = createStringObject("$12\r\npunsubscribe\r\n",19);
+    shared.smessagebulk = createStringObject("$8\r\nsmessage\r\n",14);
+    shared.ssubscribebulk = createStringObject("$10\r\nssubscribe\r\n",17);
+    shared.sunsubscribebulk = createStringObject("$12\r\nsunsubscribe\r\n",19);
     shared.del = createStringObject("DEL",3);
     shared.unlink = createStringObject("UNLINK",6);
     shared.rpop = createStringObject("RPOP",4);
@@ -1346,6 +1760,13 @@ void initServerConfig() {
     pthread_mutex_init(&server.next_client_id_mutex,NULL);
     pthread_mutex_init(&server.lruclock_mutex,NULL);
     pthread_mutex_init(&server.unixtime_mutex,NULL);
+    pthread_mutex_init(&server.stat_net_input_bytes_mutex,NULL);
+    pthread_mutex_init(&server.stat_net_output_bytes_mutex,NULL);
+    pthread_mutex_init(&server.stat_writev_calls_mutex,NULL);
+    pthread_mutex_init(&server.stat_writev_iovecs_mutex,NULL);
+    pthread_mutex_init(&server.stat_writev_bytes_mutex,NULL);
+    pthread_mutex_init(&server.stat_qbuf_pool_hits_mutex,NULL);
+    pthread_mutex_init(&server.stat_qbuf_pool_misses_mutex,NULL);
 
     getRandomHexChars(server.runid,CONFIG_RUN_ID_SIZE);
     server.runid[CONFIG_RUN_ID_SIZE] = '\0';
@@ -1357,10 +1778,20 @@ void initServerConfig() {
     server.arch_bits = (sizeof(long) == 8) ? 64 : 32;
     server.port = CONFIG_DEFAULT_SERVER_PORT;
     server.tcp_backlog = CONFIG_DEFAULT_TCP_BACKLOG;
+    server.metrics_port = CONFIG_DEFAULT_METRICS_PORT;
     server.bindaddr_count = 0;
     server.unixsocket = NULL;
     server.unixsocketperm = CONFIG_DEFAULT_UNIX_SOCKET_PERM;
     server.ipfd_count = 0;
+    server.tcp_listeners = CONFIG_DEFAULT_TCP_LISTENERS;
+    server.tls_port = CONFIG_DEFAULT_TLS_PORT;
+    server.tlsfd_count = 0;
+    server.tls_cert_file = NULL;
+    server.tls_key_file = NULL;
+    server.tls_ca_cert_file = NULL;
+    server.tls_replication = CONFIG_DEFAULT_TLS_REPLICATION;
+    server.tls_cluster = CONFIG_DEFAULT_TLS_CLUSTER;
+    server.tls_handshake_threads = CONFIG_DEFAULT_TLS_HANDSHAKE_THREADS;
     server.sofd = -1;
     server.protected_mode = CONFIG_DEFAULT_PROTECTED_MODE;
     server.dbnum = CONFIG_DEFAULT_DBNUM;
@@ -1369,14 +1800,29 @@ void initServerConfig() {
     server.tcpkeepalive = CONFIG_DEFAULT_TCP_KEEPALIVE;
     server.active_expire_enabled = 1;
     server.active_defrag_enabled = CONFIG_DEFAULT_ACTIVE_DEFRAG;
+    server.huge_pages = CONFIG_DEFAULT_HUGE_PAGES;
+    server.transient_arena = CONFIG_DEFAULT_TRANSIENT_ARENA;
     server.active_defrag_ignore_bytes = CONFIG_DEFAULT_DEFRAG_IGNORE_BYTES;
     server.active_defrag_threshold_lower = CONFIG_DEFAULT_DEFRAG_THRESHOLD_LOWER;
     server.active_defrag_threshold_upper = CONFIG_DEFAULT_DEFRAG_THRESHOLD_UPPER;
     server.active_defrag_cycle_min = CONFIG_DEFAULT_DEFRAG_CYCLE_MIN;
     server.active_defrag_cycle_max = CONFIG_DEFAULT_DEFRAG_CYCLE_MAX;
+    server.active_defrag_max_scan_fields = CONFIG_DEFAULT_DEFRAG_MAX_SCAN_FIELDS;
+    server.active_expire_cycle_min = CONFIG_DEFAULT_ACTIVE_EXPIRE_CYCLE_MIN;
+    server.active_expire_cycle_max = CONFIG_DEFAULT_ACTIVE_EXPIRE_CYCLE_MAX;
+    server.active_expire_effort = CONFIG_DEFAULT_ACTIVE_EXPIRE_CYCLE_MAX;
+    server.stat_expired_stale_perc = 0;
+    server.stat_expire_loop_lag = 0;
     server.client_max_querybuf_len = PROTO_MAX_QUERYBUF_LEN;
+    server.io_threads_num = CONFIG_DEFAULT_IO_THREADS_NUM;
+    server.io_threads_do_reads = CONFIG_DEFAULT_IO_THREADS_DO_READS;
+    server.slave_parallel_reads = CONFIG_DEFAULT_SLAVE_PARALLEL_READS;
+    server.io_threads_shards = CONFIG_DEFAULT_IO_THREADS_SHARDS;
+    server.io_threads_exec_active = 0;
+    server.module_read_shared = 0;
     server.saveparams = NULL;
     server.loading = 0;
+    server.async_loading = 0;
     server.logfile = zstrdup(CONFIG_DEFAULT_LOGFILE);
     server.syslog_enabled = CONFIG_DEFAULT_SYSLOG_ENABLED;
     server.syslog_ident = zstrdup(CONFIG_DEFAULT_SYSLOG_IDENT);
@@ -1401,15 +1847,46 @@ void initServerConfig() {
     server.aof_flush_postponed_start = 0;
     server.aof_rewrite_incremental_fsync = CONFIG_DEFAULT_AOF_REWRITE_INCREMENTAL_FSYNC;
     server.aof_load_truncated = CONFIG_DEFAULT_AOF_LOAD_TRUNCATED;
+    server.aof_load_prefetch = CONFIG_DEFAULT_AOF_LOAD_PREFETCH;
     server.aof_use_rdb_preamble = CONFIG_DEFAULT_AOF_USE_RDB_PREAMBLE;
+    server.aof_multi_part = CONFIG_DEFAULT_AOF_MULTI_PART;
+    server.aof_manifest = NULL;
+    server.aof_group_commit = CONFIG_DEFAULT_AOF_GROUP_COMMIT;
+    server.aof_writer = NULL;
+    server.aof_binary_format = CONFIG_DEFAULT_AOF_BINARY_FORMAT;
+    server.aof_binary_epoch = 1;
+    server.aof_binary_last_id = 0;
+    server.aof_fd_size = 0;
     server.pidfile = NULL;
+    server.server_cpulist = NULL;
+    server.bio_cpulist = NULL;
+    server.io_threads_cpulist = NULL;
+    server.numa_bind = CONFIG_DEFAULT_NUMA_BIND;
     server.rdb_filename = zstrdup(CONFIG_DEFAULT_RDB_FILENAME);
     server.aof_filename = zstrdup(CONFIG_DEFAULT_AOF_FILENAME);
     server.requirepass = NULL;
     server.rdb_compression = CONFIG_DEFAULT_RDB_COMPRESSION;
+    server.rdb_compression_codec = CONFIG_DEFAULT_RDB_COMPRESSION_CODEC;
+    server.rdb_compress_chunks = CONFIG_DEFAULT_RDB_COMPRESS_CHUNKS;
     server.rdb_checksum = CONFIG_DEFAULT_RDB_CHECKSUM;
+    server.rdb_load_threads = CONFIG_DEFAULT_RDB_LOAD_THREADS;
+    server.rdb_save_threads = CONFIG_DEFAULT_RDB_SAVE_THREADS;
+    server.rdb_load_mmap = CONFIG_DEFAULT_RDB_LOAD_MMAP;
+    server.lazy_loading = CONFIG_DEFAULT_LAZY_LOADING;
+    server.rdb_save_forkless = CONFIG_DEFAULT_RDB_SAVE_FORKLESS;
+    server.rdb_save_bypass_cache = CONFIG_DEFAULT_RDB_SAVE_BYPASS_CACHE;
     server.stop_writes_on_bgsave_err = CONFIG_DEFAULT_STOP_WRITES_ON_BGSAVE_ERROR;
     server.activerehashing = CONFIG_DEFAULT_ACTIVE_REHASHING;
+    server.active_rehashing_budget_us = CONFIG_DEFAULT_ACTIVE_REHASHING_BUDGET_US;
+    server.busy_poll_us = CONFIG_DEFAULT_BUSY_POLL_US;
+    server.busy_poll_max_cpu = CONFIG_DEFAULT_BUSY_POLL_MAX_CPU;
+    server.busy_poll_socket_us = CONFIG_DEFAULT_BUSY_POLL_SOCKET_US;
+    server.maxmemory_headroom = CONFIG_DEFAULT_MAXMEMORY_HEADROOM;
+    server.maxmemory_headroom_budget_us = CONFIG_DEFAULT_MAXMEMORY_HEADROOM_BUDGET_US;
+    server.tiering = CONFIG_DEFAULT_TIERING;
+    server.tiering_dir = zstrdup(CONFIG_DEFAULT_TIERING_DIR);
+    server.tiering_max_size = CONFIG_DEFAULT_TIERING_MAX_SIZE;
+    server.hash_function = CONFIG_DEFAULT_HASH_FUNCTION;
     server.active_defrag_running = 0;
     server.notify_keyspace_events = 0;
     server.maxclients = CONFIG_DEFAULT_MAX_CLIENTS;
@@ -1423,28 +1900,60 @@ void initServerConfig() {
     server.hash_max_ziplist_value = OBJ_HASH_MAX_ZIPLIST_VALUE;
     server.list_max_ziplist_size = OBJ_LIST_MAX_ZIPLIST_SIZE;
     server.list_compress_depth = OBJ_LIST_COMPRESS_DEPTH;
+    server.list_node_container = OBJ_LIST_NODE_CONTAINER;
+    server.list_node_container_conversion = OBJ_LIST_NODE_CONTAINER_CONVERSION;
+    server.list_conversion_pending = 0;
+    server.list_conversion_db = 0;
+    server.list_conversion_cursor = 0;
     server.set_max_intset_entries = OBJ_SET_MAX_INTSET_ENTRIES;
     server.zset_max_ziplist_entries = OBJ_ZSET_MAX_ZIPLIST_ENTRIES;
     server.zset_max_ziplist_value = OBJ_ZSET_MAX_ZIPLIST_VALUE;
+    server.zset_max_skiplist_entries = OBJ_ZSET_MAX_SKIPLIST_ENTRIES;
+    server.adaptive_encoding_hot_counter = CONFIG_DEFAULT_ADAPTIVE_ENCODING_HOT_COUNTER;
+    server.adaptive_encoding_cold_seconds = CONFIG_DEFAULT_ADAPTIVE_ENCODING_COLD_SECONDS;
+    server.adaptive_encoding_db = 0;
+    server.adaptive_encoding_cursor = 0;
+    server.stream_node_max_bytes = OBJ_STREAM_NODE_MAX_BYTES;
+    server.stream_node_max_entries = OBJ_STREAM_NODE_MAX_ENTRIES;
     server.hll_sparse_max_bytes = CONFIG_DEFAULT_HLL_SPARSE_MAX_BYTES;
+    server.bitmap_chunked_min_bytes = CONFIG_DEFAULT_BITMAP_CHUNKED_MIN_BYTES;
+    server.string_compression_min_bytes = CONFIG_DEFAULT_STRING_COMPRESSION_MIN_BYTES;
+    server.set_algebra_threads = CONFIG_DEFAULT_SET_ALGEBRA_THREADS;
+    server.set_algebra_parallel_threshold = CONFIG_DEFAULT_SET_ALGEBRA_PARALLEL_THRESHOLD;
     server.shutdown_asap = 0;
     server.cluster_enabled = 0;
     server.cluster_node_timeout = CLUSTER_DEFAULT_NODE_TIMEOUT;
     server.cluster_migration_barrier = CLUSTER_DEFAULT_MIGRATION_BARRIER;
+    server.cluster_migrate_inflight_bytes = CLUSTER_DEFAULT_MIGRATE_INFLIGHT_BYTES;
     server.cluster_slave_validity_factor = CLUSTER_DEFAULT_SLAVE_VALIDITY;
     server.cluster_require_full_coverage = CLUSTER_DEFAULT_REQUIRE_FULL_COVERAGE;
+    server.cluster_bus_compact = CLUSTER_DEFAULT_BUS_COMPACT;
     server.cluster_configfile = zstrdup(CONFIG_DEFAULT_CLUSTER_CONFIG_FILE);
     server.cluster_announce_ip = CONFIG_DEFAULT_CLUSTER_ANNOUNCE_IP;
     server.cluster_announce_port = CONFIG_DEFAULT_CLUSTER_ANNOUNCE_PORT;
     server.cluster_announce_bus_port = CONFIG_DEFAULT_CLUSTER_ANNOUNCE_BUS_PORT;
     server.migrate_cached_sockets = dictCreate(&migrateCacheDictType,NULL);
+    server.migrate_slot_jobs = listCreate();
+    server.keys_jobs = listCreate();
+    server.keys_jobs_timer = -1;
+    server.keys_job_threshold = CONFIG_DEFAULT_KEYS_JOB_THRESHOLD;
+    server.bgread_jobs = listCreate();
+    server.bgread_pinned = 0;
+    server.bgread_threshold = CONFIG_DEFAULT_BGREAD_THRESHOLD;
+    server.reply_stream_threshold = CONFIG_DEFAULT_REPLY_STREAM_THRESHOLD;
     server.next_client_id = 1; /* Client IDs, start from 1 .*/
     server.loading_process_events_interval_bytes = (1024*1024*2);
     server.lazyfree_lazy_eviction = CONFIG_DEFAULT_LAZYFREE_LAZY_EVICTION;
     server.lazyfree_lazy_expire = CONFIG_DEFAULT_LAZYFREE_LAZY_EXPIRE;
     server.lazyfree_lazy_server_del = CONFIG_DEFAULT_LAZYFREE_LAZY_SERVER_DEL;
+    server.lazyfree_threads = CONFIG_DEFAULT_LAZYFREE_THREADS;
+    server.lazyfree_auto_threshold = CONFIG_DEFAULT_LAZYFREE_AUTO_THRESHOLD;
+    server.active_expire_index = CONFIG_DEFAULT_ACTIVE_EXPIRE_INDEX;
+    server.keyspace_index = CONFIG_DEFAULT_KEYSPACE_INDEX;
     server.always_show_logo = CONFIG_DEFAULT_ALWAYS_SHOW_LOGO;
     server.lua_time_limit = LUA_SCRIPT_TIME_LIMIT;
+    server.lua_parallel_scripts = CONFIG_DEFAULT_LUA_PARALLEL_SCRIPTS;
+    server.lua_scripts_epoch = 0;
 
     unsigned int lruclock = getLRUClock();
     atomicSet(server.lruclock,lruclock);
@@ -1466,10 +1975,24 @@ void initServerConfig() {
     server.repl_serve_stale_data = CONFIG_DEFAULT_SLAVE_SERVE_STALE_DATA;
     server.repl_slave_ro = CONFIG_DEFAULT_SLAVE_READ_ONLY;
     server.repl_slave_lazy_flush = CONFIG_DEFAULT_SLAVE_LAZY_FLUSH;
+    server.slave_fast_ack = CONFIG_DEFAULT_SLAVE_FAST_ACK;
+    server.repl_async_load = CONFIG_DEFAULT_REPL_ASYNC_LOAD;
+    server.repl_diskless_load = CONFIG_DEFAULT_REPL_DISKLESS_LOAD;
     server.repl_down_since = 0; /* Never connected, repl is down since EVER. */
     server.repl_disable_tcp_nodelay = CONFIG_DEFAULT_REPL_DISABLE_TCP_NODELAY;
     server.repl_diskless_sync = CONFIG_DEFAULT_REPL_DISKLESS_SYNC;
     server.repl_diskless_sync_delay = CONFIG_DEFAULT_REPL_DISKLESS_SYNC_DELAY;
+    server.repl_compression = CONFIG_DEFAULT_REPL_COMPRESSION;
+    server.repl_compress_buf = sdsempty();
+    server.repl_compress_slaves = 0;
+    server.repl_buffer = replBufferCreate();
+    server.repl_compress_buffer = replBufferCreate();
+    server.master_compress = 0;
+    server.repl_diskless_resume_window = CONFIG_DEFAULT_REPL_DISKLESS_RESUME_WINDOW;
+    server.repl_spool_file = NULL;
+    server.repl_spool_size = -1;
+    server.repl_transfer_resumable = 0;
+    server.repl_resume_tmpfile = NULL;
     server.repl_ping_slave_period = CONFIG_DEFAULT_REPL_PING_SLAVE_PERIOD;
     server.repl_timeout = CONFIG_DEFAULT_REPL_TIMEOUT;
     server.repl_min_slaves_to_write = CONFIG_DEFAULT_MIN_SLAVES_TO_WRITE;
@@ -1485,6 +2008,10 @@ void initServerConfig() {
     server.repl_backlog_histlen = 0;
     server.repl_backlog_idx = 0;
     server.repl_backlog_off = 0;
+    server.repl_backlog_disk_size = CONFIG_DEFAULT_REPL_BACKLOG_DISK_SIZE;
+    server.repl_backlog_segments = listCreate();
+    server.repl_backlog_disk_off = 0;
+    server.repl_backlog_disk_histlen = 0;
     server.repl_backlog_time_limit = CONFIG_DEFAULT_REPL_BACKLOG_TIME_LIMIT;
     server.repl_no_slaves_since = time(NULL);
 
@@ -1509,14 +2036,30 @@ void initServerConfig() {
     server.lpushCommand = lookupCommandByCString("lpush");
     server.lpopCommand = lookupCommandByCString("lpop");
     server.rpopCommand = lookupCommandByCString("rpop");
+    server.ltrimCommand = lookupCommandByCString("ltrim");
+    server.xclaimCommand = lookupCommandByCString("xclaim");
+    server.xgroupCommand = lookupCommandByCString("xgroup");
     server.sremCommand = lookupCommandByCString("srem");
     server.execCommand = lookupCommandByCString("exec");
     server.expireCommand = lookupCommandByCString("expire");
     server.pexpireCommand = lookupCommandByCString("pexpire");
+    server.hdelCommand = lookupCommandByCString("hdel");
 
     /* Slow log */
     server.slowlog_log_slower_than = CONFIG_DEFAULT_SLOWLOG_LOG_SLOWER_THAN;
     server.slowlog_max_len = CONFIG_DEFAULT_SLOWLOG_MAX_LEN;
+    server.hotkeys = NULL;
+    server.hotkeys_top_k = CONFIG_DEFAULT_HOTKEYS_TOP_K;
+    server.tracer = NULL;
+    server.trace_sample_rate = CONFIG_DEFAULT_TRACE_SAMPLE_RATE;
+    server.trace_max_len = CONFIG_DEFAULT_TRACE_MAX_LEN;
+    server.memprefix = NULL;
+    server.memory_prefixes_scan_keys = CONFIG_DEFAULT_MEMORY_PREFIXES_SCAN_KEYS;
+    server.memory_prefixes_delimiter = zstrdup(CONFIG_DEFAULT_MEMORY_PREFIXES_DELIMITER);
+    server.allocprof = NULL;
+    server.alloc_profiler = CONFIG_DEFAULT_ALLOC_PROFILER;
+    server.tracking_clients = 0;
+    server.tracking_table_max_keys = CONFIG_DEFAULT_TRACKING_TABLE_MAX_KEYS;
 
     /* Latency monitor */
     server.latency_monitor_threshold = CONFIG_DEFAULT_LATENCY_MONITOR_THRESHOLD;
@@ -1543,11 +2086,14 @@ extern char **environ;
  * RESTART_SERVER_NONE              No flags.
  * RESTART_SERVER_GRACEFULLY        Do a proper shutdown before restarting.
  * RESTART_SERVER_CONFIG_REWRITE    Rewrite the config file before restarting.
+ * RESTART_SERVER_HANDOFF           Hand the dataset over to the new process
+ *                                  instead of saving it, see handoff.cpp.
  *
  * On success the function does not return, because the process turns into
  * a different process. On error C_ERR is returned. */
 int restartServer(int flags, mstime_t delay) {
-    int j;
+    int j, handoff_fd = -1;
+    pid_t handoff_pid = -1;
 
     /* Check if we still have accesses to the executable that started this
      * server instance. */
@@ -1567,20 +2113,40 @@ int restartServer(int flags, mstime_t delay) {
         return C_ERR;
     }
 
+    /* Start the child handing the dataset over, that is not saved then. */
+    if (flags & RESTART_SERVER_HANDOFF &&
+        (handoff_fd = handoffStart(&handoff_pid)) == -1)
+    {
+        serverLog(LL_WARNING,"Can't restart: error starting the handoff");
+        return C_ERR;
+    }
+
     /* Perform a proper shutdown. */
     if (flags & RESTART_SERVER_GRACEFULLY &&
-        prepareForShutdown((int)SHUTDOWN_NOFLAGS) != C_OK)
+        prepareForShutdown(handoff_fd != -1 ? SHUTDOWN_NOSAVE :
+                                              SHUTDOWN_NOFLAGS) != C_OK)
     {
         serverLog(LL_WARNING,"Can't restart: error preparing for shutdown");
+        if (handoff_fd != -1) {
+            kill(handoff_pid,SIGKILL);
+            waitpid(handoff_pid,NULL,0);
+            close(handoff_fd);
+        }
         return C_ERR;
     }
 
     /* Close all file descriptors, with the exception of stdin, stdout, strerr
-     * which are useful if we restart a Redis server which is not daemonized. */
+     * which are useful if we restart a Redis server which is not daemonized,
+     * and of the handoff pipe. */
     for (j = 3; j < (int)server.maxclients + 1024; j++) {
         /* Test the descriptor validity before closing it, otherwise
          * Valgrind issues a warning on close(). */
-        if (fcntl(j,F_GETFD) != -1) close(j);
+        if (j != handoff_fd && fcntl(j,F_GETFD) != -1) close(j);
+    }
+    if (handoff_fd != -1) {
+        char handoff[64];
+        snprintf(handoff,sizeof(handoff),"%d:%ld",handoff_fd,(long)handoff_pid);
+        setenv(HANDOFF_ENV,handoff,1);
     }
 
     /* Execute the server with the original command line. */
@@ -1698,8 +2264,12 @@ void checkTcpBacklogSettings() {
 /* Initialize a set of file descriptors to listen to the specified 'port'
  * binding the addresses specified in the Redis server configuration.
  *
- * The listening file descriptors are stored in the integer array 'fds'
- * and their number is set in '*count'.
+ * The listening file descriptors are appended to the integer array 'fds'
+ * and '*count' is incremented accordingly.
+ *
+ * If 'reuseport' is true the sockets are created with SO_REUSEPORT, so
+ * that the function can be called again to open more listeners on the
+ * same addresses.
  *
  * The addresses to bind are specified in the global server.bindaddr array
  * and their number is server.bindaddr_count. If the server configuration
@@ -1713,8 +2283,12 @@ void checkTcpBacklogSettings() {
  * impossible to bind, or no bind addresses were specified in the server
  * configuration but the function is not able to bind * for at least
  * one of the IPv4 or IPv6 protocols. */
-int listenToPort(int port, int *fds, int *count) {
-    int j;
+int listenToPort(int port, int *fds, int *count, int reuseport) {
+    int j, start = *count;
+    int (*tcpServer)(char*,int,char*,int) =
+        reuseport ? anetTcpReusePortServer : anetTcpServer;
+    int (*tcp6Server)(char*,int,char*,int) =
+        reuseport ? anetTcp6ReusePortServer : anetTcp6Server;
 
     /* Force binding of 0.0.0.0 if no bind address is specified, always
      * entering the loop if j == 0. */
@@ -1724,7 +2298,7 @@ int listenToPort(int port, int *fds, int *count) {
             int unsupported = 0;
             /* Bind * for both IPv6 and IPv4, we enter here only if
              * server.bindaddr_count == 0. */
-            fds[*count] = anetTcp6Server(server.neterr,port,NULL,
+            fds[*count] = tcp6Server(server.neterr,port,NULL,
                 server.tcp_backlog);
             if (fds[*count] != ANET_ERR) {
                 anetNonBlock(NULL,fds[*count]);
@@ -1734,9 +2308,9 @@ int listenToPort(int port, int *fds, int *count) {
                 serverLog(LL_WARNING,"Not listening to IPv6: unsupproted");
             }
 
-            if (*count == 1 || unsupported) {
+            if (*count == start+1 || unsupported) {
                 /* Bind the IPv4 address as well. */
-                fds[*count] = anetTcpServer(server.neterr,port,NULL,
+                fds[*count] = tcpServer(server.neterr,port,NULL,
                     server.tcp_backlog);
                 if (fds[*count] != ANET_ERR) {
                     anetNonBlock(NULL,fds[*count]);
@@ -1749,14 +2323,14 @@ int listenToPort(int port, int *fds, int *count) {
             /* Exit the loop if we were able to bind * on IPv4 and IPv6,
              * otherwise fds[*count] will be ANET_ERR and we'll print an
              * error and return to the caller with an error. */
-            if (*count + unsupported == 2) break;
+            if (*count - start + unsupported == 2) break;
         } else if (strchr(server.bindaddr[j],':')) {
             /* Bind IPv6 address. */
-            fds[*count] = anetTcp6Server(server.neterr,port,server.bindaddr[j],
+            fds[*count] = tcp6Server(server.neterr,port,server.bindaddr[j],
                 server.tcp_backlog);
         } else {
             /* Bind IPv4 address. */
-            fds[*count] = anetTcpServer(server.neterr,port,server.bindaddr[j],
+            fds[*count] = tcpServer(server.neterr,port,server.bindaddr[j],
                 server.tcp_backlog);
         }
         if (fds[*count] == ANET_ERR) {
@@ -1781,19 +2355,30 @@ void resetServerStats() {
     server.stat_numcommands = 0;
     server.stat_numconnections = 0;
     server.stat_expiredkeys = 0;
+    server.stat_expired_fields = 0;
+    server.stat_expire_cycle_time_cap_reached = 0;
     server.stat_evictedkeys = 0;
+    server.stat_evictedkeys_ahead = 0;
+    server.stat_bgread_jobs = 0;
+    server.stat_bgread_waits = 0;
+    server.stat_streamed_replies = 0;
     server.stat_keyspace_misses = 0;
     server.stat_keyspace_hits = 0;
     server.stat_active_defrag_hits = 0;
     server.stat_active_defrag_misses = 0;
     server.stat_active_defrag_key_hits = 0;
     server.stat_active_defrag_key_misses = 0;
+    memset(server.stat_active_defrag_type_hits,0,sizeof(server.stat_active_defrag_type_hits));
     server.stat_fork_time = 0;
     server.stat_fork_rate = 0;
     server.stat_rejected_conn = 0;
     server.stat_sync_full = 0;
     server.stat_sync_partial_ok = 0;
+    server.stat_sync_resume_ok = 0;
+    server.stat_repl_compress_in = 0;
+    server.stat_repl_compress_out = 0;
     server.stat_sync_partial_err = 0;
+    memset(server.el_phase,0,sizeof(server.el_phase));
     for (j = 0; j < STATS_METRIC_COUNT; j++) {
         server.inst_metric[j].idx = 0;
         server.inst_metric[j].last_sample_time = mstime();
@@ -1803,6 +2388,18 @@ void resetServerStats() {
     }
     server.stat_net_input_bytes = 0;
     server.stat_net_output_bytes = 0;
+    server.stat_cluster_bus_input_bytes = 0;
+    server.stat_cluster_bus_output_bytes = 0;
+    lazyfreeResetStats();
+    server.stat_io_reads_processed = 0;
+    server.stat_io_writes_processed = 0;
+    server.stat_io_commands_processed = 0;
+    resetIOThreadsCommands();
+    server.stat_writev_calls = 0;
+    server.stat_writev_iovecs = 0;
+    server.stat_writev_bytes = 0;
+    server.stat_qbuf_pool_hits = 0;
+    server.stat_qbuf_pool_misses = 0;
     server.aof_delayed_fsync = 0;
 }
 
@@ -1821,15 +2418,25 @@ void initServer() {
     server.pid = getpid();
     server.current_client = NULL;
     server.clients = listCreate();
+    server.clients_index = raxNew();
     server.clients_to_close = listCreate();
     server.slaves = listCreate();
     server.monitors = listCreate();
     server.clients_pending_write = listCreate();
+    server.clients_waiting_aof = listCreate();
+    server.clients_pending_read = listCreate();
     server.slaveseldb = -1; /* Force to emit the first SELECT command. */
+    redisOpArrayInit(&server.exec_propagate);
+    server.exec_propagate_batch = 0;
     server.unblocked_clients = listCreate();
+    server.clients_timeout_table = raxNew();
+    server.clients_timeout_timer = -1;
+    server.clients_timeout_when = 0;
     server.ready_keys = listCreate();
-    server.clients_waiting_acks = listCreate();
+    server.clients_waiting_acks = raxNew();
     server.get_ack_from_slaves = 0;
+    server.slaves_acks_changed = 0;
+    server.repl_ack_sent_off = -1;
     server.clients_paused = 0;
     server.system_memory_size = zmalloc_get_memory_size();
 
@@ -1842,11 +2449,22 @@ void initServer() {
             strerror(errno));
         exit(1);
     }
+    server.el->aeSetBusyPoll(server.busy_poll_us,server.busy_poll_max_cpu);
     server.db = (redisDb *)zmalloc(sizeof(redisDb)*server.dbnum);
 
-    /* Open the TCP listening socket for the user commands. */
-    if (server.port != 0 &&
-        listenToPort(server.port,server.ipfd,&server.ipfd_count) == C_ERR)
+    /* Open the TCP listening socket for the user commands. With more than
+     * one listener per address every socket is opened with SO_REUSEPORT. */
+    if (server.port != 0) {
+        for (j = 0; j < server.tcp_listeners; j++) {
+            if (listenToPort(server.port,server.ipfd,&server.ipfd_count,
+                             server.tcp_listeners > 1) == C_ERR)
+                exit(1);
+        }
+    }
+
+    /* Open the TLS listening socket for the user commands. */
+    if (server.tls_port != 0 &&
+        listenToPort(server.tls_port,server.tlsfd,&server.tlsfd_count,0) == C_ERR)
         exit(1);
 
     /* Open the listening Unix domain socket. */
@@ -1862,7 +2480,7 @@ void initServer() {
     }
 
     /* Abort if there are no listening sockets at all. */
-    if (server.ipfd_count == 0 && server.sofd < 0) {
+    if (server.ipfd_count == 0 && server.tlsfd_count == 0 && server.sofd < 0) {
         serverLog(LL_WARNING, "Configured to not listen anywhere, exiting.");
         exit(1);
     }
@@ -1871,13 +2489,19 @@ void initServer() {
     for (j = 0; j < server.dbnum; j++) {
         new (server.db + j) redisDb(j);
     }
+    expireIndexInit();
+    keyIndexInit();
     evictionPoolAlloc(); /* Initialize the LRU keys pool. */
     server.pubsub_channels = dictCreate(&keylistDictType,NULL);
+    server.pubsubshard_channels = dictCreate(&keylistDictType,NULL);
     server.pubsub_patterns = listCreate();
     server.pubsub_patterns->listSetFreeMethod(freePubsubPattern);
     server.pubsub_patterns->listSetMatchMethod(listMatchPubsubPattern);
+    server.pubsub_patterns_index = raxNew();
+    server.pubsub_keyspace_subscriptions = 0;
     server.cronloops = 0;
     server.rdb_child_pid = -1;
+    server.rdb_snapshot = NULL;
     server.aof_child_pid = -1;
     server.rdb_child_type = RDB_CHILD_TYPE_NONE;
     server.rdb_bgsave_scheduled = 0;
@@ -1895,8 +2519,13 @@ void initServer() {
     /* A few stats we don't want to reset: server startup time, and peak mem. */
     server.stat_starttime = time(NULL);
     server.stat_peak_memory = 0;
+    server.stat_clients_normal_memory = 0;
+    server.metrics_fd = -1;
     server.stat_rdb_cow_bytes = 0;
     server.stat_aof_cow_bytes = 0;
+    server.stat_current_cow_bytes = 0;
+    server.stat_current_cow_updated = 0;
+    memset(server.stat_cow_writes,0,sizeof(server.stat_cow_writes));
     server.resident_set_size = 0;
     server.lastbgsave_status = C_OK;
     server.aof_last_write_status = C_OK;
@@ -1913,8 +2542,10 @@ void initServer() {
     }
 
     /* Create an event handler for accepting new connections in TCP and Unix
-     * domain sockets. */
-    for (j = 0; j < server.ipfd_count; j++) {
+     * domain sockets. When multiple TCP listeners are configured they are
+     * served by dedicated accept threads instead. */
+    if (server.tcp_listeners > 1) initAcceptThreads();
+    else for (j = 0; j < server.ipfd_count; j++) {
         if (server.el->aeCreateFileEvent(server.ipfd[j], AE_READABLE,
             acceptTcpHandler,NULL) == AE_ERR)
             {
@@ -1925,6 +2556,20 @@ void initServer() {
     if (server.sofd > 0 && server.el->aeCreateFileEvent(server.sofd,AE_READABLE,
         acceptUnixHandler,NULL) == AE_ERR) serverPanic("Unrecoverable error creating server.sofd file event.");
 
+    /* TLS connections are accepted by the main thread, the handshake is
+     * then performed by the TLS handshake threads. */
+    if (server.tls_port || server.tls_replication || server.tls_cluster) {
+        if (tlsInit() == C_ERR) exit(1);
+    }
+    for (j = 0; j < server.tlsfd_count; j++) {
+        if (server.el->aeCreateFileEvent(server.tlsfd[j], AE_READABLE,
+            acceptTLSHandler,NULL) == AE_ERR)
+            {
+                serverPanic(
+                    "Unrecoverable error creating server.tlsfd file event.");
+            }
+    }
+
 
     /* Register a readable event for the pipe used to awake the event loop
      * when a blocked client in a module needs attention. */
@@ -1936,7 +2581,9 @@ void initServer() {
     }
 
     /* Open the AOF file if needed. */
-    if (server.aof_state == AOF_ON) {
+    if (server.aof_state == AOF_ON && server.aof_multi_part) {
+        aofOpenOnStartup();
+    } else if (server.aof_state == AOF_ON) {
         server.aof_fd = open(server.aof_filename,
                                O_WRONLY|O_APPEND|O_CREAT,0644);
         if (server.aof_fd == -1) {
@@ -1960,8 +2607,16 @@ void initServer() {
     replicationScriptCacheInit();
     scriptingInit(1);
     slowlogInit();
+    hotkeysInit();
+    traceInit();
+    memPrefixInit(0);
+    allocStatsInit();
+    buildCommandLookupTable();
     latencyMonitorInit();
+    metricsInit();
     bioInit();
+    dictSetFreeTableCallback(lazyfreeFreeTable,LAZYFREE_TABLE_MIN_BYTES);
+    initThreadedIO();
     server.initial_memory_usage = zmalloc_used_memory();
 }
 
@@ -1991,6 +2646,8 @@ void populateCommandTable() {
             case 'M': c->m_flags |= CMD_SKIP_MONITOR; break;
             case 'k': c->m_flags |= CMD_ASKING; break;
             case 'F': c->m_flags |= CMD_FAST; break;
+            case 'B': c->m_flags |= CMD_BITMAP; break;
+            case 'Z': c->m_flags |= CMD_COMPRESSED; break;
             default: serverPanic("Unsupported command flag"); break;
             }
             f++;
@@ -2012,6 +2669,10 @@ void resetCommandTableStats() {
         c = (struct redisCommand *) de->dictGetVal();
         c->microseconds = 0;
         c->calls = 0;
+        if (c->latency_hist) {
+            zfree(c->latency_hist);
+            c->latency_hist = NULL;
+        }
     }
 }
 
@@ -2054,10 +2715,187 @@ void redisOpArrayFree(redisOpArray *oa) {
 
 /* ====================== Commands lookup and execution ===================== */
 
+/* Perfect hash table of the commands, used by lookupCommand() before
+ * falling back to the server.commands dictionary.
+ *
+ * The table is built by buildCommandLookupTable() once the configuration
+ * was loaded, from the content of server.commands, so that commands renamed
+ * with rename-command are found under their new name only. Commands added
+ * later, like the ones registered by modules, are not in the table and are
+ * found in the dictionary.
+ *
+ * We use the "hash and displace" scheme: the names are first hashed into a
+ * small number of groups, then for every group we search a seed that, used
+ * for a second hash, places all its names in free slots of the table. A
+ * lookup costs two hash computations and a single case insensitive compare,
+ * with no collisions to resolve. */
+typedef struct commandLookupSlot {
+    const char *name;
+    size_t len;
+    struct redisCommand *cmd;
+} commandLookupSlot;
+
+static commandLookupSlot *commandLookupTable = NULL;
+static unsigned long commandLookupMask = 0;
+static uint32_t *commandLookupSeeds = NULL;
+static unsigned long commandLookupGroupsMask = 0;
+
+/* FNV-1a on the name folded to lower case. Non letters may be folded to
+ * other characters as well, which is harmless since we only need the same
+ * hash for names that are equal ignoring case. */
+static inline unsigned long commandLookupHash(const char *name, size_t len,
+                                              uint32_t seed) {
+    uint32_t h = 2166136261U ^ (seed * 0x9e3779b9U);
+    size_t j;
+
+    for (j = 0; j < len; j++) {
+        h ^= (unsigned char)name[j] | 0x20;
+        h *= 16777619U;
+    }
+    return h ^ (h >> 15);
+}
+
+/* Try to place all the names of 'group' using 'seed', on success the slots
+ * are filled and 1 is returned, otherwise the table is left untouched. */
+static int commandLookupPlaceGroup(commandLookupSlot *table, unsigned long mask,
+                                   dictEntry **group, int count, uint32_t seed) {
+    unsigned long *idx = (unsigned long *)zmalloc(sizeof(unsigned long)*count);
+    int j, k, placed = 0;
+
+    for (j = 0; j < count; j++) {
+        sds name = (sds)group[j]->dictGetKey();
+        idx[j] = commandLookupHash(name,sdslen(name),seed) & mask;
+        if (table[idx[j]].cmd) goto cleanup;
+        for (k = 0; k < j; k++) if (idx[k] == idx[j]) goto cleanup;
+    }
+    for (j = 0; j < count; j++) {
+        sds name = (sds)group[j]->dictGetKey();
+        table[idx[j]].name = name;
+        table[idx[j]].len = sdslen(name);
+        table[idx[j]].cmd = (struct redisCommand *)group[j]->dictGetVal();
+    }
+    placed = 1;
+
+cleanup:
+    zfree(idx);
+    return placed;
+}
+
+void buildCommandLookupTable(void) {
+    unsigned long numcommands = server.commands->dictSize();
+    unsigned long size = 1, numgroups = 1, j;
+    dictEntry **entries, *de;
+    unsigned long *groupof, *order;
+    int *groupsize;
+
+    zfree(commandLookupTable);
+    zfree(commandLookupSeeds);
+    commandLookupTable = NULL;
+    commandLookupSeeds = NULL;
+    if (numcommands == 0) return;
+
+    while (size < numcommands*2) size <<= 1;
+    while (numgroups < numcommands/2) numgroups <<= 1;
+
+    /* Split the names into groups. */
+    entries = (dictEntry **)zmalloc(sizeof(dictEntry*)*numcommands);
+    groupof = (unsigned long *)zmalloc(sizeof(unsigned long)*numcommands);
+    groupsize = (int *)zcalloc(sizeof(int)*numgroups);
+    j = 0;
+    {
+        dictIterator di(server.commands);
+        while ((de = di.dictNext()) != NULL) {
+            sds name = (sds)de->dictGetKey();
+            entries[j] = de;
+            groupof[j] = commandLookupHash(name,sdslen(name),0) & (numgroups-1);
+            groupsize[groupof[j]]++;
+            j++;
+        }
+    }
+
+    /* Place the biggest groups first, when the table is still empty. */
+    order = (unsigned long *)zmalloc(sizeof(unsigned long)*numgroups);
+    for (j = 0; j < numgroups; j++) order[j] = j;
+    for (j = 1; j < numgroups; j++) {
+        unsigned long g = order[j], k = j;
+        while (k > 0 && groupsize[order[k-1]] < groupsize[g]) {
+            order[k] = order[k-1];
+            k--;
+        }
+        order[k] = g;
+    }
+
+    while (commandLookupTable == NULL) {
+        commandLookupSlot *table = (commandLookupSlot *)zcalloc(sizeof(commandLookupSlot)*size);
+        uint32_t *seeds = (uint32_t *)zcalloc(sizeof(uint32_t)*numgroups);
+        dictEntry **group = (dictEntry **)zmalloc(sizeof(dictEntry*)*numcommands);
+        unsigned long g;
+
+        for (g = 0; g < numgroups; g++) {
+            unsigned long grp = order[g];
+            int count = 0;
+            uint32_t seed;
+
+            if (groupsize[grp] == 0) break;
+            for (j = 0; j < numcommands; j++)
+                if (groupof[j] == grp) group[count++] = entries[j];
+            for (seed = 1; seed < 100000; seed++)
+                if (commandLookupPlaceGroup(table,size-1,group,count,seed)) break;
+            if (seed == 100000) break;
+            seeds[grp] = seed;
+        }
+        zfree(group);
+        if (g < numgroups && groupsize[order[g]] != 0) {
+            /* A group could not be placed: retry with a bigger table. */
+            zfree(table);
+            zfree(seeds);
+            size <<= 1;
+            continue;
+        }
+        commandLookupTable = table;
+        commandLookupMask = size-1;
+        commandLookupSeeds = seeds;
+        commandLookupGroupsMask = numgroups-1;
+    }
+    zfree(entries);
+    zfree(groupof);
+    zfree(groupsize);
+    zfree(order);
+}
+
+/* Lookup the command named by the 'len' bytes at 'name' in the lookup
+ * table only, without the sds the command table dictionary needs: NULL
+ * is returned when the table was not built as well. */
+struct redisCommand *lookupCommandByBuffer(const char *name, size_t len) {
+    if (commandLookupTable) {
+        uint32_t seed = commandLookupSeeds[
+            commandLookupHash(name,len,0) & commandLookupGroupsMask];
+        commandLookupSlot *slot = commandLookupTable +
+            (commandLookupHash(name,len,seed) & commandLookupMask);
+
+        if (slot->cmd && slot->len == len && !strncasecmp(slot->name,name,len))
+            return slot->cmd;
+    }
+    return NULL;
+}
+
 struct redisCommand *lookupCommand(sds name) {
+    struct redisCommand *cmd = lookupCommandByBuffer(name,sdslen(name));
+
+    if (cmd) return cmd;
     return (struct redisCommand *)server.commands->dictFetchValue(name);
 }
 
+/* Like lookupCommand() but never touches the commands table, not even for
+ * an incremental rehashing step, so that it can be called from threads. */
+struct redisCommand *lookupCommandReadOnly(sds name) {
+    struct redisCommand *cmd = lookupCommandByBuffer(name,sdslen(name));
+
+    if (cmd) return cmd;
+    dictEntry *de = server.commands->dictFindReadOnly(name);
+    return de ? (struct redisCommand *)de->dictGetVal() : NULL;
+}
+
 struct redisCommand *lookupCommandByCString(char *s) {
     struct redisCommand *cmd;
     sds name = sdsnew(s);
@@ -2095,10 +2933,19 @@ struct redisCommand *lookupCommandOrOriginal(sds name) {
 void propagate(struct redisCommand *cmd, int dbid, robj **argv, int argc,
                int flags)
 {
-    if (server.aof_state != AOF_OFF && flags & PROPAGATE_AOF)
-        feedAppendOnlyFile(cmd,dbid,argv,argc);
-    if (flags & PROPAGATE_REPL)
-        replicationFeedSlaves(server.slaves,dbid,argv,argc);
+    if (server.exec_propagate_batch) {
+        int target = flags & PROPAGATE_REPL;
+
+        if (server.aof_state != AOF_OFF) target |= flags & PROPAGATE_AOF;
+        if (target) execPropagate(cmd,dbid,argv,argc,target);
+    } else {
+        if (server.aof_state != AOF_OFF && flags & PROPAGATE_AOF)
+            feedAppendOnlyFile(cmd,dbid,argv,argc);
+        if (flags & PROPAGATE_REPL)
+            replicationFeedSlaves(server.slaves,dbid,argv,argc);
+    }
+    if (flags & PROPAGATE_REPL && server.migrate_slot_jobs->listLength())
+        migrateSlotFeedCommand(cmd,dbid,argv,argc);
 }
 
 /* Used inside commands to schedule the propagation of additional commands
@@ -2194,6 +3041,8 @@ void preventCommandReplication(client *c) {
 void call(client *c, int flags) {
     long long dirty, start, duration;
     int client_old_flags = c->m_flags;
+    struct redisCommand *real_cmd = c->m_cmd;
+    long long reply_bytes = 0;
 
     /* Sent the command to clients in MONITOR mode, only if the commands are
      * not generated from reading an AOF. */
@@ -2210,11 +3059,22 @@ void call(client *c, int flags) {
     redisOpArray prev_also_propagate = server.also_propagate;
     redisOpArrayInit(&server.also_propagate);
 
-    /* Call the command. */
+    /* Sample the command for TRACE, measuring the reply it appends. */
+    int traced = (flags & CMD_CALL_SLOWLOG) && traceShouldSample();
+    if (traced) reply_bytes = c->m_reply_bytes + c->m_response_buff_pos;
+
+    /* Call the command. The temporary allocations it takes from the arena
+     * are released as soon as it returns. */
+    allocProfiler *ap = server.alloc_profiler ? server.allocprof : NULL;
+    size_t allocs = 0, alloc_bytes = 0;
+    zmallocTracker *prev_tracker = allocStatsStart(ap,&allocs,&alloc_bytes);
+    size_t arena_mark = zarena_mark();
     dirty = server.dirty;
     start = ustime();
     c->m_cmd->proc(c);
     duration = ustime()-start;
+    zarena_release(arena_mark);
+    allocStatsEnd(ap,prev_tracker,real_cmd,allocs,alloc_bytes);
     dirty = server.dirty-dirty;
     if (dirty < 0) dirty = 0;
 
@@ -2241,9 +3101,31 @@ void call(client *c, int flags) {
         latencyAddSampleIfNeeded(latency_event,duration/1000);
         slowlogPushEntryIfNeeded(c,c->m_argv,c->m_argc,duration);
     }
+    if (traced) {
+        reply_bytes = c->m_reply_bytes + c->m_response_buff_pos - reply_bytes;
+        tracePushEntry(c,real_cmd,duration,reply_bytes);
+    }
     if (flags & CMD_CALL_STATS) {
-        c->m_last_cmd->microseconds += duration;
-        c->m_last_cmd->calls++;
+        struct redisCommand *cmd = c->m_last_cmd;
+        cmd->microseconds += duration;
+        cmd->calls++;
+        if (cmd->latency_hist == NULL)
+            cmd->latency_hist = (struct latencyHistogram *)zcalloc(sizeof(struct latencyHistogram));
+        latencyHistogramAdd(cmd->latency_hist,duration);
+        /* The time of EXEC is already accounted by the queued commands. */
+        c->m_stat_commands++;
+        if (c->m_cmd->proc != execCommand) c->m_stat_cmd_usec += duration;
+    }
+
+    /* If the client has keys tracking enabled for client side caching,
+     * make sure to remember the keys it fetched, see tracking.cpp. When
+     * the command is called by a script the keys are the caller's ones. */
+    if (c->m_cmd->m_flags & CMD_READONLY) {
+        client *caller = (c->m_flags & CLIENT_LUA && server.lua_caller) ?
+                         server.lua_caller : c;
+        if ((caller->m_tracking_flags & (CLIENT_TRACKING|CLIENT_TRACKING_BCAST))
+            == CLIENT_TRACKING)
+            trackingRememberKeys(caller,c);
     }
 
     /* Propagate the command into the AOF and replication link */
@@ -2327,6 +3209,10 @@ int processCommand(client *c) {
         return C_ERR;
     }
 
+    /* Let the modules command filters inspect and rewrite the command
+     * before it is looked up. */
+    moduleCallCommandFilters(c);
+
     /* Now lookup the command and check ASAP about trivial error conditions
      * such as wrong arity, bad command name and so forth. */
     c->m_cmd = c->m_last_cmd = lookupCommand((sds)c->m_argv[0]->ptr);
@@ -2431,6 +3317,20 @@ int processCommand(client *c) {
         return C_OK;
     }
 
+    /* Loading a new dataset aside the served one? Only the read only
+     * commands can access the old data meanwhile. This is
+     * checked before the read only slave error, so that writes are told
+     * the slave is loading. */
+    if (server.async_loading &&
+        ((c->m_cmd->m_flags & CMD_WRITE) ||
+         !(c->m_cmd->m_flags & (CMD_READONLY|CMD_LOADING))) &&
+        c->m_cmd->proc != pingCommand)
+    {
+        flagTransaction(c);
+        c->addReply( shared.loadingerr);
+        return C_OK;
+    }
+
     /* Don't accept write commands if this is a read only slave. But
      * accept write commands if this is our master. */
     if (server.masterhost && server.repl_slave_ro &&
@@ -2447,8 +3347,10 @@ int processCommand(client *c) {
         c->m_cmd->proc != subscribeCommand &&
         c->m_cmd->proc != unsubscribeCommand &&
         c->m_cmd->proc != psubscribeCommand &&
-        c->m_cmd->proc != punsubscribeCommand) {
-        c->addReplyError("only (P)SUBSCRIBE / (P)UNSUBSCRIBE / PING / QUIT allowed in this context");
+        c->m_cmd->proc != punsubscribeCommand &&
+        c->m_cmd->proc != ssubscribeCommand &&
+        c->m_cmd->proc != sunsubscribeCommand) {
+        c->addReplyError("only (P|S)SUBSCRIBE / (P|S)UNSUBSCRIBE / PING / QUIT allowed in this context");
         return C_OK;
     }
 
@@ -2494,10 +3396,16 @@ int processCommand(client *c) {
         queueMultiCommand(c);
         c->addReply(shared.queued);
     } else {
+        /* Wait for the values in the tiering file without blocking the
+         * server: the command is executed again once they are loaded. */
+        if (tierBlockClientIfNeeded(c)) return C_OK;
+        /* Don't modify the values read in background, wait for the reads
+         * to complete instead. */
+        if (bgreadBlockClientIfNeeded(c)) return C_OK;
         call(c,CMD_CALL_FULL);
         c->m_last_write_global_replication_offset = server.master_repl_offset;
         if (server.ready_keys->listLength())
-            handleClientsBlockedOnLists();
+            handleClientsBlockedOnKeys();
     }
     return C_OK;
 }
@@ -2510,6 +3418,7 @@ void closeListeningSockets(int unlink_unix_socket) {
     int j;
 
     for (j = 0; j < server.ipfd_count; j++) close(server.ipfd[j]);
+    for (j = 0; j < server.tlsfd_count; j++) close(server.tlsfd[j]);
     if (server.sofd != -1) close(server.sofd);
     if (server.cluster_enabled)
         for (j = 0; j < server.cfd_count; j++) close(server.cfd[j]);
@@ -2536,6 +3445,7 @@ int prepareForShutdown(int flags) {
         kill(server.rdb_child_pid,SIGUSR1);
         rdbRemoveTempFile(server.rdb_child_pid);
     }
+    snapshotAbort("shutdown");
 
     if (server.aof_state != AOF_OFF) {
         /* Kill the AOF saving child as the AOF we already have may be longer
@@ -2574,6 +3484,11 @@ int prepareForShutdown(int flags) {
         }
     }
 
+    /* The cluster config is saved in the background: make sure the last
+     * version is on disk. */
+    if (server.cluster_enabled && clusterSaveConfig(1) == -1)
+        serverLog(LL_WARNING,"Error saving the cluster config on shutdown.");
+
     /* Remove the pid file if possible and needed. */
     if (server.daemonize || server.pidfile) {
         serverLog(LL_NOTICE,"Removing the pid file.");
@@ -2721,6 +3636,8 @@ void addReplyCommand(client *c, struct redisCommand *cmd) {
         flagcount += addReplyCommandFlag(c,cmd,CMD_SKIP_MONITOR, "skip_monitor");
         flagcount += addReplyCommandFlag(c,cmd,CMD_ASKING, "asking");
         flagcount += addReplyCommandFlag(c,cmd,CMD_FAST, "fast");
+        flagcount += addReplyCommandFlag(c,cmd,CMD_BITMAP, "bitmap");
+        flagcount += addReplyCommandFlag(c,cmd,CMD_COMPRESSED, "compressed");
         if ((cmd->getkeys_proc && !(cmd->m_flags & CMD_MODULE)) ||
             cmd->m_flags & CMD_MODULE_GETKEYS)
         {
@@ -2825,7 +3742,7 @@ sds genRedisInfoString(const char *section) {
 
     getrusage(RUSAGE_SELF, &self_ru);
     getrusage(RUSAGE_CHILDREN, &c_ru);
-    getClientsMaxBuffers(&lol,&bib);
+    getExpansiveClientsInfo(&lol,&bib);
 
     /* Server */
     if (allsections || defsections || !strcasecmp(section,"server")) {
@@ -2891,6 +3808,7 @@ sds genRedisInfoString(const char *section) {
             (unsigned long) lruclock,
             server.executable ? server.executable : "",
             server.configfile ? server.configfile : "");
+        info = genPlacementInfoString(info);
     }
 
     /* Clients */
@@ -2901,10 +3819,12 @@ sds genRedisInfoString(const char *section) {
             "connected_clients:%lu\r\n"
             "client_longest_output_list:%lu\r\n"
             "client_biggest_input_buf:%lu\r\n"
-            "blocked_clients:%d\r\n",
+            "blocked_clients:%d\r\n"
+            "tracking_clients:%llu\r\n",
             server.clients->listLength() - server.slaves->listLength(),
             lol, bib,
-            server.bpop_blocked_clients);
+            server.bpop_blocked_clients,
+            server.tracking_clients);
     }
 
     /* Memory */
@@ -2959,7 +3879,11 @@ sds genRedisInfoString(const char *section) {
             "mem_fragmentation_ratio:%.2f\r\n"
             "mem_allocator:%s\r\n"
             "active_defrag_running:%d\r\n"
-            "lazyfree_pending_objects:%zu\r\n",
+            "lazyfree_pending_objects:%zu\r\n"
+            "lazyfree_pending_jobs:%llu\r\n"
+            "lazyfree_threads:%d\r\n"
+            "qbuf_pool_hits:%lld\r\n"
+            "qbuf_pool_misses:%lld\r\n",
             zmalloc_used,
             hmem,
             server.resident_set_size,
@@ -2981,17 +3905,33 @@ sds genRedisInfoString(const char *section) {
             mh->fragmentation,
             ZMALLOC_LIB,
             server.active_defrag_running,
-            lazyfreeGetPendingObjectsCount()
+            lazyfreeGetPendingObjectsCount(),
+            bioPendingJobsOfType(BIO_LAZY_FREE),
+            server.lazyfree_threads,
+            server.stat_qbuf_pool_hits,
+            server.stat_qbuf_pool_misses
         );
+        info = genHugePagesInfoString(info);
+        size_t tr_allocated, tr_active, tr_resident;
+        zmalloc_transient_stats(&tr_allocated,&tr_active,&tr_resident);
+        info = sdscatprintf(info,
+            "transient_allocated:%zu\r\n"
+            "transient_active:%zu\r\n"
+            "transient_resident:%zu\r\n",
+            tr_allocated, tr_active, tr_resident);
+        info = genTierInfoString(info);
         freeMemoryOverheadData(mh);
     }
 
     /* Persistence */
     if (allsections || defsections || !strcasecmp(section,"persistence")) {
+        int child_active = server.rdb_child_pid != -1 ||
+                           server.aof_child_pid != -1;
         if (sections++) info = sdscat(info,"\r\n");
         info = sdscatprintf(info,
             "# Persistence\r\n"
             "loading:%d\r\n"
+            "async_loading:%d\r\n"
             "rdb_changes_since_last_save:%lld\r\n"
             "rdb_bgsave_in_progress:%d\r\n"
             "rdb_last_save_time:%jd\r\n"
@@ -3006,14 +3946,19 @@ sds genRedisInfoString(const char *section) {
             "aof_current_rewrite_time_sec:%jd\r\n"
             "aof_last_bgrewrite_status:%s\r\n"
             "aof_last_write_status:%s\r\n"
-            "aof_last_cow_size:%zu\r\n",
+            "aof_last_cow_size:%zu\r\n"
+            "current_cow_size:%zu\r\n"
+            "current_cow_size_age:%lld\r\n"
+            "cow_writes:string=%lld,list=%lld,set=%lld,zset=%lld,hash=%lld,"
+            "module=%lld,stream=%lld,deleted=%lld\r\n",
             server.loading,
+            server.async_loading,
             server.dirty,
-            server.rdb_child_pid != -1,
+            server.rdb_child_pid != -1 || server.rdb_snapshot != NULL,
             (intmax_t)server.lastsave,
             (server.lastbgsave_status == C_OK) ? "ok" : "err",
             (intmax_t)server.rdb_save_time_last,
-            (intmax_t)((server.rdb_child_pid == -1) ?
+            (intmax_t)((server.rdb_save_time_start == -1) ?
                 -1 : time(NULL)-server.rdb_save_time_start),
             server.stat_rdb_cow_bytes,
             server.aof_state != AOF_OFF,
@@ -3024,7 +3969,19 @@ sds genRedisInfoString(const char *section) {
                 -1 : time(NULL)-server.aof_rewrite_time_start),
             (server.aof_lastbgrewrite_status == C_OK) ? "ok" : "err",
             (server.aof_last_write_status == C_OK) ? "ok" : "err",
-            server.stat_aof_cow_bytes);
+            server.stat_aof_cow_bytes,
+            child_active ? server.stat_current_cow_bytes : 0,
+            (child_active && server.stat_current_cow_updated) ?
+                (long long)(mstime()-server.stat_current_cow_updated)/1000 : 0,
+            server.stat_cow_writes[OBJ_STRING],
+            server.stat_cow_writes[OBJ_LIST],
+            server.stat_cow_writes[OBJ_SET],
+            server.stat_cow_writes[OBJ_ZSET],
+            server.stat_cow_writes[OBJ_HASH],
+            server.stat_cow_writes[OBJ_MODULE],
+            server.stat_cow_writes[OBJ_STREAM],
+            server.stat_cow_writes[OBJ_STREAM+1]);
+        info = genLazyLoadInfoString(info);
 
         if (server.aof_state != AOF_OFF) {
             info = sdscatprintf(info,
@@ -3034,17 +3991,19 @@ sds genRedisInfoString(const char *section) {
                 "aof_buffer_length:%zu\r\n"
                 "aof_rewrite_buffer_length:%lu\r\n"
                 "aof_pending_bio_fsync:%llu\r\n"
-                "aof_delayed_fsync:%lu\r\n",
+                "aof_delayed_fsync:%lu\r\n"
+                "aof_group_commits:%lld\r\n",
                 (long long) server.aof_current_size,
                 (long long) server.aof_rewrite_base_size,
                 server.aof_rewrite_scheduled,
                 sdslen(server.aof_buf),
                 aofRewriteBufferSize(),
                 bioPendingJobsOfType(BIO_AOF_FSYNC),
-                server.aof_delayed_fsync);
+                server.aof_delayed_fsync,
+                aofGroupCommits());
         }
 
-        if (server.loading) {
+        if (server.loading || server.async_loading) {
             double perc;
             time_t eta, elapsed;
             off_t remaining_bytes = server.loading_total_bytes-
@@ -3078,6 +4037,10 @@ sds genRedisInfoString(const char *section) {
 
     /* Stats */
     if (allsections || defsections || !strcasecmp(section,"stats")) {
+        aeBusyPollStats bps;
+        sds io_commands = catIOThreadsCommands(sdsempty());
+
+        server.el->aeGetBusyPollStats(&bps);
         if (sections++) info = sdscat(info,"\r\n");
         info = sdscatprintf(info,
             "# Stats\r\n"
@@ -3091,20 +4054,53 @@ sds genRedisInfoString(const char *section) {
             "rejected_connections:%lld\r\n"
             "sync_full:%lld\r\n"
             "sync_partial_ok:%lld\r\n"
+            "sync_resume_ok:%lld\r\n"
+            "repl_compress_in_bytes:%lld\r\n"
+            "repl_compress_out_bytes:%lld\r\n"
             "sync_partial_err:%lld\r\n"
             "expired_keys:%lld\r\n"
+            "expired_fields:%lld\r\n"
+            "expired_stale_perc:%.2f\r\n"
+            "expire_cycle_cpu_perc:%.2f\r\n"
+            "expire_cycle_loop_lag_ms:%lld\r\n"
+            "expire_cycle_time_cap_reached_count:%lld\r\n"
             "evicted_keys:%lld\r\n"
+            "evicted_keys_ahead:%lld\r\n"
             "keyspace_hits:%lld\r\n"
             "keyspace_misses:%lld\r\n"
             "pubsub_channels:%ld\r\n"
             "pubsub_patterns:%lu\r\n"
             "latest_fork_usec:%lld\r\n"
             "migrate_cached_sockets:%ld\r\n"
+            "migrate_slot_jobs:%lu\r\n"
+            "keys_jobs:%lu\r\n"
+            "bgread_jobs:%lu\r\n"
+            "total_bgread_jobs:%lld\r\n"
+            "total_bgread_waits:%lld\r\n"
+            "total_streamed_replies:%lld\r\n"
             "slave_expires_tracked_keys:%zu\r\n"
             "active_defrag_hits:%lld\r\n"
             "active_defrag_misses:%lld\r\n"
             "active_defrag_key_hits:%lld\r\n"
-            "active_defrag_key_misses:%lld\r\n",
+            "active_defrag_key_misses:%lld\r\n"
+            "active_defrag_type_hits:string=%lld,list=%lld,set=%lld,zset=%lld,hash=%lld,module=%lld,stream=%lld\r\n"
+            "io_threaded_reads_processed:%lld\r\n"
+            "io_threaded_writes_processed:%lld\r\n"
+            "io_threaded_commands_processed:%lld\r\n"
+            "io_threaded_commands_by_thread:%s\r\n"
+            "total_writev_calls:%lld\r\n"
+            "writev_avg_iovecs_per_call:%.2f\r\n"
+            "writev_avg_bytes_per_call:%.2f\r\n"
+            "busy_poll_spins:%lld\r\n"
+            "busy_poll_sleeps:%lld\r\n"
+            "busy_poll_throttled:%lld\r\n"
+            "busy_poll_spin_usec:%lld\r\n"
+            "busy_poll_spin_ratio:%.2f\r\n"
+            "lazyfreed_objects:%zu\r\n"
+            "instantaneous_lazyfreed_per_sec:%lld\r\n"
+            "tracking_total_keys:%llu\r\n"
+            "tracking_total_items:%llu\r\n"
+            "tracking_total_prefixes:%llu\r\n",
             server.stat_numconnections,
             server.stat_numcommands,
             getInstantaneousMetric(STATS_METRIC_COMMAND),
@@ -3115,20 +4111,63 @@ sds genRedisInfoString(const char *section) {
             server.stat_rejected_conn,
             server.stat_sync_full,
             server.stat_sync_partial_ok,
+            server.stat_sync_resume_ok,
+            server.stat_repl_compress_in,
+            server.stat_repl_compress_out,
             server.stat_sync_partial_err,
             server.stat_expiredkeys,
+            server.stat_expired_fields,
+            server.stat_expired_stale_perc,
+            server.active_expire_effort,
+            server.stat_expire_loop_lag,
+            server.stat_expire_cycle_time_cap_reached,
             server.stat_evictedkeys,
+            server.stat_evictedkeys_ahead,
             server.stat_keyspace_hits,
             server.stat_keyspace_misses,
             server.pubsub_channels->dictSize(),
             server.pubsub_patterns->listLength(),
             server.stat_fork_time,
             server.migrate_cached_sockets->dictSize(),
+            server.migrate_slot_jobs->listLength(),
+            server.keys_jobs->listLength(),
+            server.bgread_jobs->listLength(),
+            server.stat_bgread_jobs,
+            server.stat_bgread_waits,
+            server.stat_streamed_replies,
             getSlaveKeyWithExpireCount(),
             server.stat_active_defrag_hits,
             server.stat_active_defrag_misses,
             server.stat_active_defrag_key_hits,
-            server.stat_active_defrag_key_misses);
+            server.stat_active_defrag_key_misses,
+            server.stat_active_defrag_type_hits[OBJ_STRING],
+            server.stat_active_defrag_type_hits[OBJ_LIST],
+            server.stat_active_defrag_type_hits[OBJ_SET],
+            server.stat_active_defrag_type_hits[OBJ_ZSET],
+            server.stat_active_defrag_type_hits[OBJ_HASH],
+            server.stat_active_defrag_type_hits[OBJ_MODULE],
+            server.stat_active_defrag_type_hits[OBJ_STREAM],
+            server.stat_io_reads_processed,
+            server.stat_io_writes_processed,
+            server.stat_io_commands_processed,
+            io_commands,
+            server.stat_writev_calls,
+            server.stat_writev_calls ?
+                (double)server.stat_writev_iovecs/server.stat_writev_calls : 0,
+            server.stat_writev_calls ?
+                (double)server.stat_writev_bytes/server.stat_writev_calls : 0,
+            bps.spins,
+            bps.sleeps,
+            bps.throttled,
+            bps.spin_us,
+            bps.spins+bps.sleeps+bps.throttled ?
+                (double)bps.spins/(bps.spins+bps.sleeps+bps.throttled) : 0,
+            lazyfreeGetFreedObjectsCount(),
+            getInstantaneousMetric(STATS_METRIC_LAZYFREED),
+            (unsigned long long) trackingGetTotalKeys(),
+            (unsigned long long) trackingGetTotalItems(),
+            (unsigned long long) trackingGetTotalPrefixes());
+        sdsfree(io_commands);
     }
 
     /* Replication */
@@ -3248,7 +4287,11 @@ sds genRedisInfoString(const char *section) {
             "repl_backlog_active:%d\r\n"
             "repl_backlog_size:%lld\r\n"
             "repl_backlog_first_byte_offset:%lld\r\n"
-            "repl_backlog_histlen:%lld\r\n",
+            "repl_backlog_histlen:%lld\r\n"
+            "repl_backlog_disk_first_byte_offset:%lld\r\n"
+            "repl_backlog_disk_histlen:%lld\r\n"
+            "repl_buffer_blocks:%zu\r\n"
+            "repl_buffer_bytes:%zu\r\n",
             server.replid,
             server.replid2,
             server.master_repl_offset,
@@ -3256,7 +4299,13 @@ sds genRedisInfoString(const char *section) {
             server.repl_backlog != NULL,
             server.repl_backlog_size,
             server.repl_backlog_off,
-            server.repl_backlog_histlen);
+            server.repl_backlog_histlen,
+            server.repl_backlog_disk_off,
+            server.repl_backlog_disk_histlen,
+            server.repl_buffer->replBufferBlocks()+
+            server.repl_compress_buffer->replBufferBlocks(),
+            server.repl_buffer->replBufferMemory()+
+            server.repl_compress_buffer->replBufferMemory());
     }
 
     /* CPU */
@@ -3274,6 +4323,21 @@ sds genRedisInfoString(const char *section) {
         (float)c_ru.ru_utime.tv_sec+(float)c_ru.ru_utime.tv_usec/1000000);
     }
 
+    /* Main thread phases */
+    if (allsections || defsections || !strcasecmp(section,"eventloop")) {
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscatprintf(info, "# Eventloop\r\n");
+        for (j = 0; j < EL_PHASE_COUNT; j++) {
+            info = sdscatprintf(info,
+                "el_%s:calls=%lld,usec=%lld,usec_per_call=%.2f,max_usec=%lld\r\n",
+                elPhaseTable[j].name, server.el_phase[j].calls,
+                server.el_phase[j].usec,
+                server.el_phase[j].calls ?
+                    (float)server.el_phase[j].usec/server.el_phase[j].calls : 0,
+                server.el_phase[j].max_usec);
+        }
+    }
+
     /* Command statistics */
     if (allsections || !strcasecmp(section,"commandstats")) {
         if (sections++) info = sdscat(info,"\r\n");
@@ -3292,6 +4356,13 @@ sds genRedisInfoString(const char *section) {
         }
     }
 
+    /* Latency percentiles of the commands */
+    if (allsections || !strcasecmp(section,"latencystats")) {
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscatprintf(info, "# Latencystats\r\n");
+        info = genLatencyStatsInfoString(info);
+    }
+
     /* Cluster */
     if (allsections || defsections || !strcasecmp(section,"cluster")) {
         if (sections++) info = sdscat(info,"\r\n");
@@ -3301,6 +4372,26 @@ sds genRedisInfoString(const char *section) {
         server.cluster_enabled);
     }
 
+    /* Hot keys */
+    if (allsections || defsections || !strcasecmp(section,"hotkeys")) {
+        size_t tracked = 0;
+        hotkeyEntry **top = NULL;
+
+        if (server.hotkeys) top = hotkeysGetTop(server.hotkeys,&tracked);
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscatprintf(info,
+            "# Hotkeys\r\n"
+            "hotkeys_top_k:%lld\r\n"
+            "hotkeys_tracked:%zu\r\n",
+            server.hotkeys_top_k, tracked);
+        for (size_t j = 0; j < tracked && j < HOTKEYS_INFO_KEYS; j++) {
+            info = sdscatprintf(info,"hotkey%zu:db=%d,key=",j,top[j]->dbid);
+            info = sdscatrepr(info,top[j]->key,sdslen(top[j]->key));
+            info = sdscatprintf(info,",count=%u\r\n",top[j]->count);
+        }
+        zfree(top);
+    }
+
     /* Key space */
     if (allsections || defsections || !strcasecmp(section,"keyspace")) {
         if (sections++) info = sdscat(info,"\r\n");
@@ -3311,9 +4402,23 @@ sds genRedisInfoString(const char *section) {
             keys = server.db[j].m_dict->dictSize();
             vkeys = server.db[j].m_expires->dictSize();
             if (keys || vkeys) {
+                dict *d = server.db[j].m_dict;
+                dict *e = server.db[j].m_expires;
+
                 info = sdscatprintf(info,
-                    "db%d:keys=%lld,expires=%lld,avg_ttl=%lld\r\n",
+                    "db%d:keys=%lld,expires=%lld,avg_ttl=%lld",
                     j, keys, vkeys, server.db[j].m_avg_ttl);
+                /* While a table of the DB is rehashing, report how much of it
+                 * was moved and the memory used by the old tables. */
+                if (d->dictIsRehashing() || e->dictIsRehashing()) {
+                    info = sdscatprintf(info,
+                        ",rehashing_keys=%.2f,rehashing_expires=%.2f,"
+                        "rehashing_mem=%zu",
+                        d->dictRehashProgress()*100,
+                        e->dictRehashProgress()*100,
+                        d->dictRehashingMemory()+e->dictRehashingMemory());
+                }
+                info = sdscat(info,"\r\n");
             }
         }
     }
@@ -3360,7 +4465,7 @@ void linuxMemoryWarnings() {
     if (linuxOvercommitMemoryValue() == 0) {
         serverLog(LL_WARNING,"WARNING overcommit_memory is set to 0! Background save may fail under low memory condition. To fix this issue add 'vm.overcommit_memory = 1' to /etc/sysctl.conf and then reboot or run the command 'sysctl vm.overcommit_memory=1' for this to take effect.");
     }
-    if (THPIsEnabled()) {
+    if (THPIsEnabled() && !server.huge_pages) {
         serverLog(LL_WARNING,"WARNING you have Transparent Huge Pages (THP) support enabled in your kernel. This will create latency and memory usage issues with Redis. To fix this issue run the command 'echo never > /sys/kernel/mm/transparent_hugepage/enabled' as root, and add it to your /etc/rc.local in order to retain the setting after a reboot. Redis must be restarted after THP is disabled.");
     }
 }
@@ -3527,34 +4632,45 @@ int checkForSentinelMode(int argc, char **argv) {
 }
 
 /* Function called at startup to load RDB or AOF file in memory. */
+/* Restore the replication ID / offset from the RDB file. */
+static void restoreReplicationInfo(rdbSaveInfo *rsi) {
+    if (server.masterhost &&
+        rsi->repl_id_is_set &&
+        rsi->repl_offset != -1 &&
+        /* Note that older implementations may save a repl_stream_db
+         * of -1 inside the RDB file in a wrong way, see more information
+         * in function rdbPopulateSaveInfo. */
+        rsi->repl_stream_db != -1)
+    {
+        memcpy(server.replid,rsi->repl_id,sizeof(server.replid));
+        server.master_repl_offset = rsi->repl_offset;
+        /* If we are a slave, create a cached master from this
+         * information, in order to allow partial resynchronizations
+         * with masters. */
+        replicationCacheMasterUsingMyself();
+        server.cached_master->selectDb(rsi->repl_stream_db);
+    }
+}
+
 void loadDataFromDisk() {
     long long start = ustime();
-    if (server.aof_state == AOF_ON) {
-        if (loadAppendOnlyFile(server.aof_filename) == C_OK)
+    rdbSaveInfo handoff_rsi = RDB_SAVE_INFO_INIT;
+    if (handoffLoad(&handoff_rsi) == C_OK) {
+        serverLog(LL_NOTICE,"DB handed over by the previous process: %.3f seconds",
+            (float)(ustime()-start)/1000000);
+        restoreReplicationInfo(&handoff_rsi);
+    } else if (server.aof_state == AOF_ON) {
+        if (loadAppendOnlyFiles() == C_OK)
             serverLog(LL_NOTICE,"DB loaded from append only file: %.3f seconds",(float)(ustime()-start)/1000000);
     } else {
         rdbSaveInfo rsi = RDB_SAVE_INFO_INIT;
-        if (rdbLoad(server.rdb_filename,&rsi) == C_OK) {
+        int retval = server.lazy_loading ?
+                     lazyLoadRdb(server.rdb_filename,&rsi) :
+                     rdbLoad(server.rdb_filename,&rsi);
+        if (retval == C_OK) {
             serverLog(LL_NOTICE,"DB loaded from disk: %.3f seconds",
                 (float)(ustime()-start)/1000000);
-
-            /* Restore the replication ID / offset from the RDB file. */
-            if (server.masterhost &&
-                rsi.repl_id_is_set &&
-                rsi.repl_offset != -1 &&
-                /* Note that older implementations may save a repl_stream_db
-                 * of -1 inside the RDB file in a wrong way, see more information
-                 * in function rdbPopulateSaveInfo. */
-                rsi.repl_stream_db != -1)
-            {
-                memcpy(server.replid,rsi.repl_id,sizeof(server.replid));
-                server.master_repl_offset = rsi.repl_offset;
-                /* If we are a slave, create a cached master from this
-                 * information, in order to allow partial resynchronizations
-                 * with masters. */
-                replicationCacheMasterUsingMyself();
-                server.cached_master->selectDb(rsi.repl_stream_db);
-            }
+            restoreReplicationInfo(&rsi);
         } else if (errno != ENOENT) {
             serverLog(LL_WARNING,"Fatal error loading the DB: %s. Exiting.",strerror(errno));
             exit(1);
@@ -3681,11 +4797,18 @@ int redisIsSupervised(int mode) {
 
 redisDb::redisDb(int in_id)
 {
-    m_dict = dictCreate(&dbDictType,NULL);
-    m_expires = dictCreate(&keyptrDictType,NULL);
+    m_dict = sdsDictCreate(&dbDictType,NULL);
+    m_expires = sdsDictCreate(&keyptrDictType,NULL);
+    m_expires_index = NULL;
+    m_keys_index = NULL;
+    m_hexpires = createZsetListpackObject();
     m_blocking_keys = dictCreate(&keylistDictType,NULL);
     m_ready_keys = dictCreate(&objectKeyPointerValueDictType,NULL);
     m_watched_keys = dictCreate(&keylistDictType,NULL);
+    m_watched_filter = NULL;
+    m_hll_unions = dictCreate(&hllUnionsDictType,NULL);
+    m_hll_versions = dictCreate(&hllVersionsDictType,NULL);
+    m_slots_to_keys = NULL;
     m_id = in_id;
     m_avg_ttl = 0;
 }
@@ -3714,10 +4837,16 @@ int main(int argc, char **argv) {
             return endianconvTest(argc, argv);
         } else if (!strcasecmp(argv[2], "crc64")) {
             return crc64Test(argc, argv);
+        } else if (!strcasecmp(argv[2], "crc16")) {
+            return crc16Test(argc, argv);
+        } else if (!strcasecmp(argv[2], "shm")) {
+            return shmTest(argc, argv);
         }
 
         return -1; /* test not found */
     }
+    if (argc >= 3 && !strcasecmp(argv[1], "benchmark"))
+        return microbenchMain(argc, argv);
 #endif
 
     /* We need to initialize our libraries, and the server configuration. */
@@ -3751,13 +4880,19 @@ int main(int argc, char **argv) {
         initSentinel();
     }
 
-    /* Check if we need to start in redis-check-rdb/aof mode. We just execute
-     * the program main. However the program is part of the Redis executable
-     * so that we can easily execute an RDB check on loading errors. */
+    /* Check if we need to start in redis-check-rdb/aof, redis-build-rdb or
+     * redis-sim-evict mode. We just execute the program main. However the
+     * program is part of the Redis executable so that we can easily execute
+     * an RDB check on loading errors, build RDB files with the same code
+     * saving them, and simulate the eviction with the same code evicting. */
     if (strstr(argv[0],"redis-check-rdb") != NULL)
         redis_check_rdb_main(argc,argv,NULL);
     else if (strstr(argv[0],"redis-check-aof") != NULL)
         redis_check_aof_main(argc,argv);
+    else if (strstr(argv[0],"redis-build-rdb") != NULL)
+        redis_build_rdb_main(argc,argv);
+    else if (strstr(argv[0],"redis-sim-evict") != NULL)
+        redis_sim_evict_main(argc,argv);
 
     if (argc >= 2) {
         j = 1; /* First option to parse in argv[] */
@@ -3825,6 +4960,10 @@ int main(int argc, char **argv) {
         sdsfree(options);
     }
 
+    /* The hash function can only be selected before creating the dictionaries
+     * hashing keys with it, that is, before initServer(). */
+    if (!server.sentinel_mode) dictSetHashFunction(server.hash_function);
+
     serverLog(LL_WARNING, "oO0OoO0OoO0Oo Redis is starting oO0OoO0OoO0Oo");
     serverLog(LL_WARNING,
         "Redis version=%s, bits=%d, commit=%s, modified=%d, pid=%d, just started",
@@ -3844,6 +4983,10 @@ int main(int argc, char **argv) {
     int background = server.daemonize && !server.supervised;
     if (background) daemonize();
 
+    placementInit();
+    hugePagesInit();
+    if (server.transient_arena && zmalloc_transient_init() != -1)
+        serverLog(LL_VERBOSE,"The client, AOF and replication buffers are allocated from a jemalloc arena of their own.");
     initServer();
     if (background || server.pidfile) createPidFile();
     redisSetProcTitle(argv[0]);
@@ -46,7 +46,11 @@
 #include <pthread.h>
 #include <syslog.h>
 #include <netinet/in.h>
+#ifdef USE_LUAJIT
+#include <lua.hpp> /* The LuaJIT headers have no extern "C" guards. */
+#else
 #include <lua.h>
+#endif
 #include <signal.h>
 
 typedef long long mstime_t; /* millisecond time type. */
@@ -58,7 +62,14 @@ typedef long long mstime_t; /* millisecond time type. */
 #include "zmalloc.h" /* total memory usage aware version of malloc/free */
 #include "anet.h"    /* Networking the easy way */
 #include "ziplist.h" /* Compact list data structure */
+#include "listpack.h" /* Compact list of strings, used by small hashes and zsets */
+#include "zbtree.h"   /* B+tree used by big zsets */
 #include "intset.h"  /* Compact integer set structure */
+#include "roaring.h" /* Compressed bitmap for big integer sets */
+#include "chunkedbitmap.h" /* Sparse encoding of big bitmap strings */
+#include "replbuffer.h" /* Replication stream shared by the slaves */
+#include "tls.h"      /* Native TLS with kernel offload */
+#include "shm.h"      /* Shared memory transport for local clients */
 #include "version.h" /* Version macro */
 #include "util.h"    /* Misc functions useful in many places */
 #include "latency.h" /* Latency monitor API */
@@ -66,6 +77,7 @@ typedef long long mstime_t; /* millisecond time type. */
 #include "quicklist.h"  /* Lists are encoded as linked lists of
                            N-elements flat arrays */
 #include "rax.h"     /* Radix tree */
+#include "stream.h"  /* Stream data type header file. */
 
 /* Following includes allow test functions to be called from Redis main() */
 #include "zipmap.h"
@@ -83,6 +95,7 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CONFIG_MAX_HZ            500
 #define CONFIG_DEFAULT_SERVER_PORT        6379    /* TCP port */
 #define CONFIG_DEFAULT_TCP_BACKLOG       511     /* TCP listen backlog */
+#define CONFIG_DEFAULT_METRICS_PORT 0             /* Metrics endpoint off. */
 #define CONFIG_DEFAULT_CLIENT_TIMEOUT       0       /* default client timeout: infinite */
 #define CONFIG_DEFAULT_DBNUM     16
 #define CONFIG_MAX_LINE    1024
@@ -98,6 +111,13 @@ typedef long long mstime_t; /* millisecond time type. */
 #define AOF_READ_DIFF_INTERVAL_BYTES (1024*10)
 #define CONFIG_DEFAULT_SLOWLOG_LOG_SLOWER_THAN 10000
 #define CONFIG_DEFAULT_SLOWLOG_MAX_LEN 128
+#define CONFIG_DEFAULT_HOTKEYS_TOP_K 16
+#define CONFIG_DEFAULT_TRACE_SAMPLE_RATE 0
+#define CONFIG_DEFAULT_TRACE_MAX_LEN 10000
+#define CONFIG_DEFAULT_MEMORY_PREFIXES_SCAN_KEYS 0
+#define CONFIG_DEFAULT_MEMORY_PREFIXES_DELIMITER ":"
+#define CONFIG_DEFAULT_ALLOC_PROFILER 0
+#define CONFIG_DEFAULT_TRACKING_TABLE_MAX_KEYS 1000000
 #define CONFIG_DEFAULT_MAX_CLIENTS 10000
 #define CONFIG_AUTHPASS_MAX_LEN 512
 #define CONFIG_DEFAULT_SLAVE_PRIORITY 100
@@ -108,6 +128,7 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CONFIG_DEFAULT_REPL_BACKLOG_SIZE (1024*1024)    /* 1mb */
 #define CONFIG_DEFAULT_REPL_BACKLOG_TIME_LIMIT (60*60)  /* 1 hour */
 #define CONFIG_REPL_BACKLOG_MIN_SIZE (1024*16)          /* 16k */
+#define CONFIG_DEFAULT_REPL_BACKLOG_DISK_SIZE 0         /* Disabled. */
 #define CONFIG_BGSAVE_RETRY_DELAY 5 /* Wait a few secs before trying again. */
 #define CONFIG_DEFAULT_PID_FILE "/var/run/redis.pid"
 #define CONFIG_DEFAULT_SYSLOG_IDENT "redis"
@@ -123,11 +144,23 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CONFIG_DEFAULT_SYSLOG_ENABLED 0
 #define CONFIG_DEFAULT_STOP_WRITES_ON_BGSAVE_ERROR 1
 #define CONFIG_DEFAULT_RDB_COMPRESSION 1
+#define CONFIG_DEFAULT_RDB_COMPRESSION_CODEC RDB_ENC_LZF
+#define CONFIG_DEFAULT_RDB_COMPRESS_CHUNKS 0
 #define CONFIG_DEFAULT_RDB_CHECKSUM 1
+#define CONFIG_DEFAULT_RDB_LOAD_THREADS 1
+#define RDB_LOAD_MAX_THREADS 16
+#define CONFIG_DEFAULT_RDB_SAVE_THREADS 1
+#define CONFIG_DEFAULT_RDB_LOAD_MMAP 1
+#define CONFIG_DEFAULT_LAZY_LOADING 0
+#define CONFIG_DEFAULT_RDB_SAVE_FORKLESS 0
+#define RDB_SAVE_MAX_THREADS 16
 #define CONFIG_DEFAULT_RDB_FILENAME "dump.rdb"
 #define CONFIG_DEFAULT_REPL_DISKLESS_SYNC 0
+#define CONFIG_DEFAULT_REPL_COMPRESSION 0
 #define CONFIG_DEFAULT_REPL_DISKLESS_SYNC_DELAY 5
+#define CONFIG_DEFAULT_REPL_DISKLESS_RESUME_WINDOW 0
 #define CONFIG_DEFAULT_SLAVE_SERVE_STALE_DATA 1
+#define CONFIG_DEFAULT_SLAVE_FAST_ACK 0
 #define CONFIG_DEFAULT_SLAVE_READ_ONLY 1
 #define CONFIG_DEFAULT_SLAVE_ANNOUNCE_IP NULL
 #define CONFIG_DEFAULT_SLAVE_ANNOUNCE_PORT 0
@@ -140,30 +173,74 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CONFIG_DEFAULT_AOF_NO_FSYNC_ON_REWRITE 0
 #define CONFIG_DEFAULT_AOF_LOAD_TRUNCATED 1
 #define CONFIG_DEFAULT_AOF_USE_RDB_PREAMBLE 0
+#define CONFIG_DEFAULT_AOF_MULTI_PART 0
+#define CONFIG_DEFAULT_AOF_GROUP_COMMIT 0
+#define CONFIG_DEFAULT_AOF_BINARY_FORMAT 0
+#define CONFIG_DEFAULT_AOF_LOAD_PREFETCH 0
 #define CONFIG_DEFAULT_ACTIVE_REHASHING 1
+#define CONFIG_DEFAULT_ACTIVE_REHASHING_BUDGET_US 100
+#define CONFIG_DEFAULT_BUSY_POLL_US 0
+#define CONFIG_DEFAULT_BUSY_POLL_MAX_CPU 50
+#define CONFIG_DEFAULT_BUSY_POLL_SOCKET_US 0
+#define CONFIG_DEFAULT_MAXMEMORY_HEADROOM 0
+#define CONFIG_DEFAULT_MAXMEMORY_HEADROOM_BUDGET_US 500
+#define CONFIG_DEFAULT_TIERING 0
+#define CONFIG_DEFAULT_TIERING_DIR "."
+#define CONFIG_DEFAULT_TIERING_MAX_SIZE 0
+#define CONFIG_DEFAULT_HASH_FUNCTION DICT_HASH_SIPHASH
 #define CONFIG_DEFAULT_AOF_REWRITE_INCREMENTAL_FSYNC 1
 #define CONFIG_DEFAULT_MIN_SLAVES_TO_WRITE 0
 #define CONFIG_DEFAULT_MIN_SLAVES_MAX_LAG 10
 #define NET_IP_STR_LEN 46 /* INET6_ADDRSTRLEN is 46, but we need to be sure */
 #define NET_PEER_ID_LEN (NET_IP_STR_LEN+32) /* Must be enough for ip:port */
 #define CONFIG_BINDADDR_MAX 16
+#define CONFIG_DEFAULT_TCP_LISTENERS 1
+#define CONFIG_MAX_TCP_LISTENERS 16
+#define CONFIG_DEFAULT_TLS_PORT 0
+#define CONFIG_DEFAULT_TLS_REPLICATION 0
+#define CONFIG_DEFAULT_TLS_CLUSTER 0
+#define CONFIG_DEFAULT_TLS_HANDSHAKE_THREADS 2
+#define CONFIG_MAX_TLS_HANDSHAKE_THREADS 64
 #define CONFIG_MIN_RESERVED_FDS 32
 #define CONFIG_DEFAULT_LATENCY_MONITOR_THRESHOLD 0
 #define CONFIG_DEFAULT_SLAVE_LAZY_FLUSH 0
+#define CONFIG_DEFAULT_REPL_ASYNC_LOAD 0
+#define CONFIG_DEFAULT_REPL_DISKLESS_LOAD 0
 #define CONFIG_DEFAULT_LAZYFREE_LAZY_EVICTION 0
 #define CONFIG_DEFAULT_LAZYFREE_LAZY_EXPIRE 0
 #define CONFIG_DEFAULT_LAZYFREE_LAZY_SERVER_DEL 0
+#define CONFIG_DEFAULT_LAZYFREE_THREADS 1
+#define CONFIG_DEFAULT_LAZYFREE_AUTO_THRESHOLD 8192
+#define CONFIG_DEFAULT_KEYS_JOB_THRESHOLD 100000
+#define CONFIG_DEFAULT_BGREAD_THRESHOLD 100000
+#define CONFIG_DEFAULT_REPLY_STREAM_THRESHOLD 10000
+#define KEYS_JOB_STEP_US 1000 /* Time of a step of a KEYS job. */
+#define CONFIG_DEFAULT_ACTIVE_EXPIRE_INDEX 0
+#define CONFIG_DEFAULT_KEYSPACE_INDEX 0
 #define CONFIG_DEFAULT_ALWAYS_SHOW_LOGO 0
 #define CONFIG_DEFAULT_ACTIVE_DEFRAG 0
+#define CONFIG_DEFAULT_HUGE_PAGES 0
+#define CONFIG_DEFAULT_TRANSIENT_ARENA 1
 #define CONFIG_DEFAULT_DEFRAG_THRESHOLD_LOWER 10 /* don't defrag when fragmentation is below 10% */
 #define CONFIG_DEFAULT_DEFRAG_THRESHOLD_UPPER 100 /* maximum defrag force at 100% fragmentation */
 #define CONFIG_DEFAULT_DEFRAG_IGNORE_BYTES (100<<20) /* don't defrag if frag overhead is below 100mb */
 #define CONFIG_DEFAULT_DEFRAG_CYCLE_MIN 25 /* 25% CPU min (at lower threshold) */
 #define CONFIG_DEFAULT_DEFRAG_CYCLE_MAX 75 /* 75% CPU max (at upper threshold) */
+#define CONFIG_DEFAULT_DEFRAG_MAX_SCAN_FIELDS 1000 /* keys with more than 1000 fields are defragged incrementally */
+#define CONFIG_DEFAULT_IO_THREADS_NUM 1 /* Single threaded by default */
+#define CONFIG_DEFAULT_IO_THREADS_DO_READS 0 /* Read + parse from threads? */
+#define CONFIG_DEFAULT_SLAVE_PARALLEL_READS 0 /* Commands from threads? */
+#define CONFIG_DEFAULT_IO_THREADS_SHARDS 0 /* Threads own slot ranges? */
+#define CONFIG_DEFAULT_LUA_PARALLEL_SCRIPTS 0 /* EVAL_RO from threads? */
+#define IO_THREADS_MAX_NUM 128
 
 #define ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP 20 /* Loopkups per loop. */
+#define ACTIVE_EXPIRE_CYCLE_FIELDS_PER_LOOP 64 /* Hash fields per loop. */
+#define ACTIVE_EXPIRE_CYCLE_INDEXED_PER_LOOP 64 /* Indexed keys per loop. */
 #define ACTIVE_EXPIRE_CYCLE_FAST_DURATION 1000 /* Microseconds */
 #define ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC 25 /* CPU max % for keys collection */
+#define CONFIG_DEFAULT_ACTIVE_EXPIRE_CYCLE_MIN 10 /* CPU % with no demand. */
+#define CONFIG_DEFAULT_ACTIVE_EXPIRE_CYCLE_MAX ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC
 #define ACTIVE_EXPIRE_CYCLE_SLOW 0
 #define ACTIVE_EXPIRE_CYCLE_FAST 1
 
@@ -172,7 +249,22 @@ typedef long long mstime_t; /* millisecond time type. */
 #define STATS_METRIC_COMMAND 0      /* Number of commands executed. */
 #define STATS_METRIC_NET_INPUT 1    /* Bytes read to network .*/
 #define STATS_METRIC_NET_OUTPUT 2   /* Bytes written to network. */
-#define STATS_METRIC_COUNT 3
+#define STATS_METRIC_LAZYFREED 3    /* Objects freed by the lazyfree threads. */
+#define STATS_METRIC_CLUSTER_BUS_INPUT 4  /* Bytes read from the cluster bus. */
+#define STATS_METRIC_CLUSTER_BUS_OUTPUT 5 /* Bytes written to the cluster bus. */
+#define STATS_METRIC_COUNT 6
+
+/* Main thread phases profiled with elPhaseStart() / elPhaseEnd(). */
+#define EL_PHASE_PROCESS_EVENTS 0   /* Events processing, serverCron included. */
+#define EL_PHASE_BEFORE_SLEEP 1
+#define EL_PHASE_SERVER_CRON 2
+#define EL_PHASE_CLIENTS_CRON 3
+#define EL_PHASE_DATABASES_CRON 4
+#define EL_PHASE_ACTIVE_EXPIRE 5    /* Both the slow and the fast cycles. */
+#define EL_PHASE_ACTIVE_DEFRAG 6
+#define EL_PHASE_CLUSTER_CRON 7
+#define EL_PHASE_REPLICATION_CRON 8
+#define EL_PHASE_COUNT 9
 
 /* Protocol and I/O related defines */
 #define PROTO_MAX_QUERYBUF_LEN  (1024*1024*1024) /* 1GB max query buffer. */
@@ -180,6 +272,18 @@ typedef long long mstime_t; /* millisecond time type. */
 #define PROTO_REPLY_CHUNK_BYTES (16*1024) /* 16k output buffer */
 #define PROTO_INLINE_MAX_SIZE   (1024*64) /* Max size of inline reads */
 #define PROTO_MBULK_BIG_ARG     (1024*32)
+#define PROTO_ARGV_CACHE_SIZE   8    /* Arguments reused by the next command. */
+#define PROTO_ARGV_CACHE_MAX_LEN 128 /* Max allocation of reused arguments. */
+#define PROTO_ARGV_KEEP_MAX     1024 /* Max argv array slots kept between
+                                        commands. */
+#define REPL_BULK_MAX_CHUNK     (1024*1024) /* Max RDB bytes per write to
+                                               a slave. */
+#define PROTO_REPLY_REF_MIN_BYTES (1024*64) /* Reference, don't copy, bigger
+                                               values in the reply list. */
+#define PROTO_REPLY_SHARED_MIN_BYTES 1024 /* Reference, don't copy, bigger
+                                            protocol sent to many clients. */
+#define PROTO_REPLY_PRODUCER_BYTES (1024*64) /* Produce the next part of a
+                                                reply below this output. */
 #define LONG_STR_SIZE      21          /* Bytes needed for long -> str + '\0' */
 #define AOF_AUTOSYNC_BYTES (1024*1024*32) /* fdatasync every 32MB */
 
@@ -191,6 +295,7 @@ typedef long long mstime_t; /* millisecond time type. */
 
 /* Hash table parameters */
 #define HASHTABLE_MIN_FILL        10      /* Minimal hash table fill 10% */
+#define LAZYFREE_TABLE_MIN_BYTES (1024*1024) /* Free old tables in background */
 
 /* Command flags. Please check the command table defined in the redis.c file
  * for more information about the meaning of every flag. */
@@ -210,12 +315,57 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CMD_FAST (1<<13)            /* "F" flag */
 #define CMD_MODULE_GETKEYS (1<<14)  /* Use the modules getkeys interface. */
 #define CMD_MODULE_NO_CLUSTER (1<<15) /* Deny on Redis Cluster. */
+#define CMD_BITMAP (1<<16)          /* "B" flag */
+#define CMD_COMPRESSED (1<<17)      /* "Z" flag */
 
 /* AOF states */
 #define AOF_OFF 0             /* AOF is off */
 #define AOF_ON 1              /* AOF is on */
 #define AOF_WAIT_REWRITE 2    /* AOF waits rewrite to start appending */
 
+/* With aof-multi-part the AOF is a base file, written by the rewrite as an
+ * RDB or as commands, plus the incremental files with the commands executed
+ * after it, listed by the manifest file in order. */
+struct aofManifest {
+    sds base;               /* Base file name, NULL if none yet. */
+    list *incrs;            /* Incremental file names, oldest first. */
+    long long seq;          /* Sequence number of the last incremental. */
+};
+
+/* Binary AOF records, written with aof-binary-format. They can be mixed with
+ * the RESP ones, that always start with '*', since each binary record starts
+ * with its type byte:
+ *
+ *   DEF <id> <namelen> <name>          binds <id> to a command name
+ *   CMD <id> <argc> <arg> ... <arg>     runs the command bound to <id>
+ *
+ * where every number is a varint and every argument is either STR <len>
+ * <bytes> or INT <zigzag varint>. A writer binds its IDs again in every new
+ * file, and a loader just takes the last binding seen for an ID. */
+#define AOF_BINARY_DEF 0xf6
+#define AOF_BINARY_CMD 0xf7
+#define AOF_BINARY_ARG_STR 0
+#define AOF_BINARY_ARG_INT 1
+
+/* With aof-group-commit and appendfsync always the AOF buffer is handed to
+ * a writer thread at every event loop iteration as a new batch. The thread
+ * writes and fsyncs all the batches queued while it was busy at once, and
+ * the replies of the clients that wrote in a batch are held until the batch
+ * is durable. */
+struct aofWriter {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond;   /* Signaled when a batch is queued. */
+    pthread_cond_t done_cond;   /* Signaled when a batch is durable. */
+    sds buf;                    /* Queued batches not yet taken. */
+    int fsync;                  /* Fsync the queued batches. */
+    long long queued_seq;       /* Sequence number of the last batch queued. */
+    long long durable_seq;      /* Last batch written and fsynced. */
+    long long released_seq;     /* Last batch whose clients got replies. */
+    long long commits;          /* Write and fsync rounds performed. */
+    int notify_pipe[2];         /* Awakes the event loop after a commit. */
+};
+
 /* Client flags */
 #define CLIENT_SLAVE (1<<0)   /* This client is a slave server */
 #define CLIENT_MASTER (1<<1)  /* This client is a master server */
@@ -248,6 +398,23 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CLIENT_LUA_DEBUG (1<<25)  /* Run EVAL in debug mode. */
 #define CLIENT_LUA_DEBUG_SYNC (1<<26)  /* EVAL debugging without fork() */
 #define CLIENT_MODULE (1<<27) /* Non connected client used by some module. */
+#define CLIENT_PENDING_READ (1<<28) /* The client has pending reads and was put
+                                       in the list of clients we can read
+                                       from using the I/O threads. */
+#define CLIENT_PENDING_COMMAND (1<<29) /* Used in threaded I/O to signal after
+                                          we return single threaded that the
+                                          client has already pending commands
+                                          to be executed. */
+#define CLIENT_AOF_COMMIT_WAIT (1<<30) /* Replies held until the AOF batch
+                                          with the last write is durable. */
+
+/* Client side caching flags (tracking_flags field in client structure),
+ * see CLIENT TRACKING. */
+#define CLIENT_TRACKING (1<<0)        /* Keys read by the client are tracked. */
+#define CLIENT_TRACKING_BCAST (1<<1)  /* Tracking in broadcasting mode. */
+#define CLIENT_TRACKING_BROKEN_REDIR (1<<2) /* The redirect client is gone. */
+#define CLIENT_TRACKING_NOLOOP (1<<3) /* Don't notify the client of the keys
+                                         it modified itself. */
 
 /* Client block type (btype field in client structure)
  * if CLIENT_BLOCKED flag is set. */
@@ -255,6 +422,15 @@ typedef long long mstime_t; /* millisecond time type. */
 #define BLOCKED_LIST 1    /* BLPOP & co. */
 #define BLOCKED_WAIT 2    /* WAIT for synchronous replication. */
 #define BLOCKED_MODULE 3  /* Blocked by a loadable module. */
+#define BLOCKED_STREAM 4  /* XREAD. */
+#define BLOCKED_MIGRATE 5 /* MIGRATE ... SLOT. */
+#define BLOCKED_TIER 6    /* Values read from the tiering file. */
+#define BLOCKED_CONTINUATION 7 /* Suspended, see blockClientOnContinuation(). */
+#define BLOCKED_BGREAD 8  /* Writing a value read in background. */
+
+/* Status a suspended command is resumed with. */
+#define CONTINUATION_DONE 0     /* What the command waited for happened. */
+#define CONTINUATION_TIMEOUT 1  /* The timeout of the client elapsed. */
 
 /* Client request types */
 #define PROTO_REQ_INLINE 1
@@ -304,6 +480,7 @@ typedef long long mstime_t; /* millisecond time type. */
 #define SLAVE_CAPA_NONE 0
 #define SLAVE_CAPA_EOF (1<<0)    /* Can parse the RDB EOF streaming format. */
 #define SLAVE_CAPA_PSYNC2 (1<<1) /* Supports PSYNC2 protocol. */
+#define SLAVE_CAPA_LZF (1<<2)    /* Can decode the LZF framed stream. */
 
 /* Synchronous read timeout - slave side */
 #define CONFIG_REPL_SYNCIO_TIMEOUT 5
@@ -341,19 +518,52 @@ typedef long long mstime_t; /* millisecond time type. */
 #define AOF_FSYNC_EVERYSEC 2
 #define CONFIG_DEFAULT_AOF_FSYNC AOF_FSYNC_EVERYSEC
 
+/* RDB save page cache bypass modes, see rioDirectIO. */
+#define RDB_BYPASS_CACHE_NO 0
+#define RDB_BYPASS_CACHE_FADVISE 1
+#define RDB_BYPASS_CACHE_ODIRECT 2
+#define CONFIG_DEFAULT_RDB_SAVE_BYPASS_CACHE RDB_BYPASS_CACHE_NO
+
+/* NUMA memory policies of numa-bind, see placement.cpp. */
+#define NUMA_BIND_NO 0
+#define NUMA_BIND_PREFERRED 1
+#define NUMA_BIND_STRICT 2
+#define CONFIG_DEFAULT_NUMA_BIND NUMA_BIND_NO
+
 /* Zip structure related defaults */
 #define OBJ_HASH_MAX_ZIPLIST_ENTRIES 512
 #define OBJ_HASH_MAX_ZIPLIST_VALUE 64
 #define OBJ_SET_MAX_INTSET_ENTRIES 512
 #define OBJ_ZSET_MAX_ZIPLIST_ENTRIES 128
 #define OBJ_ZSET_MAX_ZIPLIST_VALUE 64
+#define OBJ_ZSET_MAX_SKIPLIST_ENTRIES 65536
+
+/* Adaptive encoding defaults, see objectCompactMaxEntries(). */
+#define CONFIG_DEFAULT_ADAPTIVE_ENCODING_HOT_COUNTER 0
+#define CONFIG_DEFAULT_ADAPTIVE_ENCODING_COLD_SECONDS 0
+#define ADAPTIVE_ENCODING_HOT_DIVISOR 4 /* Hot keys use 1/4 of the entries. */
+#define ADAPTIVE_ENCODING_KEYS_PER_CALL 1000 /* Keys scanned per cron call. */
+#define OBJ_STREAM_NODE_MAX_BYTES 4096
+#define OBJ_STREAM_NODE_MAX_ENTRIES 100
+
+/* Set algebra (SINTER, SUNION, SDIFF) defaults */
+#define CONFIG_DEFAULT_SET_ALGEBRA_THREADS 4
+#define CONFIG_DEFAULT_SET_ALGEBRA_PARALLEL_THRESHOLD 100000
+#define SET_ALGEBRA_MAX_THREADS 64
 
 /* List defaults */
 #define OBJ_LIST_MAX_ZIPLIST_SIZE -2
 #define OBJ_LIST_COMPRESS_DEPTH 0
+#define OBJ_LIST_NODE_CONTAINER QUICKLIST_NODE_CONTAINER_LISTPACK
+#define LIST_CONVERSION_LAZY 0       /* Convert lists on their next write. */
+#define LIST_CONVERSION_BACKGROUND 1 /* Convert them in serverCron() too. */
+#define OBJ_LIST_NODE_CONTAINER_CONVERSION LIST_CONVERSION_BACKGROUND
+#define LIST_CONVERSION_NODES_PER_CALL 1000 /* Nodes converted per cron. */
 
 /* HyperLogLog defines */
 #define CONFIG_DEFAULT_HLL_SPARSE_MAX_BYTES 3000
+#define CONFIG_DEFAULT_BITMAP_CHUNKED_MIN_BYTES (1024*1024)
+#define CONFIG_DEFAULT_STRING_COMPRESSION_MIN_BYTES 0 /* Disabled. */
 
 /* Sets operations codes */
 #define SET_OP_UNION 0
@@ -366,6 +576,7 @@ typedef long long mstime_t; /* millisecond time type. */
 #define MAXMEMORY_FLAG_LRU (1<<0)
 #define MAXMEMORY_FLAG_LFU (1<<1)
 #define MAXMEMORY_FLAG_ALLKEYS (1<<2)
+#define MAXMEMORY_FLAG_SIZE (1<<3)
 #define MAXMEMORY_FLAG_NO_SHARED_INTEGERS \
     (MAXMEMORY_FLAG_LRU|MAXMEMORY_FLAG_LFU)
 
@@ -377,6 +588,9 @@ typedef long long mstime_t; /* millisecond time type. */
 #define MAXMEMORY_ALLKEYS_LFU ((5<<8)|MAXMEMORY_FLAG_LFU|MAXMEMORY_FLAG_ALLKEYS)
 #define MAXMEMORY_ALLKEYS_RANDOM ((6<<8)|MAXMEMORY_FLAG_ALLKEYS)
 #define MAXMEMORY_NO_EVICTION (7<<8)
+#define MAXMEMORY_VOLATILE_GDSF ((8<<8)|MAXMEMORY_FLAG_LFU|MAXMEMORY_FLAG_SIZE)
+#define MAXMEMORY_ALLKEYS_GDSF ((9<<8)|MAXMEMORY_FLAG_LFU|MAXMEMORY_FLAG_SIZE|\
+                                MAXMEMORY_FLAG_ALLKEYS)
 
 #define CONFIG_DEFAULT_MAXMEMORY_POLICY MAXMEMORY_NO_EVICTION
 
@@ -424,7 +638,8 @@ typedef long long mstime_t; /* millisecond time type. */
 #define NOTIFY_ZSET (1<<7)        /* z */
 #define NOTIFY_EXPIRED (1<<8)     /* x */
 #define NOTIFY_EVICTED (1<<9)     /* e */
-#define NOTIFY_ALL (NOTIFY_GENERIC | NOTIFY_STRING | NOTIFY_LIST | NOTIFY_SET | NOTIFY_HASH | NOTIFY_ZSET | NOTIFY_EXPIRED | NOTIFY_EVICTED)      /* A */
+#define NOTIFY_STREAM (1<<10)     /* t */
+#define NOTIFY_ALL (NOTIFY_GENERIC | NOTIFY_STRING | NOTIFY_LIST | NOTIFY_SET | NOTIFY_HASH | NOTIFY_ZSET | NOTIFY_EXPIRED | NOTIFY_EVICTED | NOTIFY_STREAM)      /* A */
 
 /* Get the first bind addr or NULL */
 #define NET_FIRST_BIND_ADDR (server.bindaddr_count ? server.bindaddr[0] : NULL)
@@ -434,6 +649,10 @@ typedef long long mstime_t; /* millisecond time type. */
  * The actual resolution depends on server.hz. */
 #define run_with_period(_ms_) if ((_ms_ <= 1000/server.hz) || !(server.cronloops%((_ms_)/(1000/server.hz))))
 
+/* Profile a phase of the main thread, see elPhaseRecord(). */
+#define elPhaseStart(var) var = ustime()
+#define elPhaseEnd(phase,var) elPhaseRecord(phase,ustime()-(var))
+
 /* We can print the stacktrace, so our assert is defined this way: */
 #define serverAssertWithInfo(_c,_o,_e) ((_e)?(void)0 : (_serverAssertWithInfo(_c,_o,#_e,__FILE__,__LINE__),_exit(1)))
 #define serverAssert(_e) ((_e)?(void)0 : (_serverAssert(#_e,__FILE__,__LINE__),_exit(1)))
@@ -464,6 +683,7 @@ typedef long long mstime_t; /* millisecond time type. */
  * in order to dispatch the loading to the right module, plus a 10 bits
  * encoding version. */
 #define OBJ_MODULE 5
+#define OBJ_STREAM 6
 
 /* Extract encver / signature from a module type ID. */
 #define REDISMODULE_TYPE_ENCVER_BITS 10
@@ -474,6 +694,7 @@ typedef long long mstime_t; /* millisecond time type. */
 struct RedisModule;
 struct RedisModuleIO;
 struct RedisModuleDigest;
+struct RedisModuleDefragCtx;
 struct RedisModuleCtx;
 struct redisObject;
 
@@ -487,6 +708,7 @@ typedef void (*moduleTypeRewriteFunc)(struct RedisModuleIO *io, struct redisObje
 typedef void (*moduleTypeDigestFunc)(struct RedisModuleDigest *digest, void *value);
 typedef size_t (*moduleTypeMemUsageFunc)(const void *value);
 typedef void (*moduleTypeFreeFunc)(void *value);
+typedef int (*moduleTypeDefragFunc)(struct RedisModuleDefragCtx *ctx, struct redisObject *key, void **value);
 
 /* The module type, which is referenced in each value of a given type, defines
  * the methods and links to the module exporting the type. */
@@ -499,6 +721,7 @@ struct RedisModuleType {
     moduleTypeMemUsageFunc m_mem_usage;
     moduleTypeDigestFunc m_digest;
     moduleTypeFreeFunc m_free;
+    moduleTypeDefragFunc m_defrag;
     char m_name[10]; /* 9 bytes name + null term. Charset: A-Z a-z 0-9 _- */
 };
 typedef RedisModuleType moduleType;
@@ -558,6 +781,12 @@ struct RedisModuleDigest {
     unsigned char x[20];    /* Xored elements. */
 };
 
+/* The context passed to the defrag callback of module types: the callback
+ * moves its allocations with RedisModule_DefragAlloc(), that counts them. */
+struct RedisModuleDefragCtx {
+    long long defragged;    /* Allocations moved. */
+};
+
 /* Just start with a digest composed of all zero bytes. */
 #define moduleInitDigestContext(mdvar) do { \
     memset(mdvar.o,0,sizeof(mdvar.o)); \
@@ -571,12 +800,19 @@ struct RedisModuleDigest {
 #define OBJ_ENCODING_INT 1     /* Encoded as integer */
 #define OBJ_ENCODING_HT 2      /* Encoded as hash table */
 #define OBJ_ENCODING_ZIPMAP 3  /* Encoded as zipmap */
-#define OBJ_ENCODING_LINKEDLIST 4 /* No longer used: old list encoding. */
+#define OBJ_ENCODING_COMPRESSED 4 /* Compressed string, see compressedString.
+                                   * It was the old list encoding. */
 #define OBJ_ENCODING_ZIPLIST 5 /* Encoded as ziplist */
 #define OBJ_ENCODING_INTSET 6  /* Encoded as intset */
 #define OBJ_ENCODING_SKIPLIST 7  /* Encoded as skiplist */
 #define OBJ_ENCODING_EMBSTR 8  /* Embedded sds string encoding */
 #define OBJ_ENCODING_QUICKLIST 9 /* Encoded as linked list of ziplists */
+#define OBJ_ENCODING_LISTPACK 10 /* Encoded as a listpack */
+#define OBJ_ENCODING_BTREE 11  /* Encoded as B+tree */
+#define OBJ_ENCODING_ROARING 12 /* Encoded as compressed bitmap */
+#define OBJ_ENCODING_CHUNKED 13 /* Encoded as chunked sparse bitmap */
+#define OBJ_ENCODING_STREAM 14 /* Encoded as a radix tree of listpacks */
+#define OBJ_ENCODING_LAZY 15   /* Not loaded yet from the RDB file */
 
 #define LRU_BITS 24
 #define LRU_CLOCK_MAX ((1<<LRU_BITS)-1) /* Max value of obj->lru */
@@ -605,6 +841,16 @@ typedef struct redisObject robj;
     _var.ptr = _ptr; \
 } while(0)
 
+/* The value of the strings with the OBJ_ENCODING_COMPRESSED encoding: 'len'
+ * bytes compressed into the 'clen' bytes of 'data' with the RDB_ENC_* codec
+ * 'codec', so that they are saved in the RDB file as they are. */
+typedef struct compressedString {
+    size_t len;
+    size_t clen;
+    unsigned char codec;
+    unsigned char data[];
+} compressedString;
+
 struct evictionPoolEntry; /* Defined in evict.c */
 
 /* Redis database representation. There are multiple databases identified
@@ -615,11 +861,24 @@ class redisDb
 public:
     redisDb(int in_id);
 
-    dict *m_dict;                 /* The keyspace for this DB */
-    dict *m_expires;              /* Timeout of keys with a timeout set */
+    sdsDict *m_dict;              /* The keyspace for this DB */
+    sdsDict *m_expires;           /* Entries of m_dict with a timeout set */
+    rax *m_expires_index;         /* Keys of m_expires by time, or NULL if
+                                     active-expire-index is disabled. */
+    rax *m_keys_index;            /* Keys of m_dict in lexicographic order,
+                                     or NULL if keyspace-index is disabled. */
     dict *m_blocking_keys;        /* Keys with clients waiting for data (BLPOP)*/
     dict *m_ready_keys;           /* Blocked keys that received a PUSH */
     dict *m_watched_keys;         /* WATCHED keys for MULTI/EXEC CAS */
+    uint32_t *m_watched_filter;   /* Counting filter of m_watched_keys, see
+                                     watchedFilterSlot(). NULL until the
+                                     first WATCH in this DB. */
+    dict *m_hll_unions;           /* Cached multi-key PFCOUNT results */
+    dict *m_hll_versions;         /* Keys of m_hll_unions, and their version */
+    dict **m_slots_to_keys;       /* Keys of every hash slot in cluster mode,
+                                     see slotToKeyAdd(). */
+    robj *m_hexpires;             /* Hashes with fields having a TTL, by
+                                     their earliest field expire time */
     int m_id;                     /* Database ID */
     long long m_avg_ttl;          /* Average TTL, just for stats */
 };
@@ -638,6 +897,16 @@ struct multiState {
     time_t m_minreplicas_timeout; /* MINREPLICAS timeout as unixtime. */
 };
 
+/* The continuation of a command suspended by blockClientOnContinuation(),
+ * called with CONTINUATION_DONE or CONTINUATION_TIMEOUT, and the function
+ * releasing its state. */
+typedef void clientResumeProc(client *c, void *privdata, int status);
+typedef void clientResumeFreeProc(void *privdata);
+
+/* Appends the next part of the reply of a client suspended by
+ * startReplyProducer(), returning 1 if some of it is left. */
+typedef int replyProducerProc(client *c, void *privdata);
+
 /* This structure holds the blocking operation state for a client.
  * The fields used depend on client->btype. */
 struct blockingState
@@ -647,18 +916,45 @@ struct blockingState
     /* Generic fields. */
     mstime_t m_timeout;       /* Blocking operation timeout. If UNIX current time
                              * is > timeout then the operation timed out. */
+    int m_in_timeout_table;   /* Indexed in server.clients_timeout_table. */
 
-    /* BLOCKED_LIST */
+    /* BLOCKED_LIST and BLOCKED_STREAM */
     dict *m_keys;             /* The keys we are waiting to terminate a blocking
-                             * operation such as BLPOP. Otherwise NULL. */
+                             * operation such as BLPOP or XREAD. Otherwise NULL.
+                             * For XREAD the values are the streamID the
+                             * client is waiting to be exceeded. */
     robj *m_target;           /* The key that should receive the element,
                              * for BRPOPLPUSH. */
 
+    /* BLOCKED_STREAM */
+    size_t m_xread_count;     /* XREAD COUNT option. */
+    robj *m_xread_group;      /* XREADGROUP group name. */
+    robj *m_xread_consumer;   /* XREADGROUP consumer name. */
+    int m_xread_group_noack;  /* XREADGROUP NOACK option. */
+
     /* BLOCKED_WAIT */
     int m_num_replicas;        /* Number of replicas we are waiting for ACK. */
     long long m_replication_offset;   /* Replication offset to reach. */
 
     /* BLOCKED_MODULE */
+    /* BLOCKED_MIGRATE */
+    void *m_migrate_job;           /* The migrateSlotJob of the client. */
+
+    /* BLOCKED_CONTINUATION */
+    clientResumeProc *m_resume;    /* Continuation of the command. */
+    clientResumeFreeProc *m_resume_free; /* Releases m_resume_privdata. */
+    void *m_resume_privdata;       /* State of the suspended command. */
+    replyProducerProc *m_produce;  /* Produces the rest of the reply. */
+
+    /* BLOCKED_TIER */
+    int m_tier_reads;              /* Values still read for the command. */
+
+    /* BLOCKED_BGREAD */
+    int m_bgread_waits;            /* Background reads still waited for. */
+
+    /* BLOCKED_TIER, BLOCKED_BGREAD */
+    int m_rerun;                   /* Execute the command once unblocked. */
+
     void *m_module_blocked_handle; /* RedisModuleBlockedClient structure.
                                     which is opaque for the Redis core, only
                                     handled in module.c. */
@@ -680,6 +976,25 @@ struct readyList {
     robj *key;
 } ;
 
+/* Receives the replies of a client in place of its output buffers, when
+ * set as client::m_reply_builder: scripting uses it to build the Lua
+ * values of redis.call() directly, without writing and parsing again the
+ * protocol. The typed replies go to their method, everything written
+ * as protocol, by addReply(), addReplySds() and addReplyString(), goes to
+ * raw(), that must parse it. */
+class replyBuilder {
+public:
+    virtual ~replyBuilder() {}
+    virtual void replyBulk(const char *s, size_t len) = 0;
+    virtual void replyLongLong(long long ll) = 0;
+    virtual void replyArray(long len) = 0;
+    /* The length of the array is set later by replyDeferredArrayLen(), after
+     * its elements, with the handle returned. */
+    virtual void *replyDeferredArray() = 0;
+    virtual void replyDeferredArrayLen(void *handle, long len) = 0;
+    virtual void replyRaw(const char *s, size_t len) = 0;
+};
+
 /* With multiplexing we need to take per-client state.
  * Clients are taken in a linked list. */
 class client {
@@ -706,13 +1021,16 @@ public:
     void addReplyMultiBulkLen(long length);
     void addReplyBulk(robj *obj);
     void addReplyBulkCBuffer(const void *p, size_t len);
+    void addReplyBulkObjectRange(robj *o, size_t offset, size_t len);
+    void addReplyShared(robj *o);
     void addReplyBulkSds(sds s);
     void addReplyBulkCString(const char *s);
     void addReplyBulkLongLong(long long ll);
     int  clientHasPendingReplies();
 
     void freeClientArgv();
-    void processInputBuffer();
+    int processInputBuffer();
+    int processCommandAndResetClient();
     char *getClientPeerId();
     sds catClientInfoString(sds s);
     void rewriteClientCommandVector(int argc, ...);
@@ -723,6 +1041,7 @@ public:
 
     void rewriteClientCommandArgument(int i, robj *newval);
     unsigned long getClientOutputBufferMemoryUsage();
+    unsigned long getClientOwnOutputBufferMemoryUsage();
     int getClientType();
     int checkClientOutputBufferLimits();
     void unlinkClient();
@@ -732,14 +1051,17 @@ public:
     void discardTransaction();
 
     // implemented in pubsub.cpp
-    int pubsubUnsubscribeAllChannels(int notify);
+    int pubsubUnsubscribeAllChannels(int notify, int shard = 0);
     int pubsubUnsubscribeAllPatterns(int notify);
-    int pubsubUnsubscribeChannel(robj *channel, int notify);
+    int pubsubUnsubscribeChannel(robj *channel, int notify, int shard = 0);
     int pubsubUnsubscribePattern(robj *pattern, int notify);
 
     // implemented in replication.cpp
     void replicationCacheMaster();
     char *replicationGetSlaveName();
+    void replicationAttachBuffer();
+    void replicationPrepareBufferWrite();
+    void replicationCheckBufferLimits();
 
     // implemented in blocked.cpp
     void unblockClient();
@@ -752,6 +1074,7 @@ public:
 
   uint64_t m_client_id;            /* Client incremental unique ID. */
     int m_fd;                 /* Client socket. */
+    shmConn *m_shm;           /* Shared memory rings, see CLIENT SHM. */
     redisDb *m_cur_selected_db;            /* Pointer to currently SELECTed DB. */
     robj *m_client_name;             /* As set by CLIENT SETNAME. */
     sds m_query_buf;           /* Buffer we use to accumulate client queries. */
@@ -759,14 +1082,30 @@ public:
                                yet not applied replication stream that we
                                are receiving from the master. */
     size_t m_query_buf_peak;   /* Recent (100ms or more) peak of querybuf size. */
+    size_t m_cron_memory_usage; /* Memory of the client accounted in
+                                   server.stat_clients_normal_memory. */
+    int m_query_buf_shared;    /* m_query_buf is borrowed from the pool of
+                                  shared query buffers. */
     int m_argc;               /* Num of arguments of current command. */
     robj **m_argv;            /* Arguments of current command. */
+    int m_argv_len;           /* Slots allocated in m_argv, reused by the
+                                 next command if big enough. */
+    robj *m_argv_cache[PROTO_ARGV_CACHE_SIZE]; /* Arguments of the previous
+                                  commands reused by the next ones, by
+                                  position, see createArgvObject(). */
     redisCommand *m_cmd;
     redisCommand *m_last_cmd;  /* Last command executed. */
+    long long m_thread_cmd_duration; /* Microseconds of the command executed
+                                        by an I/O thread, see
+                                        slave-parallel-reads. */
+    int m_thread_shard;        /* I/O thread executing the command, -1 for
+                                  any, see io-threads-shards. */
     int m_req_protocol_type;   /* Request protocol type: PROTO_REQ_* */
     int m_multi_bulk_len;       /* Number of multi bulk arguments left to read. */
     long m_bulk_len;           /* Length of bulk argument in multi bulk request. */
     list *m_reply;            /* List of reply objects to send to the client. */
+    replyBuilder *m_reply_builder; /* If not NULL, gets the replies instead
+                                      of the output buffers. */
     unsigned long long m_reply_bytes; /* Tot bytes of objects in reply list. */
     size_t m_already_sent_len;         /* Amount of bytes already sent in the current
                                buffer or object being sent. */
@@ -781,6 +1120,7 @@ public:
     off_t m_replication_db_file_offset;        /* Replication DB file offset. */
     off_t m_replication_db_file_size;       /* Replication DB file size. */
     sds m_replication_db_preamble;       /* Replication DB preamble. */
+    size_t m_replication_db_chunk;       /* Replication DB bytes per write. */
     long long m_read_replication_offset; /* Read replication offset if this is a master. */
     long long m_applied_replication_offset;      /* Applied replication offset if this is a master. */
     long long m_replication_ack_off; /* Replication ack offset, if this is a slave. */
@@ -792,15 +1132,33 @@ public:
     int m_slave_listening_port; /* As configured with: SLAVECONF listening-port */
     char m_slave_ip[NET_IP_STR_LEN]; /* Optionally given by REPLCONF ip-address */
     int m_slave_capabilities;         /* Slave capabilities: SLAVE_CAPA_* bitwise OR. */
+    char m_resume_mark[RDB_EOF_MARK_SIZE+1]; /* REPLCONF rdb-resume transfer. */
+    long long m_resume_offset;  /* REPLCONF rdb-resume-offset, or -1. */
+    int m_repl_compress;        /* Replication stream is LZF framed. */
+    sds m_repl_frames;          /* Master: frames not yet decoded. */
+    replBufCursor m_repl_cursor; /* Slave: position in the shared stream. */
+    list *m_repl_disk_ranges;   /* Slave: backlog on disk still to send. */
     multiState m_multi_exec_state;      /* MULTI/EXEC state */
     int m_blocking_op_type;              /* Type of blocking op if CLIENT_BLOCKED. */
     blockingState m_blocking_state;     /* blocking state */
     long long m_last_write_global_replication_offset;         /* Last write global replication offset. */
+    long long m_aof_commit_seq; /* AOF group commit batch of the last write. */
     list *m_watched_keys;     /* Keys WATCHED for MULTI/EXEC CAS */
     dict *m_pubsub_channels;  /* channels a client is interested in (SUBSCRIBE) */
     list *m_pubsub_patterns;  /* patterns a client is interested in (SUBSCRIBE) */
+    dict *m_pubsubshard_channels; /* shard channels a client is interested in (SSUBSCRIBE) */
+    int m_tracking_flags;     /* Client side caching: CLIENT_TRACKING_* flags. */
+    uint64_t m_client_tracking_redirection; /* Client receiving the
+                                               invalidation messages. */
+    rax *m_client_tracking_prefixes; /* Prefixes in BCAST mode, or NULL. */
     sds m_cached_peer_id;             /* Cached peer ID. */
 
+    /* Resources consumed by the client since it connected, see CLIENT TOP. */
+    unsigned long long m_stat_commands;      /* Commands processed. */
+    unsigned long long m_stat_cmd_usec;      /* Time spent running commands. */
+    unsigned long long m_stat_net_input_bytes;  /* Bytes read from the socket. */
+    unsigned long long m_stat_net_output_bytes; /* Bytes written to the socket. */
+
     /* Response buffer */
     int m_response_buff_pos;
     char m_response_buff[PROTO_REPLY_CHUNK_BYTES];
@@ -810,10 +1168,13 @@ private:
     void setProtocolError(const char *errstr, int pos);
     int processInlineBuffer();
     int processMultibulkBuffer();
+    int processBulkBatch(int pos);
+    robj *createArgvObject(int j, const char *ptr, size_t len);
     void genClientPeerId(char *peerid, size_t peerid_len);
     int  prepareClientToWrite();
     int  _addReplyToBuffer(const char *s, size_t len);
     void _addReplyObjectToList(robj *o);
+    int  _addReplyRefToList(robj *o, size_t offset, size_t len);
     void _addReplySdsToList(sds s);
     void _addReplyStringToList(const char *s, size_t len);
     void addReplyErrorLength(const char *s, size_t len);
@@ -840,7 +1201,8 @@ struct sharedObjectsStruct {
     *outofrangeerr, *noscripterr, *loadingerr, *slowscripterr, *bgsaveerr,
     *masterdownerr, *roslaveerr, *execaborterr, *noautherr, *noreplicaserr,
     *busykeyerr, *oomerr, *plus, *messagebulk, *pmessagebulk, *subscribebulk,
-    *unsubscribebulk, *psubscribebulk, *punsubscribebulk, *del, *unlink,
+    *unsubscribebulk, *psubscribebulk, *punsubscribebulk, *smessagebulk,
+    *ssubscribebulk, *sunsubscribebulk, *del, *unlink,
     *rpop, *lpop, *lpush, *emptyscan,
     *select[PROTO_SHARED_SELECT_CMDS],
     *integers[OBJ_SHARED_INTEGERS],
@@ -862,6 +1224,12 @@ struct zskiplistNode {
 
 struct zrangespec;
 struct zlexrangespec;
+/* A (score, element) pair to load into a skiplist, see zslBulkLoad(). */
+struct zskiplistPair {
+    double score;
+    sds ele;
+};
+
 class zskiplist
 {
 public:
@@ -869,6 +1237,7 @@ public:
     ~zskiplist();
 
     zskiplistNode *zslInsert(double score, sds ele);
+    void zslBulkLoad(const zskiplistPair *pairs, unsigned long count);
     int zslDelete(double score, sds ele, zskiplistNode **node);
     zskiplistNode *zslFirstInRange(zrangespec *range);
     zskiplistNode *zslLastInRange(zrangespec *range);
@@ -900,11 +1269,22 @@ private:
     int m_level;
 };
 
+/* Sorted sets are ordered either by a skiplist or, when they have more than
+ * zset-max-skiplist-entries elements, by a B+tree: exactly one of 'zsl' and
+ * 'zbt' is set. */
 struct zset {
     dict *_dict;
     zskiplist *zsl;
+    zbtree *zbt;
 };
 
+/* Score stored in the dictionary entry of a sorted set element: skiplist
+ * encoded zsets point to the score of the skiplist node, B+tree encoded ones
+ * keep the score in the entry itself. */
+static inline double zsetDictScore(const zset *zs, const dictEntry *de) {
+    return zs->zbt ? de->dictGetDoubleVal() : *(double*)de->dictGetVal();
+}
+
 struct clientBufferLimitsConfig {
     unsigned long long hard_limit_bytes;
     unsigned long long soft_limit_bytes;
@@ -997,6 +1377,8 @@ struct clusterState;
 #define CHILD_INFO_MAGIC 0xC17DDA7A12345678LL
 #define CHILD_INFO_TYPE_RDB 0
 #define CHILD_INFO_TYPE_AOF 1
+#define CHILD_INFO_TYPE_CURRENT_INFO 2  /* COW so far, sent during the save. */
+#define CHILD_INFO_REPORT_PERIOD 1000   /* Milliseconds between two reports. */
 
 struct redisServer {
     /* General */
@@ -1012,9 +1394,20 @@ struct redisServer {
     unsigned int lruclock;      /* Clock for LRU eviction */
     int shutdown_asap;          /* SHUTDOWN needed ASAP */
     int activerehashing;        /* Incremental rehash in serverCron() */
+    int active_rehashing_budget_us; /* Rehash time per event loop iteration,
+                                       or 0 to rehash only in serverCron(). */
+    int busy_poll_us;           /* Spin before sleeping in the event loop,
+                                   see aeSetBusyPoll(). */
+    int busy_poll_max_cpu;      /* Max percentage of time spent spinning. */
+    int busy_poll_socket_us;    /* SO_BUSY_POLL of the client sockets. */
+    int hash_function;          /* Keys hash function, see DICT_HASH_*. */
     int active_defrag_running;  /* Active defragmentation running (holds current scan aggressiveness) */
     char *requirepass;          /* Pass for AUTH command, or NULL */
     char *pidfile;              /* PID file path */
+    char *server_cpulist;       /* CPUs of the main thread, or NULL. */
+    char *bio_cpulist;          /* CPUs of the bio threads, or NULL. */
+    char *io_threads_cpulist;   /* CPUs of the I/O threads, or NULL. */
+    int numa_bind;              /* NUMA_BIND_* memory policy. */
     int arch_bits;              /* 32 or 64 depending on sizeof(long) */
     int cronloops;              /* Number of times the cron function run */
     char runid[CONFIG_RUN_ID_SIZE+1];  /* ID always different at every exec. */
@@ -1030,28 +1423,54 @@ struct redisServer {
     /* Networking */
     int port;                   /* TCP listening port */
     int tcp_backlog;            /* TCP listen() backlog */
+    int metrics_port;           /* Port of the metrics endpoint, or 0. */
+    int metrics_fd;             /* Its listening socket, or -1. */
     char *bindaddr[CONFIG_BINDADDR_MAX]; /* Addresses we should bind to */
     int bindaddr_count;         /* Number of addresses in server.bindaddr[] */
     char *unixsocket;           /* UNIX socket path */
     mode_t unixsocketperm;      /* UNIX socket permission */
-    int ipfd[CONFIG_BINDADDR_MAX]; /* TCP socket file descriptors */
+    int tcp_listeners;          /* Listening sockets per bind address */
+    int ipfd[CONFIG_BINDADDR_MAX*CONFIG_MAX_TCP_LISTENERS]; /* TCP socket file descriptors */
     int ipfd_count;             /* Used slots in ipfd[] */
     int sofd;                   /* Unix socket file descriptor */
     int cfd[CONFIG_BINDADDR_MAX];/* Cluster bus listening socket */
     int cfd_count;              /* Used slots in cfd[] */
+    int tls_port;               /* TLS listening port, or 0 */
+    int tlsfd[CONFIG_BINDADDR_MAX*2]; /* TLS socket file descriptors */
+    int tlsfd_count;            /* Used slots in tlsfd[] */
+    char *tls_cert_file;        /* PEM certificate chain of this server */
+    char *tls_key_file;         /* Its private key, if not in tls_cert_file */
+    char *tls_ca_cert_file;     /* If set peers must present a certificate
+                                   signed by this CA. */
+    int tls_replication;        /* Connect to the master using TLS? */
+    int tls_cluster;            /* Use TLS for the cluster bus? */
+    int tls_handshake_threads;  /* Threads performing the TLS handshakes. */
     list *clients;              /* List of active clients */
+    rax *clients_index;         /* Active clients by ID, see lookupClientByID. */
     list *clients_to_close;     /* Clients to close asynchronously */
     list *clients_pending_write; /* There is to write or install handler. */
+    list *clients_pending_read;  /* Client has pending read socket buffers. */
+    list *clients_waiting_aof;   /* Replies held by the AOF group commit. */
     list *slaves, *monitors;    /* List of slaves and MONITORs */
     client *current_client; /* Current client, only used on crash report */
     int clients_paused;         /* True if clients are currently paused */
     mstime_t clients_pause_end_time; /* Time when we undo clients_paused */
     char neterr[ANET_ERR_LEN];   /* Error buffer for anet.c */
     dict *migrate_cached_sockets;/* MIGRATE cached sockets */
+    list *migrate_slot_jobs;    /* MIGRATE ... SLOT jobs in progress. */
+    list *keys_jobs;            /* KEYS cursor jobs in progress. */
+    long long keys_jobs_timer;  /* Time event running them, -1 if none. */
+    long long keys_job_threshold; /* Keys of a DB for KEYS to be a job. */
+    list *bgread_jobs;          /* Background reads in progress. */
+    int bgread_pinned;          /* Values walked by the background reads. */
+    long long bgread_threshold; /* Elements of a read to run in background. */
+    long long reply_stream_threshold; /* Elements of a read to stream. */
     uint64_t next_client_id;    /* Next client unique ID. Incremental. */
     int protected_mode;         /* Don't accept external connections. */
     /* RDB / AOF loading information */
     int loading;                /* We are loading data from disk if true */
+    int async_loading;          /* Loading aside the served dataset, see
+                                   repl-async-load. */
     off_t loading_total_bytes;
     off_t loading_loaded_bytes;
     time_t loading_start_time;
@@ -1059,35 +1478,81 @@ struct redisServer {
     /* Fast pointers to often looked up command */
     struct redisCommand *delCommand, *multiCommand, *lpushCommand, *lpopCommand,
                         *rpopCommand, *sremCommand, *execCommand, *expireCommand,
-                        *pexpireCommand;
+                        *pexpireCommand, *hdelCommand, *ltrimCommand,
+                        *xclaimCommand, *xgroupCommand;
     /* Fields used only for stats */
     time_t stat_starttime;          /* Server start time */
     long long stat_numcommands;     /* Number of processed commands */
     long long stat_numconnections;  /* Number of connections received */
     long long stat_expiredkeys;     /* Number of expired keys */
+    long long stat_expired_fields;  /* Number of expired hash fields */
+    double stat_expired_stale_perc; /* Running avg of stale keys sampled */
+    long long stat_expire_loop_lag; /* Running avg of serverCron() lag, ms */
+    long long stat_expire_cycle_time_cap_reached; /* Expire cycles that hit
+                                                     their time limit. */
     long long stat_evictedkeys;     /* Number of evicted keys (maxmemory) */
+    long long stat_evictedkeys_ahead; /* Keys evicted ahead of time */
+    long long stat_bgread_jobs;     /* Reads executed in background. */
+    long long stat_bgread_waits;    /* Writes waiting for them. */
+    long long stat_streamed_replies; /* Reads streamed by the main thread. */
     long long stat_keyspace_hits;   /* Number of successful lookups of keys */
     long long stat_keyspace_misses; /* Number of failed lookups of keys */
     long long stat_active_defrag_hits;      /* number of allocations moved */
     long long stat_active_defrag_misses;    /* number of allocations scanned but not moved */
     long long stat_active_defrag_key_hits;  /* number of keys with moved allocations */
     long long stat_active_defrag_key_misses;/* number of keys scanned and not moved */
+    long long stat_active_defrag_type_hits[OBJ_STREAM+1]; /* allocations moved by value type */
     size_t stat_peak_memory;        /* Max used memory record */
+    size_t stat_clients_normal_memory; /* Memory of the normal clients as of
+                                          their last visit by clientsCron(). */
     long long stat_fork_time;       /* Time needed to perform latest fork() */
     double stat_fork_rate;          /* Fork rate in GB/sec. */
     long long stat_rejected_conn;   /* Clients rejected because of maxclients */
     long long stat_sync_full;       /* Number of full resyncs with slaves. */
     long long stat_sync_partial_ok; /* Number of accepted PSYNC requests. */
+    long long stat_sync_resume_ok;  /* Number of resumed diskless transfers. */
+    long long stat_repl_compress_in;  /* Stream bytes framed for slaves, */
+    long long stat_repl_compress_out; /* and size of the frames. */
     long long stat_sync_partial_err;/* Number of unaccepted PSYNC requests. */
+    struct {
+        long long calls;
+        long long usec;             /* Cumulative time spent in the phase. */
+        long long max_usec;         /* Longest run of the phase. */
+    } el_phase[EL_PHASE_COUNT];
+    long long el_events_start;      /* When aeProcessEvents() woke up, us. */
     list *slowlog;                  /* SLOWLOG list of commands */
     long long slowlog_entry_id;     /* SLOWLOG current entry ID */
     long long slowlog_log_slower_than; /* SLOWLOG time limit (to get logged) */
     unsigned long slowlog_max_len;     /* SLOWLOG max number of items logged */
+    struct hotkeysTracker *hotkeys; /* Hot keys tracker, NULL if disabled. */
+    long long hotkeys_top_k;        /* Hot keys to track, 0 to disable. */
+    struct commandTracer *tracer;   /* Sampled commands, NULL if disabled. */
+    long long trace_sample_rate;    /* Trace 1 command every N, 0 disables. */
+    long long trace_max_len;        /* Entries of the tracer ring. */
+    struct memPrefixProfiler *memprefix; /* Memory by key prefix, NULL if
+                                            disabled. */
+    long long memory_prefixes_scan_keys; /* Keys scanned per cron call. */
+    char *memory_prefixes_delimiter;     /* End of the key prefixes. */
+    struct allocProfiler *allocprof; /* Allocations by command, NULL until
+                                        first enabled. */
+    int alloc_profiler;             /* Account the allocations of commands. */
+    unsigned long long tracking_clients; /* Clients with tracking enabled. */
+    long long tracking_table_max_keys;   /* Tracking table size limit, 0 for
+                                            no limit. */
     size_t resident_set_size;       /* RSS sampled in serverCron(). */
     long long stat_net_input_bytes; /* Bytes read from network. */
     long long stat_net_output_bytes; /* Bytes written to network. */
+    long long stat_cluster_bus_input_bytes;  /* Bytes read from cluster bus. */
+    long long stat_cluster_bus_output_bytes; /* Bytes written to cluster bus. */
     size_t stat_rdb_cow_bytes;      /* Copy on write bytes during RDB saving. */
     size_t stat_aof_cow_bytes;      /* Copy on write bytes during AOF rewrite. */
+    long long stat_io_reads_processed; /* Number of read events processed by IO threads */
+    long long stat_io_writes_processed; /* Number of write events processed by IO threads */
+    long long stat_writev_calls;    /* Number of writev() calls flushing replies. */
+    long long stat_writev_iovecs;   /* Total iovecs passed to those writev(). */
+    long long stat_writev_bytes;    /* Total bytes written by those writev(). */
+    long long stat_qbuf_pool_hits;  /* Reads served by a pooled query buffer. */
+    long long stat_qbuf_pool_misses;/* Reads that had to allocate a new one. */
     /* The following two are used to track instantaneous metrics, like
      * number of operations per second, network traffic. */
     struct {
@@ -1102,17 +1567,36 @@ struct redisServer {
     int tcpkeepalive;               /* Set SO_KEEPALIVE if non-zero. */
     int active_expire_enabled;      /* Can be disabled for testing purposes. */
     int active_defrag_enabled;
+    int huge_pages;                 /* Keyspace backed by huge pages. */
+    int transient_arena;            /* Buffers in a jemalloc arena of their own. */
     size_t active_defrag_ignore_bytes; /* minimum amount of fragmentation waste to start active defrag */
     int active_defrag_threshold_lower; /* minimum percentage of fragmentation to start active defrag */
     int active_defrag_threshold_upper; /* maximum percentage of fragmentation at which we use maximum effort */
     int active_defrag_cycle_min;       /* minimal effort for defrag in CPU percentage */
     int active_defrag_cycle_max;       /* maximal effort for defrag in CPU percentage */
+    long active_defrag_max_scan_fields; /* larger values are defragged incrementally, across cycles */
+    int active_expire_cycle_min;       /* minimal effort for expire in CPU percentage */
+    int active_expire_cycle_max;       /* maximal effort for expire in CPU percentage */
+    double active_expire_effort;       /* Current effort for expire, see
+                                          activeExpireUpdateEffort() */
     size_t client_max_querybuf_len; /* Limit for client query buffer length */
     int dbnum;                      /* Total number of configured DBs */
     int supervised;                 /* 1 if supervised, 0 otherwise. */
     int supervised_mode;            /* See SUPERVISED_* */
     int daemonize;                  /* True if running as a daemon */
     clientBufferLimitsConfig client_obuf_limits[CLIENT_TYPE_OBUF_COUNT];
+    /* Threaded I/O */
+    int io_threads_num;             /* Number of IO threads to use. */
+    int io_threads_do_reads;        /* Read and parse from IO threads? */
+    int slave_parallel_reads;       /* Execute the read only commands of a
+                                       slave in the IO threads? */
+    int io_threads_shards;          /* Route the commands executed by the
+                                       IO threads by the slot of the key. */
+    int io_threads_exec_active;     /* IO threads executing commands now. */
+    int module_read_shared;         /* Modules threads may be reading the
+                                       dataset in parallel now, see
+                                       RM_ThreadSafeContextReadLock(). */
+    long long stat_io_commands_processed; /* Commands executed by IO threads */
     /* AOF persistence */
     int aof_state;                  /* AOF_(ON|OFF|WAIT_REWRITE) */
     int aof_fsync;                  /* Kind of fsync() policy */
@@ -1122,6 +1606,14 @@ struct redisServer {
     off_t aof_rewrite_min_size;     /* the AOF file is at least N bytes. */
     off_t aof_rewrite_base_size;    /* AOF size on latest startup or rewrite. */
     off_t aof_current_size;         /* AOF current size. */
+    off_t aof_fd_size;              /* Size of the file of aof_fd. */
+    int aof_multi_part;             /* Base and incremental files. */
+    aofManifest *aof_manifest;      /* Files of the multi part AOF. */
+    int aof_group_commit;           /* Write and fsync from a thread. */
+    int aof_binary_format;          /* Write binary records, not RESP. */
+    long long aof_binary_epoch;     /* Bumped when a new file is started. */
+    int aof_binary_last_id;         /* Last command ID assigned. */
+    aofWriter *aof_writer;          /* Group commit thread, if started. */
     int aof_rewrite_scheduled;      /* Rewrite once BGSAVE terminates. */
     pid_t aof_child_pid;            /* PID if rewriting process */
     list *aof_rewrite_buf_blocks;   /* Hold changes during an AOF rewrite. */
@@ -1138,6 +1630,7 @@ struct redisServer {
     int aof_last_write_status;      /* C_OK or C_ERR */
     int aof_last_write_errno;       /* Valid if aof_last_write_status is ERR */
     int aof_load_truncated;         /* Don't stop on unexpected AOF EOF. */
+    int aof_load_prefetch;          /* Parse the AOF in a thread on load. */
     int aof_use_rdb_preamble;       /* Use RDB preamble on AOF rewrites. */
     /* AOF pipes used to communicate between parent and child during rewrite. */
     int aof_pipe_write_data_to_child;
@@ -1157,7 +1650,16 @@ struct redisServer {
     int saveparamslen;              /* Number of saving points */
     char *rdb_filename;             /* Name of RDB file */
     int rdb_compression;            /* Use compression in RDB? */
+    int rdb_compression_codec;      /* RDB_ENC_* codec of the strings. */
+    int rdb_compress_chunks;        /* Compress RDB chunks as a whole. */
     int rdb_checksum;               /* Use RDB checksum? */
+    int rdb_load_threads;           /* Threads decoding the RDB on load. */
+    int rdb_save_threads;           /* Threads serializing the RDB. */
+    int rdb_load_mmap;              /* Load RDB files from a mapping. */
+    int lazy_loading;               /* Load the values on first access. */
+    int rdb_save_bypass_cache;      /* RDB_BYPASS_CACHE_* mode. */
+    int rdb_save_forkless;          /* BGSAVE without forking. */
+    struct rdbSnapshot *rdb_snapshot; /* Fork-less BGSAVE, NULL if none. */
     time_t lastsave;                /* Unix time of last successful save */
     time_t lastbgsave_try;          /* Unix time of last attempted bgsave */
     time_t rdb_save_time_last;      /* Time used by last RDB save run. */
@@ -1175,8 +1677,16 @@ struct redisServer {
         size_t cow_size;            /* Copy on write size. */
         unsigned long long magic;   /* Magic value to make sure data is valid. */
     } child_info_data;
+    size_t stat_current_cow_bytes;  /* COW of the running child so far. */
+    mstime_t stat_current_cow_updated; /* When it was last reported. */
+    long long stat_cow_writes[OBJ_STREAM+2]; /* Keys written by the parent
+                                       while a child runs, by type, plus
+                                       the keys deleted as the last one. */
     /* Propagation of commands in AOF / replication */
     redisOpArray also_propagate;    /* Additional command to propagate. */
+    redisOpArray exec_propagate;    /* Commands of the EXEC being executed
+                                       to propagate in a single block. */
+    int exec_propagate_batch;       /* Batch propagate() in exec_propagate. */
     /* Logging */
     char *logfile;                  /* Path of log file */
     int syslog_enabled;             /* Is syslog enabled? */
@@ -1196,6 +1706,10 @@ struct redisServer {
                                        that is the next byte will'll write to.*/
     long long repl_backlog_off;     /* Replication "master offset" of first
                                        byte in the replication backlog buffer.*/
+    long long repl_backlog_disk_size; /* Max older backlog kept on disk. */
+    list *repl_backlog_segments;    /* Its segments, oldest first. */
+    long long repl_backlog_disk_off; /* Replication offset of its first byte */
+    long long repl_backlog_disk_histlen; /* and its length. */
     time_t repl_backlog_time_limit; /* Time without slaves after the backlog
                                        gets released. */
     time_t repl_no_slaves_since;    /* We have no slaves since that time.
@@ -1205,6 +1719,18 @@ struct redisServer {
     int repl_good_slaves_count;     /* Number of slaves with lag <= max_lag. */
     int repl_diskless_sync;         /* Send RDB to slaves sockets directly. */
     int repl_diskless_sync_delay;   /* Delay to start a diskless repl BGSAVE. */
+    int repl_compression;           /* LZF frame the stream to the slaves. */
+    sds repl_compress_buf;          /* Stream for them since the last flush. */
+    int repl_compress_slaves;       /* Slaves receiving the framed stream. */
+    replBuffer *repl_buffer;        /* Stream shared by the slaves, and */
+    replBuffer *repl_compress_buffer; /* the framed one. */
+    int repl_diskless_resume_window; /* Seconds a diskless transfer can be
+                                        resumed after a disconnection. */
+    char *repl_spool_file;          /* Copy of the last diskless RDB stream. */
+    char repl_spool_replid[CONFIG_RUN_ID_SIZE+1]; /* Its FULLRESYNC replid */
+    long long repl_spool_offset;    /* and offset. */
+    off_t repl_spool_size;          /* Spool size, -1 while being written. */
+    time_t repl_spool_time;         /* Unix time the spool was completed. */
     /* Replication (slave) */
     char *masterauth;               /* AUTH with this password with master */
     char *masterhost;               /* Hostname of master */
@@ -1220,6 +1746,13 @@ struct redisServer {
     int repl_transfer_s;     /* Slave -> Master SYNC socket */
     int repl_transfer_fd;    /* Slave -> Master SYNC temp file descriptor */
     char *repl_transfer_tmpfile; /* Slave-> master SYNC temp file name */
+    int repl_transfer_resumable; /* Transfer can be resumed if interrupted. */
+    char *repl_resume_tmpfile;   /* Interrupted diskless transfer, or NULL. */
+    off_t repl_resume_read;      /* Bytes of it already received. */
+    time_t repl_resume_since;    /* Unix time it was interrupted. */
+    char repl_resume_mark[RDB_EOF_MARK_SIZE+1]; /* Its EOF mark, */
+    char repl_resume_replid[CONFIG_RUN_ID_SIZE+1]; /* FULLRESYNC replid */
+    long long repl_resume_initial_offset;          /* and offset. */
     time_t repl_transfer_lastio; /* Unix time of the latest read, for timeout */
     int repl_serve_stale_data; /* Serve stale data when link is down? */
     int repl_slave_ro;          /* Slave is read only? */
@@ -1233,24 +1766,44 @@ struct redisServer {
      * the server->master client structure. */
     char master_replid[CONFIG_RUN_ID_SIZE+1];  /* Master PSYNC runid. */
     long long master_initial_offset;           /* Master PSYNC offset. */
+    int master_compress;                       /* Master PSYNC LZF frames. */
     int repl_slave_lazy_flush;          /* Lazy FLUSHALL before loading DB? */
+    int repl_async_load;                /* Load the DB aside serving the old
+                                           one, see repl-async-load. */
+    int repl_diskless_load;             /* Load the RDB from the socket. */
     /* Replication script cache. */
     dict *repl_scriptcache_dict;        /* SHA1 all slaves are aware of. */
     list *repl_scriptcache_fifo;        /* First in, first out LRU eviction. */
     unsigned int repl_scriptcache_size; /* Max number of elements. */
     /* Synchronous replication. */
-    list *clients_waiting_acks;         /* Clients waiting in WAIT command. */
+    rax *clients_waiting_acks;          /* Clients waiting in WAIT command,
+                                           by offset, see waitCommand(). */
     int get_ack_from_slaves;            /* If true we send REPLCONF GETACK. */
+    int slaves_acks_changed;            /* Some slave acked a new offset. */
+    int slave_fast_ack;                 /* ACK the master at every iteration
+                                           applying its stream? */
+    long long repl_ack_sent_off;        /* Offset of the last ACK we sent. */
     /* Limits */
     unsigned int maxclients;            /* Max number of simultaneous clients */
     unsigned long long maxmemory;   /* Max number of memory bytes to use */
     int maxmemory_policy;           /* Policy for key eviction */
     int maxmemory_samples;          /* Pricision of random sampling */
+    int maxmemory_headroom;         /* % of maxmemory to keep free by evicting
+                                       ahead of time, 0 to disable. */
+    int maxmemory_headroom_budget_us; /* Eviction ahead of time per event
+                                         loop iteration. */
+    int tiering;                    /* Move the values evicted to a file. */
+    char *tiering_dir;              /* Directory of the tiering file. */
+    long long tiering_max_size;     /* Max size of the tiering files, 0 if
+                                       unlimited. */
     int lfu_log_factor;             /* LFU logarithmic counter factor. */
     int lfu_decay_time;             /* LFU counter decay factor. */
     /* Blocked clients */
     unsigned int bpop_blocked_clients; /* Number of clients blocked by lists */
     list *unblocked_clients; /* list of clients to unblock before next loop */
+    rax *clients_timeout_table; /* Blocked clients by deadline, then ID. */
+    long long clients_timeout_timer; /* Time event of the first deadline. */
+    mstime_t clients_timeout_when; /* When clients_timeout_timer fires. */
     list *ready_keys;        /* List of readyList structures for BLPOP & co */
     /* Sort parameters - qsort_r() is only available under BSD so we
      * have to take this state global, in order to pass it to sortCompare() */
@@ -1264,16 +1817,41 @@ struct redisServer {
     size_t set_max_intset_entries;
     size_t zset_max_ziplist_entries;
     size_t zset_max_ziplist_value;
+    size_t zset_max_skiplist_entries;
+    long long adaptive_encoding_hot_counter; /* LFU counter of hot keys. */
+    long long adaptive_encoding_cold_seconds; /* Idle time of cold keys. */
+    int adaptive_encoding_db;   /* DB and cursor of the background walk */
+    unsigned long adaptive_encoding_cursor; /* compacting cold keys. */
+    size_t stream_node_max_bytes;
+    long long stream_node_max_entries;
     size_t hll_sparse_max_bytes;
+    size_t bitmap_chunked_min_bytes;
+    size_t string_compression_min_bytes;
+    /* Set algebra threads, see redis.conf for more information */
+    int set_algebra_threads;
+    size_t set_algebra_parallel_threshold;
     /* List parameters */
     int list_max_ziplist_size;
     int list_compress_depth;
+    int list_node_container;    /* Container of new list nodes, see
+                                   QUICKLIST_NODE_CONTAINER_*. */
+    int list_node_container_conversion; /* LIST_CONVERSION_* */
+    int list_conversion_pending; /* Lists may use another container. */
+    int list_conversion_db;     /* DB and cursor of the background walk */
+    unsigned long list_conversion_cursor; /* converting the lists. */
     /* time cache */
     time_t unixtime;    /* Unix time sampled every cron cycle. */
     long long mstime;   /* Like 'unixtime' but with milliseconds resolution. */
     /* Pubsub */
     dict *pubsub_channels;  /* Map channels to list of subscribed clients */
+    dict *pubsubshard_channels; /* Map shard channels to list of subscribed
+                                   clients */
     list *pubsub_patterns;  /* A list of pubsub_patterns */
+    rax *pubsub_patterns_index; /* Literal prefix of the patterns -> list of
+                                   pubsub_patterns. The empty prefix holds
+                                   the ones starting with a wildcard. */
+    long pubsub_keyspace_subscriptions; /* Channels and patterns that may
+                                           receive keyspace notifications. */
     int notify_keyspace_events; /* Events to propagate via Pub/Sub. This is an
                                    xor of NOTIFY_... flags. */
     /* Cluster */
@@ -1282,9 +1860,12 @@ struct redisServer {
     char *cluster_configfile; /* Cluster auto-generated config file name. */
     clusterState *cluster;  /* State of the cluster */
     int cluster_migration_barrier; /* Cluster replicas migration barrier. */
+    long long cluster_migrate_inflight_bytes; /* MIGRATE SLOT unacked bytes. */
     int cluster_slave_validity_factor; /* Slave max data age for failover. */
     int cluster_require_full_coverage; /* If true, put the cluster down if
                                           there is at least an uncovered slot.*/
+    int cluster_bus_compact;  /* Send compact messages to the nodes accepting
+                                 them. */
     char *cluster_announce_ip;  /* IP address to announce on cluster bus. */
     int cluster_announce_port;     /* base port to announce on cluster bus. */
     int cluster_announce_bus_port; /* bus port to announce on cluster bus. */
@@ -1293,6 +1874,10 @@ struct redisServer {
     client *lua_client;   /* The "fake client" to query Redis from Lua */
     client *lua_caller;   /* The client running EVAL right now, or NULL */
     dict *lua_scripts;         /* A dictionary of SHA1 -> Lua scripts */
+    dict *lua_functions;  /* Name -> luaFunction loaded by FUNCTION LOAD */
+    dict *lua_script_stats; /* SHA1, or "f:" and the function name ->
+                               scriptStats, for SCRIPT STATS. */
+    struct scriptStats *lua_cur_stats; /* Stats of the running script. */
     mstime_t lua_time_limit;  /* Script timeout in milliseconds */
     mstime_t lua_time_start;  /* Start time of script, milliseconds time */
     int lua_write_dirty;  /* True if a write command was called during the
@@ -1306,10 +1891,18 @@ struct redisServer {
                              execution. */
     int lua_kill;         /* Kill the script if true. */
     int lua_always_replicate_commands; /* Default replication type. */
+    int lua_parallel_scripts; /* Execute EVAL_RO / EVALSHA_RO in the IO
+                                 threads? */
+    long long lua_scripts_epoch; /* Incremented by SCRIPT FLUSH, so that the
+                                    IO threads drop their compiled scripts. */
     /* Lazy free */
     int lazyfree_lazy_eviction;
     int lazyfree_lazy_expire;
     int lazyfree_lazy_server_del;
+    int lazyfree_threads;           /* Threads of the BIO_LAZY_FREE pool. */
+    long long lazyfree_auto_threshold; /* Free effort always freed lazily. */
+    int active_expire_index;        /* Index the expires in order of time. */
+    int keyspace_index;             /* Index the keys in lexicographic order. */
     /* Latency monitor */
     long long latency_monitor_threshold;
     dict *latency_events;
@@ -1327,11 +1920,19 @@ struct redisServer {
     pthread_mutex_t lruclock_mutex;
     pthread_mutex_t next_client_id_mutex;
     pthread_mutex_t unixtime_mutex;
+    pthread_mutex_t stat_net_input_bytes_mutex;
+    pthread_mutex_t stat_net_output_bytes_mutex;
+    pthread_mutex_t stat_writev_calls_mutex;
+    pthread_mutex_t stat_writev_iovecs_mutex;
+    pthread_mutex_t stat_writev_bytes_mutex;
+    pthread_mutex_t stat_qbuf_pool_hits_mutex;
+    pthread_mutex_t stat_qbuf_pool_misses_mutex;
 };
 
 struct pubsubPattern {
     client *client;
     robj *pattern;
+    stringmatchPattern match;   /* The pattern after its literal prefix. */
 };
 
 typedef void redisCommandProc(client *c);
@@ -1350,6 +1951,13 @@ struct redisCommand {
     int lastkey;  /* The last argument that's a key */
     int keystep;  /* The step between first and last key */
     long long microseconds, calls;
+    /* Binary AOF command ID, and the aof_binary_epoch it was bound in. */
+    int aof_id;
+    long long aof_epoch;
+    /* Latency of the calls, allocated on the first call. */
+    struct latencyHistogram *latency_hist;
+    /* Allocations made by the calls, see allocstats.cpp. */
+    long long alloc_calls, allocs, alloc_bytes;
 };
 
 struct redisFunctionSym {
@@ -1418,6 +2026,7 @@ public:
 
 private:
     int m_intset_iter; /* intset iterator */
+    roaringIterator m_roaring_iter;
     dictIterator *m_dict_iter;
 };
 
@@ -1430,11 +2039,11 @@ struct hashTypeIterator : public genericIterator
     hashTypeIterator(robj* in_subject);
     ~hashTypeIterator();
     int hashTypeNext();
-    void hashTypeCurrentFromZiplist(int what,
+    void hashTypeCurrentFromListpack(int what,
                                 unsigned char **vstr,
                                 unsigned int *vlen,
                                 long long *vll);
-    sds hashTypeCurrentFromHashTable(int what);
+    void hashTypeCurrentFromHashTable(int what, sds *vstr, long long *vll);
     void hashTypeCurrentObject(int what, unsigned char **vstr, unsigned int *vlen, long long *vll);
     sds hashTypeCurrentObjectNewSds(int what);
     int encoding() {return m_encoding;}
@@ -1457,17 +2066,22 @@ private:
 
 extern struct redisServer server;
 extern struct sharedObjectsStruct shared;
+extern __thread client *io_thread_current_client;
 extern dictType objectKeyPointerValueDictType;
+extern dictType objectKeyHeapPointerValueDictType;
 extern dictType setDictType;
 extern dictType zsetDictType;
 extern dictType clusterNodesDictType;
 extern dictType clusterNodesBlackListDictType;
 extern dictType dbDictType;
 extern dictType shaScriptObjectDictType;
+extern dictType luaFunctionDictType;
+extern dictType scriptStatsDictType;
 extern double R_Zero, R_PosInf, R_NegInf, R_Nan;
 extern dictType hashDictType;
 extern dictType replScriptCacheDictType;
 extern dictType keyptrDictType;
+extern dictType slotKeysDictType;
 extern dictType modulesDictType;
 
 /*-----------------------------------------------------------------------------
@@ -1488,6 +2102,11 @@ void moduleBlockedClientPipeReadable(aeEventLoop *el, int fd, void *privdata, in
 size_t moduleCount();
 void moduleAcquireGIL();
 void moduleReleaseGIL();
+void moduleAcquireGILAfterSleep(void);
+void moduleReleaseGILBeforeSleep(void);
+void moduleNotifyKeyspaceEvent(int type, const char *event, robj *key, int dbid);
+int moduleHasCommandFilters(void);
+void moduleCallCommandFilters(client *c);
 
 /* Utils */
 long long ustime();
@@ -1497,6 +2116,9 @@ uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l);
 void exitFromChild(int retcode);
 size_t redisPopcount(void *s, long count);
 void redisSetProcTitle(char *title);
+#ifdef REDIS_TEST
+int microbenchMain(int argc, char **argv);
+#endif
 
 /* networking.c -- Networking and Client related operations */
 client *createClient(int fd);
@@ -1506,25 +2128,53 @@ void freeClientAsync(client *c);
 void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask);
 void acceptHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void acceptTcpHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+void freeClientQueryBuffer(client *c);
+void initAcceptThreads(void);
+void acceptTLSHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void acceptUnixHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask);
 void copyClientOutputBuffer(client *dst, client *src);
 size_t sdsZmallocSize(sds s);
 size_t getStringObjectSdsUsedMemory(robj *o);
 void *dupClientReplyValue(void *o);
-void getClientsMaxBuffers(unsigned long *longest_output_list,
-                          unsigned long *biggest_input_buffer);
+void getExpansiveClientsInfo(unsigned long *longest_output_list,
+                             unsigned long *biggest_input_buffer);
 sds getAllClientsInfoString();
+client *lookupClientByID(uint64_t id);
 unsigned long getClientOutputBufferMemoryUsage(client *c);
 void freeClientsInAsyncFreeQueue();
 void flushSlavesOutputBuffers();
 void disconnectSlaves();
-int listenToPort(int port, int *fds, int *count);
+int listenToPort(int port, int *fds, int *count, int reuseport);
 void pauseClients(mstime_t duration);
 int clientsArePaused();
 int processEventsWhileBlocked();
 int handleClientsWithPendingWrites();
 int writeToClient(int fd, client *c, int handler_installed);
+void startReplyProducer(client *c, replyProducerProc *produce, clientResumeFreeProc *free_privdata, void *privdata);
+void produceClientReply(client *c);
+void initThreadedIO();
+int stopThreadedIOIfNeeded();
+int commandCanExecuteInThread(struct redisCommand *cmd);
+int postponeClientRead(client *c);
+int handleClientsWithPendingWritesUsingThreads();
+int handleClientsWithPendingReadsUsingThreads();
+sds catIOThreadsCommands(sds s);
+void resetIOThreadsCommands(void);
+
+/* The client of the command being executed: the one the calling IO thread
+ * is executing, see slave-parallel-reads, or server.current_client. */
+static inline client *executingClient(void) {
+    return io_thread_current_client ? io_thread_current_client :
+                                      server.current_client;
+}
+
+/* True when other threads may be reading the dataset at the same time as
+ * the caller: the IO threads executing commands, or the modules threads
+ * holding the read lock. The dataset must then be accessed read only. */
+static inline int datasetReadShared(void) {
+    return server.io_threads_exec_active || server.module_read_shared;
+}
 
 #ifdef __GNUC__
 void addReplyErrorFormat(client *c, const char *fmt, ...)
@@ -1547,9 +2197,14 @@ robj *listTypeGet(listTypeEntry *entry);
 void listTypeInsert(listTypeEntry *entry, robj *value, int where);
 int listTypeEqual(listTypeEntry *entry, robj *o);
 void listTypeConvert(robj *subject, int enc);
-void handleClientsBlockedOnLists();
+void listContainerConversionCron(void);
+void handleClientsBlockedOnList(redisDb *db, robj *key, robj *o);
 void popGenericCommand(client *c, int where);
-void signalListAsReady(redisDb *db, robj *key);
+
+/* Stream data type. */
+int streamParseIDOrReply(client *c, robj *o, streamID *id, uint64_t missing_seq);
+sds streamIDToSds(streamID *id);
+void handleClientsBlockedOnStream(redisDb *db, robj *key, robj *o);
 
 /* MULTI/EXEC/WATCH... */
 void initClientMultiState(client *c);
@@ -1559,6 +2214,13 @@ void touchWatchedKey(redisDb *db, robj *key);
 void touchWatchedKeysOnFlush(int dbid);
 void flagTransaction(client *c);
 void execCommandPropagateMulti(client *c);
+void execPropagate(struct redisCommand *cmd, int dbid, robj **argv, int argc, int target);
+void execFlushPropagation(void);
+
+/* HyperLogLog */
+void hllTouchKey(redisDb *db, robj *key);
+void hllFlushUnionCache(redisDb *db);
+uint64_t MurmurHash64A(const void *key, int len, unsigned int seed);
 
 /* Redis object implementation */
 void decrRefCount(robj *o);
@@ -1566,6 +2228,7 @@ void decrRefCountVoid(void *o);
 void incrRefCount(robj *o);
 robj *makeObjectShared(robj *o);
 robj *resetRefCount(robj *obj);
+void freeObjectValue(robj *o);
 void freeStringObject(robj *o);
 void freeListObject(robj *o);
 void freeSetObject(robj *o);
@@ -1575,22 +2238,38 @@ robj *createObject(int type, void *ptr);
 robj *createStringObject(const char *ptr, size_t len);
 robj *createRawStringObject(const char *ptr, size_t len);
 robj *createEmbeddedStringObject(const char *ptr, size_t len);
+size_t embeddedStringObjectSize(size_t len);
+robj *initEmbeddedStringObject(void *buf, const char *ptr, size_t len);
 robj *dupStringObject(const robj *o);
 int isSdsRepresentableAsLongLong(sds s, long long *llval);
 int isObjectRepresentableAsLongLong(robj *o, long long *llongval);
 robj *tryObjectEncoding(robj *o);
 robj *getDecodedObject(robj *o);
 size_t stringObjectLen(robj *o);
+#define OBJ_COMPUTE_SIZE_DEF_SAMPLES 5 /* Default sample size. */
+size_t objectComputeSize(robj *o, size_t sample_size);
 robj *createStringObjectFromLongLong(long long value);
 robj *createStringObjectFromLongDouble(long double value, int humanfriendly);
 robj *createQuicklistObject();
 robj *createZiplistObject();
 robj *createSetObject();
 robj *createIntsetObject();
+robj *createRoaringSetObject(roaring *r);
+robj *createChunkedBitmapObject(chunkedBitmap *cb);
+sds chunkedBitmapObjectToSds(const robj *o);
+void decodeChunkedBitmapObject(robj *o);
+int tryChunkedBitmapEncoding(robj *o, size_t len);
+robj *createCompressedStringObject(int codec, const void *c, size_t clen, size_t len);
+sds compressedStringObjectToSds(const robj *o);
+void decompressStringObject(robj *o);
+int stringCompressionWorthIt(size_t len, size_t clen);
+robj *tryStringCompression(robj *o);
 robj *createHashObject();
 robj *createZsetObject();
-robj *createZsetZiplistObject();
+robj *createZsetListpackObject();
+robj *createZsetBtreeObject();
 robj *createModuleObject(moduleType *mt, void *value);
+robj *createStreamObject();
 int getLongFromObjectOrReply(client *c, robj *o, long *target, const char *msg);
 int checkType(client *c, robj *o, int type);
 int getLongLongFromObjectOrReply(client *c, robj *o, long long *target, const char *msg);
@@ -1600,11 +2279,16 @@ int getLongLongFromObject(robj *o, long long *target);
 int getLongDoubleFromObject(robj *o, long double *target);
 int getLongDoubleFromObjectOrReply(client *c, robj *o, long double *target, const char *msg);
 char *strEncoding(int encoding);
+size_t objectCompactMaxEntries(robj *o, size_t max);
+void adaptiveEncodingCron(void);
 int compareStringObjects(robj *a, robj *b);
 int collateStringObjects(robj *a, robj *b);
 int equalStringObjects(robj *a, robj *b);
 unsigned long long estimateObjectIdleTime(robj *o);
 #define sdsEncodedObject(objptr) (objptr->encoding == OBJ_ENCODING_RAW || objptr->encoding == OBJ_ENCODING_EMBSTR)
+/* A string value stored in the allocation of its keyspace dictEntry, see
+ * dbAddFusedString(). Reference counting is a no-op for it. */
+#define objectIsFused(objptr) ((objptr)->refcount == OBJ_SHARED_REFCOUNT && (objptr)->encoding == OBJ_ENCODING_EMBSTR)
 
 /* Synchronous I/O with timeout */
 ssize_t syncWrite(int fd, char *ptr, ssize_t size, long long timeout);
@@ -1613,6 +2297,7 @@ ssize_t syncReadLine(int fd, char *ptr, ssize_t size, long long timeout);
 
 /* Replication */
 void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc);
+void replicationFeedSlavesOps(list *slaves, redisOp *ops, int numops);
 void replicationFeedSlavesFromMasterStream(list *slaves, char *buf, size_t buflen);
 void replicationFeedMonitors(client *c, list *monitors, int dictid, robj **argv, int argc);
 void updateSlavesWaitingBgsave(int bgsaveerr, int type);
@@ -1627,6 +2312,7 @@ void replicationScriptCacheFlush();
 void replicationScriptCacheAdd(sds sha1);
 int replicationScriptCacheExists(sds sha1);
 void processClientsWaitingReplicas();
+void replicationSendAckIfNeeded();
 void unblockClientWaitingReplicas(client *c);
 int replicationCountAcksByOffset(long long offset);
 void replicationSendNewlineToMaster();
@@ -1638,9 +2324,17 @@ void clearReplicationId2();
 void chopReplicationBacklog();
 void replicationCacheMasterUsingMyself();
 void feedReplicationBacklog(void *ptr, size_t len);
+void replicationFlushCompressedStream();
+int replicationSpoolCreate();
+void replicationSpoolDone(int ok);
+void replicationSpoolDiscard();
+void replicationBacklogDiskTrim();
+void replicationBacklogDiskClose(client *c);
 
 /* Generic persistence functions */
 void startLoading(FILE *fp);
+void startAsyncLoading(FILE *fp);
+void startLoadingStats(FILE *fp);
 void loadingProgress(off_t pos);
 void stopLoading();
 
@@ -1651,9 +2345,22 @@ int rdbSaveRio(rio *rdb, int *error, int flags, rdbSaveInfo *rsi);
 /* AOF persistence */
 void flushAppendOnlyFile(int force);
 void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int argc);
+sds catAppendOnlyCommand(sds buf, struct redisCommand *cmd, int dictid, robj **argv, int argc);
+void feedAppendOnlyFileBuffer(sds buf);
 void aofRemoveTempFile(pid_t childpid);
 int rewriteAppendOnlyFileBackground();
+int rewriteListObject(rio *r, robj *key, robj *o);
+int rewriteSetObject(rio *r, robj *key, robj *o);
+int rewriteSortedSetObject(rio *r, robj *key, robj *o);
+int rewriteHashObject(rio *r, robj *key, robj *o);
 int loadAppendOnlyFile(char *filename);
+int loadAppendOnlyFiles(void);
+void aofLoadManifest(void);
+void aofOpenOnStartup(void);
+int aofClientMustWaitCommit(client *c);
+void aofHoldClientReplies(client *c);
+long long aofGroupCommits(void);
+int aofReadBinaryVarint(FILE *fp, uint64_t *v);
 void stopAppendOnly();
 int startAppendOnly();
 void backgroundRewriteDoneHandler(int exitcode, int bysignal);
@@ -1666,6 +2373,9 @@ void openChildInfoPipe();
 void closeChildInfoPipe();
 void sendChildInfo(int process_type);
 void receiveChildInfo();
+void childInfoStartReports();
+void sendChildCowInfoIfNeeded();
+void childInfoTrackWrite(redisDb *db, robj *key);
 
 /* Sorted sets data type */
 
@@ -1708,12 +2418,17 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range);
 unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range);
 unsigned int zsetLength(const robj *zobj);
 void zsetConvert(robj *zobj, int encoding);
-void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen);
+void zsetConvertToListpackIfNeeded(robj *zobj, size_t maxelelen);
+int zsetCompactIfNeeded(robj *zobj);
+void zsetConvertToBtreeIfNeeded(robj *zobj);
+int zsetLoadSortedPairs(zset *zs, const zskiplistPair *pairs, unsigned long count);
 int zsetScore(robj *zobj, sds member, double *score);
 int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore);
 long zsetRank(robj *zobj, sds ele, int reverse);
+int zsetFirst(robj *zobj, sds *ele, double *score);
 int zsetDel(robj *zobj, sds ele);
-sds ziplistGetObject(unsigned char *sptr);
+sds lpGetObject(unsigned char *sptr);
+int zslPairCompare(const void *a, const void *b);
 int zslValueGteMin(double value, zrangespec *spec);
 int zslValueLteMax(double value, zrangespec *spec);
 void zslFreeLexRange(zlexrangespec *spec);
@@ -1727,14 +2442,22 @@ int zslLexValueLteMax(sds value, zlexrangespec *spec);
 
 /* Core functions */
 int freeMemoryIfNeeded();
+void freeMemoryAheadOfTime(void);
+size_t freeMemoryGetNotCountedMemory();
 int processCommand(client *c);
 void setupSignalHandlers();
 struct redisCommand *lookupCommand(sds name);
+void buildCommandLookupTable(void);
 struct redisCommand *lookupCommandByCString(char *s);
+struct redisCommand *lookupCommandByBuffer(const char *name, size_t len);
+struct redisCommand *lookupCommandReadOnly(sds name);
 struct redisCommand *lookupCommandOrOriginal(sds name);
 void call(client *c, int flags);
 void propagate(struct redisCommand *cmd, int dbid, robj **argv, int argc, int flags);
 void alsoPropagate(struct redisCommand *cmd, int dbid, robj **argv, int argc, int target);
+void redisOpArrayInit(redisOpArray *oa);
+int redisOpArrayAppend(redisOpArray *oa, struct redisCommand *cmd, int dbid, robj **argv, int argc, int target);
+void redisOpArrayFree(redisOpArray *oa);
 void forceCommandPropagation(client *c, int flags);
 void preventCommandPropagation(client *c);
 void preventCommandAOF(client *c);
@@ -1757,7 +2480,11 @@ void adjustOpenFilesLimit();
 void closeListeningSockets(int unlink_unix_socket);
 void updateCachedTime();
 void resetServerStats();
+long long getInstantaneousMetric(int metric);
 void activeDefragCycle();
+#ifdef HAVE_DEFRAG
+void *activeDefragAlloc(void *ptr);
+#endif
 unsigned int getLRUClock();
 unsigned int LRU_CLOCK();
 const char *evictPolicyToString();
@@ -1767,6 +2494,7 @@ void freeMemoryOverheadData(struct redisMemOverhead *mh);
 #define RESTART_SERVER_NONE 0
 #define RESTART_SERVER_GRACEFULLY (1<<0)     /* Do proper shutdown. */
 #define RESTART_SERVER_CONFIG_REWRITE (1<<1) /* CONFIG REWRITE before restart.*/
+#define RESTART_SERVER_HANDOFF (1<<2)       /* Hand the dataset over, see handoff.cpp. */
 int restartServer(int flags, mstime_t delay);
 
 /* Set data type */
@@ -1787,6 +2515,7 @@ void setTypeConvert(robj *subject, int enc);
 #define HASH_SET_COPY 0
 
 void hashTypeConvert(robj *o, int enc);
+int hashTypeCompactIfNeeded(robj *o);
 void hashTypeTryConversion(robj *subject, robj **argv, int start, int end);
 void hashTypeTryObjectEncoding(robj *subject, robj **o1, robj **o2);
 int hashTypeExists(robj *o, sds key);
@@ -1795,13 +2524,76 @@ unsigned long hashTypeLength(const robj *o);
 hashTypeIterator *hashTypeInitIterator(robj *subject);
 void hashTypeReleaseIterator(hashTypeIterator *hi);
 robj *hashTypeLookupWriteOrCreate(client *c, robj *key);
+int hashTypeGetValue(robj *o, sds field, unsigned char **vstr, unsigned int *vlen, long long *vll);
 robj *hashTypeGetValueObject(robj *o, sds field);
 int hashTypeSet(robj *o, sds field, sds value, int flags);
 
+/* The values of hash table encoded hashes that are integers between
+ * HASH_INT_VAL_MIN and HASH_INT_VAL_MAX are stored in the dictionary entry
+ * itself instead of as sds strings, so that counters updated by HINCRBY
+ * are not converted from and to strings at every access. They are told
+ * apart from the sds pointers by the most significant bit, that user
+ * space pointers don't have on the supported platforms. */
+#define HASH_INT_VAL_FLAG ((uint64_t)1<<63)
+#define HASH_INT_VAL_MIN (-(1LL<<62))
+#define HASH_INT_VAL_MAX ((1LL<<62)-1)
+
+static inline int hashDictValIsInt(const dictEntry *de) {
+    return (de->dictGetUnsignedIntegerVal() & HASH_INT_VAL_FLAG) != 0;
+}
+
+static inline long long hashDictValGetInt(const dictEntry *de) {
+    return (long long)(de->dictGetUnsignedIntegerVal() << 1) >> 1;
+}
+
+static inline void hashDictValSetInt(dictEntry *de, long long value) {
+    de->dictSetUnsignedIntegerVal((uint64_t)value | HASH_INT_VAL_FLAG);
+}
+
+/* Hash fields expiration. A hash with fields having a TTL is encoded as a
+ * hash table, whose privdata points to a sorted set of these fields scored
+ * by their expire time, a unix time in milliseconds. The hashes having such
+ * fields are also in the db->m_hexpires sorted set, scored by a time that is
+ * not greater than the one of their first field to expire. */
+#define HASH_FIELD_EXPIRE_MAX ((1LL<<48)-1) /* Exact as a double score. */
+
+static inline robj *hashTypeFieldExpires(const robj *o) {
+    if (o->encoding != OBJ_ENCODING_HT) return NULL;
+    return (robj*)((dict*)o->ptr)->m_privdata;
+}
+
+long long hashTypeGetFieldExpire(robj *o, sds field);
+void hashTypeSetFieldExpire(robj *o, sds field, long long when);
+int hashTypeRemoveFieldExpire(robj *o, sds field);
+unsigned long hashTypeGetFieldExpires(robj *o, zskiplistPair **pairs);
+void hashTypeFreeFieldExpires(robj *o);
+unsigned long hashTypeExpireFields(redisDb *db, robj *key, robj *o,
+                                   long long now, unsigned long max,
+                                   int *keyremoved);
+int hashExpireFieldsIfNeeded(redisDb *db, robj *key, robj *o);
+void hashExpireIndexAdd(redisDb *db, robj *key, robj *o);
+unsigned long hashExpireIndexCycle(redisDb *db, long long now,
+                                   unsigned long max);
+
 /* Pub / Sub */
 void freePubsubPattern(void *p);
 int listMatchPubsubPattern(void *a, void *b);
 int pubsubPublishMessage(robj *channel, robj *message);
+int pubsubPublishShardMessage(robj *channel, robj *message);
+void pubsubShardUnsubscribeAllClients(robj *channel);
+
+/* Client side caching (keys tracking) */
+void enableTracking(client *c, uint64_t redirect_to, int options, robj **prefix, size_t numprefix);
+void disableTracking(client *c);
+int checkPrefixCollisionsOrReply(client *c, robj **prefixes, size_t numprefix);
+void trackingRememberKeys(client *tracking, client *executing);
+void trackingInvalidateKey(robj *keyobj);
+void trackingInvalidateKeysOnFlush(int dbid);
+void trackingLimitUsedSlots(void);
+void trackingBroadcastInvalidationMessages(void);
+uint64_t trackingGetTotalKeys(void);
+uint64_t trackingGetTotalItems(void);
+uint64_t trackingGetTotalPrefixes(void);
 
 /* Keyspace events notification */
 void notifyKeyspaceEvent(int type, const char *event, robj *key, int dbid);
@@ -1830,36 +2622,70 @@ robj *lookupKeyWriteOrReply(client *c, robj *key, robj *reply);
 robj *lookupKeyReadWithFlags(redisDb *db, robj *key, int flags);
 robj *objectCommandLookup(client *c, robj *key);
 robj *objectCommandLookupOrReply(client *c, robj *key, robj *reply);
+char *getObjectTypeName(robj *o);
 #define LOOKUP_NONE 0
 #define LOOKUP_NOTOUCH (1<<0)
-void dbAdd(redisDb *db, robj *key, robj *val);
-void dbOverwrite(redisDb *db, robj *key, robj *val);
+dictEntry *dbAdd(redisDb *db, robj *key, robj *val);
+dictEntry *dbAddFusedString(redisDb *db, robj *key, robj *val);
+dictEntry *dbOverwrite(redisDb *db, robj *key, robj *val);
 void setKey(redisDb *db, robj *key, robj *val);
+void setKeyWithExpire(client *c, redisDb *db, robj *key, robj *val, long long when);
 int dbExists(redisDb *db, robj *key);
+void dbPrefetchKeys(redisDb *db, robj **keys, int numkeys, int step);
+void dbPrefetchRawKeys(redisDb *db, const void **keys, const int *lens,
+                       int count);
 robj *dbRandomKey(redisDb *db);
 int dbSyncDelete(redisDb *db, robj *key);
 int dbDelete(redisDb *db, robj *key);
 robj *dbUnshareStringValue(redisDb *db, robj *key, robj *o);
+int dbRemoveEntryExpire(redisDb *db, dictEntry *de);
+
+/* The expire of a key is stored in the metadata of its entry of db->m_dict
+ * (see dbDictType), where 0 means no expire, and db->m_expires indexes the
+ * entries of the keys with an expire, borrowed from db->m_dict: an entry
+ * found in either dictionary has its expire read this way. Returns -1 if
+ * the key is not volatile, like getExpire(). */
+static inline long long dbGetEntryExpire(const redisDb *db, const dictEntry *de) {
+    long long when = *(const long long*)db->m_dict->dictGetEntryMetadata(de);
+    return when ? when : -1;
+}
 
 #define EMPTYDB_NO_FLAGS 0      /* No flags. */
 #define EMPTYDB_ASYNC (1<<0)    /* Reclaim memory in another thread. */
 long long emptyDb(int dbnum, int flags, void(callback)(void*));
+redisDb *initTempDb(void);
+void discardTempDb(redisDb *tempDb, int async);
+void swapMainDbWithTempDb(redisDb *tempDb);
+void scanDatabaseForReadyLists(redisDb *db);
 
 void signalModifiedKey(redisDb *db, robj *key);
 void signalFlushedDb(int dbid);
 unsigned int getKeysInSlot(unsigned int hashslot, robj **keys, unsigned int count);
 unsigned int countKeysInSlot(unsigned int hashslot);
 unsigned int delKeysInSlot(unsigned int hashslot);
+dict *slotKeysDict(unsigned int hashslot);
 int verifyClusterConfigWithData();
 void scanGenericCommand(client *c, robj *o, unsigned long cursor);
 int parseScanCursorOrReply(client *c, robj *o, unsigned long *cursor);
-void slotToKeyAdd(robj *key);
-void slotToKeyDel(robj *key);
-void slotToKeyFlush();
+void slotToKeyAdd(redisDb *db, sds key);
+void slotToKeyDel(redisDb *db, sds key);
+void slotToKeyFlush(redisDb *db);
 int dbAsyncDelete(redisDb *db, robj *key);
+int dbGenericDelete(redisDb *db, robj *key, int lazy);
+int lazyfreeFreeObjectIfNeeded(robj *val, int lazy);
 void emptyDbAsync(redisDb *db);
-void slotToKeyFlushAsync();
+void slotToKeyFlushAsync(redisDb *db);
 size_t lazyfreeGetPendingObjectsCount();
+size_t lazyfreeGetFreedObjectsCount();
+void lazyfreeResetStats();
+void lazyfreeFreeTable(void *table);
+
+/* Keyspace walk */
+#define KEYSPACE_WALK_MAX_THREADS 64
+#define KEYSPACE_WALK_DEFAULT_THREADS 4
+typedef void (keyspaceWalkFunction)(void *privdata, sds key, robj *val);
+int keyspaceWalk(redisDb *db, int numthreads, keyspaceWalkFunction *fn,
+                 void **privdata);
 
 /* API to get key arguments from commands */
 int *getKeysFromCommand(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
@@ -1869,15 +2695,31 @@ int *evalGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 int *sortGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 int *migrateGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 int *georadiusGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
+int *xreadGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 
 /* Cluster */
 void clusterInit();
 unsigned short crc16(const char *buf, int len);
+uint16_t crc16Continue(uint16_t crc, const char *buf, int len);
+uint16_t crc16UntilByte(const char *buf, int len, char c, int *pos);
+#ifdef REDIS_TEST
+int crc16Test(int argc, char *argv[]);
+#endif
 unsigned int keyHashSlot(char *key, int keylen);
 void clusterCron();
 void clusterPropagatePublish(robj *channel, robj *message);
+void clusterPropagatePublishShard(robj *channel, robj *message);
 void migrateCloseTimedoutSockets();
+void migrateSlotCommand(client *c, int slot, long dbid, long timeout,
+                        int copy, int replace, int atomic);
+void migrateSlotFeedCommand(struct redisCommand *cmd, int dbid, robj **argv,
+                            int argc);
+void migrateSlotKeyModified(redisDb *db, robj *key);
+void unblockClientFromMigrate(client *c);
+void migrateSlotCron();
 void clusterBeforeSleep();
+int clusterSaveConfig(int do_fsync);
+void clusterSaveConfigJob();
 
 /* Sentinel */
 void initSentinelConfig();
@@ -1890,6 +2732,8 @@ void sentinelIsRunning();
 int redis_check_rdb(char *rdbfilename, FILE *fp);
 int redis_check_rdb_main(int argc, char **argv, FILE *fp);
 int redis_check_aof_main(int argc, char **argv);
+int redis_build_rdb_main(int argc, char **argv);
+int redis_sim_evict_main(int argc, char **argv);
 
 /* Scripting */
 void scriptingInit(int setup);
@@ -1897,16 +2741,66 @@ int ldbRemoveChild(pid_t pid);
 void ldbKillForkedSessions();
 int ldbPendingChildren();
 sds luaCreateFunction(client *c, lua_State *lua, robj *body);
+int luaIsReadOnlyScript(struct redisCommand *cmd);
+void luaThreadScriptDone(client *c, long long duration);
+
+/* A named function of FUNCTION LOAD. It is compiled once, and FCALL calls
+ * it by its reference in the Lua registry, without hashing the body or
+ * looking up a global. */
+typedef struct luaFunction {
+    robj *body;
+    int ref;    /* Lua registry reference of the compiled function. */
+} luaFunction;
+
+int luaFunctionCreate(client *c, sds name, robj *body, int replace);
+void luaFunctionsFlush();
+
+/* Execution profile of a script or function, for SCRIPT STATS. The times
+ * are in microseconds, in a histogram with 4 buckets per power of two. */
+#define SCRIPT_STATS_HIST_LEN LATENCY_HIST_LEN
+typedef struct scriptCommandStats {
+    struct redisCommand *cmd;
+    long long calls;
+    long long usec;
+} scriptCommandStats;
+
+typedef struct scriptStats {
+    int is_function;
+    long long calls;
+    long long usec;
+    long long max_usec;
+    uint32_t hist[SCRIPT_STATS_HIST_LEN];
+    scriptCommandStats *commands; /* The commands called by redis.call(). */
+    int numcommands;
+} scriptStats;
+
+/* Metrics endpoint */
+void metricsInit(void);
+void metricsCron(void);
 
 /* Blocked clients */
 void processUnblockedClients();
 void blockClient(client *c, int btype);
+void addClientToTimeoutTable(client *c);
+void removeClientFromTimeoutTable(client *c);
 void replyToBlockedClientTimedOut(client *c);
 int getTimeoutFromObjectOrReply(client *c, robj *object, mstime_t *timeout, int unit);
 void disconnectAllBlockedClients();
+void blockForKeys(client *c, int btype, robj **keys, int numkeys, mstime_t timeout, robj *target, streamID *ids);
+void blockClientOnContinuation(client *c, mstime_t timeout, clientResumeProc *resume, clientResumeFreeProc *free_privdata, void *privdata);
+void resumeBlockedClient(client *c, int status);
+void signalKeyAsReady(redisDb *db, robj *key);
+void handleClientsBlockedOnKeys();
 
 /* expire.c -- Handling of expired keys */
 void activeExpireCycle(int type);
+void expireIndexAdd(redisDb *db, sds key, long long when);
+void expireIndexDel(redisDb *db, sds key, long long when);
+void expireIndexInit(void);
+void keyIndexInit(void);
+void keyIndexAdd(redisDb *db, sds key);
+void keyIndexDel(redisDb *db, sds key);
+unsigned long expireIndexCycle(redisDb *db, long long now, unsigned long max);
 void expireSlaveKeys();
 void rememberSlaveKeyWithExpire(redisDb *db, robj *key);
 void flushSlaveKeysWithExpireList();
@@ -1918,11 +2812,15 @@ void evictionPoolAlloc();
 unsigned long LFUGetTimeInMinutes();
 uint8_t LFULogIncr(uint8_t value);
 unsigned long LFUDecrAndReturn(robj *o);
+unsigned long LFUTimeElapsed(unsigned long ldt);
+double LFUEstimateAccesses(unsigned long counter);
 
 /* Keys hashing / comparison functions for dict.c hash tables. */
 uint64_t dictSdsHash(const void *key);
+void dictSdsHashBatch(void **keys, int count, uint64_t *hashes);
 int dictSdsKeyCompare(void *privdata, const void *key1, const void *key2);
 void dictSdsDestructor(void *privdata, void *val);
+void dictHashValDestructor(void *privdata, void *val);
 
 /* Git SHA1 */
 char *redisGitSHA1();
@@ -1956,6 +2854,7 @@ void selectCommand(client *c);
 void swapdbCommand(client *c);
 void randomkeyCommand(client *c);
 void keysCommand(client *c);
+void keysrangeCommand(client *c);
 void scanCommand(client *c);
 void dbsizeCommand(client *c);
 void lastsaveCommand(client *c);
@@ -2016,6 +2915,7 @@ void roleCommand(client *c);
 void debugCommand(client *c);
 void msetCommand(client *c);
 void msetnxCommand(client *c);
+void msetexCommand(client *c);
 void zaddCommand(client *c);
 void zincrbyCommand(client *c);
 void zrangeCommand(client *c);
@@ -2058,6 +2958,15 @@ void hvalsCommand(client *c);
 void hgetallCommand(client *c);
 void hexistsCommand(client *c);
 void hscanCommand(client *c);
+void hexpireCommand(client *c);
+void hpexpireCommand(client *c);
+void hexpireatCommand(client *c);
+void hpexpireatCommand(client *c);
+void httlCommand(client *c);
+void hpttlCommand(client *c);
+void hexpiretimeCommand(client *c);
+void hpexpiretimeCommand(client *c);
+void hpersistCommand(client *c);
 void configCommand(client *c);
 void hincrbyCommand(client *c);
 void hincrbyfloatCommand(client *c);
@@ -2066,6 +2975,9 @@ void unsubscribeCommand(client *c);
 void psubscribeCommand(client *c);
 void punsubscribeCommand(client *c);
 void publishCommand(client *c);
+void ssubscribeCommand(client *c);
+void sunsubscribeCommand(client *c);
+void spublishCommand(client *c);
 void pubsubCommand(client *c);
 void watchCommand(client *c);
 void unwatchCommand(client *c);
@@ -2081,7 +2993,11 @@ void memoryCommand(client *c);
 void clientCommand(client *c);
 void evalCommand(client *c);
 void evalShaCommand(client *c);
+void evalRoCommand(client *c);
+void evalShaRoCommand(client *c);
 void scriptCommand(client *c);
+void functionCommand(client *c);
+void fcallCommand(client *c);
 void timeCommand(client *c);
 void bitopCommand(client *c);
 void bitcountCommand(client *c);
@@ -2103,6 +3019,22 @@ void pfaddCommand(client *c);
 void pfcountCommand(client *c);
 void pfmergeCommand(client *c);
 void pfdebugCommand(client *c);
+void bfaddCommand(client *c);
+void bfmaddCommand(client *c);
+void bfexistsCommand(client *c);
+void bfmexistsCommand(client *c);
+void tsaddCommand(client *c);
+void tsrangeCommand(client *c);
+void tsgetCommand(client *c);
+void xaddCommand(client *c);
+void xrangeCommand(client *c);
+void xrevrangeCommand(client *c);
+void xlenCommand(client *c);
+void xreadCommand(client *c);
+void xgroupCommand(client *c);
+void xackCommand(client *c);
+void xpendingCommand(client *c);
+void xclaimCommand(client *c);
 void latencyCommand(client *c);
 void moduleCommand(client *c);
 void securityWarningCommand(client *c);
@@ -2122,6 +3054,8 @@ void bugReportStart();
 void serverLogObjectDebugInfo(const robj *o);
 void sigsegvHandler(int sig, siginfo_t *info, void *secret);
 sds genRedisInfoString(const char *section);
+sds genLatencyStatsInfoString(sds info);
+void elPhaseRecord(int phase, long long usec);
 void enableWatchdog(int period);
 void disableWatchdog();
 void watchdogScheduleSignal(int period);
@@ -0,0 +1,480 @@
+/* Shared memory transport for the co-located clients, see shm.h.
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "shm.h"
+
+#ifdef __linux__
+
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+struct shmConn {
+    int sock;           /* The Unix socket, only watched for EOF. */
+    int efd;            /* Eventfd of the server, the fd of the client. */
+    int client_efd;     /* Eventfd of the client. */
+    void *map;
+    size_t map_len;
+    uint64_t mask;      /* ring_size-1. */
+    shmRing *req;       /* Requests, we are the consumer. */
+    shmRing *rep;       /* Replies, we are the producer. */
+    /* Our own positions: the rings are writable by the client, so only the
+     * index of the peer is ever read back from them, and validated. */
+    uint64_t req_tail;
+    uint64_t rep_head;
+};
+
+static void shmSignal(int efd) {
+    uint64_t one = 1;
+
+    if (write(efd,&one,sizeof(one)) == -1) {
+        /* The counter is saturated: the peer is going to wake up anyway. */
+    }
+}
+
+/* Read from the request ring what fits in 'buf'. Returns -1 with errno set
+ * to EAGAIN if the ring is empty, like a non blocking read(2), in which
+ * case the client is signaled to wake us up when it writes again. A head
+ * set by the client more than a ring ahead of our tail, or behind it, is
+ * a protocol violation: -1 is returned with errno set to EPROTO. */
+ssize_t shmRead(shmConn *s, char *buf, size_t len) {
+    shmRing *r = s->req;
+    uint64_t tail = s->req_tail, head, off;
+    size_t n, first;
+    uint64_t counter;
+
+    /* Consume the wakeup first: a signal arriving from now on is about
+     * data we may not see below, and must make us run again. */
+    if (read(s->efd,&counter,sizeof(counter)) == -1) {
+        /* Nothing to consume. */
+    }
+
+    head = __atomic_load_n(&r->head,__ATOMIC_ACQUIRE);
+    if (head == tail) {
+        __atomic_store_n(&r->consumer_waiting,1,__ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        head = __atomic_load_n(&r->head,__ATOMIC_ACQUIRE);
+        if (head == tail) {
+            errno = EAGAIN;
+            return -1;
+        }
+        __atomic_store_n(&r->consumer_waiting,0,__ATOMIC_RELAXED);
+    }
+
+    if (head-tail > s->mask+1) {
+        errno = EPROTO;
+        return -1;
+    }
+    n = head-tail;
+    if (n > len) n = len;
+    if (n > s->mask+1) n = s->mask+1;
+    off = tail & s->mask;
+    first = s->mask+1-off;
+    if (first > n) first = n;
+    memcpy(buf,r->data+off,first);
+    memcpy(buf+first,r->data,n-first);
+    tail += n;
+    s->req_tail = tail;
+    __atomic_store_n(&r->tail,tail,__ATOMIC_RELEASE);
+
+    /* Wake up the client if it waits for room, and make sure we run again
+     * if there is more to read, since the eventfd may be already drained. */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->producer_waiting,__ATOMIC_RELAXED)) {
+        __atomic_store_n(&r->producer_waiting,0,__ATOMIC_RELAXED);
+        shmSignal(s->client_efd);
+    }
+    if (__atomic_load_n(&r->head,__ATOMIC_ACQUIRE) != tail) {
+        shmSignal(s->efd);
+    } else {
+        __atomic_store_n(&r->consumer_waiting,1,__ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&r->head,__ATOMIC_ACQUIRE) != tail)
+            shmSignal(s->efd);
+    }
+    return n;
+}
+
+/* Write to the reply ring as much of 'iov' as fits, like a non blocking
+ * writev(2). When not everything fits the client is asked to wake us up
+ * once it made room, so the rest is written by shmClientHandler(). A tail
+ * set by the client ahead of our head, or more than a ring behind it, is
+ * a protocol violation: -1 is returned with errno set to EPROTO. */
+ssize_t shmWritev(shmConn *s, const struct iovec *iov, int iovcnt) {
+    shmRing *r = s->rep;
+    uint64_t head = s->rep_head, tail, off;
+    size_t space, n = 0, want = 0;
+    int j;
+
+    for (j = 0; j < iovcnt; j++) want += iov[j].iov_len;
+    tail = __atomic_load_n(&r->tail,__ATOMIC_ACQUIRE);
+    if (head-tail > s->mask+1) {
+        errno = EPROTO;
+        return -1;
+    }
+    space = s->mask+1-(head-tail);
+
+    for (j = 0; j < iovcnt && space; j++) {
+        const char *p = (const char*)iov[j].iov_base;
+        size_t len = iov[j].iov_len, first;
+
+        if (len > space) len = space;
+        off = head & s->mask;
+        first = s->mask+1-off;
+        if (first > len) first = len;
+        memcpy(r->data+off,p,first);
+        memcpy(r->data,p+first,len-first);
+        head += len;
+        space -= len;
+        n += len;
+    }
+    if (n) {
+        s->rep_head = head;
+        __atomic_store_n(&r->head,head,__ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&r->consumer_waiting,__ATOMIC_RELAXED)) {
+            __atomic_store_n(&r->consumer_waiting,0,__ATOMIC_RELAXED);
+            shmSignal(s->client_efd);
+        }
+    }
+    if (n < want) {
+        __atomic_store_n(&r->producer_waiting,1,__ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        /* Room made in the meantime: the client may not have seen the
+         * flag, run again. */
+        if (__atomic_load_n(&r->tail,__ATOMIC_ACQUIRE) != tail)
+            shmSignal(s->efd);
+    }
+    if (n == 0 && want) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return n;
+}
+
+/* The client signaled its eventfd: new requests, or room in the reply ring
+ * for the replies still pending. */
+static void shmClientHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    client *c = (client*) privdata;
+
+    if (c->clientHasPendingReplies() &&
+        !(c->m_flags & (CLIENT_PENDING_WRITE|CLIENT_AOF_COMMIT_WAIT)))
+    {
+        if (writeToClient(fd,c,0) == C_ERR) return;
+    }
+    readQueryFromClient(el,fd,privdata,mask);
+}
+
+/* Nothing is expected on the socket once the rings are in use: EOF means
+ * the client went away, anything else is a protocol error. */
+static void shmSocketHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    client *c = (client*) privdata;
+    char buf[64];
+    ssize_t nread;
+    UNUSED(el);
+    UNUSED(mask);
+
+    nread = read(fd,buf,sizeof(buf));
+    if (nread == -1 && errno == EAGAIN) return;
+    if (nread > 0)
+        serverLog(LL_VERBOSE,"Data on the socket of a shared memory client");
+    else
+        serverLog(LL_VERBOSE,"Client closed connection");
+    freeClient(c);
+}
+
+void shmFreeConn(shmConn *s) {
+    if (s->sock != -1) {
+        server.el->aeDeleteFileEvent(s->sock,AE_READABLE);
+        close(s->sock);
+    }
+    if (s->client_efd != -1) close(s->client_efd);
+    if (s->map) munmap(s->map,s->map_len);
+    zfree(s);
+}
+
+/* Send +OK with the memfd and the two eventfds as ancillary data. */
+static int shmSendFds(int sock, int *fds, int count) {
+    char ok[] = "+OK\r\n";
+    char cbuf[CMSG_SPACE(sizeof(int)*3)];
+    struct iovec iov = {ok, sizeof(ok)-1};
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg,0,sizeof(msg));
+    memset(cbuf,0,sizeof(cbuf));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int)*count);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int)*count);
+    memcpy(CMSG_DATA(cmsg),fds,sizeof(int)*count);
+    return sendmsg(sock,&msg,MSG_NOSIGNAL) == (ssize_t)iov.iov_len ?
+           C_OK : C_ERR;
+}
+
+/* CLIENT SHM <ring-size>: move the client to the shared memory rings. The
+ * reply is sent right away on the socket, together with the descriptors,
+ * and what the client sends after it is read from the request ring. */
+void clientShmCommand(client *c, long long size) {
+    size_t ringlen = sizeof(shmRing)+size;
+    shmConn *s;
+    shmHeader *hdr;
+    int memfd, fds[3];
+
+    if (!(c->m_flags & CLIENT_UNIX_SOCKET)) {
+        c->addReplyError("CLIENT SHM is only supported on the Unix socket");
+        return;
+    }
+    if (c->m_shm) {
+        c->addReplyError("The client already uses shared memory");
+        return;
+    }
+    if (c->m_flags & (CLIENT_MULTI|CLIENT_LUA|CLIENT_MODULE) ||
+        c->clientHasPendingReplies())
+    {
+        c->addReplyError("CLIENT SHM must be sent alone, waiting for the "
+                         "replies of the previous commands");
+        return;
+    }
+    if (size < SHM_MIN_RING_SIZE || size > SHM_MAX_RING_SIZE ||
+        (size & (size-1)))
+    {
+        c->addReplyErrorFormat("The ring size must be a power of two "
+            "between %d and %d", SHM_MIN_RING_SIZE, SHM_MAX_RING_SIZE);
+        return;
+    }
+
+    s = (shmConn*)zcalloc(sizeof(*s));
+    s->sock = -1;
+    s->efd = -1;
+    s->client_efd = -1;
+    s->mask = size-1;
+    s->map_len = sizeof(shmHeader)+ringlen*2;
+    memfd = memfd_create("redis-shm",MFD_CLOEXEC);
+    if (memfd == -1 || ftruncate(memfd,s->map_len) == -1 ||
+        (s->map = mmap(NULL,s->map_len,PROT_READ|PROT_WRITE,MAP_SHARED,
+                       memfd,0)) == MAP_FAILED ||
+        (s->efd = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC)) == -1 ||
+        (s->client_efd = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC)) == -1)
+    {
+        c->addReplyErrorFormat("Can't create the shared memory: %s",
+            strerror(errno));
+        goto err;
+    }
+
+    /* The pages are zero filled: only the header needs to be set. */
+    hdr = (shmHeader*)s->map;
+    memcpy(hdr->magic,SHM_MAGIC,sizeof(hdr->magic));
+    hdr->version = SHM_VERSION;
+    hdr->ring_size = size;
+    hdr->req_offset = sizeof(shmHeader);
+    hdr->rep_offset = sizeof(shmHeader)+ringlen;
+    s->req = (shmRing*)((char*)s->map+hdr->req_offset);
+    s->rep = (shmRing*)((char*)s->map+hdr->rep_offset);
+    s->req->consumer_waiting = 1;
+
+    fds[0] = memfd;
+    fds[1] = s->efd;
+    fds[2] = s->client_efd;
+    if (shmSendFds(c->m_fd,fds,3) == C_ERR) {
+        c->addReplyErrorFormat("Can't send the shared memory descriptors: %s",
+            strerror(errno));
+        goto err;
+    }
+    close(memfd);
+
+    /* From now on the fd of the client is our eventfd. */
+    server.el->aeDeleteFileEvent(c->m_fd,AE_READABLE|AE_WRITABLE);
+    s->sock = c->m_fd;
+    c->m_fd = s->efd;
+    c->m_shm = s;
+    if (server.el->aeCreateFileEvent(s->sock,AE_READABLE,
+            shmSocketHandler,c) == AE_ERR ||
+        server.el->aeCreateFileEvent(c->m_fd,AE_READABLE,
+            shmClientHandler,c) == AE_ERR)
+    {
+        freeClientAsync(c);
+    }
+    return;
+
+err:
+    if (memfd != -1) close(memfd);
+    if (s->efd != -1) close(s->efd);
+    if (s->map == MAP_FAILED) s->map = NULL;
+    shmFreeConn(s);
+}
+
+#ifdef REDIS_TEST
+#include <stdio.h>
+
+/* The client side of a ring, as a client library would implement it. */
+static void shmTestProduce(shmRing *r, uint64_t mask, const char *p, size_t len) {
+    uint64_t head = r->head;
+    for (size_t j = 0; j < len; j++) r->data[(head+j) & mask] = p[j];
+    __atomic_store_n(&r->head,head+len,__ATOMIC_RELEASE);
+}
+
+static size_t shmTestConsume(shmRing *r, uint64_t mask, char *p, size_t len) {
+    uint64_t tail = r->tail, head = __atomic_load_n(&r->head,__ATOMIC_ACQUIRE);
+    size_t n = head-tail < len ? head-tail : len;
+    for (size_t j = 0; j < n; j++) p[j] = r->data[(tail+j) & mask];
+    __atomic_store_n(&r->tail,tail+n,__ATOMIC_RELEASE);
+    return n;
+}
+
+#define SHM_TEST_RING 4096
+#define SHM_TEST_FAIL(msg) do { \
+    printf("shm: %s\n", msg); \
+    return 1; \
+} while(0)
+
+/* Round trips through the two rings of a connection, wrapping around their
+ * end, and the rejection of the ring indices a client can corrupt. */
+int shmTest(int argc, char **argv) {
+    static char in[SHM_TEST_RING*3], out[SHM_TEST_RING*3];
+    size_t ringlen = sizeof(shmRing)+SHM_TEST_RING;
+    shmConn s;
+    ssize_t n;
+    UNUSED(argc);
+    UNUSED(argv);
+
+    memset(&s,0,sizeof(s));
+    s.mask = SHM_TEST_RING-1;
+    s.map_len = ringlen*2;
+    s.map = mmap(NULL,s.map_len,PROT_READ|PROT_WRITE,
+                 MAP_SHARED|MAP_ANONYMOUS,-1,0);
+    s.efd = eventfd(0,EFD_NONBLOCK);
+    s.client_efd = eventfd(0,EFD_NONBLOCK);
+    if (s.map == MAP_FAILED || s.efd == -1 || s.client_efd == -1)
+        SHM_TEST_FAIL("can't create the rings");
+    s.req = (shmRing*)s.map;
+    s.rep = (shmRing*)((char*)s.map+ringlen);
+
+    for (size_t j = 0; j < sizeof(in); j++) in[j] = (char)(j*2654435761u >> 24);
+
+    /* Messages of growing sizes, so that both rings wrap many times. */
+    for (size_t len = 1; len <= SHM_TEST_RING; len += 97) {
+        struct iovec iov[2];
+
+        shmTestProduce(s.req,s.mask,in+len,len);
+        if (shmRead(&s,out,sizeof(out)) != (ssize_t)len ||
+            memcmp(in+len,out,len))
+            SHM_TEST_FAIL("request round trip mismatch");
+        if (shmRead(&s,out,sizeof(out)) != -1 || errno != EAGAIN)
+            SHM_TEST_FAIL("empty request ring not reported as EAGAIN");
+
+        iov[0].iov_base = in;
+        iov[0].iov_len = len/3;
+        iov[1].iov_base = in+len/3;
+        iov[1].iov_len = len-len/3;
+        if (shmWritev(&s,iov,2) != (ssize_t)len ||
+            shmTestConsume(s.rep,s.mask,out,sizeof(out)) != len ||
+            memcmp(in,out,len))
+            SHM_TEST_FAIL("reply round trip mismatch");
+    }
+
+    /* A full reply ring takes no more, and a reply bigger than the ring is
+     * written in parts. */
+    struct iovec big = {in, sizeof(in)};
+    if (shmWritev(&s,&big,1) != SHM_TEST_RING)
+        SHM_TEST_FAIL("reply not limited to the ring size");
+    if (shmWritev(&s,&big,1) != -1 || errno != EAGAIN)
+        SHM_TEST_FAIL("full reply ring not reported as EAGAIN");
+    if (shmTestConsume(s.rep,s.mask,out,sizeof(out)) != SHM_TEST_RING ||
+        memcmp(in,out,SHM_TEST_RING))
+        SHM_TEST_FAIL("full reply ring mismatch");
+
+    /* Indices corrupted by the client are refused. */
+    s.req->head = s.req_tail+SHM_TEST_RING+1;
+    if (shmRead(&s,out,sizeof(out)) != -1 || errno != EPROTO)
+        SHM_TEST_FAIL("request head beyond the ring accepted");
+    s.req->head = s.req_tail-1;
+    if (shmRead(&s,out,sizeof(out)) != -1 || errno != EPROTO)
+        SHM_TEST_FAIL("request head behind the tail accepted");
+    s.req->tail = 0; /* Ignored: our own tail is used. */
+    s.req->head = s.req_tail+SHM_TEST_RING;
+    if (shmRead(&s,out,sizeof(out)) != SHM_TEST_RING)
+        SHM_TEST_FAIL("full request ring not read at once");
+    s.rep->tail = s.rep_head+1;
+    if (shmWritev(&s,&big,1) != -1 || errno != EPROTO)
+        SHM_TEST_FAIL("reply tail ahead of the head accepted");
+    s.rep->tail = s.rep_head-SHM_TEST_RING-1;
+    if (shmWritev(&s,&big,1) != -1 || errno != EPROTO)
+        SHM_TEST_FAIL("reply tail beyond the ring accepted");
+
+    close(s.efd);
+    close(s.client_efd);
+    munmap(s.map,s.map_len);
+    printf("shm: all tests passed\n");
+    return 0;
+}
+#endif
+
+#else /* !__linux__ */
+
+void clientShmCommand(client *c, long long size) {
+    UNUSED(size);
+    c->addReplyError("CLIENT SHM is not supported on this system");
+}
+
+ssize_t shmRead(shmConn *s, char *buf, size_t len) {
+    UNUSED(s);
+    UNUSED(buf);
+    UNUSED(len);
+    errno = EINVAL;
+    return -1;
+}
+
+ssize_t shmWritev(shmConn *s, const struct iovec *iov, int iovcnt) {
+    UNUSED(s);
+    UNUSED(iov);
+    UNUSED(iovcnt);
+    errno = EINVAL;
+    return -1;
+}
+
+void shmFreeConn(shmConn *s) {
+    UNUSED(s);
+}
+
+#ifdef REDIS_TEST
+int shmTest(int argc, char **argv) {
+    UNUSED(argc);
+    UNUSED(argv);
+    return 0;
+}
+#endif
+
+#endif
@@ -0,0 +1,72 @@
+/* Shared memory transport for the clients running on the same host.
+ *
+ * A client connected to the Unix socket sends CLIENT SHM <ring-size>. The
+ * server replies +OK passing, as SCM_RIGHTS ancillary data of the reply,
+ * three file descriptors: a memfd holding the rings, the eventfd of the
+ * server and the eventfd of the client. From then on the client writes its
+ * requests to the request ring and reads the replies from the reply ring,
+ * with the very same protocol used on the socket, and the kernel socket
+ * stack is no longer involved. The socket is kept open only to detect the
+ * client going away: nothing else must be sent on it.
+ *
+ * The memfd is laid out as a shmHeader followed by the request ring and
+ * the reply ring, at the offsets found in the header. Every ring is a
+ * single producer single consumer queue of ring_size bytes, a power of
+ * two: head and tail are free running byte counters, the data of position
+ * p is at data[p & (ring_size-1)]. The producer only writes head, the
+ * consumer only writes tail, both with release semantics.
+ *
+ * Wakeups: a consumer about to sleep sets consumer_waiting, then checks
+ * the ring again (with a full barrier in between). A producer, after
+ * publishing head, clears consumer_waiting if set and writes 1 to the
+ * eventfd of the consumer. Likewise a producer finding the ring full sets
+ * producer_waiting and checks again, and a consumer, after publishing
+ * tail, clears producer_waiting if set and signals the producer. The
+ * eventfd of the server is used for both rings on the server side, the
+ * one of the client on the client side. */
+
+#ifndef __SHM_H
+#define __SHM_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define SHM_MAGIC "REDISSHM"
+#define SHM_VERSION 1
+#define SHM_MIN_RING_SIZE 4096
+#define SHM_MAX_RING_SIZE (64*1024*1024)
+
+typedef struct shmHeader {
+    char magic[8];          /* SHM_MAGIC, not null terminated. */
+    uint32_t version;       /* SHM_VERSION. */
+    uint32_t ring_size;     /* Data bytes of every ring. */
+    uint64_t req_offset;    /* Offset of the request ring (client->server). */
+    uint64_t rep_offset;    /* Offset of the reply ring (server->client). */
+    char pad[32];
+} shmHeader;
+
+typedef struct shmRing {
+    uint64_t head;              /* Written by the producer. */
+    char pad1[56];
+    uint64_t tail;              /* Written by the consumer. */
+    char pad2[56];
+    uint32_t consumer_waiting;  /* Consumer sleeping on its eventfd. */
+    uint32_t producer_waiting;  /* Producer waiting for free space. */
+    char pad3[56];
+    unsigned char data[];       /* ring_size bytes. */
+} shmRing;
+
+typedef struct shmConn shmConn;
+class client;
+
+void clientShmCommand(client *c, long long size);
+ssize_t shmRead(shmConn *s, char *buf, size_t len);
+ssize_t shmWritev(shmConn *s, const struct iovec *iov, int iovcnt);
+void shmFreeConn(shmConn *s);
+
+#ifdef REDIS_TEST
+int shmTest(int argc, char **argv);
+#endif
+
+#endif
@@ -0,0 +1,480 @@
+/* Fork-less RDB snapshots.
+ *
+ * With rdb-save-forkless BGSAVE does not fork: the snapshot is taken in this
+ * process, so that the time and the memory needed to copy the page tables of
+ * a big instance are not paid, and no page is duplicated because a write
+ * touched it while a child was saving.
+ *
+ * The dicts can't be read by another thread while the commands change them,
+ * so the keyspace is walked by the main thread with dictScan(), a slice of
+ * SNAPSHOT_SLICE_PERC percent of the serverCron() period at a time. The keys
+ * are serialized into a chunk per database, and the chunks are compressed
+ * and written by a writer thread, so that the main thread only spends the
+ * time to encode the values.
+ *
+ * Since the walk takes many slices, every key changed while it is in
+ * progress is saved just before the change, as it was when the snapshot
+ * started, unless the walk already visited it (see snapshotPreserveKey(),
+ * called by the lookups for writes and by the deletions). By then the key
+ * goes in the set of the keys not to save again, together with the keys
+ * created after the start, and the walk skips them. A key was visited when
+ * the scan cursor of its database went past its bucket: this holds since
+ * the tables can't shrink while the snapshot is in progress, like while
+ * a child process is saving.
+ *
+ * The file has the same format of the parallel saving, see the CHUNK
+ * opcodes in rdb.h, with the expires compared with the start time.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "snapshot.h"
+
+#include <fcntl.h>
+
+/* -----------------------------------------------------------------------------
+ * Writer thread
+ * -------------------------------------------------------------------------- */
+
+/* Queue a job for the writer thread, that takes ownership of 'buf'. */
+static void snapshotQueue(rdbSnapshot *s, int type, int dbid,
+                          unsigned long keys, sds buf)
+{
+    rdbSnapshotJob *job = (rdbSnapshotJob *)zmalloc(sizeof(*job));
+
+    job->type = type;
+    job->dbid = dbid;
+    job->keys = keys;
+    job->buf = buf;
+    job->next = NULL;
+    pthread_mutex_lock(&s->mutex);
+    if (s->tail) s->tail->next = job;
+    else s->head = job;
+    s->tail = job;
+    s->pending += sdslen(buf);
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+}
+
+/* Bytes queued and not yet written. */
+static size_t snapshotPending(rdbSnapshot *s) {
+    size_t pending;
+
+    pthread_mutex_lock(&s->mutex);
+    pending = s->pending;
+    pthread_mutex_unlock(&s->mutex);
+    return pending;
+}
+
+/* Write a job to 'rdb'. Returns -1 on write errors, with errno set. */
+static int snapshotWriteJob(rdbSnapshot *s, rio *rdb, rdbSnapshotJob *job) {
+    size_t len = sdslen(job->buf), clen = 0;
+    void *cbuf = NULL;
+    uint64_t cksum;
+    int retval;
+
+    switch(job->type) {
+    case SNAPSHOT_JOB_RAW:
+        return rdb->rioWrite(job->buf,len) ? 0 : -1;
+    case SNAPSHOT_JOB_CHUNK:
+        if (s->compress && len > 20) {
+            cbuf = zmalloc(len);
+            clen = rdbCompress(s->compress,job->buf,len,cbuf,len-4);
+        }
+        retval = clen ?
+            rdbSaveChunk(rdb,job->dbid,job->keys,s->compress,cbuf,clen,len) :
+            rdbSaveChunk(rdb,job->dbid,job->keys,0,job->buf,len,len);
+        zfree(cbuf);
+        return retval;
+    default: /* SNAPSHOT_JOB_END */
+        if (rdbSaveType(rdb,RDB_OPCODE_EOF) == -1) return -1;
+        cksum = rdb->m_checksum;
+        memrev64ifbe(&cksum);
+        if (rdb->rioWrite(&cksum,8) == 0) return -1;
+        if (rdb->rioFlush() == 0) return -1;
+        return fsync(s->fp ? fileno(s->fp) : s->fd);
+    }
+}
+
+/* Write the queued jobs until SNAPSHOT_JOB_END, or until the snapshot is
+ * aborted. After an error the jobs are just discarded. */
+static void snapshotWriteJobs(rdbSnapshot *s, rio *rdb) {
+    int failed = 0, error = 0, type;
+    rdbSnapshotJob *job;
+
+    if (s->checksum) rdb->m_update_cksum_func = rio::rioGenericUpdateChecksum;
+    do {
+        pthread_mutex_lock(&s->mutex);
+        while (s->head == NULL && !s->abort)
+            pthread_cond_wait(&s->cond,&s->mutex);
+        if (s->abort) {
+            pthread_mutex_unlock(&s->mutex);
+            return;
+        }
+        job = s->head;
+        s->head = job->next;
+        if (s->head == NULL) s->tail = NULL;
+        pthread_mutex_unlock(&s->mutex);
+
+        if (!failed && snapshotWriteJob(s,rdb,job) == -1) {
+            failed = 1;
+            error = errno;
+        }
+        type = job->type;
+        pthread_mutex_lock(&s->mutex);
+        s->pending -= sdslen(job->buf);
+        s->failed = failed;
+        s->error = error;
+        pthread_mutex_unlock(&s->mutex);
+        sdsfree(job->buf);
+        zfree(job);
+    } while (type != SNAPSHOT_JOB_END);
+}
+
+static void *snapshotWriterMain(void *privdata) {
+    rdbSnapshot *s = (rdbSnapshot *)privdata;
+
+    if (s->fp) {
+        rioFileIO rdb(s->fp);
+        snapshotWriteJobs(s,&rdb);
+    } else {
+        rioDirectIO rdb(s->fd);
+        snapshotWriteJobs(s,&rdb);
+    }
+    pthread_mutex_lock(&s->mutex);
+    s->done = 1;
+    pthread_mutex_unlock(&s->mutex);
+    return NULL;
+}
+
+/* -----------------------------------------------------------------------------
+ * Keyspace walk
+ * -------------------------------------------------------------------------- */
+
+/* Queue the chunk of the database 'dbid', if not empty. */
+static void snapshotFlushChunk(rdbSnapshot *s, int dbid) {
+    if (s->keys[dbid] == 0) return;
+    snapshotQueue(s,SNAPSHOT_JOB_CHUNK,dbid,s->keys[dbid],s->chunks[dbid]);
+    s->chunks[dbid] = sdsempty();
+    s->keys[dbid] = 0;
+}
+
+/* Serialize a key with its current value. */
+static void snapshotSaveKey(rdbSnapshot *s, redisDb *db, sds keystr,
+                            robj *val)
+{
+    long long expire = -1;
+    dictEntry *de;
+    robj key;
+    int id = db->m_id;
+
+    if (db->m_expires->dictSize() &&
+        (de = db->m_dict->dictFindReadOnly(keystr)) != NULL)
+        expire = dbGetEntryExpire(db,de);
+    initStaticStringObject(key,keystr);
+
+    /* The chunks can't hold module values: they are written as plain
+     * records, after a SELECTDB of their own. */
+    if (val->type == OBJ_MODULE) {
+        rioBufferIO rdb(sdsempty());
+        rdbSaveType(&rdb,RDB_OPCODE_SELECTDB);
+        rdbSaveLen(&rdb,id);
+        if (rdbSaveKeyValuePair(&rdb,&key,val,expire,s->now) == 1)
+            snapshotQueue(s,SNAPSHOT_JOB_RAW,id,0,rdb.m_ptr);
+        else
+            sdsfree(rdb.m_ptr);
+        return;
+    }
+    if (rdbSaveChunkRecord(&s->chunks[id],&key,val,expire,s->now,
+                           s->compress != 0)) s->keys[id]++;
+    if (s->keys[id] == RDB_CHUNK_MAX_KEYS ||
+        sdslen(s->chunks[id]) >= RDB_CHUNK_BYTES) snapshotFlushChunk(s,id);
+}
+
+/* Return 1 if the walk already went past 'key' of 'db'. */
+static int snapshotVisited(rdbSnapshot *s, redisDb *db, sds key) {
+    if (db->m_id != s->dbid) return db->m_id < s->dbid;
+    return s->cursor != 0 && db->m_dict->dictScanVisited(s->cursor,key);
+}
+
+/* The dictScan() callback of the walk. */
+static void snapshotScanCallback(void *privdata, const dictEntry *de) {
+    rdbSnapshot *s = (rdbSnapshot *)privdata;
+    dict *saved = s->saved[s->dbid];
+    sds key = (sds)de->dictGetKey();
+
+    /* Already saved before a change, or created after the start. The key
+     * is dropped from the set since it can't be met again. */
+    if (saved && saved->dictDelete(key) == DICT_OK) return;
+    snapshotSaveKey(s,server.db+s->dbid,key,(robj *)de->dictGetVal());
+}
+
+/* Called before 'key' of 'db' is changed or deleted: save it as it is, if
+ * the walk did not reach it yet and it was not saved already. */
+void snapshotPreserveKey(redisDb *db, robj *key) {
+    rdbSnapshot *s = server.rdb_snapshot;
+    dictEntry *de;
+
+    if (snapshotVisited(s,db,(sds)key->ptr)) return;
+    if (s->saved[db->m_id] == NULL)
+        s->saved[db->m_id] = dictCreate(&setDictType,NULL);
+    if (s->saved[db->m_id]->dictFind(key->ptr)) return;
+    s->saved[db->m_id]->dictAdd(sdsdup((sds)key->ptr),NULL);
+    if ((de = db->m_dict->dictFindReadOnly(key->ptr)) == NULL) return;
+    snapshotSaveKey(s,db,(sds)de->dictGetKey(),(robj *)de->dictGetVal());
+    s->preserved++;
+}
+
+/* Called when 'key' is added to 'db': the walk must not save it. */
+void snapshotNewKey(redisDb *db, robj *key) {
+    rdbSnapshot *s = server.rdb_snapshot;
+
+    if (snapshotVisited(s,db,(sds)key->ptr)) return;
+    if (s->saved[db->m_id] == NULL)
+        s->saved[db->m_id] = dictCreate(&setDictType,NULL);
+    if (s->saved[db->m_id]->dictFind(key->ptr)) return;
+    s->saved[db->m_id]->dictAdd(sdsdup((sds)key->ptr),NULL);
+}
+
+/* -----------------------------------------------------------------------------
+ * Snapshot lifecycle
+ * -------------------------------------------------------------------------- */
+
+/* The magic, the AUX fields, the scripts with replication info, and the
+ * sizes of the databases as hints for the loading. */
+static sds snapshotHeader(rdbSaveInfo *rsi) {
+    rioBufferIO rdb(sdsempty());
+    char magic[10];
+    int j;
+
+    snprintf(magic,sizeof(magic),"REDIS%04d",RDB_VERSION);
+    rdb.rioWrite(magic,9);
+    rdbSaveInfoAuxFields(&rdb,RDB_SAVE_NONE,rsi);
+    if (rsi && server.lua_scripts->dictSize()) {
+        dictIterator di(server.lua_scripts);
+        dictEntry *de;
+        while((de = di.dictNext()) != NULL) {
+            robj *body = (robj *)de->dictGetVal();
+            rdbSaveAuxField(&rdb,(void*)"lua",3,body->ptr,
+                            sdslen((sds)body->ptr));
+        }
+    }
+    for (j = 0; j < server.dbnum; j++) {
+        redisDb *db = server.db+j;
+        unsigned long size = db->m_dict->dictSize();
+        unsigned long expires = db->m_expires->dictSize();
+
+        if (size == 0) continue;
+        rdbSaveType(&rdb,RDB_OPCODE_SELECTDB);
+        rdbSaveLen(&rdb,j);
+        rdbSaveType(&rdb,RDB_OPCODE_RESIZEDB);
+        rdbSaveLen(&rdb,size <= UINT32_MAX ? size : UINT32_MAX);
+        rdbSaveLen(&rdb,expires <= UINT32_MAX ? expires : UINT32_MAX);
+    }
+    return rdb.m_ptr;
+}
+
+/* Release the snapshot after the writer exited. */
+static void snapshotFree(rdbSnapshot *s) {
+    rdbSnapshotJob *job;
+    int j;
+
+    while ((job = s->head) != NULL) {
+        s->head = job->next;
+        sdsfree(job->buf);
+        zfree(job);
+    }
+    for (j = 0; j < server.dbnum; j++) {
+        if (s->saved[j]) dictRelease(s->saved[j]);
+        sdsfree(s->chunks[j]);
+    }
+    zfree(s->saved);
+    zfree(s->chunks);
+    zfree(s->keys);
+    pthread_mutex_destroy(&s->mutex);
+    pthread_cond_destroy(&s->cond);
+    zfree(s);
+
+    server.rdb_snapshot = NULL;
+    server.rdb_save_time_last = time(NULL)-server.rdb_save_time_start;
+    server.rdb_save_time_start = -1;
+    updateDictResizePolicy();
+}
+
+/* Close the output, returning -1 on errors. */
+static int snapshotClose(rdbSnapshot *s) {
+    int retval = s->fp ? fclose(s->fp) : close(s->fd);
+
+    s->fp = NULL;
+    s->fd = -1;
+    return retval == 0 ? 0 : -1;
+}
+
+/* Start a fork-less BGSAVE to 'filename'. Returns C_ERR if a background
+ * save is already in progress or the file can't be created. */
+int snapshotStart(char *filename, rdbSaveInfo *rsi) {
+    rdbSnapshot *s;
+    int j;
+
+    if (server.rdb_child_pid != -1 || server.rdb_snapshot) return C_ERR;
+
+    server.dirty_before_bgsave = server.dirty;
+    server.lastbgsave_try = time(NULL);
+
+    s = (rdbSnapshot *)zcalloc(sizeof(*s));
+    snprintf(s->filename,sizeof(s->filename),"%s",filename);
+    /* Not temp-<pid>.rdb, that is used by SAVE in this same process. */
+    snprintf(s->tmpfile,sizeof(s->tmpfile),"temp-forkless-%d.rdb",
+             (int) getpid());
+    s->fd = -1;
+    if (server.rdb_save_bypass_cache != RDB_BYPASS_CACHE_NO)
+        s->fd = rdbOpenBypassingCache(s->tmpfile);
+    else
+        s->fp = fopen(s->tmpfile,"w");
+    if (!s->fp && s->fd == -1) {
+        serverLog(LL_WARNING,"Failed opening the RDB file %s for saving: %s",
+            s->tmpfile, strerror(errno));
+        zfree(s);
+        server.lastbgsave_status = C_ERR;
+        return C_ERR;
+    }
+
+    s->now = mstime();
+    /* The strings are not compressed one by one by the main thread: the
+     * writer compresses the chunks as a whole. */
+    s->compress = server.rdb_compression ? server.rdb_compression_codec : 0;
+    s->checksum = server.rdb_checksum;
+    s->saved = (dict **)zcalloc(sizeof(dict*)*server.dbnum);
+    s->chunks = (sds *)zmalloc(sizeof(sds)*server.dbnum);
+    s->keys = (unsigned long *)zcalloc(sizeof(unsigned long)*server.dbnum);
+    for (j = 0; j < server.dbnum; j++) s->chunks[j] = sdsempty();
+    pthread_mutex_init(&s->mutex,NULL);
+    pthread_cond_init(&s->cond,NULL);
+    snapshotQueue(s,SNAPSHOT_JOB_RAW,0,0,snapshotHeader(rsi));
+
+    server.rdb_snapshot = s;
+    server.rdb_save_time_start = time(NULL);
+    if (pthread_create(&s->thread,NULL,snapshotWriterMain,s) != 0) {
+        serverLog(LL_WARNING,"Can't save in background: "
+                             "can't create the writer thread");
+        snapshotClose(s);
+        unlink(s->tmpfile);
+        s->done = 1;
+        snapshotFree(s);
+        server.lastbgsave_status = C_ERR;
+        return C_ERR;
+    }
+    serverLog(LL_NOTICE,"Background saving started without forking");
+    updateDictResizePolicy();
+    return C_OK;
+}
+
+/* Called after the writer wrote the end of the file. */
+static void snapshotFinish(rdbSnapshot *s) {
+    int error;
+
+    pthread_join(s->thread,NULL);
+    error = s->failed ? s->error : 0;
+    if (snapshotClose(s) == -1 && !error) error = errno;
+    if (!error && rename(s->tmpfile,s->filename) == -1) error = errno;
+    if (!error) {
+        serverLog(LL_NOTICE,"Background saving terminated with success, "
+            "%llu keys saved before being modified", s->preserved);
+        server.dirty = server.dirty - server.dirty_before_bgsave;
+        server.lastsave = time(NULL);
+        server.lastbgsave_status = C_OK;
+    } else {
+        serverLog(LL_WARNING,"Background saving error: %s",strerror(error));
+        unlink(s->tmpfile);
+        server.lastbgsave_status = C_ERR;
+    }
+    snapshotFree(s);
+}
+
+/* Stop the snapshot in progress, if any, removing its temp file. Used when
+ * the keys can't be preserved one by one, like when a whole DB is flushed,
+ * and at shutdown. */
+void snapshotAbort(const char *reason) {
+    rdbSnapshot *s = server.rdb_snapshot;
+
+    if (s == NULL) return;
+    serverLog(LL_WARNING,"Fork-less background saving aborted: %s",reason);
+    pthread_mutex_lock(&s->mutex);
+    s->abort = 1;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+    pthread_join(s->thread,NULL);
+    snapshotClose(s);
+    unlink(s->tmpfile);
+    snapshotFree(s);
+}
+
+/* Called by serverCron(): walk the keyspace for a slice of time, and when
+ * the writer is done complete the snapshot. The walk pauses when the
+ * writer lags behind by more than SNAPSHOT_MAX_PENDING bytes. */
+void snapshotCron(void) {
+    rdbSnapshot *s = server.rdb_snapshot;
+    long long start, budget;
+    unsigned long steps = 0;
+    int done;
+
+    if (s == NULL) return;
+    pthread_mutex_lock(&s->mutex);
+    done = s->done;
+    pthread_mutex_unlock(&s->mutex);
+    if (done) {
+        snapshotFinish(s);
+        return;
+    }
+
+    start = ustime();
+    budget = 1000000/server.hz*SNAPSHOT_SLICE_PERC/100;
+    while (s->dbid < server.dbnum) {
+        if ((steps++ & 15) == 0 && (ustime()-start > budget ||
+            snapshotPending(s) > SNAPSHOT_MAX_PENDING)) break;
+
+        dict *d = server.db[s->dbid].m_dict;
+        s->cursor = d->dictScan(s->cursor,snapshotScanCallback,NULL,s);
+        if (s->cursor == 0) {
+            snapshotFlushChunk(s,s->dbid);
+            if (s->saved[s->dbid]) {
+                dictRelease(s->saved[s->dbid]);
+                s->saved[s->dbid] = NULL;
+            }
+            s->dbid++;
+        }
+    }
+    if (s->dbid == server.dbnum && !s->end_queued) {
+        snapshotQueue(s,SNAPSHOT_JOB_END,0,0,sdsempty());
+        s->end_queued = 1;
+    }
+}
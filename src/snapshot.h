@@ -0,0 +1,95 @@
+/* snapshot.h -- fork-less RDB snapshots API header file
+ * See snapshot.cpp for more information.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+#include <pthread.h>
+
+#define SNAPSHOT_SLICE_PERC 25          /* Max % of CPU time spent walking. */
+#define SNAPSHOT_MAX_PENDING (64*1024*1024)   /* Max bytes queued to write. */
+
+/* A piece of the RDB file, queued by the main thread for the writer. */
+struct rdbSnapshotJob {
+    int type;               /* SNAPSHOT_JOB_* */
+    int dbid;               /* Database of the chunk. */
+    unsigned long keys;     /* Keys in the chunk. */
+    sds buf;                /* Chunk payload, or raw bytes. */
+    rdbSnapshotJob *next;
+};
+
+#define SNAPSHOT_JOB_RAW 0      /* Bytes to write as they are. */
+#define SNAPSHOT_JOB_CHUNK 1    /* Keys to write as an RDB_OPCODE_CHUNK*. */
+#define SNAPSHOT_JOB_END 2      /* Write the EOF and close the file. */
+
+/* A fork-less BGSAVE in progress. The main thread walks the keyspace with
+ * dictScan() a slice at a time, and every key written before the walk
+ * reached it is saved just before the change, so that the file has every
+ * key as it was when the snapshot started. */
+struct rdbSnapshot {
+    char filename[256];     /* Final name of the RDB file. */
+    char tmpfile[256];
+    FILE *fp;               /* Output, unless 'fd' is used. */
+    int fd;                 /* Output with rdb-save-bypass-cache. */
+    long long now;          /* Keys expired at this time are not saved. */
+    int compress;           /* RDB_ENC_* codec of the chunks, or 0. */
+    int checksum;           /* Write the CRC64 of the file. */
+    int dbid;               /* Database being walked, dbnum when done. */
+    unsigned long cursor;   /* dictScan() cursor of 'dbid'. */
+    dict **saved;           /* Per DB set of the keys not to save again. */
+    sds *chunks;            /* Per DB chunk being filled. */
+    unsigned long *keys;    /* Keys in 'chunks'. */
+    unsigned long long preserved;   /* Keys saved before being changed. */
+    int end_queued;         /* SNAPSHOT_JOB_END was queued. */
+
+    /* Writer thread. */
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;    /* Signaled when a job is queued. */
+    rdbSnapshotJob *head, *tail;
+    size_t pending;         /* Bytes queued and not yet written. */
+    int done;               /* The writer exited. */
+    int abort;              /* Exit discarding the queued jobs. */
+    int failed;             /* A write failed with errno 'error'. */
+    int error;
+};
+
+/* Exported API */
+int snapshotStart(char *filename, rdbSaveInfo *rsi);
+void snapshotCron(void);
+void snapshotAbort(const char *reason);
+void snapshotPreserveKey(redisDb *db, robj *key);
+void snapshotNewKey(redisDb *db, robj *key);
+
+#endif
@@ -31,10 +31,12 @@
 
 #include "server.h"
 #include "pqsort.h" /* Partial qsort for SORT+LIMIT */
+#include "atomicvar.h"
 #include <math.h> /* isnan() */
+#include <pthread.h>
 
 redisSortOperation *createSortOperation(int type, robj *pattern) {
-    redisSortOperation* so = (redisSortOperation*)zmalloc(sizeof(*so));
+    redisSortOperation* so = (redisSortOperation*)zarena_malloc(sizeof(*so));
     so->type = type;
     so->pattern = pattern;
     return so;
@@ -151,8 +153,9 @@ int sortCompare(const void *s1, const void *s2) {
             cmp = compareStringObjects(so1->obj,so2->obj);
         }
     } else {
-        /* Alphanumeric sorting */
-        if (server.sort_bypattern) {
+        /* Alphanumeric sorting. Without STORE the objects to compare are
+         * collation keys, see sortSetWeight(). */
+        if (server.sort_bypattern || !server.sort_store) {
             if (!so1->u.cmpobj || !so2->u.cmpobj) {
                 /* At least one compare object is NULL */
                 if (so1->u.cmpobj == so2->u.cmpobj)
@@ -166,23 +169,419 @@ int sortCompare(const void *s1, const void *s2) {
                 if (server.sort_store) {
                     cmp = compareStringObjects(so1->u.cmpobj,so2->u.cmpobj);
                 } else {
-                    /* Here we can use strcoll() directly as we are sure that
-                     * the objects are decoded string objects. */
-                    cmp = strcoll((const char *)so1->u.cmpobj->ptr, (const char *)so2->u.cmpobj->ptr);
+                    /* Comparing the strxfrm() keys is the same as comparing
+                     * the strings with strcoll(). */
+                    cmp = strcmp((const char *)so1->u.cmpobj->ptr, (const char *)so2->u.cmpobj->ptr);
                 }
             }
         } else {
             /* Compare elements directly. */
-            if (server.sort_store) {
-                cmp = compareStringObjects(so1->obj,so2->obj);
-            } else {
-                cmp = collateStringObjects(so1->obj,so2->obj);
-            }
+            cmp = compareStringObjects(so1->obj,so2->obj);
         }
     }
     return server.sort_desc ? -cmp : cmp;
 }
 
+/* -----------------------------------------------------------------------------
+ * Sorting keys and sort algorithms
+ *
+ * The weights the elements are sorted by are computed once per element
+ * before sorting: the scores of numeric sorts, the collation keys with
+ * strxfrm() of ALPHA sorts not stored, so that sortCompare() never parses
+ * or collates strings.
+ *
+ * Numeric sorts of many elements are radix sorts of the scores. When only
+ * the first few elements of the sorted order are needed, because of LIMIT,
+ * they are selected with a heap instead of sorting everything.
+ *
+ * The weights of big sorts, and the values of many GET operations, are
+ * looked up by set-algebra-threads threads, as the member lookups of
+ * SINTER and friends, see lookupKeyByPatternReadOnly().
+ * -------------------------------------------------------------------------- */
+
+/* Radix sort numeric sorts with at least this number of elements. */
+#define SORT_RADIX_MIN_ELEMENTS 1024
+
+/* Select the first 'k' elements of 'n' with a heap when k*RATIO <= n. */
+#define SORT_TOPK_RATIO 8
+
+/* Every thread resolves about this number of chunks of elements. */
+#define SORT_RESOLVE_CHUNKS_PER_THREAD 16
+
+/* Return a new string object with the strxfrm() key of the string 'o'. */
+static robj *sortCollationKey(robj *o) {
+    char buf[LONG_STR_SIZE];
+    const char *s;
+
+    if (sdsEncodedObject(o)) {
+        s = (const char *)o->ptr;
+    } else {
+        ll2string(buf,sizeof(buf),(long)o->ptr);
+        s = buf;
+    }
+    size_t len = strxfrm(NULL,s,0);
+    sds key = sdsnewlen(NULL,len);
+    strxfrm(key,s,len+1);
+    return createObject(OBJ_STRING,key);
+}
+
+/* Set the weight of 'so' from 'byval', that is the element itself or the
+ * value of the BY key of the element, as sortCompare() expects it. Returns
+ * C_ERR if a numeric weight can't be converted into a double.
+ *
+ * If 'readonly' is true the refcount of 'byval' is not modified, so that
+ * different threads can set weights from the same object. */
+static int sortSetWeight(redisSortObject *so, robj *byval, int sortby,
+                         int alpha, int store, int readonly)
+{
+    if (alpha) {
+        if (!store) {
+            so->u.cmpobj = sortCollationKey(byval);
+        } else if (sortby) {
+            if (!readonly)
+                so->u.cmpobj = getDecodedObject(byval);
+            else if (sdsEncodedObject(byval))
+                so->u.cmpobj = createStringObject((const char *)byval->ptr,
+                                                  sdslen((sds)byval->ptr));
+            else
+                so->u.cmpobj = createObject(OBJ_STRING,
+                                            sdsfromlonglong((long)byval->ptr));
+        }
+    } else {
+        if (sdsEncodedObject(byval)) {
+            char *eptr;
+
+            so->u.score = strtod((const char *)byval->ptr,&eptr);
+            if (eptr[0] != '\0' || errno == ERANGE || isnan(so->u.score))
+                return C_ERR;
+        } else if (byval->encoding == OBJ_ENCODING_INT) {
+            /* Don't need to decode the object if it's integer-encoded (the
+             * only encoding supported) so far. We can just cast it */
+            so->u.score = (long)byval->ptr;
+        } else {
+            serverAssertWithInfo(NULL,byval,1 != 1);
+        }
+    }
+    return C_OK;
+}
+
+/* Set the weight of the element 'so' looking up its BY key, if any. */
+static int sortLoadWeight(redisDb *db, redisSortObject *so, robj *sortby,
+                          int alpha, int store)
+{
+    robj *byval = so->obj;
+    int retval;
+
+    if (sortby) {
+        byval = lookupKeyByPattern(db,sortby,so->obj);
+        if (!byval) return C_OK;
+    }
+    retval = sortSetWeight(so,byval,sortby != NULL,alpha,store,0);
+
+    /* when the object was retrieved using lookupKeyByPattern,
+     * its refcount needs to be decreased. */
+    if (sortby) decrRefCount(byval);
+    return retval;
+}
+
+/* Map a score to an unsigned integer with the same order. */
+static uint64_t sortScoreRadixKey(double score) {
+    uint64_t u;
+
+    memcpy(&u,&score,sizeof(u));
+    return (u >> 63) ? ~u : (u | (1ULL << 63));
+}
+
+/* Sort by score the 'n' elements of a numeric sort with a LSD radix sort,
+ * then sort with sortCompare() the runs of elements with the same score. */
+static void sortRadix(redisSortObject *v, long n) {
+    uint64_t *keys = (uint64_t *)zmalloc(sizeof(uint64_t)*n*2);
+    redisSortObject *tmp = (redisSortObject *)zmalloc(sizeof(*v)*n);
+    uint64_t *srckeys = keys, *dstkeys = keys+n;
+    redisSortObject *src = v, *dst = tmp;
+    int desc = server.sort_desc;
+    long j, i;
+
+    for (j = 0; j < n; j++) keys[j] = sortScoreRadixKey(v[j].u.score);
+    for (int shift = 0; shift < 64; shift += 8) {
+        long count[256] = {0}, pos = 0;
+
+        for (j = 0; j < n; j++) count[(srckeys[j] >> shift) & 0xff]++;
+        /* Skip the digits that are the same for all the scores, such as
+         * the low bytes of the mantissa of small integers. */
+        if (count[(srckeys[0] >> shift) & 0xff] == n) continue;
+        for (j = 0; j < 256; j++) {
+            long c = count[j];
+            count[j] = pos;
+            pos += c;
+        }
+        for (j = 0; j < n; j++) {
+            long p = count[(srckeys[j] >> shift) & 0xff]++;
+            dstkeys[p] = srckeys[j];
+            dst[p] = src[j];
+        }
+        uint64_t *tk = srckeys; srckeys = dstkeys; dstkeys = tk;
+        redisSortObject *t = src; src = dst; dst = t;
+    }
+    if (src != v) memcpy(v,src,sizeof(*v)*n);
+    zfree(keys);
+    zfree(tmp);
+
+    /* The runs are sorted in ascending order, as everything else: DESC is
+     * the reverse order, ties included. */
+    server.sort_desc = 0;
+    for (i = 0; i < n; i = j) {
+        for (j = i+1; j < n && v[j].u.score == v[i].u.score; j++);
+        if (j-i > 1) qsort(v+i,j-i,sizeof(*v),sortCompare);
+    }
+    server.sort_desc = desc;
+    if (desc) {
+        for (i = 0, j = n-1; i < j; i++, j--) {
+            redisSortObject t = v[i];
+            v[i] = v[j];
+            v[j] = t;
+        }
+    }
+}
+
+static void sortHeapSiftDown(redisSortObject *heap, long len, long i) {
+    while (1) {
+        long max = i, l = i*2+1, r = l+1;
+
+        if (l < len && sortCompare(&heap[l],&heap[max]) > 0) max = l;
+        if (r < len && sortCompare(&heap[r],&heap[max]) > 0) max = r;
+        if (max == i) return;
+        redisSortObject t = heap[i];
+        heap[i] = heap[max];
+        heap[max] = t;
+        i = max;
+    }
+}
+
+/* Move the first 'k' elements of the sorted order of 'v' to the first 'k'
+ * positions, sorted, in O(n*log(k)) time. The order of the other elements
+ * is undefined. */
+static void sortTopK(redisSortObject *v, long n, long k) {
+    long j;
+
+    for (j = k/2-1; j >= 0; j--) sortHeapSiftDown(v,k,j);
+    for (j = k; j < n; j++) {
+        if (sortCompare(&v[j],&v[0]) < 0) {
+            redisSortObject t = v[0];
+            v[0] = v[j];
+            v[j] = t;
+            sortHeapSiftDown(v,k,0);
+        }
+    }
+    for (j = k-1; j > 0; j--) {
+        redisSortObject t = v[0];
+        v[0] = v[j];
+        v[j] = t;
+        sortHeapSiftDown(v,j,0);
+    }
+}
+
+/* Parallel resolution of BY and GET patterns. */
+
+struct sortResolveJob {
+    redisDb *db;
+    redisSortObject *vector;
+    long long now;              /* Time to expire keys, as expireIfNeeded(). */
+    robj *sortby;               /* Weights: BY pattern, or NULL. */
+    int alpha;
+    int store;
+    robj **getpatterns;         /* Values: the 'numget' GET patterns of the */
+    int numget;                 /* elements from 'start', into 'getvals'. */
+    long start;
+    robj **getvals;
+    long items;                 /* Weights or values to resolve. */
+    unsigned long chunks;
+    unsigned long next;         /* Next chunk to resolve. */
+};
+
+struct sortResolveThread {
+    sortResolveJob *job;
+    sds tmp;                    /* Key names to look up. */
+    long long hits, misses;
+    int error;                  /* A weight is not a valid double. */
+    long *expired;              /* Items left to lookupKeyByPattern(). */
+    long numexpired;
+    long capacity;
+};
+
+/* Return true if lookupKeyByPatternReadOnly() can resolve 'pattern'. */
+static int sortPatternIsReadOnly(robj *pattern) {
+    const char *p = strchr((const char *)pattern->ptr,'*'), *f;
+
+    if (p == NULL) return 1;
+    return !((f = strstr(p+1,"->")) != NULL && *(f+2) != '\0');
+}
+
+/* Like lookupKeyByPattern() for patterns not dereferencing hash fields,
+ * but modifying nothing, so that different threads can resolve patterns at
+ * the same time: the object found is not returned with an incremented
+ * refcount, and the access time of the key is not updated.
+ *
+ * Keys that should be expired are not resolved: '*expired' is set instead,
+ * so that the caller resolves them with lookupKeyByPattern(), that expires
+ * and propagates them as usual. The same happens for chunked bitmaps, that
+ * the lookup of the main thread converts to plain strings. */
+static robj *lookupKeyByPatternReadOnly(sortResolveThread *t, robj *pattern,
+                                        robj *subst, int *expired)
+{
+    sortResolveJob *job = t->job;
+    sds spat = (sds)pattern->ptr;
+    char buf[LONG_STR_SIZE];
+    const char *ssub, *p;
+    size_t sublen;
+    dictEntry *de;
+
+    *expired = 0;
+    if (spat[0] == '#' && spat[1] == '\0') return subst;
+    if ((p = strchr(spat,'*')) == NULL) return NULL;
+
+    if (sdsEncodedObject(subst)) {
+        ssub = (const char *)subst->ptr;
+        sublen = sdslen((sds)subst->ptr);
+    } else {
+        sublen = ll2string(buf,sizeof(buf),(long)subst->ptr);
+        ssub = buf;
+    }
+    t->tmp = sdscpylen(t->tmp,spat,p-spat);
+    t->tmp = sdscatlen(t->tmp,ssub,sublen);
+    t->tmp = sdscatlen(t->tmp,p+1,sdslen(spat)-(p-spat)-1);
+
+    if ((de = job->db->m_dict->dictFindReadOnly(t->tmp)) == NULL) {
+        t->misses++;
+        return NULL;
+    }
+    long long when = dbGetEntryExpire(job->db,de);
+    if (when != -1 && job->now > when) {
+        *expired = 1;
+        return NULL;
+    }
+    robj *o = (robj *)de->dictGetVal();
+    if (o->encoding == OBJ_ENCODING_CHUNKED ||
+        o->encoding == OBJ_ENCODING_COMPRESSED) {
+        *expired = 1;
+        return NULL;
+    }
+    t->hits++;
+    return o->type == OBJ_STRING ? o : NULL;
+}
+
+static void sortResolveItem(sortResolveThread *t, long item) {
+    sortResolveJob *job = t->job;
+    int expired;
+
+    if (job->getvals) {
+        redisSortObject *so = job->vector+job->start+item/job->numget;
+        robj *pattern = job->getpatterns[item%job->numget];
+
+        job->getvals[item] = lookupKeyByPatternReadOnly(t,pattern,so->obj,
+                                                        &expired);
+    } else {
+        redisSortObject *so = job->vector+item;
+        robj *byval = so->obj;
+
+        expired = 0;
+        if (job->sortby) {
+            byval = lookupKeyByPatternReadOnly(t,job->sortby,so->obj,&expired);
+            if (!byval && !expired) return;
+        }
+        if (!expired &&
+            sortSetWeight(so,byval,job->sortby != NULL,job->alpha,job->store,1)
+            == C_ERR)
+        {
+            t->error = 1;
+        }
+    }
+    if (expired) {
+        if (t->numexpired == t->capacity) {
+            t->capacity = t->capacity ? t->capacity*2 : 16;
+            t->expired = (long *)zrealloc(t->expired,sizeof(long)*t->capacity);
+        }
+        t->expired[t->numexpired++] = item;
+    }
+}
+
+static void *sortResolveThreadMain(void *arg) {
+    sortResolveThread *t = (sortResolveThread *)arg;
+    sortResolveJob *job = t->job;
+    unsigned long chunk;
+
+    while(1) {
+        atomicGetIncr(job->next,chunk,1);
+        if (chunk >= job->chunks) break;
+        long from = (long)(job->items*chunk/job->chunks);
+        long to = (long)(job->items*(chunk+1)/job->chunks);
+        for (long item = from; item < to; item++) sortResolveItem(t,item);
+    }
+    return NULL;
+}
+
+/* Resolve the items of 'job' with up to 'numthreads' threads, the calling
+ * thread included. The items left because of expired keys are resolved
+ * afterwards by the caller: their indexes are returned, in a new array of
+ * '*numexpired' elements to free with zfree(), or NULL. Returns C_ERR if a
+ * weight is not a valid double. */
+static int sortResolve(sortResolveJob *job, int numthreads, long **expired,
+                       long *numexpired)
+{
+    sortResolveThread threads[SET_ALGEBRA_MAX_THREADS];
+    pthread_t tids[SET_ALGEBRA_MAX_THREADS];
+    int created = 0, retval = C_OK, j;
+
+    job->now = server.lua_caller ? server.lua_time_start : mstime();
+    job->next = 0;
+    job->chunks = (unsigned long)numthreads*SORT_RESOLVE_CHUNKS_PER_THREAD;
+    for (j = 0; j < numthreads; j++) {
+        threads[j].job = job;
+        threads[j].tmp = sdsempty();
+        threads[j].hits = threads[j].misses = 0;
+        threads[j].error = 0;
+        threads[j].expired = NULL;
+        threads[j].numexpired = threads[j].capacity = 0;
+    }
+    for (j = 1; j < numthreads; j++) {
+        if (pthread_create(&tids[j-1],NULL,sortResolveThreadMain,
+                           &threads[j]) != 0)
+        {
+            serverLog(LL_WARNING,"Can't create sort thread: %s", strerror(errno));
+            break;
+        }
+        created++;
+    }
+    sortResolveThreadMain(&threads[0]);
+    for (j = 0; j < created; j++) pthread_join(tids[j],NULL);
+
+    *expired = NULL;
+    *numexpired = 0;
+    for (j = 0; j <= created; j++) {
+        sortResolveThread *t = &threads[j];
+
+        server.stat_keyspace_hits += t->hits;
+        server.stat_keyspace_misses += t->misses;
+        if (t->error) retval = C_ERR;
+        if (t->numexpired) {
+            *expired = (long *)zrealloc(*expired,
+                sizeof(long)*(*numexpired+t->numexpired));
+            memcpy(*expired+*numexpired,t->expired,sizeof(long)*t->numexpired);
+            *numexpired += t->numexpired;
+        }
+        zfree(t->expired);
+        sdsfree(t->tmp);
+    }
+    for (; j < numthreads; j++) sdsfree(threads[j].tmp);
+    return retval;
+}
+
+/* Return the number of threads to resolve 'items' patterns. */
+static int sortResolveThreads(long items) {
+    if (items < (long)server.set_algebra_parallel_threshold) return 1;
+    return server.set_algebra_threads;
+}
+
 /* The SORT command is the most complex command in Redis. Warning: this code
  * is optimized for speed and a bit less for readability */
 void sortCommand(client *c) {
@@ -196,6 +595,9 @@ void sortCommand(client *c) {
     int syntax_error = 0;
     robj *sortval, *sortby = NULL, *storekey = NULL;
     redisSortObject *vector; /* Resulting vector to sort */
+    robj **getvals = NULL; /* GET values resolved by threads, if any */
+    robj **ownedvals = NULL; /* Values of 'getvals' to decrRefCount() */
+    long numowned = 0;
 
     /* Lookup the key to sort. It must be of the right types */
     sortval = lookupKeyRead(c->m_cur_selected_db,c->m_argv[1]);
@@ -210,7 +612,6 @@ void sortCommand(client *c) {
     /* Create a list of operations to perform for every sorted element.
      * Operations can be GET */
     operations = listCreate();
-    operations->listSetFreeMethod(zfree);
     j = 2; /* options start at argv[2] */
 
     /* Now we need to protect sortval incrementing its count, in the future
@@ -300,8 +701,9 @@ void sortCommand(client *c) {
         sortby = NULL;
     }
 
-    /* Destructively convert encoded sorted sets for SORT. */
-    if (sortval->type == OBJ_ZSET)
+    /* Destructively convert encoded sorted sets for SORT. B+tree encoded
+     * sorted sets are big, so they are already fine. */
+    if (sortval->type == OBJ_ZSET && sortval->encoding == OBJ_ENCODING_LISTPACK)
         zsetConvert(sortval, OBJ_ENCODING_SKIPLIST);
 
     /* Objtain the length of the object to sort. */
@@ -339,7 +741,7 @@ void sortCommand(client *c) {
     }
 
     /* Load the sorting vector with all the objects to sort */
-    vector = (redisSortObject *)zmalloc(sizeof(redisSortObject)*vectorlen);
+    vector = (redisSortObject *)zarena_malloc(sizeof(redisSortObject)*vectorlen);
     j = 0;
 
     if (sortval->type == OBJ_LIST && dontsort) {
@@ -385,6 +787,29 @@ void sortCommand(client *c) {
             vector[j].u.cmpobj = NULL;
             j++;
         }
+    } else if (sortval->type == OBJ_ZSET && dontsort &&
+               sortval->encoding == OBJ_ENCODING_BTREE)
+    {
+        /* Same as below for B+tree encoded sorted sets. */
+        zbtree *zbt = ((zset *)sortval->ptr)->zbt;
+        zbtCursor cur;
+        sds sdsele;
+        int rangelen = vectorlen;
+
+        if (rangelen)
+            serverAssertWithInfo(c,sortval,zbt->zbtGetElementByRank(
+                desc ? zbt->length()-start : start+1,&cur));
+        while(rangelen--) {
+            sdsele = zbtCursorEle(&cur);
+            vector[j].obj = createStringObject(sdsele,sdslen(sdsele));
+            vector[j].u.score = 0;
+            vector[j].u.cmpobj = NULL;
+            j++;
+            if (desc) zbtPrev(&cur); else zbtNext(&cur);
+        }
+        /* Fix start/end: output code is not aware of this optimization. */
+        end -= start;
+        start = 0;
     } else if (sortval->type == OBJ_ZSET && dontsort) {
         /* Special handling for a sorted set, if 'dontsort' is true.
          * This makes sure we return elements in the sorted set original
@@ -443,58 +868,97 @@ void sortCommand(client *c) {
 
     /* Now it's time to load the right scores in the sorting vector */
     if (dontsort == 0) {
-        for (j = 0; j < vectorlen; j++) {
-            robj *byval;
-            if (sortby) {
-                /* lookup value to sort by */
-                byval = lookupKeyByPattern(c->m_cur_selected_db,sortby,vector[j].obj);
-                if (!byval) continue;
-            } else {
-                /* use object itself to sort by */
-                byval = vector[j].obj;
-            }
+        int numthreads = sortResolveThreads(vectorlen);
 
-            if (alpha) {
-                if (sortby) vector[j].u.cmpobj = getDecodedObject(byval);
-            } else {
-                if (sdsEncodedObject(byval)) {
-                    char *eptr;
-
-                    vector[j].u.score = strtod((const char *)byval->ptr,&eptr);
-                    if (eptr[0] != '\0' || errno == ERANGE ||
-                        isnan(vector[j].u.score))
-                    {
-                        int_convertion_error = 1;
-                    }
-                } else if (byval->encoding == OBJ_ENCODING_INT) {
-                    /* Don't need to decode the object if it's
-                     * integer-encoded (the only encoding supported) so
-                     * far. We can just cast it */
-                    vector[j].u.score = (long)byval->ptr;
-                } else {
-                    serverAssertWithInfo(c,sortval,1 != 1);
-                }
-            }
+        if (numthreads > 1 && (!sortby || sortPatternIsReadOnly(sortby))) {
+            sortResolveJob job;
+            long *expired, numexpired;
 
-            /* when the object was retrieved using lookupKeyByPattern,
-             * its refcount needs to be decreased. */
-            if (sortby) {
-                decrRefCount(byval);
+            job.db = c->m_cur_selected_db;
+            job.vector = vector;
+            job.sortby = sortby;
+            job.alpha = alpha;
+            job.store = storekey != NULL;
+            job.getpatterns = NULL;
+            job.getvals = NULL;
+            job.items = vectorlen;
+            if (sortResolve(&job,numthreads,&expired,&numexpired) == C_ERR)
+                int_convertion_error = 1;
+            for (long k = 0; k < numexpired; k++) {
+                if (sortLoadWeight(c->m_cur_selected_db,vector+expired[k],
+                                   sortby,alpha,storekey != NULL) == C_ERR)
+                    int_convertion_error = 1;
+            }
+            zfree(expired);
+        } else {
+            for (j = 0; j < vectorlen; j++) {
+                if (sortLoadWeight(c->m_cur_selected_db,vector+j,sortby,
+                                   alpha,storekey != NULL) == C_ERR)
+                    int_convertion_error = 1;
             }
         }
     }
 
-    if (dontsort == 0) {
+    if (dontsort == 0 && !int_convertion_error && start <= end) {
         server.sort_desc = desc;
         server.sort_alpha = alpha;
         server.sort_bypattern = sortby ? 1 : 0;
         server.sort_store = storekey ? 1 : 0;
-        if (sortby && (start != 0 || end != vectorlen-1))
+        if ((end+1)*SORT_TOPK_RATIO <= vectorlen)
+            sortTopK(vector,vectorlen,end+1);
+        else if (!alpha && vectorlen >= SORT_RADIX_MIN_ELEMENTS)
+            sortRadix(vector,vectorlen);
+        else if (sortby && (start != 0 || end != vectorlen-1))
             pqsort(vector,vectorlen,sizeof(redisSortObject),sortCompare, start,end);
         else
             qsort(vector,vectorlen,sizeof(redisSortObject),sortCompare);
     }
 
+    /* Resolve the GET patterns of many elements with threads. */
+    if (getop && !int_convertion_error && start <= end) {
+        long items = (long)getop*(end-start+1);
+        int numthreads = sortResolveThreads(items);
+        robj **getpatterns = (robj **)zmalloc(sizeof(robj *)*getop);
+        int readonly = 1, k = 0;
+        listNode *ln;
+
+        listIter li(operations);
+        while((ln = li.listNext())) {
+            redisSortOperation *sop = (redisSortOperation *)ln->listNodeValue();
+            getpatterns[k++] = sop->pattern;
+            if (!sortPatternIsReadOnly(sop->pattern)) readonly = 0;
+        }
+        if (numthreads > 1 && readonly) {
+            sortResolveJob job;
+            long *expired, numexpired;
+
+            getvals = (robj **)zmalloc(sizeof(robj *)*items);
+            job.db = c->m_cur_selected_db;
+            job.vector = vector;
+            job.sortby = NULL;
+            job.getpatterns = getpatterns;
+            job.numget = getop;
+            job.start = start;
+            job.getvals = getvals;
+            job.items = items;
+            sortResolve(&job,numthreads,&expired,&numexpired);
+
+            /* Expiring keys doesn't free the values resolved by threads,
+             * that are never values of expired keys. */
+            if (numexpired)
+                ownedvals = (robj **)zmalloc(sizeof(robj *)*numexpired);
+            for (long e = 0; e < numexpired; e++) {
+                long item = expired[e];
+                robj *val = lookupKeyByPattern(c->m_cur_selected_db,
+                    getpatterns[item%getop],vector[start+item/getop].obj);
+                getvals[item] = val;
+                if (val) ownedvals[numowned++] = val;
+            }
+            zfree(expired);
+        }
+        zfree(getpatterns);
+    }
+
     /* Send command output to the output buffer, performing the specified
      * GET/DEL/INCR/DECR operations if any. */
     outputlen = getop ? getop*(end-start+1) : end-start+1;
@@ -508,17 +972,19 @@ void sortCommand(client *c) {
 
             if (!getop) c->addReplyBulk(vector[j].obj);
             listIter li(operations);
+            int k = 0;
             while((ln = li.listNext())) {
                 redisSortOperation *sop = (redisSortOperation *)ln->listNodeValue();
-                robj *val = lookupKeyByPattern(c->m_cur_selected_db,sop->pattern,
-                    vector[j].obj);
+                robj *val = getvals ? getvals[(j-start)*getop+k++] :
+                    lookupKeyByPattern(c->m_cur_selected_db,sop->pattern,
+                                       vector[j].obj);
 
                 if (sop->type == SORT_OP_GET) {
                     if (!val) {
                         c->addReply(shared.nullbulk);
                     } else {
                         c->addReplyBulk(val);
-                        decrRefCount(val);
+                        if (!getvals) decrRefCount(val);
                     }
                 } else {
                     /* Always fails */
@@ -537,10 +1003,19 @@ void sortCommand(client *c) {
                 listTypePush(sobj,vector[j].obj,LIST_TAIL);
             } else {
                 listIter li(operations);
+                int k = 0;
                 while((ln = li.listNext())) {
                     redisSortOperation *sop = (redisSortOperation *)ln->listNodeValue();
-                    robj *val = lookupKeyByPattern(c->m_cur_selected_db,sop->pattern,
-                        vector[j].obj);
+                    robj *val;
+
+                    if (getvals) {
+                        /* Take a reference as lookupKeyByPattern() does. */
+                        val = getvals[(j-start)*getop+k++];
+                        if (val) incrRefCount(val);
+                    } else {
+                        val = lookupKeyByPattern(c->m_cur_selected_db,
+                            sop->pattern,vector[j].obj);
+                    }
 
                     if (sop->type == SORT_OP_GET) {
                         if (!val) val = createStringObject("",0);
@@ -572,6 +1047,9 @@ void sortCommand(client *c) {
     }
 
     /* Cleanup */
+    for (long k = 0; k < numowned; k++) decrRefCount(ownedvals[k]);
+    zfree(ownedvals);
+    zfree(getvals);
     for (j = 0; j < vectorlen; j++)
         decrRefCount(vector[j].obj);
 
@@ -581,5 +1059,4 @@ void sortCommand(client *c) {
         if (alpha && vector[j].u.cmpobj)
             decrRefCount(vector[j].u.cmpobj);
     }
-    zfree(vector);
 }
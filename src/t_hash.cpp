@@ -28,6 +28,8 @@
  */
 
 #include "server.h"
+#include "snapshot.h"
+#include "bgread.h"
 #include <math.h>
 
 /*-----------------------------------------------------------------------------
@@ -35,12 +37,12 @@
  *----------------------------------------------------------------------------*/
 
 /* Check the length of a number of objects to see if we need to convert a
- * ziplist to a real hash. Note that we only check string encoded objects
+ * listpack to a real hash. Note that we only check string encoded objects
  * as their string length can be queried in constant time. */
 void hashTypeTryConversion(robj *o, robj **argv, int start, int end) {
     int i;
 
-    if (o->encoding != OBJ_ENCODING_ZIPLIST) return;
+    if (o->encoding != OBJ_ENCODING_LISTPACK) return;
 
     for (i = start; i <= end; i++) {
         if (sdsEncodedObject(argv[i]) &&
@@ -52,9 +54,9 @@ void hashTypeTryConversion(robj *o, robj **argv, int start, int end) {
     }
 }
 
-/* Get the value from a ziplist encoded hash, identified by field.
+/* Get the value from a listpack encoded hash, identified by field.
  * Returns -1 when the field cannot be found. */
-int hashTypeGetFromZiplist(robj *o, sds field,
+int hashTypeGetFromListpack(robj *o, sds field,
                            unsigned char **vstr,
                            unsigned int *vlen,
                            long long *vll)
@@ -62,21 +64,21 @@ int hashTypeGetFromZiplist(robj *o, sds field,
     unsigned char *zl, *fptr = NULL, *vptr = NULL;
     int ret;
 
-    serverAssert(o->encoding == OBJ_ENCODING_ZIPLIST);
+    serverAssert(o->encoding == OBJ_ENCODING_LISTPACK);
 
     zl = (unsigned char *)o->ptr;
-    fptr = ziplistIndex(zl, ZIPLIST_HEAD);
+    fptr = lpFirst(zl);
     if (fptr != NULL) {
-        fptr = ziplistFind(fptr, (unsigned char*)field, sdslen(field), 1);
+        fptr = lpFind(zl, fptr, (unsigned char*)field, sdslen(field), 1);
         if (fptr != NULL) {
             /* Grab pointer to the value (fptr points to the field) */
-            vptr = ziplistNext(zl, fptr);
+            vptr = lpNext(zl, fptr);
             serverAssert(vptr != NULL);
         }
     }
 
     if (vptr != NULL) {
-        ret = ziplistGet(vptr, vstr, vlen, vll);
+        ret = lpGetValue(vptr, vstr, vlen, vll);
         serverAssert(ret);
         return 0;
     }
@@ -84,17 +86,118 @@ int hashTypeGetFromZiplist(robj *o, sds field,
     return -1;
 }
 
+/* Find the values of many fields of a listpack encoded hash in a single pass
+ * over the listpack. The 'count' fields are argv[0], argv[step], ... so that
+ * both the fields of HMGET and the field / value pairs of HSET can be passed.
+ * On return offsets[j] is the offset in the listpack of the value of the
+ * field j, or 0 if the field does not exist, since the header makes 0 an
+ * invalid offset. The number of distinct fields is returned.
+ *
+ * Looking the fields up one by one with lpFind() would cost O(N) each: here
+ * the fields go into a small open addressing table probed with every field
+ * of the listpack, so the cost is O(N+M). */
+#define HASH_LOOKUP_STATIC_SLOTS 64
+int hashTypeListpackFindMany(unsigned char *zl, robj **argv, int step,
+                             int count, size_t *offsets)
+{
+    int static_slots[HASH_LOOKUP_STATIC_SLOTS], *slots = static_slots;
+    unsigned char intbuf[LP_INTBUF_SIZE], *fptr, *vptr, *s;
+    unsigned long size = 4, mask, idx;
+    int j, k, distinct = 0, found = 0;
+    int64_t len;
+
+    while (size < (unsigned long)count*2) size <<= 1;
+    if (size > HASH_LOOKUP_STATIC_SLOTS)
+        slots = (int *)zmalloc(sizeof(int)*size);
+    mask = size-1;
+    for (idx = 0; idx < size; idx++) slots[idx] = -1;
+
+    /* Index the fields. A field requested more than once is only indexed
+     * the first time, and gets the offset of its first occurrence below. */
+    for (j = 0; j < count; j++) {
+        sds field = (sds)argv[j*step]->ptr;
+
+        offsets[j] = 0;
+        idx = dictGenHashFunction(field,sdslen(field)) & mask;
+        while ((k = slots[idx]) != -1 &&
+               sdscmp(field,(sds)argv[k*step]->ptr) != 0)
+            idx = (idx+1) & mask;
+        if (k == -1) {
+            slots[idx] = j;
+            distinct++;
+        }
+    }
+
+    /* Probe the table with every field of the listpack. */
+    fptr = lpFirst(zl);
+    while (fptr != NULL && found < distinct) {
+        vptr = lpNext(zl,fptr);
+        serverAssert(vptr != NULL);
+        s = lpGet(fptr,&len,intbuf);
+        idx = dictGenHashFunction(s,(int)len) & mask;
+        while ((k = slots[idx]) != -1) {
+            sds field = (sds)argv[k*step]->ptr;
+            if ((int64_t)sdslen(field) == len && !memcmp(field,s,len)) {
+                offsets[k] = vptr-zl;
+                found++;
+                break;
+            }
+            idx = (idx+1) & mask;
+        }
+        fptr = lpNext(zl,vptr);
+    }
+
+    /* Fields requested more than once. */
+    if (distinct != count) {
+        for (j = 0; j < count; j++) {
+            sds field = (sds)argv[j*step]->ptr;
+
+            idx = dictGenHashFunction(field,sdslen(field)) & mask;
+            while (sdscmp(field,(sds)argv[slots[idx]*step]->ptr) != 0)
+                idx = (idx+1) & mask;
+            offsets[j] = offsets[slots[idx]];
+        }
+    }
+    if (slots != static_slots) zfree(slots);
+    return distinct;
+}
+
 /* Get the value from a hash table encoded hash, identified by field.
- * Returns NULL when the field cannot be found, otherwise the SDS value
- * is returned. */
-sds hashTypeGetFromHashTable(robj *o, sds field) {
+ * Returns -1 when the field cannot be found, otherwise 0 with the SDS value
+ * stored in *vstr, or, if the value is an integer, *vstr set to NULL and
+ * the integer stored in *vll. */
+int hashTypeGetFromHashTable(robj *o, sds field, sds *vstr, long long *vll) {
     dictEntry *de;
 
     serverAssert(o->encoding == OBJ_ENCODING_HT);
 
-    de = ((dict*)o->ptr)->dictFind(field);
-    if (de == NULL) return NULL;
-    return (sds)de->dictGetVal();
+    de = ((sdsDict*)o->ptr)->dictFind(field);
+    if (de == NULL) return -1;
+    if (hashDictValIsInt(de)) {
+        *vstr = NULL;
+        *vll = hashDictValGetInt(de);
+    } else {
+        *vstr = (sds)de->dictGetVal();
+    }
+    return 0;
+}
+
+/* Return true if the hash value 'value' should be stored as an integer in
+ * a hash table, storing it in *ll. Only the canonical representations,
+ * that format back to the same string, are converted. */
+static int hashValueToInt(sds value, long long *ll) {
+    return sdslen(value) <= 20 && string2ll(value,sdslen(value),ll) &&
+           *ll >= HASH_INT_VAL_MIN && *ll <= HASH_INT_VAL_MAX;
+}
+
+/* Set the value of the hash table entry 'de' to the integer 'll' if it
+ * fits, or to a new sds string otherwise, releasing the old value. */
+static void hashDictSetLongLong(dictEntry *de, long long ll) {
+    if (!hashDictValIsInt(de)) sdsfree((sds)de->dictGetVal());
+    if (ll >= HASH_INT_VAL_MIN && ll <= HASH_INT_VAL_MAX)
+        hashDictValSetInt(de,ll);
+    else
+        de->dictSetVal(sdsfromlonglong(ll));
 }
 
 /* Higher level function of hashTypeGet*() that returns the hash value
@@ -107,15 +210,15 @@ sds hashTypeGetFromHashTable(robj *o, sds field) {
  * can always check the function return by checking the return value
  * for C_OK and checking if vll (or vstr) is NULL. */
 int hashTypeGetValue(robj *o, sds field, unsigned char **vstr, unsigned int *vlen, long long *vll) {
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         *vstr = NULL;
-        if (hashTypeGetFromZiplist(o, field, vstr, vlen, vll) == 0)
+        if (hashTypeGetFromListpack(o, field, vstr, vlen, vll) == 0)
             return C_OK;
     } else if (o->encoding == OBJ_ENCODING_HT) {
         sds value;
-        if ((value = hashTypeGetFromHashTable(o, field)) != NULL) {
+        if (hashTypeGetFromHashTable(o, field, &value, vll) == 0) {
             *vstr = (unsigned char*) value;
-            *vlen = sdslen(value);
+            if (value) *vlen = sdslen(value);
             return C_OK;
         }
     } else {
@@ -143,18 +246,19 @@ robj *hashTypeGetValueObject(robj *o, sds field) {
  * exist. */
 size_t hashTypeGetValueLength(robj *o, sds field) {
     size_t len = 0;
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        if (hashTypeGetFromZiplist(o, field, &vstr, &vlen, &vll) == 0)
+        if (hashTypeGetFromListpack(o, field, &vstr, &vlen, &vll) == 0)
             len = vstr ? vlen : sdigits10(vll);
     } else if (o->encoding == OBJ_ENCODING_HT) {
         sds aux;
+        long long vll;
 
-        if ((aux = hashTypeGetFromHashTable(o, field)) != NULL)
-            len = sdslen(aux);
+        if (hashTypeGetFromHashTable(o, field, &aux, &vll) == 0)
+            len = aux ? sdslen(aux) : sdigits10(vll);
     } else {
         serverPanic("Unknown hash encoding");
     }
@@ -164,14 +268,14 @@ size_t hashTypeGetValueLength(robj *o, sds field) {
 /* Test if the specified field exists in the given hash. Returns 1 if the field
  * exists, and 0 when it doesn't. */
 int hashTypeExists(robj *o, sds field) {
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        if (hashTypeGetFromZiplist(o, field, &vstr, &vlen, &vll) == 0) return 1;
+        if (hashTypeGetFromListpack(o, field, &vstr, &vlen, &vll) == 0) return 1;
     } else if (o->encoding == OBJ_ENCODING_HT) {
-        if (hashTypeGetFromHashTable(o, field) != NULL) return 1;
+        if (((sdsDict*)o->ptr)->dictFind(field) != NULL) return 1;
     } else {
         serverPanic("Unknown hash encoding");
     }
@@ -202,66 +306,60 @@ int hashTypeExists(robj *o, sds field) {
 int hashTypeSet(robj *o, sds field, sds value, int flags) {
     int update = 0;
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl, *fptr, *vptr;
 
         zl = (unsigned char *)o->ptr;
-        fptr = ziplistIndex(zl, ZIPLIST_HEAD);
+        fptr = lpFirst(zl);
         if (fptr != NULL) {
-            fptr = ziplistFind(fptr, (unsigned char*)field, sdslen(field), 1);
+            fptr = lpFind(zl, fptr, (unsigned char*)field, sdslen(field), 1);
             if (fptr != NULL) {
                 /* Grab pointer to the value (fptr points to the field) */
-                vptr = ziplistNext(zl, fptr);
+                vptr = lpNext(zl, fptr);
                 serverAssert(vptr != NULL);
                 update = 1;
 
-                /* Delete value */
-                zl = ziplistDelete(zl, &vptr);
-
-                /* Insert new value */
-                zl = ziplistInsert(zl, vptr, (unsigned char*)value,
-                        sdslen(value));
+                /* Replace the value in place */
+                zl = lpInsert(zl, (unsigned char*)value, sdslen(value),
+                        vptr, LP_REPLACE, NULL);
             }
         }
 
         if (!update) {
-            /* Push new field/value pair onto the tail of the ziplist */
-            zl = ziplistPush(zl, (unsigned char*)field, sdslen(field),
-                    ZIPLIST_TAIL);
-            zl = ziplistPush(zl, (unsigned char*)value, sdslen(value),
-                    ZIPLIST_TAIL);
+            /* Push new field/value pair onto the tail of the listpack */
+            zl = lpAppend(zl, (unsigned char*)field, sdslen(field));
+            zl = lpAppend(zl, (unsigned char*)value, sdslen(value));
         }
         o->ptr = zl;
 
-        /* Check if the ziplist needs to be converted to a hash table */
-        if (hashTypeLength(o) > server.hash_max_ziplist_entries)
+        /* Check if the listpack needs to be converted to a hash table */
+        if (hashTypeLength(o) >
+            objectCompactMaxEntries(o,server.hash_max_ziplist_entries))
             hashTypeConvert(o, OBJ_ENCODING_HT);
     } else if (o->encoding == OBJ_ENCODING_HT) {
-        dictEntry *de = ((dict*)o->ptr)->dictFind(field);
+        dictEntry *de = ((sdsDict*)o->ptr)->dictFind(field);
+        long long ll;
+
         if (de) {
-            sdsfree((sds)de->dictGetVal());
-            if (flags & HASH_SET_TAKE_VALUE) {
-                de->dictSetVal(value);
-                value = NULL;
-            } else {
-                de->dictSetVal(sdsdup(value));
-            }
+            if (!hashDictValIsInt(de)) sdsfree((sds)de->dictGetVal());
             update = 1;
         } else {
-            sds f,v;
+            sds f;
             if (flags & HASH_SET_TAKE_FIELD) {
                 f = field;
                 field = NULL;
             } else {
                 f = sdsdup(field);
             }
-            if (flags & HASH_SET_TAKE_VALUE) {
-                v = value;
-                value = NULL;
-            } else {
-                v = sdsdup(value);
-            }
-            ((dict *)o->ptr)->dictAdd(f,v);
+            de = ((sdsDict*)o->ptr)->dictAddRaw(f,NULL);
+        }
+        if (hashValueToInt(value,&ll)) {
+            hashDictValSetInt(de,ll);
+        } else if (flags & HASH_SET_TAKE_VALUE) {
+            de->dictSetVal(value);
+            value = NULL;
+        } else {
+            de->dictSetVal(sdsdup(value));
         }
     } else {
         serverPanic("Unknown hash encoding");
@@ -274,28 +372,106 @@ int hashTypeSet(robj *o, sds field, sds value, int flags) {
     return update;
 }
 
+struct hashListpackUpdate {
+    size_t offset;
+    int pair;
+};
+
+static int hashListpackUpdateCompare(const void *a, const void *b) {
+    size_t oa = ((const hashListpackUpdate *)a)->offset;
+    size_t ob = ((const hashListpackUpdate *)b)->offset;
+    return (oa < ob) ? 1 : ((oa > ob) ? -1 : 0);
+}
+
+/* Set the 'count' field / value pairs argv[0], argv[1], ... of a listpack
+ * encoded hash with a single lookup pass, see hashTypeListpackFindMany(),
+ * instead of one lpFind() per pair as hashTypeSet() does. The values of the
+ * existing fields are replaced from the end of the listpack to its start, so
+ * that the offsets of the replacements still to do are not changed, then
+ * the new fields are appended. Returns the number of fields created.
+ *
+ * Like hashTypeSet() the hash is converted if it gets too many entries,
+ * while checking the length of the values is up to the caller. */
+#define HASH_UPDATE_STATIC_PAIRS 32
+int hashTypeListpackSetMany(robj *o, robj **argv, int count) {
+    size_t static_offsets[HASH_UPDATE_STATIC_PAIRS], *offsets = static_offsets;
+    hashListpackUpdate static_updates[HASH_UPDATE_STATIC_PAIRS];
+    hashListpackUpdate *updates = static_updates;
+    unsigned char *zl = (unsigned char *)o->ptr;
+    int j, updated = 0, created = 0;
+
+    serverAssert(o->encoding == OBJ_ENCODING_LISTPACK);
+    if (count > HASH_UPDATE_STATIC_PAIRS) {
+        offsets = (size_t *)zmalloc(sizeof(size_t)*count);
+        updates = (hashListpackUpdate *)zmalloc(sizeof(*updates)*count);
+    }
+
+    if (hashTypeListpackFindMany(zl,argv,2,count,offsets) != count) {
+        /* The same field is set more than once: the last value wins, and
+         * it is simpler to just set the pairs in order. */
+        for (j = 0; j < count; j++)
+            created += !hashTypeSet(o,(sds)argv[j*2]->ptr,
+                                    (sds)argv[j*2+1]->ptr,HASH_SET_COPY);
+        goto cleanup;
+    }
+
+    for (j = 0; j < count; j++) {
+        if (offsets[j] == 0) continue;
+        updates[updated].offset = offsets[j];
+        updates[updated].pair = j;
+        updated++;
+    }
+    qsort(updates,updated,sizeof(*updates),hashListpackUpdateCompare);
+    for (j = 0; j < updated; j++) {
+        sds value = (sds)argv[updates[j].pair*2+1]->ptr;
+        zl = lpInsert(zl,(unsigned char*)value,sdslen(value),
+                      zl+updates[j].offset,LP_REPLACE,NULL);
+    }
+    for (j = 0; j < count; j++) {
+        sds field = (sds)argv[j*2]->ptr, value = (sds)argv[j*2+1]->ptr;
+
+        if (offsets[j] != 0) continue;
+        zl = lpAppend(zl,(unsigned char*)field,sdslen(field));
+        zl = lpAppend(zl,(unsigned char*)value,sdslen(value));
+        created++;
+    }
+    o->ptr = zl;
+
+    if (hashTypeLength(o) >
+        objectCompactMaxEntries(o,server.hash_max_ziplist_entries))
+        hashTypeConvert(o, OBJ_ENCODING_HT);
+
+cleanup:
+    if (offsets != static_offsets) {
+        zfree(offsets);
+        zfree(updates);
+    }
+    return created;
+}
+
 /* Delete an element from a hash.
  * Return 1 on deleted and 0 on not found. */
 int hashTypeDelete(robj *o, sds field) {
     int deleted = 0;
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl, *fptr;
 
         zl = (unsigned char *)o->ptr;
-        fptr = ziplistIndex(zl, ZIPLIST_HEAD);
+        fptr = lpFirst(zl);
         if (fptr != NULL) {
-            fptr = ziplistFind(fptr, (unsigned char*)field, sdslen(field), 1);
+            fptr = lpFind(zl, fptr, (unsigned char*)field, sdslen(field), 1);
             if (fptr != NULL) {
-                zl = ziplistDelete(zl,&fptr); /* Delete the key. */
-                zl = ziplistDelete(zl,&fptr); /* Delete the value. */
+                zl = lpDelete(zl,fptr,&fptr); /* Delete the key. */
+                zl = lpDelete(zl,fptr,&fptr); /* Delete the value. */
                 o->ptr = zl;
                 deleted = 1;
             }
         }
     } else if (o->encoding == OBJ_ENCODING_HT) {
-        if (((dict*)o->ptr)->dictDelete(field) == C_OK) {
+        if (((sdsDict*)o->ptr)->dictDelete(field) == C_OK) {
             deleted = 1;
+            hashTypeRemoveFieldExpire(o,field);
 
             /* Always check if the dictionary needs a resize after a delete. */
             if (htNeedsResize((dict*)o->ptr))
@@ -312,8 +488,8 @@ int hashTypeDelete(robj *o, sds field) {
 unsigned long hashTypeLength(const robj *o) {
     unsigned long length = ULONG_MAX;
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-        length = ziplistLen((unsigned char*)o->ptr) / 2;
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        length = lpLength((unsigned char*)o->ptr) / 2;
     } else if (o->encoding == OBJ_ENCODING_HT) {
         length = (((dict*)o->ptr)->dictSize());
     } else {
@@ -335,7 +511,7 @@ hashTypeIterator::hashTypeIterator(robj* in_subject)
 , m_di(NULL)
 , m_de(NULL)
 {
-    if (m_encoding == OBJ_ENCODING_ZIPLIST) {
+    if (m_encoding == OBJ_ENCODING_LISTPACK) {
     } else if (m_encoding == OBJ_ENCODING_HT) {
         m_di = dictGetIterator((dict*)in_subject->ptr);
     } else {
@@ -359,7 +535,7 @@ hashTypeIterator::~hashTypeIterator()
  * could be found and C_ERR when the iterator reaches the end. */
 int hashTypeIterator::hashTypeNext()
 {
-    if (m_encoding == OBJ_ENCODING_ZIPLIST) {
+    if (m_encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl;
         unsigned char *fptr, *vptr;
 
@@ -370,16 +546,16 @@ int hashTypeIterator::hashTypeNext()
         if (fptr == NULL) {
             /* Initialize cursor */
             serverAssert(vptr == NULL);
-            fptr = ziplistIndex(zl, 0);
+            fptr = lpFirst(zl);
         } else {
             /* Advance cursor */
             serverAssert(vptr != NULL);
-            fptr = ziplistNext(zl, vptr);
+            fptr = lpNext(zl, vptr);
         }
         if (fptr == NULL) return C_ERR;
 
         /* Grab pointer to the value (fptr points to the field) */
-        vptr = ziplistNext(zl, fptr);
+        vptr = lpNext(zl, fptr);
         serverAssert(vptr != NULL);
 
         /* fptr, vptr now point to the first or next pair */
@@ -395,21 +571,21 @@ int hashTypeIterator::hashTypeNext()
 }
 
 /* Get the field or value at iterator cursor, for an iterator on a hash value
- * encoded as a ziplist. Prototype is similar to `hashTypeGetFromZiplist`. */
-void hashTypeIterator::hashTypeCurrentFromZiplist(int what,
+ * encoded as a listpack. Prototype is similar to `hashTypeGetFromListpack`. */
+void hashTypeIterator::hashTypeCurrentFromListpack(int what,
                                 unsigned char **vstr,
                                 unsigned int *vlen,
                                 long long *vll)
 {
     int ret;
 
-    serverAssert(m_encoding == OBJ_ENCODING_ZIPLIST);
+    serverAssert(m_encoding == OBJ_ENCODING_LISTPACK);
 
     if (what & OBJ_HASH_KEY) {
-        ret = ziplistGet(m_fptr, vstr, vlen, vll);
+        ret = lpGetValue(m_fptr, vstr, vlen, vll);
         serverAssert(ret);
     } else {
-        ret = ziplistGet(m_vptr, vstr, vlen, vll);
+        ret = lpGetValue(m_vptr, vstr, vlen, vll);
         serverAssert(ret);
     }
 }
@@ -417,14 +593,17 @@ void hashTypeIterator::hashTypeCurrentFromZiplist(int what,
 /* Get the field or value at iterator cursor, for an iterator on a hash value
  * encoded as a hash table. Prototype is similar to
  * `hashTypeGetFromHashTable`. */
-sds hashTypeIterator::hashTypeCurrentFromHashTable(int what)
+void hashTypeIterator::hashTypeCurrentFromHashTable(int what, sds *vstr, long long *vll)
 {
     serverAssert(m_encoding == OBJ_ENCODING_HT);
 
     if (what & OBJ_HASH_KEY) {
-        return (sds)m_de->dictGetKey();
+        *vstr = (sds)m_de->dictGetKey();
+    } else if (hashDictValIsInt(m_de)) {
+        *vstr = NULL;
+        *vll = hashDictValGetInt(m_de);
     } else {
-        return (sds)m_de->dictGetVal();
+        *vstr = (sds)m_de->dictGetVal();
     }
 }
 
@@ -440,13 +619,14 @@ sds hashTypeIterator::hashTypeCurrentFromHashTable(int what)
  * type checking if vstr == NULL. */
 void hashTypeIterator::hashTypeCurrentObject(int what, unsigned char **vstr, unsigned int *vlen, long long *vll)
 {
-    if (m_encoding == OBJ_ENCODING_ZIPLIST) {
+    if (m_encoding == OBJ_ENCODING_LISTPACK) {
         *vstr = NULL;
-        hashTypeCurrentFromZiplist(what, vstr, vlen, vll);
+        hashTypeCurrentFromListpack(what, vstr, vlen, vll);
     } else if (m_encoding == OBJ_ENCODING_HT) {
-        sds ele = hashTypeCurrentFromHashTable(what);
+        sds ele;
+        hashTypeCurrentFromHashTable(what, &ele, vll);
         *vstr = (unsigned char*) ele;
-        *vlen = sdslen(ele);
+        if (ele) *vlen = sdslen(ele);
     } else {
         serverPanic("Unknown hash encoding");
     }
@@ -480,29 +660,49 @@ robj *hashTypeLookupWriteOrCreate(client *c, robj *key) {
     return o;
 }
 
-void hashTypeConvertZiplist(robj *o, int enc) {
-    serverAssert(o->encoding == OBJ_ENCODING_ZIPLIST);
+void hashTypeConvertListpack(robj *o, int enc) {
+    serverAssert(o->encoding == OBJ_ENCODING_LISTPACK);
 
-    if (enc == OBJ_ENCODING_ZIPLIST) {
+    if (enc == OBJ_ENCODING_LISTPACK) {
         /* Nothing to do... */
 
     } else if (enc == OBJ_ENCODING_HT) {
         dict *_dict;
-        int ret;
 
         hashTypeIterator hi(o);
-        _dict = dictCreate(&hashDictType, NULL);
+        _dict = sdsDictCreate(&hashDictType, NULL);
 
         while (hi.hashTypeNext() != C_ERR) {
-            sds key, value;
+            sds key;
+            unsigned char *vstr;
+            unsigned int vlen;
+            long long vll;
+            dictEntry *de;
 
             key = hi.hashTypeCurrentObjectNewSds(OBJ_HASH_KEY);
-            value = hi.hashTypeCurrentObjectNewSds(OBJ_HASH_VALUE);
-            ret = _dict->dictAdd(key, value);
-            if (ret != DICT_OK) {
-                serverLogHexDump(LL_WARNING,"ziplist with dup elements dump",
-                    o->ptr,ziplistBlobLen((unsigned char *)o->ptr));
-                serverPanic("Ziplist corruption detected");
+            de = _dict->dictAddRaw(key,NULL);
+            if (de == NULL) {
+                serverLogHexDump(LL_WARNING,"listpack with dup elements dump",
+                    o->ptr,lpBytes((unsigned char *)o->ptr));
+                serverPanic("Listpack corruption detected");
+            }
+
+            /* The integers of the listpack are stored as such, the strings
+             * that look like integers too. */
+            hi.hashTypeCurrentObject(OBJ_HASH_VALUE,&vstr,&vlen,&vll);
+            if (vstr == NULL) {
+                if (vll >= HASH_INT_VAL_MIN && vll <= HASH_INT_VAL_MAX)
+                    hashDictValSetInt(de,vll);
+                else
+                    de->dictSetVal(sdsfromlonglong(vll));
+            } else {
+                sds value = sdsnewlen(vstr,vlen);
+                if (hashValueToInt(value,&vll)) {
+                    hashDictValSetInt(de,vll);
+                    sdsfree(value);
+                } else {
+                    de->dictSetVal(value);
+                }
             }
         }
 
@@ -514,16 +714,298 @@ void hashTypeConvertZiplist(robj *o, int enc) {
     }
 }
 
+/* Convert a hash table encoded hash back into a listpack. The caller checks
+ * that the hash fits, see hashTypeCompactIfNeeded(). */
+static void hashTypeConvertHashTable(robj *o, int enc) {
+    serverAssert(o->encoding == OBJ_ENCODING_HT);
+
+    if (enc == OBJ_ENCODING_HT) {
+        /* Nothing to do... */
+
+    } else if (enc == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp = lpNew();
+        char buf[LONG_STR_SIZE];
+
+        serverAssert(hashTypeFieldExpires(o) == NULL);
+        {
+            hashTypeIterator hi(o);
+            while (hi.hashTypeNext() != C_ERR) {
+                unsigned char *vstr;
+                unsigned int vlen;
+                long long vll;
+                int what[2] = {OBJ_HASH_KEY, OBJ_HASH_VALUE};
+
+                for (int j = 0; j < 2; j++) {
+                    hi.hashTypeCurrentObject(what[j],&vstr,&vlen,&vll);
+                    if (vstr == NULL) {
+                        vlen = ll2string(buf,sizeof(buf),vll);
+                        vstr = (unsigned char*)buf;
+                    }
+                    lp = lpAppend(lp,vstr,vlen);
+                }
+            }
+        }
+        dictRelease((dict*)o->ptr);
+        o->encoding = OBJ_ENCODING_LISTPACK;
+        o->ptr = lp;
+    } else {
+        serverPanic("Unknown hash encoding");
+    }
+}
+
 void hashTypeConvert(robj *o, int enc) {
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-        hashTypeConvertZiplist(o, enc);
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        hashTypeConvertListpack(o, enc);
     } else if (o->encoding == OBJ_ENCODING_HT) {
-        serverPanic("Not implemented");
+        hashTypeConvertHashTable(o, enc);
     } else {
         serverPanic("Unknown hash encoding");
     }
 }
 
+/* Convert a hash table encoded hash into a listpack if it is within the
+ * hash-max-ziplist-* limits and has no fields with a TTL. Returns 1 if the
+ * hash was converted. */
+int hashTypeCompactIfNeeded(robj *o) {
+    dict *d = (dict*)o->ptr;
+
+    if (o->encoding != OBJ_ENCODING_HT || hashTypeFieldExpires(o) ||
+        d->dictSize() > server.hash_max_ziplist_entries) return 0;
+
+    {
+        dictIterator di(d);
+        dictEntry *de;
+        while ((de = di.dictNext()) != NULL) {
+            size_t vlen = hashDictValIsInt(de) ?
+                (size_t)sdigits10(hashDictValGetInt(de)) :
+                sdslen((sds)de->dictGetVal());
+            if (sdslen((sds)de->dictGetKey()) > server.hash_max_ziplist_value ||
+                vlen > server.hash_max_ziplist_value) return 0;
+        }
+    }
+    hashTypeConvert(o, OBJ_ENCODING_LISTPACK);
+    return 1;
+}
+
+/*-----------------------------------------------------------------------------
+ * Hash fields expiration API
+ *----------------------------------------------------------------------------*/
+
+/* Return the expire time of the hash field, or -1 if it has no TTL. */
+long long hashTypeGetFieldExpire(robj *o, sds field) {
+    robj *expires = hashTypeFieldExpires(o);
+    double when;
+
+    if (expires == NULL || zsetScore(expires,field,&when) == C_ERR) return -1;
+    return (long long)when;
+}
+
+/* Set the expire time of an existing field, converting the hash to a hash
+ * table if needed. Its db->m_hexpires entry, if any, is up to the caller,
+ * see hashExpireIndexAdd(). */
+void hashTypeSetFieldExpire(robj *o, sds field, long long when) {
+    int flags = ZADD_NONE;
+    robj *expires;
+
+    if (o->encoding == OBJ_ENCODING_LISTPACK)
+        hashTypeConvert(o,OBJ_ENCODING_HT);
+    if ((expires = hashTypeFieldExpires(o)) == NULL) {
+        expires = createZsetListpackObject();
+        ((dict*)o->ptr)->m_privdata = expires;
+    }
+    serverAssert(zsetAdd(expires,(double)when,field,&flags,NULL));
+}
+
+/* Remove the TTL of a field. Returns 1 if the field had a TTL, otherwise 0.
+ * The sorted set of the fields expire times is freed with its last field,
+ * so that the hashes without TTLs only pay for a NULL pointer. */
+int hashTypeRemoveFieldExpire(robj *o, sds field) {
+    robj *expires = hashTypeFieldExpires(o);
+
+    if (expires == NULL || !zsetDel(expires,field)) return 0;
+    if (zsetLength(expires) == 0) hashTypeFreeFieldExpires(o);
+    return 1;
+}
+
+/* Store in '*pairs' a new array with the fields having a TTL and their
+ * expire time, in no particular order, and return its length. The fields
+ * are new SDS strings, the caller frees them and the array. */
+unsigned long hashTypeGetFieldExpires(robj *o, zskiplistPair **pairs) {
+    robj *expires = hashTypeFieldExpires(o);
+    unsigned long count = 0;
+
+    *pairs = NULL;
+    if (expires == NULL) return 0;
+    *pairs = (zskiplistPair *)zmalloc(sizeof(zskiplistPair)*zsetLength(expires));
+    if (expires->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *zl = (unsigned char *)expires->ptr;
+        unsigned char *eptr = lpSeek(zl,0), *sptr;
+
+        while (eptr != NULL) {
+            sptr = lpNext(zl,eptr);
+            (*pairs)[count].ele = lpGetObject(eptr);
+            (*pairs)[count].score = zzlGetScore(sptr);
+            count++;
+            zzlNext(zl,&eptr,&sptr);
+        }
+    } else {
+        zset *zs = (zset *)expires->ptr;
+        dictIterator di(zs->_dict);
+        dictEntry *de;
+
+        while ((de = di.dictNext()) != NULL) {
+            (*pairs)[count].ele = sdsdup((sds)de->dictGetKey());
+            (*pairs)[count].score = zsetDictScore(zs,de);
+            count++;
+        }
+    }
+    return count;
+}
+
+void hashTypeFreeFieldExpires(robj *o) {
+    robj *expires = hashTypeFieldExpires(o);
+
+    if (expires == NULL) return;
+    decrRefCount(expires);
+    ((dict*)o->ptr)->m_privdata = NULL;
+}
+
+/* Propagate the deletion of an expired field to the AOF and the slaves as
+ * an HDEL, like propagateExpire() does for keys. */
+static void propagateFieldExpire(redisDb *db, robj *key, sds field) {
+    robj *argv[3];
+
+    argv[0] = createStringObject("HDEL",4);
+    argv[1] = key;
+    argv[2] = createStringObject(field,sdslen(field));
+    incrRefCount(argv[1]);
+
+    if (server.aof_state != AOF_OFF)
+        feedAppendOnlyFile(server.hdelCommand,db->m_id,argv,3);
+    replicationFeedSlaves(server.slaves,db->m_id,argv,3);
+
+    decrRefCount(argv[0]);
+    decrRefCount(argv[1]);
+    decrRefCount(argv[2]);
+}
+
+/* Delete the fields of the hash 'o' stored at 'key' that expired at the
+ * unix time 'now' in milliseconds, in order of expire time and no more
+ * than 'max' of them, and the key itself if no field is left, in which
+ * case '*keyremoved' is set to 1. Returns the number of fields deleted. */
+unsigned long hashTypeExpireFields(redisDb *db, robj *key, robj *o,
+                                   long long now, unsigned long max,
+                                   int *keyremoved)
+{
+    unsigned long expired = 0;
+    robj *expires;
+    double when;
+    sds field;
+
+    *keyremoved = 0;
+    while (expired < max && (expires = hashTypeFieldExpires(o)) != NULL &&
+           zsetFirst(expires,&field,&when))
+    {
+        if (now <= (long long)when) {
+            sdsfree(field);
+            break;
+        }
+        if (expired == 0 && server.rdb_snapshot)
+            snapshotPreserveKey(db,key);
+        serverAssert(hashTypeDelete(o,field));
+        propagateFieldExpire(db,key,field);
+        sdsfree(field);
+        expired++;
+        server.stat_expired_fields++;
+        if (hashTypeLength(o) == 0) {
+            dbDelete(db,key);
+            *keyremoved = 1;
+            break;
+        }
+    }
+    if (expired) {
+        notifyKeyspaceEvent(NOTIFY_HASH,"hexpired",key,db->m_id);
+        if (*keyremoved)
+            notifyKeyspaceEvent(NOTIFY_GENERIC,"del",key,db->m_id);
+    }
+    return expired;
+}
+
+/* Called by the key lookup functions on every hash: delete its fields that
+ * reached their TTL. Returns 1 if the key was deleted since no field was
+ * left, otherwise 0.
+ *
+ * Like expireIfNeeded() nothing is done while loading, when time is frozen
+ * by a Lua script, and in the slaves, that wait for the HDELs synthesized
+ * by their master, nor while other threads read the dataset. */
+int hashExpireFieldsIfNeeded(redisDb *db, robj *key, robj *o) {
+    long long now;
+    int keyremoved;
+
+    if (hashTypeFieldExpires(o) == NULL) return 0;
+    if (server.loading || server.masterhost != NULL ||
+        datasetReadShared()) return 0;
+    now = server.lua_caller ? server.lua_time_start : mstime();
+    hashTypeExpireFields(db,key,o,now,ULONG_MAX,&keyremoved);
+    return keyremoved;
+}
+
+/* Make sure the hash stored at 'key' is in the db->m_hexpires index with a
+ * time that is not greater than the expire time of its first field. Every
+ * change lowering this time calls it, so that the index only has to be
+ * updated when the time gets lower: an entry older than needed just makes
+ * hashExpireIndexCycle() visit the hash early. */
+void hashExpireIndexAdd(redisDb *db, robj *key, robj *o) {
+    robj *expires = hashTypeFieldExpires(o);
+    double first, indexed;
+    int flags = ZADD_NONE;
+    sds field;
+
+    if (expires == NULL || !zsetFirst(expires,&field,&first)) return;
+    sdsfree(field);
+    if (zsetScore(db->m_hexpires,(sds)key->ptr,&indexed) == C_OK &&
+        indexed <= first) return;
+    zsetAdd(db->m_hexpires,first,(sds)key->ptr,&flags,NULL);
+}
+
+/* Incremental collection of expired hash fields: visit the hashes of the
+ * index in order of time, and expire their fields that reached their TTL,
+ * up to 'max' fields. Every visited hash is indexed again with its new
+ * first expire time. Returns the number of fields expired, so that the
+ * caller can stop when it is less than 'max'. */
+unsigned long hashExpireIndexCycle(redisDb *db, long long now,
+                                   unsigned long max)
+{
+    unsigned long expired = 0;
+    double when;
+    sds name;
+
+    while (expired < max && zsetFirst(db->m_hexpires,&name,&when)) {
+        if (now <= (long long)when) {
+            sdsfree(name);
+            break;
+        }
+        zsetDel(db->m_hexpires,name);
+
+        /* The key may be gone or have a value without fields to expire,
+         * in which case the index entry is just dropped. */
+        dictEntry *de = db->m_dict->dictFind(name);
+        robj *o = de ? (robj *)de->dictGetVal() : NULL;
+        if (o && o->type == OBJ_HASH && hashTypeFieldExpires(o)) {
+            robj *key = createObject(OBJ_STRING,name);
+            int keyremoved;
+
+            expired += hashTypeExpireFields(db,key,o,now,max-expired,
+                                            &keyremoved);
+            if (!keyremoved) hashExpireIndexAdd(db,key,o);
+            decrRefCount(key);
+        } else {
+            sdsfree(name);
+        }
+    }
+    return expired;
+}
+
 /*-----------------------------------------------------------------------------
  * Hash type commands
  *----------------------------------------------------------------------------*/
@@ -556,8 +1038,22 @@ void hsetCommand(client *c) {
     if ((o = hashTypeLookupWriteOrCreate(c,c->m_argv[1])) == NULL) return;
     hashTypeTryConversion(o,c->m_argv,2,c->m_argc-1);
 
-    for (i = 2; i < c->m_argc; i += 2)
-        created += !hashTypeSet(o, (sds)c->m_argv[i]->ptr, (sds)c->m_argv[i+1]->ptr,HASH_SET_COPY);
+    /* Many pairs are set in a listpack with a single lookup pass. */
+    if (o->encoding == OBJ_ENCODING_LISTPACK && c->m_argc > 4) {
+        created = hashTypeListpackSetMany(o,c->m_argv+2,(c->m_argc-2)/2);
+        i = c->m_argc;
+    } else {
+        i = 2;
+    }
+    for (; i < c->m_argc; i += 2) {
+        sds field = (sds)c->m_argv[i]->ptr;
+
+        /* Overwriting a field also clears its TTL, like SET does. */
+        if (hashTypeSet(o,field,(sds)c->m_argv[i+1]->ptr,HASH_SET_COPY))
+            hashTypeRemoveFieldExpire(o,field);
+        else
+            created++;
+    }
 
     /* HMSET (deprecated) and HSET return value is different. */
     char *cmdname = (char *)c->m_argv[0]->ptr;
@@ -579,10 +1075,25 @@ void hincrbyCommand(client *c) {
     sds _new;
     unsigned char *vstr;
     unsigned int vlen;
+    dictEntry *de = NULL;
 
     if (getLongLongFromObjectOrReply(c,c->m_argv[3],&incr,NULL) != C_OK) return;
     if ((o = hashTypeLookupWriteOrCreate(c,c->m_argv[1])) == NULL) return;
-    if (hashTypeGetValue(o, (sds)c->m_argv[2]->ptr,&vstr,&vlen,&value) == C_OK) {
+    if (o->encoding == OBJ_ENCODING_HT &&
+        (de = ((sdsDict*)o->ptr)->dictFind(c->m_argv[2]->ptr)) != NULL)
+    {
+        /* The value is updated in the entry, without looking it up again
+         * and, when it is an integer, without any conversion. */
+        if (hashDictValIsInt(de)) {
+            value = hashDictValGetInt(de);
+        } else {
+            sds v = (sds)de->dictGetVal();
+            if (string2ll(v,sdslen(v),&value) == 0) {
+                c->addReplyError("hash value is not an integer");
+                return;
+            }
+        }
+    } else if (hashTypeGetValue(o, (sds)c->m_argv[2]->ptr,&vstr,&vlen,&value) == C_OK) {
         if (vstr) {
             if (string2ll((char*)vstr,vlen,&value) == 0) {
                 c->addReplyError("hash value is not an integer");
@@ -600,8 +1111,12 @@ void hincrbyCommand(client *c) {
         return;
     }
     value += incr;
-    _new = sdsfromlonglong(value);
-    hashTypeSet(o, (sds)c->m_argv[2]->ptr, _new,HASH_SET_TAKE_VALUE);
+    if (de) {
+        hashDictSetLongLong(de,value);
+    } else {
+        _new = sdsfromlonglong(value);
+        hashTypeSet(o, (sds)c->m_argv[2]->ptr, _new,HASH_SET_TAKE_VALUE);
+    }
     c->addReplyLongLong(value);
     signalModifiedKey(c->m_cur_selected_db,c->m_argv[1]);
     notifyKeyspaceEvent(NOTIFY_HASH,"hincrby",c->m_argv[1],c->m_cur_selected_db->m_id);
@@ -664,12 +1179,12 @@ static void addHashFieldToReply(client *c, robj *o, sds field) {
         return;
     }
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        ret = hashTypeGetFromZiplist(o, field, &vstr, &vlen, &vll);
+        ret = hashTypeGetFromListpack(o, field, &vstr, &vlen, &vll);
         if (ret < 0) {
             c->addReply( shared.nullbulk);
         } else {
@@ -681,11 +1196,15 @@ static void addHashFieldToReply(client *c, robj *o, sds field) {
         }
 
     } else if (o->encoding == OBJ_ENCODING_HT) {
-        sds value = hashTypeGetFromHashTable(o, field);
-        if (value == NULL)
+        sds value;
+        long long vll;
+
+        if (hashTypeGetFromHashTable(o, field, &value, &vll) < 0)
             c->addReply( shared.nullbulk);
-        else
+        else if (value)
             c->addReplyBulkCBuffer( value, sdslen(value));
+        else
+            c->addReplyBulkLongLong(vll);
     } else {
         serverPanic("Unknown hash encoding");
     }
@@ -713,6 +1232,33 @@ void hmgetCommand(client *c) {
     }
 
     c->addReplyMultiBulkLen( c->m_argc-2);
+    if (o != NULL && o->encoding == OBJ_ENCODING_LISTPACK && c->m_argc > 3) {
+        /* Find all the fields with a single pass over the listpack. */
+        size_t static_offsets[HASH_UPDATE_STATIC_PAIRS], *offsets = static_offsets;
+        unsigned char *zl = (unsigned char *)o->ptr;
+        int count = c->m_argc-2;
+
+        if (count > HASH_UPDATE_STATIC_PAIRS)
+            offsets = (size_t *)zmalloc(sizeof(size_t)*count);
+        hashTypeListpackFindMany(zl,c->m_argv+2,1,count,offsets);
+        for (i = 0; i < count; i++) {
+            unsigned char *vstr;
+            unsigned int vlen;
+            long long vll;
+
+            if (offsets[i] == 0) {
+                c->addReply(shared.nullbulk);
+                continue;
+            }
+            serverAssert(lpGetValue(zl+offsets[i],&vstr,&vlen,&vll));
+            if (vstr)
+                c->addReplyBulkCBuffer(vstr,vlen);
+            else
+                c->addReplyBulkLongLong(vll);
+        }
+        if (offsets != static_offsets) zfree(offsets);
+        return;
+    }
     for (i = 2; i < c->m_argc; i++) {
         addHashFieldToReply(c, o, (sds)c->m_argv[i]->ptr);
     }
@@ -765,19 +1311,25 @@ void hstrlenCommand(client *c) {
 
 static void addHashIteratorCursorToReply(client *c, hashTypeIterator *hi, int what)
 {
-    if (hi->encoding() == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding() == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        hi->hashTypeCurrentFromZiplist(what, &vstr, &vlen, &vll);
+        hi->hashTypeCurrentFromListpack(what, &vstr, &vlen, &vll);
         if (vstr)
             c->addReplyBulkCBuffer( vstr, vlen);
         else
             c->addReplyBulkLongLong(vll);
     } else if (hi->encoding() == OBJ_ENCODING_HT) {
-        sds value = hi->hashTypeCurrentFromHashTable(what);
-        c->addReplyBulkCBuffer( value, sdslen(value));
+        sds value;
+        long long vll;
+
+        hi->hashTypeCurrentFromHashTable(what, &value, &vll);
+        if (value)
+            c->addReplyBulkCBuffer( value, sdslen(value));
+        else
+            c->addReplyBulkLongLong(vll);
     } else {
         serverPanic("Unknown hash encoding");
     }
@@ -795,6 +1347,10 @@ void genericHgetallCommand(client *c, int flags) {
     if (flags & OBJ_HASH_KEY) multiplier++;
     if (flags & OBJ_HASH_VALUE) multiplier++;
 
+    if (bgreadStart(c,o,0,hashTypeLength(o),
+            ((flags & OBJ_HASH_KEY) ? BGREAD_HASH_FIELDS : 0) |
+            ((flags & OBJ_HASH_VALUE) ? BGREAD_HASH_VALUES : 0))) return;
+
     length = hashTypeLength(o) * multiplier;
     c->addReplyMultiBulkLen( length);
 
@@ -842,3 +1398,254 @@ void hscanCommand(client *c) {
         checkType(c,o,OBJ_HASH)) return;
     scanGenericCommand(c,o,cursor);
 }
+
+/*-----------------------------------------------------------------------------
+ * Hash fields expiration commands
+ *----------------------------------------------------------------------------*/
+
+#define HFE_NX (1<<0)
+#define HFE_XX (1<<1)
+#define HFE_GT (1<<2)
+#define HFE_LT (1<<3)
+
+/* Parse the "FIELDS numfields field [field ...]" arguments starting at 'pos',
+ * setting '*first' to the index of the first field. */
+static int getHashFieldsArgumentsOrReply(client *c, int pos, int *first) {
+    long long numfields;
+
+    if (pos+1 >= c->m_argc || strcasecmp((char *)c->m_argv[pos]->ptr,"fields")) {
+        c->addReply(shared.syntaxerr);
+        return C_ERR;
+    }
+    if (getLongLongFromObjectOrReply(c,c->m_argv[pos+1],&numfields,NULL) != C_OK)
+        return C_ERR;
+    if (numfields <= 0 || numfields != c->m_argc-pos-2) {
+        c->addReplyError("the number of fields doesn't match the FIELDS "
+                         "arguments");
+        return C_ERR;
+    }
+    *first = pos+2;
+    return C_OK;
+}
+
+/* This is the generic command implementation for HEXPIRE, HPEXPIRE,
+ * HEXPIREAT and HPEXPIREAT, see expireGenericCommand() for the meaning of
+ * 'basetime' and 'unit':
+ *
+ *   HEXPIRE key time [NX|XX|GT|LT] FIELDS numfields field [field ...]
+ *
+ * The reply has an integer for every field: -2 if the field does not exist,
+ * 0 if the NX / XX / GT / LT condition was not met, 1 if the TTL was set,
+ * and 2 if the field was deleted since the time is already in the past.
+ *
+ * The command is propagated as an HPEXPIREAT of the fields that got the TTL,
+ * or as an HDEL of the fields deleted, so that the slaves and the AOF don't
+ * depend on the conditions nor on the time at which they execute it. */
+void hexpireGenericCommand(client *c, long long basetime, int unit) {
+    robj *key = c->m_argv[1], *o;
+    long long when;
+    int cond = 0, pos = 3, first, j, keyremoved = 0;
+
+    if (getLongLongFromObjectOrReply(c,c->m_argv[2],&when,NULL) != C_OK)
+        return;
+    if (when < 0 || when > HASH_FIELD_EXPIRE_MAX) {
+        c->addReplyError("invalid expire time");
+        return;
+    }
+    if (unit == UNIT_SECONDS) when *= 1000;
+    when += basetime;
+    if (when > HASH_FIELD_EXPIRE_MAX) {
+        c->addReplyError("invalid expire time");
+        return;
+    }
+
+    if (pos < c->m_argc) {
+        char *opt = (char *)c->m_argv[pos]->ptr;
+        if (!strcasecmp(opt,"nx")) cond = HFE_NX;
+        else if (!strcasecmp(opt,"xx")) cond = HFE_XX;
+        else if (!strcasecmp(opt,"gt")) cond = HFE_GT;
+        else if (!strcasecmp(opt,"lt")) cond = HFE_LT;
+        if (cond) pos++;
+    }
+    if (getHashFieldsArgumentsOrReply(c,pos,&first) == C_ERR) return;
+
+    if ((o = lookupKeyWrite(c->m_cur_selected_db,key)) != NULL &&
+        checkType(c,o,OBJ_HASH)) return;
+
+    /* Like EXPIRE, a time in the past deletes the fields, but not while
+     * loading the AOF or in the slaves, that get an HDEL from the master. */
+    int past = when <= mstime() && !server.loading && !server.masterhost;
+    robj **argv = (robj **)zmalloc(sizeof(robj*)*(c->m_argc));
+    int argc = first;
+
+    c->addReplyMultiBulkLen(c->m_argc-first);
+    for (j = first; j < c->m_argc; j++) {
+        sds field = (sds)c->m_argv[j]->ptr;
+        long long current;
+
+        if (o == NULL || !hashTypeExists(o,field)) {
+            c->addReplyLongLong(-2);
+            continue;
+        }
+        current = hashTypeGetFieldExpire(o,field);
+        if ((cond == HFE_NX && current != -1) ||
+            (cond == HFE_XX && current == -1) ||
+            (cond == HFE_GT && (current == -1 || when <= current)) ||
+            (cond == HFE_LT && current != -1 && when >= current))
+        {
+            c->addReplyLongLong(0);
+            continue;
+        }
+        if (past) {
+            hashTypeDelete(o,field);
+            c->addReplyLongLong(2);
+            if (hashTypeLength(o) == 0) {
+                dbDelete(c->m_cur_selected_db,key);
+                keyremoved = 1;
+                o = NULL;
+            }
+        } else {
+            hashTypeSetFieldExpire(o,field,when);
+            c->addReplyLongLong(1);
+        }
+        argv[argc++] = c->m_argv[j];
+        incrRefCount(c->m_argv[j]);
+    }
+
+    if (argc == first) {
+        zfree(argv);
+        return;
+    }
+    if (past) {
+        argv[0] = createStringObject("HDEL",4);
+        argv[1] = key;
+        incrRefCount(key);
+        memmove(argv+2,argv+first,sizeof(robj*)*(argc-first));
+        argc -= first-2;
+    } else {
+        argv[0] = createStringObject("HPEXPIREAT",10);
+        argv[1] = key;
+        argv[2] = createStringObjectFromLongLong(when);
+        argv[3] = createStringObject("FIELDS",6);
+        incrRefCount(key);
+        memmove(argv+5,argv+first,sizeof(robj*)*(argc-first));
+        argc -= first-5;
+        argv[4] = createStringObjectFromLongLong(argc-5);
+        hashExpireIndexAdd(c->m_cur_selected_db,key,o);
+    }
+    server.dirty += argc-(past ? 2 : 5);
+    c->replaceClientCommandVector(argc,argv);
+    signalModifiedKey(c->m_cur_selected_db,key);
+    notifyKeyspaceEvent(NOTIFY_HASH,past ? "hdel" : "hexpire",key,
+                        c->m_cur_selected_db->m_id);
+    if (keyremoved)
+        notifyKeyspaceEvent(NOTIFY_GENERIC,"del",key,c->m_cur_selected_db->m_id);
+}
+
+/* HEXPIRE key seconds [NX|XX|GT|LT] FIELDS numfields field [field ...] */
+void hexpireCommand(client *c) {
+    hexpireGenericCommand(c,mstime(),UNIT_SECONDS);
+}
+
+/* HPEXPIRE key milliseconds [NX|XX|GT|LT] FIELDS numfields field [...] */
+void hpexpireCommand(client *c) {
+    hexpireGenericCommand(c,mstime(),UNIT_MILLISECONDS);
+}
+
+/* HEXPIREAT key time [NX|XX|GT|LT] FIELDS numfields field [field ...] */
+void hexpireatCommand(client *c) {
+    hexpireGenericCommand(c,0,UNIT_SECONDS);
+}
+
+/* HPEXPIREAT key ms_time [NX|XX|GT|LT] FIELDS numfields field [field ...] */
+void hpexpireatCommand(client *c) {
+    hexpireGenericCommand(c,0,UNIT_MILLISECONDS);
+}
+
+/* Implements HTTL, HPTTL, HEXPIRETIME and HPEXPIRETIME: reply for every
+ * field -2 if it does not exist, -1 if it has no TTL, or its TTL (or its
+ * expire time if 'absolute' is true) in seconds or milliseconds. */
+void httlGenericCommand(client *c, int output_ms, int absolute) {
+    robj *o;
+    int first, j;
+
+    if (getHashFieldsArgumentsOrReply(c,2,&first) == C_ERR) return;
+    if ((o = lookupKeyReadWithFlags(c->m_cur_selected_db,c->m_argv[1],
+                                    LOOKUP_NOTOUCH)) != NULL &&
+        checkType(c,o,OBJ_HASH)) return;
+
+    c->addReplyMultiBulkLen(c->m_argc-first);
+    for (j = first; j < c->m_argc; j++) {
+        sds field = (sds)c->m_argv[j]->ptr;
+        long long expire, ttl;
+
+        if (o == NULL || !hashTypeExists(o,field)) {
+            c->addReplyLongLong(-2);
+            continue;
+        }
+        if ((expire = hashTypeGetFieldExpire(o,field)) == -1) {
+            c->addReplyLongLong(-1);
+            continue;
+        }
+        if (absolute) {
+            ttl = expire;
+        } else {
+            ttl = expire-mstime();
+            if (ttl < 0) ttl = 0;
+        }
+        c->addReplyLongLong(output_ms ? ttl : ((ttl+500)/1000));
+    }
+}
+
+/* HTTL key FIELDS numfields field [field ...] */
+void httlCommand(client *c) {
+    httlGenericCommand(c,0,0);
+}
+
+/* HPTTL key FIELDS numfields field [field ...] */
+void hpttlCommand(client *c) {
+    httlGenericCommand(c,1,0);
+}
+
+/* HEXPIRETIME key FIELDS numfields field [field ...] */
+void hexpiretimeCommand(client *c) {
+    httlGenericCommand(c,0,1);
+}
+
+/* HPEXPIRETIME key FIELDS numfields field [field ...] */
+void hpexpiretimeCommand(client *c) {
+    httlGenericCommand(c,1,1);
+}
+
+/* HPERSIST key FIELDS numfields field [field ...]
+ *
+ * Replies for every field -2 if it does not exist, -1 if it has no TTL, or
+ * 1 if its TTL was removed. */
+void hpersistCommand(client *c) {
+    robj *o;
+    int first, j, removed = 0;
+
+    if (getHashFieldsArgumentsOrReply(c,2,&first) == C_ERR) return;
+    if ((o = lookupKeyWrite(c->m_cur_selected_db,c->m_argv[1])) != NULL &&
+        checkType(c,o,OBJ_HASH)) return;
+
+    c->addReplyMultiBulkLen(c->m_argc-first);
+    for (j = first; j < c->m_argc; j++) {
+        sds field = (sds)c->m_argv[j]->ptr;
+
+        if (o == NULL || !hashTypeExists(o,field)) {
+            c->addReplyLongLong(-2);
+        } else if (hashTypeRemoveFieldExpire(o,field)) {
+            c->addReplyLongLong(1);
+            removed++;
+        } else {
+            c->addReplyLongLong(-1);
+        }
+    }
+    if (removed) {
+        signalModifiedKey(c->m_cur_selected_db,c->m_argv[1]);
+        notifyKeyspaceEvent(NOTIFY_HASH,"hpersist",c->m_argv[1],
+                            c->m_cur_selected_db->m_id);
+        server.dirty += removed;
+    }
+}
@@ -28,6 +28,7 @@
  */
 
 #include "server.h"
+#include "bgread.h"
 
 /*-----------------------------------------------------------------------------
  * List API
@@ -41,9 +42,14 @@
 void listTypePush(robj *subject, robj *value, int where) {
     if (subject->encoding == OBJ_ENCODING_QUICKLIST) {
         int pos = (where == LIST_HEAD) ? QUICKLIST_HEAD : QUICKLIST_TAIL;
+        quicklist *ql = (quicklist *)subject->ptr;
+        /* Lists created before the last change of list-node-container are
+         * converted on their next write. */
+        if (ql->m_container != server.list_node_container)
+            quicklistSetContainer(ql, server.list_node_container);
         value = getDecodedObject(value);
         size_t len = sdslen((sds)value->ptr);
-        quicklistPush((quicklist *)subject->ptr, value->ptr, len, pos);
+        quicklistPush(ql, value->ptr, len, pos);
         decrRefCount(value);
     } else {
         serverPanic("Unknown list encoding");
@@ -173,7 +179,7 @@ void listTypeInsert(listTypeEntry *entry, robj *value, int where) {
 int listTypeEqual(listTypeEntry *entry, robj *o) {
     if (entry->li->encoding() == OBJ_ENCODING_QUICKLIST) {
         serverAssertWithInfo(NULL,o,sdsEncodedObject(o));
-        return quicklistCompare((unsigned char *)entry->m_ql_entry.m_zip_list,(unsigned char *)o->ptr,sdslen((sds)o->ptr));
+        return quicklistCompare(&entry->m_ql_entry,(unsigned char *)o->ptr,sdslen((sds)o->ptr));
     } else {
         serverPanic("Unknown list encoding");
     }
@@ -197,13 +203,69 @@ void listTypeConvert(robj *subject, int enc) {
     if (enc == OBJ_ENCODING_QUICKLIST) {
         size_t zlen = server.list_max_ziplist_size;
         int depth = server.list_compress_depth;
-        subject->ptr = quicklistCreateFromZiplist(zlen, depth, (unsigned char *)subject->ptr);
+        quicklist *ql = quicklistNew(zlen, depth);
+        quicklistSetContainer(ql, server.list_node_container);
+        subject->ptr = quicklistAppendValuesFromZiplist(ql, (unsigned char *)subject->ptr);
         subject->encoding = OBJ_ENCODING_QUICKLIST;
     } else {
         serverPanic("Unsupported list conversion");
     }
 }
 
+/* Lists left to a next walk, since they were read in background. */
+static int list_conversion_skipped = 0;
+
+/* dictScan() callback of listContainerConversionCron(): convert the nodes
+ * of a list using another container, charging them to the budget. */
+static void listConversionScanCallback(void *privdata, const dictEntry *de) {
+    long *budget = (long *)privdata;
+    robj *o = (robj *)de->dictGetVal();
+
+    if (o->type != OBJ_LIST || o->encoding != OBJ_ENCODING_QUICKLIST) return;
+    quicklist *ql = (quicklist *)o->ptr;
+    if (ql->m_container == server.list_node_container) return;
+    if (o->refcount != 1) {
+        list_conversion_skipped = 1;
+        return;
+    }
+    quicklistSetContainer(ql,server.list_node_container);
+    *budget -= ql->m_num_ql_nodes;
+}
+
+/* Called by serverCron() after list-node-container changed: walk the
+ * keyspace converting about LIST_CONVERSION_NODES_PER_CALL list nodes per
+ * call to the new container, so that lists that are never written don't
+ * keep the old one (and its cascading updates) forever. A list is always
+ * converted at once, since all its nodes must use the same container. */
+void listContainerConversionCron(void) {
+    long budget = LIST_CONVERSION_NODES_PER_CALL;
+
+    while (budget > 0) {
+        redisDb *db = server.db+server.list_conversion_db;
+
+        if (db->m_dict->dictSize()) {
+            server.list_conversion_cursor =
+                db->m_dict->dictScan(server.list_conversion_cursor,
+                                     listConversionScanCallback,NULL,&budget);
+        } else {
+            server.list_conversion_cursor = 0;
+        }
+        budget--; /* Empty buckets and DBs cost something too. */
+        if (server.list_conversion_cursor != 0) continue;
+
+        if (++server.list_conversion_db == server.dbnum) {
+            server.list_conversion_db = 0;
+            server.list_conversion_pending = list_conversion_skipped;
+            list_conversion_skipped = 0;
+            if (server.list_conversion_pending) break;
+            serverLog(LL_VERBOSE,"Lists converted to the %s container.",
+                server.list_node_container == QUICKLIST_NODE_CONTAINER_LISTPACK ?
+                "listpack" : "ziplist");
+            break;
+        }
+    }
+}
+
 /*-----------------------------------------------------------------------------
  * List Commands
  *----------------------------------------------------------------------------*/
@@ -431,6 +493,7 @@ void lrangeCommand(client *c) {
     }
     if (end >= llen) end = llen-1;
     rangelen = (end-start)+1;
+    if (bgreadStart(c,o,start,rangelen,0)) return;
 
     /* Return the result in form of a multi-bulk reply */
     c->addReplyMultiBulkLen(rangelen);
@@ -621,119 +684,7 @@ void rpoplpushCommand(client *c) {
  * Blocking POP operations
  *----------------------------------------------------------------------------*/
 
-/* This is how the current blocking POP works, we use BLPOP as example:
- * - If the user calls BLPOP and the key exists and contains a non empty list
- *   then LPOP is called instead. So BLPOP is semantically the same as LPOP
- *   if blocking is not required.
- * - If instead BLPOP is called and the key does not exists or the list is
- *   empty we need to block. In order to do so we remove the notification for
- *   new data to read in the client socket (so that we'll not serve new
- *   requests if the blocking request is not served). Also we put the client
- *   in a dictionary (db->m_blocking_keys) mapping keys to a list of clients
- *   blocking for this keys.
- * - If a PUSH operation against a key with blocked clients waiting is
- *   performed, we mark this key as "ready", and after the current command,
- *   MULTI/EXEC block, or script, is executed, we serve all the clients waiting
- *   for this list, from the one that blocked first, to the last, accordingly
- *   to the number of elements we have in the ready list.
- */
-
-/* Set a client in blocking mode for the specified key, with the specified
- * timeout */
-void blockForKeys(client *c, robj **keys, int numkeys, mstime_t timeout, robj *target) {
-    dictEntry *de;
-    list *l;
-    int j;
-
-    c->m_blocking_state.m_timeout = timeout;
-    c->m_blocking_state.m_target = target;
-
-    if (target != NULL) incrRefCount(target);
-
-    for (j = 0; j < numkeys; j++) {
-        /* If the key already exists in the dict ignore it. */
-        if (c->m_blocking_state.m_keys->dictAdd(keys[j],NULL) != DICT_OK) continue;
-        incrRefCount(keys[j]);
-
-        /* And in the other "side", to map keys -> clients */
-        de = c->m_cur_selected_db->m_blocking_keys->dictFind(keys[j]);
-        if (de == NULL) {
-            int retval;
-
-            /* For every key we take a list of clients blocked for it */
-            l = listCreate();
-            retval = c->m_cur_selected_db->m_blocking_keys->dictAdd(keys[j],l);
-            incrRefCount(keys[j]);
-            serverAssertWithInfo(c,keys[j],retval == DICT_OK);
-        } else {
-            l = (list *)de->dictGetVal();
-        }
-        l->listAddNodeTail(c);
-    }
-    blockClient(c,BLOCKED_LIST);
-}
-
-/* Unblock a client that's waiting in a blocking operation such as BLPOP.
- * You should never call this function directly, but unblockClient() instead. */
-void client::unblockClientWaitingData() {
-    dictEntry *de;
-
-    serverAssertWithInfo(this,NULL,m_blocking_state.m_keys->dictSize() != 0);
-    {
-        dictIterator di(m_blocking_state.m_keys);
-        /* The client may wait for multiple keys, so unblock it for every key. */
-        while((de = di.dictNext()) != NULL) {
-            robj *key = (robj *)de->dictGetKey();
-
-            /* Remove this client from the list of clients waiting for this key. */
-            list *l = (list *)(m_cur_selected_db->m_blocking_keys)->dictFetchValue(key);
-            serverAssertWithInfo(this,key,l != NULL);
-            l->listDelNode(l->listSearchKey(this));
-            /* If the list is empty we need to remove it to avoid wasting memory */
-            if (l->listLength() == 0)
-                m_cur_selected_db->m_blocking_keys->dictDelete(key);
-        }
-    }
-    
-    /* Cleanup the client structure */
-    m_blocking_state.m_keys->dictEmpty(NULL);
-    if (m_blocking_state.m_target) {
-        decrRefCount(m_blocking_state.m_target);
-        m_blocking_state.m_target = NULL;
-    }
-}
-
-/* If the specified key has clients blocked waiting for list pushes, this
- * function will put the key reference into the server.ready_keys list.
- * Note that db->m_ready_keys is a hash table that allows us to avoid putting
- * the same key again and again in the list in case of multiple pushes
- * made by a script or in the context of MULTI/EXEC.
- *
- * The list will be finally processed by handleClientsBlockedOnLists() */
-void signalListAsReady(redisDb *db, robj *key) {
-    readyList *rl;
-
-    /* No clients blocking for this key? No need to queue it. */
-    if (db->m_blocking_keys->dictFind(key) == NULL) return;
-
-    /* Key was already signaled? No need to queue it again. */
-    if (db->m_ready_keys->dictFind(key) != NULL) return;
-
-    /* Ok, we need to queue this key into server.ready_keys. */
-    rl = (readyList *)zmalloc(sizeof(*rl));
-    rl->key = key;
-    rl->db = db;
-    incrRefCount(key);
-    server.ready_keys->listAddNodeTail(rl);
-
-    /* We also add the key in the db->m_ready_keys dictionary in order
-     * to avoid adding it multiple times into a list with a simple O(1)
-     * check. */
-    incrRefCount(key);
-    serverAssert(db->m_ready_keys->dictAdd(key,NULL) == DICT_OK);
-}
-
-/* This is a helper function for handleClientsBlockedOnLists(). It's work
+/* This is a helper function for handleClientsBlockedOnList(). It's work
  * is to serve a specific client (receiver) that is blocked on 'key'
  * in the context of the specified 'db', doing the following:
  *
@@ -802,94 +753,138 @@ int serveClientBlockedOnList(client *receiver, robj *key, robj *dstkey, redisDb
     return C_OK;
 }
 
-/* This function should be called by Redis every time a single command,
- * a MULTI/EXEC block, or a Lua script, terminated its execution after
- * being called by a client.
+/* Return the side of the list a client blocked on it pops from. */
+static int blockedClientListWhere(client *c) {
+    return (c->m_last_cmd && c->m_last_cmd->proc == blpopCommand) ?
+           LIST_HEAD : LIST_TAIL;
+}
+
+/* Serve, with a single quicklist operation, the first 'count' clients of
+ * 'clients', all blocked on 'key' by BLPOP or BRPOP popping from 'where',
+ * with the first 'count' elements of the list 'o' from that side.
  *
- * All the keys with at least one client blocked that received at least
- * one new element via some PUSH operation are accumulated into
- * the server.ready_keys list. This function will run the list and will
- * serve clients accordingly. Note that the function will iterate again and
- * again as a result of serving BRPOPLPUSH we can have new blocking clients
- * to serve because of the PUSH side of BRPOPLPUSH. */
-void handleClientsBlockedOnLists() {
-    while(server.ready_keys->listLength() != 0) {
-
-        /* Point server.ready_keys to a fresh list and save the current one
-         * locally. This way as we run the old list we are free to call
-         * signalListAsReady() that may push new elements in server.ready_keys
-         * when handling clients blocked into BRPOPLPUSH. */
-        list *l = server.ready_keys;
-        server.ready_keys = listCreate();
-
-        while(l->listLength() != 0) {
-            listNode *ln = l->listFirst();
-            readyList *rl = (readyList *)ln->listNodeValue();
-
-            /* First of all remove this key from db->m_ready_keys so that
-             * we can safely call signalListAsReady() against this key. */
-            rl->db->m_ready_keys->dictDelete(rl->key);
-
-            /* If the key exists and it's a list, serve blocked clients
-             * with data. */
-            robj *o = lookupKeyWrite(rl->db,rl->key);
-            if (o != NULL && o->type == OBJ_LIST) {
-                dictEntry *de;
-
-                /* We serve clients in the same order they blocked for
-                 * this key, from the first blocked to the last. */
-                de = rl->db->m_blocking_keys->dictFind(rl->key);
-                if (de) {
-                    list* clients = (list*)de->dictGetVal();
-                    int numclients = clients->listLength();
-
-                    while(numclients--) {
-                        listNode *clientnode = clients->listFirst();
-                        client *receiver = (client *)clientnode->listNodeValue();
-                        robj *dstkey = receiver->m_blocking_state.m_target;
-                        int where = (receiver->m_last_cmd &&
-                                     receiver->m_last_cmd->proc == blpopCommand) ?
-                                    LIST_HEAD : LIST_TAIL;
-                        robj *value = listTypePop(o,where);
-
-                        if (value) {
-                            /* Protect receiver->bpop.target, that will be
-                             * freed by the next unblockClient()
-                             * call. */
-                            if (dstkey) incrRefCount(dstkey);
-                            receiver->unblockClient();
-
-                            if (serveClientBlockedOnList(receiver,
-                                rl->key,dstkey,rl->db,value,
-                                where) == C_ERR)
-                            {
-                                /* If we failed serving the client we need
-                                 * to also undo the POP operation. */
-                                    listTypePush(o,value,where);
-                            }
-
-                            if (dstkey) decrRefCount(dstkey);
-                            decrRefCount(value);
-                        } else {
-                            break;
-                        }
-                    }
-                }
+ * The pops are propagated as a single LTRIM instead of one [LR]POP per
+ * client, which matters when a big push wakes up a lot of consumers. */
+void serveClientsBlockedOnListBatch(list *clients, robj *o, robj *key,
+                                    redisDb *db, int where, long count)
+{
+    quicklist *ql = (quicklist *)o->ptr;
+    quicklistIter *qi = quicklistGetIteratorAtIdx(ql,
+        (where == LIST_HEAD) ? AL_START_HEAD : AL_START_TAIL,
+        (where == LIST_HEAD) ? 0 : -1);
+    quicklistEntry entry;
+
+    for (long j = 0; j < count && qi->quicklistNext(entry); j++) {
+        client *receiver = (client *)clients->listFirst()->listNodeValue();
+        robj *value;
+
+        if (entry.m_value)
+            value = createStringObject((char *)entry.m_value,entry.m_size);
+        else
+            value = createStringObjectFromLongLong(entry.m_longval);
+        receiver->unblockClient();
+        receiver->addReplyMultiBulkLen(2);
+        receiver->addReplyBulk(key);
+        receiver->addReplyBulk(value);
+        decrRefCount(value);
+    }
+    quicklistReleaseIterator(qi);
+    quicklistDelRange(ql,(where == LIST_HEAD) ? 0 : -count,count);
+
+    /* Popping 'count' elements from the head is LTRIM key count -1, from the
+     * tail it is LTRIM key 0 -count-1. */
+    robj *argv[4];
+    argv[0] = createStringObject("LTRIM",5);
+    argv[1] = key;
+    argv[2] = createStringObjectFromLongLong((where == LIST_HEAD) ? count : 0);
+    argv[3] = createStringObjectFromLongLong((where == LIST_HEAD) ? -1 : -count-1);
+    propagate(server.ltrimCommand,db->m_id,argv,4,PROPAGATE_AOF|PROPAGATE_REPL);
+    decrRefCount(argv[0]);
+    decrRefCount(argv[2]);
+    decrRefCount(argv[3]);
+}
+
+/* Serve the clients blocked by BLPOP, BRPOP and BRPOPLPUSH on the list 'o'
+ * at 'key', that received new elements. Called by
+ * handleClientsBlockedOnKeys(). */
+void handleClientsBlockedOnList(redisDb *db, robj *key, robj *o) {
+    dictEntry *de;
+
+    /* We serve clients in the same order they blocked for
+     * this key, from the first blocked to the last. */
+    de = db->m_blocking_keys->dictFind(key);
+    if (de) {
+        list* clients = (list*)de->dictGetVal();
+        int numclients = clients->listLength();
+
+        while(numclients-- > 0) {
+            listNode *clientnode = clients->listFirst();
+            client *receiver = (client *)clientnode->listNodeValue();
+
+            /* A client blocked by XREAD on a key that is now a list is not
+             * served: move it to the tail, so that we don't run into it
+             * again in this loop. */
+            if (receiver->m_blocking_op_type != BLOCKED_LIST) {
+                clients->listDelNode(clientnode);
+                clients->listAddNodeTail(receiver);
+                continue;
+            }
 
-                if (listTypeLength(o) == 0) {
-                    dbDelete(rl->db,rl->key);
+            robj *dstkey = receiver->m_blocking_state.m_target;
+            int where = blockedClientListWhere(receiver);
+
+            /* Serve at once the run of BLPOP or BRPOP clients
+             * popping from the same side that starts here. */
+            if (dstkey == NULL) {
+                long run = 1, len = listTypeLength(o);
+                listNode *next = clientnode->listNextNode();
+                while (next && run < len && run <= numclients) {
+                    client *c = (client *)next->listNodeValue();
+                    if (c->m_blocking_op_type != BLOCKED_LIST ||
+                        c->m_blocking_state.m_target ||
+                        blockedClientListWhere(c) != where) break;
+                    run++;
+                    next = next->listNextNode();
+                }
+                if (run > 1) {
+                    serveClientsBlockedOnListBatch(clients,o,
+                        key,db,where,run);
+                    numclients -= run-1;
+                    continue;
                 }
-                /* We don't call signalModifiedKey() as it was already called
-                 * when an element was pushed on the list. */
             }
 
-            /* Free this item. */
-            decrRefCount(rl->key);
-            zfree(rl);
-            l->listDelNode(ln);
+            robj *value = listTypePop(o,where);
+
+            if (value) {
+                /* Protect receiver->bpop.target, that will be
+                 * freed by the next unblockClient()
+                 * call. */
+                if (dstkey) incrRefCount(dstkey);
+                receiver->unblockClient();
+
+                if (serveClientBlockedOnList(receiver,
+                    key,dstkey,db,value,
+                    where) == C_ERR)
+                {
+                    /* If we failed serving the client we need
+                     * to also undo the POP operation. */
+                        listTypePush(o,value,where);
+                }
+
+                if (dstkey) decrRefCount(dstkey);
+                decrRefCount(value);
+            } else {
+                break;
+            }
         }
-        listRelease(l); /* We have the new list on place at this point. */
     }
+
+    if (listTypeLength(o) == 0) {
+        dbDelete(db,key);
+    }
+    /* We don't call signalModifiedKey() as it was already called
+     * when an element was pushed on the list. */
 }
 
 /* Blocking RPOP/LPOP */
@@ -946,7 +941,7 @@ void blockingPopGenericCommand(client *c, int where) {
     }
 
     /* If the list is empty or the key does not exists we must block */
-    blockForKeys(c, c->m_argv + 1, c->m_argc - 2, timeout, NULL);
+    blockForKeys(c, BLOCKED_LIST, c->m_argv + 1, c->m_argc - 2, timeout, NULL, NULL);
 }
 
 void blpopCommand(client *c) {
@@ -972,7 +967,7 @@ void brpoplpushCommand(client *c) {
             c->addReply( shared.nullbulk);
         } else {
             /* The list is empty and the client blocks. */
-            blockForKeys(c, c->m_argv + 1, 1, timeout, c->m_argv[2]);
+            blockForKeys(c, BLOCKED_LIST, c->m_argv + 1, 1, timeout, c->m_argv[2], NULL);
         }
     } else {
         if (key->type != OBJ_LIST) {
@@ -30,6 +30,9 @@
 #include "fmacros.h"
 #include "server.h"
 #include "sds.h"
+#include "atomicvar.h"
+#include "bgread.h"
+#include <pthread.h>
 
 /*-----------------------------------------------------------------------------
  * Set Commands
@@ -54,7 +57,7 @@ robj *setTypeCreate(sds value) {
 int setTypeAdd(robj *subject, sds value) {
     long long llval;
     if (subject->encoding == OBJ_ENCODING_HT) {
-        dict *ht = (dict *)subject->ptr;
+        sdsDict *ht = (sdsDict*)subject->ptr;
         dictEntry *de = ht->dictAddRaw(value,NULL);
         if (de) {
             ht->dictSetKey(de,sdsdup(value));
@@ -66,10 +69,11 @@ int setTypeAdd(robj *subject, sds value) {
             uint8_t success = 0;
             subject->ptr = intset::intsetAdd((intset *)subject->ptr,llval,&success);
             if (success) {
-                /* Convert to regular set when the intset contains
+                /* Convert to a compressed bitmap when the intset contains
                  * too many entries. */
-                if (((intset *)subject->ptr)->intsetLen() > server.set_max_intset_entries)
-                    setTypeConvert(subject,OBJ_ENCODING_HT);
+                if (((intset *)subject->ptr)->intsetLen() >
+                    objectCompactMaxEntries(subject,server.set_max_intset_entries))
+                    setTypeConvert(subject,OBJ_ENCODING_ROARING);
                 return 1;
             }
         } else {
@@ -78,9 +82,17 @@ int setTypeAdd(robj *subject, sds value) {
 
             /* The set *was* an intset and this value is not integer
              * encodable, so dictAdd should always work. */
-            serverAssert(((dict *)subject->ptr)->dictAdd(sdsdup(value),NULL) == DICT_OK);
+            serverAssert(((sdsDict*)subject->ptr)->dictAdd(sdsdup(value),NULL) == DICT_OK);
             return 1;
         }
+    } else if (subject->encoding == OBJ_ENCODING_ROARING) {
+        if (isSdsRepresentableAsLongLong(value,&llval) == C_OK)
+            return ((roaring *)subject->ptr)->roaringAdd(llval);
+
+        /* Only integers can be stored in the bitmap. */
+        setTypeConvert(subject,OBJ_ENCODING_HT);
+        serverAssert(((sdsDict*)subject->ptr)->dictAdd(sdsdup(value),NULL) == DICT_OK);
+        return 1;
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -90,7 +102,7 @@ int setTypeAdd(robj *subject, sds value) {
 int setTypeRemove(robj *setobj, sds value) {
     long long llval;
     if (setobj->encoding == OBJ_ENCODING_HT) {
-        if (((dict*)setobj->ptr)->dictDelete(value) == DICT_OK) {
+        if (((sdsDict*)setobj->ptr)->dictDelete(value) == DICT_OK) {
             if (htNeedsResize((dict*)setobj->ptr)) ((dict*)setobj->ptr)->dictResize();
             return 1;
         }
@@ -100,6 +112,9 @@ int setTypeRemove(robj *setobj, sds value) {
             setobj->ptr = intset::intsetRemove((intset *)setobj->ptr,llval,&success);
             if (success) return 1;
         }
+    } else if (setobj->encoding == OBJ_ENCODING_ROARING) {
+        if (isSdsRepresentableAsLongLong(value,&llval) == C_OK)
+            return ((roaring *)setobj->ptr)->roaringRemove(llval);
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -109,11 +124,15 @@ int setTypeRemove(robj *setobj, sds value) {
 int setTypeIsMember(robj *subject, sds value) {
     long long llval;
     if (subject->encoding == OBJ_ENCODING_HT) {
-        return ((dict*)subject->ptr)->dictFind(value) != NULL;
+        return ((sdsDict*)subject->ptr)->dictFind(value) != NULL;
     } else if (subject->encoding == OBJ_ENCODING_INTSET) {
         if (isSdsRepresentableAsLongLong(value,&llval) == C_OK) {
             return ((intset*)subject->ptr)->intsetFind(llval);
         }
+    } else if (subject->encoding == OBJ_ENCODING_ROARING) {
+        if (isSdsRepresentableAsLongLong(value,&llval) == C_OK) {
+            return ((roaring*)subject->ptr)->roaringContains(llval);
+        }
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -135,6 +154,8 @@ setTypeIterator::setTypeIterator(robj *subject)
         m_dict_iter = dictGetIterator((dict*)subject->ptr);
    } else if (m_encoding == OBJ_ENCODING_INTSET) {
         m_intset_iter = 0;
+   } else if (m_encoding == OBJ_ENCODING_ROARING) {
+        ((roaring*)subject->ptr)->roaringInitIterator(&m_roaring_iter);
    } else {
         serverPanic("Unknown set encoding");
    }
@@ -178,6 +199,10 @@ int setTypeIterator::setTypeNext(sds *sdsele, int64_t *llele)
         if (!((intset*)m_subject->ptr)->intsetGet(m_intset_iter++,llele))
             return -1;
         *sdsele = NULL; /* Not needed. Defensive. */
+    } else if (m_encoding == OBJ_ENCODING_ROARING) {
+        if (!((roaring*)m_subject->ptr)->roaringNext(&m_roaring_iter,llele))
+            return -1;
+        *sdsele = NULL; /* Not needed. Defensive. */
     } else {
         serverPanic("Wrong set encoding in setTypeNext");
     }
@@ -200,6 +225,7 @@ sds setTypeIterator::setTypeNextObject()
     switch(the_encoding) {
         case -1:    return NULL;
         case OBJ_ENCODING_INTSET:
+        case OBJ_ENCODING_ROARING:
             return sdsfromlonglong(int_element);
         case OBJ_ENCODING_HT:
             return sdsdup(sds_element);
@@ -230,31 +256,92 @@ int setTypeRandomElement(robj *setobj, sds *sdsele, int64_t *llele) {
     } else if (setobj->encoding == OBJ_ENCODING_INTSET) {
         *llele = ((intset *)setobj->ptr)->intsetRandom();
         *sdsele = NULL; /* Not needed. Defensive. */
+    } else if (setobj->encoding == OBJ_ENCODING_ROARING) {
+        *llele = ((roaring *)setobj->ptr)->roaringRandom();
+        *sdsele = NULL; /* Not needed. Defensive. */
     } else {
         serverPanic("Unknown set encoding");
     }
     return setobj->encoding;
 }
 
+/* Remove an integer element returned by setTypeRandomElement() or by a set
+ * iterator from an intset or compressed bitmap encoded set. */
+static void setTypeRemoveInteger(robj *setobj, int64_t llele) {
+    if (setobj->encoding == OBJ_ENCODING_INTSET)
+        setobj->ptr = intset::intsetRemove((intset *)setobj->ptr,llele,NULL);
+    else
+        ((roaring *)setobj->ptr)->roaringRemove(llele);
+}
+
 unsigned long setTypeSize(const robj *subject) {
     if (subject->encoding == OBJ_ENCODING_HT) {
         return (((dict*)subject->ptr)->dictSize());
     } else if (subject->encoding == OBJ_ENCODING_INTSET) {
         return ((const intset*)subject->ptr)->intsetLen();
+    } else if (subject->encoding == OBJ_ENCODING_ROARING) {
+        return ((const roaring*)subject->ptr)->roaringLen();
     } else {
         serverPanic("Unknown set encoding");
     }
 }
 
+static roaring *setTypeIntsetToRoaring(intset *is) {
+    roaring *r = roaringCreate();
+    int64_t llele;
+
+    for (uint32_t j = 0; is->intsetGet(j,&llele); j++) r->roaringAdd(llele);
+    return r;
+}
+
+/* Return a set object holding the elements of the bitmap, that is converted
+ * to an intset when small enough. */
+static robj *setTypeFromRoaring(roaring *r) {
+    if (r->roaringLen() > server.set_max_intset_entries)
+        return createRoaringSetObject(r);
+
+    robj *o = createIntsetObject();
+    roaringIterator it;
+    int64_t llele;
+
+    r->roaringInitIterator(&it);
+    while (r->roaringNext(&it,&llele))
+        o->ptr = intset::intsetAdd((intset *)o->ptr,llele,NULL);
+    roaringFree(r);
+    return o;
+}
+
 /* Convert the set to specified encoding. The resulting dict (when converting
  * to a hash table) is presized to hold the number of elements in the original
- * set. */
+ * set. Intsets can be converted to both the other encodings, compressed
+ * bitmaps to hash tables and, when they shrank, back to intsets. */
 void setTypeConvert(robj *setobj, int enc) {
-    ;
     serverAssertWithInfo(NULL,setobj,setobj->type == OBJ_SET &&
-                             setobj->encoding == OBJ_ENCODING_INTSET);
-    if (enc == OBJ_ENCODING_HT) {
-        dict *d = dictCreate(&setDictType, NULL);
+                             (setobj->encoding == OBJ_ENCODING_INTSET ||
+                              setobj->encoding == OBJ_ENCODING_ROARING));
+    if (enc == OBJ_ENCODING_ROARING &&
+        setobj->encoding == OBJ_ENCODING_INTSET)
+    {
+        roaring *r = setTypeIntsetToRoaring((intset *)setobj->ptr);
+        zfree(setobj->ptr);
+        setobj->encoding = OBJ_ENCODING_ROARING;
+        setobj->ptr = r;
+    } else if (enc == OBJ_ENCODING_INTSET &&
+               setobj->encoding == OBJ_ENCODING_ROARING)
+    {
+        roaring *r = (roaring *)setobj->ptr;
+        intset *is = intset::intsetNew();
+        roaringIterator it;
+        int64_t llele;
+
+        r->roaringInitIterator(&it);
+        while (r->roaringNext(&it,&llele))
+            is = intset::intsetAdd(is,llele,NULL);
+        roaringFree(r);
+        setobj->encoding = OBJ_ENCODING_INTSET;
+        setobj->ptr = is;
+    } else if (enc == OBJ_ENCODING_HT) {
+        dict *d = sdsDictCreate(&setDictType, NULL);
 
         /* Presize the dict to avoid rehashing */
 
@@ -270,8 +357,8 @@ void setTypeConvert(robj *setobj, int enc) {
             }
         }
 
+        freeSetObject(setobj);
         setobj->encoding = OBJ_ENCODING_HT;
-        zfree(setobj->ptr);
         setobj->ptr = d;
     } else {
         serverPanic("Unsupported set conversion");
@@ -491,10 +578,10 @@ void spopWithCountCommand(client *c) {
         while(count--) {
             /* Emit and remove. */
             encoding = setTypeRandomElement(set,&sdsele,&llele);
-            if (encoding == OBJ_ENCODING_INTSET) {
+            if (encoding != OBJ_ENCODING_HT) {
                 c->addReplyBulkLongLong(llele);
                 objele = createStringObjectFromLongLong(llele);
-                set->ptr = intset::intsetRemove((intset *)set->ptr,llele,NULL);
+                setTypeRemoveInteger(set,llele);
             } else {
                 c->addReplyBulkCBuffer(sdsele,sdslen(sdsele));
                 objele = createStringObject(sdsele,sdslen(sdsele));
@@ -521,7 +608,7 @@ void spopWithCountCommand(client *c) {
         /* Create a new set with just the remaining elements. */
         while (remaining--) {
             encoding = setTypeRandomElement(set, &sdsele, &llele);
-            if (encoding == OBJ_ENCODING_INTSET) {
+            if (encoding != OBJ_ENCODING_HT) {
                 sdsele = sdsfromlonglong(llele);
             } else {
                 sdsele = sdsdup(sdsele);
@@ -540,7 +627,7 @@ void spopWithCountCommand(client *c) {
         {
             setTypeIterator si(set);
             while ((encoding = si.setTypeNext(&sdsele, &llele)) != -1) {
-                if (encoding == OBJ_ENCODING_INTSET) {
+                if (encoding != OBJ_ENCODING_HT) {
                     c->addReplyBulkLongLong(llele);
                     objele = createStringObjectFromLongLong(llele);
                 } else {
@@ -591,9 +678,9 @@ void spopCommand(client *c) {
     encoding = setTypeRandomElement(set,&sdsele,&llele);
 
     /* Remove the element from the set */
-    if (encoding == OBJ_ENCODING_INTSET) {
+    if (encoding != OBJ_ENCODING_HT) {
         ele = createStringObjectFromLongLong(llele);
-        set->ptr = intset::intsetRemove((intset *)set->ptr,llele,NULL);
+        setTypeRemoveInteger(set,llele);
     } else {
         ele = createStringObject(sdsele,sdslen(sdsele));
         setTypeRemove(set,(sds)ele->ptr);
@@ -668,7 +755,7 @@ void srandmemberWithCountCommand(client *c) {
         c->addReplyMultiBulkLen(count);
         while(count--) {
             encoding = setTypeRandomElement(set,&ele,&llele);
-            if (encoding == OBJ_ENCODING_INTSET) {
+            if (encoding != OBJ_ENCODING_HT) {
                 c->addReplyBulkLongLong(llele);
             } else {
                 c->addReplyBulkCBuffer(ele,sdslen(ele));
@@ -704,7 +791,7 @@ void srandmemberWithCountCommand(client *c) {
             while ((encoding = si.setTypeNext(&ele, &llele)) != -1) {
                 int retval = DICT_ERR;
 
-                if (encoding == OBJ_ENCODING_INTSET) {
+                if (encoding != OBJ_ENCODING_HT) {
                     retval = d->dictAdd(createStringObjectFromLongLong(llele), NULL);
                 } else {
                     retval = d->dictAdd(createStringObject(ele, sdslen(ele)), NULL);
@@ -734,7 +821,7 @@ void srandmemberWithCountCommand(client *c) {
 
         while(added < count) {
             encoding = setTypeRandomElement(set,&ele,&llele);
-            if (encoding == OBJ_ENCODING_INTSET) {
+            if (encoding != OBJ_ENCODING_HT) {
                 objele = createStringObjectFromLongLong(llele);
             } else {
                 objele = createStringObject(ele,sdslen(ele));
@@ -781,7 +868,7 @@ void srandmemberCommand(client *c) {
         checkType(c,set,OBJ_SET)) return;
 
     encoding = setTypeRandomElement(set,&ele,&llele);
-    if (encoding == OBJ_ENCODING_INTSET) {
+    if (encoding != OBJ_ENCODING_HT) {
         c->addReplyBulkLongLong(llele);
     } else {
         c->addReplyBulkCBuffer(ele,sdslen(ele));
@@ -806,22 +893,323 @@ int qsortCompareSetsByRevCardinality(const void *s1, const void *s2) {
     return 0;
 }
 
+/*-----------------------------------------------------------------------------
+ * Set algebra
+ *----------------------------------------------------------------------------*/
+
+/* The elements of a set that are members of all, or of none, of some other
+ * sets are selected by a filter that splits the set into partitions, scanned
+ * by up to set-algebra-threads threads at the same time if the set has at
+ * least set-algebra-parallel-threshold elements. Like the keyspace walk, the
+ * threads only read the sets, with lookups that don't perform rehashing
+ * steps, and the main thread waits for them to finish: the keyspace is only
+ * modified by the caller, replying or storing the selected elements. */
+
+#define SET_FILTER_INTER 0  /* Select the members of all the other sets. */
+#define SET_FILTER_DIFF 1   /* Select the members of none of the other sets. */
+
+/* Every thread scans about this number of partitions, see keyspaceWalk(). */
+#define SET_FILTER_PARTITIONS_PER_THREAD 16
+
+/* A selected element. 'ele' is NULL for the elements of the sets of
+ * integers, whose value is 'llele': the strings belong to the filtered set,
+ * so the selected elements are valid only as long as it is not modified. */
+struct setFilterElement {
+    sds ele;
+    int64_t llele;
+};
+
+struct setFilterJob {
+    robj *set;
+    robj **others;
+    int numothers;
+    int mode;
+    unsigned long partitions;
+    unsigned long next;         /* Next partition to scan. */
+};
+
+struct setFilterThread {
+    setFilterJob *job;
+    setFilterElement *eles;
+    unsigned long count;
+    unsigned long capacity;
+    sds tmp;                    /* Integers looked up in hash tables. */
+};
+
+struct setFilter {
+    int numthreads;             /* Threads that selected some elements. */
+    unsigned long count;        /* Elements selected by all the threads. */
+    setFilterThread threads[SET_ALGEBRA_MAX_THREADS];
+};
+
+/* Like setTypeIsMember() for the string 'ele' or, if it is NULL, for the
+ * integer 'llele', without modifying the set. */
+static int setTypeIsMemberReadOnly(robj *setobj, sds ele, int64_t llele,
+                                   sds *tmp)
+{
+    long long llval;
+
+    if (setobj->encoding == OBJ_ENCODING_HT) {
+        if (ele == NULL) {
+            char buf[LONG_STR_SIZE];
+            int len = ll2string(buf,sizeof(buf),llele);
+            *tmp = *tmp ? sdscpylen(*tmp,buf,len) : sdsnewlen(buf,len);
+            ele = *tmp;
+        }
+        return ((sdsDict*)setobj->ptr)->dictFindReadOnly(ele) != NULL;
+    }
+    if (ele != NULL) {
+        if (isSdsRepresentableAsLongLong(ele,&llval) != C_OK) return 0;
+        llele = llval;
+    }
+    if (setobj->encoding == OBJ_ENCODING_INTSET) {
+        return ((intset*)setobj->ptr)->intsetFind(llele);
+    } else if (setobj->encoding == OBJ_ENCODING_ROARING) {
+        return ((roaring*)setobj->ptr)->roaringContains(llele);
+    } else {
+        serverPanic("Unknown set encoding");
+    }
+    return 0;
+}
+
+static void setFilterSelect(setFilterThread *t, sds ele, int64_t llele) {
+    setFilterJob *job = t->job;
+
+    for (int j = 0; j < job->numothers; j++) {
+        int member = setTypeIsMemberReadOnly(job->others[j],ele,llele,&t->tmp);
+        if (member != (job->mode == SET_FILTER_INTER)) return;
+    }
+    if (t->count == t->capacity) {
+        t->capacity = t->capacity ? t->capacity*2 : 256;
+        t->eles = (setFilterElement*)
+            zrealloc(t->eles,sizeof(setFilterElement)*t->capacity);
+    }
+    t->eles[t->count].ele = ele;
+    t->eles[t->count].llele = llele;
+    t->count++;
+}
+
+static void setFilterScanCallback(void *privdata, const dictEntry *de) {
+    setFilterSelect((setFilterThread*)privdata,(sds)de->dictGetKey(),0);
+}
+
+static void setFilterScanPartition(setFilterThread *t, unsigned long partition) {
+    setFilterJob *job = t->job;
+    robj *setobj = job->set;
+    int64_t llele;
+
+    if (setobj->encoding == OBJ_ENCODING_HT) {
+        ((dict*)setobj->ptr)->dictScanPartition(partition,job->partitions,
+                                               setFilterScanCallback,t);
+        return;
+    }
+
+    /* Intsets are split by position, bitmaps by container. */
+    uint64_t units = setobj->encoding == OBJ_ENCODING_INTSET ?
+                     ((intset*)setobj->ptr)->intsetLen() :
+                     ((roaring*)setobj->ptr)->roaringContainers();
+    uint32_t start = (uint32_t)(units*partition/job->partitions);
+    uint32_t end = (uint32_t)(units*(partition+1)/job->partitions);
+
+    if (setobj->encoding == OBJ_ENCODING_INTSET) {
+        intset *is = (intset*)setobj->ptr;
+        for (uint32_t j = start; j < end; j++) {
+            is->intsetGet(j,&llele);
+            setFilterSelect(t,NULL,llele);
+        }
+    } else if (setobj->encoding == OBJ_ENCODING_ROARING) {
+        roaring *r = (roaring*)setobj->ptr;
+        roaringIterator it;
+        it.container = start;
+        it.pos = 0;
+        while (r->roaringNext(&it,&llele) && it.container < end)
+            setFilterSelect(t,NULL,llele);
+    } else {
+        serverPanic("Unknown set encoding");
+    }
+}
+
+static void *setFilterThreadMain(void *arg) {
+    setFilterThread *t = (setFilterThread*)arg;
+    setFilterJob *job = t->job;
+    unsigned long partition;
+
+    while(1) {
+        atomicGetIncr(job->next,partition,1);
+        if (partition >= job->partitions) break;
+        setFilterScanPartition(t,partition);
+    }
+    return NULL;
+}
+
+static void setFilterInit(setFilter *f) {
+    f->numthreads = 0;
+    f->count = 0;
+    for (int j = 0; j < SET_ALGEBRA_MAX_THREADS; j++) {
+        f->threads[j].job = NULL;
+        f->threads[j].eles = NULL;
+        f->threads[j].count = 0;
+        f->threads[j].capacity = 0;
+        f->threads[j].tmp = NULL;
+    }
+}
+
+static void setFilterRelease(setFilter *f) {
+    for (int j = 0; j < f->numthreads; j++) {
+        zfree(f->threads[j].eles);
+        sdsfree(f->threads[j].tmp);
+    }
+}
+
+/* Select the elements of 'setobj' that are members of all the 'numothers'
+ * sets 'others' (SET_FILTER_INTER), or of none of them (SET_FILTER_DIFF),
+ * adding them to the elements already selected by 'f'. */
+static void setFilterRun(setFilter *f, robj *setobj, robj **others,
+                         int numothers, int mode)
+{
+    setFilterJob job;
+    pthread_t tids[SET_ALGEBRA_MAX_THREADS];
+    int numthreads = 1, created = 0, j;
+
+    job.set = setobj;
+    job.others = others;
+    job.numothers = numothers;
+    job.mode = mode;
+    job.partitions = 1;
+    job.next = 0;
+
+    if (setTypeSize(setobj) >= server.set_algebra_parallel_threshold)
+        numthreads = server.set_algebra_threads;
+    if (numthreads > 1) {
+        unsigned long want = (unsigned long)numthreads*
+                             SET_FILTER_PARTITIONS_PER_THREAD;
+        if (setobj->encoding == OBJ_ENCODING_HT) {
+            /* Partitions of the dict must be a power of two. */
+            unsigned long maxpart =
+                ((dict*)setobj->ptr)->dictScanMaxPartitions();
+            while (job.partitions < want && job.partitions*2 <= maxpart)
+                job.partitions *= 2;
+        } else {
+            unsigned long units = setobj->encoding == OBJ_ENCODING_INTSET ?
+                ((intset*)setobj->ptr)->intsetLen() :
+                ((roaring*)setobj->ptr)->roaringContainers();
+            job.partitions = units < want ? units : want;
+            if (job.partitions == 0) job.partitions = 1;
+        }
+        if (job.partitions < (unsigned long)numthreads)
+            numthreads = (int)job.partitions;
+    }
+
+    for (j = 0; j < numthreads; j++) f->threads[j].job = &job;
+    for (j = 1; j < numthreads; j++) {
+        if (pthread_create(&tids[j-1],NULL,setFilterThreadMain,
+                           &f->threads[j]) != 0)
+        {
+            serverLog(LL_WARNING,"Can't create set algebra thread: %s", strerror(errno));
+            break;
+        }
+        created++;
+    }
+    setFilterThreadMain(&f->threads[0]);
+    for (j = 0; j < created; j++) pthread_join(tids[j],NULL);
+
+    if (created+1 > f->numthreads) f->numthreads = created+1;
+    f->count = 0;
+    for (j = 0; j < f->numthreads; j++) f->count += f->threads[j].count;
+}
+
+static void setFilterReply(client *c, setFilter *f) {
+    c->addReplyMultiBulkLen(f->count);
+    for (int j = 0; j < f->numthreads; j++) {
+        setFilterThread *t = &f->threads[j];
+        for (unsigned long i = 0; i < t->count; i++) {
+            if (t->eles[i].ele)
+                c->addReplyBulkCBuffer(t->eles[i].ele,sdslen(t->eles[i].ele));
+            else
+                c->addReplyBulkLongLong(t->eles[i].llele);
+        }
+    }
+}
+
+/* Add the selected elements to 'dstset', that should not contain any of
+ * them already. */
+static void setFilterAddTo(setFilter *f, robj *dstset) {
+    int expanded = 0;
+
+    for (int j = 0; j < f->numthreads; j++) {
+        setFilterThread *t = &f->threads[j];
+        for (unsigned long i = 0; i < t->count; i++) {
+            /* Size the hash table for all the elements at once, as soon
+             * as the set is converted to one. */
+            if (!expanded && dstset->encoding == OBJ_ENCODING_HT) {
+                dict *d = (dict*)dstset->ptr;
+                d->dictExpand(d->dictSize()+f->count);
+                expanded = 1;
+            }
+            if (t->eles[i].ele) {
+                setTypeAdd(dstset,t->eles[i].ele);
+            } else {
+                sds ele = sdsfromlonglong(t->eles[i].llele);
+                setTypeAdd(dstset,ele);
+                sdsfree(ele);
+            }
+        }
+    }
+}
+
+static int setTypeIsIntegers(const robj *setobj) {
+    return setobj->encoding == OBJ_ENCODING_INTSET ||
+           setobj->encoding == OBJ_ENCODING_ROARING;
+}
+
+/* Return a new set with the elements of both the sets of integers 'a' and
+ * 'b'. */
+static robj *setTypeIntersectIntegers(robj *a, robj *b) {
+    if (a->encoding == OBJ_ENCODING_INTSET &&
+        b->encoding == OBJ_ENCODING_INTSET)
+    {
+        robj *o = createObject(OBJ_SET,
+            intset::intsetIntersect((intset *)a->ptr,(intset *)b->ptr));
+        o->encoding = OBJ_ENCODING_INTSET;
+        return o;
+    }
+    if (a->encoding == OBJ_ENCODING_ROARING &&
+        b->encoding == OBJ_ENCODING_ROARING)
+    {
+        return setTypeFromRoaring(
+            roaring::roaringIntersect((roaring *)a->ptr,(roaring *)b->ptr));
+    }
+
+    /* An intset and a bitmap: look up the elements of the intset, that is
+     * by far the smaller of the two. */
+    if (a->encoding == OBJ_ENCODING_ROARING) {
+        robj *t = a; a = b; b = t;
+    }
+    robj *o = createIntsetObject();
+    intset *is = (intset *)a->ptr;
+    roaring *r = (roaring *)b->ptr;
+    int64_t llele;
+
+    for (uint32_t j = 0; is->intsetGet(j,&llele); j++) {
+        if (r->roaringContains(llele))
+            o->ptr = intset::intsetAdd((intset *)o->ptr,llele,NULL);
+    }
+    return o;
+}
+
 void sinterGenericCommand(client *c, robj **setkeys,
                           unsigned long setnum, robj *dstkey) {
-    robj **sets = (robj **) zmalloc(sizeof(robj *) * setnum);
+    robj **sets = (robj **) zarena_malloc(sizeof(robj *) * setnum);
     robj *dstset = NULL;
-    sds elesds;
-    int64_t intobj;
-    void *replylen = NULL;
-    unsigned long j, cardinality = 0;
-    int encoding;
+    robj *interset = NULL;
+    unsigned long j;
+    int allintegers = 1;
 
     for (j = 0; j < setnum; j++) {
         robj *setobj = dstkey ?
                        lookupKeyWrite(c->m_cur_selected_db, setkeys[j]) :
                        lookupKeyRead(c->m_cur_selected_db, setkeys[j]);
         if (!setobj) {
-            zfree(sets);
             if (dstkey) {
                 if (dbDelete(c->m_cur_selected_db, dstkey)) {
                     signalModifiedKey(c->m_cur_selected_db, dstkey);
@@ -834,78 +1222,63 @@ void sinterGenericCommand(client *c, robj **setkeys,
             return;
         }
         if (checkType(c, setobj, OBJ_SET)) {
-            zfree(sets);
             return;
         }
         sets[j] = setobj;
     }
+    /* The members of a big set, SMEMBERS, are read in background. */
+    if (setnum == 1 && !dstkey &&
+        bgreadStart(c,sets[0],0,setTypeSize(sets[0]),0)) return;
+
     /* Sort sets from the smallest to largest, this will improve our
      * algorithm's performance */
     qsort(sets, setnum, sizeof(robj *), qsortCompareSetsByCardinality);
 
-    /* The first thing we should output is the total number of elements...
-     * since this is a multi-bulk write, but at this stage we don't know
-     * the intersection set size, so we use a trick, append an empty object
-     * to the output list and save the pointer to later modify it with the
-     * right length */
-    if (!dstkey) {
-        replylen = c->addDeferredMultiBulkLength();
-    } else {
-        /* If we have a target key where to store the resulting set
-         * create this key with an empty set inside */
-        dstset = createIntsetObject();
-    }
-
-    /* Iterate all the elements of the first (smallest) set, and test
-     * the element against all the other sets, if at least one set does
-     * not include the element it is discarded */
-    {
-        setTypeIterator si(sets[0]);
-        while ((encoding = si.setTypeNext(&elesds, &intobj)) != -1) {
-            for (j = 1; j < setnum; j++) {
-                if (sets[j] == sets[0]) continue;
-                if (encoding == OBJ_ENCODING_INTSET) {
-                    /* intset with intset is simple... and fast */
-                    if (sets[j]->encoding == OBJ_ENCODING_INTSET &&
-                        !((intset *) sets[j]->ptr)->intsetFind(intobj)) {
-                        break;
-                        /* in order to compare an integer with an object we
-                         * have to use the generic function, creating an object
-                         * for this */
-                    } else if (sets[j]->encoding == OBJ_ENCODING_HT) {
-                        elesds = sdsfromlonglong(intobj);
-                        if (!setTypeIsMember(sets[j], elesds)) {
-                            sdsfree(elesds);
-                            break;
-                        }
-                        sdsfree(elesds);
-                    }
-                } else if (encoding == OBJ_ENCODING_HT) {
-                    if (!setTypeIsMember(sets[j], elesds)) {
-                        break;
-                    }
-                }
+    /* The sets of integers, intsets and compressed bitmaps, are intersected
+     * all at once merging their sorted representations, and are replaced by
+     * the result: the filter below then only needs to test its elements
+     * against the hash table sets. */
+    if (setTypeIsIntegers(sets[0])) {
+        for (j = 1; j < setnum; j++) {
+            if (!setTypeIsIntegers(sets[j])) {
+                allintegers = 0;
+                continue;
             }
+            if (sets[j] == sets[0]) continue;
+            robj *o = setTypeIntersectIntegers(interset ? interset : sets[0],
+                                               sets[j]);
+            if (interset) decrRefCount(interset);
+            interset = o;
+        }
+        if (interset) {
+            for (j = 0; j < setnum; j++)
+                if (setTypeIsIntegers(sets[j])) sets[j] = interset;
+        }
+    }
 
-            /* Only take action when all sets contain the member */
-            if (j == setnum) {
-                if (!dstkey) {
-                    if (encoding == OBJ_ENCODING_HT)
-                        c->addReplyBulkCBuffer( elesds, sdslen(elesds));
-                    else
-                        c->addReplyBulkLongLong(intobj);
-                    cardinality++;
-                } else {
-                    if (encoding == OBJ_ENCODING_INTSET) {
-                        elesds = sdsfromlonglong(intobj);
-                        setTypeAdd(dstset, elesds);
-                        sdsfree(elesds);
-                    } else {
-                        setTypeAdd(dstset, elesds);
-                    }
-                }
-            }
+    if (dstkey && interset && allintegers) {
+        /* The intersection of the sets of integers is already the result. */
+        dstset = interset;
+        incrRefCount(dstset);
+    } else {
+        /* Select the elements of the first (smallest) set that are members
+         * of all the other sets, skipping the ones that are the same set. */
+        setFilter f;
+        int numothers = 0;
+
+        for (j = 1; j < setnum; j++)
+            if (sets[j] != sets[0]) sets[1+numothers++] = sets[j];
+        setFilterInit(&f);
+        setFilterRun(&f,sets[0],sets+1,numothers,SET_FILTER_INTER);
+        if (!dstkey) {
+            setFilterReply(c,&f);
+        } else {
+            /* If we have a target key where to store the resulting set
+             * create this key with an empty set inside */
+            dstset = createIntsetObject();
+            setFilterAddTo(&f,dstset);
         }
+        setFilterRelease(&f);
     }
 
     if (dstkey) {
@@ -926,10 +1299,8 @@ void sinterGenericCommand(client *c, robj **setkeys,
         }
         signalModifiedKey(c->m_cur_selected_db,dstkey);
         server.dirty++;
-    } else {
-        c->setDeferredMultiBulkLength(replylen,cardinality);
     }
-    zfree(sets);
+    if (interset) decrRefCount(interset);
 }
 
 void sinterCommand(client *c) {
@@ -944,13 +1315,81 @@ void sinterstoreCommand(client *c) {
 #define SET_OP_DIFF 1
 #define SET_OP_INTER 2
 
+/* Return 1 if all the existing sets are sets of integers, and some of them
+ * are compressed bitmaps. */
+static int setTypeRoaringOperands(robj **sets, int setnum) {
+    int bitmaps = 0;
+
+    for (int j = 0; j < setnum; j++) {
+        if (sets[j] == NULL) continue;
+        if (!setTypeIsIntegers(sets[j])) return 0;
+        if (sets[j]->encoding == OBJ_ENCODING_ROARING) bitmaps++;
+    }
+    return bitmaps != 0;
+}
+
+/* Union or difference of sets verifying setTypeRoaringOperands(), computed
+ * container by container on compressed bitmaps. */
+static robj *setTypeRoaringOperation(robj **sets, int setnum, int op) {
+    roaring *result = NULL;
+
+    for (int j = 0; j < setnum; j++) {
+        if (sets[j] == NULL) {
+            if (op == SET_OP_DIFF && j == 0) break;
+            continue; /* non existing keys are like empty sets */
+        }
+
+        roaring *r, *next;
+        int converted = sets[j]->encoding == OBJ_ENCODING_INTSET;
+        r = converted ? setTypeIntsetToRoaring((intset *)sets[j]->ptr) :
+                        (roaring *)sets[j]->ptr;
+        if (result == NULL) {
+            next = converted ? r : roaring::roaringDup(r);
+            converted = 0;
+        } else if (op == SET_OP_UNION) {
+            next = roaring::roaringUnion(result,r);
+        } else {
+            next = roaring::roaringDifference(result,r);
+        }
+        if (result) roaringFree(result);
+        if (converted) roaringFree(r);
+        result = next;
+        if (op == SET_OP_DIFF && result->roaringLen() == 0) break;
+    }
+    return result ? setTypeFromRoaring(result) : createIntsetObject();
+}
+
+/* The union can also be computed selecting, for every set, the elements
+ * that are members of none of the sets before it: this only takes lookups,
+ * that a setFilter splits among threads, instead of adding every element of
+ * every set to the result. The lookups grow with the number of sets, so the
+ * sets are sorted by decreasing size, for the biggest sets to perform the
+ * fewest lookups, and the filter is used only if the lookups performed by
+ * every thread are fewer than the elements to add to the result. */
+static int setTypeUnionByFilter(robj **sets, int setnum) {
+    unsigned long long lookups = 0, elements = 0;
+
+    if (server.set_algebra_threads == 1) return 0;
+    qsort(sets,setnum,sizeof(robj*),qsortCompareSetsByRevCardinality);
+    for (int j = 0; j < setnum && sets[j]; j++) {
+        unsigned long size = setTypeSize(sets[j]);
+        int threads = size >= server.set_algebra_parallel_threshold ?
+                      server.set_algebra_threads : 1;
+        lookups += (unsigned long long)size*j/threads;
+        elements += size;
+    }
+    return lookups < elements;
+}
+
 void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
                               robj *dstkey, int op) {
-    robj **sets = (robj **)zmalloc(sizeof(robj*)*setnum);
+    robj **sets = (robj **)zarena_malloc(sizeof(robj*)*setnum);
     robj *dstset = NULL;
     sds ele;
     int j, cardinality = 0;
     int diff_algo = 1;
+    int filtered = 0;
+    setFilter f;
 
     for (j = 0; j < setnum; j++) {
         robj *setobj = dstkey ?
@@ -961,7 +1400,6 @@ void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
             continue;
         }
         if (checkType(c,setobj,OBJ_SET)) {
-            zfree(sets);
             return;
         }
         sets[j] = setobj;
@@ -1003,9 +1441,22 @@ void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
     /* We need a temp set object to store our union. If the dstkey
      * is not NULL (that is, we are inside an SUNIONSTORE operation) then
      * this set object will be the resulting object to set into the target key*/
-    dstset = createIntsetObject();
-
-    if (op == SET_OP_UNION) {
+    int bitmapop = setTypeRoaringOperands(sets,setnum);
+    dstset = bitmapop ? setTypeRoaringOperation(sets,setnum,op) :
+                        createIntsetObject();
+    setFilterInit(&f);
+
+    if (bitmapop) {
+        /* Sets of integers, some of them compressed bitmaps: the result
+         * was computed by the bitmap kernels. */
+        cardinality = setTypeSize(dstset);
+    } else if (op == SET_OP_UNION && setTypeUnionByFilter(sets,setnum)) {
+        /* Every element is selected from the first set having it, see
+         * setTypeUnionByFilter(). */
+        for (j = 0; j < setnum && sets[j]; j++)
+            setFilterRun(&f,sets[j],sets,j,SET_FILTER_DIFF);
+        filtered = 1;
+    } else if (op == SET_OP_UNION) {
         /* Union is trivial, just add every element of every set to the
          * temporary set. */
         for (j = 0; j < setnum; j++) {
@@ -1025,21 +1476,14 @@ void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
          * into all the other sets.
          *
          * This way we perform at max N*M operations, where N is the size of
-         * the first set, and M the number of sets. */
-        setTypeIterator si(sets[0]);
-        while((ele = si.setTypeNextObject()) != NULL) {
-            for (j = 1; j < setnum; j++) {
-                if (!sets[j]) continue; /* no key is an empty set. */
-                if (sets[j] == sets[0]) break; /* same set! */
-                if (setTypeIsMember(sets[j],ele)) break;
-            }
-            if (j == setnum) {
-                /* There is no other set with this element. Add it. */
-                setTypeAdd(dstset,ele);
-                cardinality++;
-            }
-            sdsfree(ele);
-        }
+         * the first set, and M the number of sets. Non existing keys are
+         * like empty sets, and are skipped. */
+        int numothers = 0;
+
+        for (j = 1; j < setnum; j++)
+            if (sets[j]) sets[1+numothers++] = sets[j];
+        setFilterRun(&f,sets[0],sets+1,numothers,SET_FILTER_DIFF);
+        filtered = 1;
 
     } else if (op == SET_OP_DIFF && sets[0] && diff_algo == 2) {
         /* DIFF Algorithm 2:
@@ -1069,8 +1513,16 @@ void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
         }
     }
 
+    if (filtered) {
+        cardinality = f.count;
+        if (dstkey) setFilterAddTo(&f,dstset);
+    }
+
     /* Output the content of the resulting set, if not in STORE mode */
-    if (!dstkey) {
+    if (!dstkey && filtered) {
+        setFilterReply(c,&f);
+        decrRefCount(dstset);
+    } else if (!dstkey) {
         c->addReplyMultiBulkLen( cardinality);
         {
             setTypeIterator si(dstset);
@@ -1101,7 +1553,7 @@ void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
         signalModifiedKey(c->m_cur_selected_db,dstkey);
         server.dirty++;
     }
-    zfree(sets);
+    setFilterRelease(&f);
 }
 
 void sunionCommand(client *c) {
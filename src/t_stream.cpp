@@ -0,0 +1,2153 @@
+/*
+ * Copyright (c) 2017, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "endianconv.h"
+#include "stream.h"
+
+/* Every stream item inside the listpack, has a flags field that is used to
+ * mark the entry as deleted, or having the same field as the "master"
+ * entry at the start of the listpack> */
+#define STREAM_ITEM_FLAG_NONE 0             /* No special flags. */
+#define STREAM_ITEM_FLAG_DELETED (1<<0)     /* Entry is delete. Skip it. */
+#define STREAM_ITEM_FLAG_SAMEFIELDS (1<<1)  /* Same fields as master entry. */
+
+/* When XREAD blocks without a COUNT, we still bound the number of entries
+ * served when the client is woken up. */
+#define XREAD_BLOCKED_DEFAULT_COUNT 1000
+
+static void streamFreeCG(streamCG *cg);
+static size_t streamReplyWithRangeFromConsumerPEL(client *c, stream *s,
+    streamID *start, streamID *end, size_t count, streamConsumer *consumer);
+
+/* -----------------------------------------------------------------------
+ * Low level stream encoding: a radix tree of listpacks.
+ * ----------------------------------------------------------------------- */
+
+/* Create a new stream data structure. */
+stream *streamNew() {
+    stream *s = (stream *)zmalloc(sizeof(*s));
+    s->rax = raxNew();
+    s->length = 0;
+    s->last_id.ms = 0;
+    s->last_id.seq = 0;
+    s->cgroups = NULL; /* Created on demand to save memory when not used. */
+    return s;
+}
+
+/* Free a stream, including the listpacks stored inside the radix tree,
+ * and its consumer groups. */
+void freeStream(stream *s) {
+    raxFreeWithCallback(s->rax,(void(*)(void*))lpFree);
+    if (s->cgroups)
+        raxFreeWithCallback(s->cgroups,(void(*)(void*))streamFreeCG);
+    zfree(s);
+}
+
+/* Set 'id' to the smallest ID greater than 'id'. If 'id' is already the
+ * greatest possible ID it is left unchanged and C_ERR is returned. */
+static int streamIncrID(streamID *id) {
+    if (id->seq == UINT64_MAX) {
+        if (id->ms == UINT64_MAX) return C_ERR;
+        id->ms++;
+        id->seq = 0;
+    } else {
+        id->seq++;
+    }
+    return C_OK;
+}
+
+/* Generate the next stream item ID given the previous one. If the current
+ * milliseconds Unix time is greater than the previous one, just use this
+ * as time part and start with sequence part of zero. Otherwise we use the
+ * previous time (and never go backward) and increment the sequence. */
+static void streamNextID(streamID *last_id, streamID *new_id) {
+    uint64_t ms = mstime();
+    if (ms > last_id->ms) {
+        new_id->ms = ms;
+        new_id->seq = 0;
+    } else {
+        *new_id = *last_id;
+        streamIncrID(new_id);
+    }
+}
+
+/* This is just a wrapper for lpAppend() to directly use a 64 bit integer
+ * instead of a string. */
+static unsigned char *lpAppendInteger(unsigned char *lp, int64_t value) {
+    char buf[LONG_STR_SIZE];
+    int slen = ll2string(buf,sizeof(buf),value);
+    return lpAppend(lp,(unsigned char*)buf,slen);
+}
+
+/* This is just a wrapper for lpInsert() to directly use a 64 bit integer
+ * instead of a string to replace the current element. The function returns
+ * the new listpack as return value, and also updates the current cursor
+ * by updating '*pos'. */
+static unsigned char *lpReplaceInteger(unsigned char *lp, unsigned char **pos,
+                                       int64_t value)
+{
+    char buf[LONG_STR_SIZE];
+    int slen = ll2string(buf,sizeof(buf),value);
+    return lpInsert(lp,(unsigned char*)buf,slen,*pos,LP_REPLACE,pos);
+}
+
+/* This is a wrapper function for lpGet() to directly get an integer value
+ * from the listpack (that may store numbers as a string), converting
+ * the string if needed. */
+static int64_t lpGetInteger(unsigned char *ele) {
+    int64_t v;
+    unsigned char *e = lpGet(ele,&v,NULL);
+    if (e == NULL) return v;
+    /* The following code path should never be used for how listpacks work:
+     * they should always be able to store an int64_t value in integer
+     * encoded form. However the implementation may change. */
+    long long ll;
+    int retval = string2ll((char*)e,v,&ll);
+    serverAssert(retval != 0);
+    return ll;
+}
+
+/* Convert the specified stream entry ID as a 128 bit big endian number, so
+ * that the IDs can be sorted lexicographically. */
+void streamEncodeID(void *buf, streamID *id) {
+    uint64_t e[2];
+    e[0] = htonu64(id->ms);
+    e[1] = htonu64(id->seq);
+    memcpy(buf,e,sizeof(e));
+}
+
+/* This is the reverse of streamEncodeID(): the decoded ID will be stored
+ * in the 'id' structure passed by reference. The buffer 'buf' must point
+ * to a 128 bit big-endian encoded ID. */
+void streamDecodeID(void *buf, streamID *id) {
+    uint64_t e[2];
+    memcpy(e,buf,sizeof(e));
+    id->ms = ntohu64(e[0]);
+    id->seq = ntohu64(e[1]);
+}
+
+/* Compare two stream IDs. Return -1 if a < b, 0 if a == b, 1 if a > b. */
+static int streamCompareID(streamID *a, streamID *b) {
+    if (a->ms > b->ms) return 1;
+    else if (a->ms < b->ms) return -1;
+    /* The ms part is the same. Check the sequence part. */
+    else if (a->seq > b->seq) return 1;
+    else if (a->seq < b->seq) return -1;
+    /* Everything is the same: IDs are equal. */
+    return 0;
+}
+
+/* Adds a new item into the stream 's' having the specified number of
+ * field-value pairs as specified in 'numfields' and stored into 'argv'.
+ * Returns the new entry ID populating the 'added_id' structure.
+ *
+ * If 'use_id' is not NULL, the ID is not auto-generated by the function,
+ * but instead the passed ID is uesd to add the new entry. In this case
+ * adding the entry may fail as specified later in this comment.
+ *
+ * The function returns C_OK if the item was added, this is always true
+ * if the ID was generated by the function. However the function may return
+ * C_ERR if an ID was given via 'use_id', but adding it failed since the
+ * current top ID is greater or equal. */
+static int streamAppendItem(stream *s, robj **argv, int64_t numfields,
+                            streamID *added_id, streamID *use_id)
+{
+    /* If an ID was given, check that it's greater than the last entry ID
+     * or return an error. */
+    if (use_id && streamCompareID(use_id,&s->last_id) <= 0) return C_ERR;
+
+    /* Get a reference to the tail node listpack, and the key of its radix
+     * tree node, that is the ID of its master entry. */
+    raxIterator ri;
+    uint64_t rax_key[2];    /* Key in the radix tree containing the listpack.*/
+    unsigned char *lp = NULL;   /* Tail listpack pointer. */
+    size_t lp_bytes = 0;        /* Total bytes in the tail listpack. */
+
+    raxStart(&ri,s->rax);
+    raxSeek(&ri,"$",NULL,0);
+    if (raxNext(&ri)) {
+        serverAssert(ri.key_len == sizeof(rax_key));
+        memcpy(rax_key,ri.key,sizeof(rax_key));
+        lp = (unsigned char *)ri.data;
+        lp_bytes = lpBytes(lp);
+    }
+    raxStop(&ri);
+    unsigned char *tail_lp = lp;
+
+    /* Generate the new entry ID. */
+    streamID id;
+    if (use_id)
+        id = *use_id;
+    else
+        streamNextID(&s->last_id,&id);
+
+    /* We have to add the key into the radix tree in lexicographic order,
+     * to do so we consider the ID as a single 128 bit number written in
+     * big endian, so that the most significant bytes are the first ones. */
+    streamID master_id;     /* ID of the master entry in the listpack. */
+
+    /* Create a new listpack and radix tree node if needed. Note that when
+     * a new listpack is created, we populate it with a "master entry". This
+     * is just a set of fields that is taken as references in order to compress
+     * the stream entries that we'll add inside the listpack.
+     *
+     * Note that while we use the first added entry fields to create
+     * the master entry, the first added entry is NOT represented in the master
+     * entry, which is a stand alone object. But of course, the first entry
+     * will compress well because it's used as reference.
+     *
+     * The master entry is composed like in the following example:
+     *
+     * +-------+---------+------------+---------+--/--+---------+---------+-+
+     * | count | deleted | num-fields | field_1 | field_2 | ... | field_N |0|
+     * +-------+---------+------------+---------+--/--+---------+---------+-+
+     *
+     * count and deleted just represent respectively the total number of
+     * entries inside the listpack that are valid, and marked as deleted
+     * (deleted flag in the entry flags set). So the total number of items
+     * actually inside the listpack (both deleted and not) is count+deleted.
+     *
+     * The real entries will be encoded with an ID that is just the
+     * millisecond and sequence difference compared to the key stored at
+     * the radix tree node containing the listpack (delta encoding), and
+     * if the fields of the entry are the same as the master enty fields, the
+     * entry flags will specify this fact and the entry fields and number
+     * of fields will be omitted (see later in the code of this function).
+     *
+     * The "0" entry at the end is the same as the 'lp-count' entry in the
+     * regular stream entries (see below), and marks the fact that there are
+     * no more entries, when we scan the stream from right to left. */
+
+    /* First of all, check if we can append to the current macro node or
+     * if we need to switch to the next one. 'lp' will be set to NULL if
+     * the current node is full. */
+    if (lp != NULL) {
+        if (server.stream_node_max_bytes &&
+            lp_bytes >= server.stream_node_max_bytes)
+        {
+            lp = NULL;
+        } else if (server.stream_node_max_entries) {
+            int64_t count = lpGetInteger(lpFirst(lp));
+            if (count >= server.stream_node_max_entries) lp = NULL;
+        }
+    }
+
+    int flags = STREAM_ITEM_FLAG_NONE;
+    if (lp == NULL) {
+        master_id = id;
+        streamEncodeID(rax_key,&id);
+        /* Create the listpack having the master entry ID and fields. */
+        lp = lpNew();
+        lp = lpAppendInteger(lp,1); /* One item, the one we are adding. */
+        lp = lpAppendInteger(lp,0); /* Zero deleted so far. */
+        lp = lpAppendInteger(lp,numfields);
+        for (int64_t i = 0; i < numfields; i++) {
+            sds field = (sds)argv[i*2]->ptr;
+            lp = lpAppend(lp,(unsigned char*)field,sdslen(field));
+        }
+        lp = lpAppendInteger(lp,0); /* Master entry zero terminator. */
+        raxInsert(s->rax,(unsigned char*)&rax_key,sizeof(rax_key),lp,NULL);
+        tail_lp = lp;
+        /* The first entry we insert, has obviously the same fields of the
+         * master entry. */
+        flags |= STREAM_ITEM_FLAG_SAMEFIELDS;
+    } else {
+        /* Read the master ID from the radix tree key. */
+        streamDecodeID(rax_key,&master_id);
+        unsigned char *lp_ele = lpFirst(lp);
+
+        /* Update count and skip the deleted fields. */
+        int64_t count = lpGetInteger(lp_ele);
+        lp = lpReplaceInteger(lp,&lp_ele,count+1);
+        lp_ele = lpNext(lp,lp_ele); /* seek deleted. */
+        lp_ele = lpNext(lp,lp_ele); /* seek master entry num fields. */
+
+        /* Check if the entry we are adding, have the same fields
+         * as the master entry. */
+        int64_t master_fields_count = lpGetInteger(lp_ele);
+        lp_ele = lpNext(lp,lp_ele);
+        if (numfields == master_fields_count) {
+            int64_t i;
+            for (i = 0; i < master_fields_count; i++) {
+                sds field = (sds)argv[i*2]->ptr;
+                int64_t e_len;
+                unsigned char buf[LP_INTBUF_SIZE];
+                unsigned char *e = lpGet(lp_ele,&e_len,buf);
+                /* Stop if there is a mismatch. */
+                if (sdslen(field) != (size_t)e_len ||
+                    memcmp(e,field,e_len) != 0) break;
+                lp_ele = lpNext(lp,lp_ele);
+            }
+            /* All fields are the same! We can compress the field names
+             * setting a single bit in the flags. */
+            if (i == master_fields_count) flags |= STREAM_ITEM_FLAG_SAMEFIELDS;
+        }
+    }
+
+    /* Populate the listpack with the new entry. We use the following
+     * encoding:
+     *
+     * +-----+--------+----------+-------+-------+-/-+-------+-------+--------+
+     * |flags|entry-id|num-fields|field-1|value-1|...|field-N|value-N|lp-count|
+     * +-----+--------+----------+-------+-------+-/-+-------+-------+--------+
+     *
+     * However if the SAMEFIELD flag is set, we have just to populate
+     * the entry with the values, so it becomes:
+     *
+     * +-----+--------+-------+-/-+-------+--------+
+     * |flags|entry-id|value-1|...|value-N|lp-count|
+     * +-----+--------+-------+-/-+-------+--------+
+     *
+     * The entry-id field is actually two separated fields: the ms
+     * and seq difference compared to the master entry.
+     *
+     * The lp-count field is a number that states the number of listpack pieces
+     * that compose the entry, so that it's possible to travel the entry
+     * in reverse order: we can just start from the end of the listpack, read
+     * the entry, and jump back N times to seek the "flags" field to read
+     * the stream full entry. */
+    lp = lpAppendInteger(lp,flags);
+    lp = lpAppendInteger(lp,id.ms - master_id.ms);
+    lp = lpAppendInteger(lp,id.seq - master_id.seq);
+    if (!(flags & STREAM_ITEM_FLAG_SAMEFIELDS))
+        lp = lpAppendInteger(lp,numfields);
+    for (int64_t i = 0; i < numfields; i++) {
+        sds field = (sds)argv[i*2]->ptr, value = (sds)argv[i*2+1]->ptr;
+        if (!(flags & STREAM_ITEM_FLAG_SAMEFIELDS))
+            lp = lpAppend(lp,(unsigned char*)field,sdslen(field));
+        lp = lpAppend(lp,(unsigned char*)value,sdslen(value));
+    }
+    /* Compute and store the lp-count field. */
+    int64_t lp_count = numfields;
+    lp_count += 3; /* Add the 3 fixed fields flags + ms-diff + seq-diff. */
+    if (!(flags & STREAM_ITEM_FLAG_SAMEFIELDS)) {
+        /* If the item is not compressed, it also has the fields other than
+         * the values, and an additional num-fileds field. */
+        lp_count += numfields+1;
+    }
+    lp = lpAppendInteger(lp,lp_count);
+
+    /* Insert back into the tree in order to update the listpack pointer. */
+    if (tail_lp != lp)
+        raxInsert(s->rax,(unsigned char*)&rax_key,sizeof(rax_key),lp,NULL);
+    s->length++;
+    s->last_id = id;
+    if (added_id) *added_id = id;
+    return C_OK;
+}
+
+/* Trim the stream 's' to have no more than maxlen elements, and return the
+ * number of elements removed from the stream. The 'approx' option, if non-zero,
+ * specifies that the trimming must be performed in a approximated way in
+ * order to maximize performances. This means that the stream may contain
+ * more elements than 'maxlen', and elements are only removed if we can remove
+ * a *whole* node of the radix tree. The elements are removed from the head
+ * of the stream (older elements).
+ *
+ * The function may return zero if:
+ *
+ * 1) The stream is already shorter or equal to the specified max length.
+ * 2) The 'approx' option is true and the head node had not enough elements
+ *    to be deleted, leaving the stream with a number of elements >= maxlen.
+ */
+static int64_t streamTrimByLength(stream *s, size_t maxlen, int approx) {
+    if (s->length <= maxlen) return 0;
+
+    raxIterator ri;
+    raxStart(&ri,s->rax);
+    raxSeek(&ri,"^",NULL,0);
+
+    int64_t deleted = 0;
+    while(s->length > maxlen && raxNext(&ri)) {
+        unsigned char *lp = (unsigned char *)ri.data, *p = lpFirst(lp);
+        int64_t entries = lpGetInteger(p);
+
+        /* Check if we can remove the whole node, and still have at
+         * least maxlen elements. */
+        if (s->length - entries >= maxlen) {
+            lpFree(lp);
+            raxRemove(s->rax,ri.key,ri.key_len,NULL);
+            raxSeek(&ri,">=",ri.key,ri.key_len);
+            s->length -= entries;
+            deleted += entries;
+            continue;
+        }
+
+        /* If we cannot remove a whole element, and approx is true,
+         * stop here. */
+        if (approx) break;
+
+        /* Otherwise, we have to mark single entries inside the listpack
+         * as deleted. We start by updating the entries/deleted counters. */
+        int64_t to_delete = s->length - maxlen;
+        serverAssert(to_delete < entries);
+        lp = lpReplaceInteger(lp,&p,entries-to_delete);
+        p = lpNext(lp,p); /* Seek deleted field. */
+        int64_t marked_deleted = lpGetInteger(p);
+        lp = lpReplaceInteger(lp,&p,marked_deleted+to_delete);
+        p = lpNext(lp,p); /* Seek num-of-fields in the master entry. */
+
+        /* Skip all the master fields. */
+        int64_t master_fields_count = lpGetInteger(p);
+        p = lpNext(lp,p); /* Seek the first field. */
+        for (int64_t j = 0; j < master_fields_count; j++)
+            p = lpNext(lp,p); /* Skip all master fields. */
+        p = lpNext(lp,p); /* Skip the zero master entry terminator. */
+
+        /* 'p' is now pointing to the first entry inside the listpack.
+         * We have to run entry after entry, marking entries as deleted
+         * if they are already not deleted. */
+        s->length -= to_delete;
+        deleted += to_delete;
+        while(p) {
+            int flags = lpGetInteger(p);
+            int64_t to_skip;
+
+            /* Mark the entry as deleted. */
+            if (!(flags & STREAM_ITEM_FLAG_DELETED)) {
+                flags |= STREAM_ITEM_FLAG_DELETED;
+                lp = lpReplaceInteger(lp,&p,flags);
+                to_delete--;
+                if (to_delete == 0) break;
+            }
+
+            p = lpNext(lp,p); /* Skip ID ms delta. */
+            p = lpNext(lp,p); /* Skip ID seq delta. */
+            p = lpNext(lp,p); /* Seek num-fields or values (if compressed). */
+            if (flags & STREAM_ITEM_FLAG_SAMEFIELDS) {
+                to_skip = master_fields_count;
+            } else {
+                to_skip = lpGetInteger(p);
+                to_skip = 1+(to_skip*2);
+            }
+
+            while(to_skip--) p = lpNext(lp,p); /* Skip the whole entry. */
+            p = lpNext(lp,p); /* Skip the final lp-count field. */
+        }
+
+        /* Update the listpack with the new pointer. */
+        raxInsert(s->rax,ri.key,ri.key_len,lp,NULL);
+
+        break; /* If we are here, there was enough to delete in the current
+                  node, so no need to go to the next node. */
+    }
+
+    raxStop(&ri);
+    return deleted;
+}
+
+/* Initialize the stream iterator, so that we can call iterating functions
+ * to get the next items. This requires a corresponding streamIteratorStop()
+ * at the end. The 'rev' parameter controls the direction. If it's zero the
+ * iteration is from the start to the end element (inclusive), otherwise
+ * if rev is non-zero, the iteration is reversed.
+ *
+ * Once the iterator is initalized, we iterate like this:
+ *
+ *  streamIterator myiterator;
+ *  streamIteratorStart(&myiterator,...);
+ *  int64_t numfields;
+ *  while(streamIteratorGetID(&myiterator,&ID,&numfields)) {
+ *      while(numfields--) {
+ *          unsigned char *key, *value;
+ *          size_t key_len, value_len;
+ *          streamIteratorGetField(&myiterator,&key,&value,&key_len,&value_len);
+ *
+ *          ... do what you want with key and value ...
+ *      }
+ *  }
+ *  streamIteratorStop(&myiterator);
+ *
+ * Note that all the fields of an entry must be consumed by
+ * streamIteratorGetField() before asking for the next ID. */
+void streamIteratorStart(streamIterator *si, stream *s, streamID *start,
+                         streamID *end, int rev)
+{
+    /* Intialize the iterator and translates the iteration start/stop
+     * elements into a 128 big big-endian number. */
+    if (start) {
+        streamEncodeID(si->start_key,start);
+    } else {
+        si->start_key[0] = 0;
+        si->start_key[1] = 0;
+    }
+
+    if (end) {
+        streamEncodeID(si->end_key,end);
+    } else {
+        si->end_key[0] = UINT64_MAX;
+        si->end_key[1] = UINT64_MAX;
+    }
+
+    /* Seek the correct node in the radix tree. */
+    raxStart(&si->ri,s->rax);
+    if (!rev) {
+        if (start && (start->ms || start->seq)) {
+            raxSeek(&si->ri,"<=",(unsigned char*)si->start_key,
+                    sizeof(si->start_key));
+            if (si->ri.flags & RAX_ITER_EOF) raxSeek(&si->ri,"^",NULL,0);
+        } else {
+            raxSeek(&si->ri,"^",NULL,0);
+        }
+    } else {
+        if (end && (end->ms || end->seq)) {
+            raxSeek(&si->ri,"<=",(unsigned char*)si->end_key,
+                    sizeof(si->end_key));
+            if (si->ri.flags & RAX_ITER_EOF) raxSeek(&si->ri,"$",NULL,0);
+        } else {
+            raxSeek(&si->ri,"$",NULL,0);
+        }
+    }
+    si->lp = NULL; /* There is no current listpack right now. */
+    si->lp_ele = NULL; /* Current listpack cursor. */
+    si->rev = rev;  /* Direction, if non-zero reversed, from end to start. */
+}
+
+/* Return 1 and store the current item ID at 'id' if there are still
+ * elements within the iteration range, otherwise return 0 in order to
+ * signal the iteration terminated. */
+int streamIteratorGetID(streamIterator *si, streamID *id, int64_t *numfields) {
+    while(1) { /* Will stop when element > stop_key or end of radix tree. */
+        /* If the current listpack is set to NULL, this is the start of the
+         * iteration or the previous listpack was completely iterated.
+         * Go to the next node. */
+        if (si->lp == NULL || si->lp_ele == NULL) {
+            if (!si->rev && !raxNext(&si->ri)) return 0;
+            else if (si->rev && !raxPrev(&si->ri)) return 0;
+            serverAssert(si->ri.key_len == sizeof(streamID));
+            /* Get the master ID. */
+            streamDecodeID(si->ri.key,&si->master_id);
+            /* Get the master fields count. */
+            si->lp = (unsigned char *)si->ri.data;
+            si->lp_ele = lpFirst(si->lp);           /* Seek items count */
+            si->lp_ele = lpNext(si->lp,si->lp_ele); /* Seek deleted count. */
+            si->lp_ele = lpNext(si->lp,si->lp_ele); /* Seek num fields. */
+            si->master_fields_count = lpGetInteger(si->lp_ele);
+            si->lp_ele = lpNext(si->lp,si->lp_ele); /* Seek first field. */
+            si->master_fields_start = si->lp_ele;
+            /* We are now pointing to the first field of the master entry.
+             * We need to seek either the first or the last entry depending
+             * on the direction of the iteration. */
+            if (!si->rev) {
+                /* If we are iterating in normal order, skip the master fields
+                 * to seek the first actual entry. */
+                for (uint64_t i = 0; i < si->master_fields_count; i++)
+                    si->lp_ele = lpNext(si->lp,si->lp_ele);
+            } else {
+                /* If we are iterating in reverse direction, just seek the
+                 * last part of the last entry in the listpack (that is, the
+                 * fields count). */
+                si->lp_ele = lpLast(si->lp);
+            }
+        } else if (si->rev) {
+            /* If we are itereating in the reverse order, and this is not
+             * the first entry emitted for this listpack, then we already
+             * emitted the current entry, and have to go back to the previous
+             * one. */
+            int64_t lp_count = lpGetInteger(si->lp_ele);
+            while(lp_count--) si->lp_ele = lpPrev(si->lp,si->lp_ele);
+            /* Seek lp-count of prev entry. */
+            si->lp_ele = lpPrev(si->lp,si->lp_ele);
+        }
+
+        /* For every radix tree node, iterate the corresponding listpack,
+         * returning elements when they are within range. */
+        while(1) {
+            if (!si->rev) {
+                /* If we are going forward, skip the previous entry
+                 * lp-count field (or in case of the master entry, the zero
+                 * term field) */
+                si->lp_ele = lpNext(si->lp,si->lp_ele);
+                if (si->lp_ele == NULL) break;
+            } else {
+                /* If we are going backward, read the number of elements this
+                 * entry is composed of, and jump backward N times to seek
+                 * its start. */
+                int64_t lp_count = lpGetInteger(si->lp_ele);
+                if (lp_count == 0) { /* We reached the master entry. */
+                    si->lp = NULL;
+                    si->lp_ele = NULL;
+                    break;
+                }
+                while(lp_count--) si->lp_ele = lpPrev(si->lp,si->lp_ele);
+            }
+
+            /* Get the flags entry. */
+            int flags = lpGetInteger(si->lp_ele);
+            si->lp_ele = lpNext(si->lp,si->lp_ele); /* Seek ID. */
+
+            /* Get the ID: it is encoded as difference between the master
+             * ID and this entry ID. */
+            *id = si->master_id;
+            id->ms += lpGetInteger(si->lp_ele);
+            si->lp_ele = lpNext(si->lp,si->lp_ele);
+            id->seq += lpGetInteger(si->lp_ele);
+            si->lp_ele = lpNext(si->lp,si->lp_ele);
+            unsigned char buf[sizeof(streamID)];
+            streamEncodeID(buf,id);
+
+            /* The number of entries is here or not depending on the
+             * flags. */
+            if (flags & STREAM_ITEM_FLAG_SAMEFIELDS) {
+                *numfields = si->master_fields_count;
+            } else {
+                *numfields = lpGetInteger(si->lp_ele);
+                si->lp_ele = lpNext(si->lp,si->lp_ele);
+            }
+
+            /* If current >= start, and the entry is not marked as
+             * deleted, emit it. */
+            if (!si->rev) {
+                if (memcmp(buf,si->start_key,sizeof(streamID)) >= 0 &&
+                    !(flags & STREAM_ITEM_FLAG_DELETED))
+                {
+                    if (memcmp(buf,si->end_key,sizeof(streamID)) > 0)
+                        return 0; /* We are already out of range. */
+                    si->entry_flags = flags;
+                    if (flags & STREAM_ITEM_FLAG_SAMEFIELDS)
+                        si->master_fields_ptr = si->master_fields_start;
+                    return 1; /* Valid item returned. */
+                }
+            } else {
+                if (memcmp(buf,si->end_key,sizeof(streamID)) <= 0 &&
+                    !(flags & STREAM_ITEM_FLAG_DELETED))
+                {
+                    if (memcmp(buf,si->start_key,sizeof(streamID)) < 0)
+                        return 0; /* We are already out of range. */
+                    si->entry_flags = flags;
+                    if (flags & STREAM_ITEM_FLAG_SAMEFIELDS)
+                        si->master_fields_ptr = si->master_fields_start;
+                    return 1; /* Valid item returned. */
+                }
+            }
+
+            /* If we do not emit, we have to discard if we are going
+             * forward, or seek the previous entry if we are going
+             * backward. */
+            if (!si->rev) {
+                int64_t to_discard = (flags & STREAM_ITEM_FLAG_SAMEFIELDS) ?
+                                      *numfields : *numfields*2;
+                for (int64_t i = 0; i < to_discard; i++)
+                    si->lp_ele = lpNext(si->lp,si->lp_ele);
+            } else {
+                int64_t prev_times = 4; /* flag + id ms + id seq + one more to
+                                           go back to the previous entry "count"
+                                           field. */
+                /* If the entry was not flagged SAMEFIELD we also read the
+                 * number of fields, so go back one more. */
+                if (!(flags & STREAM_ITEM_FLAG_SAMEFIELDS)) prev_times++;
+                while(prev_times--) si->lp_ele = lpPrev(si->lp,si->lp_ele);
+            }
+        }
+
+        /* End of listpack reached. Try the next/prev radix tree node. */
+    }
+}
+
+/* Get the field and value of the current item we are iterating. This should
+ * be called immediately after streamIteratorGetID(), and for each field
+ * according to the number of fields returned by streamIteratorGetID().
+ * The function populates the field and value pointers and the corresponding
+ * lengths by reference, that are valid until the next iterator call, assuming
+ * no one touches the stream meanwhile. */
+void streamIteratorGetField(streamIterator *si, unsigned char **fieldptr,
+                            unsigned char **valueptr, int64_t *fieldlen,
+                            int64_t *valuelen)
+{
+    if (si->entry_flags & STREAM_ITEM_FLAG_SAMEFIELDS) {
+        *fieldptr = lpGet(si->master_fields_ptr,fieldlen,si->field_buf);
+        si->master_fields_ptr = lpNext(si->lp,si->master_fields_ptr);
+    } else {
+        *fieldptr = lpGet(si->lp_ele,fieldlen,si->field_buf);
+        si->lp_ele = lpNext(si->lp,si->lp_ele);
+    }
+    *valueptr = lpGet(si->lp_ele,valuelen,si->value_buf);
+    si->lp_ele = lpNext(si->lp,si->lp_ele);
+}
+
+/* Stop the stream iterator. The only cleanup we need is to free the rax
+ * itereator, since the stream iterator itself is supposed to be stack
+ * allocated. */
+void streamIteratorStop(streamIterator *si) {
+    raxStop(&si->ri);
+}
+
+/* Create the "<ms>-<seq>" string form of a stream ID. */
+sds streamIDToSds(streamID *id) {
+    return sdscatfmt(sdsempty(),"%U-%U",id->ms,id->seq);
+}
+
+/* Emit a reply in the client output buffer by formatting a Stream ID
+ * in the standard <ms>-<seq> format, using the simple string protocol
+ * of REPL. */
+static void addReplyStreamID(client *c, streamID *id) {
+    c->addReplyBulkSds(streamIDToSds(id));
+}
+
+/* Create a string object holding the "<ms>-<seq>" form of 'id'. */
+static robj *createObjectFromStreamID(streamID *id) {
+    return createObject(OBJ_STRING,streamIDToSds(id));
+}
+
+/* -----------------------------------------------------------------------
+ * Consumer groups: low level
+ * ----------------------------------------------------------------------- */
+
+/* Create a NACK entry setting the delivery count to 1 and the delivery
+ * time to the current time. The NACK consumer will be set to the one
+ * specified as argument of the function. */
+streamNACK *streamCreateNACK(streamConsumer *consumer) {
+    streamNACK *nack = (streamNACK *)zmalloc(sizeof(*nack));
+    nack->delivery_time = mstime();
+    nack->delivery_count = 1;
+    nack->consumer = consumer;
+    return nack;
+}
+
+/* Free a NACK entry. */
+static void streamFreeNACK(streamNACK *na) {
+    zfree(na);
+}
+
+/* Free a consumer and associated data structures. Note that this function
+ * will not reassign the pending messages associated with this consumer
+ * nor will delete them from the stream, so when this function is called
+ * to delete a consumer, and not when the whole stream is destroyed, the
+ * caller should do some work before. */
+static void streamFreeConsumer(streamConsumer *sc) {
+    raxFree(sc->pel); /* No value free callback: the PEL entries are shared
+                         between the consumer and the main stream PEL. */
+    sdsfree(sc->name);
+    zfree(sc);
+}
+
+/* Create a new consumer group in the context of the stream 's', having the
+ * specified name and last server ID. If a consumer group with the same name
+ * already existed NULL is returned, otherwise the pointer to the consumer
+ * group is returned. */
+streamCG *streamCreateCG(stream *s, char *name, size_t namelen, streamID *id) {
+    if (s->cgroups == NULL) s->cgroups = raxNew();
+    if (raxFind(s->cgroups,(unsigned char*)name,namelen) != raxNotFound)
+        return NULL;
+
+    streamCG *cg = (streamCG *)zmalloc(sizeof(*cg));
+    cg->pel = raxNew();
+    cg->consumers = raxNew();
+    cg->last_id = *id;
+    raxInsert(s->cgroups,(unsigned char*)name,namelen,cg,NULL);
+    return cg;
+}
+
+/* Free a consumer group and all its associated data. */
+static void streamFreeCG(streamCG *cg) {
+    raxFreeWithCallback(cg->pel,(void(*)(void*))streamFreeNACK);
+    raxFreeWithCallback(cg->consumers,(void(*)(void*))streamFreeConsumer);
+    zfree(cg);
+}
+
+/* Lookup the consumer group in the specified stream and returns its
+ * pointer, otherwise if there is no such group, NULL is returned. */
+streamCG *streamLookupCG(stream *s, sds groupname) {
+    if (s->cgroups == NULL) return NULL;
+    streamCG *cg = (streamCG *)raxFind(s->cgroups,(unsigned char*)groupname,
+                                       sdslen(groupname));
+    return (cg == raxNotFound) ? NULL : cg;
+}
+
+/* Lookup the consumer with the specified name in the group 'cg': if the
+ * consumer does not exist it is automatically created as a side effect
+ * of calling this function when 'create' is true, otherwise NULL is
+ * returned. The consumer seen time is updated when it is created or
+ * looked up with 'create' set, since this means it is active. */
+streamConsumer *streamLookupConsumer(streamCG *cg, sds name, int create) {
+    streamConsumer *consumer = (streamConsumer *)
+        raxFind(cg->consumers,(unsigned char*)name,sdslen(name));
+    if (consumer == raxNotFound) {
+        if (!create) return NULL;
+        consumer = (streamConsumer *)zmalloc(sizeof(*consumer));
+        consumer->name = sdsdup(name);
+        consumer->pel = raxNew();
+        raxInsert(cg->consumers,(unsigned char*)name,sdslen(name),
+                  consumer,NULL);
+    }
+    if (create) consumer->seen_time = mstime();
+    return consumer;
+}
+
+/* Delete the consumer specified in the consumer group 'cg'. The consumer
+ * may have pending messages: they are removed from the PEL, and the number
+ * of pending messages "lost" is returned. */
+static uint64_t streamDelConsumer(streamCG *cg, sds name) {
+    streamConsumer *consumer = streamLookupConsumer(cg,name,0);
+    if (consumer == NULL) return 0;
+
+    uint64_t retval = consumer->pel->numele;
+
+    /* Iterate all the consumer pending messages, deleting every corresponding
+     * entry from the global entry. */
+    raxIterator ri;
+    raxStart(&ri,consumer->pel);
+    raxSeek(&ri,"^",NULL,0);
+    while(raxNext(&ri)) {
+        streamNACK *nack = (streamNACK *)ri.data;
+        raxRemove(cg->pel,ri.key,ri.key_len,NULL);
+        streamFreeNACK(nack);
+    }
+    raxStop(&ri);
+
+    /* Deallocate the consumer. */
+    raxRemove(cg->consumers,(unsigned char*)name,sdslen(name),NULL);
+    streamFreeConsumer(consumer);
+    return retval;
+}
+
+/* We need this when we want to propoagate creation of consumer that was
+ * created by XREADGROUP with the NOACK option. In that case, the only way
+ * to create the consumer at the replica is by using XCLAIM with FORCE,
+ * or by updating the group last ID, so we propagate the new last ID
+ * using XGROUP SETID. */
+static void streamPropagateGroupID(client *c, robj *key, streamCG *group,
+                                   robj *groupname)
+{
+    robj *argv[5];
+    argv[0] = createStringObject("XGROUP",6);
+    argv[1] = createStringObject("SETID",5);
+    argv[2] = key;
+    argv[3] = groupname;
+    argv[4] = createObjectFromStreamID(&group->last_id);
+
+    propagate(server.xgroupCommand,c->m_cur_selected_db->m_id,argv,5,
+              PROPAGATE_AOF|PROPAGATE_REPL);
+
+    decrRefCount(argv[0]);
+    decrRefCount(argv[1]);
+    decrRefCount(argv[4]);
+}
+
+/* As a result of an explicit XCLAIM or XREADGROUP command, new entries
+ * are created in the pending list of the stream and consumers. We need
+ * to propagate this changes in the form of XCLAIM commands, that work
+ * in an idempotent fashion:
+ *
+ * XCLAIM <key> <group> <consumer> 0 <id> TIME <milliseconds-unix-time>
+ *        RETRYCOUNT <count> FORCE JUSTID LASTID <id>
+ *
+ * JUSTID avoids the slave fetching the stream item just to discard it,
+ * and LASTID carries the group last delivered ID along. */
+static void streamPropagateXCLAIM(client *c, robj *key, streamCG *group,
+                                  robj *groupname, robj *id,
+                                  streamNACK *nack)
+{
+    robj *argv[14];
+    argv[0] = createStringObject("XCLAIM",6);
+    argv[1] = key;
+    argv[2] = groupname;
+    argv[3] = createStringObject(nack->consumer->name,
+                                 sdslen(nack->consumer->name));
+    argv[4] = createStringObjectFromLongLong(0);
+    argv[5] = id;
+    argv[6] = createStringObject("TIME",4);
+    argv[7] = createStringObjectFromLongLong(nack->delivery_time);
+    argv[8] = createStringObject("RETRYCOUNT",10);
+    argv[9] = createStringObjectFromLongLong(nack->delivery_count);
+    argv[10] = createStringObject("FORCE",5);
+    argv[11] = createStringObject("JUSTID",6);
+    argv[12] = createStringObject("LASTID",6);
+    argv[13] = createObjectFromStreamID(&group->last_id);
+
+    /* We use propagate() because this code path is not always called from
+     * the command execution context. Moreover this will just alter the
+     * consumer group state, and we don't need MULTI/EXEC wrapping because
+     * there is no message state cross-message atomicity required. */
+    propagate(server.xclaimCommand,c->m_cur_selected_db->m_id,argv,14,
+              PROPAGATE_AOF|PROPAGATE_REPL);
+
+    decrRefCount(argv[0]);
+    decrRefCount(argv[3]);
+    decrRefCount(argv[4]);
+    decrRefCount(argv[6]);
+    decrRefCount(argv[7]);
+    decrRefCount(argv[8]);
+    decrRefCount(argv[9]);
+    decrRefCount(argv[10]);
+    decrRefCount(argv[11]);
+    decrRefCount(argv[12]);
+    decrRefCount(argv[13]);
+}
+
+/* Send the specified range to the client 'c'. The range the client will
+ * receive is between start and end inclusive, if 'count' is non zero, no more
+ * than 'count' elemnets are sent. The 'end' pointer can be NULL to mean that
+ * we want all the elements from 'start' till the end of the stream. If 'rev'
+ * is non zero, elements are produced in reversed order from end to start.
+ *
+ * If group and consumer are not NULL, the function performs additional work:
+ * 1. It updates the last delivered ID in the group in case we are
+ *    sending IDs greater than the current last ID.
+ * 2. If the requested IDs are already assigned to some other consumer, they
+ *    are reassigned to this consumer.
+ * 3. An entry in the pending list will be created for every entry delivered
+ *    for the first time to this consumer, unless STREAM_RWR_NOACK is given.
+ *    The creation is propagated as XCLAIM when 'spi' is not NULL.
+ * 4. With STREAM_RWR_HISTORY only the consumer own PEL is served.
+ *
+ * STREAM_RWR_RAWENTRIES emits just the entries, without the array header. */
+size_t streamReplyWithRange(client *c, stream *s, streamID *start,
+                            streamID *end, size_t count, int rev,
+                            streamCG *group, streamConsumer *consumer,
+                            int flags, streamPropInfo *spi)
+{
+    void *arraylen_ptr = NULL;
+    size_t arraylen = 0;
+    streamIterator si;
+    int64_t numfields;
+    streamID id;
+    int propagate_last_id = 0;
+
+    /* If the client is asking for some history, we serve it using a
+     * different function, so that we return entries *solely* from its
+     * own PEL. This ensures each consumer will always and only see the
+     * history of messages delivered to it and not yet confirmed as
+     * delivered. */
+    if (group && (flags & STREAM_RWR_HISTORY)) {
+        return streamReplyWithRangeFromConsumerPEL(c,s,start,end,count,
+                                                   consumer);
+    }
+
+    if (!(flags & STREAM_RWR_RAWENTRIES))
+        arraylen_ptr = c->addDeferredMultiBulkLength();
+    streamIteratorStart(&si,s,start,end,rev);
+    while(streamIteratorGetID(&si,&id,&numfields)) {
+        /* Update the group last_id if needed. */
+        if (group && streamCompareID(&id,&group->last_id) > 0) {
+            group->last_id = id;
+            if (flags & STREAM_RWR_NOACK) propagate_last_id = 1;
+        }
+
+        /* Emit a two elements array for each item. The first is
+         * the ID, the second is an array of field-value pairs. */
+        c->addReplyMultiBulkLen(2);
+        addReplyStreamID(c,&id);
+        c->addReplyMultiBulkLen(numfields*2);
+
+        /* Emit the field-value pairs. */
+        while(numfields--) {
+            unsigned char *key, *value;
+            int64_t key_len, value_len;
+            streamIteratorGetField(&si,&key,&value,&key_len,&value_len);
+            c->addReplyBulkCBuffer(key,key_len);
+            c->addReplyBulkCBuffer(value,value_len);
+        }
+
+        /* If a group is passed, we need to create an entry in the
+         * PEL (pending entries list) of this group *and* this consumer.
+         *
+         * Note that we cannot be sure about the fact the message is not
+         * already owned by another consumer, because the admin is able
+         * to change the consumer group last delivered ID using the
+         * XGROUP SETID command. So if we find that there is already
+         * a NACK for the entry, we need to associate it to the new
+         * consumer. */
+        if (group && !(flags & STREAM_RWR_NOACK)) {
+            unsigned char buf[sizeof(streamID)];
+            streamEncodeID(buf,&id);
+
+            streamNACK *nack = (streamNACK *)
+                raxFind(group->pel,buf,sizeof(buf));
+            if (nack == raxNotFound) {
+                nack = streamCreateNACK(consumer);
+                raxInsert(group->pel,buf,sizeof(buf),nack,NULL);
+            } else {
+                raxRemove(nack->consumer->pel,buf,sizeof(buf),NULL);
+                /* Update the consumer and NACK metadata. */
+                nack->consumer = consumer;
+                nack->delivery_time = mstime();
+                nack->delivery_count = 1;
+            }
+            /* Add the entry in the consumer local PEL. */
+            raxInsert(consumer->pel,buf,sizeof(buf),nack,NULL);
+
+            /* Propagate as XCLAIM. */
+            if (spi) {
+                robj *idarg = createObjectFromStreamID(&id);
+                streamPropagateXCLAIM(c,spi->keyname,group,spi->groupname,
+                                      idarg,nack);
+                decrRefCount(idarg);
+            }
+        }
+
+        arraylen++;
+        if (count && count == arraylen) break;
+    }
+    streamIteratorStop(&si);
+    if (spi && propagate_last_id)
+        streamPropagateGroupID(c,spi->keyname,group,spi->groupname);
+    if (arraylen_ptr) c->setDeferredMultiBulkLength(arraylen_ptr,arraylen);
+    return arraylen;
+}
+
+/* This is an helper function for streamReplyWithRange() when called with
+ * a group and the STREAM_RWR_HISTORY flag: it emits the entries of the
+ * consumer PEL in the specified range, instead of the stream entries.
+ * Entries that were deleted from the stream meanwhile are still reported
+ * with their ID, followed by a NULL in place of the fields. The delivery
+ * time and count of every NACK served is updated. */
+static size_t streamReplyWithRangeFromConsumerPEL(client *c, stream *s,
+    streamID *start, streamID *end, size_t count, streamConsumer *consumer)
+{
+    raxIterator ri;
+    unsigned char startkey[sizeof(streamID)];
+    unsigned char endkey[sizeof(streamID)];
+    streamEncodeID(startkey,start);
+    if (end) streamEncodeID(endkey,end);
+
+    size_t arraylen = 0;
+    void *arraylen_ptr = c->addDeferredMultiBulkLength();
+    raxStart(&ri,consumer->pel);
+    raxSeek(&ri,">=",startkey,sizeof(startkey));
+    while(raxNext(&ri) && (!count || arraylen < count)) {
+        if (end && memcmp(ri.key,endkey,ri.key_len) > 0) break;
+        streamID thisid;
+        streamDecodeID(ri.key,&thisid);
+        if (streamReplyWithRange(c,s,&thisid,&thisid,1,0,NULL,NULL,
+                                 STREAM_RWR_RAWENTRIES,NULL) == 0)
+        {
+            c->addReplyMultiBulkLen(2);
+            addReplyStreamID(c,&thisid);
+            c->addReply(shared.nullmultibulk);
+        } else {
+            streamNACK *nack = (streamNACK *)ri.data;
+            nack->delivery_time = mstime();
+            nack->delivery_count++;
+        }
+        arraylen++;
+    }
+    raxStop(&ri);
+    c->setDeferredMultiBulkLength(arraylen_ptr,arraylen);
+    return arraylen;
+}
+
+/* -----------------------------------------------------------------------
+ * Stream commands implementation
+ * ----------------------------------------------------------------------- */
+
+/* Look the stream at 'key' and return the corresponding stream object.
+ * The function creates a key setting it to an empty stream if needed. */
+static robj *streamTypeLookupWriteOrCreate(client *c, robj *key) {
+    robj *o = lookupKeyWrite(c->m_cur_selected_db,key);
+    if (o == NULL) {
+        o = createStreamObject();
+        dbAdd(c->m_cur_selected_db,key,o);
+    } else {
+        if (o->type != OBJ_STREAM) {
+            c->addReply(shared.wrongtypeerr);
+            return NULL;
+        }
+    }
+    return o;
+}
+
+/* Parse a stream ID in the format given by clients to Redis, that is
+ * <ms>-<seq>, and converts it into a streamID structure. If
+ * the specified ID is invalid C_ERR is returned and an error is reported
+ * to the client, otherwise C_OK is returned. The ID may be in incomplete
+ * form, just stating the milliseconds time part of the stream. In such a case
+ * the missing part is set according to the value of 'missing_seq' parameter.
+ * The IDs "-" and "+" specify respectively the minimum and maximum IDs
+ * that can be represented.
+ *
+ * If 'c' is set to NULL, no reply is sent to the client. */
+int streamParseIDOrReply(client *c, robj *o, streamID *id, uint64_t missing_seq) {
+    char buf[128];
+    sds s = (sds)o->ptr;
+    if (sdsEncodedObject(o) == 0 || sdslen(s) > sizeof(buf)-1) goto invalid;
+    memcpy(buf,s,sdslen(s)+1);
+
+    /* Handle the "-" and "+" special cases. */
+    if (buf[0] == '-' && buf[1] == '\0') {
+        id->ms = 0;
+        id->seq = 0;
+        return C_OK;
+    } else if (buf[0] == '+' && buf[1] == '\0') {
+        id->ms = UINT64_MAX;
+        id->seq = UINT64_MAX;
+        return C_OK;
+    }
+
+    /* Parse <ms>-<seq> form. The older <ms>.<seq> form is accepted too. */
+    {
+        char *dot = strchr(buf,'-'), *eptr;
+        if (dot == NULL) dot = strchr(buf,'.');
+        if (dot) *dot = '\0';
+        if (!isdigit((unsigned char)buf[0])) goto invalid;
+        errno = 0;
+        id->ms = strtoull(buf,&eptr,10);
+        if (errno || *eptr != '\0') goto invalid;
+        if (dot) {
+            if (!isdigit((unsigned char)dot[1])) goto invalid;
+            id->seq = strtoull(dot+1,&eptr,10);
+            if (errno || *eptr != '\0') goto invalid;
+        } else {
+            id->seq = missing_seq;
+        }
+    }
+    return C_OK;
+
+invalid:
+    if (c) c->addReplyError("Invalid stream ID specified as stream "
+                            "command argument");
+    return C_ERR;
+}
+
+/* XADD key [MAXLEN [~] <count>] <ID or *> [field value] [field value] ... */
+void xaddCommand(client *c) {
+    streamID id;
+    int id_given = 0; /* Was an ID different than "*" specified? */
+    long long maxlen = -1;  /* If left to -1 no trimming is performed. */
+    int approx_maxlen = 0;  /* If 1 only delete whole radix tree nodes, so
+                               the maxium length is not applied verbatim. */
+
+    /* Parse options. */
+    int i = 2; /* This is the first argument position where we could
+                  find an option, or the ID. */
+    for (; i < c->m_argc; i++) {
+        int moreargs = (c->m_argc-1) - i; /* Number of additional arguments. */
+        char *opt = (char *)c->m_argv[i]->ptr;
+        if (opt[0] == '*' && opt[1] == '\0') {
+            /* This is just a fast path for the common case of auto-ID
+             * creation. */
+            break;
+        } else if (!strcasecmp(opt,"maxlen") && moreargs) {
+            char *next = (char *)c->m_argv[i+1]->ptr;
+            /* Check for the form MAXLEN ~ <count>. */
+            if (moreargs >= 2 && next[0] == '~' && next[1] == '\0') {
+                approx_maxlen = 1;
+                i++;
+            }
+            if (getLongLongFromObjectOrReply(c,c->m_argv[i+1],&maxlen,NULL)
+                != C_OK) return;
+
+            if (maxlen < 0) {
+                c->addReplyError("The MAXLEN argument must be >= 0.");
+                return;
+            }
+            i++;
+        } else {
+            /* If we are here is a syntax error or a valid ID. */
+            if (streamParseIDOrReply(c,c->m_argv[i],&id,0) != C_OK) return;
+            id_given = 1;
+            break;
+        }
+    }
+    int field_pos = i+1;
+
+    /* Check arity. */
+    if ((c->m_argc - field_pos) < 2 || ((c->m_argc-field_pos) % 2) == 1) {
+        c->addReplyError("wrong number of arguments for XADD");
+        return;
+    }
+
+    /* Return ASAP if the minimal ID (0-0) was given, so that we don't
+     * create an empty stream just to fail appending to it. */
+    if (id_given && id.ms == 0 && id.seq == 0) {
+        c->addReplyError("The ID specified in XADD must be greater than 0-0");
+        return;
+    }
+
+    /* Lookup the stream at key. */
+    robj *o;
+    stream *s;
+    if ((o = streamTypeLookupWriteOrCreate(c,c->m_argv[1])) == NULL) return;
+    s = (stream *)o->ptr;
+
+    /* Return ASAP if the stream has reached the last possible ID. */
+    if (s->last_id.ms == UINT64_MAX && s->last_id.seq == UINT64_MAX) {
+        c->addReplyError("The stream has exhausted the last possible ID, "
+                         "unable to add more items");
+        return;
+    }
+
+    /* Append using the low level function and return the ID. */
+    if (streamAppendItem(s,c->m_argv+field_pos,(c->m_argc-field_pos)/2,
+        &id, id_given ? &id : NULL) == C_ERR)
+    {
+        c->addReplyError("The ID specified in XADD is equal or smaller than "
+                         "the target stream top item");
+        return;
+    }
+    addReplyStreamID(c,&id);
+
+    signalModifiedKey(c->m_cur_selected_db,c->m_argv[1]);
+    notifyKeyspaceEvent(NOTIFY_STREAM,"xadd",c->m_argv[1],
+                        c->m_cur_selected_db->m_id);
+    server.dirty++;
+
+    /* Remove older elements if MAXLEN was specified. */
+    if (maxlen >= 0 && streamTrimByLength(s,maxlen,approx_maxlen))
+        notifyKeyspaceEvent(NOTIFY_STREAM,"xtrim",c->m_argv[1],
+                            c->m_cur_selected_db->m_id);
+
+    /* Let's rewrite the ID argument with the one actually generated for
+     * AOF/replication propagation. */
+    robj *idarg = createObject(OBJ_STRING,streamIDToSds(&id));
+    c->rewriteClientCommandArgument(i,idarg);
+    decrRefCount(idarg);
+
+    /* We need to signal to blocked clients that there is new data on this
+     * stream. */
+    signalKeyAsReady(c->m_cur_selected_db,c->m_argv[1]);
+}
+
+/* XRANGE/XREVRANGE actual implementation. */
+static void xrangeGenericCommand(client *c, int rev) {
+    robj *o;
+    stream *s;
+    streamID startid, endid;
+    long long count = -1;
+    robj *startarg = rev ? c->m_argv[3] : c->m_argv[2];
+    robj *endarg = rev ? c->m_argv[2] : c->m_argv[3];
+
+    if (streamParseIDOrReply(c,startarg,&startid,0) == C_ERR) return;
+    if (streamParseIDOrReply(c,endarg,&endid,UINT64_MAX) == C_ERR) return;
+
+    /* Parse the COUNT option if any. */
+    for (int j = 4; j < c->m_argc; j++) {
+        int additional = c->m_argc-j-1;
+        if (strcasecmp((char *)c->m_argv[j]->ptr,"COUNT") == 0 &&
+            additional >= 1)
+        {
+            if (getLongLongFromObjectOrReply(c,c->m_argv[j+1],&count,NULL)
+                != C_OK) return;
+            if (count < 0) count = 0;
+            j++; /* Consume additional arg. */
+        } else {
+            c->addReply(shared.syntaxerr);
+            return;
+        }
+    }
+
+    /* Return the specified range to the user. */
+    if ((o = lookupKeyReadOrReply(c,c->m_argv[1],shared.emptymultibulk)) == NULL
+        || checkType(c,o,OBJ_STREAM)) return;
+    s = (stream *)o->ptr;
+
+    if (count == 0) {
+        c->addReply(shared.emptymultibulk);
+    } else {
+        if (count == -1) count = 0;
+        streamReplyWithRange(c,s,&startid,&endid,count,rev,NULL,NULL,0,NULL);
+    }
+}
+
+/* XRANGE key start end [COUNT <n>] */
+void xrangeCommand(client *c) {
+    xrangeGenericCommand(c,0);
+}
+
+/* XREVRANGE key end start [COUNT <n>] */
+void xrevrangeCommand(client *c) {
+    xrangeGenericCommand(c,1);
+}
+
+/* XLEN */
+void xlenCommand(client *c) {
+    robj *o;
+    if ((o = lookupKeyReadOrReply(c,c->m_argv[1],shared.czero)) == NULL
+        || checkType(c,o,OBJ_STREAM)) return;
+    stream *s = (stream *)o->ptr;
+    c->addReplyLongLong(s->length);
+}
+
+/* Reply to a client with the stream 'key' entries having an ID greater
+ * than 'gt', as the [key, entries] pair of the XREAD reply. For XREADGROUP
+ * 'groupname', 'group' and 'consumer' are set, and 'flags' are the
+ * streamReplyWithRange() ones. */
+static void xreadReplyWithStream(client *c, robj *key, stream *s,
+                                 streamID *gt, size_t count, robj *groupname,
+                                 streamCG *group, streamConsumer *consumer,
+                                 int flags)
+{
+    /* streamReplyWithRange() handles the 'start' ID as inclusive,
+     * so start from the next ID, since we want only messages with
+     * IDs greater than start. */
+    streamID start = *gt;
+    streamIncrID(&start);
+
+    /* Emit the two elements sub-array consisting of the name
+     * of the stream and the data we extracted from it. */
+    c->addReplyMultiBulkLen(2);
+    c->addReplyBulk(key);
+    streamPropInfo spi = {key,groupname};
+    streamReplyWithRange(c,s,&start,NULL,count,0,group,consumer,flags,
+                         group ? &spi : NULL);
+}
+
+/* XREAD [BLOCK <milliseconds>] [COUNT <count>] [STREAMS] key_1 key_2 ... key_N
+ *       ID_1 ID_2 ... ID_N
+ *
+ * This function also implements the XREADGROUP command, which is like XREAD
+ * but accepting the [GROUP group-name consumer-name] additional option.
+ * This is useful because while XREAD is a read command and can be called
+ * on slaves, XREADGROUP is not. */
+void xreadCommand(client *c) {
+    long long timeout = -1; /* -1 means, no BLOCK argument given. */
+    long long count = 0;
+    int streams_count = 0;
+    int streams_arg = 0;
+    int noack = 0;          /* True if NOACK option was specified. */
+    #define STREAMID_STATIC_VECTOR_LEN 8
+    streamID static_ids[STREAMID_STATIC_VECTOR_LEN];
+    streamID *ids = static_ids;
+    streamCG **groups = NULL;
+    int xreadgroup = sdslen((sds)c->m_argv[0]->ptr) == 10; /* XREADGROUP */
+    robj *groupname = NULL;
+    robj *consumername = NULL;
+    size_t arraylen = 0;
+    void *arraylen_ptr = NULL;
+
+    /* Parse arguments. */
+    for (int i = 1; i < c->m_argc; i++) {
+        int moreargs = c->m_argc-i-1;
+        char *o = (char *)c->m_argv[i]->ptr;
+        if (!strcasecmp(o,"BLOCK") && moreargs) {
+            i++;
+            if (getTimeoutFromObjectOrReply(c,c->m_argv[i],&timeout,
+                UNIT_MILLISECONDS) != C_OK) return;
+        } else if (!strcasecmp(o,"COUNT") && moreargs) {
+            i++;
+            if (getLongLongFromObjectOrReply(c,c->m_argv[i],&count,NULL)
+                != C_OK) return;
+            if (count < 0) count = 0;
+        } else if (!strcasecmp(o,"STREAMS") && moreargs) {
+            streams_arg = i+1;
+            streams_count = (c->m_argc-streams_arg);
+            if ((streams_count % 2) != 0) {
+                c->addReplyError("Unbalanced XREAD list of streams: "
+                                 "for each stream key an ID or '$' must be "
+                                 "specified.");
+                return;
+            }
+            streams_count /= 2; /* We have two arguments for each stream. */
+            break;
+        } else if (!strcasecmp(o,"GROUP") && moreargs >= 2) {
+            if (!xreadgroup) {
+                c->addReplyError("The GROUP option is only supported by "
+                                 "XREADGROUP. You called XREAD instead.");
+                return;
+            }
+            groupname = c->m_argv[i+1];
+            consumername = c->m_argv[i+2];
+            i += 2;
+        } else if (!strcasecmp(o,"NOACK")) {
+            if (!xreadgroup) {
+                c->addReplyError("The NOACK option is only supported by "
+                                 "XREADGROUP. You called XREAD instead.");
+                return;
+            }
+            noack = 1;
+        } else {
+            c->addReply(shared.syntaxerr);
+            return;
+        }
+    }
+
+    /* STREAMS option is mandatory. */
+    if (streams_arg == 0) {
+        c->addReply(shared.syntaxerr);
+        return;
+    }
+
+    /* If the user specified XREADGROUP then it must also
+     * provide the GROUP option. */
+    if (xreadgroup && groupname == NULL) {
+        c->addReplyError("Missing GROUP option for XREADGROUP");
+        return;
+    }
+
+    /* Check the type of every key, and lookup the consumer groups, before
+     * emitting any reply. */
+    if (groupname) groups = (streamCG **)zmalloc(sizeof(streamCG*)*streams_count);
+    for (int i = 0; i < streams_count; i++) {
+        robj *key = c->m_argv[streams_arg+i];
+        robj *o = lookupKeyRead(c->m_cur_selected_db,key);
+        if (o && checkType(c,o,OBJ_STREAM)) goto cleanup;
+        if (groupname) {
+            streamCG *group = NULL;
+            if (o) group = streamLookupCG((stream *)o->ptr,
+                                          (sds)groupname->ptr);
+            if (group == NULL) {
+                c->addReplyErrorFormat("-NOGROUP No such key '%s' or consumer "
+                                       "group '%s' in XREADGROUP with GROUP "
+                                       "option",
+                                       (char *)key->ptr,
+                                       (char *)groupname->ptr);
+                goto cleanup;
+            }
+            groups[i] = group;
+        }
+    }
+
+    /* Parse the IDs. */
+    if (streams_count > STREAMID_STATIC_VECTOR_LEN)
+        ids = (streamID *)zmalloc(sizeof(streamID)*streams_count);
+
+    for (int i = streams_arg + streams_count; i < c->m_argc; i++) {
+        /* Specifying "$" as last-known-id means that the client wants to be
+         * served with just the messages that will arrive into the stream
+         * starting from now. */
+        int id_idx = i - streams_arg - streams_count;
+        char *idstr = (char *)c->m_argv[i]->ptr;
+        if (strcmp(idstr,"$") == 0) {
+            if (xreadgroup) {
+                c->addReplyError("The $ ID is meaningless in the context of "
+                                 "XREADGROUP: you want to read the history of "
+                                 "this consumer by specifying a proper ID, or "
+                                 "use the > ID to get new messages. The $ ID would "
+                                 "just return an empty result set.");
+                goto cleanup;
+            }
+            robj *o = lookupKeyRead(c->m_cur_selected_db,
+                                    c->m_argv[i-streams_count]);
+            if (o) {
+                stream *s = (stream *)o->ptr;
+                ids[id_idx] = s->last_id;
+            } else {
+                ids[id_idx].ms = 0;
+                ids[id_idx].seq = 0;
+            }
+            continue;
+        } else if (strcmp(idstr,">") == 0) {
+            if (!xreadgroup) {
+                c->addReplyError("The > ID can be specified only when calling "
+                                 "XREADGROUP using the GROUP <group> "
+                                 "<consumer> option.");
+                goto cleanup;
+            }
+            /* We use just the maximum ID to signal this is a ">" ID, anyway
+             * the code handling the blocking clients will have to update the
+             * ID later in order to match the changing consumer group last ID. */
+            ids[id_idx].ms = UINT64_MAX;
+            ids[id_idx].seq = UINT64_MAX;
+            continue;
+        }
+        if (streamParseIDOrReply(c,c->m_argv[i],ids+id_idx,0) != C_OK)
+            goto cleanup;
+    }
+
+    /* Try to serve the client synchronously. */
+    for (int i = 0; i < streams_count; i++) {
+        robj *o = lookupKeyRead(c->m_cur_selected_db,c->m_argv[streams_arg+i]);
+        if (o == NULL) continue;
+        stream *s = (stream *)o->ptr;
+        streamID *gt = ids+i; /* ID must be greater than this. */
+        int serve_synchronously = 0;
+        int flags = noack ? STREAM_RWR_NOACK : 0;
+
+        if (groups) {
+            /* If the consumer is reading from a group, we always serve it
+             * synchronously (serving its local history) if the ID specified
+             * was not the special ">" ID. */
+            if (gt->ms != UINT64_MAX || gt->seq != UINT64_MAX) {
+                serve_synchronously = 1;
+                flags |= STREAM_RWR_HISTORY;
+            } else if (streamCompareID(&s->last_id,&groups[i]->last_id) > 0) {
+                /* We also want to serve a consumer in a consumer group
+                 * synchronously in case the group top item delivered is
+                 * smaller than what the stream has inside. */
+                serve_synchronously = 1;
+                *gt = groups[i]->last_id;
+            }
+        } else if (streamCompareID(&s->last_id,gt) > 0) {
+            serve_synchronously = 1;
+        }
+
+        if (serve_synchronously) {
+            streamConsumer *consumer = NULL;
+            if (groups) consumer = streamLookupConsumer(groups[i],
+                                       (sds)consumername->ptr,1);
+            arraylen++;
+            if (arraylen == 1) arraylen_ptr = c->addDeferredMultiBulkLength();
+            xreadReplyWithStream(c,c->m_argv[streams_arg+i],s,gt,count,
+                                 groupname,groups ? groups[i] : NULL,
+                                 consumer,flags);
+        }
+    }
+
+    /* We replied synchronously? Set the top array len and return to caller. */
+    if (arraylen) {
+        c->setDeferredMultiBulkLength(arraylen_ptr,arraylen);
+        goto cleanup;
+    }
+
+    /* Block if needed. */
+    if (timeout != -1) {
+        /* If we are inside a MULTI/EXEC and the stream is empty the only thing
+         * we can do is treating it as a timeout (even with timeout 0). */
+        if (c->m_flags & CLIENT_MULTI) {
+            c->addReply(shared.nullmultibulk);
+            goto cleanup;
+        }
+        blockForKeys(c,BLOCKED_STREAM,c->m_argv+streams_arg,streams_count,
+                     timeout,NULL,ids);
+        /* If no COUNT is given and we block, set a relatively small count:
+         * in case the ID provided is too low, we do not want the server to
+         * block just to serve this client a huge stream of messages. */
+        c->m_blocking_state.m_xread_count =
+            count ? count : XREAD_BLOCKED_DEFAULT_COUNT;
+
+        /* If this is a XREADGROUP + GROUP we need to remember for which
+         * group and consumer name we are blocking, so later when one of the
+         * keys receive more data, we can call streamReplyWithRange() passing
+         * the right arguments. */
+        if (groupname) {
+            incrRefCount(groupname);
+            incrRefCount(consumername);
+            c->m_blocking_state.m_xread_group = groupname;
+            c->m_blocking_state.m_xread_consumer = consumername;
+            c->m_blocking_state.m_xread_group_noack = noack;
+        }
+        goto cleanup;
+    }
+
+    /* No BLOCK option, nor any stream we can serve. Reply as with a
+     * timeout happened. */
+    c->addReply(shared.nullmultibulk);
+    /* Continue to cleanup... */
+
+cleanup:
+    if (ids != static_ids) zfree(ids);
+    zfree(groups);
+}
+
+/* Serve the clients blocked by XREAD or XREADGROUP on the stream 'o' at
+ * 'key', that received new entries. Called by handleClientsBlockedOnKeys(). */
+void handleClientsBlockedOnStream(redisDb *db, robj *key, robj *o) {
+    dictEntry *de = db->m_blocking_keys->dictFind(key);
+    if (de == NULL) return;
+
+    stream *s = (stream *)o->ptr;
+    list *clients = (list *)de->dictGetVal();
+    listNode *ln;
+    listIter li(clients);
+
+    while((ln = li.listNext())) {
+        client *receiver = (client *)ln->listNodeValue();
+        if (receiver->m_blocking_op_type != BLOCKED_STREAM) continue;
+        blockingState *bs = &receiver->m_blocking_state;
+        streamID *gt = (streamID *)bs->m_keys->dictFetchValue(key);
+
+        /* If we blocked in the context of a consumer group, we need to
+         * resolve the group and update the last ID the client is blocked
+         * for: serving other clients in the same consumer group alters
+         * the "last ID" of the group, and clients blocked in a consumer
+         * group are always blocked for the ">" ID, so we must deliver
+         * only new messages and avoid unblocking the client otherwise. */
+        streamCG *group = NULL;
+        if (bs->m_xread_group) {
+            group = streamLookupCG(s,(sds)bs->m_xread_group->ptr);
+            /* If the group was not found, send an error to the consumer. */
+            if (group == NULL) {
+                receiver->addReplyError("-NOGROUP the consumer group this "
+                                        "client was blocked on no longer "
+                                        "exists");
+                receiver->unblockClient();
+                continue;
+            }
+            *gt = group->last_id;
+        }
+        if (streamCompareID(&s->last_id,gt) <= 0) continue;
+
+        /* Lookup the consumer for the group, if any. */
+        streamConsumer *consumer = NULL;
+        int flags = 0;
+        if (group) {
+            consumer = streamLookupConsumer(group,
+                           (sds)bs->m_xread_consumer->ptr,1);
+            if (bs->m_xread_group_noack) flags |= STREAM_RWR_NOACK;
+        }
+
+        /* Reply before unblockClient() releases the blocking state we
+         * are using. Unblocking may also free 'clients', but only after its
+         * last node was removed, so the iterator already reached the end. */
+        receiver->addReplyMultiBulkLen(1);
+        xreadReplyWithStream(receiver,key,s,gt,bs->m_xread_count,
+                             bs->m_xread_group,group,consumer,flags);
+        receiver->unblockClient();
+    }
+}
+
+/* -----------------------------------------------------------------------
+ * Consumer groups commands implementation
+ * ----------------------------------------------------------------------- */
+
+/* XGROUP CREATE <key> <groupname> <id or $> [MKSTREAM]
+ * XGROUP SETID <key> <groupname> <id or $>
+ * XGROUP DESTROY <key> <groupname>
+ * XGROUP DELCONSUMER <key> <groupname> <consumername> */
+void xgroupCommand(client *c) {
+    stream *s = NULL;
+    sds grpname = NULL;
+    streamCG *cg = NULL;
+    char *opt = (char *)c->m_argv[1]->ptr; /* Subcommand name. */
+    int mkstream = 0;
+    robj *o = NULL;
+
+    if (!strcasecmp(opt,"help") && c->m_argc == 2) {
+        void *blenp = c->addDeferredMultiBulkLength();
+        int blen = 0;
+        blen++; c->addReplyStatus(
+        "XGROUP <subcommand> key groupname [arguments]. Subcommands:");
+        blen++; c->addReplyStatus(
+        "CREATE <key> <groupname> <id or $> [MKSTREAM] -- Create a new consumer group, creating the empty stream if MKSTREAM is given.");
+        blen++; c->addReplyStatus(
+        "SETID <key> <groupname> <id or $> -- Set the current group ID.");
+        blen++; c->addReplyStatus(
+        "DESTROY <key> <groupname> -- Remove the specified group.");
+        blen++; c->addReplyStatus(
+        "DELCONSUMER <key> <groupname> <consumer> -- Remove the specified consumer.");
+        c->setDeferredMultiBulkLength(blenp,blen);
+        return;
+    }
+
+    /* CREATE has an MKSTREAM option that creates the stream if it
+     * does not exist. */
+    if (c->m_argc == 6 && !strcasecmp(opt,"CREATE")) {
+        if (strcasecmp((char *)c->m_argv[5]->ptr,"MKSTREAM")) {
+            c->addReply(shared.syntaxerr);
+            return;
+        }
+        mkstream = 1;
+    }
+
+    /* Everything but the "HELP" option requires a key and group name. */
+    if (c->m_argc >= 4) {
+        o = lookupKeyWrite(c->m_cur_selected_db,c->m_argv[2]);
+        if (o) {
+            if (checkType(c,o,OBJ_STREAM)) return;
+            s = (stream *)o->ptr;
+        }
+        grpname = (sds)c->m_argv[3]->ptr;
+    }
+
+    /* Check for missing key/group. */
+    if (c->m_argc >= 4 && !mkstream) {
+        /* At this point key must exist, or there is an error. */
+        if (s == NULL) {
+            c->addReplyError("The XGROUP subcommand requires the key to exist. "
+                             "Note that for CREATE you may want to use the "
+                             "MKSTREAM option to create an empty stream "
+                             "automatically.");
+            return;
+        }
+
+        /* Certain subcommands require the group to exist. */
+        if ((cg = streamLookupCG(s,grpname)) == NULL &&
+            (!strcasecmp(opt,"SETID") ||
+             !strcasecmp(opt,"DELCONSUMER")))
+        {
+            c->addReplyErrorFormat("-NOGROUP No such consumer group '%s' "
+                                   "for key name '%s'",
+                                   (char *)grpname,
+                                   (char *)c->m_argv[2]->ptr);
+            return;
+        }
+    }
+
+    /* Dispatch the different subcommands. */
+    if (!strcasecmp(opt,"CREATE") && (c->m_argc == 5 || c->m_argc == 6)) {
+        streamID id;
+        if (!strcmp((char *)c->m_argv[4]->ptr,"$")) {
+            if (s) {
+                id = s->last_id;
+            } else {
+                id.ms = 0;
+                id.seq = 0;
+            }
+        } else if (streamParseIDOrReply(c,c->m_argv[4],&id,0) != C_OK) {
+            return;
+        }
+
+        /* Handle the MKSTREAM option now that the command can no longer
+         * fail. */
+        if (s == NULL) {
+            o = createStreamObject();
+            dbAdd(c->m_cur_selected_db,c->m_argv[2],o);
+            s = (stream *)o->ptr;
+        }
+
+        if (streamCreateCG(s,grpname,sdslen(grpname),&id)) {
+            c->addReply(shared.ok);
+            server.dirty++;
+            notifyKeyspaceEvent(NOTIFY_STREAM,"xgroup-create",
+                                c->m_argv[2],c->m_cur_selected_db->m_id);
+        } else {
+            c->addReplySds(sdsnew("-BUSYGROUP Consumer Group name already "
+                                  "exists\r\n"));
+        }
+    } else if (!strcasecmp(opt,"SETID") && c->m_argc == 5) {
+        streamID id;
+        if (!strcmp((char *)c->m_argv[4]->ptr,"$")) {
+            id = s->last_id;
+        } else if (streamParseIDOrReply(c,c->m_argv[4],&id,0) != C_OK) {
+            return;
+        }
+        cg->last_id = id;
+        c->addReply(shared.ok);
+        server.dirty++;
+        notifyKeyspaceEvent(NOTIFY_STREAM,"xgroup-setid",
+                            c->m_argv[2],c->m_cur_selected_db->m_id);
+    } else if (!strcasecmp(opt,"DESTROY") && c->m_argc == 4) {
+        if (cg) {
+            raxRemove(s->cgroups,(unsigned char*)grpname,sdslen(grpname),NULL);
+            streamFreeCG(cg);
+            c->addReply(shared.cone);
+            server.dirty++;
+            notifyKeyspaceEvent(NOTIFY_STREAM,"xgroup-destroy",
+                                c->m_argv[2],c->m_cur_selected_db->m_id);
+            /* Let the clients blocked on the group get their error. */
+            signalKeyAsReady(c->m_cur_selected_db,c->m_argv[2]);
+        } else {
+            c->addReply(shared.czero);
+        }
+    } else if (!strcasecmp(opt,"DELCONSUMER") && c->m_argc == 5) {
+        /* Delete the consumer and returns the number of pending messages
+         * that were yet associated with such a consumer. */
+        long long pending = streamDelConsumer(cg,(sds)c->m_argv[4]->ptr);
+        c->addReplyLongLong(pending);
+        server.dirty++;
+        notifyKeyspaceEvent(NOTIFY_STREAM,"xgroup-delconsumer",
+                            c->m_argv[2],c->m_cur_selected_db->m_id);
+    } else {
+        c->addReplyErrorFormat("Unknown subcommand or wrong number of "
+                               "arguments for '%s'. Try XGROUP HELP", opt);
+    }
+}
+
+/* XACK <key> <group> <id> <id> ... <id>
+ *
+ * Acknowledge a message as processed. In practical terms we just check the
+ * pendine entries list (PEL) of the group, and delete the PEL entry both from
+ * the group and the consumer (pending messages are referenced in both places).
+ *
+ * Return value of the command is the number of messages successfully
+ * acknowledged, that is, the IDs we were actually able to resolve in the PEL.
+ */
+void xackCommand(client *c) {
+    streamCG *group = NULL;
+    robj *o = lookupKeyRead(c->m_cur_selected_db,c->m_argv[1]);
+    if (o) {
+        if (checkType(c,o,OBJ_STREAM)) return; /* Type error. */
+        group = streamLookupCG((stream *)o->ptr,(sds)c->m_argv[2]->ptr);
+    }
+
+    /* No key or group? Nothing to ack. */
+    if (o == NULL || group == NULL) {
+        c->addReply(shared.czero);
+        return;
+    }
+
+    /* Parse all the IDs first, so that the command is all or nothing. */
+    for (int j = 3; j < c->m_argc; j++) {
+        streamID id;
+        if (streamParseIDOrReply(c,c->m_argv[j],&id,0) != C_OK) return;
+    }
+
+    int acknowledged = 0;
+    for (int j = 3; j < c->m_argc; j++) {
+        streamID id;
+        unsigned char buf[sizeof(streamID)];
+        streamParseIDOrReply(NULL,c->m_argv[j],&id,0);
+        streamEncodeID(buf,&id);
+
+        /* Lookup the ID in the group PEL: it will have a reference to the
+         * NACK structure that will have a reference to the consumer, so that
+         * we are able to remove the entry from both PELs. */
+        streamNACK *nack = (streamNACK *)raxFind(group->pel,buf,sizeof(buf));
+        if (nack != raxNotFound) {
+            raxRemove(group->pel,buf,sizeof(buf),NULL);
+            raxRemove(nack->consumer->pel,buf,sizeof(buf),NULL);
+            streamFreeNACK(nack);
+            acknowledged++;
+            server.dirty++;
+        }
+    }
+    c->addReplyLongLong(acknowledged);
+}
+
+/* XPENDING <key> <group> [<start> <stop> <count> [<consumer>]]
+ *
+ * If start and stop are omitted, the command just outputs information about
+ * the amount of pending messages for the key/group pair, together with
+ * the minimum and maxium ID of pending messages.
+ *
+ * If start and stop are provided instead, the pending messages are returned
+ * with informations about the current owner, number of deliveries and last
+ * delivery time and so forth. */
+void xpendingCommand(client *c) {
+    int justinfo = c->m_argc == 3; /* Without the range just outputs general
+                                      informations about the PEL. */
+    robj *key = c->m_argv[1];
+    robj *groupname = c->m_argv[2];
+    robj *consumername = (c->m_argc == 7) ? c->m_argv[6] : NULL;
+    streamID startid, endid;
+    long long count = 0;
+
+    /* Start and stop, and the consumer, can be omitted. */
+    if (c->m_argc != 3 && c->m_argc != 6 && c->m_argc != 7) {
+        c->addReply(shared.syntaxerr);
+        return;
+    }
+
+    /* Parse start/end/count arguments ASAP if needed, in order to report
+     * syntax errors before any other error. */
+    if (c->m_argc >= 6) {
+        if (getLongLongFromObjectOrReply(c,c->m_argv[5],&count,NULL) == C_ERR)
+            return;
+        if (count < 0) count = 0;
+        if (streamParseIDOrReply(c,c->m_argv[3],&startid,0) == C_ERR)
+            return;
+        if (streamParseIDOrReply(c,c->m_argv[4],&endid,UINT64_MAX) == C_ERR)
+            return;
+    }
+
+    /* Lookup the key and the group inside the stream. */
+    robj *o = lookupKeyRead(c->m_cur_selected_db,key);
+    streamCG *group = NULL;
+
+    if (o && checkType(c,o,OBJ_STREAM)) return;
+    if (o) group = streamLookupCG((stream *)o->ptr,(sds)groupname->ptr);
+    if (group == NULL) {
+        c->addReplyErrorFormat("-NOGROUP No such key '%s' or consumer "
+                               "group '%s'",
+                               (char *)key->ptr,(char *)groupname->ptr);
+        return;
+    }
+
+    /* XPENDING <key> <group> variant. */
+    if (justinfo) {
+        c->addReplyMultiBulkLen(4);
+        /* Total number of messages in the PEL. */
+        c->addReplyLongLong(group->pel->numele);
+        /* First and last IDs. */
+        if (group->pel->numele == 0) {
+            c->addReply(shared.nullbulk); /* Start. */
+            c->addReply(shared.nullbulk); /* End. */
+            c->addReply(shared.nullmultibulk); /* Clients. */
+        } else {
+            /* Start. */
+            raxIterator ri;
+            raxStart(&ri,group->pel);
+            raxSeek(&ri,"^",NULL,0);
+            raxNext(&ri);
+            streamDecodeID(ri.key,&startid);
+            addReplyStreamID(c,&startid);
+
+            /* End. */
+            raxSeek(&ri,"$",NULL,0);
+            raxNext(&ri);
+            streamDecodeID(ri.key,&endid);
+            addReplyStreamID(c,&endid);
+            raxStop(&ri);
+
+            /* Consumers with pending messages. */
+            raxStart(&ri,group->consumers);
+            raxSeek(&ri,"^",NULL,0);
+            void *arraylen_ptr = c->addDeferredMultiBulkLength();
+            size_t arraylen = 0;
+            while(raxNext(&ri)) {
+                streamConsumer *consumer = (streamConsumer *)ri.data;
+                if (consumer->pel->numele == 0) continue;
+                c->addReplyMultiBulkLen(2);
+                c->addReplyBulkCBuffer(ri.key,ri.key_len);
+                c->addReplyBulkLongLong(consumer->pel->numele);
+                arraylen++;
+            }
+            c->setDeferredMultiBulkLength(arraylen_ptr,arraylen);
+            raxStop(&ri);
+        }
+    }
+    /* XPENDING <key> <group> <start> <stop> <count> [<consumer>] variant. */
+    else {
+        streamConsumer *consumer = consumername ?
+            streamLookupConsumer(group,(sds)consumername->ptr,0) : NULL;
+
+        /* If a consumer name was mentioned but it does not exist, we can
+         * just return an empty array. */
+        if (consumername && consumer == NULL) {
+            c->addReply(shared.emptymultibulk);
+            return;
+        }
+
+        rax *pel = consumer ? consumer->pel : group->pel;
+        unsigned char startkey[sizeof(streamID)];
+        unsigned char endkey[sizeof(streamID)];
+        raxIterator ri;
+        mstime_t now = mstime();
+
+        streamEncodeID(startkey,&startid);
+        streamEncodeID(endkey,&endid);
+        raxStart(&ri,pel);
+        raxSeek(&ri,">=",startkey,sizeof(startkey));
+        void *arraylen_ptr = c->addDeferredMultiBulkLength();
+        size_t arraylen = 0;
+
+        while(count && raxNext(&ri) && memcmp(ri.key,endkey,ri.key_len) <= 0) {
+            streamNACK *nack = (streamNACK *)ri.data;
+
+            arraylen++;
+            count--;
+            c->addReplyMultiBulkLen(4);
+
+            /* Entry ID. */
+            streamID id;
+            streamDecodeID(ri.key,&id);
+            addReplyStreamID(c,&id);
+
+            /* Consumer name. */
+            c->addReplyBulkCBuffer(nack->consumer->name,
+                                   sdslen(nack->consumer->name));
+
+            /* Milliseconds elapsed since last delivery. */
+            mstime_t elapsed = now - nack->delivery_time;
+            if (elapsed < 0) elapsed = 0;
+            c->addReplyLongLong(elapsed);
+
+            /* Number of deliveries. */
+            c->addReplyLongLong(nack->delivery_count);
+        }
+        raxStop(&ri);
+        c->setDeferredMultiBulkLength(arraylen_ptr,arraylen);
+    }
+}
+
+/* XCLAIM <key> <group> <consumer> <min-idle-time> <ID-1> <ID-2>
+ *        [IDLE <milliseconds>] [TIME <mstime>] [RETRYCOUNT <count>]
+ *        [FORCE] [JUSTID] [LASTID <id>]
+ *
+ * Gets ownership of one or multiple messages in the Pending Entries List
+ * of a given stream consumer group, if they were not delivered to their
+ * current owner for at least 'min-idle-time' milliseconds. The delivery
+ * counter is incremented, unless RETRYCOUNT sets it or JUSTID is given.
+ *
+ * FORCE creates the pending entry for IDs that exist in the stream but
+ * are not pending, JUSTID replies with just the IDs, and LASTID updates
+ * the group last delivered ID if greater: these three options are mainly
+ * used to propagate the consumer groups state to AOF and slaves, since the
+ * XCLAIM form this command propagates is idempotent.
+ *
+ * The command returns the claimed entries, or their IDs with JUSTID. */
+void xclaimCommand(client *c) {
+    streamCG *group = NULL;
+    robj *o = lookupKeyRead(c->m_cur_selected_db,c->m_argv[1]);
+    long long minidle; /* Minimum idle time argument. */
+    long long retrycount = -1;   /* -1 means RETRYCOUNT option not given. */
+    mstime_t deliverytime = -1;  /* -1 means IDLE/TIME options not given. */
+    int force = 0;
+    int justid = 0;
+
+    if (o) {
+        if (checkType(c,o,OBJ_STREAM)) return; /* Type error. */
+        group = streamLookupCG((stream *)o->ptr,(sds)c->m_argv[2]->ptr);
+    }
+
+    /* No key or group? Send an error given that the group creation
+     * is mandatory. */
+    if (o == NULL || group == NULL) {
+        c->addReplyErrorFormat("-NOGROUP No such key '%s' or "
+                               "consumer group '%s'",
+                               (char *)c->m_argv[1]->ptr,
+                               (char *)c->m_argv[2]->ptr);
+        return;
+    }
+
+    if (getLongLongFromObjectOrReply(c,c->m_argv[4],&minidle,
+        "Invalid min-idle-time argument for XCLAIM")
+        != C_OK) return;
+    if (minidle < 0) minidle = 0;
+
+    /* Start parsing the IDs, so that we abort ASAP if there is a syntax
+     * error: the return value of this command cannot be an error in case
+     * the client successfully claimed some message, so it should be
+     * executed in a "all or nothing" fashion. */
+    int j;
+    for (j = 5; j < c->m_argc; j++) {
+        streamID id;
+        if (streamParseIDOrReply(NULL,c->m_argv[j],&id,0) != C_OK) break;
+    }
+    int last_id_arg = j-1; /* Next time we iterate the IDs we now the range. */
+
+    /* If we stopped because some IDs cannot be parsed, perhaps they
+     * are trailing options. */
+    mstime_t now = mstime();
+    streamID last_id = {0,0};
+    for (; j < c->m_argc; j++) {
+        int moreargs = (c->m_argc-1) - j; /* Number of additional arguments. */
+        char *opt = (char *)c->m_argv[j]->ptr;
+        if (!strcasecmp(opt,"FORCE")) {
+            force = 1;
+        } else if (!strcasecmp(opt,"JUSTID")) {
+            justid = 1;
+        } else if (!strcasecmp(opt,"IDLE") && moreargs) {
+            j++;
+            if (getLongLongFromObjectOrReply(c,c->m_argv[j],&deliverytime,
+                "Invalid IDLE option argument for XCLAIM")
+                != C_OK) return;
+            deliverytime = now - deliverytime;
+        } else if (!strcasecmp(opt,"TIME") && moreargs) {
+            j++;
+            if (getLongLongFromObjectOrReply(c,c->m_argv[j],&deliverytime,
+                "Invalid TIME option argument for XCLAIM")
+                != C_OK) return;
+        } else if (!strcasecmp(opt,"RETRYCOUNT") && moreargs) {
+            j++;
+            if (getLongLongFromObjectOrReply(c,c->m_argv[j],&retrycount,
+                "Invalid RETRYCOUNT option argument for XCLAIM")
+                != C_OK) return;
+        } else if (!strcasecmp(opt,"LASTID") && moreargs) {
+            j++;
+            if (streamParseIDOrReply(c,c->m_argv[j],&last_id,0) != C_OK)
+                return;
+        } else {
+            c->addReplyErrorFormat("Unrecognized XCLAIM option '%s'",opt);
+            return;
+        }
+    }
+
+    int propagate_last_id = 0;
+    if (streamCompareID(&last_id,&group->last_id) > 0) {
+        group->last_id = last_id;
+        propagate_last_id = 1;
+    }
+
+    if (deliverytime != -1) {
+        /* If a delivery time was passed, either with IDLE or TIME, we
+         * do some sanity check on it, and set the deliverytime to now
+         * (which is a sane choice usually) if the value is bogus.
+         * To raise an error here is not wise because clients may compute
+         * the idle time doing some math starting from their local time,
+         * and this is not a good excuse to fail in case, for instance,
+         * the computer time is a bit in the future from our POV. */
+        if (deliverytime < 0 || deliverytime > now) deliverytime = now;
+    } else {
+        /* If no IDLE/TIME option was passed, we want the last delivery
+         * time to be now, so that the idle time of the message will be
+         * zero. */
+        deliverytime = now;
+    }
+
+    /* Do the actual claiming. */
+    streamConsumer *consumer = NULL;
+    void *arraylenptr = c->addDeferredMultiBulkLength();
+    size_t arraylen = 0;
+    for (int j = 5; j <= last_id_arg; j++) {
+        streamID id;
+        unsigned char buf[sizeof(streamID)];
+        streamParseIDOrReply(NULL,c->m_argv[j],&id,0);
+        streamEncodeID(buf,&id);
+
+        /* Lookup the ID in the group PEL. */
+        streamNACK *nack = (streamNACK *)raxFind(group->pel,buf,sizeof(buf));
+
+        /* If FORCE is passed, let's check if at least the entry
+         * exists in the Stream. In such case, we'll create a new
+         * entry in the PEL from scratch, so that XCLAIM can also
+         * be used to create entries in the PEL. Useful for AOF
+         * and replication of consumer groups. */
+        if (force && nack == raxNotFound) {
+            streamIterator myiterator;
+            streamIteratorStart(&myiterator,(stream *)o->ptr,&id,&id,0);
+            int64_t numfields;
+            int found = 0;
+            streamID item_id;
+            if (streamIteratorGetID(&myiterator,&item_id,&numfields)) found = 1;
+            streamIteratorStop(&myiterator);
+
+            /* Item must exist for us to create a NACK for it. */
+            if (!found) continue;
+
+            /* Create the NACK. */
+            nack = streamCreateNACK(NULL);
+            raxInsert(group->pel,buf,sizeof(buf),nack,NULL);
+        }
+
+        if (nack != raxNotFound) {
+            /* We need to check if the minimum idle time requested
+             * by the caller is satisfied by this entry. The NACK
+             * could be created by FORCE, in this case there was no
+             * pre-existing entry and minidle should be ignored, but
+             * in that case nack->consumer is NULL. */
+            if (nack->consumer && minidle) {
+                mstime_t this_idle = now - nack->delivery_time;
+                if (this_idle < minidle) continue;
+            }
+            if (consumer == NULL)
+                consumer = streamLookupConsumer(group,(sds)c->m_argv[3]->ptr,1);
+            /* Remove the entry from the old consumer.
+             * Note that nack->consumer is NULL if we created the
+             * NACK above because of the FORCE option. */
+            if (nack->consumer)
+                raxRemove(nack->consumer->pel,buf,sizeof(buf),NULL);
+            /* Update the consumer and idle time. */
+            nack->consumer = consumer;
+            nack->delivery_time = deliverytime;
+            /* Set the delivery attempts counter if given, otherwise
+             * autoincrement unless JUSTID option provided. */
+            if (retrycount >= 0) {
+                nack->delivery_count = retrycount;
+            } else if (!justid) {
+                nack->delivery_count++;
+            }
+            /* Add the entry in the new consumer local PEL. */
+            raxInsert(consumer->pel,buf,sizeof(buf),nack,NULL);
+            /* Send the reply for this entry. */
+            if (justid) {
+                addReplyStreamID(c,&id);
+            } else {
+                size_t emitted = streamReplyWithRange(c,(stream *)o->ptr,
+                                    &id,&id,1,0,NULL,NULL,
+                                    STREAM_RWR_RAWENTRIES,NULL);
+                if (!emitted) c->addReply(shared.nullbulk);
+            }
+            arraylen++;
+
+            /* Propagate this change. */
+            streamPropagateXCLAIM(c,c->m_argv[1],group,c->m_argv[2],
+                                  c->m_argv[j],nack);
+            propagate_last_id = 0; /* Will be propagated by XCLAIM itself. */
+            server.dirty++;
+        }
+    }
+    if (propagate_last_id) {
+        streamPropagateGroupID(c,c->m_argv[1],group,c->m_argv[2]);
+        server.dirty++;
+    }
+    c->setDeferredMultiBulkLength(arraylenptr,arraylen);
+    preventCommandPropagation(c);
+}
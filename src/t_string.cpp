@@ -64,6 +64,20 @@ static int checkStringLength(client *c, long long size) {
 #define OBJ_SET_EX (1<<2)     /* Set if time in seconds is given */
 #define OBJ_SET_PX (1<<3)     /* Set if time in ms in given */
 
+/* Set 'key' to the string 'val' like setKey(), or like setKeyWithExpire()
+ * if 'when' is not -1, storing a compressed copy of 'val' instead when it
+ * is worth it, see string-compression-min-bytes. */
+static void setStringKey(client *c, robj *key, robj *val, long long when) {
+    robj *cval = tryStringCompression(val);
+
+    if (cval) val = cval;
+    if (when != -1)
+        setKeyWithExpire(c,c->m_cur_selected_db,key,val,when);
+    else
+        setKey(c->m_cur_selected_db,key,val);
+    if (cval) decrRefCount(cval);
+}
+
 void setGenericCommand(client *c, int flags, robj *key, robj *val, robj *expire, int unit, robj *ok_reply, robj *abort_reply) {
     long long milliseconds = 0; /* initialized to avoid any harmness warning */
 
@@ -83,9 +97,8 @@ void setGenericCommand(client *c, int flags, robj *key, robj *val, robj *expire,
         c->addReply( abort_reply ? abort_reply : shared.nullbulk);
         return;
     }
-    setKey(c->m_cur_selected_db,key,val);
+    setStringKey(c,key,val,expire ? mstime()+milliseconds : -1);
     server.dirty++;
-    if (expire) setExpire(c,c->m_cur_selected_db,key,mstime()+milliseconds);
     notifyKeyspaceEvent(NOTIFY_STRING,"set",key,c->m_cur_selected_db->m_id);
     if (expire) notifyKeyspaceEvent(NOTIFY_GENERIC,
         "expire",key,c->m_cur_selected_db->m_id);
@@ -163,6 +176,13 @@ int getGenericCommand(client *c) {
     if (o->type != OBJ_STRING) {
         c->addReply(shared.wrongtypeerr);
         return C_ERR;
+    } else if (o->encoding == OBJ_ENCODING_CHUNKED) {
+        /* Reply with a plain copy, leaving the stored bitmap chunked. */
+        c->addReplyBulkSds(chunkedBitmapObjectToSds(o));
+        return C_OK;
+    } else if (o->encoding == OBJ_ENCODING_COMPRESSED) {
+        c->addReplyBulkSds(compressedStringObjectToSds(o));
+        return C_OK;
     } else {
         c->addReplyBulk(o);
         return C_OK;
@@ -176,11 +196,19 @@ void getCommand(client *c) {
 void getsetCommand(client *c) {
     if (getGenericCommand(c) == C_ERR) return;
     c->m_argv[2] = tryObjectEncoding(c->m_argv[2]);
-    setKey(c->m_cur_selected_db,c->m_argv[1],c->m_argv[2]);
+    setStringKey(c,c->m_argv[1],c->m_argv[2],-1);
     notifyKeyspaceEvent(NOTIFY_STRING,"set",c->m_argv[1],c->m_cur_selected_db->m_id);
     server.dirty++;
 }
 
+/* Signal the modification of the key of the SETRANGE command 'c'. */
+static void setrangeSignalModified(client *c) {
+    signalModifiedKey(c->m_cur_selected_db,c->m_argv[1]);
+    notifyKeyspaceEvent(NOTIFY_STRING,
+        "setrange",c->m_argv[1],c->m_cur_selected_db->m_id);
+    server.dirty++;
+}
+
 void setrangeCommand(client *c) {
     robj *o;
     long offset;
@@ -226,18 +254,33 @@ void setrangeCommand(client *c) {
         if (checkStringLength(c,offset+sdslen(value)) != C_OK)
             return;
 
-        /* Create a copy when the object is shared or encoded. */
+        /* Chunked bitmaps are written in place, only touching the chunks
+         * of the range, instead of being decoded into a plain string. */
+        if (o->encoding == OBJ_ENCODING_CHUNKED) {
+            if (o->refcount != 1) {
+                o = createChunkedBitmapObject(chunkedBitmap::chunkedBitmapDup(
+                    (chunkedBitmap *)o->ptr));
+                dbOverwrite(c->m_cur_selected_db,c->m_argv[1],o);
+            }
+            chunkedBitmap *cb = (chunkedBitmap *)o->ptr;
+            cb->chunkedBitmapWrite(offset,(unsigned char *)value,
+                                   sdslen(value));
+            setrangeSignalModified(c);
+            c->addReplyLongLong(cb->chunkedBitmapLen());
+            return;
+        }
+
+        /* Create a copy when the object is shared or encoded. A value
+         * referenced by a pending reply is shared as well. */
         o = dbUnshareStringValue(c->m_cur_selected_db,c->m_argv[1],o);
     }
 
-    if (sdslen(value) > 0) {
+    /* Overwrite in place when the string is already large enough: there
+     * is nothing to grow, and no reason to touch the allocation. */
+    if (offset+sdslen(value) > sdslen((sds)o->ptr))
         o->ptr = sdsgrowzero((sds)o->ptr,offset+sdslen(value));
-        memcpy((char*)o->ptr+offset,value,sdslen(value));
-        signalModifiedKey(c->m_cur_selected_db,c->m_argv[1]);
-        notifyKeyspaceEvent(NOTIFY_STRING,
-            "setrange",c->m_argv[1],c->m_cur_selected_db->m_id);
-        server.dirty++;
-    }
+    memcpy((char*)o->ptr+offset,value,sdslen(value));
+    setrangeSignalModified(c);
     c->addReplyLongLong(sdslen((sds)o->ptr));
 }
 
@@ -257,6 +300,9 @@ void getrangeCommand(client *c) {
     if (o->encoding == OBJ_ENCODING_INT) {
         str = llbuf;
         strlen = ll2string(llbuf,sizeof(llbuf),(long)o->ptr);
+    } else if (o->encoding == OBJ_ENCODING_CHUNKED) {
+        str = NULL;
+        strlen = ((chunkedBitmap *)o->ptr)->chunkedBitmapLen();
     } else {
         str = (char *)o->ptr;
         strlen = sdslen(str);
@@ -277,8 +323,17 @@ void getrangeCommand(client *c) {
      * nothing can be returned is: start > end. */
     if (start > end || strlen == 0) {
         c->addReply(shared.emptybulk);
-    } else {
+    } else if (str == NULL) {
+        sds range = sdsnewlen(NULL,end-start+1);
+        ((chunkedBitmap *)o->ptr)->chunkedBitmapRead(start,
+            (unsigned char *)range,end-start+1);
+        c->addReplyBulkSds(range);
+    } else if (str == llbuf) {
         c->addReplyBulkCBuffer((char*)str+start,end-start+1);
+    } else {
+        /* Large ranges are referenced, not copied, see
+         * addReplyBulkObjectRange(). */
+        c->addReplyBulkObjectRange(o,start,end-start+1);
     }
 }
 
@@ -287,12 +342,16 @@ void mgetCommand(client *c) {
 
     c->addReplyMultiBulkLen(c->m_argc-1);
     for (j = 1; j < c->m_argc; j++) {
+        if ((j-1) % DICT_PREFETCH_BATCH == 0)
+            dbPrefetchKeys(c->m_cur_selected_db,c->m_argv+j,c->m_argc-j,1);
         robj *o = lookupKeyRead(c->m_cur_selected_db,c->m_argv[j]);
         if (o == NULL) {
             c->addReply(shared.nullbulk);
         } else {
             if (o->type != OBJ_STRING) {
                 c->addReply(shared.nullbulk);
+            } else if (o->encoding == OBJ_ENCODING_COMPRESSED) {
+                c->addReplyBulkSds(compressedStringObjectToSds(o));
             } else {
                 c->addReplyBulk(o);
             }
@@ -311,6 +370,8 @@ void msetGenericCommand(client *c, int nx) {
      * set nothing at all if at least one already key exists. */
     if (nx) {
         for (j = 1; j < c->m_argc; j += 2) {
+            if ((j-1) % (DICT_PREFETCH_BATCH*2) == 0)
+                dbPrefetchKeys(c->m_cur_selected_db,c->m_argv+j,c->m_argc-j,2);
             if (lookupKeyWrite(c->m_cur_selected_db,c->m_argv[j]) != NULL) {
                 busykeys++;
             }
@@ -322,8 +383,10 @@ void msetGenericCommand(client *c, int nx) {
     }
 
     for (j = 1; j < c->m_argc; j += 2) {
+        if ((j-1) % (DICT_PREFETCH_BATCH*2) == 0)
+            dbPrefetchKeys(c->m_cur_selected_db,c->m_argv+j,c->m_argc-j,2);
         c->m_argv[j+1] = tryObjectEncoding(c->m_argv[j+1]);
-        setKey(c->m_cur_selected_db,c->m_argv[j],c->m_argv[j+1]);
+        setStringKey(c,c->m_argv[j],c->m_argv[j+1],-1);
         notifyKeyspaceEvent(NOTIFY_STRING,"set",c->m_argv[j],c->m_cur_selected_db->m_id);
     }
     server.dirty += (c->m_argc-1)/2;
@@ -338,6 +401,38 @@ void msetnxCommand(client *c) {
     msetGenericCommand(c,1);
 }
 
+/* MSETEX seconds key value [key value ...]
+ *
+ * Set all the keys with the same time to live, computed once: a cache fill
+ * costs a single command instead of a SETEX per key. */
+void msetexCommand(client *c) {
+    long long seconds, when;
+    int j;
+
+    if ((c->m_argc % 2) == 1) {
+        c->addReplyError("wrong number of arguments for MSETEX");
+        return;
+    }
+    if (getLongLongFromObjectOrReply(c,c->m_argv[1],&seconds,NULL) != C_OK)
+        return;
+    if (seconds <= 0 || seconds > LLONG_MAX/1000) {
+        c->addReplyError("invalid expire time in msetex");
+        return;
+    }
+    when = mstime()+seconds*1000;
+
+    for (j = 2; j < c->m_argc; j += 2) {
+        if ((j-2) % (DICT_PREFETCH_BATCH*2) == 0)
+            dbPrefetchKeys(c->m_cur_selected_db,c->m_argv+j,c->m_argc-j,2);
+        c->m_argv[j+1] = tryObjectEncoding(c->m_argv[j+1]);
+        setStringKey(c,c->m_argv[j],c->m_argv[j+1],when);
+        notifyKeyspaceEvent(NOTIFY_STRING,"set",c->m_argv[j],c->m_cur_selected_db->m_id);
+        notifyKeyspaceEvent(NOTIFY_GENERIC,"expire",c->m_argv[j],c->m_cur_selected_db->m_id);
+    }
+    server.dirty += (c->m_argc-2)/2;
+    c->addReply(shared.ok);
+}
+
 void incrDecrCommand(client *c, long long incr) {
     long long value, oldvalue;
     robj *o, *_new;
@@ -57,7 +57,9 @@
  * from tail to head, useful for ZREVRANGE. */
 
 #include "server.h"
+#include "bgread.h"
 #include <math.h>
+#include <pthread.h>
 
 /*-----------------------------------------------------------------------------
  * Skiplist implementation of the low level API
@@ -209,6 +211,90 @@ zskiplistNode* zskiplist::zslInsert(double score, sds ele)
     return x;
 }
 
+/* Compare two zskiplistPair by score, then by element, like the skiplist
+ * orders its nodes. */
+int zslPairCompare(const void *a, const void *b) {
+    const zskiplistPair *pa = (const zskiplistPair*)a;
+    const zskiplistPair *pb = (const zskiplistPair*)b;
+
+    if (pa->score < pb->score) return -1;
+    if (pa->score > pb->score) return 1;
+    return sdscmp(pa->ele,pb->ele);
+}
+
+/* Load into an empty skiplist 'count' pairs, sorted with zslPairCompare()
+ * and without duplicated elements. Every node is appended after the last
+ * node of its levels, so that the whole load is O(N) instead of the
+ * O(N*log(N)) of inserting the pairs one after the other. The skiplist
+ * takes ownership of the elements. */
+void zskiplist::zslBulkLoad(const zskiplistPair *pairs, unsigned long count)
+{
+    zskiplistNode *last[ZSKIPLIST_MAXLEVEL], *prev = NULL, *x;
+    unsigned long lastrank[ZSKIPLIST_MAXLEVEL];
+    int i, level;
+
+    serverAssert(m_length == 0);
+    for (i = 0; i < ZSKIPLIST_MAXLEVEL; i++) {
+        last[i] = m_header;
+        lastrank[i] = 0;
+    }
+    for (unsigned long rank = 1; rank <= count; rank++) {
+        const zskiplistPair *p = &pairs[rank-1];
+
+        serverAssert(!isnan(p->score));
+        level = zslRandomLevel();
+        if (level > m_level) m_level = level;
+        x = zslCreateNode(level,p->score,p->ele);
+        for (i = 0; i < level; i++) {
+            x->level[i].forward = NULL;
+            last[i]->level[i].forward = x;
+            last[i]->level[i].span = rank - lastrank[i];
+            last[i] = x;
+            lastrank[i] = rank;
+        }
+        x->backward = prev;
+        prev = x;
+    }
+
+    /* The last node of every level spans up to the end of the list, like
+     * the ones zslInsert() appends. */
+    for (i = 0; i < m_level; i++)
+        last[i]->level[i].span = count - lastrank[i];
+    m_tail = prev;
+    m_length = count;
+}
+
+/* Add to the empty zset 'zs' the 'count' pairs, sorted with zslPairCompare(),
+ * bulk loading the skiplist or appending to the B+tree. The zset takes
+ * ownership of the elements. Returns C_ERR if an element is found twice,
+ * leaving a zset that can only be freed. */
+int zsetLoadSortedPairs(zset *zs, const zskiplistPair *pairs,
+                        unsigned long count)
+{
+    int retval = C_OK;
+
+    zs->_dict->dictExpand(count);
+    if (zs->zbt) {
+        for (unsigned long j = 0; j < count; j++) {
+            dictEntry *de = zs->_dict->dictAddRaw(pairs[j].ele,NULL);
+            zs->zbt->zbtInsert(pairs[j].score,pairs[j].ele);
+            if (de)
+                de->dictSetDoubleVal(pairs[j].score);
+            else
+                retval = C_ERR;
+        }
+    } else {
+        zs->zsl->zslBulkLoad(pairs,count);
+        zskiplistNode *node = zs->zsl->header()->level[0].forward;
+        while (node) {
+            if (zs->_dict->dictAdd(node->ele,&node->score) != DICT_OK)
+                retval = C_ERR;
+            node = node->level[0].forward;
+        }
+    }
+    return retval;
+}
+
 /* Internal function used by zslDelete, zslDeleteByScore and zslDeleteByRank */
 void zskiplist::zslDeleteNode(zskiplistNode *x, zskiplistNode **update) {
     int i;
@@ -694,7 +780,7 @@ zskiplistNode* zskiplist::zslLastInLexRange(zlexrangespec *range)
 }
 
 /*-----------------------------------------------------------------------------
- * Ziplist-backed sorted set API
+ * Listpack-backed sorted set API
  *----------------------------------------------------------------------------*/
 
 double zzlGetScore(unsigned char *sptr) {
@@ -705,7 +791,7 @@ double zzlGetScore(unsigned char *sptr) {
     double score;
 
     serverAssert(sptr != NULL);
-    serverAssert(ziplistGet(sptr,&vstr,&vlen,&vlong));
+    serverAssert(lpGetValue(sptr,&vstr,&vlen,&vlong));
 
     if (vstr) {
         memcpy(buf,vstr,vlen);
@@ -718,14 +804,14 @@ double zzlGetScore(unsigned char *sptr) {
     return score;
 }
 
-/* Return a ziplist element as an SDS string. */
-sds ziplistGetObject(unsigned char *sptr) {
+/* Return a listpack element as an SDS string. */
+sds lpGetObject(unsigned char *sptr) {
     unsigned char *vstr;
     unsigned int vlen;
     long long vlong;
 
     serverAssert(sptr != NULL);
-    serverAssert(ziplistGet(sptr,&vstr,&vlen,&vlong));
+    serverAssert(lpGetValue(sptr,&vstr,&vlen,&vlong));
 
     if (vstr) {
         return sdsnewlen((char*)vstr,vlen);
@@ -742,7 +828,7 @@ int zzlCompareElements(unsigned char *eptr, unsigned char *cstr, unsigned int cl
     unsigned char vbuf[32];
     int minlen, cmp;
 
-    serverAssert(ziplistGet(eptr,&vstr,&vlen,&vlong));
+    serverAssert(lpGetValue(eptr,&vstr,&vlen,&vlong));
     if (vstr == NULL) {
         /* Store string representation of long long in buf. */
         vlen = ll2string((char*)vbuf,sizeof(vbuf),vlong);
@@ -756,7 +842,7 @@ int zzlCompareElements(unsigned char *eptr, unsigned char *cstr, unsigned int cl
 }
 
 unsigned int zzlLength(unsigned char *zl) {
-    return ziplistLen(zl)/2;
+    return lpLength(zl)/2;
 }
 
 /* Move to next entry based on the values in eptr and sptr. Both are set to
@@ -765,9 +851,9 @@ void zzlNext(unsigned char *zl, unsigned char **eptr, unsigned char **sptr) {
     unsigned char *_eptr, *_sptr;
     serverAssert(*eptr != NULL && *sptr != NULL);
 
-    _eptr = ziplistNext(zl,*sptr);
+    _eptr = lpNext(zl,*sptr);
     if (_eptr != NULL) {
-        _sptr = ziplistNext(zl,_eptr);
+        _sptr = lpNext(zl,_eptr);
         serverAssert(_sptr != NULL);
     } else {
         /* No next entry. */
@@ -784,9 +870,9 @@ void zzlPrev(unsigned char *zl, unsigned char **eptr, unsigned char **sptr) {
     unsigned char *_eptr, *_sptr;
     serverAssert(*eptr != NULL && *sptr != NULL);
 
-    _sptr = ziplistPrev(zl,*eptr);
+    _sptr = lpPrev(zl,*eptr);
     if (_sptr != NULL) {
-        _eptr = ziplistPrev(zl,_sptr);
+        _eptr = lpPrev(zl,_sptr);
         serverAssert(_eptr != NULL);
     } else {
         /* No previous entry. */
@@ -808,13 +894,13 @@ int zzlIsInRange(unsigned char *zl, zrangespec *range) {
             (range->min == range->max && (range->minex || range->maxex)))
         return 0;
 
-    p = ziplistIndex(zl,-1); /* Last score. */
+    p = lpSeek(zl,-1); /* Last score. */
     if (p == NULL) return 0; /* Empty sorted set */
     score = zzlGetScore(p);
     if (!zslValueGteMin(score,range))
         return 0;
 
-    p = ziplistIndex(zl,1); /* First score. */
+    p = lpSeek(zl,1); /* First score. */
     serverAssert(p != NULL);
     score = zzlGetScore(p);
     if (!zslValueLteMax(score,range))
@@ -826,14 +912,14 @@ int zzlIsInRange(unsigned char *zl, zrangespec *range) {
 /* Find pointer to the first element contained in the specified range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
     double score;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInRange(zl,range)) return NULL;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         score = zzlGetScore(sptr);
@@ -845,7 +931,7 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
         }
 
         /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
+        eptr = lpNext(zl,sptr);
     }
 
     return NULL;
@@ -854,14 +940,14 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
 /* Find pointer to the last element contained in the specified range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,-2), *sptr;
+    unsigned char *eptr = lpSeek(zl,-2), *sptr;
     double score;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInRange(zl,range)) return NULL;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         score = zzlGetScore(sptr);
@@ -874,9 +960,9 @@ unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
 
         /* Move to previous element by moving to the score of previous element.
          * When this returns NULL, we know there also is no element. */
-        sptr = ziplistPrev(zl,eptr);
+        sptr = lpPrev(zl,eptr);
         if (sptr != NULL)
-            serverAssert((eptr = ziplistPrev(zl,sptr)) != NULL);
+            serverAssert((eptr = lpPrev(zl,sptr)) != NULL);
         else
             eptr = NULL;
     }
@@ -885,14 +971,14 @@ unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
 }
 
 int zzlLexValueGteMin(unsigned char *p, zlexrangespec *spec) {
-    sds value = ziplistGetObject(p);
+    sds value = lpGetObject(p);
     int res = zslLexValueGteMin(value,spec);
     sdsfree(value);
     return res;
 }
 
 int zzlLexValueLteMax(unsigned char *p, zlexrangespec *spec) {
-    sds value = ziplistGetObject(p);
+    sds value = lpGetObject(p);
     int res = zslLexValueLteMax(value,spec);
     sdsfree(value);
     return res;
@@ -909,12 +995,12 @@ int zzlIsInLexRange(unsigned char *zl, zlexrangespec *range) {
             (range->minex || range->maxex)))
         return 0;
 
-    p = ziplistIndex(zl,-2); /* Last element. */
+    p = lpSeek(zl,-2); /* Last element. */
     if (p == NULL) return 0;
     if (!zzlLexValueGteMin(p,range))
         return 0;
 
-    p = ziplistIndex(zl,0); /* First element. */
+    p = lpSeek(zl,0); /* First element. */
     serverAssert(p != NULL);
     if (!zzlLexValueLteMax(p,range))
         return 0;
@@ -925,7 +1011,7 @@ int zzlIsInLexRange(unsigned char *zl, zlexrangespec *range) {
 /* Find pointer to the first element contained in the specified lex range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInLexRange(zl,range)) return NULL;
@@ -939,9 +1025,9 @@ unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
         }
 
         /* Move to next element. */
-        sptr = ziplistNext(zl,eptr); /* This element score. Skip it. */
+        sptr = lpNext(zl,eptr); /* This element score. Skip it. */
         serverAssert(sptr != NULL);
-        eptr = ziplistNext(zl,sptr); /* Next element. */
+        eptr = lpNext(zl,sptr); /* Next element. */
     }
 
     return NULL;
@@ -950,7 +1036,7 @@ unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
 /* Find pointer to the last element contained in the specified lex range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,-2), *sptr;
+    unsigned char *eptr = lpSeek(zl,-2), *sptr;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInLexRange(zl,range)) return NULL;
@@ -965,9 +1051,9 @@ unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
 
         /* Move to previous element by moving to the score of previous element.
          * When this returns NULL, we know there also is no element. */
-        sptr = ziplistPrev(zl,eptr);
+        sptr = lpPrev(zl,eptr);
         if (sptr != NULL)
-            serverAssert((eptr = ziplistPrev(zl,sptr)) != NULL);
+            serverAssert((eptr = lpPrev(zl,sptr)) != NULL);
         else
             eptr = NULL;
     }
@@ -976,32 +1062,31 @@ unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
 }
 
 unsigned char *zzlFind(unsigned char *zl, sds ele, double *score) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
-        if (ziplistCompare(eptr,(unsigned char*)ele,sdslen(ele))) {
+        if (lpCompare(eptr,(unsigned char*)ele,sdslen(ele))) {
             /* Matching element, pull out score. */
             if (score != NULL) *score = zzlGetScore(sptr);
             return eptr;
         }
 
         /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
+        eptr = lpNext(zl,sptr);
     }
     return NULL;
 }
 
-/* Delete (element,score) pair from ziplist. Use local copy of eptr because we
+/* Delete (element,score) pair from listpack. Use local copy of eptr because we
  * don't want to modify the one given as argument. */
 unsigned char *zzlDelete(unsigned char *zl, unsigned char *eptr) {
     unsigned char *p = eptr;
 
-    /* TODO: add function to ziplist API to delete N elements from offset. */
-    zl = ziplistDelete(zl,&p);
-    zl = ziplistDelete(zl,&p);
+    zl = lpDelete(zl,p,&p);
+    zl = lpDelete(zl,p,&p);
     return zl;
 }
 
@@ -1009,33 +1094,30 @@ unsigned char *zzlInsertAt(unsigned char *zl, unsigned char *eptr, sds ele, doub
     unsigned char *sptr;
     char scorebuf[128];
     int scorelen;
-    size_t offset;
 
     scorelen = d2string(scorebuf,sizeof(scorebuf),score);
     if (eptr == NULL) {
-        zl = ziplistPush(zl,(unsigned char*)ele,sdslen(ele),ZIPLIST_TAIL);
-        zl = ziplistPush(zl,(unsigned char*)scorebuf,scorelen,ZIPLIST_TAIL);
+        zl = lpAppend(zl,(unsigned char*)ele,sdslen(ele));
+        zl = lpAppend(zl,(unsigned char*)scorebuf,scorelen);
     } else {
-        /* Keep offset relative to zl, as it might be re-allocated. */
-        offset = eptr-zl;
-        zl = ziplistInsert(zl,eptr,(unsigned char*)ele,sdslen(ele));
-        eptr = zl+offset;
+        /* Insert the element before eptr, lpInsert() returns the pointer
+         * to it in the reallocated listpack. */
+        zl = lpInsert(zl,(unsigned char*)ele,sdslen(ele),eptr,LP_BEFORE,&sptr);
 
         /* Insert score after the element. */
-        serverAssert((sptr = ziplistNext(zl,eptr)) != NULL);
-        zl = ziplistInsert(zl,sptr,(unsigned char*)scorebuf,scorelen);
+        zl = lpInsert(zl,(unsigned char*)scorebuf,scorelen,sptr,LP_AFTER,NULL);
     }
     return zl;
 }
 
-/* Insert (element,score) pair in ziplist. This function assumes the element is
+/* Insert (element,score) pair in listpack. This function assumes the element is
  * not yet present in the list. */
 unsigned char *zzlInsert(unsigned char *zl, sds ele, double score) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
     double s;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
         s = zzlGetScore(sptr);
 
@@ -1054,7 +1136,7 @@ unsigned char *zzlInsert(unsigned char *zl, sds ele, double score) {
         }
 
         /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
+        eptr = lpNext(zl,sptr);
     }
 
     /* Push on tail of list when it was not yet inserted. */
@@ -1073,14 +1155,14 @@ unsigned char *zzlDeleteRangeByScore(unsigned char *zl, zrangespec *range, unsig
     eptr = zzlFirstInRange(zl,range);
     if (eptr == NULL) return zl;
 
-    /* When the tail of the ziplist is deleted, eptr will point to the sentinel
-     * byte and ziplistNext will return NULL. */
-    while ((sptr = ziplistNext(zl,eptr)) != NULL) {
+    /* When the tail of the listpack is deleted, lpDelete() sets eptr to
+     * NULL. */
+    while (eptr && (sptr = lpNext(zl,eptr)) != NULL) {
         score = zzlGetScore(sptr);
         if (zslValueLteMax(score,range)) {
             /* Delete both the element and the score. */
-            zl = ziplistDelete(zl,&eptr);
-            zl = ziplistDelete(zl,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
             num++;
         } else {
             /* No longer in range. */
@@ -1101,13 +1183,13 @@ unsigned char *zzlDeleteRangeByLex(unsigned char *zl, zlexrangespec *range, unsi
     eptr = zzlFirstInLexRange(zl,range);
     if (eptr == NULL) return zl;
 
-    /* When the tail of the ziplist is deleted, eptr will point to the sentinel
-     * byte and ziplistNext will return NULL. */
-    while ((sptr = ziplistNext(zl,eptr)) != NULL) {
+    /* When the tail of the listpack is deleted, lpDelete() sets eptr to
+     * NULL. */
+    while (eptr && (sptr = lpNext(zl,eptr)) != NULL) {
         if (zzlLexValueLteMax(eptr,range)) {
             /* Delete both the element and the score. */
-            zl = ziplistDelete(zl,&eptr);
-            zl = ziplistDelete(zl,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
             num++;
         } else {
             /* No longer in range. */
@@ -1124,7 +1206,7 @@ unsigned char *zzlDeleteRangeByLex(unsigned char *zl, zlexrangespec *range, unsi
 unsigned char *zzlDeleteRangeByRank(unsigned char *zl, unsigned int start, unsigned int end, unsigned long *deleted) {
     unsigned int num = (end-start)+1;
     if (deleted) *deleted = num;
-    zl = ziplistDeleteRange(zl,2*(start-1),2*num);
+    zl = lpDeleteRange(zl,2*(start-1),2*num);
     return zl;
 }
 
@@ -1134,10 +1216,12 @@ unsigned char *zzlDeleteRangeByRank(unsigned char *zl, unsigned int start, unsig
 
 unsigned int zsetLength(const robj *zobj) {
     int length = -1;
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         length = zzlLength((unsigned char *)zobj->ptr);
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
         length = ((const zset*)zobj->ptr)->zsl->length();
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        length = ((const zset*)zobj->ptr)->zbt->length();
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -1151,7 +1235,7 @@ void zsetConvert(robj *zobj, int encoding) {
     double score;
 
     if (zobj->encoding == encoding) return;
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = (unsigned char *)zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -1164,36 +1248,72 @@ void zsetConvert(robj *zobj, int encoding) {
         zs = (zset *)zmalloc(sizeof(*zs));
         zs->_dict = dictCreate(&zsetDictType,NULL);
         zs->zsl = zslCreate();
+        zs->zbt = NULL;
 
-        eptr = ziplistIndex(zl,0);
+        eptr = lpSeek(zl,0);
         serverAssertWithInfo(NULL,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssertWithInfo(NULL,zobj,sptr != NULL);
 
+        /* The listpack is sorted like the skiplist, that is bulk loaded. */
+        unsigned long count = 0;
+        zskiplistPair *pairs = (zskiplistPair *)
+            zmalloc(sizeof(zskiplistPair)*zzlLength(zl));
         while (eptr != NULL) {
             score = zzlGetScore(sptr);
-            serverAssertWithInfo(NULL,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            serverAssertWithInfo(NULL,zobj,lpGetValue(eptr,&vstr,&vlen,&vlong));
             if (vstr == NULL)
                 ele = sdsfromlonglong(vlong);
             else
                 ele = sdsnewlen((char*)vstr,vlen);
 
-            node = zs->zsl->zslInsert(score,ele);
-            serverAssert(zs->_dict->dictAdd(ele,&node->score) == DICT_OK);
+            pairs[count].score = score;
+            pairs[count].ele = ele;
+            count++;
             zzlNext(zl,&eptr,&sptr);
         }
+        serverAssert(zsetLoadSortedPairs(zs,pairs,count) == C_OK);
+        zfree(pairs);
 
         zfree(zobj->ptr);
         zobj->ptr = zs;
         zobj->encoding = OBJ_ENCODING_SKIPLIST;
+    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST &&
+               encoding == OBJ_ENCODING_BTREE)
+    {
+        zbtree *zbt = zbtCreate();
+
+        /* The skiplist is visited in order, so every element is appended
+         * to the last leaf of the tree, that is left full when split. The
+         * element SDS strings move to the tree, while the hash table entries
+         * are updated to store the score themselves. */
+        zs = (zset *)zobj->ptr;
+        node = zs->zsl->header()->level[0].forward;
+        zs->zsl->free_header_only();
+        zslFree(zs->zsl);
+        zs->zsl = NULL;
+
+        while (node) {
+            dictEntry *de = zs->_dict->dictFind(node->ele);
+            serverAssertWithInfo(NULL,zobj,de != NULL);
+            de->dictSetDoubleVal(node->score);
+            zbt->zbtInsert(node->score,node->ele);
+            next = node->level[0].forward;
+            node->ele = NULL;
+            zslFreeNode(node);
+            node = next;
+        }
+
+        zs->zbt = zbt;
+        zobj->encoding = OBJ_ENCODING_BTREE;
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
-        unsigned char *zl = ziplistNew();
+        unsigned char *zl = lpNew();
 
-        if (encoding != OBJ_ENCODING_ZIPLIST)
+        if (encoding != OBJ_ENCODING_LISTPACK)
             serverPanic("Unknown target encoding");
 
         /* Approach similar to zslFree(), since we want to free the skiplist at
-         * the same time as creating the ziplist. */
+         * the same time as creating the listpack. */
         zs = (zset *)zobj->ptr;
         dictRelease(zs->_dict);
         node = zs->zsl->header()->level[0].forward;
@@ -1210,25 +1330,73 @@ void zsetConvert(robj *zobj, int encoding) {
 
         zfree(zs);
         zobj->ptr = zl;
-        zobj->encoding = OBJ_ENCODING_ZIPLIST;
+        zobj->encoding = OBJ_ENCODING_LISTPACK;
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        unsigned char *zl = lpNew();
+        zbtCursor c;
+        int more;
+
+        if (encoding != OBJ_ENCODING_LISTPACK)
+            serverPanic("Unknown target encoding");
+
+        zs = (zset *)zobj->ptr;
+        more = zs->zbt->zbtFirst(&c);
+        while (more) {
+            zl = zzlInsertAt(zl,NULL,zbtCursorEle(&c),zbtCursorScore(&c));
+            more = zbtNext(&c);
+        }
+        dictRelease(zs->_dict);
+        zbtFree(zs->zbt);
+
+        zfree(zs);
+        zobj->ptr = zl;
+        zobj->encoding = OBJ_ENCODING_LISTPACK;
     } else {
         serverPanic("Unknown sorted set encoding");
     }
 }
 
-/* Convert the sorted set object into a ziplist if it is not already a ziplist
+/* Convert the sorted set object into a listpack if it is not already a listpack
  * and if the number of elements and the maximum element size is within the
  * expected ranges. */
-void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen)
+void zsetConvertToListpackIfNeeded(robj *zobj, size_t maxelelen)
 {
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST)
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK)
         return;
     
-    zset *_zset = (zset *)(zobj->ptr);
-
-    if (_zset->zsl->length() <= server.zset_max_ziplist_entries &&
+    if (zsetLength(zobj) <= server.zset_max_ziplist_entries &&
         maxelelen <= server.zset_max_ziplist_value)
-            zsetConvert(zobj,OBJ_ENCODING_ZIPLIST);
+            zsetConvert(zobj,OBJ_ENCODING_LISTPACK);
+}
+
+/* Convert a skiplist encoded sorted set into a B+tree if it has more elements
+ * than zset-max-skiplist-entries. */
+void zsetConvertToBtreeIfNeeded(robj *zobj)
+{
+    if (zobj->encoding == OBJ_ENCODING_SKIPLIST &&
+        zsetLength(zobj) > server.zset_max_skiplist_entries)
+            zsetConvert(zobj,OBJ_ENCODING_BTREE);
+}
+
+/* Convert a skiplist encoded sorted set into a listpack if it is within the
+ * zset-max-ziplist-* limits. Returns 1 if the sorted set was converted. */
+int zsetCompactIfNeeded(robj *zobj)
+{
+    size_t maxelelen = 0;
+
+    if (zobj->encoding != OBJ_ENCODING_SKIPLIST ||
+        zsetLength(zobj) > server.zset_max_ziplist_entries) return 0;
+
+    {
+        dictIterator di(((zset*)zobj->ptr)->_dict);
+        dictEntry *de;
+        while ((de = di.dictNext()) != NULL) {
+            size_t len = sdslen((sds)de->dictGetKey());
+            if (len > maxelelen) maxelelen = len;
+        }
+    }
+    zsetConvertToListpackIfNeeded(zobj,maxelelen);
+    return zobj->encoding == OBJ_ENCODING_LISTPACK;
 }
 
 /* Return (by reference) the score of the specified member of the sorted set
@@ -1238,13 +1406,15 @@ void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen)
 int zsetScore(robj *zobj, sds member, double *score) {
     if (!zobj || !member) return C_ERR;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         if (zzlFind((unsigned char *)zobj->ptr, member, score) == NULL) return C_ERR;
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST ||
+               zobj->encoding == OBJ_ENCODING_BTREE)
+    {
         zset *zs = (zset *)zobj->ptr;
         dictEntry *de = zs->_dict->dictFind(member);
         if (de == NULL) return C_ERR;
-        *score = *(double*)de->dictGetVal();
+        *score = zsetDictScore(zs,de);
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -1288,7 +1458,8 @@ int zsetScore(robj *zobj, sds member, double *score) {
  * start.
  *
  * The commad as a side effect of adding a new element may convert the sorted
- * set internal encoding from ziplist to hashtable+skiplist.
+ * set internal encoding from listpack to hashtable+skiplist, and from
+ * hashtable+skiplist to hashtable+btree.
  *
  * Memory managemnet of 'ele':
  *
@@ -1309,7 +1480,7 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
     }
 
     /* Update the sorted set according to its encoding. */
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *eptr;
 
         if ((eptr = zzlFind((unsigned char *)zobj->ptr,ele,&curscore)) != NULL) {
@@ -1340,10 +1511,12 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
             /* Optimize: check if the element is too large or the list
              * becomes too long *before* executing zzlInsert. */
             zobj->ptr = zzlInsert((unsigned char *)zobj->ptr,ele,score);
-            if (zzlLength((unsigned char *)zobj->ptr) > server.zset_max_ziplist_entries)
+            if (zzlLength((unsigned char *)zobj->ptr) >
+                objectCompactMaxEntries(zobj,server.zset_max_ziplist_entries))
                 zsetConvert(zobj,OBJ_ENCODING_SKIPLIST);
             if (sdslen(ele) > server.zset_max_ziplist_value)
                 zsetConvert(zobj,OBJ_ENCODING_SKIPLIST);
+            zsetConvertToBtreeIfNeeded(zobj);
             if (newscore) *newscore = score;
             *flags |= ZADD_ADDED;
             return 1;
@@ -1395,6 +1568,51 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
             ele = sdsdup(ele);
             znode = zs->zsl->zslInsert(score,ele);
             serverAssert(zs->_dict->dictAdd(ele,&znode->score) == DICT_OK);
+            zsetConvertToBtreeIfNeeded(zobj);
+            *flags |= ZADD_ADDED;
+            if (newscore) *newscore = score;
+            return 1;
+        } else {
+            *flags |= ZADD_NOP;
+            return 1;
+        }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = (zset *)zobj->ptr;
+        dictEntry *de;
+
+        de = zs->_dict->dictFind(ele);
+        if (de != NULL) {
+            /* NX? Return, same element already exists. */
+            if (nx) {
+                *flags |= ZADD_NOP;
+                return 1;
+            }
+            curscore = de->dictGetDoubleVal();
+
+            /* Prepare the score for the increment if needed. */
+            if (incr) {
+                score += curscore;
+                if (isnan(score)) {
+                    *flags |= ZADD_NAN;
+                    return 0;
+                }
+                if (newscore) *newscore = score;
+            }
+
+            /* Move the element when the score changes, the tree keeps the
+             * SDS string shared with the hash table. */
+            if (score != curscore) {
+                zs->zbt->zbtUpdateScore(curscore,(sds)de->dictGetKey(),score);
+                de->dictSetDoubleVal(score);
+                *flags |= ZADD_UPDATED;
+            }
+            return 1;
+        } else if (!xx) {
+            ele = sdsdup(ele);
+            zs->zbt->zbtInsert(score,ele);
+            de = zs->_dict->dictAddRaw(ele,NULL);
+            serverAssert(de != NULL);
+            de->dictSetDoubleVal(score);
             *flags |= ZADD_ADDED;
             if (newscore) *newscore = score;
             return 1;
@@ -1411,14 +1629,16 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
 /* Delete the element 'ele' from the sorted set, returning 1 if the element
  * existed and was deleted, 0 otherwise (the element was not there). */
 int zsetDel(robj *zobj, sds ele) {
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *eptr;
 
         if ((eptr = zzlFind((unsigned char *)zobj->ptr,ele,NULL)) != NULL) {
             zobj->ptr = zzlDelete((unsigned char *)zobj->ptr,eptr);
             return 1;
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST ||
+               zobj->encoding == OBJ_ENCODING_BTREE)
+    {
         zset *zs = (zset *)zobj->ptr;
         dictEntry *de;
         double score;
@@ -1426,7 +1646,7 @@ int zsetDel(robj *zobj, sds ele) {
         de = zs->_dict->dictUnlink(ele);
         if (de != NULL) {
             /* Get the score in order to delete from the skiplist later. */
-            score = *(double*)de->dictGetVal();
+            score = zsetDictScore(zs,de);
 
             /* Delete from the hash table and later from the skiplist.
              * Note that the order is important: deleting from the skiplist
@@ -1435,8 +1655,9 @@ int zsetDel(robj *zobj, sds ele) {
              * we need to delete from the skiplist as the final step. */
             zs->_dict->dictFreeUnlinkedEntry(de);
 
-            /* Delete from skiplist. */
-            int retval = zs->zsl->zslDelete(score,ele,NULL);
+            /* Delete from the skiplist or the B+tree. */
+            int retval = zs->zbt ? zs->zbt->zbtDelete(score,ele,NULL) :
+                                   zs->zsl->zslDelete(score,ele,NULL);
             serverAssert(retval);
 
             if (htNeedsResize(zs->_dict)) zs->_dict->dictResize();
@@ -1465,18 +1686,18 @@ long zsetRank(robj *zobj, sds ele, int reverse) {
 
     llen = zsetLength(zobj);
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = (unsigned char *)zobj->ptr;
         unsigned char *eptr, *sptr;
 
-        eptr = ziplistIndex(zl,0);
+        eptr = lpSeek(zl,0);
         serverAssert(eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         rank = 1;
         while(eptr != NULL) {
-            if (ziplistCompare(eptr,(unsigned char*)ele,sdslen(ele)))
+            if (lpCompare(eptr,(unsigned char*)ele,sdslen(ele)))
                 break;
             rank++;
             zzlNext(zl,&eptr,&sptr);
@@ -1490,16 +1711,18 @@ long zsetRank(robj *zobj, sds ele, int reverse) {
         } else {
             return -1;
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST ||
+               zobj->encoding == OBJ_ENCODING_BTREE)
+    {
         zset *zs = (zset *)zobj->ptr;
-        zskiplist *zsl = zs->zsl;
         dictEntry *de;
         double score;
 
         de = zs->_dict->dictFind(ele);
         if (de != NULL) {
-            score = *(double*)de->dictGetVal();
-            rank = zsl->zslGetRank(score,ele);
+            score = zsetDictScore(zs,de);
+            rank = zs->zbt ? zs->zbt->zbtGetRank(score,ele) :
+                             zs->zsl->zslGetRank(score,ele);
             /* Existing elements always have a rank. */
             serverAssert(rank != 0);
             if (reverse)
@@ -1514,6 +1737,43 @@ long zsetRank(robj *zobj, sds ele, int reverse) {
     }
 }
 
+/* Store in '*ele' a new SDS string with the element of the sorted set that
+ * has the lowest score, and its score in '*score'. Returns 0 without
+ * touching the arguments if the sorted set is empty, otherwise 1. */
+int zsetFirst(robj *zobj, sds *ele, double *score) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *zl = (unsigned char *)zobj->ptr;
+        unsigned char *eptr, *sptr;
+
+        if ((eptr = lpSeek(zl,0)) == NULL) return 0;
+        sptr = lpNext(zl,eptr);
+        serverAssert(sptr != NULL);
+        *ele = lpGetObject(eptr);
+        *score = zzlGetScore(sptr);
+    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST ||
+               zobj->encoding == OBJ_ENCODING_BTREE)
+    {
+        zset *zs = (zset *)zobj->ptr;
+
+        if (zs->zbt) {
+            zbtCursor cur;
+
+            if (!zs->zbt->zbtFirst(&cur)) return 0;
+            *ele = sdsdup(zbtCursorEle(&cur));
+            *score = zbtCursorScore(&cur);
+        } else {
+            zskiplistNode *ln = zs->zsl->header()->level[0].forward;
+
+            if (ln == NULL) return 0;
+            *ele = sdsdup(ln->ele);
+            *score = ln->score;
+        }
+    } else {
+        serverPanic("Unknown sorted set encoding");
+    }
+    return 1;
+}
+
 /*-----------------------------------------------------------------------------
  * Sorted set commands
  *----------------------------------------------------------------------------*/
@@ -1594,7 +1854,7 @@ void zaddGenericCommand(client *c, int flags) {
         {
             zobj = createZsetObject();
         } else {
-            zobj = createZsetZiplistObject();
+            zobj = createZsetListpackObject();
         }
         dbAdd(c->m_cur_selected_db,key,zobj);
     } else {
@@ -1727,7 +1987,7 @@ void zremrangeGenericCommand(client *c, int rangetype) {
     }
 
     /* Step 3: Perform the range deletion operation. */
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         switch(rangetype) {
         case ZRANGE_RANK:
             zobj->ptr = zzlDeleteRangeByRank((unsigned char *)zobj->ptr,start+1,end+1,&deleted);
@@ -1762,6 +2022,25 @@ void zremrangeGenericCommand(client *c, int rangetype) {
             dbDelete(c->m_cur_selected_db,key);
             keyremoved = 1;
         }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = (zset *)zobj->ptr;
+        switch(rangetype) {
+        case ZRANGE_RANK:
+            deleted = zs->zbt->zbtDeleteRangeByRank(start+1,end+1,zs->_dict);
+            break;
+        case ZRANGE_SCORE:
+            deleted = zs->zbt->zbtDeleteRangeByScore(&range,zs->_dict);
+            break;
+        case ZRANGE_LEX:
+            deleted = zs->zbt->zbtDeleteRangeByLex(&lexrange,zs->_dict);
+            break;
+        }
+        if (htNeedsResize(zs->_dict))
+            zs->_dict->dictResize();
+        if (zs->_dict->dictSize() == 0) {
+            dbDelete(c->m_cur_selected_db,key);
+            keyremoved = 1;
+        }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -1800,6 +2079,10 @@ union iterset
         intset *is;
         int ii;
     } is;
+    struct {
+        roaring *r;
+        roaringIterator it;
+    } rb;
     struct {
         dict *_dict;
         dictIterator *di;
@@ -1817,6 +2100,10 @@ union iterzset
         zset *zs;
         zskiplistNode *node;
     } sl;
+    struct {
+        zbtCursor c;
+        int valid;
+    } bt;
 };
 
 struct zsetopsrc
@@ -1868,6 +2155,9 @@ void zuiInitIterator(zsetopsrc *op) {
         if (op->encoding == OBJ_ENCODING_INTSET) {
             it->is.is = (intset *)op->subject->ptr;
             it->is.ii = 0;
+        } else if (op->encoding == OBJ_ENCODING_ROARING) {
+            it->rb.r = (roaring *)op->subject->ptr;
+            it->rb.r->roaringInitIterator(&it->rb.it);
         } else if (op->encoding == OBJ_ENCODING_HT) {
             it->ht._dict = (dict *)op->subject->ptr;
             it->ht.di = dictGetIterator((dict*)op->subject->ptr);
@@ -1877,16 +2167,19 @@ void zuiInitIterator(zsetopsrc *op) {
         }
     } else if (op->type == OBJ_ZSET) {
         iterzset *it = (iterzset *)&op->iter.zset;
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             it->zl.zl = (unsigned char *)op->subject->ptr;
-            it->zl.eptr = ziplistIndex(it->zl.zl,0);
+            it->zl.eptr = lpSeek(it->zl.zl,0);
             if (it->zl.eptr != NULL) {
-                it->zl.sptr = ziplistNext(it->zl.zl,it->zl.eptr);
+                it->zl.sptr = lpNext(it->zl.zl,it->zl.eptr);
                 serverAssert(it->zl.sptr != NULL);
             }
         } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
             it->sl.zs = (zset *)op->subject->ptr;
             it->sl.node = it->sl.zs->zsl->header()->level[0].forward;
+        } else if (op->encoding == OBJ_ENCODING_BTREE) {
+            zset *zs = (zset *)op->subject->ptr;
+            it->bt.valid = zs->zbt->zbtFirst(&it->bt.c);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -1901,7 +2194,9 @@ void zuiClearIterator(zsetopsrc *op) {
 
     if (op->type == OBJ_SET) {
         iterset *it =  (iterset *)&op->iter.set;
-        if (op->encoding == OBJ_ENCODING_INTSET) {
+        if (op->encoding == OBJ_ENCODING_INTSET ||
+            op->encoding == OBJ_ENCODING_ROARING)
+        {
             UNUSED(it); /* skip */
         } else if (op->encoding == OBJ_ENCODING_HT) {
             dictReleaseIterator(it->ht.di);
@@ -1910,9 +2205,11 @@ void zuiClearIterator(zsetopsrc *op) {
         }
     } else if (op->type == OBJ_ZSET) {
         iterzset *it =  (iterzset *)&op->iter.zset;
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             UNUSED(it); /* skip */
-        } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
+        } else if (op->encoding == OBJ_ENCODING_SKIPLIST ||
+                   op->encoding == OBJ_ENCODING_BTREE)
+        {
             UNUSED(it); /* skip */
         } else {
             serverPanic("Unknown sorted set encoding");
@@ -1929,6 +2226,8 @@ int zuiLength(zsetopsrc *op) {
     if (op->type == OBJ_SET) {
         if (op->encoding == OBJ_ENCODING_INTSET) {
             return ((intset *)op->subject->ptr)->intsetLen();
+        } else if (op->encoding == OBJ_ENCODING_ROARING) {
+            return ((roaring *)op->subject->ptr)->roaringLen();
         } else if (op->encoding == OBJ_ENCODING_HT) {
             dict *ht = (dict *)op->subject->ptr;
             return ht->dictSize();
@@ -1936,11 +2235,12 @@ int zuiLength(zsetopsrc *op) {
             serverPanic("Unknown set encoding");
         }
     } else if (op->type == OBJ_ZSET) {
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             return zzlLength((unsigned char *)op->subject->ptr);
-        } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
-            zset *zs = (zset *)op->subject->ptr;
-            return zs->zsl->length();
+        } else if (op->encoding == OBJ_ENCODING_SKIPLIST ||
+                   op->encoding == OBJ_ENCODING_BTREE)
+        {
+            return zsetLength(op->subject);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -1973,6 +2273,13 @@ int zuiNext(zsetopsrc *op, zsetopval *val) {
 
             /* Move to next element. */
             it->is.ii++;
+        } else if (op->encoding == OBJ_ENCODING_ROARING) {
+            int64_t ell;
+
+            if (!it->rb.r->roaringNext(&it->rb.it,&ell))
+                return 0;
+            val->ell = ell;
+            val->score = 1.0;
         } else if (op->encoding == OBJ_ENCODING_HT) {
             if (it->ht.de == NULL)
                 return 0;
@@ -1986,11 +2293,11 @@ int zuiNext(zsetopsrc *op, zsetopval *val) {
         }
     } else if (op->type == OBJ_ZSET) {
         iterzset *it =  (iterzset *)&op->iter.zset;
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             /* No need to check both, but better be explicit. */
             if (it->zl.eptr == NULL || it->zl.sptr == NULL)
                 return 0;
-            serverAssert(ziplistGet(it->zl.eptr,&val->estr,&val->elen,&val->ell));
+            serverAssert(lpGetValue(it->zl.eptr,&val->estr,&val->elen,&val->ell));
             val->score = zzlGetScore(it->zl.sptr);
 
             /* Move to next element. */
@@ -2003,6 +2310,14 @@ int zuiNext(zsetopsrc *op, zsetopval *val) {
 
             /* Move to next element. */
             it->sl.node = it->sl.node->level[0].forward;
+        } else if (op->encoding == OBJ_ENCODING_BTREE) {
+            if (!it->bt.valid)
+                return 0;
+            val->ele = zbtCursorEle(&it->bt.c);
+            val->score = zbtCursorScore(&it->bt.c);
+
+            /* Move to next element. */
+            it->bt.valid = zbtNext(&it->bt.c);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -2074,7 +2389,8 @@ int zuiBufferFromValue(zsetopval *val) {
 }
 
 /* Find value pointed to by val in the source pointer to by op. When found,
- * return 1 and store its score in target. Return 0 otherwise. */
+ * return 1 and store its score in target. Return 0 otherwise. The source is
+ * not modified, so that different threads can lookup the same source. */
 int zuiFind(zsetopsrc *op, zsetopval *val, double *score) {
     if (op->subject == NULL)
         return 0;
@@ -2089,10 +2405,19 @@ int zuiFind(zsetopsrc *op, zsetopval *val, double *score) {
             } else {
                 return 0;
             }
+        } else if (op->encoding == OBJ_ENCODING_ROARING) {
+            if (zuiLongLongFromValue(val) &&
+                ((roaring*)op->subject->ptr)->roaringContains(val->ell))
+            {
+                *score = 1.0;
+                return 1;
+            } else {
+                return 0;
+            }
         } else if (op->encoding == OBJ_ENCODING_HT) {
             dict *ht = (dict *)op->subject->ptr;
             zuiSdsFromValue(val);
-            if (ht->dictFind(val->ele) != NULL) {
+            if (ht->dictFindReadOnly(val->ele) != NULL) {
                 *score = 1.0;
                 return 1;
             } else {
@@ -2104,18 +2429,20 @@ int zuiFind(zsetopsrc *op, zsetopval *val, double *score) {
     } else if (op->type == OBJ_ZSET) {
         zuiSdsFromValue(val);
 
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             if (zzlFind((unsigned char *)op->subject->ptr,val->ele,score) != NULL) {
                 /* Score is already set by zzlFind. */
                 return 1;
             } else {
                 return 0;
             }
-        } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
+        } else if (op->encoding == OBJ_ENCODING_SKIPLIST ||
+                   op->encoding == OBJ_ENCODING_BTREE)
+        {
             zset *zs = (zset *)op->subject->ptr;
             dictEntry *de;
-            if ((de = zs->_dict->dictFind(val->ele)) != NULL) {
-                *score = *(double*)de->dictGetVal();
+            if ((de = zs->_dict->dictFindReadOnly(val->ele)) != NULL) {
+                *score = zsetDictScore(zs,de);
                 return 1;
             } else {
                 return 0;
@@ -2169,17 +2496,240 @@ dictType setAccumulatorDictType = {
     NULL                       /* val destructor */
 };
 
+/* ZUNIONSTORE and ZINTERSTORE split the elements of the result into
+ * partitions by a hash of the element: the partitions are disjoint, so the
+ * scores of the elements of every partition are aggregated independently.
+ * When the inputs have at least set-algebra-parallel-threshold elements in
+ * total, the set-algebra-threads partitions are computed at the same time by
+ * as many threads, that read the inputs with private iterators and with
+ * lookups that don't modify them, while the main thread waits. Every
+ * partition ends with its pairs sorted, so that the main thread only merges
+ * them to bulk load the destination. */
+
+struct zunionInterJob {
+    zsetopsrc *src;
+    long setnum;
+    int op;
+    int aggregate;
+    int partitions;
+};
+
+struct zunionInterPartition {
+    zunionInterJob *job;
+    int id;
+    zskiplistPair *pairs;       /* Sorted pairs of the partition. */
+    unsigned long count;
+    unsigned long capacity;
+    unsigned int maxelelen;     /* Longest element of the partition. */
+};
+
+/* Return the partition of the value. The high bits of the hash are used,
+ * since the low ones select the buckets of the dicts of the partitions. */
+static int zuiValuePartition(zsetopval *val, int partitions) {
+    if (partitions == 1) return 0;
+    zuiBufferFromValue(val);
+    return (int)((dictGenHashFunction(val->estr,val->elen) >> 32) % partitions);
+}
+
+static void zunionInterAddPair(zunionInterPartition *p, double score, sds ele) {
+    if (p->count == p->capacity) {
+        p->capacity = p->capacity ? p->capacity*2 : 256;
+        p->pairs = (zskiplistPair*)
+            zrealloc(p->pairs,sizeof(zskiplistPair)*p->capacity);
+    }
+    p->pairs[p->count].score = score;
+    p->pairs[p->count].ele = ele;
+    p->count++;
+    if (sdslen(ele) > p->maxelelen) p->maxelelen = sdslen(ele);
+}
+
+static void *zunionInterPartitionMain(void *arg) {
+    zunionInterPartition *p = (zunionInterPartition*)arg;
+    zunionInterJob *job = p->job;
+    long setnum = job->setnum, i, j;
+    int aggregate = job->aggregate;
+    zsetopval zval;
+    double score, value;
+
+    /* Private copy of the inputs, for the iterators. */
+    zsetopsrc *src = (zsetopsrc*)zmalloc(sizeof(zsetopsrc)*setnum);
+    memcpy(src,job->src,sizeof(zsetopsrc)*setnum);
+    memset(&zval,0,sizeof(zval));
+
+    if (job->op == SET_OP_INTER) {
+        /* Skip everything if the smallest input is empty. */
+        if (zuiLength(&src[0]) > 0) {
+            /* Precondition: as src[0] is non-empty and the inputs are ordered
+             * by size, all src[i > 0] are non-empty too. */
+            zuiInitIterator(&src[0]);
+            while (zuiNext(&src[0],&zval)) {
+                if (zuiValuePartition(&zval,job->partitions) != p->id)
+                    continue;
+
+                score = src[0].weight * zval.score;
+                if (isnan(score)) score = 0;
+
+                for (j = 1; j < setnum; j++) {
+                    /* It is not safe to access the zset we are
+                     * iterating, so explicitly check for equal object. */
+                    if (src[j].subject == src[0].subject) {
+                        value = zval.score*src[j].weight;
+                        score = zunionInterAggregate(score,value,aggregate);
+                    } else if (zuiFind(&src[j],&zval,&value)) {
+                        value *= src[j].weight;
+                        score = zunionInterAggregate(score,value,aggregate);
+                    } else {
+                        break;
+                    }
+                }
+
+                /* Only continue when present in every input. */
+                if (j == setnum)
+                    zunionInterAddPair(p,score,zuiNewSdsFromValue(&zval));
+            }
+            zuiClearIterator(&src[0]);
+        }
+    } else {
+        dict *accumulator = dictCreate(&setAccumulatorDictType,NULL);
+        dictEntry *de, *existing;
+
+        /* Our union is at least as large as our share of the largest set.
+         * Resize the dictionary ASAP to avoid useless rehashing. */
+        accumulator->dictExpand(zuiLength(&src[setnum-1])/job->partitions);
+
+        /* Create a dictionary of elements -> aggregated-scores by iterating
+         * one sorted set after the other. */
+        for (i = 0; i < setnum; i++) {
+            if (zuiLength(&src[i]) == 0) continue;
+
+            zuiInitIterator(&src[i]);
+            while (zuiNext(&src[i],&zval)) {
+                if (zuiValuePartition(&zval,job->partitions) != p->id)
+                    continue;
+
+                /* Initialize value */
+                score = src[i].weight * zval.score;
+                if (isnan(score)) score = 0;
+
+                /* Search for this element in the accumulating dictionary. */
+                de = accumulator->dictAddRaw(zuiSdsFromValue(&zval),&existing);
+                /* If we don't have it, we need to create a new entry. */
+                if (!existing) {
+                    /* Update the element with its initial score. */
+                    accumulator->dictSetKey(de, zuiNewSdsFromValue(&zval));
+                    de->dictSetDoubleVal(score);
+                } else {
+                    /* Update the score with the score of the new instance
+                     * of the element found in the current sorted set. */
+                    existing->dictSetDoubleVal(zunionInterAggregate(existing->dictGetDoubleVal(), score, aggregate));
+                }
+            }
+            zuiClearIterator(&src[i]);
+        }
+
+        /* The elements are moved from the dictionary to the pairs. */
+        {
+            dictIterator di(accumulator);
+            while((de = di.dictNext()) != NULL)
+                zunionInterAddPair(p,de->dictGetDoubleVal(),(sds)de->dictGetKey());
+        }
+        dictRelease(accumulator);
+    }
+
+    qsort(p->pairs,p->count,sizeof(zskiplistPair),zslPairCompare);
+    zfree(src);
+    return NULL;
+}
+
+/* Return the sorted set resulting from the union or intersection of the
+ * 'setnum' inputs, storing in *maxelelen the length of its longest element. */
+static robj *zunionInterCompute(zsetopsrc *src, long setnum, int op,
+                                int aggregate, unsigned int *maxelelen)
+{
+    zunionInterJob job;
+    zunionInterPartition parts[SET_ALGEBRA_MAX_THREADS];
+    pthread_t tids[SET_ALGEBRA_MAX_THREADS];
+    unsigned long long inputs = 0;
+    unsigned long count = 0, pos[SET_ALGEBRA_MAX_THREADS], k;
+    zskiplistPair *pairs;
+    int created = 0, j;
+
+    for (j = 0; j < setnum; j++) inputs += zuiLength(&src[j]);
+    job.src = src;
+    job.setnum = setnum;
+    job.op = op;
+    job.aggregate = aggregate;
+    job.partitions = inputs >= server.set_algebra_parallel_threshold ?
+                     server.set_algebra_threads : 1;
+
+    for (j = 0; j < job.partitions; j++) {
+        parts[j].job = &job;
+        parts[j].id = j;
+        parts[j].pairs = NULL;
+        parts[j].count = 0;
+        parts[j].capacity = 0;
+        parts[j].maxelelen = 0;
+        pos[j] = 0;
+    }
+    for (j = 1; j < job.partitions; j++) {
+        if (pthread_create(&tids[j-1],NULL,zunionInterPartitionMain,
+                           &parts[j]) != 0)
+        {
+            serverLog(LL_WARNING,"Can't create set algebra thread: %s", strerror(errno));
+            break;
+        }
+        created++;
+    }
+    /* The partitions without a thread are computed by the main thread. */
+    zunionInterPartitionMain(&parts[0]);
+    for (j = created+1; j < job.partitions; j++)
+        zunionInterPartitionMain(&parts[j]);
+    for (j = 0; j < created; j++) pthread_join(tids[j],NULL);
+
+    *maxelelen = 0;
+    for (j = 0; j < job.partitions; j++) {
+        count += parts[j].count;
+        if (parts[j].maxelelen > *maxelelen) *maxelelen = parts[j].maxelelen;
+    }
+
+    /* Merge the sorted partitions. */
+    if (job.partitions == 1) {
+        pairs = parts[0].pairs;
+    } else {
+        pairs = (zskiplistPair*)zmalloc(sizeof(zskiplistPair)*count);
+        for (k = 0; k < count; k++) {
+            int best = -1;
+            for (j = 0; j < job.partitions; j++) {
+                if (pos[j] == parts[j].count) continue;
+                if (best == -1 ||
+                    zslPairCompare(&parts[j].pairs[pos[j]],
+                                   &parts[best].pairs[pos[best]]) < 0)
+                {
+                    best = j;
+                }
+            }
+            pairs[k] = parts[best].pairs[pos[best]++];
+        }
+        for (j = 0; j < job.partitions; j++) zfree(parts[j].pairs);
+    }
+
+    /* We now are aware of the final size of the resulting sorted set, so the
+     * dictionary is created with the right size, and a big enough result is
+     * directly created as a B+tree. */
+    robj *dstobj = count > server.zset_max_skiplist_entries ?
+                   createZsetBtreeObject() : createZsetObject();
+    serverAssert(zsetLoadSortedPairs((zset *)dstobj->ptr,pairs,count) == C_OK);
+    zfree(pairs);
+    return dstobj;
+}
+
 void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
     int i, j;
     long setnum;
     int aggregate = REDIS_AGGR_SUM;
     zsetopsrc *src;
-    zsetopval zval;
-    sds tmp;
     unsigned int maxelelen = 0;
     robj *dstobj;
-    zset *dstzset;
-    zskiplistNode *znode;
     int touched = 0;
 
     /* expect setnum input keys to be given */
@@ -2199,12 +2749,11 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
     }
 
     /* read keys to be used for input */
-    src = (zsetopsrc *)zcalloc(sizeof(zsetopsrc) * setnum);
+    src = (zsetopsrc *)zarena_calloc(sizeof(zsetopsrc) * setnum);
     for (i = 0, j = 3; i < setnum; i++, j++) {
         robj *obj = lookupKeyWrite(c->m_cur_selected_db,c->m_argv[j]);
         if (obj != NULL) {
             if (obj->type != OBJ_ZSET && obj->type != OBJ_SET) {
-                zfree(src);
                 c->addReply(shared.wrongtypeerr);
                 return;
             }
@@ -2233,7 +2782,6 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
                     if (getDoubleFromObjectOrReply(c,c->m_argv[j],&src[i].weight,
                             "weight value is not a float") != C_OK)
                     {
-                        zfree(src);
                         return;
                     }
                 }
@@ -2248,13 +2796,11 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
                 } else if (!strcasecmp((const char*)c->m_argv[j]->ptr,"max")) {
                     aggregate = REDIS_AGGR_MAX;
                 } else {
-                    zfree(src);
                     c->addReply(shared.syntaxerr);
                     return;
                 }
                 j++; remaining--;
             } else {
-                zfree(src);
                 c->addReply(shared.syntaxerr);
                 return;
             }
@@ -2265,120 +2811,15 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
      * algorithm's performance */
     qsort(src,setnum,sizeof(zsetopsrc),zuiCompareByCardinality);
 
-    dstobj = createZsetObject();
-    dstzset = (zset *)dstobj->ptr;
-    memset(&zval, 0, sizeof(zval));
-
-    if (op == SET_OP_INTER) {
-        /* Skip everything if the smallest input is empty. */
-        if (zuiLength(&src[0]) > 0) {
-            /* Precondition: as src[0] is non-empty and the inputs are ordered
-             * by size, all src[i > 0] are non-empty too. */
-            zuiInitIterator(&src[0]);
-            while (zuiNext(&src[0],&zval)) {
-                double score, value;
-
-                score = src[0].weight * zval.score;
-                if (isnan(score)) score = 0;
-
-                for (j = 1; j < setnum; j++) {
-                    /* It is not safe to access the zset we are
-                     * iterating, so explicitly check for equal object. */
-                    if (src[j].subject == src[0].subject) {
-                        value = zval.score*src[j].weight;
-                        score = zunionInterAggregate(score,value,aggregate);
-                    } else if (zuiFind(&src[j],&zval,&value)) {
-                        value *= src[j].weight;
-                        score = zunionInterAggregate(score,value,aggregate);
-                    } else {
-                        break;
-                    }
-                }
-
-                /* Only continue when present in every input. */
-                if (j == setnum) {
-                    tmp = zuiNewSdsFromValue(&zval);
-                    znode = dstzset->zsl->zslInsert(score,tmp);
-                    dstzset->_dict->dictAdd(tmp,&znode->score);
-                    if (sdslen(tmp) > maxelelen) maxelelen = sdslen(tmp);
-                }
-            }
-            zuiClearIterator(&src[0]);
-        }
-    } else if (op == SET_OP_UNION) {
-        dict *accumulator = dictCreate(&setAccumulatorDictType,NULL);
-        dictEntry *de, *existing;
-        double score;
-
-        if (setnum) {
-            /* Our union is at least as large as the largest set.
-             * Resize the dictionary ASAP to avoid useless rehashing. */
-            accumulator->dictExpand(zuiLength(&src[setnum-1]));
-        }
-
-        /* Step 1: Create a dictionary of elements -> aggregated-scores
-         * by iterating one sorted set after the other. */
-        for (i = 0; i < setnum; i++) {
-            if (zuiLength(&src[i]) == 0) continue;
-
-            zuiInitIterator(&src[i]);
-            while (zuiNext(&src[i],&zval)) {
-                /* Initialize value */
-                score = src[i].weight * zval.score;
-                if (isnan(score)) score = 0;
-
-                /* Search for this element in the accumulating dictionary. */
-                de = accumulator->dictAddRaw(zuiSdsFromValue(&zval),&existing);
-                /* If we don't have it, we need to create a new entry. */
-                if (!existing) {
-                    tmp = zuiNewSdsFromValue(&zval);
-                    /* Remember the longest single element encountered,
-                     * to understand if it's possible to convert to ziplist
-                     * at the end. */
-                     if (sdslen(tmp) > maxelelen) maxelelen = sdslen(tmp);
-                    /* Update the element with its initial score. */
-                    accumulator->dictSetKey(de, tmp);
-                    de->dictSetDoubleVal(score);
-                } else {
-                    /* Update the score with the score of the new instance
-                     * of the element found in the current sorted set.
-                     *
-                     * Here we access directly the dictEntry double
-                     * value inside the union as it is a big speedup
-                     * compared to using the getDouble/setDouble API.
-                     * C++ed: using getDouble/setDouble these are inline
-                     * so performance degregation is not expected.
-                     * */
-                    existing->dictSetDoubleVal(zunionInterAggregate(existing->dictGetDoubleVal(), score, aggregate));
-                }
-            }
-            zuiClearIterator(&src[i]);
-        }
-
-        /* Step 2: convert the dictionary into the final sorted set. */
-        {
-            dictIterator di(accumulator);
-            /* We now are aware of the final size of the resulting sorted set,
-             * let's resize the dictionary embedded inside the sorted set to the
-             * right size, in order to save rehashing time. */
-            dstzset->_dict->dictExpand(accumulator->dictSize());
-
-            while((de = di.dictNext()) != NULL) {
-                sds ele = (sds)de->dictGetKey();
-                score = de->dictGetDoubleVal();
-                znode = dstzset->zsl->zslInsert(score,ele);
-                dstzset->_dict->dictAdd(ele,&znode->score);
-            }
-        }
-        dictRelease(accumulator);
-    } else {
+    if (op != SET_OP_UNION && op != SET_OP_INTER)
         serverPanic("Unknown operator");
-    }
+    dstobj = zunionInterCompute(src,setnum,op,aggregate,&maxelelen);
 
     if (dbDelete(c->m_cur_selected_db,dstkey))
         touched = 1;
-    if (dstzset->zsl->length()) {
-        zsetConvertToZiplistIfNeeded(dstobj,maxelelen);
+    if (zsetLength(dstobj)) {
+        zsetConvertToListpackIfNeeded(dstobj,maxelelen);
+        zsetConvertToBtreeIfNeeded(dstobj);
         dbAdd(c->m_cur_selected_db,dstkey,dstobj);
         c->addReplyLongLong(zsetLength(dstobj));
         signalModifiedKey(c->m_cur_selected_db,dstkey);
@@ -2395,7 +2836,6 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
             server.dirty++;
         }
     }
-    zfree(src);
 }
 
 void zunionstoreCommand(client *c) {
@@ -2442,11 +2882,14 @@ void zrangeGenericCommand(client *c, int reverse) {
     }
     if (end >= llen) end = llen-1;
     rangelen = (end-start)+1;
+    if (bgreadStart(c,zobj,start,rangelen,
+            (reverse ? BGREAD_REVERSE : 0) |
+            (withscores ? BGREAD_WITHSCORES : 0))) return;
 
     /* Return the result in form of a multi-bulk reply */
     c->addReplyMultiBulkLen( withscores ? (rangelen*2) : rangelen);
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = (unsigned char *)zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -2454,16 +2897,16 @@ void zrangeGenericCommand(client *c, int reverse) {
         long long vlong;
 
         if (reverse)
-            eptr = ziplistIndex(zl,-2-(2*start));
+            eptr = lpSeek(zl,-2-(2*start));
         else
-            eptr = ziplistIndex(zl,2*start);
+            eptr = lpSeek(zl,2*start);
 
         serverAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
 
         while (rangelen--) {
             serverAssertWithInfo(c,zobj,eptr != NULL && sptr != NULL);
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            serverAssertWithInfo(c,zobj,lpGetValue(eptr,&vstr,&vlen,&vlong));
             if (vstr == NULL)
                 c->addReplyBulkLongLong(vlong);
             else
@@ -2503,6 +2946,21 @@ void zrangeGenericCommand(client *c, int reverse) {
                 c->addReplyDouble(ln->score);
             ln = reverse ? ln->backward : ln->level[0].forward;
         }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zbtree *zbt = ((zset *)zobj->ptr)->zbt;
+        zbtCursor cur;
+        sds ele;
+
+        serverAssertWithInfo(c,zobj,zbt->zbtGetElementByRank(
+            reverse ? llen-start : start+1,&cur));
+        while(rangelen--) {
+            ele = zbtCursorEle(&cur);
+            c->addReplyBulkCBuffer(ele,sdslen(ele));
+            if (withscores)
+                c->addReplyDouble(zbtCursorScore(&cur));
+            if (rangelen)
+                serverAssertWithInfo(c,zobj,reverse ? zbtPrev(&cur) : zbtNext(&cur));
+        }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -2516,6 +2974,60 @@ void zrevrangeCommand(client *c) {
     zrangeGenericCommand(c,1);
 }
 
+/* Move the cursor 'offset' elements forward, or backward if 'reverse' is
+ * true, seeking the target rank instead of visiting the skipped elements.
+ * Return 0 if there is no such element. */
+static int zbtSkipByRank(zbtree *zbt, zbtCursor *cur, long offset, int reverse) {
+    unsigned long rank = zbt->zbtGetRank(zbtCursorScore(cur),zbtCursorEle(cur));
+
+    if (offset < 0) return 0;
+    if (reverse) {
+        if ((unsigned long)offset >= rank) return 0;
+        return zbt->zbtGetElementByRank(rank-offset,cur);
+    }
+    return zbt->zbtGetElementByRank(rank+offset,cur);
+}
+
+/* Same as zbtSkipByRank() for the skiplist: the spans give the rank of the
+ * node, and the node at the target rank, in O(log(N)). */
+static zskiplistNode *zslSkipByRank(zskiplist *zsl, zskiplistNode *ln,
+                                    long offset, int reverse)
+{
+    unsigned long rank = zsl->zslGetRank(ln->score,ln->ele);
+
+    if (offset < 0) return NULL;
+    if (reverse) {
+        if ((unsigned long)offset >= rank) return NULL;
+        return zsl->zslGetElementByRank(rank-offset);
+    }
+    if ((unsigned long)offset > zsl->length()-rank) return NULL;
+    return zsl->zslGetElementByRank(rank+offset);
+}
+
+/* Skip 'offset' elements of the listpack, forward or backward if 'reverse'
+ * is true, without looking at the scores: only the entry pointers are
+ * moved, the score pointer is set once at the end. */
+static void zzlSkip(unsigned char *zl, unsigned char **eptr,
+                    unsigned char **sptr, long offset, int reverse)
+{
+    unsigned char *p = *eptr;
+
+    if (offset < 0 || (unsigned long)offset >= zzlLength(zl)) p = NULL;
+    if (reverse) {
+        while (p && offset--) {
+            p = lpPrev(zl,p);
+            if (p) p = lpPrev(zl,p);
+        }
+    } else {
+        while (p && offset--) {
+            p = lpNext(zl,p);
+            if (p) p = lpNext(zl,p);
+        }
+    }
+    *eptr = p;
+    *sptr = p ? lpNext(zl,p) : NULL;
+}
+
 /* This command implements ZRANGEBYSCORE, ZREVRANGEBYSCORE. */
 void genericZrangebyscoreCommand(client *c, int reverse) {
     zrangespec range;
@@ -2571,7 +3083,7 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
     if ((zobj = lookupKeyReadOrReply(c,key,shared.emptymultibulk)) == NULL ||
         checkType(c,zobj,OBJ_ZSET)) return;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = (unsigned char *)zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -2594,22 +3106,16 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
 
         /* Get score pointer for the first element. */
         serverAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
 
         /* We don't know in advance how many matching elements there are in the
          * list, so we push this object that will represent the multi-bulk
          * length in the output buffer, and will "fix" it later */
         replylen = c->addDeferredMultiBulkLength();
 
-        /* If there is an offset, just traverse the number of elements without
+        /* If there is an offset, just skip the number of elements without
          * checking the score because that is done in the next loop. */
-        while (eptr && offset--) {
-            if (reverse) {
-                zzlPrev(zl,&eptr,&sptr);
-            } else {
-                zzlNext(zl,&eptr,&sptr);
-            }
-        }
+        if (offset) zzlSkip(zl,&eptr,&sptr,offset,reverse);
 
         while (eptr && limit--) {
             score = zzlGetScore(sptr);
@@ -2621,8 +3127,8 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
                 if (!zslValueLteMax(score,&range)) break;
             }
 
-            /* We know the element exists, so ziplistGet should always succeed */
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            /* We know the element exists, so lpGetValue should always succeed */
+            serverAssertWithInfo(c,zobj,lpGetValue(eptr,&vstr,&vlen,&vlong));
 
             rangelen++;
             if (vstr == NULL) {
@@ -2665,15 +3171,9 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
          * length in the output buffer, and will "fix" it later */
         replylen = c->addDeferredMultiBulkLength();
 
-        /* If there is an offset, just traverse the number of elements without
+        /* If there is an offset, jump to the element at its rank without
          * checking the score because that is done in the next loop. */
-        while (ln && offset--) {
-            if (reverse) {
-                ln = ln->backward;
-            } else {
-                ln = ln->level[0].forward;
-            }
-        }
+        if (offset) ln = zslSkipByRank(zsl,ln,offset,reverse);
 
         while (ln && limit--) {
             /* Abort when the node is no longer in range. */
@@ -2697,6 +3197,54 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
                 ln = ln->level[0].forward;
             }
         }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zbtree *zbt = ((zset *)zobj->ptr)->zbt;
+        zbtCursor cur;
+        int valid;
+
+        /* If reversed, get the last element in range as starting point. */
+        if (reverse) {
+            valid = zbt->zbtLastInRange(&range,&cur);
+        } else {
+            valid = zbt->zbtFirstInRange(&range,&cur);
+        }
+
+        /* No "first" element in the specified interval. */
+        if (!valid) {
+            c->addReply( shared.emptymultibulk);
+            return;
+        }
+
+        /* We don't know in advance how many matching elements there are in the
+         * list, so we push this object that will represent the multi-bulk
+         * length in the output buffer, and will "fix" it later */
+        replylen = c->addDeferredMultiBulkLength();
+
+        /* Unlike the skiplist, the tree can skip the offset by rank without
+         * traversing the elements. */
+        if (offset) valid = zbtSkipByRank(zbt,&cur,offset,reverse);
+
+        while (valid && limit--) {
+            double score = zbtCursorScore(&cur);
+            sds ele = zbtCursorEle(&cur);
+
+            /* Abort when the element is no longer in range. */
+            if (reverse) {
+                if (!zslValueGteMin(score,&range)) break;
+            } else {
+                if (!zslValueLteMax(score,&range)) break;
+            }
+
+            rangelen++;
+            c->addReplyBulkCBuffer(ele,sdslen(ele));
+
+            if (withscores) {
+                c->addReplyDouble(score);
+            }
+
+            /* Move to next element */
+            valid = reverse ? zbtPrev(&cur) : zbtNext(&cur);
+        }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -2732,7 +3280,7 @@ void zcountCommand(client *c) {
     if ((zobj = lookupKeyReadOrReply(c, key, shared.czero)) == NULL ||
         checkType(c, zobj, OBJ_ZSET)) return;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = (unsigned char *)zobj->ptr;
         unsigned char *eptr, *sptr;
         double score;
@@ -2747,7 +3295,7 @@ void zcountCommand(client *c) {
         }
 
         /* First element is in range */
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         score = zzlGetScore(sptr);
         serverAssertWithInfo(c,zobj,zslValueLteMax(score,&range));
 
@@ -2786,6 +3334,18 @@ void zcountCommand(client *c) {
                 count -= (zsl->length() - rank);
             }
         }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zbtree *zbt = ((zset *)zobj->ptr)->zbt;
+        zbtCursor first, last;
+
+        /* The count is the difference of the ranks of the first and of the
+         * last elements in range. */
+        if (zbt->zbtFirstInRange(&range,&first) &&
+            zbt->zbtLastInRange(&range,&last))
+        {
+            count = zbt->zbtGetRank(zbtCursorScore(&last),zbtCursorEle(&last)) -
+                    zbt->zbtGetRank(zbtCursorScore(&first),zbtCursorEle(&first)) + 1;
+        }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -2813,7 +3373,7 @@ void zlexcountCommand(client *c) {
         return;
     }
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = (unsigned char *)zobj->ptr;
         unsigned char *eptr, *sptr;
 
@@ -2828,7 +3388,7 @@ void zlexcountCommand(client *c) {
         }
 
         /* First element is in range */
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssertWithInfo(c,zobj,zzlLexValueLteMax(eptr,&range));
 
         /* Iterate over elements in range */
@@ -2864,6 +3424,18 @@ void zlexcountCommand(client *c) {
                 count -= (zsl->length() - rank);
             }
         }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zbtree *zbt = ((zset *)zobj->ptr)->zbt;
+        zbtCursor first, last;
+
+        /* The count is the difference of the ranks of the first and of the
+         * last elements in range. */
+        if (zbt->zbtFirstInLexRange(&range,&first) &&
+            zbt->zbtLastInLexRange(&range,&last))
+        {
+            count = zbt->zbtGetRank(zbtCursorScore(&last),zbtCursorEle(&last)) -
+                    zbt->zbtGetRank(zbtCursorScore(&first),zbtCursorEle(&first)) + 1;
+        }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -2923,7 +3495,7 @@ void genericZrangebylexCommand(client *c, int reverse) {
         return;
     }
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = (unsigned char *)zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -2946,22 +3518,16 @@ void genericZrangebylexCommand(client *c, int reverse) {
 
         /* Get score pointer for the first element. */
         serverAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
 
         /* We don't know in advance how many matching elements there are in the
          * list, so we push this object that will represent the multi-bulk
          * length in the output buffer, and will "fix" it later */
         replylen = c->addDeferredMultiBulkLength();
 
-        /* If there is an offset, just traverse the number of elements without
+        /* If there is an offset, just skip the number of elements without
          * checking the score because that is done in the next loop. */
-        while (eptr && offset--) {
-            if (reverse) {
-                zzlPrev(zl,&eptr,&sptr);
-            } else {
-                zzlNext(zl,&eptr,&sptr);
-            }
-        }
+        if (offset) zzlSkip(zl,&eptr,&sptr,offset,reverse);
 
         while (eptr && limit--) {
             /* Abort when the node is no longer in range. */
@@ -2971,9 +3537,9 @@ void genericZrangebylexCommand(client *c, int reverse) {
                 if (!zzlLexValueLteMax(eptr,&range)) break;
             }
 
-            /* We know the element exists, so ziplistGet should always
+            /* We know the element exists, so lpGetValue should always
              * succeed. */
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            serverAssertWithInfo(c,zobj,lpGetValue(eptr,&vstr,&vlen,&vlong));
 
             rangelen++;
             if (vstr == NULL) {
@@ -3013,15 +3579,9 @@ void genericZrangebylexCommand(client *c, int reverse) {
          * length in the output buffer, and will "fix" it later */
         replylen = c->addDeferredMultiBulkLength();
 
-        /* If there is an offset, just traverse the number of elements without
+        /* If there is an offset, jump to the element at its rank without
          * checking the score because that is done in the next loop. */
-        while (ln && offset--) {
-            if (reverse) {
-                ln = ln->backward;
-            } else {
-                ln = ln->level[0].forward;
-            }
-        }
+        if (offset) ln = zslSkipByRank(zsl,ln,offset,reverse);
 
         while (ln && limit--) {
             /* Abort when the node is no longer in range. */
@@ -3041,6 +3601,48 @@ void genericZrangebylexCommand(client *c, int reverse) {
                 ln = ln->level[0].forward;
             }
         }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zbtree *zbt = ((zset *)zobj->ptr)->zbt;
+        zbtCursor cur;
+        int valid;
+
+        /* If reversed, get the last element in range as starting point. */
+        if (reverse) {
+            valid = zbt->zbtLastInLexRange(&range,&cur);
+        } else {
+            valid = zbt->zbtFirstInLexRange(&range,&cur);
+        }
+
+        /* No "first" element in the specified interval. */
+        if (!valid) {
+            c->addReply( shared.emptymultibulk);
+            zslFreeLexRange(&range);
+            return;
+        }
+
+        /* We don't know in advance how many matching elements there are in the
+         * list, so we push this object that will represent the multi-bulk
+         * length in the output buffer, and will "fix" it later */
+        replylen = c->addDeferredMultiBulkLength();
+
+        if (offset) valid = zbtSkipByRank(zbt,&cur,offset,reverse);
+
+        while (valid && limit--) {
+            sds ele = zbtCursorEle(&cur);
+
+            /* Abort when the element is no longer in range. */
+            if (reverse) {
+                if (!zslLexValueGteMin(ele,&range)) break;
+            } else {
+                if (!zslLexValueLteMax(ele,&range)) break;
+            }
+
+            rangelen++;
+            c->addReplyBulkCBuffer(ele,sdslen(ele));
+
+            /* Move to next element */
+            valid = reverse ? zbtPrev(&cur) : zbtNext(&cur);
+        }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -0,0 +1,621 @@
+/* Tiering of the cold values to a file.
+ *
+ * With "tiering yes" the eviction, instead of deleting the key selected by
+ * the maxmemory policy, moves its value to a file on local storage and
+ * leaves in the keyspace a placeholder: the same OBJ_ENCODING_LAZY object
+ * of lazyload.cpp, flagged LAZY_TIERED, referencing the record of the value
+ * in the file. The key, its TTL and its type stay in memory, only the value
+ * is moved, so that the dataset can be larger than the memory while the
+ * hot keys are still served from memory.
+ *
+ * A record is the 32 bit length of the rest of the record, the RDB type and
+ * the value serialized as in the RDB file. The RDB and AOF rewrite children
+ * copy the record in the snapshot without loading the value.
+ *
+ * A placeholder accessed by a command is loaded in place, as the lazy
+ * values are, but reading the file would block the server: the clients
+ * sending commands about tiered keys are blocked instead (BLOCKED_TIER)
+ * while a reader thread reads the records, and the command is executed once
+ * all the values are in memory. The replication link, the scripts and the
+ * modules still read the values synchronously.
+ *
+ * The records of the values loaded back or deleted are just not referenced
+ * anymore. The file is truncated when no record is referenced, otherwise
+ * when most of the records are garbage the live ones are moved by serverCron
+ * to a new file, the next generation, and the old file is closed. The files
+ * are unlinked as soon as they are created: nothing is left behind by a
+ * crash, and the values are not persistent across restarts, the RDB and AOF
+ * files are.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "tier.h"
+#include "lazyload.h"
+#include "atomicvar.h"
+#include <fcntl.h>
+
+#define tierGen(ref) (((ref) & LAZY_TIER_GEN) ? 1 : 0)
+#define tierOffset(ref) ((off_t)((ref) >> LAZY_TYPE_BITS))
+
+/* A record read by the reader thread. */
+struct tierRead {
+    robj *o;            /* Placeholder, a reference is held. */
+    uintptr_t ref;      /* Record read. */
+    int fd;             /* File of the record. */
+    sds data;           /* RDB type and value read, NULL on error. */
+    int error;          /* errno of the read failed. */
+    list *clients;      /* Clients waiting for the value. */
+};
+
+static struct {
+    int fd[2];                      /* Files of the generations, or -1. */
+    off_t size[2];                  /* Bytes written to the files. */
+    unsigned long long records[2];  /* Records written to the files. */
+    unsigned long long live[2];     /* Records still referenced. */
+    int reading[2];                 /* Reads in flight. */
+    int gen;                        /* Generation of the new records. */
+    int compacting;                 /* Moving the records of !gen to gen. */
+    int dbid;                       /* Position of the compaction scan. */
+    unsigned long cursor;
+    unsigned long long stores, loads, async_loads, compactions;
+
+    /* Reader thread. */
+    int started;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    list *todo;                     /* Reads queued, under the mutex. */
+    list *done;                     /* Reads completed, under the mutex. */
+    list *inflight;                 /* Reads not completed yet. */
+    int notify_pipe[2];
+} tier = {{-1,-1}};
+
+/* Log the error of the last call failed, at most once a minute: the writes
+ * are retried at every eviction. */
+static void tierLogError(const char *msg) {
+    static time_t last_error = 0;
+    int error = errno;
+
+    if (server.unixtime-last_error < 60) return;
+    last_error = server.unixtime;
+    serverLog(LL_WARNING,"%s: %s", msg, strerror(error));
+}
+
+/* Read or write exactly 'len' bytes at 'offset'. Return 0 on success, -1 on
+ * error with errno set. */
+static int tierPread(int fd, void *buf, size_t len, off_t offset) {
+    while (len) {
+        ssize_t n = pread(fd,buf,len,offset);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            return -1;
+        }
+        buf = (char*)buf+n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int tierPwrite(int fd, const void *buf, size_t len, off_t offset) {
+    while (len) {
+        ssize_t n = pwrite(fd,buf,len,offset);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0) errno = ENOSPC;
+            return -1;
+        }
+        buf = (const char*)buf+n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/* Create the file of the generation 'gen', unlinked right away. */
+static int tierOpenFile(int gen) {
+    char path[PATH_MAX];
+    int fd;
+
+    snprintf(path,sizeof(path),"%s/temp-tier-%d-%d.dat",
+        server.tiering_dir,(int)getpid(),gen);
+    if ((fd = open(path,O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC,0600)) == -1)
+        return C_ERR;
+    unlink(path);
+    tier.fd[gen] = fd;
+    tier.size[gen] = 0;
+    tier.records[gen] = 0;
+    atomicSet(tier.live[gen],0);
+    return C_OK;
+}
+
+/* Append the record 'rec', whose first 4 bytes are reserved to the length,
+ * to the file of the current generation. Returns the reference of the
+ * record, of RDB type 'rdbtype', or 0 on error. */
+static uintptr_t tierAppend(sds rec, int rdbtype) {
+    int gen = tier.gen;
+    off_t offset = tier.size[gen];
+    uint32_t len = sdslen(rec)-sizeof(len);
+
+    /* The offset must fit the reference, a limit on 32 bit systems. */
+    if ((uintmax_t)offset > (UINTPTR_MAX >> LAZY_TYPE_BITS)) return 0;
+    if (tier.fd[gen] == -1 && tierOpenFile(gen) == C_ERR) {
+        tierLogError("Can't create the tiering file");
+        return 0;
+    }
+    memrev32ifbe(&len);
+    memcpy(rec,&len,sizeof(len));
+    if (tierPwrite(tier.fd[gen],rec,sdslen(rec),offset) == -1) {
+        tierLogError("Can't write to the tiering file");
+        return 0;
+    }
+    tier.size[gen] += sdslen(rec);
+    tier.records[gen]++;
+    atomicIncr(tier.live[gen],1);
+    return ((uintptr_t)offset << LAZY_TYPE_BITS) | LAZY_TIERED |
+           (gen ? LAZY_TIER_GEN : 0) | rdbtype;
+}
+
+/* Read the RDB type and the value of the record 'ref'. Returns NULL on
+ * error, with errno set. */
+static sds tierReadRecord(int fd, uintptr_t ref) {
+    uint32_t len;
+    sds data;
+
+    if (tierPread(fd,&len,sizeof(len),tierOffset(ref)) == -1) return NULL;
+    memrev32ifbe(&len);
+    data = sdsnewlen(NULL,len);
+    if (tierPread(fd,data,len,tierOffset(ref)+sizeof(len)) == -1) {
+        sdsfree(data);
+        return NULL;
+    }
+    return data;
+}
+
+/* The value is lost: there is nothing better to do than exiting. */
+static void tierReadError(uintptr_t ref, int error) {
+    serverLog(LL_WARNING,"Can't read the value at offset %lld of the "
+        "tiering file: %s. Exiting.", (long long)tierOffset(ref),
+        strerror(error));
+    exit(1);
+}
+
+static robj *tierDecode(sds data, uintptr_t ref) {
+    rioBufferIO rdb(data);
+    robj *val = NULL;
+    int type;
+
+    if ((type = rdbLoadObjectType(&rdb)) == -1 ||
+        (val = rdbLoadObject(type,&rdb)) == NULL)
+        tierReadError(ref,EINVAL);
+    return val;
+}
+
+/* Called by the eviction in place of deleting the key: move the value to
+ * the tiering file, leaving a placeholder. Returns 1 if the value was moved,
+ * otherwise 0 and the key should be evicted. */
+int tierStoreValue(redisDb *db, sds key) {
+    dictEntry *de;
+    robj *o;
+    uintptr_t ref;
+    size_t len;
+
+    if (!server.tiering || server.loading || server.rdb_snapshot) return 0;
+    if ((de = db->m_dict->dictFind(key)) == NULL) return 0;
+    o = (robj*)de->dictGetVal();
+    if (o->refcount != 1 || o->type == OBJ_MODULE ||
+        o->encoding == OBJ_ENCODING_LAZY ||
+        o->encoding == OBJ_ENCODING_EMBSTR ||
+        o->encoding == OBJ_ENCODING_INT) return 0;
+    /* The size of the value itself: the record may be compressed. */
+    len = (o->type == OBJ_STRING) ? stringObjectLen(o) :
+          objectComputeSize(o,OBJ_COMPUTE_SIZE_DEF_SAMPLES);
+    if (len < TIER_MIN_VALUE_BYTES) return 0;
+
+    rioBufferIO rec(sdsnewlen(NULL,sizeof(uint32_t)));
+    if (rdbSaveObjectType(&rec,o) == -1 || rdbSaveObject(&rec,o) == -1) {
+        sdsfree(rec.m_ptr);
+        return 0;
+    }
+    len = sdslen(rec.m_ptr);
+    ref = 0;
+    if (!server.tiering_max_size ||
+        tier.size[0]+tier.size[1]+len <= (unsigned long long)server.tiering_max_size)
+    {
+        ref = tierAppend(rec.m_ptr,(unsigned char)rec.m_ptr[sizeof(uint32_t)]);
+    }
+    sdsfree(rec.m_ptr);
+    if (ref == 0) return 0;
+
+    freeObjectValue(o);
+    o->ptr = (void*)ref;
+    o->encoding = OBJ_ENCODING_LAZY;
+    /* Otherwise the placeholder, still the coldest key, would be evicted
+     * right away. */
+    if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU)
+        o->lru = (LFUGetTimeInMinutes()<<8) | LFU_INIT_VAL;
+    else
+        o->lru = LRU_CLOCK();
+    tier.stores++;
+    return 1;
+}
+
+/* Read the value of the record 'ref', that is not referenced anymore.
+ * Called by lazyLoadValue() with its mutex locked. */
+robj *tierLoadValue(uintptr_t ref) {
+    sds data = tierReadRecord(tier.fd[tierGen(ref)],ref);
+    robj *val;
+
+    if (data == NULL) tierReadError(ref,errno);
+    val = tierDecode(data,ref);
+    sdsfree(data);
+    tierFreeValue(ref);
+    atomicIncr(tier.loads,1);
+    return val;
+}
+
+/* Copy the value of the placeholder 'o' to the RDB file, as rdbSaveObject()
+ * does. Returns the bytes written, -1 on error. With 'rdb' NULL just
+ * computes the length. */
+ssize_t tierSaveValue(rio *rdb, robj *o) {
+    uintptr_t ref = (uintptr_t)o->ptr;
+    sds data = tierReadRecord(tier.fd[tierGen(ref)],ref);
+    ssize_t n;
+
+    if (data == NULL) {
+        serverLog(LL_WARNING,"Can't read the value at offset %lld of the "
+            "tiering file: %s", (long long)tierOffset(ref), strerror(errno));
+        return -1;
+    }
+    /* Skip the RDB type, saved by rdbSaveObjectType(). */
+    n = sdslen(data)-1;
+    if (rdb && rdb->rioWrite(data+1,n) == 0) n = -1;
+    sdsfree(data);
+    return n;
+}
+
+/* The record 'ref' is not referenced anymore. Called by any thread. */
+void tierFreeValue(uintptr_t ref) {
+    atomicDecr(tier.live[tierGen(ref)],1);
+}
+
+/* Used by the processes forked without the server state, to keep the
+ * files open. */
+int tierIsFile(int fd) {
+    return fd != -1 && (fd == tier.fd[0] || fd == tier.fd[1]);
+}
+
+/* ---------------------------- Reader thread ------------------------------ */
+
+static void *tierReaderMain(void *arg) {
+    UNUSED(arg);
+
+    while (1) {
+        pthread_mutex_lock(&tier.mutex);
+        while (tier.todo->listLength() == 0)
+            pthread_cond_wait(&tier.cond,&tier.mutex);
+        listNode *ln = tier.todo->listFirst();
+        tierRead *r = (tierRead*)ln->listNodeValue();
+        tier.todo->listDelNode(ln);
+        pthread_mutex_unlock(&tier.mutex);
+
+        if ((r->data = tierReadRecord(r->fd,r->ref)) == NULL) r->error = errno;
+
+        pthread_mutex_lock(&tier.mutex);
+        tier.done->listAddNodeTail(r);
+        pthread_mutex_unlock(&tier.mutex);
+        if (write(tier.notify_pipe[1],"T",1) != 1) {
+            /* Ignore the error, the event loop is awake anyway. */
+        }
+    }
+    return NULL;
+}
+
+/* Convert the placeholder, unless it was loaded or deleted meanwhile, and
+ * execute the commands of the clients that have all their values. */
+static void tierCompleteRead(tierRead *r) {
+    robj *o = r->o;
+    listNode *ln;
+
+    if (r->data == NULL) tierReadError(r->ref,r->error);
+    if (o->refcount > 1 && o->encoding == OBJ_ENCODING_LAZY &&
+        (uintptr_t)o->ptr == r->ref)
+    {
+        robj *val = tierDecode(r->data,r->ref);
+        if (lazyLoadConvert(o,r->ref,val)) {
+            tierFreeValue(r->ref);
+            atomicIncr(tier.loads,1);
+            tier.async_loads++;
+        } else {
+            decrRefCount(val);
+        }
+    }
+    sdsfree(r->data);
+    decrRefCount(o);
+    tier.reading[tierGen(r->ref)]--;
+    tier.inflight->listDelNode(tier.inflight->listSearchKey(r));
+
+    while ((ln = r->clients->listFirst()) != NULL) {
+        client *c = (client*)ln->listNodeValue();
+        r->clients->listDelNode(ln);
+        if (--c->m_blocking_state.m_tier_reads == 0) {
+            c->m_blocking_state.m_rerun = 1;
+            c->unblockClient();
+        }
+    }
+    listRelease(r->clients);
+    zfree(r);
+}
+
+static void tierReadDoneHandler(aeEventLoop *el, int fd, void *privdata,
+                                int mask)
+{
+    char buf[64];
+    listNode *ln;
+    list *done;
+    UNUSED(el);
+    UNUSED(privdata);
+    UNUSED(mask);
+
+    while (read(fd,buf,sizeof(buf)) > 0);
+    pthread_mutex_lock(&tier.mutex);
+    done = tier.done;
+    tier.done = listCreate();
+    pthread_mutex_unlock(&tier.mutex);
+
+    while ((ln = done->listFirst()) != NULL) {
+        tierRead *r = (tierRead*)ln->listNodeValue();
+        done->listDelNode(ln);
+        tierCompleteRead(r);
+    }
+    listRelease(done);
+}
+
+static void tierStartReader() {
+    tier.todo = listCreate();
+    tier.done = listCreate();
+    tier.inflight = listCreate();
+    pthread_mutex_init(&tier.mutex,NULL);
+    pthread_cond_init(&tier.cond,NULL);
+    if (pipe(tier.notify_pipe) == -1 ||
+        anetNonBlock(NULL,tier.notify_pipe[0]) != ANET_OK ||
+        anetNonBlock(NULL,tier.notify_pipe[1]) != ANET_OK ||
+        server.el->aeCreateFileEvent(tier.notify_pipe[0],AE_READABLE,
+            tierReadDoneHandler,NULL) == AE_ERR ||
+        pthread_create(&tier.thread,NULL,tierReaderMain,NULL) != 0)
+    {
+        serverLog(LL_WARNING,"Can't start the tiering reader thread: %s",
+            strerror(errno));
+        exit(1);
+    }
+    tier.started = 1;
+}
+
+/* Queue the read of the placeholder 'o', unless it is already in flight. */
+static tierRead *tierQueueRead(robj *o) {
+    uintptr_t ref = (uintptr_t)o->ptr;
+    tierRead *r;
+    listNode *ln;
+
+    if (!tier.started) tierStartReader();
+    listIter li(tier.inflight);
+    while ((ln = li.listNext())) {
+        r = (tierRead*)ln->listNodeValue();
+        if (r->o == o && r->ref == ref) return r;
+    }
+
+    r = (tierRead*)zmalloc(sizeof(*r));
+    incrRefCount(o);
+    r->o = o;
+    r->ref = ref;
+    r->fd = tier.fd[tierGen(ref)];
+    r->data = NULL;
+    r->error = 0;
+    r->clients = listCreate();
+    tier.reading[tierGen(ref)]++;
+    tier.inflight->listAddNodeTail(r);
+
+    pthread_mutex_lock(&tier.mutex);
+    tier.todo->listAddNodeTail(r);
+    pthread_cond_signal(&tier.cond);
+    pthread_mutex_unlock(&tier.mutex);
+    return r;
+}
+
+/* Called by processCommand() before executing the command: if some of its
+ * keys are placeholders, block the client while the reader thread reads the
+ * values, and return 1. The command is executed again once the values are
+ * loaded, without blocking again, see processUnblockedClients(). */
+int tierBlockClientIfNeeded(client *c) {
+    unsigned long long live[2];
+    int numkeys, reads = 0;
+    int *keys;
+
+    atomicGet(tier.live[0],live[0]);
+    atomicGet(tier.live[1],live[1]);
+    if (live[0]+live[1] == 0 || c->m_fd == -1 ||
+        c->m_flags & CLIENT_MASTER || c->m_blocking_state.m_rerun)
+        return 0;
+
+    keys = getKeysFromCommand(c->m_cmd,c->m_argv,c->m_argc,&numkeys);
+    for (int j = 0; j < numkeys; j++) {
+        dictEntry *de = c->m_cur_selected_db->m_dict->dictFind(
+            c->m_argv[keys[j]]->ptr);
+        robj *o;
+
+        if (de == NULL) continue;
+        o = (robj*)de->dictGetVal();
+        if (o->encoding != OBJ_ENCODING_LAZY || !lazyIsTiered(o)) continue;
+
+        tierRead *r = tierQueueRead(o);
+        if (r->clients->listSearchKey(c)) continue; /* Same key twice. */
+        r->clients->listAddNodeTail(c);
+        reads++;
+    }
+    getKeysFreeResult(keys);
+    if (reads == 0) return 0;
+
+    c->m_blocking_state.m_timeout = 0;
+    c->m_blocking_state.m_tier_reads = reads;
+    blockClient(c,BLOCKED_TIER);
+    return 1;
+}
+
+/* Called by unblockClient(): the client is not waiting anymore for the
+ * reads in flight, that still complete. */
+void unblockClientFromTier(client *c) {
+    listNode *ln;
+
+    listIter li(tier.inflight);
+    while ((ln = li.listNext())) {
+        tierRead *r = (tierRead*)ln->listNodeValue();
+        listNode *cn = r->clients->listSearchKey(c);
+        if (cn) r->clients->listDelNode(cn);
+    }
+    c->m_blocking_state.m_tier_reads = 0;
+}
+
+/* ------------------------------ Compaction ------------------------------- */
+
+/* Move the record of the placeholder from the old generation to the
+ * current one. */
+static void tierCompactCallback(void *privdata, const dictEntry *de) {
+    int from = *(int*)privdata;
+    robj *o = (robj*)de->dictGetVal();
+    uintptr_t ref, newref;
+    sds data, rec;
+
+    if (o->encoding != OBJ_ENCODING_LAZY) return;
+    ref = (uintptr_t)o->ptr;
+    if (!(ref & LAZY_TIERED) || tierGen(ref) != from) return;
+
+    if ((data = tierReadRecord(tier.fd[from],ref)) == NULL)
+        tierReadError(ref,errno);
+    rec = sdscatsds(sdsnewlen(NULL,sizeof(uint32_t)),data);
+    newref = tierAppend(rec,ref & LAZY_RDBTYPE_MASK);
+    if (newref) {
+        if (lazyLoadMove(o,ref,newref)) tierFreeValue(ref);
+        else tierFreeValue(newref);
+    }
+    sdsfree(data);
+    sdsfree(rec);
+}
+
+/* Called by serverCron(): truncate the file when no record is referenced,
+ * otherwise when most of the records are garbage move the live ones to the
+ * file of the other generation, a bit at every call, and close the old file
+ * once done. Nothing is done while a child reads the files. */
+void tierCron() {
+    unsigned long long live[2];
+    long long start, timelimit;
+    int gen = tier.gen, from = !tier.gen;
+
+    if (tier.fd[gen] == -1) return;
+    if (server.rdb_child_pid != -1 || server.aof_child_pid != -1) return;
+    atomicGet(tier.live[0],live[0]);
+    atomicGet(tier.live[1],live[1]);
+
+    if (!tier.compacting) {
+        if (tier.size[gen] && live[gen] == 0 && tier.reading[gen] == 0) {
+            if (ftruncate(tier.fd[gen],0) == 0) {
+                tier.size[gen] = 0;
+                tier.records[gen] = 0;
+            }
+            return;
+        }
+        if (tier.size[gen] < TIER_COMPACT_MIN_BYTES ||
+            live[gen]*2 >= tier.records[gen]) return;
+        if (tierOpenFile(from) == C_ERR) {
+            tierLogError("Can't create the tiering file");
+            return;
+        }
+        serverLog(LL_NOTICE,"Compacting the tiering file, %llu of %llu "
+            "values are referenced.", live[gen], tier.records[gen]);
+        tier.gen = from;
+        tier.compacting = 1;
+        tier.dbid = 0;
+        tier.cursor = 0;
+        tier.compactions++;
+        return;
+    }
+
+    start = ustime();
+    timelimit = 1000000*TIER_CPU_PERCENT/server.hz/100;
+    if (timelimit <= 0) timelimit = 1;
+    while (tier.dbid < server.dbnum && ustime()-start < timelimit) {
+        redisDb *db = server.db+tier.dbid;
+        tier.cursor = db->m_dict->dictScan(tier.cursor,
+            tierCompactCallback,NULL,&from);
+        if (tier.cursor == 0) tier.dbid++;
+    }
+    if (tier.dbid < server.dbnum) return;
+
+    /* A full pass is done. The records still referenced are of values not
+     * freed yet, or of keys moved by SWAPDB during the scan: scan again. */
+    atomicGet(tier.live[from],live[from]);
+    if (live[from] != 0) {
+        tier.dbid = 0;
+        return;
+    }
+    if (tier.reading[from]) return;
+    close(tier.fd[from]);
+    tier.fd[from] = -1;
+    tier.size[from] = 0;
+    tier.records[from] = 0;
+    tier.compacting = 0;
+}
+
+sds genTierInfoString(sds info) {
+    unsigned long long live[2], loads;
+
+    atomicGet(tier.live[0],live[0]);
+    atomicGet(tier.live[1],live[1]);
+    atomicGet(tier.loads,loads);
+    return sdscatprintf(info,
+        "tiering:%d\r\n"
+        "tiering_values:%llu\r\n"
+        "tiering_file_bytes:%lld\r\n"
+        "tiering_stores:%llu\r\n"
+        "tiering_loads:%llu\r\n"
+        "tiering_async_loads:%llu\r\n"
+        "tiering_compactions:%llu\r\n"
+        "tiering_compacting:%d\r\n",
+        server.tiering,
+        live[0]+live[1],
+        (long long)(tier.size[0]+tier.size[1]),
+        tier.stores,
+        loads,
+        tier.async_loads,
+        tier.compactions,
+        tier.compacting);
+}
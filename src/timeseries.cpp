@@ -0,0 +1,616 @@
+/* timeseries.cpp - Compressed time series.
+ *
+ * A time series is a sequence of (timestamp, value) samples, appended with
+ * increasing timestamps in milliseconds. Stored in a sorted set each sample
+ * costs about 70 bytes. Here samples are compressed as described in the
+ * Gorilla paper [1], so a regular series uses a couple of bytes per sample:
+ *
+ * * The timestamps are encoded as the difference between two consecutive
+ *   deltas, that is zero for samples taken at a fixed interval, so a single
+ *   bit, otherwise a few bits.
+ * * The values are encoded as the XOR with the previous value, that is
+ *   zero when it didn't change, so a single bit, otherwise only the bits
+ *   between the leading and trailing zeros of the XOR.
+ *
+ * Like the HyperLogLogs no new type is introduced: a time series is a
+ * string starting with a header, so that it is saved in the RDB file and
+ * replicated as any other string. The samples are compressed in chunks of
+ * TS_CHUNK_BYTES bytes, so that a range query finds the first chunk with a
+ * binary search, and decodes only the chunks in range. Every chunk header
+ * holds what is needed to append a sample without decoding the chunk, and
+ * the count, min, max and sum of its samples, so that the aggregation of a
+ * chunk entirely in a bucket doesn't decode it.
+ *
+ * [1] Pelkonen et al: Gorilla: A Fast, Scalable, In-Memory Time Series
+ *     Database.
+ *
+ * The string is composed of a 16 bytes header:
+ *
+ * +------+--------+----------+
+ * | TSER | chunks | count    |
+ * +------+--------+----------+
+ *
+ * With 'chunks' a 32 bit and 'count', the number of samples, a 64 bit
+ * little endian integer. The chunks of TS_CHUNK_BYTES bytes follow, each
+ * one a tschunk header followed by the bits of its samples but the first.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "endianconv.h"
+#include <math.h>
+
+#define TS_CHUNK_BYTES 512
+#define TS_CHUNK_BITS ((TS_CHUNK_BYTES-sizeof(tschunk))*8)
+#define TS_SAMPLE_MAX_BITS (4+64+2+5+6+64) /* Worst timestamp and value. */
+#define TS_CHUNK_MAX_SAMPLES (TS_CHUNK_BITS/2+1) /* At least 2 bits each. */
+#define TS_NO_LEADING 0xff  /* No XOR window yet. */
+
+/* Aggregations of TS.RANGE. */
+#define TS_AGG_NONE 0
+#define TS_AGG_AVG 1
+#define TS_AGG_SUM 2
+#define TS_AGG_MIN 3
+#define TS_AGG_MAX 4
+#define TS_AGG_COUNT 5
+#define TS_AGG_FIRST 6
+#define TS_AGG_LAST 7
+
+struct tshdr {
+    char magic[4];      /* "TSER" */
+    uint8_t chunks[4];  /* Number of chunks. */
+    uint8_t count[8];   /* Number of samples. */
+};
+
+struct tschunk {
+    uint8_t first_ts[8];
+    uint8_t last_ts[8];
+    uint8_t last_delta[8];  /* Between the last two timestamps. */
+    uint8_t first_value[8]; /* Bits of the doubles. */
+    uint8_t last_value[8];
+    uint8_t min[8];
+    uint8_t max[8];
+    uint8_t sum[8];
+    uint8_t count[2];       /* Samples in the chunk. */
+    uint8_t bits[2];        /* Bits used after the header. */
+    uint8_t leading;        /* XOR window of the last value, or */
+    uint8_t trailing;       /* TS_NO_LEADING. */
+    uint8_t notused[2];
+};
+
+static const char *invalid_ts_err = "-WRONGTYPE Key is not a valid "
+                                    "time series string value.\r\n";
+
+/* ============================ Low level API =============================== */
+
+static uint64_t tsGet64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v,p,sizeof(v));
+    memrev64ifbe(&v);
+    return v;
+}
+
+static void tsSet64(uint8_t *p, uint64_t v) {
+    memrev64ifbe(&v);
+    memcpy(p,&v,sizeof(v));
+}
+
+static double tsGetDouble(const uint8_t *p) {
+    uint64_t bits = tsGet64(p);
+    double d;
+    memcpy(&d,&bits,sizeof(d));
+    return d;
+}
+
+static void tsSetDouble(uint8_t *p, double d) {
+    uint64_t bits;
+    memcpy(&bits,&d,sizeof(bits));
+    tsSet64(p,bits);
+}
+
+static uint32_t tsGet16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static void tsSet16(uint8_t *p, uint32_t v) {
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+
+static uint32_t tsChunks(robj *o) {
+    uint32_t v;
+    memcpy(&v,((tshdr*)o->ptr)->chunks,sizeof(v));
+    memrev32ifbe(&v);
+    return v;
+}
+
+static tschunk *tsChunk(robj *o, uint32_t j) {
+    return (tschunk*)((char*)o->ptr+sizeof(tshdr)+(size_t)j*TS_CHUNK_BYTES);
+}
+
+static uint8_t *tsChunkBits(tschunk *c) {
+    return (uint8_t*)(c+1);
+}
+
+/* Append the 'n' low bits of 'v' at the bit 'pos' of 'buf', that is zero
+ * there, the most significant bit first. */
+static void tsWriteBits(uint8_t *buf, uint32_t *pos, uint64_t v, int n) {
+    while (n) {
+        int room = 8-(*pos & 7);
+        int take = n < room ? n : room;
+        uint64_t bits = (v >> (n-take)) & ((1ULL << take)-1);
+
+        buf[*pos >> 3] |= bits << (room-take);
+        *pos += take;
+        n -= take;
+    }
+}
+
+static uint64_t tsReadBits(const uint8_t *buf, uint32_t *pos, int n) {
+    uint64_t v = 0;
+
+    while (n) {
+        int room = 8-(*pos & 7);
+        int take = n < room ? n : room;
+
+        v = (v << take) |
+            ((buf[*pos >> 3] >> (room-take)) & ((1U << take)-1));
+        *pos += take;
+        n -= take;
+    }
+    return v;
+}
+
+/* Sign extend the 'n' low bits of 'v'. */
+static int64_t tsSignExtend(uint64_t v, int n) {
+    return (int64_t)(v << (64-n)) >> (64-n);
+}
+
+/* Append the timestamp as the difference between its delta and the delta
+ * of the previous one. */
+static void tsEncodeTimestamp(uint8_t *buf, uint32_t *pos, int64_t dod) {
+    if (dod == 0) {
+        tsWriteBits(buf,pos,0,1);
+    } else if (dod >= -64 && dod <= 63) {
+        tsWriteBits(buf,pos,2,2);
+        tsWriteBits(buf,pos,(uint64_t)dod,7);
+    } else if (dod >= -256 && dod <= 255) {
+        tsWriteBits(buf,pos,6,3);
+        tsWriteBits(buf,pos,(uint64_t)dod,9);
+    } else if (dod >= -2048 && dod <= 2047) {
+        tsWriteBits(buf,pos,14,4);
+        tsWriteBits(buf,pos,(uint64_t)dod,12);
+    } else {
+        tsWriteBits(buf,pos,15,4);
+        tsWriteBits(buf,pos,(uint64_t)dod,64);
+    }
+}
+
+static int64_t tsDecodeTimestamp(const uint8_t *buf, uint32_t *pos) {
+    if (tsReadBits(buf,pos,1) == 0) return 0;
+    if (tsReadBits(buf,pos,1) == 0) return tsSignExtend(tsReadBits(buf,pos,7),7);
+    if (tsReadBits(buf,pos,1) == 0) return tsSignExtend(tsReadBits(buf,pos,9),9);
+    if (tsReadBits(buf,pos,1) == 0) return tsSignExtend(tsReadBits(buf,pos,12),12);
+    return (int64_t)tsReadBits(buf,pos,64);
+}
+
+/* Append the XOR of the value with the previous one: nothing if it is the
+ * same, its meaningful bits in the window of the previous XOR if they fit,
+ * otherwise a new window. */
+static void tsEncodeValue(uint8_t *buf, uint32_t *pos, uint64_t x,
+                          uint8_t *leading, uint8_t *trailing)
+{
+    if (x == 0) {
+        tsWriteBits(buf,pos,0,1);
+        return;
+    }
+
+    int lead = __builtin_clzll(x), trail = __builtin_ctzll(x);
+    if (lead > 31) lead = 31;
+    if (*leading != TS_NO_LEADING && lead >= *leading && trail >= *trailing) {
+        tsWriteBits(buf,pos,2,2);
+        tsWriteBits(buf,pos,x >> *trailing,64-*leading-*trailing);
+    } else {
+        int sig = 64-lead-trail;
+        tsWriteBits(buf,pos,3,2);
+        tsWriteBits(buf,pos,lead,5);
+        tsWriteBits(buf,pos,sig-1,6);
+        tsWriteBits(buf,pos,x >> trail,sig);
+        *leading = lead;
+        *trailing = trail;
+    }
+}
+
+static uint64_t tsDecodeValue(const uint8_t *buf, uint32_t *pos,
+                              uint8_t *leading, uint8_t *trailing)
+{
+    if (tsReadBits(buf,pos,1) == 0) return 0;
+    if (tsReadBits(buf,pos,1) == 1) {
+        *leading = tsReadBits(buf,pos,5);
+        int sig = tsReadBits(buf,pos,6)+1;
+        *trailing = 64-*leading-sig;
+    }
+    return tsReadBits(buf,pos,64-*leading-*trailing) << *trailing;
+}
+
+/* Decode the samples of the chunk into 'ts' and 'values', that have room
+ * for TS_CHUNK_MAX_SAMPLES samples. Return the number of samples. */
+static int tsDecodeChunk(tschunk *c, int64_t *ts, double *values) {
+    const uint8_t *buf = tsChunkBits(c);
+    int count = tsGet16(c->count);
+    uint64_t value = tsGet64(c->first_value);
+    uint8_t leading = TS_NO_LEADING, trailing = 0;
+    int64_t delta = 0;
+    uint32_t pos = 0;
+
+    ts[0] = tsGet64(c->first_ts);
+    memcpy(&values[0],&value,sizeof(value));
+    for (int j = 1; j < count; j++) {
+        delta += tsDecodeTimestamp(buf,&pos);
+        ts[j] = ts[j-1]+delta;
+        value ^= tsDecodeValue(buf,&pos,&leading,&trailing);
+        memcpy(&values[j],&value,sizeof(value));
+    }
+    return count;
+}
+
+/* Return a new time series object holding no sample. */
+static robj *createTimeSeriesObject() {
+    robj *o = createObject(OBJ_STRING,sdsnewlen(NULL,sizeof(tshdr)));
+    memcpy(((tshdr*)o->ptr)->magic,"TSER",4);
+    return o;
+}
+
+/* Check that 'o' is a time series. Otherwise reply an error and return
+ * C_ERR. */
+static int isTimeSeriesObjectOrReply(client *c, robj *o) {
+    size_t len;
+
+    if (checkType(c,o,OBJ_STRING))
+        return C_ERR; /* Error already sent. */
+
+    if (!sdsEncodedObject(o)) goto invalid;
+    len = stringObjectLen(o);
+    if (len < sizeof(tshdr) ||
+        memcmp(((tshdr*)o->ptr)->magic,"TSER",4) ||
+        len != sizeof(tshdr)+(size_t)tsChunks(o)*TS_CHUNK_BYTES) goto invalid;
+    for (uint32_t j = 0; j < tsChunks(o); j++) {
+        tschunk *chunk = tsChunk(o,j);
+        uint32_t count = tsGet16(chunk->count);
+        if (count == 0 || count > TS_CHUNK_MAX_SAMPLES ||
+            tsGet16(chunk->bits) > TS_CHUNK_BITS) goto invalid;
+    }
+    return C_OK;
+
+invalid:
+    c->addReplySds(sdsnew(invalid_ts_err));
+    return C_ERR;
+}
+
+/* Append a sample to the time series 'o', starting a new chunk when the
+ * last one may not hold it. */
+static void tsAppend(robj *o, int64_t ts, double value) {
+    uint32_t chunks = tsChunks(o);
+    tschunk *c = chunks ? tsChunk(o,chunks-1) : NULL;
+    uint64_t vbits;
+
+    memcpy(&vbits,&value,sizeof(vbits));
+    if (c == NULL || tsGet16(c->bits)+TS_SAMPLE_MAX_BITS > TS_CHUNK_BITS) {
+        o->ptr = sdsgrowzero((sds)o->ptr,sdslen((sds)o->ptr)+TS_CHUNK_BYTES);
+        chunks++;
+        memrev32ifbe(&chunks);
+        memcpy(((tshdr*)o->ptr)->chunks,&chunks,sizeof(chunks));
+        memrev32ifbe(&chunks);
+        c = tsChunk(o,chunks-1);
+        tsSet64(c->first_ts,ts);
+        tsSet64(c->last_ts,ts);
+        tsSet64(c->first_value,vbits);
+        tsSet64(c->last_value,vbits);
+        tsSetDouble(c->min,value);
+        tsSetDouble(c->max,value);
+        tsSetDouble(c->sum,value);
+        tsSet16(c->count,1);
+        c->leading = TS_NO_LEADING;
+    } else {
+        int64_t delta = ts-(int64_t)tsGet64(c->last_ts);
+        uint32_t pos = tsGet16(c->bits);
+
+        tsEncodeTimestamp(tsChunkBits(c),&pos,
+            delta-(int64_t)tsGet64(c->last_delta));
+        tsEncodeValue(tsChunkBits(c),&pos,vbits^tsGet64(c->last_value),
+            &c->leading,&c->trailing);
+        tsSet16(c->bits,pos);
+        tsSet64(c->last_delta,delta);
+        tsSet64(c->last_ts,ts);
+        tsSet64(c->last_value,vbits);
+        if (value < tsGetDouble(c->min)) tsSetDouble(c->min,value);
+        if (value > tsGetDouble(c->max)) tsSetDouble(c->max,value);
+        tsSetDouble(c->sum,tsGetDouble(c->sum)+value);
+        tsSet16(c->count,tsGet16(c->count)+1);
+    }
+
+    tshdr *hdr = (tshdr*)o->ptr;
+    tsSet64(hdr->count,tsGet64(hdr->count)+1);
+}
+
+/* Return the first chunk whose last timestamp is >= 'ts'. */
+static uint32_t tsSeekChunk(robj *o, int64_t ts) {
+    uint32_t lo = 0, hi = tsChunks(o);
+
+    while (lo < hi) {
+        uint32_t mid = lo+(hi-lo)/2;
+        if ((int64_t)tsGet64(tsChunk(o,mid)->last_ts) < ts) lo = mid+1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* ============================== Aggregation =============================== */
+
+/* The bucket being aggregated by TS.RANGE. */
+struct tsAggState {
+    client *c;
+    int type;
+    int64_t bucket;         /* Width of the buckets in milliseconds. */
+    int64_t start;          /* Start of the current bucket. */
+    long long count;        /* Samples in the current bucket. */
+    double sum, min, max, first, last;
+    long replies;
+};
+
+static int64_t tsBucketStart(tsAggState *agg, int64_t ts) {
+    int64_t start = ts - ts % agg->bucket;
+    if (ts < 0 && ts % agg->bucket) start -= agg->bucket;
+    return start;
+}
+
+static void tsAggReply(tsAggState *agg) {
+    double v = 0;
+
+    if (agg->count == 0) return;
+    switch(agg->type) {
+    case TS_AGG_AVG: v = agg->sum/agg->count; break;
+    case TS_AGG_SUM: v = agg->sum; break;
+    case TS_AGG_MIN: v = agg->min; break;
+    case TS_AGG_MAX: v = agg->max; break;
+    case TS_AGG_COUNT: v = agg->count; break;
+    case TS_AGG_FIRST: v = agg->first; break;
+    case TS_AGG_LAST: v = agg->last; break;
+    }
+    agg->c->addReplyMultiBulkLen(2);
+    agg->c->addReplyLongLong(agg->start);
+    agg->c->addReplyDouble(v);
+    agg->replies++;
+    agg->count = 0;
+}
+
+/* Add to the aggregation 'count' samples of the bucket starting at 'start',
+ * summarized by their sum, min, max, first and last values. */
+static void tsAggAdd(tsAggState *agg, int64_t start, long long count,
+                     double sum, double min, double max, double first,
+                     double last)
+{
+    if (agg->count && start != agg->start) tsAggReply(agg);
+    if (agg->count == 0) {
+        agg->start = start;
+        agg->sum = 0;
+        agg->min = min;
+        agg->max = max;
+        agg->first = first;
+    }
+    agg->count += count;
+    agg->sum += sum;
+    if (min < agg->min) agg->min = min;
+    if (max > agg->max) agg->max = max;
+    agg->last = last;
+}
+
+/* Aggregate the decoded samples [from,to) of the same bucket. The loops
+ * only depend on the values, so the compiler may vectorize them. */
+static void tsAggAddSamples(tsAggState *agg, int64_t start,
+                            const double *values, int from, int to)
+{
+    double sum = 0, min = values[from], max = values[from];
+
+    for (int j = from; j < to; j++) sum += values[j];
+    for (int j = from; j < to; j++) min = values[j] < min ? values[j] : min;
+    for (int j = from; j < to; j++) max = values[j] > max ? values[j] : max;
+    tsAggAdd(agg,start,to-from,sum,min,max,values[from],values[to-1]);
+}
+
+/* ========================= Time series commands =========================== */
+
+/* TS.ADD key timestamp|* value => the timestamp of the sample.
+ *
+ * The timestamp must be greater than the last one. With '*' the current
+ * time is used, and the command is propagated with the actual timestamp. */
+void tsaddCommand(client *c) {
+    robj *key = c->m_argv[1];
+    robj *o;
+    long long ts;
+    double value;
+
+    if (!strcmp((char*)c->m_argv[2]->ptr,"*")) {
+        ts = mstime();
+    } else if (getLongLongFromObjectOrReply(c,c->m_argv[2],&ts,
+               "timestamp is not an integer or out of range") != C_OK) {
+        return;
+    }
+    if (getDoubleFromObjectOrReply(c,c->m_argv[3],&value,NULL) != C_OK)
+        return;
+
+    o = lookupKeyWrite(c->m_cur_selected_db,key);
+    if (o == NULL) {
+        o = createTimeSeriesObject();
+        dbAdd(c->m_cur_selected_db,key,o);
+    } else {
+        if (isTimeSeriesObjectOrReply(c,o) != C_OK) return;
+        uint32_t chunks = tsChunks(o);
+        if (chunks &&
+            ts <= (long long)tsGet64(tsChunk(o,chunks-1)->last_ts))
+        {
+            c->addReplyError("the timestamp must be greater than the last one");
+            return;
+        }
+        o = dbUnshareStringValue(c->m_cur_selected_db,key,o);
+    }
+
+    tsAppend(o,ts,value);
+    if (!strcmp((char*)c->m_argv[2]->ptr,"*"))
+        c->rewriteClientCommandArgument(2,createStringObjectFromLongLong(ts));
+    signalModifiedKey(c->m_cur_selected_db,key);
+    notifyKeyspaceEvent(NOTIFY_STRING,"ts.add",key,c->m_cur_selected_db->m_id);
+    server.dirty++;
+    c->addReplyLongLong(ts);
+}
+
+/* TS.GET key => the last sample as [timestamp, value], or null. */
+void tsgetCommand(client *c) {
+    robj *o = lookupKeyRead(c->m_cur_selected_db,c->m_argv[1]);
+    uint32_t chunks;
+
+    if (o == NULL) {
+        c->addReply(shared.nullmultibulk);
+        return;
+    }
+    if (isTimeSeriesObjectOrReply(c,o) != C_OK) return;
+    if ((chunks = tsChunks(o)) == 0) {
+        c->addReply(shared.nullmultibulk);
+        return;
+    }
+    tschunk *chunk = tsChunk(o,chunks-1);
+    c->addReplyMultiBulkLen(2);
+    c->addReplyLongLong(tsGet64(chunk->last_ts));
+    c->addReplyDouble(tsGetDouble(chunk->last_value));
+}
+
+static int tsParseTimestamp(client *c, robj *o, long long *ts) {
+    if (!strcmp((char*)o->ptr,"-")) {
+        *ts = LLONG_MIN;
+    } else if (!strcmp((char*)o->ptr,"+")) {
+        *ts = LLONG_MAX;
+    } else if (getLongLongFromObjectOrReply(c,o,ts,
+               "timestamp is not an integer or out of range") != C_OK) {
+        return C_ERR;
+    }
+    return C_OK;
+}
+
+/* TS.RANGE key from to [AGGREGATION avg|sum|min|max|count|first|last bucket]
+ *
+ * Reply the samples with a timestamp in [from,to], '-' and '+' being the
+ * first and the last one, as [timestamp, value] pairs. With AGGREGATION
+ * the samples are grouped in buckets of 'bucket' milliseconds, aligned on
+ * multiples of 'bucket', and every bucket holding samples is replied as
+ * [start of the bucket, aggregated value]. */
+void tsrangeCommand(client *c) {
+    static const char *aggnames[] = {"none","avg","sum","min","max","count",
+                                     "first","last"};
+    long long from, to, bucket = 0;
+    int aggtype = TS_AGG_NONE;
+    robj *o;
+
+    if (tsParseTimestamp(c,c->m_argv[2],&from) != C_OK ||
+        tsParseTimestamp(c,c->m_argv[3],&to) != C_OK) return;
+    if (c->m_argc == 7 &&
+        !strcasecmp((char*)c->m_argv[4]->ptr,"aggregation"))
+    {
+        for (int j = 1; j <= TS_AGG_LAST; j++) {
+            if (!strcasecmp((char*)c->m_argv[5]->ptr,aggnames[j])) aggtype = j;
+        }
+        if (aggtype == TS_AGG_NONE) {
+            c->addReplyError("unknown aggregation type");
+            return;
+        }
+        if (getLongLongFromObjectOrReply(c,c->m_argv[6],&bucket,NULL) != C_OK)
+            return;
+        if (bucket <= 0) {
+            c->addReplyError("the bucket must be positive");
+            return;
+        }
+    } else if (c->m_argc != 4) {
+        c->addReply(shared.syntaxerr);
+        return;
+    }
+
+    if ((o = lookupKeyReadOrReply(c,c->m_argv[1],shared.emptymultibulk))
+        == NULL || isTimeSeriesObjectOrReply(c,o) != C_OK) return;
+
+    void *replylen = c->addDeferredMultiBulkLength();
+    int64_t *ts = (int64_t*)zmalloc(sizeof(int64_t)*TS_CHUNK_MAX_SAMPLES);
+    double *values = (double*)zmalloc(sizeof(double)*TS_CHUNK_MAX_SAMPLES);
+    tsAggState agg = {c,aggtype,bucket,0,0,0,0,0,0,0,0};
+    uint32_t chunks = tsChunks(o);
+
+    for (uint32_t j = tsSeekChunk(o,from); j < chunks; j++) {
+        tschunk *chunk = tsChunk(o,j);
+        int64_t first = tsGet64(chunk->first_ts);
+        int64_t last = tsGet64(chunk->last_ts);
+
+        if (first > to) break;
+
+        /* A chunk entirely in range and in a bucket is aggregated from
+         * its header. */
+        if (aggtype != TS_AGG_NONE && first >= from && last <= to &&
+            tsBucketStart(&agg,first) == tsBucketStart(&agg,last))
+        {
+            tsAggAdd(&agg,tsBucketStart(&agg,first),tsGet16(chunk->count),
+                tsGetDouble(chunk->sum),tsGetDouble(chunk->min),
+                tsGetDouble(chunk->max),tsGetDouble(chunk->first_value),
+                tsGetDouble(chunk->last_value));
+            continue;
+        }
+
+        int count = tsDecodeChunk(chunk,ts,values);
+        int k = 0;
+        while (k < count && ts[k] < from) k++;
+        while (k < count && ts[k] <= to) {
+            if (aggtype == TS_AGG_NONE) {
+                c->addReplyMultiBulkLen(2);
+                c->addReplyLongLong(ts[k]);
+                c->addReplyDouble(values[k]);
+                agg.replies++;
+                k++;
+                continue;
+            }
+            int64_t start = tsBucketStart(&agg,ts[k]);
+            int end = k+1;
+            while (end < count && ts[end] <= to &&
+                   ts[end] < start+bucket) end++;
+            tsAggAddSamples(&agg,start,values,k,end);
+            k = end;
+        }
+    }
+    tsAggReply(&agg);
+    zfree(ts);
+    zfree(values);
+    c->setDeferredMultiBulkLength(replylen,agg.replies);
+}
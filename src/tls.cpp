@@ -0,0 +1,334 @@
+/* Native TLS with kernel TLS offload, see tls.h.
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "tls.h"
+
+#ifdef USE_OPENSSL
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <pthread.h>
+
+/* kTLS receive offload of TLS 1.3 sessions needs OpenSSL 3.2, with older
+ * versions TLS 1.2 is the highest version we can negotiate. */
+#if OPENSSL_VERSION_NUMBER >= 0x30200000L
+#define TLS_MAX_VERSION_KTLS TLS1_3_VERSION
+#else
+#define TLS_MAX_VERSION_KTLS TLS1_2_VERSION
+#endif
+
+/* Only AES-GCM is offloaded by every kernel supporting kTLS. */
+#define TLS_CIPHERS "ECDHE+AESGCM"
+#define TLS_CIPHERSUITES "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384"
+
+struct tlsHandshake {
+    int fd;         /* The socket of the owner. */
+    int dupfd;      /* dup() of fd used by the thread, so that the owner
+                       may close fd while the handshake is in progress. */
+    int role;       /* TLS_ACCEPT or TLS_CONNECT. */
+    int ok;         /* Set by the thread: the connection can be used. */
+    int cancelled;  /* Set by tlsCancelHandshake(). */
+    tlsHandshakeDone *done;
+    void *privdata;
+    char err[128];  /* Why the handshake failed. */
+};
+
+static SSL_CTX *tls_server_ctx, *tls_client_ctx;
+static pthread_mutex_t tls_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tls_cond = PTHREAD_COND_INITIALIZER;
+static list *tls_jobs;  /* Handshakes waiting for a thread. */
+static list *tls_done;  /* Handshakes waiting for the main thread. */
+static int tls_pipe[2]; /* Wakes up the main thread when tls_done becomes
+                           non empty. */
+
+static void tlsSetError(tlsHandshake *hs, const char *msg) {
+    unsigned long e = ERR_get_error();
+
+    if (e)
+        ERR_error_string_n(e,hs->err,sizeof(hs->err));
+    else
+        snprintf(hs->err,sizeof(hs->err),"%s",msg);
+    ERR_clear_error();
+}
+
+/* Perform the handshake on the blocking socket, then check that both
+ * directions were offloaded to the kernel. The SSL object is freed without
+ * sending anything: the kernel owns the session from now on. */
+static int tlsRunHandshake(tlsHandshake *hs) {
+    SSL *ssl;
+    int ok = 0, ret;
+
+    anetBlock(NULL,hs->dupfd);
+    anetRecvTimeout(NULL,hs->dupfd,TLS_HANDSHAKE_TIMEOUT);
+    anetSendTimeout(NULL,hs->dupfd,TLS_HANDSHAKE_TIMEOUT);
+    ssl = SSL_new(hs->role == TLS_ACCEPT ? tls_server_ctx : tls_client_ctx);
+    if (ssl == NULL || SSL_set_fd(ssl,hs->dupfd) != 1) {
+        tlsSetError(hs,"can't create the TLS session");
+    } else {
+        ret = hs->role == TLS_ACCEPT ? SSL_accept(ssl) : SSL_connect(ssl);
+        if (ret != 1) {
+            tlsSetError(hs,errno ? strerror(errno) : "connection closed");
+        } else if (!BIO_get_ktls_send(SSL_get_wbio(ssl)) ||
+                   !BIO_get_ktls_recv(SSL_get_rbio(ssl)))
+        {
+            snprintf(hs->err,sizeof(hs->err),
+                "kernel TLS offload not available for %s",
+                SSL_get_cipher_name(ssl));
+        } else {
+            ok = 1;
+        }
+    }
+    if (ssl) {
+        SSL_set_quiet_shutdown(ssl,1);
+        SSL_free(ssl);
+    }
+    anetRecvTimeout(NULL,hs->dupfd,0);
+    anetSendTimeout(NULL,hs->dupfd,0);
+    anetNonBlock(NULL,hs->dupfd);
+    return ok;
+}
+
+static void *tlsThreadMain(void *arg) {
+    UNUSED(arg);
+
+    while(1) {
+        tlsHandshake *hs;
+        int wakeup;
+
+        pthread_mutex_lock(&tls_mutex);
+        while (tls_jobs->listLength() == 0)
+            pthread_cond_wait(&tls_cond,&tls_mutex);
+        hs = (tlsHandshake*)tls_jobs->listFirst()->listNodeValue();
+        tls_jobs->listDelNode(tls_jobs->listFirst());
+        pthread_mutex_unlock(&tls_mutex);
+
+        errno = 0;
+        hs->ok = tlsRunHandshake(hs);
+
+        pthread_mutex_lock(&tls_mutex);
+        tls_done->listAddNodeTail(hs);
+        wakeup = tls_done->listLength() == 1;
+        pthread_mutex_unlock(&tls_mutex);
+        if (wakeup && write(tls_pipe[1],"x",1) == -1) {
+            /* The pipe is full: the main thread is already going to
+             * drain the queue. */
+        }
+    }
+    return NULL;
+}
+
+/* Main thread side: report the completed handshakes to their owners. */
+static void tlsDoneHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    char buf[128];
+    list *queue;
+    UNUSED(el);
+    UNUSED(mask);
+    UNUSED(privdata);
+
+    while (read(fd,buf,sizeof(buf)) == sizeof(buf));
+
+    pthread_mutex_lock(&tls_mutex);
+    queue = tls_done;
+    tls_done = listCreate();
+    pthread_mutex_unlock(&tls_mutex);
+
+    /* A callback may cancel one of the handshakes still in the queue, so
+     * the dup()ed socket is closed only once we get to it. */
+    while (queue->listLength()) {
+        listNode *ln = queue->listFirst();
+        tlsHandshake *hs = (tlsHandshake*)ln->listNodeValue();
+
+        queue->listDelNode(ln);
+        close(hs->dupfd);
+        if (!hs->cancelled) {
+            if (!hs->ok)
+                serverLog(LL_VERBOSE,"TLS handshake failed (fd=%d): %s",
+                    hs->fd, hs->err);
+            hs->done(hs->fd,hs->ok,hs->privdata);
+        }
+        zfree(hs);
+    }
+    listRelease(queue);
+}
+
+static SSL_CTX *tlsCreateContext(int server_side) {
+    SSL_CTX *ctx;
+
+    ctx = SSL_CTX_new(server_side ? TLS_server_method() : TLS_client_method());
+    if (ctx == NULL) return NULL;
+    SSL_CTX_set_options(ctx,SSL_OP_ENABLE_KTLS|SSL_OP_NO_RENEGOTIATION|
+                            SSL_OP_NO_COMPRESSION|SSL_OP_NO_TICKET|
+                            SSL_OP_IGNORE_UNEXPECTED_EOF);
+    /* Post handshake messages would be delivered to the kernel as non
+     * application data records, failing the read(2) of the owner. */
+    SSL_CTX_set_num_tickets(ctx,0);
+    SSL_CTX_set_min_proto_version(ctx,TLS1_2_VERSION);
+    SSL_CTX_set_max_proto_version(ctx,TLS_MAX_VERSION_KTLS);
+    if (SSL_CTX_set_cipher_list(ctx,TLS_CIPHERS) != 1 ||
+        SSL_CTX_set_ciphersuites(ctx,TLS_CIPHERSUITES) != 1)
+        goto err;
+
+    if (server.tls_cert_file) {
+        if (SSL_CTX_use_certificate_chain_file(ctx,server.tls_cert_file) != 1) {
+            serverLog(LL_WARNING,"Failed to load the TLS certificate %s",
+                server.tls_cert_file);
+            goto err;
+        }
+        if (SSL_CTX_use_PrivateKey_file(ctx,
+                server.tls_key_file ? server.tls_key_file : server.tls_cert_file,
+                SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(ctx) != 1)
+        {
+            serverLog(LL_WARNING,"Failed to load the TLS private key %s",
+                server.tls_key_file ? server.tls_key_file : server.tls_cert_file);
+            goto err;
+        }
+    } else if (server_side) {
+        serverLog(LL_WARNING,"TLS requires tls-cert-file to be set");
+        goto err;
+    }
+
+    /* With a CA both sides of every connection are authenticated. */
+    if (server.tls_ca_cert_file) {
+        if (SSL_CTX_load_verify_locations(ctx,server.tls_ca_cert_file,NULL) != 1) {
+            serverLog(LL_WARNING,"Failed to load the TLS CA certificate %s",
+                server.tls_ca_cert_file);
+            goto err;
+        }
+        SSL_CTX_set_verify(ctx,SSL_VERIFY_PEER|SSL_VERIFY_FAIL_IF_NO_PEER_CERT,NULL);
+    }
+    return ctx;
+
+err:
+    SSL_CTX_free(ctx);
+    return NULL;
+}
+
+/* Create the SSL contexts and the handshake threads. Called at startup
+ * when any of tls-port, tls-replication or tls-cluster is used. */
+int tlsInit(void) {
+    int j;
+
+    if ((tls_server_ctx = tlsCreateContext(1)) == NULL ||
+        (tls_client_ctx = tlsCreateContext(0)) == NULL)
+    {
+        serverLog(LL_WARNING,"Can't initialize TLS: %s",
+            ERR_error_string(ERR_get_error(),NULL));
+        return C_ERR;
+    }
+
+    tls_jobs = listCreate();
+    tls_done = listCreate();
+    if (pipe(tls_pipe) == -1) {
+        serverLog(LL_WARNING,"Can't create the TLS threads pipe: %s",
+            strerror(errno));
+        return C_ERR;
+    }
+    anetNonBlock(NULL,tls_pipe[0]);
+    anetNonBlock(NULL,tls_pipe[1]);
+    if (server.el->aeCreateFileEvent(tls_pipe[0], AE_READABLE,
+        tlsDoneHandler,NULL) == AE_ERR)
+    {
+        serverPanic("Unrecoverable error creating the TLS threads pipe "
+                    "file event.");
+    }
+
+    for (j = 0; j < server.tls_handshake_threads; j++) {
+        pthread_t tid;
+        if (pthread_create(&tid,NULL,tlsThreadMain,NULL) != 0) {
+            serverLog(LL_WARNING,"Fatal: Can't initialize TLS handshake threads.");
+            return C_ERR;
+        }
+    }
+    return C_OK;
+}
+
+/* Queue the handshake of the connected (or still connecting) socket 'fd'.
+ * Returns NULL on error, in which case 'done' will never be called. */
+tlsHandshake *tlsStartHandshake(int fd, int role, tlsHandshakeDone *done, void *privdata) {
+    tlsHandshake *hs;
+    int dupfd;
+
+    if ((dupfd = dup(fd)) == -1) return NULL;
+    hs = (tlsHandshake*)zcalloc(sizeof(*hs));
+    hs->fd = fd;
+    hs->dupfd = dupfd;
+    hs->role = role;
+    hs->done = done;
+    hs->privdata = privdata;
+
+    pthread_mutex_lock(&tls_mutex);
+    tls_jobs->listAddNodeTail(hs);
+    pthread_cond_signal(&tls_cond);
+    pthread_mutex_unlock(&tls_mutex);
+    return hs;
+}
+
+/* Called by the owner before closing the socket of a handshake still in
+ * progress. A handshake still queued is dropped, one already served by a
+ * thread is aborted shutting down the socket, and freed by the main thread
+ * when the thread is done with it. */
+void tlsCancelHandshake(tlsHandshake *hs) {
+    listNode *ln;
+
+    pthread_mutex_lock(&tls_mutex);
+    hs->cancelled = 1;
+    if ((ln = tls_jobs->listSearchKey(hs)) != NULL) {
+        tls_jobs->listDelNode(ln);
+        close(hs->dupfd);
+        zfree(hs);
+    } else {
+        shutdown(hs->dupfd,SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&tls_mutex);
+}
+
+#else /* !USE_OPENSSL */
+
+int tlsInit(void) {
+    serverLog(LL_WARNING,"TLS support not compiled in, build with "
+                         "BUILD_TLS=yes to use tls-port, tls-replication "
+                         "or tls-cluster.");
+    return C_ERR;
+}
+
+tlsHandshake *tlsStartHandshake(int fd, int role, tlsHandshakeDone *done, void *privdata) {
+    UNUSED(fd);
+    UNUSED(role);
+    UNUSED(done);
+    UNUSED(privdata);
+    return NULL;
+}
+
+void tlsCancelHandshake(tlsHandshake *hs) {
+    UNUSED(hs);
+}
+
+#endif
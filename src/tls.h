@@ -0,0 +1,32 @@
+/* Native TLS for the client, replication and cluster bus connections.
+ *
+ * Only the handshake is performed by OpenSSL, by a pool of threads so that
+ * the expensive public key operations never run in the event loop. Once
+ * the session is established the keys are handed to the kernel (kTLS), and
+ * from then on the socket is used exactly like a plain TCP socket: read(2),
+ * writev(2) and sendfile(2) are encrypted and decrypted by the kernel, so
+ * every zero copy path of the server keeps working. Connections where kTLS
+ * can't be enabled are refused, there is no user space TLS fallback.
+ *
+ * While a handshake is in progress the owner of the socket must not
+ * install file events for it. The completion callback is called by the
+ * main thread with ok set to 1 if the connection can be used, otherwise
+ * the owner is expected to close it. A cancelled handshake never calls
+ * the callback. */
+
+#ifndef __TLS_H
+#define __TLS_H
+
+#define TLS_ACCEPT 0    /* We are the server side of the handshake. */
+#define TLS_CONNECT 1   /* We are the client side of the handshake. */
+
+#define TLS_HANDSHAKE_TIMEOUT 10000 /* Milliseconds. */
+
+typedef struct tlsHandshake tlsHandshake;
+typedef void tlsHandshakeDone(int fd, int ok, void *privdata);
+
+int tlsInit(void);
+tlsHandshake *tlsStartHandshake(int fd, int role, tlsHandshakeDone *done, void *privdata);
+void tlsCancelHandshake(tlsHandshake *hs);
+
+#endif
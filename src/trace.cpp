@@ -0,0 +1,231 @@
+/* Sampled commands tracer.
+ *
+ * One command every trace-sample-rate, on average, is recorded into a ring
+ * buffer of trace-max-len entries: the command name, its first key, the
+ * size of the arguments and of the reply, the execution time, the client
+ * and the DB. Unlike MONITOR nothing is formatted or sent while commands
+ * are executed, and the commands that are not sampled just decrement a
+ * counter, so the tracer can be left enabled in production.
+ *
+ * The entries are read with TRACE FETCH in batches of binary records, see
+ * trace.h for their layout, resuming from the ID of the next entry: the
+ * reply also reports the entries that were overwritten before they were
+ * fetched.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "trace.h"
+#include "endianconv.h"
+
+/* Draw the number of commands before the next sample, uniformly between 1
+ * and 2*N-1, so that one command every N is sampled on average without
+ * following the period of the workload. */
+void traceSetCountdown(commandTracer *tracer) {
+    long long rate = server.trace_sample_rate;
+    tracer->countdown = rate > 1 ? 1+(random() % (rate*2-1)) : 1;
+}
+
+/* Create the tracer as configured by trace-sample-rate and trace-max-len,
+ * or release it if tracing is disabled. The entries recorded so far are
+ * kept if the ring size did not change. */
+void traceInit(void) {
+    commandTracer *tracer = server.tracer;
+
+    if (tracer && (server.trace_sample_rate == 0 ||
+                   tracer->len != (size_t)server.trace_max_len))
+    {
+        zfree(tracer->ring);
+        zfree(tracer);
+        server.tracer = tracer = NULL;
+    }
+    if (server.trace_sample_rate == 0) return;
+
+    if (tracer == NULL) {
+        tracer = (commandTracer *)zmalloc(sizeof(*tracer));
+        tracer->len = server.trace_max_len;
+        tracer->ring = (traceEntry *)zmalloc(sizeof(traceEntry)*tracer->len);
+        tracer->next_id = 0;
+        tracer->reset_id = 0;
+        server.tracer = tracer;
+    }
+    traceSetCountdown(tracer);
+}
+
+/* Record the command 'cmd' just executed by 'c', called by call() when
+ * traceShouldSample() returned 1. */
+void tracePushEntry(client *c, struct redisCommand *cmd, long long duration,
+                    long long reply_bytes)
+{
+    commandTracer *tracer = server.tracer;
+    uint64_t arg_bytes = 0;
+
+    /* The command may have just disabled the tracer. */
+    if (tracer == NULL) return;
+    traceEntry *te = tracer->ring + (tracer->next_id % tracer->len);
+
+    te->id = tracer->next_id++;
+    te->time = ustime();
+    te->client_id = c->m_client_id;
+    te->duration = duration;
+    te->argc = c->m_argc;
+    te->dbid = c->m_cur_selected_db->m_id;
+    te->cmd = cmd;
+    te->reply_bytes = reply_bytes < 0 ? 0 : reply_bytes;
+    for (int j = 0; j < c->m_argc; j++)
+        arg_bytes += stringObjectLen(c->m_argv[j]);
+    te->arg_bytes = arg_bytes;
+
+    te->keylen = 0;
+    if (cmd->firstkey > 0 && cmd->firstkey < c->m_argc) {
+        robj *key = c->m_argv[cmd->firstkey];
+        if (sdsEncodedObject(key)) {
+            size_t len = sdslen((sds)key->ptr);
+            if (len > TRACE_MAX_KEY_LEN) len = TRACE_MAX_KEY_LEN;
+            memcpy(te->key,key->ptr,len);
+            te->keylen = len;
+        } else if (key->encoding == OBJ_ENCODING_INT) {
+            te->keylen = ll2string(te->key,sizeof(te->key),(long)key->ptr);
+        }
+    }
+}
+
+/* Append the binary record of 'te' to 'buf'. */
+static sds traceCatEntry(sds buf, traceEntry *te) {
+    unsigned char hdr[TRACE_RECORD_HDR_LEN], *p = hdr;
+    uint64_t u64[5] = {te->id, te->time, te->client_id, te->arg_bytes,
+                       te->reply_bytes};
+    uint32_t u32[2] = {te->duration, te->argc};
+    uint16_t cmdlen = strlen(te->cmd->name);
+    uint16_t u16[3] = {te->dbid, cmdlen, te->keylen};
+
+    for (int j = 0; j < 5; j++) {
+        memrev64ifbe(&u64[j]);
+        memcpy(p,&u64[j],8);
+        p += 8;
+    }
+    for (int j = 0; j < 2; j++) {
+        memrev32ifbe(&u32[j]);
+        memcpy(p,&u32[j],4);
+        p += 4;
+    }
+    for (int j = 0; j < 3; j++) {
+        memrev16ifbe(&u16[j]);
+        memcpy(p,&u16[j],2);
+        p += 2;
+    }
+    buf = sdscatlen(buf,hdr,sizeof(hdr));
+    buf = sdscatlen(buf,te->cmd->name,cmdlen);
+    return sdscatlen(buf,te->key,te->keylen);
+}
+
+/* TRACE FETCH [FROM <id>] [COUNT <count>]
+ * TRACE LEN
+ * TRACE RESET
+ * TRACE HELP */
+void traceCommand(client *c) {
+    if (c->m_argc == 2 && !strcasecmp((const char*)c->m_argv[1]->ptr,"help")) {
+        void *blenp = c->addDeferredMultiBulkLength();
+        int blen = 0;
+        blen++; c->addReplyStatus(
+        "TRACE FETCH [FROM <id>] [COUNT <count>] -- Return the next ID to fetch, the entries lost before <id> was fetched, and the binary records of the entries starting at <id>.");
+        blen++; c->addReplyStatus(
+        "TRACE LEN -- Return the number of entries in the tracer.");
+        blen++; c->addReplyStatus(
+        "TRACE RESET -- Forget the entries recorded so far.");
+        c->setDeferredMultiBulkLength(blenp,blen);
+        return;
+    }
+
+    commandTracer *tracer = server.tracer;
+    if (tracer == NULL) {
+        c->addReplyError("The commands tracer is disabled: set "
+                         "trace-sample-rate to enable it");
+        return;
+    }
+    uint64_t oldest = tracer->next_id > tracer->len ?
+                      tracer->next_id - tracer->len : 0;
+    if (oldest < tracer->reset_id) oldest = tracer->reset_id;
+
+    if (c->m_argc == 2 && !strcasecmp((const char*)c->m_argv[1]->ptr,"len")) {
+        c->addReplyLongLong(tracer->next_id - oldest);
+    } else if (c->m_argc == 2 &&
+               !strcasecmp((const char*)c->m_argv[1]->ptr,"reset"))
+    {
+        /* The IDs keep growing, so that the readers can resume. */
+        tracer->reset_id = tracer->next_id;
+        c->addReply(shared.ok);
+    } else if (c->m_argc >= 2 &&
+               !strcasecmp((const char*)c->m_argv[1]->ptr,"fetch"))
+    {
+        long long from = 0, count = TRACE_FETCH_DEFAULT_COUNT;
+
+        for (int j = 2; j < c->m_argc; j++) {
+            int moreargs = j+1 < c->m_argc;
+            if (!strcasecmp((const char*)c->m_argv[j]->ptr,"from") && moreargs) {
+                if (getLongLongFromObjectOrReply(c,c->m_argv[++j],&from,NULL)
+                    != C_OK) return;
+            } else if (!strcasecmp((const char*)c->m_argv[j]->ptr,"count") &&
+                       moreargs)
+            {
+                if (getLongLongFromObjectOrReply(c,c->m_argv[++j],&count,NULL)
+                    != C_OK) return;
+            } else {
+                c->addReply(shared.syntaxerr);
+                return;
+            }
+        }
+        if (from < 0 || count < 0) {
+            c->addReplyError("FROM and COUNT can't be negative");
+            return;
+        }
+
+        /* Entries overwritten before they could be fetched are reported,
+         * so that the reader knows the trace has a gap. */
+        uint64_t id = from, lost = 0;
+        if (id < oldest) {
+            lost = oldest - id;
+            id = oldest;
+        }
+        if (id > tracer->next_id) id = tracer->next_id;
+
+        sds buf = sdsempty();
+        while (id < tracer->next_id && count--)
+            buf = traceCatEntry(buf,tracer->ring + (id++ % tracer->len));
+
+        c->addReplyMultiBulkLen(3);
+        c->addReplyLongLong(id);
+        c->addReplyLongLong(lost);
+        c->addReplyBulkSds(buf);
+    } else {
+        c->addReply(shared.syntaxerr);
+    }
+}
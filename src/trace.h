@@ -0,0 +1,91 @@
+/* trace.h -- sampled commands tracer API header file
+ * See trace.cpp for more information.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#define TRACE_MAX_KEY_LEN 64            /* Bytes of the first key recorded. */
+#define TRACE_MAX_LEN (1024*1024)       /* Max value of trace-max-len. */
+#define TRACE_FETCH_DEFAULT_COUNT 1000  /* Entries returned by TRACE FETCH. */
+
+/* Size of the fixed part of the records returned by TRACE FETCH: an entry
+ * is serialized as the little endian fields id, time, client id, argument
+ * bytes, reply bytes (64 bit), duration, argc (32 bit), db, command name
+ * length and key length (16 bit), followed by the command name and the
+ * key bytes. */
+#define TRACE_RECORD_HDR_LEN (8*5+4*2+2*3)
+
+/* A sampled command. The entries are stored by value in the ring, the key
+ * bytes included, so that recording a command allocates nothing. */
+struct traceEntry {
+    uint64_t id;
+    uint64_t time;          /* Unix time in microseconds. */
+    uint64_t client_id;
+    uint64_t arg_bytes;     /* Total length of the arguments. */
+    uint64_t reply_bytes;   /* Bytes appended to the client output. */
+    uint32_t duration;      /* Execution time in microseconds. */
+    uint32_t argc;
+    uint16_t dbid;
+    uint16_t keylen;        /* Recorded bytes of the first key. */
+    struct redisCommand *cmd;
+    char key[TRACE_MAX_KEY_LEN];
+};
+
+/* The tracer keeps the last trace-max-len sampled commands, the entry with
+ * ID 'id' being at ring[id % len]. */
+struct commandTracer {
+    traceEntry *ring;
+    size_t len;
+    uint64_t next_id;       /* ID of the next entry. */
+    uint64_t reset_id;      /* Entries before it were reset. */
+    long long countdown;    /* Commands before the next sample. */
+};
+
+/* Exported API */
+void traceInit(void);
+void tracePushEntry(client *c, struct redisCommand *cmd, long long duration,
+                    long long reply_bytes);
+void traceSetCountdown(commandTracer *tracer);
+
+/* Return 1 if the command about to be called must be traced. This is all
+ * the untraced commands pay for. */
+static inline int traceShouldSample(void) {
+    if (server.tracer == NULL || --server.tracer->countdown > 0) return 0;
+    traceSetCountdown(server.tracer);
+    return 1;
+}
+
+/* Exported commands */
+void traceCommand(client *c);
+
+#endif
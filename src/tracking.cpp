@@ -0,0 +1,458 @@
+/* Client side caching: keys tracking and invalidation.
+ *
+ * A client that enabled tracking with CLIENT TRACKING on is sent an
+ * invalidation message every time a key it read may have changed, so that
+ * it can keep the values in a local cache without serving stale data.
+ *
+ * In the default mode we remember, for every key read by a tracking client,
+ * the IDs of the clients that may have it cached: the tracking table maps
+ * the key names to a radix tree of client IDs. When the key is modified the
+ * clients are notified and the key is removed from the table, so the next
+ * read must remember it again. Since the table costs memory proportional to
+ * the keys read, once it holds more than tracking-table-max-keys keys we
+ * evict random keys from it, sending their invalidation ahead of time.
+ *
+ * In the broadcasting mode (BCAST) nothing is remembered: the clients
+ * subscribe to key prefixes and receive the invalidation of every key
+ * matching a prefix, collected in the event loop iteration and sent in
+ * beforeSleep().
+ *
+ * There is no RESP3 here, so the invalidation messages are always sent to
+ * another connection, selected with the REDIRECT option, as Pub/Sub messages
+ * of the __redis__:invalidate channel. The redirect client must be in
+ * Pub/Sub mode, usually subscribed to that channel.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+
+#define TRACKING_CHANNEL "__redis__:invalidate"
+
+/* Key name -> radix tree of the IDs of the clients that may have it cached.
+ * The IDs are stored as 8 bytes keys, with NULL values. */
+static rax *TrackingTable = NULL;
+static uint64_t TrackingTableTotalItems = 0; /* Client IDs in all the trees. */
+
+/* Prefix -> bcastState, for the clients in BCAST mode. */
+static rax *PrefixTable = NULL;
+
+struct bcastState {
+    rax *keys;      /* Keys modified in the current event loop iteration,
+                       the value is the client that modified the key, or
+                       NULL if more than one did, for NOLOOP. */
+    rax *clients;   /* Clients subscribed to the prefix, stored as pointers
+                       in the keys, with NULL values. */
+};
+
+/* Return the client of the current command, that is the caller of the
+ * script when the command is called by Lua. */
+static client *trackingCurrentClient(void) {
+    client *c = server.current_client;
+    if (c && c->m_flags & CLIENT_LUA && server.lua_caller)
+        c = server.lua_caller;
+    return c;
+}
+
+/* Remove the client from the clients of its prefixes, and free the prefixes
+ * without clients. */
+static void disableBcastTracking(client *c) {
+    raxIterator ri;
+    raxStart(&ri,c->m_client_tracking_prefixes);
+    raxSeek(&ri,"^",NULL,0);
+    while(raxNext(&ri)) {
+        bcastState *bs = (bcastState *)raxFind(PrefixTable,ri.key,ri.key_len);
+        serverAssert(bs != raxNotFound);
+        raxRemove(bs->clients,(unsigned char*)&c,sizeof(c),NULL);
+        if (bs->clients->numele == 0) {
+            raxFree(bs->clients);
+            raxFree(bs->keys);
+            zfree(bs);
+            raxRemove(PrefixTable,ri.key,ri.key_len,NULL);
+        }
+    }
+    raxStop(&ri);
+    raxFree(c->m_client_tracking_prefixes);
+    c->m_client_tracking_prefixes = NULL;
+}
+
+/* Disable tracking for the client. The client IDs in the tracking table
+ * are not removed: they are discarded lazily when the keys are invalidated,
+ * since the client (or a new one with the same ID, which can't happen) is
+ * no longer found or no longer tracking. */
+void disableTracking(client *c) {
+    if (!(c->m_tracking_flags & CLIENT_TRACKING)) return;
+    if (c->m_tracking_flags & CLIENT_TRACKING_BCAST)
+        disableBcastTracking(c);
+    c->m_tracking_flags = 0;
+    c->m_client_tracking_redirection = 0;
+    server.tracking_clients--;
+}
+
+/* Subscribe the client to the invalidation of the keys starting with
+ * 'prefix'. */
+static void enableBcastTrackingForPrefix(client *c, const char *prefix, size_t plen) {
+    bcastState *bs = (bcastState *)raxFind(PrefixTable,(unsigned char*)prefix,plen);
+    if (bs == raxNotFound) {
+        bs = (bcastState *)zmalloc(sizeof(*bs));
+        bs->keys = raxNew();
+        bs->clients = raxNew();
+        raxInsert(PrefixTable,(unsigned char*)prefix,plen,bs,NULL);
+    }
+    if (raxInsert(bs->clients,(unsigned char*)&c,sizeof(c),NULL,NULL)) {
+        if (!c->m_client_tracking_prefixes)
+            c->m_client_tracking_prefixes = raxNew();
+        raxInsert(c->m_client_tracking_prefixes,
+                  (unsigned char*)prefix,plen,NULL,NULL);
+    }
+}
+
+/* Enable tracking for the client, sending the invalidation messages to the
+ * client with ID 'redirect_to'. 'options' are CLIENT_TRACKING_BCAST and
+ * CLIENT_TRACKING_NOLOOP. In BCAST mode the client is subscribed to the
+ * 'numprefix' prefixes, or to all the keys when there are none. */
+void enableTracking(client *c, uint64_t redirect_to, int options, robj **prefix, size_t numprefix) {
+    if (!(c->m_tracking_flags & CLIENT_TRACKING)) server.tracking_clients++;
+    c->m_tracking_flags |= CLIENT_TRACKING;
+    c->m_tracking_flags &= ~(CLIENT_TRACKING_BROKEN_REDIR|CLIENT_TRACKING_NOLOOP);
+    c->m_tracking_flags |= options;
+    c->m_client_tracking_redirection = redirect_to;
+
+    if (TrackingTable == NULL) {
+        TrackingTable = raxNew();
+        PrefixTable = raxNew();
+    }
+
+    if (options & CLIENT_TRACKING_BCAST) {
+        if (numprefix == 0) enableBcastTrackingForPrefix(c,"",0);
+        for (size_t j = 0; j < numprefix; j++) {
+            sds sdsprefix = (sds)prefix[j]->ptr;
+            enableBcastTrackingForPrefix(c,sdsprefix,sdslen(sdsprefix));
+        }
+    }
+}
+
+/* Return 1 if one of the two strings is a prefix of the other. */
+static int trackingPrefixesOverlap(const char *a, size_t alen, const char *b, size_t blen) {
+    return memcmp(a,b,alen < blen ? alen : blen) == 0;
+}
+
+/* In BCAST mode the prefixes of a client can't overlap, otherwise the
+ * client could receive the same invalidation more than once. Return C_OK if
+ * the 'numprefix' prefixes don't overlap with each other or with the ones
+ * the client already has, otherwise reply with an error and return C_ERR. */
+int checkPrefixCollisionsOrReply(client *c, robj **prefixes, size_t numprefix) {
+    for (size_t i = 0; i < numprefix; i++) {
+        sds p = (sds)prefixes[i]->ptr;
+
+        if (c->m_client_tracking_prefixes) {
+            raxIterator ri;
+            raxStart(&ri,c->m_client_tracking_prefixes);
+            raxSeek(&ri,"^",NULL,0);
+            while(raxNext(&ri)) {
+                if (trackingPrefixesOverlap(p,sdslen(p),
+                                            (char*)ri.key,ri.key_len))
+                {
+                    sds collision = sdsnewlen(ri.key,ri.key_len);
+                    c->addReplyErrorFormat(
+                        "Prefix '%s' overlaps with an existing prefix '%s'. "
+                        "Prefixes for a single client must not overlap.",
+                        p,collision);
+                    sdsfree(collision);
+                    raxStop(&ri);
+                    return C_ERR;
+                }
+            }
+            raxStop(&ri);
+        }
+        for (size_t j = i+1; j < numprefix; j++) {
+            sds q = (sds)prefixes[j]->ptr;
+            if (trackingPrefixesOverlap(p,sdslen(p),q,sdslen(q))) {
+                c->addReplyErrorFormat(
+                    "Prefix '%s' overlaps with another provided prefix '%s'. "
+                    "Prefixes for a single client must not overlap.",
+                    p,q);
+                return C_ERR;
+            }
+        }
+    }
+    return C_OK;
+}
+
+/* Remember the keys of the read only command just executed by 'executing'
+ * for the client 'tracking', that is tracking in the default mode, so that
+ * it is notified when they change. The two clients differ when the command
+ * is called by a script: the keys are remembered for the caller. */
+void trackingRememberKeys(client *tracking, client *executing) {
+    int numkeys;
+    int *keys = getKeysFromCommand(executing->m_cmd,executing->m_argv,
+                                   executing->m_argc,&numkeys);
+    if (keys == NULL) return;
+
+    for (int j = 0; j < numkeys; j++) {
+        robj *keyobj = executing->m_argv[keys[j]];
+        if (!sdsEncodedObject(keyobj)) continue;
+        sds sdskey = (sds)keyobj->ptr;
+
+        rax *ids = (rax *)raxFind(TrackingTable,(unsigned char*)sdskey,sdslen(sdskey));
+        if (ids == raxNotFound) {
+            ids = raxNew();
+            raxInsert(TrackingTable,(unsigned char*)sdskey,sdslen(sdskey),ids,NULL);
+        }
+        if (raxInsert(ids,(unsigned char*)&tracking->m_client_id,
+                      sizeof(tracking->m_client_id),NULL,NULL))
+            TrackingTableTotalItems++;
+    }
+    getKeysFreeResult(keys);
+}
+
+/* Return the client the invalidation messages of 'c' must be sent to, or
+ * NULL if there is none, flagging the redirection as broken if the client
+ * is gone. */
+static client *trackingTargetClient(client *c) {
+    client *target = lookupClientByID(c->m_client_tracking_redirection);
+    if (target == NULL) {
+        c->m_tracking_flags |= CLIENT_TRACKING_BROKEN_REDIR;
+        return NULL;
+    }
+    /* Only clients in Pub/Sub mode can receive the messages. */
+    if (!(target->m_flags & CLIENT_PUBSUB)) return NULL;
+    return target;
+}
+
+/* Send the header of an invalidation message, the payload must follow:
+ * an array of keys, or a null array to invalidate everything. */
+static void trackingAddMessageHeader(client *target) {
+    target->addReply(shared.mbulkhdr[3]);
+    target->addReply(shared.messagebulk);
+    target->addReplyBulkCBuffer(TRACKING_CHANNEL,sizeof(TRACKING_CHANNEL)-1);
+}
+
+/* Send the invalidation of the key to the client 'c', or better to its
+ * redirect client. */
+static void sendTrackingMessage(client *c, const char *keyname, size_t keylen) {
+    client *target = trackingTargetClient(c);
+    if (target == NULL) return;
+    trackingAddMessageHeader(target);
+    target->addReplyMultiBulkLen(1);
+    target->addReplyBulkCBuffer(keyname,keylen);
+}
+
+/* Callback of raxFindPrefixes() for trackingRememberKeyToBroadcast(). */
+struct bcastRememberState {
+    sds key;
+    client *c;
+};
+
+static void trackingRememberKeyToPrefix(void *data, size_t keylen, void *privdata) {
+    bcastState *bs = (bcastState *)data;
+    bcastRememberState *st = (bcastRememberState *)privdata;
+    UNUSED(keylen);
+    void *old = raxFind(bs->keys,(unsigned char*)st->key,sdslen(st->key));
+
+    if (old == raxNotFound)
+        raxInsert(bs->keys,(unsigned char*)st->key,sdslen(st->key),st->c,NULL);
+    else if (old != st->c)
+        raxInsert(bs->keys,(unsigned char*)st->key,sdslen(st->key),NULL,NULL);
+}
+
+/* Remember the modified key for the broadcasting of the prefixes that
+ * match it, see trackingBroadcastInvalidationMessages(). */
+static void trackingRememberKeyToBroadcast(sds key) {
+    bcastRememberState st = {key, trackingCurrentClient()};
+    raxFindPrefixes(PrefixTable,(unsigned char*)key,sdslen(key),
+                    trackingRememberKeyToPrefix,&st);
+}
+
+/* Invalidate the key for the clients that may have it cached, and remove
+ * it from the tracking table. Called by signalModifiedKey(), and when the
+ * key is evicted from the tracking table. */
+static void trackingInvalidateKeyRaw(sds sdskey, int bcast) {
+    if (bcast && PrefixTable->numele) trackingRememberKeyToBroadcast(sdskey);
+
+    rax *ids = (rax *)raxFind(TrackingTable,(unsigned char*)sdskey,sdslen(sdskey));
+    if (ids == raxNotFound) return;
+
+    client *current = trackingCurrentClient();
+    raxIterator ri;
+    raxStart(&ri,ids);
+    raxSeek(&ri,"^",NULL,0);
+    while(raxNext(&ri)) {
+        uint64_t id;
+        memcpy(&id,ri.key,sizeof(id));
+        client *target = lookupClientByID(id);
+        /* The client may no longer track keys, or track them in BCAST
+         * mode after turning tracking off and on again. */
+        if (target == NULL ||
+            !(target->m_tracking_flags & CLIENT_TRACKING) ||
+            target->m_tracking_flags & CLIENT_TRACKING_BCAST) continue;
+        if (target->m_tracking_flags & CLIENT_TRACKING_NOLOOP &&
+            target == current) continue;
+        sendTrackingMessage(target,sdskey,sdslen(sdskey));
+    }
+    raxStop(&ri);
+
+    TrackingTableTotalItems -= ids->numele;
+    raxFree(ids);
+    raxRemove(TrackingTable,(unsigned char*)sdskey,sdslen(sdskey),NULL);
+}
+
+void trackingInvalidateKey(robj *keyobj) {
+    if (TrackingTable == NULL || !sdsEncodedObject(keyobj)) return;
+    trackingInvalidateKeyRaw((sds)keyobj->ptr,1);
+}
+
+/* Send a null invalidation message, that invalidates all the keys, to every
+ * tracking client, as all the keys are gone after FLUSHALL / FLUSHDB. The
+ * tracking table is not per database, so it is freed only when all the
+ * databases are flushed. */
+void trackingInvalidateKeysOnFlush(int dbid) {
+    if (server.tracking_clients == 0) return;
+
+    listNode *ln;
+    listIter li(server.clients);
+    while ((ln = li.listNext()) != NULL) {
+        client *c = (client *)ln->listNodeValue();
+        if (!(c->m_tracking_flags & CLIENT_TRACKING)) continue;
+        client *target = trackingTargetClient(c);
+        if (target == NULL) continue;
+        trackingAddMessageHeader(target);
+        target->addReply(shared.nullmultibulk);
+    }
+
+    if (dbid == -1 && TrackingTable) {
+        raxFreeWithCallback(TrackingTable,(void (*)(void*))raxFree);
+        TrackingTable = raxNew();
+        TrackingTableTotalItems = 0;
+    }
+}
+
+/* Keep the tracking table under tracking-table-max-keys keys, invalidating
+ * random keys ahead of time: the clients will cache them again when they
+ * read them next. Called from serverCron(): to bound the latency, only a
+ * small number of keys is evicted per call if the clients are reading keys
+ * faster than that, the effort grows with the table overrun. */
+void trackingLimitUsedSlots(void) {
+    static unsigned int timeout_counter = 0;
+
+    if (TrackingTable == NULL || server.tracking_table_max_keys == 0) return;
+    size_t max_keys = server.tracking_table_max_keys;
+    if (TrackingTable->numele <= max_keys) {
+        timeout_counter = 0;
+        return;
+    }
+
+    int effort = 100 * (timeout_counter+1);
+    raxIterator ri;
+    raxStart(&ri,TrackingTable);
+    while (effort > 0) {
+        effort--;
+        raxSeek(&ri,"^",NULL,0);
+        if (!raxRandomWalk(&ri,0)) break;
+        sds key = sdsnewlen(ri.key,ri.key_len);
+        trackingInvalidateKeyRaw(key,0);
+        sdsfree(key);
+        if (TrackingTable->numele <= max_keys) {
+            timeout_counter = 0;
+            raxStop(&ri);
+            return;
+        }
+    }
+    raxStop(&ri);
+    /* Still over the limit: spend more effort the next time. */
+    if (timeout_counter < 100) timeout_counter++;
+}
+
+/* Send to the clients in BCAST mode the keys modified in this event loop
+ * iteration that match their prefixes. Called in beforeSleep(). */
+void trackingBroadcastInvalidationMessages(void) {
+    raxIterator ri, ri2;
+
+    if (TrackingTable == NULL || PrefixTable->numele == 0) return;
+
+    raxStart(&ri,PrefixTable);
+    raxSeek(&ri,"^",NULL,0);
+    while(raxNext(&ri)) {
+        bcastState *bs = (bcastState *)ri.data;
+        if (bs->keys->numele == 0) continue;
+
+        raxStart(&ri2,bs->clients);
+        raxSeek(&ri2,"^",NULL,0);
+        while(raxNext(&ri2)) {
+            client *c;
+            memcpy(&c,ri2.key,sizeof(c));
+            client *target = trackingTargetClient(c);
+            if (target == NULL) continue;
+
+            /* With NOLOOP skip the keys modified by the client itself. */
+            int noloop = c->m_tracking_flags & CLIENT_TRACKING_NOLOOP;
+            list *keys = listCreate();
+            raxIterator ki;
+            raxStart(&ki,bs->keys);
+            raxSeek(&ki,"^",NULL,0);
+            while(raxNext(&ki)) {
+                if (noloop && ki.data == c) continue;
+                keys->listAddNodeTail(sdsnewlen(ki.key,ki.key_len));
+            }
+            raxStop(&ki);
+
+            if (keys->listLength()) {
+                listNode *ln;
+                listIter li(keys);
+                trackingAddMessageHeader(target);
+                target->addReplyMultiBulkLen(keys->listLength());
+                while ((ln = li.listNext()) != NULL) {
+                    sds key = (sds)ln->listNodeValue();
+                    target->addReplyBulkCBuffer(key,sdslen(key));
+                    sdsfree(key);
+                }
+            }
+            listRelease(keys);
+        }
+        raxStop(&ri2);
+
+        raxFree(bs->keys);
+        bs->keys = raxNew();
+    }
+    raxStop(&ri);
+}
+
+/* Stats for INFO. */
+uint64_t trackingGetTotalKeys(void) {
+    return TrackingTable ? TrackingTable->numele : 0;
+}
+
+uint64_t trackingGetTotalItems(void) {
+    return TrackingTableTotalItems;
+}
+
+uint64_t trackingGetTotalPrefixes(void) {
+    return PrefixTable ? PrefixTable->numele : 0;
+}
@@ -43,134 +43,238 @@
 #include "util.h"
 #include "sha1.h"
 
-/* Glob-style pattern matching. */
-int stringmatchlen(const char *pattern, int patternLen,
-        const char *string, int stringLen, int nocase)
+/* Match the character 'c' against the single character token at the start
+ * of the pattern, that is not a '*': a '?', a [...] class, an escaped or a
+ * plain character. Return 1 on match, setting *consumed to the length of
+ * the token. */
+static int stringmatchToken(const char *pattern, int patternLen, int c,
+                            int nocase, int *consumed)
 {
-    while(patternLen) {
-        switch(pattern[0]) {
-        case '*':
-            while (pattern[1] == '*') {
-                pattern++;
-                patternLen--;
-            }
-            if (patternLen == 1)
-                return 1; /* match */
-            while(stringLen) {
-                if (stringmatchlen(pattern+1, patternLen-1,
-                            string, stringLen, nocase))
-                    return 1; /* match */
-                string++;
-                stringLen--;
-            }
-            return 0; /* no match */
-            break;
-        case '?':
-            if (stringLen == 0)
-                return 0; /* no match */
-            string++;
-            stringLen--;
-            break;
-        case '[':
-        {
-            int _not;
-            int match;
+    const char *p = pattern;
+    int plen = patternLen;
 
-            pattern++;
-            patternLen--;
-            _not = pattern[0] == '^';
-            if (_not) {
-                pattern++;
-                patternLen--;
-            }
-            match = 0;
-            while(1) {
-                if (pattern[0] == '\\') {
-                    pattern++;
-                    patternLen--;
-                    if (pattern[0] == string[0])
-                        match = 1;
-                } else if (pattern[0] == ']') {
-                    break;
-                } else if (patternLen == 0) {
-                    pattern--;
-                    patternLen++;
-                    break;
-                } else if (pattern[1] == '-' && patternLen >= 3) {
-                    int start = pattern[0];
-                    int end = pattern[2];
-                    int c = string[0];
-                    if (start > end) {
-                        int t = start;
-                        start = end;
-                        end = t;
-                    }
-                    if (nocase) {
-                        start = tolower(start);
-                        end = tolower(end);
-                        c = tolower(c);
-                    }
-                    pattern += 2;
-                    patternLen -= 2;
-                    if (c >= start && c <= end)
+    switch(p[0]) {
+    case '?':
+        *consumed = 1;
+        return 1;
+    case '[':
+    {
+        int _not, match = 0;
+
+        p++;
+        plen--;
+        _not = plen && p[0] == '^';
+        if (_not) {
+            p++;
+            plen--;
+        }
+        while(1) {
+            if (plen == 0) {
+                /* Unterminated class: the last char closes it. */
+                p--;
+                plen++;
+                break;
+            } else if (p[0] == '\\' && plen >= 2) {
+                p++;
+                plen--;
+                if (p[0] == c)
+                    match = 1;
+            } else if (p[0] == ']') {
+                break;
+            } else if (plen >= 3 && p[1] == '-') {
+                int start = p[0];
+                int end = p[2];
+                int cc = c;
+                if (start > end) {
+                    int t = start;
+                    start = end;
+                    end = t;
+                }
+                if (nocase) {
+                    start = tolower(start);
+                    end = tolower(end);
+                    cc = tolower(cc);
+                }
+                p += 2;
+                plen -= 2;
+                if (cc >= start && cc <= end)
+                    match = 1;
+            } else {
+                if (!nocase) {
+                    if (p[0] == c)
                         match = 1;
                 } else {
-                    if (!nocase) {
-                        if (pattern[0] == string[0])
-                            match = 1;
-                    } else {
-                        if (tolower((int)pattern[0]) == tolower((int)string[0]))
-                            match = 1;
-                    }
+                    if (tolower((int)p[0]) == tolower(c))
+                        match = 1;
                 }
-                pattern++;
-                patternLen--;
             }
-            if (_not)
-                match = !match;
-            if (!match)
-                return 0; /* no match */
-            string++;
-            stringLen--;
-            break;
+            p++;
+            plen--;
+        }
+        *consumed = (p-pattern)+1;
+        return _not ? !match : match;
+    }
+    case '\\':
+        if (plen >= 2) {
+            p++;
+            plen--;
         }
-        case '\\':
-            if (patternLen >= 2) {
+        /* fall through */
+    default:
+        *consumed = (p-pattern)+1;
+        if (!nocase) return p[0] == c;
+        return tolower((int)p[0]) == tolower(c);
+    }
+}
+
+/* Glob-style pattern matching.
+ *
+ * Every token but '*' matches exactly one character, so when a token does
+ * not match it is enough to retry from the last '*', making it absorb one
+ * more character: the earlier stars can't do better than that. This takes
+ * at most O(patternLen*stringLen) steps, without recursion. */
+int stringmatchlen(const char *pattern, int patternLen,
+        const char *string, int stringLen, int nocase)
+{
+    const char *star = NULL, *backtrack = NULL;
+    int starLen = 0, backtrackLen = 0, consumed;
+
+    while(stringLen) {
+        if (patternLen && pattern[0] == '*') {
+            while (patternLen > 1 && pattern[1] == '*') {
                 pattern++;
                 patternLen--;
             }
-            /* fall through */
-        default:
-            if (!nocase) {
-                if (pattern[0] != string[0])
-                    return 0; /* no match */
-            } else {
-                if (tolower((int)pattern[0]) != tolower((int)string[0]))
-                    return 0; /* no match */
-            }
+            if (patternLen == 1)
+                return 1; /* match */
+            star = ++pattern;
+            starLen = --patternLen;
+            backtrack = string;
+            backtrackLen = stringLen;
+            continue;
+        }
+        if (patternLen &&
+            stringmatchToken(pattern,patternLen,string[0],
+                             nocase,&consumed))
+        {
+            pattern += consumed;
+            patternLen -= consumed;
             string++;
             stringLen--;
-            break;
+            continue;
         }
+        if (star == NULL)
+            return 0; /* no match */
+        /* Let the last star absorb one more character. */
+        pattern = star;
+        patternLen = starLen;
+        string = ++backtrack;
+        stringLen = --backtrackLen;
+    }
+    while(patternLen && pattern[0] == '*') {
         pattern++;
         patternLen--;
-        if (stringLen == 0) {
-            while(*pattern == '*') {
-                pattern++;
-                patternLen--;
-            }
-            break;
-        }
     }
-    if (patternLen == 0 && stringLen == 0)
-        return 1;
-    return 0;
+    return patternLen == 0;
 }
 
 int stringmatch(const char *pattern, const char *string, int nocase) {
     return stringmatchlen(pattern,strlen(pattern),string,strlen(string),nocase);
 }
 
+/* Analyze the pattern so that stringmatchCompiled() can match it. The
+ * pattern is referenced, not copied, so it must outlive 'sp'.
+ *
+ * The literal prefix and suffix are the characters before the first and
+ * after the last special char: they are only computed when the pattern has
+ * no [...] class or escape, where a plain character may not be literal. */
+void stringmatchCompile(stringmatchPattern *sp, const char *p, int plen, int nocase) {
+    int j, stars = 0, questions = 0, classes = 0, first = -1, last = -1;
+
+    sp->pattern = p;
+    sp->len = plen;
+    sp->nocase = nocase;
+    sp->prefixlen = sp->suffixlen = sp->minlen = 0;
+
+    for (j = 0; j < plen; j++) {
+        switch(p[j]) {
+        case '*': stars++; break;
+        case '?': questions++; break;
+        case '[': case '\\': classes++; break;
+        default: continue;
+        }
+        if (first == -1) first = j;
+        last = j;
+    }
+
+    if (first == -1) {
+        sp->type = STRINGMATCH_EXACT;
+        sp->prefixlen = sp->minlen = plen;
+        return;
+    }
+    sp->prefixlen = sp->minlen = first;
+    if (classes) {
+        sp->type = STRINGMATCH_GLOB;
+        return;
+    }
+    sp->suffixlen = plen-last-1;
+    sp->minlen = plen-stars;
+    if (stars == plen) {
+        sp->type = STRINGMATCH_ALL;
+    } else if (questions == 0 && stars == last-first+1) {
+        /* All the special chars are in a single run of stars. */
+        sp->type = STRINGMATCH_AFFIX;
+    } else if (questions == 0 && !nocase && p[0] == '*' && p[plen-1] == '*') {
+        /* Check that the stars are only at the two ends. */
+        int lead = 0, trail = 0;
+        while (p[lead] == '*') lead++;
+        while (p[plen-1-trail] == '*') trail++;
+        if (lead+trail == stars) {
+            sp->type = STRINGMATCH_CONTAINS;
+            sp->prefixlen = lead; /* Offset of the literal in the pattern. */
+        } else {
+            sp->type = STRINGMATCH_GLOB;
+        }
+    } else {
+        sp->type = STRINGMATCH_GLOB;
+    }
+}
+
+static inline int stringmatchEqual(const char *a, const char *b, int len,
+                                   int nocase)
+{
+    return nocase ? strncasecmp(a,b,len) == 0 : memcmp(a,b,len) == 0;
+}
+
+/* Match the string against a pattern compiled by stringmatchCompile().
+ * Returns the same as stringmatchlen() would. */
+int stringmatchCompiled(const stringmatchPattern *sp, const char *s, int slen) {
+    const char *p = sp->pattern;
+
+    switch(sp->type) {
+    case STRINGMATCH_ALL:
+        return 1;
+    case STRINGMATCH_EXACT:
+        return slen == sp->len && stringmatchEqual(p,s,slen,sp->nocase);
+    case STRINGMATCH_AFFIX:
+        return slen >= sp->minlen &&
+               stringmatchEqual(p,s,sp->prefixlen,sp->nocase) &&
+               stringmatchEqual(p+sp->len-sp->suffixlen,s+slen-sp->suffixlen,
+                                sp->suffixlen,sp->nocase);
+    case STRINGMATCH_CONTAINS:
+        return slen >= sp->minlen &&
+               memmem(s,slen,p+sp->prefixlen,sp->minlen) != NULL;
+    default:
+        if (slen < sp->minlen) return 0;
+        if (!stringmatchEqual(p,s,sp->prefixlen,sp->nocase)) return 0;
+        if (!stringmatchEqual(p+sp->len-sp->suffixlen,s+slen-sp->suffixlen,
+                              sp->suffixlen,sp->nocase)) return 0;
+        /* The literal prefix matched, the rest needs the glob matcher. */
+        return stringmatchlen(p+sp->prefixlen,sp->len-sp->prefixlen,
+                              s+sp->prefixlen,slen-sp->prefixlen,sp->nocase);
+    }
+}
+
 /* Convert a string representing an amount of memory into the number of
  * bytes, so for instance memtoll("1Gb") will return 1073741824 that is
  * (1024*1024*1024).
@@ -231,25 +335,22 @@ long long memtoll(const char *p, int *err) {
 }
 
 /* Return the number of digits of 'v' when converted to string in radix 10.
- * See ll2string() for more information. */
+ * See ll2string() for more information.
+ *
+ * The bit length of 'v' times log10(2) (1233/4096) is either the number of
+ * digits or one more, and a single comparison with the matching power of
+ * ten tells which, so there are no data dependent branches. */
 uint32_t digits10(uint64_t v) {
-    if (v < 10) return 1;
-    if (v < 100) return 2;
-    if (v < 1000) return 3;
-    if (v < 1000000000000UL) {
-        if (v < 100000000UL) {
-            if (v < 1000000) {
-                if (v < 10000) return 4;
-                return 5 + (v >= 100000);
-            }
-            return 7 + (v >= 10000000UL);
-        }
-        if (v < 10000000000UL) {
-            return 9 + (v >= 1000000000UL);
-        }
-        return 11 + (v >= 100000000000UL);
-    }
-    return 12 + digits10(v / 1000000000000UL);
+    static const uint64_t pow10[20] = {
+        0, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+        10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+        100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+        100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+        100000000000000000ULL, 1000000000000000000ULL,
+        10000000000000000000ULL
+    };
+    uint32_t t = ((64 - __builtin_clzll(v | 1)) * 1233) >> 12;
+    return t - (v < pow10[t]) + 1;
 }
 
 /* Like digits10() but for signed values. */
@@ -449,8 +550,311 @@ int string2ld(const char *s, size_t slen, long double *dp) {
     return 1;
 }
 
+/* Round trip formatting of doubles, using the Grisu2 algorithm
+ * described in "Printing Floating-Point Numbers Quickly and Accurately
+ * with Integers" (Florian Loitsch, 2010). The digits it generates always
+ * read back to the same double with strtod(3), and they are the shortest
+ * such digits for the vast majority of the inputs, so a score like 0.1 is
+ * emitted as "0.1" instead of "0.10000000000000001" without the cost of
+ * going through snprintf(). */
+struct grisuFp {
+    uint64_t f;
+    int e;
+};
+
+#define GRISU_FRACT_MASK 0x000FFFFFFFFFFFFFULL
+#define GRISU_EXP_MASK 0x7FF0000000000000ULL
+#define GRISU_HIDDEN_BIT 0x0010000000000000ULL
+#define GRISU_MANT_BITS 52
+#define GRISU_EXP_BIAS 1075
+#define GRISU_FIRST_POW10 (-348)
+#define GRISU_STEP_POW10 8
+#define GRISU_EXP_MIN (-60)
+#define GRISU_EXP_MAX (-32)
+
+/* Normalized 64 bit approximations of 10^k, k = -348, -340, ..., 340. */
+static const grisuFp grisuPow10[] = {
+    {0xfa8fd5a0081c0288ULL,-1220}, {0xbaaee17fa23ebf76ULL,-1193},
+    {0x8b16fb203055ac76ULL,-1166}, {0xcf42894a5dce35eaULL,-1140},
+    {0x9a6bb0aa55653b2dULL,-1113}, {0xe61acf033d1a45dfULL,-1087},
+    {0xab70fe17c79ac6caULL,-1060}, {0xff77b1fcbebcdc4fULL,-1034},
+    {0xbe5691ef416bd60cULL,-1007}, {0x8dd01fad907ffc3cULL, -980},
+    {0xd3515c2831559a83ULL, -954}, {0x9d71ac8fada6c9b5ULL, -927},
+    {0xea9c227723ee8bcbULL, -901}, {0xaecc49914078536dULL, -874},
+    {0x823c12795db6ce57ULL, -847}, {0xc21094364dfb5637ULL, -821},
+    {0x9096ea6f3848984fULL, -794}, {0xd77485cb25823ac7ULL, -768},
+    {0xa086cfcd97bf97f4ULL, -741}, {0xef340a98172aace5ULL, -715},
+    {0xb23867fb2a35b28eULL, -688}, {0x84c8d4dfd2c63f3bULL, -661},
+    {0xc5dd44271ad3cdbaULL, -635}, {0x936b9fcebb25c996ULL, -608},
+    {0xdbac6c247d62a584ULL, -582}, {0xa3ab66580d5fdaf6ULL, -555},
+    {0xf3e2f893dec3f126ULL, -529}, {0xb5b5ada8aaff80b8ULL, -502},
+    {0x87625f056c7c4a8bULL, -475}, {0xc9bcff6034c13053ULL, -449},
+    {0x964e858c91ba2655ULL, -422}, {0xdff9772470297ebdULL, -396},
+    {0xa6dfbd9fb8e5b88fULL, -369}, {0xf8a95fcf88747d94ULL, -343},
+    {0xb94470938fa89bcfULL, -316}, {0x8a08f0f8bf0f156bULL, -289},
+    {0xcdb02555653131b6ULL, -263}, {0x993fe2c6d07b7facULL, -236},
+    {0xe45c10c42a2b3b06ULL, -210}, {0xaa242499697392d3ULL, -183},
+    {0xfd87b5f28300ca0eULL, -157}, {0xbce5086492111aebULL, -130},
+    {0x8cbccc096f5088ccULL, -103}, {0xd1b71758e219652cULL,  -77},
+    {0x9c40000000000000ULL,  -50}, {0xe8d4a51000000000ULL,  -24},
+    {0xad78ebc5ac620000ULL,    3}, {0x813f3978f8940984ULL,   30},
+    {0xc097ce7bc90715b3ULL,   56}, {0x8f7e32ce7bea5c70ULL,   83},
+    {0xd5d238a4abe98068ULL,  109}, {0x9f4f2726179a2245ULL,  136},
+    {0xed63a231d4c4fb27ULL,  162}, {0xb0de65388cc8ada8ULL,  189},
+    {0x83c7088e1aab65dbULL,  216}, {0xc45d1df942711d9aULL,  242},
+    {0x924d692ca61be758ULL,  269}, {0xda01ee641a708deaULL,  295},
+    {0xa26da3999aef774aULL,  322}, {0xf209787bb47d6b85ULL,  348},
+    {0xb454e4a179dd1877ULL,  375}, {0x865b86925b9bc5c2ULL,  402},
+    {0xc83553c5c8965d3dULL,  428}, {0x952ab45cfa97a0b3ULL,  455},
+    {0xde469fbd99a05fe3ULL,  481}, {0xa59bc234db398c25ULL,  508},
+    {0xf6c69a72a3989f5cULL,  534}, {0xb7dcbf5354e9beceULL,  561},
+    {0x88fcf317f22241e2ULL,  588}, {0xcc20ce9bd35c78a5ULL,  614},
+    {0x98165af37b2153dfULL,  641}, {0xe2a0b5dc971f303aULL,  667},
+    {0xa8d9d1535ce3b396ULL,  694}, {0xfb9b7cd9a4a7443cULL,  720},
+    {0xbb764c4ca7a44410ULL,  747}, {0x8bab8eefb6409c1aULL,  774},
+    {0xd01fef10a657842cULL,  800}, {0x9b10a4e5e9913129ULL,  827},
+    {0xe7109bfba19c0c9dULL,  853}, {0xac2820d9623bf429ULL,  880},
+    {0x80444b5e7aa7cf85ULL,  907}, {0xbf21e44003acdd2dULL,  933},
+    {0x8e679c2f5e44ff8fULL,  960}, {0xd433179d9c8cb841ULL,  986},
+    {0x9e19db92b4e31ba9ULL, 1013}, {0xeb96bf6ebadf77d9ULL, 1039},
+    {0xaf87023b9bf0ee6bULL, 1066},
+};
+
+static const uint64_t grisuTens[] = {
+    10000000000000000000ULL, 1000000000000000000ULL, 100000000000000000ULL,
+    10000000000000000ULL, 1000000000000000ULL, 100000000000000ULL,
+    10000000000000ULL, 1000000000000ULL, 100000000000ULL, 10000000000ULL,
+    1000000000ULL, 100000000ULL, 10000000ULL, 1000000ULL, 100000ULL,
+    10000ULL, 1000ULL, 100ULL, 10ULL, 1ULL
+};
+
+static grisuFp grisuBuildFp(double d) {
+    uint64_t bits;
+    grisuFp fp;
+
+    memcpy(&bits,&d,sizeof(bits));
+    fp.f = bits & GRISU_FRACT_MASK;
+    fp.e = (bits & GRISU_EXP_MASK) >> GRISU_MANT_BITS;
+    if (fp.e) {
+        fp.f += GRISU_HIDDEN_BIT;
+        fp.e -= GRISU_EXP_BIAS;
+    } else {
+        fp.e = -GRISU_EXP_BIAS+1; /* Subnormal. */
+    }
+    return fp;
+}
+
+static void grisuNormalize(grisuFp *fp) {
+    while (!(fp->f & GRISU_HIDDEN_BIT)) {
+        fp->f <<= 1;
+        fp->e--;
+    }
+    fp->f <<= 64-GRISU_MANT_BITS-1;
+    fp->e -= 64-GRISU_MANT_BITS-1;
+}
+
+/* Compute the boundaries m- and m+ of the interval of the reals that round
+ * to 'fp', normalized to the same exponent. */
+static void grisuBoundaries(grisuFp *fp, grisuFp *lower, grisuFp *upper) {
+    upper->f = (fp->f << 1) + 1;
+    upper->e = fp->e - 1;
+    while (!(upper->f & (GRISU_HIDDEN_BIT << 1))) {
+        upper->f <<= 1;
+        upper->e--;
+    }
+    upper->f <<= 64-GRISU_MANT_BITS-2;
+    upper->e -= 64-GRISU_MANT_BITS-2;
+
+    /* The lower boundary is closer when 'fp' is a power of two. */
+    int lshift = fp->f == GRISU_HIDDEN_BIT ? 2 : 1;
+    lower->f = (fp->f << lshift) - 1;
+    lower->e = fp->e - lshift;
+    lower->f <<= lower->e - upper->e;
+    lower->e = upper->e;
+}
+
+/* Rounded product of the 64 bit significands. */
+static grisuFp grisuMultiply(grisuFp *a, grisuFp *b) {
+    const uint64_t lomask = 0x00000000FFFFFFFFULL;
+    uint64_t ah_bl = (a->f >> 32) * (b->f & lomask);
+    uint64_t al_bh = (a->f & lomask) * (b->f >> 32);
+    uint64_t al_bl = (a->f & lomask) * (b->f & lomask);
+    uint64_t ah_bh = (a->f >> 32) * (b->f >> 32);
+    uint64_t tmp = (al_bl >> 32) + (ah_bl & lomask) + (al_bh & lomask);
+    tmp += 1ULL << 31; /* Round. */
+    grisuFp p;
+    p.f = ah_bh + (ah_bl >> 32) + (al_bh >> 32) + (tmp >> 32);
+    p.e = a->e + b->e + 64;
+    return p;
+}
+
+/* Find the cached power of ten that brings the binary exponent 'e' in the
+ * [GRISU_EXP_MIN, GRISU_EXP_MAX] range, returning its decimal exponent
+ * in '*k'. */
+static grisuFp grisuCachedPow10(int e, int *k) {
+    /* A 64 bit normalized 10^k has a binary exponent close to
+     * k*log2(10)-63: aim at the middle of the range and refine. */
+    const double one_log_ten = 0.30102999566398114;
+    int approx = -(e + 64 - (GRISU_EXP_MIN+GRISU_EXP_MAX)/2 - 63) * one_log_ten;
+    int idx = (approx - GRISU_FIRST_POW10) / GRISU_STEP_POW10;
+
+    while (1) {
+        int current = e + grisuPow10[idx].e + 64;
+        if (current < GRISU_EXP_MIN) {
+            idx++;
+        } else if (current > GRISU_EXP_MAX) {
+            idx--;
+        } else {
+            *k = GRISU_FIRST_POW10 + idx*GRISU_STEP_POW10;
+            return grisuPow10[idx];
+        }
+    }
+}
+
+/* Move the last digit towards the value while it stays inside the
+ * rounding interval. */
+static void grisuRoundDigit(char *digits, int ndigits, uint64_t delta,
+                            uint64_t rem, uint64_t kappa, uint64_t frac)
+{
+    while (rem < frac && delta - rem >= kappa &&
+           (rem + kappa < frac || frac - rem > rem + kappa - frac))
+    {
+        digits[ndigits-1]--;
+        rem += kappa;
+    }
+}
+
+static int grisuDigits(grisuFp *fp, grisuFp *upper, grisuFp *lower,
+                       char *digits, int *K)
+{
+    uint64_t wfrac = upper->f - fp->f;
+    uint64_t delta = upper->f - lower->f;
+    int shift = -upper->e;
+    uint64_t one = 1ULL << shift;
+    uint64_t part1 = upper->f >> shift;
+    uint64_t part2 = upper->f & (one - 1);
+    int idx = 0, kappa = 10;
+
+    /* Integral part: part1 fits in 32 bits, so it has at most 10 digits. */
+    for (const uint64_t *divp = grisuTens+10; kappa > 0; divp++) {
+        uint64_t div = *divp;
+        unsigned digit = part1 / div;
+        if (digit || idx) digits[idx++] = digit + '0';
+        part1 -= digit * div;
+        kappa--;
+        uint64_t tmp = (part1 << shift) + part2;
+        if (tmp <= delta) {
+            *K += kappa;
+            grisuRoundDigit(digits,idx,delta,tmp,div << shift,wfrac);
+            return idx;
+        }
+    }
+
+    /* Fractional part. */
+    const uint64_t *unit = grisuTens+18;
+    while (1) {
+        part2 *= 10;
+        delta *= 10;
+        kappa--;
+        unsigned digit = part2 >> shift;
+        if (digit || idx) digits[idx++] = digit + '0';
+        part2 &= one - 1;
+        if (part2 < delta) {
+            *K += kappa;
+            grisuRoundDigit(digits,idx,delta,part2,one,wfrac * *unit);
+            return idx;
+        }
+        unit--;
+    }
+}
+
+/* Emit the digits of a positive finite double 'value' into 'digits',
+ * returning their count and setting '*K' so that value = digits * 10^K. */
+static int grisu2(double value, char *digits, int *K) {
+    grisuFp w = grisuBuildFp(value);
+    grisuFp lower, upper;
+    int k;
+
+    grisuBoundaries(&w,&lower,&upper);
+    grisuNormalize(&w);
+    grisuFp cp = grisuCachedPow10(upper.e,&k);
+    w = grisuMultiply(&w,&cp);
+    upper = grisuMultiply(&upper,&cp);
+    lower = grisuMultiply(&lower,&cp);
+    lower.f++;
+    upper.f--;
+    *K = -k;
+    return grisuDigits(&w,&upper,&lower,digits,K);
+}
+
+/* Format a finite non zero double with Grisu2 digits that round trip,
+ * laying them out like the "%.17g" printf format would: exponential
+ * notation when the decimal exponent is less than -4 or greater than 16.
+ * Returns the number of bytes written, excluding the null terminator, or
+ * zero if there was not enough room. At most 24 bytes plus the null
+ * terminator are ever needed. */
+static int grisuFormat(char *buf, size_t len, double value) {
+    char digits[24], tmp[32];
+    char *p = tmp;
+    int K, ndigits;
+
+    if (value < 0) {
+        *p++ = '-';
+        value = -value;
+    }
+    ndigits = grisu2(value,digits,&K);
+    int exp10 = ndigits + K - 1; /* Exponent in scientific notation. */
+
+    if (exp10 < -4 || exp10 > 16) {
+        *p++ = digits[0];
+        if (ndigits > 1) {
+            *p++ = '.';
+            memcpy(p,digits+1,ndigits-1);
+            p += ndigits-1;
+        }
+        *p++ = 'e';
+        *p++ = exp10 < 0 ? '-' : '+';
+        if (exp10 < 0) exp10 = -exp10;
+        if (exp10 >= 100) {
+            *p++ = '0' + exp10/100;
+            exp10 %= 100;
+        }
+        *p++ = '0' + exp10/10;
+        *p++ = '0' + exp10%10;
+    } else if (K >= 0) {
+        /* Integer: pad with zeros. */
+        memcpy(p,digits,ndigits);
+        p += ndigits;
+        memset(p,'0',K);
+        p += K;
+    } else if (exp10 >= 0) {
+        /* Decimal point inside the digits. */
+        memcpy(p,digits,exp10+1);
+        p += exp10+1;
+        *p++ = '.';
+        memcpy(p,digits+exp10+1,ndigits-exp10-1);
+        p += ndigits-exp10-1;
+    } else {
+        /* Leading zeros after the decimal point. */
+        *p++ = '0';
+        *p++ = '.';
+        memset(p,'0',-exp10-1);
+        p += -exp10-1;
+        memcpy(p,digits,ndigits);
+        p += ndigits;
+    }
+
+    size_t l = p - tmp;
+    if (l+1 > len) return 0;
+    memcpy(buf,tmp,l);
+    buf[l] = '\0';
+    return l;
+}
+
 /* Convert a double to a string representation. Returns the number of bytes
- * required. The representation should always be parsable by strtod(3).
+ * required. The representation should always be parsable by strtod(3), and
+ * uses the Grisu2 digits that read back to the same double: the shortest
+ * ones for almost every input, but a digit more is emitted in a few cases.
  * This function does not support human-friendly formatting like ld2string
  * does. It is intented mainly to be used inside t_zset.c when writing scores
  * into a ziplist representing a sorted set. */
@@ -485,7 +889,7 @@ int d2string(char *buf, size_t len, double value) {
             len = ll2string(buf,len,(long long)value);
         else
 #endif
-            len = snprintf(buf,len,"%.17g",value);
+            len = grisuFormat(buf,len,value);
     }
 
     return len;
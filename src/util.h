@@ -35,6 +35,28 @@
 
 int stringmatchlen(const char *p, int plen, const char *s, int slen, int nocase);
 int stringmatch(const char *p, const char *s, int nocase);
+
+/* A glob-style pattern analyzed once by stringmatchCompile(), to be matched
+ * against many strings, for instance all the keys scanned by KEYS. The
+ * common pattern shapes are matched without running the glob matcher. */
+#define STRINGMATCH_ALL 0       /* "*": everything matches. */
+#define STRINGMATCH_EXACT 1     /* No special char: a plain comparison. */
+#define STRINGMATCH_AFFIX 2     /* "prefix*suffix", each part optional. */
+#define STRINGMATCH_CONTAINS 3  /* "*literal*". */
+#define STRINGMATCH_GLOB 4      /* Anything else. */
+
+struct stringmatchPattern {
+    const char *pattern;    /* The pattern, that is not copied. */
+    int len;
+    int nocase;
+    int type;               /* STRINGMATCH_* */
+    int prefixlen;          /* Length of the literal prefix. */
+    int suffixlen;          /* Length of the literal suffix. */
+    int minlen;             /* Length of the shortest matching string. */
+};
+
+void stringmatchCompile(stringmatchPattern *sp, const char *p, int plen, int nocase);
+int stringmatchCompiled(const stringmatchPattern *sp, const char *s, int slen);
 long long memtoll(const char *p, int *err);
 uint32_t digits10(uint64_t v);
 uint32_t sdigits10(int64_t v);
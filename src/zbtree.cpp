@@ -0,0 +1,608 @@
+/* B+tree implementation for big sorted sets, see zbtree.h.
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+
+/* Nodes with less entries than this are merged with a sibling, or take
+ * entries from it, after a deletion. */
+#define ZBTREE_LEAF_MIN (ZBTREE_LEAF_ENTRIES/2)
+#define ZBTREE_INNER_MIN (ZBTREE_INNER_ENTRIES/2)
+
+/* Compare two (score, element) pairs, with the same ordering used by the
+ * skiplist. */
+static inline int zbtCompare(double s1, sds e1, double s2, sds e2) {
+    if (s1 < s2) return -1;
+    if (s1 > s2) return 1;
+    return sdscmp(e1,e2);
+}
+
+/* Position of the first entry of the leaf not less than the pair. */
+static int zbtLeafLowerBound(zbtLeaf *leaf, double score, sds ele) {
+    int lo = 0, hi = leaf->count;
+
+    while (lo < hi) {
+        int mid = (lo+hi)/2;
+        if (zbtCompare(leaf->scores[mid],leaf->eles[mid],score,ele) < 0)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Child of the inner node that may contain the pair: the first one with a
+ * greatest pair not less than it, or the last one. */
+static int zbtInnerChild(zbtInner *in, double score, sds ele) {
+    int i = 0, last = in->count-1;
+
+    while (i < last && (in->maxscores[i] < score ||
+           (in->maxscores[i] == score && sdscmp(in->maxeles[i],ele) < 0)))
+        i++;
+    return i;
+}
+
+static unsigned long zbtNodeSize(void *node, int height) {
+    if (height == 0) return ((zbtLeaf*)node)->count;
+
+    zbtInner *in = (zbtInner*)node;
+    unsigned long size = 0;
+    for (unsigned int j = 0; j < in->count; j++) size += in->sizes[j];
+    return size;
+}
+
+/* Refresh the size and the greatest pair of the child 'i' of 'in'. */
+static void zbtUpdateChild(zbtInner *in, int i, int height) {
+    void *child = in->children[i];
+
+    in->sizes[i] = zbtNodeSize(child,height);
+    if (height == 0) {
+        zbtLeaf *leaf = (zbtLeaf*)child;
+        if (leaf->count == 0) return;
+        in->maxscores[i] = leaf->scores[leaf->count-1];
+        in->maxeles[i] = leaf->eles[leaf->count-1];
+    } else {
+        zbtInner *c = (zbtInner*)child;
+        in->maxscores[i] = c->maxscores[c->count-1];
+        in->maxeles[i] = c->maxeles[c->count-1];
+    }
+}
+
+/* Move 'n' children of 'src' starting at 'spos' to 'dst' at 'dpos'. The
+ * destination must have room for them. */
+static void zbtInnerMove(zbtInner *dst, int dpos, zbtInner *src, int spos, int n) {
+    int tail = dst->count-dpos;
+
+    memmove(dst->sizes+dpos+n,dst->sizes+dpos,sizeof(unsigned long)*tail);
+    memmove(dst->maxscores+dpos+n,dst->maxscores+dpos,sizeof(double)*tail);
+    memmove(dst->maxeles+dpos+n,dst->maxeles+dpos,sizeof(sds)*tail);
+    memmove(dst->children+dpos+n,dst->children+dpos,sizeof(void*)*tail);
+    memcpy(dst->sizes+dpos,src->sizes+spos,sizeof(unsigned long)*n);
+    memcpy(dst->maxscores+dpos,src->maxscores+spos,sizeof(double)*n);
+    memcpy(dst->maxeles+dpos,src->maxeles+spos,sizeof(sds)*n);
+    memcpy(dst->children+dpos,src->children+spos,sizeof(void*)*n);
+    dst->count += n;
+
+    tail = src->count-spos-n;
+    memmove(src->sizes+spos,src->sizes+spos+n,sizeof(unsigned long)*tail);
+    memmove(src->maxscores+spos,src->maxscores+spos+n,sizeof(double)*tail);
+    memmove(src->maxeles+spos,src->maxeles+spos+n,sizeof(sds)*tail);
+    memmove(src->children+spos,src->children+spos+n,sizeof(void*)*tail);
+    src->count -= n;
+}
+
+/* Same as zbtInnerMove() for the entries of two leaves. */
+static void zbtLeafMove(zbtLeaf *dst, int dpos, zbtLeaf *src, int spos, int n) {
+    int tail = dst->count-dpos;
+
+    memmove(dst->scores+dpos+n,dst->scores+dpos,sizeof(double)*tail);
+    memmove(dst->eles+dpos+n,dst->eles+dpos,sizeof(sds)*tail);
+    memcpy(dst->scores+dpos,src->scores+spos,sizeof(double)*n);
+    memcpy(dst->eles+dpos,src->eles+spos,sizeof(sds)*n);
+    dst->count += n;
+
+    tail = src->count-spos-n;
+    memmove(src->scores+spos,src->scores+spos+n,sizeof(double)*tail);
+    memmove(src->eles+spos,src->eles+spos+n,sizeof(sds)*tail);
+    src->count -= n;
+}
+
+static void zbtLeafInsertAt(zbtLeaf *leaf, int pos, double score, sds ele) {
+    memmove(leaf->scores+pos+1,leaf->scores+pos,sizeof(double)*(leaf->count-pos));
+    memmove(leaf->eles+pos+1,leaf->eles+pos,sizeof(sds)*(leaf->count-pos));
+    leaf->scores[pos] = score;
+    leaf->eles[pos] = ele;
+    leaf->count++;
+}
+
+static void zbtInnerRemoveAt(zbtInner *in, int pos) {
+    int tail = in->count-pos-1;
+
+    memmove(in->sizes+pos,in->sizes+pos+1,sizeof(unsigned long)*tail);
+    memmove(in->maxscores+pos,in->maxscores+pos+1,sizeof(double)*tail);
+    memmove(in->maxeles+pos,in->maxeles+pos+1,sizeof(sds)*tail);
+    memmove(in->children+pos,in->children+pos+1,sizeof(void*)*tail);
+    in->count--;
+}
+
+static void zbtInnerInsertAt(zbtInner *in, int pos, void *child, int height) {
+    int tail = in->count-pos;
+
+    memmove(in->sizes+pos+1,in->sizes+pos,sizeof(unsigned long)*tail);
+    memmove(in->maxscores+pos+1,in->maxscores+pos,sizeof(double)*tail);
+    memmove(in->maxeles+pos+1,in->maxeles+pos,sizeof(sds)*tail);
+    memmove(in->children+pos+1,in->children+pos,sizeof(void*)*tail);
+    in->children[pos] = child;
+    in->count++;
+    zbtUpdateChild(in,pos,height);
+}
+
+zbtree *zbtCreate(void) {
+    zbtree *zbt = new (zmalloc(sizeof(zbtree))) zbtree;
+    return zbt;
+}
+
+void zbtFree(zbtree *zbt) {
+    zbt->~zbtree();
+    zfree(zbt);
+}
+
+zbtree::zbtree()
+: m_root(NULL)
+, m_height(0)
+, m_length(0)
+, m_head(NULL)
+, m_tail(NULL)
+, m_alloc_size(0)
+{
+    m_head = m_tail = zbtCreateLeaf();
+    m_root = m_head;
+}
+
+zbtree::~zbtree()
+{
+    zbtFreeNode(m_root,m_height);
+}
+
+zbtLeaf *zbtree::zbtCreateLeaf() {
+    zbtLeaf *leaf = (zbtLeaf*)zmalloc(sizeof(*leaf));
+    leaf->prev = leaf->next = NULL;
+    leaf->count = 0;
+    m_alloc_size += sizeof(*leaf);
+    return leaf;
+}
+
+zbtInner *zbtree::zbtCreateInner() {
+    zbtInner *in = (zbtInner*)zmalloc(sizeof(*in));
+    in->count = 0;
+    m_alloc_size += sizeof(*in);
+    return in;
+}
+
+/* Free a subtree together with its elements. */
+void zbtree::zbtFreeNode(void *node, int height) {
+    if (height == 0) {
+        zbtLeaf *leaf = (zbtLeaf*)node;
+        for (unsigned int j = 0; j < leaf->count; j++) sdsfree(leaf->eles[j]);
+        zfree(leaf);
+        return;
+    }
+    zbtInner *in = (zbtInner*)node;
+    for (unsigned int j = 0; j < in->count; j++)
+        zbtFreeNode(in->children[j],height-1);
+    zfree(in);
+}
+
+/* Insert the pair in the subtree. If the node had to be split the function
+ * returns the new right sibling, that the caller must link, otherwise NULL
+ * is returned. */
+void *zbtree::zbtInsertNode(void *node, int height, double score, sds ele) {
+    if (height == 0) {
+        zbtLeaf *leaf = (zbtLeaf*)node, *right;
+        int pos = zbtLeafLowerBound(leaf,score,ele);
+        int append, prepend;
+
+        if (leaf->count < ZBTREE_LEAF_ENTRIES) {
+            zbtLeafInsertAt(leaf,pos,score,ele);
+            return NULL;
+        }
+        append = leaf->next == NULL && pos == (int)leaf->count;
+        prepend = leaf->prev == NULL && pos == 0;
+        right = zbtCreateLeaf();
+        right->prev = leaf;
+        right->next = leaf->next;
+        if (leaf->next) leaf->next->prev = right; else m_tail = right;
+        leaf->next = right;
+
+        /* Appending to the last leaf or prepending to the first one, as when
+         * the tree is populated in order, leaves the old entries in a full
+         * leaf, otherwise the entries are split evenly. */
+        if (append) {
+            zbtLeafInsertAt(right,0,score,ele);
+        } else if (prepend) {
+            zbtLeafMove(right,0,leaf,0,leaf->count);
+            zbtLeafInsertAt(leaf,0,score,ele);
+        } else {
+            int half = leaf->count/2;
+            zbtLeafMove(right,0,leaf,half,leaf->count-half);
+            if (pos <= half)
+                zbtLeafInsertAt(leaf,pos,score,ele);
+            else
+                zbtLeafInsertAt(right,pos-half,score,ele);
+        }
+        return right;
+    }
+
+    zbtInner *in = (zbtInner*)node, *right;
+    int i = zbtInnerChild(in,score,ele);
+    void *split = zbtInsertNode(in->children[i],height-1,score,ele);
+
+    zbtUpdateChild(in,i,height-1);
+    if (split == NULL) return NULL;
+    if (in->count < ZBTREE_INNER_ENTRIES) {
+        zbtInnerInsertAt(in,i+1,split,height-1);
+        return NULL;
+    }
+    /* Inner nodes are always split evenly: every node but the root must
+     * have at least ZBTREE_INNER_MIN children, so that leaves emptied by a
+     * deletion always have a sibling to be merged with. */
+    int half = (in->count+1)/2;
+    right = zbtCreateInner();
+    zbtInnerMove(right,0,in,half,in->count-half);
+    if (i+1 <= half)
+        zbtInnerInsertAt(in,i+1,split,height-1);
+    else
+        zbtInnerInsertAt(right,i+1-half,split,height-1);
+    return right;
+}
+
+/* Insert a new element. The pair must not already be in the tree. The tree
+ * takes ownership of the 'ele' SDS string. */
+void zbtree::zbtInsert(double score, sds ele) {
+    void *split = zbtInsertNode(m_root,m_height,score,ele);
+
+    if (split) {
+        zbtInner *root = zbtCreateInner();
+        zbtInnerInsertAt(root,0,m_root,m_height);
+        zbtInnerInsertAt(root,1,split,m_height);
+        m_root = root;
+        m_height++;
+    }
+    m_length++;
+}
+
+/* Append the entries of the leaf 'r' to its left sibling 'l' and free it. */
+void zbtree::zbtMergeLeaves(zbtLeaf *l, zbtLeaf *r) {
+    zbtLeafMove(l,l->count,r,0,r->count);
+    l->next = r->next;
+    if (r->next) r->next->prev = l; else m_tail = l;
+    zfree(r);
+    m_alloc_size -= sizeof(*r);
+}
+
+/* Called after removing an element from the child 'i' of 'in': if the child
+ * is now too small it is merged with a sibling when they fit in a single
+ * node, otherwise entries are moved from the sibling so that both have about
+ * the same number. */
+void zbtree::zbtFixChild(zbtInner *in, int i, int height) {
+    unsigned int min = height ? ZBTREE_INNER_MIN : ZBTREE_LEAF_MIN;
+    unsigned int cap = height ? ZBTREE_INNER_ENTRIES : ZBTREE_LEAF_ENTRIES;
+    unsigned int lcount, rcount;
+    int l;
+
+#define ZBTREE_CHILD_COUNT(_n) (height ? ((zbtInner*)(_n))->count : \
+                                         ((zbtLeaf*)(_n))->count)
+    if (ZBTREE_CHILD_COUNT(in->children[i]) >= min || in->count == 1) {
+        zbtUpdateChild(in,i,height);
+        return;
+    }
+    l = (i+1 < (int)in->count) ? i : i-1;
+    lcount = ZBTREE_CHILD_COUNT(in->children[l]);
+    rcount = ZBTREE_CHILD_COUNT(in->children[l+1]);
+#undef ZBTREE_CHILD_COUNT
+
+    void *left = in->children[l], *right = in->children[l+1];
+    if (lcount+rcount <= cap) {
+        if (height == 0) {
+            zbtMergeLeaves((zbtLeaf*)left,(zbtLeaf*)right);
+        } else {
+            zbtInnerMove((zbtInner*)left,lcount,(zbtInner*)right,0,rcount);
+            zfree(right);
+            m_alloc_size -= sizeof(zbtInner);
+        }
+        zbtInnerRemoveAt(in,l+1);
+        zbtUpdateChild(in,l,height);
+        return;
+    }
+
+    if (height == 0) {
+        zbtLeaf *ll = (zbtLeaf*)left, *rl = (zbtLeaf*)right;
+        if (lcount < rcount)
+            zbtLeafMove(ll,lcount,rl,0,(rcount-lcount)/2);
+        else
+            zbtLeafMove(rl,0,ll,lcount-(lcount-rcount)/2,(lcount-rcount)/2);
+    } else {
+        zbtInner *li = (zbtInner*)left, *ri = (zbtInner*)right;
+        if (lcount < rcount)
+            zbtInnerMove(li,lcount,ri,0,(rcount-lcount)/2);
+        else
+            zbtInnerMove(ri,0,li,lcount-(lcount-rcount)/2,(lcount-rcount)/2);
+    }
+    zbtUpdateChild(in,l,height);
+    zbtUpdateChild(in,l+1,height);
+}
+
+/* Remove the pair from the subtree, storing the removed element SDS string
+ * in '*deleted'. Return 1 if the pair was found, 0 otherwise. */
+int zbtree::zbtDeleteNode(void *node, int height, double score, sds ele, sds *deleted) {
+    if (height == 0) {
+        zbtLeaf *leaf = (zbtLeaf*)node;
+        int pos = zbtLeafLowerBound(leaf,score,ele);
+
+        if (pos == (int)leaf->count ||
+            zbtCompare(leaf->scores[pos],leaf->eles[pos],score,ele) != 0)
+            return 0;
+        *deleted = leaf->eles[pos];
+        memmove(leaf->scores+pos,leaf->scores+pos+1,sizeof(double)*(leaf->count-pos-1));
+        memmove(leaf->eles+pos,leaf->eles+pos+1,sizeof(sds)*(leaf->count-pos-1));
+        leaf->count--;
+        return 1;
+    }
+
+    zbtInner *in = (zbtInner*)node;
+    int i = zbtInnerChild(in,score,ele);
+    if (!zbtDeleteNode(in->children[i],height-1,score,ele,deleted)) return 0;
+    zbtFixChild(in,i,height-1);
+    return 1;
+}
+
+/* Delete an element with matching score/element from the tree. The function
+ * returns 1 if the element was found and deleted, otherwise 0 is returned.
+ *
+ * If 'deleted' is NULL the SDS string of the removed element is freed,
+ * otherwise it is returned to the caller, that takes ownership of it. */
+int zbtree::zbtDelete(double score, sds ele, sds *deleted) {
+    sds removed;
+
+    if (!zbtDeleteNode(m_root,m_height,score,ele,&removed)) return 0;
+    m_length--;
+    while (m_height > 0 && ((zbtInner*)m_root)->count == 1) {
+        zbtInner *old = (zbtInner*)m_root;
+        m_root = old->children[0];
+        m_height--;
+        zfree(old);
+        m_alloc_size -= sizeof(*old);
+    }
+    if (deleted)
+        *deleted = removed;
+    else
+        sdsfree(removed);
+    return 1;
+}
+
+/* Change the score of an element already in the tree, keeping its SDS
+ * string. When the element stays at the same place the score is updated in
+ * place. */
+void zbtree::zbtUpdateScore(double curscore, sds ele, double newscore) {
+    void *node = m_root;
+    zbtLeaf *leaf;
+    sds removed;
+    int pos;
+
+    for (int h = m_height; h > 0; h--) {
+        zbtInner *in = (zbtInner*)node;
+        node = in->children[zbtInnerChild(in,curscore,ele)];
+    }
+    leaf = (zbtLeaf*)node;
+    pos = zbtLeafLowerBound(leaf,curscore,ele);
+    serverAssert(pos < (int)leaf->count && sdscmp(leaf->eles[pos],ele) == 0);
+
+    /* The greatest pair of the leaf is also stored in the inner nodes, so it
+     * can't be updated in place, and the first one is not checked against
+     * the previous leaf. */
+    if (pos > 0 && pos+1 < (int)leaf->count &&
+        zbtCompare(leaf->scores[pos-1],leaf->eles[pos-1],newscore,ele) < 0 &&
+        zbtCompare(leaf->scores[pos+1],leaf->eles[pos+1],newscore,ele) > 0)
+    {
+        leaf->scores[pos] = newscore;
+        return;
+    }
+    serverAssert(zbtDelete(curscore,ele,&removed));
+    zbtInsert(newscore,removed);
+}
+
+/* Find the rank for an element by both score and key.
+ * Returns 0 when the element cannot be found, rank otherwise.
+ * Note that the rank is 1-based. */
+unsigned long zbtree::zbtGetRank(double score, sds ele) {
+    unsigned long rank = 0;
+    void *node = m_root;
+
+    for (int h = m_height; h > 0; h--) {
+        zbtInner *in = (zbtInner*)node;
+        int i = zbtInnerChild(in,score,ele);
+        for (int j = 0; j < i; j++) rank += in->sizes[j];
+        node = in->children[i];
+    }
+    zbtLeaf *leaf = (zbtLeaf*)node;
+    int pos = zbtLeafLowerBound(leaf,score,ele);
+    if (pos == (int)leaf->count ||
+        zbtCompare(leaf->scores[pos],leaf->eles[pos],score,ele) != 0)
+        return 0;
+    return rank+pos+1;
+}
+
+/* Point the cursor to the element with the specified 1-based rank. Return 0
+ * if the rank is out of range. */
+int zbtree::zbtGetElementByRank(unsigned long rank, zbtCursor *c) {
+    void *node = m_root;
+
+    if (rank == 0 || rank > m_length) return 0;
+    rank--;
+    for (int h = m_height; h > 0; h--) {
+        zbtInner *in = (zbtInner*)node;
+        int i = 0;
+        while (rank >= in->sizes[i]) rank -= in->sizes[i++];
+        node = in->children[i];
+    }
+    c->leaf = (zbtLeaf*)node;
+    c->pos = rank;
+    return 1;
+}
+
+int zbtree::zbtFirst(zbtCursor *c) {
+    if (m_length == 0) return 0;
+    c->leaf = m_head;
+    c->pos = 0;
+    return 1;
+}
+
+int zbtree::zbtLast(zbtCursor *c) {
+    if (m_length == 0) return 0;
+    c->leaf = m_tail;
+    c->pos = m_tail->count-1;
+    return 1;
+}
+
+/* Point the cursor to the first element for which 'pred' is true. The
+ * predicate must be false for a prefix of the tree and true for the rest of
+ * it. Return 0 if there is no such element. */
+int zbtree::zbtSeek(zbtPredicate *pred, void *arg, zbtCursor *c) {
+    void *node = m_root;
+
+    for (int h = m_height; h > 0; h--) {
+        zbtInner *in = (zbtInner*)node;
+        unsigned int i = 0;
+        while (i < in->count && !pred(in->maxscores[i],in->maxeles[i],arg)) i++;
+        if (i == in->count) return 0;
+        node = in->children[i];
+    }
+    zbtLeaf *leaf = (zbtLeaf*)node;
+    unsigned int pos = 0;
+    while (pos < leaf->count && !pred(leaf->scores[pos],leaf->eles[pos],arg)) pos++;
+    if (pos == leaf->count) return 0;
+    c->leaf = leaf;
+    c->pos = pos;
+    return 1;
+}
+
+static int zbtGteMin(double score, sds ele, void *range) {
+    UNUSED(ele);
+    return zslValueGteMin(score,(zrangespec*)range);
+}
+
+static int zbtGtMax(double score, sds ele, void *range) {
+    UNUSED(ele);
+    return !zslValueLteMax(score,(zrangespec*)range);
+}
+
+static int zbtLexGteMin(double score, sds ele, void *range) {
+    UNUSED(score);
+    return zslLexValueGteMin(ele,(zlexrangespec*)range);
+}
+
+static int zbtLexGtMax(double score, sds ele, void *range) {
+    UNUSED(score);
+    return !zslLexValueLteMax(ele,(zlexrangespec*)range);
+}
+
+/* Find the first element that is contained in the specified range.
+ * Returns 0 when no element is contained in the range. */
+int zbtree::zbtFirstInRange(zrangespec *range, zbtCursor *c) {
+    if (!zbtSeek(zbtGteMin,range,c)) return 0;
+    return zslValueLteMax(zbtCursorScore(c),range);
+}
+
+/* Find the last element that is contained in the specified range.
+ * Returns 0 when no element is contained in the range. */
+int zbtree::zbtLastInRange(zrangespec *range, zbtCursor *c) {
+    if (zbtSeek(zbtGtMax,range,c)) {
+        if (!zbtPrev(c)) return 0;
+    } else if (!zbtLast(c)) {
+        return 0;
+    }
+    return zslValueGteMin(zbtCursorScore(c),range);
+}
+
+int zbtree::zbtFirstInLexRange(zlexrangespec *range, zbtCursor *c) {
+    if (!zbtSeek(zbtLexGteMin,range,c)) return 0;
+    return zslLexValueLteMax(zbtCursorEle(c),range);
+}
+
+int zbtree::zbtLastInLexRange(zlexrangespec *range, zbtCursor *c) {
+    if (zbtSeek(zbtLexGtMax,range,c)) {
+        if (!zbtPrev(c)) return 0;
+    } else if (!zbtLast(c)) {
+        return 0;
+    }
+    return zslLexValueGteMin(zbtCursorEle(c),range);
+}
+
+/* Delete all the elements with score between min and max from the tree and
+ * from the dictionary, returning the number of removed elements. */
+unsigned long zbtree::zbtDeleteRangeByScore(zrangespec *range, dict *dict) {
+    unsigned long removed = 0;
+    zbtCursor c;
+
+    while (zbtFirstInRange(range,&c)) {
+        sds ele = zbtCursorEle(&c);
+        dict->dictDelete(ele);
+        zbtDelete(zbtCursorScore(&c),ele,NULL);
+        removed++;
+    }
+    return removed;
+}
+
+unsigned long zbtree::zbtDeleteRangeByLex(zlexrangespec *range, dict *dict) {
+    unsigned long removed = 0;
+    zbtCursor c;
+
+    while (zbtFirstInLexRange(range,&c)) {
+        sds ele = zbtCursorEle(&c);
+        dict->dictDelete(ele);
+        zbtDelete(zbtCursorScore(&c),ele,NULL);
+        removed++;
+    }
+    return removed;
+}
+
+/* Delete all the elements with rank between start and end from the tree.
+ * Start and end are inclusive. Note that start and end need to be 1-based */
+unsigned long zbtree::zbtDeleteRangeByRank(unsigned long start, unsigned long end, dict *dict) {
+    unsigned long removed = 0;
+    zbtCursor c;
+
+    while (removed <= end-start && zbtGetElementByRank(start,&c)) {
+        sds ele = zbtCursorEle(&c);
+        dict->dictDelete(ele);
+        zbtDelete(zbtCursorScore(&c),ele,NULL);
+        removed++;
+    }
+    return removed;
+}
@@ -0,0 +1,122 @@
+/* B+tree of (score, element) pairs, used by the sorted sets that are too big
+ * for a skiplist to be a good choice.
+ *
+ * Elements are only stored in the leaves, that are linked in a double linked
+ * list in order to iterate the tree in both directions. Inner nodes hold, for
+ * every child, the greatest pair of the subtree, used to route lookups, and
+ * the number of elements of the subtree, used to compute ranks and to seek
+ * an element by rank in O(log N). Both kinds of node fit in 512 bytes, that
+ * is a whole number of cache lines, so that a lookup touches a handful of
+ * cache lines per level instead of one per skiplist node.
+ *
+ * Ordering and ranks are 1-based exactly like the ones of the skiplist, that
+ * is, elements are sorted by score and then by element. */
+
+#ifndef __ZBTREE_H
+#define __ZBTREE_H
+
+#include "sds.h"
+
+class dict;
+struct zrangespec;
+struct zlexrangespec;
+
+#define ZBTREE_LEAF_ENTRIES 30   /* sizeof(zbtLeaf) is 504 bytes. */
+#define ZBTREE_INNER_ENTRIES 15  /* sizeof(zbtInner) is 488 bytes. */
+
+struct zbtLeaf {
+    zbtLeaf *prev, *next;
+    unsigned int count;
+    double scores[ZBTREE_LEAF_ENTRIES];
+    sds eles[ZBTREE_LEAF_ENTRIES];
+};
+
+struct zbtInner {
+    unsigned int count;                         /* Number of children. */
+    unsigned long sizes[ZBTREE_INNER_ENTRIES];  /* Elements in every subtree. */
+    double maxscores[ZBTREE_INNER_ENTRIES];     /* Greatest pair of every */
+    sds maxeles[ZBTREE_INNER_ENTRIES];          /* subtree. */
+    void *children[ZBTREE_INNER_ENTRIES];
+};
+
+/* Position of an element of the tree. It is valid only until the tree is
+ * modified. */
+struct zbtCursor {
+    zbtLeaf *leaf;
+    int pos;
+};
+
+static inline double zbtCursorScore(const zbtCursor *c) {
+    return c->leaf->scores[c->pos];
+}
+
+static inline sds zbtCursorEle(const zbtCursor *c) {
+    return c->leaf->eles[c->pos];
+}
+
+/* Move the cursor to the next / previous element. Return 0 if there is no
+ * such element, in which case the cursor must no longer be used. */
+static inline int zbtNext(zbtCursor *c) {
+    if (++c->pos < (int)c->leaf->count) return 1;
+    if (c->leaf->next == NULL) return 0;
+    c->leaf = c->leaf->next;
+    c->pos = 0;
+    return 1;
+}
+
+static inline int zbtPrev(zbtCursor *c) {
+    if (--c->pos >= 0) return 1;
+    if (c->leaf->prev == NULL) return 0;
+    c->leaf = c->leaf->prev;
+    c->pos = c->leaf->count-1;
+    return 1;
+}
+
+typedef int zbtPredicate(double score, sds ele, void *arg);
+
+class zbtree
+{
+public:
+    zbtree();
+    ~zbtree();
+
+    void zbtInsert(double score, sds ele);
+    int zbtDelete(double score, sds ele, sds *deleted);
+    void zbtUpdateScore(double curscore, sds ele, double newscore);
+    unsigned long zbtGetRank(double score, sds ele);
+    int zbtGetElementByRank(unsigned long rank, zbtCursor *c);
+    int zbtFirst(zbtCursor *c);
+    int zbtLast(zbtCursor *c);
+    int zbtFirstInRange(zrangespec *range, zbtCursor *c);
+    int zbtLastInRange(zrangespec *range, zbtCursor *c);
+    int zbtFirstInLexRange(zlexrangespec *range, zbtCursor *c);
+    int zbtLastInLexRange(zlexrangespec *range, zbtCursor *c);
+    unsigned long zbtDeleteRangeByScore(zrangespec *range, dict *dict);
+    unsigned long zbtDeleteRangeByLex(zlexrangespec *range, dict *dict);
+    unsigned long zbtDeleteRangeByRank(unsigned long start, unsigned long end, dict *dict);
+
+    inline unsigned long length() {return m_length;}
+    inline size_t allocSize() {return m_alloc_size;}
+
+private:
+    zbtLeaf *zbtCreateLeaf();
+    zbtInner *zbtCreateInner();
+    void zbtFreeNode(void *node, int height);
+    void *zbtInsertNode(void *node, int height, double score, sds ele);
+    int zbtDeleteNode(void *node, int height, double score, sds ele, sds *deleted);
+    void zbtFixChild(zbtInner *in, int i, int height);
+    void zbtMergeLeaves(zbtLeaf *l, zbtLeaf *r);
+    int zbtSeek(zbtPredicate *pred, void *arg, zbtCursor *c);
+
+    void *m_root;          /* A zbtLeaf if m_height is 0, a zbtInner otherwise. */
+    int m_height;
+    unsigned long m_length;
+    zbtLeaf *m_head;
+    zbtLeaf *m_tail;
+    size_t m_alloc_size;   /* Bytes allocated for the nodes. */
+};
+
+zbtree *zbtCreate(void);
+void zbtFree(zbtree *zbt);
+
+#endif
@@ -68,23 +68,252 @@ void zlibc_free(void *ptr) {
 #define free(ptr) je_free(ptr)
 #define mallocx(size,flags) je_mallocx(size,flags)
 #define dallocx(ptr,flags) je_dallocx(ptr,flags)
+#define rallocx(ptr,size,flags) je_rallocx(ptr,size,flags)
 #endif
 
+#ifdef REDIS_TEST
+/* Allocations, reallocations included, made by the calling thread, that the
+ * micro benchmarks report per operation. */
+static __thread size_t zmalloc_thread_allocations = 0;
+#define count_zmalloc_allocation() (zmalloc_thread_allocations++)
+#else
+#define count_zmalloc_allocation()
+#endif
+
+/* The tracker of the calling thread, see zmalloc_set_tracker(). The return
+ * address is taken by the macro, so it must be used by the functions called
+ * by the code allocating, not by their helpers. */
+static __thread zmallocTracker *zmalloc_thread_tracker = NULL;
+
+#define track_zmalloc_allocation(__n) do { \
+    zmallocTracker *_t = zmalloc_thread_tracker; \
+    if (_t) { \
+        _t->allocs++; \
+        _t->bytes += (__n); \
+        if (_t->site) _t->site(_t,__builtin_return_address(0),(__n)); \
+    } \
+} while(0)
+
 #define update_zmalloc_stat_alloc(__n) do { \
     size_t _n = (__n); \
     if (_n&(sizeof(long)-1)) _n += sizeof(long)-(_n&(sizeof(long)-1)); \
-    atomicIncr(used_memory,__n); \
+    zmallocUsedMemoryAdd(__n); \
+    count_zmalloc_allocation(); \
 } while(0)
 
 #define update_zmalloc_stat_free(__n) do { \
     size_t _n = (__n); \
     if (_n&(sizeof(long)-1)) _n += sizeof(long)-(_n&(sizeof(long)-1)); \
-    atomicDecr(used_memory,__n); \
+    zmallocUsedMemoryAdd(-(size_t)(__n)); \
 } while(0)
 
+#if defined(__ATOMIC_RELAXED)
+/* The used memory is counted per thread, so that threads allocating at the
+ * same time don't contend the same cache line. Every thread owns a counter
+ * for as long as it runs, that only the owner modifies, so updating it needs
+ * no atomic read-modify-write, just an atomic store. The counters wrap
+ * around: a thread freeing memory allocated by another one takes its counter
+ * below zero, but the sum of all the counters is the used memory.
+ *
+ * zmalloc_used_memory() sums the counters without stopping the other
+ * threads, so it can miss allocations in progress, and can count twice the
+ * balance of a thread that is exiting (see zmallocThreadExit()). */
+#define ZMALLOC_THREAD_COUNTERS 128
+#define ZMALLOC_CACHE_LINE 64
+
+struct alignas(ZMALLOC_CACHE_LINE) zmallocCounter {
+    size_t used;
+    int shared;     /* Updated by more threads, with atomic increments. */
+    int next_free;  /* Next unused counter, or -1. */
+};
+
+/* The last counter is shared by the threads that can't get their own, which
+ * also receives the balance of the threads that exit. */
+#define ZMALLOC_SHARED_COUNTER (ZMALLOC_THREAD_COUNTERS-1)
+static zmallocCounter zmalloc_counters[ZMALLOC_THREAD_COUNTERS];
+static int zmalloc_counters_used = 0;    /* Counters ever assigned. */
+static int zmalloc_counters_free = -1;   /* List of released counters. */
+static pthread_mutex_t zmalloc_counters_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t zmalloc_counter_key;
+static pthread_once_t zmalloc_counter_key_once = PTHREAD_ONCE_INIT;
+static __thread zmallocCounter *zmalloc_thread_counter = NULL;
+
+/* Called when a thread exits: move its balance to the shared counter so that
+ * its counter can be reused by a new thread. */
+static void zmallocThreadExit(void *arg) {
+    zmallocCounter *c = (zmallocCounter *)arg;
+    zmallocCounter *shared = &zmalloc_counters[ZMALLOC_SHARED_COUNTER];
+
+    __atomic_add_fetch(&shared->used,c->used,__ATOMIC_RELAXED);
+    __atomic_store_n(&c->used,0,__ATOMIC_RELAXED);
+    /* Destructors running after this one may still free memory. */
+    zmalloc_thread_counter = shared;
+    pthread_mutex_lock(&zmalloc_counters_mutex);
+    c->next_free = zmalloc_counters_free;
+    zmalloc_counters_free = (int)(c-zmalloc_counters);
+    pthread_mutex_unlock(&zmalloc_counters_mutex);
+}
+
+static void zmallocCounterKeyInit(void) {
+    zmalloc_counters[ZMALLOC_SHARED_COUNTER].shared = 1;
+    pthread_key_create(&zmalloc_counter_key,zmallocThreadExit);
+}
+
+/* Assign a counter to the calling thread, the first time it allocates. */
+static zmallocCounter *zmallocThreadCounter(void) {
+    int idx = ZMALLOC_SHARED_COUNTER;
+
+    pthread_once(&zmalloc_counter_key_once,zmallocCounterKeyInit);
+    pthread_mutex_lock(&zmalloc_counters_mutex);
+    if (zmalloc_counters_free != -1) {
+        idx = zmalloc_counters_free;
+        zmalloc_counters_free = zmalloc_counters[idx].next_free;
+    } else if (zmalloc_counters_used < ZMALLOC_SHARED_COUNTER) {
+        idx = zmalloc_counters_used;
+        __atomic_store_n(&zmalloc_counters_used,idx+1,__ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&zmalloc_counters_mutex);
+
+    zmalloc_thread_counter = &zmalloc_counters[idx];
+    if (idx != ZMALLOC_SHARED_COUNTER)
+        pthread_setspecific(zmalloc_counter_key,zmalloc_thread_counter);
+    return zmalloc_thread_counter;
+}
+
+static inline void zmallocUsedMemoryAdd(size_t n) {
+    zmallocCounter *c = zmalloc_thread_counter;
+
+    if (c == NULL) c = zmallocThreadCounter();
+    if (c->shared)
+        __atomic_add_fetch(&c->used,n,__ATOMIC_RELAXED);
+    else
+        __atomic_store_n(&c->used,c->used+n,__ATOMIC_RELAXED);
+}
+
+static size_t zmallocUsedMemorySum(void) {
+    size_t um = 0;
+    int used = __atomic_load_n(&zmalloc_counters_used,__ATOMIC_RELAXED);
+
+    for (int j = 0; j < used; j++)
+        um += __atomic_load_n(&zmalloc_counters[j].used,__ATOMIC_RELAXED);
+    um += __atomic_load_n(&zmalloc_counters[ZMALLOC_SHARED_COUNTER].used,
+                          __ATOMIC_RELAXED);
+    return um;
+}
+#else
+/* Without atomic builtins a single counter is protected by a mutex. */
 static size_t used_memory = 0;
 pthread_mutex_t used_memory_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+static inline void zmallocUsedMemoryAdd(size_t n) {
+    atomicIncr(used_memory,n);
+}
+
+static size_t zmallocUsedMemorySum(void) {
+    size_t um;
+    atomicGet(used_memory,um);
+    return um;
+}
+#endif
+
+/* Lifetime segregated allocations.
+ *
+ * The buffers of the clients, of the AOF and of the replication live for a
+ * few event loop iterations at most, while the dataset lives for hours: when
+ * both are allocated from the same arena, a peak of buffers leaves behind
+ * runs where a few long lived keys pin pages that are otherwise empty, which
+ * is fragmentation the defragger can't fix since it only moves the keys.
+ * The code allocating and freeing buffers does it between
+ * zmalloc_transient_begin() and zmalloc_transient_end(), so that with jemalloc
+ * zmalloc() and friends take the memory from an arena only used by buffers,
+ * through a thread cache of its own. Scopes nest. Without jemalloc, or when
+ * zmalloc_transient_init() was not called, scopes change nothing.
+ *
+ * Buffers can be freed out of a scope, and objects of the dataset inside
+ * one: both are still correct, the memory just ends in the thread cache of
+ * the other kind of allocations, which holds only a few regions per size. */
+static __thread int zmalloc_transient_depth = 0;
+#if defined(USE_JEMALLOC)
+static int zmalloc_transient_arena = -1;
+static __thread int zmalloc_transient_flags = 0; /* Arena and tcache flags. */
+#define zmalloc_transient() \
+    (zmalloc_transient_depth && zmalloc_transient_arena != -1)
+#endif
+
+/* Create the transient arena. Called at startup, before the threads are
+ * created. Return the arena index, or -1 when it is not supported. */
+int zmalloc_transient_init(void) {
+#if defined(USE_JEMALLOC)
+    unsigned arena;
+    size_t sz = sizeof(arena);
+
+    if (zmalloc_transient_arena == -1 &&
+        je_mallctl("arenas.extend",&arena,&sz,NULL,0) == 0)
+        zmalloc_transient_arena = (int)arena;
+    return zmalloc_transient_arena;
+#else
+    return -1;
+#endif
+}
+
+void zmalloc_transient_begin(void) {
+    zmalloc_transient_depth++;
+}
+
+void zmalloc_transient_end(void) {
+    zmalloc_transient_depth--;
+}
+
+#if defined(USE_JEMALLOC)
+/* The mallocx() flags of the transient allocations of the calling thread,
+ * that gets its own explicit thread cache the first time. */
+static int zmallocTransientFlags(void) {
+    if (zmalloc_transient_flags == 0) {
+        unsigned tc;
+        size_t sz = sizeof(tc);
+        int flags = MALLOCX_ARENA(zmalloc_transient_arena);
+
+        if (je_mallctl("tcache.create",&tc,&sz,NULL,0) == 0)
+            flags |= MALLOCX_TCACHE(tc);
+        else
+            flags |= MALLOCX_TCACHE_NONE;
+        zmalloc_transient_flags = flags;
+    }
+    return zmalloc_transient_flags;
+}
+
+/* Bytes allocated, in active pages and resident (active and dirty pages)
+ * in the transient arena, all zero if there is no transient arena. This
+ * refreshes the statistics cached by mallctl, also the global ones. */
+void zmalloc_transient_stats(size_t *allocated, size_t *active, size_t *resident) {
+    size_t small = 0, large = 0, huge = 0, pactive = 0, pdirty = 0, page = 0;
+    size_t epoch = 1, sz = sizeof(size_t);
+    char name[64];
+
+    *allocated = *active = *resident = 0;
+    je_mallctl("epoch",&epoch,&sz,&epoch,sz);
+    if (zmalloc_transient_arena == -1) return;
+#define TRANSIENT_STAT(field, var) do { \
+    snprintf(name,sizeof(name),"stats.arenas.%d." field,zmalloc_transient_arena); \
+    je_mallctl(name,&(var),&sz,NULL,0); \
+} while(0)
+    TRANSIENT_STAT("small.allocated",small);
+    TRANSIENT_STAT("large.allocated",large);
+    TRANSIENT_STAT("huge.allocated",huge);
+    TRANSIENT_STAT("pactive",pactive);
+    TRANSIENT_STAT("pdirty",pdirty);
+#undef TRANSIENT_STAT
+    je_mallctl("arenas.page",&page,&sz,NULL,0);
+    *allocated = small+large+huge;
+    *active = pactive*page;
+    *resident = (pactive+pdirty)*page;
+}
+#else
+void zmalloc_transient_stats(size_t *allocated, size_t *active, size_t *resident) {
+    *allocated = *active = *resident = 0;
+}
+#endif
+
 static void zmalloc_default_oom(size_t size) {
     fprintf(stderr, "zmalloc: Out of memory trying to allocate %zu bytes\n",
         size);
@@ -95,9 +324,15 @@ static void zmalloc_default_oom(size_t size) {
 static void (*zmalloc_oom_handler)(size_t) = zmalloc_default_oom;
 
 void *zmalloc(size_t size) {
+#if defined(USE_JEMALLOC)
+    void *ptr = zmalloc_transient() ?
+        mallocx(size ? size : 1,zmallocTransientFlags()) : malloc(size);
+#else
     void *ptr = malloc(size+PREFIX_SIZE);
+#endif
 
     if (!ptr) zmalloc_oom_handler(size);
+    track_zmalloc_allocation(size);
 #ifdef HAVE_MALLOC_SIZE
     update_zmalloc_stat_alloc(zmalloc_size(ptr));
     return ptr;
@@ -127,9 +362,16 @@ void zfree_no_tcache(void *ptr) {
 #endif
 
 void *zcalloc(size_t size) {
+#if defined(USE_JEMALLOC)
+    void *ptr = zmalloc_transient() ?
+        mallocx(size ? size : 1,zmallocTransientFlags()|MALLOCX_ZERO) :
+        calloc(1,size);
+#else
     void *ptr = calloc(1, size+PREFIX_SIZE);
+#endif
 
     if (!ptr) zmalloc_oom_handler(size);
+    track_zmalloc_allocation(size);
 #ifdef HAVE_MALLOC_SIZE
     update_zmalloc_stat_alloc(zmalloc_size(ptr));
     return ptr;
@@ -148,9 +390,16 @@ void *zrealloc(void *ptr, size_t size) {
     void *newptr;
 
     if (ptr == NULL) return zmalloc(size);
+    track_zmalloc_allocation(size);
 #ifdef HAVE_MALLOC_SIZE
     oldsize = zmalloc_size(ptr);
+#if defined(USE_JEMALLOC)
+    newptr = zmalloc_transient() ?
+        rallocx(ptr,size ? size : 1,zmallocTransientFlags()) :
+        realloc(ptr,size);
+#else
     newptr = realloc(ptr,size);
+#endif
     if (!newptr) zmalloc_oom_handler(size);
 
     update_zmalloc_stat_free(oldsize);
@@ -192,7 +441,14 @@ void zfree(void *ptr) {
     if (ptr == NULL) return;
 #ifdef HAVE_MALLOC_SIZE
     update_zmalloc_stat_free(zmalloc_size(ptr));
+#if defined(USE_JEMALLOC)
+    if (zmalloc_transient())
+        dallocx(ptr,zmallocTransientFlags());
+    else
+        free(ptr);
+#else
     free(ptr);
+#endif
 #else
     realptr = (char*)ptr-PREFIX_SIZE;
     oldsize = *((size_t*)realptr);
@@ -210,9 +466,131 @@ char *zstrdup(const char *s) {
 }
 
 size_t zmalloc_used_memory() {
-    size_t um;
-    atomicGet(used_memory,um);
-    return um;
+    return zmallocUsedMemorySum();
+}
+
+/* Account the allocations and reallocations of the calling thread to 't',
+ * or stop accounting them if 't' is NULL. Return the previous tracker, so
+ * that nested callers can restore it. */
+zmallocTracker *zmalloc_set_tracker(zmallocTracker *t) {
+    zmallocTracker *prev = zmalloc_thread_tracker;
+    zmalloc_thread_tracker = t;
+    return prev;
+}
+
+#ifdef REDIS_TEST
+size_t zmalloc_allocations() {
+    return zmalloc_thread_allocations;
+}
+#endif
+
+/* Arena allocator for temporary allocations.
+ *
+ * Commands allocating many temporary arrays can take them from the arena with
+ * zarena_malloc(), zarena_calloc() and zarena_realloc() instead of zmalloc():
+ * allocating just bumps a pointer inside the current chunk, and the memory is
+ * never freed explicitly. Instead call() takes a mark with zarena_mark()
+ * before running a command and releases everything allocated after the mark
+ * with zarena_release() when the command returns. Marks nest, so commands
+ * called by scripts or by MULTI/EXEC don't release the memory of the caller.
+ *
+ * Every thread has its own arena, so that the commands executed by the I/O
+ * threads can use it as well. The memory it returns must not be referenced
+ * after the command returns: it is meant for arrays and structures only used
+ * while the command runs, never for objects that can be stored into the
+ * dataset or in the clients. */
+#define ZARENA_CHUNK_SIZE (64*1024)
+#define ZARENA_ALIGN 16
+
+struct zarenaChunk {
+    zarenaChunk *prev;
+    size_t start;   /* Arena position of the first byte of the chunk. */
+    size_t size;    /* Usable bytes of the chunk. */
+    size_t used;
+};
+
+#define ZARENA_HDR_SIZE \
+    ((sizeof(zarenaChunk)+ZARENA_ALIGN-1) & ~(size_t)(ZARENA_ALIGN-1))
+#define zarenaChunkData(chunk) ((char*)(chunk)+ZARENA_HDR_SIZE)
+
+static __thread zarenaChunk *zarena_current = NULL;
+static __thread zarenaChunk *zarena_spare = NULL; /* A free chunk kept for reuse. */
+static __thread void *zarena_last = NULL;         /* Last allocation, for realloc. */
+
+void *zarena_malloc(size_t size) {
+    zarenaChunk *chunk = zarena_current;
+    void *ptr;
+
+    size = (size+ZARENA_ALIGN-1) & ~(size_t)(ZARENA_ALIGN-1);
+    if (chunk == NULL || chunk->size-chunk->used < size) {
+        size_t start = chunk ? chunk->start+chunk->used : 0;
+
+        if (size <= ZARENA_CHUNK_SIZE && zarena_spare) {
+            chunk = zarena_spare;
+            zarena_spare = NULL;
+        } else {
+            size_t csize = size > ZARENA_CHUNK_SIZE ? size : ZARENA_CHUNK_SIZE;
+            chunk = (zarenaChunk*)zmalloc(ZARENA_HDR_SIZE+csize);
+            chunk->size = csize;
+        }
+        chunk->prev = zarena_current;
+        chunk->start = start;
+        chunk->used = 0;
+        zarena_current = chunk;
+    }
+    ptr = zarenaChunkData(chunk)+chunk->used;
+    chunk->used += size;
+    zarena_last = ptr;
+    return ptr;
+}
+
+void *zarena_calloc(size_t size) {
+    void *ptr = zarena_malloc(size);
+    memset(ptr,0,size);
+    return ptr;
+}
+
+/* Resize an arena allocation of 'oldsize' bytes. The last allocation is
+ * resized in place when the chunk has room, otherwise the content is copied
+ * into a new allocation. */
+void *zarena_realloc(void *ptr, size_t oldsize, size_t size) {
+    zarenaChunk *chunk = zarena_current;
+    void *newptr;
+
+    if (ptr == NULL) return zarena_malloc(size);
+    if (ptr == zarena_last) {
+        size_t offset = (char*)ptr-zarenaChunkData(chunk);
+        size_t asize = (size+ZARENA_ALIGN-1) & ~(size_t)(ZARENA_ALIGN-1);
+        if (chunk->size-offset >= asize) {
+            chunk->used = offset+asize;
+            return ptr;
+        }
+    }
+    newptr = zarena_malloc(size);
+    memcpy(newptr,ptr,oldsize < size ? oldsize : size);
+    return newptr;
+}
+
+/* Return the current position of the arena, to pass to zarena_release(). */
+size_t zarena_mark() {
+    return zarena_current ? zarena_current->start+zarena_current->used : 0;
+}
+
+/* Release all the arena allocations performed after 'mark' was taken. */
+void zarena_release(size_t mark) {
+    while (zarena_current && zarena_current->start >= mark &&
+           zarena_current->start+zarena_current->used > mark)
+    {
+        zarenaChunk *chunk = zarena_current;
+        zarena_current = chunk->prev;
+        if (zarena_spare == NULL && chunk->size == ZARENA_CHUNK_SIZE)
+            zarena_spare = chunk;
+        else
+            zfree(chunk);
+    }
+    if (zarena_current && zarena_current->start+zarena_current->used > mark)
+        zarena_current->used = mark-zarena_current->start;
+    zarena_last = NULL;
 }
 
 void zmalloc_set_oom_handler(void (*oom_handler)(size_t)) {
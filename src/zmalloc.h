@@ -72,6 +72,14 @@
 #define HAVE_DEFRAG
 #endif
 
+/* Allocations made by a thread while it has a tracker. The 'site' callback,
+ * if not NULL, is also called with the return address of every allocation. */
+struct zmallocTracker {
+    size_t allocs;
+    size_t bytes;
+    void (*site)(zmallocTracker *t, void *caller, size_t size);
+};
+
 void *zmalloc(size_t size);
 void *zcalloc(size_t size);
 void *zrealloc(void *ptr, size_t size);
@@ -85,6 +93,16 @@ size_t zmalloc_get_private_dirty(long pid);
 size_t zmalloc_get_smap_bytes_by_field(char *field, long pid);
 size_t zmalloc_get_memory_size();
 void zlibc_free(void *ptr);
+void *zarena_malloc(size_t size);
+void *zarena_calloc(size_t size);
+void *zarena_realloc(void *ptr, size_t oldsize, size_t size);
+size_t zarena_mark();
+void zarena_release(size_t mark);
+zmallocTracker *zmalloc_set_tracker(zmallocTracker *t);
+int zmalloc_transient_init(void);
+void zmalloc_transient_begin(void);
+void zmalloc_transient_end(void);
+void zmalloc_transient_stats(size_t *allocated, size_t *active, size_t *resident);
 
 #ifdef HAVE_DEFRAG
 void zfree_no_tcache(void *ptr);
@@ -95,4 +113,8 @@ void *zmalloc_no_tcache(size_t size);
 size_t zmalloc_size(void *ptr);
 #endif
 
+#ifdef REDIS_TEST
+size_t zmalloc_allocations();
+#endif
+
 #endif /* __ZMALLOC_H */
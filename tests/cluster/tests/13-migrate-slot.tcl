@@ -0,0 +1,102 @@
+# Test MIGRATE ... SLOT, moving a whole hash slot in the background.
+
+source "../tests/includes/init-tests.tcl"
+
+test "Create a 2 nodes cluster" {
+    create_cluster 2 0
+}
+
+test "Cluster is up" {
+    assert_cluster_state ok
+}
+
+set slot [R 0 cluster keyslot "{mig}"]
+if {[catch {R 0 set {mig}probe 1}]} {
+    set src 1
+    set dst 0
+} else {
+    set src 0
+    set dst 1
+}
+R $src del {mig}probe
+set src_id [dict get [get_myself $src] id]
+set dst_id [dict get [get_myself $dst] id]
+
+test "Populate the slot with small and big keys" {
+    for {set j 0} {$j < 1000} {incr j} {
+        R $src set "{mig}str:$j" $j
+    }
+    R $src pexpire "{mig}str:0" 100000
+    for {set j 0} {$j < 5000} {incr j} {
+        R $src rpush "{mig}list" $j
+        R $src sadd "{mig}set" $j
+        R $src zadd "{mig}zset" $j $j
+        R $src hset "{mig}hash" $j $j
+    }
+    assert {[R $src cluster countkeysinslot $slot] == 1004}
+}
+
+test "MIGRATE SLOT moves all the keys to the target" {
+    R $dst cluster setslot $slot importing $src_id
+    R $src cluster setslot $slot migrating $dst_id
+    R $src config set cluster-migrate-inflight-bytes 4096
+    set port [get_instance_attrib redis $dst port]
+    assert_equal OK [R $src migrate 127.0.0.1 $port "" 0 5000 replace slot $slot]
+    assert_equal 0 [R $src cluster countkeysinslot $slot]
+    assert_equal 1004 [R $dst cluster countkeysinslot $slot]
+    R $src cluster setslot $slot node $dst_id
+    R $dst cluster setslot $slot node $dst_id
+}
+
+test "The migrated keys have the same content" {
+    assert_equal 999 [R $dst get "{mig}str:999"]
+    assert {[R $dst pttl "{mig}str:0"] > 0}
+    assert_equal 5000 [R $dst llen "{mig}list"]
+    assert_equal {0 1 2} [R $dst lrange "{mig}list" 0 2]
+    assert_equal 5000 [R $dst scard "{mig}set"]
+    assert_equal 4999 [R $dst zscore "{mig}zset" 4999]
+    assert_equal 42 [R $dst hget "{mig}hash" 42]
+}
+
+test "MIGRATE SLOT of an empty slot replies NOKEY" {
+    set port [get_instance_attrib redis $src port]
+    assert_equal NOKEY [R $src migrate 127.0.0.1 $port "" 0 5000 slot $slot]
+}
+
+set slot [R 0 cluster keyslot "{atom}"]
+if {[catch {R 0 set {atom}probe 1}]} {
+    set src 1
+    set dst 0
+} else {
+    set src 0
+    set dst 1
+}
+R $src del {atom}probe
+set src_id [dict get [get_myself $src] id]
+set dst_id [dict get [get_myself $dst] id]
+
+test "MIGRATE SLOT ATOMIC moves the keys and the slot ownership" {
+    for {set j 0} {$j < 1000} {incr j} {
+        R $src set "{atom}str:$j" $j
+    }
+    for {set j 0} {$j < 5000} {incr j} {
+        R $src rpush "{atom}list" $j
+    }
+    R $dst cluster setslot $slot importing $src_id
+    set port [get_instance_attrib redis $dst port]
+    assert_equal OK [R $src migrate 127.0.0.1 $port "" 0 5000 slot $slot atomic]
+    assert_equal 0 [R $src cluster countkeysinslot $slot]
+    assert_equal 1001 [R $dst cluster countkeysinslot $slot]
+    assert_match "*MOVED*" [catch {R $src get "{atom}str:1"} e; set e]
+    assert_equal 1 [R $dst get "{atom}str:1"]
+    assert_equal 5000 [R $dst llen "{atom}list"]
+}
+
+test "The new owner of the slot is propagated to the cluster" {
+    wait_for_condition 1000 50 {
+        [CI $src cluster_state] eq {ok} &&
+        [catch {R $src get "{atom}str:1"} e] && [string match "*MOVED*$port*" $e]
+    } else {
+        fail "The slot did not move to the target"
+    }
+}
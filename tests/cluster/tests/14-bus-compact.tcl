@@ -0,0 +1,69 @@
+# Test the compact encoding of the cluster bus messages.
+
+source "../tests/includes/init-tests.tcl"
+
+test "Create a 5 nodes cluster" {
+    create_cluster 5 5
+}
+
+test "Cluster is up" {
+    assert_cluster_state ok
+}
+
+test "The nodes exchange compact messages" {
+    foreach_redis_id id {
+        wait_for_condition 1000 50 {
+            [CI $id cluster_stats_compact_messages_sent] > 0
+        } else {
+            fail "Node #$id is not sending compact messages"
+        }
+        assert {[CI $id cluster_stats_bus_bytes_sent] > 0}
+        assert {[CI $id cluster_stats_bus_bytes_received] > 0}
+    }
+}
+
+test "Every node sees the whole cluster" {
+    foreach_redis_id id {
+        assert {[CI $id cluster_known_nodes] == 10}
+        assert {[CI $id cluster_slots_assigned] == 16384}
+    }
+}
+
+test "PUBLISH is propagated with compact messages" {
+    R 1 deferred 1
+    R 1 subscribe compactchannel
+    R 1 read
+    R 0 publish compactchannel hello
+    assert {[lindex [R 1 read] 2] eq {hello}}
+    R 1 unsubscribe compactchannel
+    R 1 read
+    R 1 deferred 0
+}
+
+test "Nodes with cluster-bus-compact disabled still talk with the others" {
+    R 0 config set cluster-bus-compact no
+    R 5 config set cluster-bus-compact no
+    set sent [CI 0 cluster_stats_compact_messages_sent]
+    after 2000
+    assert {[CI 0 cluster_stats_compact_messages_sent] == $sent}
+    assert_cluster_state ok
+}
+
+test "Killing one master is detected with mixed encodings" {
+    set current_epoch [CI 1 cluster_current_epoch]
+    kill_instance redis 0
+    wait_for_condition 1000 50 {
+        [CI 1 cluster_current_epoch] > $current_epoch
+    } else {
+        fail "No failover detected"
+    }
+    assert_cluster_state ok
+}
+
+test "Restarting the killed master" {
+    restart_instance redis 0
+    foreach_redis_id id {
+        R $id config set cluster-bus-compact yes
+    }
+    assert_cluster_state ok
+}
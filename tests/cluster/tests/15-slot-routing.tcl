@@ -0,0 +1,55 @@
+# Test the routing of the single key commands while slots are stable and
+# while a slot is migrating.
+
+source "../tests/includes/init-tests.tcl"
+
+test "Create a 2 nodes cluster" {
+    create_cluster 2 0
+}
+
+test "Cluster is up" {
+    assert_cluster_state ok
+}
+
+set slot [R 0 cluster keyslot "{route}"]
+if {[catch {R 0 set {route}probe 1}]} {
+    set src 1
+    set dst 0
+} else {
+    set src 0
+    set dst 1
+}
+set dst_id [dict get [get_myself $dst] id]
+set src_id [dict get [get_myself $src] id]
+
+test "Single key commands are served by the owner and redirected by the others" {
+    R $src set {route}a 1
+    assert {[R $src get {route}a] eq 1}
+    catch {R $dst get {route}a} err
+    assert_match "MOVED $slot *" $err
+}
+
+test "A migrating slot sends ASK for the missing keys" {
+    R $dst cluster setslot $slot importing $src_id
+    R $src cluster setslot $slot migrating $dst_id
+    assert {[R $src get {route}a] eq 1}
+    catch {R $src get {route}missing} err
+    assert_match "ASK $slot *" $err
+}
+
+test "Multi key commands on a migrating slot get TRYAGAIN on the target" {
+    R $dst asking
+    assert {[R $dst set {route}b 2] eq {OK}}
+    R $dst asking
+    catch {R $dst mget {route}a {route}b} err
+    assert_match "TRYAGAIN *" $err
+}
+
+test "Closing the slot restores the normal redirections" {
+    R $src cluster setslot $slot stable
+    R $dst cluster setslot $slot stable
+    catch {R $src get {route}missing} err
+    assert {$err eq {}}
+    catch {R $dst get {route}a} err
+    assert_match "MOVED $slot *" $err
+}
@@ -0,0 +1,84 @@
+# Test sharded Pub/Sub: SPUBLISH messages only travel inside the shard
+# serving the slot of the channel.
+
+source "../tests/includes/init-tests.tcl"
+
+test "Create a 3 nodes cluster with one slave each" {
+    create_cluster 3 3
+}
+
+test "Cluster is up" {
+    assert_cluster_state ok
+}
+
+set channel "{shard}channel"
+set slot [R 0 cluster keyslot $channel]
+
+# Find the master serving the channel, and its slave.
+for {set j 0} {$j < 3} {incr j} {
+    if {![catch {R $j spublish $channel hello}]} {set owner $j}
+}
+set owner_id [dict get [get_myself $owner] id]
+for {set j 3} {$j < 6} {incr j} {
+    if {[dict get [get_myself $j] slaveof] eq $owner_id} {set replica $j}
+}
+set other [expr {($owner+1)%3}]
+
+test "SSUBSCRIBE and SPUBLISH are redirected outside the shard" {
+    catch {R $other spublish $channel hello} err
+    assert_match "MOVED $slot *" $err
+    catch {R $other ssubscribe $channel} err
+    assert_match "MOVED $slot *" $err
+}
+
+test "SSUBSCRIBE of channels in different slots is refused" {
+    catch {R $owner ssubscribe {a}x {b}x} err
+    assert_match "CROSSSLOT *" $err
+}
+
+proc deferring_client {id} {
+    redis [get_instance_attrib redis $id host] \
+          [get_instance_attrib redis $id port] 1
+}
+
+test "SPUBLISH reaches the subscribers of the master and the slave" {
+    set subscribers {}
+    foreach j [list $owner $replica] {
+        set rd [deferring_client $j]
+        $rd ssubscribe $channel
+        assert_equal [list ssubscribe $channel 1] [$rd read]
+        lappend subscribers $rd
+    }
+
+    set data [randomValue]
+    assert_equal 1 [R $owner spublish $channel $data]
+    foreach rd $subscribers {
+        assert_equal [list smessage $channel $data] [$rd read]
+    }
+}
+
+test "SPUBLISH is not propagated to the other shards" {
+    for {set j 0} {$j < 6} {incr j} {
+        if {$j == $owner || $j == $replica} continue
+        assert {[CI $j cluster_stats_messages_publishshard_received] eq {}}
+    }
+}
+
+test "SUNSUBSCRIBE replies with the shard channels count" {
+    foreach rd $subscribers {
+        $rd sunsubscribe
+        assert_equal [list sunsubscribe $channel 0] [$rd read]
+        $rd close
+    }
+}
+
+test "Subscribers are dropped when the slot moves to another shard" {
+    set rd [deferring_client $owner]
+    $rd ssubscribe $channel
+    $rd read
+    set other_id [dict get [get_myself $other] id]
+    R $other cluster setslot $slot node $other_id
+    R $owner cluster setslot $slot node $other_id
+    assert_equal [list sunsubscribe $channel 0] [$rd read]
+    $rd close
+}
@@ -0,0 +1,41 @@
+# Check that the cached CLUSTER SLOTS and CLUSTER NODES replies follow
+# the changes of the cluster configuration.
+
+source "../tests/includes/init-tests.tcl"
+
+test "Create a 2 nodes cluster" {
+    create_cluster 2 0
+}
+
+test "Cluster is up" {
+    assert_cluster_state ok
+}
+
+# Return the node ID serving 'slot' according to the CLUSTER SLOTS reply.
+proc slot_owner {slots slot} {
+    foreach range $slots {
+        if {$slot >= [lindex $range 0] && $slot <= [lindex $range 1]} {
+            return [lindex $range 2 2]
+        }
+    }
+}
+
+set id0 [dict get [get_myself 0] id]
+set id1 [dict get [get_myself 1] id]
+
+test "CLUSTER SLOTS is stable across calls" {
+    set slots [R 0 cluster slots]
+    assert_equal $slots [R 0 cluster slots]
+}
+
+test "CLUSTER SLOTS and NODES reflect the slots moved to another node" {
+    # Move a slot of node 0, that has no keys, to node 1.
+    set slot [expr {[slot_owner [R 0 cluster slots] 0] eq $id0 ? 0 : 16383}]
+    assert_equal $id0 [slot_owner [R 0 cluster slots] $slot]
+    R 1 cluster setslot $slot node $id1
+    R 0 cluster setslot $slot node $id1
+    assert_equal $id1 [slot_owner [R 0 cluster slots] $slot]
+    set myline [lsearch -inline [split [R 0 cluster nodes] "\n"] "$id0 *"]
+    assert {![string match "* $slot-*" $myline]}
+    assert {![string match "*-$slot" $myline]}
+}
@@ -257,4 +257,108 @@ tags {"aof"} {
             r expire x -1
         }
     }
+
+    ## Test that the prefetch thread stops at the truncated command too
+    create_aof {
+        for {set j 0} {$j < 1000} {incr j} {
+            append_to_aof [formatCommand incr foo]
+        }
+        append_to_aof [string range [formatCommand incr foo] 0 end-1]
+    }
+
+    start_server_aof [list dir $server_path aof-load-truncated yes aof-load-prefetch yes] {
+        test "AOF prefetch: truncated AOF loaded up to the last command" {
+            set client [redis [dict get $srv host] [dict get $srv port]]
+            wait_for_condition 50 100 {
+                [catch {$client ping} e] == 0
+            } else {
+                fail "Loading DB is taking too much time."
+            }
+            assert_equal 1000 [$client get foo]
+        }
+    }
+
+    start_server {overrides {appendonly {yes} appendfilename {appendonly.aof} aof-load-prefetch {yes}}} {
+        test {AOF prefetch loads the same dataset} {
+            createComplexDataset r 2000
+            r multi
+            r set in multi
+            r exec
+            set digest [r debug digest]
+            r debug loadaof
+            assert_equal $digest [r debug digest]
+        }
+    }
+
+    start_server {overrides {appendonly {yes} appendfsync {always} aof-group-commit {yes}}} {
+        test {AOF group commit replies only after the write is durable} {
+            set clients {}
+            for {set j 0} {$j < 10} {incr j} {
+                set rd [redis_deferring_client]
+                for {set k 0} {$k < 100} {incr k} {
+                    $rd incr counter
+                }
+                lappend clients $rd
+            }
+            foreach rd $clients {
+                for {set k 0} {$k < 100} {incr k} {
+                    $rd read
+                }
+                $rd close
+            }
+            assert {[s aof_group_commits] > 0}
+            set digest [r debug digest]
+            r debug loadaof
+            assert_equal $digest [r debug digest]
+            r get counter
+        } {1000}
+    }
+
+    start_server {overrides {appendonly {yes} appendfilename {appendonly.aof}}} {
+        test {Binary AOF records are reloaded mixed with RESP ones} {
+            r set text before
+            r config set aof-binary-format yes
+            r set foo bar
+            r incrby counter 100
+            r incrby counter -7
+            r rpush list a 1 -2 [string repeat x 1000]
+            r hset hash field 12345678901234
+            r multi
+            r set in multi
+            r exec
+            r config set aof-binary-format no
+            r set text after
+            set digest [r debug digest]
+            r debug loadaof
+            assert_equal $digest [r debug digest]
+            list [r get counter] [r lrange list 0 2] [r get text]
+        } {93 {a 1 -2} after}
+
+        test {Binary AOF passes redis-check-aof} {
+            set aof [file join [lindex [r config get dir] 1] appendonly.aof]
+            r config set appendfsync always
+            r set final 1
+            catch {exec src/redis-check-aof $aof} result
+            assert_match "*AOF is valid*" $result
+        }
+    }
+
+    start_server {overrides {appendonly {yes} aof-multi-part {yes}}} {
+        test {Multi part AOF is reloaded after a rewrite} {
+            r debug populate 1000
+            r bgrewriteaof
+            wait_for_condition 50 100 {
+                [s aof_rewrite_in_progress] == 0
+            } else {
+                fail "AOF rewrite is taking too much time."
+            }
+            r set after rewrite
+            r lpush list a b c
+            set digest [r debug digest]
+            assert {[file exists [file join [lindex [r config get dir] 1] appendonly.aof.manifest]]}
+            r debug loadaof
+            assert_equal $digest [r debug digest]
+            assert_equal rewrite [r get after]
+        }
+    }
 }
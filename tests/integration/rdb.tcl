@@ -96,3 +96,259 @@ start_server_and_kill_it [list "dir" $server_path] {
         }
     }
 }
+
+start_server {tags {"rdb"} overrides {rdb-load-threads 4}} {
+    test {Parallel RDB loading restores every data type} {
+        createComplexDataset r 10000
+        r xadd mystream * field value
+        r xgroup create mystream mygroup 0
+        r xreadgroup group mygroup alice streams mystream >
+        r debug populate 20000
+        r setex volatile 1000 value
+        set digest [r debug digest]
+        r debug reload
+        assert_equal $digest [r debug digest]
+        assert {[r ttl volatile] > 0}
+        assert_equal 1 [llength [r xpending mystream mygroup - + 10]]
+    }
+
+    test {Parallel and sequential RDB loading load the same dataset} {
+        set digest [r debug digest]
+        r config set rdb-load-threads 1
+        r debug reload
+        assert_equal $digest [r debug digest]
+        r config set rdb-load-threads 4
+        r debug reload
+        assert_equal $digest [r debug digest]
+    }
+}
+
+start_server {tags {"rdb"} overrides {rdb-save-threads 4}} {
+    test {RDB saved in chunks by parallel threads is loaded back} {
+        createComplexDataset r 10000
+        r debug populate 50000
+        r select 10
+        r debug populate 1000 other
+        r setex volatile 1000 value
+        r select 9
+        set digest [r debug digest]
+        r debug reload
+        assert_equal $digest [r debug digest]
+        r select 10
+        assert {[r ttl volatile] > 0}
+        r select 9
+    }
+
+    test {RDB chunks are loaded by the loader threads and by the main thread alike} {
+        set digest [r debug digest]
+        r config set rdb-load-threads 4
+        r debug reload
+        assert_equal $digest [r debug digest]
+        r config set rdb-load-threads 1
+        r debug reload
+        assert_equal $digest [r debug digest]
+    }
+
+    test {BGSAVE with parallel threads produces a valid RDB} {
+        waitForBgsave r
+        r bgsave
+        waitForBgsave r
+        set rdb [file join [lindex [r config get dir] 1] \
+                           [lindex [r config get dbfilename] 1]]
+        assert_match {*Checksum OK*RDB looks OK*} [exec src/redis-check-rdb $rdb]
+    }
+}
+
+start_server {tags {"rdb"} overrides {rdb-save-threads 4 rdb-compress-chunks yes}} {
+    test {RDB with compressed chunks is loaded back} {
+        createComplexDataset r 10000
+        r debug populate 50000
+        set digest [r debug digest]
+        r debug reload
+        assert_equal $digest [r debug digest]
+        r config set rdb-load-threads 4
+        r debug reload
+        assert_equal $digest [r debug digest]
+    }
+
+    test {Compressed chunks are smaller than per-string compression on small values} {
+        r debug reload
+        set rdb [file join [lindex [r config get dir] 1] \
+                           [lindex [r config get dbfilename] 1]]
+        set chunked [file size $rdb]
+        r config set rdb-compress-chunks no
+        r debug reload
+        assert {$chunked < [file size $rdb]}
+        assert_match {*RDB looks OK*} [exec src/redis-check-rdb $rdb]
+    }
+
+    test {redis-check-rdb checks chunks in parallel and reports stats} {
+        r config set rdb-compress-chunks yes
+        r debug reload
+        set rdb [file join [lindex [r config get dir] 1] \
+                           [lindex [r config get dbfilename] 1]]
+        set serial [exec src/redis-check-rdb $rdb]
+        set parallel [exec src/redis-check-rdb --stats --threads 4 $rdb]
+        assert_match {*Checksum OK*RDB looks OK*} $parallel
+        regexp {(\d+) keys read} $serial -> serial_keys
+        regexp {(\d+) keys read} $parallel -> parallel_keys
+        assert_equal $serial_keys $parallel_keys
+        assert_equal [r dbsize] $parallel_keys
+        assert_match {*\[stats\] type string:*} $parallel
+        assert_match {*compressed: *} $parallel
+        assert_match {*biggest key #1:*} $parallel
+    }
+
+    test {CONFIG SET rdb-compression-codec only accepts known codecs} {
+        catch {r config set rdb-compression-codec snappy} e
+        assert_match {*Invalid argument*} $e
+        r config set rdb-compression-codec lzf
+        r config get rdb-compression-codec
+    } {rdb-compression-codec lzf}
+}
+
+start_server {tags {"rdb"}} {
+    test {RDB is loaded the same with and without rdb-load-mmap} {
+        createComplexDataset r 10000
+        r debug populate 20000
+        set digest [r debug digest]
+        r config set rdb-load-mmap yes
+        r debug reload
+        assert_equal $digest [r debug digest]
+        r config set rdb-load-mmap no
+        r debug reload
+        assert_equal $digest [r debug digest]
+    }
+}
+
+start_server {tags {"rdb"}} {
+    foreach mode {fadvise odirect} {
+        test "RDB saved with rdb-save-bypass-cache $mode is loaded back" {
+            r flushall
+            createComplexDataset r 10000
+            r debug populate 20000
+            set digest [r debug digest]
+            r config set rdb-save-bypass-cache $mode
+            r debug reload
+            assert_equal $digest [r debug digest]
+            waitForBgsave r
+            r bgsave
+            waitForBgsave r
+            set rdb [file join [lindex [r config get dir] 1] \
+                               [lindex [r config get dbfilename] 1]]
+            assert_match {*RDB looks OK*} [exec src/redis-check-rdb $rdb]
+            r config set rdb-save-bypass-cache no
+        }
+    }
+}
+
+set server_path [tmpdir "server.rdb-forkless-test"]
+
+start_server [list overrides [list "dir" $server_path "rdb-save-forkless" "yes"]] {
+    test {Fork-less BGSAVE saves the dataset as it was when it started} {
+        r debug populate 200000
+        createComplexDataset r 10000
+        set digest [r debug digest]
+        r bgsave
+        # Change, delete and create keys while the keyspace is walked.
+        for {set j 0} {$j < 1000} {incr j} {
+            r set key:$j changed
+            r del key:[expr {$j+100000}]
+            r set newkey:$j value
+        }
+        waitForBgsave r
+        assert_equal ok [status r rdb_last_bgsave_status]
+        assert_match {*RDB looks OK*} \
+            [exec src/redis-check-rdb [file join $server_path dump.rdb]]
+        # The shutdown save would overwrite dump.rdb, so keep the snapshot.
+        file copy -force [file join $server_path dump.rdb] \
+                         [file join $server_path forkless.rdb]
+    }
+}
+
+start_server [list overrides [list "dir" $server_path "dbfilename" "forkless.rdb"]] {
+    test {Fork-less BGSAVE RDB is loaded as the dataset at its start} {
+        assert_equal $digest [r debug digest]
+    }
+}
+
+start_server {} {
+    test {SHUTDOWN HANDOFF restarts with the same dataset} {
+        r debug populate 100000
+        createComplexDataset r 1000
+        set digest [r debug digest]
+        set pid [s process_id]
+        catch {r shutdown handoff}
+        wait_for_condition 50 100 {
+            [catch {r ping}] == 0
+        } else {
+            fail "Server not restarted"
+        }
+        wait_for_condition 50 100 {
+            [s loading] == 0
+        } else {
+            fail "Dataset still loading"
+        }
+        assert_equal $pid [s process_id]
+        assert_equal $digest [r debug digest]
+    }
+}
+
+set server_path [tmpdir "server.rdb-lazy-loading-test"]
+exec cp tests/assets/encodings.rdb $server_path
+
+start_server [list overrides [list "dir" $server_path "dbfilename" "encodings.rdb"]] {
+    r select 0
+    set expected_dump [csvdump r]
+    set expected_digest [r debug digest]
+}
+
+start_server [list overrides [list "dir" $server_path "dbfilename" "encodings.rdb" "lazy-loading" "yes"]] {
+    test {RDB encoding lazy loading test} {
+        r select 0
+        assert_equal $expected_dump [csvdump r]
+    }
+
+    test {Lazy loading loads all the values in the background} {
+        wait_for_condition 50 100 {
+            [s lazy_loading] == 0
+        } else {
+            fail "Values still pending"
+        }
+        assert {[s lazy_loading_loaded_keys] > 0}
+        assert_equal $expected_digest [r debug digest]
+    }
+}
+
+set server_path [tmpdir "server.rdb-build-test"]
+set input [open [file join $server_path input.csv] w]
+puts $input "SET,string,\"with,comma\"\nSET,number,12345"
+puts $input "HSET,small,f1,v1\nHSET,small,f2,v2"
+for {set j 0} {$j < 200} {incr j} {puts $input "HSET,big,field:$j,$j"}
+puts $input "SADD,ints,1,2,3\nZADD,zset,1,a,2.5,b\nRPUSH,list,a,b,c"
+puts $input "PEXPIRE,string,1000000"
+close $input
+set input [open [file join $server_path input.json] w]
+puts $input {["SELECT", 1]}
+puts $input {["SET", "json", "quote\" é"]}
+close $input
+exec src/redis-build-rdb --format csv --threads 4 \
+    [file join $server_path built.rdb] [file join $server_path input.csv] \
+    [file join $server_path input.json]
+
+start_server [list overrides [list "dir" $server_path "dbfilename" "built.rdb" "rdb-load-threads" "4"]] {
+    test {RDB built offline is loaded with compact encodings} {
+        assert_equal "with,comma" [r get string]
+        assert {[r pttl string] > 0}
+        assert_encoding int number
+        assert_encoding listpack small
+        assert_equal {f1 v1 f2 v2} [r hgetall small]
+        assert_encoding hashtable big
+        assert_equal 200 [r hlen big]
+        assert_encoding intset ints
+        assert_equal {a 1 b 2.5} [r zrange zset 0 -1 withscores]
+        assert_equal {a b c} [r lrange list 0 -1]
+        r select 1
+        assert_equal "quote\" é" [r get json]
+    }
+}
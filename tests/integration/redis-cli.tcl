@@ -205,4 +205,34 @@ start_server {tags {"cli"}} {
         assert_equal "OK" [run_cli_with_input_file $tmpfile set key]
         assert_equal "from file" [r get key]
     }
+
+    test_nontty_cli "Parallel --bigkeys samples every key once" {
+        r flushdb
+        r debug populate 10000
+        r rpush mylist a b c
+        set out [run_cli --bigkeys --scan-jobs 4]
+        assert_match "*Sampled 10001 keys*" $out
+        assert_match "*Biggest   list found 'mylist' has 3 items*" $out
+        assert_match "*string size distribution (bytes)*" $out
+    }
+
+    test_nontty_cli "--memkeys reports the memory used" {
+        set out [run_cli --memkeys]
+        assert_match "*Sampled 10001 keys*" $out
+        assert_match "*list size distribution (bytes)*" $out
+    }
+
+    test_nontty_cli "--pipe with parallel connections" {
+        r flushdb
+        set cmds {}
+        for {set j 0} {$j < 1000} {incr j} {
+            append cmds "*3\r\n\$5\r\nRPUSH\r\n\$[string length key:[expr {$j%10}]]\r\nkey:[expr {$j%10}]\r\n\$[string length $j]\r\n$j\r\n"
+        }
+        set tmpfile [write_tmpfile $cmds]
+        set out [run_cli_with_input_file $tmpfile --pipe --pipe-jobs 4]
+        assert_match "*errors: 0, replies: 1000*" $out
+        assert_equal 10 [r dbsize]
+        # The commands about the same key are executed in order.
+        assert_equal {7 17 27} [r lrange key:7 0 2]
+    }
 }
@@ -266,3 +266,355 @@ foreach dl {no yes} {
         }
     }
 }
+
+start_server {tags {"repl"}} {
+    set master [srv 0 client]
+    set master_host [srv 0 host]
+    set master_port [srv 0 port]
+    $master config set repl-diskless-sync yes
+    $master config set repl-diskless-sync-delay 0
+    $master config set repl-diskless-resume-window 60
+    $master config set repl-timeout 1
+    $master debug populate 50000 key 1000
+
+    start_server {} {
+        set slave [srv 0 client]
+        set slave_pid [srv 0 pid]
+        $slave config set repl-diskless-resume-window 60
+
+        test {Interrupted diskless transfer is resumed} {
+            $slave slaveof $master_host $master_port
+            # Streamed transfers have no known size, so the left bytes
+            # become negative as soon as the RDB starts to arrive.
+            wait_for_condition 100 10 {
+                [s master_sync_in_progress] == 1 &&
+                [s master_sync_left_bytes] < -1
+            } else {
+                fail "Diskless transfer not started"
+            }
+
+            # Stop the slave in the middle of the transfer: the master
+            # gives up sending it the RDB, but completes the spool.
+            exec kill -STOP $slave_pid
+            wait_for_condition 100 100 {
+                [status $master rdb_bgsave_in_progress] == 0
+            } else {
+                exec kill -CONT $slave_pid
+                fail "Diskless transfer child not terminated"
+            }
+            exec kill -CONT $slave_pid
+
+            wait_for_condition 100 100 {
+                [s master_link_status] eq {up}
+            } else {
+                fail "Slave not synchronized after the interrupted transfer"
+            }
+            assert_equal 1 [status $master sync_resume_ok]
+            assert_equal 1 [status $master sync_full]
+            $master set foo bar
+            wait_for_condition 50 100 {
+                [$master debug digest] eq [$slave debug digest]
+            } else {
+                fail "Different dataset after resuming the transfer"
+            }
+        }
+    }
+}
+
+foreach diskless {no yes} {
+    start_server {tags {"repl"}} {
+        set master [srv 0 client]
+        set master_host [srv 0 host]
+        set master_port [srv 0 port]
+        $master config set repl-compression yes
+        $master config set repl-diskless-sync $diskless
+        $master config set repl-diskless-sync-delay 0
+        $master debug populate 10000 key 100
+
+        start_server {} {
+            set slave [srv 0 client]
+
+            test "LZF compressed replication stream (diskless: $diskless)" {
+                $slave slaveof $master_host $master_port
+                wait_for_condition 50 100 {
+                    [s master_link_status] eq {up}
+                } else {
+                    fail "Slave not synchronized with the compressing master"
+                }
+
+                for {set j 0} {$j < 1000} {incr j} {
+                    $master set "compressed:$j" [string repeat "abcd" 100]
+                    $master incr counter
+                }
+                $master rpush biglist {*}[lrepeat 100 [string repeat x 200]]
+
+                wait_for_condition 50 100 {
+                    [$master debug digest] eq [$slave debug digest]
+                } else {
+                    fail "Different dataset with the compressed stream"
+                }
+                set in [status $master repl_compress_in_bytes]
+                set out [status $master repl_compress_out_bytes]
+                assert {$in > 0 && $out < $in}
+            }
+        }
+    }
+}
+
+start_server {tags {"repl"}} {
+    set master [srv 0 client]
+    set master_host [srv 0 host]
+    set master_port [srv 0 port]
+
+    start_server {} {
+    start_server {} {
+    start_server {} {
+        set slaves [list [srv 0 client] [srv -1 client] [srv -2 client]]
+        set pids [list [srv 0 pid] [srv -1 pid] [srv -2 pid]]
+
+        test {Slaves share the replication buffer} {
+            foreach slave $slaves {$slave slaveof $master_host $master_port}
+            wait_for_condition 50 100 {
+                [regexp -all {state=online} [$master info replication]] == 3
+            } else {
+                fail "Slaves not synchronized"
+            }
+
+            # With the slaves stopped the stream accumulates on the master,
+            # but once for all of them.
+            foreach pid $pids {exec kill -STOP $pid}
+            set val [string repeat x 100000]
+            for {set j 0} {$j < 300} {incr j} {
+                $master set "big:$j" $val
+            }
+            set sum 0
+            foreach line [split [$master client list] "\n"] {
+                if {[regexp {flags=S .*omem=([0-9]+)} $line - omem]} {
+                    incr sum $omem
+                }
+            }
+            set shared [status $master repl_buffer_bytes]
+            foreach pid $pids {exec kill -CONT $pid}
+            assert {$shared > 0 && $shared < $sum/2}
+
+            foreach slave $slaves {
+                wait_for_condition 50 100 {
+                    [$master debug digest] eq [$slave debug digest]
+                } else {
+                    fail "Different dataset on a slave"
+                }
+            }
+            # Only the block the slaves are at is left.
+            wait_for_condition 50 100 {
+                [status $master repl_buffer_blocks] <= 1
+            } else {
+                fail "Shared replication buffer not released"
+            }
+        }
+    }
+    }
+    }
+}
+
+start_server {tags {"repl"}} {
+    set master [srv 0 client]
+    set master_host [srv 0 host]
+    set master_port [srv 0 port]
+    $master config set repl-backlog-size 16kb
+    $master config set repl-backlog-disk-size 20mb
+
+    start_server {} {
+        set slave [srv 0 client]
+        set slave_pid [srv 0 pid]
+
+        test {Partial resync from the backlog on disk} {
+            $slave slaveof $master_host $master_port
+            wait_for_condition 50 100 {
+                [s master_link_status] eq {up}
+            } else {
+                fail "Slave not synchronized"
+            }
+
+            # Write much more than the memory backlog while the slave is
+            # disconnected.
+            exec kill -STOP $slave_pid
+            $master client kill type slave
+            set val [string repeat x 10000]
+            for {set j 0} {$j < 200} {incr j} {
+                $master set "disk:$j" $val
+            }
+            exec kill -CONT $slave_pid
+            # About 2MB were written, all but the memory backlog on disk.
+            assert {[status $master repl_backlog_disk_histlen] > 1500000}
+
+            wait_for_condition 50 100 {
+                [status $master sync_partial_ok] == 1
+            } else {
+                fail "Slave not partially resynchronized"
+            }
+            wait_for_condition 50 100 {
+                [$master debug digest] eq [$slave debug digest]
+            } else {
+                fail "Different dataset after the resync from disk"
+            }
+            assert_equal 1 [status $master sync_full]
+        }
+    }
+}
+
+start_server {tags {"repl"}} {
+    set master [srv 0 client]
+    set master_host [srv 0 host]
+    set master_port [srv 0 port]
+    $master debug populate 1000000 key 100
+
+    start_server {} {
+        set slave [srv 0 client]
+        $slave config set repl-async-load yes
+        $slave set old-key old-value
+
+        test {Slave serves the old data while loading asynchronously} {
+            $slave slaveof $master_host $master_port
+            wait_for_condition 500 10 {
+                [s async_loading] eq 1
+            } else {
+                fail "Slave not loading asynchronously"
+            }
+            assert_equal old-value [$slave get old-key]
+            assert_equal 0 [s loading]
+            catch {$slave set foo bar} err
+            assert_match {LOADING*} $err
+
+            wait_for_condition 100 100 {
+                [s master_link_status] eq {up}
+            } else {
+                fail "Slave not synchronized"
+            }
+            assert_equal 0 [s async_loading]
+            assert_equal {} [$slave get old-key]
+            assert_equal [$master dbsize] [$slave dbsize]
+        }
+    }
+}
+
+foreach mdl {no yes} {
+    start_server {tags {"repl"}} {
+        set master [srv 0 client]
+        $master config set repl-diskless-sync $mdl
+        $master config set repl-diskless-sync-delay 0
+        set master_host [srv 0 host]
+        set master_port [srv 0 port]
+        $master debug populate 100000 key 100
+        set load_handle [start_write_load $master_host $master_port 5]
+
+        start_server {} {
+            set slave [srv 0 client]
+            $slave config set repl-diskless-load yes
+            $slave set old-key old-value
+
+            test "Slave loads the RDB from the socket, diskless master=$mdl" {
+                $slave slaveof $master_host $master_port
+                wait_for_condition 100 100 {
+                    [s master_link_status] eq {up}
+                } else {
+                    fail "Slave not synchronized"
+                }
+                stop_write_load $load_handle
+                wait_for_condition 100 100 {
+                    [$master debug digest] eq [$slave debug digest]
+                } else {
+                    fail "Different dataset after loading from the socket"
+                }
+                assert_equal {} [$slave get old-key]
+            }
+        }
+    }
+}
+
+start_server {tags {"repl"}} {
+    set master [srv 0 client]
+    set master_host [srv 0 host]
+    set master_port [srv 0 port]
+    for {set j 0} {$j < 100} {incr j} {
+        $master set "key:$j" "val:$j"
+        $master hset "hash:$j" field $j
+        $master set "{shard}key:$j" "val:$j"
+        $master hset "{shard}hash:$j" field $j
+    }
+
+    start_server {overrides {io-threads 4 io-threads-do-reads yes
+                             slave-parallel-reads yes}} {
+        set slave [srv 0 client]
+
+        test {Slave executes read only commands in the I/O threads} {
+            $slave slaveof $master_host $master_port
+            wait_for_condition 50 100 {
+                [s master_link_status] eq {up}
+            } else {
+                fail "Slave not synchronized"
+            }
+
+            set clients {}
+            for {set c 0} {$c < 20} {incr c} {
+                lappend clients [redis_deferring_client]
+            }
+            for {set round 0} {$round < 50} {incr round} {
+                foreach rd $clients {
+                    for {set j 0} {$j < 10} {incr j} {
+                        $rd get "key:$j"
+                        $rd hget "hash:$j" field
+                    }
+                }
+                foreach rd $clients {
+                    for {set j 0} {$j < 10} {incr j} {
+                        assert_equal "val:$j" [$rd read]
+                        assert_equal $j [$rd read]
+                    }
+                }
+                if {[s io_threaded_commands_processed] > 0} break
+            }
+            foreach rd $clients {$rd close}
+            assert {[s io_threaded_commands_processed] > 0}
+        }
+
+        test {Slave executes the reads by slot with io-threads-shards} {
+            # All the keys hash to the same slot, so every command executed
+            # by the I/O threads must be executed by the same thread, while
+            # the clients are otherwise distributed round robin.
+            $slave config set io-threads-shards yes
+            $slave config resetstat
+            set clients {}
+            for {set c 0} {$c < 20} {incr c} {
+                lappend clients [redis_deferring_client]
+            }
+            for {set round 0} {$round < 50} {incr round} {
+                foreach rd $clients {
+                    for {set j 0} {$j < 10} {incr j} {
+                        $rd get "{shard}key:$j"
+                        $rd hget "{shard}hash:$j" field
+                    }
+                }
+                foreach rd $clients {
+                    for {set j 0} {$j < 10} {incr j} {
+                        assert_equal "val:$j" [$rd read]
+                        assert_equal $j [$rd read]
+                    }
+                }
+                if {[s io_threaded_commands_processed] > 0} break
+            }
+            foreach rd $clients {$rd close}
+            $slave config set io-threads-shards no
+
+            set total [s io_threaded_commands_processed]
+            assert {$total > 0}
+            set threads {}
+            foreach counter [split [s io_threaded_commands_by_thread] ,] {
+                lassign [split $counter =] id count
+                if {$count > 0} {lappend threads $id}
+                set executed($id) $count
+            }
+            assert_equal 1 [llength $threads]
+            assert_equal $total $executed([lindex $threads 0])
+        }
+    }
+}
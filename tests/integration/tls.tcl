@@ -0,0 +1,115 @@
+# TLS tests, only run by ./runtest --tls against a server built with
+# BUILD_TLS=yes. The certificates are generated in tests/tls by
+# utils/gen-test-certs.sh the first time.
+
+proc tls_file {name} {
+    file normalize tests/tls/$name
+}
+
+# The server only performs the handshake, then hands the session to the
+# kernel: without the kTLS module every connection would be refused.
+proc ktls_available {} {
+    if {[catch {set fd [open /proc/sys/net/ipv4/tcp_available_ulp]}]} {
+        return 0
+    }
+    set ulps [read $fd]
+    close $fd
+    expr {[lsearch -exact $ulps tls] != -1}
+}
+
+# Reserve a port for tls-port, like start_server does for port.
+proc tls_port {} {
+    set ::port [find_available_port [expr {$::port+1}]]
+}
+
+proc tls_server_overrides {port} {
+    list tls-port $port \
+         tls-cert-file [tls_file redis.crt] \
+         tls-key-file [tls_file redis.key] \
+         tls-ca-cert-file [tls_file ca.crt]
+}
+
+proc tls_client {port {cert client}} {
+    set client [redis [srv 0 host] $port 0 [list \
+        -cafile [tls_file ca.crt] \
+        -certfile [tls_file $cert.crt] \
+        -keyfile [tls_file $cert.key] \
+        -require 1]]
+    $client select 9
+    return $client
+}
+
+if {$::tls} {
+    if {![file exists [tls_file ca.crt]]} {
+        exec utils/gen-test-certs.sh [file normalize tests/tls] 2>@1
+    }
+
+    test {Kernel TLS is available for the TLS tests} {
+        assert {[ktls_available]}
+    }
+}
+
+if {$::tls && [ktls_available]} {
+    set port [tls_port]
+    start_server [list tags {tls} overrides [tls_server_overrides $port]] {
+        test {TLS client round trip on tls-port} {
+            set rd [tls_client $port]
+            assert_equal OK [$rd set tlskey tlsval]
+            assert_equal tlsval [$rd get tlskey]
+            assert_equal tlsval [r get tlskey]
+            set big [string repeat abcd 250000]
+            assert_equal OK [$rd set tlsbig $big]
+            for {set j 0} {$j < 10} {incr j} {
+                assert_equal $big [$rd get tlsbig]
+            }
+            $rd close
+        }
+
+        test {TLS handshake with a certificate of another CA is refused} {
+            set rd {}
+            assert_equal 1 [catch {
+                set rd [tls_client $port other-client]
+                $rd ping
+            }]
+            if {$rd ne {}} {$rd close}
+            # The server keeps serving the clients with a valid certificate.
+            set rd [tls_client $port]
+            assert_equal PONG [$rd ping]
+            $rd close
+        }
+    }
+
+    set master_port [tls_port]
+    start_server [list tags {tls repl} overrides [tls_server_overrides $master_port]] {
+        set master [srv 0 client]
+        set master_host [srv 0 host]
+        for {set j 0} {$j < 1000} {incr j} {
+            $master set "key:$j" [string repeat x $j]
+        }
+
+        start_server [list overrides [concat [tls_server_overrides [tls_port]] \
+                                             {tls-replication yes}]] {
+            test {TLS replica syncs with the master on tls-port} {
+                r slaveof $master_host $master_port
+                wait_for_condition 50 100 {
+                    [s master_link_status] eq {up}
+                } else {
+                    fail "Replica not synchronized over TLS"
+                }
+                assert_equal 1000 [r dbsize]
+                assert_equal [string repeat x 999] [r get key:999]
+            }
+
+            test {TLS replica receives the replication stream} {
+                for {set j 0} {$j < 100} {incr j} {
+                    $master incr counter
+                }
+                wait_for_condition 50 100 {
+                    [r get counter] eq {100}
+                } else {
+                    fail "Writes not propagated over TLS"
+                }
+            }
+        }
+    }
+}
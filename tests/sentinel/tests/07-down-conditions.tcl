@@ -66,3 +66,23 @@ test "SDOWN is triggered by misconfigured instance repling with errors" {
     R 0 bgsave
     ensure_master_up
 }
+
+test "Sub-second down-after-milliseconds with a phi threshold" {
+    S 4 SENTINEL SET mymaster down-after-milliseconds 300 phi-threshold 8
+    set info [S 4 sentinel master mymaster]
+    assert_equal 8 [dict get $info phi-threshold]
+    assert {[dict get $info ping-period] < 300}
+    # The round trip times are measured, and the master stays up.
+    wait_for_condition 100 50 {
+        [dict get [S 4 sentinel master mymaster] round-trip-time-us] > 0
+    } else {
+        fail "No round trip time measured"
+    }
+    after 2000
+    ensure_master_up
+    lassign [S 4 SENTINEL GET-MASTER-ADDR-BY-NAME mymaster] host port
+    exec ../../../src/redis-cli -h $host -p $port debug sleep 3 > /dev/null &
+    ensure_master_down
+    ensure_master_up
+    S 4 SENTINEL SET mymaster down-after-milliseconds 2000 phi-threshold 0
+}
@@ -24,6 +24,11 @@
 # $r get fo [list handlePong]
 #
 # vwait forever
+#
+# TLS connections, that need the tls package, are created passing the
+# options of ::tls::socket:
+#
+# set r [redis 127.0.0.1 6380 0 {-cafile ca.crt -certfile client.crt -keyfile client.key}]
 
 package require Tcl 8.5
 package provide redis 0.1
@@ -32,6 +37,7 @@ namespace eval redis {}
 set ::redis::id 0
 array set ::redis::fd {}
 array set ::redis::addr {}
+array set ::redis::tlsoptions {}
 array set ::redis::blocking {}
 array set ::redis::deferred {}
 array set ::redis::reconnect {}
@@ -39,12 +45,12 @@ array set ::redis::callback {}
 array set ::redis::state {} ;# State in non-blocking reply reading
 array set ::redis::statestack {} ;# Stack of states, for nested mbulks
 
-proc redis {{server 127.0.0.1} {port 6379} {defer 0}} {
-    set fd [socket $server $port]
-    fconfigure $fd -translation binary
+proc redis {{server 127.0.0.1} {port 6379} {defer 0} {tlsoptions {}}} {
+    set fd [::redis::redis_connect $server $port $tlsoptions]
     set id [incr ::redis::id]
     set ::redis::fd($id) $fd
     set ::redis::addr($id) [list $server $port]
+    set ::redis::tlsoptions($id) $tlsoptions
     set ::redis::blocking($id) 1
     set ::redis::deferred($id) $defer
     set ::redis::reconnect($id) 0
@@ -52,6 +58,17 @@ proc redis {{server 127.0.0.1} {port 6379} {defer 0}} {
     interp alias {} ::redis::redisHandle$id {} ::redis::__dispatch__ $id
 }
 
+proc ::redis::redis_connect {server port tlsoptions} {
+    if {$tlsoptions ne {}} {
+        package require tls
+        set fd [::tls::socket {*}$tlsoptions $server $port]
+    } else {
+        set fd [socket $server $port]
+    }
+    fconfigure $fd -translation binary
+    return $fd
+}
+
 # This is a wrapper to the actual dispatching procedure that handles
 # reconnection if needed.
 proc ::redis::__dispatch__ {id method args} {
@@ -72,8 +89,8 @@ proc ::redis::__dispatch__raw__ {id method argv} {
     # Reconnect the link if needed.
     if {$fd eq {}} {
         lassign $::redis::addr($id) host port
-        set ::redis::fd($id) [socket $host $port]
-        fconfigure $::redis::fd($id) -translation binary
+        set ::redis::fd($id) [::redis::redis_connect $host $port \
+            $::redis::tlsoptions($id)]
         set fd $::redis::fd($id)
     }
 
@@ -139,6 +156,7 @@ proc ::redis::__method__close {id fd} {
     catch {close $fd}
     catch {unset ::redis::fd($id)}
     catch {unset ::redis::addr($id)}
+    catch {unset ::redis::tlsoptions($id)}
     catch {unset ::redis::blocking($id)}
     catch {unset ::redis::deferred($id)}
     catch {unset ::redis::reconnect($id)}
@@ -26,6 +26,7 @@ set ::all_tests {
     unit/type/set
     unit/type/zset
     unit/type/hash
+    unit/type/stream
     unit/sort
     unit/expire
     unit/other
@@ -43,7 +44,9 @@ set ::all_tests {
     integration/logging
     integration/psync2
     integration/psync2-reg
+    integration/tls
     unit/pubsub
+    unit/tracking
     unit/slowlog
     unit/scripting
     unit/maxmemory
@@ -56,6 +59,8 @@ set ::all_tests {
     unit/geo
     unit/memefficiency
     unit/hyperloglog
+    unit/bloom
+    unit/timeseries
     unit/lazyfree
     unit/wait
 }
@@ -75,6 +80,7 @@ set ::external 0; # If "1" this means, we are running against external instance
 set ::file ""; # If set, runs only the tests in this comma separated list
 set ::curfile ""; # Hold the filename of the current suite
 set ::accurate 0; # If true runs fuzz tests with more iterations
+set ::tls 0; # If true runs the TLS tests, see integration/tls.tcl
 set ::force_failure 0
 set ::timeout 600; # 10 minutes without progresses will quit the test.
 set ::last_progress [clock seconds]
@@ -401,6 +407,7 @@ proc print_help_screen {} {
         "--valgrind         Run the test over valgrind."
         "--stack-logging    Enable OSX leaks/malloc stack logging."
         "--accurate         Run slow randomized tests for more iterations."
+        "--tls              Run the TLS tests (needs a BUILD_TLS=yes build)."
         "--quiet            Don't show individual tests."
         "--single <unit>    Just execute the specified unit (see next option)."
         "--list-tests       List all the available test units."
@@ -441,6 +448,8 @@ for {set j 0} {$j < [llength $argv]} {incr j} {
         incr j
     } elseif {$opt eq {--accurate}} {
         set ::accurate 1
+    } elseif {$opt eq {--tls}} {
+        set ::tls 1
     } elseif {$opt eq {--force-failure}} {
         set ::force_failure 1
     } elseif {$opt eq {--single}} {
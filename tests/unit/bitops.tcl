@@ -182,6 +182,22 @@ start_server {tags {"bitops"}} {
         }
     }
 
+    test {BITOP with more than 16 keys of the same length} {
+        r flushall
+        set vec {}
+        set veckeys {}
+        for {set j 0} {$j < 20} {incr j} {
+            set str [randstring 300 300]
+            lappend vec $str
+            lappend veckeys vector_$j
+            r set vector_$j $str
+        }
+        foreach op {and or xor} {
+            r bitop $op target {*}$veckeys
+            assert_equal [r get target] [simulate_bit_op $op {*}$vec]
+        }
+    }
+
     test {BITOP NOT fuzzing} {
         for {set i 0} {$i < 10} {incr i} {
             r flushall
@@ -348,4 +364,44 @@ start_server {tags {"bitops"}} {
             }
         }
     }
+
+    test {Chunked bitmaps behave like plain strings} {
+        r del big plain dest
+        r config set bitmap-chunked-min-bytes 4096
+        r setbit big 1000000 1
+        r setbit big 20 1
+        assert_encoding chunked big
+        r set plain [r get big]
+        assert_encoding raw plain
+        assert {[r strlen big] == [r strlen plain]}
+        assert {[r getbit big 1000000] == 1}
+        assert {[r getbit big 500000] == 0}
+        assert {[r bitcount big] == 2}
+        assert {[r bitcount big 10 -1] == 1}
+        assert {[r bitpos big 1 3] == 1000000}
+        assert {[r bitpos big 0 0 1] == 0}
+        r bitfield big set u8 999992 255
+        r bitfield plain set u8 999992 255
+        assert {[r bitfield big get u16 999990] == [r bitfield plain get u16 999990]}
+        assert {[r getrange big 124990 -1] eq [r getrange plain 124990 -1]}
+        r setrange big 60000 hello
+        r setrange plain 60000 hello
+        assert_encoding chunked big
+        assert {[r getrange big 59990 60010] eq [r getrange plain 59990 60010]}
+        assert {[r setrange big 125010 tail] == [r setrange plain 125010 tail]}
+        assert {[r get big] eq [r get plain]}
+        foreach op {and or xor} {
+            r bitop $op dest big plain big
+            r bitop $op dest2 plain plain plain
+            assert {[r get dest] eq [r get dest2]}
+        }
+        r bitop not dest big
+        assert_encoding chunked dest
+        r bitop not dest2 plain
+        assert {[r get dest] eq [r get dest2]}
+        r append big x
+        assert_encoding raw big
+        assert {[r get big] eq "[r get plain]x"}
+        r config set bitmap-chunked-min-bytes 1mb
+    }
 }
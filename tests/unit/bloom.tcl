@@ -0,0 +1,76 @@
+start_server {tags {"bloom"}} {
+    test {BF.ADD creates a Bloom filter} {
+        r del bf
+        list [r bf.add bf a] [r bf.add bf a] [r exists bf] [r type bf]
+    } {1 0 1 string}
+
+    test {BF.EXISTS of elements added and missing} {
+        r del bf
+        r bf.add bf foo
+        list [r bf.exists bf foo] [r bf.exists bf bar] [r bf.exists nokey foo]
+    } {1 0 0}
+
+    test {BF.MADD and BF.MEXISTS} {
+        r del bf
+        assert_equal {1 1 0} [r bf.madd bf a b a]
+        assert_equal {1 0 1} [r bf.mexists bf a c b]
+        r bf.mexists nokey a b
+    } {0 0}
+
+    test {Bloom filter grows without losing elements} {
+        r del bf
+        set elements {}
+        for {set j 0} {$j < 5000} {incr j} {
+            lappend elements e$j
+        }
+        foreach {a b c d e} $elements {
+            r bf.madd bf $a $b $c $d $e
+        }
+        set missing 0
+        foreach found [r bf.mexists bf {*}$elements] {
+            if {!$found} {incr missing}
+        }
+        assert_equal 0 $missing
+        foreach element $elements {
+            if {![r bf.exists bf $element]} {incr missing}
+        }
+        assert_equal 0 $missing
+
+        # With 5000 elements the filter grew, yet the false positives
+        # stay about below the 1% error rate.
+        set falsepos 0
+        set others {}
+        for {set j 0} {$j < 5000} {incr j} {
+            lappend others other$j
+        }
+        foreach found [r bf.mexists bf {*}$others] {
+            incr falsepos $found
+        }
+        assert {$falsepos < 100}
+    }
+
+    test {Bloom filter survives DEBUG RELOAD} {
+        r del bf
+        r bf.madd bf a b c
+        r debug reload
+        list [r bf.mexists bf a b c d] [r bf.add bf d]
+    } {{1 1 1 0} 1}
+
+    test {BF commands against a key holding something else} {
+        r del bf
+        r set bf foo
+        assert_error "WRONGTYPE*" {r bf.add bf a}
+        assert_error "WRONGTYPE*" {r bf.exists bf a}
+        r del bf
+        r lpush bf foo
+        assert_error "WRONGTYPE*" {r bf.mexists bf a}
+    }
+
+    test {BF.ADD against a corrupted Bloom filter} {
+        r del bf
+        r bf.add bf a
+        r setrange bf 4 "\x7f"
+        assert_error "WRONGTYPE*" {r bf.add bf b}
+        assert_error "WRONGTYPE*" {r bf.exists bf a}
+    }
+}
@@ -61,6 +61,35 @@ start_server {tags {"expire"}} {
         set _ $e
     } {*invalid expire*}
 
+    test {SETEX and SET EX replace the expire of an existing key} {
+        r del x
+        r set x foo
+        r setex x 100 bar
+        assert {[r ttl x] > 90 && [r ttl x] <= 100}
+        r set x baz px 5000
+        assert {[r pttl x] > 4000 && [r pttl x] <= 5000}
+        r set x plain
+        list [r get x] [r ttl x]
+    } {plain -1}
+
+    test {MSETEX sets all the keys with the same TTL} {
+        r del a b c
+        r set b old
+        r expire b 5
+        r msetex 100 a 1 b 2 c 3
+        assert_equal {1 2 3} [r mget a b c]
+        foreach k {a b c} {assert {[r ttl $k] > 90 && [r ttl $k] <= 100}}
+        r msetex 1 a 1
+        after 1100
+        list [r exists a] [r exists b]
+    } {0 1}
+
+    test {MSETEX - Wrong parameters} {
+        assert_error {*invalid expire*} {r msetex 0 a 1}
+        assert_error {*invalid expire*} {r msetex -10 a 1}
+        assert_error {*wrong number*} {r msetex 10 a 1 b}
+    }
+
     test {PERSIST can undo an EXPIRE} {
         r set x foo
         r expire x 50
@@ -219,4 +248,95 @@ start_server {tags {"expire"}} {
         set ttl [r ttl foo]
         assert {$ttl <= 98 && $ttl > 90}
     }
+
+    test {Active expire with the expire index reclaims only expired keys} {
+        r flushdb
+        r set stale1 a PX 1000000
+        r config set active-expire-index yes
+        for {set j 0} {$j < 200} {incr j} {r psetex short$j 100 v}
+        for {set j 0} {$j < 50} {incr j} {r setex long$j 1000 v}
+        r setex persisted 1 v
+        r persist persisted
+        r setex overwritten 1 v
+        r set overwritten v
+        r pexpire stale1 100
+        wait_for_condition 50 100 {
+            [r dbsize] == 52
+        } else {
+            fail "Keys not reclaimed by the expire index: [r dbsize]"
+        }
+        assert_equal {} [r keys short*]
+        assert_equal 50 [llength [r keys long*]]
+        assert_equal {-1 -1} [list [r ttl persisted] [r ttl overwritten]]
+    }
+
+    test {The expire index survives FLUSHDB ASYNC, SWAPDB and being disabled} {
+        r flushdb async
+        r select 10
+        r setex other 1 v
+        r select 9
+        r swapdb 9 10
+        wait_for_condition 50 100 {
+            [r dbsize] == 0
+        } else {
+            fail "Key of the swapped DB not reclaimed"
+        }
+        r config set active-expire-index no
+        r psetex foo 100 v
+        wait_for_condition 50 100 {
+            [r dbsize] == 0
+        } else {
+            fail "Key not reclaimed with the index disabled"
+        }
+    }
+
+    test {The expire cycle effort follows the stale keys} {
+        r flushdb
+        r config set active-expire-cycle-min 5
+        r config set active-expire-cycle-max 5
+        wait_for_condition 50 100 {
+            [status r expire_cycle_cpu_perc] < 5.5
+        } else {
+            fail "Expire effort didn't settle to the configured value"
+        }
+        r config set active-expire-cycle-max 50
+        r debug populate 5000 stale 1
+        for {set j 0} {$j < 5000} {incr j} {r pexpire stale:$j 1}
+        wait_for_condition 50 100 {
+            [r dbsize] == 0
+        } else {
+            fail "Stale keys not reclaimed"
+        }
+        assert {[status r expired_stale_perc] > 0}
+        r config set active-expire-cycle-min 10
+        r config set active-expire-cycle-max 25
+    }
+
+    test {The expire stored in the key entry follows the key} {
+        r flushall
+        r set foo bar ex 100
+        r append foo baz
+        assert {[r ttl foo] > 90}
+        r rename foo foo2
+        assert {[r ttl foo2] > 90}
+        r move foo2 10
+        r select 10
+        assert {[r ttl foo2] > 90}
+        r set foo2 bar
+        assert_equal -1 [r ttl foo2]
+        r select 9
+        r psetex a 100 v
+        r set b v
+        r expire b 100
+        r set c v
+        assert_match {*db9:keys=3,expires=2,*} [r info keyspace]
+        r persist b
+        assert_match {*db9:keys=3,expires=1,*} [r info keyspace]
+        wait_for_condition 50 100 {
+            [r dbsize] == 2
+        } else {
+            fail "Key with an expire not reclaimed"
+        }
+        assert_match {*db9:keys=2,expires=0,*} [r info keyspace]
+    }
 }
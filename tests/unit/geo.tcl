@@ -85,6 +85,23 @@ start_server {tags {"geo"}} {
         r geoadd nyc -73.9733487 40.7648057 "central park n/q/r" -73.9903085 40.7362513 "union square" -74.0131604 40.7126674 "wtc one" -73.7858139 40.6428986 "jfk" -73.9375699 40.7498929 "q4" -73.9564142 40.7480973 4545
     } {6}
 
+    test {GEOADD big batch, wrong type and no partial add} {
+        r del bigset wrongtype
+        set args {}
+        for {set j 0} {$j < 200} {incr j} {
+            lappend args [expr {-73.0-$j*0.01}] [expr {40.0+$j*0.01}] m$j
+        }
+        assert_equal 200 [r geoadd bigset {*}$args]
+        assert_equal 1 [r geoadd bigset {*}$args -70 40 m200]
+        assert_encoding skiplist bigset
+        assert_equal 201 [r zcard bigset]
+        catch {r geoadd bigset -70 40 new foo bar other} err
+        assert_match {*valid*} $err
+        assert_equal {} [r zscore bigset new]
+        r set wrongtype foo
+        assert_error "WRONGTYPE*" {r geoadd wrongtype -70 40 m}
+    }
+
     test {Check geoset values} {
         r zrange nyc 0 -1 withscores
     } {{wtc one} 1791873972053020 {union square} 1791875485187452 {central park n/q/r} 1791875761332224 4545 1791875796750882 {lic market} 1791875804419201 q4 1791875830079666 jfk 1791895905559723}
@@ -223,6 +240,30 @@ start_server {tags {"geo"}} {
         assert {[lindex $res 0] eq "Catania"}
     }
 
+    test {GEORADIUS with COUNT returns the nearest points of the radius} {
+        r del mypoints
+        set argv {}
+        for {set j 0} {$j < 2000} {incr j} {
+            geo_random_point lon lat
+            lappend argv $lon $lat "place:$j"
+        }
+        r geoadd mypoints {*}$argv
+        foreach radius_km {100 2000 20000} {
+            geo_random_point search_lon search_lat
+            set all [r georadius mypoints $search_lon $search_lat \
+                     $radius_km km WITHDIST ASC]
+            foreach count {1 5 50} {
+                set res [r georadius mypoints $search_lon $search_lat \
+                         $radius_km km WITHDIST COUNT $count]
+                set expected [lrange $all 0 [expr {$count-1}]]
+                assert_equal [llength $expected] [llength $res]
+                foreach e $expected got $res {
+                    assert_equal [lindex $e 1] [lindex $got 1]
+                }
+            }
+        }
+    }
+
     test {GEOADD + GEORANGE randomized test} {
         set attempt 30
         while {[incr attempt -1]} {
@@ -182,4 +182,23 @@ start_server {tags {"hll"}} {
         r pfadd hll 1 2 3
         assert {[r getrange hll 15 15] eq "\x80"}
     }
+
+    test {PFCOUNT multiple-keys cached union is invalidated by changes} {
+        r del hll1 hll2 hll3
+        r pfadd hll1 a b c
+        r pfadd hll2 c d e
+        assert {[r pfcount hll1 hll2 hll3] == 5}
+        assert {[r pfcount hll1 hll2 hll3] == 5}
+        r pfadd hll3 f g
+        assert {[r pfcount hll1 hll2 hll3] == 7}
+        r pfadd hll2 h
+        assert {[r pfcount hll1 hll2 hll3] == 8}
+        r del hll1
+        assert {[r pfcount hll1 hll2 hll3] == 6}
+        r pexpire hll3 1
+        after 10
+        assert {[r pfcount hll1 hll2 hll3] == 4}
+        r set hll2 foo
+        assert_error {*WRONGTYPE*} {r pfcount hll1 hll2 hll3}
+    }
 }
@@ -20,4 +20,136 @@ start_server {tags {"introspection"}} {
         r set key2 2
         r touch key0 key1 key2 key3
     } 2
+
+    test {HOTKEYS reports the most accessed keys first} {
+        r flushdb
+        r config set hotkeys-top-k 4
+        r mset hot 1 warm 1 cold 1
+        for {set j 0} {$j < 100} {incr j} {r get hot}
+        for {set j 0} {$j < 10} {incr j} {r get warm}
+        r get cold
+        set top [r hotkeys]
+        lassign [lindex $top 0] key db count
+        assert_equal {hot 9} [list $key $db]
+        assert {$count >= 100}
+        assert_equal warm [lindex $top 1 0]
+        assert_equal 1 [llength [r hotkeys count 1]]
+        assert_match {*hotkey0:db=9,key="hot",count=*} [r info hotkeys]
+    }
+
+    test {HOTKEYS RESET and disabled tracking} {
+        r hotkeys reset
+        assert_equal {} [r hotkeys]
+        r config set hotkeys-top-k 0
+        assert_error {*disabled*} {r hotkeys}
+        r config set hotkeys-top-k 16
+    } {OK}
+
+    # Decode the binary records of TRACE FETCH as a list of
+    # {command key argc arg_bytes reply_bytes db} entries.
+    proc decode_trace {blob} {
+        set entries {}
+        set off 0
+        while {$off < [string length $blob]} {
+            binary scan $blob @${off}wwwwwiisss id time cid argbytes \
+                replybytes duration argc db cmdlen keylen
+            incr off 54
+            binary scan $blob @${off}a${cmdlen}a${keylen} cmd key
+            incr off [expr {$cmdlen+$keylen}]
+            lappend entries [list $cmd $key $argc $argbytes $replybytes $db]
+        }
+        return $entries
+    }
+
+    test {TRACE records the sampled commands} {
+        r config set trace-sample-rate 1
+        r trace reset
+        r set tracedkey somevalue
+        r get tracedkey
+        lassign [r trace fetch] next lost blob
+        assert_equal 0 $lost
+        set entries [decode_trace $blob]
+        # The first entry is TRACE RESET itself.
+        assert_equal {set tracedkey 3 21 5 9} [lindex $entries 1]
+        assert_equal {get tracedkey 2 12 15 9} [lindex $entries 2]
+        # Resuming from the next ID returns just the new entries.
+        lassign [r trace fetch from $next] next2 lost blob
+        assert_equal {trace} [lindex [decode_trace $blob] 0 0]
+        assert {$next2 > $next}
+    }
+
+    test {TRACE reports the entries overwritten before the fetch} {
+        r config set trace-max-len 4
+        for {set j 0} {$j < 10} {incr j} {r ping}
+        assert_equal 4 [r trace len]
+        lassign [r trace fetch from 0 count 2] next lost blob
+        # CONFIG SET, the pings and TRACE LEN: 12 entries, 4 still there.
+        assert_equal 8 $lost
+        assert_equal 2 [llength [decode_trace $blob]]
+        r config set trace-sample-rate 0
+        assert_error {*disabled*} {r trace len}
+        r config set trace-max-len 10000
+    } {OK}
+}
+
+set metrics_port [find_available_port [expr {$::port+100}]]
+start_server [list tags {"introspection"} overrides [list metrics-port $metrics_port]] {
+    proc metrics_get {port path} {
+        set fd [socket 127.0.0.1 $port]
+        fconfigure $fd -translation binary
+        puts -nonewline $fd "GET $path HTTP/1.0\r\n\r\n"
+        flush $fd
+        set page [read $fd]
+        close $fd
+        return $page
+    }
+
+    test {Metrics endpoint serves the counters in the Prometheus format} {
+        r set foo bar
+        r get foo
+        wait_for_condition 50 100 {
+            [string match {*redis_command_calls_total{cmd="get"} 1*} \
+                [metrics_get $metrics_port /metrics]]
+        } else {
+            fail "GET not reported by the metrics endpoint"
+        }
+        set page [metrics_get $metrics_port /metrics]
+        assert_match "HTTP/1.0 200 OK*" $page
+        assert_match {*# TYPE redis_command_duration_seconds histogram*} $page
+        assert_match {*redis_command_duration_seconds_count{cmd="set"} 1*} $page
+        assert_match {*redis_db_keys{db="9"} 1*} $page
+    }
+
+    test {Metrics endpoint only serves the metrics path} {
+        assert_match "HTTP/1.0 404 *" [metrics_get $metrics_port /other]
+    }
+}
+
+start_server {tags {"introspection"} overrides {busy-poll-us 2000}} {
+    test {Busy polling serves the requests while spinning} {
+        for {set j 0} {$j < 100} {incr j} {
+            r ping
+        }
+        assert {[status r busy_poll_spins] > 0}
+        assert {[status r busy_poll_spin_usec] > 0}
+        r config set busy-poll-us 0
+        set spins [status r busy_poll_spins]
+        for {set j 0} {$j < 100} {incr j} {
+            r ping
+        }
+        assert_equal $spins [status r busy_poll_spins]
+    }
+
+    test {Busy polling CPU cap} {
+        r config set busy-poll-us 100000
+        r config set busy-poll-max-cpu 1
+        after 1100
+        for {set j 0} {$j < 20} {incr j} {
+            r ping
+            after 20
+        }
+        assert {[status r busy_poll_throttled] > 0}
+        assert_error "*" {r config set busy-poll-max-cpu 0}
+        r config set busy-poll-us 0
+    }
 }
@@ -1,7 +1,7 @@
 start_server {tags {"introspection"}} {
     test {CLIENT LIST} {
         r client list
-    } {*addr=*:* fd=* age=* idle=* flags=N db=9 sub=0 psub=0 multi=-1 qbuf=0 qbuf-free=* obl=0 oll=0 omem=0 events=r cmd=client*}
+    } {*addr=*:* fd=* age=* idle=* flags=N db=9 sub=0 psub=0 ssub=0 multi=-1 qbuf=0 qbuf-free=* obl=0 oll=0 omem=0 events=r cmd=client*}
 
     test {MONITOR can log executed commands} {
         set rd [redis_deferring_client]
@@ -57,4 +57,48 @@ start_server {tags {"introspection"}} {
             fail "Client still listed in CLIENT LIST after SETNAME."
         }
     }
+
+    test {CLIENT LIST reports the resources used by the client} {
+        r client list
+    } {*tot-cmds=* tot-usec=* tot-net-in=* tot-net-out=*}
+
+    test {CLIENT TOP reports the heaviest clients first} {
+        set rd [redis_deferring_client]
+        $rd client setname heavy
+        $rd read
+        for {set j 0} {$j < 100} {incr j} {
+            $rd set foo [string repeat x 1000]
+            $rd read
+        }
+        set top [r client top commands count 1]
+        assert_equal 1 [llength $top]
+        assert_equal heavy [lindex $top 0 2]
+        assert {[lindex $top 0 3] >= 101}
+        assert_equal heavy [lindex [r client top net-in] 0 2]
+        $rd close
+    }
+
+    test {CLIENT TOP refuses bad arguments} {
+        catch {r client top something} e
+        assert_match {*syntax*} $e
+        catch {r client top count 0} e
+        assert_match {*COUNT*} $e
+    }
+
+    test {CLIENT SHM is refused on TCP connections} {
+        assert_error "*only supported on the Unix socket*" {r client shm 65536}
+        assert_error "*not an integer*" {r client shm foo}
+        r ping
+    } {PONG}
+}
+
+start_server {tags {"introspection"} overrides {server-cpulist 0 bio-cpulist 0}} {
+    test {The main thread runs on the CPUs of server-cpulist} {
+        assert_equal 0 [s server_cpulist]
+        assert_equal no [s numa_bind]
+        if {$::tcl_platform(os) eq {Linux}} {
+            assert_equal 0 [s main_thread_cpu]
+        }
+        assert_equal {server-cpulist 0} [r config get server-cpulist]
+    }
 }
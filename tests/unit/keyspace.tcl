@@ -20,6 +20,20 @@ start_server {tags {"keyspace"}} {
         lsort [r keys foo*]
     } {foo_a foo_b foo_c}
 
+    test {KEYS with literal, suffix, contains and glob patterns} {
+        list [r keys foo_a] [lsort [r keys *_a]] [lsort [r keys *o_*]] \
+             [lsort [r keys k?y_\[xy\]]] [lsort [r keys f*_?]] [r keys *z*z*]
+    } {foo_a foo_a {foo_a foo_b foo_c} {key_x key_y} {foo_a foo_b foo_c} {}}
+
+    test {KEYS with a pattern with many stars does not take forever} {
+        r set [string repeat a 64] 1
+        set start [clock milliseconds]
+        set res [r keys [string repeat *a 20]*b]
+        r del [string repeat a 64]
+        assert {[clock milliseconds]-$start < 1000}
+        set res
+    } {}
+
     test {KEYS to get all keys} {
         lsort [r keys *]
     } {foo_a foo_b foo_c key_x key_y key_z}
@@ -266,10 +280,123 @@ start_server {tags {"keyspace"}} {
         r randomkey
     } {}
 
+    test {KEYS of a big database runs as a job} {
+        r flushdb
+        r config set keys-job-threshold 100
+        r debug populate 5000 jobkey
+        set rd [redis_deferring_client]
+        $rd keys jobkey:1*
+        r set other 1
+        set keys [$rd read]
+        $rd close
+        set all [r keys *]
+        r config set keys-job-threshold 100000
+        list [llength $keys] [llength [lsort -unique $keys]] \
+             [llength $all] [llength [lsort -unique $all]]
+    } {1111 1111 5001 5001}
+
+    test {KEYS job is released when its client disconnects} {
+        r flushdb
+        r config set keys-job-threshold 100
+        r debug populate 200000 jobkey
+        set rd [redis_deferring_client]
+        $rd keys *
+        $rd close
+        wait_for_condition 50 100 {
+            [s keys_jobs] == 0
+        } else {
+            fail "KEYS job still running"
+        }
+        r config set keys-job-threshold 100000
+        r ping
+    } {PONG}
+
+    test {KEYS job skips the expired keys} {
+        r flushdb
+        r config set keys-job-threshold 100
+        r debug populate 1000
+        r debug set-active-expire 0
+        r pexpire key:1 1
+        r pexpire key:2 1
+        after 10
+        set keys [r keys key:*]
+        r debug set-active-expire 1
+        r config set keys-job-threshold 100000
+        list [llength $keys] [r exists key:1] [r dbsize]
+    } {998 0 998}
+
     test {KEYS * two times with long key, Github issue #1208} {
         r flushdb
         r set dlskeriewrioeuwqoirueioqwrueoqwrueqw test
         r keys *
         r keys *
     } {dlskeriewrioeuwqoirueioqwrueoqwrueqw}
+
+    test {KEYS and SCAN with a prefix use the ordered index of the keys} {
+        r flushdb
+        r config set keyspace-index yes
+        for {set j 0} {$j < 100} {incr j} {
+            r set tenant:1:$j $j
+            r set tenant:2:$j $j
+        }
+        r sadd tenant:1:set a b c
+        r del tenant:1:99
+        assert_equal 100 [llength [r keys tenant:1:*]]
+        set expected {}
+        for {set j 10} {$j < 20} {incr j} {lappend expected tenant:1:$j}
+        assert_equal $expected [lsort [r keys tenant:1:1?]]
+
+        set cur 0
+        set keys {}
+        set calls 0
+        while 1 {
+            set res [r scan $cur match tenant:2:* count 7]
+            set cur [lindex $res 0]
+            lappend keys {*}[lindex $res 1]
+            incr calls
+            if {$cur == 0} break
+        }
+        assert {$calls > 1}
+        assert_equal 100 [llength [lsort -unique $keys]]
+
+        set res [r scan 0 match tenant:1:* type set count 1000]
+        assert_equal {tenant:1:set} [lindex $res 1]
+        r config set keyspace-index no
+        assert_equal $expected [lsort [r keys tenant:1:1?]]
+    }
+
+    test {KEYSRANGE returns the keys of a range in order} {
+        r flushdb
+        r config set keyspace-index no
+        catch {r keysrange - +} e
+        assert_match {*keyspace-index*} $e
+        r config set keyspace-index yes
+        r mset b 1 a 1 d 1 c 1 e 1
+        assert_equal {a b c d e} [r keysrange - +]
+        assert_equal {b c d} [r keysrange {[b} {[d}]
+        assert_equal {c} [r keysrange {(b} {(d}]
+        assert_equal {a b} [r keysrange - + count 2]
+        r pexpire c 1
+        after 10
+        set res [r keysrange - +]
+        r config set keyspace-index no
+        set _ $res
+    } {a b d e}
+
+    test {The ordered index of the keys follows FLUSHDB and SWAPDB} {
+        r config set keyspace-index yes
+        r flushdb
+        r set x 1
+        r select 10
+        r flushdb
+        r set y 1
+        r swapdb 9 10
+        set res [r keysrange - +]
+        r select 9
+        lappend res {*}[r keysrange - +]
+        r flushdb
+        lappend res [llength [r keysrange - +]]
+        r config set keyspace-index no
+        set _ $res
+    } {x y 0}
 }
@@ -48,12 +48,48 @@ start_server {tags {"latency-monitor"}} {
         assert {[r latency latest] eq {}}
     }
 
+    test {LATENCY HISTOGRAM reports the percentiles of the commands} {
+        r config resetstat
+        for {set j 0} {$j < 100} {incr j} {r set foo bar}
+        r debug sleep 0.1
+        set reply [r latency histogram set debug]
+        assert_equal 4 [llength $reply]
+        set set_hist [dict get $reply set]
+        assert_equal 100 [dict get $set_hist calls]
+        assert {[dict get $set_hist p50] <= [dict get $set_hist p99]}
+        assert {[dict get $set_hist p99] <= [dict get $set_hist p99.9]}
+        # The last bucket counts all the calls.
+        assert_equal 100 [lindex [dict get $set_hist histogram_usec] end]
+        set debug_hist [dict get $reply debug]
+        assert {[dict get $debug_hist p50] >= 100000}
+    }
+
+    test {INFO latencystats reports the commands percentiles} {
+        assert_match {*latency_percentiles_usec_set:p50=*,p99=*,p99.9=*} \
+            [r info latencystats]
+        r config resetstat
+        assert_equal {} [r latency histogram set]
+    }
+
+    test {INFO eventloop profiles the main thread phases} {
+        after 200
+        set info [r info eventloop]
+        foreach phase {process_events before_sleep server_cron clients_cron
+                       databases_cron} {
+            assert {[regexp "el_$phase:calls=(\\d+),usec=(\\d+)" $info - calls usec]}
+            assert {$calls > 0}
+        }
+        r config resetstat
+        regexp {el_server_cron:calls=(\d+)} [r info eventloop] - after_reset
+        assert {$after_reset < $calls}
+    }
+
     test {LATENCY of expire events are correctly collected} {
         r config set latency-monitor-threshold 20
         r eval {
             local i = 0
             while (i < 1000000) do
-                redis.call('sadd','mybigkey',i)
+                redis.call('sadd','mybigkey','member:'..i)
                 i = i+1
              end
         } 0
@@ -3,7 +3,7 @@ start_server {tags {"lazyfree"}} {
         set orig_mem [s used_memory]
         set args {}
         for {set i 0} {$i < 100000} {incr i} {
-            lappend args $i
+            lappend args "member:$i"
         }
         r sadd myset {*}$args
         assert {[r scard myset] == 100000}
@@ -22,7 +22,7 @@ start_server {tags {"lazyfree"}} {
         set orig_mem [s used_memory]
         set args {}
         for {set i 0} {$i < 100000} {incr i} {
-            lappend args $i
+            lappend args "member:$i"
         }
         r sadd myset {*}$args
         assert {[r scard myset] == 100000}
@@ -36,4 +36,104 @@ start_server {tags {"lazyfree"}} {
             fail "Memory is not reclaimed by FLUSHDB ASYNC"
         }
     }
+
+    test "The keyspace table shrinks after most keys are deleted" {
+        r flushdb
+        r debug populate 200000
+        set args {}
+        for {set i 0} {$i < 199990} {incr i} {
+            lappend args key:$i
+        }
+        r unlink {*}$args
+        assert {[r dbsize] == 10}
+        wait_for_condition 50 100 {
+            [regexp {table size: ([0-9]+)} [r debug htstats 9] - size] &&
+            $size < 1024
+        } else {
+            fail "The keyspace table was not shrunk"
+        }
+    }
+}
+
+start_server {tags {"lazyfree"} overrides {lazyfree-threads 4}} {
+    test "FLUSHALL ASYNC of a huge database is freed by the lazyfree pool" {
+        assert_equal 4 [s lazyfree_threads]
+        r debug populate 1000000
+        set freed [s lazyfreed_objects]
+        r flushall async
+        assert_equal 0 [r dbsize]
+        wait_for_condition 100 100 {
+            [s lazyfree_pending_objects] == 0 &&
+            [s lazyfree_pending_jobs] == 0
+        } else {
+            fail "The database was not freed in background"
+        }
+        assert {[s lazyfreed_objects] >= $freed+1000000}
+    }
+
+    test "UNLINK is served while a huge database is being freed" {
+        r debug populate 1000000
+        r flushall async
+        set args {}
+        for {set i 0} {$i < 1000} {incr i} {
+            lappend args $i
+        }
+        r sadd myset {*}$args
+        assert_equal 1 [r unlink myset]
+        wait_for_condition 100 100 {
+            [s lazyfree_pending_objects] == 0
+        } else {
+            fail "The lazyfree jobs were not completed"
+        }
+    }
+}
+
+start_server {tags {"lazyfree"}} {
+    proc create_big_set {key} {
+        set args {}
+        for {set i 0} {$i < 1000} {incr i} {
+            lappend args "member:$i"
+        }
+        r sadd $key {*}$args
+    }
+
+    test "DEL of a value above lazyfree-auto-threshold is freed lazily" {
+        r config set lazyfree-auto-threshold 100
+        create_big_set myset
+        set freed [s lazyfreed_objects]
+        assert_equal 1 [r del myset]
+        assert_equal 0 [r exists myset]
+        wait_for_condition 50 100 {
+            [s lazyfreed_objects] == $freed+1
+        } else {
+            fail "The value was not freed lazily"
+        }
+    }
+
+    test "Overwriting and expiring big values frees them lazily" {
+        create_big_set myset
+        set freed [s lazyfreed_objects]
+        r set myset foo
+        assert_equal foo [r get myset]
+        create_big_set other
+        r rename other myset
+        assert_equal 1000 [r scard myset]
+        r pexpire myset 1
+        wait_for_condition 50 100 {
+            [s lazyfreed_objects] == $freed+2
+        } else {
+            fail "The values were not freed lazily"
+        }
+        assert_equal 0 [r exists myset]
+    }
+
+    test "lazyfree-auto-threshold 0 frees synchronously" {
+        r config set lazyfree-auto-threshold 0
+        create_big_set myset
+        set freed [s lazyfreed_objects]
+        assert_equal 1 [r del myset]
+        after 100
+        assert_equal $freed [s lazyfreed_objects]
+        r config set lazyfree-auto-threshold 8192
+    }
 }
@@ -25,6 +25,7 @@ start_server {tags {"maxmemory"}} {
 
     foreach policy {
         allkeys-random allkeys-lru allkeys-lfu volatile-lru volatile-lfu volatile-random volatile-ttl
+        allkeys-gdsf volatile-gdsf
     } {
         test "maxmemory - is the memory limit honoured? (policy $policy)" {
             # make sure to start with a blank instance
@@ -98,7 +99,7 @@ start_server {tags {"maxmemory"}} {
     }
 
     foreach policy {
-        volatile-lru volatile-lfu volatile-random volatile-ttl
+        volatile-lru volatile-lfu volatile-random volatile-ttl volatile-gdsf
     } {
         test "maxmemory - policy $policy should only remove volatile keys." {
             # make sure to start with a blank instance
@@ -141,4 +142,100 @@ start_server {tags {"maxmemory"}} {
             }
         }
     }
+
+    test "maxmemory - keys are evicted ahead of time to keep the headroom" {
+        r flushall
+        r config set maxmemory 0
+        r config set maxmemory-policy allkeys-lru
+        set used [s used_memory]
+        for {set j 0} {$j < 2000} {incr j} {
+            r set key:$j [string repeat x 100]
+        }
+        set full [s used_memory]
+        # The keys fit maxmemory, but not its 20% headroom.
+        set limit [expr {$used+int(($full-$used)*1.1)}]
+        r config set maxmemory $limit
+        r config set maxmemory-headroom 20
+        wait_for_condition 50 100 {
+            [s evicted_keys_ahead] > 0 &&
+            [s used_memory] < $limit-$limit/100*20+4096
+        } else {
+            fail "Keys were not evicted ahead of time"
+        }
+        r config set maxmemory-headroom 0
+        r config set maxmemory 0
+    }
+
+    test "maxmemory - tiering moves the values to a file keeping the keys" {
+        r flushall
+        r config set maxmemory 0
+        r config set maxmemory-policy allkeys-lru
+        set used [s used_memory]
+        for {set j 0} {$j < 1000} {incr j} {
+            r set key:$j [string repeat $j 100]
+        }
+        set full [s used_memory]
+        r config set tiering yes
+        r config set maxmemory [expr {$used+($full-$used)/2}]
+        r set trigger x
+        r config set maxmemory 0
+        assert {[s tiering_values] > 0}
+        assert_equal 1001 [r dbsize]
+        for {set j 0} {$j < 1000} {incr j} {
+            assert_equal [string repeat $j 100] [r get key:$j]
+        }
+        assert {[s tiering_async_loads] > 0}
+        set digest [r debug digest]
+        r debug reload
+        assert_equal $digest [r debug digest]
+        r config set tiering no
+    }
+
+    test "maxmemory - allkeys-gdsf evicts a big value before many small ones" {
+        r flushall
+        r config set maxmemory 0
+        r config set tiering no
+        r config set maxmemory-policy allkeys-gdsf
+        r set big [string repeat x 200000]
+        for {set j 0} {$j < 100} {incr j} {r set small:$j x}
+        set used [s used_memory]
+        r config set maxmemory [expr {$used+10*1024}]
+        for {set j 0} {$j < 200} {incr j} {r set new:$j [string repeat y 100]}
+        assert_equal 0 [r exists big]
+        assert {[llength [r keys small:*]] > 90}
+        r config set maxmemory 0
+    }
+
+    test "redis-sim-evict replays the sampled commands with every policy" {
+        r flushall
+        r config set trace-max-len 100000
+        r config set trace-sample-rate 1
+        r trace reset
+        # A few hot keys read over and over among many cold ones.
+        for {set j 0} {$j < 2000} {incr j} {
+            r set cold:$j [string repeat x 100]
+            r get hot:[expr {$j % 10}]
+            r set hot:[expr {$j % 10}] [string repeat y 100]
+        }
+        lassign [r trace fetch count 100000] next lost blob
+        r config set trace-sample-rate 0
+        set trace [tmpfile keys.trace]
+        set fd [open $trace w]
+        fconfigure $fd -translation binary
+        puts -nonewline $fd $blob
+        close $fd
+
+        set out [exec src/redis-sim-evict --maxmemory 50kb \
+                 --policies allkeys-lru,allkeys-lfu,volatile-lru \
+                 --samples 5,10 $trace 2>@1]
+        assert_match {*6000 accesses (2000 reads)*} $out
+        assert_match {*volatile-lru skipped*} $out
+        foreach policy {allkeys-lru allkeys-lfu} {
+            foreach samples {5 10} {
+                assert {[regexp "$policy +$samples +(\[0-9.\]+)% +(\\d+)" \
+                         $out -> hits evicted]}
+                assert {$hits > 90 && $evicted > 1000}
+            }
+        }
+    }
 }
@@ -34,6 +34,127 @@ start_server {tags {"memefficiency"}} {
             assert {$efficiency >= $expected_min_efficiency}
         }
     }
+
+    test "MEMORY KEYSPACE reports the same totals with any number of threads" {
+        r flushall
+        r debug populate 20000
+        for {set j 0} {$j < 50} {incr j} {
+            r rpush mylist:$j {*}[lrepeat [expr {$j+1}] x]
+        }
+        set results {}
+        foreach threads {1 4 16} {
+            set reply [r memory keyspace threads $threads]
+            set string [dict get $reply string]
+            set list [dict get $reply list]
+            assert_equal 20000 [dict get $string keys]
+            assert_equal 50 [dict get $list keys]
+            assert_equal 1275 [dict get $list elements]
+            assert_equal mylist:49 [dict get $list biggest.key]
+            set hkeys 0
+            foreach {bytes count} [dict get $reply histogram.bytes] {
+                incr hkeys $count
+            }
+            assert_equal 20050 $hkeys
+            lappend results [dict get $string bytes] [dict get $list bytes]
+        }
+        assert_equal [lrange $results 0 1] [lrange $results 2 3]
+        assert_equal [lrange $results 0 1] [lrange $results 4 5]
+    }
+
+    test {MEMORY PREFIXES accounts the keys to their prefix} {
+        r flushall
+        catch {r memory prefixes} e
+        assert_match {*disabled*} $e
+        for {set j 0} {$j < 1000} {incr j} {
+            r set big:$j [string repeat x 100]
+        }
+        for {set j 0} {$j < 100} {incr j} {
+            r setex small:$j 600 x
+        }
+        r set noprefix x
+        r config set memory-prefixes-scan-keys 500
+        wait_for_condition 50 100 {
+            [dict get [r memory prefixes] complete] == 1
+        } else {
+            fail "The keyspace walk did not complete"
+        }
+        set reply [r memory prefixes count 1]
+        assert_equal 1101 [dict get $reply keys]
+        set prefixes [dict get $reply prefixes]
+        assert_equal 2 [llength $prefixes]
+        set big [dict get $prefixes big]
+        assert_equal 1000 [dict get $big keys]
+        assert_equal 1000 [dict get $big ttl.none]
+        assert {[dict get $big bytes] > 100000}
+        set small [dict get [dict get [r memory prefixes] prefixes] small]
+        assert_equal 100 [dict get $small ttl.1h]
+        assert_equal 1 [dict get [dict get $reply no.prefix] keys]
+        r config set memory-prefixes-delimiter -
+        assert_equal {} [dict get [r memory prefixes] prefixes]
+        r config set memory-prefixes-scan-keys 0
+    }
+
+    test {MEMORY ALLOCSTATS accounts the allocations to the commands} {
+        catch {r memory allocstats} e
+        assert_match {*disabled*} $e
+        r config set alloc-profiler yes
+        r memory allocstats reset
+        for {set j 0} {$j < 100} {incr j} {
+            r set key:$j [string repeat x 100]
+        }
+        set reply [r memory allocstats]
+        set set [dict get [dict get $reply commands] set]
+        assert_equal 100 [dict get $set calls]
+        assert {[dict get $set allocs] >= 100}
+        assert {[llength [dict get $reply sites]] > 0}
+        # The size classes depend on the allocator: only check that ten
+        # times bigger values account for more bytes than the first ones.
+        set bytes [dict get $set bytes]
+        for {set j 100} {$j < 200} {incr j} {
+            r set key:$j [string repeat x 1000]
+        }
+        set set [dict get [dict get [r memory allocstats] commands] set]
+        assert_equal 200 [dict get $set calls]
+        assert {[dict get $set bytes]-$bytes > $bytes}
+        r config set alloc-profiler no
+        r set foo bar
+        set set [dict get [dict get [r memory allocstats] commands] set]
+        assert_equal 200 [dict get $set calls]
+    }
+}
+
+start_server {tags {"memefficiency"} overrides {huge-pages yes}} {
+    test {huge-pages is reported by INFO memory} {
+        # Without jemalloc or THP in the kernel the option is ignored.
+        set active [s huge_pages]
+        r debug populate 100000 key 100
+        if {$active} {
+            assert {[s huge_pages_chunks] > 0}
+        } else {
+            assert_equal 0 [s huge_pages_chunks]
+        }
+        assert_equal yes [lindex [r config get huge-pages] 1]
+    }
+}
+
+start_server {tags {"memefficiency"}} {
+    test {Client buffers are allocated from the transient arena} {
+        # Without jemalloc there is no transient arena.
+        set jemalloc [string match {*jemalloc*} [s mem_allocator]]
+        set rd [redis_deferring_client]
+        $rd set foo [string repeat x 100000]
+        $rd read
+        for {set j 0} {$j < 100} {incr j} {$rd get foo}
+        if {$jemalloc} {
+            assert {[s transient_allocated] > 0}
+            assert {[s transient_active] >= [s transient_allocated]}
+        } else {
+            assert_equal 0 [s transient_allocated]
+        }
+        for {set j 0} {$j < 100} {incr j} {$rd read}
+        $rd close
+        assert_equal yes [lindex [r config get transient-arena] 1]
+    }
 }
 
 if 0 {
@@ -66,6 +187,9 @@ if 0 {
                     assert {$tries < 100}
                 }
 
+                # The populated keys are all strings.
+                assert_match {string=[1-9]*} [s active_defrag_type_hits]
+
                 # TODO: we need to expose more accurate fragmentation info
                 # i.e. the allocator used and active pages
                 # instead we currently look at RSS so we need to ask for purge
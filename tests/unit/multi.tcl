@@ -121,6 +121,31 @@ start_server {tags {"multi"}} {
         r exec
     } {}
 
+    test {EXEC fail on WATCHed key modified (1 key of many watched)} {
+        r flushdb
+        set keys {}
+        for {set j 0} {$j < 2000} {incr j} {lappend keys key:$j}
+        r watch {*}$keys
+        for {set j 2000} {$j < 4000} {incr j} {r set key:$j foo}
+        r set key:1500 foo
+        r multi
+        r ping
+        r exec
+    } {}
+
+    test {EXEC works when only unwatched keys are modified} {
+        set keys {}
+        for {set j 0} {$j < 2000} {incr j} {lappend keys key:$j}
+        r watch {*}$keys
+        for {set j 2000} {$j < 4000} {incr j} {r set key:$j foo}
+        r unwatch
+        r watch key:1500
+        r set key:2500 bar
+        r multi
+        r ping
+        r exec
+    } {PONG}
+
     test {After successful EXEC key is no longer watched} {
         r set x 30
         r watch x
@@ -293,6 +318,30 @@ start_server {tags {"multi"}} {
         close_replication_stream $repl
     }
 
+    test {MULTI / EXEC propagates adjacent writes to the same key merged} {
+        r del h s
+        set repl [attach_to_replication_stream]
+        r multi
+        r hset h a 1
+        r hset h b 2 c 3
+        r sadd s x
+        r hset h d 4
+        r sadd s y
+        r sadd s z
+        r exec
+        assert_replication_stream $repl {
+            {select *}
+            {multi}
+            {hset h a 1 b 2 c 3}
+            {sadd s x}
+            {hset h d 4}
+            {sadd s y z}
+            {exec}
+        }
+        close_replication_stream $repl
+        list [r hgetall h] [lsort [r smembers s]]
+    } {{a 1 b 2 c 3 d 4} {x y z}}
+
     test {MULTI / EXEC is propagated correctly (write command, no effect)} {
         r del bar foo bar
         set repl [attach_to_replication_stream]
@@ -49,6 +49,22 @@ start_server {tags {"other"}} {
         r get x
     } {10}
 
+    test {BGSAVE counts the writes by type while the child runs} {
+        r flushdb
+        r debug populate 200000
+        r bgsave
+        r set x 10
+        r lpush mylist a
+        set during [status r rdb_bgsave_in_progress]
+        waitForBgsave r
+        set info [r info persistence]
+        assert_match {*current_cow_size:0*} $info
+        if {$during} {
+            assert_match {*cow_writes:string=1,list=1,*} $info
+        }
+        r flushdb
+    } {OK}
+
     test {SELECT an out of range DB} {
         catch {r select 1000000} err
         set _ $err
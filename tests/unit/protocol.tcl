@@ -115,3 +115,117 @@ start_server {tags {"regression"}} {
         $rd read
     }
 }
+
+start_server {tags {"protocol"}} {
+    test "Large replies spanning many reply list nodes are delivered intact" {
+        r del biglist
+        for {set j 0} {$j < 1000} {incr j} {
+            r rpush biglist [string repeat x 100]$j
+        }
+        set rd [redis_deferring_client]
+        for {set j 0} {$j < 10} {incr j} {
+            $rd lrange biglist 0 -1
+        }
+        for {set j 0} {$j < 10} {incr j} {
+            set res [$rd read]
+            assert_equal 1000 [llength $res]
+            assert_equal [string repeat x 100]999 [lindex $res end]
+        }
+        $rd close
+        assert {[s total_writev_calls] > 0}
+        assert {[s writev_avg_iovecs_per_call] >= 1}
+    }
+
+    test "Commands split across reads are reassembled" {
+        reconnect
+        r write "*3\r\n\$3\r\nSET\r\n\$3\r\nfo"
+        r flush
+        after 100
+        r write "o\r\n\$3\r\nbar\r\n*2\r\n\$3\r\nGET\r\n"
+        r flush
+        after 100
+        r write "\$3\r\nfoo\r\n"
+        r flush
+        assert_equal OK [r read]
+        assert_equal bar [r read]
+        assert {[s qbuf_pool_hits] + [s qbuf_pool_misses] > 0}
+    }
+
+    test "Pipelined commands with and without keys are executed in order" {
+        reconnect
+        r select 10
+        r del pkey:1
+        r select 9
+        r del pkey:0
+        set proto {}
+        for {set j 0} {$j < 40} {incr j} {
+            append proto [formatCommand incr pkey:[expr {$j%2}]]
+            append proto [formatCommand ping]
+            append proto [formatCommand select [expr {$j%2 ? 9 : 10}]]
+        }
+        append proto [formatCommand get pkey:0]
+        # The last command is incomplete until the second write.
+        set cut [expr {[string length $proto]-3}]
+        r write [string range $proto 0 [expr {$cut-1}]]
+        r flush
+        after 100
+        r write [string range $proto $cut end]
+        r flush
+        for {set j 0} {$j < 40} {incr j} {
+            assert_equal [expr {$j/2+1}] [r read]
+            assert_equal PONG [r read]
+            assert_equal OK [r read]
+        }
+        assert_equal 20 [r read]
+        assert_equal {} [r get pkey:1]
+        r select 10
+        assert_equal 20 [r get pkey:1]
+        r select 9
+    }
+
+    test "Large values referenced by pending replies are not affected by writes" {
+        set big [string repeat abcd 50000]
+        r set bigval $big
+        set rd [redis_deferring_client]
+        for {set j 0} {$j < 5} {incr j} {
+            $rd get bigval
+        }
+        $rd append bigval tail
+        $rd setrange bigval 0 XXXX
+        for {set j 0} {$j < 5} {incr j} {
+            assert_equal $big [$rd read]
+        }
+        assert_equal [expr {200000+4}] [$rd read]
+        $rd read
+        $rd close
+        assert_equal XXXXabcd [r getrange bigval 0 7]
+    }
+
+    test "Large GETRANGE replies are not affected by later writes" {
+        r set bigval [string repeat abcd 50000]
+        set rd [redis_deferring_client]
+        $rd getrange bigval 4 100003
+        $rd setrange bigval 4 XXXX
+        $rd getrange bigval 0 7
+        assert_equal [string repeat abcd 25000] [$rd read]
+        assert_equal 200000 [$rd read]
+        assert_equal abcdXXXX [$rd read]
+        $rd close
+    }
+
+    test "Arguments reused by the next commands don't alter stored values" {
+        r del mylist
+        for {set j 0} {$j < 100} {incr j} {
+            set val [string repeat [expr {$j%10}] [expr {($j*7)%60}]]
+            r set key:$j $val
+            r rpush mylist $val
+            r hset myhash field:$j $val
+        }
+        for {set j 0} {$j < 100} {incr j} {
+            set val [string repeat [expr {$j%10}] [expr {($j*7)%60}]]
+            assert_equal $val [r get key:$j]
+            assert_equal $val [r lindex mylist $j]
+            assert_equal $val [r hget myhash field:$j]
+        }
+    }
+}
@@ -37,6 +37,16 @@ start_server {tags {"pubsub"}} {
         __consume_subscribe_messages $client unsubscribe $channels
     }
 
+    proc ssubscribe {client channels} {
+        $client ssubscribe {*}$channels
+        __consume_subscribe_messages $client ssubscribe $channels
+    }
+
+    proc sunsubscribe {client {channels {}}} {
+        $client sunsubscribe {*}$channels
+        __consume_subscribe_messages $client sunsubscribe $channels
+    }
+
     proc psubscribe {client channels} {
         $client psubscribe {*}$channels
         __consume_subscribe_messages $client psubscribe $channels
@@ -213,6 +223,111 @@ start_server {tags {"pubsub"}} {
         $rd1 close
     }
 
+    test "PUBLISH/PSUBSCRIBE with patterns sharing literal prefixes" {
+        set rd1 [redis_deferring_client]
+        set rd2 [redis_deferring_client]
+        assert_equal {1 2 3 4 5} [psubscribe $rd1 {* f* foo.* foo.b?r foo.bar}]
+        assert_equal {1 2} [psubscribe $rd2 {foo.* [fb]oo.bar}]
+
+        assert_equal 7 [r publish foo.bar hello]
+        set msgs {}
+        for {set j 0} {$j < 5} {incr j} {lappend msgs [lindex [$rd1 read] 1]}
+        assert_equal {* f* foo.* foo.b?r foo.bar} [lsort $msgs]
+        set msgs {}
+        for {set j 0} {$j < 2} {incr j} {lappend msgs [lindex [$rd2 read] 1]}
+        assert_equal [list {[fb]oo.bar} foo.*] [lsort $msgs]
+
+        assert_equal 2 [r publish boo.bar hello]
+        assert_equal 2 [r publish foo hello]
+        assert_equal 1 [r publish bar hello]
+        for {set j 0} {$j < 4} {incr j} {$rd1 read}
+        $rd2 read
+
+        # Patterns removed from the index are no longer matched.
+        assert_equal {4 3} [punsubscribe $rd1 {foo.* foo.bar}]
+        assert_equal 1 [punsubscribe $rd2 {foo.*}]
+        assert_equal 4 [r pubsub numpat]
+        assert_equal 4 [r publish foo.bar hello]
+        assert_equal 1 [r publish x hello]
+
+        # clean up clients
+        $rd1 close
+        $rd2 close
+    }
+
+    test "PUBLISH of large messages to many subscribers" {
+        set clients {}
+        for {set j 0} {$j < 10} {incr j} {
+            set rd [redis_deferring_client]
+            if {$j % 2} {
+                psubscribe $rd {big.*}
+            } else {
+                subscribe $rd {big.chan}
+            }
+            lappend clients $rd
+        }
+        set payload [string repeat "abcdefghij" 2000]
+        assert_equal 10 [r publish big.chan $payload]
+        assert_equal 10 [r publish big.chan small]
+        assert_equal 10 [r publish big.chan 12345]
+        set j 0
+        foreach rd $clients {
+            if {$j % 2} {
+                assert_equal [list pmessage big.* big.chan $payload] [$rd read]
+                assert_equal {pmessage big.* big.chan small} [$rd read]
+                assert_equal {pmessage big.* big.chan 12345} [$rd read]
+            } else {
+                assert_equal [list message big.chan $payload] [$rd read]
+                assert_equal {message big.chan small} [$rd read]
+                assert_equal {message big.chan 12345} [$rd read]
+            }
+            $rd close
+            incr j
+        }
+    }
+
+    test "SPUBLISH/SSUBSCRIBE basics" {
+        set rd1 [redis_deferring_client]
+        assert_equal {1 2} [ssubscribe $rd1 {chan1 chan2}]
+        assert_equal 1 [r spublish chan1 hello]
+        assert_equal 1 [r spublish chan2 world]
+        assert_equal {smessage chan1 hello} [$rd1 read]
+        assert_equal {smessage chan2 world} [$rd1 read]
+
+        # Shard channels and channels are separate namespaces.
+        assert_equal 0 [r publish chan1 hello]
+        assert_equal {chan1 1 chan2 1} [r pubsub shardnumsub chan1 chan2]
+        assert_equal {chan1 0} [r pubsub numsub chan1]
+        assert_equal {chan1 chan2} [lsort [r pubsub shardchannels]]
+        assert_equal {chan1} [r pubsub shardchannels *1]
+
+        assert_equal {1} [sunsubscribe $rd1 {chan1}]
+        assert_equal 0 [r spublish chan1 hello]
+        assert_equal {0} [sunsubscribe $rd1 {chan2}]
+        assert_equal 0 [r spublish chan2 hello]
+        $rd1 close
+    }
+
+    test "SSUBSCRIBE and SUBSCRIBE subscriptions are counted apart" {
+        set rd1 [redis_deferring_client]
+        assert_equal {1} [subscribe $rd1 {foo}]
+        assert_equal {1} [ssubscribe $rd1 {foo}]
+        assert_equal {2} [psubscribe $rd1 {f*}]
+        assert_equal 2 [r publish foo hello]
+        assert_equal 1 [r spublish foo world]
+        assert_equal {message foo hello} [$rd1 read]
+        assert_equal {pmessage f* foo hello} [$rd1 read]
+        assert_equal {smessage foo world} [$rd1 read]
+
+        # The client stays in Pub/Sub mode until all the kinds are gone.
+        assert_equal {0} [sunsubscribe $rd1 {foo}]
+        assert_equal {1} [unsubscribe $rd1 {foo}]
+        assert_equal {0} [punsubscribe $rd1 {f*}]
+        $rd1 ping
+        assert_equal {PONG} [$rd1 read]
+        $rd1 close
+    }
+
     test "PUNSUBSCRIBE and UNSUBSCRIBE should always reply" {
         # Make sure we are not subscribed to any channel at all.
         r punsubscribe
@@ -234,6 +349,25 @@ start_server {tags {"pubsub"}} {
         $rd1 close
     }
 
+    test "Keyspace notifications: only channels and patterns that can match get them" {
+        r config set notify-keyspace-events KEA
+        set rd1 [redis_deferring_client]
+        assert_equal {1} [psubscribe $rd1 news.*]
+        assert_equal {2} [subscribe $rd1 __keyevent@9__:set]
+        assert_equal {3} [psubscribe $rd1 __key*@9__:bar]
+        r set foo bar
+        r set bar foo
+        assert_equal {message __keyevent@9__:set foo} [$rd1 read]
+        assert_equal {pmessage __key*@9__:bar __keyspace@9__:bar set} [$rd1 read]
+        assert_equal {message __keyevent@9__:set bar} [$rd1 read]
+        unsubscribe $rd1 __keyevent@9__:set
+        punsubscribe $rd1 __key*@9__:bar
+        assert_equal {2} [subscribe $rd1 __keyspace@9__:foo]
+        r set foo bar
+        assert_equal {message __keyspace@9__:foo set} [$rd1 read]
+        $rd1 close
+    }
+
     test "Keyspace notifications: we receive keyevent notifications" {
         r config set notify-keyspace-events EA
         set rd1 [redis_deferring_client]
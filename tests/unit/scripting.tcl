@@ -111,6 +111,18 @@ start_server {tags {"scripting"}} {
         } 1 mykey
     } {boolean 1}
 
+    test {EVAL - Redis nested and deferred multi bulk -> Lua type conversion} {
+        r del myzset myhash
+        r zadd myzset 1 a 2 b
+        r hset myhash f v
+        r eval {
+            local z = redis.call('zrange',KEYS[1],0,-1,'withscores')
+            local s = redis.call('hscan',KEYS[2],0)
+            local d = redis.call('zscore',KEYS[1],'b')
+            return {z[1],z[2],z[4],s[1],s[2][1],s[2][2],type(d),d}
+        } 2 myzset myhash
+    } {a 1 2 0 f v string 2}
+
     test {EVAL - Is the Lua client using the currently selected DB?} {
         r set mykey "this is DB 9"
         r select 10
@@ -477,6 +489,136 @@ start_server {tags {"scripting"}} {
         } e
         set e
     } {*wrong number*}
+
+    test {FUNCTION LOAD and FCALL} {
+        r function flush
+        r function load incrby2 {return redis.call('incrby',KEYS[1],ARGV[1]*2)}
+        r del mykey
+        list [r fcall incrby2 1 mykey 5] [r fcall INCRBY2 1 mykey 1]
+    } {10 12}
+
+    test {FUNCTION LOAD refuses existing names without REPLACE} {
+        catch {r function load incrby2 {return 1}} e
+        assert_match {*already exists*} $e
+        r function load replace incrby2 {return 'replaced'}
+        r fcall incrby2 0
+    } {replaced}
+
+    test {FUNCTION LOAD reports compile errors and invalid names} {
+        catch {r function load broken {return (}} e
+        assert_match {*Error compiling function*} $e
+        catch {r function load {bad name} {return 1}} e
+        assert_match {*letters, digits*} $e
+        r function list
+    } {{incrby2 {return 'replaced'}}}
+
+    test {FCALL of a missing function} {
+        catch {r fcall nosuchfunction 0} e
+        set e
+    } {NOSCRIPT*}
+
+    test {Functions survive SCRIPT FLUSH and DEBUG RELOAD} {
+        r function load fget {return redis.call('get',KEYS[1])}
+        r set mykey foo
+        r script flush
+        assert_equal foo [r fcall fget 1 mykey]
+        r debug reload
+        r fcall fget 1 mykey
+    } {foo}
+
+    test {SCRIPT STATS reports the calls and the commands of the scripts} {
+        r script stats reset
+        set sha [r script load {redis.call('set',KEYS[1],'x'); return redis.call('get',KEYS[1])}]
+        r evalsha $sha 1 statkey
+        r evalsha $sha 1 statkey
+        r fcall incrby2 1 statcounter 1
+        set stats [r script stats]
+        assert_equal 2 [llength $stats]
+        foreach entry $stats {
+            array set s $entry
+            if {[info exists s(sha)]} {
+                assert_equal $sha $s(sha)
+                assert_equal 2 $s(calls)
+                assert {$s(p99_usec) <= $s(max_usec)}
+                set cmds {}
+                foreach cmd $s(commands) {
+                    lappend cmds [lindex $cmd 0] [lindex $cmd 2]
+                }
+                assert_equal {set 2 get 2} $cmds
+            } else {
+                assert_equal incrby2 $s(function)
+                assert_equal 1 $s(calls)
+            }
+            array unset s
+        }
+        r script stats reset
+        r script stats
+    } {}
+
+    test {FUNCTION DELETE and FUNCTION FLUSH} {
+        r function delete fget
+        catch {r fcall fget 1 mykey} e
+        assert_match {NOSCRIPT*} $e
+        catch {r function delete fget} e
+        assert_match {*No such function*} $e
+        r function flush
+        r function list
+    } {}
+
+    test {EVAL_RO and EVALSHA_RO read the declared keys} {
+        r del rokey
+        r rpush rokey a b c
+        set sha [r script load {return redis.call('lrange',KEYS[1],0,-1)}]
+        list [r eval_ro {return redis.call('llen',KEYS[1])} 1 rokey] \
+             [r evalsha_ro $sha 1 rokey]
+    } {3 {a b c}}
+
+    test {EVAL_RO refuses write commands and undeclared keys} {
+        catch {r eval_ro {return redis.call('del',KEYS[1])} 1 rokey} e
+        assert_match {*Only read only commands*} $e
+        catch {r eval_ro {return redis.call('llen','otherkey')} 1 rokey} e
+        assert_match {*not declared in KEYS*} $e
+        catch {r eval_ro {return redis.call('dbsize')} 0} e
+        assert_match {*Only read only commands*} $e
+        r eval_ro {return redis.pcall('llen','otherkey')['err'] ~= nil} 1 rokey
+    } {1}
+}
+
+start_server {tags {"scripting"}
+              overrides {io-threads 4 io-threads-do-reads yes
+                         lua-parallel-scripts yes}} {
+    test {Read only scripts are executed by the I/O threads} {
+        for {set j 0} {$j < 10} {incr j} {r set "key:$j" "val:$j"}
+        set sha [r script load {return redis.call('get',KEYS[1]) .. ARGV[1]}]
+        set clients {}
+        for {set c 0} {$c < 20} {incr c} {
+            lappend clients [redis_deferring_client]
+        }
+        for {set round 0} {$round < 50} {incr round} {
+            foreach rd $clients {
+                for {set j 0} {$j < 10} {incr j} {
+                    $rd evalsha_ro $sha 1 "key:$j" "-$round"
+                }
+            }
+            foreach rd $clients {
+                for {set j 0} {$j < 10} {incr j} {
+                    assert_equal "val:$j-$round" [$rd read]
+                }
+            }
+            if {[s io_threaded_commands_processed] > 0} break
+        }
+        foreach rd $clients {$rd close}
+        assert {[s io_threaded_commands_processed] > 0}
+    }
+
+    test {Scripts sent by EVAL_RO are added to the script cache} {
+        set rd [redis_deferring_client]
+        $rd eval_ro {return redis.call('get',KEYS[1])} 1 key:1
+        assert_equal val:1 [$rd read]
+        $rd close
+        set body {return redis.call('get',KEYS[1])}
+        r script exists [r eval {return redis.sha1hex(ARGV[1])} 0 $body]
+    } {1}
 }
 
 # Start a new server since the last test in this stanza will kill the
@@ -730,6 +872,17 @@ start_server {tags {"scripting repl"}} {
                 fail "Time key does not match between master and slave"
             }
         }
+
+        test "Functions are replicated to the slave" {
+            r function load setfn {return redis.call('set',KEYS[1],ARGV[1])}
+            r fcall setfn 1 fkey fval
+            wait_for_condition 50 100 {
+                [r -1 get fkey] eq {fval}
+            } else {
+                fail "FCALL was not replicated"
+            }
+            r -1 function list
+        } {{setfn {return redis.call('set',KEYS[1],ARGV[1])}}}
     }
 }
 
@@ -39,8 +39,8 @@ start_server {
         1000 lpush quicklist "Old Linked list"
         10000 lpush quicklist "Old Big Linked list"
         16 sadd intset "Intset"
-        1000 sadd hashtable "Hash table"
-        10000 sadd hashtable "Big Hash table"
+        1000 sadd roaring "Roaring bitmap"
+        10000 sadd roaring "Big Roaring bitmap"
     } {
         set result [create_random_dataset $num $cmd]
         assert_encoding $enc tosort
@@ -59,6 +59,28 @@ start_server {
     }
 
     set result [create_random_dataset 16 lpush]
+    test "SORT BY and GET resolved by threads" {
+        set result [create_random_dataset 1000 lpush]
+        r config set set-algebra-parallel-threshold 100
+        assert_equal $result [r sort tosort BY weight_*]
+        assert_equal [lrange $result 0 9] [r sort tosort BY weight_* LIMIT 0 10]
+        set weights {}
+        foreach i $result {lappend weights [r get weight_$i]}
+        assert_equal $weights [r sort tosort BY weight_* GET weight_*]
+        r sort tosort BY weight_* GET # GET weight_* STORE sorted
+        assert_equal [r sort tosort BY weight_* GET # GET weight_*] \
+            [r lrange sorted 0 -1]
+
+        # Keys that expired are resolved as usual, and deleted.
+        set first [lindex $result 0]
+        r pexpire weight_$first 1
+        after 10
+        assert_equal [lrange $result 1 end] \
+            [lrange [r sort tosort BY weight_*] 1 end]
+        assert_equal 0 [r exists weight_$first]
+        r config set set-algebra-parallel-threshold 100000
+    }
+
     test "SORT GET #" {
         assert_equal [lsort -integer $result] [r sort tosort GET #]
     }
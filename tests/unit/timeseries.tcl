@@ -0,0 +1,101 @@
+start_server {tags {"timeseries"}} {
+    test {TS.ADD creates a time series} {
+        r del ts
+        list [r ts.add ts 1000 1.5] [r ts.add ts 2000 2] [r type ts] \
+             [r ts.get ts]
+    } {1000 2000 string {2000 2}}
+
+    test {TS.ADD with a timestamp not greater than the last one} {
+        r del ts
+        r ts.add ts 1000 1
+        assert_error "*greater than the last*" {r ts.add ts 1000 2}
+        assert_error "*greater than the last*" {r ts.add ts 999 2}
+        assert_error "*not an integer*" {r ts.add ts foo 2}
+        assert_error "*not a valid float*" {r ts.add ts 2000 foo}
+        r ts.range ts - +
+    } {{1000 1}}
+
+    test {TS.ADD with * uses the current time} {
+        r del ts
+        set before [clock milliseconds]
+        set ts [r ts.add ts * 3]
+        assert {$ts >= $before && $ts <= [clock milliseconds]}
+        assert_equal [list $ts 3] [r ts.get ts]
+    }
+
+    test {TS.GET and TS.RANGE of a missing key} {
+        r del ts
+        list [r ts.get ts] [r ts.range ts - +]
+    } {{} {}}
+
+    test {TS.RANGE of samples spanning many chunks} {
+        r del ts
+        set samples {}
+        set t 1000000
+        for {set j 0} {$j < 5000} {incr j} {
+            # Irregular intervals and values to exercise every encoding.
+            incr t [expr {$j % 7 ? 1000 : 1000 + $j * 37}]
+            set v [expr {$j % 3 ? $j % 10 : $j * 1.25}]
+            r ts.add ts $t $v
+            lappend samples [list $t [expr {$v == int($v) ? int($v) : $v}]]
+        }
+        assert_equal $samples [r ts.range ts - +]
+        set from [lindex $samples 1234 0]
+        set to [lindex $samples 3210 0]
+        assert_equal [lrange $samples 1234 3210] [r ts.range ts $from $to]
+        assert_equal [lrange $samples 1234 3210] \
+            [r ts.range ts [expr {$from - 1}] [expr {$to + 1}]]
+        assert_equal {} [r ts.range ts 0 999999]
+        assert {[r strlen ts] < 5000*8}
+    }
+
+    test {TS.RANGE with AGGREGATION} {
+        r del ts
+        for {set t 0} {$t < 10000} {incr t 10} {
+            r ts.add ts $t [expr {$t / 10 % 100}]
+        }
+        assert_equal {{0 4950} {1000 4950}} \
+            [lrange [r ts.range ts - + aggregation sum 1000] 0 1]
+        assert_equal {{0 100} {1000 100}} \
+            [lrange [r ts.range ts - + aggregation count 1000] 0 1]
+        assert_equal {{0 0} {5000 0}} \
+            [r ts.range ts - + aggregation min 5000]
+        assert_equal {{0 99} {5000 99}} \
+            [r ts.range ts - + aggregation max 5000]
+        assert_equal {{0 49.5}} [r ts.range ts - + aggregation avg 10000]
+        assert_equal {{0 50} {1000 0}} \
+            [r ts.range ts 500 1000 aggregation first 1000]
+        assert_equal {{0 99} {1000 0}} \
+            [r ts.range ts 500 1000 aggregation last 1000]
+        assert_error "*unknown aggregation*" \
+            {r ts.range ts - + aggregation foo 10}
+        assert_error "*must be positive*" {r ts.range ts - + aggregation avg 0}
+        assert_error "*syntax*" {r ts.range ts - + foo}
+    }
+
+    test {Time series survives DEBUG RELOAD} {
+        r del ts
+        for {set t 1} {$t <= 3000} {incr t} {
+            r ts.add ts $t [expr {$t * 0.5}]
+        }
+        set range [r ts.range ts - +]
+        r debug reload
+        assert_equal $range [r ts.range ts - +]
+        r ts.get ts
+    } {3000 1500}
+
+    test {Time series commands against wrong type} {
+        r del ts
+        r set ts foo
+        assert_error "WRONGTYPE*" {r ts.add ts 1 1}
+        assert_error "WRONGTYPE*" {r ts.get ts}
+        assert_error "WRONGTYPE*" {r ts.range ts - +}
+        r del ts
+        r lpush ts a
+        assert_error "WRONGTYPE*" {r ts.add ts 1 1}
+        r del ts
+        r ts.add ts 1 1
+        r append ts x
+        assert_error "WRONGTYPE*" {r ts.range ts - +}
+    }
+}
@@ -0,0 +1,178 @@
+start_server {tags {"tracking"}} {
+    # The invalidation messages are received by a second connection,
+    # subscribed to the __redis__:invalidate channel.
+    set rd_redirection [redis_deferring_client]
+    $rd_redirection client id
+    set redir_id [$rd_redirection read]
+    $rd_redirection subscribe __redis__:invalidate
+    $rd_redirection read ; # Consume the SUBSCRIBE reply.
+
+    # A second connection modifying the keys, for NOLOOP.
+    set rd [redis_deferring_client]
+
+    test {CLIENT ID returns the ID of the connection} {
+        set id [r client id]
+        assert_match "*id=$id *cmd=client*" [r client list]
+    }
+
+    test {CLIENT TRACKING requires the REDIRECT option} {
+        catch {r CLIENT TRACKING on} e
+        set e
+    } {*REDIRECT*}
+
+    test {CLIENT TRACKING refuses to redirect to a missing client} {
+        catch {r CLIENT TRACKING on REDIRECT 123456789} e
+        set e
+    } {*does not exist*}
+
+    test {Clients are able to enable tracking and redirect it} {
+        r CLIENT TRACKING on REDIRECT $redir_id
+    } {*OK}
+
+    test {The other connection is able to get invalidations} {
+        r SET a 1
+        r GET a
+        r INCR a
+        r INCR b ; # This key should not be notified, since it wasn't fetched.
+        set keys [lindex [$rd_redirection read] 2]
+        assert {[llength $keys] == 1}
+        assert {[lindex $keys 0] eq {a}}
+    }
+
+    test {The keys read by scripts are tracked too} {
+        r EVAL {return redis.call('get',KEYS[1])} 1 script
+        r SET script 1
+        set keys [lindex [$rd_redirection read] 2]
+        assert {$keys eq {script}}
+    }
+
+    test {CLIENT GETREDIR returns the redirect client ID} {
+        r CLIENT GETREDIR
+    } $redir_id
+
+    test {The client is now able to disable tracking} {
+        # Make sure to add a few more keys in the tracking list
+        # so that we can check for leaks, as a side effect.
+        r MGET a b c d e f g
+        r CLIENT TRACKING off
+        r CLIENT GETREDIR
+    } {-1}
+
+    test {Clients can enable the BCAST mode with the empty prefix} {
+        r CLIENT TRACKING on BCAST REDIRECT $redir_id
+    } {*OK*}
+
+    test {The connection gets invalidation messages about all the keys} {
+        r MSET a 1 b 2 c 3
+        set keys [lsort [lindex [$rd_redirection read] 2]]
+        assert {$keys eq {a b c}}
+    }
+
+    test {BCAST mode can't be switched on/off without disabling tracking} {
+        catch {r CLIENT TRACKING on REDIRECT $redir_id} e
+        set e
+    } {*BCAST mode*}
+
+    test {Clients can enable the BCAST mode with prefixes} {
+        r CLIENT TRACKING off
+        r CLIENT TRACKING on BCAST REDIRECT $redir_id PREFIX a: PREFIX b:
+        r MULTI
+        r INCR a:1
+        r INCR a:2
+        r INCR b:1
+        r INCR b:2
+        r INCR c:1 ; # Not matching any prefix.
+        r EXEC
+        # The two prefixes are sent as two separated messages.
+        set keys1 [lsort [lindex [$rd_redirection read] 2]]
+        set keys2 [lsort [lindex [$rd_redirection read] 2]]
+        set keys [lsort [list {*}$keys1 {*}$keys2]]
+        assert {$keys eq {a:1 a:2 b:1 b:2}}
+    }
+
+    test {Adding prefixes to BCAST mode works} {
+        r CLIENT TRACKING on BCAST REDIRECT $redir_id PREFIX c:
+        r INCR c:1234
+        set keys [lsort [lindex [$rd_redirection read] 2]]
+        assert {$keys eq {c:1234}}
+    }
+
+    test {Overlapping prefixes are refused} {
+        catch {r CLIENT TRACKING on BCAST REDIRECT $redir_id PREFIX a:b} e
+        assert_match {*overlaps*} $e
+        catch {r CLIENT TRACKING on BCAST REDIRECT $redir_id PREFIX x PREFIX xy} e
+        assert_match {*overlaps*} $e
+    }
+
+    test {INFO reports the tracking clients and prefixes} {
+        assert_equal 1 [s tracking_clients]
+        assert_equal 3 [s tracking_total_prefixes]
+        assert_match {*flags=tB *} [r client list]
+    }
+
+    test {Tracking NOLOOP mode in BCAST mode works} {
+        r CLIENT TRACKING off
+        r CLIENT TRACKING on BCAST REDIRECT $redir_id NOLOOP
+        r SET foo1 1 ; # Not notified, modified by the tracking client.
+        $rd SET foo2 2
+        $rd read
+        set keys [lindex [$rd_redirection read] 2]
+        assert {$keys eq {foo2}}
+    }
+
+    test {Tracking NOLOOP mode in default mode works} {
+        r CLIENT TRACKING off
+        r CLIENT TRACKING on REDIRECT $redir_id NOLOOP
+        r MGET otherkey1 loopkey otherkey2
+        r SET loopkey 1 ; # We should not get this.
+        $rd SET otherkey1 1
+        $rd read
+        $rd SET otherkey2 1
+        $rd read
+        set keys1 [lindex [$rd_redirection read] 2]
+        set keys2 [lindex [$rd_redirection read] 2]
+        assert {[list {*}$keys1 {*}$keys2] eq {otherkey1 otherkey2}}
+    }
+
+    test {FLUSHALL invalidates all the keys at once} {
+        r GET a
+        r FLUSHALL
+        assert_equal {message __redis__:invalidate {}} [$rd_redirection read]
+        assert_equal 0 [s tracking_total_keys]
+    }
+
+    test {The tracking table is kept under tracking-table-max-keys} {
+        r CONFIG SET tracking-table-max-keys 10
+        for {set j 0} {$j < 20} {incr j} {r GET key:$j}
+        wait_for_condition 50 100 {
+            [s tracking_total_keys] <= 10
+        } else {
+            fail "The tracking table was not trimmed"
+        }
+        # The evicted keys were invalidated ahead of time.
+        set keys [lindex [$rd_redirection read] 2]
+        assert_match {key:*} $keys
+        r CONFIG SET tracking-table-max-keys 1000000
+    }
+
+    test {The redirection is flagged as broken when the client is gone} {
+        r CLIENT TRACKING off
+        set rd_gone [redis_deferring_client]
+        $rd_gone client id
+        set gone_id [$rd_gone read]
+        r CLIENT TRACKING on REDIRECT $gone_id
+        r GET broken
+        $rd_gone close
+        wait_for_condition 50 100 {
+            ![string match "*id=$gone_id *" [r client list]]
+        } else {
+            fail "The redirect client was not closed"
+        }
+        r SET broken 1
+        assert_match {*flags=tR *} [r client list]
+        r CLIENT TRACKING off
+    }
+
+    $rd_redirection close
+    $rd close
+}
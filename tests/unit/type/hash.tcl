@@ -14,8 +14,16 @@ start_server {tags {"hash"}} {
         list [r hlen smallhash]
     } {8}
 
-    test {Is the small hash encoded with a ziplist?} {
-        assert_encoding ziplist smallhash
+    test {Is the small hash encoded with a listpack?} {
+        assert_encoding listpack smallhash
+    }
+
+    test {Small hash keeps the listpack encoding after DEBUG RELOAD} {
+        r debug reload
+        assert_encoding listpack smallhash
+        foreach k [array names smallhash] {
+            assert_equal $smallhash($k) [r hget smallhash $k]
+        }
     }
 
     test {HSET/HLEN - Big hash creation} {
@@ -252,7 +260,7 @@ start_server {tags {"hash"}} {
         lappend rv [r hexists bighash nokey]
     } {1 0 1 0}
 
-    test {Is a ziplist encoded Hash promoted on big payload?} {
+    test {Is a listpack encoded Hash promoted on big payload?} {
         r hset smallhash foo [string repeat a 1024]
         r debug object smallhash
     } {*hashtable*}
@@ -326,6 +334,32 @@ start_server {tags {"hash"}} {
         set e
     } {*overflow*}
 
+    test {HINCRBY and HSET on counters of a hash table encoded hash} {
+        r del counters
+        r config set hash-max-ziplist-entries 0
+        r hset counters a 10 b 007 c -5 d " 1" e 4611686018427387903
+        r config set hash-max-ziplist-entries 512
+        assert_encoding hashtable counters
+        assert_equal 15 [r hincrby counters a 5]
+        assert_error {*not an integer*} {r hincrby counters b 1}
+        assert_equal -10 [r hincrby counters c -5]
+        assert_error {*not an integer*} {r hincrby counters d 1}
+        assert_equal 4611686018427387904 [r hincrby counters e 1]
+        assert_equal 4611686018427387903 [r hincrby counters e -1]
+        assert_equal 9223372036854775807 [r hincrby counters f 9223372036854775807]
+        r hincrbyfloat counters g 1.5
+        assert_equal {15 007 -10 { 1} 4611686018427387903 9223372036854775807 1.5} \
+            [r hmget counters a b c d e f g]
+        foreach {f len} {a 2 b 3 c 3 d 2 f 19} {
+            assert_equal $len [r hstrlen counters $f]
+        }
+        set all [r hgetall counters]
+        assert_equal [lsort $all] [lsort [lindex [r hscan counters 0 count 100] 1]]
+        r debug reload
+        assert_equal [lsort $all] [lsort [r hgetall counters]]
+        assert_equal 16 [r hincrby counters a 1]
+    }
+
     test {HINCRBYFLOAT against non existing database key} {
         r del htest
         list [r hincrbyfloat htest foo 2.5]
@@ -438,7 +472,7 @@ start_server {tags {"hash"}} {
         }
     }
 
-    test {Hash ziplist regression test for large keys} {
+    test {Hash listpack regression test for large keys} {
         r hset hash kkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkk a
         r hset hash kkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkk b
         r hget hash kkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkk
@@ -505,7 +539,7 @@ start_server {tags {"hash"}} {
         }
     }
 
-    test {Stress test the hash ziplist -> hashtable encoding conversion} {
+    test {Stress test the hash listpack -> hashtable encoding conversion} {
         r config set hash-max-ziplist-entries 32
         for {set j 0} {$j < 100} {incr j} {
             r del myhash
@@ -516,6 +550,153 @@ start_server {tags {"hash"}} {
         }
     }
 
+    test {HMGET and HSET of many fields of a listpack hash} {
+        r del smallhash bighash
+        r config set hash-max-ziplist-entries 512
+        set fields {}
+        for {set i 0} {$i < 40} {incr i} {
+            r hset smallhash $i v$i
+            r hset bighash $i v$i
+            lappend fields $i f$i
+        }
+        r hset smallhash -12 neg str 1234
+        r hset bighash -12 neg str 1234
+        r config set hash-max-ziplist-entries 0
+        r hset bighash conv x
+        r hdel bighash conv
+        r config set hash-max-ziplist-entries 512
+        assert_encoding listpack smallhash
+        assert_encoding hashtable bighash
+        set query [concat $fields {-12 str 7 7 nokey}]
+        assert_equal [r hmget bighash {*}$query] [r hmget smallhash {*}$query]
+        assert_equal {v0 neg 1234 {}} [r hmget smallhash 0 -12 str nokey]
+        set pairs {}
+        for {set i 30} {$i < 50} {incr i} {lappend pairs $i w$i}
+        assert_equal 10 [r hset smallhash {*}$pairs str 9876]
+        assert_equal 10 [r hset bighash {*}$pairs str 9876]
+        assert_equal 1 [r hset smallhash dup 1 dup 2 7 x]
+        assert_equal 1 [r hset bighash dup 1 dup 2 7 x]
+        assert_encoding listpack smallhash
+        assert_equal [lsort [r hgetall bighash]] [lsort [r hgetall smallhash]]
+        assert_equal {2 x w35 9876} [r hmget smallhash dup 7 35 str]
+    }
+
+    test {HEXPIRE, HTTL and HPERSIST on hash fields} {
+        r del myhash
+        r hset myhash f1 v1 f2 v2 f3 v3 f4 v4
+        assert_equal {1 1 -2} [r hexpire myhash 100 FIELDS 3 f1 f2 nofield]
+        assert_encoding hashtable myhash
+        assert_equal {0 1} [r hexpire myhash 200 NX FIELDS 2 f1 f3]
+        assert_equal {0 1} [r hexpire myhash 150 LT FIELDS 2 f1 f3]
+        assert_equal {0 0} [r hexpire myhash 10 GT FIELDS 2 f2 f4]
+        assert_equal {1} [r hexpire myhash 50 LT FIELDS 1 f1]
+        set ttl [r httl myhash FIELDS 4 f1 f2 f4 nofield]
+        assert {[lindex $ttl 0] > 45 && [lindex $ttl 0] <= 50}
+        assert {[lindex $ttl 1] > 95 && [lindex $ttl 1] <= 100}
+        assert_equal {-1 -2} [lrange $ttl 2 3]
+        assert_equal {1 -1} [r hpersist myhash FIELDS 2 f1 f4]
+        assert_equal {-1} [r httl myhash FIELDS 1 f1]
+        # Overwriting a field clears its TTL, incrementing it does not.
+        r hset myhash f2 new
+        assert_equal {-1} [r httl myhash FIELDS 1 f2]
+        r hset myhash n 1
+        r hexpire myhash 100 FIELDS 1 n
+        r hincrby myhash n 1
+        assert {[r httl myhash FIELDS 1 n] > 95}
+        assert_error {*FIELDS*} {r hexpire myhash 100 FIELDS 2 f1}
+        assert_error {*invalid expire*} {r hexpire myhash -1 FIELDS 1 f1}
+    }
+
+    test {Hash fields are deleted when their TTL is reached} {
+        r del myhash
+        r hset myhash a 1 b 2 c 3
+        assert_equal {1 1} [r hpexpire myhash 100 FIELDS 2 a b]
+        assert_equal {2} [r hpexpireat myhash 1 FIELDS 1 c]
+        assert_equal {a b} [lsort [r hkeys myhash]]
+        after 200
+        # Either lazily on access or by the active expire cycle.
+        assert_equal 0 [r exists myhash]
+        r hset myhash a 1 b 2
+        r hpexpire myhash 100 FIELDS 1 a
+        wait_for_condition 50 100 {
+            [r hlen myhash] == 1
+        } else {
+            fail "The field with a TTL was not actively expired"
+        }
+        assert_equal {b} [r hkeys myhash]
+    }
+
+    test {Hash fields TTLs are kept by DEBUG RELOAD and AOF rewrite} {
+        r del myhash
+        r config set hash-max-ziplist-entries 512
+        r hset myhash a 1 b 2 c 3
+        r hexpire myhash 1000 FIELDS 1 a
+        r hpexpireat myhash 100000000000000 FIELDS 1 b
+        r debug reload
+        assert {[r httl myhash FIELDS 1 a] > 990}
+        assert_equal {100000000000000 -1} [r hpexpiretime myhash FIELDS 2 b c]
+        r config set appendonly yes
+        waitForBgrewriteaof r
+        r debug loadaof
+        r config set appendonly no
+        assert {[r httl myhash FIELDS 1 a] > 990}
+        assert_equal {100000000000000 -1} [r hpexpiretime myhash FIELDS 2 b c]
+    }
+
+    test {Hot hashes leave the listpack encoding earlier} {
+        r config set maxmemory-policy allkeys-lfu
+        r config set adaptive-encoding-hot-counter 1
+        r del hothash
+        for {set i 0} {$i < 200} {incr i} {
+            r hset hothash f$i v$i
+        }
+        assert_encoding hashtable hothash
+        r config set adaptive-encoding-hot-counter 0
+        r config set maxmemory-policy noeviction
+        r del hothash
+        for {set i 0} {$i < 200} {incr i} {
+            r hset hothash f$i v$i
+        }
+        assert_encoding listpack hothash
+    }
+
+    test {Cold hashes shrunk within the limits are compacted in background} {
+        r del coldhash
+        r hset coldhash a [string repeat x 100] b 1
+        assert_encoding hashtable coldhash
+        r hset coldhash a short
+        r config set adaptive-encoding-cold-seconds 1
+        wait_for_condition 50 100 {
+            [r object encoding coldhash] eq {listpack}
+        } else {
+            fail "The hash was not compacted"
+        }
+        r config set adaptive-encoding-cold-seconds 0
+        assert_equal {short 1} [r hmget coldhash a b]
+    }
+
+    test {HGETALL, HKEYS and HVALS of a big hash are read in background} {
+        r del bighash
+        for {set j 0} {$j < 1000} {incr j} {
+            r hset bighash f$j $j
+        }
+        r hset bighash str [string repeat x 100]
+        assert_encoding hashtable bighash
+        set expected [list [lsort [r hgetall bighash]] \
+                           [lsort [r hkeys bighash]] [lsort [r hvals bighash]]]
+        r config set bgread-threshold 100
+        set reply [list {} [lsort [r hkeys bighash]] [lsort [r hvals bighash]]]
+        set rd [redis_deferring_client]
+        $rd hgetall bighash
+        $rd hset bighash f0 changed
+        lset reply 0 [lsort [$rd read]]
+        assert_equal 0 [$rd read]
+        $rd close
+        r config set bgread-threshold 100000
+        assert_equal $expected $reply
+        assert_equal changed [r hget bighash f0]
+    }
+
     # The following test can only be executed if we don't use Valgrind, and if
     # we are using x86_64 architecture, because:
     #
@@ -222,6 +222,34 @@ start_server {
         assert_equal foo [lindex [r lrange blist 0 -1] 0]
     }
 
+    test "Clients blocked on the same list are served and propagated in batches" {
+        r del blist
+        set clients {}
+        foreach cmd {blpop blpop blpop brpop blpop} {
+            set rd [redis_deferring_client]
+            $rd $cmd blist 0
+            lappend clients $rd
+            after 20
+        }
+        set repl [attach_to_replication_stream]
+        r rpush blist a b c d e f
+        set got {}
+        foreach rd $clients {
+            lappend got [lindex [$rd read] 1]
+            $rd close
+        }
+        assert_equal {a b c f d} $got
+        assert_equal {e} [r lrange blist 0 -1]
+        assert_replication_stream $repl {
+            {select *}
+            {rpush blist a b c d e f}
+            {ltrim blist 3 -1}
+            {rpop blist}
+            {lpop blist}
+        }
+        close_replication_stream $repl
+    }
+
     test "BRPOPLPUSH with zero timeout should block indefinitely" {
         set rd [redis_deferring_client]
         r del blist target
@@ -576,6 +604,95 @@ start_server {
         }
     }
 
+    test {Lists survive a change of list-node-container and DEBUG RELOAD} {
+        r del mylist
+        r config set list-node-container ziplist
+        for {set i 0} {$i < 100} {incr i} {
+            r rpush mylist $i
+        }
+        r debug reload
+        r config set list-node-container listpack
+        r rpush mylist 100
+        r debug reload
+        check_numbered_list_consistency mylist
+        assert_equal 101 [r llen mylist]
+        assert_equal 100 [r lindex mylist -1]
+    }
+
+    test {Lists are converted to a new list-node-container in background} {
+        r del mylist
+        r config set list-node-container ziplist
+        for {set i 0} {$i < 100} {incr i} {
+            r rpush mylist $i
+        }
+        assert_match {*ql_container:ziplist*} [r debug object mylist]
+
+        # With lazy conversion only a write converts the list.
+        r config set list-node-container-conversion lazy
+        r config set list-node-container listpack
+        after 300
+        assert_match {*ql_container:ziplist*} [r debug object mylist]
+        r config set list-node-container-conversion background
+        wait_for_condition 50 100 {
+            [string match {*ql_container:listpack*} [r debug object mylist]]
+        } else {
+            fail "The list was not converted in background"
+        }
+        check_numbered_list_consistency mylist
+        assert_equal 100 [r llen mylist]
+    }
+
+    test {LINDEX, LSET and LRANGE of a list with many nodes} {
+        r del mylist
+        set l {}
+        for {set i 0} {$i < 2000} {incr i} {
+            r rpush mylist $i
+            r lpush mylist -$i
+            set l [concat -$i $l $i]
+        }
+        for {set i 0} {$i < 200} {incr i} {
+            r lpop mylist
+            r rpop mylist
+            r rpush mylist x$i
+            set l [lrange $l 1 end-1]
+            lappend l x$i
+        }
+        set len [llength $l]
+        for {set i 0} {$i < 500} {incr i} {
+            set idx [randomInt $len]
+            assert_equal [lindex $l $idx] [r lindex mylist $idx]
+            assert_equal [lindex $l $idx] [r lindex mylist [expr {$idx-$len}]]
+            if {$i % 10 == 0} {
+                r lset mylist $idx v$i
+                lset l $idx v$i
+                r linsert mylist before [lindex $l 0] h$i
+                set l [linsert $l 0 h$i]
+                incr len
+            }
+        }
+        assert_equal [lrange $l 1000 1100] [r lrange mylist 1000 1100]
+        assert_equal $l [r lrange mylist 0 -1]
+    }
+
+    test {Hot nodes of a compressed list are kept decompressed} {
+        r del mylist
+        r config set list-compress-depth 1
+        set l {}
+        for {set i 0} {$i < 400} {incr i} {
+            set v "[string repeat x 20]$i"
+            r rpush mylist $v
+            lappend l $v
+        }
+        for {set i 0} {$i < 10} {incr i} {
+            assert_equal [lrange $l 200 210] [r lrange mylist 200 210]
+        }
+        assert_match {*ql_hot_nodes:[1-9]*} [r debug object mylist]
+        r lset mylist 205 foo
+        lset l 205 foo
+        assert_equal $l [r lrange mylist 0 -1]
+        r config set list-compress-depth 0
+    }
+
     test {LLEN against non-list value error} {
         r del mylist
         r set mylist foobar
@@ -733,6 +850,48 @@ start_server {
         assert_equal {} [r lrange nosuchkey 0 1]
     }
 
+    test {LRANGE of a big list is read in background} {
+        r del biglist
+        for {set j 0} {$j < 1000} {incr j} {
+            r rpush biglist $j [string repeat x $j]
+        }
+        set ranges {{0 -1} {10 20} {-300 -1} {1990 5000}}
+        set expected {}
+        foreach range $ranges {
+            lappend expected [r lrange biglist {*}$range]
+        }
+        r config set bgread-threshold 1
+        set reply {}
+        foreach range $ranges {
+            lappend reply [r lrange biglist {*}$range]
+        }
+        r config set bgread-threshold 100000
+        assert_equal $expected $reply
+    }
+
+    foreach depth {0 1} {
+        test "LRANGE of a big list is streamed - compress depth $depth" {
+            r config set list-compress-depth $depth
+            r del biglist
+            for {set j 0} {$j < 1000} {incr j} {
+                r rpush biglist $j [string repeat x $j]
+            }
+            set expected [r lrange biglist 0 -1]
+            r config set reply-stream-threshold 1
+            set rd [redis_deferring_client]
+            $rd lrange biglist 0 -1
+            $rd lrange biglist 10 20
+            # The write completes the reply being streamed first.
+            r rpush biglist foo
+            assert_equal $expected [$rd read]
+            assert_equal [r lrange biglist 10 20] [$rd read]
+            $rd close
+            r config set reply-stream-threshold 10000
+            r config set list-compress-depth 0
+            assert_equal [r lindex biglist -1] foo
+        }
+    }
+
     foreach {type large} [array get largevalue] {
         proc trim_list {type min max} {
             upvar 1 large large
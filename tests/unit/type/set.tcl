@@ -56,7 +56,10 @@ start_server {
         for {set i 0} {$i < 512} {incr i} { r sadd myset $i }
         assert_encoding intset myset
         assert_equal 1 [r sadd myset 512]
+        assert_encoding roaring myset
+        assert_equal 1 [r sadd myset foo]
         assert_encoding hashtable myset
+        assert_equal 514 [r scard myset]
     }
 
     test {Variadic SADD} {
@@ -72,12 +75,12 @@ start_server {
         for {set i 0} {$i < 1280} {incr i} { r sadd mylargeintset $i }
         for {set i 0} {$i <  256} {incr i} { r sadd myhashset [format "i%03d" $i] }
         assert_encoding intset myintset
-        assert_encoding hashtable mylargeintset
+        assert_encoding roaring mylargeintset
         assert_encoding hashtable myhashset
 
         r debug reload
         assert_encoding intset myintset
-        assert_encoding hashtable mylargeintset
+        assert_encoding roaring mylargeintset
         assert_encoding hashtable myhashset
     }
 
@@ -111,7 +114,30 @@ start_server {
         r srem myset 1 2 3 4 5 6 7 8
     } {3}
 
-    foreach {type} {hashtable intset} {
+    foreach {type prefix} {hashtable e intset {} roaring {}} {
+        test "SMEMBERS of a big set is read in background - $type" {
+            if {$type eq "roaring"} {
+                r config set set-max-intset-entries 0
+            }
+            r del bigset
+            for {set j 0} {$j < 300} {incr j} {
+                r sadd bigset $prefix$j
+            }
+            assert_encoding $type bigset
+            set expected [lsort [r smembers bigset]]
+            r config set bgread-threshold 1
+            set reply [r smembers bigset]
+            r config set bgread-threshold 100000
+            r config set set-max-intset-entries 512
+            assert_equal $expected [lsort $reply]
+        }
+    }
+
+    foreach {type} {hashtable intset roaring} {
+        # Every set of integers is a bitmap when intsets can't hold any.
+        if {$type eq "roaring"} {
+            r config set set-max-intset-entries 0
+        }
         for {set i 1} {$i <= 5} {incr i} {
             r del [format "set%d" $i]
         }
@@ -205,6 +231,97 @@ start_server {
             }
             assert_equal {1 2 3 4} [lsort [r smembers setres]]
         }
+        r config set set-max-intset-entries 512
+    }
+
+    test "Big sets of integers are encoded as compressed bitmaps" {
+        r del bigset1 bigset2 smallset setres
+        # A bitmap and an array container in bigset1, sparse values in bigset2.
+        for {set i 0} {$i < 10000} {incr i} { r sadd bigset1 $i }
+        for {set i 0} {$i < 1000} {incr i} {
+            r sadd bigset1 [expr {$i*3+1000000}]
+            r sadd bigset2 [expr {$i*7}] [expr {-$i*1000003}]
+        }
+        assert_encoding roaring bigset1
+        assert_encoding roaring bigset2
+        assert_equal 11000 [r scard bigset1]
+        assert_equal 1999 [r scard bigset2]
+        assert_equal 1 [r sismember bigset1 9999]
+        assert_equal 0 [r sismember bigset1 10000]
+        assert_equal 1 [r sismember bigset2 -999002997]
+        assert_equal 0 [r sismember bigset2 foo]
+
+        assert_equal 1000 [r sinterstore setres bigset1 bigset2]
+        assert_encoding roaring setres
+        assert_equal 11999 [r sunionstore setres bigset1 bigset2]
+        assert_encoding roaring setres
+        assert_equal 10000 [r sdiffstore setres bigset1 bigset2]
+        assert_encoding roaring setres
+        r sadd smallset 0 7 8 14 15
+        assert_equal 3 [r sinterstore setres bigset1 bigset2 smallset]
+        assert_encoding intset setres
+
+        r debug reload
+        assert_encoding roaring bigset1
+        assert_equal 11000 [r scard bigset1]
+        assert_equal [lsort [r smembers bigset2]] [lsort [r sdiff bigset2 nokey]]
+
+        set cur 0
+        set scanned {}
+        while 1 {
+            set res [r sscan bigset2 $cur]
+            set cur [lindex $res 0]
+            lappend scanned {*}[lindex $res 1]
+            if {$cur == 0} break
+        }
+        assert_equal [lsort [r smembers bigset2]] [lsort -unique $scanned]
+
+        foreach ele [r srandmember bigset2 -20] {
+            assert_equal 1 [r sismember bigset2 $ele]
+        }
+        set popped [r spop bigset1 10]
+        assert_equal 10990 [r scard bigset1]
+        foreach ele $popped {
+            assert_equal 0 [r sismember bigset1 $ele]
+        }
+        assert_equal 1 [r srem bigset2 0]
+        assert_equal 0 [r srem bigset2 0]
+        assert_equal 1998 [r scard bigset2]
+    }
+
+    test "SINTER, SUNION, SDIFF with the members looked up by threads" {
+        r del pset1 pset2 pset3 pset4 setres
+        for {set i 0} {$i < 3000} {incr i} {
+            r sadd pset1 $i
+            r sadd pset2 [expr {$i*2}]
+            r sadd pset3 "e[expr {$i*3}]"
+            r sadd pset3 [expr {$i*3}]
+        }
+        r sadd pset4 1 2 3 foo
+        assert_encoding roaring pset1
+        assert_encoding hashtable pset3
+
+        set cmds {
+            {sinter pset1 pset2 pset3} {sinter pset3 pset1} {sinter pset3 pset4}
+            {sunion pset1 pset2 pset3} {sunion pset3 pset3 pset4 nokey}
+            {sdiff pset3 pset1 pset4} {sdiff pset1 pset3 nokey pset4}
+            {sdiff pset3 pset3}
+        }
+        r config set set-algebra-threads 1
+        set expected {}
+        foreach cmd $cmds {
+            lappend expected [lsort [r {*}$cmd]]
+        }
+        r config set set-algebra-threads 4
+        r config set set-algebra-parallel-threshold 0
+        foreach cmd $cmds exp $expected {
+            assert_equal $exp [lsort [r {*}$cmd]]
+            set op [lindex $cmd 0]
+            set n [r ${op}store setres {*}[lrange $cmd 1 end]]
+            assert_equal [llength $exp] $n
+            assert_equal $exp [lsort [r smembers setres]]
+        }
+        r config set set-algebra-parallel-threshold 100000
     }
 
     test "SDIFF with first set empty" {
@@ -273,6 +390,28 @@ start_server {
         lsort [r sinter set1 set2]
     } {1 2 3}
 
+    test "SINTER of intsets with mixed encodings and a hashtable" {
+        r del set1 set2 set3 setres
+        set expected {}
+        for {set i -200} {$i < 200} {incr i} {
+            r sadd set1 [expr {$i*70000}]
+            if {$i % 3 == 0} {
+                r sadd set2 [expr {$i*70000}]
+                lappend expected [expr {$i*70000}]
+            }
+        }
+        r sadd set2 123456789012 -5
+        r sadd set3 0 70000 -210000 420000 a
+        assert_encoding intset set1
+        assert_encoding intset set2
+        assert_encoding hashtable set3
+        assert_equal $expected [lsort -integer [r sinter set1 set2 set1]]
+        assert_equal {-210000 0 420000} [lsort -integer [r sinter set1 set2 set3]]
+        assert_equal 133 [r sinterstore setres set2 set1]
+        assert_encoding intset setres
+        assert_equal $expected [lsort -integer [r smembers setres]]
+    }
+
     test "SINTERSTORE against non existing keys should delete dstkey" {
         r set setres xxx
         assert_equal 0 [r sinterstore setres foo111 bar222]
@@ -253,4 +253,133 @@ start_server {
             }
         }
     }
+
+    test {XADD with MAXLEN ~ option only removes whole nodes} {
+        r DEL mystream
+        r config set stream-node-max-entries 100
+        for {set j 0} {$j < 1000} {incr j} {
+            r XADD mystream MAXLEN ~ 555 * xitem $j
+        }
+        set len [r XLEN mystream]
+        assert {$len >= 555 && $len < 655}
+        assert_equal [expr {1000-$len}] [lindex [r XRANGE mystream - + COUNT 1] 0 1 1]
+    }
+
+    test {Stream content and last ID survive DEBUG RELOAD and AOF rewrite} {
+        r DEL mystream emptystream
+        foreach j {1 2 3} {r XADD mystream $j-0 f $j}
+        r XADD emptystream 5-5 f v
+        r XADD emptystream MAXLEN 0 6-0 f v
+        set d1 [r debug digest]
+        r debug reload
+        assert_equal $d1 [r debug digest]
+        r config set appendonly yes
+        waitForBgrewriteaof r
+        r debug loadaof
+        r config set appendonly no
+        assert_equal $d1 [r debug digest]
+        assert_equal 0 [r XLEN emptystream]
+        assert_error "*equal or smaller*" {r XADD emptystream 6-0 f v}
+        r XRANGE mystream - +
+    } {{1-0 {f 1}} {2-0 {f 2}} {3-0 {f 3}}}
+
+    test {XGROUP CREATE: creation and duplicate group name detection} {
+        r DEL mystream
+        r XADD mystream 1-0 a 1
+        r XGROUP CREATE mystream mygroup $
+        assert_error "*BUSYGROUP*" {r XGROUP CREATE mystream mygroup $}
+        assert_error "*requires the key to exist*" {r XGROUP CREATE nokey g $}
+        r XGROUP CREATE newstream mygroup $ MKSTREAM
+        r XLEN newstream
+    } {0}
+
+    test {XREADGROUP will return only new elements} {
+        r DEL mystream
+        r XADD mystream 1-0 a 1
+        r XGROUP CREATE mystream mygroup 0
+        r XADD mystream 2-0 b 2
+        set reply [r XREADGROUP GROUP mygroup alice STREAMS mystream >]
+        assert_equal {{mystream {{1-0 {a 1}} {2-0 {b 2}}}}} $reply
+        r XREADGROUP GROUP mygroup bob STREAMS mystream >
+    } {}
+
+    test {XREADGROUP can read the history of the elements we own} {
+        r XADD mystream 3-0 c 3
+        r XREADGROUP GROUP mygroup bob COUNT 10 STREAMS mystream >
+        set alice [r XREADGROUP GROUP mygroup alice STREAMS mystream 0]
+        set bob [r XREADGROUP GROUP mygroup bob STREAMS mystream 0]
+        assert_equal {{mystream {{1-0 {a 1}} {2-0 {b 2}}}}} $alice
+        assert_equal {{mystream {{3-0 {c 3}}}}} $bob
+    }
+
+    test {XPENDING and XACK track the pending entries} {
+        set pending [r XPENDING mystream mygroup]
+        assert_equal {3 1-0 3-0 {{alice 2} {bob 1}}} $pending
+        set pending [r XPENDING mystream mygroup - + 10 alice]
+        assert_equal 2 [llength $pending]
+        assert_equal {1-0 alice} [lrange [lindex $pending 0] 0 1]
+        assert_equal 2 [r XACK mystream mygroup 1-0 3-0 4-0]
+        r XPENDING mystream mygroup
+    } {1 2-0 2-0 {{alice 1}}}
+
+    test {XCLAIM can claim pending entries from another consumer} {
+        after 20
+        assert_equal {} [r XCLAIM mystream mygroup bob 60000 2-0]
+        set reply [r XCLAIM mystream mygroup bob 10 2-0]
+        assert_equal {{2-0 {b 2}}} $reply
+        assert_equal 0 [r XGROUP DELCONSUMER mystream mygroup alice]
+        set pending [r XPENDING mystream mygroup - + 10]
+        assert_equal {2-0 bob} [lrange [lindex $pending 0] 0 1]
+        lindex $pending 0 3
+    } {3}
+
+    test {Consumer groups survive DEBUG RELOAD} {
+        r debug reload
+        set pending [lindex [r XPENDING mystream mygroup - + 10] 0]
+        assert_equal {2-0 bob 3} [lreplace $pending 2 2]
+        r XREADGROUP GROUP mygroup bob STREAMS mystream 0
+    } {{mystream {{2-0 {b 2}}}}}
+
+    test {Large streams and PELs survive DEBUG RELOAD} {
+        r DEL bigstream
+        r config set stream-node-max-entries 4
+        for {set j 1} {$j <= 1000} {incr j} {
+            r XADD bigstream $j-[expr {$j%3}] f $j
+        }
+        r XGROUP CREATE bigstream g 0
+        r XREADGROUP GROUP g alice COUNT 300 STREAMS bigstream >
+        r XREADGROUP GROUP g bob COUNT 300 STREAMS bigstream >
+        set d1 [r debug digest]
+        set p1 {}
+        foreach e [r XPENDING bigstream g - + 1000] {lappend p1 [lrange $e 0 1]}
+        r debug reload
+        r config set stream-node-max-entries 100
+        assert_equal $d1 [r debug digest]
+        set p2 {}
+        foreach e [r XPENDING bigstream g - + 1000] {lappend p2 [lrange $e 0 1]}
+        assert_equal 600 [llength $p2]
+        assert_equal $p1 $p2
+        assert_equal 1000 [llength [r XRANGE bigstream - +]]
+        assert_equal {500-2} [lindex [r XRANGE bigstream 500 + COUNT 1] 0 0]
+        llength [lindex [r XREADGROUP GROUP g bob STREAMS bigstream 0] 0 1]
+    } {300}
+
+    test {Blocking XREADGROUP is served by XADD and tracks the PEL} {
+        r DEL mystream
+        r XGROUP CREATE mystream mygroup $ MKSTREAM
+        set rd [redis_deferring_client]
+        $rd XREADGROUP GROUP mygroup alice BLOCK 0 STREAMS mystream >
+        r XADD mystream 1-0 f v
+        assert_equal {{mystream {{1-0 {f v}}}}} [$rd read]
+        $rd close
+        lindex [r XPENDING mystream mygroup] 0
+    } {1}
+
+    test {Blocking XREADGROUP gets -NOGROUP if the group is destroyed} {
+        set rd [redis_deferring_client]
+        $rd XREADGROUP GROUP mygroup alice BLOCK 0 STREAMS mystream >
+        r XGROUP DESTROY mystream mygroup
+        assert_error "*NOGROUP*" {$rd read}
+        $rd close
+    }
 }
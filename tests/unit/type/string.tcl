@@ -419,4 +419,63 @@ start_server {tags {"string"}} {
         r set foo bar
         r getrange foo 0 4294967297
     } {bar}
+
+    test {Small values stored with their key survive RENAME, MOVE and APPEND} {
+        r flushdb
+        r set foo small-value
+        r rename foo bar
+        r append bar -more
+        r set foo [r get bar]
+        r move bar 10
+        r del foo
+        r select 10
+        set res [r get bar]
+        r del bar
+        r select 9
+        set res
+    } {small-value-more}
+
+    test {Compressed strings behave like plain strings} {
+        r flushdb
+        r config set string-compression-min-bytes 1024
+        set json [string repeat {{"id":1234,"name":"user","tags":["a","b"]},} 200]
+        r set doc $json
+        r mset doc2 $json doc3 $json
+        r set small {{"id":1}}
+        assert_encoding compressed doc
+        assert_encoding compressed doc2
+        assert_encoding embstr small
+        assert {[r memory usage doc] < [string length $json]/2}
+        assert {[r get doc] eq $json}
+        assert {[r mget doc2 small] eq [list $json {{"id":1}}]}
+        assert {[r strlen doc] == [string length $json]}
+        r expire doc 100
+        assert_encoding compressed doc
+        assert {[r getset doc3 $json] eq $json}
+        assert_encoding compressed doc3
+        r append doc x
+        assert_encoding raw doc
+        assert {[r get doc] eq "${json}x"}
+        r setrange doc2 0 {[}
+        assert_encoding raw doc2
+        assert {[r getrange doc2 0 5] eq {["id":}}
+        r config set string-compression-min-bytes 0
+    }
+
+    test {Compressed strings survive DEBUG RELOAD and DUMP/RESTORE} {
+        r flushdb
+        r config set string-compression-min-bytes 1024
+        set json [string repeat {{"id":1234,"name":"user"},} 200]
+        r set doc $json
+        r debug reload
+        assert_encoding compressed doc
+        assert {[r get doc] eq $json}
+        r restore doc2 0 [r dump doc]
+        assert_encoding compressed doc2
+        assert {[r get doc2] eq $json}
+        r config set string-compression-min-bytes 0
+        r debug reload
+        assert_encoding raw doc
+        assert {[r get doc] eq $json}
+    }
 }
@@ -7,12 +7,16 @@ start_server {tags {"zset"}} {
     }
 
     proc basics {encoding} {
-        if {$encoding == "ziplist"} {
+        if {$encoding == "listpack"} {
             r config set zset-max-ziplist-entries 128
             r config set zset-max-ziplist-value 64
         } elseif {$encoding == "skiplist"} {
             r config set zset-max-ziplist-entries 0
             r config set zset-max-ziplist-value 0
+        } elseif {$encoding == "btree"} {
+            r config set zset-max-ziplist-entries 0
+            r config set zset-max-ziplist-value 0
+            r config set zset-max-skiplist-entries 0
         } else {
             puts "Unknown sorted set encoding"
             exit
@@ -248,6 +252,28 @@ start_server {tags {"zset"}} {
             assert_equal {d 4 c 3 b 2 a 1} [r zrevrange ztmp 0 -1 withscores]
         }
 
+        test "ZRANGE/ZREVRANGE read in background - $encoding" {
+            r del ztmp
+            for {set j 0} {$j < 100} {incr j} {
+                r zadd ztmp [expr {$j*1.5}] e$j
+            }
+            r zadd ztmp inf top -inf bottom
+            set ranges {{0 -1} {3 50} {-10 -1} {90 500}}
+            set expected {}
+            foreach range $ranges {
+                lappend expected [r zrange ztmp {*}$range withscores] \
+                                 [r zrevrange ztmp {*}$range]
+            }
+            r config set bgread-threshold 1
+            set reply {}
+            foreach range $ranges {
+                lappend reply [r zrange ztmp {*}$range withscores] \
+                              [r zrevrange ztmp {*}$range]
+            }
+            r config set bgread-threshold 100000
+            assert_equal $expected $reply
+        }
+
         test "ZRANK/ZREVRANK basics - $encoding" {
             r del zranktmp
             r zadd zranktmp 10 x
@@ -376,6 +402,17 @@ start_server {tags {"zset"}} {
             assert_equal {d 3 c 2} [r zrevrangebyscore zset 5 2 LIMIT 2 3 WITHSCORES]
         }
 
+        test "ZRANGEBYSCORE with LIMIT offsets up to the end of the zset" {
+            create_default_zset
+            assert_equal {g}   [r zrangebyscore zset 2 +inf LIMIT 4 10]
+            assert_equal {}    [r zrangebyscore zset 2 +inf LIMIT 5 10]
+            assert_equal {}    [r zrangebyscore zset 2 +inf LIMIT -1 10]
+            assert_equal {f}   [r zrangebyscore zset 2 5 LIMIT 3 10]
+            assert_equal {a}   [r zrevrangebyscore zset 4 -inf LIMIT 4 10]
+            assert_equal {}    [r zrevrangebyscore zset 4 -inf LIMIT 5 10]
+            assert_equal {}    [r zrevrangebyscore zset 4 -inf LIMIT -1 10]
+        }
+
         test "ZRANGEBYSCORE with non-value min or max" {
             assert_error "*not*float*" {r zrangebyscore fooz str 1}
             assert_error "*not*float*" {r zrangebyscore fooz 1 str}
@@ -650,8 +687,71 @@ start_server {tags {"zset"}} {
         }
     }
 
-    basics ziplist
+    basics listpack
     basics skiplist
+    basics btree
+
+    test {ZSET skiplist converted to btree keeps order and ranks across DEBUG RELOAD} {
+        r config set zset-max-ziplist-entries 0
+        r config set zset-max-skiplist-entries 100
+        r del zbig
+        for {set j 0} {$j < 100} {incr j} {
+            r zadd zbig [expr {$j % 10}] m$j
+        }
+        assert_encoding skiplist zbig
+        set before [r zrange zbig 0 -1 withscores]
+        r zadd zbig 5 m100
+        assert_encoding btree zbig
+        set after [r zrange zbig 0 -1 withscores]
+        assert_equal [r zrank zbig m100] [expr {[lsearch $after m100]/2}]
+        assert_equal [r zrangebyscore zbig 3 3 limit 2 3] {m3 m33 m43}
+        assert_equal [r zrevrangebyscore zbig 5 5 limit 1 2] {m85 m75}
+        set digest [r debug digest]
+        r debug reload
+        assert_encoding btree zbig
+        assert_equal $digest [r debug digest]
+        assert_equal $after [r zrange zbig 0 -1 withscores]
+        r config set zset-max-skiplist-entries 65536
+        r debug reload
+        assert_encoding skiplist zbig
+        assert_equal $digest [r debug digest]
+        r config set zset-max-ziplist-entries 128
+    }
+
+    test {ZSET skiplist bulk loaded from RDB and listpack keeps ranks} {
+        r del zbulk zsmall
+        r config set zset-max-ziplist-entries 128
+        r config set zset-max-ziplist-value 64
+        for {set j 0} {$j < 1000} {incr j} {
+            r zadd zbulk [randomInt 50] m$j
+        }
+        for {set j 0} {$j < 100} {incr j} {
+            r zadd zsmall [randomInt 10] [randomInt 1000]
+        }
+        assert_encoding skiplist zbulk
+        assert_encoding listpack zsmall
+        set expected [r zrange zbulk 0 -1 withscores]
+        r debug reload
+        assert_encoding skiplist zbulk
+        assert_equal $expected [r zrange zbulk 0 -1 withscores]
+        assert_equal [lindex $expected end-1] [r zrevrange zbulk 0 0]
+
+        set small [r zrange zsmall 0 -1 withscores]
+        r zadd zsmall 0 [string repeat x 100]
+        assert_encoding skiplist zsmall
+        r zrem zsmall [string repeat x 100]
+        assert_equal $small [r zrange zsmall 0 -1 withscores]
+
+        foreach key {zbulk zsmall} {
+            set rank 0
+            foreach {ele score} [r zrange $key 0 -1 withscores] {
+                assert_equal $rank [r zrank $key $ele]
+                incr rank
+            }
+        }
+        r zremrangebyrank zbulk 100 199
+        assert_equal [lrange $expected 400 end] [r zrange zbulk 100 -1 withscores]
+    }
 
     test {ZINTERSTORE regression with two sets, intset+hashtable} {
         r del seta setb setc
@@ -666,7 +766,7 @@ start_server {tags {"zset"}} {
         r zrange out 0 -1 withscores
     } {neginf 0}
 
-    test {ZINTERSTORE #516 regression, mixed sets and ziplist zsets} {
+    test {ZINTERSTORE #516 regression, mixed sets and listpack zsets} {
         r sadd one 100 101 102 103
         r sadd two 100 200 201 202
         r zadd three 1 500 1 501 1 502 1 503 1 100
@@ -696,12 +796,54 @@ start_server {tags {"zset"}} {
         }
     }
 
+    test {ZUNIONSTORE / ZINTERSTORE computed by threads} {
+        r del z1 z2 z3 s1 dest
+        for {set j 0} {$j < 1500} {incr j} {
+            r zadd z1 [randomInt 100] e$j
+            r zadd z2 [randomInt 100] e[expr {$j*2}]
+            r zadd z3 [expr {rand()}] e[expr {$j*3}]
+            r sadd s1 e[expr {$j*5}]
+        }
+        set cmds {
+            {zunionstore dest 4 z1 z2 z3 s1}
+            {zunionstore dest 3 z1 z1 z2 WEIGHTS 1 2 3 AGGREGATE MAX}
+            {zinterstore dest 3 z2 z1 s1 WEIGHTS 2 1 1}
+            {zinterstore dest 2 z3 z3 AGGREGATE MIN}
+        }
+        foreach maxentries {65536 100} {
+            r config set zset-max-skiplist-entries $maxentries
+            foreach cmd $cmds {
+                r config set set-algebra-threads 1
+                set n [r {*}$cmd]
+                set expected [r zrange dest 0 -1 withscores]
+                r config set set-algebra-threads 3
+                r config set set-algebra-parallel-threshold 0
+                assert_equal $n [r {*}$cmd]
+                assert_equal $expected [r zrange dest 0 -1 withscores]
+                r config set set-algebra-parallel-threshold 100000
+
+                # The ranks of the bulk loaded destination are right.
+                set rank 0
+                foreach {ele score} $expected {
+                    assert_equal $rank [r zrank dest $ele]
+                    incr rank
+                }
+                r zremrangebyrank dest 10 20
+                assert_equal [expr {$n-11}] [r zcard dest]
+                assert_equal [lrange $expected 42 end] \
+                             [r zrange dest 10 -1 withscores]
+            }
+        }
+        r config set zset-max-skiplist-entries 65536
+        r config set set-algebra-threads 4
+    }
+
     test "ZSET commands don't accept the empty strings as valid score" {
         assert_error "*not*float*" {r zadd myzset "" abc}
     }
 
     proc stressers {encoding} {
-        if {$encoding == "ziplist"} {
+        if {$encoding == "listpack"} {
             # Little extra to allow proper fuzzing in the sorting stresser
             r config set zset-max-ziplist-entries 256
             r config set zset-max-ziplist-value 64
@@ -710,6 +852,11 @@ start_server {tags {"zset"}} {
             r config set zset-max-ziplist-entries 0
             r config set zset-max-ziplist-value 0
             if {$::accurate} {set elements 1000} else {set elements 100}
+        } elseif {$encoding == "btree"} {
+            r config set zset-max-ziplist-entries 0
+            r config set zset-max-ziplist-value 0
+            r config set zset-max-skiplist-entries 0
+            if {$::accurate} {set elements 10000} else {set elements 1000}
         } else {
             puts "Unknown sorted set encoding"
             exit
@@ -726,7 +873,9 @@ start_server {tags {"zset"}} {
 
             assert_encoding $encoding zscoretest
             for {set i 0} {$i < $elements} {incr i} {
-                assert_equal [lindex $aux $i] [r zscore zscoretest $i]
+                # Replies carry fewer digits that still round trip, while
+                # the harness prints 17, so compare the doubles.
+                assert {[lindex $aux $i] == [r zscore zscoretest $i]}
             }
         }
 
@@ -742,10 +891,26 @@ start_server {tags {"zset"}} {
             r debug reload
             assert_encoding $encoding zscoretest
             for {set i 0} {$i < $elements} {incr i} {
-                assert_equal [lindex $aux $i] [r zscore zscoretest $i]
+                # Replies carry fewer digits that still round trip, while
+                # the harness prints 17, so compare the doubles.
+                assert {[lindex $aux $i] == [r zscore zscoretest $i]}
             }
         }
 
+        test "ZSCORE replies with round trip digits - $encoding" {
+            r del zscoretest
+            r zadd zscoretest 0.1 a 1e-5 b 1.5e300 c -2.5 d 123456789 e
+            assert_equal 0.1 [r zscore zscoretest a]
+            assert_equal 1e-05 [r zscore zscoretest b]
+            assert_equal 1.5e+300 [r zscore zscoretest c]
+            assert_equal -2.5 [r zscore zscoretest d]
+            assert_equal 123456789 [r zscore zscoretest e]
+            r debug reload
+            assert_encoding $encoding zscoretest
+            assert_equal {b 1e-05 a 0.1} [r zrange zscoretest 1 2 withscores]
+            assert_equal 1.5e+300 [r zscore zscoretest c]
+        }
+
         test "ZSET sorting stresser - $encoding" {
             set delta 0
             for {set test 0} {$test < 2} {incr test} {
@@ -1028,7 +1193,8 @@ start_server {tags {"zset"}} {
     }
 
     tags {"slow"} {
-        stressers ziplist
+        stressers listpack
         stressers skiplist
+        stressers btree
     }
 }
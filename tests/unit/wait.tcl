@@ -39,4 +39,37 @@ start_server {} {
         $master incr foo
         assert {[$master wait 1 3000] == 0}
     }
+
+    test {WAIT unblocks the clients in order of offset} {
+        wait_for_condition 50 100 {
+            [$master wait 1 100] == 1
+        } else {
+            fail "Slave not acknowledging the writes"
+        }
+        $slave config set slave-fast-ack yes
+        set clients {}
+        for {set j 0} {$j < 20} {incr j} {
+            set rd [redis_deferring_client -1]
+            $rd incr foo
+            $rd wait 1 5000
+            lappend clients $rd
+        }
+        foreach rd $clients {
+            $rd read
+            assert_equal 1 [$rd read]
+            $rd close
+        }
+        assert {[$master wait 2 100] <= 1}
+        $slave config set slave-fast-ack no
+    }
+
+    test {WAIT times out on time regardless of hz} {
+        $master config set hz 1
+        $master incr foo
+        set start [clock milliseconds]
+        assert {[$master wait 2 50] <= 1}
+        set elapsed [expr {[clock milliseconds]-$start}]
+        $master config set hz 10
+        assert {$elapsed >= 50 && $elapsed < 500}
+    }
 }}
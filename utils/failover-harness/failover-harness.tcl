@@ -0,0 +1,374 @@
+# Failover timing harness.
+#
+# Kills a master with SIGKILL while redis-benchmark loads the deployment,
+# and measures what a client writing to the killed master observes:
+#
+#   unavailable  Milliseconds from the first failed write to the first
+#                write acknowledged by the new master.
+#   converge     Milliseconds from the kill to the moment every node (or
+#                Sentinel) agrees on the new master and the cluster is ok.
+#   lost         Writes acknowledged by the old master that are missing on
+#                the new one, and the time span they were acknowledged in
+#                (the write loss window).
+#
+# The killed instance is restarted and rejoins as a replica before the next
+# iteration. Both Redis Cluster failovers, driving a create-cluster
+# topology, and Sentinel failovers can be measured. See the README.
+
+source [file join [file dirname [info script]] ../../tests/support/redis.tcl]
+source [file join [file dirname [info script]] ../../tests/support/cluster.tcl]
+
+set ::opt(mode) cluster         ; # cluster or sentinel.
+set ::opt(host) 127.0.0.1
+set ::opt(port) 30001           ; # Any cluster node, or a Sentinel.
+set ::opt(master-name) mymaster ; # Sentinel: name of the monitored master.
+set ::opt(iterations) 5
+set ::opt(threads) 4            ; # redis-benchmark --threads.
+set ::opt(clients) 50           ; # redis-benchmark -c, 0 for no load.
+set ::opt(tests) set,get        ; # redis-benchmark -t.
+set ::opt(settle) 5000          ; # Milliseconds of load before each kill.
+set ::opt(timeout) 60000        ; # Give up on an iteration after this.
+set ::opt(csv) {}               ; # Append the samples to this file.
+
+set ::root [file normalize [file join [file dirname [info script]] ../..]]
+
+proc usage {} {
+    puts "Usage: tclsh failover-harness.tcl \[options\]"
+    puts ""
+    foreach name [lsort [array names ::opt]] {
+        puts [format "  --%-12s (default: %s)" $name $::opt($name)]
+    }
+    exit 1
+}
+
+for {set j 0} {$j < [llength $argv]} {incr j 2} {
+    set name [string range [lindex $argv $j] 2 end]
+    if {![info exists ::opt($name)] || $j+1 >= [llength $argv]} usage
+    set ::opt($name) [lindex $argv $j+1]
+}
+if {$::opt(mode) ni {cluster sentinel}} usage
+
+proc log msg {
+    puts "[clock format [clock seconds] -format %H:%M:%S] $msg"
+    flush stdout
+}
+
+# Call a command on host:port with a new connection, returning the reply,
+# or raising an error if the instance is unreachable.
+proc call {addr args} {
+    lassign [split $addr :] host port
+    set r [redis $host $port]
+    if {[catch {$r {*}$args} reply]} {
+        catch {$r close}
+        error $reply
+    }
+    $r close
+    return $reply
+}
+
+proc info_field {info field} {
+    if {[regexp "\r\n$field:(.*?)\r\n" "\r\n$info" -> value]} {return $value}
+    return {}
+}
+
+# -----------------------------------------------------------------------------
+# Topology
+# -----------------------------------------------------------------------------
+
+# Return the masters as a list of {addr firstslot} in cluster mode, asking
+# the nodes in 'seeds' until one replies.
+proc cluster_masters {seeds} {
+    foreach addr $seeds {
+        if {[catch {call $addr cluster slots} slots]} continue
+        set masters {}
+        foreach range $slots {
+            lassign $range start end master
+            lappend masters "[lindex $master 0]:[lindex $master 1]" $start
+        }
+        return $masters
+    }
+    error "No cluster node reachable"
+}
+
+proc cluster_nodes {seed} {
+    set nodes {}
+    foreach line [split [call $seed cluster nodes] "\n"] {
+        if {$line eq {} || [string match *noaddr* $line]} continue
+        lappend nodes [lindex [split [lindex $line 1] @] 0]
+    }
+    return $nodes
+}
+
+# Address of the node serving 'slot' according to 'addr'.
+proc cluster_slot_owner {addr slot} {
+    foreach range [call $addr cluster slots] {
+        lassign $range start end master
+        if {$slot >= $start && $slot <= $end} {
+            return "[lindex $master 0]:[lindex $master 1]"
+        }
+    }
+    return {}
+}
+
+proc sentinel_master {sentinel} {
+    join [call $sentinel sentinel get-master-addr-by-name $::opt(master-name)] :
+}
+
+proc sentinels {sentinel} {
+    set list [list $sentinel]
+    foreach s [call $sentinel sentinel sentinels $::opt(master-name)] {
+        lappend list "[dict get $s ip]:[dict get $s port]"
+    }
+    return $list
+}
+
+# The address the probe should write to right now, or {} if unknown.
+proc current_master {ctx} {
+    if {$::opt(mode) eq {cluster}} {
+        foreach addr [dict get $ctx nodes] {
+            if {[catch {cluster_slot_owner $addr [dict get $ctx slot]} owner]} continue
+            if {$owner ne {} && $owner ne [dict get $ctx victim]} {return $owner}
+        }
+        return {}
+    } else {
+        foreach s [dict get $ctx sentinels] {
+            if {[catch {sentinel_master $s} addr]} continue
+            if {$addr ne [dict get $ctx victim]} {return $addr}
+        }
+        return {}
+    }
+}
+
+# True when the failover of the victim completed everywhere.
+proc converged {ctx} {
+    if {$::opt(mode) eq {cluster}} {
+        set owners {}
+        foreach addr [dict get $ctx nodes] {
+            if {$addr eq [dict get $ctx victim]} continue
+            if {[catch {
+                set state [info_field [call $addr cluster info] cluster_state]
+                set owner [cluster_slot_owner $addr [dict get $ctx slot]]
+            }]} {return 0}
+            if {$state ne {ok}} {return 0}
+            lappend owners $owner
+        }
+        set owners [lsort -unique $owners]
+        return [expr {[llength $owners] == 1 &&
+                      [lindex $owners 0] ne [dict get $ctx victim]}]
+    } else {
+        set masters {}
+        foreach s [dict get $ctx sentinels] {
+            if {[catch {sentinel_master $s} addr]} {return 0}
+            lappend masters $addr
+        }
+        set masters [lsort -unique $masters]
+        if {[llength $masters] != 1 ||
+            [lindex $masters 0] eq [dict get $ctx victim]} {return 0}
+        if {[catch {call [lindex $masters 0] role} role]} {return 0}
+        return [expr {[lindex $role 0] eq {master}}]
+    }
+}
+
+# A hash tag whose keys belong to 'slot'.
+proc tag_for_slot {slot} {
+    for {set j 0} {1} {incr j} {
+        if {[::redis_cluster::hash "h$j"] == $slot} {return "{h$j}"}
+    }
+}
+
+# -----------------------------------------------------------------------------
+# Load and kills
+# -----------------------------------------------------------------------------
+
+proc start_load {} {
+    if {$::opt(clients) == 0} return
+    lassign [split [expr {$::opt(mode) eq {cluster} ?
+        "$::opt(host):$::opt(port)" :
+        [sentinel_master "$::opt(host):$::opt(port)"]}] :] host port
+    set cmd [list $::root/src/redis-benchmark -h $host -p $port \
+        --threads $::opt(threads) -c $::opt(clients) -t $::opt(tests) \
+        -r 1000000 -n 2000000000 -q]
+    if {$::opt(mode) eq {cluster}} {lappend cmd --cluster}
+    set ::load [open "|$cmd 2>@1" r]
+    fconfigure $::load -blocking 0
+    log "Load started: [lrange $cmd 1 end]"
+}
+
+proc stop_load {} {
+    if {![info exists ::load]} return
+    catch {exec kill {*}[pid $::load]}
+    catch {close $::load}
+    unset ::load
+}
+
+# Kill the instance at 'addr', returning what restart_instance needs.
+proc kill_instance {addr} {
+    set info [call $addr info server]
+    set pid [info_field $info process_id]
+    set ::restart($addr) [list [info_field $info executable] \
+                               [info_field $info config_file] \
+                               [call $addr config get dir]]
+    exec kill -9 $pid
+    return $pid
+}
+
+# Restart the killed instance with its config file, or, without one, with
+# the arguments create-cluster uses.
+proc restart_instance {addr} {
+    lassign $::restart($addr) executable config dir
+    set dir [lindex $dir 1]
+    set port [lindex [split $addr :] 1]
+    if {$config ne {}} {
+        set args [list $config --daemonize yes]
+    } elseif {$::opt(mode) eq {cluster}} {
+        set timeout [lindex [call [lindex [dict get $::ctx nodes] 0] \
+                     config get cluster-node-timeout] 1]
+        set args [list --port $port --cluster-enabled yes \
+            --cluster-config-file nodes-$port.conf \
+            --cluster-node-timeout $timeout --appendonly yes \
+            --appendfilename appendonly-$port.aof \
+            --dbfilename dump-$port.rdb --logfile $port.log --daemonize yes]
+    } else {
+        log "Can't restart $addr: it has no config file."
+        return 0
+    }
+    set cwd [pwd]
+    cd $dir
+    exec $executable {*}$args
+    cd $cwd
+    return 1
+}
+
+# -----------------------------------------------------------------------------
+# Iterations
+# -----------------------------------------------------------------------------
+
+proc iteration {n} {
+    set seed "$::opt(host):$::opt(port)"
+    if {$::opt(mode) eq {cluster}} {
+        set masters [cluster_masters [list $seed]]
+        set pick [expr {$n % ([llength $masters]/2)}]
+        set victim [lindex $masters [expr {$pick*2}]]
+        set slot [lindex $masters [expr {$pick*2+1}]]
+        set ::ctx [dict create victim $victim slot $slot \
+                                nodes [cluster_nodes $seed]]
+    } else {
+        set victim [sentinel_master $seed]
+        set slot 0
+        set ::ctx [dict create victim $victim slot 0 \
+                                sentinels [sentinels $seed]]
+    }
+    set tag [tag_for_slot $slot]
+    log "Iteration $n: killing $victim (slot $slot) after $::opt(settle) ms"
+
+    # Write to the victim until the kill, then to whoever serves the slot.
+    set acked {}                ; # seq -> ack time in milliseconds.
+    set seq 0
+    set target $victim
+    set link [redis {*}[split $victim :]]
+    set kill_at [expr {[clock milliseconds]+$::opt(settle)}]
+    set killed 0
+    set first_error {}
+    set recovered {}
+    set converged_at {}
+    while 1 {
+        set now [clock milliseconds]
+        if {!$killed && $now >= $kill_at} {
+            kill_instance $victim
+            set kill_time [clock milliseconds]
+            set killed 1
+        }
+        if {$killed && $now-$kill_time > $::opt(timeout)} {
+            log "Timeout: no failover of $victim"
+            break
+        }
+
+        incr seq
+        if {$link ne {} && ![catch {$link set "$tag:$seq" $seq} reply] &&
+            $reply eq {OK}} {
+            dict set acked $seq $now
+            if {$first_error ne {} && $recovered eq {}} {
+                set recovered [clock milliseconds]
+            }
+        } else {
+            if {$killed && $first_error eq {}} {set first_error $now}
+            if {$link ne {}} {catch {$link close}}
+            set link {}
+            set target [current_master $::ctx]
+            if {$target ne {}} {
+                catch {set link [redis {*}[split $target :]]}
+            }
+            if {$link eq {}} {after 10}
+        }
+        if {$killed && $converged_at eq {} && $seq % 50 == 0 &&
+            [converged $::ctx]} {
+            set converged_at [clock milliseconds]
+        }
+        if {$recovered ne {} && $converged_at ne {}} break
+    }
+    if {$link ne {}} {catch {$link close}}
+    if {$recovered eq {} || $converged_at eq {}} return {}
+
+    # Acknowledged writes missing on the new master.
+    set lost 0
+    set lost_from {}
+    set lost_to {}
+    set r [redis {*}[split $target :]]
+    foreach {s t} $acked {
+        if {[$r exists "$tag:$s"]} continue
+        incr lost
+        if {$lost_from eq {}} {set lost_from $t}
+        set lost_to $t
+    }
+    $r close
+    set window [expr {$lost ? $lost_to-$lost_from : 0}]
+
+    set unavailable [expr {$recovered-$first_error}]
+    set converge [expr {$converged_at-$kill_time}]
+    log "Iteration $n: unavailable $unavailable ms, converge $converge ms,\
+         lost $lost writes in $window ms, new master $target"
+
+    # Let the killed master come back as a replica.
+    if {[restart_instance $victim]} {
+        set deadline [expr {[clock milliseconds]+$::opt(timeout)}]
+        while {[clock milliseconds] < $deadline} {
+            if {![catch {call $victim role} role] &&
+                [lindex $role 0] eq {slave} &&
+                [lindex $role 3] eq {connected}} break
+            after 100
+        }
+    }
+    return [list $unavailable $converge $lost $window]
+}
+
+proc stats {name values} {
+    set values [lsort -integer $values]
+    set sum 0
+    foreach v $values {incr sum $v}
+    log [format "%-12s min %6d  avg %8.1f  max %6d" $name \
+        [lindex $values 0] [expr {double($sum)/[llength $values]}] \
+        [lindex $values end]]
+}
+
+start_load
+set samples {}
+for {set n 0} {$n < $::opt(iterations)} {incr n} {
+    set s [iteration $n]
+    if {$s eq {}} continue
+    lappend samples $s
+    if {$::opt(csv) ne {}} {
+        set fd [open $::opt(csv) a]
+        puts $fd [join [concat $::opt(mode) $::opt(clients) $s] ,]
+        close $fd
+    }
+}
+stop_load
+
+if {[llength $samples]} {
+    log "[llength $samples] failovers of $::opt(iterations) measured:"
+    foreach name {unavailable converge lost window} idx {0 1 2 3} {
+        set values {}
+        foreach s $samples {lappend values [lindex $s $idx]}
+        stats $name $values
+    }
+}
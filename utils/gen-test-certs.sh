@@ -0,0 +1,29 @@
+#!/bin/sh
+# Generate the certificates used by the TLS tests (./runtest --tls) in
+# tests/tls: a CA with a server and a client certificate signed by it, and
+# a client certificate signed by another CA, that the server must refuse.
+
+set -e
+DIR=${1:-tests/tls}
+mkdir -p $DIR
+
+generate_ca() {
+    openssl genrsa -out $DIR/$1.key 2048 2>/dev/null
+    openssl req -x509 -new -nodes -sha256 -days 3650 \
+        -key $DIR/$1.key -subj "/O=Redis Test/CN=$2" -out $DIR/$1.crt
+}
+
+# generate_cert <name> <ca> <common name>
+generate_cert() {
+    openssl genrsa -out $DIR/$1.key 2048 2>/dev/null
+    openssl req -new -sha256 -key $DIR/$1.key -subj "/O=Redis Test/CN=$3" |
+        openssl x509 -req -sha256 -days 365 \
+            -CA $DIR/$2.crt -CAkey $DIR/$2.key -CAcreateserial \
+            -CAserial $DIR/$2.srl -out $DIR/$1.crt 2>/dev/null
+}
+
+generate_ca ca "Certificate Authority"
+generate_ca other-ca "Other Certificate Authority"
+generate_cert redis ca "Server"
+generate_cert client ca "Client"
+generate_cert other-client other-ca "Other Client"
@@ -0,0 +1,34 @@
+# Append the commands sampled by the tracer of a running server to a file,
+# in the format read by redis-sim-evict. The tracer must be enabled with
+# trace-sample-rate: with a rate of 1 every command is recorded, and
+# trace-max-len should hold at least the commands of a polling interval.
+#
+#     tclsh trace-capture.tcl <host> <port> <file> [<seconds>]
+
+source [file join [file dirname [info script]] ../../tests/support/redis.tcl]
+
+if {[llength $argv] < 3} {
+    puts "Usage: tclsh trace-capture.tcl <host> <port> <file> \[<seconds>\]"
+    exit 1
+}
+lassign $argv host port filename seconds
+
+set r [redis $host $port]
+set fd [open $filename a]
+fconfigure $fd -translation binary
+set deadline [expr {$seconds eq {} ? 0 : [clock seconds]+$seconds}]
+set next [lindex [$r trace fetch count 0] 0]
+set lost 0
+
+while {$deadline == 0 || [clock seconds] < $deadline} {
+    lassign [$r trace fetch from $next count 10000] next gap blob
+    incr lost $gap
+    if {[string length $blob]} {
+        puts -nonewline $fd $blob
+        flush $fd
+        continue
+    }
+    after 100
+}
+close $fd
+puts "Done, $lost entries overwritten before they could be fetched."
@@ -0,0 +1,159 @@
+#!/usr/bin/env tclsh8.5
+# Compare the scripting throughput of two redis-server executables, usually
+# one built with the bundled Lua and one built with 'make USE_LUAJIT=yes'.
+#
+# Usage: cd utils; ./lua-engine-bench.tcl path/to/redis-server-lua \
+#                                         path/to/redis-server-luajit
+#
+# Released under the BSD license like Redis itself
+
+source ../tests/support/redis.tcl
+set ::port 12124
+set ::requests 20000
+set ::clients 50
+set ::time_limit 5000
+
+# Typical scripts: the first ones spend most of the time calling Redis,
+# the others in the Lua code itself.
+set ::scripts {
+    incr {
+        return redis.call('incr',KEYS[1])
+    }
+    hash_update {
+        local v = redis.call('hget',KEYS[1],'count')
+        v = (tonumber(v) or 0) + 1
+        redis.call('hset',KEYS[1],'count',v)
+        redis.call('hset',KEYS[1],'last',ARGV[1])
+        return v
+    }
+    list_sum {
+        if redis.call('llen',KEYS[1]) == 0 then
+            for i=1,100 do redis.call('rpush',KEYS[1],i) end
+        end
+        local sum = 0
+        for _,v in ipairs(redis.call('lrange',KEYS[1],0,-1)) do
+            sum = sum + tonumber(v)
+        end
+        return sum
+    }
+    cjson {
+        local doc = cjson.decode('{"id":1,"tags":["a","b","c"],' ..
+            '"user":{"name":"redis","age":10},"score":3.14}')
+        doc.id = doc.id + 1
+        return cjson.encode(doc)
+    }
+    cmsgpack {
+        local t = {}
+        for i=1,50 do t[i] = {i,'field'..i,i*1.5} end
+        return #cmsgpack.pack(cmsgpack.unpack(cmsgpack.pack(t)))
+    }
+    string_ops {
+        local parts = {}
+        for i=1,200 do
+            parts[#parts+1] = string.format('%d:%s',i,string.rep('x',i%8))
+        end
+        local s = table.concat(parts,',')
+        return #string.gsub(s,'x+','y')
+    }
+    loop {
+        local sum = 0
+        for i=1,10000 do sum = sum + (i % 7) * 3 end
+        return sum
+    }
+}
+
+proc run-server {path} {
+    set conf "port $::port\nloglevel warning\nsave \"\"\n"
+    append conf "lua-time-limit $::time_limit\n"
+    set pid [exec echo $conf | $path - > /dev/null 2> /dev/null &]
+    after 1000
+    return $pid
+}
+
+proc bench-server {path} {
+    puts "Benchmarking $path"
+    set pid [run-server $path]
+    set r [redis 127.0.0.1 $::port]
+    set results {}
+    foreach {name body} $::scripts {
+        set sha [$r script load $body]
+        set output [exec ../src/redis-benchmark -p $::port -q --csv \
+            -n $::requests -c $::clients -r 10000 \
+            evalsha $sha 1 key:__rand_int__ __rand_int__]
+        # Skip the CSV header, the first field of the row is the command.
+        set rps n/a
+        foreach line [split $output "\n"] {
+            if {[string match {"test"*} $line] || $line eq {}} continue
+            set rps [string range [lindex [split $line ","] 1] 1 end-1]
+            break
+        }
+        lappend results $name $rps
+        puts [format "  %-12s %s requests per second" $name [lindex $results end]]
+    }
+    $r close
+    catch {exec kill -9 $pid}
+    after 500
+    return $results
+}
+
+proc main {servers} {
+    set runs {}
+    foreach path $servers {
+        lappend runs $path [bench-server $path]
+    }
+    puts "\n# requests=$::requests clients=$::clients lua-time-limit=$::time_limit"
+    puts -nonewline [format "%-12s" script]
+    foreach {path _} $runs {puts -nonewline [format " %20s" [file tail $path]]}
+    puts {}
+    foreach {name _} $::scripts {
+        puts -nonewline [format "%-12s" $name]
+        foreach {_ results} $runs {
+            puts -nonewline [format " %20s" [dict get $results $name]]
+        }
+        puts {}
+    }
+}
+
+# Force the user to run the script from the 'utils' directory.
+if {![file exists lua-engine-bench.tcl]} {
+    puts "Please make sure to run lua-engine-bench.tcl while inside /utils."
+    exit 1
+}
+
+# Make sure there is not already a server running on our port.
+set is_not_running [catch {set r [redis 127.0.0.1 $::port]}]
+if {!$is_not_running} {
+    puts "Sorry, you have a running server on port $::port"
+    exit 1
+}
+
+# Parse arguments. Note that while lua-time-limit is set the scripts run
+# with a count hook, that keeps LuaJIT in its interpreter: use
+# '--time-limit 0' to see what the JIT compiler does to long scripts.
+set servers {}
+for {set j 0} {$j < [llength $argv]} {incr j} {
+    set opt [lindex $argv $j]
+    set arg [lindex $argv [expr $j+1]]
+    if {$opt eq {--requests}} {
+        set ::requests $arg
+        incr j
+    } elseif {$opt eq {--clients}} {
+        set ::clients $arg
+        incr j
+    } elseif {$opt eq {--time-limit}} {
+        set ::time_limit $arg
+        incr j
+    } elseif {[string match -* $opt]} {
+        puts "Wrong argument: $opt"
+        exit 1
+    } else {
+        lappend servers $opt
+    }
+}
+
+if {[llength $servers] == 0} {
+    puts "Usage: ./lua-engine-bench.tcl \[--requests <n>\] \[--clients <n>\] \[--time-limit <ms>\] <redis-server> ..."
+    exit 1
+}
+
+main $servers
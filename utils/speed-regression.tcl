@@ -1,97 +1,192 @@
 #!/usr/bin/env tclsh8.5
 # Copyright (C) 2011 Salvatore Sanfilippo
 # Released under the BSD license like Redis itself
+#
+# Performance regression suite. Every redis-benchmark test is run for every
+# combination of pipeline and data size, after a warmup run, a number of
+# times: the results are the mean requests per second of the trials, with a
+# 95% confidence interval. With --microbench the data structures micro
+# benchmarks of a server built with REDIS_TEST ("make microbench") are run
+# as well, reporting the mean ns/op.
+#
+# The results can be saved with --save and compared with a saved baseline
+# with --baseline: a result is a regression when it is worse than the
+# baseline by more than --threshold percent and the confidence intervals
+# do not overlap. The script exits with 1 when there are regressions.
+#
+# The server and the benchmark are pinned to the --server-cpu and
+# --client-cpu CPUs when taskset is available.
+#
+# Usage: cd utils; ./speed-regression.tcl [--baseline file] [--save file] ...
 
 source ../tests/support/redis.tcl
 set ::port 12123
+set ::server ../src/redis-server
+set ::benchmark ../src/redis-benchmark
+set ::microbench {}
 set ::tests {PING,SET,GET,INCR,LPUSH,LPOP,SADD,SPOP,LRANGE_100,LRANGE_600,MSET}
-set ::datasize 16
+set ::pipelines {1 16}
+set ::datasizes {16 1024}
 set ::requests 100000
+set ::clients 50
+set ::trials 5
+set ::server_cpu 0
+set ::client_cpu 1
+set ::threshold 5
+set ::baseline {}
+set ::save {}
 
-proc run-tests branches {
-    set runs {}
-    set branch_id 0
-    foreach b $branches {
-        cd ../src
-        puts "Benchmarking $b"
-        exec -ignorestderr git checkout $b 2> /dev/null
-        exec -ignorestderr make clean 2> /dev/null
-        puts "  compiling..."
-        exec -ignorestderr make 2> /dev/null
-
-        if {$branch_id == 0} {
-            puts "  copy redis-benchmark from unstable to /tmp..."
-            exec -ignorestderr cp ./redis-benchmark /tmp
-            incr branch_id
-            continue
-        }
+# Two sided 95% Student's t values by degrees of freedom.
+set ::tvalues {12.71 4.30 3.18 2.78 2.57 2.45 2.36 2.31 2.26 2.23}
 
-        # Start the Redis server
-        puts "  starting the server... [exec ./redis-server -v]"
-        set pids [exec echo "port $::port\nloglevel warning\n" | ./redis-server - > /dev/null 2> /dev/null &]
-        puts "  pids: $pids"
-        after 1000
-        puts "  running the benchmark"
-
-        set r [redis 127.0.0.1 $::port]
-        set i [$r info]
-        puts "  redis INFO shows version: [lindex [split $i] 0]"
-        $r close
-
-        set output [exec /tmp/redis-benchmark -n $::requests -t $::tests -d $::datasize --csv -p $::port]
-        lappend runs $b $output
-        puts "  killing server..."
-        catch {exec kill -9 [lindex $pids 0]}
-        catch {exec kill -9 [lindex $pids 1]}
-        incr branch_id
+proc pinned {cpu cmd} {
+    if {$cpu ne {} && [auto_execok taskset] ne {}} {
+        return [concat taskset -c $cpu $cmd]
     }
-    return $runs
+    return $cmd
+}
+
+# Return {mean ci} of the list of samples.
+proc stats samples {
+    set n [llength $samples]
+    set sum 0
+    foreach s $samples {set sum [expr {$sum+$s}]}
+    set mean [expr {double($sum)/$n}]
+    if {$n < 2} {return [list $mean 0]}
+    set sq 0
+    foreach s $samples {set sq [expr {$sq+($s-$mean)*($s-$mean)}]}
+    set t [lindex $::tvalues [expr {min($n-2,[llength $::tvalues]-1)}]]
+    if {$n > 11} {set t 1.96}
+    return [list $mean [expr {$t*sqrt($sq/($n-1))/sqrt($n)}]]
+}
+
+proc start-server {} {
+    set conf "port $::port\nloglevel warning\nsave \"\"\nappendonly no\n"
+    set pid [exec echo $conf | {*}[pinned $::server_cpu $::server] - \
+        > /dev/null 2> /dev/null &]
+    after 1000
+    return $pid
 }
 
-proc get-result-with-name {output name} {
+# Run redis-benchmark once, returning a dict of test -> requests per second.
+proc run-benchmark {pipeline datasize} {
+    set output [exec {*}[pinned $::client_cpu $::benchmark] -p $::port -q \
+        --csv -n $::requests -c $::clients -P $pipeline -d $datasize \
+        -t $::tests]
+    set rps {}
     foreach line [split $output "\n"] {
+        if {[string match {"test"*} $line] || $line eq {}} continue
         lassign [split $line ","] key value
-        set key [string tolower [string range $key 1 end-1]]
-        set value [string range $value 1 end-1]
-        if {$key eq [string tolower $name]} {
-            return $value
-        }
+        dict set rps [string tolower [string range $key 1 end-1]] \
+            [string range $value 1 end-1]
     }
-    return "n/a"
+    return $rps
 }
 
-proc get-test-names output {
-    set names {}
+# Run the micro benchmarks once, returning a dict of name -> ns/op.
+proc run-microbench {} {
+    set output [exec {*}[pinned $::server_cpu $::microbench] benchmark all]
+    set nsop {}
     foreach line [split $output "\n"] {
-        lassign [split $line ","] key value
-        set key [string tolower [string range $key 1 end-1]]
-        lappend names $key
+        if {[llength $line] < 4} continue
+        dict set nsop [lindex $line 0] [lindex $line 3]
+    }
+    return $nsop
+}
+
+# Results are a list of {name unit mean ci}: for "rps" higher is better,
+# for "ns/op" lower is better.
+proc collect {name unit samples} {
+    lassign [stats $samples] mean ci
+    puts [format "  %-40s %12.2f +/- %8.2f %s" $name $mean $ci $unit]
+    return [list $name $unit $mean $ci]
+}
+
+proc run-suite {} {
+    set results {}
+    set pid [start-server]
+    set r [redis 127.0.0.1 $::port]
+    puts "Benchmarking [lindex [split [$r info server] "\r\n"] 2]"
+    foreach pipeline $::pipelines {
+        foreach datasize $::datasizes {
+            puts "pipeline=$pipeline datasize=$datasize"
+            run-benchmark $pipeline $datasize ;# Warmup
+            set trials {}
+            for {set j 0} {$j < $::trials} {incr j} {
+                $r flushall
+                lappend trials [run-benchmark $pipeline $datasize]
+            }
+            foreach test [dict keys [lindex $trials 0]] {
+                set samples {}
+                foreach t $trials {lappend samples [dict get $t $test]}
+                lappend results [collect "$test P=$pipeline d=$datasize" \
+                    rps $samples]
+            }
+        }
+    }
+    $r close
+    catch {exec kill -9 $pid}
+
+    if {$::microbench ne {}} {
+        puts "micro benchmarks"
+        run-microbench ;# Warmup
+        set trials {}
+        for {set j 0} {$j < $::trials} {incr j} {
+            lappend trials [run-microbench]
+        }
+        foreach name [dict keys [lindex $trials 0]] {
+            set samples {}
+            foreach t $trials {lappend samples [dict get $t $name]}
+            lappend results [collect $name ns/op $samples]
+        }
     }
-    return $names
+    return $results
 }
 
-proc combine-results {results} {
-    set tests [get-test-names [lindex $results 1]]
-    foreach test $tests {
-        puts $test
-        foreach {branch output} $results {
-            puts [format "%-20s %s" \
-                $branch [get-result-with-name $output $test]]
+# Return the number of regressions of the results against the baseline.
+proc compare {results baseline} {
+    set base {}
+    foreach b $baseline {dict set base [lindex $b 0] $b}
+    set regressions 0
+    puts "\n# Comparison with the baseline, threshold $::threshold%"
+    foreach res $results {
+        lassign $res name unit mean ci
+        if {![dict exists $base $name]} continue
+        lassign [dict get $base $name] _ _ bmean bci
+        if {$bmean == 0} continue
+        set delta [expr {($mean-$bmean)*100.0/$bmean}]
+        if {$unit eq {ns/op}} {set delta [expr {-$delta}]}
+        set overlap [expr {abs($mean-$bmean) <= $ci+$bci}]
+        set status ok
+        if {$delta < -$::threshold && !$overlap} {
+            set status REGRESSION
+            incr regressions
+        } elseif {$delta > $::threshold && !$overlap} {
+            set status improved
         }
-        puts {}
+        puts [format "%-40s %+8.2f%% %s" $name $delta $status]
     }
+    return $regressions
 }
 
 proc main {} {
-    # Note: the first branch is only used in order to get the redis-benchmark
-    # executable. Tests are performed starting from the second branch.
-    set branches {
-        slowset 2.2.0 2.4.0 unstable slowset
+    set results [run-suite]
+    if {$::save ne {}} {
+        set fd [open $::save w]
+        puts $fd "# requests=$::requests clients=$::clients trials=$::trials"
+        foreach res $results {puts $fd [list {*}$res]}
+        close $fd
+    }
+    if {$::baseline ne {}} {
+        set fd [open $::baseline]
+        set baseline {}
+        foreach line [split [read $fd] "\n"] {
+            if {$line eq {} || [string match #* $line]} continue
+            lappend baseline $line
+        }
+        close $fd
+        if {[compare $results $baseline]} {exit 1}
     }
-    set results [run-tests $branches]
-    puts "\n"
-    puts "# Test results: datasize=$::datasize requests=$::requests"
-    puts [combine-results $results]
 }
 
 # Force the user to run the script from the 'utils' directory.
@@ -109,17 +204,23 @@ if {!$is_not_running} {
 }
 
 # parse arguments
+set options {
+    --server server --benchmark benchmark --microbench microbench
+    --tests tests --requests requests --clients clients --trials trials
+    --server-cpu server_cpu --client-cpu client_cpu --threshold threshold
+    --baseline baseline --save save
+}
 for {set j 0} {$j < [llength $argv]} {incr j} {
     set opt [lindex $argv $j]
     set arg [lindex $argv [expr $j+1]]
-    if {$opt eq {--tests}} {
-        set ::tests $arg
+    if {[dict exists $options $opt]} {
+        set ::[dict get $options $opt] $arg
         incr j
-    } elseif {$opt eq {--datasize}} {
-        set ::datasize $arg
+    } elseif {$opt eq {--pipelines}} {
+        set ::pipelines [split $arg ,]
         incr j
-    } elseif {$opt eq {--requests}} {
-        set ::requests $arg
+    } elseif {$opt eq {--datasizes}} {
+        set ::datasizes [split $arg ,]
         incr j
     } else {
         puts "Wrong argument: $opt"